@@ -13,6 +13,8 @@
  * Synthetic Initialization Vector (SIV) Authenticated Encryption
  *           Using the Advanced Encryption Standard (AES)
  *
+ * and, for comparison, ntpd's AES-128-GCM-SIV (RFC 8452)
+ * from ntpd/nts_gcm_siv.c
  */
 
 #include <assert.h>
@@ -29,12 +31,15 @@
 #include "aes_siv.h"
 #include "ntp_fp.h"
 #include "nts.h"
+#include "nts2.h"
 
 #define UNUSED_ARG(arg)         ((void)(arg))
 #define INSIST(x)       assert(x)
 
 int SAMPLESIZE = 1000000;
 
+const char *progname = "aes-siv-timing";
+
 AES_SIV_CTX* cookie_ctx;
 uint32_t key_I = 123;  /* timestamp or whatever used to \
                         * indicate key used for this cookie */
@@ -318,6 +323,72 @@ static void DoMakeCrypto(
 	printf("\n");
 }
 
+/* DoMakeCrypto() with AEAD_AES_128_GCM_SIV: same cookie layout,
+ * the nonce is the first 12 bytes of N and the tag goes last.
+ */
+static void DoGcmSivCrypto(
+  const char *name,       /* name of aead */
+  int     keylen          /* length of c2s and s2c */
+)
+{
+	uint8_t cookie[NTS_MAX_COOKIELEN];
+	uint8_t c2s[NTS_MAX_KEYLEN], s2c[NTS_MAX_KEYLEN];
+	uint8_t *plaintext, *finger;
+	struct timespec start, stop;
+	double fast;
+	int samplesize = SAMPLESIZE;
+	int plainlength, ok = 0;
+	uint32_t temp;
+	GCM_SIV_CTX *ctx = gcm_siv_new();
+
+	if (NULL == ctx) {
+		printf("Can't make GCM_SIV_CTX\n");
+		exit(1);
+	}
+	ntp_RAND_bytes(c2s, NTS_MAX_KEYLEN);
+	ntp_RAND_bytes(s2c, NTS_MAX_KEYLEN);
+
+	finger = cookie;
+	memcpy(finger, &key_I, sizeof(key_I));
+	finger += sizeof(key_I);
+	ntp_RAND_bytes(finger, NONCE_LENGTH);
+	finger += NONCE_LENGTH;
+
+	plaintext = finger;
+	temp = AEAD_AES_128_GCM_SIV;
+	memcpy(finger, &temp, sizeof(temp));
+	finger += sizeof(temp);
+	memcpy(finger, c2s, keylen);
+	finger += keylen;
+	memcpy(finger, s2c, keylen);
+	finger += keylen;
+	plainlength = finger-plaintext;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < samplesize; i++) {
+		/* encrypts in place, so this re-encrypts the last output;
+		 * the cost is the same */
+		ok += gcm_siv_encrypt(ctx, plaintext,
+			key_K, AEAD_AES_128_GCM_SIV_KEYLEN,
+			cookie + sizeof(key_I),
+			plaintext, plainlength,
+			cookie, AD_LENGTH);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	gcm_siv_free(ctx);
+
+	if (samplesize != ok) {
+		printf("Error from gcm_siv_encrypt\n");
+		exit(1);
+	}
+
+	fast = (stop.tv_sec-start.tv_sec)*1E9 + (stop.tv_nsec-start.tv_nsec);
+	printf("%12s  %2d %4d %6.0f %7.3f",
+	       name, keylen, AD_LENGTH + plainlength + GCM_SIV_TAG_LENGTH,
+	       fast/samplesize,  fast/1E9);
+	printf("\n");
+}
+
 int main(int argc, char *argv[])
 {
 	char *ctimetxt;
@@ -373,6 +444,9 @@ int main(int argc, char *argv[])
 // AES_SIV_CMAC_256  32  104   2066   2.066
 // AES_SIV_CMAC_256  48  136   2119   2.119
 // AES_SIV_CMAC_256  64  168   2157   2.157
+	DoGcmSivCrypto("AES_128_GCM_SIV", 16);
+	DoGcmSivCrypto("AES_128_GCM_SIV", 32);
+	DoGcmSivCrypto("AES_128_GCM_SIV", 64);
 
 	return 0;
 }
@@ -0,0 +1,224 @@
+/* Hack to time decoding of the binary GPS messages' fields.
+ *
+ * Compares the way libparse used to take an IEEE 754 number apart,
+ * assembling each field a byte at a time through get_byte(), and the
+ * little-endian getters as out-of-line calls, against fetch_ieee754()
+ * gathering the whole word first and the inline getters.  The records
+ * are shaped like a Meinberg XYZ position (three doubles, in Meinberg
+ * byte order), a TSIP superpacket's floats (big-endian singles), and
+ * a Meinberg header (four little-endian 16 bit words).
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ntp_stdlib.h"
+#include "ntp_fp.h"
+#include "binio.h"
+#include "ieee754io.h"
+
+int NUM = 1000000;
+
+/* byte order for meinberg doubles */
+static offsets_t mbg_double = { 1, 0, 3, 2, 5, 4, 7, 6 };
+static offsets_t trim_single = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+/* 6378137.0, -1.5 and 0.25 in Meinberg order; TSIP 1.0, -2.0, 0.5 */
+static unsigned char mbg_xyz[24] = {
+	0x58, 0x41, 0xa6, 0x54, 0x00, 0x40, 0x00, 0x00,
+	0xf8, 0xbf, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xd0, 0x3f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+static unsigned char tsip_floats[12] = {
+	0x3f, 0x80, 0x00, 0x00,
+	0xc0, 0x00, 0x00, 0x00,
+	0x3f, 0x00, 0x00, 0x00,
+};
+static unsigned char mbg_header[8] = {
+	0x34, 0x12, 0x18, 0x00, 0xcd, 0xab, 0x21, 0x43,
+};
+
+/*******************************************************************/
+/* the old way, trimmed from ieee754io.c and binio.c */
+
+static uint64_t __attribute__((noinline))
+get_byte(unsigned char *bufp, offsets_t offset, int *fieldindex)
+{
+	unsigned char val;
+
+	val = *(bufp + offset[*fieldindex]);
+	(*fieldindex)++;
+	return val;
+}
+
+static int16_t __attribute__((noinline))
+old_get_lsb_int16(unsigned char **bufpp)
+{
+	int16_t retval;
+
+	retval  = *((*bufpp)++);
+	retval |= *((*bufpp)++) << 8;
+
+	return retval;
+}
+
+static int
+old_fetch_ieee754(unsigned char **buffpp, int size, l_fp *lfpp,
+		  offsets_t offsets)
+{
+	unsigned char *bufp = *buffpp;
+	bool sign;
+	int bias, maxexp, mbits, characteristic, exponent, maxexp_lfp;
+	int fudge, shift;
+	uint64_t mantissa;
+	unsigned char val;
+	int fieldindex = 0;
+
+	*lfpp = 0;
+	val = (unsigned char)get_byte(bufp, offsets, &fieldindex);
+	sign = (val & 0x80) != 0;
+	characteristic = (val & 0x7F);
+	val = (unsigned char)get_byte(bufp, offsets, &fieldindex);
+
+	switch (size) {
+	    case IEEE_DOUBLE:
+		fudge = -20;
+		maxexp_lfp = 31;
+		mbits  = 52;
+		bias   = 1023;
+		maxexp = 2047;
+		characteristic <<= 4;
+		characteristic  |= (val & 0xF0) >> 4;
+		mantissa  = (val & 0x0FULL) << 48;
+		mantissa |= get_byte(bufp, offsets, &fieldindex) << 40;
+		mantissa |= get_byte(bufp, offsets, &fieldindex) << 32;
+		mantissa |= get_byte(bufp, offsets, &fieldindex) << 24;
+		mantissa |= get_byte(bufp, offsets, &fieldindex) << 16;
+		mantissa |= get_byte(bufp, offsets, &fieldindex) << 8;
+		mantissa |= get_byte(bufp, offsets, &fieldindex);
+		break;
+
+	    case IEEE_SINGLE:
+		fudge = 9;
+		maxexp_lfp = 30;
+		mbits  = 23;
+		bias   = 127;
+		maxexp = 255;
+		characteristic <<= 1;
+		characteristic |= (val & 0x80) ? 1 : 0 ;
+		mantissa   = (val & 0x7FU) << 16;
+		mantissa  |= get_byte(bufp, offsets, &fieldindex) << 8;
+		mantissa  |= get_byte(bufp, offsets, &fieldindex);
+		break;
+
+	    default:
+		return IEEE_BADCALL;
+	}
+
+	exponent = characteristic - bias;
+	shift = exponent + fudge;
+	*buffpp += fieldindex;
+	if (characteristic == maxexp)
+		return mantissa ? IEEE_NAN :
+		    sign ? IEEE_NEGINFINITY : IEEE_POSINFINITY;
+	if (exponent > maxexp_lfp)
+		return sign ? IEEE_NEGOVERFLOW : IEEE_POSOVERFLOW;
+	if (characteristic == 0)
+		return IEEE_OK;
+	mantissa  |= 1ULL << mbits;
+	if ( 0 == shift )
+		*lfpp = mantissa;
+	else if ( 0 > shift )
+		*lfpp = mantissa >> -shift;
+	else
+		*lfpp = mantissa << shift;
+	if (sign)
+		L_NEG(*lfpp);
+	return IEEE_OK;
+}
+
+/*******************************************************************/
+
+static l_fp
+decode_xyz(bool old)
+{
+	unsigned char *bp = mbg_xyz;
+	l_fp sum = 0, v;
+
+	for (int i = 0; i < 3; i++) {
+		if (old)
+			old_fetch_ieee754(&bp, IEEE_DOUBLE, &v, mbg_double);
+		else
+			fetch_ieee754(&bp, IEEE_DOUBLE, &v, mbg_double);
+		sum += v;
+	}
+	return sum;
+}
+
+static l_fp
+decode_tsip(bool old)
+{
+	unsigned char *bp = tsip_floats;
+	l_fp sum = 0, v;
+
+	for (int i = 0; i < 3; i++) {
+		if (old)
+			old_fetch_ieee754(&bp, IEEE_SINGLE, &v, trim_single);
+		else
+			fetch_ieee754(&bp, IEEE_SINGLE, &v, trim_single);
+		sum += v;
+	}
+	return sum;
+}
+
+static l_fp
+decode_header(bool old)
+{
+	unsigned char *bp = mbg_header;
+	l_fp sum = 0;
+
+	for (int i = 0; i < 4; i++)
+		sum += (uint16_t)(old ? old_get_lsb_int16(&bp) :
+				  get_lsb_int16(&bp));
+	return sum;
+}
+
+static void
+DoDecode(const char *name, l_fp (*decode)(bool), bool old)
+{
+	struct timespec start, stop;
+	double	average;
+	l_fp	sum = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int j = 0; j < NUM; j++) {
+		sum += decode(old);
+		/* keep the compiler from hoisting the decode */
+		__asm__ __volatile__("" : : : "memory");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	average = (stop.tv_sec-start.tv_sec)*1E9 + (stop.tv_nsec-start.tv_nsec);
+	average = average/NUM;
+	printf("%-7s %-4s %8.1f %016llx\n", name, old ? "old" : "new",
+	       average, (unsigned long long)sum);
+}
+
+int main (int argc, char *argv[]) {
+	if (argc > 1)
+		NUM = atoi(argv[1]);
+
+	printf("record  way   avg ns sum\n");
+	DoDecode("mbg xyz", decode_xyz, true);
+	DoDecode("mbg xyz", decode_xyz, false);
+	DoDecode("tsip", decode_tsip, true);
+	DoDecode("tsip", decode_tsip, false);
+	DoDecode("header", decode_header, true);
+	DoDecode("header", decode_header, false);
+
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Time ntpd's configuration scanner on a large synthetic ntp.conf:
+ * server, restrict and fudge lines and comments, as a generated
+ * configuration might have them.  Links with the real ntp_scanner.c
+ * and drives yylex() over the file, without the parser or the
+ * configuration it would build.  Reports microseconds per pass and
+ * nanoseconds per line and per token.
+ *
+ * Usage: config-timing [-n passes] [-s lines[,lines...]]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ntpd.h"
+#include "ntp_config.h"
+#include "ntp_scanner.h"
+#include "ntp_parser.tab.h"
+
+static long passes = 20;
+static long sizes[32] = { 1000, 10000, 100000 };
+static int nsizes = 3;
+
+const char *progname = "config-timing";
+
+/* the parser and ntp_config.c, as far as the scanner needs them */
+YYSTYPE yylval;
+struct REMOTE_CONFIG_INFO remote_config;
+
+const char *
+token_name(
+	int token
+	)
+{
+	UNUSED_ARG(token);
+	return "";
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void
+write_config(const char *path, long lines)
+{
+	FILE *fp = fopen(path, "w");
+
+	if (NULL == fp) {
+		perror(path);
+		exit(1);
+	}
+	for (long i = 0; i < lines; i++) {
+		unsigned int a = (unsigned int)(i >> 8) & 0xff;
+		unsigned int b = (unsigned int)i & 0xff;
+
+		switch (i % 5) {
+		case 0:
+			fprintf(fp, "server 192.0.%u.%u iburst minpoll 4 "
+				"maxpoll 10 prefer\n", a, b);
+			break;
+		case 1:
+			fprintf(fp, "restrict 10.%u.%u.0 mask 255.255.255.0 "
+				"nomodify noquery limited kod\n", a, b);
+			break;
+		case 2:
+			fprintf(fp, "restrict 2001:db8::%lx nomodify nopeer "
+				"noquery\n", (unsigned long)i);
+			break;
+		case 3:
+			fprintf(fp, "fudge 127.127.28.%u time1 0.%03u "
+				"refid GPS stratum 1\n", b & 3, b);
+			break;
+		default:
+			fprintf(fp, "# generated line %ld\n", i);
+			break;
+		}
+	}
+	fclose(fp);
+}
+
+static void
+time_lex(const char *path, long lines)
+{
+	double start, seconds;
+	long tokens = 0;
+
+	start = now();
+	for (long p = 0; p < passes; p++) {
+		if (!lex_init_stack(path, "r")) {
+			fprintf(stderr, "cannot open %s\n", path);
+			exit(1);
+		}
+		while (yylex() != 0)
+			tokens++;
+		lex_drop_stack();
+	}
+	seconds = now() - start;
+	printf("%8ld %10.1f %8.1f %8.1f\n", lines,
+	       seconds * 1e6 / (double)passes,
+	       seconds * 1e9 / (double)(passes * lines),
+	       seconds * 1e9 / (double)tokens);
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n passes] [-s lines[,lines...]]\n",
+		name);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[] = "/tmp/config-timing.XXXXXX";
+	char *tok;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			passes = atol(optarg);
+			break;
+		case 's':
+			nsizes = 0;
+			for (tok = strtok(optarg, ","); tok != NULL &&
+			     nsizes < (int)COUNTOF(sizes);
+			     tok = strtok(NULL, ","))
+				sizes[nsizes++] = atol(tok);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (passes < 1 || nsizes < 1)
+		usage(argv[0]);
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+
+	printf("   lines    us/pass  ns/line ns/token\n");
+	for (int s = 0; s < nsizes; s++) {
+		write_config(path, sizes[s]);
+		time_lex(path, sizes[s]);
+	}
+	unlink(path);
+	return 0;
+}
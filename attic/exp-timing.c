@@ -1,7 +1,7 @@
 /* Hack to time exponential decay calculations.
  *
  * exp() and expf() are used to calculate the score for rate limiting.
- * expf() is used in the mainline path.
+ * ntp_monitor() now uses tables (DoTable) in the mainline path.
  * exp/expf are used to limit logging.
  */
 
@@ -53,6 +53,33 @@ static void DoExpf(void) {
     printf("expf: %8d    %.6f %.6f %.6f\n", (int)average, x, exp(0.0), exp(-1.0));
 }
 
+/* As mon_decay() in ntpd/ntp_monitor.c: 1/16 s ticks, 6 bits a table */
+static float table[3][64];
+
+static void DoTable(void) {
+    struct timespec start, stop;
+    double average;
+    float x = 0;
+    uint32_t t;
+
+    for (int l=0; l<3; l++)
+       for (int i=0; i<64; i++)
+           table[l][i] = (float)exp(-(double)((uint32_t)i << (6*l))/16/64);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<NUM; i++) {
+       x = 1000.0;
+       for (int j=0; j<STEPS; j++) {
+           t = (uint32_t)j*16/64;
+           x *= table[0][t & 63] * table[1][(t >> 6) & 63] * table[2][t >> 12];
+       }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    average = (stop.tv_sec-start.tv_sec)*1E9 + (stop.tv_nsec-start.tv_nsec);
+    average = average/NUM/STEPS;
+    printf("table:%8d    %.6f %.6f %.6f\n", (int)average, x, exp(0.0), exp(-1.0));
+}
+
 int main (int argc, char *argv[]) {
 
 	UNUSED_ARG(argc);
@@ -61,6 +88,7 @@ int main (int argc, char *argv[]) {
 	printf("         avg ns\n");
         DoExp();
         DoExpf();
+        DoTable();
 
 	return 0;
 }
@@ -0,0 +1,183 @@
+/* Hack to time parsing of GPSD JSON records.
+ *
+ * Compares the way the GPSD driver used to read a record, tokenizing
+ * all of it with JSMN and then searching the tokens once per member,
+ * against json_scan(), which reads each record for just the members
+ * wanted.  The records are typical of a multi-constellation receiver;
+ * after the class, only the TPV members are looked up.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define JSMN_STATIC
+#define JSMN_PARENT_LINKS
+#include "jsmn.h"
+
+#include "json_scan.h"
+
+#define MAXTOK	350
+
+int NUM = 200000;
+
+static const char *records[] = {
+"{\"class\":\"TPV\",\"device\":\"/dev/ttyACM0\",\"status\":2,\"mode\":3,"
+"\"time\":\"2024-05-01T12:00:00.000Z\",\"leapseconds\":18,\"ept\":0.005,"
+"\"lat\":51.477928000,\"lon\":-0.001545000,\"altHAE\":46.1170,"
+"\"altMSL\":0.3540,\"alt\":0.3540,\"epx\":1.734,\"epy\":2.162,\"epv\":3.680,"
+"\"track\":0.0000,\"magtrack\":359.1000,\"magvar\":-0.9,\"speed\":0.011,"
+"\"climb\":0.000,\"eps\":4.33,\"epc\":7.36,\"geoidSep\":45.763,"
+"\"eph\":2.590,\"sep\":4.200}",
+"{\"class\":\"PPS\",\"device\":\"/dev/pps0\",\"real_sec\":1714564800,"
+"\"real_nsec\":0,\"clock_sec\":1714564800,\"clock_nsec\":153,"
+"\"precision\":-20,\"shm\":\"NTP2\",\"qErr\":-2931}",
+"{\"class\":\"TOFF\",\"device\":\"/dev/ttyACM0\",\"real_sec\":1714564800,"
+"\"real_nsec\":0,\"clock_sec\":1714564800,\"clock_nsec\":101873261,"
+"\"precision\":-1,\"shm\":\"NTP0\"}",
+NULL	/* SKY, built in main() */
+};
+
+/* the TPV members the driver reads */
+static const char * const tpv_keys[] = { "mode", "time", "ept" };
+
+/*******************************************************************/
+/* the old way, trimmed from refclock_gpsd.c */
+
+typedef struct {
+	char		*buf;
+	int		 ntok;
+	jsmntok_t	 tok[MAXTOK];
+} json_ctx;
+
+static int
+token_skip(const json_ctx *ctx, int tid)
+{
+	int len = ctx->tok[tid].size;
+
+	switch (ctx->tok[tid].type) {
+	case JSMN_OBJECT:
+		len *= 2;
+		/* FALLTHROUGH */
+	case JSMN_ARRAY:
+		for (++tid; len; --len)
+			tid = token_skip(ctx, tid);
+		break;
+	case JSMN_UNDEFINED:
+	case JSMN_STRING:
+	case JSMN_PRIMITIVE:
+	default:
+		++tid;
+		break;
+	}
+	return tid < ctx->ntok ? tid : ctx->ntok;
+}
+
+static const char *
+object_lookup(const json_ctx *ctx, const char *key)
+{
+	int tid, len = ctx->tok[0].size;
+
+	for (tid = 1; len && tid + 1 < ctx->ntok; --len) {
+		if (!strcmp(key, ctx->buf + ctx->tok[tid].start))
+			return ctx->buf + ctx->tok[tid + 1].start;
+		tid = token_skip(ctx, tid + 1);
+	}
+	return NULL;
+}
+
+static int
+jsmn_record(json_ctx *ctx, char *buf, size_t len)
+{
+	jsmn_parser jsm;
+	const char *cls;
+	int n = 0;
+
+	jsmn_init(&jsm);
+	ctx->ntok = jsmn_parse(&jsm, buf, len, ctx->tok, MAXTOK);
+	if (ctx->ntok <= 0)
+		return -1;
+	ctx->buf = buf;
+	for (int i = 0; i < ctx->ntok; i++)
+		if (ctx->tok[i].end > ctx->tok[i].start)
+			buf[ctx->tok[i].end] = '\0';
+	cls = object_lookup(ctx, "class");
+	if (NULL == cls || strcmp(cls, "TPV"))
+		return 0;
+	for (size_t i = 0; i < sizeof(tpv_keys) / sizeof(tpv_keys[0]); i++)
+		n += (NULL != object_lookup(ctx, tpv_keys[i]));
+	return n;
+}
+
+/*******************************************************************/
+
+static int
+scan_record(char *buf, size_t len)
+{
+	static const char * const class_key[] = { "class" };
+	json_value val[3];
+
+	if (json_scan(buf, len, class_key, 1, val) < 1)
+		return -1;
+	if (!json_value_is(&val[0], "TPV"))
+		return 0;
+	return json_scan(buf, len, tpv_keys, 3, val);
+}
+
+static void
+DoParse(const char *name, const char *rec, bool jsmn)
+{
+	static json_ctx ctx;
+	struct timespec start, stop;
+	char	buf[8192];
+	size_t	len = strlen(rec);
+	double	average;
+	int	n = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++) {
+		memcpy(buf, rec, len + 1);	/* the old way writes NULs */
+		n += jsmn ? jsmn_record(&ctx, buf, len) : scan_record(buf, len);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	average = (stop.tv_sec-start.tv_sec)*1E9 + (stop.tv_nsec-start.tv_nsec);
+	average = average/NUM;
+	printf("%-5s %-6s %8.0f %6d %4d\n", name, jsmn ? "jsmn" : "scan",
+	       average, (int)len, n / NUM);
+}
+
+int main (int argc, char *argv[]) {
+	static const char *names[] = { "TPV", "PPS", "TOFF", "SKY" };
+	char	sky[4096];
+	size_t	len;
+
+	if (argc > 1)
+		NUM = atoi(argv[1]);
+
+	/* 24 satellites in view, as GPSD reports them */
+	len = (size_t)snprintf(sky, sizeof(sky),
+		"{\"class\":\"SKY\",\"device\":\"/dev/ttyACM0\","
+		"\"time\":\"2024-05-01T12:00:00.000Z\",\"xdop\":0.54,"
+		"\"ydop\":0.77,\"vdop\":0.91,\"tdop\":0.62,\"hdop\":0.94,"
+		"\"gdop\":1.44,\"pdop\":1.31,\"nSat\":24,\"uSat\":18,"
+		"\"satellites\":[");
+	for (int i = 0; i < 24; i++)
+		len += (size_t)snprintf(sky + len, sizeof(sky) - len,
+			"%s{\"PRN\":%d,\"el\":%d.0,\"az\":%d.0,\"ss\":%d.0,"
+			"\"used\":%s,\"gnssid\":%d,\"svid\":%d,\"health\":1}",
+			i ? "," : "", i + 1, 10 + 3 * i, 15 * i, 20 + i,
+			i < 18 ? "true" : "false", i / 8, i % 8 + 1);
+	snprintf(sky + len, sizeof(sky) - len, "]}");
+	records[3] = sky;
+
+	printf("class parser avg ns  bytes keys\n");
+	for (int i = 0; i < 4; i++) {
+		DoParse(names[i], records[i], true);
+		DoParse(names[i], records[i], false);
+	}
+
+	return 0;
+}
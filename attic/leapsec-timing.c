@@ -0,0 +1,101 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Hack to time leapsec_query(), which check_leapsec() calls once a
+ * second.  Loads a leap second file with the 2017 leap as the next
+ * one and queries a second at a time, as ntpd does, over and over
+ * across the last
+ *
+ *   quiet     year before the leap, less a month, where nothing is due
+ *   schedule  week before, the leap scheduled but not announced
+ *   announce  hour before, the leap announced
+ *
+ * Usage: leapsec-timing [count]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ntpd.h"
+#include "ntp_calendar.h"
+#include "ntp_leapsec.h"
+#include "ntp_dns.h"
+
+int NUM = 10000000;
+
+static const char leapfile[] =
+	"#@	3881174400\n"
+	"3029443200	30	# 1 Jan 1996\n"
+	"3076704000	31	# 1 Jul 1997\n"
+	"3124137600	32	# 1 Jan 1999\n"
+	"3345062400	33	# 1 Jan 2006\n"
+	"3439756800	34	# 1 Jan 2009\n"
+	"3550089600	35	# 1 Jul 2012\n"
+	"3644697600	36	# 1 Jul 2015\n"
+	"3692217600	37	# 1 Jan 2017\n";
+
+static const time_t leap2017 = 3692217600U - JAN_1970;
+
+static int
+stringreader(void *farg)
+{
+	const char **cpp = (const char **)farg;
+
+	if (**cpp)
+		return *(*cpp)++;
+	return EOF;
+}
+
+static void
+DoQuery(const char *name, time_t first, int span)
+{
+	struct timespec start, stop;
+	leap_result_t qr;
+	double	average;
+	long	sum = 0;
+
+	/* get the era loaded before the clock starts */
+	leapsec_query(&qr, first);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int j = 0; j < NUM; j++) {
+		leapsec_query(&qr, first + j % span);
+		sum += qr.proximity;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	average = (stop.tv_sec-start.tv_sec)*1E9 + (stop.tv_nsec-start.tv_nsec);
+	average = average/NUM;
+	printf("%-9s %8.2f %10ld\n", name, average, sum);
+}
+
+int main (int argc, char *argv[]) {
+	const char *cp = leapfile;
+	leap_table_t *pt;
+
+	if (argc > 1)
+		NUM = atoi(argv[1]);
+	if (NUM < 1)
+		NUM = 1;
+
+	pt = leapsec_get_table(false);
+	if (!leapsec_load(pt, stringreader, &cp) || !leapsec_set_table(pt)) {
+		printf("can't load the leap second table\n");
+		exit(1);
+	}
+
+	printf("query       avg ns  proximity\n");
+	DoQuery("quiet", leap2017 - 365 * SECSPERDAY, 330 * SECSPERDAY);
+	DoQuery("schedule", leap2017 - 7 * SECSPERDAY, 6 * SECSPERDAY);
+	DoQuery("announce", leap2017 - 3600, 3590);
+	return 0;
+}
+
+/* the rest of ntpd it links without is in ntpd-stubs.c */
+const char *progname = "leapsec-timing";
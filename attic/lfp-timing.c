@@ -0,0 +1,198 @@
+/* Hack to time l_fp and timespec arithmetic.
+ *
+ * Compares the old ways of converting l_fp to and from double, which
+ * called ldexpl(), of normalizing a timespec, which called ldiv(),
+ * and of converting an l_fp interval to a timespec, which negated
+ * and normalized negative values, against what libntp does now.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ntp_fp.h"
+#include "timespecops.h"
+
+int NUM = 10000000;
+
+static l_fp samples[1024];
+
+/*******************************************************************/
+/* the old ways, trimmed from ntp_fp.h and timespecops.c */
+
+static doubletime_t
+old_lfptod(l_fp r)
+{
+	return ldexpl((double)((int64_t)r), -32);
+}
+
+static l_fp
+old_dtolfp(doubletime_t d)
+{
+	return (l_fp)(int64_t)(ldexpl(d, 32));
+}
+
+static struct timespec
+old_normalize_tspec(struct timespec x)
+{
+	if (x.tv_nsec < 0 || x.tv_nsec >= NS_PER_S) {
+		ldiv_t	z = ldiv(x.tv_nsec, NS_PER_S);
+		if (z.rem < 0) {
+			z.quot--;
+			z.rem  += NS_PER_S;
+		}
+		x.tv_sec  += z.quot;
+		x.tv_nsec  = z.rem;
+	}
+	return x;
+}
+
+static struct timespec
+old_lfp_intv_to_tspec(l_fp x)
+{
+	struct timespec out;
+	l_fp absx = x;
+	int neg = L_ISNEG(x);
+
+	if (neg)
+		L_NEG(absx);
+	out.tv_nsec = FTOTVN(lfpfrac(absx));
+	out.tv_sec = lfpsint(absx);
+	if (neg) {
+		out.tv_sec = -out.tv_sec;
+		out.tv_nsec = -out.tv_nsec;
+		out = old_normalize_tspec(out);
+	}
+	return out;
+}
+
+/*******************************************************************/
+
+static double
+elapsed(struct timespec *start)
+{
+	struct timespec stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	return ((stop.tv_sec - start->tv_sec) * 1E9 +
+		(stop.tv_nsec - start->tv_nsec)) / NUM;
+}
+
+static void
+DoToDouble(void)
+{
+	struct timespec start;
+	doubletime_t sum;
+	double old_ns;
+
+	sum = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++)
+		sum += old_lfptod(samples[i & 1023]);
+	old_ns = elapsed(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++)
+		sum += lfptod(samples[i & 1023]);
+	printf("lfptod    %8.2f %8.2f   %Lg\n", old_ns, elapsed(&start), sum);
+}
+
+static void
+DoFromDouble(void)
+{
+	struct timespec start;
+	l_fp sum;
+	double old_ns;
+
+	sum = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++)
+		sum += old_dtolfp((doubletime_t)(int64_t)samples[i & 1023]
+				  * 1e-12);
+	old_ns = elapsed(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++)
+		sum += dtolfp((doubletime_t)(int64_t)samples[i & 1023]
+			      * 1e-12);
+	printf("dtolfp    %8.2f %8.2f   %llx\n", old_ns, elapsed(&start),
+	       (unsigned long long)sum);
+}
+
+static void
+DoNormalize(void)
+{
+	struct timespec start, x, sum;
+	double old_ns;
+
+	sum.tv_sec = sum.tv_nsec = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++) {
+		/* the sum of two normal values, as add_tspec() has */
+		x.tv_sec = 1;
+		x.tv_nsec = (long)(samples[i & 1023] % (2 * NS_PER_S));
+		x = old_normalize_tspec(x);
+		sum.tv_sec += x.tv_sec;
+		sum.tv_nsec += x.tv_nsec;
+	}
+	old_ns = elapsed(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++) {
+		x.tv_sec = 1;
+		x.tv_nsec = (long)(samples[i & 1023] % (2 * NS_PER_S));
+		x = normalize_tspec(x);
+		sum.tv_sec += x.tv_sec;
+		sum.tv_nsec += x.tv_nsec;
+	}
+	printf("normalize %8.2f %8.2f   %ld\n", old_ns, elapsed(&start),
+	       (long)sum.tv_sec + sum.tv_nsec);
+}
+
+static void
+DoToTspec(void)
+{
+	struct timespec start, x, sum;
+	double old_ns;
+
+	sum.tv_sec = sum.tv_nsec = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++) {
+		x = old_lfp_intv_to_tspec(samples[i & 1023]);
+		sum.tv_sec += x.tv_sec;
+		sum.tv_nsec += x.tv_nsec;
+	}
+	old_ns = elapsed(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++) {
+		x = lfp_intv_to_tspec(samples[i & 1023]);
+		sum.tv_sec += x.tv_sec;
+		sum.tv_nsec += x.tv_nsec;
+	}
+	printf("to tspec  %8.2f %8.2f   %ld\n", old_ns, elapsed(&start),
+	       (long)sum.tv_sec + sum.tv_nsec);
+}
+
+int main (int argc, char *argv[]) {
+	uint64_t state = 0x9e3779b97f4a7c15;
+
+	UNUSED_ARG(argc);
+	UNUSED_ARG(argv);
+
+	/* offsets of either sign, up to a few seconds */
+	for (int i = 0; i < 1024; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		samples[i] = (l_fp)((int64_t)state >> 30);
+	}
+
+	printf("           old ns   now ns   sum\n");
+	DoToDouble();
+	DoFromDouble();
+	DoNormalize();
+	DoToTspec();
+
+	return 0;
+}
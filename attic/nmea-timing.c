@@ -0,0 +1,182 @@
+/* Hack to time parsing of NMEA sentences.
+ *
+ * Compares the way the NMEA driver used to read a sentence, checking
+ * syntax and checksum in one pass, naming it with a chain of strncmp()
+ * and then walking the commas again for each field, against
+ * nmea_scan(), which does all of that in a single pass.  After the
+ * name, the fields the driver reads for each sentence are fetched in
+ * the order it fetches them.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nmea_scan.h"
+
+int NUM = 1000000;
+
+static const struct {
+	const char	*name;
+	const char	*text;
+	int		 fields[4];	/* read by the driver, -1 ends */
+} sentences[] = {
+	{ "RMC",
+	  "$GPRMC,123519.00,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W*44",
+	  { 1, 2, 9, -1 } },
+	{ "GGA",
+	  "$GPGGA,123519.00,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*69",
+	  { 6, 1, -1 } },
+	{ "ZDA",
+	  "$GPZDA,201530.00,04,07,2002,00,00*60",
+	  { 1, 2, -1 } },
+	{ "GSV",
+	  "$GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00*74",
+	  { -1 } },
+};
+
+/*******************************************************************/
+/* the old way, trimmed from refclock_nmea.c */
+
+typedef struct {
+	char  *base;
+	char  *cptr;
+	int    blen;
+	int    cidx;
+} nmea_data;
+
+static int
+field_init(nmea_data *data, char *cptr, int dlen)
+{
+	uint8_t cs_l = 0, cs_r = 0;
+	char *eptr = cptr + dlen;
+	char tmp;
+
+	data->base = data->cptr = cptr;
+	data->cidx = 0;
+	data->blen = dlen;
+	if (*cptr == '\0')
+		return NMEA_EMPTY;
+	if (*cptr++ != '$')
+		return NMEA_INVALID;
+	data->base++;
+	data->cptr++;
+	data->blen--;
+	if (*cptr < 'A' || *cptr > 'Z')
+		return NMEA_INVALID;
+	cs_l ^= *cptr++;
+	while ((*cptr >= 'A' && *cptr <= 'Z') ||
+	       (*cptr >= '0' && *cptr <= '9'))
+		cs_l ^= *cptr++;
+	if (*cptr != ',' || (cptr - data->base) < NMEA_IDLEN)
+		return NMEA_INVALID;
+	cs_l ^= *cptr++;
+	while (*cptr && *cptr != '*')
+		cs_l ^= *cptr++;
+	if (*cptr == '\0')
+		return NMEA_VALID;
+	if (*cptr != '*' || cptr != eptr - 3 ||
+	    (cptr - data->base) >= NMEA_MAXLEN)
+		return NMEA_INVALID;
+	for (cptr++; (tmp = *cptr) != '\0'; cptr++) {
+		if (tmp >= '0' && tmp <= '9')
+			cs_r = (cs_r << 4) + (tmp - '0');
+		else if (tmp >= 'A' && tmp <= 'F')
+			cs_r = (cs_r << 4) + (tmp - 'A' + 10);
+		else
+			break;
+	}
+	if (cptr != eptr || cs_l != cs_r)
+		return NMEA_INVALID;
+	return NMEA_CSVALID;
+}
+
+static char *
+field_parse(nmea_data *data, int fn)
+{
+	char tmp;
+
+	if (fn < data->cidx) {
+		data->cidx = 0;
+		data->cptr = data->base;
+	}
+	while ((fn > data->cidx) && (tmp = *data->cptr) != '\0') {
+		data->cidx += (tmp == ',');
+		data->cptr++;
+	}
+	return data->cptr;
+}
+
+static int
+old_sentence(char *buf, int len, const int *fields)
+{
+	nmea_data rdata;
+	char *cp;
+	int sum = 0;
+
+	if (field_init(&rdata, buf, len) <= NMEA_INVALID)
+		return -1;
+	cp = field_parse(&rdata, 0);
+	if (strncmp(cp + 2, "RMC,", 4) && strncmp(cp + 2, "GGA,", 4) &&
+	    strncmp(cp + 2, "GLL,", 4) && strncmp(cp + 2, "ZDA,", 4) &&
+	    strncmp(cp + 2, "ZDG,", 4) && strncmp(cp, "PGRMF,", 6))
+		return 0;
+	for (; *fields >= 0; fields++)
+		sum += *field_parse(&rdata, *fields);
+	return sum;
+}
+
+/*******************************************************************/
+
+static int
+scan_sentence(char *buf, int len, const int *fields)
+{
+	nmea_sentence s;
+	int sum = 0;
+
+	if (nmea_scan(buf, len, &s) <= NMEA_INVALID)
+		return -1;
+	if (NMEA_SENT_UNKNOWN == s.sentence)
+		return 0;
+	for (; *fields >= 0; fields++)
+		sum += *nmea_field(&s, *fields);
+	return sum;
+}
+
+static void
+DoParse(int i, bool old)
+{
+	struct timespec start, stop;
+	char	buf[128];
+	int	len = (int)strlen(sentences[i].text);
+	double	average;
+	int	n = 0;
+
+	memcpy(buf, sentences[i].text, (size_t)len + 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int j = 0; j < NUM; j++)
+		n = old ? old_sentence(buf, len, sentences[i].fields) :
+		    scan_sentence(buf, len, sentences[i].fields);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	average = (stop.tv_sec-start.tv_sec)*1E9 + (stop.tv_nsec-start.tv_nsec);
+	average = average/NUM;
+	printf("%-4s %-5s %8.1f %6d %5d\n", sentences[i].name,
+	       old ? "old" : "scan", average, len, n);
+}
+
+int main (int argc, char *argv[]) {
+	if (argc > 1)
+		NUM = atoi(argv[1]);
+
+	printf("name parse  avg ns  bytes   sum\n");
+	for (size_t i = 0; i < sizeof(sentences) / sizeof(sentences[0]); i++) {
+		DoParse((int)i, true);
+		DoParse((int)i, false);
+	}
+
+	return 0;
+}
@@ -0,0 +1,520 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Load a running ntpd with client requests and measure what it serves.
+ *
+ * Each of -s simulated clients sends from its own address, counting up
+ * from -b (127.2.0.1 by default; on Linux all of 127/8 is local).  Each
+ * keeps -w requests outstanding, closed loop: a new one goes out as
+ * soon as one is answered or -T milliseconds pass without an answer.
+ * A client never sends faster than -r requests per second, so that
+ * restrict ... limited can be made to send KoDs, or not.
+ *
+ *   -a keyid -k keyfile  MAC every request with a key ntpd trusts
+ *   -K cookiekeys        NTS: mint cookies with ntpd's cookie key file
+ *                        (nts cookie in ntp.conf) instead of running
+ *                        NTS-KE, and send every request with one
+ *
+ * After -d seconds it reports requests sent, good replies, KoDs and
+ * lost requests, reply latency percentiles, and what ntpd's counters
+ * say happened meanwhile: packets dropped for want of a receive buffer
+ * (io_dropped), shed as floods (io_shed), and rate limited (ss_limited,
+ * ss_kodsent).  Those come from mode 6, so ntpd must allow queries.
+ *
+ * Usage: ntpd-load [-s sources] [-w window] [-r rate] [-d seconds]
+ *                  [-T timeout-ms] [-b first-source] [-a keyid -k keyfile]
+ *                  [-K cookiekeys] [server [port]]
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ntpd.h"
+#include "ntp_auth.h"
+#include "ntp_control.h"
+#include "ntp_dns.h"
+#include "nts.h"
+#include "nts2.h"
+
+static int nsources = 64;
+static int window = 1;
+static double rate = 0;			/* per source, 0 for no limit */
+static double duration = 10;
+static double timeout = 1;
+static struct in_addr first_source;
+
+static auth_info *auth;			/* MAC key, if any */
+#ifndef DISABLE_NTS
+static bool nts;
+static struct peer nts_peer;		/* holds the cookies and keys */
+static struct peer_cold nts_cold;
+#endif
+
+static int sock;
+static struct sockaddr_storage server;
+static socklen_t serverlen;
+
+struct slot {
+	int source;
+	uint32_t seq;			/* of the request in flight */
+	bool out;			/* a request is in flight */
+	double sent;
+};
+static struct slot *slots;
+static int nslots;
+static double *next_send;		/* per source, for -r */
+
+static unsigned long sent, replies, kods, lost, senderrs;
+static unsigned long kod_rate, kod_deny, kod_nts;
+static double *lat;			/* seconds, one per good reply */
+static size_t nlat, latalloc;
+
+/* ntpd counters, read before and after */
+static const char *counter_names[] = {
+	"ss_received", "ss_processed", "io_dropped", "io_shed",
+	"ss_limited", "ss_kodsent", "ss_badauth",
+};
+#define NCOUNTERS (sizeof(counter_names) / sizeof(counter_names[0]))
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Send len bytes to the server from source address src (network order) */
+static bool
+send_from(const void *buf, size_t len, struct in_addr src)
+{
+	struct msghdr msg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)(intptr_t)buf;
+	iov.iov_len = len;
+	msg.msg_name = &server;
+	msg.msg_namelen = serverlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+#ifdef IP_PKTINFO
+	char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+	if (AF_INET == server.ss_family) {
+		struct cmsghdr *cmsg;
+		struct in_pktinfo *pi;
+
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+		pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+		pi->ipi_spec_dst = src;
+	}
+#else
+	UNUSED_ARG(src);
+#endif
+	return sendmsg(sock, &msg, 0) == (ssize_t)len;
+}
+
+/*
+ * Send the request for slot i.  The transmit timestamp carries the
+ * slot and a sequence number; the reply brings it back as origin.
+ */
+static void
+send_request(int i, double t)
+{
+	struct slot *s = &slots[i];
+	struct pkt pkt;
+	struct in_addr src;
+	size_t len = LEN_PKT_NOMAC;
+
+	memset(&pkt, 0, LEN_PKT_NOMAC);
+	pkt.li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC, NTP_VERSION,
+					MODE_CLIENT);
+	s->seq++;
+	pkt.xmt.l_ui = htonl((uint32_t)i);
+	pkt.xmt.l_uf = htonl(s->seq);
+	if (NULL != auth)
+		len += (size_t)authencrypt(auth, (uint32_t *)&pkt, LEN_PKT_NOMAC);
+#ifndef DISABLE_NTS
+	if (nts) {
+		/* Cookies are reused, the server can't tell */
+		nts_peer.cold->nts_state.count = NTS_MAX_COOKIES;
+		len += (size_t)extens_client_send(&nts_peer, &pkt);
+	}
+#endif
+	src.s_addr = htonl(ntohl(first_source.s_addr) + (uint32_t)s->source);
+	if (!send_from(&pkt, len, src)) {
+		senderrs++;
+		return;
+	}
+	sent++;
+	s->out = true;
+	s->sent = t;
+	if (rate > 0)
+		next_send[s->source] = t + 1 / rate;
+}
+
+static void
+take_reply(const struct pkt *r, ssize_t len, double t)
+{
+	uint32_t i, seq;
+	struct slot *s;
+
+	if (len < LEN_PKT_NOMAC || MODE_SERVER != PKT_MODE(r->li_vn_mode))
+		return;
+	i = ntohl(r->org.l_ui);
+	seq = ntohl(r->org.l_uf);
+	if (i >= (uint32_t)nslots)
+		return;
+	s = &slots[i];
+	if (!s->out || seq != s->seq)
+		return;			/* late, already counted lost */
+	s->out = false;
+	/* An unsynchronized server says stratum 0 too, with INIT or STEP */
+	if (STRATUM_PKT_UNSPEC == r->stratum) {
+		if (0 == memcmp(&r->refid, "RATE", REFIDLEN))
+			kod_rate++;
+		else if (0 == memcmp(&r->refid, "NTSN", REFIDLEN))
+			kod_nts++;
+		else if (0 == memcmp(&r->refid, "DENY", REFIDLEN) ||
+			 0 == memcmp(&r->refid, "RSTR", REFIDLEN))
+			kod_deny++;
+		if (kod_rate + kod_nts + kod_deny > kods) {
+			kods++;
+			return;
+		}
+	}
+	replies++;
+	if (nlat == latalloc) {
+		latalloc = latalloc ? 2 * latalloc : 65536;
+		lat = erealloc(lat, latalloc * sizeof(*lat));
+	}
+	lat[nlat++] = t - s->sent;
+}
+
+static void
+run(void)
+{
+	double start = now(), t;
+	struct pkt reply;
+	ssize_t len;
+
+	while ((t = now()) < start + duration) {
+		for (int i = 0; i < nslots; i++) {
+			struct slot *s = &slots[i];
+
+			if (s->out) {
+				if (t - s->sent < timeout)
+					continue;
+				s->out = false;
+				lost++;
+			}
+			if (rate > 0 && t < next_send[s->source])
+				continue;
+			send_request(i, t);
+		}
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		if (poll(&pfd, 1, 1) <= 0)
+			continue;
+		while ((len = recv(sock, &reply, sizeof(reply),
+				   MSG_DONTWAIT)) >= 0)
+			take_reply(&reply, len, now());
+	}
+}
+
+/*
+ * Read ntpd's counters with a mode 6 READVAR from an ordinary socket.
+ * They all fit in one response.
+ */
+static bool
+read_counters(uint64_t *values)
+{
+	struct ntp_control req, resp;
+	size_t count = 0;
+	ssize_t len;
+	int fd;
+	struct pollfd pfd;
+	char text[sizeof(resp.data) + 1];
+
+	memset(&req, 0, sizeof(req));
+	req.li_vn_mode = PKT_LI_VN_MODE(0, NTP_VERSION, MODE_CONTROL);
+	req.r_m_e_op = CTL_OP_READVAR;
+	req.sequence = htons(1);
+	for (size_t i = 0; i < NCOUNTERS; i++)
+		count += (size_t)snprintf((char *)req.data + count,
+					  sizeof(req.data) - count, "%s%s",
+					  i ? "," : "", counter_names[i]);
+	req.count = htons((uint16_t)count);
+
+	fd = socket(server.ss_family, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return false;
+	len = sendto(fd, &req, CTL_HEADER_LEN + ((count + 3) & ~3U), 0,
+		     (struct sockaddr *)&server, serverlen);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (len < 0 || poll(&pfd, 1, 1000) <= 0 ||
+	    (len = recv(fd, &resp, sizeof(resp), 0)) < (ssize_t)CTL_HEADER_LEN ||
+	    CTL_ISERROR(resp.r_m_e_op)) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+	count = min(ntohs(resp.count), (size_t)len - CTL_HEADER_LEN);
+	memcpy(text, resp.data, count);
+	text[count] = '\0';
+	for (size_t i = 0; i < NCOUNTERS; i++) {
+		size_t n = strlen(counter_names[i]);
+		char *p = text;
+
+		values[i] = 0;
+		while (NULL != (p = strstr(p, counter_names[i]))) {
+			if ((p == text || isspace((unsigned char)p[-1]) ||
+			     ',' == p[-1]) &&
+			    '=' == p[n]) {
+				values[i] = strtoull(p + n + 1, NULL, 10);
+				break;
+			}
+			p += n;
+		}
+	}
+	return true;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(double *sorted, size_t n, double p)
+{
+	return sorted[(size_t)(p / 100.0 * (double)(n - 1))];
+}
+
+static void
+report(bool counted, const uint64_t *before, const uint64_t *after)
+{
+	printf("%d sources x %d outstanding, %.0f s", nsources, window,
+	       duration);
+	if (rate > 0)
+		printf(", at most %g/s each", rate);
+	printf("%s%s\n", auth ? ", MAC" : "",
+#ifndef DISABLE_NTS
+	       nts ? ", NTS" :
+#endif
+	       "");
+	printf("sent %lu  replies %lu  KoD %lu (RATE %lu, NTSN %lu, DENY/RSTR %lu)"
+	       "  lost %lu", sent, replies, kods, kod_rate, kod_nts, kod_deny,
+	       lost);
+	if (0 != senderrs)
+		printf("  send errors %lu", senderrs);
+	printf("\n");
+	printf("served %.0f/s  lost %.2f%%\n", (double)replies / duration,
+	       sent ? 100.0 * (double)lost / (double)sent : 0.0);
+	if (0 != nlat) {
+		qsort(lat, nlat, sizeof(*lat), cmp_double);
+		printf("latency p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  "
+		       "max %.1f usec\n",
+		       percentile(lat, nlat, 50) * 1e6,
+		       percentile(lat, nlat, 90) * 1e6,
+		       percentile(lat, nlat, 99) * 1e6,
+		       percentile(lat, nlat, 99.9) * 1e6, lat[nlat - 1] * 1e6);
+	}
+	if (!counted) {
+		printf("ntpd counters unavailable (mode 6 refused?)\n");
+		return;
+	}
+	printf("ntpd:");
+	for (size_t i = 0; i < NCOUNTERS; i++)
+		printf(" %s %llu", counter_names[i],
+		       (unsigned long long)(after[i] - before[i]));
+	printf("\n");
+}
+
+#ifndef DISABLE_NTS
+static void
+setup_nts(const char *cookiekeys)
+{
+	uint16_t aead = AEAD_AES_SIV_CMAC_256;
+	int keylen = nts_get_key_length(aead);
+
+	ntsconfig.KI = cookiekeys;
+	nts_cookie_init();
+	extens_init();
+	if (!nts_read_cookie_keys()) {
+		printf("can't read NTS cookie keys from %s\n", cookiekeys);
+		exit(1);
+	}
+	memset(&nts_peer, 0, sizeof(nts_peer));
+	nts_peer.cold = &nts_cold;
+	nts_peer.cold->nts_state.aead = aead;
+	nts_peer.cold->nts_state.keylen = keylen;
+	ntp_RAND_bytes(nts_peer.cold->nts_state.c2s, keylen);
+	ntp_RAND_bytes(nts_peer.cold->nts_state.s2c, keylen);
+	for (int i = 0; i < NTS_MAX_COOKIES; i++)
+		nts_peer.cold->nts_state.cookielen = nts_make_cookie(
+			nts_peer.cold->nts_state.cookies[i], aead,
+			nts_peer.cold->nts_state.c2s, nts_peer.cold->nts_state.s2c, keylen);
+	nts = true;
+}
+#endif
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [-s sources] [-w window] [-r rate] [-d seconds]\n"
+	       "       [-T timeout-ms] [-b first-source] "
+	       "[-a keyid -k keyfile]\n"
+	       "       [-K cookiekeys] [server [port]]\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1", *port = "123";
+	const char *keyfile = NULL, *cookiekeys = NULL;
+	keyid_t keyid = 0;
+	struct addrinfo hints, *res;
+	uint64_t before[NCOUNTERS], after[NCOUNTERS];
+	bool counted;
+	int c;
+
+	inet_pton(AF_INET, "127.2.0.1", &first_source);
+	while ((c = getopt(argc, argv, "s:w:r:d:T:b:a:k:K:")) != -1) {
+		switch (c) {
+		    case 's':
+			nsources = atoi(optarg);
+			break;
+		    case 'w':
+			window = atoi(optarg);
+			break;
+		    case 'r':
+			rate = atof(optarg);
+			break;
+		    case 'd':
+			duration = atof(optarg);
+			break;
+		    case 'T':
+			timeout = atof(optarg) / 1000;
+			break;
+		    case 'b':
+			if (1 != inet_pton(AF_INET, optarg, &first_source))
+				usage(argv[0]);
+			break;
+		    case 'a':
+			keyid = (keyid_t)atoi(optarg);
+			break;
+		    case 'k':
+			keyfile = optarg;
+			break;
+		    case 'K':
+			cookiekeys = optarg;
+			break;
+		    default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		host = argv[optind++];
+	if (optind < argc)
+		port = argv[optind++];
+	if (nsources < 1 || window < 1 || duration <= 0 || timeout <= 0)
+		usage(argv[0]);
+
+	if (NULL != keyfile) {
+		ssl_init();
+		auth_init();
+		if (!authreadkeys(keyfile)) {
+			printf("can't read keys from %s\n", keyfile);
+			exit(1);
+		}
+		authtrust(keyid, true);
+		auth = authlookup(keyid, true);
+		if (NULL == auth) {
+			printf("no key %u in %s\n", (unsigned)keyid, keyfile);
+			exit(1);
+		}
+	}
+	if (NULL != cookiekeys) {
+#ifndef DISABLE_NTS
+		ssl_init();
+		setup_nts(cookiekeys);
+#else
+		printf("built without NTS\n");
+		exit(1);
+#endif
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	if (0 != getaddrinfo(host, port, &hints, &res)) {
+		printf("can't resolve %s\n", host);
+		exit(1);
+	}
+	memcpy(&server, res->ai_addr, res->ai_addrlen);
+	serverlen = res->ai_addrlen;
+	freeaddrinfo(res);
+#ifdef IP_PKTINFO
+	if (AF_INET != server.ss_family)
+#endif
+	{
+		/* can't choose the source address */
+		nsources = 1;
+	}
+
+	sock = socket(server.ss_family, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+	/* replies arrive in bursts, don't lose them here */
+	c = 8 * 1024 * 1024;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &c, sizeof(c));
+
+	nslots = nsources * window;
+	slots = calloc((size_t)nslots, sizeof(*slots));
+	next_send = calloc((size_t)nsources, sizeof(*next_send));
+	if (NULL == slots || NULL == next_send) {
+		printf("out of memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < nslots; i++)
+		slots[i].source = i / window;
+
+	counted = read_counters(before);
+	run();
+	/* let the last replies in before asking ntpd what it did */
+	usleep(100000);
+	counted = counted && read_counters(after);
+	report(counted, before, after);
+	return 0;
+}
+
+/* the rest of ntpd it links without is in ntpd-stubs.c */
+const char *progname = "ntpd-load";
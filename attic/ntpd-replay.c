@@ -0,0 +1,575 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Replay a pcap capture of NTP traffic straight into ntpd's receive
+ * path, with no sockets: each UDP datagram to port 123 becomes a
+ * recvbuf stamped with its capture time, and replies are caught where
+ * ntpd would queue them for sending.  current_time follows the
+ * capture, so rate limiting and the MRU list see the traffic as ntpd
+ * saw it, and a run is repeatable.
+ *
+ * The capture goes through in passes, each from a fresh MRU list and
+ * fresh counters, timing one stage a packet at a time:
+ *
+ *   restrict  restrictions()
+ *   monitor   ntp_monitor()
+ *   auth      authlookup() and authdecrypt(), packets with a MAC only
+ *   receive   receive(): all of the above, parsing, NTS, the reply
+ *
+ * and reports nanoseconds per packet, mean and percentiles, with what
+ * receive() made of the packets.
+ *
+ *   -n count     replay the capture count times in each pass
+ *   -l           restrict default limited kod
+ *   -R count     add count restrict entries ahead of the default
+ *   -k keyfile -a keyid[,keyid...]
+ *                trust these keys for MACed requests
+ *   -K cookiekeys
+ *                decrypt NTS cookies with ntpd's cookie key file
+ *
+ * Only classic pcap files are read, not pcapng (editcap -F pcap).
+ *
+ * Usage: ntpd-replay [-n count] [-l] [-R count] [-k keyfile -a keyids]
+ *                    [-K cookiekeys] capture.pcap
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ntpd.h"
+#include "ntp_auth.h"
+#include "ntp_config.h"
+#include "ntp_dns.h"
+#include "ntp_endian.h"
+#include "ntp_io.h"
+#include "ntp_lists.h"
+#include "ntp_refclock.h"
+#include "nts.h"
+#include "nts2.h"
+#include "recvbuff.h"
+#include "timespecops.h"
+
+#define PCAP_MAGIC	0xa1b2c3d4	/* microsecond stamps */
+#define PCAP_MAGIC_NS	0xa1b23c4d	/* nanosecond stamps */
+
+/* link types this understands */
+#define DLT_NULL	0
+#define DLT_EN10MB	1
+#define DLT_RAW		101
+#define DLT_LINUX_SLL	113
+#define DLT_LINUX_SLL2	276
+
+struct request {
+	sockaddr_u	src;
+	sockaddr_u	dst;
+	double		when;		/* seconds into the capture */
+	size_t		off;		/* of the payload in data */
+	size_t		len;
+};
+
+static struct request *reqs;
+static size_t nreqs, reqalloc;
+static uint8_t *data;
+static size_t datalen, dataalloc;
+static double span;			/* of the capture, seconds */
+static size_t skipped;			/* not UDP to port 123 */
+
+static int passes = 1;
+
+/* What ntpd tried to send */
+static unsigned long replies, reply_octets, kods;
+
+static double *ns;			/* per packet, one pass */
+
+static uint32_t
+get32(const uint8_t *p, bool swap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static void
+add_request(const sockaddr_u *src, const sockaddr_u *dst, double when,
+	    const uint8_t *payload, size_t len)
+{
+	struct request *r;
+
+	if (len > RX_BUFF_SIZE)
+		return;
+	if (nreqs == reqalloc) {
+		reqalloc = reqalloc ? 2 * reqalloc : 4096;
+		reqs = erealloc(reqs, reqalloc * sizeof(*reqs));
+	}
+	while (datalen + len > dataalloc) {
+		dataalloc = dataalloc ? 2 * dataalloc : 1024 * 1024;
+		data = erealloc(data, dataalloc);
+	}
+	r = &reqs[nreqs++];
+	r->src = *src;
+	r->dst = *dst;
+	r->when = when;
+	r->off = datalen;
+	r->len = len;
+	memcpy(data + datalen, payload, len);
+	datalen += len;
+}
+
+/* One IP datagram; keep it if it is UDP to port 123 */
+static void
+take_ip(const uint8_t *p, size_t len, double when)
+{
+	sockaddr_u src, dst;
+	const uint8_t *udp;
+	size_t hl, ulen;
+	uint8_t proto;
+
+	ZERO(src);
+	ZERO(dst);
+	if (len >= 20 && 4 == p[0] >> 4) {
+		hl = (size_t)(p[0] & 0xf) * 4;
+		/* fragments other than the first can't be parsed */
+		if (hl < 20 || len < hl || 0 != (ntp_be16dec(p + 6) & 0x3fff))
+			goto skip;
+		proto = p[9];
+		AF(&src) = AF(&dst) = AF_INET;
+		memcpy(&PSOCK_ADDR4(&src)->s_addr, p + 12, 4);
+		memcpy(&PSOCK_ADDR4(&dst)->s_addr, p + 16, 4);
+	} else if (len >= 40 && 6 == p[0] >> 4) {
+		/* no extension headers */
+		hl = 40;
+		proto = p[6];
+		AF(&src) = AF(&dst) = AF_INET6;
+		memcpy(PSOCK_ADDR6(&src)->s6_addr, p + 8, 16);
+		memcpy(PSOCK_ADDR6(&dst)->s6_addr, p + 24, 16);
+	} else {
+		goto skip;
+	}
+	if (IPPROTO_UDP != proto || len < hl + 8)
+		goto skip;
+	udp = p + hl;
+	if (NTP_PORT != ntp_be16dec(udp + 2))
+		goto skip;
+	SET_PORT(&src, ntp_be16dec(udp));
+	SET_PORT(&dst, NTP_PORT);
+	ulen = ntp_be16dec(udp + 4);
+	if (ulen < 8)
+		goto skip;
+	/* trust the UDP length only as far as the capture goes */
+	ulen = min(ulen - 8, len - hl - 8);
+	add_request(&src, &dst, when, udp + 8, ulen);
+	return;
+    skip:
+	skipped++;
+}
+
+/* One frame; strip the link layer */
+static void
+take_frame(uint32_t linktype, const uint8_t *p, size_t len, double when)
+{
+	size_t hl;
+	unsigned int ethertype;
+
+	switch (linktype) {
+	    case DLT_NULL:
+		hl = 4;
+		break;
+	    case DLT_RAW:
+		hl = 0;
+		break;
+	    case DLT_LINUX_SLL:
+		hl = 16;
+		break;
+	    case DLT_LINUX_SLL2:
+		hl = 20;
+		break;
+	    case DLT_EN10MB:
+		hl = 14;
+		if (len < hl)
+			goto skip;
+		ethertype = ntp_be16dec(p + 12);
+		/* 802.1Q VLAN tags */
+		while ((0x8100 == ethertype || 0x88a8 == ethertype) &&
+		       len >= hl + 4) {
+			ethertype = ntp_be16dec(p + hl + 2);
+			hl += 4;
+		}
+		if (0x0800 != ethertype && 0x86dd != ethertype)
+			goto skip;
+		break;
+	    default:
+		goto skip;
+	}
+	if (len < hl)
+		goto skip;
+	take_ip(p + hl, len - hl, when);
+	return;
+    skip:
+	skipped++;
+}
+
+static void
+load_pcap(const char *name)
+{
+	FILE *fp;
+	uint8_t hdr[24], rec[16];
+	uint8_t *frame;
+	uint32_t magic, linktype, snaplen, caplen;
+	bool swap, nano;
+	double when, first = -1;
+
+	fp = fopen(name, "rb");
+	if (NULL == fp) {
+		perror(name);
+		exit(1);
+	}
+	if (1 != fread(hdr, sizeof(hdr), 1, fp)) {
+		printf("%s: too short for a pcap file\n", name);
+		exit(1);
+	}
+	memcpy(&magic, hdr, sizeof(magic));
+	swap = (PCAP_MAGIC != magic && PCAP_MAGIC_NS != magic);
+	magic = get32(hdr, swap);
+	if (PCAP_MAGIC != magic && PCAP_MAGIC_NS != magic) {
+		printf("%s: not a pcap file (pcapng isn't read)\n", name);
+		exit(1);
+	}
+	nano = (PCAP_MAGIC_NS == magic);
+	snaplen = get32(hdr + 16, swap);
+	/* the top bits can carry FCS information */
+	linktype = get32(hdr + 20, swap) & 0x0fffffff;
+	frame = emalloc(max(snaplen, 65536U));
+
+	while (1 == fread(rec, sizeof(rec), 1, fp)) {
+		caplen = get32(rec + 8, swap);
+		if (caplen > max(snaplen, 65536U)) {
+			printf("%s: corrupt record\n", name);
+			exit(1);
+		}
+		if (1 != fread(frame, caplen, 1, fp))
+			break;
+		when = (double)get32(rec, swap) +
+			(double)get32(rec + 4, swap) * (nano ? 1e-9 : 1e-6);
+		if (first < 0)
+			first = when;
+		take_frame(linktype, frame, caplen, when - first);
+	}
+	fclose(fp);
+	free(frame);
+	if (nreqs > 0)
+		span = reqs[nreqs - 1].when;
+}
+
+/* Stamp the recvbuf and the clock for request r of repetition rep */
+static void
+fill_recvbuf(struct recvbuf *rb, const struct request *r, int rep,
+	     endpt *ep)
+{
+	double when = r->when + rep * (floor(span) + 1);
+
+	memset(rb, 0, offsetof(struct recvbuf, recv_buffer));
+	current_time = (uptime_t)when + 1;
+	rb->recv_time = dtolfp(when + 1);
+	rb->recv_length = r->len;
+	rb->recv_srcadr = r->src;
+	rb->fd = -1;
+	ep->sin = r->dst;
+	ep->family = AF(&r->dst);
+	rb->dstadr = ep;
+	memcpy(rb->recv_buffer, data + r->off, r->len);
+}
+
+/* A MAC, and nothing else, after the header: return its length */
+static int
+mac_length(const struct request *r)
+{
+	size_t extra = r->len - LEN_PKT_NOMAC;
+
+	if (r->len <= LEN_PKT_NOMAC)
+		return 0;
+	if (extra == 4 + 16 || extra == 4 + 20)
+		return (int)extra;
+	return 0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(double *sorted, size_t n, double p)
+{
+	return sorted[(size_t)(p / 100.0 * (double)(n - 1))];
+}
+
+static void
+report(const char *stage, size_t n)
+{
+	double sum = 0;
+
+	if (0 == n) {
+		printf("%-8s  no packets\n", stage);
+		return;
+	}
+	for (size_t i = 0; i < n; i++)
+		sum += ns[i];
+	qsort(ns, n, sizeof(*ns), cmp_double);
+	printf("%-8s %9zu  %8.0f %8.0f %8.0f %8.0f %9.0f\n", stage, n,
+	       sum / (double)n, percentile(ns, n, 50), percentile(ns, n, 99),
+	       percentile(ns, n, 99.9), ns[n - 1]);
+}
+
+static void
+fresh_state(void)
+{
+	mon_stop();
+	mon_start();
+	proto_clr_stats();
+	replies = reply_octets = kods = 0;
+}
+
+static void
+run_passes(void)
+{
+	static struct recvbuf rb;
+	endpt ep;
+	struct timespec start, finish;
+	size_t n;
+	unsigned short mask;
+
+	ZERO(ep);
+	printf("%-8s %9s  %8s %8s %8s %8s %9s  (ns)\n", "stage", "packets",
+	       "mean", "p50", "p99", "p99.9", "max");
+
+	fresh_state();
+	n = 0;
+	for (int rep = 0; rep < passes; rep++)
+		for (size_t i = 0; i < nreqs; i++) {
+			fill_recvbuf(&rb, &reqs[i], rep, &ep);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			mask = restrictions(&rb.recv_srcadr);
+			clock_gettime(CLOCK_MONOTONIC, &finish);
+			ns[n++] = tspec_to_d(sub_tspec(finish, start)) * 1e9;
+		}
+	report("restrict", n);
+
+	fresh_state();
+	n = 0;
+	for (int rep = 0; rep < passes; rep++)
+		for (size_t i = 0; i < nreqs; i++) {
+			fill_recvbuf(&rb, &reqs[i], rep, &ep);
+			mask = restrictions(&rb.recv_srcadr);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ntp_monitor(&rb, mask);
+			clock_gettime(CLOCK_MONOTONIC, &finish);
+			ns[n++] = tspec_to_d(sub_tspec(finish, start)) * 1e9;
+		}
+	report("monitor", n);
+
+	n = 0;
+	for (int rep = 0; rep < passes; rep++)
+		for (size_t i = 0; i < nreqs; i++) {
+			int maclen = mac_length(&reqs[i]);
+			auth_info *auth;
+
+			if (0 == maclen)
+				continue;
+			fill_recvbuf(&rb, &reqs[i], rep, &ep);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			auth = authlookup(ntp_be32dec(rb.recv_buffer +
+						      LEN_PKT_NOMAC), true);
+			if (NULL != auth)
+				authdecrypt(auth, (uint32_t *)rb.recv_buffer,
+					    LEN_PKT_NOMAC, maclen);
+			clock_gettime(CLOCK_MONOTONIC, &finish);
+			ns[n++] = tspec_to_d(sub_tspec(finish, start)) * 1e9;
+		}
+	report("auth", n);
+
+	fresh_state();
+	n = 0;
+	for (int rep = 0; rep < passes; rep++)
+		for (size_t i = 0; i < nreqs; i++) {
+			fill_recvbuf(&rb, &reqs[i], rep, &ep);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			receive(&rb);
+			clock_gettime(CLOCK_MONOTONIC, &finish);
+			ns[n++] = tspec_to_d(sub_tspec(finish, start)) * 1e9;
+		}
+	report("receive", n);
+
+	printf("\nreceive: replies %lu (%lu octets), KoD %lu\n",
+	       replies, reply_octets, kods);
+	printf("ntpd: received %llu processed %llu restricted %llu "
+	       "limited %llu kodsent %llu\n"
+	       "      badlength %llu badauth %llu declined %llu\n",
+	       (unsigned long long)stat_total_received(),
+	       (unsigned long long)stat_total_processed(),
+	       (unsigned long long)stat_total_restricted(),
+	       (unsigned long long)stat_total_limitrejected(),
+	       (unsigned long long)stat_total_kodsent(),
+	       (unsigned long long)stat_total_badlength(),
+	       (unsigned long long)stat_total_badauth(),
+	       (unsigned long long)stat_total_declined());
+}
+
+/* Put count restrict entries, 10.x.y.0/24 noquery, ahead of default */
+static void
+add_restricts(int count)
+{
+	sockaddr_u addr, mask;
+
+	ZERO(addr);
+	ZERO(mask);
+	AF(&addr) = AF(&mask) = AF_INET;
+	PSOCK_ADDR4(&mask)->s_addr = htonl(0xffffff00);
+	for (int i = 0; i < count; i++) {
+		PSOCK_ADDR4(&addr)->s_addr =
+			htonl(0x0a000000 | ((uint32_t)i << 8));
+		hack_restrict(RESTRICT_FLAGS, &addr, &mask, 0, RES_NOQUERY);
+	}
+}
+
+static void
+limit_default(void)
+{
+	sockaddr_u addr, mask;
+
+	ZERO(addr);
+	ZERO(mask);
+	AF(&addr) = AF(&mask) = AF_INET;
+	hack_restrict(RESTRICT_FLAGS, &addr, &mask, 0, RES_LIMITED | RES_KOD);
+	AF(&addr) = AF(&mask) = AF_INET6;
+	hack_restrict(RESTRICT_FLAGS, &addr, &mask, 0, RES_LIMITED | RES_KOD);
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [-n count] [-l] [-R count] "
+	       "[-k keyfile -a keyids]\n"
+	       "       [-K cookiekeys] capture.pcap\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *keyfile = NULL, *keyids = NULL, *cookiekeys = NULL;
+	bool limited = false;
+	int restricts = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:lR:k:a:K:")) != -1) {
+		switch (c) {
+		    case 'n':
+			passes = atoi(optarg);
+			break;
+		    case 'l':
+			limited = true;
+			break;
+		    case 'R':
+			restricts = atoi(optarg);
+			break;
+		    case 'k':
+			keyfile = optarg;
+			break;
+		    case 'a':
+			keyids = optarg;
+			break;
+		    case 'K':
+			cookiekeys = optarg;
+			break;
+		    default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc || passes < 1)
+		usage(argv[0]);
+
+	ssl_init();
+	auth_init();
+	init_restrict();
+	init_mon();
+	mon_setup(MON_ON);
+	init_proto(false);
+	if (limited)
+		limit_default();
+	add_restricts(restricts);
+	if (NULL != keyfile) {
+		char *ids = estrdup(NULL != keyids ? keyids : "");
+
+		if (!authreadkeys(keyfile)) {
+			printf("can't read keys from %s\n", keyfile);
+			exit(1);
+		}
+		for (char *id = strtok(ids, ","); NULL != id;
+		     id = strtok(NULL, ","))
+			authtrust((keyid_t)atoi(id), true);
+		free(ids);
+	}
+	if (NULL != cookiekeys) {
+#ifndef DISABLE_NTS
+		ntsconfig.KI = cookiekeys;
+		nts_cookie_init();
+		extens_init();
+		if (!nts_read_cookie_keys()) {
+			printf("can't read NTS cookie keys from %s\n",
+			       cookiekeys);
+			exit(1);
+		}
+#else
+		printf("built without NTS\n");
+		exit(1);
+#endif
+	}
+
+	load_pcap(argv[optind]);
+	printf("%zu requests over %.0f s, %zu other frames skipped\n\n",
+	       nreqs, span, skipped);
+	if (0 == nreqs)
+		exit(1);
+	ns = emalloc(nreqs * (size_t)passes * sizeof(*ns));
+	run_passes();
+	return 0;
+}
+
+/*
+ * Replies are counted where they would be sent; the rest of ntpd's
+ * I/O is in ntpd-stubs.c.
+ */
+
+static void
+take_sent(void *pkt, unsigned int len)
+{
+	const struct pkt *p = pkt;
+
+	replies++;
+	reply_octets += len;
+	if (STRATUM_PKT_UNSPEC == p->stratum &&
+	    0 == memcmp(&p->refid, "RATE", REFIDLEN))
+		kods++;
+}
+
+void sendpkt(sockaddr_u *dest, endpt *ep, void *pkt, unsigned int len) {
+	UNUSED_ARG(dest);
+	UNUSED_ARG(ep);
+	take_sent(pkt, len);
+}
+
+const char *progname = "ntpd-replay";
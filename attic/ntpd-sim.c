@@ -0,0 +1,679 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Run ntpd's clock discipline against a simulated system clock and
+ * network, many times faster than real time, for tuning the loop
+ * filter offline.  Unlike kern.c this is the real code: transmit()
+ * and receive() for each exchange, then clock_filter(),
+ * clock_select(), clock_combine() and local_clock(), with
+ * adj_host_clock() once a simulated second.  get_systime(),
+ * adj_systime() and step_systime() are replaced by a clock with a
+ * frequency error that wanders as a random walk, slewed by adjtime()
+ * at 500 PPM the way Linux does it.  The daemon loop disciplines it;
+ * there is no kernel PLL here.
+ *
+ * The servers are truth plus an optional constant offset each, behind
+ * a path of fixed delay plus exponentially distributed queueing both
+ * ways.  Or, with -r, a rawstats file supplies the noise: each
+ * simulated poll of a server takes the offset and delay of that
+ * server's latest sample at the same point in the recording.  The
+ * recorded offsets include the recorded clock's own error; give the
+ * loopstats from the same run with -l and the loop offset is taken
+ * out first.  Text rawstats only.
+ *
+ * -g is ntpd's -g: without it an offset past the panic threshold ends
+ * the run, as it would end ntpd.
+ *
+ * Prints the true clock error, the loop's idea of it, the frequency
+ * and the poll interval every -v seconds, and a summary at the end.
+ *
+ * Usage: ntpd-sim [-g] [-d duration] [-s servers] [-f ppm] [-w ppm]
+ *		   [-o offset] [-D delay] [-j jitter] [-b spread]
+ *		   [-L loss] [-m minpoll] [-M maxpoll] [-S seed]
+ *		   [-W warmup] [-v interval] [-t tinker=value]...
+ *		   [-r rawstats [-l loopstats]]
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ntpd.h"
+#include "ntp_auth.h"
+#include "ntp_calendar.h"
+#include "ntp_config.h"
+#include "ntp_dns.h"
+#include "ntp_io.h"
+#include "ntp_refclock.h"
+#include "ntp_syscall.h"
+#include "ntp_syslog.h"
+#include "nts.h"
+#include "recvbuff.h"
+#include "timespecops.h"
+
+#define	SLEW_RATE	500e-6	/* adjtime() slew (s/s) */
+#define	SETTLED		1e-3	/* clock error counted as settled (s) */
+#define	SIM_EPOCH	1767225600	/* 2026-01-01, POSIX */
+#define	MAXSERVERS	64
+
+/* Tinker items, as in ntp.conf */
+static const struct {
+	const char	*name;
+	int		item;
+} tinkers[] = {
+	{ "allan",	LOOP_ALLAN },
+	{ "dispersion",	LOOP_PHI },
+	{ "freq",	LOOP_FREQ },
+	{ "huffpuff",	LOOP_HUFFPUFF },
+	{ "panic",	LOOP_PANIC },
+	{ "step",	LOOP_MAX },
+	{ "stepback",	LOOP_MAX_BACK },
+	{ "stepfwd",	LOOP_MAX_FWD },
+	{ "stepout",	LOOP_MINSTEP },
+};
+
+/* A rawstats sample, as offset and delay */
+struct sample {
+	double	when;		/* seconds from the first record */
+	double	offset;
+	double	delay;
+};
+
+struct server {
+	char		label[64];
+	struct peer	*peer;
+	double		bias;		/* offset of its clock (s) */
+	struct sample	*samples;	/* -r only */
+	size_t		nsamples;
+	size_t		next;
+};
+
+static struct server servers[MAXSERVERS];
+static int nservers = 3;
+
+/* The simulated clock */
+static l_fp epoch;		/* local clock reading at true time zero */
+static doubletime_t now_true;	/* true time (s) */
+static doubletime_t clock_error; /* local clock minus true time (s) */
+static double osc_freq = 15e-6;	/* oscillator frequency error (s/s) */
+static double wander = 0.05e-6;	/* random walk, s/s in a day */
+static double slew;		/* adjtime() left to do (s) */
+static long steps;
+
+/* The network */
+static double base_delay = 0.002;	/* round trip, without queues */
+static double queue_mean = 0.0002;	/* mean queueing each way */
+static double spread;			/* server offsets, +/- spread/2 */
+static double loss;			/* fraction of replies lost */
+static double span;			/* length of the recording */
+
+static struct pkt request;	/* what transmit() sent last */
+static sockaddr_u request_dest;
+static bool request_sent;
+
+static uint64_t prng = 0x9e3779b97f4a7c15;
+
+/* xorshift64*: the same run from the same seed */
+static double
+uniform(void)
+{
+	prng ^= prng >> 12;
+	prng ^= prng << 25;
+	prng ^= prng >> 27;
+	return (double)((prng * 0x2545f4914f6cdd1d) >> 11) * 0x1p-53;
+}
+
+static double
+gaussian(void)
+{
+	double u = uniform();
+
+	return sqrt(-2 * log(1 - u)) * cos(2 * M_PI * uniform());
+}
+
+static double
+exponential(double mean)
+{
+	return -mean * log(1 - uniform());
+}
+
+static double
+now_real(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* 30s, 15m, 12h, 7d */
+static double
+duration(const char *arg)
+{
+	char *end;
+	double d = strtod(arg, &end);
+
+	switch (*end) {
+	    case 'd':
+		return d * 86400;
+	    case 'h':
+		return d * 3600;
+	    case 'm':
+		return d * 60;
+	    default:
+		return d;
+	}
+}
+
+static double
+mjdtime(double mjd, double sod)
+{
+	return (mjd - MJD_1970) * 86400 + sod;
+}
+
+/* Loop offsets from loopstats, to take out of the rawstats offsets */
+static double *loop_when, *loop_offset;
+static size_t nloop;
+
+static void
+read_loopstats(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char line[256];
+	double mjd, sod, offset;
+	size_t room = 0;
+
+	if (NULL == fp) {
+		perror(path);
+		exit(1);
+	}
+	while (NULL != fgets(line, sizeof(line), fp)) {
+		if (3 != sscanf(line, "%lf %lf %lf", &mjd, &sod, &offset))
+			continue;
+		if (nloop == room) {
+			room = room ? 2 * room : 1024;
+			loop_when = erealloc(loop_when,
+					     room * sizeof(*loop_when));
+			loop_offset = erealloc(loop_offset,
+					       room * sizeof(*loop_offset));
+		}
+		loop_when[nloop] = mjdtime(mjd, sod);
+		loop_offset[nloop++] = offset;
+	}
+	fclose(fp);
+}
+
+/* The loop offset at t, interpolated between updates */
+static double
+loop_offset_at(double t)
+{
+	size_t lo = 0, hi = nloop;
+
+	if (0 == nloop)
+		return 0;
+	if (t <= loop_when[0])
+		return loop_offset[0];
+	if (t >= loop_when[nloop - 1])
+		return loop_offset[nloop - 1];
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+
+		if (loop_when[mid] <= t)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return loop_offset[lo] + (loop_offset[hi] - loop_offset[lo]) *
+	    (t - loop_when[lo]) / (loop_when[hi] - loop_when[lo]);
+}
+
+static void
+read_rawstats(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char line[512], src[64];
+	double mjd, sod, first = 0;
+	long double t1, t2, t3, t4;
+	size_t room[MAXSERVERS] = { 0 };
+	bool any = false;
+
+	if (NULL == fp) {
+		perror(path);
+		exit(1);
+	}
+	nservers = 0;
+	while (NULL != fgets(line, sizeof(line), fp)) {
+		struct server *s = NULL;
+		struct sample *x;
+		double t;
+		int i;
+
+		if (7 != sscanf(line, "%lf %lf %63s %*s %Lf %Lf %Lf %Lf",
+				&mjd, &sod, src, &t1, &t2, &t3, &t4))
+			continue;
+		t = mjdtime(mjd, sod);
+		if (!any) {
+			first = t;
+			any = true;
+		}
+		for (i = 0; i < nservers; i++)
+			if (!strcmp(servers[i].label, src))
+				break;
+		if (i == nservers) {
+			if (MAXSERVERS == nservers)
+				continue;
+			strlcpy(servers[i].label, src,
+				sizeof(servers[i].label));
+			nservers++;
+		}
+		s = &servers[i];
+		if (s->nsamples == room[i]) {
+			room[i] = room[i] ? 2 * room[i] : 256;
+			s->samples = erealloc(s->samples,
+					      room[i] * sizeof(*s->samples));
+		}
+		x = &s->samples[s->nsamples++];
+		x->when = t - first;
+		x->offset = (double)(((t2 - t1) + (t3 - t4)) / 2) -
+		    loop_offset_at(t);
+		x->delay = (double)((t4 - t1) - (t3 - t2));
+		if (x->when > span)
+			span = x->when;
+	}
+	fclose(fp);
+	if (0 == nservers) {
+		fprintf(stderr, "%s: no rawstats records\n", path);
+		exit(1);
+	}
+}
+
+/*
+ * The server's offset and the path delays for an exchange starting
+ * now.  A recording is replayed from the start again if the run is
+ * longer than it.
+ */
+static void
+path(struct server *s, double *offset, double *out, double *back)
+{
+	if (NULL == s->samples) {
+		*offset = s->bias;
+		*out = base_delay / 2 + exponential(queue_mean);
+		*back = base_delay / 2 + exponential(queue_mean);
+		return;
+	}
+
+	double t = fmod((double)now_true, floor(span) + 1);
+
+	if (t < s->samples[0].when || s->next >= s->nsamples ||
+	    (s->next > 0 && t < s->samples[s->next - 1].when))
+		s->next = 0;
+	while (s->next + 1 < s->nsamples && s->samples[s->next + 1].when <= t)
+		s->next++;
+	*offset = s->samples[s->next].offset;
+	*out = *back = fmax(s->samples[s->next].delay, 0) / 2;
+}
+
+static l_fp_w
+wire(l_fp ts)
+{
+	l_fp_w w;
+
+	w.l_ui = htonl(lfpuint(ts));
+	w.l_uf = htonl(lfpfrac(ts));
+	return w;
+}
+
+/* What the local clock reads dt seconds from now */
+static l_fp
+local_time(double dt)
+{
+	return epoch + dtolfp(now_true + dt + clock_error);
+}
+
+/* Answer the request transmit() just sent, through receive() */
+static void
+reply(struct server *s, endpt *ep)
+{
+	static struct recvbuf rb;
+	struct pkt *rpkt = (struct pkt *)rb.recv_buffer;
+	double offset, out, back;
+	l_fp t2;
+
+	path(s, &offset, &out, &back);
+	t2 = epoch + dtolfp(now_true + out + offset);
+
+	memset(&rb, 0, sizeof(rb));
+	rpkt->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOWARNING, NTP_VERSION,
+					  MODE_SERVER);
+	rpkt->stratum = 1;
+	rpkt->ppoll = s->peer->hpoll;
+	rpkt->precision = -20;
+	rpkt->rootdelay = 0;
+	rpkt->rootdisp = htonl(DTOUFP(1e-5));
+	memcpy(&rpkt->refid, "SIM", 4);
+	rpkt->reftime = wire(t2 - dtolfp(1.0));
+	rpkt->org = request.xmt;
+	rpkt->rec = wire(t2);
+	rpkt->xmt = wire(t2);
+
+	rb.recv_time = local_time(out + back);
+	rb.recv_length = LEN_PKT_NOMAC;
+	rb.recv_srcadr = request_dest;
+	rb.dstadr = ep;
+	rb.fd = -1;
+	receive(&rb);
+}
+
+/* One simulated second of the clock: slew and oscillator */
+static void
+tick(void)
+{
+	double step = slew;
+
+	if (step > SLEW_RATE)
+		step = SLEW_RATE;
+	else if (step < -SLEW_RATE)
+		step = -SLEW_RATE;
+	slew -= step;
+	clock_error += osc_freq + step;
+	osc_freq += wander / sqrt(86400) * gaussian();
+	now_true += 1;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-g] [-d duration] [-s servers] [-f ppm] "
+		"[-w ppm]\n"
+		"\t[-o offset] [-D delay] [-j jitter] [-b spread] "
+		"[-L loss]\n"
+		"\t[-m minpoll] [-M maxpoll] [-S seed] [-W warmup] "
+		"[-v interval]\n"
+		"\t[-t tinker=value]... [-r rawstats [-l loopstats]]\n",
+		name);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct peer_ctl ctl;
+	endpt ep;
+	double runtime = 0, warmup = -1, offset0 = 0.01;
+	double sumsq = 0, worst = 0, settled = 0, started;
+	const char *rawpath = NULL, *looppath = NULL;
+	long counted = 0, sent = 0, trace = 0;
+	int minpoll = NTP_MINDPOLL, maxpoll = NTP_MAXDPOLL;
+	int ntinker = 0, c;
+	struct {
+		int	item;
+		double	value;
+	} tinker[COUNTOF(tinkers) * 2];
+
+	while ((c = getopt(argc, argv, "b:d:D:f:gj:l:L:m:M:o:r:s:S:t:v:w:W:"))
+	       != -1) {
+		switch (c) {
+		    case 'b':
+			spread = atof(optarg);
+			break;
+		    case 'd':
+			runtime = duration(optarg);
+			break;
+		    case 'D':
+			base_delay = atof(optarg);
+			break;
+		    case 'f':
+			osc_freq = atof(optarg) * 1e-6;
+			break;
+		    case 'g':
+			clock_ctl.allow_panic = true;
+			break;
+		    case 'j':
+			queue_mean = atof(optarg);
+			break;
+		    case 'l':
+			looppath = optarg;
+			break;
+		    case 'L':
+			loss = atof(optarg);
+			break;
+		    case 'm':
+			minpoll = atoi(optarg);
+			break;
+		    case 'M':
+			maxpoll = atoi(optarg);
+			break;
+		    case 'o':
+			offset0 = atof(optarg);
+			break;
+		    case 'r':
+			rawpath = optarg;
+			break;
+		    case 's':
+			nservers = atoi(optarg);
+			break;
+		    case 'S':
+			prng = strtoull(optarg, NULL, 0) | 1;
+			break;
+		    case 't': {
+			char *eq = strchr(optarg, '=');
+			size_t i;
+
+			if (NULL == eq ||
+			    ntinker == (int)COUNTOF(tinker))
+				usage(argv[0]);
+			*eq = '\0';
+			for (i = 0; i < COUNTOF(tinkers); i++)
+				if (!strcmp(optarg, tinkers[i].name))
+					break;
+			if (i == COUNTOF(tinkers))
+				usage(argv[0]);
+			tinker[ntinker].item = tinkers[i].item;
+			tinker[ntinker++].value = atof(eq + 1);
+			break;
+		    }
+		    case 'v':
+			trace = (long)duration(optarg);
+			break;
+		    case 'w':
+			wander = atof(optarg) * 1e-6;
+			break;
+		    case 'W':
+			warmup = duration(optarg);
+			break;
+		    default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || (NULL != looppath && NULL == rawpath))
+		usage(argv[0]);
+	if (NULL != rawpath) {
+		if (NULL != looppath)
+			read_loopstats(looppath);
+		read_rawstats(rawpath);
+		if (runtime <= 0)
+			runtime = floor(span) + 1;
+	}
+	if (runtime <= 0)
+		runtime = 86400;
+	if (nservers < 1 || nservers > MAXSERVERS || runtime < 1 ||
+	    minpoll < NTP_MINPOLL || maxpoll > NTP_MAXPOLL ||
+	    minpoll > maxpoll)
+		usage(argv[0]);
+	if (warmup < 0)
+		warmup = min(3600, runtime / 4);
+
+	syslogit = false;
+	termlogit = trace > 0;
+	ssl_init();
+	auth_init();
+	init_restrict();
+	init_peer();
+	init_mon();
+	current_time = 1;
+	init_proto(false);
+	init_loopfilter();
+
+	/* the daemon loop, as with "disable kernel" */
+	select_loop(false);
+	for (int i = 0; i < ntinker; i++)
+		loop_config(tinker[i].item, tinker[i].value);
+	loop_config(LOOP_DRIFTINIT, 0);
+
+	epoch = lfpinit_u(SIM_EPOCH + JAN_1970, 0);
+	clock_error = offset0;
+
+	ZERO(ep);
+	SET_AF(&ep.sin, AF_INET);
+	SET_ADDR4(&ep.sin, 0xc00002fe);	/* 192.0.2.254 */
+	ep.family = AF_INET;
+	for (int i = 0; i < nservers; i++) {
+		struct server *s = &servers[i];
+		sockaddr_u addr;
+
+		ZERO(addr);
+		SET_AF(&addr, AF_INET);
+		SET_ADDR4(&addr, 0xc0000201 + (uint32_t)i);
+		SET_PORT(&addr, NTP_PORT);
+		if ('\0' == s->label[0])
+			snprintf(s->label, sizeof(s->label), "%s",
+				 socktoa(&addr));
+		if (nservers > 1)
+			s->bias = spread * ((double)i / (nservers - 1) - 0.5);
+		ZERO(ctl);
+		ctl.version = NTP_VERSION;
+		ctl.minpoll = (uint8_t)minpoll;
+		ctl.maxpoll = (uint8_t)maxpoll;
+		ctl.flags = FLAG_CONFIG | FLAG_IBURST;
+		s->peer = newpeer(&addr, NULL, &ep, MODE_CLIENT, &ctl,
+				  MDF_UCAST, true);
+	}
+
+	if (trace > 0)
+		printf("%10s %12s %12s %11s %9s %4s %s\n", "time", "error",
+		       "offset", "freq", "freqerr", "poll", "peer");
+	started = now_real();
+	while (now_true < runtime) {
+		double error;
+
+		current_time++;
+		tick();
+		adj_host_clock();
+		if (0 == current_time % HUFFPUFF)
+			huffpuff();
+		for (int i = 0; i < nservers; i++) {
+			struct server *s = &servers[i];
+
+			if (s->peer->nextdate > current_time)
+				continue;
+			request_sent = false;
+			transmit(s->peer);
+			if (!request_sent)
+				continue;
+			sent++;
+			if (uniform() >= loss)
+				reply(s, &ep);
+		}
+
+		error = (double)clock_error;
+		if (fabs(error) >= SETTLED)
+			settled = (double)now_true;
+		if (now_true > warmup) {
+			sumsq += error * error;
+			worst = fmax(worst, fabs(error));
+			counted++;
+		}
+		if (trace > 0 && 0 == (long)now_true % trace) {
+			int peer = -1;
+
+			for (int i = 0; i < nservers; i++)
+				if (servers[i].peer == sys_vars.sys_peer)
+					peer = i;
+			printf("%10.0f %12.9f %12.9f %11.6f %9.6f %4d %s\n",
+			       (double)now_true, error, clkstate.sys_offset,
+			       loop_data.drift_comp * US_PER_S,
+			       (loop_data.drift_comp + osc_freq) * US_PER_S,
+			       clkstate.sys_poll,
+			       peer < 0 ? "-" : servers[peer].label);
+		}
+	}
+	started = now_real() - started;
+
+	printf("servers    %d%s%s\n", nservers, rawpath ? " from " : "",
+	       rawpath ? rawpath : "");
+	printf("simulated  %.0f s in %.2f s, %.0fx real time\n",
+	       (double)now_true, started,
+	       (double)now_true / fmax(started, 1e-6));
+	printf("polls      %ld, %ld steps\n", sent, steps);
+	if (settled < (double)now_true)
+		printf("settled    %.0f s, within %g s from then on\n",
+		       settled, SETTLED);
+	else
+		printf("settled    never\n");
+	if (counted > 0)
+		printf("error      %.3f us rms, %.3f us max after %.0f s\n",
+		       sqrt(sumsq / counted) * 1e6, worst * 1e6, warmup);
+	printf("frequency  %.6f PPM, %.6f PPM off\n",
+	       loop_data.drift_comp * US_PER_S,
+	       (loop_data.drift_comp + osc_freq) * US_PER_S);
+	printf("poll       %d\n", clkstate.sys_poll);
+	return 0;
+}
+
+/*
+ * The system clock, simulated.  These replace libntp's systime.c and
+ * the ntp_adjtime() wrapper, so nothing here touches the real clock.
+ */
+
+time_stepped_callback step_callback;
+
+void get_systime(l_fp *now) {
+	*now = local_time(0);
+}
+
+bool adj_systime(double adjustment,
+		 int (*ladjtime)(const struct timeval *, struct timeval *)) {
+	UNUSED_ARG(ladjtime);
+	/* as the real one, a zero adjustment leaves a slew running */
+	if (D_ISZERO_NS(adjustment))
+		return true;
+	slew = adjustment;
+	return true;
+}
+
+bool step_systime(doubletime_t step) {
+	clock_error += step;
+	steps++;
+	if (step_callback)
+		(*step_callback)();
+	return true;
+}
+
+int ntp_adjtime_ns(struct timex *ntx) {
+	UNUSED_ARG(ntx);
+	return TIME_OK;
+}
+
+/*
+ * The one packet sent is the request to answer; the rest of ntpd's
+ * I/O is in ntpd-stubs.c.
+ */
+
+void sendpkt(sockaddr_u *dest, endpt *ep, void *pkt, unsigned int len) {
+	UNUSED_ARG(ep);
+	memcpy(&request, pkt, min(len, sizeof(request)));
+	request_dest = *dest;
+	request_sent = true;
+}
+
+const char *progname = "ntpd-sim";
@@ -0,0 +1,224 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * The parts of ntpd the attic programs link without:
+ * its sockets, timers, DNS and configuration.  Each program defines
+ * progname, and those built with NTPD_STUBS_PROTO, which take the
+ * protocol code from ntpd, define sendpkt() as well; every other way
+ * of sending a packet ends up there.
+ */
+
+#include "config.h"
+
+#include "ntpd.h"
+#include "ntp_config.h"
+#include "ntp_dns.h"
+#include "ntp_io.h"
+#include "ntp_refclock.h"
+#include "nts.h"
+#include "nts2.h"
+
+uint16_t extra_port = 0;
+
+#ifdef HAVE_SECCOMP_H
+void setup_SIGSYS_trap(void) {
+	return;
+}
+#endif
+
+SOCKET handover_take(const sockaddr_u *addr, int type) {
+	UNUSED_ARG(addr);
+	UNUSED_ARG(type);
+	return INVALID_SOCKET;
+}
+
+#ifndef NTPD_STUBS_PROTO
+
+/* What the library code wants from ntp_proto.c, ntp_peer.c and
+ * ntp_util.c, which these programs leave out */
+
+struct peer *peer_list = NULL;
+
+void dns_take_server(struct peer *a, sockaddr_u *b) {
+	UNUSED_ARG(a);
+	UNUSED_ARG(b);
+}
+
+void dns_take_status(struct peer *a, DNS_Status b) {
+	UNUSED_ARG(a);
+	UNUSED_ARG(b);
+}
+
+void startup_mark(int which) {
+	UNUSED_ARG(which);
+}
+
+struct histogram latency[LAT_MAX];
+uint64_t latency_ns(struct timespec intv) {
+	UNUSED_ARG(intv);
+	return 0;
+}
+
+#else /* NTPD_STUBS_PROTO */
+
+uptime_t current_time;
+uptime_t orphwait;
+int waitsync_fd_to_close = -1;
+
+void sendpkt_txstamp(sockaddr_u *dest, endpt *ep, void *pkt,
+		     unsigned int len) {
+	sendpkt(dest, ep, pkt, len);
+}
+
+void sendpkts(sockaddr_u *dest, endpt *ep, struct iovec *iov,
+	      unsigned int n) {
+	for (unsigned int i = 0; i < n; i++)
+		sendpkt(dest, ep, iov[i].iov_base,
+			(unsigned int)iov[i].iov_len);
+}
+
+void queue_sendpkt(sockaddr_u *dest, endpt *ep, void *pkt,
+		   unsigned int len) {
+	sendpkt(dest, ep, pkt, len);
+}
+
+void queue_sendpkt_txstamp(sockaddr_u *dest, endpt *ep, void *pkt,
+			   unsigned int len) {
+	sendpkt(dest, ep, pkt, len);
+}
+
+void flush_sendpkts(void) {
+}
+
+/* Sealing is part of the cost of an NTS reply, so do it */
+void queue_sealed_sendpkt(sockaddr_u *dest, endpt *ep, void *pkt,
+			  unsigned int len, struct nts_seal *seal,
+			  bool txstamp) {
+	UNUSED_ARG(txstamp);
+#ifndef DISABLE_NTS
+	nts_seal_batch((uint8_t **)&pkt, &seal, 1);
+#else
+	UNUSED_ARG(seal);
+#endif
+	sendpkt(dest, ep, pkt, len);
+}
+
+void tx_queue_put(struct tx_queue *q, sockaddr_u *dest, void *pkt,
+		  unsigned int len, bool txstamp) {
+	UNUSED_ARG(q);
+	UNUSED_ARG(txstamp);
+	sendpkt(dest, NULL, pkt, len);
+}
+
+endpt *findinterface(sockaddr_u *addr) {
+	UNUSED_ARG(addr);
+	return NULL;
+}
+
+endpt *select_peerinterface(struct peer *peer, sockaddr_u *addr,
+			    endpt *ep) {
+	UNUSED_ARG(peer);
+	UNUSED_ARG(addr);
+	return ep;
+}
+
+endpt *wildcard_interface(const sockaddr_u *addr) {
+	UNUSED_ARG(addr);
+	return NULL;
+}
+
+endpt *getinterface(sockaddr_u *addr, uint32_t flags) {
+	UNUSED_ARG(addr);
+	UNUSED_ARG(flags);
+	return NULL;
+}
+
+const char *latoa(endpt *ep) {
+	UNUSED_ARG(ep);
+	return progname;
+}
+
+void reinit_timer(void) {
+}
+
+void timer_schedule(struct peer *peer) {
+	UNUSED_ARG(peer);
+}
+
+void timer_unschedule(struct peer *peer) {
+	UNUSED_ARG(peer);
+}
+
+#ifdef REFCLOCK
+/* no drivers; ntp_refclock.c itself is linked */
+struct refclock * const refclock_conf[] = { NULL };
+const uint8_t num_refclock_conf = 0;
+
+void io_closeclock(struct refclockio *rio) {
+	UNUSED_ARG(rio);
+}
+
+#ifdef REFCLOCK_MODULES
+void refclock_load(uint8_t clktype) {
+	UNUSED_ARG(clktype);
+}
+#endif
+#endif
+
+bool dns_probe(struct peer *peer) {
+	UNUSED_ARG(peer);
+	return false;
+}
+
+void dns_forget(struct peer *peer) {
+	UNUSED_ARG(peer);
+}
+
+#ifdef ENABLE_MSSNTP
+struct mssntp_counters mssntp_cnt, old_mssntp_cnt;
+
+void send_via_ntp_signd(struct recvbuf *rbufp, void *xpkt) {
+	UNUSED_ARG(rbufp);
+	UNUSED_ARG(xpkt);
+}
+#endif
+
+/* What mode 6 reads from the I/O and timer code */
+
+struct ntp_io_data io_data;
+uptime_t io_timereset;
+uptime_t timer_timereset;
+unsigned long timer_xmtcalls;
+unsigned long alarm_overflow;
+struct REMOTE_CONFIG_INFO remote_config;
+
+uint64_t dropped_count(void) { return 0; }
+uint64_t ignored_count(void) { return 0; }
+uint64_t shed_count(void) { return 0; }
+uint64_t overload_shed_count(void) { return 0; }
+uint64_t overloads_count(void) { return 0; }
+uint64_t received_count(void) { return 0; }
+uint64_t sent_count(void) { return 0; }
+uint64_t notsent_count(void) { return 0; }
+uint64_t handler_calls_count(void) { return 0; }
+uint64_t handler_pkts_count(void) { return 0; }
+#ifdef REFCLOCK
+uint64_t handler_refrds_count(void) { return 0; }
+#endif
+#ifdef ENABLE_LEAP_SMEAR
+unsigned int leap_smear_intv;
+#endif
+
+void config_remotely(sockaddr_u *addr) {
+	UNUSED_ARG(addr);
+}
+
+const char *ntpd_version(void) {
+	return progname;
+}
+
+#endif /* NTPD_STUBS_PROTO */
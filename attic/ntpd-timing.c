@@ -0,0 +1,464 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Time ntpd's own data structures at a range of sizes, linked with
+ * the real code.  Reports nanoseconds per operation.
+ *
+ *   mru-insert   ntp_monitor() on an address it has not seen
+ *   mru-hit      ntp_monitor() on one it has
+ *   mru-reclaim  ntp_monitor() on a new address with the MRU list full,
+ *                so the oldest entry is recycled
+ *   restrict     restrictions() with size entries, half the lookups
+ *                matching one of them
+ *   authlookup   authlookup() with size keys
+ *   filter       clock_filter() without the selection it can trigger
+ *   select       clock_select() over size peers, picking but not
+ *                winding the clock
+ *   refclock     refclock_receive(), whose refclock_sample() median
+ *                filter sorts size stages, then clock_filter()
+ *
+ * Usage: ntpd-timing [-n count] [-s size[,size...]] [test...]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ntpd.h"
+#include "ntp_auth.h"
+#include "ntp_config.h"
+#include "ntp_dns.h"
+#include "ntp_io.h"
+#include "ntp_lists.h"
+#include "ntp_refclock.h"
+#include "nts.h"
+#include "recvbuff.h"
+#include "timespecops.h"
+
+static long count = 1000000;		/* operations per test and size */
+static long sizes[32] = { 10, 100, 1000, 10000, 100000 };
+static int nsizes = 5;
+
+static uint64_t prng = 0x9e3779b97f4a7c15;
+
+/* xorshift64*: the same addresses every run */
+static uint32_t
+next_random(void)
+{
+	prng ^= prng >> 12;
+	prng ^= prng << 25;
+	prng ^= prng >> 27;
+	return (uint32_t)((prng * 0x2545f4914f6cdd1d) >> 32);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *test, long size, double seconds, long ops)
+{
+	printf("%-12s %7ld %10.1f\n", test, size, seconds * 1e9 / (double)ops);
+}
+
+static sockaddr_u *
+make_addrs(long n)
+{
+	sockaddr_u *addrs = emalloc_zero((size_t)n * sizeof(*addrs));
+
+	for (long i = 0; i < n; i++) {
+		AF(&addrs[i]) = AF_INET;
+		PSOCK_ADDR4(&addrs[i])->s_addr = htonl(next_random());
+		SET_PORT(&addrs[i], NTP_PORT);
+	}
+	return addrs;
+}
+
+/* A client request from addr, arriving at t */
+static void
+make_request(struct recvbuf *rb, const sockaddr_u *addr, l_fp t)
+{
+	static endpt ep;
+
+	rb->recv_srcadr = *addr;
+	rb->recv_time = t;
+	rb->recv_length = LEN_PKT_NOMAC;
+	rb->dstadr = &ep;
+	rb->recv_buffer[0] = PKT_LI_VN_MODE(LEAP_NOTINSYNC, NTP_VERSION,
+					    MODE_CLIENT);
+}
+
+static void
+mru_reset(uint64_t maxdepth, uint64_t mindepth)
+{
+	mon_stop();
+	mon_data.mru_maxdepth = maxdepth;
+	mon_data.mru_mindepth = mindepth;
+	mon_data.mru_minage = 0;
+	mon_data.mru_maxage = 3600;
+	mon_start();
+}
+
+static void
+time_mru(const char *test, long size)
+{
+	static struct recvbuf rb;
+	sockaddr_u *addrs, *fresh = NULL;
+	long ops = 0, rounds, n;
+	double start, total = 0;
+	l_fp t = lfpinit(1, 0);
+
+	addrs = make_addrs(size);
+	if (0 == strcmp(test, "mru-insert")) {
+		/* each round starts empty, so an insert never reclaims */
+		rounds = max(1, count / size);
+		for (long r = 0; r < rounds; r++) {
+			mru_reset((uint64_t)size, (uint64_t)size);
+			start = now();
+			for (long i = 0; i < size; i++) {
+				make_request(&rb, &addrs[i], t);
+				ntp_monitor(&rb, 0);
+			}
+			total += now() - start;
+			ops += size;
+		}
+	} else {
+		mru_reset((uint64_t)size, 0);
+		for (long i = 0; i < size; i++) {
+			make_request(&rb, &addrs[i], t);
+			ntp_monitor(&rb, 0);
+		}
+		if (0 == strcmp(test, "mru-reclaim")) {
+			n = min(count, 1000000);
+			fresh = make_addrs(n);
+		}
+		start = now();
+		for (long i = 0; i < count; i++) {
+			t += 1000;
+			if (NULL != fresh)
+				make_request(&rb, &fresh[i % n], t);
+			else
+				make_request(&rb, &addrs[next_random() % size],
+					     t);
+			ntp_monitor(&rb, 0);
+		}
+		total = now() - start;
+		ops = count;
+		free(fresh);
+	}
+	report(test, size, total, ops);
+	free(addrs);
+}
+
+static void
+time_restrict(long size)
+{
+	sockaddr_u *nets, *masks, *probes;
+	unsigned short sink = 0;
+	double start, total;
+
+	/* /16 to /32 networks, then probes half of which land in one */
+	nets = make_addrs(size);
+	masks = make_addrs(size);
+	for (long i = 0; i < size; i++) {
+		uint32_t bits = 16 + next_random() % 17;
+
+		PSOCK_ADDR4(&masks[i])->s_addr = htonl(~0U << (32 - bits));
+		PSOCK_ADDR4(&nets[i])->s_addr &= PSOCK_ADDR4(&masks[i])->s_addr;
+		hack_restrict(RESTRICT_FLAGS, &nets[i], &masks[i], 0,
+			      RES_NOQUERY);
+	}
+	probes = make_addrs(1024);
+	for (long i = 0; i < 1024; i += 2)
+		PSOCK_ADDR4(&probes[i])->s_addr =
+			PSOCK_ADDR4(&nets[next_random() % size])->s_addr;
+
+	start = now();
+	for (long i = 0; i < count; i++)
+		sink |= restrictions(&probes[i & 1023]);
+	total = now() - start;
+	report("restrict", size, total, count);
+	UNUSED_LOCAL(sink);
+
+	for (long i = 0; i < size; i++)
+		hack_restrict(RESTRICT_REMOVE, &nets[i], &masks[i], 0, 0);
+	free(nets);
+	free(masks);
+	free(probes);
+}
+
+static void
+time_authlookup(long size)
+{
+	uint8_t key[20];
+	keyid_t *ids;
+	double start, total;
+	long found = 0;
+
+	memset(key, 0x5a, sizeof(key));
+	for (long i = 1; i <= size; i++) {
+		auth_setkey((keyid_t)i, AUTH_DIGEST, "SHA1", key, sizeof(key));
+		authtrust((keyid_t)i, true);
+	}
+	ids = emalloc(1024 * sizeof(*ids));
+	for (int i = 0; i < 1024; i++)
+		ids[i] = 1 + (keyid_t)(next_random() % (uint32_t)size);
+
+	start = now();
+	for (long i = 0; i < count; i++)
+		if (NULL != authlookup(ids[i & 1023], true))
+			found++;
+	total = now() - start;
+	report("authlookup", size, total, count);
+	if (found != count)
+		printf("authlookup: missed %ld keys\n", count - found);
+	auth_delkeys();
+	free(ids);
+}
+
+/* A fit, reachable server with a full filter a little off true */
+static struct peer *
+make_peer(const sockaddr_u *addr)
+{
+	struct peer *peer = emalloc_zero(sizeof(*peer));
+
+	peer->cold = emalloc_zero(sizeof(*peer->cold));
+	peer->srcadr = *addr;
+	peer->leap = LEAP_NOWARNING;
+	peer->stratum = 2;
+	peer->hpoll = 6;
+	peer->reach = 0377;
+	peer->refid = htonl(next_random());
+	peer->rootdelay = 0.01;
+	peer->rootdisp = 0.01;
+	peer->update = current_time;
+	peer->offset = ((int)(next_random() % 2001) - 1000) * 1e-6;
+	peer->delay = 0.02;
+	peer->disp = 0.01;
+	peer->jitter = 0.0005;
+	for (int i = 0; i < NTP_SHIFT; i++) {
+		peer->filter_offset[i] = peer->offset;
+		peer->filter_delay[i] = peer->delay;
+		peer->filter_disp[i] = peer->disp;
+		peer->filter_epoch[i] = current_time;
+		peer->filter_order[i] = (uint8_t)i;
+	}
+	return peer;
+}
+
+static void
+time_filter(void)
+{
+	sockaddr_u *addr = make_addrs(1);
+	struct peer *peer = make_peer(addr);
+	double start, total;
+
+	/* in a burst and in sync, clock_filter() doesn't select */
+	peer->burst = 1;
+	set_sys_leap(LEAP_NOWARNING);
+	start = now();
+	for (long i = 0; i < count; i++) {
+		current_time++;
+		clock_filter(peer, peer->offset + (i & 7) * 1e-6, 0.02,
+			     0.001);
+	}
+	total = now() - start;
+	set_sys_leap(LEAP_NOTINSYNC);
+	report("filter", NTP_SHIFT, total, count);
+	free(peer->cold);
+	free(peer);
+	free(addr);
+}
+
+static void
+time_select(long size)
+{
+	sockaddr_u *addrs = make_addrs(size + 1);
+	struct peer *trigger, *peer;
+	double start, total;
+	long ops = max(1, count / size), done;
+
+	for (long i = 0; i < size; i++) {
+		peer = make_peer(&addrs[i]);
+		peer->p_link = peer_list;
+		peer_list = peer;
+	}
+	/*
+	 * A sample too dispersed to use makes clock_filter() go
+	 * straight to clock_select().  The peers' epochs are all before
+	 * the last clock update, so the pick isn't used.
+	 */
+	trigger = make_peer(&addrs[size]);
+	start = now();
+	for (done = 0; done < ops; done++) {
+		clock_filter(trigger, 0, 0, 2 * sys_maxdisp);
+		/* the cluster algorithm is worse than quadratic; cap it */
+		if ((total = now() - start) > 10.0) {
+			done++;
+			break;
+		}
+	}
+	report("select", size, total, done);
+
+	while (NULL != peer_list) {
+		peer = peer_list;
+		peer_list = peer->p_link;
+		free(peer->cold);
+		free(peer);
+	}
+	free(trigger->cold);
+	free(trigger);
+	free(addrs);
+}
+
+#ifdef REFCLOCK
+static void
+time_refclock(long size)
+{
+	sockaddr_u *addr = make_addrs(1);
+	struct peer *peer = make_peer(addr);
+	struct refclockproc pp;
+	double start, total = 0;
+	long ops = max(1, count / size);
+
+	if (size > FILTER_STAGES_MAX) {
+		free(peer->cold);
+		free(peer);
+		free(addr);
+		return;
+	}
+	ZERO(pp);
+	pp.leap = LEAP_NOWARNING;
+	pp.nstage = (int)size;
+	pp.filter = emalloc_zero(((size_t)size * 2 + 1) * sizeof(double));
+	pp.sorted = pp.filter + size + 1;
+	peer->procptr = &pp;
+	peer->burst = 1;
+	set_sys_leap(LEAP_NOWARNING);
+	for (long i = 0; i < ops; i++) {
+		/* a full median filter, as a driver would leave it */
+		for (long j = 0; j < size; j++) {
+			pp.coderecv = (pp.coderecv + 1) % (pp.nstage + 1);
+			pp.filter[pp.coderecv] =
+				((int)(next_random() % 2001) - 1000) * 1e-6;
+		}
+		current_time++;
+		start = now();
+		refclock_receive(peer);
+		total += now() - start;
+	}
+	set_sys_leap(LEAP_NOTINSYNC);
+	report("refclock", size, total, ops);
+	free(pp.filter);
+	free(peer->cold);
+	free(peer);
+	free(addr);
+}
+#endif
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [-n count] [-s size[,size...]] [test...]\n"
+	       "tests: mru-insert mru-hit mru-reclaim restrict authlookup "
+	       "filter select refclock\n", name);
+	exit(1);
+}
+
+static bool
+wanted(int argc, char *argv[], const char *test)
+{
+	if (optind == argc)
+		return true;
+	for (int i = optind; i < argc; i++)
+		if (0 == strcmp(argv[i], test))
+			return true;
+	return false;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *mru_tests[] = {
+		"mru-insert", "mru-hit", "mru-reclaim",
+	};
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		    case 'n':
+			count = atol(optarg);
+			break;
+		    case 's':
+			nsizes = 0;
+			for (char *s = strtok(optarg, ","); NULL != s &&
+			     nsizes < (int)COUNTOF(sizes);
+			     s = strtok(NULL, ","))
+				sizes[nsizes++] = atol(s);
+			break;
+		    default:
+			usage(argv[0]);
+		}
+	}
+	if (count < 1 || 0 == nsizes)
+		usage(argv[0]);
+	for (int i = 0; i < nsizes; i++)
+		if (sizes[i] < 1)
+			usage(argv[0]);
+
+	ssl_init();
+	auth_init();
+	init_restrict();
+	init_mon();
+	mon_setup(MON_ON);
+	init_proto(false);
+	current_time = 1;
+
+	printf("%-12s %7s %10s\n", "test", "size", "ns/op");
+	for (size_t t = 0; t < COUNTOF(mru_tests); t++)
+		if (wanted(argc, argv, mru_tests[t]))
+			for (int i = 0; i < nsizes; i++)
+				time_mru(mru_tests[t], sizes[i]);
+	if (wanted(argc, argv, "restrict"))
+		for (int i = 0; i < nsizes; i++)
+			time_restrict(sizes[i]);
+	if (wanted(argc, argv, "authlookup"))
+		for (int i = 0; i < nsizes; i++)
+			time_authlookup(sizes[i]);
+	if (wanted(argc, argv, "filter"))
+		time_filter();
+	if (wanted(argc, argv, "select"))
+		for (int i = 0; i < nsizes; i++)
+			time_select(sizes[i]);
+#ifdef REFCLOCK
+	if (wanted(argc, argv, "refclock"))
+		for (int i = 0; i < nsizes; i++)
+			time_refclock(sizes[i]);
+#endif
+	return 0;
+}
+
+/* Nothing here sends a packet; the rest of ntpd's I/O is in
+ * ntpd-stubs.c. */
+
+void sendpkt(sockaddr_u *dest, endpt *ep, void *pkt, unsigned int len) {
+	UNUSED_ARG(dest);
+	UNUSED_ARG(ep);
+	UNUSED_ARG(pkt);
+	UNUSED_ARG(len);
+}
+
+const char *progname = "ntpd-timing";
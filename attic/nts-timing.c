@@ -0,0 +1,303 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Benchmark the NTS server code paths end to end, without the network.
+ *
+ *   cookie  nts_make_cookie() then nts_unpack_cookie()
+ *   ke      nts_ke_process_receive() then nts_ke_setup_send(),
+ *           the NTS-KE work after the TLS handshake.  The c2s/s2c
+ *           keys are fixed rather than exported from a TLS session.
+ *   ntp     extens_server_recv() and extens_server_send() under a
+ *           lock standing in for proto_lock, then nts_seal_batch()
+ *           outside it, as the responder threads do.
+ *
+ * Each of -t threads runs -n operations.  Reports ops/sec for all
+ * threads together and latency percentiles for single operations.
+ *
+ * Usage: nts-timing [-n count] [-t threads] [-a 256|384|512] [cookie|ke|ntp]...
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ntpd.h"
+#include "nts.h"
+#include "nts2.h"
+#include "ntp_dns.h"
+#include "timespecops.h"
+
+static int count = 100000;		/* operations per thread */
+static int nthreads = 1;
+static uint16_t aead = AEAD_AES_SIV_CMAC_256;
+static int keylen;
+static uint8_t c2s[NTS_MAX_KEYLEN], s2c[NTS_MAX_KEYLEN];
+
+/* pre-built client messages */
+static uint8_t ke_request[1000];
+static int ke_request_len;
+static uint8_t ntp_request[sizeof(struct pkt)];
+static int ntp_request_len;
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef bool (*bench_op)(void);
+
+struct bench_thread {
+	pthread_t tid;
+	bench_op op;
+	double *lat;		/* seconds, one per operation */
+	int failed;
+};
+
+static bool op_cookie(void) {
+	uint8_t cookie[NTS_MAX_COOKIELEN];
+	uint8_t c2s_out[NTS_MAX_KEYLEN], s2c_out[NTS_MAX_KEYLEN];
+	uint16_t aead_out;
+	int len, keylen_out;
+
+	len = nts_make_cookie(cookie, aead, c2s, s2c, keylen);
+	return nts_unpack_cookie(cookie, len, &aead_out,
+				 c2s_out, s2c_out, &keylen_out);
+}
+
+static bool op_ke(void) {
+	uint8_t reply[2048];	/* as in nts_ke_request */
+	struct BufCtl_t buf;
+	int aead_out = NO_AEAD;
+
+	buf.next = ke_request;
+	buf.left = ke_request_len;
+	if (!nts_ke_process_receive(&buf, &aead_out))
+		return false;
+	buf.next = reply;
+	buf.left = sizeof(reply);
+	return nts_ke_setup_send(&buf, aead_out, c2s, s2c,
+				 nts_get_key_length((uint16_t)aead_out));
+}
+
+static bool op_ntp(void) {
+	uint8_t pkt[sizeof(struct pkt)];
+	struct pkt reply;
+	struct ntspacket_t ntspacket;
+	struct nts_seal seal, *sealp = &seal;
+	uint8_t *replyp = (uint8_t *)&reply;
+	bool ok;
+
+	memcpy(pkt, ntp_request, (size_t)ntp_request_len);
+	memset(&ntspacket, 0, sizeof(ntspacket));
+	memcpy(&reply, pkt, LEN_PKT_NOMAC);
+	seal.pending = false;
+
+	pthread_mutex_lock(&bench_lock);
+	ok = extens_server_recv(&ntspacket, pkt, ntp_request_len);
+	if (ok)
+		extens_server_send(&ntspacket, &reply, &seal);
+	pthread_mutex_unlock(&bench_lock);
+	if (ok)
+		nts_seal_batch(&replyp, &sealp, 1);
+	return ok;
+}
+
+static void *bench_main(void *arg) {
+	struct bench_thread *t = arg;
+	struct timespec start, finish;
+
+	for (int i = 0; i < count; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!t->op())
+			t->failed++;
+		clock_gettime(CLOCK_MONOTONIC, &finish);
+		t->lat[i] = tspec_to_d(sub_tspec(finish, start));
+	}
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, size_t n, double p) {
+	size_t idx = (size_t)(p / 100.0 * (double)(n - 1));
+	return sorted[idx];
+}
+
+static void run(const char *name, bench_op op) {
+	struct bench_thread *threads;
+	struct timespec start, finish;
+	double wall, *all;
+	size_t n = (size_t)count * (size_t)nthreads;
+	int failed = 0;
+
+	threads = calloc((size_t)nthreads, sizeof(*threads));
+	all = calloc(n, sizeof(*all));
+	if (NULL == threads || NULL == all) {
+		printf("out of memory\n");
+		exit(1);
+	}
+
+	/* warm up per-thread contexts and caches */
+	for (int i = 0; i < 100; i++)
+		op();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nthreads; i++) {
+		threads[i].op = op;
+		threads[i].lat = all + (size_t)i * (size_t)count;
+		if (0 != pthread_create(&threads[i].tid, NULL,
+					bench_main, &threads[i])) {
+			printf("pthread_create failed\n");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		failed += threads[i].failed;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	wall = tspec_to_d(sub_tspec(finish, start));
+
+	qsort(all, n, sizeof(*all), cmp_double);
+	printf("%-6s %2d threads %10.0f ops/sec  "
+	       "p50 %6.2f  p90 %6.2f  p99 %6.2f  p99.9 %7.2f  max %8.2f usec",
+	       name, nthreads, (double)n / wall,
+	       percentile(all, n, 50) * 1e6, percentile(all, n, 90) * 1e6,
+	       percentile(all, n, 99) * 1e6, percentile(all, n, 99.9) * 1e6,
+	       all[n - 1] * 1e6);
+	if (0 != failed)
+		printf("  %d FAILED", failed);
+	printf("\n");
+
+	free(all);
+	free(threads);
+}
+
+static void setup(void) {
+	struct peer peer;
+	struct peer_cold cold;
+	struct pkt *pkt = (struct pkt *)ntp_request;
+	uint8_t reply[sizeof(struct pkt)];
+	int used;
+	struct BufCtl_t buf;
+
+	nts_cookie_init();
+	extens_init();
+	nts_nKeys = 0;
+	nts_make_cookie_key();
+
+	keylen = nts_get_key_length(aead);
+	ntp_RAND_bytes(c2s, keylen);
+	ntp_RAND_bytes(s2c, keylen);
+
+	/* NTS-KE request, as from a client */
+	memset(&peer, 0, sizeof(peer));
+	memset(&cold, 0, sizeof(cold));
+	peer.cold = &cold;
+	ntsconfig.aead = NULL;
+	peer.cfg.nts_cfg.aead = NULL;
+	buf.next = ke_request;
+	buf.left = sizeof(ke_request);
+	ke_append_record_uint16(&buf,
+		NTS_CRITICAL+nts_next_protocol_negotiation, nts_protocol_NTP);
+	ke_append_record_uint16(&buf, nts_algorithm_negotiation, aead);
+	ke_append_record_null(&buf, NTS_CRITICAL+nts_end_of_message);
+	ke_request_len = (int)sizeof(ke_request) - buf.left;
+
+	/* NTP request with a full set of cookies on hand */
+	peer.cold->nts_state.aead = aead;
+	peer.cold->nts_state.keylen = keylen;
+	memcpy(peer.cold->nts_state.c2s, c2s, (size_t)keylen);
+	memcpy(peer.cold->nts_state.s2c, s2c, (size_t)keylen);
+	for (int i = 0; i < NTS_MAX_COOKIES; i++)
+		peer.cold->nts_state.cookielen = nts_make_cookie(
+			peer.cold->nts_state.cookies[i], aead, c2s, s2c, keylen);
+	peer.cold->nts_state.count = NTS_MAX_COOKIES;
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC, NTP_VERSION, MODE_CLIENT);
+	used = extens_client_send(&peer, pkt);
+	ntp_request_len = LEN_PKT_NOMAC + used;
+
+	/* Check the reply path once, with the client's code */
+	{
+		struct pkt *r = (struct pkt *)reply;
+		struct ntspacket_t ntspacket;
+		struct nts_seal seal, *sealp = &seal;
+		uint8_t *replyp = reply;
+		int len;
+
+		memset(&ntspacket, 0, sizeof(ntspacket));
+		memcpy(r, pkt, LEN_PKT_NOMAC);
+		if (!extens_server_recv(&ntspacket, ntp_request, ntp_request_len)) {
+			printf("extens_server_recv rejected our request\n");
+			exit(1);
+		}
+		len = LEN_PKT_NOMAC + extens_server_send(&ntspacket, r, &seal);
+		nts_seal_batch(&replyp, &sealp, 1);
+		if (!extens_client_recv(&peer, reply, len)) {
+			printf("extens_client_recv rejected our reply\n");
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int c;
+	bool any = false;
+
+	while ((c = getopt(argc, argv, "n:t:a:")) != -1) {
+		switch (c) {
+		    case 'n':
+			count = atoi(optarg);
+			break;
+		    case 't':
+			nthreads = atoi(optarg);
+			break;
+		    case 'a':
+			aead = (0 == strcmp(optarg, "512")) ? AEAD_AES_SIV_CMAC_512 :
+			       (0 == strcmp(optarg, "384")) ? AEAD_AES_SIV_CMAC_384 :
+			       AEAD_AES_SIV_CMAC_256;
+			break;
+		    default:
+			printf("Usage: %s [-n count] [-t threads] "
+			       "[-a 256|384|512] [cookie|ke|ntp]...\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (count < 1 || nthreads < 1) {
+		printf("count and threads must be positive\n");
+		exit(1);
+	}
+
+	setup();
+	printf("AEAD %d, %d ops per thread\n", aead, count);
+	for (int i = optind; i < argc; i++) {
+		any = true;
+		if (0 == strcmp(argv[i], "cookie"))
+			run("cookie", op_cookie);
+		else if (0 == strcmp(argv[i], "ke"))
+			run("ke", op_ke);
+		else if (0 == strcmp(argv[i], "ntp"))
+			run("ntp", op_ntp);
+		else
+			printf("unknown benchmark: %s\n", argv[i]);
+	}
+	if (!any) {
+		run("cookie", op_cookie);
+		run("ke", op_ke);
+		run("ntp", op_ntp);
+	}
+	return 0;
+}
+
+/* the rest of ntpd it links without is in ntpd-stubs.c */
+const char *progname = "nts-timing";
@@ -0,0 +1,118 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Hack to time get_systime(), which ntpd calls at least once per
+ * reply, against the clock_gettime() underneath it.
+ *
+ *   clock      clock_gettime(CLOCK_REALTIME) alone
+ *   old        clock_gettime() then the general conversion, as
+ *              get_systime() used to: normalize, convert, add the era
+ *   systime    get_systime()
+ *
+ * and the conversion alone, from a timespec the compiler can't see.
+ * clocks.c covers the other clocks.
+ *
+ * Usage: systime-timing [count]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ntp_fp.h"
+#include "ntp_calendar.h"
+#include "timespecops.h"
+
+int NUM = 10000000;
+const char *progname = "systime-timing";
+
+static volatile long sink;
+static struct timespec volatile fixed = { 1700000000, 123456789 };
+
+static l_fp
+old_stamp_to_lfp(struct timespec x)
+{
+	l_fp y = tspec_intv_to_lfp(x);
+
+	bumplfpuint(y, JAN_1970);
+	return y;
+}
+
+static void
+clock_only(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	sink += ts.tv_nsec;
+}
+
+static void
+old_systime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	sink += (long)old_stamp_to_lfp(ts);
+}
+
+static void
+new_systime(void)
+{
+	l_fp now;
+
+	get_systime(&now);
+	sink += (long)now;
+}
+
+static void
+old_convert(void)
+{
+	struct timespec ts = { fixed.tv_sec, fixed.tv_nsec };
+
+	sink += (long)old_stamp_to_lfp(ts);
+}
+
+static void
+new_convert(void)
+{
+	struct timespec ts = { fixed.tv_sec, fixed.tv_nsec };
+
+	sink += (long)tspec_stamp_to_lfp(ts);
+}
+
+static void
+DoTime(const char *name, void (*fn)(void))
+{
+	struct timespec start, stop;
+	double	average;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < NUM; i++)
+		fn();
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	average = (stop.tv_sec-start.tv_sec)*1E9 + (stop.tv_nsec-start.tv_nsec);
+	average = average/NUM;
+	printf("%-12s %8.2f\n", name, average);
+}
+
+int main (int argc, char *argv[]) {
+	if (argc > 1)
+		NUM = atoi(argv[1]);
+	if (NUM < 1)
+		NUM = 1;
+
+	printf("path           avg ns\n");
+	DoTime("clock", clock_only);
+	DoTime("old", old_systime);
+	DoTime("systime", new_systime);
+	DoTime("old-convert", old_convert);
+	DoTime("convert", new_convert);
+	return 0;
+}
@@ -8,9 +8,34 @@
 
 #include "ntp_stdlib.h"
 
-int16_t get_lsb_int16 (unsigned char **);
+/*
+ * The little-endian getters decode most fields of the binary GPS
+ * messages, so they are inline.
+ */
+static inline int16_t
+get_lsb_int16(
+	unsigned char **bufpp
+	)
+{
+	unsigned char *p = *bufpp;
+
+	*bufpp += 2;
+	return (int16_t)(p[0] | p[1] << 8);
+}
+
+static inline int32_t
+get_lsb_int32(
+	unsigned char **bufpp
+	)
+{
+	unsigned char *p = *bufpp;
+
+	*bufpp += 4;
+	return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			 (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
 void put_lsb_uint16 (unsigned char **, uint16_t);
-int32_t get_lsb_int32 (unsigned char **);
 
 #define get_lsb_uint16( _x_ )  ((uint16_t) get_lsb_int16( _x_ ))
 #define get_lsb_uint32( _x_ )  ((uint32_t) get_lsb_int32( _x_ ))
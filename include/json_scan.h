@@ -0,0 +1,40 @@
+/*
+ * json_scan.h -- pick a few members out of a JSON object in one pass
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef GUARD_JSON_SCAN_H
+#define GUARD_JSON_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* what a member's value looked like */
+#define JSON_NONE	0	/* no such member */
+#define JSON_STRING	1	/* "...", quotes not included */
+#define JSON_PRIMITIVE	2	/* number, true, false or null */
+#define JSON_COMPOUND	3	/* object or array, skipped unread */
+
+typedef struct json_value {
+	char	*ptr;		/* start of the value text */
+	int	 len;		/* its length */
+	int	 kind;		/* JSON_* above */
+} json_value;
+
+/*
+ * Walk the top-level object in buf[0..len) once, and for each member
+ * whose key is keys[i] fill in val[i].  Stops as soon as every key has
+ * been seen, so members after the last wanted one are never looked at.
+ * Returns how many keys were found, or -1 if what was read is not JSON.
+ */
+extern int	json_scan(char *buf, size_t len, const char * const *keys,
+			  int nkeys, json_value *val);
+
+extern bool	json_value_is(const json_value *, const char *);
+extern bool	json_value_int(const json_value *, long *);
+extern bool	json_value_float(const json_value *, double *);
+extern int	json_value_bool(const json_value *);
+extern const char *json_value_string(json_value *);
+
+#endif	/* GUARD_JSON_SCAN_H */
@@ -0,0 +1,60 @@
+/*
+ * nmea_scan.h -- check and split an NMEA 0183 sentence in one pass
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef GUARD_NMEA_SCAN_H
+#define GUARD_NMEA_SCAN_H
+
+#include <stdint.h>
+
+#define NMEA_IDLEN	5	/* name field must be at least 5 chars */
+#define NMEA_MAXLEN	80	/* max chars in sentence, excluding CS */
+#define NMEA_FIELDS	32	/* not official; limit on fields per record */
+
+/* what nmea_scan() thought of it */
+#define NMEA_EMPTY	-1	/* no data */
+#define NMEA_INVALID	0	/* not a valid NMEA sentence */
+#define NMEA_VALID	1	/* valid but without checksum */
+#define NMEA_CSVALID	2	/* valid with checksum OK */
+
+/* the sentences someone in ntpd reads, any talker but PGRMF */
+#define NMEA_SENT_UNKNOWN	-1
+#define NMEA_SENT_RMC	0	/* recommended min. nav. */
+#define NMEA_SENT_GGA	1	/* fix and quality */
+#define NMEA_SENT_GLL	2	/* geo. lat/long */
+#define NMEA_SENT_ZDA	3	/* date/time */
+#define NMEA_SENT_ZDG	4	/* GPS date/time, not UTC */
+#define NMEA_SENT_PGRMF	5	/* Garmin position fix */
+#define NMEA_SENT_COUNT	6
+
+typedef struct nmea_sentence {
+	char	*base;		/* the name field, after the '$' */
+	int	 blen;		/* length from there, checksum included */
+	int	 nfields;	/* fields found, the name being field 0 */
+	int	 sentence;	/* NMEA_SENT_* above */
+	uint16_t field[NMEA_FIELDS + 1]; /* where each one starts */
+} nmea_sentence;
+
+/*
+ * Check buf[0..len) for NMEA syntax and checksum, note where each
+ * field starts and which sentence it is, all in one pass over it.
+ * buf[len] must be a NUL.  Returns NMEA_EMPTY, NMEA_INVALID,
+ * NMEA_VALID or NMEA_CSVALID; s is only good for the last two.
+ */
+extern int	nmea_scan(char *buf, int len, nmea_sentence *s);
+
+/*
+ * Field idx, running to the next ',' or '*'.  A field the sentence
+ * does not have is the empty string at its end.
+ */
+static inline char *
+nmea_field(const nmea_sentence *s, int idx)
+{
+	if (idx < 0 || idx >= s->nfields || idx > NMEA_FIELDS)
+		return s->base + s->blen;
+	return s->base + s->field[idx];
+}
+
+#endif	/* GUARD_NMEA_SCAN_H */
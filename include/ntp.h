@@ -19,6 +19,8 @@
 /* common place to check/crash on unlikely error return */
 void ntp_RAND_bytes(unsigned char *buf, int num);
 void ntp_RAND_priv_bytes(unsigned char *buf, int num);
+/* buffered, for nonces and such on the packet path; not for keys */
+void ntp_RAND_pool_bytes(unsigned char *buf, int num);
 
 
 /*
@@ -138,6 +140,17 @@ typedef uint32_t	refid_t;
  * numbers of each of the local network addresses we are using.
  * endpt is unrelated to the select algorithm's struct endpoint.
  */
+struct phc;
+
+/*
+ * What sockbuf_poll() knows of a socket's receive buffer
+ */
+struct sockbuf {
+	int		rcvbuf;		/* bytes, as the kernel reports it */
+	uint32_t	drops;		/* kernel drop counter, last read */
+	bool		maxed;		/* won't grow any more */
+};
+
 typedef struct netendpt {
 	struct netendpt *elink;		/* endpt list link */
 	SOCKET		fd;		/* socket descriptor */
@@ -152,10 +165,14 @@ typedef struct netendpt {
 	volatile long	received;	/* number of incoming packets */
 	long		sent;		/* number of outgoing packets */
 	long		notsent;	/* number of send failures */
+	long		kdropped;	/* dropped by the kernel, buffer full */
+	struct sockbuf	sockbuf;	/* of fd, see sockbuf_poll() */
 	unsigned int	ifindex;	/* for IPV6_MULTICAST_IF */
 	bool		ignore_packets; /* listen-read-drop this? */
 	struct peer *	peers;		/* list of peers using endpt */
 	unsigned int	peercnt;	/* count of same */
+	struct phc *	phc;		/* NIC clock stamping, or NULL */
+	bool		txstamped;	/* has asked for transmit stamps */
 } endpt;
 
 /*
@@ -173,6 +190,9 @@ typedef struct netendpt {
 /* #define INT_MCASTIF	0x100	** bound directly to MCAST address */
 /* #define INT_PRIVACY	0x200	** RFC 4941 IPv6 privacy address */
 /* #define INT_BCASTXMIT	0x400   ** socket setup to allow broadcasts */
+#define INT_PKTINFO	0x800	/* wildcard that learns each destination */
+#define INT_SHARED	0x1000	/* no socket of its own, uses the wildcard's */
+#define INT_POLLED	0x2000	/* input read by the busy poller */
 
 /*
  * Read-only control knobs for a peer structure.
@@ -189,6 +209,7 @@ struct peer_ctl {
 	uint32_t	mode;	/* only used by refclocks */
 #ifdef REFCLOCK
 	uint32_t	baud;
+	uint32_t	stages;	/* median filter stages, 0 default */
 	char		*path;
 	char		*ppspath;
 #endif /* REFCLOCK */
@@ -232,6 +253,48 @@ struct peer_ctl {
 #define IS_PEER_REFCLOCK(p)	false
 #endif
 
+/*
+ * A raw sample kept by the samples option: the four timestamps of the
+ * exchange and what was made of them, the offset in units of 2^-32 s
+ * and the delay and dispersion in 2^-24 s.  A reference clock's
+ * sample has only t3 and t4, its reference and receive times.
+ */
+struct peer_sample {
+	l_fp	t1, t2, t3, t4;
+	int64_t	offset;
+	uint32_t delay;
+	uint32_t disp;
+};
+
+/*
+ * The part of a peer the packet path doesn't look at: NTS keys and
+ * cookies, the name, and counters of rare events.  The NTS state alone
+ * is several times the size of the rest of the peer, so it is kept
+ * apart, in slabs of its own beside the peers', and walking hundreds
+ * of associations doesn't drag it through the cache.  A peer's cold
+ * side is bound to it for good, and cleared with it.
+ */
+struct peer_cold {
+	char *	hostname;	/* if non-NULL, remote name */
+	struct ntsclient_t nts_state;	/* per-peer NTS state */
+
+	unsigned long	timereset;	/* time stat counters were reset */
+	unsigned long	timereachable;	/* last reachable/unreachable time */
+
+	unsigned long	badauth;	/* bad authentication (BOGON5) */
+	unsigned long	bogusorg;	/* bogus origin (BOGON2, BOGON3) */
+	unsigned long	oldpkt;		/* old duplicate (BOGON1) */
+	unsigned long	seldisptoolarge; /* bad header (BOGON6, BOGON7) */
+	unsigned long	selbroken;	/* KoD received */
+
+	struct peer_sample *samples;	/* last sample_slots samples, or NULL */
+	unsigned int	sample_slots;	/* size of samples */
+	uint32_t	sample_seq;	/* number of the newest sample, from 1 */
+	uint32_t	sample_base;	/* sample_seq when samples was made */
+
+	struct stats_agg *agg;		/* peeraggstats this minute, or NULL */
+};
+
 /*
  * The peer structure. Holds state information relating to the guys
  * we are peering with. Most of this stuff is from section 3.2 of the
@@ -250,7 +313,6 @@ struct peer {
 	struct peer *ilink;	/* list of peers for interface */
 	struct peer_ctl cfg;	/* peer configuration block */
 	sockaddr_u srcadr;	/* address of remote host */
-	char *	hostname;	/* if non-NULL, remote name */
 	endpt *	dstadr;		/* local address */
 	associd_t associd;	/* association ID */
 	uint8_t	hmode;		/* local association mode */
@@ -258,7 +320,7 @@ struct peer {
 	uint8_t	cast_flags;	/* additional flags */
 	uint8_t	last_event;	/* last peer error code */
 	uint8_t	num_events;	/* number of error events */
-	struct ntsclient_t nts_state;	/* per-peer NTS state */
+	struct peer_cold *cold;	/* what the packet path doesn't need */
 
 	/*
 	 * Variables used by reference clock support
@@ -289,11 +351,14 @@ struct peer {
 	 */
 	uint8_t	status;		/* peer status */
 	uint8_t	new_status;	/* under-construction status */
+	int	sel_rank[2];	/* 1 + where the lower and upper endpoints
+				 * sorted last select, 0 if nowhere */
 	uint8_t	reach;		/* reachability register */
 	int	flash;		/* protocol error test tally bits */
 	uptime_t	epoch;	/* reference epoch */
 	int	burst;		/* packets remaining in burst */
 	int	retry;		/* retry counter */
+	int	probe;		/* probes left to confirm a miss */
 	int	filter_nextpt;	/* index into filter shift register */
 	double	filter_delay[NTP_SHIFT]; /* delay shift register */
 	double	filter_offset[NTP_SHIFT]; /* offset shift register */
@@ -305,6 +370,7 @@ struct peer {
 	l_fp	dst;		/* destination timestamp */
 	l_fp	org_ts;		/* origin real-timestamp */
 	l_fp	org_rand;	/* origin pseudo-timestamp */
+	l_fp	org_prev;	/* org_ts of the last exchange, for xleave */
 	double	offset;		/* peer clock offset */
 	double	delay;		/* peer roundtrip delay */
 	double	jitter;		/* peer jitter (squares) */
@@ -321,24 +387,18 @@ struct peer {
 
 	int	unreach;	/* watchdog counter */
 	int	throttle;	/* rate control */
+	uptime_t	throttle_at;	/* when throttle was last drained */
 	uptime_t	outdate;	/* send time last packet */
 	uptime_t	nextdate;	/* send time next packet */
+	unsigned int	poll_index;	/* 1 + place in the poll queue */
 
 	/*
-	 * Statistic counters
+	 * Statistic counters every packet updates, the rest are cold
 	 */
-	unsigned long	timereset;	/* time stat counters were reset */
 	unsigned long	timereceived;	/* last packet received time */
-	unsigned long	timereachable;	/* last reachable/unreachable time */
-
 	unsigned long	sent;		/* packets sent */
 	unsigned long	received;	/* packets received */
 	unsigned long	processed;	/* packets processed */
-	unsigned long	badauth;	/* bad authentication (BOGON5) */
-	unsigned long	bogusorg;	/* bogus origin (BOGON2, BOGON3) */
-	unsigned long	oldpkt;		/* old duplicate (BOGON1) */
-	unsigned long	seldisptoolarge; /* bad header (BOGON6, BOGON7) */
-	unsigned long	selbroken;	/* KoD received */
 };
 
 /* pythonize-header: stop ignoring */
@@ -407,6 +467,11 @@ struct peer {
 #define FLAG_NTS_NOVAL   0x8000u   /* do not validate the server certificate */
 #define FLAG_TSTAMP_PPS	0x10000u   /* PPS source provides absolute timestamp */
 #define	FLAG_LOOKUP	0x20000u   /* needs DNS or NTS lookup */
+#define	FLAG_XLEAVE	0x40000u   /* ask for interleaved replies */
+#define	FLAG_PPSTHREAD	0x80000u   /* refclock: capture PPS in a thread */
+#define	FLAG_FIT	0x100000u  /* refclock: least-squares fit, not median */
+#define	FLAG_IOTHREAD	0x200000u  /* refclock: read input in a thread */
+#define	FLAG_PROBE	0x400000u  /* confirm a missed reply with probes */
 
 /* FLAG_DNS and FLAG_NTS stay on.
  * FLAG_LOOKUP gets turned off when lookup succeeds.
@@ -533,14 +598,6 @@ struct pkt {
 
 /* pythonize-header: start ignoring */
 
-/*
- * To speed lookups, peers are hashed by the low order bits of the
- * remote IP address. These definitions relate to that.
- */
-#define	NTP_HASH_SIZE		128
-#define	NTP_HASH_MASK		(NTP_HASH_SIZE-1)
-#define	NTP_HASH_ADDR(src)	(sock_hash(src) & NTP_HASH_MASK)
-
 /*
  * min, and max.  Makes it easier to transliterate the spec without
  * thinking about it.
@@ -580,6 +637,7 @@ struct pkt {
 #define	PROTO_ORPHAN		26
 #define	PROTO_ORPHWAIT		27
 /* #define	PROTO_MODE7		28 was ntpdc */
+#define	PROTO_FASTSTART		29
 
 /*
  * Configuration items for the loop filter
@@ -598,6 +656,8 @@ struct pkt {
 #define LOOP_FREQ		12	/* set initial frequency */
 #define	LOOP_LEAP		13	/* insert leap after second 23:59 */
 #define	LOOP_TICK		14	/* sim. low precision clock */
+#define	LOOP_FASTLOOP		15	/* set fast loop updates/s */
+#define	LOOP_BUDGET		16	/* set predicted error for poll (s) */
 
 /*
  * Configuration items for the stats printer
@@ -606,13 +666,14 @@ struct pkt {
 #define STATS_STATSDIR		2	/* directory prefix for stats files */
 #define	STATS_PID_FILE		3	/* configure ntpd PID file */
 #define	STATS_LEAP_FILE		4	/* configure ntpd leapseconds file */
+#define	STATS_STATE_FILE	5	/* configure warm restart file */
 
 /*
  * Structure used optionally for monitoring when this is turned on.
  */
 typedef struct mon_data	mon_entry;
 struct mon_data {
-	mon_entry *	hash_next;	/* next structure in hash list */
+	mon_entry *	free_next;	/* next structure on free list */
 	DECL_DLIST_LINK(mon_entry, mru);/* MRU list link pointers */
 	endpt *		lcladr;		/* address on which this arrived */
 	l_fp		first;		/* first time seen */
@@ -622,6 +683,17 @@ struct mon_data {
 	float		score;		/* recent packets/second */
 	unsigned short	flags;		/* restrict flags */
 	uint8_t		vn_mode;	/* packet mode & version */
+	bool		referenced;	/* hit since last CLOCK sweep */
+	float		ctl_tokens;	/* mode 6 budget left, cost units */
+	uptime_t	ctl_stamp;	/* when ctl_tokens was topped up */
+	l_fp		xl_rx;		/* last client request received */
+	l_fp		xl_tx;		/* and the reply to it sent */
+	l_fp		req_xmt;	/* its transmit time, to spot copies */
+	bool		req_plain;	/* 48 bytes in basic mode */
+	struct restrict_u_tag *res;	/* restrict entry last matched */
+	unsigned int	res_gen;	/* restrict generation then, 0 none */
+	bool		res_ntpport;	/* matched from the NTP port */
+	bool		res_inset;	/* and in the restrict set */
 	sockaddr_u	rmtadr;		/* address of remote host */
 };
 
@@ -658,6 +730,7 @@ typedef struct res_addr6_tag {
 typedef struct restrict_u_tag	restrict_u;
 struct restrict_u_tag {
 	restrict_u *		link;	/* link to next entry */
+	restrict_u *		hlink;	/* next in hash chain */
 	uint64_t		hitcount;	/* number of packets matched */
 	unsigned short		flags;	/* accesslist flags */
 	unsigned short		mflags;	/* match flags */
@@ -719,6 +792,7 @@ struct restrict_u_tag {
 struct endpoint {
 	double	val;			/* offset of endpoint */
 	int	type;			/* interval entry/exit */
+	struct peer *peer;		/* whose interval */
 };
 
 
@@ -726,5 +800,7 @@ struct endpoint {
 #define MRU_ROW_LIMIT	256
 /* similar datagrams per response limit for ntpd */
 #define MRU_FRAGS_LIMIT	128
+/* and packets per response over a stream, where nothing is lost */
+#define CTL_STREAM_FRAGS	65535
 
 #endif /* GUARD_NTP_H */
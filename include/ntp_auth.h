@@ -5,6 +5,9 @@
 #include "ntp_lists.h"
 
 #include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER < 0x20000000L
+#include <openssl/cmac.h>
+#endif
 
 typedef enum {AUTH_NONE, AUTH_CMAC, AUTH_DIGEST} AUTH_Type;
 
@@ -22,10 +25,11 @@ struct auth_data {
 	uint8_t *	key;			/* shared secret */
 	unsigned short	key_size;		/* secret length */
 	const EVP_MD *	digest;			/* Digest mode only */
+	EVP_MD_CTX *	md_ctx;			/* Digest mode only, key hashed */
 #if OPENSSL_VERSION_NUMBER > 0x20000000L
-	EVP_MAC_CTX *mac_ctx;			/* EVP CMAC mode only */
+	EVP_MAC_CTX *mac_ctx;			/* CMAC mode only, pre-keyed */
 #else
-	const EVP_CIPHER *cipher;		/* Old CMAC mode only */
+	CMAC_CTX *mac_ctx;			/* CMAC mode only, pre-keyed */
 #endif
 };
 
@@ -36,10 +40,19 @@ extern  void    auth_reset_stats(uptime_t reset_time);
 
 extern  void	auth_setkey	(keyid_t, AUTH_Type, const char *, const uint8_t *, size_t);
 extern  void    auth_delkeys    (void);
+extern  void    auth_delkey     (keyid_t);
 extern  bool    authreadkeys    (const char *);
+
+/* A parsed keys file; parse anywhere, apply on the main thread */
+typedef struct auth_keyfile auth_keyfile;
+extern  auth_keyfile *authparsekeys  (const char *);
+extern  int     authapplykeys   (auth_keyfile *);
+extern  void    authfreekeyfile (auth_keyfile *);
+extern  bool    authkeydb_load  (keyid_t);
 extern  void    authtrust       (keyid_t, bool);
 
 extern  auth_info *    authlookup   (keyid_t, bool);
+extern  void    auth_index      (void);
 
 extern  bool    authdecrypt     (auth_info*, uint32_t *, int, int);
 extern  int     authencrypt     (auth_info*, uint32_t *, int);
@@ -70,7 +83,12 @@ extern	uptime_t auth_timereset;	/* current_time when stats reset */
 extern EVP_MAC_CTX *evp_ctx;   /* used by authreadkeys and authkeys */
 /* For testing */
 extern EVP_MAC_CTX* Setup_MAC_CTX(const char *name, uint8_t *key, int keylen);
+#else
+extern CMAC_CTX* Setup_MAC_CTX(const char *name, uint8_t *key, int keylen);
 #endif
+extern EVP_MD_CTX* Setup_MD_CTX(const EVP_MD *digest, const uint8_t *key,
+				int keylen);
+extern void Free_MAC_CTX(auth_info *auth);
 
 /* Not in CMAC API */
 #define CMAC_MAX_MAC_LENGTH 64
@@ -170,6 +170,34 @@ ntpcal_tm_to_daysec(const struct tm * /* utm */);
 extern int
 ntpcal_time_to_date(struct calendar * /* jd */, const time64_t /* ts */);
 
+/*
+ * One day's worth of ntpcal_time_to_date().  The date part is worked
+ * out when the day changes, and calls within the same day only split
+ * the seconds since midnight.  Start from a zeroed one; the caller
+ * owns it, so it needs no locking of its own.
+ */
+typedef struct {
+	time64_t	midnight;	/* UN*X seconds at the start of the day */
+	struct calendar	date;		/* the date part of that day */
+	int32_t		mjd;		/* Modified Julian Day of that day */
+	int		leaps;		/* from ntpcal_rd_to_date() */
+	bool		valid;
+} ntpcal_daycache;
+
+/*
+ * Bring the cache to the day of 'ts', a UN*X time, and return the
+ * seconds since that midnight.
+ */
+extern int32_t
+ntpcal_daycache_update(ntpcal_daycache *, const time64_t /* ts */);
+
+/*
+ * ntpcal_time_to_date() by way of a day cache.
+ */
+extern int
+ntpcal_time_to_date_cached(ntpcal_daycache *, struct calendar * /* jd */,
+			   const time64_t /* ts */);
+
 extern int32_t
 ntpcal_periodic_extend(int32_t /* pivot */, int32_t /* value */,
 		       int32_t /* cycle */) __attribute__((const));
@@ -205,6 +233,11 @@ ntpcal_date_to_time(const struct calendar * /* jd */);
  */
 #define NTP_TO_UNIX_DAYS (DAY_UNIX_STARTS - DAY_NTP_STARTS)
 
+/*
+ * Modified Julian Day of the UNIX epoch.
+ */
+#define	MJD_1970	40587
+
 /*
  * Days in a normal 4 year leap year calendar cycle (1461).
  */
@@ -92,6 +92,7 @@ struct restrict_node_tag {
 	address_node *	addr;
 	address_node *	mask;
 	int_fifo *	flags;
+	char *		set;	/* restrict set file, or NULL */
 	int		line_no;
 };
 
@@ -164,6 +165,15 @@ struct addr_opts_node_tag {
 
 typedef DECL_FIFO_ANCHOR(addr_opts_node) addr_opts_fifo;
 
+typedef struct thread_node_tag thread_node;
+struct thread_node_tag {
+	thread_node *	link;
+	int		thread_class;	/* T_Main, T_Workers, ... */
+	attr_val_fifo *	options;
+};
+
+typedef DECL_FIFO_ANCHOR(thread_node) thread_fifo;
+
 typedef struct sim_node_tag sim_node;
 struct sim_node_tag {
 	sim_node *		link;
@@ -201,6 +211,7 @@ struct config_tree_tag {
 	attr_val_fifo *	extra;
 	attr_val_fifo *	tinker;
 	attr_val_fifo *	nts;
+	thread_fifo *	threads;
 	attr_val_fifo *	enable_opts;
 	attr_val_fifo *	disable_opts;
 
@@ -260,6 +271,7 @@ attr_val *create_attr_rangeval(int attr, int first, int last);
 attr_val *create_attr_sval(int attr, const char *s);
 filegen_node *create_filegen_node(int filegen_token,
 				  attr_val_fifo *options);
+thread_node *create_thread_node(int thread_class, attr_val_fifo *options);
 string_node *create_string_node(char *str);
 restrict_node *create_restrict_node(int mode, address_node *addr,
 				    address_node *mask,
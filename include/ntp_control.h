@@ -64,8 +64,53 @@ struct ntp_control {
 #define CTL_OP_READ_MRU		10	/* retrieve MRU (mrulist) */
 #define CTL_OP_READ_ORDLIST_A	11	/* ordered list req. auth. */
 #define CTL_OP_REQ_NONCE	12	/* request a client nonce */
+#define CTL_OP_READVAR_BIN	13	/* read variables, binary values */
+#define CTL_OP_READ_PEERS	14	/* read all peers' variables */
+#define CTL_OP_READ_SAMPLES	15	/* read a peer's raw samples */
+#define CTL_OP_READ_PKTTRACE	16	/* read the packet trace */
 /* #def	CTL_OP_UNSETTRAP	31	** unset trap (unused) */
 
+/*
+ * CTL_OP_READVAR_BIN answers with the variables of CTL_OP_READVAR, each
+ * as a type octet, a name length octet, a 16 bit value length, the name
+ * and then the value.  Numbers are in network byte order; a double is
+ * its IEEE 754 bit pattern followed by an octet giving the precision
+ * the text reply would have used (CTL_BIN_GFMT for %g).
+ */
+#define	CTL_BIN_STR		1	/* quoted string */
+#define	CTL_BIN_TEXT		2	/* unquoted text, as in the text reply */
+#define	CTL_BIN_INT		3	/* int64_t */
+#define	CTL_BIN_UINT		4	/* uint64_t */
+#define	CTL_BIN_HEX		5	/* uint64_t shown in hex */
+#define	CTL_BIN_DBL		6	/* double, precision */
+#define	CTL_BIN_TS		7	/* l_fp: seconds, fraction */
+#define	CTL_BIN_ARRAY		8	/* doubles, shown with %.2f */
+
+#define	CTL_BIN_GFMT		0xff
+
+/*
+ * CTL_OP_READ_SAMPLES answers with a header of the newest sample's
+ * number, the oldest the peer still keeps, the record length and the
+ * number of records, then the records, oldest first.  A record holds
+ * the sample number, t1 to t4 as l_fp, the offset in units of 2^-32 s
+ * and the delay and dispersion in units of 2^-24 s, all in network
+ * byte order.
+ */
+#define	CTL_SAMPLES_HDRLEN	12
+#define	CTL_SAMPLE_LEN		52
+
+/*
+ * CTL_OP_READ_PKTTRACE answers with a header of the newest record's
+ * number as 64 bits, the oldest the ring can hold the same way, and a
+ * 16 bit record length, then as many records, oldest first, as the
+ * response has room for.  A record holds its number, the time as an
+ * l_fp, the direction, the address family (4 or 6), the port, the
+ * packet length, two octets of padding, the address padded to 16
+ * octets and the first 48 octets of the packet as on the wire.
+ */
+#define	CTL_PKTTRACE_HDRLEN	20
+#define	CTL_PKTTRACE_LEN	88
+
 /*
  * {En,De}coding of the system status word
  */
@@ -164,7 +209,7 @@ struct ntp_control {
  * IFSTATS_FIELDS is the number of fields ntpd supplies for each ifstats
  * row.  Similarly RESLIST_FIELDS for reslist.
  */
-#define	IFSTATS_FIELDS	9
+#define	IFSTATS_FIELDS	11
 #define	RESLIST_FIELDS	4
 
 /*
@@ -8,9 +8,12 @@
 
 typedef enum {DNS_good, DNS_temp, DNS_error} DNS_Status;
 
-/* start DNS query (unless busy) */
+/* queue DNS query (unless too many are) */
 extern bool dns_probe(struct peer*);
 
+/* peer is going away, drop its query */
+extern void dns_forget(struct peer*);
+
 /* called by main thread to do callbacks */
 extern void dns_check(void);
 
@@ -22,4 +25,14 @@ extern void dns_take_status(struct peer*, DNS_Status);
 /* SIGHUP or a new interface has appeared - try again */
 extern void dns_try_again(void);
 
+/* getaddrinfo() with a cache, answers kept for their DNS TTL.
+ * Free what it returns with dns_cache_free(). */
+extern int dns_cache_getaddrinfo(const char *, const char *,
+	const struct addrinfo *, struct addrinfo **);
+/* cached answer only, no lookup */
+extern bool dns_cache_get(const char *, const char *,
+	const struct addrinfo *, struct addrinfo **);
+extern void dns_cache_free(struct addrinfo *);
+extern void dns_cache_flush(void);
+
 #endif	/* GUARD_NTP_DNS_H */
@@ -9,6 +9,7 @@
 #define GUARD_NTP_FILEGEN_H
 
 #include "ntp_types.h"
+#include "ntp_stdlib.h"
 
 /*
  * supported file generation types
@@ -28,22 +29,55 @@
  */
 
 #define FGEN_FLAG_LINK		0x01 /* make a link to base name */
+#define FGEN_FLAG_BINARY	0x02 /* binary records, see filegen_binary() */
+#define FGEN_FLAG_COMPRESS	0x04 /* gzip generations once closed */
 
 #define FGEN_FLAG_ENABLED	0x80 /* set this to really create files	  */
 				     /* without this, open is suppressed */
 
+struct filegen_stream;
+
 typedef struct filegen_tag {
 	FILE *	fp;	/* file referring to current generation */
+	struct filegen_stream *stream;	/* socket instead of files */
+	char *	buf;	/* stdio buffer of fp, when buffering */
+	bool	pending;	/* records not yet flushed */
+	uptime_t since;	/* when the oldest of them was written */
+	const char *fields;	/* binary record layout, NULL = text only */
+	uint16_t reclen;	/* binary record length */
 	char *	dir;	/* currently always statsdir */
 	char *	fname;	/* filename prefix of generation file */
 			/* must be malloced, will be fed to free() */
+	char *	name;	/* full name of the open generation */
 	time_t	id_lo;	/* lower bound of ident value */
 	time_t	id_hi;	/* upper bound of ident value */
 	uint8_t	type;	/* type of file generation */
 	uint8_t	flag;	/* flags modifying processing of file generation */
 } FILEGEN;
 
+/*
+ * Stats records are normally flushed as they are written.  With a
+ * nonzero flush window they are buffered instead, and reach the file
+ * when the buffer fills or the oldest has waited this many seconds.
+ */
+#define FILEGEN_BUFSIZE		65536	/* stdio buffer per file */
+#define FILEGEN_BINSUFFIX	"-bin"	/* after the name of binary files */
+#define FILEGEN_GZSUFFIX	".gz"	/* after the name of compressed files */
+#define FILEGEN_WINDOW_MAX	3600	/* longest flush window, seconds */
+#define FILEGEN_STREAM_HEADER	60	/* binary stream header interval */
+extern	int	filegen_window;
+
 extern	void	filegen_setup	(FILEGEN *, time_t);
+extern	void	filegen_write	(FILEGEN *, time_t, const char *, ...)
+			NTP_PRINTF(3, 4);
+extern	void	filegen_write_binary(FILEGEN *, time_t, const void *, size_t);
+extern	void	filegen_binary	(FILEGEN *, const char *, size_t);
+extern	bool	filegen_stream	(FILEGEN *, const char *);
+extern	void	filegen_timer	(void);
+extern	void	filegen_flush	(void);
+extern	void	filegen_start_writer(void);
+extern	size_t	filegen_memory	(void);
+extern	void	filegen_stop_writer(void);
 extern	void	filegen_config	(FILEGEN *, const char *, const char *,
 				 unsigned int, unsigned int);
 extern	void	filegen_statsdir(void);
@@ -116,9 +116,12 @@ typedef struct {
 /*
  * scaling to 32bit FP format
  * double to u_fp conversion
+ *
+ * Scaling by a power of two is exact, so a multiply or divide by
+ * one gives what ldexp() would, without the call into libm.
  */
-#define FP_SCALE(r)	(ldexp((double)(r),  16))
-#define FP_UNSCALE(r)	(ldexp((double)(r), -16))
+#define FP_SCALE(r)	((double)(r) * 65536.0)
+#define FP_UNSCALE(r)	((double)(r) / 65536.0)
 #define DTOUFP(r)	((u_fp)FP_SCALE(r))
 
 /*
@@ -126,27 +129,28 @@ typedef struct {
  */
 #define FRAC		4294967296.0 		/* 2^32 as a double */
 
-#include <math.h>	/* ldexpl() */
+#include <math.h>
 
 static inline l_fp dtolfp(doubletime_t d) {
 /* long double to l_fp
  * assumes signed l_fp, i.e. a time offset
  * undefined return if d in NaN
  */
-	return (l_fp)(int64_t)(ldexpl(d, 32));
+	return (l_fp)(int64_t)(d * FRAC);
 }
 
 static inline doubletime_t lfptod(l_fp r) {
 /* l_fp to long double
  * assumes signed l_fp, i.e. a time offset
  */
-	return ldexpl((double)((int64_t)r), -32);
+	return (doubletime_t)(double)((int64_t)r) / FRAC;
 }
 
 /*
  * Prototypes
  */
 extern	char *	dolfptoa	(l_fp, bool, short, bool);
+extern	char *	dolfptoa_r	(l_fp, bool, short, bool, char *, size_t);
 extern	char *	mfptoa		(l_fp, short);
 extern	char *	mfptoms		(l_fp, short);
 
@@ -166,6 +170,11 @@ extern	bool	adj_systime	(double, int (*adjtime)(const struct timeval *, struct t
 #define	ulfptoms(fpv, ndec)	dolfptoa((fpv), false, (ndec), true)
 #define	umfptoa(lfp, ndec)	dolfptoa((lfp), false, (ndec), false)
 
+/* room for any of the above: sign, 24 digits, point and NUL */
+#define	LFPTOA_LEN	32
+#define	ulfptoa_r(fpv, ndec, buf, len) \
+	dolfptoa_r((fpv), false, (ndec), false, (buf), (len))
+
 /*
  * Optional callback from libntp step_systime() to ntpd.  Optional
 *  because other libntp clients like ntpdate don't use it.
@@ -0,0 +1,35 @@
+/* ntp_histogram.h - fixed-size log-scale latency histograms
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Each power of two of nanoseconds is split into HIST_SUB buckets,
+ * so a bucket is at most 25% wide and a percentile read back from
+ * it is that close to the truth.  Nothing is allocated; adding a
+ * sample is a few shifts and three stores, cheap enough for the
+ * packet path.  There is no locking here, callers share with care.
+ */
+#ifndef GUARD_NTP_HISTOGRAM_H
+#define GUARD_NTP_HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUBBITS	2
+#define HIST_SUB	(1 << HIST_SUBBITS)
+#define HIST_TOPBIT	40		/* 2^40 ns is about 18 minutes */
+#define HIST_BUCKETS	(HIST_SUB * (HIST_TOPBIT - HIST_SUBBITS + 2))
+
+struct histogram {
+	uint64_t	count;
+	uint64_t	sum;		/* ns */
+	uint64_t	max;		/* ns */
+	uint64_t	bucket[HIST_BUCKETS];
+};
+
+extern void	histogram_clear(struct histogram *);
+extern void	histogram_add(struct histogram *, uint64_t);
+extern unsigned int histogram_bucket(uint64_t) __attribute__((const));
+extern uint64_t	histogram_bucket_top(unsigned int) __attribute__((const));
+extern uint64_t	histogram_percentile(const struct histogram *, double);
+
+#endif	/* GUARD_NTP_HISTOGRAM_H */
@@ -36,6 +36,31 @@ typedef enum {
 
 
 extern int	qos;
+#define RX_BATCH_MAX	64	/* upper bound for rxbatch */
+extern int	rx_batch;
+extern bool	single_socket;	/* per-address endpoints share wildcards */
+extern int	sock_rcvbuf;	/* SO_RCVBUF to ask for, 0 for the default */
+extern int	sock_sndbuf;	/* SO_SNDBUF to ask for, 0 for the default */
+extern int	sock_rcvmax;	/* autotuning grows SO_RCVBUF to this */
+#define SOCKBUF_MAX	(1024 * 1024)	/* KB, for rcvbuf, rcvmax, sndbuf */
+
+struct tx_queue;
+struct recvbuf;
+struct msghdr;
+struct netendpt;
+extern struct tx_queue *tx_queue_create(void);
+extern void	tx_queue_select(struct tx_queue *, SOCKET);
+extern void	tx_queue_flush(struct tx_queue *, unsigned long *,
+			       unsigned long *);
+extern void	tx_queue_put(struct tx_queue *, sockaddr_u *, void *,
+			     unsigned int, bool);
+extern SOCKET	open_worker_socket(struct netendpt *);
+extern void	sockbuf_poll(SOCKET, struct netendpt *, struct sockbuf *);
+extern bool	accept_network_packet(struct recvbuf *, struct netendpt *);
+extern void	input_latency(const struct recvbuf *);
+extern void	input_polled(struct recvbuf *, struct netendpt *,
+			     struct msghdr *);
+extern bool	io_endpt_polled(struct netendpt *, bool);
 extern bool	is_ip_address(const char *, unsigned short, sockaddr_u *);
 extern void	add_nic_rule(nic_rule_match match_type,
 			     const char *if_name, int prefixlen,
@@ -69,6 +69,7 @@ struct refclockio {
 				due to small bursts
 				of refclock input data */
 	struct peer *srcclock;	/* refclock peer */
+	struct recvbuf *rb;	/* this clock's own, not from the pool */
 	size_t	datalen;	/* length of data */
 	int	fd;		/* file descriptor */
 	unsigned long	recvcount;	/* count of receive completions */
@@ -94,11 +95,23 @@ struct refclockbug {
  * Structure interface between the reference clock support
  * ntp_refclock.c and the driver utility routines
  */
-#define MAXSTAGE	60	/* max median filter stages  */
+#define FILTER_STAGES	60	/* median filter stages unless configured */
+#define FILTER_STAGES_MAX 16384	/* most the stages option allows */
 #define NSTAGE		5	/* default median filter stages */
 #define BMAX		128	/* max timecode length */
 #define MAXDIAL		60	/* max length of modem dial strings */
 
+/*
+ * A sample as a driver hands it over in a batch, and as the median
+ * filter ring keeps it beside the offset: the local receive time and
+ * the driver's estimate of the sample's error, 0 if it has none.
+ */
+struct refclock_stamp {
+	l_fp	ref;		/* reference timestamp */
+	l_fp	rec;		/* receive timestamp */
+	double	err;		/* error estimate (s), 0 if unknown */
+};
+
 struct refclockproc {
 	void *	unitptr;	/* pointer to unit structure */
 	struct refclock * conf;	/* pointer to driver method table */
@@ -129,7 +142,12 @@ struct refclockproc {
 	double	offset;		/* mean offset */
 	double	disp;		/* sample dispersion */
 	double	jitter;		/* jitter (mean squares) */
-	double	filter[MAXSTAGE]; /* median filter */
+	double	freq;		/* fitted frequency offset (s/s) */
+	int	nstage;		/* median filter stages */
+	double	*filter;	/* median filter ring, nstage + 1 slots */
+	struct refclock_stamp *stamps;	/* its rec and err, ref unused */
+	double	*sorted;	/* refclock_sample() scratch, nstage slots */
+	struct refclock_ppscap *ppscap;	/* PPS capture thread, if any */
 
 	/*
 	 * Configuration data
@@ -165,6 +183,47 @@ struct refclock {
 				 struct refclockstat *, struct peer *);
 	void (*clock_init)	(void);
 	void (*clock_timer)	(int, struct peer *);
+	bool (*clock_fast)	(int, struct peer *, double *);
+};
+
+/*
+ * The NTP SHM segment, keyed "NTP0" plus the unit.  Producers such as
+ * GPSD write it and the SHM and GPSD drivers read it.  Do not change
+ * its size: existing producers would map a segment of the wrong size.
+ */
+struct shmTime {
+	int    mode; /* 0 - if valid is set:
+		      *       use values,
+		      *       clear valid
+		      * 1 - if valid is set:
+		      *       if count before and after read of values is equal,
+		      *         use values
+		      *       clear valid
+		      */
+	volatile int    count;
+	time_t		clockTimeStampSec;
+	int		clockTimeStampUSec;
+	time_t		receiveTimeStampSec;
+	int		receiveTimeStampUSec;
+	int		leap;
+	int		precision;
+	int		nsamples;
+	volatile int    valid;
+	unsigned	clockTimeStampNSec;	/* Unsigned ns timestamps */
+	unsigned	receiveTimeStampNSec;	/* Unsigned ns timestamps */
+	int		dummy[8];
+};
+
+enum segstat_t {
+	SHM_OK, SHM_NO_SEGMENT, SHM_NOT_READY, SHM_BAD_MODE, SHM_CLASH
+};
+
+struct shm_stat_t {
+	int status;
+	int mode;
+	struct timespec tvc, tvr, tvt;
+	int precision;
+	int leap;
 };
 
 /*
@@ -172,12 +231,17 @@ struct refclock {
  */
 extern	bool	io_addclock	(struct refclockio *);
 extern	void	io_closeclock	(struct refclockio *);
+extern	void	io_refclock_input (struct refclockio *, struct recvbuf *);
+
+/* ntp_refio.c */
+extern	bool	refio_add	(struct refclockio *);
+extern	void	refio_remove	(struct refclockio *);
+extern	void	refio_timer	(void);
 
 #ifdef REFCLOCK
 extern	bool	refclock_newpeer (uint8_t, int, struct peer *);
 extern	void	refclock_unpeer (struct peer *);
 extern	void	refclock_receive (struct peer *);
-extern	void	init_refclock	(void);
 extern	void	refclock_control(sockaddr_u *,
 				 const struct refclockstat *,
 				 struct refclockstat *);
@@ -188,12 +252,19 @@ extern 	bool	refclock_process(struct refclockproc *);
 extern 	bool	refclock_process_f(struct refclockproc *, double);
 extern 	void	refclock_process_offset(struct refclockproc *, l_fp,
 					l_fp, double);
+extern	void	refclock_process_batch(struct refclockproc *,
+				       const struct refclock_stamp *,
+				       size_t, double);
 extern	void	refclock_report	(struct peer *, int);
+extern	bool	refclock_fast	(struct peer *, double *);
 extern	char	*refclock_name	(const struct peer *);
 extern	int	refclock_gtlin	(struct recvbuf *, char *, int, l_fp *);
 extern	size_t	refclock_gtraw	(struct recvbuf *, char *, size_t, l_fp *);
 extern	bool	indicate_refclock_packet(struct refclockio *,
 					 struct recvbuf *);
+extern	struct shmTime *refclock_shm_attach(int, bool);
+extern	enum segstat_t	refclock_shm_query(volatile struct shmTime *,
+					   struct shm_stat_t *);
 
 extern struct refclock refclock_none;
 
@@ -251,6 +322,12 @@ extern	struct refclock refclock_oncore;
 #define refclock_oncore refclock_none
 #endif
 
+#ifdef CLOCK_PHC
+extern	struct refclock	refclock_phc;
+#else
+#define	refclock_phc	refclock_none
+#endif
+
 #if defined (CLOCK_PPS) && defined(HAVE_PPSAPI)
 extern	struct refclock	refclock_pps;
 #else
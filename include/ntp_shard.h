@@ -0,0 +1,39 @@
+/* ntp_shard.h - per-thread counter shards, summed when read
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * A counter struct bumped from several threads either needs a lock
+ * around every increment or it loses counts.  Instead each thread
+ * gets a zeroed copy of its own, on cache lines no other thread
+ * writes, and a reader adds the copies up.  The struct must hold
+ * nothing but uint64_t (or l_fp) fields; sums wrap the same way the
+ * plain counters would.  A thread's shards are folded into the set
+ * and freed when it exits.  A fold does not stop the writers, so a
+ * struct read back may be a few counts behind the threads.
+ */
+#ifndef GUARD_NTP_SHARD_H
+#define GUARD_NTP_SHARD_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHARD_ALIGN	64		/* bytes, a cache line */
+
+struct shard;
+
+struct shard_set {
+	pthread_mutex_t	lock;
+	size_t		size;		/* bytes, a multiple of 8 */
+	struct shard	*shards;	/* live threads */
+	uint64_t	*retired;	/* sums from threads that exited */
+};
+
+#define SHARD_SET_INIT(type) \
+	{ PTHREAD_MUTEX_INITIALIZER, sizeof(type), NULL, NULL }
+
+extern void	*shard_mine(struct shard_set *);
+extern void	shard_fold(struct shard_set *, void *);
+
+#endif	/* GUARD_NTP_SHARD_H */
@@ -6,6 +6,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <pthread.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
@@ -42,6 +43,10 @@ extern	void	init_logging	(const char *, uint32_t, int);
 extern	int	change_logfile	(const char *, bool);
 extern	void	check_logfile	(void);
 extern	void	setup_logfile	(const char *);
+extern	void	msyslog_start_async	(void);
+extern	size_t	msyslog_memory		(void);
+extern	void	msyslog_stop_async	(void);
+extern	void	msyslog_sync	(void);
 
 extern	int	clocktime	(int, int, int, int, int, time_t, uint32_t, uint32_t *, uint32_t *);
 extern	void	init_network	(void);
@@ -98,6 +103,37 @@ extern	char *	estrdup_impl(const char *, const char *, int);
 #define	estrdup(s) estrdup_impl((s), __FILE__, __LINE__)
 #endif
 
+/*
+ * Memory accounting by subsystem.  The _tag allocators charge what they
+ * return to a tag and free_tag() credits it back, given the size the
+ * caller already knows; mem_charge() and mem_credit() do the same for
+ * memory carved out of something bigger.  A change of size with
+ * mem_charge() passes the old size, a new block 0.
+ */
+#define	MEM_MRU		0	/* MRU entries, hash tables and sketch */
+#define	MEM_RESTRICT	1	/* restrict entries, tries and sets */
+#define	MEM_PEER	2	/* associations and their hash tables */
+#define	MEM_RECVBUF	3	/* receive buffers and rings */
+#define	MEM_KEYS	4	/* symmetric keys and their index */
+#define	MEM_NTS		5	/* NTS-KE and NTS packet state */
+#define	MEM_TAGS	6
+
+#define	MEM_BYTES	0	/* bytes in use */
+#define	MEM_BLOCKS	1	/* blocks in use */
+#define	MEM_PEAK	2	/* most bytes ever in use */
+
+extern	void	mem_charge	(int, size_t, size_t);
+extern	void	mem_credit	(int, size_t);
+extern	void	free_tag	(int, void *, size_t);
+extern	uint64_t mem_stat	(int, int);
+#define	emalloc_tag(t, n)	(mem_charge((t), (n), 0), emalloc(n))
+#define	emalloc_zero_tag(t, n)	(mem_charge((t), (n), 0), emalloc_zero(n))
+#define	eallocarray_tag(t, n, s) \
+	(mem_charge((t), (n) * (s), 0), eallocarray((n), (s)))
+#define	erealloc_tag(t, p, n, o) \
+	(mem_charge((t), (n), (o)), erealloc((p), (n)))
+#define	estrdup_tag(t, s)	(mem_charge((t), strlen(s) + 1, 0), estrdup(s))
+
 
 extern	const char * eventstr	(int);
 extern	const char * ceventstr	(int);
@@ -109,8 +145,15 @@ extern	const char * socktoa	(const sockaddr_u *);
 extern	const char * socktoa_r	(const sockaddr_u *sock, char *buf, size_t buflen);
 extern	const char * sockporttoa(const sockaddr_u *);
 extern	const char * sockporttoa_r(const sockaddr_u *sock, char *buf, size_t buflen);
+extern	void		sock_hash_init(void);
 extern	unsigned int	sock_hash(const sockaddr_u *) __attribute__((pure));
+extern	unsigned int	sock_hash_bytes(const void *, size_t) __attribute__((pure));
+extern	uint64_t	sip_hash24(const uint64_t [2], const void *, size_t)
+			    __attribute__((pure));
+extern	const char digit_pairs[200];
 extern	const char *refid_str	(uint32_t, int);
+extern	const char *refid_str_r	(uint32_t, int, char *, size_t);
+extern	size_t	u64toa_r	(uint64_t, char *, size_t);
 
 extern	int	decodenetnum	(const char *, sockaddr_u *);
 
@@ -118,6 +161,8 @@ extern	void	signal_no_reset (int, void (*func)(int));
 #ifndef __NetBSD__
 extern void signal_no_reset1(int, void (*func)(int, siginfo_t *, void *));
 #endif
+extern	int	ntp_thread_create(pthread_t *, void *(*)(void *), void *,
+				  const char *);
 
 extern	void	getauthkeys 	(const char *);
 
@@ -13,6 +13,8 @@
 extern bool	syslogit;	/* log to syslogit */
 extern bool	termlogit;	/* duplicate to stdout/err */
 extern bool	termlogit_pid;
+extern unsigned int msyslog_slots;	/* async queue, a power of 2 */
+extern unsigned int msyslog_report;	/* seconds between summaries */
 extern bool	msyslog_include_timestamp;
 
 /*
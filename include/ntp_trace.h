@@ -0,0 +1,34 @@
+/*
+ * ntp_trace.h - USDT tracepoints on ntpd's packet and clock paths
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Built with --enable-usdt, NTP_TRACEn(name, ...) is a probe in the
+ * "ntpd" provider, a nop until bpftrace, perf, SystemTap or DTrace
+ * attaches to it.  Otherwise the arguments are evaluated and thrown
+ * away, which the compiler does for nothing.  Arguments must be
+ * integers or pointers.
+ */
+#ifndef GUARD_NTP_TRACE_H
+#define GUARD_NTP_TRACE_H
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define NTP_TRACE2(name, a, b) \
+	DTRACE_PROBE2(ntpd, name, a, b)
+#define NTP_TRACE3(name, a, b, c) \
+	DTRACE_PROBE3(ntpd, name, a, b, c)
+#define NTP_TRACE4(name, a, b, c, d) \
+	DTRACE_PROBE4(ntpd, name, a, b, c, d)
+#else
+#define NTP_TRACE2(name, a, b) \
+	((void)(a), (void)(b))
+#define NTP_TRACE3(name, a, b, c) \
+	((void)(a), (void)(b), (void)(c))
+#define NTP_TRACE4(name, a, b, c, d) \
+	((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+#endif	/* GUARD_NTP_TRACE_H */
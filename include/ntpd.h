@@ -18,6 +18,7 @@
 #include "ntp_malloc.h"
 #include "ntp_refclock.h"
 #include "ntp_control.h"
+#include "ntp_histogram.h"
 #include "recvbuff.h"
 
 /*
@@ -37,16 +38,44 @@
 # define FALLTHRU
 #endif
 
+/*
+ * The per-request path of a server-profile build, which the compiler
+ * optimizes harder and keeps together, and its rarely run exits.
+ */
+#if defined(ENABLE_SERVER_PROFILE) && defined(__GNUC__)
+# define NTP_HOT __attribute__ ((hot))
+# define NTP_COLD __attribute__ ((cold))
+#else
+# define NTP_HOT
+# define NTP_COLD
+#endif
+
 /* ntpd.c */
 extern	void announce_starting(void);
 
 /* ntp_config.c */
 extern	const char	*getconfig	(const char *);
 extern	void	readconfig(const char *);
+extern	void	reload_config(void);
 extern	void	ctl_clr_stats	(void);
+extern	void	ctl_sysvars_changed (void);
 extern	unsigned short ctlpeerstatus	(struct peer *);
 extern	void	init_control	(void);
 extern	void	process_control (struct recvbuf *, int);
+/*
+ * A connection that mode 6 requests came in on and responses go back
+ * out on, rather than a datagram socket.  send() gets the packets of a
+ * response a batch at a time.
+ */
+struct iovec;
+struct ctl_stream {
+	void	(*send)(struct ctl_stream *, const struct iovec *,
+			unsigned int);
+	bool	authonly;	/* refuse requests without the control key */
+};
+extern	void	process_control_stream (struct recvbuf *, int,
+					struct ctl_stream *);
+extern	void	ctl_timer	(void);
 extern	void	report_event	(int, struct peer *, const char *);
 extern	int	mprintf_event	(int, struct peer *, const char *, ...)
 			NTP_PRINTF(3, 4);
@@ -109,11 +138,30 @@ extern	void	init_io		(void);
 extern	void	io_open_sockets	(void);
 extern	void	io_clr_stats	(void);
 extern	void	sendpkt		(sockaddr_u *, endpt *, void *, unsigned int);
+extern	void	sendpkts	(sockaddr_u *, endpt *, struct iovec *,
+				 unsigned int);
+extern	void	sendpkt_txstamp	(sockaddr_u *, endpt *, void *, unsigned int);
+extern	void	queue_sendpkt	(sockaddr_u *, endpt *, void *, unsigned int);
+extern	void	queue_sendpkt_txstamp (sockaddr_u *, endpt *, void *,
+				       unsigned int);
+extern	void	queue_sealed_sendpkt (sockaddr_u *, endpt *, void *,
+				      unsigned int, struct nts_seal *, bool);
+extern	void	flush_sendpkts	(void);
+extern	void	sockbuf_timer	(void);
+#if defined(HAVE_NET_ROUTE_H) || defined(ENABLE_MSSNTP)
+extern	void	io_add_reader	(SOCKET, void (*)(SOCKET));
+extern	void	io_close_reader	(SOCKET);
+#endif
 extern const char * latoa(endpt *);
 extern  uint64_t dropped_count(void);
 extern  uint64_t ignored_count(void);
+extern  uint64_t shed_count(void);
+extern  uint64_t overload_shed_count(void);
+extern  uint64_t overloads_count(void);
 extern  uint64_t received_count(void);
 extern  void     inc_received_count(void);
+extern  void     inc_ignored_count(void);
+extern  void     add_sent_counts(unsigned long, unsigned long);
 extern  uint64_t sent_count(void);
 extern  uint64_t notsent_count(void);
 extern  uint64_t handler_calls_count(void);
@@ -128,12 +176,39 @@ extern  uint16_t extra_port;
 extern	void	init_loopfilter(void);
 extern	int	local_clock(struct peer *, double);
 extern	void	adj_host_clock(void);
+extern	void	fast_clock(void);
 extern	void	loop_config(int, double);
 extern	void	select_loop(int);
 extern	void	huffpuff(void);
 extern	unsigned int	sys_tai;
+extern	int	fastloop_rate;	/* fast loop updates/s, 0 = off */
 extern	int	freq_cnt;
 
+/* ntp_ctlstream.c */
+extern	void	ctlstream_config (const char *);
+extern	void	ctlstream_start	(void);
+
+/* ntp_handover.c */
+extern	void	handover_config	(const char *);
+extern	void	handover_receive (void);
+extern	SOCKET	handover_take	(const sockaddr_u *, int);
+extern	FILE *	handover_state	(void);
+extern	void	handover_start	(void);
+extern	bool	handover_gone	(void);
+
+/* ntp_filewatch.c */
+struct stat;
+typedef void (*filewatch_fn)(const char *path, struct stat *sb, bool verbose);
+extern	void	filewatch_add	(const char *, const struct stat *, filewatch_fn);
+extern	bool	filewatch_load	(const char *, filewatch_fn);
+extern	bool	filewatch_poke	(bool verbose);
+extern	void	filewatch_start	(void);
+
+/* ntp_metrics.c */
+extern	void	metrics_config	(const char *);
+extern	void	metrics_start	(void);
+extern	void	metrics_timer	(void);
+
 /* ntp_monitor.c */
 extern	void	init_mon(void);
 extern	void	mon_setup(int);
@@ -141,10 +216,21 @@ extern	void	mon_setdown(int);
 extern	void	mon_start(void);
 extern	void	mon_stop(void);
 extern	void	mon_timer(void);
-extern	unsigned short	ntp_monitor	(struct recvbuf *, unsigned short);
+extern	unsigned short	ntp_monitor	(struct recvbuf *, unsigned short)
+				NTP_HOT;
+extern	unsigned short	mon_restrictions (sockaddr_u *) NTP_HOT;
+extern	void	mon_xleave_sent	(struct recvbuf *);
+extern	bool	mon_txstamp	(const void *, size_t, l_fp);
 extern	void	mon_clearinterface(endpt *interface);
 extern  int	mon_get_oldest_age(l_fp);
+extern	void	mon_expire(l_fp);
+extern	bool	mon_state(const mon_entry *, l_fp, float *);
+extern	bool	mon_restore(const sockaddr_u *, l_fp, int, uint8_t, float,
+			    l_fp);
 extern  mon_entry *mon_get_slot(sockaddr_u *);
+extern  bool	mon_ctl_charge(sockaddr_u *, unsigned int);
+extern	void	mon_sort_mru(void);
+extern	size_t	mon_memory	(void);
 
 /* ntp_peer.c */
 extern	void	init_peer	(void);
@@ -166,13 +252,35 @@ extern	void	unpeer		(struct peer *);
 extern	void	clear_all	(void);
 extern	int	score_all	(struct peer *);
 extern	void	peer_cleanup	(void);
+extern	size_t	peer_memory	(void);
+
+/* ntp_pool.c */
+extern	void	pool_take	(struct peer *, sockaddr_u *);
+extern	bool	pool_fill	(struct peer *, int);
+extern	bool	pool_spare	(struct peer *);
+extern	void	pool_demote	(struct peer *);
+extern	void	pool_stale	(struct peer *);
+extern	void	pool_forget	(struct peer *);
 
 /* ntp_proto.c */
 extern	void	transmit	(struct peer *);
+extern	void	xmit_batch	(bool);
 extern	void	receive		(struct recvbuf *);
+struct tx_queue;
+extern	int	fast_admit	(struct recvbuf *) NTP_HOT;
+extern	void	fast_reply	(struct recvbuf *, struct tx_queue *) NTP_HOT;
+#define FAST_SLOW	0	/* needs the full receive() path */
+#define FAST_DONE	1	/* dropped, or answered with a KoD */
+#define FAST_REPLY	2	/* admitted, answer with fast_reply() */
 extern	void	peer_clear	(struct peer *, const char *, const bool);
+extern	struct peer *pool_associate (struct peer *, sockaddr_u *);
 extern	void	set_sys_leap	(uint8_t);
+extern	void	publish_reply_template (void);
+extern	void	keep_sample	(struct peer *, l_fp, l_fp, l_fp, l_fp,
+				 double, double, double);
 
+#define	SAMPLES_MAX	16384	/* upper bound for the samples option */
+extern	int	peer_samples;	/* raw samples kept per peer, 0 = none */
 extern	int	sys_orphan;
 extern	double	sys_mindist;
 extern	double	sys_maxdisp;
@@ -194,6 +302,8 @@ stat_sys_form(badauth);
 stat_sys_form(declined);
 stat_sys_form(limitrejected);
 stat_sys_form(kodsent);
+stat_sys_form(kodlimited);
+stat_sys_form(duplicate);
 #undef stat_sys_form
 
 extern uptime_t stat_total_stattime(void);
@@ -207,24 +317,53 @@ extern uptime_t	use_stattime;		/* time since usestats reset */
 extern	void	poll_update	(struct peer *, uint8_t);
 
 extern	void	clock_filter	(struct peer *, double, double, double);
+extern	int	peer_throttle	(const struct peer *);
 extern	void	init_proto	(const bool);
 extern	void	proto_config	(int, unsigned long, double);
 extern	void	proto_clr_stats (void);
 
 /* ntp_restrict.c */
 extern	void	init_restrict	(void);
-extern	unsigned short	restrictions	(sockaddr_u *);
+extern	unsigned short	restrictions	(sockaddr_u *) NTP_HOT;
+extern	unsigned short	restrictions_cached (sockaddr_u *, mon_entry *) NTP_HOT;
 extern	void	hack_restrict	(int, sockaddr_u *, sockaddr_u *,
 				 unsigned short, unsigned short);
+extern	void	sort_restrict	(void);
+extern	void	restrict_publish	(void);
+extern	void	restrict_refilter	(void);
+extern	void	restrict_set	(const char *, unsigned short);
+extern	void	check_restrict_pending	(void);
+extern	bool	restrict_set_info	(const char **, unsigned long *,
+					 uint64_t *, unsigned short *);
 extern	void	restrict_source		(struct peer *);
 extern	void	unrestrict_source	(struct peer *);
 
+/* ntp_select.c */
+/*
+ * peer_select groups statistics for a peer used by clock_select() and
+ * clock_cluster().
+ */
+typedef struct peer_select_tag {
+	struct peer *	peer;
+	double		synch;	/* sync distance */
+	double		error;	/* jitter */
+	double		seljit;	/* selection jitter */
+} peer_select;
+
+extern	void	select_endpoints(const peer_select *, int,
+				 struct endpoint *, struct endpoint *);
+extern	void	select_intersect(const struct endpoint *, int,
+				 double *, double *);
+extern	int	select_cluster	(peer_select *, int, int, int, double *);
+
 /* ntp_timer.c */
 extern	void	init_timer	(void);
 extern	void	reinit_timer	(void);
 extern	void	timer		(void);
 extern	void	timer_clr_stats (void);
 extern	void	timer_interfacetimeout (uptime_t);
+extern	void	timer_schedule	(struct peer *);
+extern	void	timer_unschedule (struct peer *);
 extern	int	interface_interval;
 extern	uptime_t	orphwait;		/* orphan wait time */
 
@@ -233,9 +372,21 @@ extern	void	init_util	(void);
 extern	void 	write_pidfile	(const char *, pid_t);
 extern	void	write_stats	(void);
 extern	void	stats_config	(int, const char *);
+extern	void	state_restore	(FILE *);
+extern	void	state_save	(FILE *);
+extern	void	state_restore_peer (struct peer *);
+extern	void	state_write	(void);
 extern	void	record_peer_stats (struct peer *, int);
 extern	void	record_proto_stats (char *);
+extern	uint64_t latency_since	(int, const struct timespec *);
+extern	void	latency_lfp	(int, l_fp);
+extern	void	cpu_init	(void);
+extern	int	cpu_switch	(int);
+extern	uint64_t	latency_ns	(struct timespec);
+extern	void	startup_mark	(int);
 extern	void	record_loop_stats (double, double, double, double, int);
+extern	void	record_agg_stats (void);
+extern	void	peer_agg_forget	(struct peer *);
 extern	void	record_clock_stats (struct peer *, const char *);
 extern	int	mprintf_clock_stats(struct peer *, const char *, ...)
 			NTP_PRINTF(2, 3);
@@ -261,13 +412,69 @@ extern void record_ref_stats(
     );
 
 extern	void	check_leap_file	(bool is_daily_check, time_t systime);
+extern	void	check_leap_pending (time_t systime);
+extern	void	check_keys_file	(void);
+extern	void	check_keys_reload (void);
+
+/*
+ * Startup milestones, each logged the first time it is reached with
+ * the time since START_EXEC.
+ */
+#define START_EXEC	0	/* main() */
+#define START_CONFIG	1	/* configuration read */
+#define START_LOOP	2	/* main loop entered */
+#define START_DNS	3	/* first server address from DNS */
+#define START_NTSKE	4	/* first NTS-KE exchange done */
+#define START_SAMPLE	5	/* first sample from a source */
+#define START_UPDATE	6	/* first clock update */
+#define START_SYNC	7	/* clock first in sync */
+#define START_MAX	8
+
+/* ntp_workers.c */
+extern	void	start_workers	(void);
+extern	void	workers_add_endpt (endpt *);
+extern	void	workers_remove_endpt (endpt *);
+extern	void	workers_sockbuf	(void);
+extern	void	proto_lock	(void);
+extern	void	proto_unlock	(void);
+
+/* ntp_poller.c */
+extern	void	start_poller	(void);
+extern	void	poller_add_endpt (endpt *);
+extern	void	poller_remove_endpt (endpt *);
+extern	void	poller_timer	(void);
+
+/* ntp_bpf.c */
+extern	void	bpf_filter_start (void);
+extern	bool	bpf_filter_loaded (void);
+extern	void	bpf_filter_attach (SOCKET);
+extern	void	bpf_filter_begin (void);
+extern	bool	bpf_filter_prefix (const uint8_t *, int, bool, bool);
+extern	void	bpf_filter_commit (void);
+extern	void	bpf_filter_hold	(const sockaddr_u *, double);
+extern	void	bpf_filter_timer (void);
+extern	uint64_t bpf_dropped_count (void);
+
+/* ntp_uring.c */
+extern	void	start_uring	(void);
+extern	void	uring_add_endpt	(endpt *);
+extern	void	uring_remove_endpt (endpt *);
+extern	size_t	uring_memory	(void);
 
 /* NTS */
 extern	void	check_cert_file	(void);
 
 /* packetstamp.c */
+#define PKTSTAMP_CONTROL	128	/* cmsg space for the stamps */
 extern void	enable_packetstamps(int, sockaddr_u *);
-extern l_fp	fetch_packetstamp(struct msghdr *);
+extern l_fp	fetch_packetstamp(struct msghdr *, struct phc *);
+extern void	hwstamp_config(const char *);
+#define TXSTAMP_CONTROL		32	/* cmsg space to ask for one */
+extern void	enable_timestamping(int, endpt *);
+extern size_t	txstamp_control(void *, size_t);
+extern bool	txstamp_refused(struct msghdr *);
+extern ssize_t	sendto_txstamp(int, void *, size_t, sockaddr_u *);
+extern void	fetch_txstamps(SOCKET, struct phc *, struct peer *);
 
 /*
  * Signals we catch for debugging.
@@ -303,6 +510,8 @@ struct ntp_io_data {
   endpt *wild6_interface_extra; /* IPv6 wildcard, extra_port */
   endpt *loopback_interface;    /* IPv4 loopback for refclocks */
   endpt *ep_list;               /* complete endpt list */
+  unsigned int shed_average;    /* pkts/s per source prefix, 0 for none */
+  unsigned int shed_burst;      /* pkts a quiet prefix may send at once */
 };
 extern struct ntp_io_data io_data;
 
@@ -348,6 +557,11 @@ struct clock_state_machine {
 extern struct clock_state_machine clkstate;
 
 /* ntp_monitor.c */
+struct mon_slot {
+	uint32_t	key;		/* address digest, 0 if empty */
+	mon_entry *	mon;
+};
+
 struct monitor_data {
 	uint8_t	mon_hash_bits;		/* log2 size of hash table */
 	/*
@@ -357,7 +571,7 @@ struct monitor_data {
 	 * Total count is unlikely to exceed 32 bits in 2017
 	 *   but memories keep growing.
 	 */
-	mon_entry ** mon_hash;		/* MRU hash table */
+	struct mon_slot * mon_hash;	/* MRU hash table */
 	mon_entry mon_mru_list;		/* mru listhead */
 	uint64_t	mru_entries;		/* mru list count */
 	uint64_t	mru_hashslots;		/* hash slots in use */
@@ -375,23 +589,52 @@ struct monitor_data {
 	uint64_t	mru_mindepth;		/* preempt above this */
 	int		mru_maxage;		/* recycle if older than this */
 	int		mru_minage;		/* recycle if older & full */
+	unsigned int	mru_sweep;		/* stale entries freed a second */
 	uint64_t	mru_maxdepth;		/* MRU size hard limit */
+	bool		mru_clocksweep;		/* no relink on hit, see below */
+	bool		mru_unsorted;		/* list out of last-seen order */
+	bool		mru_hugepages;		/* back the arena with huge pages */
+	uint64_t	mru_sketchkb;		/* "mru sketch" size, 0 for none */
+/* Slot arena */
+	uint64_t	mru_arenasize;		/* entries reserved */
+	uint64_t	mru_arenaused;		/* entries handed out */
+	bool		mru_arenahuge;		/* huge pages in effect */
 /* Slot (re)allocation counters */
 	uint64_t	mru_exists;		/* slot already exists */
 	uint64_t	mru_new;		/* allocated new slot */
 	uint64_t	mru_recycleold;		/* age > maxage */
 	uint64_t	mru_recyclefull;	/* full & age > minage */
+	uint64_t	mru_expired;		/* age > maxage, freed by timer */
 	uint64_t	mru_none;		/* couldn't allocate slot */
+	uint64_t	mru_sketched;		/* judged by the sketch alone */
 /* rate limiting */
 	float		rate_limit;   /* responses per second */
 	float		decay_time;   /* seconds, exponential decay time */
 	float		kod_limit ;   /* KoDs per second */
+	unsigned int	kod_max;      /* KoDs/s from the server, 0 for no cap */
+/* duplicate client requests */
+	l_fp		dup_window;   /* copies this soon are duplicates, 0 off */
+	bool		dup_drop;     /* drop them rather than answer */
+/* mode 6 query budget */
+	float		ctl_average;  /* cost units per second, 0 for none */
+	float		ctl_burst;    /* cost units a quiet source may spend */
+	float		ctl_slice;    /* ms of main loop a request may take */
 };
 extern struct monitor_data mon_data;
+extern bool	lean_memory;	/* "lean": allocate late and small */
 
 /* ntp_peer.c */
 extern struct peer *peer_list;		/* peer structures list */
 
+struct peer_hash {
+	struct peer **	bucket;
+	uint8_t		bits;		/* log2 of the bucket count */
+	uint32_t	count;		/* peers in the table */
+	uint64_t	resizes;	/* times grown or shrunk */
+};
+extern struct peer_hash peer_adr_hash;	/* by address */
+extern struct peer_hash peer_aid_hash;	/* by association ID */
+
 /*
  * Miscellaneous statistic counters which may be queried.
  */
@@ -446,11 +689,13 @@ extern struct restriction_data rstrct;
 #ifdef ENABLE_MSSNTP
 /* ntp_signd.c */
 extern void send_via_ntp_signd(struct recvbuf *, void *);
+extern void signd_timer(void);
+extern void signd_clearinterface(endpt *);
 
 struct mssntp_counters {
   uint64_t serves;		/* packets to send_via_ntp_signd */
   uint64_t serves_no;		/* can't contact samba */
-  uint64_t serves_err;		/* troubles talking to samba */
+  uint64_t serves_err;		/* troubles talking to samba, no reply */
   uint64_t serves_good;
   l_fp     serves_good_wall;
   l_fp     serves_good_slowest;
@@ -478,6 +723,96 @@ extern	char	statsdir[MAXFILENAME];
 extern	bool	stats_control;		/* write stats to fileset? */
 extern	double	wander_threshold;
 
+/*
+ * Latency histograms, in ns, kept since startup.  All but LAT_NTSKE
+ * are fed with proto_lock held; LAT_NTSKE is fed under the NTS-KE
+ * queue lock.
+ */
+#define LAT_XMIT	0	/* server reply, receive to send */
+#define LAT_RECEIVE	1	/* receive() */
+#define LAT_SELECT	2	/* clock_select(), not the update */
+#define LAT_CLOCK	3	/* local_clock() */
+#define LAT_NTSKE	4	/* nts_ke_request() */
+#define LAT_INPUT	5	/* receive stamp to the protocol machine */
+#define LAT_MAX		6
+extern	struct histogram latency[LAT_MAX];
+
+/*
+ * Where the main thread's time goes, from CLOCK_MONOTONIC, since
+ * startup.  One activity is current at a time and is charged until
+ * cpu_switch() picks another; calls from other threads are ignored.
+ */
+#define CPU_OTHER	0	/* none of the below */
+#define CPU_IDLE	1	/* waiting for input or the timer */
+#define CPU_RECEIVE	2	/* reading and answering packets */
+#define CPU_TRANSMIT	3	/* polling servers */
+#define CPU_TIMER	4	/* the rest of timer() */
+#define CPU_CONTROL	5	/* mode 6 requests */
+#define CPU_REFCLOCK	6	/* refclock reads, timers and polls */
+#define CPU_STATS	7	/* writing statistics files */
+#define CPU_MAX		8
+extern	l_fp	cpu_time[CPU_MAX];
+
+/* ntp_affinity.c */
+#define THREAD_MAIN	0	/* main loop and clock discipline */
+#define THREAD_WORKERS	1	/* server-mode responders */
+#define THREAD_NTSKE	2	/* NTS-KE server and client */
+#define THREAD_DNS	3	/* name lookups */
+#define THREAD_OTHER	4	/* statistics, file watch, metrics, keys */
+#define THREAD_CLASSES	5
+#define THREAD_CPUS	1024	/* CPUs and nodes a thread command can name */
+struct thread_conf {
+	bool		set;		/* named by a thread command */
+	bool		has_cpus;
+	uint64_t	cpus[THREAD_CPUS / 64];
+	int		node;		/* NUMA node, -1 for none */
+	int		priority;	/* SCHED_FIFO priority, 0 for none */
+	bool		has_nice;
+	int		nice;
+};
+extern	struct thread_conf thread_conf[THREAD_CLASSES];
+extern	void	thread_setup	(void);
+extern	void	thread_place	(int, int);
+extern	int	thread_cpu	(int, int);
+extern	void	thread_socket	(SOCKET, int);
+
+/* ntp_workers.c */
+#define	WORKERS_MAX	64	/* upper bound for the workers option */
+extern	int	server_workers;		/* responder threads, 0 = none */
+
+/* ntp_poller.c */
+#define	BUSY_POLL_MAX	1000	/* us, upper bound for busypoll */
+extern	int	busy_poll;		/* SO_BUSY_POLL us, 0 = no poller */
+
+/* ntp_uring.c */
+extern	bool	io_uring_input;		/* receive through an io_uring */
+
+/* ntp_bpf.c */
+extern	bool	bpf_filtering;		/* drop in a kernel socket filter */
+
+/* ntp_pkttrace.c */
+#define	PKTTRACE_DEFAULT 4096	/* packets traced unless configured */
+#define	PKTTRACE_LEAN	256	/* the default under "lean" */
+#define	PKTTRACE_MAX	(1024 * 1024)	/* upper bound for pkttrace */
+#define	PKTTRACE_RECV	1
+#define	PKTTRACE_XMIT	2
+struct pkttrace {
+	volatile uint64_t seq;	/* from 1, 0 while being written */
+	l_fp		stamp;	/* arrival, or see pkttrace_xmit() */
+	sockaddr_u	addr;	/* the other end */
+	uint16_t	length;	/* of the whole packet */
+	uint8_t		dir;	/* PKTTRACE_RECV or PKTTRACE_XMIT */
+	uint8_t		header[LEN_PKT_NOMAC];	/* as on the wire */
+};
+extern	unsigned int pkttrace_slots;	/* ring size, 0 = no trace */
+extern	void	pkttrace_init	(void);
+extern	void	pkttrace_recv	(const struct recvbuf *);
+extern	void	pkttrace_xmit	(const sockaddr_u *, const struct pkt *,
+				 size_t, l_fp);
+extern	uint64_t pkttrace_newest (void);
+extern	unsigned int pkttrace_size (void);
+extern	bool	pkttrace_get	(uint64_t, struct pkttrace *);
+
 /* ntpd.c */
 extern	int	waitsync_fd_to_close;	/* -w/--wait-sync */
 
@@ -486,20 +821,30 @@ extern	int	waitsync_fd_to_close;	/* -w/--wait-sync */
 /* refclock configuration table */
 extern struct refclock * const refclock_conf[];
 extern const uint8_t	num_refclock_conf;
+#ifdef REFCLOCK_MODULES
+extern	void	refclock_load	(uint8_t);
+#endif
 #endif
 
 /* nts_extens.c */
 bool extens_init(void);
 int extens_client_send(struct peer *peer, struct pkt *xpkt);
 bool extens_server_recv(struct ntspacket_t *ntspacket, uint8_t *pkt, int lng);
-int extens_server_send(struct ntspacket_t *ntspacket, struct pkt *xpkt);
+int extens_server_send(struct ntspacket_t *ntspacket, struct pkt *xpkt,
+	struct nts_seal *seal);
+void nts_seal_batch(uint8_t **pkts, struct nts_seal **seals, int n);
 bool extens_client_recv(struct peer *peer, uint8_t *pkt, int lng);
 
 /* nts.c */
-void nts_init(void);   /* Before sandbox() */
+void nts_init(bool);   /* Before sandbox(), true: client TLS later */
 void nts_init2(void);  /* After sandbox() */
 bool nts_probe(struct peer *peer);
-bool nts_check(struct peer *peer);
+bool nts_check(struct peer *peer, bool queued);
+void nts_check_done(void);
+bool nts_probe_pending(struct peer *peer);
+bool nts_client_restore(struct peer *peer);
+bool nts_write_client_cache(void);
+void nts_client_forget(struct peer *peer);
 void nts_timer(void);
 
 /* ntp_sandbox.c */
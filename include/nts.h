@@ -21,20 +21,29 @@
 #define NTS_KE_PORTA		"4460"
 
 #define NTS_KE_TIMEOUT		3
+#define NTS_KE_WORKERS		4	/* default KE worker threads */
+#define NTS_KE_LIMIT		60	/* default connections/minute/source */
+#define NTS_TICKET_LIFETIME	(24*60*60)	/* cookie key rotation period */
+#define NTS_CLIENT_CACHE_LIFETIME (24*60*60)	/* trust saved cookies this long */
 
 bool nts_server_init(void);
-bool nts_client_init(void);
+bool nts_client_init(bool);
 bool nts_cookie_init(void);
 bool nts_server_init2(void);    /* after sandbox */
+int nts_server_listeners(int *fds);
 bool nts_cookie_init2(void);
 
 void nts_cert_timer(void);
+void nts_rotate_ticket_keys(void);
 void nts_cookie_timer(void);
 
 bool nts_read_cookie_keys(void);
 void nts_make_cookie_key(void);
 bool nts_write_cookie_keys(void);
+bool nts_read_cookie_secret(void);
+void nts_cluster_cookie_keys(time_t now);
 
+int nts_cookie_length(int keylen);
 int nts_make_cookie(uint8_t *cookie,
   uint16_t aead,
   uint8_t *c2s, uint8_t *s2c, int keylen);
@@ -96,6 +105,7 @@ uint16_t next_bytes(BufCtl* buf, uint8_t *data, int length);
 #define NTS_MAX_KEYLEN		64	/* used in cookies */
 #define NTS_MAX_COOKIELEN	192	/* see nts_cookie.c */
 #define NTS_MAX_COOKIES		8	/* RFC 4.1.6 */
+#define NTS_CLIENT_COOKIES	16	/* most a client holds, see nts_extens.c */
 #define NTS_UID_LENGTH		32	/* RFC 5.3 */
 #define NTS_UID_MAX_LENGTH	64
 
@@ -131,7 +141,30 @@ struct ntsclient_t {
 	int readIdx, writeIdx;
 	int count;			/* -1 if not in NTS mode */
 	int cookielen;
-	uint8_t cookies[NTS_MAX_COOKIES][NTS_MAX_COOKIELEN];
+	uint8_t cookies[NTS_CLIENT_COOKIES][NTS_MAX_COOKIELEN];
+	int unanswered;			/* requests since the last good reply */
+	float lossrun;			/* recent longest run of lost replies */
+	/* TLS session from the last NTS-KE, for resumption */
+	struct ssl_session_st *session;
+};
+
+/* A server reply whose AEEF encryption has been put off until the
+ * reply is sent, so a batch of them can be done together, outside
+ * proto_lock when a responder thread sends them.  Offsets are from
+ * the start of the packet; the Additional Data is the first adlen
+ * bytes.  For AES-SIV-CMAC the SIV goes at cipher and the plaintext
+ * follows it; for AES-GCM-SIV the plaintext is at cipher and the tag
+ * follows it.
+ */
+struct nts_seal {
+	bool pending;
+	uint16_t aead;
+	int keylen;
+	uint8_t key[NTS_MAX_KEYLEN];
+	int adlen;
+	int nonce;
+	int cipher;
+	int plainlen;
 };
 
 /* Server-side state per packet */
@@ -159,6 +192,12 @@ struct ntsconfig_t {
 	const char *ca;		/* root cert dir/file */
 	const char *aead;	/* AEAD algorithms on wire */
 	bool tlscipherserverpreference;  /* OpenSSL 3.0 default is client */
+	int workers;		/* NTS-KE worker threads */
+	int backlog;		/* NTS-KE listen() backlog */
+	int kelimit;		/* NTS-KE connections/minute/source, 0 off */
+	bool tickets;		/* TLS session tickets/resumption */
+	const char *clientcache; /* file saving client cookies, NULL for none */
+	const char *cookiesecret; /* cluster secret for cookie keys, or NULL */
 };
 
 
@@ -236,8 +275,9 @@ enum aead_ciphers {
 
 	AEAD_CHACHA20_POLY1305 = 29,
 
-	AEAD_AES_128_GCM_SIV = 30,
+	AEAD_AES_128_GCM_SIV = 30,	/* RFC 8452, we use this too */
 	AEAD_AES_256_GCM_SIV = 31,
+#define AEAD_AES_128_GCM_SIV_KEYLEN 16
 
 	AEAD_AEGIS128L = 32,
 	AEAD_AEGIS256 = 33
@@ -277,11 +317,20 @@ struct ntske_counters {
   uint64_t serves_bad;
   l_fp     serves_bad_wall;
   l_fp     serves_bad_cpu;
+  uint64_t serves_limited;	/* dropped by kelimit before TLS */
   uint64_t probes_good;
   uint64_t probes_bad;
 };
+/* The packet path, the KE threads and the client all count, so the
+ * counters are bumped through the calling thread's shard, see
+ * ntp_shard.h.  nts_cnt and ntske_cnt hold the sums as of the last
+ * nts_fold_counters() and are only read.
+ */
 extern struct nts_counters nts_cnt, old_nts_cnt;
 extern struct ntske_counters ntske_cnt, old_ntske_cnt;
+extern struct nts_counters *nts_cnt_mine(void);
+extern struct ntske_counters *ntske_cnt_mine(void);
+extern void nts_fold_counters(void);
 
 
 #endif /* GUARD_NTS_H */
@@ -15,10 +15,21 @@
 #include <openssl/ssl.h>
 
 #include "nts.h"
+#include "ntp_net.h"
 
 
+/* a certificate chain and its key, read but not yet in use */
+struct nts_cert {
+	X509 *cert;
+	STACK_OF(X509) *chain;	/* the rest of the chain */
+	EVP_PKEY *key;
+};
+
 bool nts_load_certificate(SSL_CTX *ctx);
 void nts_reload_certificate(SSL_CTX *ctx);
+bool nts_read_certificate(struct nts_cert *nc);
+bool nts_use_certificate(SSL_CTX *ctx, struct nts_cert *nc);
+void nts_free_certificate(struct nts_cert *nc);
 bool nts_load_ciphers(SSL_CTX *ctx);
 bool nts_load_ecdhcurves(SSL_CTX *ctx);
 bool nts_set_cipher_order(SSL_CTX *ctx);
@@ -33,8 +44,28 @@ int nts_get_key_length(uint16_t aead);
 int nts_translate_version(const char *arg);
 uint16_t nts_string_to_aead(const char* text);
 
+bool nts_ke_rate_limited(const sockaddr_u *addr, struct timespec now);
+
 bool nts_make_keys(SSL *ssl, uint16_t aead,
   uint8_t *c2s, uint8_t *s2c, int keylen);
 
+/* AES-GCM-SIV, RFC 8452, in nts_gcm_siv.c
+ * Output is ciphertext then tag.  Keys are 16 or 32 bytes. */
+#define GCM_SIV_NONCE_LENGTH 12
+#define GCM_SIV_TAG_LENGTH 16
+typedef struct gcm_siv_ctx GCM_SIV_CTX;
+GCM_SIV_CTX *gcm_siv_new(void);
+void gcm_siv_free(GCM_SIV_CTX *ctx);
+bool gcm_siv_encrypt(GCM_SIV_CTX *ctx, uint8_t *out,
+  const uint8_t *key, size_t keylen, const uint8_t *nonce,
+  const uint8_t *plaintext, size_t plainlen,
+  const uint8_t *ad, size_t adlen);
+bool gcm_siv_decrypt(GCM_SIV_CTX *ctx, uint8_t *out,
+  const uint8_t *key, size_t keylen, const uint8_t *nonce,
+  const uint8_t *ciphertext, size_t cipherlen,
+  const uint8_t *ad, size_t adlen);
+void gcm_siv_polyval(uint8_t S[16], const uint8_t H[16],
+  const uint8_t *in, size_t blocks, bool generic);
+
 
 #endif /* GUARD_NTS2_H */
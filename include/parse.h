@@ -166,6 +166,7 @@ struct parse {			/* parse module local data */
 	int            parse_flags;	/* operation and current status flags */
 
 	int		 parse_ioflags;	   /* io handling flags (5-8 Bit control currently) */
+	unsigned char	 parse_chmask;	   /* character bits kept, from parse_ioflags */
 
 	/*
 	 * private data - fixed format only
@@ -180,6 +181,7 @@ struct parse {			/* parse module local data */
 	char          *parse_data;    /* data buffer */
 	unsigned short parse_dsize;	/* size of data buffer */
 	unsigned short parse_lformat;	/* last format used */
+	const struct clockformat *parse_fmt; /* clockformats[parse_lformat] */
 	unsigned long  parse_lstate;	/* last state code */
 	char          *parse_ldata;	/* last data buffer */
 	unsigned short parse_ldsize;	/* last data buffer length */
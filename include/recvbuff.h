@@ -11,8 +11,10 @@
  */
 #define RECV_INIT	10	/* 10 buffers initially */
 #define RECV_LOWAT	3	/* when we're down to three buffers get more */
-#define RECV_INC	5	/* get 5 more at a time */
-#define RECV_TOOMANY	40	/* this is way too many buffers */
+#define RECV_INC	16	/* get 16 more at a time */
+#define RECV_TOOMANY	128	/* this is way too many buffers: a full
+				 * recvmmsg() batch and then some */
+#define RECV_NTS_INC	8	/* NTS request state, 8 at a time */
 
 /*
  * Format of a recvbuf.  Back when ntpd did true asynchronous
@@ -33,23 +35,45 @@
 
 typedef struct recvbuf recvbuf_t;
 
+/* how ntp_monitor() wants a client request answered */
+#define XLEAVE_NONE	0	/* basic mode, nothing kept */
+#define XLEAVE_BASIC	1	/* basic mode, keep the reply's xmt */
+#define XLEAVE_REPLY	2	/* interleaved mode */
+#define XLEAVE_DUP	3	/* a copy of the last request, answer that */
+#define XLEAVE_DROP	4	/* a copy of the last request, drop it */
+
+/*
+ * Laid out by use.  Everything receive and the first look at a packet
+ * touch comes first, 64 bytes on LP64, one cache line when the buffer
+ * is line aligned.  What parse_packet() fills in comes next, then the
+ * wire bytes.  NTS state hangs off the side, for the requests that
+ * have it.
+ */
 struct recvbuf {
 	recvbuf_t *	link;		/* next in list */
-	sockaddr_u	recv_srcadr;	/* where packet came from */
-	struct netendpt *	dstadr;	/* address pkt arrived on */
-	SOCKET		fd;		/* fd on which it was received */
 	l_fp		recv_time;	/* time of arrival */
 	size_t		recv_length;	/* number of octets received */
-	uint8_t		recv_buffer[RX_BUFF_SIZE];
-	struct parsed_pkt pkt;  /* host-order copy of data from wire */
-	bool keyid_present;
-	keyid_t keyid;
-	int mac_len;
-	bool extens_present;
-	struct ntspacket_t ntspacket;
+	struct netendpt *	dstadr;	/* address pkt arrived on */
+	sockaddr_u	recv_srcadr;	/* where packet came from */
+	SOCKET		fd;		/* fd on which it was received */
+	/* end of the hot line */
+	bool		keyid_present;
+	bool		extens_present;
+	uint8_t		xleave;		/* XLEAVE_* above */
+	keyid_t		keyid;
+	int		mac_len;
+	struct ntspacket_t *ntspacket;	/* NTS requests only, see
+					 * get_recv_ntspacket() */
+	l_fp		xleave_tx;	/* last reply's transmit time, then
+					 * once built, this one's; for
+					 * XLEAVE_DUP, when the first copy
+					 * arrived */
 #ifdef REFCLOCK
 	struct peer *	recv_peer;
 #endif /* REFCLOCK */
+	struct parsed_pkt pkt;  /* host-order copy of data from wire */
+	/* last, so a fresh buffer need not clear it */
+	uint8_t		recv_buffer[RX_BUFF_SIZE];
 };
 
 extern	void	init_recvbuff(unsigned int); /* not really pure */
@@ -65,9 +89,18 @@ extern	void	freerecvbuf(struct recvbuf *);
  *  you put it back with freerecvbuf() or
  */
 
-/* signal safe - no malloc */
+/* Main thread only.  Grows the pool RECV_INC at a time, up to
+ * RECV_TOOMANY buffers; NULL past that.  Everything up to recv_buffer
+ * is zeroed.
+ */
 extern	struct recvbuf *get_free_recv_buffer(void);
 
+/* NTS state for a request, from a pool of its own so packets without
+ * NTS don't carry it.  Zeroed, attached to rb and returned with it by
+ * freerecvbuf().
+ */
+extern	struct ntspacket_t *get_recv_ntspacket(struct recvbuf *rb);
+
 
 /* number of recvbufs on freelist */
 extern unsigned long free_recvbuffs(void);    /* not really pure */
@@ -7,6 +7,9 @@ struct refclock_ppsctl {
 	pps_params_t pps_params;
 	struct timespec ts;
 	unsigned long sequence;
+	int	samples;	/* taken by the last refclock_catcher() */
+	unsigned long missed;	/* edges the capture thread never saw */
+	unsigned long dropped;	/* edges lost to a full capture queue */
 };
 
 typedef enum {
@@ -19,3 +22,4 @@ typedef enum {
 extern	bool	refclock_ppsapi(int, struct refclock_ppsctl *);
 extern	bool	refclock_params(int, struct refclock_ppsctl *);
 extern pps_status refclock_catcher(struct peer *, struct refclock_ppsctl *, int);
+extern	void	refclock_ppsthread_stop(struct refclockproc *);
@@ -0,0 +1,45 @@
+/*
+ * tsip_frame.h - Trimble TSIP DLE/ETX framing, shared by the Trimble
+ * refclock and the TSIP format of the generic one
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#ifndef GUARD_TSIP_FRAME_H
+#define GUARD_TSIP_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TSIP_DLE	0x10
+#define TSIP_ETX	0x03
+
+/* framer states */
+#define TSIP_IDLE	0	/* hunting for a DLE */
+#define TSIP_ID		1	/* DLE seen, the packet ID is next */
+#define TSIP_DATA	2	/* in the packet body */
+#define TSIP_STUFF	3	/* DLE seen in the body */
+#define TSIP_MARK	4	/* 0xff seen in the body, parity marking on */
+
+/* what tsip_frame() stopped for */
+#define TSIP_MORE	0	/* used up the input, no packet yet */
+#define TSIP_PACKET	1	/* buf holds ID and data, len long */
+#define TSIP_PARITY	2	/* the port marked a parity error */
+#define TSIP_OVERSIZE	3	/* packet too long for buf, dropped */
+
+struct tsip_framer {
+	uint8_t *	buf;	/* packet ID, then the unstuffed data */
+	size_t		size;	/* room in buf */
+	size_t		len;	/* bytes in buf so far */
+	uint8_t		state;	/* TSIP_IDLE etc. */
+	bool		parmrk;	/* 0xff 0xff is data, 0xff x an error */
+	unsigned int	starts;	/* packets begun, bumped at each ID */
+};
+
+extern void	tsip_framer_init(struct tsip_framer *, uint8_t *buf,
+				 size_t size, bool parmrk);
+extern size_t	tsip_frame(struct tsip_framer *, const uint8_t *in,
+			   size_t n, int *event);
+
+#endif /* GUARD_TSIP_FRAME_H */
@@ -49,6 +49,24 @@ int AES_SIV_Decrypt(AES_SIV_CTX *ctx, unsigned char *out, size_t *out_len,
                     unsigned char const *ciphertext, size_t ciphertext_len,
                     unsigned char const *ad, size_t ad_len);
 
+/* One message for AES_SIV_Encrypt_batch(); the fields are the
+ * arguments of AES_SIV_Encrypt(), and ok receives its result. */
+typedef struct AES_SIV_Job_st {
+        unsigned char *out;
+        size_t out_len;
+        unsigned char const *key;
+        size_t key_len;
+        unsigned char const *nonce;
+        size_t nonce_len;
+        unsigned char const *plaintext;
+        size_t plaintext_len;
+        unsigned char const *ad;
+        size_t ad_len;
+        int ok;
+} AES_SIV_Job;
+
+size_t AES_SIV_Encrypt_batch(AES_SIV_CTX *ctx, AES_SIV_Job *jobs, size_t n);
+
 
 #ifdef __cplusplus
 }
@@ -443,6 +443,60 @@ static void test_highlevel_with_nonce(void) {
         AES_SIV_CTX_free(ctx);
 }
 
+static void test_batch(void) {
+        static const unsigned char key[3][32] = {
+                { 0x01 }, { 0x02 }, { 0x03 }
+        };
+        static const unsigned char nonce[16] = { 0x09 };
+        static const unsigned char ad[3][20] = {
+                { 0x10 }, { 0x20 }, { 0x30 }
+        };
+        static const unsigned char plaintext[3][40] = {
+                { 0x11 }, { 0x22 }, { 0x33 }
+        };
+        unsigned char batch_out[3][64];
+        unsigned char single_out[64];
+        size_t single_len;
+        AES_SIV_Job jobs[3];
+        AES_SIV_CTX *ctx;
+        size_t i;
+        int ret;
+
+        printf("Test batch interface:\n");
+        ctx = AES_SIV_CTX_new();
+        assert(ctx != NULL);
+
+        for (i = 0; i < 3; i++) {
+                jobs[i].out = batch_out[i];
+                jobs[i].out_len = sizeof batch_out[i];
+                jobs[i].key = key[i];
+                jobs[i].key_len = sizeof key[i];
+                jobs[i].nonce = nonce;
+                jobs[i].nonce_len = sizeof nonce;
+                jobs[i].plaintext = plaintext[i];
+                jobs[i].plaintext_len = sizeof plaintext[i];
+                jobs[i].ad = ad[i];
+                jobs[i].ad_len = sizeof ad[i];
+        }
+        /* a job that doesn't fit fails alone */
+        jobs[1].out_len = 16;
+        assert(AES_SIV_Encrypt_batch(ctx, jobs, 3) == 2);
+        assert(jobs[0].ok && !jobs[1].ok && jobs[2].ok);
+
+        for (i = 0; i < 3; i += 2) {
+                single_len = sizeof single_out;
+                ret = AES_SIV_Encrypt(ctx, single_out, &single_len,
+                                      key[i], sizeof key[i],
+                                      nonce, sizeof nonce,
+                                      plaintext[i], sizeof plaintext[i],
+                                      ad[i], sizeof ad[i]);
+                assert(ret == 1);
+                assert(jobs[i].out_len == single_len);
+                assert(!memcmp(batch_out[i], single_out, single_len));
+        }
+        AES_SIV_CTX_free(ctx);
+}
+
 static void test_copy(void) {
         const unsigned char key[] = {
                 0xff, 0xfe, 0xfd, 0xfc, 0xfb, 0xfa, 0xf9, 0xf8,
@@ -580,6 +634,7 @@ int main(void) {
         test_512bit();
         test_highlevel_with_nonce();
         test_copy();
+        test_batch();
         test_bad_key();
         test_decrypt_failure();
         return 0;
@@ -149,6 +149,7 @@ assertion_failed(
         /* Is recursion an issue? */
 
 	termlogit = true; /* insist log to terminal */
+	msyslog_sync();	/* the logger may never get to it */
 
 	msyslog(LOG_ERR, "ERR: %s:%d: %s(%s) failed",
 		file, line, assertion_typetotext(type), cond);
@@ -40,6 +40,7 @@ static void	alloc_auth_info(auth_info **, keyid_t,	AUTH_Type,
 				    const char *,
 				    unsigned short, unsigned short, uint8_t *);
 static void	free_auth_info(auth_info *, auth_info **);
+static void	auth_index_build(void);
 #ifdef DEBUG
 static void	free_auth_mem(void);
 #endif
@@ -51,9 +52,43 @@ static auth_info key_listhead;		/* list of all in-use keys */
  */
 #define KEYHASH(keyid)	((keyid) & authhashmask)
 #define INIT_AUTHHASHSIZE 64
-static unsigned short authhashbuckets = INIT_AUTHHASHSIZE;
-static unsigned short authhashmask = INIT_AUTHHASHSIZE - 1;
+#define MAX_AUTHHASHBITS 20
+static unsigned int authhashbuckets = INIT_AUTHHASHSIZE;
+static unsigned int authhashmask = INIT_AUTHHASHSIZE - 1;
 static auth_info **key_hash;
+static size_t	key_hash_alloc;		/* bytes in key_hash */
+
+/*
+ * The lookup index.  authlookup() is on the packet path and the hash
+ * chains above get long with many keys, so it uses a bucketized
+ * cuckoo table instead: every key with a secret sits in one of the
+ * two buckets its keyid hashes to, and a bucket is one cache line.
+ * Lookups touch at most two lines however many keys there are.
+ *
+ * The chains remain the master copy.  A new key goes straight into
+ * a current index; anything that drops a key, or an insert that
+ * doesn't fit, marks the index stale and the next lookup rebuilds
+ * it.  authreadkeys() rebuilds up front so packets don't pay for it.
+ */
+#define INDEX_WAYS	4	/* slots per bucket */
+#define INDEX_KICKS	500	/* evictions before giving up on a build */
+#define INDEX_LINE	64	/* cache line size */
+
+typedef struct key_bucket key_bucket;
+struct key_bucket {
+	keyid_t		keyid[INDEX_WAYS];
+	auth_info *	auth[INDEX_WAYS];	/* NULL => empty slot */
+};
+
+static key_bucket *key_index;		/* INDEX_LINE aligned */
+static void *	key_index_mem;		/* what to free() */
+static size_t	key_index_alloc;	/* bytes in key_index_mem */
+static uint32_t	key_index_mask;		/* buckets - 1 */
+static uint64_t	key_index_seed;
+static bool	key_index_valid;
+
+static bool	key_index_insert(auth_info *);
+static void	key_index_add(auth_info *);
 
 unsigned int authnumkeys;	/* number of active keys */
 unsigned int authnumfreekeys;	/* number of free keys */
@@ -101,7 +136,8 @@ auth_init(void)
 	 */
 	newalloc = authhashbuckets * sizeof(key_hash[0]);
 
-	key_hash = erealloc(key_hash, newalloc);
+	key_hash = erealloc_tag(MEM_KEYS, key_hash, newalloc, key_hash_alloc);
+	key_hash_alloc = newalloc;
 	memset(key_hash, '\0', newalloc);
 
 	INIT_DLIST(key_listhead, llink);
@@ -149,8 +185,14 @@ free_auth_mem(void)
 	while (NULL != (sk = HEAD_DLIST(key_listhead, llink))) {
 		free_auth_info(sk, &key_hash[KEYHASH(sk->keyid)]);
 	}
-	free(key_hash);
+	free_tag(MEM_KEYS, key_hash, key_hash_alloc);
 	key_hash = NULL;
+	key_hash_alloc = 0;
+	free_tag(MEM_KEYS, key_index_mem, key_index_alloc);
+	key_index_mem = NULL;
+	key_index_alloc = 0;
+	key_index = NULL;
+	key_index_valid = false;
 	for (alloc = auth_allocs; NULL != alloc; alloc = next_alloc) {
 		next_alloc = alloc->link;
 		free(alloc->mem);
@@ -182,7 +224,8 @@ auth_moremem(
 	i = (keycount > 0)
 		? keycount
 		: MEMINC;
-	auth = emalloc_zero((unsigned int)i * sizeof(*auth) + MOREMEM_EXTRA_ALLOC);
+	auth = emalloc_zero_tag(MEM_KEYS, (unsigned int)i * sizeof(*auth)
+				+ MOREMEM_EXTRA_ALLOC);
 #ifdef DEBUG
 	base = auth;
 #endif
@@ -231,28 +274,30 @@ auth_log2(double x)
  * auth_resize_hashtable
  *
  * Size hash table to average 4 or fewer entries per bucket initially,
- * within the bounds of at least 4 and no more than 15 bits for the hash
- * table index.  Populate the hash table.
+ * within the bounds of at least 4 and no more than MAX_AUTHHASHBITS
+ * bits for the hash table index.  Populate the hash table.
+ * Also called when the keys outgrow it.
  */
 static void
 auth_resize_hashtable(void)
 {
 	unsigned int	totalkeys;
 	unsigned short	hashbits;
-	unsigned short	hash;
+	unsigned int	hash;
 	size_t		newalloc;
 	auth_info *	auth;
 
 	totalkeys = authnumkeys + (unsigned int)authnumfreekeys;
 	hashbits = auth_log2(totalkeys / 4.0) + 1;
 	hashbits = max(4, hashbits);
-	hashbits = min(15, hashbits);
+	hashbits = min(MAX_AUTHHASHBITS, hashbits);
 
-	authhashbuckets = 1 << hashbits;
+	authhashbuckets = 1U << hashbits;
 	authhashmask = authhashbuckets - 1;
 	newalloc = authhashbuckets * sizeof(key_hash[0]);
 
-	key_hash = erealloc(key_hash, newalloc);
+	key_hash = erealloc_tag(MEM_KEYS, key_hash, newalloc, key_hash_alloc);
+	key_hash_alloc = newalloc;
 	memset(key_hash, '\0', newalloc);
 
 	ITER_DLIST_BEGIN(key_listhead, auth, llink, auth_info)
@@ -305,27 +350,19 @@ alloc_auth_info(
 	switch (type) {
 	  case AUTH_NONE:
 		auth->digest = NULL;
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
+		auth->md_ctx = NULL;
 		auth->mac_ctx = NULL;
-#else
-		auth->cipher = NULL;
-#endif
 		break;
 	  case AUTH_DIGEST:
 		auth->digest = EVP_get_digestbyname(name);
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
+		auth->md_ctx = Setup_MD_CTX(auth->digest, auth->key,
+					    auth->key_size);
 		auth->mac_ctx = NULL;
-#else
-		auth->cipher = NULL;
-#endif
 		break;
 	  case AUTH_CMAC:
 		auth->digest = NULL;
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
+		auth->md_ctx = NULL;
 		auth->mac_ctx = Setup_MAC_CTX(name, auth->key, auth->key_size);
-#else
-		auth->cipher = EVP_get_cipherbyname(name);
-#endif
 		break;
 	  default:
 		msyslog(LOG_ERR, "BUG: alloc_auth_info: bogus type %u", type);
@@ -335,6 +372,12 @@ alloc_auth_info(
 	LINK_TAIL_DLIST(key_listhead, auth, llink);
 	authnumfreekeys--;
 	authnumkeys++;
+	if (AUTH_NONE != type)
+		key_index_add(auth);
+	/* keep the chains short while a big keys file is read */
+	if (authnumkeys > 4 * authhashbuckets
+	    && authhashbuckets < (1U << MAX_AUTHHASHBITS))
+		auth_resize_hashtable();
 }
 
 
@@ -351,12 +394,11 @@ free_auth_info(
 
 	if (NULL != auth->key) {
 		memset(auth->key, '\0', auth->key_size);
-		free(auth->key);
+		free_tag(MEM_KEYS, auth->key, auth->key_size);
                 auth->key = NULL;
 	}
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
-	EVP_MAC_CTX_free(auth->mac_ctx);
-#endif
+	Free_MAC_CTX(auth);
+	key_index_valid = false;
 	UNLINK_SLIST(unlinked, *bucket, auth, hlink, auth_info);
 	//ENSURE(sk == unlinked);
 	UNLINK_DLIST(auth, llink);
@@ -413,6 +455,161 @@ authtrust(
 	alloc_auth_info(bucket, id, AUTH_NONE, 0, KEY_TRUSTED, 0, NULL);
 }
 
+/*
+ * key_index_hash - both bucket numbers for a keyid, one per half
+ */
+static inline uint64_t
+key_index_hash(
+	keyid_t	keyid
+	)
+{
+	/* splitmix64 finalizer */
+	uint64_t h = (uint64_t)keyid + key_index_seed;
+
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+
+static inline auth_info *
+key_index_find(
+	keyid_t	keyid
+	)
+{
+	uint64_t	h;
+	key_bucket *	b;
+
+	if (NULL == key_index)
+		return NULL;
+	h = key_index_hash(keyid);
+	b = &key_index[(uint32_t)h & key_index_mask];
+	for (int i = 0; i < INDEX_WAYS; i++)
+		if (keyid == b->keyid[i] && NULL != b->auth[i])
+			return b->auth[i];
+	b = &key_index[(uint32_t)(h >> 32) & key_index_mask];
+	for (int i = 0; i < INDEX_WAYS; i++)
+		if (keyid == b->keyid[i] && NULL != b->auth[i])
+			return b->auth[i];
+	return NULL;
+}
+
+
+/*
+ * key_index_insert - place a key, evicting others to their other
+ * bucket as needed.  Returns false if the table is too crowded.
+ */
+static bool
+key_index_insert(
+	auth_info *	auth
+	)
+{
+	keyid_t		keyid = auth->keyid;
+	uint64_t	h;
+	uint32_t	b1, b2, bn;
+	int		slot;
+	auth_info *	victim;
+
+	for (int kick = 0; kick < INDEX_KICKS; kick++) {
+		h = key_index_hash(keyid);
+		b1 = (uint32_t)h & key_index_mask;
+		b2 = (uint32_t)(h >> 32) & key_index_mask;
+		for (int i = 0; i < INDEX_WAYS; i++)
+			if (NULL == key_index[b1].auth[i]) {
+				key_index[b1].keyid[i] = keyid;
+				key_index[b1].auth[i] = auth;
+				return true;
+			}
+		for (int i = 0; i < INDEX_WAYS; i++)
+			if (NULL == key_index[b2].auth[i]) {
+				key_index[b2].keyid[i] = keyid;
+				key_index[b2].auth[i] = auth;
+				return true;
+			}
+		/* both full: take a slot, rehome its owner */
+		bn = ((h >> 63) ^ (uint64_t)kick) & 1 ? b2 : b1;
+		slot = (int)(((h >> 48) + (uint64_t)kick) % INDEX_WAYS);
+		victim = key_index[bn].auth[slot];
+		key_index[bn].keyid[slot] = keyid;
+		key_index[bn].auth[slot] = auth;
+		auth = victim;
+		keyid = victim->keyid;
+	}
+	return false;
+}
+
+
+/*
+ * key_index_add - put a new key in the index, if the index is current
+ */
+static void
+key_index_add(
+	auth_info *	auth
+	)
+{
+	if (key_index_valid && !key_index_insert(auth))
+		key_index_valid = false;
+}
+
+
+/*
+ * auth_index_build - rebuild the lookup index from the key list
+ */
+static void
+auth_index_build(void)
+{
+	auth_info *	auth;
+	unsigned int	nkeys = 0;
+	uint32_t	nbuckets = 1;
+	size_t		size;
+	bool		ok;
+
+	ITER_DLIST_BEGIN(key_listhead, auth, llink, auth_info)
+		if (AUTH_NONE != auth->type)
+			nkeys++;
+	ITER_DLIST_END()
+
+	/* aim for buckets at most 3/4 full */
+	while (nbuckets * INDEX_WAYS * 3 < nkeys * 4)
+		nbuckets <<= 1;
+
+	for (;;) {
+		size = nbuckets * sizeof(key_bucket);
+		free_tag(MEM_KEYS, key_index_mem, key_index_alloc);
+		key_index_alloc = size + INDEX_LINE - 1;
+		key_index_mem = emalloc_zero_tag(MEM_KEYS, key_index_alloc);
+		key_index = (key_bucket *)(((uintptr_t)key_index_mem
+			+ INDEX_LINE - 1) & ~(uintptr_t)(INDEX_LINE - 1));
+		key_index_mask = nbuckets - 1;
+		key_index_seed += 0x9e3779b97f4a7c15ULL;
+
+		ok = true;
+		ITER_DLIST_BEGIN(key_listhead, auth, llink, auth_info)
+			if (AUTH_NONE != auth->type && !key_index_insert(auth)) {
+				ok = false;
+				break;
+			}
+		ITER_DLIST_END()
+		if (ok)
+			break;
+		/* The evicted key is lost, so start over, bigger */
+		nbuckets <<= 1;
+	}
+	key_index_valid = true;
+}
+
+
+/*
+ * auth_index - build the lookup index now rather than on first use
+ */
+void
+auth_index(void)
+{
+	if (!key_index_valid)
+		auth_index_build();
+}
+
+
 /*
  * authlookup - find key, check trust
  */
@@ -423,14 +620,17 @@ authlookup(
         )
 {
         auth_info *     auth;
-        auth_info **    bucket;
 
 	authkeylookups++;
-        bucket = &key_hash[KEYHASH(keyno)];
-        for (auth = *bucket; NULL != auth; auth = auth->hlink) {
-                if (keyno == auth->keyid)
-                        break;
-        }
+	if (!key_index_valid)
+		auth_index_build();
+	auth = key_index_find(keyno);
+	if (NULL == auth && authkeydb_load(keyno)) {
+		/* first use of a key from a compiled keys file */
+		if (!key_index_valid)
+			auth_index_build();
+		auth = key_index_find(keyno);
+	}
         if (NULL == auth ||
 	   (AUTH_NONE == auth->type) ||
 	   (needtrust && !(KEY_TRUSTED & auth->flags))) {
@@ -467,45 +667,39 @@ auth_setkey(
 	bucket = &key_hash[KEYHASH(keyno)];
 	for (auth_info * auth = *bucket; NULL != auth; auth = auth->hlink) {
 		if (keyno == auth->keyid) {
+			if (AUTH_NONE == type && AUTH_NONE != auth->type)
+				key_index_valid = false;
+			else if (AUTH_NONE != type && AUTH_NONE == auth->type)
+				key_index_add(auth);
 			auth->type = type;
+			/* the contexts are keyed from the new key */
+			if (NULL != auth->key) {
+				memset(auth->key, '\0', auth->key_size);
+                        	free_tag(MEM_KEYS, auth->key,
+					 auth->key_size);
+			}
+			auth->key_size = (unsigned short)key_size;
+                        auth->key = emalloc_tag(MEM_KEYS, key_size);
+			memcpy(auth->key, key, key_size);
+			Free_MAC_CTX(auth);
 			switch (type) {
 			  case AUTH_NONE:
 				auth->digest = NULL;
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
-				auth->mac_ctx = NULL;
-#else
-				auth->cipher = NULL;
-#endif
 				break;
 			  case AUTH_DIGEST:
 				auth->digest = EVP_get_digestbyname(name);
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
-				auth->mac_ctx = NULL;
-#else
-				auth->cipher = NULL;
-#endif
+				auth->md_ctx = Setup_MD_CTX(auth->digest,
+					auth->key, auth->key_size);
 				break;
 			  case AUTH_CMAC:
 				auth->digest = NULL;
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
-				EVP_MAC_CTX_free(auth->mac_ctx);
 				auth->mac_ctx = Setup_MAC_CTX(name, \
 					auth->key, auth->key_size);
-#else
-				auth->cipher = EVP_get_cipherbyname(name);
-#endif
 				break;
 			  default:
 				msyslog(LOG_ERR, "BUG: auth_setkey: bogus type %u", type);
 				exit(1);
 			}
-			if (NULL != auth->key) {
-				memset(auth->key, '\0', auth->key_size);
-                        	free(auth->key);
-			}
-			auth->key_size = (unsigned short)key_size;
-                        auth->key = emalloc(key_size);
-			memcpy(auth->key, key, key_size);
 			return;
 		}
 	}
@@ -513,7 +707,7 @@ auth_setkey(
 	/*
 	 * Need to allocate new structure.  Do it.
 	 */
-	newkey = emalloc(key_size);
+	newkey = emalloc_tag(MEM_KEYS, key_size);
 	memcpy(newkey, key, key_size);
 	alloc_auth_info(bucket, keyno, type, name, 0,
 		    (unsigned short)key_size, newkey);
@@ -546,17 +740,15 @@ auth_delkeys(void)
 		if (KEY_TRUSTED & auth->flags) {
 			if (NULL != auth->key) {
 				memset(auth->key, '\0', auth->key_size);
-				free(auth->key);
+				free_tag(MEM_KEYS, auth->key,
+					 auth->key_size);
 				auth->key = NULL;
 			}
 			auth->key_size = 0;
 			auth->type = AUTH_NONE;
 			auth->digest = NULL;
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
-			auth->mac_ctx = NULL;
-#else
-			auth->cipher = NULL;
-#endif
+			Free_MAC_CTX(auth);
+			key_index_valid = false;
 		} else {
 			free_auth_info(auth, &key_hash[KEYHASH(auth->keyid)]);
 		}
@@ -564,6 +756,39 @@ auth_delkeys(void)
 }
 
 
+/*
+ * auth_delkey - drop one key, as auth_delkeys() does for all of them
+ */
+void
+auth_delkey(
+	keyid_t	keyno
+	)
+{
+	auth_info **	bucket = &key_hash[KEYHASH(keyno)];
+	auth_info *	auth;
+
+	for (auth = *bucket; NULL != auth; auth = auth->hlink)
+		if (keyno == auth->keyid)
+			break;
+	if (NULL == auth)
+		return;
+	if (KEY_TRUSTED & auth->flags) {
+		if (NULL != auth->key) {
+			memset(auth->key, '\0', auth->key_size);
+			free_tag(MEM_KEYS, auth->key, auth->key_size);
+			auth->key = NULL;
+		}
+		auth->key_size = 0;
+		auth->type = AUTH_NONE;
+		auth->digest = NULL;
+		Free_MAC_CTX(auth);
+		key_index_valid = false;
+	} else {
+		free_auth_info(auth, bucket);
+	}
+}
+
+
 /*
  * authencrypt - generate message authenticator
  * fills in keyid in packet
@@ -665,5 +890,61 @@ EVP_MAC_CTX* Setup_MAC_CTX(const char *name, uint8_t *key, int keylen) {
 	}
 	return ctx;
 }
+#else
+/* Returns NULL, and cmac_encrypt/cmac_decrypt fail, if the key size is wrong */
+CMAC_CTX* Setup_MAC_CTX(const char *name, uint8_t *key, int keylen) {
+	const EVP_CIPHER *cipher = EVP_get_cipherbyname(name);
+	CMAC_CTX *ctx = CMAC_CTX_new();
+
+	if (NULL == ctx) {
+		msyslog(LOG_ERR, "Setup_MAC_CTX: CMAC_CTX_new failed");
+		exit(1);
+	}
+	if (NULL == cipher ||
+	    !CMAC_Init(ctx, key, (size_t)keylen, cipher, NULL)) {
+		msyslog(LOG_ERR, "Setup_MAC_CTX: CMAC_Init failed: %s, %d",
+			name, keylen);
+		CMAC_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
 #endif
 
+/*
+ * Setup_MD_CTX - the digest state after hashing the key.  The MAC is
+ * the digest of key and packet, so each packet starts from a copy of
+ * this and hashes only itself.
+ */
+EVP_MD_CTX* Setup_MD_CTX(const EVP_MD *digest, const uint8_t *key,
+			 int keylen) {
+	EVP_MD_CTX *ctx;
+
+	if (NULL == digest)
+		return NULL;
+	ctx = EVP_MD_CTX_new();
+	if (NULL == ctx) {
+		msyslog(LOG_ERR, "Setup_MD_CTX: EVP_MD_CTX_new failed");
+		exit(1);
+	}
+	if (!EVP_DigestInit_ex(ctx, digest, NULL) ||
+	    !EVP_DigestUpdate(ctx, key, (size_t)keylen)) {
+		msyslog(LOG_ERR, "Setup_MD_CTX: digest init failed: %s",
+			EVP_MD_name(digest));
+		EVP_MD_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void Free_MAC_CTX(auth_info *auth) {
+#if OPENSSL_VERSION_NUMBER > 0x20000000L
+	EVP_MAC_CTX_free(auth->mac_ctx);
+#else
+	CMAC_CTX_free(auth->mac_ctx);
+#endif
+	auth->mac_ctx = NULL;
+	EVP_MD_CTX_free(auth->md_ctx);
+	auth->md_ctx = NULL;
+}
+
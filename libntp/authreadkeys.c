@@ -12,6 +12,10 @@
 #include "config.h"
 #include <stdio.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "ntp.h"
 #include "ntp_syslog.h"
@@ -288,10 +292,295 @@ check_key_length(
 
 
 /*
- * authreadkeys - (re)read keys from a file.
+ * A keys file as parsed, sorted by key number.  Parsing touches no
+ * shared state, so it can run in a helper thread; applying it is
+ * done by the main thread and only touches keys that changed.
+ */
+#define KF_MAXNAMES	32	/* distinct key types in one file */
+#define KF_MAXKEY	32	/* Bug 2537 */
+
+typedef struct keyfile_entry keyfile_entry;
+struct keyfile_entry {
+	keyid_t		keyno;
+	unsigned int	line;		/* later lines win */
+	AUTH_Type	type;
+	uint8_t		name;		/* index into names[] */
+	uint8_t		len;
+	uint8_t		key[KF_MAXKEY];
+};
+
+typedef struct keydb keydb;
+
+struct auth_keyfile {
+	char *		names[KF_MAXNAMES];
+	int		nnames;
+	keyfile_entry *	keys;
+	size_t		nkeys;
+	size_t		kalloc;
+	keydb *		db;		/* compiled file, keys unused */
+};
+
+/* The keys file as last applied, to diff reloads against */
+static auth_keyfile *current_keys;
+
+
+/*
+ * Compiled keys files, written by ntpkeydb(8).  Instead of being
+ * parsed, the file is mapped and used in place: a key is only
+ * checked and loaded into the keys table the first time authlookup()
+ * asks for it, so opening a full file costs no more than an empty
+ * one.  Key numbers stop at NTP_MAXKEY, which makes a direct-mapped
+ * slot table small enough to just keep in the file.
+ *
+ * All integers are big-endian.
+ *   header   "NTPKEYDB", version, nnames, nkeys	(uint32 each)
+ *   names    nnames * KDB_NAMELEN, NUL padded type names
+ *   slots    (NTP_MAXKEY + 1) uint32, record number + 1, 0 = no key
+ *   records  nkeys * { uint8 name, uint8 len, key[KF_MAXKEY] }
+ */
+#define KDB_MAGIC	"NTPKEYDB"
+#define KDB_MAGICLEN	8
+#define KDB_VERSION	1
+#define KDB_HEADER	(KDB_MAGICLEN + 3 * 4)
+#define KDB_NAMELEN	32
+#define KDB_MAXNAMES	255
+#define KDB_SLOTS	((size_t)NTP_MAXKEY + 1)
+#define KDB_RECLEN	(2 + KF_MAXKEY)
+
+struct keydb {
+	void *		map;
+	size_t		size;
+	uint32_t	nnames;
+	uint32_t	nkeys;
+	const uint8_t *	slots;
+	const uint8_t *	records;
+	AUTH_Type	types[KDB_MAXNAMES];
+	char *		names[KDB_MAXNAMES];	/* NULL => unusable */
+};
+
+/* The compiled keys file in use, if any */
+static keydb *active_db;
+
+static uint32_t
+kdb_get32(
+	const uint8_t *	p
+	)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	    | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void
+keydb_close(
+	keydb *	db
+	)
+{
+	if (NULL == db)
+		return;
+	for (uint32_t i = 0; i < db->nnames; i++)
+		free(db->names[i]);
+	munmap(db->map, db->size);
+	free(db);
+}
+
+/*
+ * keydb_resolve - turn a key type from the file into a name OpenSSL
+ * knows, the way authparsekeys() does for each line
+ */
+static char *
+keydb_resolve(
+	const char *	token,
+	AUTH_Type *	type
+	)
+{
+	char	upcased[KDB_NAMELEN];
+	char	namebuf[NAMEBUFSIZE];
+	char *	name;
+
+	strlcpy(upcased, token, sizeof(upcased));
+	for (char *pch = upcased; '\0' != *pch; pch++)
+		*pch = (char)toupper((unsigned char)*pch);
+	name = try_cmac(upcased, namebuf);
+	if (NULL != name) {
+		*type = AUTH_CMAC;
+		return estrdup(name);
+	}
+	name = try_digest(upcased, namebuf);
+	if (NULL != name) {
+		*type = AUTH_DIGEST;
+		return estrdup(name);
+	}
+	return NULL;
+}
+
+/*
+ * keydb_open - map and check a compiled keys file.
+ * Safe to call from any thread.  Returns NULL if it is no good.
+ */
+static keydb *
+keydb_open(
+	const char *	file
+	)
+{
+	struct stat	sb;
+	keydb *		db;
+	const uint8_t *	base;
+	const uint8_t *	np;
+	void *		map;
+	size_t		want;
+	uint32_t	nnames, nkeys;
+	int		fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		msyslog(LOG_ERR, "AUTH: authreadkeys: file %s: %s",
+			file, strerror(errno));
+		return NULL;
+	}
+	if (0 != fstat(fd, &sb) || (size_t)sb.st_size < KDB_HEADER) {
+		msyslog(LOG_ERR, "AUTH: authreadkeys: %s: truncated", file);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) {
+		msyslog(LOG_ERR, "AUTH: authreadkeys: can't map %s: %s",
+			file, strerror(errno));
+		return NULL;
+	}
+	base = map;
+	nnames = kdb_get32(base + KDB_MAGICLEN + 4);
+	nkeys = kdb_get32(base + KDB_MAGICLEN + 8);
+	want = KDB_HEADER + (size_t)nnames * KDB_NAMELEN
+	    + KDB_SLOTS * 4 + (size_t)nkeys * KDB_RECLEN;
+	if (KDB_VERSION != kdb_get32(base + KDB_MAGICLEN)
+	    || KDB_MAXNAMES < nnames || NTP_MAXKEY < nkeys
+	    || (size_t)sb.st_size != want) {
+		msyslog(LOG_ERR, "AUTH: authreadkeys: %s: bad compiled keys file",
+			file);
+		munmap(map, (size_t)sb.st_size);
+		return NULL;
+	}
+
+	db = emalloc_zero(sizeof(*db));
+	db->map = map;
+	db->size = (size_t)sb.st_size;
+	db->nnames = nnames;
+	db->nkeys = nkeys;
+	np = base + KDB_HEADER;
+	db->slots = np + (size_t)nnames * KDB_NAMELEN;
+	db->records = db->slots + KDB_SLOTS * 4;
+	for (uint32_t i = 0; i < nnames; i++, np += KDB_NAMELEN) {
+		if (NULL == memchr(np, '\0', KDB_NAMELEN)) {
+			msyslog(LOG_ERR, "AUTH: authreadkeys: %s: bad key type",
+				file);
+			continue;
+		}
+		db->names[i] = keydb_resolve((const char *)np, &db->types[i]);
+		if (NULL == db->names[i])
+			msyslog(LOG_ERR,
+				"AUTH: authreadkeys: %s: unknown auth type %s",
+				file, (const char *)np);
+	}
+	return db;
+}
+
+/*
+ * authkeydb_load - load one key from the compiled keys file, if it
+ * has it.  Called by authlookup() for keys it doesn't know.
  */
 bool
-authreadkeys(
+authkeydb_load(
+	keyid_t	keyno
+	)
+{
+	keydb *		db = active_db;
+	const uint8_t *	rec;
+	uint32_t	slot;
+	uint8_t		keystr[EVP_MAX_KEY_LENGTH];	/* room to pad */
+	char *		name;
+	int		len;
+
+	if (NULL == db || NTP_MAXKEY < keyno)
+		return false;
+	slot = kdb_get32(db->slots + 4 * (size_t)keyno);
+	if (0 == slot || db->nkeys < slot)
+		return false;
+	rec = db->records + (size_t)(slot - 1) * KDB_RECLEN;
+	if (db->nnames <= rec[0] || NULL == db->names[rec[0]]
+	    || 0 == rec[1] || KF_MAXKEY < rec[1])
+		return false;
+	name = db->names[rec[0]];
+
+	memcpy(keystr, rec + 2, rec[1]);
+	len = check_key_length(keyno, db->types[rec[0]], name,
+			       (char *)keystr, rec[1]);
+	if (KF_MAXKEY < len) {
+		msyslog(LOG_ERR, "AUTH: authreadkeys: key %u: %s key too long",
+			keyno, name);
+		return false;
+	}
+	check_mac_length(keyno, db->types[rec[0]], name, name);
+	auth_setkey(keyno, db->types[rec[0]], name, keystr, (size_t)len);
+	memset(keystr, '\0', sizeof(keystr));
+	return true;
+}
+
+static int
+keyfile_name(
+	auth_keyfile *	kf,
+	const char *	name
+	)
+{
+	for (int i = 0; i < kf->nnames; i++)
+		if (0 == strcmp(kf->names[i], name))
+			return i;
+	if (KF_MAXNAMES == kf->nnames)
+		return -1;
+	kf->names[kf->nnames] = estrdup(name);
+	return kf->nnames++;
+}
+
+static int
+keyfile_cmp(
+	const void *	a,
+	const void *	b
+	)
+{
+	const keyfile_entry *ka = a;
+	const keyfile_entry *kb = b;
+
+	if (ka->keyno != kb->keyno)
+		return (ka->keyno < kb->keyno) ? -1 : 1;
+	return (ka->line < kb->line) ? -1 : (ka->line > kb->line);
+}
+
+void
+authfreekeyfile(
+	auth_keyfile *	kf
+	)
+{
+	if (NULL == kf)
+		return;
+	for (int i = 0; i < kf->nnames; i++)
+		free(kf->names[i]);
+	keydb_close(kf->db);
+	if (NULL != kf->keys) {
+		memset(kf->keys, '\0', kf->kalloc * sizeof(*kf->keys));
+		free(kf->keys);
+	}
+	free(kf);
+}
+
+
+/*
+ * authparsekeys - read and check a keys file, without loading it.
+ * A compiled file is only mapped and checked.
+ * Safe to call from any thread.  Returns NULL if it can't be read.
+ */
+auth_keyfile *
+authparsekeys(
 	const char *file
 	)
 {
@@ -300,11 +589,16 @@ authreadkeys(
 	keyid_t	keyno;
 	AUTH_Type type;
 	char	buf[512];		/* lots of room for line */
-	uint8_t	keystr[32];		/* Bug 2537 */
+	uint8_t	keystr[EVP_MAX_KEY_LENGTH];	/* room to pad */
 	char *	name;
 	char	namebuf[NAMEBUFSIZE];
+	char	upcased[LIB_BUFLENGTH];
 	size_t	len;
-	int	keys = 0;
+	unsigned int lineno = 0;
+	auth_keyfile *kf;
+	keyfile_entry *kp;
+	int	nameidx;
+	size_t	j;
 
 	/*
 	 * Open file.  Complain and return if it can't be opened.
@@ -313,21 +607,30 @@ authreadkeys(
 	if (fp == NULL) {
 		msyslog(LOG_ERR, "AUTH: authreadkeys: file %s: %s",
 		    file, strerror(errno));
-		return false;
+		return NULL;
 	}
-	ssl_init();
 msyslog(LOG_ERR, "AUTH: authreadkeys: reading %s", file);
-
-	/*
-	 * Remove all existing keys
-	 */
-	auth_delkeys();
+	if (KDB_MAGICLEN == fread(buf, 1, KDB_MAGICLEN, fp)
+	    && 0 == memcmp(buf, KDB_MAGIC, KDB_MAGICLEN)) {
+		keydb *db;
+
+		fclose(fp);
+		db = keydb_open(file);
+		if (NULL == db)
+			return NULL;
+		kf = emalloc_zero(sizeof(*kf));
+		kf->db = db;
+		return kf;
+	}
+	rewind(fp);
+	kf = emalloc_zero(sizeof(*kf));
 
 	/*
 	 * Now read lines from the file, looking for key entries
 	 */
 	while ((line = fgets(buf, sizeof(buf), fp)) != NULL) {
 		char *token = nexttok(&line);
+		lineno++;
 		if (token == NULL) {
 			continue;
 		}
@@ -379,10 +682,8 @@ msyslog(LOG_ERR, "AUTH: authreadkeys: reading %s", file);
 		 * Try CMAC names first to dodge this hack in case future
 		 * cipher names begin with M.
 		 */
-		char *upcased;
 		char *pch;
-		upcased = lib_getbuf();
-		strlcpy(upcased, token, LIB_BUFLENGTH);
+		strlcpy(upcased, token, sizeof(upcased));
 		for (pch = upcased; '\0' != *pch; pch++) {
 			*pch = (char)toupper((unsigned char)*pch);
 		}
@@ -408,7 +709,7 @@ msyslog(LOG_ERR, "AUTH: authreadkeys: reading %s", file);
 
 
 		/*
-		 * Finally, get key and insert it.
+		 * Finally, get key and save it.
 		 * If it is longer than 20 characters, it is a binary
 		 * string encoded in hex; otherwise, it is a text string
 		 * of printable ASCII characters.
@@ -421,23 +722,19 @@ msyslog(LOG_ERR, "AUTH: authreadkeys: reading %s", file);
 		}
 		len = strlen(token);
 		if (len <= 20) {	/* Bug 2537 */
-			len = check_key_length(keyno, type, name, upcased, len);
-			check_mac_length(keyno, type, name, upcased);
-			auth_setkey(keyno, type, name, (uint8_t *)token, len);
-			keys++;
+			memcpy(keystr, token, len);
 		} else {
 			char	hex[] = "0123456789abcdef";
 			size_t	jlim;
 
 			jlim = len;
-			if ((2*sizeof(keystr)) < jlim) {
-			  jlim =  2 * sizeof(keystr);
+			if ((2*KF_MAXKEY) < jlim) {
+			  jlim =  2 * KF_MAXKEY;
 			  msyslog(LOG_ERR,
 			    "AUTH: authreadkeys: key %u truncated to %u bytes",
 			    keyno, (unsigned int)jlim);
 
 			}
-			size_t j;
 			for (j = 0; j < jlim; j++) {
 				char *ptr = strchr(hex, tolower((unsigned char)token[j]));
 				if (ptr == NULL) {
@@ -457,13 +754,166 @@ msyslog(LOG_ERR, "AUTH: authreadkeys: reading %s", file);
 			    continue;
 			}
 			len = jlim / 2;
-			len = check_key_length(keyno, type, name, upcased, len);
-			check_mac_length(keyno, type, name, upcased);
-			auth_setkey(keyno, type, name, keystr, len);
-			keys++;
 		}
+		len = (size_t)check_key_length(keyno, type, name,
+					       (char *)keystr, (int)len);
+		if (len > KF_MAXKEY) {
+			msyslog(LOG_ERR,
+			    "AUTH: authreadkeys: key %u: %s key too long",
+			    keyno, name);
+			continue;
+		}
+
+		if (kf->nkeys == kf->kalloc) {
+			kf->kalloc = kf->kalloc ? 2 * kf->kalloc : 64;
+			kf->keys = erealloc(kf->keys,
+					    kf->kalloc * sizeof(*kf->keys));
+		}
+		nameidx = keyfile_name(kf, name);
+		if (nameidx < 0) {
+			msyslog(LOG_ERR,
+			    "AUTH: authreadkeys: too many key types, key %u",
+			    keyno);
+			continue;
+		}
+		kp = &kf->keys[kf->nkeys++];
+		memset(kp, '\0', sizeof(*kp));
+		kp->keyno = keyno;
+		kp->line = lineno;
+		kp->type = type;
+		kp->name = (uint8_t)nameidx;
+		kp->len = (uint8_t)len;
+		memcpy(kp->key, keystr, len);
 	}
 	fclose(fp);
-	msyslog(LOG_ERR, "AUTH: authreadkeys: added %d keys", keys);
+	memset(keystr, '\0', sizeof(keystr));
+	memset(buf, '\0', sizeof(buf));
+
+	/* sort, and keep only the last line for each key number */
+	if (0 < kf->nkeys) {
+		qsort(kf->keys, kf->nkeys, sizeof(*kf->keys), keyfile_cmp);
+		j = 0;
+		for (size_t i = 0; i < kf->nkeys; i++) {
+			if (i + 1 < kf->nkeys &&
+			    kf->keys[i].keyno == kf->keys[i + 1].keyno)
+				continue;
+			kf->keys[j++] = kf->keys[i];
+		}
+		kf->nkeys = j;
+	}
+	return kf;
+}
+
+
+static bool
+keyfile_same(
+	const auth_keyfile *	ka,
+	const keyfile_entry *	a,
+	const auth_keyfile *	kb,
+	const keyfile_entry *	b
+	)
+{
+	return a->type == b->type && a->len == b->len
+	    && 0 == strcmp(ka->names[a->name], kb->names[b->name])
+	    && 0 == memcmp(a->key, b->key, a->len);
+}
+
+
+/*
+ * authapplykeys - make the keys table match a parsed keys file.
+ * Keys that didn't change are left alone; the rest are set or
+ * dropped.  Takes ownership of kf.  Main thread only.
+ */
+int
+authapplykeys(
+	auth_keyfile *	kf
+	)
+{
+	auth_keyfile *	old = current_keys;
+	size_t		i = 0, o = 0;
+	size_t		nold = (NULL == old) ? 0 : old->nkeys;
+	keyfile_entry *	kp;
+	int		changed = 0;
+
+	ssl_init();
+	if (NULL != kf->db) {
+		/* a compiled file replaces everything, keys load on use */
+		auth_delkeys();
+		keydb_close(active_db);
+		active_db = kf->db;
+		kf->db = NULL;
+		authfreekeyfile(kf);
+		authfreekeyfile(old);
+		current_keys = NULL;
+		auth_index();
+		return (int)active_db->nkeys;
+	}
+	if (NULL != active_db) {
+		/* back to a text file, so nothing to diff against */
+		auth_delkeys();
+		keydb_close(active_db);
+		active_db = NULL;
+		authfreekeyfile(old);
+		old = NULL;
+		nold = 0;
+	}
+	while (i < kf->nkeys || o < nold) {
+		if (o < nold && (i == kf->nkeys ||
+		    old->keys[o].keyno < kf->keys[i].keyno)) {
+			/* gone from the file */
+			auth_delkey(old->keys[o].keyno);
+			changed++;
+			o++;
+			continue;
+		}
+		kp = &kf->keys[i];
+		if (o < nold && old->keys[o].keyno == kp->keyno) {
+			bool same = keyfile_same(old, &old->keys[o], kf, kp);
+			o++;
+			if (same) {
+				i++;
+				continue;
+			}
+		}
+		check_mac_length(kp->keyno, kp->type, kf->names[kp->name],
+				 kf->names[kp->name]);
+		auth_setkey(kp->keyno, kp->type, kf->names[kp->name],
+			    kp->key, kp->len);
+		changed++;
+		i++;
+	}
+	auth_index();
+	authfreekeyfile(old);
+	current_keys = kf;
+	return changed;
+}
+
+
+/*
+ * authreadkeys - (re)read keys from a file.
+ */
+bool
+authreadkeys(
+	const char *file
+	)
+{
+	auth_keyfile *kf;
+	int changed;
+
+	ssl_init();
+	kf = authparsekeys(file);
+	if (NULL == kf) {
+		return false;
+	}
+
+	/*
+	 * Remove all existing keys
+	 */
+	auth_delkeys();
+	authfreekeyfile(current_keys);
+	current_keys = NULL;
+
+	changed = authapplykeys(kf);
+	msyslog(LOG_ERR, "AUTH: authreadkeys: added %d keys", changed);
 	return true;
 }
@@ -20,48 +20,63 @@ dolfptoa(
 	short ndec,
 	bool msec
 	)
+{
+	return dolfptoa_r(lfp, neg, ndec, msec, lib_getbuf(), LIB_BUFLENGTH);
+}
+
+
+/*
+ * dolfptoa_r - dolfptoa() into the caller's buffer, for threads other
+ * than the main one and for callers formatting several at once.
+ *
+ * Digits come two at a time: the integral part from digit_pairs[] by
+ * division by 100, the fraction by multiplying it by 100 in 64 bits,
+ * which moves the next two digits above the binary point exactly as
+ * two multiplications by ten would.
+ */
+char *
+dolfptoa_r(
+	l_fp lfp,
+	bool neg,
+	short ndec,
+	bool msec,
+	char *buf,
+	size_t buflen
+	)
 {
 	uint32_t fpi = lfpuint(lfp);
 	uint32_t fpv = lfpfrac(lfp);
-	uint8_t *cp, *cpend, *cpdec;
+	char *cp, *cpend, *cpdec, *tp;
 	int dec;
-	uint8_t cbuf[24];
-	char *buf, *bp;
+	char cbuf[24];
+	char out[1 + sizeof(cbuf) + 2];
+	char *bp;
 
 	/*
-	 * Get a string buffer before starting
-	 */
-	buf = lib_getbuf();
-
-	/*
-	 * Zero the character buffer
-	 */
-	ZERO(cbuf);
-
-	/*
-	 * Work on the integral part. This should work reasonable on
-	 * all machines with 32 bit arithmetic. Please note that 32 bits
-	 * can *always* be represented with at most 10 decimal digits,
-	 * including a possible rounding from the fractional part.
+	 * Start with all zeros, so the fraction is zero extended and
+	 * rounding can carry into the space before the integral part.
+	 * 32 bits always fit in 10 digits, including a carry from the
+	 * fraction.
 	 */
+	memset(cbuf, '0', sizeof(cbuf));
 	cp = cpend = cpdec = &cbuf[10];
-	for (dec = cp - cbuf; dec > 0 && fpi != 0; dec--) {
-		/* can add another digit */
-		uint32_t digit;
-
-		digit  = fpi;
-		fpi   /= 10U;
-		/*
-		 * This should be able to be replaced by [digit -= fpi * 10].
-		 * It is being left as is at the moment for subtle bug avoidance.
-		 */
-		digit -= (fpi << 3) + (fpi << 1); /* i*10 */
-		*--cp  = (uint8_t)digit;
+	while (fpi >= 100) {
+		unsigned int pair = fpi % 100;
+
+		fpi /= 100;
+		cp -= 2;
+		memcpy(cp, &digit_pairs[2 * pair], 2);
+	}
+	if (fpi >= 10) {
+		cp -= 2;
+		memcpy(cp, &digit_pairs[2 * fpi], 2);
+	} else if (fpi > 0) {
+		*--cp = (char)('0' + fpi);
 	}
 
 	/*
-	 * Done that, now deal with the problem of the fraction.  First
-	 * determine the number of decimal places.
+	 * Now the fraction.  First determine the number of decimal
+	 * places.
 	 */
 	dec = ndec;
 	if (dec < 0) {
@@ -74,86 +89,61 @@ dolfptoa(
 	if (dec > (long)sizeof(cbuf) - (cpend - cbuf))
 		dec = (long)sizeof(cbuf) - (cpend - cbuf);
 
-	/*
-	 * If there's a fraction to deal with, do so.
-	 */
-	for (/*NOP*/;  dec > 0 && fpv != 0;  dec--)  {
-		uint32_t digit, tmph, tmpl;
-
-		/* FIXME - get rid of this ugly kludge! */
-#define M_ADD(r_i, r_f, a_i, a_f)	/* r += a */ \
-		do { \
-			uint32_t add_t = (r_f); \
-			(r_f) += (a_f); \
-			(r_i) += (a_i) + ((uint32_t)(r_f) < add_t); \
-		} while (false)
-
-#define	M_LSHIFT(v_i, v_f)		/* v <<= 1 */ \
-		do { \
-			(v_i) = ((uint32_t)(v_i) << 1) | ((uint32_t)(v_f) >> 31);	\
-			(v_f) = ((uint32_t)(v_f) << 1); \
-		} while (false)
-
-		/*
-		 * The scheme here is to multiply the fraction
-		 * (0.1234...) by ten.  This moves a junk of BCD into
-		 * the units part.  record that and iterate.
-		 * multiply by shift/add in two dwords.
-		 */
-		digit = 0;
-		M_LSHIFT(digit, fpv);
-		tmph = digit;
-		tmpl = fpv;
-		M_LSHIFT(digit, fpv);
-		M_LSHIFT(digit, fpv);
-		M_ADD(digit, fpv, tmph, tmpl);
-#undef M_ADD
-#undef M_LSHIFT
-		*cpend++ = (uint8_t)digit;
+	for (/*NOP*/;  dec >= 2 && fpv != 0;  dec -= 2) {
+		uint64_t prod = (uint64_t)fpv * 100;
+
+		memcpy(cpend, &digit_pairs[2 * (prod >> 32)], 2);
+		cpend += 2;
+		fpv = (uint32_t)prod;
+	}
+	if (dec == 1 && fpv != 0) {
+		uint64_t prod = (uint64_t)fpv * 10;
+
+		*cpend++ = (char)('0' + (prod >> 32));
+		fpv = (uint32_t)prod;
+		dec = 0;
 	}
 
 	/* decide whether to round or simply extend by zeros */
 	if (dec > 0) {
 		/* only '0' digits left -- just reposition end */
 		cpend += dec;
-	} else {
-		/* some bits remain in 'fpv'; do round */
-		uint8_t *tp    = cpend;
-		int     carry = ((fpv & 0x80000000) != 0);
-
-		for (dec = tp - cbuf;  carry && dec > 0;  dec--) {
-			*--tp += 1;
-			if (*tp == 10)
-				*tp = 0;
-			else
-				carry = false;
+	} else if (fpv & 0x80000000) {
+		/* the rest is at least half a digit; round up */
+		for (tp = cpend; tp > cbuf; ) {
+			if (*--tp != '9') {
+				(*tp)++;
+				break;
+			}
+			*tp = '0';
 		}
-
 		if (tp < cp) /* rounding from 999 to 1000 or similar? */
 			cp = tp;
 	}
 
 	/*
-	 * We've now got the fraction in cbuf[], with cp pointing at
-	 * the first character, cpend pointing past the last, and
-	 * cpdec pointing at the first character past the decimal.
-	 * Remove leading zeros, then format the number into the
-	 * buffer.
+	 * We've now got the number in cbuf[], with cp pointing at the
+	 * first digit, cpend pointing past the last, and cpdec pointing
+	 * at the first digit past the decimal.  Remove leading zeros,
+	 * then format the number into the buffer.
 	 */
-	while (cp < cpdec && *cp == 0)
+	while (cp < cpdec && *cp == '0')
 		cp++;
 	if (cp >= cpdec)
 		cp = cpdec - 1;
 
-	bp = buf;
+	bp = out;
 	if (neg)
 		*bp++ = '-';
-	while (cp < cpend) {
-		if (cp == cpdec)
-			*bp++ = '.';
-		*bp++ = (char)(*cp++) + '0';
+	memcpy(bp, cp, (size_t)(cpdec - cp));
+	bp += cpdec - cp;
+	if (cpend > cpdec) {
+		*bp++ = '.';
+		memcpy(bp, cpdec, (size_t)(cpend - cpdec));
+		bp += cpend - cpdec;
 	}
 	*bp = '\0';
+	strlcpy(buf, out, buflen);
 
 	/*
 	 * Done!
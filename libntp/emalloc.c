@@ -7,6 +7,10 @@
 #include "ntp_syslog.h"
 #include "ntp_stdlib.h"
 
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
+
 
 /*
  * When using the debug MS CRT allocator, each allocation stores the
@@ -138,3 +142,101 @@ estrdup_impl(
 	return copy;
 }
 
+
+/*
+ * The accounts are bumped from any thread, with relaxed atomics: each
+ * counter is exact, but a reader may see bytes and blocks from slightly
+ * different moments.  The peak is only raised, never taken back.
+ */
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+static atomic_uint_fast64_t	mem_bytes[MEM_TAGS];
+static atomic_uint_fast64_t	mem_blocks[MEM_TAGS];
+static atomic_uint_fast64_t	mem_peak[MEM_TAGS];
+#else
+static volatile uint64_t	mem_bytes[MEM_TAGS];	/* racy without atomics */
+static volatile uint64_t	mem_blocks[MEM_TAGS];
+static volatile uint64_t	mem_peak[MEM_TAGS];
+#endif /* HAVE_STDATOMIC_H */
+
+void
+mem_charge(
+	int	tag,
+	size_t	newsz,
+	size_t	oldsz
+	)
+{
+	uint64_t now;
+
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	uint_fast64_t peak;
+
+	if (0 == oldsz)
+		atomic_fetch_add_explicit(&mem_blocks[tag], 1,
+					  memory_order_relaxed);
+	/* unsigned wraps, so a shrink comes out right too */
+	now = atomic_fetch_add_explicit(&mem_bytes[tag],
+					(uint64_t)newsz - oldsz,
+					memory_order_relaxed)
+	      + newsz - oldsz;
+	peak = atomic_load_explicit(&mem_peak[tag], memory_order_relaxed);
+	while (now > peak &&
+	       !atomic_compare_exchange_weak_explicit(&mem_peak[tag], &peak,
+			now, memory_order_relaxed, memory_order_relaxed))
+		continue;
+#else
+	if (0 == oldsz)
+		mem_blocks[tag]++;
+	now = mem_bytes[tag] += (uint64_t)newsz - oldsz;
+	if (now > mem_peak[tag])
+		mem_peak[tag] = now;
+#endif /* HAVE_STDATOMIC_H */
+}
+
+void
+mem_credit(
+	int	tag,
+	size_t	size
+	)
+{
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_fetch_sub_explicit(&mem_blocks[tag], 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&mem_bytes[tag], size, memory_order_relaxed);
+#else
+	mem_blocks[tag]--;
+	mem_bytes[tag] -= size;
+#endif /* HAVE_STDATOMIC_H */
+}
+
+/*
+ * free_tag - free() a block from one of the _tag allocators
+ */
+void
+free_tag(
+	int	tag,
+	void *	ptr,
+	size_t	size
+	)
+{
+	if (NULL == ptr)
+		return;
+	free(ptr);
+	mem_credit(tag, size);
+}
+
+uint64_t
+mem_stat(
+	int	tag,
+	int	what
+	)
+{
+	switch (what) {
+	case MEM_BYTES:
+		return mem_bytes[tag];
+	case MEM_BLOCKS:
+		return mem_blocks[tag];
+	case MEM_PEAK:
+		return mem_peak[tag];
+	default:
+		return 0;
+	}
+}
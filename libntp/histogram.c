@@ -0,0 +1,98 @@
+/* histogram.c - fixed-size log-scale latency histograms
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include "ntp_histogram.h"
+
+void
+histogram_clear(
+	struct histogram *h
+	)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/*
+ * histogram_bucket - the bucket a value in ns falls in.  Values below
+ * HIST_SUB get a bucket each; above that the top HIST_SUBBITS + 1 bits
+ * pick the bucket.  Anything past 2^HIST_TOPBIT lands in the last one.
+ */
+unsigned int
+histogram_bucket(
+	uint64_t ns
+	)
+{
+	int bit;
+
+	if (ns < HIST_SUB)
+		return (unsigned int)ns;
+	bit = 63 - __builtin_clzll(ns);
+	if (bit > HIST_TOPBIT)
+		return HIST_BUCKETS - 1;
+	return (unsigned int)((bit - HIST_SUBBITS + 1) * HIST_SUB) +
+	    (unsigned int)((ns >> (bit - HIST_SUBBITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * histogram_bucket_top - the largest value in ns that falls in bucket b
+ */
+uint64_t
+histogram_bucket_top(
+	unsigned int b
+	)
+{
+	unsigned int shift;
+
+	if (b < HIST_SUB)
+		return b;
+	if (b >= HIST_BUCKETS - 1)
+		return UINT64_MAX;
+	shift = b / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+void
+histogram_add(
+	struct histogram *h,
+	uint64_t ns
+	)
+{
+	h->count++;
+	h->sum += ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->bucket[histogram_bucket(ns)]++;
+}
+
+/*
+ * histogram_percentile - the value in ns that pct percent of samples
+ * are no larger than, rounded up to the top of its bucket but never
+ * past the largest sample.  Zero when there are no samples.
+ */
+uint64_t
+histogram_percentile(
+	const struct histogram *h,
+	double pct
+	)
+{
+	double rank = h->count * pct / 100;
+	uint64_t want = (uint64_t)rank, seen = 0;
+
+	if (0 == h->count)
+		return 0;
+	if (pct >= 100)
+		return h->max;
+	if (want < rank || want < 1)
+		want++;
+	for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= want) {
+			uint64_t top = histogram_bucket_top(b);
+			return top < h->max ? top : h->max;
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,269 @@
+/*
+ * json_scan.c - pick a few members out of a JSON object in one pass
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * A tokenizer hands back every token of a record and the caller then
+ * searches the token list once per member it wants.  Clients like the
+ * GPSD driver want three or four members of a flat object and not the
+ * nested arrays that make up most of the bigger records, so this walks
+ * the object once, steps over nested values by bracket counting alone,
+ * and matches each key against the short list of wanted ones.  Nothing
+ * is allocated and the buffer is left alone, except by
+ * json_value_string().
+ */
+
+#include "config.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_scan.h"
+
+static const char *
+skip_space(
+	const char *cp,
+	const char *end
+	)
+{
+	while (cp < end &&
+	       (' ' == *cp || '\t' == *cp || '\n' == *cp || '\r' == *cp))
+		cp++;
+	return cp;
+}
+
+/* past the closing quote of the string opening at cp, or NULL */
+static const char *
+skip_string(
+	const char *cp,
+	const char *end
+	)
+{
+	for (cp++; cp < end; cp++) {
+		if ('\\' == *cp)
+			cp++;
+		else if ('"' == *cp)
+			return cp + 1;
+	}
+	return NULL;
+}
+
+/* past the value starting at cp, or NULL; sets what it was */
+static const char *
+skip_value(
+	const char *cp,
+	const char *end,
+	int	   *kind
+	)
+{
+	const char *start = cp;
+	int	depth = 0;
+
+	switch (*cp) {
+	case '"':
+		*kind = JSON_STRING;
+		return skip_string(cp, end);
+
+	case '{':
+	case '[':
+		*kind = JSON_COMPOUND;
+		while (cp < end) {
+			switch (*cp) {
+			case '"':
+				cp = skip_string(cp, end);
+				if (NULL == cp)
+					return NULL;
+				continue;
+			case '{':
+			case '[':
+				depth++;
+				break;
+			case '}':
+			case ']':
+				if (0 == --depth)
+					return cp + 1;
+				break;
+			default:
+				break;
+			}
+			cp++;
+		}
+		return NULL;
+
+	default:
+		*kind = JSON_PRIMITIVE;
+		while (cp < end && NULL == strchr(",}] \t\r\n", *cp))
+			cp++;
+		/* a primitive must be followed by something, so that
+		 * number conversion stops inside the buffer */
+		if (cp == start || cp >= end || '\0' == *cp)
+			return NULL;
+		return cp;
+	}
+}
+
+int
+json_scan(
+	char		  *buf,
+	size_t		   len,
+	const char * const *keys,
+	int		   nkeys,
+	json_value	  *val
+	)
+{
+	const char *cp = buf, *end = buf + len;
+	const char *key, *vp;
+	int	found = 0, i, klen, kind;
+
+	for (i = 0; i < nkeys; i++) {
+		val[i].ptr = NULL;
+		val[i].len = 0;
+		val[i].kind = JSON_NONE;
+	}
+
+	cp = skip_space(cp, end);
+	if (cp >= end || '{' != *cp)
+		return -1;
+	cp = skip_space(cp + 1, end);
+	if (cp < end && '}' == *cp)
+		return 0;
+
+	while (found < nkeys) {
+		if (cp >= end || '"' != *cp)
+			return -1;
+		key = cp + 1;
+		cp = skip_string(cp, end);
+		if (NULL == cp)
+			return -1;
+		klen = (int)(cp - key) - 1;
+		cp = skip_space(cp, end);
+		if (cp >= end || ':' != *cp)
+			return -1;
+		vp = cp = skip_space(cp + 1, end);
+		if (cp >= end)
+			return -1;
+		cp = skip_value(cp, end, &kind);
+		if (NULL == cp)
+			return -1;
+
+		for (i = 0; i < nkeys; i++) {
+			if (JSON_NONE != val[i].kind ||
+			    strncmp(keys[i], key, (size_t)klen) ||
+			    '\0' != keys[i][klen])
+				continue;
+			val[i].ptr = buf + (vp - buf);
+			val[i].len = (int)(cp - vp);
+			val[i].kind = kind;
+			if (JSON_STRING == kind) {
+				val[i].ptr++;
+				val[i].len -= 2;
+			}
+			found++;
+			break;
+		}
+
+		cp = skip_space(cp, end);
+		if (cp < end && ',' == *cp)
+			cp = skip_space(cp + 1, end);
+		else if (cp < end && '}' == *cp)
+			break;
+		else
+			return -1;
+	}
+	return found;
+}
+
+/* is it the string s? */
+bool
+json_value_is(
+	const json_value *v,
+	const char	 *s
+	)
+{
+	return JSON_STRING == v->kind &&
+	       0 == strncmp(s, v->ptr, (size_t)v->len) &&
+	       '\0' == s[v->len];
+}
+
+/* a decimal integer without fraction or exponent */
+bool
+json_value_int(
+	const json_value *v,
+	long		 *ret
+	)
+{
+	const char	*cp, *end;
+	unsigned long	accu = 0, limit;
+	bool	neg;
+
+	if (JSON_PRIMITIVE != v->kind)
+		return false;
+	cp = v->ptr;
+	end = cp + v->len;
+	neg = ('-' == *cp);
+	cp += (neg || '+' == *cp);
+	limit = neg ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+	if (cp == end)
+		return false;
+	for (; cp < end; cp++) {
+		unsigned int d = (unsigned int)(unsigned char)*cp - '0';
+
+		if (d > 9 || accu > (limit - d) / 10)
+			return false;
+		accu = accu * 10 + d;
+	}
+	/* avoid negation overflows */
+	*ret = (neg && accu) ? -(long)(accu - 1) - 1 : (long)accu;
+	return true;
+}
+
+bool
+json_value_float(
+	const json_value *v,
+	double		 *ret
+	)
+{
+	char	*ep;
+	double	d;
+
+	if (JSON_PRIMITIVE != v->kind)
+		return false;
+	d = strtod(v->ptr, &ep);
+	if (ep != v->ptr + v->len)
+		return false;
+	*ret = d;
+	return true;
+}
+
+/* 0 for false, 1 for true, -1 for anything else */
+int
+json_value_bool(
+	const json_value *v
+	)
+{
+	if (JSON_PRIMITIVE != v->kind)
+		return -1;
+	switch (*v->ptr) {
+	case 't': return  1;
+	case 'f': return  0;
+	default : return -1;
+	}
+}
+
+/*
+ * The string, NUL terminated in place over its closing quote, or NULL
+ * if the value is not a string.  The buffer cannot be scanned again
+ * afterwards.
+ */
+const char *
+json_value_string(
+	json_value *v
+	)
+{
+	if (JSON_STRING != v->kind)
+		return NULL;
+	v->ptr[v->len] = '\0';
+	return v->ptr;
+}
@@ -29,12 +29,22 @@
  * more memory.  I call that preloading.
  *
  * This code now expects both the cipher and key to be preloaded.
+ * Each key carries its own CMAC context, keyed when the key is
+ * loaded, so the per packet init is just a reset.  OpenSSL 3.0.2
+ * and older can't reset an EVP_MAC without reloading the key, so
+ * there we work on a copy of the pre-keyed context instead.
  * Just preloading the cipher will save a lot of memory if you
  * are using a lot of keys.  The edit in this code is simple.
  *
  * Play with attic/cmac-timing for numbers.
  *
  *
+ * The digests get the same treatment.  The MAC is the digest of the
+ * key followed by the packet, so each key carries the digest state
+ * after hashing the key, and a packet starts from a copy of that.
+ * The copy goes into a context each thread keeps for itself.
+ *
+ *
  * Modern CPUs come with support to speed up AES operations.
  * On Intel, it's the aes capability.  You can see them
  * under flags in /proc/cpuinfo
@@ -44,6 +54,7 @@
 
 #include "config.h"
 
+#include <pthread.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdbool.h>
@@ -59,14 +70,63 @@
 #include "ntp_auth.h"
 #include "ntp.h"
 
-/* Need one per thread. */
-extern EVP_MD_CTX *digest_ctx;
-
 #if OPENSSL_VERSION_NUMBER > 0x20000000L
 #include <openssl/params.h>
 #else
 #include <openssl/cmac.h>
-extern CMAC_CTX *cmac_ctx;
+#endif
+
+
+/*
+ * cmac_start - ready the per key CMAC context for a new packet
+ *
+ * Returns NULL on failure.  Hand the result back to cmac_done().
+ */
+#if OPENSSL_VERSION_NUMBER > 0x30000020L
+static EVP_MAC_CTX *
+cmac_start(auth_info *auth)
+{
+	if (0 == EVP_MAC_init(auth->mac_ctx, NULL, 0, NULL))
+		return NULL;
+	return auth->mac_ctx;
+}
+
+static void
+cmac_done(EVP_MAC_CTX *ctx)
+{
+	UNUSED_ARG(ctx);
+}
+#elif OPENSSL_VERSION_NUMBER > 0x20000000L
+/* Bug in OpenSSL 3.0.2: EVP_MAC_init() without a key doesn't reset
+ * the CMAC.  Reloading the key is slow; copying the never used,
+ * pre-keyed context is much cheaper.  See attic/cmac-timing */
+static EVP_MAC_CTX *
+cmac_start(auth_info *auth)
+{
+	return EVP_MAC_CTX_dup(auth->mac_ctx);
+}
+
+static void
+cmac_done(EVP_MAC_CTX *ctx)
+{
+	EVP_MAC_CTX_free(ctx);
+}
+#else
+/* No key or cipher means reset, keeping the key schedule */
+static CMAC_CTX *
+cmac_start(auth_info *auth)
+{
+	if (NULL == auth->mac_ctx ||
+	    !CMAC_Init(auth->mac_ctx, NULL, 0, NULL, NULL))
+		return NULL;
+	return auth->mac_ctx;
+}
+
+static void
+cmac_done(CMAC_CTX *ctx)
+{
+	UNUSED_ARG(ctx);
+}
 #endif
 
 
@@ -85,15 +145,9 @@ cmac_encrypt(
 	uint8_t	mac[CMAC_MAX_MAC_LENGTH];
 	size_t	len;
 #if OPENSSL_VERSION_NUMBER > 0x20000000L
-        EVP_MAC_CTX *ctx = auth->mac_ctx;
+        EVP_MAC_CTX *ctx = cmac_start(auth);
 
-#if OPENSSL_VERSION_NUMBER > 0x30000020L
-        if (0 == EVP_MAC_init(ctx, NULL, 0, NULL)) {
-#else
-// Bug in OpenSSL 3.0.2
-// Need to reload key which is slow.  See attic/cmac-timing
-        if (0 == EVP_MAC_init(ctx, auth->key, auth->key_size, NULL)) {
-#endif
+        if (NULL == ctx) {
                 unsigned long err = ERR_get_error();
                 char * str = ERR_error_string(err, NULL);
                 msyslog(LOG_ERR, "encrypt: EVP_MAC_init() failed: %s.", str);
@@ -111,9 +165,10 @@ cmac_encrypt(
                 msyslog(LOG_ERR, "encrypt: EVP_MAC_final() failed: %s.", str);
                 exit(1);
         }
+        cmac_done(ctx);
 #else
-	CMAC_CTX *ctx = cmac_ctx;
-	if (!CMAC_Init(ctx, auth->key, auth->key_size, auth->cipher, NULL)) {
+	CMAC_CTX *ctx = cmac_start(auth);
+	if (NULL == ctx) {
 		/* Shouldn't happen.  Does if wrong key_size. */
 		msyslog(LOG_ERR,
 		    "encrypt: CMAC init failed, %u, %u",
@@ -146,15 +201,9 @@ cmac_decrypt(
 	uint8_t	mac[CMAC_MAX_MAC_LENGTH];
 	size_t	len;
 #if OPENSSL_VERSION_NUMBER > 0x20000000L
-        EVP_MAC_CTX *ctx = auth->mac_ctx;
+        EVP_MAC_CTX *ctx = cmac_start(auth);
 
-#if OPENSSL_VERSION_NUMBER > 0x30000020L
-        if (0 == EVP_MAC_init(ctx, NULL, 0, NULL)) {
-#else
-// Bug in OpenSSL 3.0.2
-// Need to reload key which is slow.  See attic/cmac-timing
-        if (0 == EVP_MAC_init(ctx, auth->key, auth->key_size, NULL)) {
-#endif
+        if (NULL == ctx) {
                 unsigned long err = ERR_get_error();
                 char * str = ERR_error_string(err, NULL);
                 msyslog(LOG_ERR, "decrypt: EVP_MAC_init() failed: %s.", str);
@@ -164,17 +213,20 @@ cmac_decrypt(
                 unsigned long err = ERR_get_error();
                 char * str = ERR_error_string(err, NULL);
                 msyslog(LOG_ERR, "decrypt: EVP_MAC_update() failed: %s.", str);
+                cmac_done(ctx);
                 return false;
         }
         if (0 == EVP_MAC_final(ctx, mac, &len, sizeof(mac))) {
                 unsigned long err = ERR_get_error();
                 char * str = ERR_error_string(err, NULL);
                 msyslog(LOG_ERR, "decrypt: EVP_MAC_final() failed: %s.", str);
+                cmac_done(ctx);
                 return false;
         }
+        cmac_done(ctx);
 #else
-	CMAC_CTX *ctx = cmac_ctx;
-	if (!CMAC_Init(ctx, auth->key, auth->key_size, auth->cipher, NULL)) {
+	CMAC_CTX *ctx = cmac_start(auth);
+	if (NULL == ctx) {
 		/* Shouldn't happen.  Does if wrong key_size. */
 		msyslog(LOG_ERR,
 		    "decrypt: CMAC init failed, %u, %u",
@@ -200,6 +252,52 @@ cmac_decrypt(
 	return !CRYPTO_memcmp(mac, (char *)pkt + length + 4, len);
 }
 
+/* The context each thread copies the per key state into */
+static pthread_key_t	digest_key;
+static pthread_once_t	digest_once = PTHREAD_ONCE_INIT;
+
+static void
+digest_ctx_free(void *ctx)
+{
+	EVP_MD_CTX_free(ctx);
+}
+
+static void
+digest_key_init(void)
+{
+	if (0 != pthread_key_create(&digest_key, digest_ctx_free)) {
+		msyslog(LOG_ERR, "MAC: pthread_key_create failed");
+		exit(1);
+	}
+}
+
+/*
+ * digest_start - this thread's context, with the key already hashed
+ *
+ * Returns NULL on failure.
+ */
+static EVP_MD_CTX *
+digest_start(auth_info *auth)
+{
+	EVP_MD_CTX *ctx;
+
+	if (NULL == auth->md_ctx)
+		return NULL;
+	pthread_once(&digest_once, digest_key_init);
+	ctx = pthread_getspecific(digest_key);
+	if (NULL == ctx) {
+		ctx = EVP_MD_CTX_new();
+		if (NULL == ctx || 0 != pthread_setspecific(digest_key, ctx)) {
+			EVP_MD_CTX_free(ctx);
+			return NULL;
+		}
+	}
+	if (!EVP_MD_CTX_copy_ex(ctx, auth->md_ctx))
+		return NULL;
+	return ctx;
+}
+
+
 /*
  * digest_encrypt - generate message digest
  *
@@ -214,19 +312,18 @@ digest_encrypt(
 {
 	uint8_t	digest[EVP_MAX_MD_SIZE];
 	unsigned int	len;
-	EVP_MD_CTX *ctx = digest_ctx;
+	EVP_MD_CTX *ctx = digest_start(auth);
 
 	/*
-	 * Compute digest of key concatenated with packet. Note: the
-	 * key type and digest type have been verified when the key
-	 * was created.
+	 * Compute digest of key concatenated with packet.  The key is
+	 * already in.  Note: the key type and digest type have been
+	 * verified when the key was created.
 	 */
-	if (!EVP_DigestInit_ex(ctx, auth->digest, NULL)) {
+	if (NULL == ctx) {
 		msyslog(LOG_ERR,
 		    "MAC: encrypt: digest init failed");
 		return (0);
 	}
-	EVP_DigestUpdate(ctx, auth->key, auth->key_size);
 	EVP_DigestUpdate(ctx, (uint8_t *)pkt, (unsigned int)length);
 	EVP_DigestFinal_ex(ctx, digest, &len);
 	if (MAX_BARE_MAC_LENGTH < len)
@@ -251,19 +348,18 @@ digest_decrypt(
 {
 	uint8_t	digest[EVP_MAX_MD_SIZE];
 	unsigned int	len;
-	EVP_MD_CTX *ctx = digest_ctx;
+	EVP_MD_CTX *ctx = digest_start(auth);
 
 	/*
-	 * Compute digest of key concatenated with packet. Note: the
-	 * key type and digest type have been verified when the key
-	 * was created.
+	 * Compute digest of key concatenated with packet.  The key is
+	 * already in.  Note: the key type and digest type have been
+	 * verified when the key was created.
 	 */
-	if (!EVP_DigestInit_ex(ctx, auth->digest, NULL)) {
+	if (NULL == ctx) {
 		msyslog(LOG_ERR,
 		    "MAC: decrypt: digest init failed");
 		return false;
 	}
-	EVP_DigestUpdate(ctx, auth->key, auth->key_size);
 	EVP_DigestUpdate(ctx, (uint8_t *)pkt, (unsigned int)length);
 	EVP_DigestFinal_ex(ctx, digest, &len);
 	if (MAX_BARE_MAC_LENGTH < len)
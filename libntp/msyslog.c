@@ -8,6 +8,9 @@
 #include "config.h"
 
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -39,6 +42,7 @@ struct log_counters {   /* LOG_EMERG, LOG_ALERT, LOG_CRIT not used */
   uint64_t errors;      /* LOG_ERR */
   uint64_t warnings;    /* LOG_WARNING */
   uint64_t others;      /* LOG_NOTICE, LOG_INFO, and LOG_DEBUG */
+  uint64_t dropped;     /* async queue full */
 };
 struct log_counters log_cnt;
 
@@ -50,19 +54,18 @@ extern	char *	progname;
 
 /* Declare the local functions */
 #define TIMESTAMP_LEN  128
-static void	humanlogtime(char buf[TIMESTAMP_LEN]);
-static void	addto_syslog	(int, const char *);
+static void	humanlogtime(char buf[TIMESTAMP_LEN], time_t);
+static void	addto_syslog	(int, const char *, time_t);
+static void	log_message	(int, const char *);
 
 
 /* We don't want to clutter up the log with the year and day of the week,
    etc.; just the minimal date and time.  */
 static void
-humanlogtime(char buf[TIMESTAMP_LEN])
+humanlogtime(char buf[TIMESTAMP_LEN], time_t cursec)
 {
-	time_t		cursec;
 	struct tm	tmbuf, *tm;
 
-	cursec = time(NULL);
 	tm = localtime_r(&cursec, &tmbuf);
 	if (!tm) {
 		strlcpy(buf, "-- --- --:--:--", TIMESTAMP_LEN);
@@ -90,12 +93,14 @@ humanlogtime(char buf[TIMESTAMP_LEN])
 /*
  * addto_syslog()
  * This routine adds the contents of a buffer to the syslog or an
- * application-specific logfile.
+ * application-specific logfile.  when is the time the message was
+ * made, which is later than now if it waited in the queue.
  */
 static void
 addto_syslog(
 	int		level,
-	const char *	msg
+	const char *	msg,
+	time_t		when
 	)
 {
 	static char *	prevcall_progname;
@@ -137,7 +142,7 @@ addto_syslog(
 
 	/* syslog() adds the timestamp, name, and pid */
 	if (msyslog_include_timestamp) {
-		humanlogtime(tbuf);
+		humanlogtime(tbuf, when);
 		human_time = tbuf;
 	} else	/* suppress gcc pot. uninit. warning */
 		human_time = NULL;
@@ -187,6 +192,300 @@ addto_syslog(
 }
 
 
+/*
+ * The logger.  Once msyslog_start_async() has been called, msyslog()
+ * doesn't write anything: it formats the message into a queue and a
+ * logger thread hands it to syslog or the logfile.  A syslog socket
+ * that blocks, or a logfile on a stalled disk, then backs up the queue
+ * instead of the main loop.
+ *
+ * Any thread may log, so the queue is under log_mutex, which is held
+ * only to copy a message in or out.  A full queue drops messages and
+ * counts them rather than wait; the logger says how many, at most once
+ * every msyslog_report seconds.  A message the same as the one before it
+ * is not queued again but counted, and comes out as "last message
+ * repeated N times" when a different one arrives or msyslog_report seconds
+ * after the first repeat, as syslogd does it.
+ *
+ * log_io_mutex keeps logfile changes out of the logger's way.
+ */
+#define LOG_SLOTS	256		/* power of 2 */
+#define LOG_LINE	1024		/* longest message queued */
+#define LOG_REPORT	30		/* seconds between summaries */
+
+struct log_slot {
+	time_t		when;
+	int		level;
+	char		text[LOG_LINE];
+};
+
+unsigned int			msyslog_slots = LOG_SLOTS;
+unsigned int			msyslog_report = LOG_REPORT;
+static struct log_slot *	log_ring;
+static unsigned int		log_size;	/* fixed once made */
+static unsigned int		log_head;	/* advanced by the logger */
+static unsigned int		log_tail;	/* advanced by producers */
+static bool			log_stopping;
+static char			log_last[LOG_LINE];	/* last message queued */
+static int			log_last_level = -1;
+static unsigned long		log_repeats;	/* of log_last, not yet said */
+static time_t			log_repeat_start;
+static volatile bool		logger_running;
+static volatile bool		log_direct;	/* write from the caller */
+static pthread_t		logger_tid;
+static pthread_mutex_t		log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t		log_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		log_wake = PTHREAD_COND_INITIALIZER;
+
+static void
+log_io_lock(void)
+{
+	if (logger_running)
+		pthread_mutex_lock(&log_io_mutex);
+}
+
+static void
+log_io_unlock(void)
+{
+	if (logger_running)
+		pthread_mutex_unlock(&log_io_mutex);
+}
+
+
+/*
+ * log_queue - put a message on the queue.  log_mutex held.
+ */
+static void
+log_queue(
+	int		level,
+	const char *	msg,
+	time_t		when
+	)
+{
+	struct log_slot *slot;
+
+	if (log_tail - log_head >= log_size) {
+		log_cnt.dropped++;
+		return;
+	}
+	slot = &log_ring[log_tail & (log_size - 1)];
+	slot->when = when;
+	slot->level = level;
+	strlcpy(slot->text, msg, sizeof(slot->text));
+	if (log_head == log_tail)
+		pthread_cond_signal(&log_wake);
+	log_tail++;
+}
+
+
+/*
+ * log_repeated - queue the count of repeats not yet said.  log_mutex
+ * held.
+ */
+static void
+log_repeated(
+	time_t	when
+	)
+{
+	char	buf[64];
+
+	if (0 == log_repeats)
+		return;
+	snprintf(buf, sizeof(buf), "last message repeated %lu time%s",
+		 log_repeats, (1 == log_repeats) ? "" : "s");
+	log_queue(log_last_level, buf, when);
+	log_repeats = 0;
+}
+
+
+/*
+ * log_message - write a formatted message, or queue it for the logger
+ */
+static void
+log_message(
+	int		level,
+	const char *	msg
+	)
+{
+	time_t	now = time(NULL);
+
+	if (!logger_running || log_direct) {
+		addto_syslog(level, msg, now);
+		return;
+	}
+	pthread_mutex_lock(&log_mutex);
+	if (level == log_last_level &&
+	    0 == strncmp(msg, log_last, sizeof(log_last) - 1)) {
+		if (0 == log_repeats++) {
+			/* the logger may be asleep with no deadline */
+			log_repeat_start = now;
+			pthread_cond_signal(&log_wake);
+		}
+	} else {
+		log_repeated(now);
+		log_queue(level, msg, now);
+		log_last_level = level;
+		strlcpy(log_last, msg, sizeof(log_last));
+	}
+	pthread_mutex_unlock(&log_mutex);
+}
+
+
+static void *
+logger_main(
+	void *	arg
+	)
+{
+	struct log_slot *	slot;
+	struct timespec		deadline;
+	uint64_t		reported = 0;
+	time_t			report_time = 0;
+	time_t			now;
+	time_t			report;
+	unsigned int		head;
+	char			buf[80];
+
+	UNUSED_ARG(arg);
+	pthread_mutex_lock(&log_mutex);
+	for (;;) {
+		/* producers don't touch the slots between head and tail */
+		while (log_head != log_tail) {
+			head = log_head;
+			slot = &log_ring[head & (log_size - 1)];
+			pthread_mutex_unlock(&log_mutex);
+			pthread_mutex_lock(&log_io_mutex);
+			addto_syslog(slot->level, slot->text, slot->when);
+			pthread_mutex_unlock(&log_io_mutex);
+			pthread_mutex_lock(&log_mutex);
+			if (log_head == head)	/* else msyslog_sync() had it */
+				log_head++;
+		}
+
+		now = time(NULL);
+		report = msyslog_report;
+		if (log_stopping ||
+		    (log_repeats > 0 && now - log_repeat_start >= report)) {
+			log_repeated(now);
+			if (log_head != log_tail)
+				continue;
+		}
+		if (log_cnt.dropped != reported &&
+		    (log_stopping || now - report_time >= report)) {
+			snprintf(buf, sizeof(buf),
+				 "LOG: logger behind, %llu messages dropped",
+				 (unsigned long long)(log_cnt.dropped - reported));
+			reported = log_cnt.dropped;
+			report_time = now;
+			pthread_mutex_unlock(&log_mutex);
+			pthread_mutex_lock(&log_io_mutex);
+			addto_syslog(LOG_WARNING, buf, now);
+			pthread_mutex_unlock(&log_io_mutex);
+			pthread_mutex_lock(&log_mutex);
+			continue;
+		}
+		if (log_stopping)
+			break;
+
+		deadline.tv_sec = 0;
+		if (log_repeats > 0)
+			deadline.tv_sec = log_repeat_start + report;
+		if (log_cnt.dropped != reported &&
+		    (0 == deadline.tv_sec ||
+		     report_time + report < deadline.tv_sec))
+			deadline.tv_sec = report_time + report;
+		if (0 == deadline.tv_sec) {
+			pthread_cond_wait(&log_wake, &log_mutex);
+		} else {
+			deadline.tv_nsec = 0;
+			pthread_cond_timedwait(&log_wake, &log_mutex, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&log_mutex);
+	return NULL;
+}
+
+
+/*
+ * msyslog_memory - bytes in the queue, once made
+ */
+size_t
+msyslog_memory(void)
+{
+	return log_size * sizeof(*log_ring);
+}
+
+
+/*
+ * msyslog_start_async - move log output to its own thread.  Messages
+ * still queued are written out at exit.
+ */
+void
+msyslog_start_async(void)
+{
+	static bool	registered;
+
+	if (logger_running)
+		return;
+	if (NULL == log_ring) {
+		log_size = msyslog_slots;
+		log_ring = eallocarray(log_size, sizeof(*log_ring));
+	}
+	log_stopping = false;
+	log_direct = false;
+	log_last_level = -1;
+
+	if (ntp_thread_create(&logger_tid, logger_main, NULL, "LOG"))
+		return;
+	logger_running = true;
+	if (!registered) {
+		registered = true;
+		atexit(msyslog_stop_async);
+	}
+}
+
+
+/*
+ * msyslog_stop_async - write out everything queued and go back to
+ * writing from the caller
+ */
+void
+msyslog_stop_async(void)
+{
+	if (!logger_running || pthread_equal(pthread_self(), logger_tid))
+		return;
+	pthread_mutex_lock(&log_mutex);
+	log_stopping = true;
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_mutex);
+	pthread_join(logger_tid, NULL);
+	logger_running = false;
+}
+
+
+/*
+ * msyslog_sync - we are about to die, perhaps holding log_mutex or
+ * in the logger.  Write what the queue holds if it can be had, and
+ * everything from here on from the caller.
+ */
+void
+msyslog_sync(void)
+{
+	struct log_slot *slot;
+
+	if (!logger_running || log_direct)
+		return;
+	log_direct = true;
+	if (pthread_mutex_trylock(&log_mutex))
+		return;
+	while (log_head != log_tail) {
+		slot = &log_ring[log_head & (log_size - 1)];
+		addto_syslog(slot->level, slot->text, slot->when);
+		log_head++;
+	}
+	pthread_mutex_unlock(&log_mutex);
+}
+
+
 void
 msyslog(
 	int		level,
@@ -216,7 +515,7 @@ msyslog(
 	va_start(ap, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
-	addto_syslog(level, buf);
+	log_message(level, buf);
 }
 
 
@@ -259,7 +558,7 @@ maybe_log(
 	va_start(ap, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
-	addto_syslog(level, buf);
+	log_message(level, buf);
 }
 
 
@@ -410,6 +709,7 @@ change_logfile(
 		msyslog(LOG_NOTICE, "LOG: switching logging to file %s",
 			abs_fname);
 
+	log_io_lock();
 	if (syslog_file != NULL &&
 	    syslog_file != stderr && syslog_file != stdout &&
 	    fileno(syslog_file) != fileno(new_file)) {
@@ -430,6 +730,7 @@ change_logfile(
 		syslog_abs_fname = abs_fname;
 	}
 	syslogit = false;
+	log_io_unlock();
 
 	/* This leaves something in the log file if you have errors
 	 * parsing ntp.conf and you switch to a log file.
@@ -512,7 +813,9 @@ check_logfile(void)
 	 * newsyslog on FreeBSD puts a "logfile turned over" message there.
 	 * This seems to work.
 	 */
+	log_io_lock();
 	if (ftell(syslog_file) == ftell(new_file)) {
+		log_io_unlock();
 		fclose(new_file);
 		return;
 	}
@@ -520,6 +823,7 @@ check_logfile(void)
 	msyslog(LOG_INFO, "LOG: check_logfile: closing old file");
 	fclose(syslog_file);
 	syslog_file = new_file;
+	log_io_unlock();
 	msyslog(LOG_INFO, "LOG: check_logfile: using %s", syslog_fname);
 }
 
@@ -0,0 +1,179 @@
+/*
+ * nmea_scan.c - check and split an NMEA 0183 sentence in one pass
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * The syntax check, the checksum, finding the fields and telling
+ * which sentence it is all want to look at every character, so they
+ * are done together.  Afterwards any field is a table lookup away, in
+ * any order, and the sentence type is a small integer.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "nmea_scan.h"
+
+/*
+ * Sentence types are told apart by the three characters after the
+ * talker ID.  This hash of them is perfect for the types in the table,
+ * so one comparison settles it.
+ */
+#define TYPE_HASH(a, b, c) \
+	((((unsigned)(a) << 2) ^ ((unsigned)(b) << 3) ^ (unsigned)(c)) & 7)
+
+static const struct {
+	char	name[6];	/* whole name field if fixed, else type */
+	int8_t	sentence;
+} types[8] = {
+	[TYPE_HASH('G', 'L', 'L')] = { "GLL",   NMEA_SENT_GLL },
+	[TYPE_HASH('Z', 'D', 'A')] = { "ZDA",   NMEA_SENT_ZDA },
+	[TYPE_HASH('R', 'M', 'C')] = { "RMC",   NMEA_SENT_RMC },
+	[TYPE_HASH('G', 'G', 'A')] = { "GGA",   NMEA_SENT_GGA },
+	[TYPE_HASH('R', 'M', 'F')] = { "PGRMF", NMEA_SENT_PGRMF },
+	[TYPE_HASH('Z', 'D', 'G')] = { "ZDG",   NMEA_SENT_ZDG },
+};
+
+static int
+classify(
+	const char *name	/* exactly NMEA_IDLEN characters */
+	)
+{
+	unsigned int h = TYPE_HASH(name[2], name[3], name[4]);
+
+	if ('\0' == types[h].name[0])
+		return NMEA_SENT_UNKNOWN;
+	if ('\0' == types[h].name[3])
+		return memcmp(name + 2, types[h].name, 3) ?
+		    NMEA_SENT_UNKNOWN : types[h].sentence;
+	return memcmp(name, types[h].name, NMEA_IDLEN) ?
+	    NMEA_SENT_UNKNOWN : types[h].sentence;
+}
+
+static inline int
+hexval(
+	char c
+	)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * The data fields are read eight bytes at a time.  XOR is happy to
+ * fold a whole word into the checksum and sort out the bytes at the
+ * end, and commas, '*' and NUL are found with the usual bit trick.
+ */
+#define ONES	0x0101010101010101ULL
+#define LOWS	0x7f7f7f7f7f7f7f7fULL
+
+/* top bit set in every byte of w that is zero, and nowhere else */
+static inline uint64_t
+zero_bytes(
+	uint64_t w
+	)
+{
+	return ~(((w & LOWS) + LOWS) | w | LOWS);
+}
+
+/* eight bytes, the first of them in the low byte */
+static inline uint64_t
+load_word(
+	const char *cp
+	)
+{
+	uint64_t w;
+
+	memcpy(&w, cp, sizeof(w));
+#ifdef WORDS_BIGENDIAN
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+/*
+ * The syntax is, as a regex,
+ *	'^\$[A-Z][A-Z0-9]{4,}[^*]*(\*[0-9A-F]{2})?$'
+ * and the checksum, when there is one, is the XOR of everything
+ * between the '$' and the '*'.
+ */
+int
+nmea_scan(
+	char		*buf,
+	int		 len,
+	nmea_sentence	*s
+	)
+{
+	char	 *cp = buf, *end, *stop;
+	uint64_t  acc = 0, w, m;
+	uint8_t	  cs = 0;
+	int	  hi, lo, n = 1;
+
+	if (len <= 0 || '\0' == *cp)
+		return NMEA_EMPTY;
+	end = buf + len;
+	if ('$' != *cp++)
+		return NMEA_INVALID;
+
+	s->base = cp;
+	s->blen = len - 1;
+	s->nfields = 1;
+	s->field[0] = 0;
+
+	/* name field */
+	if (*cp < 'A' || *cp > 'Z')
+		return NMEA_INVALID;
+	cs ^= (uint8_t)*cp++;
+	while ((*cp >= 'A' && *cp <= 'Z') || (*cp >= '0' && *cp <= '9'))
+		cs ^= (uint8_t)*cp++;
+	if (',' != *cp || cp - s->base < NMEA_IDLEN)
+		return NMEA_INVALID;
+	s->sentence = (NMEA_IDLEN == cp - s->base) ?
+	    classify(s->base) : NMEA_SENT_UNKNOWN;
+
+	/*
+	 * The rest of the fields, up to the checksum if there is one.
+	 * Any '*' or NUL before that is an error.
+	 */
+	stop = (end - cp > 3 && '*' == end[-3]) ? end - 3 : end;
+	for (; stop - cp >= 8; cp += 8) {
+		w = load_word(cp);
+		acc ^= w;
+		if (zero_bytes(w) | zero_bytes(w ^ (ONES * '*')))
+			return NMEA_INVALID;
+		for (m = zero_bytes(w ^ (ONES * ',')); m; m &= m - 1) {
+			if (n > NMEA_FIELDS)
+				break;
+			s->field[n++] = (uint16_t)(cp - s->base +
+			    __builtin_ctzll(m) / 8 + 1);
+		}
+	}
+	for (; cp < stop; cp++) {
+		if ('\0' == *cp || '*' == *cp)
+			return NMEA_INVALID;
+		cs ^= (uint8_t)*cp;
+		if (',' == *cp && n <= NMEA_FIELDS)
+			s->field[n++] = (uint16_t)(cp + 1 - s->base);
+	}
+	s->nfields = n;
+	acc ^= acc >> 32;
+	acc ^= acc >> 16;
+	acc ^= acc >> 8;
+	cs ^= (uint8_t)acc;
+
+	/* checksum */
+	if (stop == end)
+		return NMEA_VALID;
+	if (stop - s->base >= NMEA_MAXLEN)
+		return NMEA_INVALID;
+	hi = hexval(stop[1]);
+	lo = hexval(stop[2]);
+	if (hi < 0 || lo < 0 || cs != (uint8_t)(hi << 4 | lo))
+		return NMEA_INVALID;
+	return NMEA_CSVALID;
+}
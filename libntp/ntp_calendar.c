@@ -473,10 +473,22 @@ ntpcal_split_yeardays(
 	return res;
 }
 
+/*
+ * Rata Die of 65535-12-31, the last day a 'struct calendar' can hold.
+ */
+#define RD_YEAR_MAX	23936166
+
 /*
  *---------------------------------------------------------------------
  * Convert a RD into the date part of a 'struct calendar'.
  * Returns -1 on calculation overflow.
+ *
+ * Days in the range of 'struct calendar' take the Euclidean affine
+ * route of Neri & Schneider, "Euclidean affine functions and their
+ * application to calendar algorithms" (2022): with years starting in
+ * March, the leap day comes last, and year, month and day each drop
+ * out of a multiply and a shift with no correction steps.  Everything
+ * else goes by the calendar cycles.
  *---------------------------------------------------------------------
  */
 int
@@ -488,6 +500,8 @@ ntpcal_rd_to_date(
 	ntpcal_split split;
 	int32_t	     leaps;
 	int32_t	     retv;
+	uint32_t     n, c, ny, y, m, d, j;
+	uint64_t     p;
 
 	leaps = 0;
 	retv = 0;
@@ -502,6 +516,27 @@ ntpcal_rd_to_date(
 	if (jd->weekday >= 7)	/* unsigned! */
 		jd->weekday += 7;
 
+	if (1 <= rd && rd <= RD_YEAR_MAX) {
+		n  = 4 * ((uint32_t)rd + 305) + 3; /* from 0000-03-01 */
+		c  = n / GREGORIAN_CYCLE_DAYS;	  /* centuries */
+		n  = n % GREGORIAN_CYCLE_DAYS | 3;  /* 4 * day of century + 3 */
+		p  = (uint64_t)2939745 * n;
+		y  = 100 * c + (uint32_t)(p >> 32);
+		ny = (uint32_t)p / 2939745 / 4;	  /* day of year, from March */
+		n  = 2141 * ny + 197913;
+		m  = n >> 16;			  /* March is 3, February 14 */
+		d  = (n & 0xffff) / 2141;
+		j  = (ny >= 306);		  /* January or February */
+		y += j;
+		leaps = !(y & 3) && ((y % 100) || !(y & 15));
+		jd->year     = (uint16_t)y;
+		jd->yearday  = (uint16_t)(j ? ny - 305
+					    : ny + 60 + (uint32_t)leaps);
+		jd->month    = (uint8_t)(m - 12 * j);
+		jd->monthday = (uint8_t)(d + 1);
+		return leaps;
+	}
+
 	split = ntpcal_split_eradays(rd - 1, &leaps);
 	retv  = (int)leaps;
 	/* get year and day-of-year */
@@ -563,6 +598,41 @@ ntpcal_time_to_date(
 	return ntpcal_rd_to_date(jd, ds.hi);
 }
 
+int32_t
+ntpcal_daycache_update(
+	ntpcal_daycache *dc,
+	const time64_t	 ts
+	)
+{
+	ntpcal_split ds;
+	int64_t	     off;
+
+	off = time64s(ts) - time64s(dc->midnight);
+	if (dc->valid && 0 <= off && off < SECSPERDAY)
+		return (int32_t)off;
+
+	ds = ntpcal_daysplit(ts);
+	settime64s(dc->midnight, time64s(ts) - ds.lo);
+	dc->leaps = ntpcal_rd_to_date(&dc->date, ds.hi + DAY_UNIX_STARTS);
+	dc->mjd = ds.hi + MJD_1970;
+	dc->valid = true;
+	return ds.lo;
+}
+
+int
+ntpcal_time_to_date_cached(
+	ntpcal_daycache *dc,
+	struct calendar	*jd,
+	const time64_t	 ts
+	)
+{
+	int32_t secs;
+
+	secs = ntpcal_daycache_update(dc, ts);
+	*jd = dc->date;
+	ntpcal_daysec_to_date(jd, secs);
+	return dc->leaps;
+}
 
 /*
  * ==================================================================
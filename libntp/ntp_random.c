@@ -3,7 +3,9 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <openssl/opensslv.h>
 #include <openssl/rand.h>
@@ -39,3 +41,70 @@ void ntp_RAND_priv_bytes(unsigned char *buf, int num) {
 		exit(1);
 	}
 }
+
+/* Small requests on the packet path, transmit timestamps, NTS UIDs
+ * and nonces, cost as much in RAND_bytes overhead and DRBG locking as
+ * in the bytes themselves.  ntp_RAND_pool_bytes() hands them out from
+ * a per-thread pool filled RAND_POOL_SIZE bytes at a time, wiping
+ * each byte as it goes out.  It is not for keys: a pooled byte sits
+ * in memory until it is used.
+ *
+ * A forked child would hand out the same bytes as its parent, so the
+ * child bumps pool_gen and every pool made before the fork is dropped.
+ */
+#define RAND_POOL_SIZE	1024	/* bytes per refill */
+#define RAND_POOL_MAX	256	/* bigger requests go straight through */
+
+struct rand_pool {
+	unsigned int gen;	/* pool_gen when filled */
+	int left;		/* unused bytes, at the front */
+	unsigned char bytes[RAND_POOL_SIZE];
+};
+
+static pthread_key_t rand_pool_key;
+static pthread_once_t rand_pool_once = PTHREAD_ONCE_INIT;
+static unsigned int pool_gen;
+
+static void rand_pool_free(void *arg) {
+	memset(arg, 0, sizeof(struct rand_pool));
+	free(arg);
+}
+
+static void rand_pool_forked(void) {
+	pool_gen++;
+}
+
+static void rand_pool_make_key(void) {
+	int err = pthread_key_create(&rand_pool_key, rand_pool_free);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't create rand_pool_key: %d", err);
+		exit(2);
+	}
+	pthread_atfork(NULL, NULL, rand_pool_forked);
+}
+
+void ntp_RAND_pool_bytes(unsigned char *buf, int num) {
+	struct rand_pool *pool;
+	unsigned char *next;
+
+	if (num > RAND_POOL_MAX) {
+		ntp_RAND_bytes(buf, num);
+		return;
+	}
+	pthread_once(&rand_pool_once, rand_pool_make_key);
+	pool = pthread_getspecific(rand_pool_key);
+	if (NULL == pool) {
+		pool = emalloc_zero(sizeof(*pool));
+		pool->gen = pool_gen;
+		pthread_setspecific(rand_pool_key, pool);
+	}
+	if (pool->gen != pool_gen || pool->left < num) {
+		ntp_RAND_bytes(pool->bytes, (int)sizeof(pool->bytes));
+		pool->left = (int)sizeof(pool->bytes);
+		pool->gen = pool_gen;
+	}
+	pool->left -= num;
+	next = pool->bytes + pool->left;
+	memcpy(buf, next, (size_t)num);
+	memset(next, 0, (size_t)num);
+}
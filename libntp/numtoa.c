@@ -5,13 +5,29 @@
 
 #include <sys/types.h>
 #include <netinet/in.h>		/* ntohl */
+#include <arpa/inet.h>
 
 #include <stdio.h>
+#include <string.h>
 
 #include "ntp_fp.h"
 #include "lib_strbuf.h"
 #include "ntp_stdlib.h"
 
+/* "00".."99", for converting two digits at a time */
+const char digit_pairs[200] = {
+	'0','0','0','1','0','2','0','3','0','4','0','5','0','6','0','7','0','8','0','9',
+	'1','0','1','1','1','2','1','3','1','4','1','5','1','6','1','7','1','8','1','9',
+	'2','0','2','1','2','2','2','3','2','4','2','5','2','6','2','7','2','8','2','9',
+	'3','0','3','1','3','2','3','3','3','4','3','5','3','6','3','7','3','8','3','9',
+	'4','0','4','1','4','2','4','3','4','4','4','5','4','6','4','7','4','8','4','9',
+	'5','0','5','1','5','2','5','3','5','4','5','5','5','6','5','7','5','8','5','9',
+	'6','0','6','1','6','2','6','3','6','4','6','5','6','6','6','7','6','8','6','9',
+	'7','0','7','1','7','2','7','3','7','4','7','5','7','6','7','7','7','8','7','9',
+	'8','0','8','1','8','2','8','3','8','4','8','5','8','6','8','7','8','8','8','9',
+	'9','0','9','1','9','2','9','3','9','4','9','5','9','6','9','7','9','8','9','9',
+};
+
 /* Convert a refid & stratum to a string
  * Only used by record_raw_stats
  */
@@ -21,28 +37,72 @@ refid_str(
 	int	stratum
 	)
 {
-	char *	text;
-	size_t	tlen;
+	return refid_str_r(refid, stratum, lib_getbuf(), LIB_BUFLENGTH);
+}
+
+/* refid_str() into the caller's buffer */
+const char *
+refid_str_r(
+	uint32_t	refid,
+	int	stratum,
+	char *	buf,
+	size_t	buflen
+	)
+{
+	char	text[sizeof(refid) + 1];
 
 	if (stratum > 1) {
-		struct in_addr in4;
-		in4.s_addr = refid;
-		return inet_ntoa(in4);
+		if (NULL == inet_ntop(AF_INET, &refid, buf, (socklen_t)buflen))
+			strlcpy(buf, "?", buflen);
+		return buf;
 	}
 
-	text = lib_getbuf();
-	memcpy(&text[0], &refid, sizeof(refid));
-	text[1 + sizeof(refid)] = '\0';
+	memcpy(text, &refid, sizeof(refid));
+	text[sizeof(refid)] = '\0';
 	// Chop off trailing spaces. Facebook was sending "FB  "
 	for (int i=sizeof(refid)-1; i>0; i--) {
 	  if (text[i] != ' ') break;
 	  text[i] = '\0';
 	}
-	tlen = strlen(text);
-	if (0 == tlen) {
-	  strlcat(text, "?", LIB_BUFLENGTH);
+	if ('\0' == text[0]) {
+	  strlcpy(text, "?", sizeof(text));
 	}
+	strlcpy(buf, text, buflen);
 
-	return text;
+	return buf;
 }
 
+/* An unsigned number in decimal, two digits at a time, into buf.
+ * Returns its length, which is at most 20.
+ */
+size_t
+u64toa_r(
+	uint64_t	val,
+	char *	buf,
+	size_t	buflen
+	)
+{
+	char	tmp[20];
+	char *	cp = tmp + sizeof(tmp);
+	size_t	len;
+
+	while (val >= 100) {
+		unsigned int pair = (unsigned int)(val % 100);
+
+		val /= 100;
+		cp -= 2;
+		memcpy(cp, &digit_pairs[2 * pair], 2);
+	}
+	if (val >= 10) {
+		cp -= 2;
+		memcpy(cp, &digit_pairs[2 * val], 2);
+	} else {
+		*--cp = (char)('0' + val);
+	}
+	len = (size_t)(tmp + sizeof(tmp) - cp);
+	if (len >= buflen)
+		len = buflen - 1;
+	memcpy(buf, cp, len);
+	buf[len] = '\0';
+	return len;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Convert whole columns of timestamps to Unix time floats, so the
+ * Python tools don't pay for a call, a parse and a float object per
+ * value when they work through an MRU list or a stats file.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ntp_fp.h"
+#include "timespecops.h"
+
+#include "pymodule-stamps.h"
+
+// Don't include Python.h
+
+/* from the NTP era to the Unix one, as statfiles.py has it */
+#define MJD_UNIX_OFFSET	3506716800.0
+/* more MJD digits than that are garbage, not a date */
+#define MJD_DIGITS	9
+
+static bool
+is_space(char c)
+{
+	return (' ' == c || ('\t' <= c && c <= '\r'));
+}
+
+static int
+hex_value(char c)
+{
+	if ('0' <= c && c <= '9')
+		return c - '0';
+	if ('a' <= c && c <= 'f')
+		return c - 'a' + 10;
+	if ('A' <= c && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Eight hex digits at *pp, taken off it, or false */
+static bool
+hex_word(const char **pp, const char *end, uint32_t *word)
+{
+	const char *p = *pp;
+	uint32_t w = 0;
+	int v;
+
+	if (end - p < 8)
+		return false;
+	for (int i = 0; i < 8; i++) {
+		v = hex_value(p[i]);
+		if (v < 0)
+			return false;
+		w = (w << 4) | (uint32_t)v;
+	}
+	*pp = p + 8;
+	*word = w;
+	return true;
+}
+
+/* One timestamp as ntpq shows it, 0x then 8 digits, a dot, 8 more */
+static double
+hex_stamp(const char *p, const char *end, time_t pivot)
+{
+	uint32_t sec, frac;
+	struct timespec ts;
+
+	if (end - p > 2 && '0' == p[0] && ('x' == p[1] || 'X' == p[1]))
+		p += 2;
+	if (!hex_word(&p, end, &sec))
+		return NAN;
+	if (p < end && '.' == *p)
+		p++;
+	if (!hex_word(&p, end, &frac) || p != end)
+		return NAN;
+	ts = lfp_stamp_to_tspec(lfpinit_u(sec, frac), pivot);
+	return ts.tv_sec + ts.tv_nsec * S_PER_NS;
+}
+
+/*
+ * do_lfptofloats - convert the hex l_fp timestamps in len bytes of
+ * in, split at white space or commas, to Unix time as lfptofloat()
+ * does, NaN for any it can't parse.  Returns how many went to out,
+ * outlen at most.
+ */
+size_t
+do_lfptofloats(
+	const char *	in,
+	size_t		len,
+	double *	out,
+	size_t		outlen
+	)
+{
+	const char *end = in + len, *tok;
+	time_t pivot = time(NULL);
+	size_t n = 0;
+
+	while (n < outlen) {
+		while (in < end && (is_space(*in) || ',' == *in))
+			in++;
+		if (in == end)
+			break;
+		tok = in;
+		while (in < end && !is_space(*in) && ',' != *in)
+			in++;
+		out[n++] = hex_stamp(tok, in, pivot);
+	}
+	return n;
+}
+
+/* A stats line starts with the MJD and the seconds past midnight */
+static double
+mjd_stamp(const char *p, const char *end)
+{
+	char buf[64];
+	const char *tok;
+	char *ep;
+	long long mjd = 0;
+	bool negative = false;
+	double second;
+	size_t digits = 0;
+
+	while (p < end && is_space(*p))
+		p++;
+	if (p < end && ('+' == *p || '-' == *p))
+		negative = ('-' == *p++);
+	while (p < end && '0' <= *p && *p <= '9') {
+		if (++digits > MJD_DIGITS)
+			return NAN;
+		mjd = mjd * 10 + (*p++ - '0');
+	}
+	if (0 == digits || p == end || !is_space(*p))
+		return NAN;
+	if (negative)
+		mjd = -mjd;
+
+	while (p < end && is_space(*p))
+		p++;
+	tok = p;
+	while (p < end && !is_space(*p))
+		p++;
+	if (tok == p || (size_t)(p - tok) >= sizeof(buf))
+		return NAN;
+	memcpy(buf, tok, (size_t)(p - tok));
+	buf[p - tok] = '\0';
+	second = strtod(buf, &ep);
+	if ('\0' != *ep)
+		return NAN;
+
+	/* the same sums in the same order as Python, to the last bit */
+	return (double)(86400 * mjd) + second - MJD_UNIX_OFFSET;
+}
+
+/*
+ * do_mjdtounix - convert the MJD and seconds that start each line of
+ * len bytes of stats file text to Unix time, NaN for lines that
+ * don't start that way.  Returns how many lines went to out, outlen
+ * at most.
+ */
+size_t
+do_mjdtounix(
+	const char *	in,
+	size_t		len,
+	double *	out,
+	size_t		outlen
+	)
+{
+	const char *end = in + len, *eol;
+	size_t n = 0;
+
+	while (n < outlen && in < end) {
+		eol = memchr(in, '\n', (size_t)(end - in));
+		if (NULL == eol)
+			eol = end;
+		out[n++] = mjd_stamp(in, eol);
+		in = (eol < end) ? eol + 1 : end;
+	}
+	return n;
+}
@@ -0,0 +1,22 @@
+/*
+ * pymodule-stamps.h -- converting columns of timestamps at once,
+ * shared by the FFI stub and the Python extension
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ */
+
+#ifndef GUARD_PYMODULE_STAMPS_H
+#define GUARD_PYMODULE_STAMPS_H
+
+#include <stddef.h>
+
+/* can't include Python.h */
+
+size_t do_lfptofloats(const char *in, size_t len, double *out,
+		      size_t outlen);
+size_t do_mjdtounix(const char *in, size_t len, double *out,
+		    size_t outlen);
+
+#endif /* GUARD_PYMODULE_STAMPS_H */
@@ -0,0 +1,175 @@
+/*
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Split a mode 6 text response into its key=value pairs, as
+ * ControlSession.__varlist_items() in pylib/packet.py does, a lot
+ * faster than Python can a character at a time.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "pymodule-varlist.h"
+
+// Don't include Python.h
+
+/* What Python's str.strip() takes off, short of Unicode */
+static bool
+is_space(char c)
+{
+	return (' ' == c || ('\t' <= c && c <= '\r') ||
+		('\x1c' <= c && c <= '\x1f'));
+}
+
+static bool
+is_digit(char c)
+{
+	return '0' <= c && c <= '9';
+}
+
+static bool
+is_xdigit(char c)
+{
+	return is_digit(c) || ('a' <= c && c <= 'f') ||
+		('A' <= c && c <= 'F');
+}
+
+static bool
+is_alnum(char c)
+{
+	return is_digit(c) || ('a' <= c && c <= 'z') ||
+		('A' <= c && c <= 'Z');
+}
+
+/*
+ * Guess whether int(v, 0) or float(v) takes v.  Anything odd, like
+ * underscores or leading zeros, is left to Python.
+ */
+static char
+kind_of(const char *v, size_t n)
+{
+	const char *p = v, *end = v + n;
+	size_t digits = 0;
+
+	if (0 == n || '"' == v[0])
+		return VARLIST_STR;
+	if (NULL != memchr(v, '_', n))
+		return VARLIST_ASK;
+	if ('+' == *p || '-' == *p)
+		p++;
+	if (end - p > 2 && '0' == p[0] && ('x' == p[1] || 'X' == p[1])) {
+		/* float() takes no hex, so a hex timestamp is a string */
+		for (p += 2; p < end; p++)
+			if (!is_xdigit(*p))
+				return VARLIST_STR;
+		return VARLIST_INT;
+	}
+	while (p + digits < end && is_digit(p[digits]))
+		digits++;
+	if (p + digits == end && digits > 0)
+		return ('0' == p[0] && digits > 1) ? VARLIST_ASK : VARLIST_INT;
+	p += digits;
+	if (p < end && '.' == *p) {
+		p++;
+		while (p < end && is_digit(*p)) {
+			p++;
+			digits++;
+		}
+	}
+	if (digits > 0 && p < end && ('e' == *p || 'E' == *p)) {
+		p++;
+		if (p < end && ('+' == *p || '-' == *p))
+			p++;
+		if (p < end && is_digit(*p))
+			while (p < end && is_digit(*p))
+				p++;
+		else
+			digits = 0;
+	}
+	if (digits > 0 && p == end)
+		return VARLIST_FLOAT;
+	for (p = v; p < end; p++)
+		if (!is_alnum(*p) && NULL == strchr("+-.", *p))
+			return VARLIST_STR;
+	return VARLIST_ASK;
+}
+
+/*
+ * Write one pair, stripped, as kind, key, NUL, value, NUL.  out has
+ * room: the pair, its comma and its equals sign take as much.
+ */
+static char *
+put_pair(const char *pair, size_t n, char *out)
+{
+	const char *eq, *key = pair, *val;
+	size_t keylen, vallen;
+
+	eq = memchr(pair, '=', n);
+	keylen = (NULL != eq) ? (size_t)(eq - pair) : n;
+	val = (NULL != eq) ? eq + 1 : pair + n;
+	vallen = (size_t)(pair + n - val);
+	while (keylen > 0 && is_space(*key)) {
+		key++;
+		keylen--;
+	}
+	while (keylen > 0 && is_space(key[keylen - 1]))
+		keylen--;
+	while (vallen > 0 && is_space(*val)) {
+		val++;
+		vallen--;
+	}
+	while (vallen > 0 && is_space(val[vallen - 1]))
+		vallen--;
+
+	*out++ = kind_of(val, vallen);
+	memcpy(out, key, keylen);
+	out += keylen;
+	*out++ = '\0';
+	memcpy(out, val, vallen);
+	out += vallen;
+	*out++ = '\0';
+	return out;
+}
+
+/*
+ * do_varlist - split len bytes of response text at commas outside
+ * quotes, dropping NULs and other garbage as ntpq always has.  Each
+ * pair goes to out as its kind, key, NUL, value, NUL.  Returns the
+ * length written, 0 if outlen is short of VARLIST_OUTLEN(len).
+ */
+size_t
+do_varlist(
+	const char *	in,
+	size_t		len,
+	char *		out,
+	size_t		outlen
+	)
+{
+	const char *end = in + len;
+	char *pair, *op = out;
+	size_t n = 0;
+	bool instring = false;
+
+	if (outlen < VARLIST_OUTLEN(len))
+		return 0;
+	/* Gather each pair in the last len bytes of out, clear of
+	 * what is written */
+	pair = out + outlen - len;
+	for (; in < end; in++) {
+		if ('"' == *in) {
+			pair[n++] = *in;
+			instring = !instring;
+		} else if (!instring && ',' == *in) {
+			op = put_pair(pair, n, op);
+			n = 0;
+		} else if (0 < *in && *in < 127) {
+			pair[n++] = *in;
+		}
+	}
+	if (n > 0)
+		op = put_pair(pair, n, op);
+	return (size_t)(op - out);
+}
@@ -0,0 +1,31 @@
+/*
+ * pymodule-varlist.h -- splitting mode 6 text responses, shared by
+ * the FFI stub and the Python extension
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ */
+
+#ifndef GUARD_PYMODULE_VARLIST_H
+#define GUARD_PYMODULE_VARLIST_H
+
+#include <stddef.h>
+
+/* can't include Python.h */
+
+/*
+ * What a value looks like, so Python can cast it without trying
+ * int() and float() in turn and catching the failures.
+ */
+#define VARLIST_INT	'i'	/* int(value, 0) will take it */
+#define VARLIST_FLOAT	'f'	/* float(value) will take it */
+#define VARLIST_STR	's'	/* neither will */
+#define VARLIST_ASK	'?'	/* can't tell, try them */
+
+/* Worst case output for len bytes of input: ",,,," */
+#define VARLIST_OUTLEN(len)	(4 * (len) + 4)
+
+size_t do_varlist(const char *in, size_t len, char *out, size_t outlen);
+
+#endif /* GUARD_PYMODULE_VARLIST_H */
@@ -27,6 +27,8 @@
 #include "ntp_control.h"
 
 #include "pymodule-mac.h"
+#include "pymodule-varlist.h"
+#include "pymodule-stamps.h"
 
 #include "python_compatibility.h"
 
@@ -139,6 +141,115 @@ ntpc_step_systime(PyObject *self, PyObject *args)
 	return Py_BuildValue("d", step_systime(full_adjustment));
 }
 
+/* pairs = ntp.ntpc.varlist(text)
+ * returns a list of (key, value, kind) from a mode 6 text response. */
+
+static PyObject *
+ntpc_varlist(PyObject *self, PyObject *args)
+{
+	const char *text;
+	Py_ssize_t textlen;
+	char *buf, *cp, *key, *val;
+	size_t buflen, len;
+	PyObject *list, *item;
+
+	UNUSED_ARG(self);
+#if PY_MAJOR_VERSION >= 3
+	if (!PyArg_ParseTuple(args, "y#", &text, &textlen))
+#else
+	if (!PyArg_ParseTuple(args, "s#", &text, &textlen))
+#endif
+		return NULL;
+	buflen = VARLIST_OUTLEN((size_t)textlen);
+	buf = malloc(buflen);
+	if (NULL == buf)
+		return PyErr_NoMemory();
+	len = do_varlist(text, (size_t)textlen, buf, buflen);
+	list = PyList_New(0);
+	cp = buf;
+	while (NULL != list && cp < buf + len) {
+		key = cp + 1;
+		val = key + strlen(key) + 1;
+		item = Py_BuildValue("(sss#)", key, val, cp, (Py_ssize_t)1);
+		cp = val + strlen(val) + 1;
+		if (NULL == item || PyList_Append(list, item) < 0) {
+			Py_XDECREF(item);
+			Py_CLEAR(list);
+			break;
+		}
+		Py_DECREF(item);
+	}
+	free(buf);
+	return list;
+}
+
+/* An array('d') holding n doubles from vals */
+static PyObject *
+double_array(const double *vals, size_t n)
+{
+	PyObject *mod, *bytes, *arr;
+
+	mod = PyImport_ImportModule("array");
+	if (NULL == mod)
+		return NULL;
+	bytes = PyBytes_FromStringAndSize((const char *)vals,
+					  (Py_ssize_t)(n * sizeof(*vals)));
+	arr = (NULL == bytes) ? NULL :
+		PyObject_CallMethod(mod, "array", "sO", "d", bytes);
+	Py_XDECREF(bytes);
+	Py_DECREF(mod);
+	return arr;
+}
+
+/* Run one of the stamp column converters over a buffer */
+static PyObject *
+stamps_column(PyObject *args, bool mjd)
+{
+	Py_buffer text;
+	double *vals;
+	size_t len, max, n;
+	PyObject *arr;
+
+	if (!PyArg_ParseTuple(args, "s*", &text))
+		return NULL;
+	len = (size_t)text.len;
+	/* no more values than separators, plus one */
+	max = len / 2 + 1;
+	vals = malloc(max * sizeof(*vals));
+	if (NULL == vals) {
+		PyBuffer_Release(&text);
+		return PyErr_NoMemory();
+	}
+	if (mjd)
+		n = do_mjdtounix(text.buf, len, vals, max);
+	else
+		n = do_lfptofloats(text.buf, len, vals, max);
+	PyBuffer_Release(&text);
+	arr = double_array(vals, n);
+	free(vals);
+	return arr;
+}
+
+/* floats = ntp.ntpc.lfptofloats(text)
+ * returns array('d') of the hex timestamps in text, NaN where bad. */
+
+static PyObject *
+ntpc_lfptofloats(PyObject *self, PyObject *args)
+{
+	UNUSED_ARG(self);
+	return stamps_column(args, false);
+}
+
+/* times = ntp.ntpc.mjdtounix(text)
+ * returns array('d') of the Unix time starting each stats line. */
+
+static PyObject *
+ntpc_mjdtounix(PyObject *self, PyObject *args)
+{
+	UNUSED_ARG(self);
+	return stamps_column(args, true);
+}
+
 /* --------------------------------------------------------------- */
 /* Hook for CMAC/HMAC
  * Not really part of libntp, but this is a handy place to put it.
@@ -230,6 +341,12 @@ static PyMethodDef ntpc_methods[] = {
 	 PyDoc_STR("Check if name is a valid algorithm name")},
 	{"mac",			ntpc_mac,		METH_VARARGS,
 	 PyDoc_STR("Compute HMAC or CMAC from data, key, and algorithm name")},
+	{"varlist",		ntpc_varlist,		METH_VARARGS,
+	 PyDoc_STR("Split a mode 6 text response into (key, value, kind).")},
+	{"lfptofloats",		ntpc_lfptofloats,	METH_VARARGS,
+	 PyDoc_STR("A column of NTP l_fp to an array of float times.")},
+	{"mjdtounix",		ntpc_mjdtounix,		METH_VARARGS,
+	 PyDoc_STR("A column of stats file MJD and seconds to Unix times.")},
 	{NULL,			NULL, 0, NULL}		/* sentinel */
 };
 
@@ -0,0 +1,133 @@
+/* shard.c - per-thread counter shards, summed when read
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntp_stdlib.h"
+#include "ntp_syslog.h"
+#include "ntp_shard.h"
+
+/* The header sits on a line of its own, the counters start on the
+ * next one and are padded out to a whole line.
+ */
+struct shard {
+	struct shard	*link;		/* in the set */
+	struct shard	*next;		/* this thread's shards */
+	struct shard_set *set;
+};
+
+#define SHARD_HEAD	SHARD_ALIGN
+#define SHARD_BODY(s)	((uint64_t *)((char *)(s) + SHARD_HEAD))
+
+static pthread_key_t	shard_key;	/* this thread's shards */
+static pthread_once_t	shard_once = PTHREAD_ONCE_INIT;
+
+static void
+add_words(
+	uint64_t *sum,
+	const uint64_t *from,
+	size_t size
+	)
+{
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+		sum[i] += from[i];
+}
+
+/*
+ * shard_exit - a thread is going away: keep what it counted, free
+ * its shards
+ */
+static void
+shard_exit(
+	void *arg
+	)
+{
+	struct shard *s = arg, *next, **pp;
+	struct shard_set *set;
+
+	for (; NULL != s; s = next) {
+		next = s->next;
+		set = s->set;
+		pthread_mutex_lock(&set->lock);
+		for (pp = &set->shards; *pp != s; pp = &(*pp)->link)
+			continue;
+		*pp = s->link;
+		if (NULL == set->retired)
+			set->retired = emalloc_zero(set->size);
+		add_words(set->retired, SHARD_BODY(s), set->size);
+		pthread_mutex_unlock(&set->lock);
+		free(s);
+	}
+}
+
+static void
+shard_key_init(void)
+{
+	int err = pthread_key_create(&shard_key, shard_exit);
+
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't create shard_key: %d", err);
+		exit(1);
+	}
+}
+
+/*
+ * shard_mine - the calling thread's counters in a set, zeroed the
+ * first time it asks
+ */
+void *
+shard_mine(
+	struct shard_set *set
+	)
+{
+	struct shard *head, *s;
+	size_t body;
+	void *p;
+
+	pthread_once(&shard_once, shard_key_init);
+	head = pthread_getspecific(shard_key);
+	for (s = head; NULL != s; s = s->next)
+		if (s->set == set)
+			return SHARD_BODY(s);
+
+	body = (set->size + SHARD_ALIGN - 1) & ~(size_t)(SHARD_ALIGN - 1);
+	if (0 != posix_memalign(&p, SHARD_ALIGN, SHARD_HEAD + body)) {
+		msyslog(LOG_ERR, "ERR: fatal out of memory (%lu bytes)",
+			(unsigned long)(SHARD_HEAD + body));
+		exit(1);
+	}
+	memset(p, 0, SHARD_HEAD + body);
+	s = p;
+	s->set = set;
+	s->next = head;
+	pthread_setspecific(shard_key, s);
+	pthread_mutex_lock(&set->lock);
+	s->link = set->shards;
+	set->shards = s;
+	pthread_mutex_unlock(&set->lock);
+	return SHARD_BODY(s);
+}
+
+/*
+ * shard_fold - sum every thread's counters, live and exited, into out
+ */
+void
+shard_fold(
+	struct shard_set *set,
+	void *out
+	)
+{
+	memset(out, 0, set->size);
+	pthread_mutex_lock(&set->lock);
+	if (NULL != set->retired)
+		add_words(out, set->retired, set->size);
+	for (struct shard *s = set->shards; NULL != s; s = s->link)
+		add_words(out, SHARD_BODY(s), set->size);
+	pthread_mutex_unlock(&set->lock);
+}
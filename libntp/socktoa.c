@@ -9,6 +9,7 @@
 #include <netinet/in.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <arpa/inet.h>
 #include "isc_netaddr.h"
 
@@ -105,6 +106,115 @@ sockporttoa_r(
 }
 
 
+/*
+ * The address hashes are SipHash-1-3, keyed at startup, so someone
+ * sending from many spoofed addresses can't aim them all at one hash
+ * chain.  Until sock_hash_init() is called the key is all zeros, which
+ * makes the hashes repeatable for the tests.
+ */
+static uint64_t	hash_key[2];
+
+#define ROTL64(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3)					\
+	do {								\
+		v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0;		\
+		v0 = ROTL64(v0, 32);					\
+		v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;		\
+		v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;		\
+		v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2;		\
+		v2 = ROTL64(v2, 32);					\
+	} while (0)
+
+
+/*
+ * sock_hash_init - pick a new key.  Every table hashed with the old
+ * one has to be rebuilt, so call it before there are any.
+ */
+void
+sock_hash_init(void)
+{
+	ntp_RAND_bytes((unsigned char *)hash_key, (int)sizeof(hash_key));
+}
+
+
+/*
+ * siphash - SipHash-c-d of len bytes at p, a word at a time.  The
+ * rounds are constants at each call, so this folds into the callers.
+ */
+static inline uint64_t
+siphash(
+	const uint64_t	key[2],
+	const void *	p,
+	size_t		len,
+	int		crounds,
+	int		drounds
+	)
+{
+	const uint8_t *	cp = p;
+	uint64_t	v0, v1, v2, v3, m;
+	size_t		left;
+	int		r;
+
+	v0 = key[0] ^ 0x736f6d6570736575ULL;
+	v1 = key[1] ^ 0x646f72616e646f6dULL;
+	v2 = key[0] ^ 0x6c7967656e657261ULL;
+	v3 = key[1] ^ 0x7465646279746573ULL;
+
+	for (left = len; left >= sizeof(m); left -= sizeof(m)) {
+		memcpy(&m, cp, sizeof(m));
+		cp += sizeof(m);
+		v3 ^= m;
+		for (r = 0; r < crounds; r++)
+			SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	m = (uint64_t)len << 56;
+	while (left-- > 0)
+		m |= (uint64_t)cp[left] << (8 * left);
+	v3 ^= m;
+	for (r = 0; r < crounds; r++)
+		SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	for (r = 0; r < drounds; r++)
+		SIPROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+/*
+ * sock_hash_bytes - hash len bytes at p with the startup key
+ */
+unsigned int
+sock_hash_bytes(
+	const void *	p,
+	size_t		len
+	)
+{
+	uint64_t	m = siphash(hash_key, p, len, 1, 3);
+
+	return (unsigned int)(m ^ (m >> 32));
+}
+
+
+/*
+ * sip_hash24 - SipHash-2-4 of len bytes at p under the caller's key,
+ * for when the hash has to stand up as a MAC.  Words are loaded in
+ * host order, so the reference vectors only match little-endian.
+ */
+uint64_t
+sip_hash24(
+	const uint64_t	key[2],
+	const void *	p,
+	size_t		len
+	)
+{
+	return siphash(key, p, len, 2, 4);
+}
+
+
 /*
  * sock_hash - hash a sockaddr_u structure
  */
@@ -113,42 +223,30 @@ sock_hash(
 	const sockaddr_u *addr
 	)
 {
-	unsigned int hashVal;
+	uint8_t buf[sizeof(AF(addr)) + sizeof(SOCK_ADDR6(addr))];
 	size_t len;
-	const uint8_t *pch;
-
-	hashVal = 0;
-	len = 0;
 
 	/*
 	 * We can't just hash the whole thing because there are hidden
 	 * fields in sockaddr_in6 that might be filled in by recvfrom(),
-	 * so just use the family, port and address.
+	 * so just use the family and address.
 	 */
-	pch = (const void *)&AF(addr);
-	hashVal = 37 * hashVal + *pch;
-	if (sizeof(AF(addr)) > 1) {
-		pch++;
-		hashVal = 37 * hashVal + *pch;
-	}
+	memcpy(buf, &AF(addr), sizeof(AF(addr)));
+	len = sizeof(AF(addr));
 	switch(AF(addr)) {
 	case AF_INET:
-		pch = (const void *)&SOCK_ADDR4(addr);
-		len = sizeof(SOCK_ADDR4(addr));
+		memcpy(buf + len, &SOCK_ADDR4(addr), sizeof(SOCK_ADDR4(addr)));
+		len += sizeof(SOCK_ADDR4(addr));
 		break;
 
 	case AF_INET6:
-		pch = (const void *)&SOCK_ADDR6(addr);
-		len = sizeof(SOCK_ADDR6(addr));
+		memcpy(buf + len, &SOCK_ADDR6(addr), sizeof(SOCK_ADDR6(addr)));
+		len += sizeof(SOCK_ADDR6(addr));
 		break;
         default:
                 /* huh? */
                 break;
 	}
 
-	for (unsigned int j = 0; j < len ; j++) {
-		hashVal = 37 * hashVal + pch[j];
-	}
-
-	return hashVal;
+	return sock_hash_bytes(buf, len);
 }
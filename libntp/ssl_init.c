@@ -14,8 +14,6 @@
 #if OPENSSL_VERSION_NUMBER > 0x20000000L
 #include <openssl/params.h>
 #include <openssl/err.h>
-#else
-#include <openssl/cmac.h>
 #endif
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
@@ -23,11 +21,8 @@ static void	atexit_ssl_cleanup(void);
 #endif
 
 static bool ssl_init_done;
-EVP_MD_CTX *digest_ctx;
 #if OPENSSL_VERSION_NUMBER > 0x20000000L
 EVP_MAC_CTX *evp_ctx;
-#else
-CMAC_CTX *cmac_ctx;
 #endif
 
 void
@@ -53,7 +48,6 @@ ssl_init(void)
 	/* RAND_poll in OpenSSL on Raspbian needs get{u,g,eu,eg}id() */
 	ntp_RAND_bytes(&dummy, 1);
 
-	digest_ctx = EVP_MD_CTX_new();
 #if OPENSSL_VERSION_NUMBER > 0x20000000L
 	{
 	EVP_MAC *mac = EVP_MAC_fetch(NULL, "cmac", NULL);
@@ -101,8 +95,6 @@ ssl_init(void)
 		msyslog(LOG_ERR, "ssl_init: second dup failed: %s", str);
 	}
 	}
-#else
-	cmac_ctx = CMAC_CTX_new();
 #endif
 	ssl_init_done = true;
 }
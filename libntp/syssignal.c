@@ -1,5 +1,6 @@
 # include "config.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <signal.h>
@@ -56,3 +57,28 @@ signal_no_reset1(
 }
 #endif
 
+/*
+ * ntp_thread_create - start a thread with every signal blocked, since
+ * signals belong to the main thread.  On failure the error is logged
+ * after tag and returned.
+ */
+int
+ntp_thread_create(
+	pthread_t *	tid,
+	void *		(*func)(void *),
+	void *		arg,
+	const char *	tag
+	)
+{
+	sigset_t	block_mask, saved_sig_mask;
+	int		rc;
+
+	sigfillset(&block_mask);
+	pthread_sigmask(SIG_BLOCK, &block_mask, &saved_sig_mask);
+	rc = pthread_create(tid, NULL, func, arg);
+	pthread_sigmask(SIG_SETMASK, &saved_sig_mask, NULL);
+	if (rc)
+		msyslog(LOG_ERR, "%s: error from pthread_create: %s",
+			tag, strerror(rc));
+	return rc;
+}
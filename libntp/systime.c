@@ -92,7 +92,13 @@ get_systime(
 {
 	struct timespec ts;	/* seconds and nanoseconds */
 	get_ostime(&ts);
-	*now = tspec_stamp_to_lfp(ts);
+	/*
+	 * This is tspec_stamp_to_lfp() without the calls: the clock
+	 * hands back 0 <= tv_nsec < NS_PER_S, so there is nothing for
+	 * normalize_tspec() to do, and TVNTOF()'s division by a constant
+	 * compiles to a multiply and shift.
+	 */
+	*now = lfpinit_u((uint32_t)ts.tv_sec + JAN_1970, TVNTOF(ts.tv_nsec));
 }
 
 
@@ -59,17 +59,19 @@ normalize_tspec(
 	 * loops becomes prohibitive once the upper 32 bits get
 	 * involved. On the other hand, division by constant should be
 	 * fast enough; so we do a division of the nanoseconds in that
-	 * case.
+	 * case.  The sum or difference of two normal values is at most
+	 * a second out, and that is fixed without a branch.
 	 */
-	if (x.tv_nsec < 0 || x.tv_nsec >= NS_PER_S) {
-		ldiv_t	z = ldiv( x.tv_nsec, NS_PER_S);
-		if (z.rem < 0) {
-			z.quot--;
-			z.rem  += NS_PER_S;
-		}
-		x.tv_sec  += z.quot;
-		x.tv_nsec  = z.rem;
+	long	step;
+
+	if (x.tv_nsec < -NS_PER_S || x.tv_nsec >= 2L * NS_PER_S) {
+		step = x.tv_nsec / NS_PER_S;
+		x.tv_sec  += step;
+		x.tv_nsec -= step * NS_PER_S;
 	}
+	step = (x.tv_nsec >= NS_PER_S) - (x.tv_nsec < 0);
+	x.tv_sec  += step;
+	x.tv_nsec -= step * NS_PER_S;
 #else
 	/* since 10**9 is close to 2**32, we don't divide but do a
 	 * normalization in a loop; this takes 3 steps max, and should
@@ -298,6 +300,11 @@ tspec_stamp_to_lfp(
 {
 	l_fp		y;
 
+	/* what the clock and the kernel hand us is already normal */
+	if (timespec_isnormal(&x))
+		return lfpinit_u((uint32_t)x.tv_sec + JAN_1970,
+				 TVNTOF(x.tv_nsec));
+
 	y = tspec_intv_to_lfp(x);
 	bumplfpuint(y, JAN_1970);
 
@@ -311,21 +318,16 @@ lfp_intv_to_tspec(
 	)
 {
 	struct timespec out;
-	l_fp		absx;
-	int		neg;
-
-	neg = L_ISNEG(x);
-	absx = x;
-	if (neg) {
-		L_NEG(absx);
-	}
-	out.tv_nsec = FTOTVN(lfpfrac(absx));
-	out.tv_sec = lfpsint(absx);
-	if (neg) {
-		out.tv_sec = -out.tv_sec;
-		out.tv_nsec = -out.tv_nsec;
-		out = normalize_tspec(out);
-	}
+	/* 1 if x < 0, when ties in the fraction round toward zero */
+	unsigned int	neg = (unsigned int)(x >> 63);
+	uint32_t	ns;
+
+	/* the fraction of the two's complement is already the one
+	 * past the floor, so no negating and normalizing */
+	ns = (uint32_t)(((uint64_t)lfpfrac(x) * NS_PER_S +
+			 0x80000000 - neg) >> 32);
+	out.tv_sec = (time_t)lfpsint(x) + (ns >= NS_PER_S);
+	out.tv_nsec = (long)ns - (ns >= NS_PER_S) * NS_PER_S;
 
 	return out;
 }
@@ -7,19 +7,6 @@
 #include "config.h"
 #include "binio.h"
 
-int16_t
-get_lsb_int16(
-	unsigned char **bufpp
-	)
-{
-	int16_t retval;
-
-	retval  = *((*bufpp)++);
-	retval |= *((*bufpp)++) << 8;
-
-	return retval;
-}
-
 void
 put_lsb_uint16(
 	unsigned char **bufpp,
@@ -30,21 +17,6 @@ put_lsb_uint16(
 	*((*bufpp)++) = (unsigned char) ((val >> 8) & 0xFF);
 }
 
-int32_t
-get_lsb_int32(
-	unsigned char **bufpp
-	)
-{
-	int32_t retval;
-
-	retval  = *((*bufpp)++);
-	retval |= *((*bufpp)++) << 8;
-	retval |= *((*bufpp)++) << 16;
-	retval |= *((*bufpp)++) << 24;
-
-	return retval;
-}
-
 unsigned short
 get_msb_ushort(
 	 unsigned char *p
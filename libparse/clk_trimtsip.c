@@ -25,6 +25,7 @@
 #include "ieee754io.h"
 #include "trimble.h"
 #include "gpstolfp.h"
+#include "tsip_frame.h"
 
 /*
  * Trimble low level TSIP parser / time converter
@@ -63,8 +64,7 @@ static offsets_t trim_offsets = { 0, 1, 2, 3, 4, 5, 6, 7 };
 
 struct trimble
 {
-	uint8_t  t_in_pkt;	/* first DLE received */
-	uint8_t  t_dle;		/* subsequent DLE received */
+	struct tsip_framer t_frame;	/* DLE framing state */
 	unsigned short t_week;		/* GPS week */
 	unsigned short t_weekleap;	/* GPS week of next/last week */
 	unsigned short t_dayleap;	/* day in week */
@@ -105,65 +105,45 @@ inp_tsip(
 	)
 {
 	struct trimble *t = (struct trimble *)parseio->parse_pdata;
+	uint8_t c = (uint8_t)ch;
+	uint8_t state;
+	int event;
+	size_t len;
 
 	if (!t)
 		return PARSE_INP_SKIP;		/* local data not allocated - sigh! */
 
-	if (!t->t_in_pkt && ch != DLE) {
-		/* wait for start of packet */
+	/*
+	 * Frame straight into the data area, with room for the DLE in
+	 * front and the DLE ETX behind, which cvt_trimtsip() checks.
+	 */
+	if (parseio->parse_dsize < 4)
 		return PARSE_INP_SKIP;
+	t->t_frame.buf = (uint8_t *)parseio->parse_data + 1;
+	t->t_frame.size = parseio->parse_dsize - 3U;
+
+	state = t->t_frame.state;
+	tsip_frame(&t->t_frame, &c, 1, &event);
+	if (TSIP_ID == state && TSIP_DATA == t->t_frame.state) {
+		/* pick up time stamp at packet start */
+		parseio->parse_dtime.parse_stime = *tstamp;
 	}
-
-	if ((parseio->parse_index >= (parseio->parse_dsize - 2)) ||
-	    (parseio->parse_dtime.parse_msglen >= (sizeof(parseio->parse_dtime.parse_msg) - 2)))
-	{		/* OVERFLOW - DROP! */
-		t->t_in_pkt = t->t_dle = 0;
-		parseio->parse_index = 0;
-		parseio->parse_dtime.parse_msglen = 0;
+	if (TSIP_PACKET != event)
 		return PARSE_INP_SKIP;
-	}
-
-	switch (ch) {
-	    case DLE:
-		if (!t->t_in_pkt) {
-			t->t_dle = 0;
-			t->t_in_pkt = 1;
-			parseio->parse_index = 0;
-			parseio->parse_data[parseio->parse_index++] = ch;
-			parseio->parse_dtime.parse_msglen = 0;
-			parseio->parse_dtime.parse_msg[parseio->parse_dtime.parse_msglen++] = (unsigned char)ch;
-			parseio->parse_dtime.parse_stime = *tstamp; /* pick up time stamp at packet start */
-		} else if (t->t_dle) {
-			/* Double DLE -> insert a DLE */
-			t->t_dle = 0;
-			parseio->parse_data[parseio->parse_index++] = DLE;
-			parseio->parse_dtime.parse_msg[parseio->parse_dtime.parse_msglen++] = DLE;
-		} else {
-			t->t_dle = 1;
-		}
-		break;
-
-	    case ETX:
-		if (t->t_dle) {
-			/* DLE,ETX -> end of packet */
-			parseio->parse_data[parseio->parse_index++] = DLE;
-			parseio->parse_data[parseio->parse_index] = ch;
-			parseio->parse_ldsize = (unsigned short) (parseio->parse_index + 1);
-			memcpy(parseio->parse_ldata, parseio->parse_data, parseio->parse_ldsize);
-			parseio->parse_dtime.parse_msg[parseio->parse_dtime.parse_msglen++] = DLE;
-			parseio->parse_dtime.parse_msg[parseio->parse_dtime.parse_msglen++] = (unsigned char)ch;
-			t->t_in_pkt = t->t_dle = 0;
-			return PARSE_INP_TIME|PARSE_INP_DATA;
-		}
-		/*FALLTHROUGH*/
-
-	    default:		/* collect data */
-		t->t_dle = 0;
-		parseio->parse_data[parseio->parse_index++] = ch;
-		parseio->parse_dtime.parse_msg[parseio->parse_dtime.parse_msglen++] = (unsigned char)ch;
-	}
 
-	return PARSE_INP_SKIP;
+	len = t->t_frame.len;
+	parseio->parse_data[0] = DLE;
+	parseio->parse_data[len + 1] = DLE;
+	parseio->parse_data[len + 2] = ETX;
+	parseio->parse_index = (unsigned short)(len + 2);
+	parseio->parse_ldsize = (unsigned short)(len + 3);
+	memcpy(parseio->parse_ldata, parseio->parse_data, parseio->parse_ldsize);
+	len = parseio->parse_ldsize;
+	if (len > sizeof(parseio->parse_dtime.parse_msg))
+		len = sizeof(parseio->parse_dtime.parse_msg);
+	memcpy(parseio->parse_dtime.parse_msg, parseio->parse_data, len);
+	parseio->parse_dtime.parse_msglen = (unsigned short)len;
+	return PARSE_INP_TIME|PARSE_INP_DATA;
 }
 
 /*
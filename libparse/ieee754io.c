@@ -11,8 +11,6 @@
 #include "ntp_fp.h"
 #include "ieee754io.h"
 
-static uint64_t get_byte (unsigned char *, offsets_t, int *);
-
 #ifdef DEBUG_PARSELIB
 
 #include "lib_strbuf.h"
@@ -89,20 +87,6 @@ fmt_hex(
 
 #endif
 
-static uint64_t
-get_byte(
-         unsigned char *bufp,
-         offsets_t offset,
-         int *fieldindex
-         )
-{
-	unsigned char val;
-
-	val = *(bufp + offset[*fieldindex]);
-	(*fieldindex)++;
-	return val;
-}
-
 /*
  * make conversions to and from external IEEE754 formats and internal
  * NTP FP format.
@@ -117,80 +101,62 @@ fetch_ieee754(
 {
 	unsigned char *bufp = *buffpp;
 	bool sign;
+	int length;                     /* 4 or 8 bytes */
 	int bias;                       /* bias 127 or 1023 */
 	int maxexp;
 	int mbits;                      /* length of mantissa, 23 or 52 */
+	uint64_t bits;                  /* the number, most significant byte first */
 	uint64_t mantissa;              /* mantissa, 23 or 52 bits used, +1 */
 	int characteristic;             /* biased exponent, 0 to 255 or 2047 */
 	int exponent;                   /* unbiased exponent */
 	int maxexp_lfp;                 /* maximum exponent that fits in an l_fp */
-	unsigned char val;
-	int fieldindex = 0;             /* index into bufp */
 	int fudge;                      /* shift difference of l_fp and IEEE */
 	int shift;                      /* amount to shift IEEE to get l_fp */
 
 
 	*lfpp = 0;          /* return zero for all errors: NAN, +INF, -INF, etc. */
 
-	/* fetch sign byte & first part of characteristic */
-	val = (unsigned char)get_byte(bufp, offsets, &fieldindex);
-
-	sign = (val & 0x80) != 0;
-	characteristic = (val & 0x7F);
-
-	/* fetch rest of characteristic and start of mantissa */
-	val = (unsigned char)get_byte(bufp, offsets, &fieldindex);
-
 	switch (size) {
 	    case IEEE_DOUBLE:
+		length = 8;
 		fudge = -20;
 		maxexp_lfp = 31;
 		mbits  = 52;
 		bias   = 1023;
 		maxexp = 2047;
-		characteristic <<= 4;
-		/* grab lower characteristic bits */
-		characteristic  |= (val & 0xF0) >> 4;
-
-		mantissa  = (val & 0x0FULL) << 48;
-		mantissa |= get_byte(bufp, offsets, &fieldindex) << 40;
-		mantissa |= get_byte(bufp, offsets, &fieldindex) << 32;
-
-		mantissa |= get_byte(bufp, offsets, &fieldindex) << 24;
-		mantissa |= get_byte(bufp, offsets, &fieldindex) << 16;
-		mantissa |= get_byte(bufp, offsets, &fieldindex) << 8;
-		mantissa |= get_byte(bufp, offsets, &fieldindex);
 		break;
 
 	    case IEEE_SINGLE:
+		length = 4;
 		fudge = 9;
 		maxexp_lfp = 30;
 		mbits  = 23;
 		bias   = 127;
 		maxexp = 255;
-		characteristic <<= 1;
-		/* grab last characteristic bit from 2nd byte */
-		characteristic |= (val & 0x80) ? 1 : 0 ;
-
-		mantissa   = (val & 0x7FU) << 16;
-		mantissa  |= get_byte(bufp, offsets, &fieldindex) << 8;
-		mantissa  |= get_byte(bufp, offsets, &fieldindex);
 		break;
 
 	    default:
 		return IEEE_BADCALL;
 	}
 
+	/*
+	 * Gather the bytes in the order the offsets give in one pass,
+	 * then cut the fields out of the word, rather than assemble
+	 * each field from the bytes it straddles.
+	 */
+	bits = 0;
+	for (int i = 0; i < length; i++) {
+		bits = (bits << 8) | bufp[offsets[i]];
+	}
+	sign = (bits >> (8 * length - 1)) & 1;
+	characteristic = (int)((bits >> mbits) & (uint64_t)maxexp);
+	mantissa = bits & ((1ULL << mbits) - 1);
+
 	exponent = characteristic - bias;
 	shift = exponent + fudge;
 
 #ifdef DEBUG_PARSELIB
 	if ( debug > 4) { /* SPECIAL DEBUG */
-		int length = 8;
-		if ( IEEE_SINGLE == size ) {
-			length = 4;
-		}
-
 		printf("\nfetchieee754: FP: %s -> %s\n", fmt_hex(*buffpp, length),
 		       fmt_flt(sign, mantissa, characteristic, length));
 		printf("fetchieee754: Char: %d, Exp: %d, mbits %d, shift %d\n",
@@ -198,7 +164,7 @@ fetch_ieee754(
 	}
 #endif
 
-	*buffpp += fieldindex;
+	*buffpp += length;
 
 	/* detect funny numbers */
 	if (characteristic == maxexp) {
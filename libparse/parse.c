@@ -68,6 +68,8 @@ parse_ioinit(
 
 	parseio->parse_badformat = 0;
 	parseio->parse_ioflags   = PARSE_IO_CS7;	/* usual unix default */
+	parseio->parse_chmask    = 0x7F;
+	parseio->parse_fmt       = NULL;
 	parseio->parse_index     = 0;
 	parseio->parse_ldsize    = 0;
 
@@ -168,48 +170,35 @@ parse_ioread(
 	timestamp_t *tstamp
 	)
 {
+	const clockformat_t *fmt = parseio->parse_fmt;
 	unsigned int updated = CVT_NONE;
+
 	/*
 	 * within STREAMS CSx (x < 8) chars still have the upper bits set
 	 * so we normalize the characters by masking unnecessary bits off.
+	 * The mask is worked out by parse_setcs(), not for every character.
 	 *
 	 * (ESR, 2015: Probably not necessary since STREAMS support has
 	 * been removed, but harmless.)
 	 */
-	switch (parseio->parse_ioflags & PARSE_IO_CSIZE) {
-	    case PARSE_IO_CS5:
-		ch &= 0x1F;
-		break;
-
-	    case PARSE_IO_CS6:
-		ch &= 0x3F;
-		break;
-
-	    case PARSE_IO_CS7:
-		ch &= 0x7F;
-		break;
-
-	    case PARSE_IO_CS8:
-		ch &= (char) 0xFFU;
-		break;
-
-            default:
-                /* huh? */
-                break;
-	}
+	ch = (char)(ch & parseio->parse_chmask);
 
 	parseprintf(DD_PARSE, ("parse_ioread(0x%lx, char=0x%x, ..., ...)\n",
                     (unsigned long)parseio, (unsigned)(ch & 0xFF)));
 
-	if (!clockformats[parseio->parse_lformat]->convert) {
+	/*
+	 * The format is fixed when the unit is set up; parse_setfmt()
+	 * leaves it here so we needn't look it up for every character.
+	 */
+	if (NULL == fmt || !fmt->convert) {
 		parseprintf(DD_PARSE, ("parse_ioread: input dropped.\n"));
 		return CVT_NONE;
 	}
 
-	if (clockformats[parseio->parse_lformat]->input) {
+	if (fmt->input) {
 		unsigned long input_status;
 
-		input_status = clockformats[parseio->parse_lformat]->input(parseio, ch, tstamp);
+		input_status = fmt->input(parseio, ch, tstamp);
 
 		if (input_status & PARSE_INP_SYNTH) {
 			updated = CVT_OK;
@@ -492,20 +481,19 @@ timepacket(
 	parse_t *parseio
 	)
 {
-	unsigned short format;
+	const clockformat_t *fmt = parseio->parse_fmt;
 	time_t t;
 	unsigned long cvtrtc;		/* current conversion result */
 	clocktime_t clock_time;
 
 	memset((char *)&clock_time, 0, sizeof clock_time);
-	format = parseio->parse_lformat;
 
-	if (format == (unsigned short)~0) {
+	if (NULL == fmt) {
 		return CVT_NONE;
 	}
 
-	switch ((cvtrtc = clockformats[format]->convert ?
-		 clockformats[format]->convert((unsigned char *)parseio->parse_ldata, parseio->parse_ldsize, (struct format *)(clockformats[format]->data), &clock_time, parseio->parse_pdata) :
+	switch ((cvtrtc = fmt->convert ?
+		 fmt->convert((unsigned char *)parseio->parse_ldata, parseio->parse_ldsize, (struct format *)(fmt->data), &clock_time, parseio->parse_pdata) :
 		 CVT_NONE) & CVT_MASK)
 	{
 	case CVT_FAIL:
@@ -527,7 +515,7 @@ timepacket(
 
 	default:
 		/* shouldn't happen */
-		msyslog(LOG_WARNING, "ERR: parse: INTERNAL error: bad return code of convert routine \"%s\"", clockformats[format]->name);
+		msyslog(LOG_WARNING, "ERR: parse: INTERNAL error: bad return code of convert routine \"%s\"", fmt->name);
 		return CVT_FAIL|cvtrtc;
 	}
 
@@ -541,7 +529,7 @@ timepacket(
 	struct timespec ts = {t, clock_time.usecond * 1000};
 	parseio->parse_dtime.parse_time = tspec_stamp_to_lfp(ts);
 
-	parseio->parse_dtime.parse_format       = format;
+	parseio->parse_dtime.parse_format       = parseio->parse_lformat;
 
 	return updatetimeinfo(parseio, clock_time.flags);
 }
@@ -628,6 +616,7 @@ parse_setfmt(
 					parse->parse_ldata     = parse->parse_data + parse->parse_dsize + 1;
 
 					parse->parse_lformat  = i;
+					parse->parse_fmt      = clockformats[i];
 
 					return true;
 				}
@@ -665,6 +654,24 @@ parse_setcs(
 {
 	parse->parse_ioflags &= ~PARSE_IO_CSIZE;
 	parse->parse_ioflags |= (int) (dct->parsesetcs.parse_cs & PARSE_IO_CSIZE);
+
+	switch (parse->parse_ioflags & PARSE_IO_CSIZE) {
+	    case PARSE_IO_CS5:
+		parse->parse_chmask = 0x1F;
+		break;
+
+	    case PARSE_IO_CS6:
+		parse->parse_chmask = 0x3F;
+		break;
+
+	    case PARSE_IO_CS7:
+		parse->parse_chmask = 0x7F;
+		break;
+
+	    default:
+		parse->parse_chmask = 0xFF;
+		break;
+	}
 	return true;
 }
 
@@ -0,0 +1,157 @@
+/*
+ * tsip_frame.c - find Trimble TSIP packets in serial input
+ *
+ * A TSIP packet is <DLE><id> ... <data> ... <DLE><ETX>, with each DLE
+ * in the data doubled.  Rather than stepping a state machine over
+ * every byte, tsip_frame() looks for the next DLE (or parity mark)
+ * with memchr() and copies the plain run before it in one go, so a
+ * packet costs a few calls however long it is.  The state only has to
+ * carry over when a read ends in the middle of a packet.
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include "config.h"
+
+#include <string.h>
+
+#include "tsip_frame.h"
+
+#define PARITY_MARK	0xff
+
+void
+tsip_framer_init(
+	struct tsip_framer *f,
+	uint8_t *buf,
+	size_t size,
+	bool parmrk
+	)
+{
+	f->buf = buf;
+	f->size = size;
+	f->len = 0;
+	f->state = TSIP_IDLE;
+	f->parmrk = parmrk;
+	f->starts = 0;
+}
+
+/* The byte after a lone DLE: the ID of a new packet, or noise */
+static void
+start_packet(
+	struct tsip_framer *f,
+	uint8_t id
+	)
+{
+	if (0 == id || TSIP_DLE == id || TSIP_ETX == id) {
+		f->state = TSIP_IDLE;
+		return;
+	}
+	f->buf[0] = id;
+	f->len = 1;
+	f->state = TSIP_DATA;
+	f->starts++;
+}
+
+static bool
+append(
+	struct tsip_framer *f,
+	const uint8_t *data,
+	size_t n
+	)
+{
+	if (n > f->size - f->len) {
+		f->state = TSIP_IDLE;
+		return false;
+	}
+	memcpy(f->buf + f->len, data, n);
+	f->len += n;
+	return true;
+}
+
+/*
+ * tsip_frame - take in up to n bytes, stopping early after the end of
+ * a packet or an error.  Returns how many bytes it used and says why
+ * it stopped in *event; on TSIP_PACKET the packet is in f->buf, ID
+ * first, f->len bytes in all, until the next call.
+ */
+size_t
+tsip_frame(
+	struct tsip_framer *f,
+	const uint8_t *in,
+	size_t n,
+	int *event
+	)
+{
+	const uint8_t *p = in, *end = in + n, *q, *r;
+	uint8_t b;
+
+	*event = TSIP_MORE;
+	while (p < end) {
+		switch (f->state) {
+		case TSIP_ID:
+			start_packet(f, *p++);
+			break;
+
+		case TSIP_DATA:
+			q = memchr(p, TSIP_DLE, (size_t)(end - p));
+			if (NULL == q)
+				q = end;
+			if (f->parmrk) {
+				r = memchr(p, PARITY_MARK, (size_t)(q - p));
+				if (NULL != r)
+					q = r;
+			}
+			if (!append(f, p, (size_t)(q - p))) {
+				*event = TSIP_OVERSIZE;
+				return (size_t)(q - in);
+			}
+			p = q;
+			if (p < end)
+				f->state = (TSIP_DLE == *p++) ?
+					TSIP_STUFF : TSIP_MARK;
+			break;
+
+		case TSIP_STUFF:
+			b = *p++;
+			if (TSIP_ETX == b) {
+				f->state = TSIP_IDLE;
+				*event = TSIP_PACKET;
+				return (size_t)(p - in);
+			} else if (TSIP_DLE == b) {
+				if (!append(f, &b, 1)) {
+					*event = TSIP_OVERSIZE;
+					return (size_t)(p - in);
+				}
+				f->state = TSIP_DATA;
+			} else {
+				/* a DLE that wasn't stuffed starts a packet */
+				start_packet(f, b);
+			}
+			break;
+
+		case TSIP_MARK:
+			b = *p++;
+			if (PARITY_MARK != b) {
+				f->state = TSIP_IDLE;
+				*event = TSIP_PARITY;
+				return (size_t)(p - in);
+			}
+			if (!append(f, &b, 1)) {
+				*event = TSIP_OVERSIZE;
+				return (size_t)(p - in);
+			}
+			f->state = TSIP_DATA;
+			break;
+
+		case TSIP_IDLE:
+		default:
+			q = memchr(p, TSIP_DLE, (size_t)(end - p));
+			if (NULL == q)
+				return n;
+			p = q + 1;
+			f->state = TSIP_ID;
+			break;
+		}
+	}
+	return n;
+}
@@ -59,107 +59,171 @@ except ImportError as e:
 # The one new option in this version is -p, borrowed from ntpdate.
 
 
-def read_append(s, packets, packet, sockaddr):
-    d, a = s.recvfrom(1024)
+def take_reply(d, server, sockaddr):
+    "A SyncPacket from the reply d, checking its MAC if we have keys."
     if debug >= 2:
         ntp.packet.dump_hex_printable(d)
+    pkt = ntp.packet.SyncPacket(d)
     if credentials:
         if not ntp.packet.Authenticator.have_mac(d):
             if debug:
-                log("no MAC on reply from %s" % packet.hostname)
+                log("no MAC on reply from %s" % server)
         if not credentials.verify_mac(d, packet_end=48, mac_begin=48):
-            packet.trusted = False
+            pkt.trusted = False
             log("MAC verification on reply from %s failed"
                 % sockaddr[0])
         elif debug:
             log("MAC verification on reply from %s succeeded"
                 % sockaddr[0])
-    pkt = ntp.packet.SyncPacket(d)
     pkt.hostname = server
     pkt.resolved = sockaddr[0]
-    packets.append(pkt)
-    return packets
+    return pkt
 
 
-def queryhost(server, concurrent, timeout=5, port=123, bindaddr=None):
-    "Query IP addresses associated with a specified host."
+def resolve(server, port=123):
+    "The addresses of a host, as getaddrinfo() has them, or []."
     try:
-        iptuples = socket.getaddrinfo(server, port,
-                                      af, socket.SOCK_DGRAM,
-                                      socket.IPPROTO_UDP)
+        return socket.getaddrinfo(server, port, af, socket.SOCK_DGRAM,
+                                  socket.IPPROTO_UDP)
     except socket.gaierror as e:
         log("lookup of %s failed, errno %d = %s" % (server, e.args[0], e.args[1]))
         return []
+
+
+def make_socket(family, socktype, bindaddr=None):
+    "A socket to send requests from, or None if it can't be had."
+    try:
+        s = socket.socket(family, socktype)
+    except OSError:
+        if debug:
+            log("Skipping because socket of family"
+                " %d, type %d could not be formed." % (family, socktype))
+        return None
     if bindaddr:
         try:
             bindsock = socket.getaddrinfo(bindaddr,None,af,
                                           socket.SOCK_DGRAM,socket.IPPROTO_UDP)
         except socket.gaierror as e:
-            log("lookup of %s failed, errno %d = %s" % (server, e.args[0], e.args[1]))
+            log("lookup of %s failed, errno %d = %s" % (bindaddr, e.args[0], e.args[1]))
             raise SystemExit(1)
-    sockets = []
-    packets = []
+        try:
+            if debug:
+                log("Binding to Source IP %s," % bindaddr)
+            s.bind(bindsock[0][4])
+        except OSError as e:
+            log("binding to %s failed, errno %d = %s" % (bindaddr, e.args[0], e.args[1]))
+            raise SystemExit(1)
+    return s
+
+
+def make_request():
+    """A request stamped with the time now, and that stamp, which the
+    reply carries back as its origin timestamp."""
     request = ntp.packet.SyncPacket()
     request.transmit_timestamp = ntp.packet.SyncPacket.posix_to_ntp(
         time.time())
     packet = request.flatten()
-    needgap = (len(iptuples) > 1) and (gap > 0)
+    if keyid and keytype and passwd:
+        if debug:
+            log("authenticating with %s key %d" % (keytype, keyid))
+        mac = ntp.packet.Authenticator.compute_mac(packet,
+                                                   keyid, keytype, passwd)
+        if mac is None:
+            log("MAC generation failed")
+            raise SystemExit(1)
+        packet += mac
+    return (packet, request.transmit_timestamp)
+
+
+def send_request(s, server, sockaddr):
+    "Send a fresh request, returning its transmit stamp, None on failure."
+    (packet, stamp) = make_request()
+    try:
+        s.sendto(packet, sockaddr)
+    except socket.error as e:
+        if debug:
+            log("socket error on transmission: %s" % e)
+        return None
+    if debug >= 2:
+        log("Sent to %s:" % (sockaddr[0],))
+        ntp.packet.dump_hex_printable(packet)
+    return stamp
+
+
+def queryhost(server, timeout=5, port=123, bindaddr=None):
+    "Query IP addresses associated with a specified host, one at a time."
+    packets = []
     firstloop = True
-    for (family, socktype, proto, canonname, sockaddr) in iptuples:
-        if needgap and not firstloop:
+    for (family, socktype, proto, canonname, sockaddr) in resolve(server,
+                                                                  port):
+        if gap > 0 and not firstloop:
             time.sleep(gap)
-        if firstloop:
-            firstloop = False
+        firstloop = False
         if debug:
             log("querying %s (%s)" % (sockaddr[0], server))
-        try:
-            s = socket.socket(family, socktype)
-        except OSError:
+        s = make_socket(family, socktype, bindaddr)
+        if s is None:
+            continue
+        if send_request(s, server, sockaddr) is not None:
+            r, _, _ = select.select([s], [], [], timeout)
+            if r:
+                d, a = s.recvfrom(1024)
+                packets.append(take_reply(d, server, sockaddr))
+        s.close()
+    return packets
+
+
+def queryhosts(servers, timeout=5, port=123, bindaddr=None):
+    """Query every address of every server at once.  Requests go out
+    gap apart, from one socket per address family, and replies are
+    read as they come, until all are in or timeout after the last
+    request, so a pool takes one timeout however many it has."""
+    targets = []
+    for server in servers:
+        for (family, socktype, _, _, sockaddr) in resolve(server, port):
+            targets.append((server, family, socktype, sockaddr))
+    sockets = {}    # family: socket
+    pending = {}    # (address, port): (server, transmit stamp)
+    packets = []
+    nextsend = deadline = time.time()
+    while targets or (pending and time.time() < deadline):
+        now = time.time()
+        if targets and now >= nextsend:
+            (server, family, socktype, sockaddr) = targets.pop(0)
+            if family not in sockets:
+                sockets[family] = make_socket(family, socktype, bindaddr)
+            if sockets[family] is None:
+                continue
             if debug:
-                log("Skipping because socket for %s of family"
-                    " %d, type %d could not be formed." %
-                    (sockaddr[0], family, socktype))
+                log("querying %s (%s)" % (sockaddr[0], server))
+            stamp = send_request(sockets[family], server, sockaddr)
+            if stamp is not None:
+                pending[sockaddr[:2]] = (server, stamp)
+                nextsend = now + gap
+                deadline = now + timeout
             continue
-        if bindaddr:
+        # Read what comes in until the next request or the deadline
+        wait = (nextsend if targets else deadline) - now
+        live = [s for s in sockets.values() if s is not None]
+        r, _, _ = select.select(live, [], [], max(wait, 0))
+        for s in r:
+            d, sockaddr = s.recvfrom(1024)
+            sent = pending.get(sockaddr[:2])
             try:
+                if sent is None:
+                    raise ntp.packet.SyncException("not asked")
+                pkt = take_reply(d, sent[0], sockaddr)
+                if pkt.origin_timestamp != sent[1]:
+                    raise ntp.packet.SyncException("not our request")
+            except ntp.packet.SyncException as e:
                 if debug:
-                    log("Binding to Source IP %s," % bindaddr)
-                s.bind(bindsock[0][4])
-            except OSError as e:
-                log("binding to %s failed, errno %d = %s" % (bindaddr, e.args[0], e.args[1]))
-                raise SystemExit(1)
-        if keyid and keytype and passwd:
-            if debug:
-                log("authenticating with %s key %d" % (keytype, keyid))
-            mac = ntp.packet.Authenticator.compute_mac(packet,
-                                                       keyid, keytype, passwd)
-            if mac is None:
-                log("MAC generation failed while querying %s" % server)
-                raise SystemExit(1)
-            else:
-                packet += mac
-        try:
-            s.sendto(packet, sockaddr)
-        except socket.error as e:
-            if debug:
-                log("socket error on transmission: %s" % e)
-            continue
-        if debug >= 2:
-            log("Sent to %s:" % (sockaddr[0],))
-            ntp.packet.dump_hex_printable(packet)
-        if concurrent:
-            sockets.append(s)
-        else:
-            r, _, _ = select.select([s], [], [], timeout)
-            if r:
-                read_append(s, packets, packet, sockaddr)
-        while sockets:
-            r, _, _ = select.select(sockets, [], [], timeout)
-            if not r:
-                return packets
-            for s in sockets:
-                read_append(s, packets, packet, sockaddr)
-                sockets.remove(s)
+                    log("dropping reply from %s: %s" % (sockaddr[0], e))
+                continue
+            del pending[sockaddr[:2]]
+            packets.append(pkt)
+    for s in sockets.values():
+        if s is not None:
+            s.close()
     return packets
 
 
@@ -416,7 +480,7 @@ if __name__ == '__main__':
             sys.stderr.write("-a option requires -k.\n")
             raise SystemExit(1)
 
-        if not arguments:
+        if not arguments and not concurrent_hosts:
             arguments = ["localhost"]
 
         if replay:
@@ -433,19 +497,16 @@ if __name__ == '__main__':
                     time.sleep(gap)
                 if firstloop:
                     firstloop = False
-                for server in concurrent_hosts:
+                if concurrent_hosts:
                     try:
-                        returned += queryhost(server=server,
-                                              concurrent=True,
-                                              timeout=timeout,
-                                              bindaddr=bindaddr)
+                        returned += queryhosts(servers=concurrent_hosts,
+                                               timeout=timeout,
+                                               bindaddr=bindaddr)
                     except ntp.packet.SyncException as e:
                         log(str(e))
-                        continue
                 for server in arguments:
                     try:
                         returned += queryhost(server=server,
-                                              concurrent=False,
                                               timeout=timeout,
                                               bindaddr=bindaddr)
                     except ntp.packet.SyncException as e:
@@ -0,0 +1,163 @@
+#! @PYSHEBANG@
+# -*- coding: utf-8 -*-
+
+# Copyright the NTPsec project contributors
+#
+# SPDX-License-Identifier: BSD-2-Clause
+
+'''
+ntpkeydb - compile an NTP keys file for fast loading
+
+Reads a keys file in the usual text format and writes the same keys
+in the compiled format that ntpd maps instead of parsing.  The rules
+are those of ntpd's own keys file reader: key numbers run 1 to 65535,
+a key of up to 20 characters is ASCII and a longer one is hex, and
+when a key number appears twice the later line wins.
+
+The output is written to a temporary file and renamed into place, so
+a running ntpd never sees a partial file.
+'''
+
+from __future__ import print_function
+
+import getopt
+import io
+import os
+import re
+import stat
+import struct
+import sys
+
+MAGIC = b"NTPKEYDB"
+VERSION = 1
+NAMELEN = 32    # bytes per key type name, NUL padded
+MAXNAMES = 255
+MAXKEYID = 65535
+MAXKEY = 32     # bytes of key, Bug 2537
+
+usage = '''\
+usage: ntpkeydb [-hV] keysfile outfile
+'''
+
+
+def warn(line, msg):
+    "Complain about a line of the keys file."
+    sys.stderr.write("ntpkeydb: line %d: %s\n" % (line, msg))
+
+
+def parse(fp):
+    "Return a dictionary of keyid: (type, key bytes) from a keys file."
+    keys = {}
+    for (lineno, line) in enumerate(fp, 1):
+        fields = line.split("#", 1)[0].split()
+        if not fields:
+            continue
+        m = re.match(r"[0-9]+", fields[0])
+        keyid = int(m.group(0)) if m else 0
+        if keyid == 0:
+            warn(lineno, "cannot change key %s" % fields[0])
+            continue
+        if keyid > MAXKEYID:
+            warn(lineno, "key %s > %d reserved" % (fields[0], MAXKEYID))
+            continue
+        if len(fields) < 2:
+            warn(lineno, "no key type for key %d" % keyid)
+            continue
+        keytype = fields[1].upper()
+        if len(keytype) >= NAMELEN:
+            warn(lineno, "key type too long for key %d" % keyid)
+            continue
+        if len(fields) < 3:
+            warn(lineno, "no key for key %d" % keyid)
+            continue
+        text = fields[2]
+        if len(text) <= 20:
+            key = text.encode("latin-1", "replace")
+        else:
+            if len(text) > 2 * MAXKEY:
+                warn(lineno, "key %d truncated to %d bytes"
+                     % (keyid, 2 * MAXKEY))
+                text = text[:2 * MAXKEY]
+            if not re.match(r"^[0-9a-fA-F]*$", text):
+                warn(lineno, "invalid hex digit for key %d" % keyid)
+                continue
+            key = bytes(bytearray.fromhex(text[:len(text) & ~1]))
+        keys[keyid] = (keytype, key)
+    return keys
+
+
+def compile_keys(keys):
+    "Return the compiled keys file for a dictionary from parse()."
+    names = sorted(set(keytype for (keytype, key) in keys.values()))
+    if len(names) > MAXNAMES:
+        sys.stderr.write("ntpkeydb: too many key types\n")
+        raise SystemExit(1)
+    nameidx = dict((name, i) for (i, name) in enumerate(names))
+    slots = [0] * (MAXKEYID + 1)
+    records = []
+    for keyid in sorted(keys):
+        (keytype, key) = keys[keyid]
+        records.append(struct.pack(">BB%ds" % MAXKEY,
+                                   nameidx[keytype], len(key), key))
+        slots[keyid] = len(records)
+    out = [MAGIC, struct.pack(">III", VERSION, len(names), len(records))]
+    for name in names:
+        out.append(struct.pack("%ds" % NAMELEN, name.encode("latin-1")))
+    out.append(struct.pack(">%dI" % len(slots), *slots))
+    out.extend(records)
+    return b"".join(out)
+
+
+def write_file(filename, data):
+    "Write data to filename, atomically, readable only by the owner."
+    tmpname = "%s.%d" % (filename, os.getpid())
+    orig_umask = os.umask(stat.S_IRWXG | stat.S_IRWXO)
+    try:
+        with open(tmpname, "wb") as wp:
+            wp.write(data)
+            wp.flush()
+            os.fsync(wp.fileno())
+        os.rename(tmpname, filename)
+    except (IOError, OSError) as e:
+        sys.stderr.write("ntpkeydb: %s: %s\n" % (filename, e))
+        try:
+            os.remove(tmpname)
+        except OSError:
+            pass
+        raise SystemExit(1)
+    finally:
+        os.umask(orig_umask)
+
+
+if __name__ == '__main__':
+    try:
+        (options, arguments) = getopt.getopt(sys.argv[1:], "hV",
+                                             ["help", "version"])
+    except getopt.GetoptError as e:
+        print(e)
+        raise SystemExit(1)
+
+    for (switch, val) in options:
+        if switch in ("-h", "--help"):
+            print(usage, end="")
+            raise SystemExit(0)
+        elif switch in ("-V", "--version"):
+            print("ntpkeydb ntpsec-@NTPSEC_VERSION_EXTENDED@")
+            raise SystemExit(0)
+
+    if len(arguments) != 2:
+        sys.stderr.write(usage)
+        raise SystemExit(1)
+
+    try:
+        with io.open(arguments[0], "r", encoding="latin-1") as fp:
+            keys = parse(fp)
+    except (IOError, OSError) as e:
+        sys.stderr.write("ntpkeydb: %s: %s\n" % (arguments[0], e))
+        raise SystemExit(1)
+    write_file(arguments[1], compile_keys(keys))
+    sys.stderr.write("ntpkeydb: %d keys written to %s\n"
+                     % (len(keys), arguments[1]))
+    raise SystemExit(0)
+
+# end
@@ -6,7 +6,8 @@
 # SPDX-License-Identifier: BSD-2-Clause
 
 """\
-usage: ntplogtemp [-h] [-l LOGFILE] [-o] [-q] [-v] [-w WAIT] [-V]
+usage: ntplogtemp [-h] [-l LOGFILE] [-o] [-q] [-s SMARTWAIT] [-v] [-w WAIT]
+                  [-V]
 
 Program to log system temperatures
 
@@ -16,6 +17,9 @@ optional arguments:
                         append log data to LOGFILE instead of stdout
   -o, --once            Run the output once and exit
   -q, --quiet           be quite
+  -s SMARTWAIT, --smartwait SMARTWAIT
+                        Set delay time in seconds between smartctl runs,
+                        default is 1800
   -v, --verbose         be verbose
   -w WAIT, --wait WAIT  Set delay time in seconds, default is 60
   -V, --version         show program's version number and exit
@@ -33,8 +37,14 @@ import os
 import re
 import subprocess
 import sys
+import threading
 import time
 
+try:
+    import queue
+except ImportError:
+    import Queue as queue       # Python 2
+
 
 class logfile_header_class(logging.handlers.TimedRotatingFileHandler):
     'A class to modify the file logging handler.'
@@ -75,12 +85,48 @@ Return output if good, None if bad
     return output
 
 
+def numeric_key(path):
+    "Sort key putting hwmon10 after hwmon9"
+    return [int(x) if x.isdigit() else x for x in re.split(r'(\d+)', path)]
+
+
+class SysfsTemps:
+    """\
+Temperature attributes in sysfs, in millidegrees.  The files are kept
+open and read again in place, so a sample costs a read() each.
+"""
+
+    def __init__(self, paths):
+        self.fds = []
+        for path in sorted(paths, key=numeric_key):
+            try:
+                self.fds.append(os.open(path, os.O_RDONLY))
+            except OSError:
+                # not readable, leave it out
+                continue
+
+    def read(self):
+        "The readings in degrees, None for any that failed this time"
+        temps = []
+        for fd in self.fds:
+            try:
+                os.lseek(fd, 0, os.SEEK_SET)
+                temps.append(int(os.read(fd, 32)) / 1000)
+            except (OSError, ValueError):
+                temps.append(None)
+        return temps
+
+
 class CpuTemp:
-    "Sensors on the CPU Core"
+    "Sensors on the CPU Core, read from /sys/class/hwmon as sensors does"
     has_sensors = False
 
     def __init__(self):
-        # check for sensors binary
+        self.hwmon = SysfsTemps(glob.glob('/sys/class/hwmon/hwmon*/'
+                                          'temp*_input'))
+        if self.hwmon.fds:
+            return
+        # no hwmon here, check for sensors binary
         ret = run_binary(["sensors", "-h"])
         if ret is not None:
             self.has_sensors = True
@@ -90,6 +136,11 @@ class CpuTemp:
 
     def get_data(self):
         "Collects the data and return the output as an array"
+        _now = int(time.time())
+        if self.hwmon.fds:
+            return ['%d LM%d %s' % (_now, i, temp)
+                    for (i, temp) in enumerate(self.hwmon.read())
+                    if temp is not None]
         if not self.has_sensors:
             return None
 
@@ -102,7 +153,6 @@ class CpuTemp:
             for record in output:
                 match = self._pattern.match(record)
                 if match and match.group(1):
-                    _now = int(time.time())
                     _cpu_temperature = match.group(1)
                     _data.append('%d LM%s %s' % (_now, _index,
                                                  _cpu_temperature))
@@ -117,11 +167,17 @@ class CpuTemp:
 
 
 class SmartCtl:
-    "Sensor on the Hard Drive"
+    """\
+Sensor on the Hard Drive.  Drive temperatures change slowly and
+smartctl is costly, so unless logging once it runs every SMARTWAIT
+seconds in a thread of its own, and each reading is logged once.
+"""
     _drives = []
     has_smartctl = False
 
-    def __init__(self):
+    def __init__(self, background):
+        self.background = background
+        self._readings = queue.Queue()
         ret = run_binary(["smartctl", "-h"])
         if ret is not None:
             self.has_smartctl = True
@@ -133,12 +189,20 @@ class SmartCtl:
             for child in glob.glob('/dev/nvme?n?'):
                 self._drives.append(child)
             self._drives = sorted(self._drives)
-
-    def get_data(self):
-        "Collects the data and return the output as an array"
-        if not self.has_smartctl:
-            return None
-
+            if background:
+                poller = threading.Thread(target=self._poller)
+                poller.daemon = True
+                poller.start()
+
+    def _poller(self):
+        "Put readings in the queue every SMARTWAIT seconds"
+        while self._drives:
+            for reading in self._poll():
+                self._readings.put(reading)
+            time.sleep(args.smartwait[0])
+
+    def _poll(self):
+        "Run smartctl on each drive"
         data = []
         for _device in self._drives[:]:
             output = run_binary(["smartctl", "-A", _device])
@@ -160,6 +224,20 @@ class SmartCtl:
                         break
         return data
 
+    def get_data(self):
+        "Collects the data and return the output as an array"
+        if not self.has_smartctl:
+            return None
+        if not self.background:
+            return self._poll()
+
+        data = []
+        while True:
+            try:
+                data.append(self._readings.get_nowait())
+            except queue.Empty:
+                return data
+
 
 class Temper:
     """\
@@ -209,27 +287,15 @@ class ZoneTemp:
     "Zone sensors"
 
     def __init__(self):
-        base_dir = '/sys/class/thermal/thermal_zone?/'
-        self.zones = []
-        for child in glob.glob(base_dir):
-            self.zones.append(child)
+        self.zones = SysfsTemps(glob.glob('/sys/class/thermal/'
+                                          'thermal_zone*/temp'))
 
     def get_data(self):
         "Collects the data and return the output as an array"
-        _zone = 0
-        _data = []
-        for zone in self.zones:
-            try:
-                with open(os.path.join(zone, 'temp')) as _zone_data:
-                    for line in _zone_data:
-                        temp = float(line) / 1000
-                        _now = int(time.time())
-                        _data.append('%d ZONE%s %s' % (_now, _zone, temp))
-                        _zone += 1
-            except OSError:
-                # temp might not be readable, if so continue on to the next one
-                continue
-        return _data
+        _now = int(time.time())
+        return ['%d ZONE%d %s' % (_now, i, temp)
+                for (i, temp) in enumerate(self.zones.read())
+                if temp is not None]
 
 
 # Work with argvars
@@ -247,6 +313,13 @@ parser.add_argument('-q', '--quiet',
                     action="store_true",
                     dest='quiet',
                     help="be quite")
+parser.add_argument('-s', '--smartwait',
+                    default=[1800],
+                    dest='smartwait',
+                    help="Set delay time in seconds between smartctl runs, "
+                         "default is 1800",
+                    nargs=1,
+                    type=int)
 parser.add_argument('-v', '--verbose',
                     action="store_true",
                     dest='verbose',
@@ -290,10 +363,9 @@ def logging_setup():
 
 
 def logData(log, data):
-    "log the data"
-    if data is not None:
-        for _item in data:
-            log.info(_item)
+    "log the data, in one write"
+    if data:
+        log.info("\n".join(data))
 
 
 def log_data():
@@ -301,7 +373,7 @@ def log_data():
     # Create objects
     cpu = CpuTemp()
     zone = ZoneTemp()
-    hdd = SmartCtl()
+    hdd = SmartCtl(background=not args.once)
     temper = Temper()
 
     # Create the logger instance
@@ -312,10 +384,10 @@ def log_data():
 
     # Write data to their respective logs
     while True:
-        logData(Logger, zone.get_data())
-        logData(Logger, cpu.get_data())
-        logData(Logger, hdd.get_data())
-        logData(Logger, temper.get_data())
+        data = []
+        for sensor in (zone, cpu, hdd, temper):
+            data += sensor.get_data() or []
+        logData(Logger, data)
         if args.once:
             sys.exit(0)
         time.sleep(args.wait[0])
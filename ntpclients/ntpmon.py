@@ -72,6 +72,10 @@ except ImportError as e:
 
 stdscr = None
 
+# Seconds between full reads of the peers; in between, only the
+# associations that changed are read again.
+FULL_REFRESH = 300
+
 
 def iso8601(t):
     "ISO8601 string from Unix time."
@@ -268,6 +272,8 @@ if __name__ == '__main__':
         logfp = open(defaultlog, "a", 1)
 
     poll_interval = 1
+    peers = None
+    full_refresh = 0
     helpmode = selectmode = detailmode = False
     selected = -1
     peer_report = ntp.util.PeerSummary(displaymode="peers",
@@ -300,7 +306,13 @@ if __name__ == '__main__':
                 else:
                     if showpeers:
                         try:
-                            peers = session.readstat()
+                            # Only what changed, with a full read now
+                            # and then in case something was missed
+                            if ntp.util.monoclock() >= full_refresh:
+                                peers = None
+                                full_refresh = (ntp.util.monoclock() +
+                                                FULL_REFRESH)
+                            peers = session.refreshpeers(peers, raw=True)
                         except ntp.packet.ControlException as e:
                             raise Fatal(e.message)
                         except IOError as e:
@@ -315,27 +327,16 @@ if __name__ == '__main__':
                         raise Fatal("no peers reported")
                     try:
                         initphase = False
+                        peer_report.prefetch([peer.variables
+                                              for peer in peers
+                                              if peer.variables])
                         for (i, peer) in enumerate(peers):
                             if (not showall and not (
                                     ntp.control.CTL_PEER_STATVAL(peer.status) &
                                     (ntp.control.CTL_PST_CONFIG |
                                      ntp.control.CTL_PST_REACH))):
                                 continue
-                            try:
-                                variables = session.readvar(peer.associd,
-                                                            raw=True)
-                            except ntp.packet.ControlException as e:
-                                if e.errorcode == ntp.control.CERR_BADASSOC:
-                                    # Probable race condition due to pool
-                                    # dropping an association during refresh;
-                                    # ignore. (GitLab issue #374.)
-                                    break
-                                raise Fatal(e.message + "\n")
-                            except IOError as e:
-                                raise Fatal(e.strerror)
-                            except IndexError:
-                                raise Fatal(
-                                    "no 'hpoll' variable in peer response")
+                            variables = peer.variables
                             if not variables:
                                 continue
                             if selectmode and selected == i:
@@ -343,7 +344,7 @@ if __name__ == '__main__':
                                 hilite = curses.A_REVERSE
                             else:
                                 hilite = curses.A_NORMAL
-                            data = peer_report.summary(session.rstatus,
+                            data = peer_report.summary(peer.status,
                                                        variables,
                                                        peer.associd)
                             data = data.encode('UTF-8')
@@ -398,6 +399,7 @@ if __name__ == '__main__':
                             strconvert = ntp.util.MRUSummary.header + "\n"
                             stdscr.addstr(strconvert.encode('UTF-8'),
                                           curses.A_BOLD)
+                            mru_report.prefetch(span.entries)
                             for entry in reversed(span.entries):
                                 strcon = mru_report.summary(entry) + "\n"
                                 stdscr.addstr(strcon.encode('UTF-8'))
@@ -217,7 +217,18 @@ usage: help [ command ]
             self.say(display + "\n")
 
     def __dopeers(self, showall, mode):
-        if not self.__dogetassoc():
+        try:
+            self.peers = self.session.readpeers(raw=True)
+        except ntp.packet.ControlException as e:
+            self.warn(e.message)
+            return
+        except IOError as e:
+            self.warn(e.strerror)
+            return
+        if not self.peers:
+            if self.chosts:
+                self.say("server=%s " % self.session.hostname)
+            self.say("No association IDs returned\n")
             return
         report = ntp.util.PeerSummary(mode,
                                       self.pktversion,
@@ -238,6 +249,8 @@ usage: help [ command ]
                 maxhostlen = max([len(host) for (host, _af) in self.chosts])
                 self.say("=" * (maxhostlen + 1))
             self.say(("=" * report.width()) + "\n")
+            report.prefetch([peer.variables for peer in self.peers
+                             if peer.variables])
             for peer in self.peers:
                 if (not showall and
                     not (ntp.control.CTL_PEER_STATVAL(peer.status) &
@@ -246,14 +259,7 @@ usage: help [ command ]
                     if self.debug:
                         self.warn("eliding [%d]\n" % peer.associd)
                     continue
-                try:
-                    variables = self.session.readvar(peer.associd, raw=True)
-                except ntp.packet.ControlException as e:
-                    self.warn(e.message)
-                    return
-                except IOError as e:
-                    self.warn(e.strerror)
-                    return
+                variables = peer.variables
                 if not variables:
                     if len(self.chosts) > 1:
                         self.warn("server=%s " % self.session.hostname)
@@ -264,7 +270,7 @@ usage: help [ command ]
                     self.say(ntp.util.PeerSummary.high_truncate(
                              self.session.hostname, maxhostlen) + " " *
                              (maxhostlen + 1 - len(self.session.hostname)))
-                self.say(report.summary(self.session.rstatus,
+                self.say(report.summary(peer.status,
                                         variables, peer.associd))
         except KeyboardInterrupt:
             pass
@@ -1418,6 +1424,7 @@ usage: doflake <probability>
                     # reversed puts most recent entries at the top if no sort=
                     # see sort comments in pylib/packet.py
                     formatter.now = span.now
+                    formatter.prefetch(span.entries)
                     for entry in reversed(span.entries):
                         self.say(formatter.summary(entry) + "\n")
                     self.say("# Collected %d slots in %.3f seconds\n"
@@ -1471,6 +1478,33 @@ usage: mrulist [tag=value] [tag=value] [tag=value] [tag=value]
         self.say("""\
 function: show statistics for each local address ntpd is using
 usage: ifstats
+""")
+
+    def do_pkttrace(self, line):
+        "show the packets ntpd received and sent last"
+        try:
+            self.session.password()
+            entries = self.session.pkttrace()
+            if self.rawmode:
+                for entry in entries:
+                    self.say("%s\n" % entry)
+            else:
+                formatter = ntp.util.PkttraceSummary()
+                self.say(ntp.util.PkttraceSummary.header)
+                self.say(("=" * ntp.util.PkttraceSummary.width) + "\n")
+                newest = max([e.stamp for e in entries] or [0])
+                for entry in entries:
+                    self.say(formatter.summary(newest, entry))
+        except ntp.packet.ControlException as e:
+            self.warn(e.message)
+            return
+        except IOError:
+            self.warn("***Can't read control key from /etc/ntp.conf")
+
+    def help_pkttrace(self):
+        self.say("""\
+function: show the packets ntpd received and sent last
+usage: pkttrace
 """)
 
     def do_reslist(self, line):
@@ -1563,6 +1597,19 @@ usage: kerninfo
         sysstats = (
             ("ss_uptime",    "uptime:               ", NTP_UPTIME),
             ("ss_numctlreq", "control requests:     ", NTP_INT),
+            ("ss_numctllimited", "control rate limited: ", NTP_INT),
+            ("mem_mru",       "bytes MRU:            ", NTP_INT),
+            ("mem_mru_peak",  "bytes MRU peak:       ", NTP_INT),
+            ("mem_restrict",  "bytes restrict:       ", NTP_INT),
+            ("mem_restrict_peak", "bytes restrict peak:  ", NTP_INT),
+            ("mem_peer",      "bytes peers:          ", NTP_INT),
+            ("mem_peer_peak", "bytes peers peak:     ", NTP_INT),
+            ("mem_recvbuf",   "bytes recvbufs:       ", NTP_INT),
+            ("mem_recvbuf_peak", "bytes recvbufs peak:  ", NTP_INT),
+            ("mem_keys",      "bytes keys:           ", NTP_INT),
+            ("mem_keys_peak", "bytes keys peak:      ", NTP_INT),
+            ("mem_nts",       "bytes NTS:            ", NTP_INT),
+            ("mem_nts_peak",  "bytes NTS peak:       ", NTP_INT),
         )
         sysstats2 = (
             ("ss_reset",     "sysstats reset:       ", NTP_UPTIME),
@@ -1579,6 +1626,8 @@ usage: kerninfo
             ("ss_restricted","restricted:           ", NTP_PACKETS),
             ("ss_limited",   "rate limited:         ", NTP_PACKETS),
             ("ss_kodsent",   "KoD responses:        ", NTP_PACKETS),
+            ("ss_kodlimited"," KoD over budget:     ", NTP_PACKETS),
+            ("ss_duplicate", "duplicate requests:   ", NTP_PACKETS),
             ("ss_processed", "processed for time:   ", NTP_PACKETS),
         )
         self.collect_display(associd=0, variables=sysstats, decodestatus=False)
@@ -1605,11 +1654,17 @@ usage: sysstats
             ("mru_minage",      "reclaim minage:       ", NTP_UPTIME),
             ("mru_mem",         "kilobytes:            ", NTP_INT),
             ("mru_maxmem",      "maximum kilobytes:    ", NTP_INT),
+            ("mru_arenamem",    "arena kilobytes:      ", NTP_INT),
+            ("mru_arenaused",   "arena kilobytes used: ", NTP_INT),
+            ("mru_arenahuge",   "arena huge pages:     ", NTP_INT),
             ("mru_exists",      "alloc: exists:        ", NTP_INT),
             ("mru_new",         "alloc: new:           ", NTP_INT),
             ("mru_recycleold",  "alloc: recycle old:   ", NTP_INT),
             ("mru_recyclefull", "alloc: recycle full:  ", NTP_INT),
+            ("mru_expired",     "expired by timer:     ", NTP_INT),
             ("mru_none",        "alloc: none:          ", NTP_INT),
+            ("mru_sketchmem",   "sketch kilobytes:     ", NTP_INT),
+            ("mru_sketched",    "judged by sketch:     ", NTP_INT),
             ("mru_oldest_age",  "age of oldest slot:   ", NTP_UPTIME),
         )
         self.collect_display(associd=0, variables=monstats, decodestatus=False)
@@ -1682,6 +1737,7 @@ usage: authinfo
    ("nts_ke_serves_bad",         "NTS KE serves bad:          ", NTP_UINT),
    ("nts_ke_serves_bad_wall",    "NTS KE serves bad wall:     ", NTP_FLOAT),
    ("nts_ke_serves_bad_cpu",     "NTS KE serves bad CPU:      ", NTP_FLOAT),
+   ("nts_ke_serves_limited",     "NTS KE serves rate limited: ", NTP_UINT),
    ("nts_ke_probes_good",        "NTS KE client probes good:  ", NTP_UINT),
    ("nts_ke_probes_bad",         "NTS KE client probes bad:   ", NTP_UINT),
   )
@@ -1729,6 +1785,10 @@ usage: mssntpinfo
             ("rbuf_lowater", "low water refills:    ", NTP_INT),
             ("io_dropped", "dropped packets:      ", NTP_PACKETS),
             ("io_ignored", "ignored packets:      ", NTP_PACKETS),
+            ("io_shed", "shed flood packets:   ", NTP_PACKETS),
+            ("io_overload_shed", "shed when overloaded: ", NTP_PACKETS),
+            ("io_overloads", "times overloaded:     ", NTP_INT),
+            ("io_bpf_dropped", "dropped in kernel:    ", NTP_PACKETS),
             ("io_received", "received packets:     ", NTP_PACKETS),
             ("io_sent", "packets sent:         ", NTP_PACKETS),
             ("io_sendfailed", "packet send failures: ", NTP_PACKETS),
@@ -1761,6 +1821,29 @@ function: display interval timer counters
 usage: timerstats
 """)
 
+    def do_cpustats(self, _line):
+        "display where ntpd's main thread spends its time"
+        cpustats = (
+            ("ss_uptime", "uptime:     ", NTP_UPTIME),
+            ("cpu_idle", "idle:       ", NTP_FLOAT),
+            ("cpu_receive", "receive:    ", NTP_FLOAT),
+            ("cpu_transmit", "transmit:   ", NTP_FLOAT),
+            ("cpu_timer", "timer:      ", NTP_FLOAT),
+            ("cpu_control", "control:    ", NTP_FLOAT),
+            ("cpu_refclock", "refclock:   ", NTP_FLOAT),
+            ("cpu_stats", "stats:      ", NTP_FLOAT),
+            ("cpu_other", "other:      ", NTP_FLOAT),
+        )
+        self.collect_display(associd=0, variables=cpustats,
+                             decodestatus=False)
+
+    def help_cpustats(self):
+        self.say("""\
+function: display where ntpd's main thread spends its time, in seconds
+usage: cpustats
+""")
+
+
 
 # Default values we use.
 DEFHOST = "localhost"    # default host name
@@ -44,13 +44,25 @@ snmpSysUptime = (1, 3, 6, 1, 2, 1, 1, 3, 0)
 DEFHOST = "localhost"
 DEFLOG = "ntpsnmpd.log"
 
+# What the MIB callbacks read, fetched from ntpd once per cache period
+SNAPSHOT_SYSVARS = ("fuzz", "io_received", "io_sent", "koffset", "leap",
+                    "peeradr", "precision", "reftime", "rootdisp",
+                    "rootdist", "ss_badauth", "ss_badformat", "ss_oldver",
+                    "ss_reset", "stratum")
+SNAPSHOT_PEERVARS = ("badauth", "bogusorg", "delay", "jitter", "offset",
+                     "received", "refid", "rootdisp", "selbroken",
+                     "seldisp", "sent", "srcadr", "stratum")
+
 
 class DataSource(ntp.agentx.MIBControl):
     def __init__(self, hostname=DEFHOST, settingsFile=None, notifySpin=0.1):
         # This is defined as a dict tree because it is simpler, and avoids
         # certain edge cases
         # OIDs are relative from ntp root
-        ntp.agentx.MIBControl.__init__(self, mibRoot=ntpRootOID)
+        # The peer tables only change with the snapshot, so the walked
+        # tree is good for as long
+        ntp.agentx.MIBControl.__init__(self, mibRoot=ntpRootOID,
+                                       treeCacheTTL=1)
         # MIB node init
         # block 0
         self.addNode((0,))  # ntpEntNotifications
@@ -161,7 +173,10 @@ class DataSource(ntp.agentx.MIBControl):
         # Cache so we don't hammer ntpd, default 1 second timeout
         # Timeout default pulled from a hat: we don't want it to last for
         # long, just not flood ntpd with duplicatte requests during a walk.
+        # Everything ntpd knows is read into one snapshot per period, so
+        # a walk costs a few queries instead of one per OID.
         self.cache = ntp.util.Cache(1)
+        self.snapshotSysvars = list(SNAPSHOT_SYSVARS)
         self.oldValues = {}  # Used by notifications to detect changes
         # spinGap so we don't spam ntpd with requests during notify checks
         self.notifySpinTime = notifySpin
@@ -267,10 +282,10 @@ class DataSource(ntp.agentx.MIBControl):
     def cbr_statusNumRefSources(self, oid):
         # range of uint32
         try:
-            data = self.session.readstat()
-            return ax.Varbind(ax.VALUE_GAUGE32, oid, len(data))
+            peers = self.misc_getSnapshot()["peerdata"]
         except ntp.packet.ControlException:
             return None
+        return ax.Varbind(ax.VALUE_GAUGE32, oid, len(peers))
 
     def cbr_statusDispersion(self, oid):
         # DisplayString
@@ -900,15 +915,13 @@ class DataSource(ntp.agentx.MIBControl):
 
     def misc_getMode(self):  # FIXME: not fully implemented
         try:
-            # Don't care about the data, this is a ploy to get the rstatus
-            self.session.readvar(0, ["stratum"])
+            rstatus = self.misc_getSnapshot()["sysstatus"]
         except ntp.packet.ControlException as e:
             if e.message == ntp.packet.SERR_SOCKET:
                 # Can't connect, ntpd probably not running
                 return 1
             else:
                 raise e
-        rstatus = self.session.rstatus  # a ploy to get the system status
         source = ntp.control.CTL_SYS_SOURCE(rstatus)
         if source == ntp.control.CTL_SST_TS_UNSPEC:
             mode = 2  # Not yet synced
@@ -942,11 +955,26 @@ class DataSource(ntp.agentx.MIBControl):
 
     def safeReadvar(self, associd, variables=None, raw=False):
         # Use this when we want to catch packet errors, but don't care
-        # about what they are
+        # about what they are.  Served from the snapshot, so only the
+        # variables it holds can be asked for.
         try:
-            return self.session.readvar(associd, varlist=variables, raw=raw)
+            snapshot = self.misc_getSnapshot()
         except ntp.packet.ControlException:
             return None
+        if associd == 0:
+            data = snapshot["sysvars"]
+        elif associd in snapshot["peerdata"]:
+            data = snapshot["peerdata"][associd]
+        else:
+            return None
+        if variables is None:
+            variables = [x for x in data if x != "peerstatus"]
+        result = {}
+        for name in variables:
+            if name not in data:
+                return None
+            result[name] = data[name] if raw else data[name][0]
+        return result
 
     def dynamicCallbackPeerdata(self, variable, raw, valueType):
         rawindex = 1 if raw else 0
@@ -966,8 +994,10 @@ class DataSource(ntp.agentx.MIBControl):
             # last number in the OID is the index.
             index = oid.subids[-1]  # if called properly this works (Ha!)
             index -= 1  # SNMP reserves index 0, effectively 1-based lists
-            associd = self.misc_getPeerIDs()[index]
-            return handler(oid, associd)
+            associds = self.misc_getPeerIDs()
+            if index >= len(associds):  # gone since the tree was walked
+                return None
+            return handler(oid, associds[index])
         subs = {}
         associds = self.misc_getPeerIDs()  # need the peer count
         for i in range(len(associds)):
@@ -983,32 +1013,50 @@ class DataSource(ntp.agentx.MIBControl):
         else:
             return ax.Varbind(dataType, oid, data[varname])
 
-    def misc_getPeerIDs(self):
-        peerids = self.cache.get("peerids")
-        if peerids is None:
+    def misc_getSnapshot(self):
+        """The system and peer variables ntpd had at most a cache period
+        ago, raw, or throw an exception."""
+        snapshot = self.cache.get("snapshot")
+        if snapshot is None:
             try:
-                peerids = [x.associd for x in self.session.readstat()]
-            except ntp.packet.ControlException:
-                peerids = []
-            peerids.sort()
-            self.cache.set("peerids", peerids)
+                sysvars = self.session.readvar(0, self.snapshotSysvars,
+                                               raw=True)
+            except ntp.packet.ControlException as e:
+                if e.errorcode != ntp.control.CERR_UNKNOWNVAR:
+                    raise e
+                # One this ntpd lacks spoils them all, stop asking for it
+                known = []
+                for name in self.snapshotSysvars:
+                    try:
+                        self.session.readvar(0, [name])
+                        known.append(name)
+                    except ntp.packet.ControlException:
+                        pass
+                self.snapshotSysvars = known
+                sysvars = self.session.readvar(0, self.snapshotSysvars,
+                                               raw=True)
+            snapshot = {"sysvars": sysvars,
+                        "sysstatus": self.session.rstatus,
+                        "peerdata": {}}
+            for peer in self.session.readpeers(SNAPSHOT_PEERVARS, raw=True):
+                peer.variables["peerstatus"] = peer.status
+                snapshot["peerdata"][peer.associd] = peer.variables
+            self.cache.set("snapshot", snapshot)
+        return snapshot
+
+    def misc_getPeerIDs(self):
+        try:
+            peerids = list(self.misc_getSnapshot()["peerdata"].keys())
+        except ntp.packet.ControlException:
+            peerids = []
+        peerids.sort()
         return peerids
 
     def misc_getPeerData(self):
-        peerdata = self.cache.get("peerdata")
-        if peerdata is None:
-            associds = self.misc_getPeerIDs()
-            peerdata = {}
-            for aid in associds:
-                try:
-                    pdata = self.safeReadvar(aid, raw=True)
-                    pdata["peerstatus"] = self.session.rstatus
-                except IOError:
-                    continue
-                peerdata[aid] = pdata
-            self.cache.set("peerdata", peerdata)
-        return peerdata
-
+        try:
+            return self.misc_getSnapshot()["peerdata"]
+        except ntp.packet.ControlException:
+            return {}
 
 def connect(address):
     try:
@@ -11,6 +11,7 @@ USAGE: ntpsweep [-<flag> [<val>] | --<name>[{=| }<val>]]... [hostfile]
     -m, --maxlevel=num         Traverse peers up to this level
                                    (4 is a reasonable number)
     -s, --strip=str            Strip this string from hostnames
+    -j, --jobs=num             Query up to this many hosts at once
     -V, --version              Output version information and exit
 
 Options are specified by doubled hyphens and their name or by a single
@@ -29,7 +30,6 @@ hyphen and the flag character.
 
 from __future__ import print_function
 
-import os
 import sys
 import getopt
 
@@ -43,76 +43,106 @@ except ImportError as e:
     sys.exit(1)
 
 
-def ntp_peers(host):
-    """Return: a list of peer IP addrs for a specified host,
-            empty list if query failed.
-    """
-    try:
-        with os.popen("ntpq -npw " + host) as rp:
-            hostlines = rp.readlines()[2:]      # Drop display header
-            # Strip tally mark from first field
-            return [ln.split()[0][1:] for
-                    ln in hostlines if ln[0] in " x.-+#*o"]
-    except OSError:
-        return []
+def shorten(sysvars):
+    "Return: the line of host info to print for a host's system vars."
+    stratum = sysvars.get('stratum', 0)
+    if not stratum:
+        # Stratum level 0 is considered invalid
+        return " ?"
+    offset = sysvars.get('offset', 0)
+    daemonversion = str(sysvars.get('version', ""))
+    system = str(sysvars.get('system', ""))
+    processor = str(sysvars.get('processor', ""))
+
+    # Shorten daemon_version string.
+    # daemonversion =~ s/(|Mon|Tue|Wed|Thu|Fri|Sat|Sun).*$//
+    daemonversion = daemonversion.replace("version=", "")
+    daemonversion = daemonversion.replace("ntpd ", "")
+    daemonversion = daemonversion.replace("(", "").replace(")", "")
+    daemonversion = daemonversion.replace("beta", "b")
+    daemonversion = daemonversion.replace("multicast", "mc")
+
+    # Shorten system string. Note, the assumptions here
+    # are very old, reflecting ancient big-iron Unixes
+    system = system.replace("UNIX/", "")
+    system = system.replace("RELEASE", "r")
+    system = system.replace("CURRENT", "c")
+
+    # Shorten processor string
+    processor = processor.replace("unknown", "")
+
+    return "%2d %9.3f %-11s %-12s %s"  \
+           % (stratum, offset, daemonversion[:11],
+              system[:12], processor[0:9])
+
+
+def probe_hosts(hosts):
+    """Ask all the hosts not asked already for their system variables,
+    and their peers if we are recursing, jobs hosts at a time."""
+    unknown = []
+    for host in hosts:
+        if host not in known_host_info:
+            known_host_info[host] = " ?"
+            unknown.append(host)
+    hosts = unknown
+    for start in range(0, len(hosts), jobs):
+        sessions = []
+        for host in hosts[start:start + jobs]:
+            session = ntp.packet.ControlSession()
+            try:
+                session.openhost(host)
+            except ntp.packet.ControlException as e:
+                known_host_errors[host] = e.message
+            sessions.append(session)
+        try:
+            mux = ntp.packet.ControlMux(sessions)
+            replies = mux.readvar()
+            asked = []
+            for (session, host, sysvars) in zip(sessions, hosts[start:],
+                                                replies):
+                if isinstance(sysvars, ntp.packet.ControlException):
+                    known_host_errors.setdefault(host, sysvars.message)
+                    continue
+                known_host_info[host] = shorten(sysvars)
+                if sysvars.get('version') and recurse:
+                    asked.append((session, host))
+            if asked:
+                # Consider doing something more intelligent on failure
+                # than simply returning an empty list.  Though it might
+                # be the right thing to do under modern conditions in
+                # which most hosts will refuse to be queried.
+                mux = ntp.packet.ControlMux([a[0] for a in asked])
+                for ((_, host), peers) in zip(asked,
+                                              mux.readpeers(["srcadr"])):
+                    if isinstance(peers, ntp.packet.ControlException):
+                        peers = []
+                    known_host_peers[host] = [
+                        str(peer.variables.get("srcadr", ""))
+                        for peer in peers]
+        finally:
+            for session in sessions:
+                session.close()
+
+
+def is_legacy(peer):
+    "Return: True if a peer address is one to sweep."
+    # FIXME: Ugh! Magic-address assumption.
+    # Needed to deal with peers running legacy NTP.
+    # Might cause problems in the future.  First
+    # part of the guard is an attempt to skip
+    # NTPsec-style clock IDs.
+    return (peer[:1].isdigit() and not peer.startswith("127")
+            and peer != "0.0.0.0")
 
 
 def scan_host(host, level):
-    stratum = 0
-    offset = 0
-    daemonversion = ""
-    system = ""
-    processor = ""
-    known_host = False
-
-    if host in known_host_info:
-        known_host = True
-    else:
-        session = ntp.packet.ControlSession()
-        session.openhost(host)
-        sysvars = session.readvar()
-
-        # got answers ? If so, go on.
-        if isinstance(sysvars, dict):
-            stratum = sysvars['stratum']
-            offset = sysvars['offset']
-            daemonversion = sysvars['version']
-            system = sysvars['system']
-            processor = sysvars['processor']
-
-            # Shorten daemon_version string.
-            # daemonversion =~ s/(|Mon|Tue|Wed|Thu|Fri|Sat|Sun).*$//
-            daemonversion = daemonversion.replace("version=", "")
-            daemonversion = daemonversion.replace("ntpd ", "")
-            daemonversion = daemonversion.replace("(", "").replace(")", "")
-            daemonversion = daemonversion.replace("beta", "b")
-            daemonversion = daemonversion.replace("multicast", "mc")
-
-            # Shorten system string. Note, the assumptions here
-            # are very old, reflecting ancient big-iron Unixes
-            system = system.replace("UNIX/", "")
-            system = system.replace("RELEASE", "r")
-            system = system.replace("CURRENT", "c")
-
-            # Shorten processor string
-            processor = processor.replace("unknown", "")
-
-        # got answers ? If so, go on.
-        if daemonversion and recurse:
-            # Consider doing something more intelligent on failure
-            # than simply returning an empty list.  Though it might
-            # be the right thing to do under modern conditions in
-            # which most hosts will refuse to be queried.
-            known_host_peers[host] = ntp_peers(host)
-
-        # Collect info on host
-        if stratum:
-            known_host_info[host] = "%2d %9.3f %-11s %-12s %s"  \
-                                    % (stratum, offset, daemonversion[:11],
-                                       system[:12], processor[0:9])
-        else:
-            # Stratum level 0 is considered invalid
-            known_host_info[host] = " ?"
+    known_host = host in scanned
+    scanned.add(host)
+    probe_hosts([host])
+    if host in known_host_errors:
+        sys.stderr.write(known_host_errors.pop(host) + "\n")
+        return
+    stratum = known_host_info[host] != " ?"
 
     if stratum or known_host:   # Valid or known host
         printhost = (' ' * level) + (ntp.util.canonicalize_dns(host) or host)
@@ -127,8 +157,12 @@ def scan_host(host, level):
         print("%-32s %s" % (printhost[:32], known_host_info[host]))
         if recurse and (maxlevel == 0 or level < maxlevel):
             trace.append(host)
+            peers = known_host_peers.get(host, [])
+            # Ask all the peers at once, before printing any of them
+            probe_hosts([peer for peer in peers
+                         if peer not in trace and is_legacy(peer)])
             # Loop through peers
-            for peer in known_host_peers[host]:
+            for peer in peers:
                 if peer in trace:
                     # we've detected a loop!
                     printhost = (' ' * (level + 1)) + "= " + peer
@@ -136,14 +170,8 @@ def scan_host(host, level):
                     if strip:
                         printhost = printhost.replace(strip, "")
                     print("%-32s" % printhost[:32])
-                else:
-                    # FIXME: Ugh! Magic-address assumption.
-                    # Needed to deal with peers running legacy NTP.
-                    # Might cause problems in the future.  First
-                    # part of the guard is an attempt to skip
-                    # NTPsec-style clock IDs.
-                    if peer[0].isdigit() and not peer.startswith("127"):
-                        scan_host(peer, level + 1)
+                elif is_legacy(peer):
+                    scan_host(peer, level + 1)
     else:   # We did not get answers from this host
         printhost = (' ' * level) + (ntp.util.canonicalize_dns(host) or host)
         if strip:
@@ -156,18 +184,23 @@ if __name__ == '__main__':
     ntp.util.stdversioncheck(bin_ver)
     try:
         (options, arguments) = getopt.getopt(
-            sys.argv[1:], "h:l:m:ps:?V",
-            ["host=", "host-list=", "maxlevel=", "peers", "strip=", "version"])
+            sys.argv[1:], "h:j:l:m:ps:?V",
+            ["host=", "host-list=", "jobs=", "maxlevel=", "peers", "strip=",
+             "version"])
     except getopt.GetoptError as err:
         sys.stderr.write(str(err) + "\n")
         raise SystemExit(1)
     hostlist = []
+    jobs = 256
     maxlevel = 1
     recurse = False
     strip = ""
     for (switch, val) in options:
         if switch == "-h" or switch == "--host":
             hostlist = [val]
+        elif switch == "-j" or switch == "--jobs":
+            errmsg = "Error: -j parameter '%s' not a number\n"
+            jobs = max(1, ntp.util.safeargcast(val, int, errmsg, __doc__))
         elif switch == "-l" or switch == "--host-list":
             hostlist = val.split(",")
         elif switch == "-m" or switch == "--maxlevel":
@@ -202,7 +235,10 @@ Host                             st offset(s) version     system       processor
 
     known_host_info = {}
     known_host_peers = {}
+    known_host_errors = {}
+    scanned = set()
     trace = []
+    probe_hosts(hostlist)
     for host in hostlist:
         try:
             scan_host(host, 0)
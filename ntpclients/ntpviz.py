@@ -43,12 +43,14 @@ Python by ESR, concept and gnuplot code by Dan Drown.
 
 from __future__ import print_function, division
 
+import array
 import atexit
 import binascii
 import collections
 import csv
 import datetime
 import math
+import multiprocessing.pool
 import re
 import os
 import socket
@@ -199,8 +201,16 @@ class RunningStats(object):
             # no data??
             return
 
+        numpy = ntp.statfiles.numpy
         self.mu = sum(values) / self.num
-        self.variance = sum(pow((v-self.mu), 2) for v in values) / self.num
+        if numpy is not None:
+            # one pass in C per moment, not one pow() per value
+            dev = numpy.asarray(values, dtype=float) - self.mu
+            sq = dev * dev
+            self.variance = float(sq.sum()) / self.num
+        else:
+            self.variance = sum(pow((v-self.mu), 2)
+                                for v in values) / self.num
         self.sigma = math.sqrt(self.variance)
 
         # Note: math.isnan(float("+Inf")) is false, so isnan() and isinf()
@@ -213,11 +223,15 @@ class RunningStats(object):
             self.kurtosis = float('nan')
             return
 
-        m3 = 0
-        m4 = 0
-        for val in values:
-            m3 += pow(val - self.mu, 3)
-            m4 += pow(val - self.mu, 4)
+        if numpy is not None:
+            m3 = float((sq * dev).sum())
+            m4 = float((sq * sq).sum())
+        else:
+            m3 = 0
+            m4 = 0
+            for val in values:
+                m3 += pow(val - self.mu, 3)
+                m4 += pow(val - self.mu, 4)
 
         self.skewness = m3 / (self.num * pow(self.sigma, 3))
         self.kurtosis = m4 / (self.num * pow(self.sigma, 4))
@@ -269,8 +283,8 @@ class VizStats(ntp.statfiles.NTPStats):
 
     def __init__(self, values, title, freq=0, units=''):
 
-        values.sort()
-        self.percs = self.percentiles((100, 99, 95, 50, 5, 1, 0), values)
+        self.percs = self.select_percentiles((100, 99, 95, 50, 5, 1, 0),
+                                             values)
 
         # find the target for autoranging
         if args.clip:
@@ -468,6 +482,53 @@ def gnuplot(template, outfile=None):
     return rcode
 
 
+def gnuplot_job(job):
+    "Run gnuplot() for gnuplot_all(), handing back a SystemExit."
+    try:
+        gnuplot(*job)
+    except SystemExit as e:
+        return e
+    return None
+
+
+def gnuplot_all(jobs):
+    """Run gnuplot() on each (template, outfile) in jobs, args.jobs at
+    a time.  The work is in the gnuplot processes, so threads will do,
+    and the plots were made from the one copy of the stats."""
+    if 1 >= args.jobs or 1 >= len(jobs):
+        for job in jobs:
+            gnuplot(*job)
+        return
+    pool = multiprocessing.pool.ThreadPool(min(args.jobs, len(jobs)))
+    try:
+        # a SystemExit would kill a pool thread, so it comes back here
+        for err in pool.map(gnuplot_job, jobs):
+            if err is not None:
+                raise err
+    finally:
+        pool.close()
+        pool.join()
+
+
+def freq_temp_pairs(loopstats, temps):
+    """Yield (temperature, frequency offset) for each temps row with a
+    loopstats row no more than 2,200 seconds before it.  Both are in
+    time order, so they are walked together once."""
+    rows = iter(loopstats)
+    last = None
+    ahead = next(rows, None)
+    for temp in temps:
+        while ahead is not None and ahead[0] <= temp[0]:
+            last = ahead
+            ahead = next(rows, None)
+        if last is None or 2200000 < temp[0] - last[0]:
+            continue
+        try:
+            yield (float(temp[3]), float(last[3]))
+        except (IndexError, ValueError):
+            continue
+
+
 class NTPViz(ntp.statfiles.NTPStats):
     "Class for visualizing statistics from a single server."
 
@@ -485,22 +546,38 @@ set rmargin 10
 """
 
     def __init__(self, statsdir,
-                 sitename=None, period=None, starttime=None, endtime=None):
+                 sitename=None, period=None, starttime=None, endtime=None,
+                 cachedir=None):
         ntp.statfiles.NTPStats.__init__(self, statsdir=statsdir,
                                         sitename=sitename,
                                         period=period,
                                         starttime=starttime,
-                                        endtime=endtime)
+                                        endtime=endtime,
+                                        cachedir=cachedir)
+        # plot_slice() results: (id(rows), item1, item2) -> (rows, result)
+        self.slices = {}
 
     def plot_slice(self, rows, item1, item2=None):
-        "slice 0,item1, maybe item2, from rows, ready for gnuplot"
+        """slice 0,item1, maybe item2, from rows, ready for gnuplot.
+        The values come back as arrays of doubles, converted once: the
+        same slice is asked for again by later plots and the summary
+        table.  Callers must not change them."""
+        key = (id(rows), item1, item2)
+        cached = self.slices.get(key)
+        # holding on to rows keeps its id from being reused
+        if cached is None or cached[0] is not rows:
+            cached = (rows, self.__slice(rows, item1, item2))
+            self.slices[key] = cached
+        return cached[1]
+
+    def __slice(self, rows, item1, item2):
         # speed up by only sending gnuplot the data it will actually use
         # WARNING: this is hot code, only modify if you profile
         # since we are looping the data, get the values too
         plot_data = ''
         last_time = 0
-        values1 = []
-        values2 = []
+        values1 = array.array('d')
+        values2 = array.array('d')
         if item2:
             for row in rows:
                 try:
@@ -632,6 +709,7 @@ file.</p>
         stats = [stats_f]
         table = ''
         plot_data_t = ''
+        fits = ''
         max_temp = -300
         min_temp = 1000
         for key in tempslist:
@@ -644,6 +722,20 @@ file.</p>
             min_temp = min(s.percs["min_y"], min_temp)
             table += s.table
             stats.append(s)
+            fit = self.polyfit(freq_temp_pairs(self.loopstats,
+                                               tempsmap[key]))
+            if fit is not None:
+                fits += "<li>%s: %.4f ppm/°C</li>\n" % (key, fit[0])
+
+        if fits:
+            fits = """\
+<p>A least-squares line through each temperature and the frequency
+offset logged last before it gives how far the frequency moves with
+that temperature:</p>
+<ul>
+%s</ul>
+
+""" % fits
 
         # out = stats.percs
         out = {}
@@ -696,7 +788,7 @@ file, and field 3 from the tempstats log file.</p>
 """
 
         ret = {'html': VizStats.table_head + stats_f.table +
-               table + VizStats.table_tail + exp,
+               table + VizStats.table_tail + exp + fits,
                'plot': plot_template + plot_data + plot_data_t,
                'stats': stats,
                'title': "Local Frequency/Temp"}
@@ -1169,6 +1261,7 @@ plot \
 """ % out
 
         plot_template += percentages
+        self.prefetch_labels(peerlist)
         for key in peerlist:
             out['label'] = self.ip_label(key)
             plot_template += "'-' using 1:($2*%(multiplier)s) " \
@@ -1216,8 +1309,8 @@ plot \
 
         # TODO normalize to 0 to 100?
 
-        # grab and sort the values, no need for the timestamp, etc.
-        values = [float(row[2]) for row in self.loopstats]
+        # grab the values, no need for the timestamp, etc.
+        values = self.plot_slice(self.loopstats, 2)[1]
         stats = VizStats(values, 'Local Clock Offset')
         out = stats.percs
         out["fmt_x"] = stats.percs["fmt"]
@@ -1431,6 +1524,10 @@ Python by ESR, concept and gnuplot code by Dan Drown.
                         action="store_true",
                         dest='clip',
                         help="Clip plots at 1%% and 99%%")
+    parser.add_argument('--cache-dir',
+                        dest='cachedir',
+                        help="keep decoded log files here for the next run",
+                        type=str)
     parser.add_argument('-d', '--datadir',
                         default="/var/log/ntpstats",
                         dest='statsdirs',
@@ -1449,6 +1546,11 @@ Python by ESR, concept and gnuplot code by Dan Drown.
                         action="store_true",
                         dest='generate',
                         help="Run through gnuplot to make plot images")
+    parser.add_argument('-j', '--jobs',
+                        default=1,
+                        dest='jobs',
+                        help="number of gnuplot processes to run at once",
+                        type=int)
     parser.add_argument('-n', '--name',
                         default=socket.getfqdn(),
                         dest='sitename',
@@ -1590,6 +1692,8 @@ Python by ESR, concept and gnuplot code by Dan Drown.
 
     args.statsdirs = [os.path.expanduser(path)
                       for path in args.statsdirs.split(",")]
+    if args.cachedir is not None:
+        args.cachedir = os.path.expanduser(args.cachedir)
 
     if args.show_peer_offsets:
         args.show_peer_offsets = []
@@ -1660,11 +1764,11 @@ Python by ESR, concept and gnuplot code by Dan Drown.
     if 1 == len(args.statsdirs):
         statlist = [NTPViz(statsdir=args.statsdirs[0], sitename=args.sitename,
                            period=args.period, starttime=args.starttime,
-                           endtime=args.endtime)]
+                           endtime=args.endtime, cachedir=args.cachedir)]
     else:
         statlist = [NTPViz(statsdir=d, sitename=d,
                            period=args.period, starttime=args.starttime,
-                           endtime=args.endtime)
+                           endtime=args.endtime, cachedir=args.cachedir)
                     for d in args.statsdirs]
 
     if len(statlist) == 1:
@@ -1971,7 +2075,8 @@ ntpviz</a>, part of the <a href="https://www.ntpsec.org/">NTPsec project</a>
             pass
 
     if len(statlist) > 1:
-        index_buffer += local_offset_multiplot(statlist)
+        imagepairs = [("local-offset-multiplot",
+                       local_offset_multiplot(statlist))]
     else:
         # imagepairs in the order of the html entries
         imagepairs = [
@@ -2000,31 +2105,33 @@ ntpviz</a>, part of the <a href="https://www.ntpsec.org/">NTPsec project</a>
             imagepairs.append(("peer-jitter-" + key,
                                stats.peer_jitters_gnuplot([key])))
 
-        stats = []
-        for (imagename, image) in imagepairs:
-            if not image:
-                continue
-            if 1 <= args.debug_level:
-                sys.stderr.write("ntpviz: plotting %s\n" % image['title'])
-            stats.append(image['stats'])
-            # give each H2 an unique ID.
-            div_id = image['title'].lower().replace(' ', '_').replace(':', '_')
+    stats = []
+    jobs = []
+    for (imagename, image) in imagepairs:
+        if not image:
+            continue
+        if 1 <= args.debug_level:
+            sys.stderr.write("ntpviz: plotting %s\n" % image['title'])
+        stats.append(image['stats'])
+        # give each H2 an unique ID.
+        div_id = image['title'].lower().replace(' ', '_').replace(':', '_')
 
-            index_buffer += """\
+        index_buffer += """\
 <div id="%s">\n<h2><a class="section" href="#%s">%s</a></h2>
 """ % (div_id, div_id, image['title'])
 
-            div_name = imagename.replace('-', ' ')
-            # Windows hates colons in filename
-            imagename = imagename.replace(':', '-')
-            index_buffer += imagewrapper % (imagename, div_name)
-
-            if image['html']:
-                index_buffer += "<div>\n%s</div>\n" % image['html']
-            index_buffer += "<br><br>\n"
-            gnuplot(image['plot'], os.path.join(args.outdir,
-                    imagename + args.img_ext))
-            index_buffer += "</div>\n"
+        div_name = imagename.replace('-', ' ')
+        # Windows hates colons in filename
+        imagename = imagename.replace(':', '-')
+        index_buffer += imagewrapper % (imagename, div_name)
+
+        if image['html']:
+            index_buffer += "<div>\n%s</div>\n" % image['html']
+        index_buffer += "<br><br>\n"
+        jobs.append((image['plot'], os.path.join(args.outdir,
+                     imagename + args.img_ext)))
+        index_buffer += "</div>\n"
+    gnuplot_all(jobs)
 
     # dump stats
     csvs = []
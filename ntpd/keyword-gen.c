@@ -1,12 +1,13 @@
 /*
- * keyword-gen.c -- generate keyword scanner finite state machine and
- *		    keyword_text array.
+ * keyword-gen.c -- generate keyword scanner finite state machine,
+ *		    keyword hash table and keyword_text array.
  *
  * This program is run to generate ntp_keyword.h
  */
 #include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "ntp_scanner.h"
@@ -28,6 +29,7 @@ struct key_tok ntp_keywords[] = {
 { "bias",		T_Bias,			FOLLBY_TOKEN },
 { "baud",		T_Baud,			FOLLBY_TOKEN },
 { "clock",		T_Clock,		FOLLBY_STRING },
+{ "controlsocket",	T_Controlsocket,	FOLLBY_STRING },
 { "cookie",		T_Cookie,		FOLLBY_TOKEN },
 { "ctl",		T_Ctl,			FOLLBY_TOKEN },
 { "disable",		T_Disable,		FOLLBY_TOKEN },
@@ -38,6 +40,8 @@ struct key_tok ntp_keywords[] = {
 { "extra",		T_Extra,		FOLLBY_TOKEN },
 { "filegen",		T_Filegen,		FOLLBY_TOKEN },
 { "fudge",		T_Fudge,		FOLLBY_STRING },
+{ "handover",		T_Handover,		FOLLBY_STRING },
+{ "hwtimestamp",	T_Hwtimestamp,		FOLLBY_STRING },
 { "io",			T_Io,			FOLLBY_TOKEN },
 { "includefile",	T_Includefile,		FOLLBY_STRING },
 { "leapfile",		T_Leapfile,		FOLLBY_STRING },
@@ -48,18 +52,34 @@ struct key_tok ntp_keywords[] = {
 { "path",		T_Path,			FOLLBY_STRING },
 { "peer",		T_Peer,			FOLLBY_STRING },
 { "phone",		T_Phone,		FOLLBY_STRINGS_TO_EOC },
+{ "metrics",		T_Metrics,		FOLLBY_STRING },
 { "pidfile",		T_Pidfile,		FOLLBY_STRING },
+{ "pkttrace",		T_Pkttrace,		FOLLBY_TOKEN },
 { "pool",		T_Pool,			FOLLBY_STRING },
 { "port",		T_Port,			FOLLBY_TOKEN },
 { "ppspath",		T_Ppspath,		FOLLBY_STRING },
+{ "stages",		T_Stages,		FOLLBY_TOKEN },
 { "reset",		T_Reset,		FOLLBY_TOKEN },
 { "restrict",		T_Restrict,		FOLLBY_TOKEN },
+{ "set",		T_Set,			FOLLBY_STRING },
 { "refclock",		T_Refclock,		FOLLBY_STRING },
 { "rlimit",		T_Rlimit,		FOLLBY_TOKEN },
+{ "busypoll",		T_Busypoll,		FOLLBY_TOKEN },
+{ "rcvbuf",		T_Rcvbuf,		FOLLBY_TOKEN },
+{ "rcvmax",		T_Rcvmax,		FOLLBY_TOKEN },
+{ "rxbatch",		T_Rxbatch,		FOLLBY_TOKEN },
+{ "samples",		T_Samples,		FOLLBY_TOKEN },
 { "server",		T_Server,		FOLLBY_STRING },
 { "setvar",		T_Setvar,		FOLLBY_STRING },
+{ "singlesocket",	T_Singlesocket,		FOLLBY_TOKEN },
+{ "iouring",		T_Iouring,		FOLLBY_TOKEN },
+{ "bpffilter",		T_Bpffilter,		FOLLBY_TOKEN },
+{ "lean",		T_Lean,			FOLLBY_TOKEN },
+{ "sndbuf",		T_Sndbuf,		FOLLBY_TOKEN },
+{ "statefile",		T_Statefile,		FOLLBY_STRING },
 { "statistics",		T_Statistics,		FOLLBY_TOKEN },
 { "statsdir",		T_Statsdir,		FOLLBY_STRING },
+{ "statsflush",		T_Statsflush,		FOLLBY_TOKEN },
 { "sys",		T_Sys,			FOLLBY_TOKEN },
 { "tick",		T_Tick,			FOLLBY_TOKEN },
 { "timer",		T_Timer,		FOLLBY_TOKEN },
@@ -69,6 +89,7 @@ struct key_tok ntp_keywords[] = {
 { "unit",		T_Unit,			FOLLBY_TOKEN },
 { "unpeer",		T_Unpeer,		FOLLBY_STRING },
 { "unrestrict",		T_Unrestrict,		FOLLBY_TOKEN },
+{ "workers",		T_Workers,		FOLLBY_TOKEN },
 /* authentication_command */
 { "controlkey",		T_ControlKey,		FOLLBY_TOKEN },
 { "requestkey",		T_Requestkey,		FOLLBY_TOKEN }, /* dummy */
@@ -81,20 +102,27 @@ struct key_tok ntp_keywords[] = {
 /* option */
 { "burst",		T_Burst,		FOLLBY_TOKEN },
 { "iburst",		T_Iburst,		FOLLBY_TOKEN },
+{ "iothread",		T_Iothread,		FOLLBY_TOKEN },
 { "key",		T_Key,			FOLLBY_TOKEN },
 { "maxpoll",		T_Maxpoll,		FOLLBY_TOKEN },
 { "mdnstries",		T_Mdnstries,		FOLLBY_TOKEN },
 { "minpoll",		T_Minpoll,		FOLLBY_TOKEN },
 { "mode",		T_Mode,			FOLLBY_TOKEN },
+{ "fit",		T_Fit,			FOLLBY_TOKEN },
 { "noselect",		T_Noselect,		FOLLBY_TOKEN },
 { "true",		T_True,			FOLLBY_TOKEN },
 { "prefer",		T_Prefer,		FOLLBY_TOKEN },
+{ "ppsthread",		T_Ppsthread,		FOLLBY_TOKEN },
+{ "probe",		T_Probe,		FOLLBY_TOKEN },
 { "subtype",		T_Subtype,		FOLLBY_TOKEN },
 { "version",		T_Version,		FOLLBY_TOKEN },
+{ "xleave",		T_Xleave,		FOLLBY_TOKEN },
 /*** MONITORING COMMANDS ***/
 /* stat */
 { "clockstats",		T_Clockstats,		FOLLBY_TOKEN },
+{ "loopaggstats",	T_Loopaggstats,		FOLLBY_TOKEN },
 { "loopstats",		T_Loopstats,		FOLLBY_TOKEN },
+{ "peeraggstats",	T_Peeraggstats,		FOLLBY_TOKEN },
 { "peerstats",		T_Peerstats,		FOLLBY_TOKEN },
 { "protostats",		T_Protostats,		FOLLBY_TOKEN },
 { "rawstats",		T_Rawstats,		FOLLBY_TOKEN },
@@ -103,9 +131,14 @@ struct key_tok ntp_keywords[] = {
 { "ntsstats",		T_Ntsstats,		FOLLBY_TOKEN },
 { "ntskestats",		T_Ntskestats,		FOLLBY_TOKEN },
 /* filegen_option */
+{ "binary",		T_Binary,		FOLLBY_TOKEN },
+{ "compress",		T_Compress,		FOLLBY_TOKEN },
 { "file",		T_File,			FOLLBY_STRING },
 { "link",		T_Link,			FOLLBY_TOKEN },
+{ "nocompress",		T_Nocompress,		FOLLBY_TOKEN },
 { "nolink",		T_Nolink,		FOLLBY_TOKEN },
+{ "stream",		T_Stream,		FOLLBY_STRING },
+{ "text",		T_Text,			FOLLBY_TOKEN },
 { "type",		T_Type,			FOLLBY_TOKEN },
 /* filegen_type */
 { "age",		T_Age,			FOLLBY_TOKEN },
@@ -127,6 +160,7 @@ struct key_tok ntp_keywords[] = {
 { "maxdist",		T_Maxdist,		FOLLBY_TOKEN },
 { "orphan",		T_Orphan,		FOLLBY_TOKEN },
 { "orphanwait",		T_Orphanwait,		FOLLBY_TOKEN },
+{ "faststart",		T_Faststart,		FOLLBY_TOKEN },
 { "nonvolatile",	T_Nonvolatile,		FOLLBY_TOKEN },
 /* access_control_flag */
 { "default",		T_Default,		FOLLBY_TOKEN },
@@ -148,6 +182,14 @@ struct key_tok ntp_keywords[] = {
 { "ntpport",		T_Ntpport,		FOLLBY_TOKEN },
 /* limit_option */
 { "average",		T_Average,		FOLLBY_TOKEN },
+{ "ctlaverage",		T_Ctlaverage,		FOLLBY_TOKEN },
+{ "ctlburst",		T_Ctlburst,		FOLLBY_TOKEN },
+{ "ctlslice",		T_Ctlslice,		FOLLBY_TOKEN },
+{ "kodmax",		T_Kodmax,		FOLLBY_TOKEN },
+{ "duplicate",		T_Duplicate,		FOLLBY_TOKEN },
+{ "dupdrop",		T_Dupdrop,		FOLLBY_TOKEN },
+{ "shed",		T_Shed,			FOLLBY_TOKEN },
+{ "shedburst",		T_Shedburst,		FOLLBY_TOKEN },
 { "monitor",		T_Monitor,		FOLLBY_TOKEN },
 /* mru_option */
 { "incalloc",		T_Incalloc,		FOLLBY_TOKEN },
@@ -159,6 +201,10 @@ struct key_tok ntp_keywords[] = {
 { "maxage",		T_Maxage,		FOLLBY_TOKEN },
 { "minage",		T_Minage,		FOLLBY_TOKEN },
 { "maxmem",		T_Maxmem,		FOLLBY_TOKEN },
+{ "clocksweep",		T_Clocksweep,		FOLLBY_TOKEN },
+{ "hugepages",		T_Hugepages,		FOLLBY_TOKEN },
+{ "sketch",		T_Sketch,		FOLLBY_TOKEN },
+{ "sweep",		T_Sweep,		FOLLBY_TOKEN },
 { "mru",		T_Mru,			FOLLBY_TOKEN },
 /* fudge_factor */
 { "flag1",		T_Flag1,		FOLLBY_TOKEN },
@@ -187,6 +233,8 @@ struct key_tok ntp_keywords[] = {
 { "dispersion",		T_Dispersion,		FOLLBY_TOKEN },
 { "stepout",		T_Stepout,		FOLLBY_TOKEN },
 { "allan",		T_Allan,		FOLLBY_TOKEN },
+{ "budget",		T_Budget,		FOLLBY_TOKEN },
+{ "fastloop",		T_Fastloop,		FOLLBY_TOKEN },
 { "huffpuff",		T_Huffpuff,		FOLLBY_TOKEN },
 { "freq",		T_Freq,			FOLLBY_TOKEN },
 /* miscellaneous_command */
@@ -199,6 +247,15 @@ struct key_tok ntp_keywords[] = {
 { "wildcard",		T_Wildcard,		FOLLBY_TOKEN },
 { "listen",		T_Listen,		FOLLBY_TOKEN },
 { "drop",		T_Drop,			FOLLBY_TOKEN },
+/* thread_command */
+{ "thread",		T_Thread,		FOLLBY_TOKEN },
+{ "main",		T_Main,			FOLLBY_TOKEN },
+{ "ntske",		T_Ntske,		FOLLBY_TOKEN },
+{ "dns",		T_Dns,			FOLLBY_TOKEN },
+{ "cpu",		T_Cpu,			FOLLBY_TOKEN },
+{ "node",		T_Node,			FOLLBY_TOKEN },
+{ "priority",		T_Priority,		FOLLBY_TOKEN },
+{ "nice",		T_Nice,			FOLLBY_TOKEN },
 /* NTS */
 { "nts",		T_Nts,			FOLLBY_TOKEN },
 { "noval",		T_Noval,		FOLLBY_TOKEN },
@@ -209,6 +266,11 @@ struct key_tok ntp_keywords[] = {
 { "tlsciphersuites",	T_Tlsciphersuites,	FOLLBY_STRING },
 { "tlsecdhcurves",	T_Tlsecdhcurves,	FOLLBY_STRING },
 { "tlscipherserverpreference",	T_Tlscipherserverpreference,	FOLLBY_TOKEN },
+{ "tickets",		T_Tickets,		FOLLBY_TOKEN },
+{ "clientcache",	T_Clientcache,		FOLLBY_TOKEN },
+{ "backlog",		T_Backlog,		FOLLBY_TOKEN },
+{ "kelimit",		T_Kelimit,		FOLLBY_TOKEN },
+{ "cookiesecret",	T_Cookiesecret,		FOLLBY_TOKEN },
 };
 
 typedef struct big_scan_state_tag {
@@ -229,6 +291,7 @@ typedef struct big_scan_state_tag {
  */
 #define MAXSTATES	2048
 #define MAX_TOK_LEN	63
+#define MAX_BUCKET	16	/* most keywords in one hash bucket */
 
 const char *	current_keyword;/* for error reporting */
 static big_scan_state	sst[MAXSTATES];	/* scanner FSM state entries */
@@ -241,6 +304,7 @@ const char *	progname = "keyword-gen";
 int			main			(int, char **);
 static void		generate_preamble	(void);
 static void		generate_fsm		(void);
+static void		generate_hash		(void);
 static void		generate_token_text	(void);
 static unsigned short	create_keyword_scanner	(void);
 static unsigned short	create_scan_states	(const char *,
@@ -264,6 +328,7 @@ int main(int argc, char **argv)
 	generate_preamble();
 	generate_token_text();
 	generate_fsm();
+	generate_hash();
 
 	return 0;
 }
@@ -461,6 +526,114 @@ generate_fsm(void)
 }
 
 
+/*
+ * generate_hash - build the perfect hash table is_keyword() looks
+ * keywords up in; see kw_hash() in ntp_scanner.h.  Buckets are placed
+ * largest first, each with the first displacement that puts all its
+ * keywords in free slots.  Slots number twice the keywords, buckets
+ * half, so that is quick.
+ */
+static void
+generate_hash(void)
+{
+	unsigned int	nbuckets = 1;
+	unsigned int	nslots = 1;
+	unsigned int	nkw = COUNTOF(ntp_keywords);
+	unsigned int	biggest = 0;
+	unsigned int	b, d, i, j, n, size;
+	unsigned int	members[MAX_BUCKET];
+	unsigned int	tried[MAX_BUCKET];
+	unsigned int *	bucket_of;
+	unsigned int *	bucket_size;
+	unsigned short *disp;
+	unsigned short *slot;
+	uint64_t *	hash;
+
+	while (nbuckets < nkw / 2)
+		nbuckets <<= 1;
+	while (nslots < 2 * nkw)
+		nslots <<= 1;
+	bucket_of = calloc(nkw, sizeof(*bucket_of));
+	hash = calloc(nkw, sizeof(*hash));
+	bucket_size = calloc(nbuckets, sizeof(*bucket_size));
+	disp = calloc(nbuckets, sizeof(*disp));
+	slot = calloc(nslots, sizeof(*slot));
+	if (NULL == bucket_of || NULL == hash || NULL == bucket_size
+	    || NULL == disp || NULL == slot) {
+		fprintf(stderr, "keyword-gen: out of memory\n");
+		exit(11);
+	}
+
+	for (i = 0; i < nkw; i++) {
+		hash[i] = kw_hash(ntp_keywords[i].key);
+		bucket_of[i] = (unsigned int)(hash[i] & (nbuckets - 1));
+		size = ++bucket_size[bucket_of[i]];
+		if (size > biggest)
+			biggest = size;
+	}
+	if (biggest > MAX_BUCKET) {
+		fprintf(stderr, "keyword-gen: hash bucket of %u keywords, "
+			"MAX_BUCKET is %d\n", biggest, MAX_BUCKET);
+		exit(12);
+	}
+
+	for (size = biggest; size > 0; size--) {
+		for (b = 0; b < nbuckets; b++) {
+			if (bucket_size[b] != size)
+				continue;
+			n = 0;
+			for (i = 0; i < nkw; i++)
+				if (bucket_of[i] == b)
+					members[n++] = i;
+			for (d = 0; d <= USHRT_MAX; d++) {
+				for (i = 0; i < n; i++) {
+					tried[i] = kw_hash_slot(hash[members[i]], d)
+						   & (nslots - 1);
+					if (slot[tried[i]])
+						break;
+					for (j = 0; j < i; j++)
+						if (tried[j] == tried[i])
+							break;
+					if (j < i)
+						break;
+				}
+				if (i == n)
+					break;
+			}
+			if (d > USHRT_MAX) {
+				fprintf(stderr, "keyword-gen: no displacement "
+					"fits hash bucket %u\n", b);
+				exit(13);
+			}
+			disp[b] = (unsigned short)d;
+			for (i = 0; i < n; i++)
+				slot[tried[i]] = ntp_keywords[members[i]].token;
+		}
+	}
+
+	printf("#define KW_BUCKETS %u\n", nbuckets);
+	printf("#define KW_SLOTS %u\n\n", nslots);
+
+	printf("const unsigned short kw_disp[KW_BUCKETS] = {");
+	for (b = 0; b < nbuckets; b++)
+		printf("%s%5u%s", (b % 8) ? " " : "\n\t", disp[b],
+		       (b + 1 < nbuckets) ? "," : "");
+	printf("\n};\n\n");
+
+	printf("const unsigned short kw_token[KW_SLOTS] = {");
+	for (i = 0; i < nslots; i++)
+		printf("%s%5u%s", (i % 8) ? " " : "\n\t", slot[i],
+		       (i + 1 < nslots) ? "," : "");
+	printf("\n};\n\n");
+
+	free(bucket_of);
+	free(hash);
+	free(bucket_size);
+	free(disp);
+	free(slot);
+}
+
+
 /* Define a function to create the states of the scanner. This function
  * is used by the create_keyword_scanner function below.
  *
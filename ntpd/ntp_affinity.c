@@ -0,0 +1,351 @@
+/*
+ * ntp_affinity.c - CPU, NUMA node and scheduling placement of threads
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * The thread command gives each class of thread a set of CPUs, a NUMA
+ * node to take CPUs and memory from, and a SCHED_FIFO priority or a
+ * nice value.  Every thread calls thread_place() with its class when it
+ * starts.  A new thread inherits its creator's placement, and the main
+ * thread creates most of them, so a class with no thread command is
+ * put back where the process started wherever the main thread has
+ * been moved away from that.
+ *
+ * Workers are dealt out one to a CPU of their set, and each worker's
+ * sockets ask with SO_INCOMING_CPU for the packets that CPU's receive
+ * queue takes, so a packet is read on the core the NIC handed it to.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_MEMPOLICY_H
+# include <linux/mempolicy.h>
+#endif
+
+#include "ntpd.h"
+#include "ntp_stdlib.h"
+
+struct thread_conf thread_conf[THREAD_CLASSES];
+
+static const char * const class_name[THREAD_CLASSES] = {
+	"main", "workers", "ntske", "dns", "other"
+};
+
+static bool	placed;		/* thread_setup() has run */
+
+/* what the process started with */
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+static cpu_set_t	start_cpus;
+#endif
+static int		start_policy;
+static struct sched_param start_param;
+static int		start_nice;
+
+static bool	cpu_isset	(const struct thread_conf *, int);
+static void	node_cpus	(struct thread_conf *, int);
+static void	place_cpus	(int, const struct thread_conf *, int);
+static void	place_memory	(int, int);
+static void	place_sched	(int, const struct thread_conf *);
+
+
+static bool
+cpu_isset(
+	const struct thread_conf *tc,
+	int cpu
+	)
+{
+	return 0 != (tc->cpus[cpu / 64] & (1ULL << (cpu % 64)));
+}
+
+
+/*
+ * thread_cpu - the CPU a thread of a class runs on, with index its
+ * number among the workers, or -1 if it is not pinned to one.
+ */
+int
+thread_cpu(
+	int cls,
+	int index
+	)
+{
+	const struct thread_conf *tc = &thread_conf[cls];
+	int n = 0, cpu;
+
+	if (!tc->has_cpus || index < 0)
+		return -1;
+	for (cpu = 0; cpu < THREAD_CPUS; cpu++)
+		if (cpu_isset(tc, cpu))
+			n++;
+	if (0 == n)
+		return -1;
+	index %= n;
+	for (cpu = 0; cpu < THREAD_CPUS; cpu++)
+		if (cpu_isset(tc, cpu) && 0 == index--)
+			return cpu;
+	return -1;
+}
+
+
+/*
+ * node_cpus - narrow a class's CPUs to those of its NUMA node, from
+ * sysfs, which is out of reach once chrooted.  A node that isn't there
+ * is forgotten.
+ */
+static void
+node_cpus(
+	struct thread_conf *tc,
+	int cls
+	)
+{
+	uint64_t	cpus[THREAD_CPUS / 64];
+	char		path[64];
+	FILE *		fp;
+	int		first, last, c;
+	bool		any = false;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", tc->node);
+	fp = fopen(path, "r");
+	if (NULL == fp) {
+		msyslog(LOG_ERR, "INIT: thread %s: no NUMA node %d: %s",
+			class_name[cls], tc->node, strerror(errno));
+		tc->node = -1;
+		return;
+	}
+	ZERO(cpus);
+	/* "0-3,8-11" */
+	while (1 <= fscanf(fp, "%d", &first)) {
+		last = first;
+		c = getc(fp);
+		if ('-' == c) {
+			if (1 != fscanf(fp, "%d", &last))
+				break;
+			c = getc(fp);
+		}
+		for (; first <= last && first < THREAD_CPUS; first++)
+			if (first >= 0)
+				cpus[first / 64] |= 1ULL << (first % 64);
+		if (',' != c)
+			break;
+	}
+	fclose(fp);
+
+	for (size_t i = 0; i < COUNTOF(cpus); i++) {
+		if (tc->has_cpus)
+			cpus[i] &= tc->cpus[i];
+		tc->cpus[i] = cpus[i];
+		any |= (0 != cpus[i]);
+	}
+	tc->has_cpus = any;
+	if (!any)
+		msyslog(LOG_ERR, "INIT: thread %s: no CPU of NUMA node %d",
+			class_name[cls], tc->node);
+}
+
+
+/*
+ * thread_setup - note where the process started, resolve NUMA nodes
+ * and place the main thread.  Call after the configuration is read and
+ * before dropping root.
+ */
+void
+thread_setup(void)
+{
+	int cls;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	pthread_getaffinity_np(pthread_self(), sizeof(start_cpus),
+			       &start_cpus);
+#endif
+	pthread_getschedparam(pthread_self(), &start_policy, &start_param);
+	errno = 0;
+	start_nice = getpriority(PRIO_PROCESS, 0);
+	if (-1 == start_nice && 0 != errno)
+		start_nice = 0;
+
+	for (cls = 0; cls < THREAD_CLASSES; cls++) {
+		struct thread_conf *tc = &thread_conf[cls];
+
+		if (!tc->set)
+			continue;
+#ifndef HAVE_PTHREAD_SETAFFINITY_NP
+		if (tc->has_cpus || tc->node >= 0)
+			msyslog(LOG_WARNING,
+				"INIT: thread %s: no CPU affinity on "
+				"this system, cpu and node ignored",
+				class_name[cls]);
+#endif
+		if (tc->node >= 0)
+			node_cpus(tc, cls);
+	}
+	placed = true;
+	thread_place(THREAD_MAIN, -1);
+}
+
+
+/*
+ * thread_place - put the calling thread where its class belongs.
+ * index is its number among the workers, -1 for other classes.
+ */
+void
+thread_place(
+	int cls,
+	int index
+	)
+{
+	const struct thread_conf *tc = &thread_conf[cls];
+
+	if (!placed)
+		return;
+	place_cpus(cls, tc, index);
+	place_memory(cls, tc->set ? tc->node : -1);
+	place_sched(cls, tc);
+}
+
+
+static void
+place_cpus(
+	int cls,
+	const struct thread_conf *tc,
+	int index
+	)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	const cpu_set_t	*cpus = &start_cpus;
+	cpu_set_t	set;
+	int		cpu, rc;
+
+	if (tc->set && tc->has_cpus) {
+		CPU_ZERO(&set);
+		cpu = thread_cpu(cls, index);
+		if (cpu >= 0) {
+			CPU_SET(cpu, &set);
+		} else {
+			for (cpu = 0; cpu < THREAD_CPUS; cpu++)
+				if (cpu_isset(tc, cpu))
+					CPU_SET(cpu, &set);
+		}
+		cpus = &set;
+	} else if (!(thread_conf[THREAD_MAIN].set &&
+		     thread_conf[THREAD_MAIN].has_cpus)) {
+		return;		/* where we started */
+	}
+	rc = pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+	if (rc)
+		msyslog(LOG_ERR, "INIT: thread %s: can't set CPUs: %s",
+			class_name[cls], strerror(rc));
+#else
+	UNUSED_ARG(cls);
+	UNUSED_ARG(tc);
+	UNUSED_ARG(index);
+#endif
+}
+
+
+/*
+ * place_memory - prefer the node's memory for what this thread
+ * allocates from now on, or go back to the default policy.
+ */
+static void
+place_memory(
+	int cls,
+	int node
+	)
+{
+#if defined(HAVE_LINUX_MEMPOLICY_H) && defined(SYS_set_mempolicy)
+	unsigned long	mask[THREAD_CPUS / (8 * sizeof(unsigned long))];
+	long		rc;
+
+	if (node < 0 || node >= THREAD_CPUS) {
+		if (thread_conf[THREAD_MAIN].node < 0
+		    || !thread_conf[THREAD_MAIN].set)
+			return;
+		rc = syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+	} else {
+		ZERO(mask);
+		mask[node / (8 * sizeof(mask[0]))] |=
+			1UL << (node % (8 * sizeof(mask[0])));
+		rc = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+			     (unsigned long)THREAD_CPUS);
+	}
+	if (rc < 0)
+		msyslog(LOG_ERR, "INIT: thread %s: can't set memory node: %s",
+			class_name[cls], strerror(errno));
+#else
+	UNUSED_ARG(cls);
+	UNUSED_ARG(node);
+#endif
+}
+
+
+static void
+place_sched(
+	int cls,
+	const struct thread_conf *tc
+	)
+{
+	const struct thread_conf *mt = &thread_conf[THREAD_MAIN];
+	struct sched_param	param;
+	int			rc;
+
+	if (tc->set && tc->priority > 0) {
+		ZERO(param);
+		param.sched_priority = max(sched_get_priority_min(SCHED_FIFO),
+			min(tc->priority, sched_get_priority_max(SCHED_FIFO)));
+		rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (rc)
+			msyslog(LOG_ERR, "INIT: thread %s: not SCHED_FIFO: %s",
+				class_name[cls], strerror(rc));
+	} else if (mt->set && mt->priority > 0) {
+		pthread_setschedparam(pthread_self(), start_policy,
+				      &start_param);
+	}
+
+#ifdef SYS_gettid
+	/* On Linux, and only there, a nice value belongs to a thread */
+	if (tc->set && tc->has_nice) {
+		if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid),
+				tc->nice) < 0)
+			msyslog(LOG_ERR, "INIT: thread %s: can't set nice %d: %s",
+				class_name[cls], tc->nice, strerror(errno));
+	} else if (mt->set && mt->has_nice) {
+		setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid),
+			    start_nice);
+	}
+#endif
+}
+
+
+/*
+ * thread_socket - steer a worker's socket to the packets its CPU
+ * receives.
+ */
+void
+thread_socket(
+	SOCKET	fd,
+	int	index
+	)
+{
+#ifdef SO_INCOMING_CPU
+	int cpu = thread_cpu(THREAD_WORKERS, index);
+
+	if (cpu < 0 || !thread_conf[THREAD_WORKERS].set)
+		return;
+	if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)))
+		msyslog(LOG_ERR, "IO: worker %d: SO_INCOMING_CPU %d: %s",
+			index, cpu, strerror(errno));
+#else
+	UNUSED_ARG(fd);
+	UNUSED_ARG(index);
+#endif
+}
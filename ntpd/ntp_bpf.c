@@ -0,0 +1,709 @@
+/*
+ * ntp_bpf.c - optional kernel filter for ignored and limited sources
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * With bpffilter set, every NTP socket gets an eBPF socket filter
+ * that looks the source address up in a longest prefix match map and
+ * drops the datagram in the kernel when the entry says so, before it
+ * costs a system call, a receive buffer and a trip through receive().
+ * IPv4 sources are looked up IPv4-mapped, so one map serves both.
+ *
+ * Two things fill the map.  Each restrict snapshot hands over its
+ * prefixes: one whose entries all say "ignore", for sources on any
+ * port, drops everything, the rest pass, so the longest prefix gives
+ * the kernel the answer restrictions() would give or leaves it to
+ * restrictions().  And ntp_monitor() holds a source that is over its
+ * "limited" rate for as long as its score takes to decay back under
+ * it; a hold drops only client requests, so a server that is also a
+ * noisy client still gets through.  Held sources get no KoD.
+ *
+ * The filter is loaded at config time, with privileges.  The map
+ * stays writable through its descriptor; the sandbox keeps cap_bpf
+ * for kernels that still want it for that.  When the kernel won't
+ * take a map update that a pass depends on, all the drops go and
+ * the choice is back with restrictions().
+ *
+ * The program is hand assembled, so there is no compiler or libbpf
+ * dependency.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_BPF_H
+# include <linux/bpf.h>
+# include <linux/if_ether.h>
+# include <linux/filter.h>
+#endif
+
+#include "ntpd.h"
+#include "ntp_stdlib.h"
+
+#if defined(HAVE_LINUX_BPF_H) && defined(__NR_bpf) && \
+    defined(SO_ATTACH_BPF)
+# define USE_BPF_FILTER
+#endif
+
+bool bpf_filtering = false;	/* bpffilter configured */
+
+#ifdef USE_BPF_FILTER
+#define BPF_RESTRICT_MAX 65536	/* prefixes from the restrict lists */
+#define BPF_HOLDS	4096	/* limited sources held at once */
+#define BPF_DROP_ALL	UINT64_MAX
+
+struct bpf_key {
+	uint32_t	plen;		/* as the LPM trie wants it */
+	uint8_t		addr[16];
+};
+
+struct bpf_val {
+	uint64_t	until;		/* CLOCK_MONOTONIC ns to drop until */
+	uint64_t	clientonly;	/* drop only mode 3 */
+};
+
+struct bpf_prefix {
+	struct bpf_key	key;
+	bool		drop;		/* ignored from any port */
+	bool		sure;		/* dropped whatever else is there */
+};
+
+struct bpf_hold {
+	uint8_t		addr[16];
+	uint64_t	until;
+};
+
+static int		map_fd = -1;	/* the LPM trie */
+static int		count_fd = -1;	/* datagrams dropped */
+static int		prog_fd = -1;
+
+/* both guarded by bpf_lock, the responders hold sources too */
+static pthread_mutex_t	bpf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bpf_prefix *prefixes;	/* in the map, sorted */
+static size_t		nprefixes;
+static struct bpf_hold	holds[BPF_HOLDS];
+static size_t		nholds;
+
+/* main thread only, between bpf_filter_begin() and _commit() */
+static struct bpf_prefix *building;
+static size_t		nbuilding;
+static size_t		building_alloc;
+static bool		broken;		/* a pass didn't fit */
+
+/*
+ * Enough of an assembler for the program below
+ */
+#define INSN(c, d, s, o, i)	((struct bpf_insn){ .code = (c), \
+	.dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s)		INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)		INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)		INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND64_IMM(d, i)		INSN(BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define TO_BE32(d)		INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 32)
+#define LDX(sz, d, s, o)	INSN(BPF_LDX | BPF_MEM | (sz), d, s, o, 0)
+#define STX(sz, d, s, o)	INSN(BPF_STX | BPF_MEM | (sz), d, s, o, 0)
+#define ST(sz, d, o, i)		INSN(BPF_ST | BPF_MEM | (sz), d, 0, o, i)
+#define XADD64(d, s, o)		INSN(BPF_STX | BPF_XADD | BPF_DW, d, s, o, 0)
+#define LD_ABS(sz, o)		INSN(BPF_LD | BPF_ABS | (sz), 0, 0, 0, o)
+#define LD_MAP(d, fd)		INSN(BPF_LD | BPF_IMM | BPF_DW, d, \
+				     BPF_PSEUDO_MAP_FD, 0, fd), \
+				INSN(0, 0, 0, 0, 0)
+#define JMP_IMM(op, d, i, o)	INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JMP_REG(op, d, s, o)	INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+#define JA(o)			INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define CALL(f)			INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()			INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+#define SKB(f)			((short)offsetof(struct __sk_buff, f))
+#define KEY			(-24)	/* struct bpf_key on the stack */
+#define COUNT_KEY		(-28)	/* and the counter's index */
+
+static void	bpf_apply_holds	(void);
+static bool	bpf_load_prog	(void);
+static bool	bpf_set		(const struct bpf_key *,
+				 const struct bpf_val *);
+
+
+static int
+bpf_call(
+	int		cmd,
+	union bpf_attr *attr
+	)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+static uint64_t
+bpf_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);	/* bpf_ktime_get_ns() */
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static bool
+bpf_mapped(
+	const uint8_t *	addr
+	)
+{
+	static const uint8_t mapped[12] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+	return 0 == memcmp(addr, mapped, sizeof(mapped));
+}
+
+
+static int
+bpf_key_cmp(
+	const void *	a,
+	const void *	b
+	)
+{
+	const struct bpf_key *ka = a;
+	const struct bpf_key *kb = b;
+
+	if (ka->plen != kb->plen)
+		return (ka->plen > kb->plen) - (ka->plen < kb->plen);
+	return memcmp(ka->addr, kb->addr, sizeof(ka->addr));
+}
+
+
+/*
+ * bpf_restricted - the value the restrict lists give key, NULL if
+ * they don't have it.  Call with bpf_lock held.
+ */
+static const struct bpf_prefix *
+bpf_restricted(
+	const struct bpf_key *	key
+	)
+{
+	if (0 == nprefixes)
+		return NULL;
+	return bsearch(key, prefixes, nprefixes, sizeof(*prefixes),
+		       bpf_key_cmp);
+}
+
+
+static bool
+bpf_set(
+	const struct bpf_key *	key,
+	const struct bpf_val *	val
+	)
+{
+	union bpf_attr attr;
+
+	ZERO(attr);
+	attr.map_fd = (uint32_t)map_fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)val;
+	attr.flags = BPF_ANY;
+	return 0 == bpf_call(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+
+static void
+bpf_unset(
+	const struct bpf_key *	key
+	)
+{
+	union bpf_attr attr;
+
+	ZERO(attr);
+	attr.map_fd = (uint32_t)map_fd;
+	attr.key = (uintptr_t)key;
+	bpf_call(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+
+/*
+ * bpf_load - make the maps and the program
+ */
+static bool
+bpf_load(void)
+{
+	union bpf_attr	attr;
+
+	ZERO(attr);
+	attr.map_type = BPF_MAP_TYPE_LPM_TRIE;
+	attr.key_size = sizeof(struct bpf_key);
+	attr.value_size = sizeof(struct bpf_val);
+	attr.max_entries = BPF_RESTRICT_MAX + BPF_HOLDS;
+	attr.map_flags = BPF_F_NO_PREALLOC;
+	map_fd = bpf_call(BPF_MAP_CREATE, &attr);
+	if (map_fd < 0)
+		return false;
+
+	ZERO(attr);
+	attr.map_type = BPF_MAP_TYPE_ARRAY;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint64_t);
+	attr.max_entries = 1;
+	count_fd = bpf_call(BPF_MAP_CREATE, &attr);
+	if (count_fd < 0)
+		return false;
+	return bpf_load_prog();
+}
+
+
+/*
+ * bpf_load_prog - the program looks up the source as struct bpf_key
+ * on the stack and returns 0, drop, while the entry's until is ahead
+ * of the clock, for any datagram or, with clientonly, for a mode 3
+ * one.  Otherwise it keeps the whole datagram.  skb->data is at the
+ * UDP header, the network header is at SKF_NET_OFF.
+ */
+static bool
+bpf_load_prog(void)
+{
+	static char	license[] = "Dual BSD/GPL";
+	union bpf_attr	attr;
+	const struct bpf_insn prog[] = {
+/* 0 */		MOV64_REG(BPF_REG_6, BPF_REG_1),
+		LDX(BPF_W, BPF_REG_2, BPF_REG_6, SKB(protocol)),
+		ST(BPF_W, BPF_REG_10, KEY, 128),
+		ST(BPF_W, BPF_REG_10, COUNT_KEY, 0),
+		JMP_IMM(BPF_JEQ, BPF_REG_2, htons(ETH_P_IP), 13),  /* v4 */
+/* 5 */		JMP_IMM(BPF_JNE, BPF_REG_2, htons(ETH_P_IPV6), 42),
+		/* IPv6 source, LD_ABS takes it to host order */
+		LD_ABS(BPF_W, SKF_NET_OFF + 8),
+		TO_BE32(BPF_REG_0),
+		STX(BPF_W, BPF_REG_10, BPF_REG_0, KEY + 4),
+		LD_ABS(BPF_W, SKF_NET_OFF + 12),
+/* 10 */	TO_BE32(BPF_REG_0),
+		STX(BPF_W, BPF_REG_10, BPF_REG_0, KEY + 8),
+		LD_ABS(BPF_W, SKF_NET_OFF + 16),
+		TO_BE32(BPF_REG_0),
+		STX(BPF_W, BPF_REG_10, BPF_REG_0, KEY + 12),
+/* 15 */	LD_ABS(BPF_W, SKF_NET_OFF + 20),
+		TO_BE32(BPF_REG_0),
+		JA(5),						/* last */
+		/* v4: IPv4 source, mapped */
+		ST(BPF_W, BPF_REG_10, KEY + 4, 0),
+		ST(BPF_W, BPF_REG_10, KEY + 8, 0),
+/* 20 */	ST(BPF_W, BPF_REG_10, KEY + 12, (int32_t)htonl(0xffff)),
+		LD_ABS(BPF_W, SKF_NET_OFF + 12),
+		TO_BE32(BPF_REG_0),
+		/* last */
+		STX(BPF_W, BPF_REG_10, BPF_REG_0, KEY + 16),
+		LD_MAP(BPF_REG_1, map_fd),
+/* 26 */	MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, KEY),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 18),		/* pass */
+/* 30 */	LDX(BPF_DW, BPF_REG_7, BPF_REG_0, 0),
+		LDX(BPF_DW, BPF_REG_8, BPF_REG_0, 8),
+		CALL(BPF_FUNC_ktime_get_ns),
+		JMP_REG(BPF_JGE, BPF_REG_0, BPF_REG_7, 14),	/* pass */
+		JMP_IMM(BPF_JEQ, BPF_REG_8, 0, 3),		/* drop */
+/* 35 */	LD_ABS(BPF_B, 8),	/* li_vn_mode, after the UDP header */
+		AND64_IMM(BPF_REG_0, 7),
+		JMP_IMM(BPF_JNE, BPF_REG_0, MODE_CLIENT, 10),	/* pass */
+		/* drop: count it */
+		LD_MAP(BPF_REG_1, count_fd),
+/* 40 */	MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, COUNT_KEY),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2),
+		MOV64_IMM(BPF_REG_1, 1),
+/* 45 */	XADD64(BPF_REG_0, BPF_REG_1, 0),
+		MOV64_IMM(BPF_REG_0, 0),
+		EXIT(),
+		/* pass */
+		LDX(BPF_W, BPF_REG_0, BPF_REG_6, SKB(len)),
+		EXIT(),
+	};
+
+	ZERO(attr);
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = COUNTOF(prog);
+	attr.license = (uintptr_t)license;
+	prog_fd = bpf_call(BPF_PROG_LOAD, &attr);
+	return prog_fd >= 0;
+}
+
+
+/*
+ * bpf_filter_start - load the filter for "bpffilter".  Called at
+ * config time, before the sockets open and before droproot.
+ */
+void
+bpf_filter_start(void)
+{
+	if (!bpf_filtering || prog_fd >= 0)
+		return;
+	if (!bpf_load()) {
+		msyslog(LOG_ERR, "INIT: bpffilter: can't load the filter: %s",
+			strerror(errno));
+		if (map_fd >= 0)
+			close(map_fd);
+		if (count_fd >= 0)
+			close(count_fd);
+		map_fd = count_fd = -1;
+		bpf_filtering = false;
+		return;
+	}
+	restrict_refilter();
+	msyslog(LOG_INFO, "INIT: bpffilter: dropping ignored and limited "
+		"sources in the kernel");
+}
+
+
+bool
+bpf_filter_loaded(void)
+{
+	return prog_fd >= 0;
+}
+
+
+/*
+ * bpf_filter_attach - filter a socket's input, if there is a filter
+ */
+void
+bpf_filter_attach(
+	SOCKET	fd
+	)
+{
+	if (prog_fd < 0)
+		return;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_BPF, &prog_fd,
+		       sizeof(prog_fd)) < 0)
+		msyslog(LOG_ERR, "IO: bpffilter: attach to socket %d: %s",
+			fd, strerror(errno));
+}
+
+
+/*
+ * bpf_filter_begin - start collecting the prefixes of a restrict
+ * snapshot
+ */
+void
+bpf_filter_begin(void)
+{
+	nbuilding = 0;
+	broken = false;
+}
+
+
+/*
+ * bpf_filter_prefix - note a prefix of addr, 16 octets, IPv4 ones
+ * mapped.  The drops of all the entries for a prefix must agree, a
+ * sure one wins.  Returns false once there's no more room.
+ */
+bool
+bpf_filter_prefix(
+	const uint8_t *	addr,
+	int		plen,
+	bool		drop,
+	bool		sure
+	)
+{
+	struct bpf_prefix *p;
+
+	if (nbuilding >= BPF_RESTRICT_MAX) {
+		if (!sure)
+			broken = true;
+		return false;
+	}
+	if (nbuilding == building_alloc) {
+		building_alloc = max(2 * building_alloc, 64);
+		building = erealloc(building,
+				    building_alloc * sizeof(*building));
+	}
+	p = &building[nbuilding++];
+	ZERO(*p);
+	p->key.plen = (uint32_t)plen;
+	for (int i = 0; i < 16 && plen > 0; i++, plen -= 8)
+		p->key.addr[i] = (plen >= 8) ? addr[i]
+		    : addr[i] & (uint8_t)(0xff << (8 - plen));
+	p->drop = drop || sure;
+	p->sure = sure;
+	return true;
+}
+
+
+/*
+ * bpf_filter_commit - make the map what bpf_filter_prefix() said,
+ * holds apart
+ */
+void
+bpf_filter_commit(void)
+{
+	static const struct bpf_val pass = { 0, 0 };
+	static const struct bpf_val drop = { BPF_DROP_ALL, 0 };
+	struct bpf_prefix *fresh;
+	size_t		n = 0, m;
+
+	qsort(building, nbuilding, sizeof(*building), bpf_key_cmp);
+	for (size_t i = 0; i < nbuilding; i++) {
+		if (n > 0 && 0 == bpf_key_cmp(&building[n - 1], &building[i])) {
+			building[n - 1].sure |= building[i].sure;
+			building[n - 1].drop = building[n - 1].sure ||
+			    (building[n - 1].drop && building[i].drop);
+		} else
+			building[n++] = building[i];
+	}
+	/* what a sure drop covers drops too, IPv4 apart from IPv6 */
+	for (size_t i = 0; i < n; i++) {
+		struct bpf_prefix cover = building[i];
+		int	least = bpf_mapped(cover.key.addr) ? 96 : 0;
+		int	p = (int)cover.key.plen;
+
+		while (!building[i].drop && p-- > least) {
+			const struct bpf_prefix *found;
+
+			cover.key.addr[p / 8] &= (uint8_t)(0xff00 >> (p % 8));
+			cover.key.plen = (uint32_t)p;
+			found = bsearch(&cover, building, n, sizeof(*building),
+					bpf_key_cmp);
+			if (NULL != found && found->sure)
+				building[i].drop = true;
+		}
+	}
+	fresh = emalloc_zero(max(n, 1) * sizeof(*fresh));
+	memcpy(fresh, building, n * sizeof(*fresh));
+
+	pthread_mutex_lock(&bpf_lock);
+	/* passes first, so no drop covers more than it should meanwhile */
+	for (size_t i = 0; i < n && !broken; i++)
+		if (!fresh[i].drop && !bpf_set(&fresh[i].key, &pass))
+			broken = true;
+	if (broken) {
+		msyslog(LOG_ERR, "IO: bpffilter: restrict lists don't fit "
+			"the map, filtering only limited sources");
+		for (size_t i = 0; i < n; i++)
+			bpf_unset(&fresh[i].key);
+		n = 0;
+	}
+	/* a drop the map won't take is left to restrictions() */
+	m = 0;
+	for (size_t i = 0; i < n; i++)
+		if (!fresh[i].drop || bpf_set(&fresh[i].key, &drop))
+			fresh[m++] = fresh[i];
+	n = m;
+	for (size_t i = 0; i < nprefixes; i++)
+		if (NULL == bsearch(&prefixes[i], fresh, n, sizeof(*fresh),
+				    bpf_key_cmp))
+			bpf_unset(&prefixes[i].key);
+	free(prefixes);
+	prefixes = fresh;
+	nprefixes = n;
+	bpf_apply_holds();
+	pthread_mutex_unlock(&bpf_lock);
+}
+
+
+/*
+ * bpf_apply_holds - put the holds back over what the restrict lists
+ * pass.  Call with bpf_lock held.
+ */
+static void
+bpf_apply_holds(void)
+{
+	const struct bpf_prefix *res;
+	struct bpf_key	key;
+	struct bpf_val	val;
+
+	ZERO(key);
+	key.plen = 128;
+	for (size_t i = 0; i < nholds; i++) {
+		memcpy(key.addr, holds[i].addr, sizeof(key.addr));
+		res = bpf_restricted(&key);
+		if (NULL != res && res->drop)
+			continue;
+		val.until = holds[i].until;
+		val.clientonly = 1;
+		bpf_set(&key, &val);
+	}
+}
+
+
+/*
+ * bpf_filter_hold - drop client requests from addr for the next secs
+ * seconds.  Any thread.
+ */
+void
+bpf_filter_hold(
+	const sockaddr_u *	addr,
+	double			secs
+	)
+{
+	struct bpf_key	key;
+	struct bpf_val	val;
+	const struct bpf_prefix *res;
+	size_t		i;
+
+	if (prog_fd < 0)
+		return;
+	ZERO(key);
+	key.plen = 128;
+	if (IS_IPV4(addr)) {
+		key.addr[10] = key.addr[11] = 0xff;
+		memcpy(&key.addr[12], &NSRCADR(addr), 4);
+	} else if (IS_IPV6(addr)) {
+		memcpy(key.addr, PSOCK_ADDR6(addr), 16);
+	} else
+		return;
+	val.until = bpf_now() + (uint64_t)(secs * 1e9);
+	val.clientonly = 1;
+
+	pthread_mutex_lock(&bpf_lock);
+	for (i = 0; i < nholds; i++)
+		if (0 == memcmp(holds[i].addr, key.addr, sizeof(key.addr)))
+			break;
+	res = bpf_restricted(&key);
+	if ((i == nholds && nholds == BPF_HOLDS) ||
+	    (NULL != res && res->drop)) {
+		pthread_mutex_unlock(&bpf_lock);
+		return;
+	}
+	if (i == nholds) {
+		memcpy(holds[i].addr, key.addr, sizeof(key.addr));
+		holds[i].until = 0;
+		nholds++;
+	}
+	holds[i].until = max(holds[i].until, val.until);
+	val.until = holds[i].until;
+	bpf_set(&key, &val);
+	pthread_mutex_unlock(&bpf_lock);
+}
+
+
+/*
+ * bpf_filter_timer - let go of the holds that are over, once a second
+ */
+void
+bpf_filter_timer(void)
+{
+	static const struct bpf_val pass = { 0, 0 };
+	const struct bpf_prefix *res;
+	struct bpf_key	key;
+	uint64_t	now;
+	size_t		n = 0;
+
+	if (prog_fd < 0)
+		return;
+	now = bpf_now();
+	ZERO(key);
+	key.plen = 128;
+	pthread_mutex_lock(&bpf_lock);
+	for (size_t i = 0; i < nholds; i++) {
+		if (holds[i].until > now) {
+			holds[n++] = holds[i];
+			continue;
+		}
+		memcpy(key.addr, holds[i].addr, sizeof(key.addr));
+		res = bpf_restricted(&key);
+		if (NULL == res)
+			bpf_unset(&key);
+		else if (!res->drop)
+			bpf_set(&key, &pass);
+	}
+	nholds = n;
+	pthread_mutex_unlock(&bpf_lock);
+}
+
+
+/*
+ * bpf_dropped_count - datagrams the filter has dropped
+ */
+uint64_t
+bpf_dropped_count(void)
+{
+	union bpf_attr	attr;
+	uint32_t	index = 0;
+	uint64_t	count = 0;
+
+	if (count_fd < 0)
+		return 0;
+	ZERO(attr);
+	attr.map_fd = (uint32_t)count_fd;
+	attr.key = (uintptr_t)&index;
+	attr.value = (uintptr_t)&count;
+	bpf_call(BPF_MAP_LOOKUP_ELEM, &attr);
+	return count;
+}
+
+#else	/* !USE_BPF_FILTER */
+
+void
+bpf_filter_start(void)
+{
+	if (bpf_filtering) {
+		msyslog(LOG_WARNING,
+			"INIT: bpffilter: not supported on this system, ignored");
+		bpf_filtering = false;
+	}
+}
+
+bool
+bpf_filter_loaded(void)
+{
+	return false;
+}
+
+void
+bpf_filter_attach(
+	SOCKET	fd
+	)
+{
+	UNUSED_ARG(fd);
+}
+
+void
+bpf_filter_begin(void)
+{
+}
+
+bool
+bpf_filter_prefix(
+	const uint8_t *	addr,
+	int		plen,
+	bool		drop,
+	bool		sure
+	)
+{
+	UNUSED_ARG(addr);
+	UNUSED_ARG(plen);
+	UNUSED_ARG(drop);
+	UNUSED_ARG(sure);
+	return false;
+}
+
+void
+bpf_filter_commit(void)
+{
+}
+
+void
+bpf_filter_hold(
+	const sockaddr_u *	addr,
+	double			secs
+	)
+{
+	UNUSED_ARG(addr);
+	UNUSED_ARG(secs);
+}
+
+void
+bpf_filter_timer(void)
+{
+}
+
+uint64_t
+bpf_dropped_count(void)
+{
+	return 0;
+}
+#endif	/* !USE_BPF_FILTER */
@@ -157,6 +157,42 @@ char *ntp_signd_socket = default_ntp_signd_socket;
 
 struct REMOTE_CONFIG_INFO remote_config;  /* Remote configuration buffer and
 					     pointer info */
+
+/*
+ * What the config file last asked for, for reload_config() to compare
+ * the file against when it changes.  Restrictions are noted as
+ * hack_restrict() calls and folded into the flags each address, mask
+ * and mflags ended up with; peers are kept as their config lines.
+ */
+typedef struct res_note_tag {
+	sockaddr_u	addr;		/* masked, no port */
+	sockaddr_u	mask;
+	unsigned short	mflags;
+	unsigned short	flags;
+	int		op;		/* RESTRICT_*, before folding */
+	int		seq;		/* order noted, before folding */
+} res_note;
+
+typedef struct res_notes_tag {
+	res_note *	note;
+	size_t		count;
+	size_t		alloc;
+} res_notes;
+
+static res_notes	file_restrict;	/* folded, sorted */
+static res_notes	new_restrict;	/* being noted */
+static bool		restrict_set_noted;	/* config has restrict set */
+
+typedef struct peer_note_tag {
+	char *		address;
+	unsigned short	type;
+	int		host_mode;
+	struct peer_ctl	ctl;		/* as parsed */
+} peer_note;
+
+static peer_note *	file_peers;
+static size_t		file_peer_count;
+const char *	config_path;	/* for reload_config(), and the tests */
 /* FUNCTION PROTOTYPES */
 
 static void init_syntax_tree(config_tree *);
@@ -183,6 +219,7 @@ static void free_config_system_opts(config_tree *);
 static void free_config_extra(config_tree *);
 static void free_config_tinker(config_tree *);
 static void free_config_nts(config_tree *);
+static void free_config_threads(config_tree *);
 static void free_config_tos(config_tree *);
 static void free_config_unpeers(config_tree *);
 static void free_config_vars(config_tree *);
@@ -192,6 +229,7 @@ static void free_config_tree(config_tree *ptree);
 static void destroy_restrict_node(restrict_node *my_node);
 static bool is_sane_resolved_address(sockaddr_u *peeraddr, int hmode);
 static void save_and_apply_config_tree(bool from_file);
+static int parse_config_files(const char *config_file);
 static void destroy_int_fifo(int_fifo *);
 #define FREE_INT_FIFO(pf)			\
 	do {					\
@@ -216,6 +254,12 @@ static void destroy_filegen_fifo(filegen_fifo *);
 		destroy_filegen_fifo(pf);	\
 		(pf) = NULL;			\
 	} while (0)
+static void destroy_thread_fifo(thread_fifo *);
+#define FREE_THREAD_FIFO(pf)			\
+	do {					\
+		destroy_thread_fifo(pf);	\
+		(pf) = NULL;			\
+	} while (0)
 static void destroy_restrict_fifo(restrict_fifo *);
 #define FREE_RESTRICT_FIFO(pf)			\
 	do {					\
@@ -242,13 +286,16 @@ static void config_system_opts(config_tree *);
 static void config_extra(config_tree *);
 static void config_tinker(config_tree *);
 static void config_nts(config_tree *);
+static void config_threads(config_tree *);
 static void config_tos(config_tree *);
 static void config_logfile(config_tree *);
 static void config_vars(config_tree *);
 
 static void config_ntpd(config_tree *, bool input_from_file);
 static void config_auth(config_tree *);
-static void config_access(config_tree *);
+typedef void (*restrict_fn)(int, sockaddr_u *, sockaddr_u *,
+			    unsigned short, unsigned short);
+static void config_access(config_tree *, restrict_fn);
 static void config_mdnstries(config_tree *);
 static void config_phone(config_tree *);
 static void config_setvar(config_tree *);
@@ -268,6 +315,17 @@ static uint32_t get_pfxmatch(const char **, struct masks *);
 static uint32_t get_match(const char *, struct masks *);
 static uint32_t get_logmask(const char *);
 static int getnetnum(const char *num, sockaddr_u *addr);
+static void unpeer_by_name(const char *name, unsigned short type);
+static void note_restrict(int, sockaddr_u *, sockaddr_u *,
+			  unsigned short, unsigned short);
+static void note_and_hack_restrict(int, sockaddr_u *, sockaddr_u *,
+				   unsigned short, unsigned short);
+static void begin_restrict_notes(void);
+static void fold_restrict_notes(void);
+static void keep_restrict_notes(void);
+static void note_peers(config_tree *);
+static void reload_restrict(void);
+static void reload_peers(config_tree *);
 static void fix_node_cidr(restrict_node *my_node);
 
 
@@ -333,6 +391,7 @@ free_config_tree(
 	free_config_extra(ptree);
 	free_config_tinker(ptree);
 	free_config_nts(ptree);
+	free_config_threads(ptree);
 	free_config_rlimit(ptree);
 	free_config_system_opts(ptree);
 	free_config_logconfig(ptree);
@@ -596,10 +655,18 @@ create_peer_node(
 				my_node->ctl.flags |= FLAG_BURST;
 				break;
 
+			case T_Fit:
+				my_node->ctl.flags |= FLAG_FIT;
+				break;
+
 			case T_Iburst:
 				my_node->ctl.flags |= FLAG_IBURST;
 				break;
 
+			case T_Iothread:
+				my_node->ctl.flags |= FLAG_IOTHREAD;
+				break;
+
 			case T_Noselect:
 				my_node->ctl.flags |= FLAG_NOSELECT;
 				break;
@@ -617,6 +684,14 @@ create_peer_node(
 				break;
 #endif
 
+			case T_Ppsthread:
+				my_node->ctl.flags |= FLAG_PPSTHREAD;
+				break;
+
+			case T_Probe:
+				my_node->ctl.flags |= FLAG_PROBE;
+				break;
+
 			case T_Prefer:
 				my_node->ctl.flags |= FLAG_PREFER;
 				break;
@@ -624,6 +699,10 @@ create_peer_node(
 			case T_True:
 				my_node->ctl.flags |= FLAG_TRUE;
 				break;
+
+			case T_Xleave:
+				my_node->ctl.flags |= FLAG_XLEAVE;
+				break;
 			}
 			break;
 
@@ -715,6 +794,19 @@ create_peer_node(
 			my_node->ctl.baud = option->value.u;
 			break;
 
+		case T_Stages:
+			if (option->value.i < 1 ||
+			    option->value.i > FILTER_STAGES_MAX) {
+				msyslog(LOG_ERR,
+					"CONFIG: stages: value (%d) out of range [1-%d]",
+					option->value.i, FILTER_STAGES_MAX);
+				errflag = true;
+			} else {
+				my_node->ctl.stages =
+					(uint32_t)option->value.i;
+			}
+			break;
+
 			/*
 			 * Past this point are options the old syntax
 			 * handled in fudge processing. They're parsed
@@ -858,6 +950,22 @@ create_filegen_node(
 }
 
 
+thread_node *
+create_thread_node(
+	int		thread_class,
+	attr_val_fifo *	options
+	)
+{
+	thread_node *my_node;
+
+	my_node = emalloc_zero(sizeof(*my_node));
+	my_node->thread_class = thread_class;
+	my_node->options = options;
+
+	return my_node;
+}
+
+
 restrict_node *
 create_restrict_node(
 	const int       mode,
@@ -891,6 +999,7 @@ destroy_restrict_node(
 	destroy_address_node(my_node->addr);
 	destroy_address_node(my_node->mask);
 	destroy_int_fifo(my_node->flags);
+	free(my_node->set);
 	free(my_node);
 }
 
@@ -975,6 +1084,26 @@ destroy_filegen_fifo(
 }
 
 
+static void
+destroy_thread_fifo(
+	thread_fifo *	fifo
+	)
+{
+	thread_node *	tn;
+
+	if (fifo != NULL) {
+		for (;;) {
+			UNLINK_FIFO(tn, *fifo, link);
+			if (tn == NULL)
+				break;
+			destroy_attr_val_fifo(tn->options);
+			free(tn);
+		}
+		free(fifo);
+	}
+}
+
+
 static void
 destroy_restrict_fifo(
 	restrict_fifo *	fifo
@@ -1258,6 +1387,10 @@ config_tos(
 			item = PROTO_MINSANE;
 			break;
 
+		case T_Faststart:
+			item = PROTO_FASTSTART;
+			break;
+
 		}
 		proto_config(item, 0, val);
 	}
@@ -1281,6 +1414,7 @@ config_monitor(
 	int_node *pfilegen_token;
 	const char *filegen_string;
 	const char *filegen_file;
+	const char *filegen_target;
 	FILEGEN *filegen;
 	filegen_node *my_node;
 	attr_val *my_opts;
@@ -1336,6 +1470,7 @@ config_monitor(
 			continue;
 		}
 		filegen_file = filegen_string;
+		filegen_target = NULL;
 
 		/* Initialize the filegen variables to their pre-configuration states */
 		filegen_flag = filegen->flag;
@@ -1352,6 +1487,10 @@ config_monitor(
 				filegen_file = my_opts->value.s;
 				break;
 
+			case T_Stream:
+				filegen_target = my_opts->value.s;
+				break;
+
 			case T_Type:
 				switch (my_opts->value.i) {
 
@@ -1400,6 +1539,34 @@ config_monitor(
 					filegen_flag &= ~FGEN_FLAG_LINK;
 					break;
 
+				case T_Binary:
+					if (NULL == filegen->fields) {
+						msyslog(LOG_ERR,
+							"CONFIG: filegen %s has no binary format",
+							filegen_string);
+						break;
+					}
+					filegen_flag |= FGEN_FLAG_BINARY;
+					break;
+
+				case T_Text:
+					filegen_flag &= ~FGEN_FLAG_BINARY;
+					break;
+
+				case T_Compress:
+#ifdef HAVE_ZLIB_H
+					filegen_flag |= FGEN_FLAG_COMPRESS;
+#else
+					msyslog(LOG_ERR,
+						"CONFIG: filegen %s compress needs zlib, ignored",
+						filegen_string);
+#endif
+					break;
+
+				case T_Nocompress:
+					filegen_flag &= ~FGEN_FLAG_COMPRESS;
+					break;
+
 				case T_Enable:
 					filegen_flag |= FGEN_FLAG_ENABLED;
 					break;
@@ -1425,6 +1592,8 @@ config_monitor(
 		}
 		filegen_config(filegen, statsdir, filegen_file,
 			       (unsigned int)filegen_type, (unsigned int)filegen_flag);
+		if (NULL != filegen_target)
+			filegen_stream(filegen, filegen_target);
 	}
 }
 
@@ -1446,7 +1615,8 @@ free_config_monitor(
 
 static void
 config_access(
-	config_tree *ptree
+	config_tree *	ptree,
+	restrict_fn	apply
 	)
 {
 	static bool		warned_signd;
@@ -1538,6 +1708,28 @@ config_access(
 				mon_data.mru_maxdepth = UINT_MAX;
 			break;
 
+		case T_Clocksweep:
+			mon_data.mru_clocksweep = true;
+			break;
+
+		case T_Hugepages:
+			mon_data.mru_hugepages = true;
+			break;
+
+		case T_Sketch:
+			if (0 <= my_opt->value.i)
+				mon_data.mru_sketchkb = my_opt->value.u;
+			else
+				range_err = true;
+			break;
+
+		case T_Sweep:
+			if (0 <= my_opt->value.i)
+				mon_data.mru_sweep = my_opt->value.u;
+			else
+				range_err = true;
+			break;
+
 		default:
 			msyslog(LOG_ERR,
 				"CONFIG: Unknown mru option %s (%d)",
@@ -1572,6 +1764,47 @@ config_access(
 			mon_data.kod_limit = my_opt->value.d;
 			break;
 
+		case T_Kodmax:
+			if (0 <= my_opt->value.d)
+				mon_data.kod_max =
+				    (unsigned int)my_opt->value.d;
+			break;
+
+		case T_Duplicate:
+		case T_Dupdrop:
+			/* whichever comes last */
+			if (0 <= my_opt->value.d) {
+				mon_data.dup_window =
+				    dtolfp(my_opt->value.d / 1000);
+				mon_data.dup_drop = (T_Dupdrop == my_opt->attr);
+			}
+			break;
+
+		case T_Ctlaverage:
+			mon_data.ctl_average = my_opt->value.d;
+			break;
+
+		case T_Ctlburst:
+			mon_data.ctl_burst = my_opt->value.d;
+			break;
+
+		case T_Ctlslice:
+			if (0 <= my_opt->value.d)
+				mon_data.ctl_slice = my_opt->value.d;
+			break;
+
+		case T_Shed:
+			if (0 <= my_opt->value.d)
+				io_data.shed_average =
+				    (unsigned int)my_opt->value.d;
+			break;
+
+		case T_Shedburst:
+			if (1 <= my_opt->value.d)
+				io_data.shed_burst =
+				    (unsigned int)my_opt->value.d;
+			break;
+
 		}
 	}
 
@@ -1668,6 +1901,8 @@ config_access(
 		if ((RES_KOD & flags) && !(RES_LIMITED & flags)) {
 			const char *kod_where = (my_node->addr)
 					  ? my_node->addr->address
+					  : (my_node->set)
+					    ? my_node->set
 					  : (mflags & RESM_SOURCE)
 					    ? "source"
 					    : "default";
@@ -1677,6 +1912,18 @@ config_access(
 			msyslog(LOG_WARNING, "CONFIG: restrict %s: %s", kod_where, kod_warn);
 		}
 
+		if (NULL != my_node->set) {
+			/* the set's flags go on top of the lists' */
+			if (mflags)
+				msyslog(LOG_ERR,
+					"CONFIG: restrict set: line %d: ntpport ignored",
+					my_node->line_no);
+			restrict_set_noted = true;
+			restrict_set((T_Restrict == my_node->mode)
+					 ? my_node->set : NULL, flags);
+			continue;
+		}
+
 		ZERO_SOCK(&addr);
 		pai = NULL;
 		restrict_default = false;
@@ -1694,8 +1941,8 @@ config_access(
 				/* apply "restrict source ..." */
 				DPRINT(1, ("restrict source template mflags %x flags %x\n",
 					   mflags, flags));
-				hack_restrict(RESTRICT_FLAGS, NULL,
-					      NULL, mflags, flags);
+				apply(RESTRICT_FLAGS, NULL, NULL, mflags,
+				      flags);
 				continue;
 			}
 		} else {
@@ -1778,13 +2025,13 @@ config_access(
 			/* default case, do both -4 and -6 */
 			AF(&addr) = AF_INET;
 			AF(&mask) = AF_INET;
-			hack_restrict(op, &addr, &mask, mflags, flags);
+			apply(op, &addr, &mask, mflags, flags);
 			AF(&addr) = AF_INET6;
 			AF(&mask) = AF_INET6;
 		}
 
 		do {
-			hack_restrict(op, &addr, &mask, mflags, flags);
+			apply(op, &addr, &mask, mflags, flags);
 			if (pai != NULL &&
 			    NULL != (pai = pai->ai_next)) {
 				INSIST(pai->ai_addr != NULL);
@@ -1901,10 +2148,18 @@ config_tinker(
 			item = LOOP_ALLAN;
 			break;
 
+		case T_Budget:
+			item = LOOP_BUDGET;
+			break;
+
 		case T_Dispersion:
 			item = LOOP_PHI;
 			break;
 
+		case T_Fastloop:
+			item = LOOP_FASTLOOP;
+			break;
+
 		case T_Freq:
 			item = LOOP_FREQ;
 			break;
@@ -1960,6 +2215,16 @@ config_nts(
 			ntsconfig.aead = estrdup(nts->value.s);
 			break;
 
+		case T_Backlog:
+			if (nts->value.i < 1) {
+				msyslog(LOG_ERR,
+					"CONFIG: nts backlog %d out of range, ignored",
+					nts->value.i);
+				break;
+			}
+			ntsconfig.backlog = nts->value.i;
+			break;
+
 		case T_Ca:
 			free((void *)(intptr_t)ntsconfig.ca);
 			ntsconfig.ca = estrdup(nts->value.s);
@@ -1970,11 +2235,21 @@ config_nts(
 			ntsconfig.cert = estrdup(nts->value.s);
 			break;
 
+		case T_Clientcache:
+			free((void *)(intptr_t)ntsconfig.clientcache);
+			ntsconfig.clientcache = estrdup(nts->value.s);
+			break;
+
 		case T_Cookie:
 			free((void *)(intptr_t)ntsconfig.KI);
 			ntsconfig.KI = estrdup(nts->value.s);
 			break;
 
+		case T_Cookiesecret:
+			free((void *)(intptr_t)ntsconfig.cookiesecret);
+			ntsconfig.cookiesecret = estrdup(nts->value.s);
+			break;
+
 		case T_Disable:
 			ntsconfig.ntsenable = false;
 			break;
@@ -1998,10 +2273,24 @@ config_nts(
 			ntsconfig.mintls = estrdup(nts->value.s);
 			break;
 
+		case T_Kelimit:
+			if (nts->value.i < 0) {
+				msyslog(LOG_ERR,
+					"CONFIG: nts kelimit %d out of range, ignored",
+					nts->value.i);
+				break;
+			}
+			ntsconfig.kelimit = nts->value.i;
+			break;
+
 		case T_Port:
 			extra_port = nts->value.i;
 			break;
 
+		case T_Tickets:
+			ntsconfig.tickets = true;
+			break;
+
 		case T_Tlscipherserverpreference:
 			free((void *)(intptr_t)ntsconfig.tlscipherserverpreference);
 			ntsconfig.tlscipherserverpreference = true;
@@ -2016,12 +2305,139 @@ config_nts(
 			free((void *)(intptr_t)ntsconfig.tlsecdhcurves);
 			ntsconfig.tlsecdhcurves = estrdup(nts->value.s);
 			break;
+
+		case T_Workers:
+			if (nts->value.i < 1) {
+				msyslog(LOG_ERR,
+					"CONFIG: nts workers %d out of range, ignored",
+					nts->value.i);
+				break;
+			}
+			ntsconfig.workers = nts->value.i;
+			break;
 #endif
 		}
 	}
 }
 
 
+/*
+ * config_threads - where each class of thread runs, for ntp_affinity.c
+ */
+static void
+config_threads(
+	config_tree *ptree
+	)
+{
+	struct thread_conf *tc;
+	thread_node *tn;
+	attr_val *opt;
+	int cls, first, last;
+
+	for (tn = HEAD_PFIFO(ptree->threads); tn != NULL; tn = tn->link) {
+		switch (tn->thread_class) {
+		    case T_Main:
+			cls = THREAD_MAIN;
+			break;
+		    case T_Workers:
+			cls = THREAD_WORKERS;
+			break;
+		    case T_Ntske:
+			cls = THREAD_NTSKE;
+			break;
+		    case T_Dns:
+		    default:
+			cls = THREAD_DNS;
+			break;
+		}
+		tc = &thread_conf[cls];
+		ZERO(*tc);
+		tc->set = true;
+		tc->node = -1;
+
+		for (opt = HEAD_PFIFO(tn->options); opt != NULL;
+		     opt = opt->link) {
+			switch (opt->attr) {
+			    case T_Cpu:
+				if (T_Intrange == opt->type) {
+					first = opt->value.r.first;
+					last = opt->value.r.last;
+				} else {
+					first = last = opt->value.i;
+				}
+				if (first < 0 || last >= THREAD_CPUS
+				    || first > last) {
+					msyslog(LOG_ERR,
+						"CONFIG: thread %s: cpu %d..%d "
+						"out of range 0..%d, ignored",
+						keyword(tn->thread_class),
+						first, last, THREAD_CPUS - 1);
+					break;
+				}
+				for (; first <= last; first++)
+					tc->cpus[first / 64] |=
+						1ULL << (first % 64);
+				tc->has_cpus = true;
+				break;
+
+			    case T_Nice:
+				if (opt->value.i < -20 || opt->value.i > 19) {
+					msyslog(LOG_ERR,
+						"CONFIG: thread %s: nice %d "
+						"out of range -20..19, ignored",
+						keyword(tn->thread_class),
+						opt->value.i);
+					break;
+				}
+				tc->has_nice = true;
+				tc->nice = opt->value.i;
+				break;
+
+			    case T_Node:
+				if (opt->value.i < 0
+				    || opt->value.i >= THREAD_CPUS) {
+					msyslog(LOG_ERR,
+						"CONFIG: thread %s: node %d "
+						"out of range, ignored",
+						keyword(tn->thread_class),
+						opt->value.i);
+					break;
+				}
+				tc->node = opt->value.i;
+				break;
+
+			    case T_Priority:
+				if (opt->value.i < 1) {
+					msyslog(LOG_ERR,
+						"CONFIG: thread %s: priority %d "
+						"out of range, ignored",
+						keyword(tn->thread_class),
+						opt->value.i);
+					break;
+				}
+				tc->priority = opt->value.i;
+				break;
+
+			    default:
+				msyslog(LOG_ERR,
+					"CONFIG: thread: unknown option %d",
+					opt->attr);
+				break;
+			}
+		}
+	}
+}
+
+
+static void
+free_config_threads(
+	config_tree *ptree
+	)
+{
+	FREE_THREAD_FIFO(ptree->threads);
+}
+
+
 static void
 free_config_rlimit(
 	config_tree *ptree
@@ -2575,6 +2991,123 @@ config_vars(
 			qos = curr_var->value.i << 2;
 			break;
 
+		case T_Pkttrace:
+			if (curr_var->value.i < 0 ||
+			    curr_var->value.i > PKTTRACE_MAX) {
+				msyslog(LOG_ERR,
+					"CONFIG: pkttrace %d out of range 0..%d, ignored",
+					curr_var->value.i, PKTTRACE_MAX);
+				break;
+			}
+			/* the ring is made once, at startup */
+			pkttrace_slots = (unsigned int)curr_var->value.i;
+			break;
+
+		case T_Rxbatch:
+			if (curr_var->value.i < 1 ||
+			    curr_var->value.i > RX_BATCH_MAX) {
+				msyslog(LOG_ERR,
+					"CONFIG: rxbatch %d out of range 1..%d, ignored",
+					curr_var->value.i, RX_BATCH_MAX);
+				break;
+			}
+			rx_batch = curr_var->value.i;
+			break;
+
+		case T_Samples:
+			if (curr_var->value.i < 0 ||
+			    curr_var->value.i > SAMPLES_MAX) {
+				msyslog(LOG_ERR,
+					"CONFIG: samples %d out of range 0..%d, ignored",
+					curr_var->value.i, SAMPLES_MAX);
+				break;
+			}
+			/* each peer's ring follows at its next sample */
+			peer_samples = curr_var->value.i;
+			break;
+
+		case T_Singlesocket:
+			/* the wildcard sockets are set up once, at startup */
+			single_socket = true;
+			break;
+
+		case T_Iouring:
+			/* the ring is set up once, after the sockets open */
+			io_uring_input = true;
+			break;
+
+		case T_Bpffilter:
+			/* loaded once, before the sockets open */
+			bpf_filtering = true;
+			break;
+
+		case T_Lean:
+			/* read as the pools and rings are first made */
+			lean_memory = true;
+			break;
+
+		case T_Busypoll:
+			if (curr_var->value.i < 0 ||
+			    curr_var->value.i > BUSY_POLL_MAX) {
+				msyslog(LOG_ERR,
+					"CONFIG: busypoll %d out of range 0..%d, ignored",
+					curr_var->value.i, BUSY_POLL_MAX);
+				break;
+			}
+			/* the poller starts once, after the sockets open */
+			busy_poll = curr_var->value.i;
+			break;
+
+		case T_Rcvbuf:		/* FALLTHROUGH */
+		case T_Rcvmax:		/* FALLTHROUGH */
+		case T_Sndbuf:
+			if (curr_var->value.i < 0 ||
+			    curr_var->value.i > SOCKBUF_MAX) {
+				msyslog(LOG_ERR,
+					"CONFIG: %s %d out of range 0..%d, ignored",
+					keyword(curr_var->attr),
+					curr_var->value.i, SOCKBUF_MAX);
+				break;
+			}
+			/* kilobytes; sockets opened from now on see it */
+			if (T_Rcvbuf == curr_var->attr)
+				sock_rcvbuf = curr_var->value.i * 1024;
+			else if (T_Rcvmax == curr_var->attr)
+				sock_rcvmax = curr_var->value.i * 1024;
+			else
+				sock_sndbuf = curr_var->value.i * 1024;
+			break;
+
+		case T_Statsflush:
+			if (curr_var->value.i < 0 ||
+			    curr_var->value.i > FILEGEN_WINDOW_MAX) {
+				msyslog(LOG_ERR,
+					"CONFIG: statsflush %d out of range 0..%d, ignored",
+					curr_var->value.i, FILEGEN_WINDOW_MAX);
+				break;
+			}
+			filegen_window = curr_var->value.i;
+			break;
+
+		case T_Workers:
+			if (curr_var->value.i < 0 ||
+			    curr_var->value.i > WORKERS_MAX) {
+				msyslog(LOG_ERR,
+					"CONFIG: workers %d out of range 0..%d, ignored",
+					curr_var->value.i, WORKERS_MAX);
+				break;
+			}
+#ifndef SO_REUSEPORT
+			if (curr_var->value.i > 0) {
+				msyslog(LOG_ERR,
+					"CONFIG: workers needs SO_REUSEPORT, ignored");
+				break;
+			}
+#endif
+			/* the pool is sized once, as the sockets open */
+			server_workers = curr_var->value.i;
+			break;
+
 		case T_WanderThreshold:		/* FALLTHROUGH */
 		case T_Nonvolatile:
 			wander_threshold = curr_var->value.d;
@@ -2599,6 +3132,26 @@ config_vars(
 			stats_config(STATS_PID_FILE, curr_var->value.s);
 			break;
 
+		case T_Statefile:
+			stats_config(STATS_STATE_FILE, curr_var->value.s);
+			break;
+
+		case T_Metrics:
+			metrics_config(curr_var->value.s);
+			break;
+
+		case T_Hwtimestamp:
+			hwstamp_config(curr_var->value.s);
+			break;
+
+		case T_Handover:
+			handover_config(curr_var->value.s);
+			break;
+
+		case T_Controlsocket:
+			ctlstream_config(curr_var->value.s);
+			break;
+
 		case T_Logfile:
 			/* processed in config_logfile */
 			break;
@@ -2892,10 +3445,7 @@ config_unpeers(
 	config_tree *ptree
 	)
 {
-	sockaddr_u		peeraddr;
 	struct peer *		p;
-	const char *		name;
-	int			rc;
 
 	unpeer_node * curr_unpeer = HEAD_PFIFO(ptree->unpeers);
 	for (; curr_unpeer != NULL; curr_unpeer = curr_unpeer->link) {
@@ -2920,34 +3470,52 @@ config_unpeers(
 			continue;
 		}
 
-		ZERO(peeraddr);
-		AF(&peeraddr) = curr_unpeer->addr->type;
-		name = curr_unpeer->addr->address;
-		rc = getnetnum(name, &peeraddr);
-		/* Do we have a numeric address? */
-		if (rc > 0) {
-			DPRINT(1, ("unpeer: searching for %s\n",
-				   socktoa(&peeraddr)));
-			p = findexistingpeer(&peeraddr, NULL, NULL, -1);
-			if (p != NULL) {
-				msyslog(LOG_NOTICE, "CONFIG: unpeered %s",
-					socktoa(&peeraddr));
-				peer_clear(p, "GONE", true);
-				unpeer(p);
-			}
+		unpeer_by_name(curr_unpeer->addr->address,
+			       curr_unpeer->addr->type);
+	}
+}
 
-			continue;
-		}
 
-		/* It's not a numeric IP address... */
+/*
+ * unpeer_by_name - remove the association for a numeric address or
+ *		    a hostname, as written in the config
+ */
+static void
+unpeer_by_name(
+	const char *	name,
+	unsigned short	type
+	)
+{
+	sockaddr_u		peeraddr;
+	struct peer *		p;
+	int			rc;
 
-		/* It's a hostname. */
-		p = findexistingpeer(NULL, name, NULL, -1);
+	ZERO(peeraddr);
+	AF(&peeraddr) = type;
+	rc = getnetnum(name, &peeraddr);
+	/* Do we have a numeric address? */
+	if (rc > 0) {
+		DPRINT(1, ("unpeer: searching for %s\n",
+			   socktoa(&peeraddr)));
+		p = findexistingpeer(&peeraddr, NULL, NULL, -1);
 		if (p != NULL) {
-			msyslog(LOG_NOTICE, "CONFIG: unpeered %s", name);
+			msyslog(LOG_NOTICE, "CONFIG: unpeered %s",
+				socktoa(&peeraddr));
 			peer_clear(p, "GONE", true);
 			unpeer(p);
 		}
+
+		return;
+	}
+
+	/* It's not a numeric IP address... */
+
+	/* It's a hostname. */
+	p = findexistingpeer(NULL, name, NULL, -1);
+	if (p != NULL) {
+		msyslog(LOG_NOTICE, "CONFIG: unpeered %s", name);
+		peer_clear(p, "GONE", true);
+		unpeer(p);
 	}
 }
 
@@ -3044,10 +3612,20 @@ config_ntpd(
 	config_monitor(ptree);
 	config_auth(ptree);
 	config_tos(ptree);
-	config_access(ptree);	/* before config_peers */
+	/* before config_peers */
+	if (input_from_files) {
+		begin_restrict_notes();
+		config_access(ptree, note_and_hack_restrict);
+		fold_restrict_notes();
+		keep_restrict_notes();
+	} else {
+		config_access(ptree, hack_restrict);
+	}
 	config_extra(ptree);
 	config_tinker(ptree);
 	config_nts(ptree);
+	if (input_from_files)
+		config_threads(ptree);
 	config_rlimit(ptree);
 	config_system_opts(ptree);
 	config_logconfig(ptree);
@@ -3055,13 +3633,19 @@ config_ntpd(
 	config_mdnstries(ptree);
 	config_setvar(ptree);
 	config_vars(ptree);
+	bpf_filter_start();
 
+	if (input_from_files)
+		handover_receive();	/* before we bind anything */
 	io_open_sockets();
 
+	if (input_from_files)
+		note_peers(ptree);
 	config_peers(ptree);
 	config_unpeers(ptree);
 	config_fudge(ptree);
 	config_reset_counters(ptree);
+	ctl_sysvars_changed();
 }
 
 
@@ -3117,13 +3701,42 @@ void init_readconfig(void)
 	init_syntax_tree(&cfgt);
 }
 
+/*
+ * parse_config_files() - parse the config file and the directory of
+ * snippets beside it into cfgt, returning how many were there
+ */
+static int
+parse_config_files(const char *config_file)
+{
+	char	dirpath[PATH_MAX];
+	int	srccount = 0;
+
+	/* parse the plain config file if it exists */
+	if (lex_init_stack(config_file, "r")) {
+		msyslog(LOG_INFO, "CONFIG: readconfig: parsing file: %s", config_file);
+	 	yyparse();
+		++srccount;
+		//cfgt.source.value.s = estrdup(config_file);
+	}
+
+	/* parse configs in parallel subdirectory if that exists */
+	reparent(dirpath, sizeof(dirpath), config_file, CONFIG_DIR);
+	if (is_directory(dirpath) && lex_push_file(dirpath)) {
+		msyslog(LOG_INFO, "CONFIG: readconfig: parsing directory: %s", dirpath);
+	    yyparse();
+	    ++srccount;
+	}
+
+	lex_drop_stack();
+	return srccount;
+}
+
 /*
  * readconfig() - process startup configuration file
  */
 void readconfig(const char *config_file)
 {
 	char	line[256];
-	char	dirpath[PATH_MAX];
 	int	srccount;
 	/*
 	 * install a non default variable with this daemon version
@@ -3144,30 +3757,13 @@ void readconfig(const char *config_file)
 	/* Moved to init_readconfig so command lines can contribute info
 	 * init_syntax_tree(&cfgt);
 	 */
-	srccount = 0;
-
-	/* parse the plain config file if it exists */
-	if (lex_init_stack(config_file, "r")) {
-		msyslog(LOG_INFO, "CONFIG: readconfig: parsing file: %s", config_file);
-	 	yyparse();
-		++srccount;
-		//cfgt.source.value.s = estrdup(config_file);
-	}
-
-	/* parse configs in parallel subdirectory if that exists */
-	reparent(dirpath, sizeof(dirpath), config_file, CONFIG_DIR);
-	if (is_directory(dirpath) && lex_push_file(dirpath)) {
-		msyslog(LOG_INFO, "CONFIG: readconfig: parsing directory: %s", dirpath);
-	    yyparse();
-	    ++srccount;
-	}
+	config_path = config_file;
+	srccount = parse_config_files(config_file);
 
 	if (srccount == 0) {
 	    io_open_sockets();
 	}
 
-	lex_drop_stack();
-
 	DPRINT(1, ("Finished Parsing!!\n"));
 
 	//cfgt.source.attr = CONF_SOURCE_FILE;
@@ -3225,6 +3821,480 @@ save_and_apply_config_tree(bool input_from_file)
 }
 
 
+/*
+ * reload_config() - on SIGHUP, read the config file again and apply
+ * what changed in it to the running daemon
+ *
+ * Only restrictions, associations, mru, limit and tos settings are
+ * compared; everything else in the file needs a restart.  Restrictions
+ * and associations the file no longer has are removed, new ones are
+ * added and changed ones are fixed up, so associations that did not
+ * change keep their filter state and the MRU list is kept whole.
+ * tos, mru and limit settings are applied as given; one dropped from
+ * the file keeps its current value.  Changes made with ntpq :config
+ * are left alone.  A file that does not parse cleanly changes nothing.
+ */
+void
+reload_config(void)
+{
+	config_tree *ptree;
+	int saved_errors;
+
+	if (NULL == config_path)
+		return;
+	if (0 != access(config_path, R_OK)) {
+		msyslog(LOG_ERR, "CONFIG: reload: can't read %s: %s",
+			config_path, strerror(errno));
+		return;
+	}
+
+	saved_errors = parsing_errors;
+	parsing_errors = 0;
+	init_syntax_tree(&cfgt);
+	parse_config_files(config_path);
+	ptree = emalloc(sizeof(*ptree));
+	memcpy(ptree, &cfgt, sizeof(*ptree));
+	ZERO(cfgt);
+
+	if (0 < parsing_errors) {
+		msyslog(LOG_ERR,
+			"CONFIG: reload: saw %d parsing errors in %s, nothing changed",
+			parsing_errors, config_path);
+		parsing_errors = saved_errors;
+		free_config_tree(ptree);
+		return;
+	}
+	parsing_errors = saved_errors;
+
+	config_tos(ptree);
+	begin_restrict_notes();
+	restrict_set_noted = false;
+	config_access(ptree, note_restrict);	/* and mru, limit */
+	fold_restrict_notes();
+	if (!restrict_set_noted)
+		restrict_set(NULL, 0);
+	reload_restrict();
+	reload_peers(ptree);
+	ctl_sysvars_changed();
+
+	free_config_tree(ptree);
+}
+
+
+/*
+ * note_restrict - note a hack_restrict() the config asks for
+ */
+static void
+note_restrict(
+	int		op,
+	sockaddr_u *	resaddr,
+	sockaddr_u *	resmask,
+	unsigned short	mflags,
+	unsigned short	flags
+	)
+{
+	res_note *	n;
+
+	if (NULL == resaddr) {
+		/* the "restrict source" template just gets set */
+		hack_restrict(op, resaddr, resmask, mflags, flags);
+		return;
+	}
+	if (new_restrict.count == new_restrict.alloc) {
+		new_restrict.alloc = new_restrict.alloc
+					 ? 2 * new_restrict.alloc : 64;
+		new_restrict.note = erealloc(new_restrict.note,
+			new_restrict.alloc * sizeof(*new_restrict.note));
+	}
+	n = &new_restrict.note[new_restrict.count];
+	ZERO(*n);
+	AF(&n->addr) = AF(resaddr);
+	AF(&n->mask) = AF(resaddr);
+	if (IS_IPV4(resaddr)) {
+		NSRCADR(&n->mask) = NSRCADR(resmask);
+		NSRCADR(&n->addr) = NSRCADR(resaddr) & NSRCADR(resmask);
+	} else {
+		for (int i = 0; i < 16; i++) {
+			NSRCADR6(&n->mask)[i] = NSRCADR6(resmask)[i];
+			NSRCADR6(&n->addr)[i] = NSRCADR6(resaddr)[i] &
+						NSRCADR6(resmask)[i];
+		}
+	}
+	n->mflags = mflags;
+	n->flags = flags;
+	n->op = op;
+	n->seq = (int)new_restrict.count++;
+}
+
+
+static void
+note_and_hack_restrict(
+	int		op,
+	sockaddr_u *	resaddr,
+	sockaddr_u *	resmask,
+	unsigned short	mflags,
+	unsigned short	flags
+	)
+{
+	if (resaddr != NULL)
+		note_restrict(op, resaddr, resmask, mflags, flags);
+	hack_restrict(op, resaddr, resmask, mflags, flags);
+}
+
+
+/* which restrict entry, ignoring flags */
+static int
+res_note_keycmp(
+	const res_note *	a,
+	const res_note *	b
+	)
+{
+	int	cmp;
+
+	if (AF(&a->addr) != AF(&b->addr))
+		return AF(&a->addr) - AF(&b->addr);
+	if (IS_IPV4(&a->addr)) {
+		cmp = memcmp(&NSRCADR(&a->addr), &NSRCADR(&b->addr), 4);
+		if (0 == cmp)
+			cmp = memcmp(&NSRCADR(&a->mask),
+				     &NSRCADR(&b->mask), 4);
+	} else {
+		cmp = memcmp(NSRCADR6(&a->addr), NSRCADR6(&b->addr), 16);
+		if (0 == cmp)
+			cmp = memcmp(NSRCADR6(&a->mask),
+				     NSRCADR6(&b->mask), 16);
+	}
+	if (0 == cmp)
+		cmp = a->mflags - b->mflags;
+	return cmp;
+}
+
+
+static int
+res_note_cmp(
+	const void *	va,
+	const void *	vb
+	)
+{
+	const res_note *a = va;
+	const res_note *b = vb;
+	int		cmp;
+
+	cmp = res_note_keycmp(a, b);
+	return (0 != cmp) ? cmp : a->seq - b->seq;
+}
+
+
+/*
+ * fold_restrict_notes - work out, as hack_restrict() would, which
+ * entries the noted calls leave and with what flags, and keep that as
+ * what the file asks for
+ */
+static void
+fold_restrict_notes(void)
+{
+	res_note *	n = new_restrict.note;
+	res_note	first;
+	size_t		i, j, out = 0;
+	bool		present, is_default;
+
+	if (new_restrict.count > 0)
+		qsort(n, new_restrict.count, sizeof(*n), res_note_cmp);
+	for (i = 0; i < new_restrict.count; i = j) {
+		first = n[i];
+		/* the defaults are there from the start, and stay */
+		is_default = (0 == first.mflags) && (IS_IPV4(&first.mask)
+			? 0 == NSRCADR(&first.mask)
+			: IN6_IS_ADDR_UNSPECIFIED(PSOCK_ADDR6(&first.mask)));
+		present = is_default;
+		first.flags = is_default ? RES_Default : 0;
+		for (j = i; j < new_restrict.count &&
+			    0 == res_note_keycmp(&n[j], &n[i]); j++) {
+			switch (n[j].op) {
+			case RESTRICT_FLAGS:
+				present = true;
+				first.flags |= n[j].flags;
+				break;
+			case RESTRICT_UNFLAG:
+				first.flags &= ~n[j].flags;
+				break;
+			default:	/* RESTRICT_REMOVE */
+				if (!is_default) {
+					present = false;
+					first.flags = 0;
+				}
+				break;
+			}
+		}
+		if (present)
+			n[out++] = first;
+	}
+	new_restrict.count = out;
+}
+
+
+/*
+ * begin_restrict_notes - start noting, with the default entries
+ * hack_restrict() always has
+ */
+static void
+begin_restrict_notes(void)
+{
+	sockaddr_u	any;
+
+	new_restrict.count = 0;
+	ZERO_SOCK(&any);
+	AF(&any) = AF_INET;
+	note_restrict(RESTRICT_FLAGS, &any, &any, 0, 0);
+	AF(&any) = AF_INET6;
+	note_restrict(RESTRICT_FLAGS, &any, &any, 0, 0);
+}
+
+
+/*
+ * keep_restrict_notes - the folded notes are now what the file asks
+ * for; the old array is kept for next time
+ */
+static void
+keep_restrict_notes(void)
+{
+	res_notes	old = file_restrict;
+
+	file_restrict = new_restrict;
+	new_restrict = old;
+}
+
+
+/*
+ * reload_restrict - take the restrict list from what the file asked
+ * for to what it asks for now
+ */
+static void
+reload_restrict(void)
+{
+	res_note *	was;
+	res_note *	now;
+	size_t		i = 0, j = 0;
+	int		cmp, added = 0, removed = 0, changed = 0;
+
+	while (i < file_restrict.count || j < new_restrict.count) {
+		was = &file_restrict.note[i];
+		now = &new_restrict.note[j];
+		if (i == file_restrict.count)
+			cmp = 1;
+		else if (j == new_restrict.count)
+			cmp = -1;
+		else
+			cmp = res_note_keycmp(was, now);
+		if (cmp < 0) {
+			hack_restrict(RESTRICT_REMOVE, &was->addr, &was->mask,
+				      was->mflags, 0);
+			removed++;
+			i++;
+		} else if (cmp > 0) {
+			hack_restrict(RESTRICT_FLAGS, &now->addr, &now->mask,
+				      now->mflags, now->flags);
+			added++;
+			j++;
+		} else {
+			if (was->flags & ~now->flags)
+				hack_restrict(RESTRICT_UNFLAG, &was->addr,
+					      &was->mask, was->mflags,
+					      was->flags & ~now->flags);
+			if (now->flags & ~was->flags)
+				hack_restrict(RESTRICT_FLAGS, &now->addr,
+					      &now->mask, now->mflags,
+					      now->flags & ~was->flags);
+			if (was->flags != now->flags)
+				changed++;
+			i++;
+			j++;
+		}
+	}
+	keep_restrict_notes();
+	msyslog(LOG_INFO,
+		"CONFIG: reload: %d restrictions added, %d removed, %d changed",
+		added, removed, changed);
+}
+
+
+static bool
+same_string(
+	const char *	a,
+	const char *	b
+	)
+{
+	if (NULL == a || NULL == b)
+		return a == b;
+	return 0 == strcmp(a, b);
+}
+
+
+/* the options on two config lines for an association match */
+static bool
+same_peer_ctl(
+	const struct peer_ctl *	a,
+	const struct peer_ctl *	b
+	)
+{
+	return a->version == b->version
+	    && a->minpoll == b->minpoll
+	    && a->maxpoll == b->maxpoll
+	    && a->flags == b->flags
+	    && a->peerkey == b->peerkey
+	    && 0 == memcmp(&a->bias, &b->bias, sizeof(a->bias))
+	    && a->mode == b->mode
+	    && same_string(a->nts_cfg.ca, b->nts_cfg.ca)
+	    && same_string(a->nts_cfg.aead, b->nts_cfg.aead)
+#ifdef REFCLOCK
+	    && a->baud == b->baud
+	    && a->stages == b->stages
+	    && same_string(a->path, b->path)
+	    && same_string(a->ppspath, b->ppspath)
+#endif
+	    ;
+}
+
+
+static bool
+same_peer_line(
+	const peer_note *	note,
+	const peer_node *	node
+	)
+{
+	return note->host_mode == node->host_mode
+	    && note->type == node->addr->type
+	    && 0 == strcasecmp(note->address, node->addr->address)
+	    && same_peer_ctl(&note->ctl, &node->ctl);
+}
+
+
+static bool
+is_refclock_line(
+	const char *	address,
+	unsigned short	type
+	)
+{
+	sockaddr_u	addr;
+
+	ZERO_SOCK(&addr);
+	return is_ip_address(address, type, &addr) && ISREFCLOCKADR(&addr);
+}
+
+
+/*
+ * note_peers - keep the association lines of the config file, before
+ * config_peers() gets at their options
+ */
+static void
+note_peers(
+	config_tree *	ptree
+	)
+{
+	peer_node *	node;
+	size_t		n = 0;
+
+	for (size_t i = 0; i < file_peer_count; i++)
+		free(file_peers[i].address);
+	free(file_peers);
+	file_peers = NULL;
+	file_peer_count = 0;
+
+	node = HEAD_PFIFO(ptree->peers);
+	for (; node != NULL; node = node->link)
+		n++;
+	if (0 == n)
+		return;
+	file_peers = emalloc_zero(n * sizeof(*file_peers));
+	node = HEAD_PFIFO(ptree->peers);
+	for (; node != NULL; node = node->link) {
+		peer_note *note = &file_peers[file_peer_count++];
+
+		note->address = estrdup(node->addr->address);
+		note->type = node->addr->type;
+		note->host_mode = node->host_mode;
+		note->ctl = node->ctl;
+	}
+}
+
+
+/*
+ * reload_peers - remove the associations the file no longer has, or
+ * has with other options, and add the ones it has now.  Refclocks
+ * need a restart.
+ */
+static void
+reload_peers(
+	config_tree *	ptree
+	)
+{
+	config_tree	added;
+	peer_fifo *	kept = NULL;
+	peer_note *	was = file_peers;
+	size_t		nwas = file_peer_count;
+	peer_node *	node;
+	bool		found;
+	int		nadded = 0, nremoved = 0;
+
+	file_peers = NULL;
+	file_peer_count = 0;
+	note_peers(ptree);
+
+	for (size_t i = 0; i < nwas; i++) {
+		found = false;
+		node = HEAD_PFIFO(ptree->peers);
+		for (; node != NULL && !found; node = node->link)
+			found = same_peer_line(&was[i], node);
+		if (found)
+			continue;
+		if (is_refclock_line(was[i].address, was[i].type)) {
+			msyslog(LOG_NOTICE,
+				"CONFIG: reload: refclock %s changed, restart to apply",
+				was[i].address);
+			continue;
+		}
+		unpeer_by_name(was[i].address, was[i].type);
+		nremoved++;
+	}
+
+	/* move the new lines to a tree of their own for config_peers() */
+	init_syntax_tree(&added);
+	while (ptree->peers != NULL) {
+		UNLINK_FIFO(node, *ptree->peers, link);
+		if (NULL == node)
+			break;
+		found = false;
+		for (size_t i = 0; i < nwas && !found; i++)
+			found = same_peer_line(&was[i], node);
+		if (!found && is_refclock_line(node->addr->address,
+					       node->addr->type)) {
+			msyslog(LOG_NOTICE,
+				"CONFIG: reload: refclock %s changed, restart to apply",
+				node->addr->address);
+			found = true;
+		}
+		if (found) {
+			APPEND_G_FIFO(kept, node);
+		} else {
+			APPEND_G_FIFO(added.peers, node);
+			nadded++;
+		}
+	}
+	free(ptree->peers);
+	ptree->peers = kept;
+	config_peers(&added);
+	free_config_peers(&added);
+
+	for (size_t i = 0; i < nwas; i++)
+		free(was[i].address);
+	free(was);
+
+	msyslog(LOG_INFO,
+		"CONFIG: reload: %d associations added, %d removed",
+		nadded, nremoved);
+}
+
+
 /* FUNCTIONS COPIED FROM THE OLDER ntp_config.c
  * --------------------------------------------
  */
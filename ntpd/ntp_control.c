@@ -13,9 +13,6 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
-#include <openssl/evp.h>	/* provides OpenSSL digest API */
-#include "hack-ancient-openssl.h"
-
 #include "ntpd.h"
 #include "ntp_io.h"
 #include "ntp_refclock.h"
@@ -69,6 +66,8 @@ static uint64_t numctlbadoffset;	/* # of input pkts with nonzero offset */
 static uint64_t numctlbadversion;	/* # of input pkts with unknown version */
 static uint64_t numctldatatooshort;	/* data too short for count */
 static uint64_t numctlbadop;		/* bad op code found in packet */
+static uint64_t numctlcost;		/* cost units charged to sources */
+static uint64_t numctllimited;		/* requests over their source's budget */
 
 static int log_limit = 0;               /* Avoid DDoS to log file */ 
 
@@ -90,6 +89,9 @@ struct ctl_proc {
 	/* Only one flag.  Authentication required or not. */
 #define NOAUTH	0
 #define AUTH	1
+	unsigned short cost;		/* charged against mon_ctl_charge() */
+#define CHEAP	1
+#define DEAR	4	/* walks a list of unbounded length */
 	void (*handler) (struct recvbuf *, int); /* handle request */
 };
 
@@ -104,7 +106,11 @@ static	void	ctl_error	(uint8_t);
 static	unsigned short ctlclkstatus	(struct refclockstat *);
 #endif
 static	void	ctl_flushpkt	(uint8_t);
+static	void	ctl_queuepkt	(unsigned int);
+static	void	ctl_sendpkts	(void);
 static	void	ctl_putdata	(const char *, unsigned int, bool);
+static	void	ctl_putbin	(uint8_t, const char *, const void *, size_t);
+static	void	ctl_putext	(const char *);
 static	void	ctl_putstr	(const char *, const char *, size_t);
 static	void	ctl_putdblf	(const char *, bool, int, double);
 #define	ctl_putdbl(tag, d)	ctl_putdblf(tag, true, 3, d)
@@ -126,13 +132,16 @@ static	void	ctl_putclock	(int, struct refclockstat *, bool);
 /* 2023-Jan-14 Fedora c compiler barfs on function with
  * arg of const struct foo * unless that is used as a result previously.
  */
-static	const struct var * ctl_getitem(const struct var *, char **);
+struct name_index;
+static	const struct var * ctl_getitem(const struct var *,
+			struct name_index *, char **);
 static	void	ctl_putsys	(const struct var *);
 static	void	ctl_putspecial	(const struct var *);
 void do_sys_var_list(const char* name, const struct var* v);
 
 
-static	const struct ctl_var *ctl_getitem2(const struct ctl_var *, char **);
+static	const struct ctl_var *ctl_getitem2(const struct ctl_var *,
+			struct name_index *, char **);
 static	unsigned short ctlsysstatus	(void);
 static	unsigned short	count_var	(const struct ctl_var *);
 static	void	control_unspec	(struct recvbuf *, int);
@@ -140,6 +149,10 @@ static	void	read_status	(struct recvbuf *, int);
 static	void	read_sysvars	(void);
 static	void	read_peervars	(void);
 static	void	read_variables	(struct recvbuf *, int);
+static	void	read_variables_bin(struct recvbuf *, int);
+static	void	read_peers	(struct recvbuf *, int);
+static	void	read_samples	(struct recvbuf *, int);
+static	void	read_pkttrace	(struct recvbuf *, int);
 static	void	read_clockstatus(struct recvbuf *, int);
 static	void	configure	(struct recvbuf *, int);
 static	void	send_mru_entry	(mon_entry *, int);
@@ -152,8 +165,10 @@ static	void	read_ifstats	(struct recvbuf *);
 static	void	sockaddrs_from_restrict_u(sockaddr_u *,	sockaddr_u *,
 					  restrict_u *, int);
 static	void	send_restrict_entry(restrict_u *, int, unsigned int);
-static	void	send_restrict_list(restrict_u *, int, unsigned int *);
-static	void	read_addr_restrictions(struct recvbuf *);
+static	bool	send_restrict_list(restrict_u *, int, unsigned int *,
+				   unsigned int, bool);
+static	void	read_addr_restrictions(struct recvbuf *, bool,
+				       unsigned int);
 static	void	read_ordlist	(struct recvbuf *, int);
 static	uint32_t	derive_nonce	(sockaddr_u *, uint32_t, uint32_t);
 static	void	generate_nonce	(struct recvbuf *, char *, size_t);
@@ -161,17 +176,21 @@ static	int	validate_nonce	(const char *, struct recvbuf *);
 static	void	req_nonce	(struct recvbuf *, int);
 
 static const struct ctl_proc control_codes[] = {
-	{ CTL_OP_UNSPEC,		NOAUTH,	control_unspec },
-	{ CTL_OP_READSTAT,		NOAUTH,	read_status },
-	{ CTL_OP_READVAR,		NOAUTH,	read_variables },
-	{ CTL_OP_WRITEVAR,		AUTH,	NULL },
-	{ CTL_OP_READCLOCK,		NOAUTH,	read_clockstatus },
-	{ CTL_OP_WRITECLOCK,		NOAUTH,	NULL },
-	{ CTL_OP_CONFIGURE,		AUTH,	configure },
-	{ CTL_OP_READ_MRU,		NOAUTH,	read_mru_list },
-	{ CTL_OP_READ_ORDLIST_A,	AUTH,	read_ordlist },
-	{ CTL_OP_REQ_NONCE,		NOAUTH,	req_nonce },
-	{ NO_REQUEST,			0,	NULL }
+	{ CTL_OP_UNSPEC,		NOAUTH,	CHEAP,	control_unspec },
+	{ CTL_OP_READSTAT,		NOAUTH,	CHEAP,	read_status },
+	{ CTL_OP_READVAR,		NOAUTH,	CHEAP,	read_variables },
+	{ CTL_OP_WRITEVAR,		AUTH,	CHEAP,	NULL },
+	{ CTL_OP_READCLOCK,		NOAUTH,	CHEAP,	read_clockstatus },
+	{ CTL_OP_WRITECLOCK,		NOAUTH,	CHEAP,	NULL },
+	{ CTL_OP_CONFIGURE,		AUTH,	DEAR,	configure },
+	{ CTL_OP_READ_MRU,		NOAUTH,	DEAR,	read_mru_list },
+	{ CTL_OP_READ_ORDLIST_A,	AUTH,	DEAR,	read_ordlist },
+	{ CTL_OP_REQ_NONCE,		NOAUTH,	CHEAP,	req_nonce },
+	{ CTL_OP_READVAR_BIN,		NOAUTH,	CHEAP,	read_variables_bin },
+	{ CTL_OP_READ_PEERS,		NOAUTH,	DEAR,	read_peers },
+	{ CTL_OP_READ_SAMPLES,		NOAUTH,	DEAR,	read_samples },
+	{ CTL_OP_READ_PKTTRACE,		AUTH,	DEAR,	read_pkttrace },
+	{ NO_REQUEST,			0,	0,	NULL }
 };
 
 enum var_type {v_time,
@@ -180,7 +199,7 @@ enum var_type {v_time,
 	v_strP, v_u64P, v_u32P, v_uliP,
 	v_l_fp, v_l_fp_ms, v_l_fp_sec, v_l_fp_sec6,
 	v_u64_r, v_l_fp_sec_r,
-	v_mrumem,
+	v_mrumem, v_hist, v_mem,
 	v_since, v_kli, v_special};
 enum var_type_special {
 	vs_peer, vs_peeradr, vs_peermode,
@@ -213,16 +232,22 @@ struct var {
     const bool* boool;
     const l_fp* l_fp;
     const uptime_t* up;
+    const struct histogram* hist;
     const char* (*strP)(void);
     uint64_t (*u64P)(void);
     uint32_t (*u32P)(void);
     unsigned long int (*uliP)(void);
     const enum var_type_special special;
+    int tag;		/* MEM_* for v_mem */
     } p;
   union {
     /* second pointer for returning recent since-stats-logged */
     const uint64_t* u64;
     const uint64_t* l_fp;
+    /* percentile for v_hist */
+    double pct;
+    /* MEM_BYTES, MEM_BLOCKS or MEM_PEAK for v_mem */
+    int what;
     } p2;  
   };
 
@@ -284,6 +309,12 @@ struct var {
 
 #define Var_mrumem(xname, xflags, xlocation) { \
   .name = xname, .flags = xflags, .type = v_mrumem, .p.u64 = &xlocation }
+#define Var_hist(xname, xflags, xlocation, xpct) { \
+  .name = xname, .flags = xflags, .type = v_hist, \
+  .p.hist = &xlocation, .p2.pct = xpct }
+#define Var_mem(xname, xflags, xtag, xwhat) { \
+  .name = xname, .flags = xflags, .type = v_mem, \
+  .p.tag = xtag, .p2.what = xwhat }
 #define Var_kli(xname, xflags, xlocation) { \
   .name = xname, .flags = xflags, .type = v_kli, .p.timex_li = &xlocation }
 #define Var_special(xname, xflags, xspecial) { \
@@ -329,13 +360,38 @@ static const struct var sys_var[] = {
   Var_u64("mru_maxdepth", RO, mon_data.mru_maxdepth),
   Var_mrumem("mru_mem", RO, mon_data.mru_entries),
   Var_mrumem("mru_maxmem", RO, mon_data.mru_maxdepth),
+  Var_mrumem("mru_arenamem", RO, mon_data.mru_arenasize),
+  Var_mrumem("mru_arenaused", RO, mon_data.mru_arenaused),
+  Var_bool("mru_arenahuge", RO, mon_data.mru_arenahuge),
   Var_u64("mru_exists", RO, mon_data.mru_exists),
   Var_u64("mru_new", RO, mon_data.mru_new),
   Var_u64("mru_recycleold", RO, mon_data.mru_recycleold),
   Var_u64("mru_recyclefull", RO, mon_data.mru_recyclefull),
+  Var_u64("mru_expired", RO, mon_data.mru_expired),
   Var_u64("mru_none", RO, mon_data.mru_none),
+  Var_u64("mru_sketchmem", RO, mon_data.mru_sketchkb),
+  Var_u64("mru_sketched", RO, mon_data.mru_sketched),
   Var_special("mru_oldest_age", RO, vs_mruoldest),
 
+  Var_u8("peer_adr_hashbits", RO, peer_adr_hash.bits),
+  Var_u32("peer_adr_hashed", RO, peer_adr_hash.count),
+  Var_u64("peer_adr_resizes", RO, peer_adr_hash.resizes),
+  Var_u8("peer_aid_hashbits", RO, peer_aid_hash.bits),
+  Var_u32("peer_aid_hashed", RO, peer_aid_hash.count),
+  Var_u64("peer_aid_resizes", RO, peer_aid_hash.resizes),
+
+#define Var_Mem(name, tag) \
+  Var_mem("mem_" name, RO, tag, MEM_BYTES), \
+  Var_mem("mem_" name "_blocks", RO, tag, MEM_BLOCKS), \
+  Var_mem("mem_" name "_peak", RO, tag, MEM_PEAK)
+  Var_Mem("mru", MEM_MRU),
+  Var_Mem("restrict", MEM_RESTRICT),
+  Var_Mem("peer", MEM_PEER),
+  Var_Mem("recvbuf", MEM_RECVBUF),
+  Var_Mem("keys", MEM_KEYS),
+  Var_Mem("nts", MEM_NTS),
+#undef Var_Mem
+
 #define Var_Pair(name, location) \
   Var_u64P(name, RO, stat_##location), \
   Var_u64P(name "_r", RO, stat_total_##location)
@@ -356,12 +412,16 @@ static const struct var sys_var[] = {
   Var_Pair("ss_restricted", restricted),
   Var_Pair("ss_limited", limitrejected),
   Var_Pair("ss_kodsent", kodsent),
+  Var_Pair("ss_kodlimited", kodlimited),
+  Var_Pair("ss_duplicate", duplicate),
   Var_Pair("ss_processed", processed),
 #undef Var_Pair
 
 /* We own this one.  See above.  No proc mode.
  * Note that lots of others are not (yet?) in this table.  */
   Var_u64("ss_numctlreq", RO, numctlreq),
+  Var_u64("ss_numctlcost", RO, numctlcost),
+  Var_u64("ss_numctllimited", RO, numctllimited),
 
   Var_special("peeradr", RO, vs_peeradr),
   Var_special("peermode", RO, vs_peermode),
@@ -405,6 +465,10 @@ static const struct var sys_var[] = {
   Var_since("iostats_reset", RO, io_timereset),
   Var_u64P("io_dropped", RO, dropped_count),
   Var_u64P("io_ignored", RO, ignored_count),
+  Var_u64P("io_shed", RO, shed_count),
+  Var_u64P("io_overload_shed", RO, overload_shed_count),
+  Var_u64P("io_overloads", RO, overloads_count),
+  Var_u64P("io_bpf_dropped", RO, bpf_dropped_count),
   Var_u64P("io_received", RO, received_count),
   Var_u64P("io_sent", RO, sent_count),
   Var_u64P("io_sendfailed", RO, notsent_count),
@@ -425,6 +489,35 @@ static const struct var sys_var[] = {
 
   Var_uli("clk_wander_threshold", RO|ToPPM, timer_xmtcalls),
 
+/* latency histograms: sample count, percentiles and max in ms */
+#define Var_Hist(name, which) \
+  Var_u64(name "_n", RO, latency[which].count), \
+  Var_hist(name "_p50", RO, latency[which], 50), \
+  Var_hist(name "_p99", RO, latency[which], 99), \
+  Var_hist(name "_p999", RO, latency[which], 99.9), \
+  Var_hist(name "_max", RO, latency[which], 100)
+  Var_Hist("lat_xmit", LAT_XMIT),
+  Var_Hist("lat_receive", LAT_RECEIVE),
+  Var_Hist("lat_select", LAT_SELECT),
+  Var_Hist("lat_clock", LAT_CLOCK),
+  Var_Hist("lat_input", LAT_INPUT),
+#ifndef DISABLE_NTS
+  Var_Hist("lat_ntske", LAT_NTSKE),
+#endif
+#undef Var_Hist
+
+/* main thread time by activity, in seconds */
+  Var_l_fp_sec("cpu_other", RO, cpu_time[CPU_OTHER]),
+  Var_l_fp_sec("cpu_idle", RO, cpu_time[CPU_IDLE]),
+  Var_l_fp_sec("cpu_receive", RO, cpu_time[CPU_RECEIVE]),
+  Var_l_fp_sec("cpu_transmit", RO, cpu_time[CPU_TRANSMIT]),
+  Var_l_fp_sec("cpu_timer", RO, cpu_time[CPU_TIMER]),
+  Var_l_fp_sec("cpu_control", RO, cpu_time[CPU_CONTROL]),
+#ifdef REFCLOCK
+  Var_l_fp_sec("cpu_refclock", RO, cpu_time[CPU_REFCLOCK]),
+#endif
+  Var_l_fp_sec("cpu_stats", RO, cpu_time[CPU_STATS]),
+
 #ifdef ENABLE_LEAP_SMEAR
   /* Old code returned nothing if leap.smear_intv was 0 */
   Var_uint("leapsmearinterval", RO, leap_smear_intv),
@@ -468,6 +561,7 @@ static const struct var sys_var[] = {
   Var_Pair("nts_ke_serves_bad", ntske_cnt.serves_bad),
   Var_PairF("nts_ke_serves_bad_wall", ntske_cnt.serves_bad_wall),
   Var_PairF("nts_ke_serves_bad_cpu", ntske_cnt.serves_bad_cpu),
+  Var_Pair("nts_ke_serves_limited", ntske_cnt.serves_limited),
   Var_Pair("nts_ke_probes_good", ntske_cnt.probes_good),
   Var_Pair("nts_ke_probes_bad", ntske_cnt.probes_bad),
 #undef Var_Pair
@@ -677,13 +771,19 @@ static	uint8_t ctl_sys_num_events;
 
 
 /*
- * Response packet used by these routines. Also some state information
+ * Response packets used by these routines. Also some state information
  * so that we can handle packet formatting within a common set of
- * subroutines.  Note we try to enter data in place whenever possible,
- * but the need to set the more bit correctly means we occasionally
- * use the extra buffer and copy.
+ * subroutines.  Data is entered in place in rpkt, the fragment being
+ * built.  A finished fragment stays where it is, padded, MACed and
+ * queued, and the next is built in the following buffer, so up to
+ * CTL_BATCH fragments leave in one sendpkts() call.
  */
-static struct ntp_control rpkt;
+#define CTL_BATCH	8	/* fragments sent together */
+
+static struct ntp_control rpkts[CTL_BATCH];
+static struct ntp_control *rpkt = rpkts;
+static struct iovec res_iov[CTL_BATCH];	/* finished, not yet sent */
+static unsigned int res_queued;
 static uint8_t	res_version;
 static uint8_t	res_opcode;
 static associd_t res_associd;
@@ -693,13 +793,52 @@ static uint8_t * datapt;
 static int	datalinelen;
 static bool	datasent;	/* flag to avoid initial ", " */
 static bool	datanotbinflag;
+static bool	res_binary;	/* put values as CTL_BIN_* records */
 static sockaddr_u *rmt_addr;
 static endpt *lcl_inter;
+static struct ctl_stream *res_stream;	/* or NULL for a datagram */
 
 static auth_info* res_auth;  /* !NULL => authenticate */
 
+/*
+ * Each request has "limit ctlslice" ms of the main loop.  The lists
+ * that can run long, mrulist and reslist, stop at the end of it and
+ * tell the client where to go on from, so time for the clients and
+ * servers waiting behind a big query is held up for no longer.
+ */
+static struct timespec ctl_deadline;
+
 #define MAXDATALINELEN	(72)
 
+/*
+ * The default "rv 0" answer, kept as the pieces ctl_putdata() was
+ * given the last time it was formatted.  Replaying the pieces through
+ * ctl_putdata() keeps the separators and fragmenting exactly as a
+ * fresh pass would make them.  Variables that change without an event
+ * (the clock, for one) are left as live items and formatted on each
+ * query.  ctl_sysvars_changed() throws the cache away.
+ */
+struct sysvar_item {
+	const struct var *live;	/* format at query time, or NULL */
+	size_t		off;	/* piece within data */
+	unsigned int	len;
+	bool		bin;
+};
+
+struct sysvar_cache {
+	unsigned long	gen;	/* sysvar_gen when built, 0 if never */
+	char *		data;
+	size_t		used;
+	size_t		size;
+	struct sysvar_item *items;
+	size_t		nitems;
+	size_t		maxitems;
+};
+
+static unsigned long sysvar_gen = 1;
+static struct sysvar_cache sysvar_cache[2];	/* text, binary */
+static struct sysvar_cache *sysvar_fill;	/* being built, or NULL */
+
 /*
  * Pointers for saving state when decoding request packets
  */
@@ -767,24 +906,105 @@ ctl_error(
 	DPRINT(3, ("sending control error %u\n", errcode));
 
 	/*
-	 * Fill in the fields. We assume rpkt.sequence and rpkt.associd
+	 * Fill in the fields. We assume rpkt->sequence and rpkt->associd
 	 * have already been filled in.
 	 */
-	rpkt.r_m_e_op = (uint8_t)CTL_RESPONSE | CTL_ERROR |
+	rpkt->r_m_e_op = (uint8_t)CTL_RESPONSE | CTL_ERROR |
 			(res_opcode & CTL_OP_MASK);
-	rpkt.status = htons((unsigned short)(errcode & 0xff) << 8);
-	rpkt.count = 0;
+	rpkt->status = htons((unsigned short)(errcode & 0xff) << 8);
+	rpkt->count = 0;
 
 	/*
-	 * send packet and bump counters
+	 * send packet, after any fragments before it, and bump counters
 	 */
 	if (NULL != res_auth) {
-		maclen = authencrypt(res_auth, (uint32_t *)&rpkt,
+		maclen = authencrypt(res_auth, (uint32_t *)rpkt,
 				     CTL_HEADER_LEN);
-		sendpkt(rmt_addr, lcl_inter, &rpkt,
-                        (int)CTL_HEADER_LEN + maclen);
+		ctl_queuepkt(CTL_HEADER_LEN + (unsigned int)maclen);
 	} else
-		sendpkt(rmt_addr, lcl_inter, &rpkt, CTL_HEADER_LEN);
+		ctl_queuepkt(CTL_HEADER_LEN);
+	ctl_sendpkts();
+}
+
+
+/*
+ * ctl_queuepkt - queue the finished rpkt, len bytes of it, and start
+ *		  the next in the following buffer with the same header
+ */
+static void
+ctl_queuepkt(
+	unsigned int len
+	)
+{
+	struct ntp_control *next;
+
+	res_iov[res_queued].iov_base = rpkt;
+	res_iov[res_queued].iov_len = len;
+	res_queued++;
+	if (CTL_BATCH == res_queued)
+		ctl_sendpkts();
+	next = &rpkts[res_queued];
+	if (next != rpkt)
+		memcpy(next, rpkt, CTL_HEADER_LEN);
+	rpkt = next;
+}
+
+
+/*
+ * ctl_sendpkts - send the queued fragments
+ */
+static void
+ctl_sendpkts(void)
+{
+	if (0 == res_queued)
+		return;
+	if (NULL != res_stream)
+		res_stream->send(res_stream, res_iov, res_queued);
+	else
+		sendpkts(rmt_addr, lcl_inter, res_iov, res_queued);
+	res_queued = 0;
+}
+
+
+/*
+ * ctl_frags_max - the most packets a request may ask for in a response
+ */
+static unsigned int
+ctl_frags_max(void)
+{
+	return (NULL != res_stream) ? CTL_STREAM_FRAGS : MRU_FRAGS_LIMIT;
+}
+
+
+/*
+ * ctl_overtime - whether the current request has used up its slice
+ */
+static bool
+ctl_overtime(void)
+{
+	struct timespec now;
+
+	if (mon_data.ctl_slice <= 0)
+		return false;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return cmp_tspec(now, ctl_deadline) >= 0;
+}
+
+
+/*
+ * process_control_stream - process a control message that came in on
+ *			    a stream, and answer on it
+ */
+void
+process_control_stream(
+	struct recvbuf *	rbufp,
+	int			restrict_mask,
+	struct ctl_stream *	stream
+	)
+{
+	res_stream = stream;
+	process_control(rbufp, restrict_mask);
+	res_stream = NULL;
 }
 
 /*
@@ -848,21 +1068,23 @@ process_control(
 	 * Pull enough data from the packet to make intelligent
 	 * responses
 	 */
-	rpkt.li_vn_mode = PKT_LI_VN_MODE(sys_vars.sys_leap, res_version,
+	rpkt = rpkts;
+	rpkt->li_vn_mode = PKT_LI_VN_MODE(sys_vars.sys_leap, res_version,
 					 MODE_CONTROL);
 	res_opcode = pkt->r_m_e_op;
-	rpkt.sequence = pkt->sequence;
-	rpkt.associd = pkt->associd;
-	rpkt.status = 0;
+	rpkt->sequence = pkt->sequence;
+	rpkt->associd = pkt->associd;
+	rpkt->status = 0;
 	res_frags = 1;
 	res_offset = 0;
 	res_associd = ntohs(pkt->associd);
 	res_auth = NULL;
 	req_count = (int)ntohs(pkt->count);
 	datanotbinflag = false;
+	res_binary = false;
 	datalinelen = 0;
 	datasent = false;
-	datapt = rpkt.data;
+	datapt = rpkt->data;
 
 	if ((rbufp->recv_length & 0x3) != 0)
 		DPRINT(3, ("Control packet length %zu unrounded\n",
@@ -928,6 +1150,13 @@ process_control(
 #endif /* __COVERITY__ */
 	reqend = reqpt + req_count;
 
+	/* Over TCP, nothing is read without the control key */
+	if (NULL != res_stream && res_stream->authonly
+	    && (NULL == res_auth || res_auth->keyid != ctl_auth_keyid)) {
+		ctl_error(CERR_PERMISSION);
+		return;
+	}
+
 	/*
 	 * Look for the opcode processor
 	 */
@@ -945,7 +1174,25 @@ process_control(
 				ctl_error(CERR_PERMISSION);
 				return;
 			}
+			/* Our own key pays nothing; everybody else is
+			 * held to a budget so a busy monitor can't starve
+			 * the loop that serves time.  Drop, don't answer,
+			 * like RES_LIMITED. */
+			if (NULL == res_auth
+			    || res_auth->keyid != ctl_auth_keyid) {
+				if (!mon_ctl_charge(&rbufp->recv_srcadr,
+						    cc->cost)) {
+					numctllimited++;
+					return;
+				}
+				numctlcost += cc->cost;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &ctl_deadline);
+			ctl_deadline = add_tspec_ns(ctl_deadline,
+			    (long)(mon_data.ctl_slice * NS_PER_MS));
 			(cc->handler)(rbufp, restrict_mask);
+			/* a handler that stopped short of the end */
+			ctl_sendpkts();
 			return;
 		}
 	}
@@ -1033,7 +1280,7 @@ ctl_flushpkt(
 	int maclen;
 	int totlen;
 
-	dlen = datapt - rpkt.data;
+	dlen = datapt - rpkt->data;
 	if (!more && datanotbinflag && dlen + 2 < CTL_MAX_DATA_LEN) {
 		/*
 		 * Big hack, output a trailing \r\n
@@ -1044,15 +1291,6 @@ ctl_flushpkt(
 	}
 	sendlen = dlen + (int)CTL_HEADER_LEN;
 
-	/*
-	 * Zero-fill the unused part of the packet.  This wasn't needed
-	 * when the clients were all in C, for which the first NUL is
-	 * a string terminator.  But Python allows NULs in strings,
-	 * which means Python mode 6 clients might actually see the trailing
-	 * garbage.
-	 */
-	memset(rpkt.data + sendlen, '\0', sizeof(rpkt.data) - (size_t)sendlen);
-
 	/*
 	 * Pad to a multiple of 32 bits
 	 */
@@ -1063,13 +1301,12 @@ ctl_flushpkt(
 	/*
 	 * Fill in the packet with the current info
 	 */
-	rpkt.r_m_e_op = CTL_RESPONSE | more |
+	rpkt->r_m_e_op = CTL_RESPONSE | more |
 			(res_opcode & CTL_OP_MASK);
-	rpkt.count = htons((unsigned short)dlen);
-	rpkt.offset = htons((unsigned short)res_offset);
+	rpkt->count = htons((unsigned short)dlen);
+	rpkt->offset = htons((unsigned short)res_offset);
+	totlen = sendlen;
 	if (NULL != res_auth) {
-		keyid_t keyid;
-		totlen = sendlen;
 		/*
 		 * If we are going to authenticate, then there
 		 * is an additional requirement that the MAC
@@ -1078,18 +1315,29 @@ ctl_flushpkt(
 		while (totlen & 7) {
 			totlen++;
 		}
-		keyid = htonl(res_auth->keyid);
-		memcpy(datapt, &keyid, sizeof(keyid));
+	}
+
+	/*
+	 * Zero the padding, the part of the packet past the data that
+	 * goes out.  This wasn't needed when the clients were all in C,
+	 * for which the first NUL is a string terminator.  But Python
+	 * allows NULs in strings, which means Python mode 6 clients
+	 * might actually see the trailing garbage.
+	 */
+	memset(datapt, '\0', (size_t)(totlen - (int)CTL_HEADER_LEN - dlen));
+
+	if (NULL != res_auth) {
 		maclen = authencrypt(res_auth,
-				     (uint32_t *)&rpkt, totlen);
-		sendpkt(rmt_addr, lcl_inter, &rpkt, totlen + maclen);
+				     (uint32_t *)rpkt, totlen);
+		ctl_queuepkt((unsigned int)(totlen + maclen));
 	} else {
-		sendpkt(rmt_addr, lcl_inter, &rpkt, sendlen);
+		ctl_queuepkt((unsigned int)sendlen);
 	}
 	if (more) {
 		numctlfrags++;
 	} else {
 		numctlresponses++;
+		ctl_sendpkts();
 	}
 
 	/*
@@ -1097,7 +1345,52 @@ ctl_flushpkt(
 	 */
 	res_frags++;
 	res_offset += dlen;
-	datapt = rpkt.data;
+	datapt = rpkt->data;
+}
+
+
+/*
+ * sysvar_item_new - add an item to the system variable cache being built
+ */
+static struct sysvar_item *
+sysvar_item_new(void)
+{
+	struct sysvar_cache *c = sysvar_fill;
+
+	if (c->nitems == c->maxitems) {
+		c->maxitems = c->maxitems ? 2 * c->maxitems : 64;
+		c->items = erealloc(c->items,
+				    c->maxitems * sizeof(*c->items));
+	}
+	ZERO(c->items[c->nitems]);
+	return &c->items[c->nitems++];
+}
+
+
+/*
+ * sysvar_save - copy a piece of the response into the cache being built
+ */
+static void
+sysvar_save(
+	const char *dp,
+	unsigned int dlen,
+	bool bin
+	)
+{
+	struct sysvar_cache *c = sysvar_fill;
+	struct sysvar_item *item;
+
+	if (c->used + dlen > c->size) {
+		while (c->used + dlen > c->size)
+			c->size = c->size ? 2 * c->size : 4096;
+		c->data = erealloc(c->data, c->size);
+	}
+	memcpy(c->data + c->used, dp, dlen);
+	item = sysvar_item_new();
+	item->off = c->used;
+	item->len = dlen;
+	item->bin = bin;
+	c->used += dlen;
 }
 
 
@@ -1114,7 +1407,10 @@ ctl_putdata(
 {
 	unsigned int overhead;
 	unsigned int currentlen;
-	const uint8_t * dataend = &rpkt.data[CTL_MAX_DATA_LEN];
+	const uint8_t * dataend = &rpkt->data[CTL_MAX_DATA_LEN];
+
+	if (NULL != sysvar_fill)
+		sysvar_save(dp, dlen, bin);
 
 	overhead = 0;
 	if (!bin) {
@@ -1152,6 +1448,8 @@ ctl_putdata(
 		datalinelen += (int)currentlen;
 
 		ctl_flushpkt(CTL_MORE);
+		/* the next fragment is in another buffer */
+		dataend = &rpkt->data[CTL_MAX_DATA_LEN];
 	}
 
 	memcpy(datapt, dp, dlen);
@@ -1161,6 +1459,78 @@ ctl_putdata(
 }
 
 
+/*
+ * put_be64 - store a 64 bit value in network byte order
+ */
+static void
+put_be64(
+	uint8_t *cp,
+	uint64_t val
+	)
+{
+	for (int i = 7; i >= 0; i--) {
+		cp[i] = (uint8_t)val;
+		val >>= 8;
+	}
+}
+
+
+/*
+ * ctl_putbin - write a CTL_OP_READVAR_BIN record into the response
+ */
+static void
+ctl_putbin(
+	uint8_t		type,
+	const char *	tag,
+	const void *	value,
+	size_t		len
+	)
+{
+	uint8_t hdr[4 + UINT8_MAX];
+	size_t taglen;
+
+	taglen = strlen(tag);
+	if (taglen > UINT8_MAX || len > UINT16_MAX) {
+		return;
+	}
+	hdr[0] = type;
+	hdr[1] = (uint8_t)taglen;
+	hdr[2] = (uint8_t)(len >> 8);
+	hdr[3] = (uint8_t)len;
+	memcpy(&hdr[4], tag, taglen);
+	ctl_putdata((const char *)hdr, (unsigned int)(4 + taglen), true);
+	ctl_putdata(value, (unsigned int)len, true);
+}
+
+
+/*
+ * ctl_putext - write a preformatted tag=value, as from ext_sys_var
+ */
+static void
+ctl_putext(
+	const char *text
+	)
+{
+	char tag[UINT8_MAX + 1];
+	const char *value;
+	size_t taglen;
+
+	if (!res_binary) {
+		ctl_putdata(text, strlen(text), false);
+		return;
+	}
+	value = strchr(text, '=');
+	taglen = (NULL == value) ? strlen(text) : (size_t)(value - text);
+	if (taglen >= sizeof(tag)) {
+		return;
+	}
+	memcpy(tag, text, taglen);
+	tag[taglen] = '\0';
+	value = (NULL == value) ? "" : value + 1;
+	ctl_putbin(CTL_BIN_TEXT, tag, value, strlen(value));
+}
+
+
 /*
  * ctl_putstr - write a tagged string into the response packet
  *		in the form:
@@ -1181,6 +1551,10 @@ ctl_putstr(
 {
 	char buffer[512];
 
+	if (res_binary) {
+		ctl_putbin(CTL_BIN_STR, tag, data, strnlen(data, len));
+		return;
+	}
         strlcpy(buffer, tag, sizeof(buffer));
         strlcat(buffer, "=\"", sizeof(buffer));
         if (0 < len) {
@@ -1209,17 +1583,21 @@ ctl_putunqstr(
 	)
 {
 	char buffer[512];
+	size_t taglen = strlen(tag);
 
-	if ((strlen(tag) + 2 + len) >= sizeof(buffer)) {
+	if (res_binary) {
+		ctl_putbin(CTL_BIN_TEXT, tag, data, len);
 		return;
 	}
-
-        strlcpy(buffer, tag, sizeof(buffer));
-        strlcat(buffer, "=", sizeof(buffer));
-	if (len > 0) {
-		strlcat(buffer, data, sizeof(buffer));
+	if ((taglen + 2 + len) >= sizeof(buffer)) {
+		return;
 	}
-	ctl_putdata(buffer, strlen(buffer), false);
+
+	/* data need not be NUL terminated, ctl_putts() doesn't */
+	memcpy(buffer, tag, taglen);
+	buffer[taglen] = '=';
+	memcpy(buffer + taglen + 1, data, len);
+	ctl_putdata(buffer, (unsigned int)(taglen + 1 + len), false);
 }
 
 
@@ -1235,6 +1613,17 @@ ctl_putdblf(
 	)
 {
         char buf[50];
+
+	if (res_binary) {
+		uint64_t bits;
+		uint8_t val[9];
+
+		memcpy(&bits, &d, sizeof(bits));
+		put_be64(val, bits);
+		val[8] = use_f ? (uint8_t)precision : CTL_BIN_GFMT;
+		ctl_putbin(CTL_BIN_DBL, tag, val, sizeof(val));
+		return;
+	}
         snprintf(buf, sizeof(buf), use_f ? "%.*f" : "%.*g", precision, d);
 	ctl_putunqstr(tag, buf, strlen(buf));
 }
@@ -1250,8 +1639,15 @@ ctl_putuint(
 	)
 {
         char buf[50];
-        snprintf(buf, sizeof(buf), "%" PRIu64, uval);
-	ctl_putunqstr(tag, buf, strlen(buf));
+
+	if (res_binary) {
+		uint8_t val[8];
+
+		put_be64(val, uval);
+		ctl_putbin(CTL_BIN_UINT, tag, val, sizeof(val));
+		return;
+	}
+	ctl_putunqstr(tag, buf, u64toa_r(uval, buf, sizeof(buf)));
 }
 
 /*
@@ -1287,6 +1683,14 @@ ctl_puthex(
 	)
 {
         char buf[50];
+
+	if (res_binary) {
+		uint8_t val[8];
+
+		put_be64(val, uval);
+		ctl_putbin(CTL_BIN_HEX, tag, val, sizeof(val));
+		return;
+	}
 	snprintf(buf, sizeof(buf), "0x%" PRIx64, uval);
 	ctl_putunqstr(tag, buf, strlen(buf));
 }
@@ -1302,8 +1706,21 @@ ctl_putint(
 	)
 {
 	char buf[50];
-	snprintf(buf, sizeof(buf), "%" PRId64, ival);
-	ctl_putunqstr(tag, buf, strlen(buf));
+
+	if (res_binary) {
+		uint8_t val[8];
+
+		put_be64(val, (uint64_t)ival);
+		ctl_putbin(CTL_BIN_INT, tag, val, sizeof(val));
+		return;
+	}
+	if (ival < 0) {
+		buf[0] = '-';
+		ctl_putunqstr(tag, buf, 1 + u64toa_r(-(uint64_t)ival,
+						     buf + 1, sizeof(buf) - 1));
+	} else
+		ctl_putunqstr(tag, buf, u64toa_r((uint64_t)ival,
+						 buf, sizeof(buf)));
 }
 
 
@@ -1317,9 +1734,22 @@ ctl_putts(
 	)
 {
 	char buf[50];
-	snprintf(buf, sizeof(buf), "0x%08x.%08x",
-		 (unsigned int)lfpuint(ts), (unsigned int)lfpfrac(ts));
-	ctl_putunqstr(tag, buf, strlen(buf));
+
+	if (res_binary) {
+		uint8_t val[8];
+
+		put_be64(val, ts);
+		ctl_putbin(CTL_BIN_TS, tag, val, sizeof(val));
+		return;
+	}
+	/* "0x%08x.%08x", a nibble at a time */
+	buf[0] = '0';
+	buf[1] = 'x';
+	for (int i = 0; i < 16; i++)
+		buf[i + 2 + (i >= 8)] =
+		    "0123456789abcdef"[(ts >> (60 - 4 * i)) & 0xf];
+	buf[10] = '.';
+	ctl_putunqstr(tag, buf, 19);
 }
 
 
@@ -1333,13 +1763,15 @@ ctl_putadr(
 	sockaddr_u *addr
 	)
 {
-        const char *cq;
-	if (NULL == addr) {
-		struct in_addr in4;
-		in4.s_addr = addr32;
-		cq = inet_ntoa(in4);
-	} else
-		cq = socktoa(addr);
+	char buf[LIB_BUFLENGTH];
+	const char *cq;
+
+	if (NULL == addr)
+		cq = inet_ntop(AF_INET, &addr32, buf, sizeof(buf));
+	else
+		cq = socktoa_r(addr, buf, sizeof(buf));
+	if (NULL == cq)
+		return;
 	ctl_putunqstr(tag, cq, strlen(cq));
 }
 
@@ -1384,6 +1816,25 @@ ctl_putarray(
 	char buffer[200];
 	char buf[50];
 	int i;
+
+	if (res_binary) {
+		uint8_t val[NTP_SHIFT * 8];
+		uint64_t bits;
+		double d;
+		int n = 0;
+
+		i = start;
+		do {
+			if (i == 0)
+				i = NTP_SHIFT;
+			i--;
+			d = arr[i] * MS_PER_S;
+			memcpy(&bits, &d, sizeof(bits));
+			put_be64(&val[8 * n++], bits);
+		} while (i != start);
+		ctl_putbin(CTL_BIN_ARRAY, tag, val, sizeof(val));
+		return;
+	}
 	buffer[0] = 0;
 	i = start;
 	do {
@@ -1522,6 +1973,15 @@ ctl_putsys(const struct var * v) {
             ctl_putuint(v->name, mem);
             break;
 
+	case v_mem:
+	    ctl_putuint(v->name, mem_stat(v->p.tag, v->p2.what));
+	    break;
+
+	case v_hist:
+	    temp_d = (double)histogram_percentile(v->p.hist, v->p2.pct);
+	    ctl_putdbl6(v->name, temp_d / NS_PER_MS);
+	    break;
+
 	case v_special: ctl_putspecial(v); break;
 
         default: {
@@ -1640,9 +2100,9 @@ ctl_putpeer(
 	CASE_UINT(CP_SRCPORT, SRCPORT(&p->srcadr));
 
 	case CP_SRCHOST:
-		if (p->hostname != NULL)
-			ctl_putstr(CV_NAME, p->hostname,
-				   strlen(p->hostname));
+		if (p->cold->hostname != NULL)
+			ctl_putstr(CV_NAME, p->cold->hostname,
+				   strlen(p->cold->hostname));
 #ifdef REFCLOCK
 		if (p->procptr != NULL) {
 		    char buf1[256];
@@ -1666,7 +2126,7 @@ ctl_putpeer(
 				: 0);
 		break;
 
-	CASE_UINT(CP_RATE, p->throttle);
+	CASE_UINT(CP_RATE, peer_throttle(p));
 
 	CASE_UINT(CP_LEAP, p->leap);
 
@@ -1768,21 +2228,21 @@ ctl_putpeer(
 
 	CASE_UINT(CP_TIMEREC, current_time - p->timereceived);
 
-	CASE_UINT(CP_TIMEREACH, current_time - p->timereachable);
+	CASE_UINT(CP_TIMEREACH, current_time - p->cold->timereachable);
 
-	CASE_UINT(CP_BADAUTH, p->badauth);
+	CASE_UINT(CP_BADAUTH, p->cold->badauth);
 
-	CASE_UINT(CP_BOGUSORG, p->bogusorg);
+	CASE_UINT(CP_BOGUSORG, p->cold->bogusorg);
 
-	CASE_UINT(CP_OLDPKT, p->oldpkt);
+	CASE_UINT(CP_OLDPKT, p->cold->oldpkt);
 
-	CASE_UINT(CP_SELDISP, p->seldisptoolarge);
+	CASE_UINT(CP_SELDISP, p->cold->seldisptoolarge);
 
-	CASE_UINT(CP_SELBROKEN, p->selbroken);
+	CASE_UINT(CP_SELBROKEN, p->cold->selbroken);
 
 	CASE_UINT(CP_CANDIDATE, p->status);
 
-	CASE_INT(CP_NTSCOOKIES, p->nts_state.count);
+	CASE_INT(CP_NTSCOOKIES, p->cold->nts_state.count);
 
 	default:
 		break;
@@ -1822,6 +2282,13 @@ bool CF_VARLIST(
 		return false;
 	}
 	buffer_lap += increment;
+	if (res_binary) {
+		const char *list = buf + strlen(entry->text) + 2;
+
+		ctl_putbin(CTL_BIN_STR, entry->text, list,
+			   (size_t)(buffer_lap - list));
+		return true;
+	}
 	if (buffer_lap + 2 >= buffer_end)
 		return false;
 
@@ -1903,6 +2370,12 @@ void do_sys_var_list(const char* name, const struct var* v) {
                 buffer+= length;
 	}
 
+	if (res_binary) {
+		const char *list = buf + strlen(name) + 2;
+
+		ctl_putbin(CTL_BIN_STR, name, list, (size_t)(buffer - list));
+		return;
+	}
 	*buffer++ = '"';
 	*buffer = '\0';
 	ctl_putdata(buf, (unsigned)(buffer - buf), false);
@@ -2013,6 +2486,132 @@ ctl_putclock(
 #undef CASE_DBL
 
 
+/*
+ * A request can name dozens of variables, so the big fixed tables get
+ * a hash index, built on first use, instead of a scan per name.  Open
+ * addressing, at most half full.  The first of duplicate names wins,
+ * as it did with the scan.  Lists built at run time (ext_sys_var, a
+ * clock's kv_list) are still scanned.
+ */
+struct name_index {
+	const char **	names;		/* NULL for PADDING */
+	size_t		count;		/* entries before EOV */
+	unsigned int	mask;
+	unsigned short *slot;		/* entry + 1, 0 is empty */
+};
+
+static struct name_index sys_var_index;
+static struct name_index peer_var_index;
+#ifdef REFCLOCK
+static struct name_index clock_var_index;
+#endif
+
+static uint32_t
+name_hash(
+	const char *name,
+	size_t len
+	)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* a ctl_var name may be followed by "=value" */
+static size_t
+name_len(
+	const char *name
+	)
+{
+	return strcspn(name, "=");
+}
+
+/*
+ * index_find - the entry named by key[0..len), or -1
+ */
+static long
+index_find(
+	const struct name_index *idx,
+	const char *key,
+	size_t len
+	)
+{
+	unsigned int h = name_hash(key, len) & idx->mask;
+
+	for (; 0 != idx->slot[h]; h = (h + 1) & idx->mask) {
+		const char *name = idx->names[idx->slot[h] - 1];
+
+		if (len == name_len(name) && 0 == memcmp(key, name, len))
+			return idx->slot[h] - 1;
+	}
+	return -1;
+}
+
+/*
+ * index_build - hash idx->names, filled in by the caller
+ */
+static void
+index_build(
+	struct name_index *idx
+	)
+{
+	unsigned int size = 4;
+
+	while (size < 2 * idx->count)
+		size <<= 1;
+	idx->mask = size - 1;
+	idx->slot = emalloc_zero(size * sizeof(*idx->slot));
+	for (size_t i = 0; i < idx->count; i++) {
+		const char *name = idx->names[i];
+		size_t len;
+		unsigned int h;
+
+		if (NULL == name)
+			continue;
+		len = name_len(name);
+		if (0 <= index_find(idx, name, len))
+			continue;		/* duplicate */
+		h = name_hash(name, len) & idx->mask;
+		while (0 != idx->slot[h])
+			h = (h + 1) & idx->mask;
+		idx->slot[h] = (unsigned short)(i + 1);
+	}
+}
+
+static void
+index_vars(
+	struct name_index *idx,
+	const struct var *list
+	)
+{
+	while (!(EOV & list[idx->count].flags))
+		idx->count++;
+	idx->names = emalloc(idx->count * sizeof(*idx->names));
+	for (size_t i = 0; i < idx->count; i++)
+		idx->names[i] = list[i].name;
+	index_build(idx);
+}
+
+static void
+index_ctl_vars(
+	struct name_index *idx,
+	const struct ctl_var *list
+	)
+{
+	while (!(EOV & list[idx->count].flags))
+		idx->count++;
+	idx->names = emalloc(idx->count * sizeof(*idx->names));
+	for (size_t i = 0; i < idx->count; i++)
+		idx->names[i] = (PADDING & list[i].flags) ? NULL :
+		    list[i].text;
+	index_build(idx);
+}
+
+
 /*
  * ctl_getitem - get the next data item from the incoming packet
  * Return NULL on error, pointer to EOV on can't find.
@@ -2021,6 +2620,7 @@ ctl_putclock(
 static const struct var *
 ctl_getitem(
 	const struct var *var_list,
+	struct name_index *idx,
 	char **data                 // for writes
 	)
 {
@@ -2028,6 +2628,7 @@ ctl_getitem(
 	static u_long quiet_until;
 	const struct var *v;
 	size_t len;
+	long i;
 	char *cp;
 	char *tp;
 
@@ -2066,20 +2667,17 @@ ctl_getitem(
 		tp = cp;
 	}
 
+	/* The name is bracketed by [reqpt..tp] and not NUL
+	 * terminated, and it contains no '=' char.
+	 */
 	len = tp-reqpt;
-	for (v = var_list; !(EOV & v->flags); ++v) {
-		/* Check if the var name matches the buffer. The
-		 * name is bracketed by [reqpt..tp] and not NUL
-		 * terminated, and it contains no '=' char.
-		 */
-		if (len == strlen(v->name) 
-                    && 0 == memcmp(reqpt, v->name, len)) {
-			break;
-		}
-	}
-	if (EOV & v->flags) {
-		return v;
+	if (NULL == idx->slot)
+		index_vars(idx, var_list);
+	i = index_find(idx, reqpt, len);
+	if (0 > i) {
+		return &var_list[idx->count];
 	}
+	v = &var_list[i];
 	if (cp < reqend) cp++;  // skip over ","
 	reqpt = cp;		// advance past this slot
 	return v;
@@ -2111,6 +2709,7 @@ ctl_getitem(
 static const struct ctl_var *
 ctl_getitem2(
 	const struct ctl_var *var_list,
+	struct name_index *idx,		/* NULL to scan */
 	char **data
 	)
 {
@@ -2196,27 +2795,36 @@ ctl_getitem2(
 	if (NULL == var_list)
 		return &eol;
 
-	for (v = var_list; !(EOV & v->flags); ++v)
-		if (!(PADDING & v->flags)) {
-			/* Check if the var name matches the buffer. The
-			 * name is bracketed by [reqpt..tp] and not NUL
-			 * terminated, and it contains no '=' char. The
-			 * lookup value IS NUL-terminated but might
-			 * include a '='... We have to look out for
-			 * that!
-			 */
-			const char *sp1 = reqpt;
-			const char *sp2 = v->text;
-
-			/* [Bug 3412] do not compare past NUL byte in name */
-			while (   (sp1 != tp)
-			       && ('\0' != *sp2) && (*sp1 == *sp2)) {
-				++sp1;
-				++sp2;
+	if (NULL != idx) {
+		long i;
+
+		if (NULL == idx->slot)
+			index_ctl_vars(idx, var_list);
+		i = index_find(idx, reqpt, (size_t)(tp - reqpt));
+		v = &var_list[0 > i ? idx->count : (size_t)i];
+	} else {
+		for (v = var_list; !(EOV & v->flags); ++v)
+			if (!(PADDING & v->flags)) {
+				/* Check if the var name matches the buffer. The
+				 * name is bracketed by [reqpt..tp] and not NUL
+				 * terminated, and it contains no '=' char. The
+				 * lookup value IS NUL-terminated but might
+				 * include a '='... We have to look out for
+				 * that!
+				 */
+				const char *sp1 = reqpt;
+				const char *sp2 = v->text;
+
+				/* [Bug 3412] do not compare past NUL byte in name */
+				while (   (sp1 != tp)
+				       && ('\0' != *sp2) && (*sp1 == *sp2)) {
+					++sp1;
+					++sp2;
+				}
+				if (sp1 == tp && (*sp2 == '\0' || *sp2 == '='))
+					break;
 			}
-			if (sp1 == tp && (*sp2 == '\0' || *sp2 == '='))
-				break;
-		}
+	}
 
 	/* See if we have found a valid entry or not. If found, advance
 	 * the request pointer for the next round; if not, clear the
@@ -2275,9 +2883,9 @@ control_unspec(
 			ctl_error(CERR_BADASSOC);
 			return;
 		}
-		rpkt.status = htons(ctlpeerstatus(peer));
+		rpkt->status = htons(ctlpeerstatus(peer));
 	} else
-		rpkt.status = htons(ctlsysstatus());
+		rpkt->status = htons(ctlsysstatus());
 	ctl_flushpkt(0);
 }
 
@@ -2312,7 +2920,7 @@ read_status(
 			ctl_error(CERR_BADASSOC);
 			return;
 		}
-		rpkt.status = htons(ctlpeerstatus(peer));
+		rpkt->status = htons(ctlpeerstatus(peer));
 		if (NULL != res_auth)  /* FIXME: what's this for? */
 			peer->num_events = 0;
 		/*
@@ -2326,7 +2934,7 @@ read_status(
 		return;
 	}
 	n = 0;
-	rpkt.status = htons(ctlsysstatus());
+	rpkt->status = htons(ctlsysstatus());
 	for (peer = peer_list; peer != NULL; peer = peer->p_link) {
 		a_st[n++] = htons(peer->associd);
 		a_st[n++] = htons(ctlpeerstatus(peer));
@@ -2365,12 +2973,12 @@ read_peervars(void)
 		ctl_error(CERR_BADASSOC);
 		return;
 	}
-	rpkt.status = htons(ctlpeerstatus(peer));
+	rpkt->status = htons(ctlpeerstatus(peer));
 	if (NULL != res_auth)  /* FIXME: What's this for?? */
 		peer->num_events = 0;
 	ZERO(wants);
 	gotvar = false;
-	while (NULL != (v = ctl_getitem2(peer_var2, &valuep))) {
+	while (NULL != (v = ctl_getitem2(peer_var2, &peer_var_index, &valuep))) {
 		if (v->flags & EOV) {
 			ctl_error(CERR_UNKNOWNVAR);
 			return;
@@ -2392,35 +3000,94 @@ read_peervars(void)
 
 
 /*
- * read_sysvars - half of read_variables() implementation
+ * sysvar_is_live - true if a system variable changes on its own, so
+ * caching its formatted value would be wrong
+ */
+static bool
+sysvar_is_live(const struct var *v)
+{
+	if (v->flags & (N_CLOCK|N_LEAP))
+		return true;
+	if (v_since == v->type)
+		return true;
+	return v_special == v->type &&
+	    (vs_systime == v->p.special || vs_mruoldest == v->p.special);
+}
+
+
+/*
+ * ctl_putsysdefs - output the default system variables, from the cache
+ * when nothing has changed since it was built
  */
 static void
-read_sysvars(void)
+ctl_putsysdefs(void)
 {
+	struct sysvar_cache *c = &sysvar_cache[res_binary ? 1 : 0];
 	const struct var *v;
 	const struct ctl_var *v2;
-	char *	valuep;
-	const char * pch;
-
-	/*
-	 * Wants system variables. Figure out which he wants
-	 * and give them to him.
-	 */
 
-	/* Old code had a wants bit map.  Two passes.
-	 * Maybe to verify all target names before giving a partial answer.
-	 */
-	rpkt.status = htons(ctlsysstatus());
+	if (c->gen == sysvar_gen) {
+		for (size_t i = 0; i < c->nitems; i++) {
+			const struct sysvar_item *item = &c->items[i];
 
-	if (reqpt == reqend) {
-		/* No names provided, send back defaults */
-		for (v = sys_var; v && !(EOV & v->flags); v++)
-			if (DEF & v->flags)
-				ctl_putsys(v);
-		for (v2 = ext_sys_var; v2 && !(EOV & v2->flags); v2++)
-			if (DEF & v2->flags)
-				ctl_putdata(v2->text, strlen(v2->text),
-					    false);
+			if (NULL != item->live)
+				ctl_putsys(item->live);
+			else
+				ctl_putdata(c->data + item->off, item->len,
+					    item->bin);
+		}
+		return;
+	}
+
+	c->used = 0;
+	c->nitems = 0;
+	sysvar_fill = c;
+	for (v = sys_var; v && !(EOV & v->flags); v++) {
+		if (!(DEF & v->flags))
+			continue;
+		if (sysvar_is_live(v)) {
+			sysvar_item_new()->live = v;
+			sysvar_fill = NULL;
+			ctl_putsys(v);
+			sysvar_fill = c;
+		} else
+			ctl_putsys(v);
+	}
+	for (v2 = ext_sys_var; v2 && !(EOV & v2->flags); v2++)
+		if (DEF & v2->flags)
+			ctl_putext(v2->text);
+	sysvar_fill = NULL;
+	c->gen = sysvar_gen;
+}
+
+
+/*
+ * read_sysvars - half of read_variables() implementation
+ */
+static void
+read_sysvars(void)
+{
+	const struct var *v;
+	const struct ctl_var *v2;
+	char *	valuep;
+	const char * pch;
+
+	/*
+	 * Wants system variables. Figure out which he wants
+	 * and give them to him.
+	 */
+
+	/* Old code had a wants bit map.  Two passes.
+	 * Maybe to verify all target names before giving a partial answer.
+	 */
+	rpkt->status = htons(ctlsysstatus());
+#ifndef DISABLE_NTS
+	nts_fold_counters();
+#endif
+
+	if (reqpt == reqend) {
+		/* No names provided, send back defaults */
+		ctl_putsysdefs();
 		ctl_flushpkt(0);
 		return;
 	}
@@ -2433,13 +3100,13 @@ read_sysvars(void)
  * Advance reqpt on success.
  */
 	while (reqpt < reqend) {
-		v = ctl_getitem(sys_var, &valuep);
+		v = ctl_getitem(sys_var, &sys_var_index, &valuep);
 		if (NULL == v)
 			break;  // parsing error
 		if (!(v->flags & EOV)) {
 			ctl_putsys(v);
 		} else {
-			v2 = ctl_getitem2(ext_sys_var, &valuep);
+			v2 = ctl_getitem2(ext_sys_var, NULL, &valuep);
 			if (NULL == v2) {
 				ctl_error(CERR_BADVALUE);
 				return;
@@ -2450,7 +3117,7 @@ read_sysvars(void)
 				return;
 			}
 			pch = ext_sys_var[v2->code].text;
-			ctl_putdata(pch, strlen(pch), false);
+			ctl_putext(pch);
 		}
 	}
 
@@ -2478,6 +3145,405 @@ read_variables(
 }
 
 
+/*
+ * read_variables_bin - read_variables() with the values as CTL_BIN_*
+ * records, so neither end has to format and parse numbers as text
+ */
+static void
+read_variables_bin(
+	struct recvbuf *rbufp,
+	int restrict_mask
+	)
+{
+	res_binary = true;
+	read_variables(rbufp, restrict_mask);
+}
+
+
+/*
+ * Datagrams in a read_peers() response when the request has no frags=
+ */
+#define READ_PEERS_FRAGS	32
+
+static int
+peer_associd_cmp(
+	const void *	a,
+	const void *	b
+	)
+{
+	const struct peer *pa = *(struct peer * const *)a;
+	const struct peer *pb = *(struct peer * const *)b;
+
+	return (pa->associd > pb->associd) - (pa->associd < pb->associd);
+}
+
+
+/*
+ * read_peers - CTL_OP_READ_PEERS: the variables of every association,
+ * in order of association ID, so a client needs no readstat and one
+ * readvar per peer.
+ *
+ * The request payload is an optional textual varlist of:
+ *
+ *	frags=		Limit on datagrams in the response, at most
+ *			MRU_FRAGS_LIMIT, CTL_STREAM_FRAGS over a stream.
+ *			Default READ_PEERS_FRAGS.
+ *	after=		Start after this association ID.
+ *	binary		Put values as CTL_BIN_* records, as
+ *			CTL_OP_READVAR_BIN does.
+ *	since=		Only send the variables of associations that
+ *			have polled or heard from their server since
+ *			this uptime, the now= of an earlier response.
+ *	name		Any number of peer variable names, to return
+ *			just those.  Default: those rv would return.
+ *
+ * Each association starts with associd= and status= (the peer status
+ * word) followed by its variables.  When the frags= limit stops the
+ * response early, it ends with after= to pass in the next request.
+ * With since=, the response starts with now=, the current uptime.
+ */
+static void
+read_peers(
+	struct recvbuf *rbufp,
+	int restrict_mask
+	)
+{
+	static const struct ctl_var peers_parms[] = {
+		{ 0,		PADDING, "" },
+#define	RP_FRAGS	1
+		{ RP_FRAGS,	RO, "frags" },
+#define	RP_AFTER	2
+		{ RP_AFTER,	RO, "after" },
+#define	RP_BINARY	3
+		{ RP_BINARY,	RO, "binary" },
+#define	RP_SINCE	4
+		{ RP_SINCE,	RO, "since" },
+		{ 0,		EOV, "" }
+	};
+	const struct ctl_var *v;
+	struct peer *peer;
+	struct peer **sorted;
+	char *	valuep;
+	bool	wants[CP_MAXCODE + 1];
+	bool	gotvar;
+	unsigned int frags;
+	unsigned int after;
+	unsigned int val;
+	uptime_t since;
+	bool	have_since;
+	size_t	count;
+	size_t	sent;
+
+	UNUSED_ARG(rbufp);
+	UNUSED_ARG(restrict_mask);
+
+	ZERO(wants);
+	gotvar = false;
+	frags = READ_PEERS_FRAGS;
+	after = 0;
+	since = 0;
+	have_since = false;
+	while (NULL != (v = ctl_getitem2(peers_parms, NULL, &valuep))) {
+		if (EOV & v->flags) {
+			v = ctl_getitem2(peer_var2, &peer_var_index, &valuep);
+			if (NULL == v)
+				break;
+			if (EOV & v->flags) {
+				ctl_error(CERR_UNKNOWNVAR);
+				return;
+			}
+			INSIST(v->code < COUNTOF(wants));
+			wants[v->code] = true;
+			gotvar = true;
+			continue;
+		}
+		if (RP_BINARY == v->code) {
+			res_binary = true;
+			continue;
+		}
+		if (NULL == valuep || 1 != sscanf(valuep, "%u", &val)) {
+			ctl_error(CERR_BADVALUE);
+			return;
+		}
+		if (RP_FRAGS == v->code) {
+			frags = val;
+		} else if (RP_SINCE == v->code) {
+			since = val;
+			have_since = true;
+		} else {
+			after = val;
+		}
+	}
+	if (0 == frags || frags > ctl_frags_max()) {
+		ctl_error(CERR_BADVALUE);
+		return;
+	}
+
+	count = 0;
+	for (peer = peer_list; peer != NULL; peer = peer->p_link)
+		count++;
+	sorted = emalloc((count + 1) * sizeof(*sorted));
+	count = 0;
+	for (peer = peer_list; peer != NULL; peer = peer->p_link)
+		sorted[count++] = peer;
+	qsort(sorted, count, sizeof(*sorted), peer_associd_cmp);
+
+	rpkt->status = htons(ctlsysstatus());
+	if (have_since)
+		ctl_putuint("now", current_time);
+	sent = 0;
+	for (size_t i = 0; i < count; i++) {
+		peer = sorted[i];
+		if (peer->associd <= after)
+			continue;
+		if (sent > 0 && res_frags >= frags) {
+			ctl_putuint("after", sorted[i - 1]->associd);
+			break;
+		}
+		ctl_putuint("associd", peer->associd);
+		ctl_puthex("status", ctlpeerstatus(peer));
+		sent++;
+		/* Nothing but the status word changes between polls */
+		if (have_since && peer->outdate < since &&
+		    peer->timereceived < since)
+			continue;
+		if (gotvar) {
+			for (size_t j = 1; j < COUNTOF(wants); j++)
+				if (wants[j])
+					ctl_putpeer((int)j, peer);
+		} else {
+			for (v = peer_var2; !(EOV & v->flags); v++)
+				if (DEF & v->flags)
+					ctl_putpeer(v->code, peer);
+		}
+	}
+	free(sorted);
+	ctl_flushpkt(0);
+}
+
+
+/*
+ * read_samples - CTL_OP_READ_SAMPLES: the raw samples an association
+ * keeps when the samples option is set, in the binary form described
+ * in ntp_control.h.
+ *
+ * The request payload is an optional textual varlist of:
+ *
+ *	frags=		Limit on datagrams in the response, at most
+ *			MRU_FRAGS_LIMIT, CTL_STREAM_FRAGS over a stream.
+ *			Default READ_PEERS_FRAGS.
+ *	after=		Start after this sample number.
+ *
+ * A client reads on with after= set to the last number it got until
+ * that is the newest.
+ */
+static void
+read_samples(
+	struct recvbuf *rbufp,
+	int restrict_mask
+	)
+{
+	static const struct ctl_var samples_parms[] = {
+		{ 0,		PADDING, "" },
+#define	RS_FRAGS	1
+		{ RS_FRAGS,	RO, "frags" },
+#define	RS_AFTER	2
+		{ RS_AFTER,	RO, "after" },
+		{ 0,		EOV, "" }
+	};
+	const struct ctl_var *v;
+	const struct peer_cold *cold;
+	const struct peer_sample *s;
+	struct peer *peer;
+	uint8_t	buf[CTL_SAMPLE_LEN];
+	char *	valuep;
+	unsigned int frags;
+	unsigned int val;
+	uint32_t after;
+	uint32_t oldest;
+	uint32_t count;
+	uint32_t limit;
+
+	UNUSED_ARG(rbufp);
+	UNUSED_ARG(restrict_mask);
+
+	peer = findpeerbyassoc(res_associd);
+	if (NULL == peer) {
+		ctl_error(CERR_BADASSOC);
+		return;
+	}
+	frags = READ_PEERS_FRAGS;
+	after = 0;
+	while (NULL != (v = ctl_getitem2(samples_parms, NULL, &valuep))) {
+		if (EOV & v->flags) {
+			ctl_error(CERR_UNKNOWNVAR);
+			return;
+		}
+		if (NULL == valuep || 1 != sscanf(valuep, "%u", &val)) {
+			ctl_error(CERR_BADVALUE);
+			return;
+		}
+		if (RS_FRAGS == v->code)
+			frags = val;
+		else
+			after = val;
+	}
+	if (0 == frags || frags > ctl_frags_max()) {
+		ctl_error(CERR_BADVALUE);
+		return;
+	}
+
+	cold = peer->cold;
+	oldest = cold->sample_seq + 1;
+	if (cold->sample_slots > 0)
+		oldest = max(cold->sample_base,
+			     cold->sample_seq - min(cold->sample_seq,
+						    cold->sample_slots)) + 1;
+	if (after < oldest - 1)
+		after = oldest - 1;
+	count = (after < cold->sample_seq) ? cold->sample_seq - after : 0;
+	limit = (frags * CTL_MAX_DATA_LEN - CTL_SAMPLES_HDRLEN) /
+		CTL_SAMPLE_LEN;
+	if (count > limit)
+		count = limit;
+
+	rpkt->status = htons(ctlpeerstatus(peer));
+	buf[0] = (uint8_t)(cold->sample_seq >> 24);
+	buf[1] = (uint8_t)(cold->sample_seq >> 16);
+	buf[2] = (uint8_t)(cold->sample_seq >> 8);
+	buf[3] = (uint8_t)cold->sample_seq;
+	buf[4] = (uint8_t)(oldest >> 24);
+	buf[5] = (uint8_t)(oldest >> 16);
+	buf[6] = (uint8_t)(oldest >> 8);
+	buf[7] = (uint8_t)oldest;
+	buf[8] = 0;
+	buf[9] = CTL_SAMPLE_LEN;
+	buf[10] = (uint8_t)(count >> 8);
+	buf[11] = (uint8_t)count;
+	ctl_putdata((const char *)buf, CTL_SAMPLES_HDRLEN, true);
+	for (uint32_t seq = after + 1; seq <= after + count; seq++) {
+		s = &cold->samples[(seq - 1) % cold->sample_slots];
+		buf[0] = (uint8_t)(seq >> 24);
+		buf[1] = (uint8_t)(seq >> 16);
+		buf[2] = (uint8_t)(seq >> 8);
+		buf[3] = (uint8_t)seq;
+		put_be64(&buf[4], s->t1);
+		put_be64(&buf[12], s->t2);
+		put_be64(&buf[20], s->t3);
+		put_be64(&buf[28], s->t4);
+		put_be64(&buf[36], (uint64_t)s->offset);
+		put_be64(&buf[44], ((uint64_t)s->delay << 32) | s->disp);
+		ctl_putdata((const char *)buf, CTL_SAMPLE_LEN, true);
+	}
+	ctl_flushpkt(0);
+}
+
+
+/*
+ * read_pkttrace - CTL_OP_READ_PKTTRACE: the packets in the trace ring,
+ * in the binary form described in ntp_control.h.  It shows other
+ * hosts' traffic, so it needs authentication.
+ *
+ * The request payload is an optional textual varlist of:
+ *
+ *	frags=		Limit on datagrams in the response, at most
+ *			MRU_FRAGS_LIMIT, CTL_STREAM_FRAGS over a stream.
+ *			Default READ_PEERS_FRAGS.
+ *	after=		Start after this record number.
+ *
+ * Records being overwritten as they are read are left out.  A client
+ * reads on with after= set to the last number it got, up to the
+ * newest of its first response, as packets keep coming.
+ */
+static void
+read_pkttrace(
+	struct recvbuf *rbufp,
+	int restrict_mask
+	)
+{
+	static const struct ctl_var pkttrace_parms[] = {
+		{ 0,		PADDING, "" },
+#define	RT_FRAGS	1
+		{ RT_FRAGS,	RO, "frags" },
+#define	RT_AFTER	2
+		{ RT_AFTER,	RO, "after" },
+		{ 0,		EOV, "" }
+	};
+	const struct ctl_var *v;
+	struct pkttrace t;
+	uint8_t	buf[CTL_PKTTRACE_LEN];
+	char *	valuep;
+	unsigned int frags;
+	unsigned int limit;
+	unsigned int sent;
+	uint64_t after;
+	uint64_t newest;
+	uint64_t oldest;
+	unsigned long long val;
+
+	UNUSED_ARG(rbufp);
+	UNUSED_ARG(restrict_mask);
+
+	frags = READ_PEERS_FRAGS;
+	after = 0;
+	while (NULL != (v = ctl_getitem2(pkttrace_parms, NULL, &valuep))) {
+		if (EOV & v->flags) {
+			ctl_error(CERR_UNKNOWNVAR);
+			return;
+		}
+		if (NULL == valuep || 1 != sscanf(valuep, "%llu", &val)) {
+			ctl_error(CERR_BADVALUE);
+			return;
+		}
+		if (RT_FRAGS == v->code)
+			frags = (val > ctl_frags_max()) ? 0 : (unsigned int)val;
+		else
+			after = val;
+	}
+	if (0 == frags) {
+		ctl_error(CERR_BADVALUE);
+		return;
+	}
+
+	newest = pkttrace_newest();
+	oldest = newest - min(newest, pkttrace_size()) + 1;
+	if (after < oldest - 1)
+		after = oldest - 1;
+	limit = (frags * CTL_MAX_DATA_LEN - CTL_PKTTRACE_HDRLEN) /
+		CTL_PKTTRACE_LEN;
+
+	rpkt->status = htons(ctlsysstatus());
+	ZERO(buf);
+	put_be64(&buf[0], newest);
+	put_be64(&buf[8], oldest);
+	buf[16] = 0;
+	buf[17] = CTL_PKTTRACE_LEN;
+	ctl_putdata((const char *)buf, CTL_PKTTRACE_HDRLEN, true);
+	sent = 0;
+	for (uint64_t seq = after + 1; seq <= newest && sent < limit; seq++) {
+		if (!pkttrace_get(seq, &t))
+			continue;
+		ZERO(buf);
+		put_be64(&buf[0], seq);
+		put_be64(&buf[8], t.stamp);
+		buf[16] = t.dir;
+		buf[17] = IS_IPV6(&t.addr) ? 6 : 4;
+		buf[18] = (uint8_t)(SRCPORT(&t.addr) >> 8);
+		buf[19] = (uint8_t)SRCPORT(&t.addr);
+		buf[20] = (uint8_t)(t.length >> 8);
+		buf[21] = (uint8_t)t.length;
+		if (IS_IPV6(&t.addr))
+			memcpy(&buf[24], PSOCK_ADDR6(&t.addr), 16);
+		else
+			memcpy(&buf[24], &PSOCK_ADDR4(&t.addr)->s_addr, 4);
+		memcpy(&buf[40], t.header, sizeof(t.header));
+		ctl_putdata((const char *)buf, CTL_PKTTRACE_LEN, true);
+		sent++;
+	}
+	ctl_flushpkt(0);
+}
+
+
 /*
  * configure() processes ntpq :config/config-from-file, allowing
  *		generic runtime reconfiguration.
@@ -2591,6 +3657,10 @@ static void configure(
 /*
  * derive_nonce - generate client-address-specific nonce value
  *		  associated with a given timestamp.
+ *
+ * This is making a cookie which is only checked by this system, so
+ * a keyed SipHash-2-4 under the hourly salt does; mrulist polling
+ * runs it twice per request.
  */
 static uint32_t derive_nonce(
 	sockaddr_u *	addr,
@@ -2598,60 +3668,36 @@ static uint32_t derive_nonce(
 	uint32_t		ts_f
 	)
 {
-	static uint8_t	salt[16];
+	static uint64_t	salt[2];
 	static unsigned long	next_salt_update = 0;
-	union d_tag {
-		uint8_t	digest[EVP_MAX_MD_SIZE];
-		uint32_t extract;
-	}		d;
-
-	static EVP_MD_CTX *ctx;
-	static const EVP_MD *evp;
-	unsigned int len;
-
-	if (NULL == ctx) {
-	  ctx = EVP_MD_CTX_new();
-	  if (NULL == ctx) {
-	    msyslog(LOG_ERR, "ERR: EVP_MD_CTX_new() failed");
-	    exit(1);
-	  }
-	}
-
-	if (NULL == evp) {
-	  /* EVP_md5() doesn't work on FIPS systems.
-	   * Check here in case EVP_sha1() gets demoted.
-	   * This is making a cookie which is only checked by
-	   * this system so the details of how it is made don't matter.
-	   */
-	  evp = EVP_sha1();
-	  if (NULL == evp) {
-	    msyslog(LOG_ERR, "ERR: EVP_sha1() failed");
-	    exit(1);
-	  }
-	}
+	uint8_t		msg[2 * sizeof(uint32_t) + sizeof(SOCK_ADDR6(addr)) +
+			    sizeof(NSRCPORT(addr))];
+	size_t		len;
+	uint64_t	h;
 
 	if (current_time >= next_salt_update) {
-		ntp_RAND_bytes(&salt[0], sizeof(salt));
+		ntp_RAND_bytes((unsigned char *)salt, (int)sizeof(salt));
 		next_salt_update = current_time+SECSPERHR;
 		if (0) msyslog(LOG_INFO, "derive_nonce: update salt, %lld", \
 			(long long)next_salt_update);
 	}
 
-	EVP_DigestInit_ex(ctx, evp, NULL);
-	EVP_DigestUpdate(ctx, salt, sizeof(salt));
-	EVP_DigestUpdate(ctx, &ts_i, sizeof(ts_i));
-	EVP_DigestUpdate(ctx, &ts_f, sizeof(ts_f));
-	if (IS_IPV4(addr))
-		EVP_DigestUpdate(ctx, &SOCK_ADDR4(addr),
-			         sizeof(SOCK_ADDR4(addr)));
-	else
-		EVP_DigestUpdate(ctx, &SOCK_ADDR6(addr),
-			         sizeof(SOCK_ADDR6(addr)));
-	EVP_DigestUpdate(ctx, &NSRCPORT(addr), sizeof(NSRCPORT(addr)));
-	EVP_DigestUpdate(ctx, salt, sizeof(salt));
-	EVP_DigestFinal_ex(ctx, d.digest, &len);
+	memcpy(msg, &ts_i, sizeof(ts_i));
+	len = sizeof(ts_i);
+	memcpy(msg + len, &ts_f, sizeof(ts_f));
+	len += sizeof(ts_f);
+	if (IS_IPV4(addr)) {
+		memcpy(msg + len, &SOCK_ADDR4(addr), sizeof(SOCK_ADDR4(addr)));
+		len += sizeof(SOCK_ADDR4(addr));
+	} else {
+		memcpy(msg + len, &SOCK_ADDR6(addr), sizeof(SOCK_ADDR6(addr)));
+		len += sizeof(SOCK_ADDR6(addr));
+	}
+	memcpy(msg + len, &NSRCPORT(addr), sizeof(NSRCPORT(addr)));
+	len += sizeof(NSRCPORT(addr));
 
-	return d.extract;
+	h = sip_hash24(salt, msg, len);
+	return (uint32_t)(h ^ (h >> 32));
 }
 
 
@@ -2832,6 +3878,350 @@ send_mru_entry(
 }
 
 
+/*
+ * The filters of an mrulist request, see read_mru_list()
+ */
+struct mru_filter {
+	int		mincount;
+	unsigned int	mindrop;
+	float		minscore;
+	unsigned short	resall;
+	unsigned short	resany;
+	unsigned int	maxlstint;
+	unsigned int	minlstint;
+	endpt *		lcladr;
+};
+
+static bool
+mru_wanted(
+	const mon_entry *		mon,
+	const struct mru_filter *	f,
+	l_fp				now
+	)
+{
+	if (mon->count < f->mincount)
+		return false;
+	if (mon->dropped < f->mindrop)
+		return false;
+	if (mon->score < f->minscore)
+		return false;
+	if (f->resall && f->resall != (f->resall & mon->flags))
+		return false;
+	if (f->resany && !(f->resany & mon->flags))
+		return false;
+	if (f->maxlstint > 0 && lfpuint(now) - lfpuint(mon->last) >
+	    f->maxlstint)
+		return false;
+	if (f->minlstint > 0 && lfpuint(now) - lfpuint(mon->last) <
+	    f->minlstint)
+		return false;
+	if (f->lcladr != NULL && mon->lcladr != f->lcladr)
+		return false;
+	return true;
+}
+
+/*
+ * mrulist cursors.  Resuming a fetch from the newest entries the client
+ * holds costs a lookup per resumption and fails over to a restart when
+ * those have been bumped, which on a busy server with a long MRU list
+ * can go on indefinitely.  With "cursor=new" the first request instead
+ * copies the matching entries, and later requests page through the copy
+ * by position, so a fetch takes one pass whatever the churn.
+ *
+ * Positions are in the cursor text, and every response carries total=,
+ * the size of the copy, so a client can ask for several pages at once.
+ * For the same reason a copy is kept for MRU_CURSOR_LINGER seconds
+ * after its last entry has gone, for pages lost on the way and asked
+ * for again.
+ *
+ * A copy is at most mru_entries entries, there are at most MRU_CURSORS
+ * of them, one per client address, and one not used for
+ * MRU_CURSOR_IDLE seconds is freed.  When all are in use, a lingering
+ * one is taken over, and failing that requests get the classic
+ * protocol.
+ */
+#define MRU_CURSORS	2
+#define MRU_CURSOR_IDLE	30	/* seconds */
+#define MRU_CURSOR_LINGER 5	/* seconds */
+
+static struct mru_cursor {
+	uint32_t	id;		/* 0 when free */
+	sockaddr_u	client;		/* only it may use the cursor */
+	uptime_t	used;		/* last request */
+	l_fp		now;		/* when it was taken */
+	bool		sent_all;	/* the last entry has gone */
+	size_t		count;
+	mon_entry *	entries;	/* oldest first */
+} mru_cursors[MRU_CURSORS];
+
+static void
+mru_cursor_free(
+	struct mru_cursor *	c
+	)
+{
+	free(c->entries);
+	ZERO(*c);
+}
+
+/*
+ * ctl_timer - once a second: free abandoned mrulist cursors
+ */
+void
+ctl_timer(void)
+{
+	for (size_t i = 0; i < COUNTOF(mru_cursors); i++)
+		if (mru_cursors[i].id != 0 &&
+		    current_time - mru_cursors[i].used >=
+		    (mru_cursors[i].sent_all ? MRU_CURSOR_LINGER
+					     : MRU_CURSOR_IDLE))
+			mru_cursor_free(&mru_cursors[i]);
+}
+
+/*
+ * mru_cursor_new - copy the entries matching f, oldest first.  Returns
+ * NULL if there is no room.
+ */
+static struct mru_cursor *
+mru_cursor_new(
+	const sockaddr_u *		client,
+	const struct mru_filter *	f,
+	unsigned int			recent
+	)
+{
+	struct mru_cursor *	c = NULL;
+	mon_entry *		mon;
+	uint64_t		countdown;
+	size_t			n = 0;
+
+	for (size_t i = 0; i < COUNTOF(mru_cursors); i++) {
+		/* a client starting over doesn't need its old one */
+		if (mru_cursors[i].id != 0 &&
+		    SOCK_EQ(&mru_cursors[i].client, client))
+			mru_cursor_free(&mru_cursors[i]);
+		if (mru_cursors[i].id == 0 && NULL == c)
+			c = &mru_cursors[i];
+	}
+	for (size_t i = 0; i < COUNTOF(mru_cursors) && NULL == c; i++)
+		if (mru_cursors[i].sent_all) {
+			c = &mru_cursors[i];
+			mru_cursor_free(c);
+		}
+	if (NULL == c)
+		return NULL;
+
+	c->entries = calloc((size_t)mon_data.mru_entries + 1,
+			    sizeof(*c->entries));
+	if (NULL == c->entries)
+		return NULL;
+	get_systime(&c->now);
+	mon_sort_mru();
+	countdown = mon_data.mru_entries;
+	for (mon = TAIL_DLIST(mon_data.mon_mru_list, mru);
+	     mon != NULL && n <= mon_data.mru_entries;
+	     mon = PREV_DLIST(mon_data.mon_mru_list, mon, mru)) {
+		if (!mru_wanted(mon, f, c->now))
+			continue;
+		if (recent != 0 && countdown-- > recent)
+			continue;
+		c->entries[n] = *mon;
+		ZERO(c->entries[n].mru);
+		c->entries[n].lcladr = NULL;
+		n++;
+	}
+	c->count = n;
+	do {
+		ntp_RAND_pool_bytes((unsigned char *)&c->id, sizeof(c->id));
+	} while (0 == c->id);
+	c->client = *client;
+	c->used = current_time;
+	return c;
+}
+
+/*
+ * mru_cursor_find - the cursor named by text "id-position", if the
+ * client owns it
+ */
+static struct mru_cursor *
+mru_cursor_find(
+	const char *		text,
+	const sockaddr_u *	client,
+	size_t *		pos
+	)
+{
+	unsigned int	id;
+	unsigned long	where;
+
+	if (2 != sscanf(text, "%8x-%lu", &id, &where) || 0 == id)
+		return NULL;
+	for (size_t i = 0; i < COUNTOF(mru_cursors); i++)
+		if (mru_cursors[i].id == id &&
+		    SOCK_EQ(&mru_cursors[i].client, client) &&
+		    where <= mru_cursors[i].count) {
+			*pos = where;
+			return &mru_cursors[i];
+		}
+	return NULL;
+}
+
+/*
+ * send_mru_cursor - respond with entries of c from pos on.  The cursor
+ * is freed once all have gone.
+ */
+static void
+send_mru_cursor(
+	struct recvbuf *	rbufp,
+	struct mru_cursor *	c,
+	size_t			pos,
+	unsigned int		limit,
+	unsigned short		frags
+	)
+{
+	char		buf[128];
+	unsigned int	count;
+
+	c->used = current_time;
+	generate_nonce(rbufp, buf, sizeof(buf));
+	ctl_putunqstr("nonce", buf, strlen(buf));
+	for (count = 0;
+	     pos < c->count && res_frags < frags && count < limit &&
+	     !(count > 0 && ctl_overtime());
+	     pos++) {
+		send_mru_entry(&c->entries[pos], (int)count);
+#ifdef USE_RANDOMIZE_RESPONSES
+		if (!count)
+			send_random_tag_value(0);
+#endif /* USE_RANDOMIZE_RESPONSES */
+		count++;
+	}
+	if (pos < c->count) {
+		snprintf(buf, sizeof(buf), "%08x-%lu", c->id,
+			 (unsigned long)pos);
+		ctl_putunqstr("cursor", buf, strlen(buf));
+		ctl_putuint("total", c->count);
+	} else {
+#ifdef USE_RANDOMIZE_RESPONSES
+		if (count > 1) {
+			send_random_tag_value((int)count - 1);
+		}
+#endif /* USE_RANDOMIZE_RESPONSES */
+		ctl_putts("now", c->now);
+		if (count > 0)
+			ctl_putts("last.newest", c->entries[pos - 1].last);
+		c->sent_all = true;
+	}
+	ctl_flushpkt(0);
+}
+
+/*
+ * mrulist top=: the entries highest by count, drops or score, found in
+ * one pass over the list.  A min-heap holds the best so far, so an
+ * entry not above the least of them costs one comparison, and the
+ * heap is sorted in place at the end.  With "mru sketch" the list
+ * holds only the sources the sketch found busy, which are the ones
+ * wanted here.
+ */
+enum mru_by { MRU_BY_COUNT, MRU_BY_DROP, MRU_BY_SCORE };
+
+static double
+mru_key(
+	const mon_entry *	mon,
+	enum mru_by		by
+	)
+{
+	switch (by) {
+	case MRU_BY_DROP:
+		return mon->dropped;
+	case MRU_BY_SCORE:
+		return mon->score;
+	case MRU_BY_COUNT:
+	default:
+		return mon->count;
+	}
+}
+
+/* sift heap[i] down a min-heap of n */
+static void
+mru_heap_down(
+	mon_entry **	heap,
+	size_t		n,
+	size_t		i,
+	enum mru_by	by
+	)
+{
+	mon_entry *	mon = heap[i];
+	size_t		child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && mru_key(heap[child + 1], by) <
+		    mru_key(heap[child], by))
+			child++;
+		if (mru_key(mon, by) <= mru_key(heap[child], by))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = mon;
+}
+
+/*
+ * send_mru_top - respond with the top entries matching f, highest
+ * first, as many as fit in frags
+ */
+static void
+send_mru_top(
+	struct recvbuf *		rbufp,
+	const struct mru_filter *	f,
+	size_t				top,
+	enum mru_by			by,
+	unsigned short			frags
+	)
+{
+	mon_entry **	heap;
+	mon_entry *	mon;
+	size_t		n = 0;
+	size_t		i;
+	char		buf[128];
+	l_fp		now;
+
+	top = min(top, (size_t)mon_data.mru_entries);
+	heap = emalloc(max(top, 1) * sizeof(*heap));
+	get_systime(&now);
+	for (mon = TAIL_DLIST(mon_data.mon_mru_list, mru);
+	     top > 0 && mon != NULL;
+	     mon = PREV_DLIST(mon_data.mon_mru_list, mon, mru)) {
+		if (!mru_wanted(mon, f, now))
+			continue;
+		if (n < top) {
+			heap[n++] = mon;
+			if (n == top)
+				for (i = n / 2; i-- > 0; )
+					mru_heap_down(heap, n, i, by);
+		} else if (mru_key(mon, by) > mru_key(heap[0], by)) {
+			heap[0] = mon;
+			mru_heap_down(heap, n, 0, by);
+		}
+	}
+	if (n < top)
+		for (i = n / 2; i-- > 0; )
+			mru_heap_down(heap, n, i, by);
+	/* the least goes to the end each time, leaving the highest first */
+	for (i = n; i > 1; i--) {
+		mon = heap[0];
+		heap[0] = heap[i - 1];
+		heap[i - 1] = mon;
+		mru_heap_down(heap, i - 1, 0, by);
+	}
+
+	generate_nonce(rbufp, buf, sizeof(buf));
+	ctl_putunqstr("nonce", buf, strlen(buf));
+	for (i = 0; i < n && res_frags < frags; i++)
+		send_mru_entry(heap[i], (int)i);
+	ctl_putts("now", now);
+	ctl_flushpkt(0);
+	free(heap);
+}
+
+
 /*
  * read_mru_list - supports ntpq's mrulist command.
  *
@@ -2864,7 +4254,9 @@ send_mru_entry(
  *			ability to receive traffic sent to its address.
  *	frags=		Limit on datagrams (fragments) in response.  Used
  *			by newer ntpq versions instead of limit= when
- *			retrieving multiple entries.
+ *			retrieving multiple entries.  At most
+ *			MRU_FRAGS_LIMIT, or CTL_STREAM_FRAGS over a
+ *			stream, about 30 MB.
  *	limit=		Limit on MRU entries returned.  One of frags= or
  *			limit= must be provided.
  *			limit=1 is a special case:  Instead of fetching
@@ -2906,6 +4298,23 @@ send_mru_entry(
  *	last.1=		timestamp of 2nd newest entry client has.
  *	addr.1=		address of 2nd newest entry.
  *	[...]
+ *	cursor=		"new" to page through a copy of the list as it
+ *			is now, see struct mru_cursor.  The response
+ *			has a cursor= value to send back, instead of
+ *			last.x/addr.x, for the next entries.  Filters
+ *			apply when the copy is made and need not be
+ *			sent again.  Responses with no cursor= mean the
+ *			copy could not be made and the classic protocol
+ *			applies.  A cursor that is unknown, expired or
+ *			belongs to another client gets CERR_UNKNOWNVAR.
+ *			The cursor text is "id-position", and total= is
+ *			the number of entries in the copy, so any page
+ *			may be asked for, several at a time.
+ *	top=		Instead of the list, the top= entries matching
+ *			the filters with the highest by= value, highest
+ *			first, in one response; see send_mru_top().
+ *			Takes the place of cursor=, last.x and addr.x.
+ *	by=		"count" (the default), "drop" or "score".
  *
  * ntpq provides as many last/addr pairs as will fit in a single request
  * packet, except for the first request in a MRU fetch operation.
@@ -2975,20 +4384,21 @@ static void read_mru_list(
 	static const char	minlstint_text[] =	"minlstint";
 	static const char	laddr_text[] =		"laddr";
 	static const char	recent_text[] =		"recent";
+	static const char	cursor_text[] =		"cursor";
+	static const char	top_text[] =		"top";
+	static const char	by_text[] =		"by";
 	static const char	resaxx_fmt[] =		"0x%hx";
 
 	unsigned int		limit;
 	unsigned short		frags;
-	unsigned short		resall;
-	unsigned short		resany;
-	int			mincount;
-	unsigned int		mindrop;
-	float			minscore;
-	unsigned int		maxlstint;
-	unsigned int		minlstint;
+	struct mru_filter	filter;
 	sockaddr_u		laddr;
 	unsigned int		recent;
-	endpt *                 lcladr;
+	char *			pcursor;
+	struct mru_cursor *	cursor;
+	size_t			cursor_pos;
+	unsigned int		top;
+	enum mru_by		by;
 	unsigned int		count;
 	static unsigned int	countdown;
 	unsigned int		ui;
@@ -3034,6 +4444,9 @@ static void read_mru_list(
 	set_var(&in_parms, minlstint_text, sizeof(minlstint_text), 0);
 	set_var(&in_parms, laddr_text, sizeof(laddr_text), 0);
 	set_var(&in_parms, recent_text, sizeof(recent_text), 0);
+	set_var(&in_parms, cursor_text, sizeof(cursor_text), 0);
+	set_var(&in_parms, top_text, sizeof(top_text), 0);
+	set_var(&in_parms, by_text, sizeof(by_text), 0);
 	for (i = 0; i < COUNTOF(last); i++) {
 		snprintf(buf, sizeof(buf), last_fmt, (int)i);
 		set_var(&in_parms, buf, strlen(buf) + 1, 0);
@@ -3045,15 +4458,11 @@ static void read_mru_list(
 	pnonce = NULL;
 	frags = 0;
 	limit = 0;
-	mincount = 0;
-	mindrop = 0;
-	minscore = 0.0;
-	resall = 0;
-	resany = 0;
-	maxlstint = 0;
-	minlstint = 0;
+	ZERO(filter);
 	recent = 0;
-	lcladr = NULL;
+	pcursor = NULL;
+	top = 0;
+	by = MRU_BY_COUNT;
 	priors = 0;
 	ZERO(last);
 	ZERO(addr);
@@ -3061,7 +4470,7 @@ static void read_mru_list(
 	/* have to go through '(void*)' to drop 'const' property from pointer.
 	 * ctl_getitem2()' needs some cleanup, too.... perlinger@ntp.org
 	 */
-	while (NULL != (v = ctl_getitem2(in_parms, (void*)&val)) &&
+	while (NULL != (v = ctl_getitem2(in_parms, NULL, (void*)&val)) &&
 	       !(EOV & v->flags)) {
 		int si;
 
@@ -3078,37 +4487,52 @@ static void read_mru_list(
 			if (1 != sscanf(val, "%u", &limit))
 				goto blooper;
 		} else if (!strcmp(mincount_text, v->text)) {
-			if (1 != sscanf(val, "%d", &mincount))
+			if (1 != sscanf(val, "%d", &filter.mincount))
 				goto blooper;
-			if (mincount < 0)
-				mincount = 0;
+			if (filter.mincount < 0)
+				filter.mincount = 0;
 		} else if (!strcmp(mindrop_text, v->text)) {
-			if (1 != sscanf(val, "%u", &mindrop))
+			if (1 != sscanf(val, "%u", &filter.mindrop))
 				goto blooper;
 		} else if (!strcmp(minscore_text, v->text)) {
-			if (1 != sscanf(val, "%f", &minscore))
+			if (1 != sscanf(val, "%f", &filter.minscore))
 				goto blooper;
-			if (minscore < 0)
-				minscore = 0.0;
+			if (filter.minscore < 0)
+				filter.minscore = 0.0;
 		} else if (!strcmp(resall_text, v->text)) {
-			if (1 != sscanf(val, resaxx_fmt, &resall))
+			if (1 != sscanf(val, resaxx_fmt, &filter.resall))
 				goto blooper;
 		} else if (!strcmp(resany_text, v->text)) {
-			if (1 != sscanf(val, resaxx_fmt, &resany))
+			if (1 != sscanf(val, resaxx_fmt, &filter.resany))
 				goto blooper;
 		} else if (!strcmp(maxlstint_text, v->text)) {
-			if (1 != sscanf(val, "%u", &maxlstint))
+			if (1 != sscanf(val, "%u", &filter.maxlstint))
 				goto blooper;
 		} else if (!strcmp(minlstint_text, v->text)) {
-			if (1 != sscanf(val, "%u", &minlstint))
+			if (1 != sscanf(val, "%u", &filter.minlstint))
 				goto blooper;
 		} else if (!strcmp(laddr_text, v->text)) {
 			if (decodenetnum(val, &laddr))
 				goto blooper;
-			lcladr = getinterface(&laddr, 0);
+			filter.lcladr = getinterface(&laddr, 0);
 		} else if (!strcmp(recent_text, v->text)) {
 			if (1 != sscanf(val, "%u", &recent))
 				goto blooper;
+		} else if (!strcmp(cursor_text, v->text)) {
+			free(pcursor);
+			pcursor = (*val) ? estrdup(val) : NULL;
+		} else if (!strcmp(top_text, v->text)) {
+			if (1 != sscanf(val, "%u", &top))
+				goto blooper;
+		} else if (!strcmp(by_text, v->text)) {
+			if (!strcmp(val, "count"))
+				by = MRU_BY_COUNT;
+			else if (!strcmp(val, "drop"))
+				by = MRU_BY_DROP;
+			else if (!strcmp(val, "score"))
+				by = MRU_BY_SCORE;
+			else
+				goto blooper;
 		} else if (1 == sscanf(v->text, last_fmt, &si) &&
 			   (size_t)si < COUNTOF(last)) {
 			if (2 != sscanf(val, "0x%08x.%08x", &ui, &uf))
@@ -3142,17 +4566,20 @@ static void read_mru_list(
 
 	/* return no responses until the nonce is validated */
 	if (NULL == pnonce) {
+		free(pcursor);
 		return;
 	}
 
 	nonce_valid = validate_nonce(pnonce, rbufp);
 	free(pnonce);
 	if (!nonce_valid) {
+		free(pcursor);
 		return;
 	}
 
 	if ((0 == frags && !(0 < limit && limit <= MRU_ROW_LIMIT)) ||
-	    frags > MRU_FRAGS_LIMIT) {
+	    frags > ctl_frags_max()) {
+		free(pcursor);
 		ctl_error(CERR_BADVALUE);
 		return;
 	}
@@ -3163,7 +4590,34 @@ static void read_mru_list(
 	if (0 != frags && 0 == limit) {
 		limit = UINT_MAX;
 	} else if (0 != limit && 0 == frags)
-		frags = MRU_FRAGS_LIMIT;
+		frags = (unsigned short)ctl_frags_max();
+
+	if (top > 0) {
+		free(pcursor);
+		send_mru_top(rbufp, &filter, min(top, limit), by, frags);
+		return;
+	}
+
+	if (NULL != pcursor && limit != 1) {
+		cursor_pos = 0;
+		if (!strcmp(pcursor, "new"))
+			cursor = mru_cursor_new(&rbufp->recv_srcadr,
+						&filter, recent);
+		else if (NULL == (cursor = mru_cursor_find(pcursor,
+				 &rbufp->recv_srcadr, &cursor_pos))) {
+			free(pcursor);
+			ctl_error(CERR_UNKNOWNVAR);
+			return;
+		}
+		free(pcursor);
+		/* with no room for a copy, carry on the classic way */
+		if (NULL != cursor) {
+			send_mru_cursor(rbufp, cursor, cursor_pos,
+					limit, frags);
+			return;
+		}
+	} else
+		free(pcursor);
 
 	mon = NULL;
 	if (limit == 1) {
@@ -3213,6 +4667,8 @@ static void read_mru_list(
 		if (limit > 1)
 			mon = PREV_DLIST(mon_data.mon_mru_list, mon, mru);
 	} else {	/* start with the oldest */
+		/* a fresh fetch; later rounds resume wherever it left off */
+		mon_sort_mru();
 		mon = TAIL_DLIST(mon_data.mon_mru_list, mru);
 		countdown = mon_data.mru_entries;
 	}
@@ -3225,26 +4681,11 @@ static void read_mru_list(
 	ctl_putunqstr("nonce", buf, strlen(buf));
 	prior_mon = NULL;
 	for (count = 0;
-	     mon != NULL && res_frags < frags && count < limit;
+	     mon != NULL && res_frags < frags && count < limit &&
+	     !(count > 0 && ctl_overtime());
 	     mon = PREV_DLIST(mon_data.mon_mru_list, mon, mru)) {
 
-		if (mon->count < mincount)
-			continue;
-		if (mon->dropped < mindrop)
-			continue;
-		if (mon->score < minscore)
-			continue;
-		if (resall && resall != (resall & mon->flags))
-			continue;
-		if (resany && !(resany & mon->flags))
-			continue;
-		if (maxlstint > 0 && lfpuint(now) - lfpuint(mon->last) >
-		    maxlstint)
-			continue;
-		if (minlstint > 0 && lfpuint(now) - lfpuint(mon->last) <
-		    minlstint)
-			continue;
-		if (lcladr != NULL && mon->lcladr != lcladr)
+		if (!mru_wanted(mon, &filter, now))
 			continue;
 		if (recent != 0 && countdown-- > recent)
 			continue;
@@ -3298,8 +4739,10 @@ send_ifstats_entry(
 	const char txerr_fmt[] =	"txerr.%u";
 	const char pc_fmt[] =		"pc.%u";	/* peer count */
 	const char up_fmt[] =		"up.%u";	/* uptime */
+	const char kd_fmt[] =		"kd.%u";	/* kernel drops */
+	const char rb_fmt[] =		"rb.%u";	/* receive buffer */
 	char	tag[32];
-	uint8_t	sent[IFSTATS_FIELDS]; /* 9 tag=value pairs */
+	uint8_t	sent[IFSTATS_FIELDS]; /* 11 tag=value pairs */
 	int	noisebits;
 	uint32_t noise;
 	unsigned int	which = 0;
@@ -3373,6 +4816,16 @@ send_ifstats_entry(
 			ctl_putuint(tag, current_time - la->starttime);
 			break;
 
+		case 9:
+			snprintf(tag, sizeof(tag), kd_fmt, ifnum);
+			ctl_putint(tag, la->kdropped);
+			break;
+
+		case 10:
+			snprintf(tag, sizeof(tag), rb_fmt, ifnum);
+			ctl_putint(tag, la->sockbuf.rcvbuf);
+			break;
+
 		default:
 			/* Get here if IFSTATS_FIELDS is too big. */
 			break;
@@ -3541,26 +4994,72 @@ send_restrict_entry(
 }
 
 
-static void
+/*
+ * send_restrict_list - the entries of a list numbered from on.  With
+ * sliced, stop when the request's time is up; false if it stopped.
+ */
+static bool
 send_restrict_list(
 	restrict_u *	pres,
 	int		ipv6,
-	unsigned int *		pidx
+	unsigned int *		pidx,
+	unsigned int	from,
+	bool		sliced
 	)
 {
 	for ( ; pres != NULL; pres = pres->link) {
-		send_restrict_entry(pres, ipv6, *pidx);
+		if (*pidx >= from) {
+			if (sliced && *pidx > from && ctl_overtime())
+				return false;
+			send_restrict_entry(pres, ipv6, *pidx);
+		}
 		(*pidx)++;
 	}
+	return true;
 }
 
 
 /*
- * read_addr_restrictions - returns IPv4 and IPv6 access control lists
+ * send_restrict_set - the restrict set, as one more entry with its
+ * file and prefix count where the lists' have address and mask
+ */
+static void
+send_restrict_set(
+	unsigned int	idx
+	)
+{
+	const char *	path;
+	const char *	pch;
+	unsigned long	prefixes;
+	uint64_t	hits;
+	unsigned short	flags;
+	char		tag[32];
+
+	if (!restrict_set_info(&path, &prefixes, &hits, &flags))
+		return;
+	snprintf(tag, sizeof(tag), "set.%u", idx);
+	ctl_putunqstr(tag, path, strlen(path));
+	snprintf(tag, sizeof(tag), "prefixes.%u", idx);
+	ctl_putuint(tag, prefixes);
+	snprintf(tag, sizeof(tag), "hits.%u", idx);
+	ctl_putuint(tag, hits);
+	snprintf(tag, sizeof(tag), "flags.%u", idx);
+	pch = res_access_flags(flags);
+	ctl_putunqstr(tag, pch, strlen(pch));
+}
+
+
+/*
+ * read_addr_restrictions - returns IPv4 and IPv6 access control lists,
+ * and the restrict set.  A client that asks "from=" an entry gets
+ * what fits in the request's slice and then "more=", the entry to ask
+ * from next; one that doesn't gets it all at once, as it always has.
  */
 static void
 read_addr_restrictions(
-	struct recvbuf *	rbufp
+	struct recvbuf *	rbufp,
+	bool			sliced,
+	unsigned int		from
 )
 {
 	unsigned int idx;
@@ -3568,8 +5067,14 @@ read_addr_restrictions(
 	UNUSED_ARG(rbufp);
 
 	idx = 0;
-	send_restrict_list(rstrct.restrictlist4, false, &idx);
-	send_restrict_list(rstrct.restrictlist6, true, &idx);
+	sort_restrict();
+	if (send_restrict_list(rstrct.restrictlist4, false, &idx, from,
+			       sliced) &&
+	    send_restrict_list(rstrct.restrictlist6, true, &idx, from,
+			       sliced))
+		send_restrict_set(idx);
+	else
+		ctl_putuint("more", idx);
 	ctl_flushpkt(0);
 }
 
@@ -3590,6 +5095,8 @@ read_ordlist(
 	struct ntp_control *	cpkt;
 	struct ntp_control pkt_core;
 	unsigned short		qdata_octets;
+	char			qdata[32];
+	unsigned int		from;
 
 	UNUSED_ARG(rbufp);
 	UNUSED_ARG(restrict_mask);
@@ -3602,8 +5109,9 @@ read_ordlist(
 	 * contains "ifstats" (not null terminated) to retrieve local
 	 * addresses and associated stats.  It is "addr_restrictions"
 	 * to retrieve the IPv4 then IPv6 remote address restrictions,
-	 * which are access control lists.  Other request data return
-	 * CERR_UNKNOWNVAR.
+	 * which are access control lists, or "addr_restrictions
+	 * from=N" to have them a slice at a time.  Other request data
+	 * return CERR_UNKNOWNVAR.
 	 */
 	unmarshall_ntp_control(&pkt_core, rbufp);
 	cpkt = &pkt_core;
@@ -3615,9 +5123,18 @@ read_ordlist(
 	}
 	if (a_r_chars == qdata_octets &&
 	    !memcmp(addr_rst_s, cpkt->data, a_r_chars)) {
-		read_addr_restrictions(rbufp);
+		read_addr_restrictions(rbufp, false, 0);
 		return;
 	}
+	if (a_r_chars < qdata_octets && qdata_octets < sizeof(qdata)) {
+		memcpy(qdata, cpkt->data, qdata_octets);
+		qdata[qdata_octets] = '\0';
+		if (!memcmp(addr_rst_s, qdata, a_r_chars) &&
+		    1 == sscanf(qdata + a_r_chars, " from=%u", &from)) {
+			read_addr_restrictions(rbufp, true, from);
+			return;
+		}
+	}
 	ctl_error(CERR_UNKNOWNVAR);
 }
 
@@ -3702,16 +5219,16 @@ read_clockstatus(
 	/*
 	 * Look for variables in the packet.
 	 */
-	rpkt.status = htons(ctlclkstatus(&cs));
+	rpkt->status = htons(ctlclkstatus(&cs));
 	wants_alloc = CC_MAXCODE + 1 + count_var(kv);
 	wants = emalloc_zero(wants_alloc);
 	gotvar = false;
-	while (NULL != (v = ctl_getitem2(clock_var2, &valuep))) {
+	while (NULL != (v = ctl_getitem2(clock_var2, &clock_var_index, &valuep))) {
 		if (!(EOV & v->flags)) {
 			wants[v->code] = true;
 			gotvar = true;
 		} else {
-			v = ctl_getitem2(kv, &valuep);
+			v = ctl_getitem2(kv, NULL, &valuep);
 			if (NULL == v) {
 				ctl_error(CERR_BADVALUE);
 				free(wants);
@@ -3825,7 +5342,7 @@ report_event(
 		else
 #endif /* REFCLOCK */
 		if (AF_UNSPEC == AF(&peer->srcadr))
-		    src = peer->hostname;
+		    src = peer->cold->hostname;
 		else
 		    src = socktoa(&peer->srcadr);
 
@@ -3876,8 +5393,11 @@ mprintf_event(
 void
 ctl_clr_stats(void)
 {
+	ctl_sysvars_changed();
 	ctltimereset = current_time;
 	numctlreq = 0;
+	numctlcost = 0;
+	numctllimited = 0;
 	numctlbadpkts = 0;
 	numctlresponses = 0;
 	numctlfrags = 0;
@@ -3997,6 +5517,18 @@ set_sys_var(
 	)
 {
 	set_var(&ext_sys_var, data, size, def);
+	ctl_sysvars_changed();
+}
+
+
+/*
+ * ctl_sysvars_changed - note that the default system variables may
+ * read differently, so the cached answer must be rebuilt
+ */
+void
+ctl_sysvars_changed(void)
+{
+	sysvar_gen++;
 }
 
 
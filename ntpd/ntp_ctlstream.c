@@ -0,0 +1,344 @@
+/*
+ * ntp_ctlstream.c - mode 6 over a stream socket
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * "controlsocket <target>" listens on a Unix socket (absolute path) or
+ * TCP (address:port) for mode 6 requests.  Each message, either way,
+ * is a mode 6 packet just as it would be in a datagram, MAC and all,
+ * behind its length in two octets, network order, as DNS does over
+ * TCP.  A connection carries any number of requests, one at a time.
+ *
+ * Nothing is lost or reordered on a stream, so a response may run to
+ * CTL_STREAM_FRAGS packets instead of MRU_FRAGS_LIMIT, and a client can
+ * take a whole MRU list in one request.  Packets still carry at most
+ * CTL_MAX_DATA_LEN octets, so the code building responses is the same
+ * either way; the offset field wraps past 64 KB and the client just
+ * appends.
+ *
+ * Requests are served on the main thread, as datagrams are.  A client
+ * that stops reading gets CTLSTREAM_WAIT to drain its socket and is
+ * then dropped, so it can't hold up the loop for longer than that.  A
+ * Unix socket is for its owner and group only; over TCP every request
+ * must carry the control key's MAC.  Both go through the restrictions
+ * for their address, 127.0.0.1 for a Unix socket.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "ntpd.h"
+#include "ntp_io.h"
+#include "ntp_stdlib.h"
+#include "recvbuff.h"
+
+#define CTLSTREAM_BACKLOG	8
+#define CTLSTREAM_MAX		16	/* connections at once */
+#define CTLSTREAM_WAIT		500	/* ms for a client to make room */
+#define CTLSTREAM_SNDBUF	(1024 * 1024)
+#define CTLSTREAM_BATCH		16	/* packets per writev() */
+
+struct ctl_conn {
+	struct ctl_stream	stream;	/* first, for the send callback */
+	struct ctl_conn *	link;
+	SOCKET			fd;
+	sockaddr_u		addr;	/* for restrictions and nonces */
+	bool			dead;	/* write failed, close when done */
+	size_t			have;	/* octets in buf */
+	uint8_t			buf[2 + RX_BUFF_SIZE];
+};
+
+static SOCKET		listen_fd = INVALID_SOCKET;
+static bool		listen_unix;
+static char *		listen_target;
+static struct ctl_conn *conns;
+static unsigned int	nconns;
+
+static void	ctlstream_accept	(SOCKET);
+static void	ctlstream_input		(SOCKET);
+static void	ctlstream_send		(struct ctl_stream *,
+					 const struct iovec *, unsigned int);
+static void	ctlstream_close		(struct ctl_conn *);
+
+
+/*
+ * ctlstream_config - open the listening socket for
+ * "controlsocket <target>".  This runs at config time, with
+ * privileges; the main loop starts watching it in ctlstream_start().
+ */
+void
+ctlstream_config(
+	const char *	target
+	)
+{
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	struct sockaddr_un *	sun;
+	sockaddr_u		netaddr;
+	SOCKET			fd;
+	int			on = 1;
+
+	ZERO(addr);
+	if ('/' == target[0]) {
+		sun = (struct sockaddr_un *)&addr;
+		if (strlen(target) >= sizeof(sun->sun_path)) {
+			msyslog(LOG_ERR, "CONFIG: controlsocket %s: path "
+				"too long", target);
+			return;
+		}
+		sun->sun_family = AF_UNIX;
+		strlcpy(sun->sun_path, target, sizeof(sun->sun_path));
+		addrlen = sizeof(*sun);
+	} else if (0 == decodenetnum(target, &netaddr)) {
+		memcpy(&addr, &netaddr, SOCKLEN(&netaddr));
+		addrlen = SOCKLEN(&netaddr);
+	} else {
+		msyslog(LOG_ERR, "CONFIG: controlsocket %s: not a socket "
+			"path or address:port", target);
+		return;
+	}
+
+	fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		msyslog(LOG_ERR, "CONFIG: controlsocket %s: socket: %s",
+			target, strerror(errno));
+		return;
+	}
+	if (AF_UNIX == addr.ss_family)
+		unlink(target);		/* left over from the last run */
+	else
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0
+	    || listen(fd, CTLSTREAM_BACKLOG) < 0) {
+		msyslog(LOG_ERR, "CONFIG: controlsocket %s: %s", target,
+			strerror(errno));
+		close(fd);
+		return;
+	}
+	/* A client that won't read costs the loop; chgrp to share. */
+	if (AF_UNIX == addr.ss_family)
+		chmod(target, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	make_socket_nonblocking(fd);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (INVALID_SOCKET != listen_fd) {
+		close(listen_fd);
+		free(listen_target);
+	}
+	listen_fd = fd;
+	listen_unix = (AF_UNIX == addr.ss_family);
+	listen_target = estrdup(target);
+	msyslog(LOG_INFO, "CONFIG: mode 6 on %s", target);
+}
+
+
+/*
+ * ctlstream_start - have the main loop take connections.  Called once
+ * the sockets are open, which would forget a reader added before.
+ */
+void
+ctlstream_start(void)
+{
+	if (INVALID_SOCKET != listen_fd)
+		io_add_reader(listen_fd, ctlstream_accept);
+}
+
+
+static void
+ctlstream_accept(
+	SOCKET	lfd
+	)
+{
+	struct sockaddr_storage	from;
+	socklen_t		fromlen = sizeof(from);
+	struct ctl_conn *	c;
+	SOCKET			fd;
+	int			sndbuf = CTLSTREAM_SNDBUF;
+
+	fd = accept(lfd, (struct sockaddr *)&from, &fromlen);
+	if (fd < 0) {
+		if (EAGAIN != errno && EWOULDBLOCK != errno &&
+		    EINTR != errno && ECONNABORTED != errno)
+			msyslog(LOG_ERR, "CTL: %s: accept: %s",
+				listen_target, strerror(errno));
+		return;
+	}
+	if (nconns >= CTLSTREAM_MAX) {
+		close(fd);
+		return;
+	}
+	make_socket_nonblocking(fd);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	c = emalloc_zero(sizeof(*c));
+	c->fd = fd;
+	c->stream.send = ctlstream_send;
+	c->stream.authonly = !listen_unix;
+	if (listen_unix) {
+		SET_AF(&c->addr, AF_INET);
+		SET_ADDR4N(&c->addr, htonl(INADDR_LOOPBACK));
+	} else {
+		memcpy(&c->addr, &from, min(sizeof(c->addr), fromlen));
+	}
+	LINK_SLIST(conns, c, link);
+	nconns++;
+	io_add_reader(fd, ctlstream_input);
+}
+
+
+/*
+ * ctlstream_input - read what has come in on a connection and answer
+ * every whole request in it
+ */
+static void
+ctlstream_input(
+	SOCKET	fd
+	)
+{
+	static struct recvbuf rb;
+	struct ctl_conn *c;
+	unsigned short	restrict_mask;
+	size_t		len;
+	ssize_t		n;
+	int		was;
+
+	for (c = conns; c != NULL; c = c->link)
+		if (c->fd == fd)
+			break;
+	if (NULL == c)
+		return;
+
+	n = read(fd, c->buf + c->have, sizeof(c->buf) - c->have);
+	if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno ||
+		      EINTR == errno))
+		return;
+	if (n <= 0) {
+		ctlstream_close(c);
+		return;
+	}
+	c->have += (size_t)n;
+
+	while (c->have >= 2 && !c->dead) {
+		len = ((size_t)c->buf[0] << 8) | c->buf[1];
+		if (len > RX_BUFF_SIZE) {
+			c->dead = true;		/* not mode 6 */
+			break;
+		}
+		if (c->have < 2 + len)
+			break;
+
+		restrict_mask = restrictions(&c->addr);
+		if ((RES_IGNORE | RES_NOQUERY) & restrict_mask) {
+			c->dead = true;
+			break;
+		}
+		memset(&rb, '\0', offsetof(struct recvbuf, recv_buffer));
+		memcpy(rb.recv_buffer, c->buf + 2, len);
+		rb.recv_length = len;
+		rb.recv_srcadr = c->addr;
+		rb.fd = fd;
+		get_systime(&rb.recv_time);
+
+		was = cpu_switch(CPU_CONTROL);
+		process_control_stream(&rb, restrict_mask, &c->stream);
+		cpu_switch(was);
+
+		c->have -= 2 + len;
+		memmove(c->buf, c->buf + 2 + len, c->have);
+	}
+	if (c->dead)
+		ctlstream_close(c);
+}
+
+
+/*
+ * ctlstream_send - write out the packets of a response, each behind
+ * its length
+ */
+static void
+ctlstream_send(
+	struct ctl_stream *	stream,
+	const struct iovec *	pkts,
+	unsigned int		npkts
+	)
+{
+	struct ctl_conn *c = (struct ctl_conn *)stream;
+	struct iovec	iov[2 * CTLSTREAM_BATCH];
+	uint8_t		lens[CTLSTREAM_BATCH][2];
+	struct iovec *	next;
+	struct pollfd	pfd;
+	unsigned int	batch, niov;
+	ssize_t		n;
+
+	while (npkts > 0 && !c->dead) {
+		batch = min(npkts, CTLSTREAM_BATCH);
+		for (unsigned int i = 0; i < batch; i++) {
+			lens[i][0] = (uint8_t)(pkts[i].iov_len >> 8);
+			lens[i][1] = (uint8_t)pkts[i].iov_len;
+			iov[2 * i].iov_base = lens[i];
+			iov[2 * i].iov_len = 2;
+			iov[2 * i + 1] = pkts[i];
+		}
+		pkts += batch;
+		npkts -= batch;
+
+		next = iov;
+		niov = 2 * batch;
+		while (niov > 0) {
+			n = writev(c->fd, next, (int)niov);
+			if (n < 0) {
+				if (EINTR == errno)
+					continue;
+				if (EAGAIN != errno && EWOULDBLOCK != errno) {
+					c->dead = true;
+					return;
+				}
+				/* full; give the client a moment to read */
+				pfd.fd = c->fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, CTLSTREAM_WAIT) <= 0) {
+					c->dead = true;
+					return;
+				}
+				continue;
+			}
+			while (niov > 0 && (size_t)n >= next->iov_len) {
+				n -= (ssize_t)next->iov_len;
+				next++;
+				niov--;
+			}
+			if (niov > 0) {
+				next->iov_base = (char *)next->iov_base + n;
+				next->iov_len -= (size_t)n;
+			}
+		}
+	}
+}
+
+
+static void
+ctlstream_close(
+	struct ctl_conn *	c
+	)
+{
+	struct ctl_conn *unlinked;
+
+	UNLINK_SLIST(unlinked, conns, c, link, struct ctl_conn);
+	if (NULL == unlinked)
+		return;
+	nconns--;
+	io_close_reader(c->fd);
+	free(c);
+}
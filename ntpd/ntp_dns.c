@@ -24,7 +24,17 @@
 
   This module also handles the start of NTS-KE.
 
-  Only one DNS/NTS lookup active at a time
+  Lookups are queued for a small pool of worker threads, so a long
+  list of server and pool hostnames doesn't resolve one at a time.
+  Workers are started as they are needed, up to DNS_WORKERS, and
+  stay around waiting for more.  Each finished lookup goes on a
+  completion queue and the worker signals SIGDNS; dns_check, on the
+  main thread, hands the answers to dns_take_server/dns_take_pool
+  as they arrive.  Answers still in the cache (ntp_dnscache.c) skip
+  the workers and go straight on the completion queue.
+  For NTS, the worker does only the DNS part, then nts_probe() hands
+  the server to the NTS-KE client thread, which runs many at once.
+  That thread signals SIGDNS too when it has something for dns_check.
 
   peer->srcadr holds IPv4/IPv6/UNSPEC flag
   peer->hmode holds DNS retry time (log 2)
@@ -36,30 +46,64 @@
   Pool case makes new peer slots.
 */
 
-static struct peer* active = NULL;  /* busy flag */
-static pthread_t worker;
-static int gai_rc;
-static struct addrinfo *answer;
-
+#define DNS_WORKERS	8	/* lookups running at once */
+#define DNS_MAXJOBS	64	/* queued, running or done, before we push back */
+
+struct dns_job {
+	struct dns_job *link;
+	struct peer *peer;		/* NULL once cancelled */
+	char hostname[256];		/* copy, the peer's may go away */
+	int family;
+	bool nts;
+	int gai_rc;
+	struct addrinfo *answer;
+	bool nts_queued;		/* nts_probe handed it on */
+};
+
+/* All three lists, and the worker counts, are under dns_mutex. */
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_wake = PTHREAD_COND_INITIALIZER;
+static struct dns_job *dns_queue;	/* waiting for a worker */
+static struct dns_job *dns_running;	/* being looked up */
+static struct dns_job *dns_done;	/* waiting for dns_check */
+static int dns_workers;			/* started */
+static int dns_idle;			/* waiting on dns_wake */
+static int dns_jobs;			/* on any list; main thread only */
+
+static bool dns_pending(struct peer *pp);
+static void dns_hints(struct addrinfo *hints, int family);
+static bool dns_start_worker(void);
+static void dns_finish(struct dns_job *job);
 static void* dns_lookup(void* arg);
 
 /* Initially, this was only used for DNS where pp=>hostname was valid.
  * With NTS, it also gets used for numerical IP Addresses.
+ * Returns false if the queue is full, to be called again later.
  */
 bool dns_probe(struct peer* pp)
 {
-	int rc;
-        sigset_t        block_mask, saved_sig_mask;
 	const char	* busy = "";
-	const char	*hostname = pp->hostname;
+	const char	*hostname = pp->cold->hostname;
+	struct dns_job	*job, *unlinked;
+	struct addrinfo	hints;
+	bool		started = true;
+
+#ifndef DISABLE_NTS
+	/* NTS-KE already under way, nothing to retry */
+	if ((pp->cfg.flags & FLAG_NTS) && nts_probe_pending(pp))
+		return true;
+	/* Saved cookies from before a restart, no NTS-KE needed */
+	if ((pp->cfg.flags & FLAG_NTS) && nts_client_restore(pp))
+		return true;
+#endif
 
 	/* Comment out the next two lines to get (much) more
 	 * printout when we are busy.
 	 */
-        if (NULL != active)
+        if (DNS_MAXJOBS <= dns_jobs)
 		return false;
 
-	if (NULL != active) {
+	if (DNS_MAXJOBS <= dns_jobs) {
 		busy = ", busy";
 	}
 	if (NULL == hostname) {
@@ -68,59 +112,153 @@ bool dns_probe(struct peer* pp)
 
 	msyslog(LOG_INFO, "DNS: dns_probe: %s, cast_flags:%x, flags:%x%s",
 		hostname, pp->cast_flags, pp->cfg.flags, busy);
-        if (NULL != active)	/* normally redundant */
+        if (DNS_MAXJOBS <= dns_jobs)	/* normally redundant */
 		return false;
 
-	active = pp;
-
-        sigfillset(&block_mask);
-        pthread_sigmask(SIG_BLOCK, &block_mask, &saved_sig_mask);
-	rc = pthread_create(&worker, NULL, dns_lookup, pp);
-        if (rc) {
-	  msyslog(LOG_ERR, "DNS: dns_probe: error from pthread_create: %s, %s",
-	      hostname, strerror(rc));
-          pthread_sigmask(SIG_SETMASK, &saved_sig_mask, NULL);
-	  return true;  /* don't try again */
+	pthread_mutex_lock(&dns_mutex);
+	if (dns_pending(pp)) {
+		pthread_mutex_unlock(&dns_mutex);
+		return true;	/* one is enough */
+	}
+	job = emalloc_zero(sizeof(*job));
+	job->peer = pp;
+	strlcpy(job->hostname, hostname, sizeof(job->hostname));
+	job->family = AF(&pp->srcadr);
+	job->nts = (pp->cfg.flags & FLAG_NTS);
+	dns_jobs++;
+	dns_hints(&hints, job->family);
+	if (!job->nts &&
+	    dns_cache_get(job->hostname, NTP_PORTA, &hints, &job->answer)) {
+		LINK_TAIL_SLIST(dns_done, job, link, struct dns_job);
+		pthread_mutex_unlock(&dns_mutex);
+		kill(getpid(), SIGDNS);
+		return true;
 	}
-        pthread_sigmask(SIG_SETMASK, &saved_sig_mask, NULL);
+	LINK_TAIL_SLIST(dns_queue, job, link, struct dns_job);
+	if (0 == dns_idle && DNS_WORKERS > dns_workers)
+		started = dns_start_worker();
+	if (!started && 0 == dns_workers) {
+		/* Nobody to do it, so take it back */
+		UNLINK_SLIST(unlinked, dns_queue, job, link, struct dns_job);
+		dns_jobs--;
+		pthread_mutex_unlock(&dns_mutex);
+		free(job);
+		return true;  /* don't try again */
+	}
+	pthread_cond_signal(&dns_wake);
+	pthread_mutex_unlock(&dns_mutex);
 
 	return true;
 }
 
+/* Caller holds dns_mutex */
+static bool dns_pending(struct peer *pp)
+{
+	struct dns_job *job;
+
+	for (job = dns_queue; NULL != job; job = job->link)
+		if (pp == job->peer)
+			return true;
+	for (job = dns_running; NULL != job; job = job->link)
+		if (pp == job->peer)
+			return true;
+	for (job = dns_done; NULL != job; job = job->link)
+		if (pp == job->peer)
+			return true;
+	return false;
+}
+
+static void dns_hints(struct addrinfo *hints, int family)
+{
+	ZERO(*hints);
+	hints->ai_protocol = IPPROTO_UDP;
+	hints->ai_socktype = SOCK_DGRAM;
+	hints->ai_family = family;
+}
+
+/* Caller holds dns_mutex.  The new thread doesn't need it until
+ * we let go.
+ */
+static bool dns_start_worker(void)
+{
+	pthread_t worker;
+
+	if (ntp_thread_create(&worker, dns_lookup, NULL, "DNS: dns_probe"))
+		return false;
+	pthread_detach(worker);
+	dns_workers++;
+	return true;
+}
+
+/* The peer is going away: drop any lookup for it.  One already
+ * running finishes, but nobody hears about it.
+ */
+void dns_forget(struct peer *pp)
+{
+	struct dns_job *job;
+
+	pthread_mutex_lock(&dns_mutex);
+	for (job = dns_queue; NULL != job; job = job->link)
+		if (pp == job->peer)
+			job->peer = NULL;
+	for (job = dns_running; NULL != job; job = job->link)
+		if (pp == job->peer)
+			job->peer = NULL;
+	for (job = dns_done; NULL != job; job = job->link)
+		if (pp == job->peer)
+			job->peer = NULL;
+	pthread_mutex_unlock(&dns_mutex);
+}
+
 void dns_check(void)
 {
-	int rc;
+	struct dns_job *done, *job;
+
+#ifndef DISABLE_NTS
+	nts_check_done();
+#endif
+
+	pthread_mutex_lock(&dns_mutex);
+	done = dns_done;
+	dns_done = NULL;
+	pthread_mutex_unlock(&dns_mutex);
+
+	while (NULL != done) {
+		job = done;
+		done = job->link;
+		if (NULL != job->peer)
+			dns_finish(job);
+		if (NULL != job->answer) {
+			dns_cache_free(job->answer);
+		}
+		free(job);
+		dns_jobs--;
+	}
+}
+
+static void dns_finish(struct dns_job *job)
+{
+	struct peer *pp = job->peer;
 	struct addrinfo *ai;
-	const char      *hostname = active->hostname;
 	DNS_Status status;
 
-	if (NULL == hostname) {
-		hostname = socktoa(&active->srcadr);
-	}
 	msyslog(LOG_INFO, "DNS: dns_check: processing %s, %x, %x",
-		hostname, active->cast_flags, (unsigned int)active->cfg.flags);
-
-	rc = pthread_join(worker, NULL);
-	if (0 != rc) {
-		msyslog(LOG_ERR, "DNS: dns_check: join failed %s", strerror(rc));
-		return;  /* leaves active set */
-	}
+		job->hostname, pp->cast_flags, (unsigned int)pp->cfg.flags);
 
 #ifndef DISABLE_NTS
-	if (active->cfg.flags & FLAG_NTS) {
-		nts_check(active);
-		active = NULL;
+	if (job->nts) {
+		nts_check(pp, job->nts_queued);
 		return;
 	}
 #endif
 
-	if (0 != gai_rc) {
+	if (0 != job->gai_rc) {
 		msyslog(LOG_INFO, "DNS: dns_check: DNS error: %d, %s",
-			gai_rc, gai_strerror(gai_rc));
-		answer = NULL;
+			job->gai_rc, gai_strerror(job->gai_rc));
+		job->answer = NULL;
 	}
 
-	for (ai = answer; NULL != ai; ai = ai->ai_next) {
+	for (ai = job->answer; NULL != ai; ai = ai->ai_next) {
 		sockaddr_u sockaddr;
 		if (sizeof(sockaddr_u) < ai->ai_addrlen)
 			continue;  /* Weird */
@@ -128,15 +266,16 @@ void dns_check(void)
 		/* Both dns_take_pool and dns_take_server log something. */
 		// msyslog(LOG_INFO, "DNS: Take %s=>%s",
 		//		socktoa(ai->ai_addr), socktoa(&sockaddr));
-		if (active->cast_flags & MDF_POOL)
-			dns_take_pool(active, &sockaddr);
+		if (pp->cast_flags & MDF_POOL)
+			dns_take_pool(pp, &sockaddr);
 		else
-			dns_take_server(active, &sockaddr);
+			dns_take_server(pp, &sockaddr);
 	}
 
-	switch (gai_rc) {
+	switch (job->gai_rc) {
 		case 0:
 			status = DNS_good;
+			startup_mark(START_DNS);
 			break;
 
 		case EAI_AGAIN:
@@ -150,55 +289,77 @@ void dns_check(void)
 			status = DNS_error;
 	}
 
-	dns_take_status(active, status);
-
-	if (NULL != answer) {
-		freeaddrinfo(answer);
-	}
-	active = NULL;
+	dns_take_status(pp, status);
 }
 
 /* Beware: no calls to msyslog from here.
  * It's not thread safe.
- * This is the only other thread in ntpd.
+ * Nor may job->peer be looked at, except by nts_probe,
+ * since the main thread can cancel the job at any time.
  */
 static void* dns_lookup(void* arg)
 {
-	struct peer *pp = (struct peer *) arg;
+	struct dns_job *job, *unlinked;
+#ifndef DISABLE_NTS
+	struct peer *pp;
+#endif
 	struct addrinfo hints;
 
+	UNUSED_ARG(arg);
 #ifdef HAVE_SECCOMP_H
         setup_SIGSYS_trap();      /* enable trap for this thread */
 #endif
+	thread_place(THREAD_DNS, -1);
+
+	for (;;) {
+		pthread_mutex_lock(&dns_mutex);
+		while (NULL == dns_queue) {
+			dns_idle++;
+			pthread_cond_wait(&dns_wake, &dns_mutex);
+			dns_idle--;
+		}
+		UNLINK_HEAD_SLIST(job, dns_queue, link);
+		if (NULL == job->peer) {
+			/* cancelled while queued, dns_check frees it */
+			LINK_SLIST(dns_done, job, link);
+			pthread_mutex_unlock(&dns_mutex);
+			continue;
+		}
+		LINK_SLIST(dns_running, job, link);
+#ifndef DISABLE_NTS
+		pp = job->peer;
+#endif
+		pthread_mutex_unlock(&dns_mutex);
 
 #ifdef HAVE_RES_INIT
-	/* Reload DNS servers from /etc/resolv.conf in case DHCP has updated it.
-	 * We only need to do this occasionally, but it's not expensive
-	 * and simpler to do it every time than it is to figure out when
-	 * to do it.
-	 * This res_init() covers NTS too.
-	 */
-	res_init();
+		/* Reload DNS servers from /etc/resolv.conf in case DHCP
+		 * has updated it.  We only need to do this occasionally,
+		 * but it's not expensive and simpler to do it every time
+		 * than it is to figure out when to do it.
+		 * This res_init() covers NTS too.
+		 */
+		res_init();
 #endif
 
-	if (pp->cfg.flags & FLAG_NTS) {
+		if (job->nts) {
 #ifndef DISABLE_NTS
-		nts_probe(pp);
+			job->nts_queued = nts_probe(pp);
 #endif
-	} else {
-		ZERO(hints);
-		hints.ai_protocol = IPPROTO_UDP;
-		hints.ai_socktype = SOCK_DGRAM;
-		hints.ai_family = AF(&pp->srcadr);
-		gai_rc = getaddrinfo(pp->hostname, NTP_PORTA, &hints, &answer);
+		} else {
+			dns_hints(&hints, job->family);
+			job->gai_rc = dns_cache_getaddrinfo(job->hostname,
+					NTP_PORTA, &hints, &job->answer);
+		}
+
+		pthread_mutex_lock(&dns_mutex);
+		UNLINK_SLIST(unlinked, dns_running, job, link, struct dns_job);
+		LINK_TAIL_SLIST(dns_done, job, link, struct dns_job);
+		pthread_mutex_unlock(&dns_mutex);
+		kill(getpid(), SIGDNS);
 	}
 
-	kill(getpid(), SIGDNS);
-	pthread_exit(NULL);
-
 	/* Prevent compiler warning.
 	 * More portable than an attribute or directive
 	 */
 	return (void *)NULL;
 }
-
@@ -0,0 +1,300 @@
+/*
+ * ntp_dnscache.c - getaddrinfo() with a cache in front of it
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Pool refills, dns_try_again() and NTS-KE look up the same few names
+ * over and over.  Answers are kept for as long as the DNS says they
+ * may be, so repeats come from here rather than the resolver, and
+ * dns_probe() can hand them over without waking a worker thread.
+ *
+ * getaddrinfo() doesn't tell us the TTL, so after a miss we ask for
+ * the record with res_query() and take the smallest TTL in the
+ * answer.  Names the DNS doesn't know, from /etc/hosts say, are kept
+ * for DNS_CACHE_TTL.  Failures, and answers with a TTL of 0, are not
+ * kept.
+ *
+ * Callers get their own copy of the answer, to be freed with
+ * dns_cache_free(), so an entry can be replaced under them.  Any
+ * thread may call in.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_RES_INIT
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#endif
+
+#include "ntpd.h"
+#include "ntp_dns.h"
+
+#define DNS_CACHE_SIZE	64	/* entries */
+#define DNS_CACHE_TTL	60	/* sec, when the DNS doesn't say */
+#define DNS_CACHE_MAXTTL 3600	/* sec, however long the DNS says */
+
+struct dns_cache_entry {
+	struct dns_cache_entry *link;
+	char node[256];
+	char service[32];
+	int family, socktype, protocol, flags;
+	time_t expires;			/* CLOCK_MONOTONIC */
+	struct addrinfo *answer;	/* our copy */
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dns_cache_entry *cache;
+static int cache_count;
+
+/* Not static, for the tests */
+void dns_cache_put(const char *node, const char *service,
+	const struct addrinfo *hints, const struct addrinfo *answer, int ttl);
+int dns_cache_answer_ttl(const unsigned char *msg, int len);
+
+static struct addrinfo *copy_answer(const struct addrinfo *answer);
+static bool entry_matches(const struct dns_cache_entry *entry,
+	const char *node, const char *service, const struct addrinfo *hints);
+static void entry_free(struct dns_cache_entry *entry);
+static int lookup_ttl(const char *node, int family);
+static time_t now_sec(void);
+
+
+/* Like getaddrinfo(), but the answer may come from the cache and
+ * must be freed with dns_cache_free().  hints is required.
+ */
+int dns_cache_getaddrinfo(const char *node, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res) {
+	struct addrinfo *answer;
+	int rc, ttl;
+
+	if (dns_cache_get(node, service, hints, res))
+		return 0;
+	rc = getaddrinfo(node, service, hints, &answer);
+	if (0 != rc)
+		return rc;
+	ttl = lookup_ttl(node, hints->ai_family);
+	if (0 > ttl)
+		ttl = DNS_CACHE_TTL;
+	else if (DNS_CACHE_MAXTTL < ttl)
+		ttl = DNS_CACHE_MAXTTL;
+	dns_cache_put(node, service, hints, answer, ttl);
+	*res = copy_answer(answer);
+	freeaddrinfo(answer);
+	return 0;
+}
+
+/* A copy of the cached answer, if there is one still good.
+ * Never asks the resolver, so the main thread can use it.
+ */
+bool dns_cache_get(const char *node, const char *service,
+	const struct addrinfo *hints, struct addrinfo **res) {
+	struct dns_cache_entry *entry, **prev;
+	time_t now = now_sec();
+	bool found = false;
+
+	pthread_mutex_lock(&cache_mutex);
+	prev = &cache;
+	while (NULL != (entry = *prev)) {
+		if (entry->expires <= now) {
+			*prev = entry->link;
+			cache_count--;
+			entry_free(entry);
+			continue;
+		}
+		if (entry_matches(entry, node, service, hints)) {
+			*res = copy_answer(entry->answer);
+			found = true;
+			break;
+		}
+		prev = &entry->link;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return found;
+}
+
+void dns_cache_put(const char *node, const char *service,
+	const struct addrinfo *hints, const struct addrinfo *answer, int ttl) {
+	struct dns_cache_entry *entry, **prev, **oldest = NULL;
+
+	if (0 >= ttl || NULL == answer)
+		return;
+	if (strlen(node) >= sizeof(entry->node) ||
+	    strlen(service) >= sizeof(entry->service))
+		return;
+
+	pthread_mutex_lock(&cache_mutex);
+	/* Drop any entry for the same question, and if we are full,
+	 * the one that would expire first. */
+	for (prev = &cache; NULL != (entry = *prev); ) {
+		if (entry_matches(entry, node, service, hints)) {
+			*prev = entry->link;
+			cache_count--;
+			entry_free(entry);
+			continue;
+		}
+		if (NULL == oldest || entry->expires < (*oldest)->expires)
+			oldest = prev;
+		prev = &entry->link;
+	}
+	if (DNS_CACHE_SIZE <= cache_count && NULL != oldest) {
+		entry = *oldest;
+		*oldest = entry->link;
+		cache_count--;
+		entry_free(entry);
+	}
+
+	entry = emalloc_zero(sizeof(*entry));
+	strlcpy(entry->node, node, sizeof(entry->node));
+	strlcpy(entry->service, service, sizeof(entry->service));
+	entry->family = hints->ai_family;
+	entry->socktype = hints->ai_socktype;
+	entry->protocol = hints->ai_protocol;
+	entry->flags = hints->ai_flags;
+	entry->expires = now_sec() + ttl;
+	entry->answer = copy_answer(answer);
+	entry->link = cache;
+	cache = entry;
+	cache_count++;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/* Forget everything, when the network or resolv.conf may have changed. */
+void dns_cache_flush(void) {
+	struct dns_cache_entry *entry;
+
+	pthread_mutex_lock(&cache_mutex);
+	while (NULL != (entry = cache)) {
+		cache = entry->link;
+		entry_free(entry);
+	}
+	cache_count = 0;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void dns_cache_free(struct addrinfo *ai) {
+	struct addrinfo *next;
+
+	for (; NULL != ai; ai = next) {
+		next = ai->ai_next;
+		free(ai);
+	}
+}
+
+/* One allocation per address, sockaddr tacked on the end.
+ * Canonical names are not kept; nobody here asks for them.
+ */
+static struct addrinfo *copy_answer(const struct addrinfo *answer) {
+	struct addrinfo *head = NULL, **tail = &head, *ai;
+
+	for (; NULL != answer; answer = answer->ai_next) {
+		ai = emalloc_zero(sizeof(*ai) + answer->ai_addrlen);
+		ai->ai_flags = answer->ai_flags;
+		ai->ai_family = answer->ai_family;
+		ai->ai_socktype = answer->ai_socktype;
+		ai->ai_protocol = answer->ai_protocol;
+		ai->ai_addrlen = answer->ai_addrlen;
+		ai->ai_addr = (struct sockaddr *)(ai + 1);
+		memcpy(ai->ai_addr, answer->ai_addr, answer->ai_addrlen);
+		*tail = ai;
+		tail = &ai->ai_next;
+	}
+	return head;
+}
+
+static bool entry_matches(const struct dns_cache_entry *entry,
+	const char *node, const char *service, const struct addrinfo *hints) {
+	return entry->family == hints->ai_family &&
+	    entry->socktype == hints->ai_socktype &&
+	    entry->protocol == hints->ai_protocol &&
+	    entry->flags == hints->ai_flags &&
+	    0 == strcmp(entry->service, service) &&
+	    0 == strcasecmp(entry->node, node);
+}
+
+static void entry_free(struct dns_cache_entry *entry) {
+	dns_cache_free(entry->answer);
+	free(entry);
+}
+
+/* The TTL of the A or AAAA records for node, -1 if the DNS won't say. */
+static int lookup_ttl(const char *node, int family) {
+#ifdef HAVE_RES_INIT
+	unsigned char msg[NS_PACKETSZ];
+	struct in6_addr addr;
+	int len = -1;
+
+	/* Numbers aren't in the DNS */
+	if (1 == inet_pton(AF_INET, node, &addr) ||
+	    1 == inet_pton(AF_INET6, node, &addr))
+		return -1;
+	if (AF_INET6 != family)
+		len = res_query(node, ns_c_in, ns_t_a, msg, sizeof(msg));
+	if (0 > len && AF_INET != family)
+		len = res_query(node, ns_c_in, ns_t_aaaa, msg, sizeof(msg));
+	if (0 > len)
+		return -1;
+	return dns_cache_answer_ttl(msg, len);
+#else
+	UNUSED_ARG(node);
+	UNUSED_ARG(family);
+	return -1;
+#endif
+}
+
+/* The smallest TTL of the records in the answer section of a DNS
+ * reply, CNAMEs included.  -1 if there are none or it doesn't parse.
+ */
+int dns_cache_answer_ttl(const unsigned char *msg, int len) {
+#ifdef HAVE_RES_INIT
+	const unsigned char *cp = msg + NS_HFIXEDSZ, *end = msg + len;
+	int qdcount, ancount, n, rdlength;
+	long ttl = -1, rrttl;
+
+	if (NS_HFIXEDSZ > len)
+		return -1;
+	qdcount = msg[4] << 8 | msg[5];
+	ancount = msg[6] << 8 | msg[7];
+	while (0 < qdcount--) {
+		n = dn_skipname(cp, end);
+		if (0 > n || end - cp < n + NS_QFIXEDSZ)
+			return -1;
+		cp += n + NS_QFIXEDSZ;
+	}
+	while (0 < ancount--) {
+		n = dn_skipname(cp, end);
+		if (0 > n || end - cp < n + NS_RRFIXEDSZ)
+			return -1;
+		cp += n;
+		/* type, class, ttl, rdlength */
+		rrttl = (long)((uint32_t)cp[4] << 24 | (uint32_t)cp[5] << 16 |
+			       (uint32_t)cp[6] << 8 | cp[7]);
+		rdlength = cp[8] << 8 | cp[9];
+		cp += NS_RRFIXEDSZ;
+		if (end - cp < rdlength)
+			return -1;
+		cp += rdlength;
+		if (INT32_MAX < rrttl)
+			rrttl = 0;	/* RFC 2181 8. */
+		if (0 > ttl || rrttl < ttl)
+			ttl = rrttl;
+	}
+	return (int)ttl;
+#else
+	UNUSED_ARG(msg);
+	UNUSED_ARG(len);
+	return -1;
+#endif
+}
+
+static time_t now_sec(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
@@ -11,10 +11,20 @@
 
 #include "config.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <string.h>
+#include <unistd.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
 
 #include "ntpd.h"
 #include "ntp_io.h"
@@ -22,6 +32,10 @@
 #include "ntp_filegen.h"
 #include "ntp_stdlib.h"
 
+#ifdef HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+
 /*
  * NTP is intended to run long periods of time without restart.
  * Thus log and statistic files generated by NTP will grow large.
@@ -39,7 +53,42 @@
  */
 #define SUFFIX_SEP '.'
 
+#define FILEGEN_MAGIC		"NTPSTATB"
+#define FILEGEN_HDRMAX		1024
+
+/*
+ * A file set can send its records to a collector instead of writing
+ * files: one datagram per record, to a Unix datagram socket or over
+ * UDP.  Sends never block; whatever the collector can't take is
+ * dropped.
+ */
+struct filegen_stream {
+	int			fd;
+	struct sockaddr_storage	dest;
+	socklen_t		destlen;
+	char *			target;	/* as configured, for logging */
+	uptime_t		header;	/* last binary header sent */
+};
+#define STREAM_REPORT		3600	/* seconds between drop reports */
+static unsigned long	stream_dropped;
+
+int	filegen_window = 0;	/* seconds records may wait, 0 = none */
+
+/*
+ * filegen registry
+ */
+static struct filegen_entry {
+	char *			name;
+	FILEGEN *		filegen;
+	struct filegen_entry *	next;
+} *filegen_registry = NULL;
+
 static	void	filegen_open	(FILEGEN *, const time_t);
+static	void	filegen_close	(FILEGEN *);
+static	void	filegen_compress(const char *);
+static	void	filegen_header	(FILEGEN *);
+static	void	filegen_lock	(void);
+static	void	filegen_unlock	(void);
 static	int	valid_fileref	(const char *, const char *)
 			         __attribute__((pure));
 static	void	filegen_init	(const char *, const char *, FILEGEN *);
@@ -60,8 +109,14 @@ filegen_init(
 	)
 {
 	fgp->fp = NULL;
+	fgp->stream = NULL;
+	fgp->buf = NULL;
+	fgp->pending = false;
+	fgp->fields = NULL;
+	fgp->reclen = 0;
 	fgp->dir = estrdup(dir);
 	fgp->fname = estrdup(fname);
+	fgp->name = NULL;
 	fgp->id_lo = 0;
 	fgp->id_hi = 0;
 	fgp->type = FILEGEN_DAY;
@@ -78,8 +133,18 @@ filegen_uninit(
 	FILEGEN *fgp
 	)
 {
+	filegen_lock();
+	filegen_close(fgp);
+	filegen_unlock();
+	if (NULL != fgp->stream) {
+		close(fgp->stream->fd);
+		free(fgp->stream->target);
+		free(fgp->stream);
+		fgp->stream = NULL;
+	}
 	free(fgp->dir);
 	free(fgp->fname);
+	free(fgp->name);
 }
 #endif
 
@@ -99,6 +164,7 @@ filegen_open(
 	char *fullname;	/* name with any designation extension */
 	char *filename;	/* name without designation extension */
 	char *suffix;	/* where to print suffix extension */
+	char *buf = NULL;
 	unsigned int len, suflen;
 	FILE *fp;
 	struct tm tm;
@@ -108,7 +174,9 @@ filegen_open(
 	filename = emalloc(len);
 	fullname = emalloc(len);
 	savename = NULL;
-	snprintf(filename, len, "%s%s", gen->dir, gen->fname);
+	/* binary files get their own names, never mixed with text */
+	snprintf(filename, len, "%s%s%s", gen->dir, gen->fname,
+		 (gen->flag & FGEN_FLAG_BINARY) ? FILEGEN_BINSUFFIX : "");
 
 	/* where to place suffix */
 	suflen = strlcpy(fullname, filename, len);
@@ -283,11 +351,25 @@ filegen_open(
 		if (ENOENT != errno)
 			msyslog(LOG_ERR, "LOG: can't open %s: %s", fullname, strerror(errno));
 	} else {
-		if (NULL != gen->fp) {
-			fclose(gen->fp);
-			gen->fp = NULL;
+		if (filegen_window > 0) {
+			/* the old generation may still be using its buffer */
+			buf = emalloc(FILEGEN_BUFSIZE);
+			setvbuf(fp, buf, _IOFBF, FILEGEN_BUFSIZE);
+		}
+		/* a generation that is over can be compressed now */
+		if ((gen->flag & FGEN_FLAG_COMPRESS) && NULL != gen->fp
+		    && NULL != gen->name && strcmp(gen->name, fullname) != 0) {
+			filegen_close(gen);
+			filegen_compress(gen->name);
+		} else {
+			filegen_close(gen);
 		}
+		free(gen->name);
+		gen->name = estrdup(fullname);
 		gen->fp = fp;
+		gen->buf = buf;
+		if (gen->flag & FGEN_FLAG_BINARY)
+			filegen_header(gen);
 
 		if (gen->flag & FGEN_FLAG_LINK) {
 			/*
@@ -313,6 +395,738 @@ filegen_open(
 	return;
 }
 
+/*
+ * filegen_header - start a new binary file with a description of
+ * its records, so readers don't need to know the layout ahead:
+ *
+ *   "NTPSTATB", uint16 header length, uint16 record length,
+ *   field list, NUL padded to a multiple of 8
+ *
+ * The field list is space separated name:type pairs, in record order.
+ * Everything in the file is little-endian.
+ */
+static size_t
+filegen_make_header(
+	const FILEGEN *	gen,
+	uint8_t *	hdr		/* FILEGEN_HDRMAX bytes */
+	)
+{
+	size_t		flen = strlen(gen->fields) + 1;
+	size_t		hlen = (12 + flen + 7) & ~(size_t)7;
+
+	if (hlen > FILEGEN_HDRMAX)
+		return 0;
+	memset(hdr, '\0', hlen);
+	memcpy(hdr, FILEGEN_MAGIC, 8);
+	hdr[8] = (uint8_t)hlen;
+	hdr[9] = (uint8_t)(hlen >> 8);
+	hdr[10] = (uint8_t)gen->reclen;
+	hdr[11] = (uint8_t)(gen->reclen >> 8);
+	memcpy(hdr + 12, gen->fields, flen);
+	return hlen;
+}
+
+static void
+filegen_header(
+	FILEGEN *	gen
+	)
+{
+	struct stat	sb;
+	uint8_t		hdr[FILEGEN_HDRMAX];
+	size_t		hlen;
+
+	if (0 != fstat(fileno(gen->fp), &sb) || 0 != sb.st_size)
+		return;		/* reopened, header is there */
+	hlen = filegen_make_header(gen, hdr);
+	if (0 != hlen)
+		fwrite(hdr, 1, hlen, gen->fp);
+}
+
+
+/*
+ * filegen_binary - give gen a binary record format.  fields is the
+ * layout written into the header of each file, and must stay valid.
+ */
+void
+filegen_binary(
+	FILEGEN *	gen,
+	const char *	fields,
+	size_t		reclen
+	)
+{
+	gen->fields = fields;
+	gen->reclen = (uint16_t)reclen;
+}
+
+
+/*
+ * filegen_stream - send gen's records to target instead of files.
+ * target is the path of a Unix datagram socket, or address:port of
+ * a UDP collector.  Returns false, after logging why, if it can't be
+ * used.
+ */
+bool
+filegen_stream(
+	FILEGEN *	gen,
+	const char *	target
+	)
+{
+	struct filegen_stream *	st;
+	sockaddr_u		addr;
+	struct sockaddr_un *	sun;
+	int			fd;
+
+	st = emalloc_zero(sizeof(*st));
+	if ('/' == target[0]) {
+		sun = (struct sockaddr_un *)&st->dest;
+		if (strlen(target) >= sizeof(sun->sun_path)) {
+			msyslog(LOG_ERR, "LOG: stream %s: path too long",
+				target);
+			free(st);
+			return false;
+		}
+		sun->sun_family = AF_UNIX;
+		strlcpy(sun->sun_path, target, sizeof(sun->sun_path));
+		st->destlen = sizeof(*sun);
+	} else if (0 == decodenetnum(target, &addr)) {
+		memcpy(&st->dest, &addr, SOCKLEN(&addr));
+		st->destlen = SOCKLEN(&addr);
+	} else {
+		msyslog(LOG_ERR, "LOG: stream %s: not a socket path "
+			"or address:port", target);
+		free(st);
+		return false;
+	}
+	fd = socket(st->dest.ss_family, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		msyslog(LOG_ERR, "LOG: stream %s: socket: %s", target,
+			strerror(errno));
+		free(st);
+		return false;
+	}
+	make_socket_nonblocking(fd);
+	st->fd = fd;
+	st->target = estrdup(target);
+	/* first binary record goes out with a header */
+	st->header = current_time - FILEGEN_STREAM_HEADER;
+
+	filegen_lock();
+	filegen_close(gen);
+	if (NULL != gen->stream) {
+		close(gen->stream->fd);
+		free(gen->stream->target);
+		free(gen->stream);
+	}
+	gen->stream = st;
+	filegen_unlock();
+	return true;
+}
+
+
+/*
+ * stream_send - one datagram to gen's collector, or count it dropped
+ */
+static void
+stream_send(
+	struct filegen_stream *	st,
+	const void *		data,
+	size_t			len
+	)
+{
+	if (sendto(st->fd, data, len, MSG_DONTWAIT,
+		   (struct sockaddr *)&st->dest, st->destlen) < 0)
+		stream_dropped++;
+}
+
+
+/*
+ * stream_header - send the binary layout, when it's time to remind
+ * collectors that started late
+ */
+static void
+stream_header(
+	FILEGEN *	gen
+	)
+{
+	uint8_t	hdr[FILEGEN_HDRMAX];
+	size_t	hlen;
+
+	if (!(gen->flag & FGEN_FLAG_BINARY)
+	    || current_time - gen->stream->header < FILEGEN_STREAM_HEADER)
+		return;
+	gen->stream->header = current_time;
+	hlen = filegen_make_header(gen, hdr);
+	if (0 != hlen)
+		stream_send(gen->stream, hdr, hlen);
+}
+
+
+/*
+ * filegen_close - close the current generation, if any
+ */
+static void
+filegen_close(
+	FILEGEN *	gen
+	)
+{
+	if (NULL != gen->fp) {
+		fclose(gen->fp);
+		gen->fp = NULL;
+	}
+	free(gen->buf);
+	gen->buf = NULL;
+	gen->pending = false;
+}
+
+
+#ifdef HAVE_ZLIB_H
+/*
+ * compress_worker - gzip one finished generation to name.gz and
+ * remove the original.  The data goes to a temporary file first so
+ * readers never see half of it.  A name.gz already there (the clock
+ * went back, say) is kept as the first member of the new one.
+ */
+static void *
+compress_worker(
+	void *	arg
+	)
+{
+	char *		name = arg;
+	size_t		len = strlen(name) + sizeof(FILEGEN_GZSUFFIX ".tmp");
+	char *		gzname = emalloc(len);
+	char *		tmpname = emalloc(len);
+	char		buf[BUFSIZ];
+	struct stat	stats;
+	struct timespec	times[2];
+	FILE *		in;
+	gzFile		gz = NULL;
+	size_t		got;
+	ssize_t		n;
+	int		fd, old;
+	bool		ok = false;
+
+	thread_place(THREAD_OTHER, -1);
+	snprintf(gzname, len, "%s%s", name, FILEGEN_GZSUFFIX);
+	snprintf(tmpname, len, "%s.tmp", gzname);
+	in = fopen(name, "r");
+	if (NULL == in || 0 != fstat(fileno(in), &stats)) {
+		msyslog(LOG_ERR, "LOG: can't compress %s: %s", name,
+			strerror(errno));
+		goto done;
+	}
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (-1 == fd) {
+		msyslog(LOG_ERR, "LOG: can't open %s: %s", tmpname,
+			strerror(errno));
+		goto done;
+	}
+	old = open(gzname, O_RDONLY);
+	if (-1 != old) {
+		while ((n = read(old, buf, sizeof(buf))) > 0)
+			if (write(fd, buf, (size_t)n) != n)
+				break;
+		close(old);
+	}
+	gz = gzdopen(fd, "wb");
+	if (NULL == gz) {
+		close(fd);
+		msyslog(LOG_ERR, "LOG: can't compress %s", name);
+		goto done;
+	}
+	ok = true;
+	while (ok && (got = fread(buf, 1, sizeof(buf), in)) > 0)
+		ok = gzwrite(gz, buf, (unsigned)got) == (int)got;
+	ok = ok && !ferror(in);
+	ok = (Z_OK == gzclose(gz)) && ok;
+	if (ok && 0 != rename(tmpname, gzname))
+		ok = false;
+	if (!ok) {
+		msyslog(LOG_ERR, "LOG: can't compress %s, left as is", name);
+		unlink(tmpname);
+		goto done;
+	}
+	/* ntpviz places files it can't date by their mtime */
+	times[0] = stats.st_atim;
+	times[1] = stats.st_mtim;
+	utimensat(AT_FDCWD, gzname, times, 0);
+	if (0 != unlink(name))
+		msyslog(LOG_ERR, "LOG: can't unlink %s: %s", name,
+			strerror(errno));
+	DPRINT(2, ("filegen: compressed %s\n", name));
+    done:
+	if (NULL != in)
+		fclose(in);
+	free(tmpname);
+	free(gzname);
+	free(name);
+	return NULL;
+}
+#endif	/* HAVE_ZLIB_H */
+
+
+/*
+ * filegen_compress - gzip a closed generation in the background, so
+ * neither the writer nor the main loop waits on it
+ */
+static void
+filegen_compress(
+	const char *	name
+	)
+{
+#ifdef HAVE_ZLIB_H
+	pthread_t	tid;
+	char *		arg = estrdup(name);
+	char		tag[PATH_MAX + 32];
+
+	snprintf(tag, sizeof(tag), "LOG: can't compress %s", name);
+	if (ntp_thread_create(&tid, compress_worker, arg, tag))
+		free(arg);
+	else
+		pthread_detach(tid);
+#else
+	UNUSED_ARG(name);
+#endif
+}
+
+
+/*
+ * filegen_wrote - note that a record went to gen->fp at uptime when.
+ * Flushes it now unless records are being buffered.
+ */
+static void
+filegen_wrote(
+	FILEGEN *	gen,
+	uptime_t	when
+	)
+{
+	if (0 == filegen_window) {
+		fflush(gen->fp);
+		return;
+	}
+	if (!gen->pending) {
+		gen->pending = true;
+		gen->since = when;
+	}
+}
+
+
+/*
+ * filegen_ready - make sure gen has a file open for a record at stamp.
+ * Only the first record opens one; after that it is kept current by
+ * filegen_rotate_due() from the timer, not checked per record.
+ */
+static inline bool
+filegen_ready(
+	FILEGEN *	gen,
+	time_t		stamp
+	)
+{
+	if (NULL == gen->fp)
+		filegen_setup(gen, stamp);
+	return NULL != gen->fp;
+}
+
+
+/*
+ * filegen_rotate_due - move open files whose generation has ended
+ * on to the next one
+ */
+static void
+filegen_rotate_due(
+	time_t	now
+	)
+{
+	struct filegen_entry *f;
+
+	for (f = filegen_registry; f != NULL; f = f->next)
+		if (NULL != f->filegen->fp)
+			filegen_setup(f->filegen, now);
+}
+
+
+/*
+ * filegen_flush_due - write out buffered records that have waited
+ * out the flush window, or all of them
+ */
+static void
+filegen_flush_due(
+	bool	all
+	)
+{
+	struct filegen_entry *f;
+	FILEGEN *gen;
+
+	for (f = filegen_registry; f != NULL; f = f->next) {
+		gen = f->filegen;
+		if (NULL == gen->fp || !gen->pending)
+			continue;
+		if (all || current_time - gen->since >=
+		    (uptime_t)filegen_window) {
+			fflush(gen->fp);
+			gen->pending = false;
+		}
+	}
+}
+
+
+/*
+ * The stats writer.  Once it is started, making a record doesn't touch
+ * the filesystem: filegen_write() formats it into a ring and a writer
+ * thread does the opening, writing and flushing.  A stalled disk, log
+ * rotation or a slow NFS statsdir then only backs up the ring.
+ *
+ * Records come from the main loop and the responder threads, always
+ * under proto_lock, so there is one producer at a time and the ring
+ * takes no locks.  A full ring drops records and counts them rather
+ * than wait.  filegen_mutex keeps configuration changes, which are
+ * made by the main thread, out of the writer's way.
+ */
+#define STATS_SLOTS	1024		/* power of 2 */
+#define STATS_LEAN	64		/* the same under "lean" */
+#define STATS_LINE	1024		/* longest record */
+
+struct stats_slot {
+	FILEGEN *	gen;
+	time_t		stamp;
+	uptime_t	when;
+	bool		binary;		/* else text */
+	unsigned short	len;
+	char		text[STATS_LINE];
+};
+
+static struct stats_slot *	stats_ring;
+static unsigned int		stats_slots;	/* fixed while it runs */
+static volatile unsigned int	stats_head;	/* advanced by the writer */
+static volatile unsigned int	stats_tail;	/* advanced by producers */
+static volatile bool		stats_sleeping;	/* writer waits for wake */
+static volatile bool		stats_tick;	/* time to check flushes */
+static volatile bool		stats_stopping;
+static volatile unsigned long	stats_dropped;	/* ring was full */
+static bool			writer_running;
+static pthread_t		writer_tid;
+static pthread_mutex_t		filegen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t		writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		writer_wake = PTHREAD_COND_INITIALIZER;
+
+static inline void stats_barrier(void) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
+}
+
+static void
+filegen_lock(void)
+{
+	if (writer_running)
+		pthread_mutex_lock(&filegen_mutex);
+}
+
+static void
+filegen_unlock(void)
+{
+	if (writer_running)
+		pthread_mutex_unlock(&filegen_mutex);
+}
+
+static void
+writer_poke(void)
+{
+	pthread_mutex_lock(&writer_mutex);
+	pthread_cond_signal(&writer_wake);
+	pthread_mutex_unlock(&writer_mutex);
+}
+
+
+static void *
+filegen_writer(
+	void *	arg
+	)
+{
+	struct stats_slot *	slot;
+	unsigned long		dropped, reported = 0;
+
+	UNUSED_ARG(arg);
+	thread_place(THREAD_OTHER, -1);
+	for (;;) {
+		while (stats_head != stats_tail) {
+			stats_barrier();
+			slot = &stats_ring[stats_head & (stats_slots - 1)];
+			pthread_mutex_lock(&filegen_mutex);
+			/* the format may have changed since it was queued */
+			if (filegen_ready(slot->gen, slot->stamp)
+			    && slot->binary ==
+			    !!(slot->gen->flag & FGEN_FLAG_BINARY)) {
+				fwrite(slot->text, 1, slot->len,
+				       slot->gen->fp);
+				filegen_wrote(slot->gen, slot->when);
+			}
+			pthread_mutex_unlock(&filegen_mutex);
+			stats_barrier();
+			stats_head++;
+		}
+		if (stats_stopping) {
+			pthread_mutex_lock(&filegen_mutex);
+			filegen_flush_due(true);
+			pthread_mutex_unlock(&filegen_mutex);
+			return NULL;
+		}
+		if (stats_tick) {
+			stats_tick = false;
+			pthread_mutex_lock(&filegen_mutex);
+			filegen_rotate_due(time(NULL));
+			filegen_flush_due(false);
+			pthread_mutex_unlock(&filegen_mutex);
+			dropped = stats_dropped;
+			if (dropped != reported) {
+				msyslog(LOG_WARNING,
+					"LOG: stats writer behind, %lu records dropped",
+					dropped - reported);
+				reported = dropped;
+			}
+		}
+
+		pthread_mutex_lock(&writer_mutex);
+		stats_sleeping = true;
+		stats_barrier();
+		if (stats_head == stats_tail && !stats_tick && !stats_stopping)
+			pthread_cond_wait(&writer_wake, &writer_mutex);
+		stats_sleeping = false;
+		pthread_mutex_unlock(&writer_mutex);
+	}
+}
+
+
+/*
+ * filegen_start_writer - move stats file I/O to its own thread
+ */
+void
+filegen_start_writer(void)
+{
+	if (writer_running)
+		return;
+	stats_slots = lean_memory ? STATS_LEAN : STATS_SLOTS;
+	stats_ring = eallocarray(stats_slots, sizeof(*stats_ring));
+
+	if (ntp_thread_create(&writer_tid, filegen_writer, NULL,
+			      "LOG: stats writer")) {
+		free(stats_ring);
+		stats_ring = NULL;
+		return;
+	}
+	writer_running = true;
+}
+
+
+/*
+ * filegen_memory - bytes in the writer's ring
+ */
+size_t
+filegen_memory(void)
+{
+	return (NULL == stats_ring) ? 0 : stats_slots * sizeof(*stats_ring);
+}
+
+
+/*
+ * filegen_stop_writer - write out everything queued and stop the
+ * writer.  Called on the way out.
+ */
+void
+filegen_stop_writer(void)
+{
+	if (!writer_running)
+		return;
+	stats_stopping = true;
+	stats_barrier();
+	writer_poke();
+	pthread_join(writer_tid, NULL);
+	writer_running = false;
+	free(stats_ring);
+	stats_ring = NULL;
+}
+
+
+/*
+ * filegen_timer - once a second: start new file generations that are
+ * due and write out buffered records that have waited out the flush
+ * window
+ */
+void
+filegen_timer(void)
+{
+	static unsigned long	reported;
+	static uptime_t		report_time;
+	unsigned long		dropped = stream_dropped;
+	struct filegen_entry *	f;
+
+	for (f = filegen_registry; f != NULL; f = f->next)
+		if (NULL != f->filegen->stream
+		    && (f->filegen->flag & FGEN_FLAG_ENABLED))
+			stream_header(f->filegen);
+	if (dropped != reported
+	    && current_time - report_time >= STREAM_REPORT) {
+		msyslog(LOG_WARNING,
+			"LOG: stats stream %lu records dropped",
+			dropped - reported);
+		reported = dropped;
+		report_time = current_time;
+	}
+
+	if (writer_running) {
+		stats_tick = true;
+		stats_barrier();
+		writer_poke();
+		return;
+	}
+	filegen_rotate_due(time(NULL));
+	filegen_flush_due(false);
+}
+
+
+/*
+ * filegen_flush - write out all buffered records, on the way out.
+ * The writer must be stopped first.
+ */
+void
+filegen_flush(void)
+{
+	filegen_flush_due(true);
+}
+
+
+/*
+ * stats_push - finish filling the slot at tail and hand it over
+ */
+static void
+stats_push(
+	FILEGEN *	gen,
+	time_t		stamp,
+	unsigned int	tail
+	)
+{
+	struct stats_slot *slot = &stats_ring[tail & (stats_slots - 1)];
+
+	slot->gen = gen;
+	slot->stamp = stamp;
+	slot->when = current_time;
+	stats_barrier();
+	stats_tail = tail + 1;
+	stats_barrier();
+	if (stats_sleeping)
+		writer_poke();
+}
+
+
+/*
+ * filegen_write - add a text record to gen, for a file generation
+ * at stamp.  Dropped if gen is writing binary records.
+ */
+void
+filegen_write(
+	FILEGEN *	gen,
+	time_t		stamp,
+	const char *	fmt,
+	...
+	)
+{
+	struct stats_slot *	slot;
+	unsigned int		tail = stats_tail;
+	va_list			ap;
+	int			len;
+
+	if (!(gen->flag & FGEN_FLAG_ENABLED)
+	    || (gen->flag & FGEN_FLAG_BINARY))
+		return;
+
+	if (NULL != gen->stream) {
+		char	line[STATS_LINE];
+
+		va_start(ap, fmt);
+		len = vsnprintf(line, sizeof(line), fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		if (len >= (int)sizeof(line))
+			len = (int)sizeof(line) - 1;
+		stream_send(gen->stream, line, (size_t)len);
+		return;
+	}
+
+	if (!writer_running) {
+		if (!filegen_ready(gen, stamp))
+			return;
+		va_start(ap, fmt);
+		vfprintf(gen->fp, fmt, ap);
+		va_end(ap);
+		filegen_wrote(gen, current_time);
+		return;
+	}
+
+	if (tail - stats_head >= stats_slots) {
+		stats_dropped++;
+		return;
+	}
+	slot = &stats_ring[tail & (stats_slots - 1)];
+	va_start(ap, fmt);
+	len = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len >= (int)sizeof(slot->text)) {
+		len = (int)sizeof(slot->text) - 1;
+		slot->text[len - 1] = '\n';
+	}
+	slot->len = (unsigned short)len;
+	slot->binary = false;
+	stats_push(gen, stamp, tail);
+}
+
+
+/*
+ * filegen_write_binary - add a binary record to gen, see filegen_binary()
+ */
+void
+filegen_write_binary(
+	FILEGEN *	gen,
+	time_t		stamp,
+	const void *	rec,
+	size_t		len
+	)
+{
+	struct stats_slot *	slot;
+	unsigned int		tail = stats_tail;
+
+	if (!(gen->flag & FGEN_FLAG_ENABLED)
+	    || !(gen->flag & FGEN_FLAG_BINARY) || len != gen->reclen
+	    || len > STATS_LINE)
+		return;
+
+	if (NULL != gen->stream) {
+		stream_header(gen);
+		stream_send(gen->stream, rec, len);
+		return;
+	}
+
+	if (!writer_running) {
+		if (!filegen_ready(gen, stamp))
+			return;
+		fwrite(rec, 1, len, gen->fp);
+		filegen_wrote(gen, current_time);
+		return;
+	}
+
+	if (tail - stats_head >= stats_slots) {
+		stats_dropped++;
+		return;
+	}
+	slot = &stats_ring[tail & (stats_slots - 1)];
+	memcpy(slot->text, rec, len);
+	slot->len = (unsigned short)len;
+	slot->binary = true;
+	stats_push(gen, stamp, tail);
+}
+
+
 /*
  * this function sets up gen->fp to point to the correct
  * generation of the file for the time specified by 'now'
@@ -327,10 +1141,7 @@ filegen_setup(
 	bool	current;
 
 	if (!(gen->flag & FGEN_FLAG_ENABLED)) {
-		if (NULL != gen->fp) {
-			fclose(gen->fp);
-			gen->fp = NULL;
-		}
+		filegen_close(gen);
 		return;
 	}
 
@@ -397,9 +1208,9 @@ filegen_config(
 		return;
 }
 
+	filegen_lock();
 	if (NULL != gen->fp) {
-		fclose(gen->fp);
-		gen->fp = NULL;
+		filegen_close(gen);
 		file_existed = true;
 	} else {
 		file_existed = false;
@@ -436,6 +1247,7 @@ filegen_config(
 	if (file_existed) {
 		filegen_setup(gen, time(NULL));
 	}
+	filegen_unlock();
 }
 
 
@@ -483,16 +1295,6 @@ valid_fileref(
 }
 
 
-/*
- * filegen registry
- */
-
-static struct filegen_entry {
-	char *			name;
-	FILEGEN *		filegen;
-	struct filegen_entry *	next;
-} *filegen_registry = NULL;
-
 
 FILEGEN *
 filegen_get(
@@ -0,0 +1,324 @@
+/*
+ * ntp_filewatch.c - notice changed files and reload them off the main thread
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * The leap second file and the NTS certificate used to be stat()ed,
+ * read and checked from the main loop, hourly and on SIGHUP.  On slow
+ * storage that held up packet processing.  Now a thread of its own
+ * does the reading.  Each watched file has a callback that runs on
+ * that thread.  The callback prepares what it read, a leap table or
+ * a certificate and key, and hands it over to the main thread.
+ *
+ * Where there is inotify, the directory of each file is watched, so a
+ * file replaced by rename() is noticed too.  The hourly and SIGHUP
+ * checks still happen: they just poke the thread.  That covers
+ * systems without inotify, and changes inotify can't see, such as a
+ * symlink target changing in another directory.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#include "ntpd.h"
+#include "ntp_stdlib.h"
+
+#define FILEWATCH_MAX	4	/* leap file, NTS certificate, restrict set */
+
+#define POKE_QUIET	'q'
+#define POKE_VERBOSE	'v'
+
+typedef struct watched watched;
+struct watched {
+	char *		path;
+	const char *	base;	/* file name within its directory */
+	struct stat	sb;	/* as of the last check */
+	filewatch_fn	fn;
+	int		wd;	/* inotify watch on the directory */
+};
+
+static watched		watch[FILEWATCH_MAX];
+static int		nwatch;
+static bool		watch_dirty;	/* watch[] changed since last sync */
+static pthread_mutex_t	watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool		filewatch_running;
+static int		poke_fd[2] = { -1, -1 };
+static int		notify_fd = -1;
+
+static void *	filewatch_main	(void *);
+static void	sync_watches	(void);
+static void	read_events	(void);
+static void	check_all	(bool);
+
+
+/*
+ * filewatch_add - have fn called, off the main thread, when path
+ * changes.  sb is what the caller last loaded, or NULL to take the
+ * file as it is now.  Adding a callback again replaces its path.
+ */
+void
+filewatch_add(
+	const char *		path,
+	const struct stat *	sb,
+	filewatch_fn		fn
+	)
+{
+	watched *	w;
+	int		i;
+
+	pthread_mutex_lock(&watch_lock);
+	for (i = 0; i < nwatch; i++)
+		if (watch[i].fn == fn)
+			break;
+	if (i == nwatch) {
+		if (FILEWATCH_MAX == nwatch) {
+			pthread_mutex_unlock(&watch_lock);
+			msyslog(LOG_ERR, "FILEWATCH: too many files, %s not watched",
+				path);
+			return;
+		}
+		nwatch++;
+		watch[i].wd = -1;
+	}
+	w = &watch[i];
+	free(w->path);
+	w->path = estrdup(path);
+	w->base = strrchr(w->path, '/');
+	w->base = (NULL == w->base) ? w->path : w->base + 1;
+	w->fn = fn;
+	if (NULL != sb)
+		w->sb = *sb;
+	else if (0 != stat(path, &w->sb))
+		ZERO(w->sb);
+	watch_dirty = true;
+	pthread_mutex_unlock(&watch_lock);
+	if (filewatch_running)
+		filewatch_poke(false);
+}
+
+
+/*
+ * filewatch_load - have fn read path afresh on the thread, for a
+ * caller on the main loop that shouldn't wait for it.  false if the
+ * thread isn't running yet, and the caller has to read it itself.
+ */
+bool
+filewatch_load(
+	const char *	path,
+	filewatch_fn	fn
+	)
+{
+	struct stat	sb;
+
+	if (!filewatch_running)
+		return false;
+	ZERO(sb);		/* unlike anything on disk */
+	filewatch_add(path, &sb, fn);
+	filewatch_poke(true);
+	return true;
+}
+
+
+/*
+ * filewatch_poke - have the thread check every file now.  verbose is
+ * passed on to the callbacks, to log what they would keep quiet
+ * about every hour.  Returns false if there is no thread to do it, so
+ * the caller should.
+ */
+bool
+filewatch_poke(
+	bool	verbose
+	)
+{
+	char	c = verbose ? POKE_VERBOSE : POKE_QUIET;
+
+	if (!filewatch_running)
+		return false;
+	/* if the pipe is full, a poke is already waiting */
+	if (write(poke_fd[1], &c, 1) < 0 && EAGAIN != errno)
+		msyslog(LOG_ERR, "FILEWATCH: poke: %s", strerror(errno));
+	return true;
+}
+
+
+/*
+ * filewatch_start - start the thread.  Called after the sandbox is
+ * set up, so the thread inherits it.
+ */
+void
+filewatch_start(void)
+{
+	pthread_t	tid;
+
+	if (filewatch_running)
+		return;
+	if (0 != pipe(poke_fd)) {
+		msyslog(LOG_ERR, "FILEWATCH: pipe: %s", strerror(errno));
+		return;
+	}
+	fcntl(poke_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(poke_fd[1], F_SETFL, O_NONBLOCK);
+	fcntl(poke_fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(poke_fd[1], F_SETFD, FD_CLOEXEC);
+#ifdef HAVE_SYS_INOTIFY_H
+	notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (notify_fd < 0)
+		msyslog(LOG_INFO, "FILEWATCH: no inotify, checking hourly: %s",
+			strerror(errno));
+#endif
+
+	if (ntp_thread_create(&tid, filewatch_main, NULL, "FILEWATCH")) {
+		close(poke_fd[0]);
+		close(poke_fd[1]);
+		if (notify_fd >= 0)
+			close(notify_fd);
+		poke_fd[0] = poke_fd[1] = notify_fd = -1;
+		return;
+	}
+	pthread_detach(tid);
+	filewatch_running = true;
+}
+
+
+static void *
+filewatch_main(
+	void *	arg
+	)
+{
+	struct pollfd	pfd[2];
+	char		buf[16];
+	ssize_t		n;
+	bool		poked, verbose;
+
+	UNUSED_ARG(arg);
+	thread_place(THREAD_OTHER, -1);
+	for (;;) {
+		pthread_mutex_lock(&watch_lock);
+		if (watch_dirty)
+			sync_watches();
+		pthread_mutex_unlock(&watch_lock);
+
+		pfd[0].fd = poke_fd[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = notify_fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, (notify_fd >= 0) ? 2 : 1, -1) < 0) {
+			if (EINTR != errno) {
+				msyslog(LOG_ERR, "FILEWATCH: poll: %s",
+					strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+
+		poked = verbose = false;
+		while ((n = read(poke_fd[0], buf, sizeof(buf))) > 0) {
+			poked = true;
+			verbose |= (NULL != memchr(buf, POKE_VERBOSE, (size_t)n));
+		}
+		if (poked)
+			check_all(verbose);
+		else if (notify_fd >= 0 && (POLLIN & pfd[1].revents))
+			read_events();
+	}
+	return NULL;
+}
+
+
+/*
+ * sync_watches - watch the directory of every file.  Called with
+ * watch_lock held.
+ */
+static void
+sync_watches(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char	dir[PATH_MAX];
+	size_t	len;
+	int	i;
+
+	for (i = 0; notify_fd >= 0 && i < nwatch; i++) {
+		len = (size_t)(watch[i].base - watch[i].path);
+		if (0 == len)
+			strlcpy(dir, ".", sizeof(dir));
+		else if (1 == len)
+			strlcpy(dir, "/", sizeof(dir));
+		else if (len <= sizeof(dir))
+			strlcpy(dir, watch[i].path, len);
+		else
+			continue;
+		/* the kernel hands back the same wd for the same directory */
+		watch[i].wd = inotify_add_watch(notify_fd, dir,
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ATTRIB);
+		if (watch[i].wd < 0)
+			msyslog(LOG_INFO, "FILEWATCH: can't watch %s: %s",
+				dir, strerror(errno));
+	}
+#endif
+	watch_dirty = false;
+}
+
+
+/*
+ * read_events - check the files inotify says were touched
+ */
+static void
+read_events(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char	buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool	touched[FILEWATCH_MAX];
+	ssize_t	n;
+	char *	cp;
+	int	i;
+
+	ZERO(touched);
+	pthread_mutex_lock(&watch_lock);
+	while ((n = read(notify_fd, buf, sizeof(buf))) > 0) {
+		for (cp = buf; cp < buf + n; cp += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)cp;
+			if (IN_Q_OVERFLOW & ev->mask) {
+				for (i = 0; i < nwatch; i++)
+					touched[i] = true;
+				continue;
+			}
+			for (i = 0; i < nwatch; i++)
+				if (ev->wd == watch[i].wd && 0 < ev->len &&
+				    0 == strcmp(ev->name, watch[i].base))
+					touched[i] = true;
+		}
+	}
+	for (i = 0; i < nwatch; i++)
+		if (touched[i])
+			watch[i].fn(watch[i].path, &watch[i].sb, false);
+	pthread_mutex_unlock(&watch_lock);
+#endif
+}
+
+
+static void
+check_all(
+	bool	verbose
+	)
+{
+	int	i;
+
+	pthread_mutex_lock(&watch_lock);
+	for (i = 0; i < nwatch; i++)
+		watch[i].fn(watch[i].path, &watch[i].sb, verbose);
+	pthread_mutex_unlock(&watch_lock);
+}
@@ -0,0 +1,497 @@
+/*
+ * ntp_handover.c - hand the sockets and state of a running ntpd to
+ * the one replacing it
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * With "handover <path>" in ntp.conf, ntpd listens on a Unix socket at
+ * path.  A new ntpd with the same option connects to it while reading
+ * its configuration, before it opens any sockets of its own.  The old
+ * one passes over its bound NTP and NTS-KE sockets with SCM_RIGHTS,
+ * then a snapshot of the associations and MRU scores in the state file
+ * format.  It writes the NTS client cache first, so the new ntpd reads
+ * the cookies it would have saved on the way out.  The NTS cookie keys
+ * are already on disk.
+ *
+ * The new ntpd binds nothing it was given.  Both processes serve from
+ * the same sockets until the new one is about to enter its main loop.
+ * Then it says it is ready and the old one exits, without saving its
+ * state over what the new one has.  If the new one dies first, the old
+ * one carries on.
+ *
+ * Protocol, over a stream socket; every message starts with a byte:
+ *   old <- new	'H'		take over, please
+ *   old -> new	'F' + fds	some sockets, HANDOVER_BATCH at most
+ *   old -> new	'S' <len>\n	and len bytes of state
+ *   old -> new	'E'		that's all
+ *   old <- new	'R'		ready, go away
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ntpd.h"
+#include "ntp_stdlib.h"
+#include "nts.h"
+
+#define HANDOVER_FDS	256	/* sockets taken over, at most */
+#define HANDOVER_BATCH	32	/* fds per 'F' message */
+#define HANDOVER_STATE	(64 * 1024 * 1024)	/* bytes, sanity limit */
+
+static char *		handover_path;
+static int		listen_fd = -1;
+static int		conn_fd = -1;	/* to the old ntpd until ready */
+static int		taken[HANDOVER_FDS];
+static int		ntaken;
+static char *		state_buf;
+static size_t		state_len;
+static volatile bool	gone;		/* handed over, exiting */
+
+static void *	handover_main	(void *);
+
+/*
+ * handover_config - set the rendezvous path
+ */
+void
+handover_config(
+	const char *	path
+	)
+{
+	struct sockaddr_un sun;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		msyslog(LOG_ERR, "HANDOVER: path %s too long, ignored", path);
+		return;
+	}
+	free(handover_path);
+	handover_path = estrdup(path);
+}
+
+static void
+handover_address(
+	struct sockaddr_un *sun
+	)
+{
+	ZERO(*sun);
+	sun->sun_family = AF_UNIX;
+	strlcpy(sun->sun_path, handover_path, sizeof(sun->sun_path));
+}
+
+/* read exactly len bytes */
+static bool
+read_all(
+	int	fd,
+	void *	buf,
+	size_t	len
+	)
+{
+	char *	p = buf;
+	ssize_t	n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+static bool
+write_all(
+	int		fd,
+	const void *	buf,
+	size_t		len
+	)
+{
+	const char *p = buf;
+	ssize_t	n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+/*
+ * recv_fds - one message from the old ntpd: its type byte, and any
+ * sockets that came with it onto taken[]
+ */
+static bool
+recv_fds(
+	int	fd,
+	char *	type
+	)
+{
+	union {
+		char	buf[CMSG_SPACE(HANDOVER_BATCH * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr	msg;
+	struct iovec	iov;
+	struct cmsghdr *cmsg;
+	int		fds[HANDOVER_BATCH];
+	size_t		n;
+
+	ZERO(msg);
+	iov.iov_base = type;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if (1 != recvmsg(fd, &msg, 0))
+		return false;
+	for (cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (SOL_SOCKET != cmsg->cmsg_level ||
+		    SCM_RIGHTS != cmsg->cmsg_type)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+		for (size_t i = 0; i < n; i++)
+			if (ntaken < HANDOVER_FDS)
+				taken[ntaken++] = fds[i];
+			else
+				close(fds[i]);
+	}
+	return true;
+}
+
+/*
+ * handover_receive - new ntpd, while reading the configuration: if an
+ * ntpd is listening on the path, take its sockets and state.  Then
+ * listen there ourselves.  Only the first call does anything.
+ */
+void
+handover_receive(void)
+{
+	static bool	tried;
+	struct sockaddr_un sun;
+	char		type, line[32];
+	size_t		n;
+	int		fd;
+
+	if (tried || NULL == handover_path)
+		return;
+	tried = true;
+	handover_address(&sun);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		msyslog(LOG_ERR, "HANDOVER: socket: %s", strerror(errno));
+		return;
+	}
+	if (0 == connect(fd, (struct sockaddr *)&sun, sizeof(sun)) &&
+	    write_all(fd, "H", 1)) {
+		for (;;) {
+			if (!recv_fds(fd, &type))
+				goto fail;
+			if ('E' == type)
+				break;
+			if ('S' != type)
+				continue;
+			for (n = 0; n < sizeof(line) - 1; n++)
+				if (!read_all(fd, &line[n], 1) ||
+				    '\n' == line[n])
+					break;
+			line[n] = '\0';
+			if (1 != sscanf(line, "%zu", &state_len) ||
+			    HANDOVER_STATE < state_len)
+				goto fail;
+			free(state_buf);
+			state_buf = emalloc(state_len + 1);
+			if (!read_all(fd, state_buf, state_len))
+				goto fail;
+		}
+		conn_fd = fd;
+		msyslog(LOG_INFO,
+			"HANDOVER: took %d sockets and %zu bytes of state",
+			ntaken, state_len);
+	} else {
+		/* nobody there, or it died; a fresh start */
+		close(fd);
+	}
+
+	(void)unlink(handover_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0 ||
+	    bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    chmod(handover_path, S_IRUSR | S_IWUSR) < 0 ||
+	    listen(listen_fd, 1) < 0) {
+		msyslog(LOG_ERR, "HANDOVER: can't listen on %s: %s",
+			handover_path, strerror(errno));
+		if (listen_fd >= 0)
+			close(listen_fd);
+		listen_fd = -1;
+	}
+	return;
+
+  fail:
+	msyslog(LOG_ERR, "HANDOVER: broken handover from %s, starting afresh",
+		handover_path);
+	close(fd);
+	for (int i = 0; i < ntaken; i++)
+		close(taken[i]);
+	ntaken = 0;
+	free(state_buf);
+	state_buf = NULL;
+	state_len = 0;
+}
+
+/*
+ * handover_take - a socket of the given type bound to addr, if the old
+ * ntpd gave us one, else INVALID_SOCKET
+ */
+SOCKET
+handover_take(
+	const sockaddr_u *	addr,
+	int			type
+	)
+{
+	sockaddr_u	bound;
+	socklen_t	len;
+	int		sotype;
+	SOCKET		fd;
+
+	for (int i = 0; i < ntaken; i++) {
+		ZERO(bound);
+		len = sizeof(bound);
+		if (getsockname(taken[i], &bound.sa, &len) < 0)
+			continue;
+		len = sizeof(sotype);
+		if (getsockopt(taken[i], SOL_SOCKET, SO_TYPE, &sotype,
+			       &len) < 0 || type != sotype)
+			continue;
+		if (!ADDR_PORT_EQ(addr, &bound))
+			continue;
+		fd = taken[i];
+		taken[i] = taken[--ntaken];
+		DPRINT(2, ("handover_take: fd %d for %s\n", fd,
+			   sockporttoa(addr)));
+		return fd;
+	}
+	return INVALID_SOCKET;
+}
+
+/*
+ * handover_state - the snapshot from the old ntpd as a stream, or NULL
+ */
+FILE *
+handover_state(void)
+{
+	if (NULL == state_buf || 0 == state_len)
+		return NULL;
+	return fmemopen(state_buf, state_len, "r");
+}
+
+/*
+ * handover_start - new ntpd, about to enter the main loop: let the old
+ * one go, drop what it gave us that we didn't want, and wait for the
+ * next ntpd
+ */
+void
+handover_start(void)
+{
+	pthread_t	tid;
+
+	if (conn_fd >= 0) {
+		if (!write_all(conn_fd, "R", 1))
+			msyslog(LOG_ERR, "HANDOVER: old ntpd went away");
+		close(conn_fd);
+		conn_fd = -1;
+		if (ntaken > 0)
+			msyslog(LOG_INFO, "HANDOVER: %d sockets not wanted",
+				ntaken);
+		for (int i = 0; i < ntaken; i++)
+			close(taken[i]);
+		ntaken = 0;
+	}
+	free(state_buf);
+	state_buf = NULL;
+	state_len = 0;
+	if (listen_fd < 0)
+		return;
+
+	if (ntp_thread_create(&tid, handover_main, NULL, "HANDOVER"))
+		return;
+	pthread_detach(tid);
+}
+
+/*
+ * handover_gone - true once the sockets are handed over and this ntpd
+ * is on its way out
+ */
+bool
+handover_gone(void)
+{
+	return gone;
+}
+
+/* send some fds, with a type byte */
+static bool
+send_fds(
+	int		fd,
+	char		type,
+	const int *	fds,
+	size_t		n
+	)
+{
+	union {
+		char	buf[CMSG_SPACE(HANDOVER_BATCH * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr	msg;
+	struct iovec	iov;
+	struct cmsghdr *cmsg;
+
+	ZERO(msg);
+	ZERO(control);
+	iov.iov_base = &type;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (n > 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+	}
+	return 1 == sendmsg(fd, &msg, 0);
+}
+
+/*
+ * handover_send - old ntpd: everything the new one needs.  The sockets
+ * are dup()ed under the protocol lock, so the main thread closing one
+ * meanwhile does no harm.
+ */
+static bool
+handover_send(
+	int	fd
+	)
+{
+	int	src[HANDOVER_FDS], fds[HANDOVER_FDS];
+	int	nsrc = 0, n = 0;
+	char	*buf = NULL, line[32];
+	size_t	len = 0;
+	FILE	*mem;
+	bool	ok = true;
+
+	proto_lock();
+#ifndef DISABLE_NTS
+	nts_write_client_cache();
+	nsrc = nts_server_listeners(src);
+#endif
+	for (endpt *ep = io_data.ep_list; ep != NULL && nsrc < HANDOVER_FDS;
+	     ep = ep->elink)
+		if (INVALID_SOCKET != ep->fd && !(INT_SHARED & ep->flags))
+			src[nsrc++] = ep->fd;
+	for (int i = 0; i < nsrc; i++)
+		if ((fds[n] = dup(src[i])) >= 0)
+			n++;
+	mem = open_memstream(&buf, &len);
+	if (NULL != mem) {
+		state_save(mem);
+		fclose(mem);
+	}
+	proto_unlock();
+
+	for (int i = 0; i < n && ok; i += HANDOVER_BATCH)
+		ok = send_fds(fd, 'F', &fds[i],
+			      (size_t)min(n - i, HANDOVER_BATCH));
+	if (ok && NULL != buf) {
+		snprintf(line, sizeof(line), "%zu\n", len);
+		ok = send_fds(fd, 'S', NULL, 0) &&
+		     write_all(fd, line, strlen(line)) &&
+		     write_all(fd, buf, len);
+	}
+	if (ok)
+		ok = send_fds(fd, 'E', NULL, 0);
+	for (int i = 0; i < n; i++)
+		close(fds[i]);
+	free(buf);
+	msyslog(LOG_INFO, "HANDOVER: %s %d sockets and %zu bytes of state",
+		ok ? "sent" : "failed to send", n, len);
+	return ok;
+}
+
+/* only root and our own user may take over */
+static bool
+handover_peer_ok(
+	int	fd
+	)
+{
+#ifdef SO_PEERCRED
+	struct ucred	cred;
+	socklen_t	len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return false;
+	if (0 != cred.uid && geteuid() != cred.uid) {
+		msyslog(LOG_ERR, "HANDOVER: refused uid %u",
+			(unsigned)cred.uid);
+		return false;
+	}
+#else
+	UNUSED_ARG(fd);		/* the socket is mode 0600 */
+#endif
+	return true;
+}
+
+static void *
+handover_main(
+	void *	arg
+	)
+{
+	char	c;
+	int	fd;
+
+	UNUSED_ARG(arg);
+	for (;;) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (EINTR == errno || ECONNABORTED == errno)
+				continue;
+			msyslog(LOG_ERR, "HANDOVER: accept: %s",
+				strerror(errno));
+			return NULL;
+		}
+		if (!handover_peer_ok(fd) || !read_all(fd, &c, 1) ||
+		    'H' != c || !handover_send(fd)) {
+			close(fd);
+			continue;
+		}
+		/* serve on until the new ntpd is up */
+		if (read_all(fd, &c, 1) && 'R' == c) {
+			msyslog(LOG_NOTICE, "HANDOVER: new ntpd running, exiting");
+			gone = true;
+			close(fd);
+			kill(getpid(), SIGTERM);
+			return NULL;
+		}
+		msyslog(LOG_ERR, "HANDOVER: new ntpd went away, carrying on");
+		close(fd);
+	}
+}
@@ -20,18 +20,45 @@
 #include "ntp_stdlib.h"
 #include "ntp_assert.h"
 #include "ntp_dns.h"
+#include "ntp_trace.h"
 #include "timespecops.h"
 
 #include "isc_interfaceiter.h"
 #include "isc_netaddr.h"
 
+/*
+ * Event notification backend.  select() has to rebuild and scan an
+ * fd_set covering every descriptor on each wakeup; epoll and kqueue
+ * keep the interest set in the kernel and hand back only the
+ * descriptors that are ready.
+ */
+#if defined(HAVE_SYS_EPOLL_H)
+# define USE_EPOLL
+# include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+# define USE_KQUEUE
+# include <sys/event.h>
+#endif
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+# define USE_IO_EVENTS
+#endif
+
 #ifdef HAVE_NET_ROUTE_H
 # define USE_ROUTING_SOCKET
 # include <net/route.h>
 # ifdef HAVE_LINUX_RTNETLINK_H
 #  include <linux/rtnetlink.h>
+#  include <sys/ioctl.h>
+#  define USE_NETLINK_ADDRS	/* addresses come and go one at a time */
 # endif
 #endif
+#if defined(USE_ROUTING_SOCKET) || defined(ENABLE_MSSNTP)
+# define USE_ASYNCIO_READER
+#endif
+#if defined(HAVE_LINUX_SOCK_DIAG_H) && defined(SO_MEMINFO)
+# include <linux/sock_diag.h>
+# define USE_SO_MEMINFO		/* per-socket kernel drop counter */
+#endif
 
 /* From ntp_request.h - after nuking ntpdc */
 #define IFS_EXISTS      1       /* just exists */
@@ -43,6 +70,35 @@
 #endif
 int qos = IPTOS_DSCP_EF;	/* QoS RFC 3246 */
 
+/*
+ * Number of datagrams pulled from a socket per recvmmsg() call.
+ * 1 means one recvmsg() per packet, as before.
+ */
+#ifdef HAVE_RECVMMSG
+# define RX_BATCH_DEFAULT	16
+#else
+# define RX_BATCH_DEFAULT	1
+#endif
+int rx_batch = RX_BATCH_DEFAULT;
+
+/*
+ * With singlesocket, each wildcard socket is told the destination of
+ * every datagram (IP_PKTINFO/IPV6_RECVPKTINFO) and the local addresses
+ * share it rather than binding sockets of their own.  Replies name
+ * their source address in the same way.
+ */
+bool single_socket = false;
+
+/*
+ * Socket buffers, in bytes.  A socket whose kernel drop counter moved
+ * in the last second had its receive queue overflow, and gets twice
+ * the receive buffer, up to sock_rcvmax; the kernel also holds an
+ * unprivileged process to net.core.rmem_max.
+ */
+int sock_rcvbuf = 0;
+int sock_sndbuf = 0;
+int sock_rcvmax = 4 * 1024 * 1024;
+
 
 uint16_t extra_port = 0;	/* 0 => not used */
 
@@ -91,6 +147,9 @@ static nic_rule *nic_rule_list;
 struct packet_counters {
 	uint64_t dropped;	/* # packets dropped on reception */
 	uint64_t ignored;	/* received on wild card interface */
+	uint64_t shed;		/* turned away by shed_packet() */
+	uint64_t overload_shed;	/* turned away by overload_shed() */
+	uint64_t overloads;	/* times the main loop fell behind */
 	uint64_t received;	/* total number of packets received */
 	uint64_t sent;		/* total number of packets sent */
 	uint64_t notsent;	/* total number of packets which couldn't be sent */
@@ -109,10 +168,67 @@ uptime_t io_timereset;	/* time counters were reset */
 /*
  * Interface stuff
  */
-struct ntp_io_data io_data;
+struct ntp_io_data io_data = {
+	.shed_average = 2000,	/* packets per second per prefix */
+	.shed_burst = 4000,	/* packets */
+};
+
+/*
+ * Front-line flood shedding.  Before restrictions() and the MRU list
+ * see a packet, its source prefix, /24 for IPv4 and /48 for IPv6, is
+ * charged against a token bucket in a small direct-mapped table.  A
+ * bucket fills at "limit shed" packets a second, whole seconds at a
+ * time, up to "limit shedburst".  Prefixes that collide share a slot,
+ * each taking it over with a full bucket, so a collision can only let
+ * packets through, never hold a quiet prefix back.  The limits are
+ * far above anything a well-behaved client sends: this is for
+ * floods, the MRU list still does the fine-grained work.
+ */
+#define SHED_SLOTS	4096		/* power of 2 */
+
+struct shed_slot {
+	uint32_t	tag;		/* prefix hash, 0 when empty */
+	uint32_t	tokens;		/* packets left this second */
+	uptime_t	stamp;		/* when tokens was topped up */
+};
+static struct shed_slot shed_table[SHED_SLOTS];
+
+/*
+ * Overload.  Under a flood the main loop could spend all its time
+ * draining one socket, while refclocks, the replies from our own
+ * servers and timer() wait.  So:
+ *  - a wakeup reads at most RX_PASS_MAX datagrams from a socket, then
+ *    lets the loop go round; the kernel keeps the rest for next time,
+ *  - refclocks are read first, then the endpoints on the extra port,
+ *    if there is one, which our own requests go out from,
+ *  - a socket left with datagrams unread, or a wakeup that took more
+ *    than OVERLOAD_LAG, means overload for OVERLOAD_HOLD seconds,
+ *  - while overloaded, each wakeup answers at most CLIENT_PASS_MAX
+ *    client (mode 3) requests; the others are read and dropped, and
+ *    counted.  Server replies, mode 6 and the rest all go through.
+ * The main thread does all of this; worker threads have their own
+ * sockets and don't hold the loop up.
+ */
+#define RX_PASS_MAX	1024	/* datagrams per socket per wakeup */
+#define CLIENT_PASS_MAX	256	/* client requests per wakeup, overloaded */
+#define OVERLOAD_LAG	20000000 /* ns for a wakeup that means overload */
+#define OVERLOAD_HOLD	2	/* s overload lasts after the last sign */
+
+static uptime_t	overload_until;	/* overloaded until current_time is this */
+static unsigned int pass_clients; /* client requests this wakeup */
 static int ninterfaces;			/* total # of interfaces */
 
 static  SOCKET  open_socket     (sockaddr_u *, bool, endpt *);
+static  SOCKET  bind_socket     (sockaddr_u *, bool, endpt *);
+static	void	set_socket_options (SOCKET, sockaddr_u *);
+static	int	set_sockbuf	(SOCKET, int, int);
+static	void	enable_pktinfo	(endpt *);
+static	size_t	pktinfo_control	(void *, size_t, const endpt *);
+static	ssize_t	sendto_from	(const endpt *, void *, size_t,
+				 sockaddr_u *);
+static	endpt *	pktinfo_endpt	(endpt *, struct msghdr *);
+
+#define PKTINFO_CONTROL	48	/* cmsg space to name a source address */
 
 static bool
 netaddr_eqprefix(const isc_netaddr_t *, const isc_netaddr_t *,
@@ -144,9 +260,30 @@ static	struct refclockio *refio;
  * File descriptor masks etc. for call to select
  * Not needed for I/O Completion Ports or anything outside this file
  */
+#ifndef USE_IO_EVENTS
 static fd_set activefds;
+#endif
 static int maxactivefd;
 
+#ifdef USE_IO_EVENTS
+/*
+ * Readiness events are fetched in batches of this many per wakeup;
+ * anything left over is picked up on the next call.
+ */
+#define IO_EVENT_BATCH	64
+
+static int io_event_fd = -1;		/* epoll or kqueue descriptor */
+# ifdef USE_EPOLL
+static struct epoll_event io_events[IO_EVENT_BATCH];
+static const char io_backend[] = "epoll_pwait";
+# else
+static struct kevent io_events[IO_EVENT_BATCH];
+static const char io_backend[] = "kevent";
+# endif
+#else
+static const char io_backend[] = "select";
+#endif
+
 static void	add_interface(endpt *);
 static bool	update_interfaces(void);
 static void	update_interfaces_phase0(void);
@@ -175,16 +312,29 @@ static void print_interface	(const endpt *, const char *, const char *);
 
 typedef struct vsock vsock_t;
 enum desc_type { FD_TYPE_SOCKET, FD_TYPE_FILE };
+enum desc_owner { FD_OWNER_ENDPT, FD_OWNER_REFCLOCK, FD_OWNER_ASYNCIO };
 
 struct vsock {
 	vsock_t	*	link;
 	SOCKET		fd;
 	enum desc_type	type;
+	enum desc_owner	owner_type;
+	void *		owner;	/* endpt, refclockio or asyncio_reader */
 };
 
 static vsock_t	*fd_list;
 
-#if defined(USE_ROUTING_SOCKET)
+#ifdef USE_IO_EVENTS
+/*
+ * fd-indexed view of fd_list so a ready descriptor can be mapped
+ * straight back to its owner.  A NULL slot means the descriptor was
+ * closed, possibly by a callback earlier in the same event batch.
+ */
+static vsock_t	**fd_table;
+static int	fd_table_size;
+#endif
+
+#ifdef USE_ASYNCIO_READER
 /*
  * async notification processing (e. g. routing sockets)
  */
@@ -197,6 +347,7 @@ struct asyncio_reader {
 	SOCKET fd;				    /* fd to be read */
 	void  *data;				    /* possibly local data */
 	void (*receiver)(struct asyncio_reader *);  /* input handler */
+	void (*input)(SOCKET);			    /* io_add_reader() handler */
 };
 
 static struct asyncio_reader *asyncio_reader_list;
@@ -206,7 +357,19 @@ static struct asyncio_reader *new_asyncio_reader (void);
 static void add_asyncio_reader (struct asyncio_reader *, enum desc_type);
 static void remove_asyncio_reader (struct asyncio_reader *);
 
-#endif /* defined(USE_ROUTING_SOCKET) */
+#endif /* USE_ASYNCIO_READER */
+
+#ifdef USE_NETLINK_ADDRS
+/*
+ * While the netlink socket is up it tells us about every address as
+ * it is added or deleted, and those are applied as they come in.
+ * Enumerating all of them again is only needed when a message was
+ * lost, a link changed state or the nic rules changed.
+ */
+static bool	netlink_addrs;		/* addresses tracked by netlink */
+static bool	rescan_needed;		/* but they need a full scan */
+static void	netlink_addr_msg (struct nlmsghdr *);
+#endif
 
 static void init_async_notifications (void);
 
@@ -223,11 +386,30 @@ struct remaddr {
 	endpt *			ep;
 };
 
-static remaddr_t * remoteaddr_list;
+/*
+ * Our local addresses, each keyed by its endpoint's own address and
+ * port and hashed with sock_hash(), so getinterface() doesn't have to
+ * walk all of them.  The table doubles when it fills.
+ */
+static remaddr_t **	remoteaddr_hash;
+static size_t		remoteaddr_size;	/* a power of 2, or 0 */
+static size_t		remoteaddr_count;
+
+#define	INIT_REMADDR_HASH	64
+
+/*
+ * The endpoints in address order, for findclosestinterface() to look
+ * either side of the address connect() suggested.  Rebuilt the first
+ * time it is wanted after an endpoint comes or goes.
+ */
+static endpt **		ep_sorted;
+static size_t		ep_sorted_count;
+static bool		ep_sorted_stale = true;
 
 static const int accept_wildcard_if_for_winnt = false;
 
-static void	add_fd_to_list		(SOCKET, enum desc_type);
+static void	add_fd_to_list		(SOCKET, enum desc_type,
+					 enum desc_owner, void *);
 static endpt *	find_addr_in_list	(sockaddr_u *);
 static void	delete_interface_from_list(endpt *);
 static void	close_and_delete_fd_from_list(SOCKET);
@@ -235,6 +417,9 @@ static void	add_addr_to_list	(sockaddr_u *, endpt *);
 static void	create_wildcards	(unsigned short);
 static endpt *	findlocalinterface	(sockaddr_u *);
 static endpt *	findclosestinterface	(sockaddr_u *, int);
+static int	ep_addr_cmp		(const sockaddr_u *, const endpt *);
+static int	ep_sorted_cmp		(const void *, const void *);
+static void	ep_sorted_build		(void);
 
 #ifdef DEBUG
 static const char *	action_text	(nic_rule_action);
@@ -253,9 +438,23 @@ static void		maintain_activefds(int fd, bool closing);
  * Routines to read the ntp packets
  */
 static int	read_network_packet	(SOCKET, endpt *);
-static void input_handler (fd_set *);
+static void	process_network_packet	(struct recvbuf *, endpt *,
+					 struct msghdr *);
+#ifdef HAVE_RECVMMSG
+static int	read_network_batch	(SOCKET, endpt *);
+#endif
+static bool	input_first		(const endpt *);
+static void	input_endpt		(endpt *);
+static void	overload_note		(void);
+static bool	overload_shed		(const struct recvbuf *);
+#ifdef USE_IO_EVENTS
+static void	event_handler		(int);
+#else
+static void	input_handler		(fd_set *);
+#endif
 #ifdef REFCLOCK
 static int	read_refclock_packet	(SOCKET, struct refclockio *);
+static void	input_refclock		(struct refclockio *);
 #endif
 
 /*
@@ -275,6 +474,41 @@ maintain_activefds(
 	bool closing
 	)
 {
+#if defined(USE_EPOLL)
+	struct epoll_event ev;
+
+	ZERO(ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(io_event_fd, closing ? EPOLL_CTL_DEL : EPOLL_CTL_ADD,
+		      fd, &ev) < 0) {
+		/* a refclock that hit EOF has already been dropped */
+		if (closing && ENOENT == errno)
+			return;
+		msyslog(LOG_ERR, "IO: epoll_ctl(%s) fd %d failed: %s",
+			closing ? "DEL" : "ADD", fd, strerror(errno));
+		if (!closing)
+			exit(1);
+	}
+	if (!closing)
+		maxactivefd = max(fd, maxactivefd);
+#elif defined(USE_KQUEUE)
+	struct kevent kev;
+
+	EV_SET(&kev, fd, EVFILT_READ, closing ? EV_DELETE : EV_ADD,
+	       0, 0, NULL);
+	if (kevent(io_event_fd, &kev, 1, NULL, 0, NULL) < 0) {
+		/* a refclock that hit EOF has already been dropped */
+		if (closing && ENOENT == errno)
+			return;
+		msyslog(LOG_ERR, "IO: kevent(%s) fd %d failed: %s",
+			closing ? "EV_DELETE" : "EV_ADD", fd, strerror(errno));
+		if (!closing)
+			exit(1);
+	}
+	if (!closing)
+		maxactivefd = max(fd, maxactivefd);
+#else
 	if (fd < 0 || fd >= (int)FD_SETSIZE) {
 		msyslog(LOG_ERR,
 			"IO: Too many sockets in use, FD_SETSIZE %d exceeded by fd %d",
@@ -297,6 +531,7 @@ maintain_activefds(
 			INSIST(fd != maxactivefd);
 		}
 	}
+#endif
 }
 
 
@@ -353,6 +588,43 @@ init_io(void)
 	sigaddset(&blockMask, SIGTERM);
 	sigaddset(&blockMask, SIGHUP);
 
+#ifdef USE_IO_EVENTS
+# ifdef USE_EPOLL
+	io_event_fd = epoll_create1(EPOLL_CLOEXEC);
+# else
+	io_event_fd = kqueue();
+# endif
+	if (io_event_fd < 0) {
+		msyslog(LOG_ERR, "IO: unable to create %s descriptor: %s",
+			io_backend, strerror(errno));
+		exit(1);
+	}
+# ifdef USE_KQUEUE
+	/*
+	 * kevent() has no pselect()-style signal mask, so a signal
+	 * caught between unblocking and sleeping would go unnoticed
+	 * until the next packet.  EVFILT_SIGNAL events coexist with
+	 * the handlers and make kevent() return instead.
+	 */
+	{
+		static const int sigs[] = {
+			SIGALRM, MOREDEBUGSIG, LESSDEBUGSIG,
+			SIGINT, SIGQUIT, SIGTERM, SIGHUP, SIGDNS
+		};
+		struct kevent kev;
+
+		for (size_t i = 0; i < COUNTOF(sigs); i++) {
+			EV_SET(&kev, sigs[i], EVFILT_SIGNAL, EV_ADD,
+			       0, 0, NULL);
+			if (kevent(io_event_fd, &kev, 1, NULL, 0, NULL) < 0)
+				msyslog(LOG_ERR,
+					"IO: kevent(EVFILT_SIGNAL %d) failed: %s",
+					sigs[i], strerror(errno));
+		}
+	}
+# endif
+	msyslog(LOG_INFO, "IO: using %s event notification", io_backend);
+#endif
 }
 
 
@@ -447,7 +719,7 @@ print_interface(const endpt *iface, const char *pfx, const char *sfx)
 }
 #endif
 
-#if defined(USE_ROUTING_SOCKET)
+#ifdef USE_ASYNCIO_READER
 /*
  * create an asyncio_reader structure
  */
@@ -482,7 +754,7 @@ add_asyncio_reader(
 	enum desc_type		type)
 {
 	LINK_SLIST(asyncio_reader_list, reader, link);
-	add_fd_to_list(reader->fd, type);
+	add_fd_to_list(reader->fd, type, FD_OWNER_ASYNCIO, reader);
 }
 
 /*
@@ -503,7 +775,54 @@ remove_asyncio_reader(
 
 	reader->fd = INVALID_SOCKET;
 }
-#endif /* defined(USE_ROUTING_SOCKET) */
+
+static void
+call_reader(
+	struct asyncio_reader *reader
+	)
+{
+	(*reader->input)(reader->fd);
+}
+
+/*
+ * io_add_reader - have the main loop call input with fd whenever fd
+ * is readable.
+ */
+void
+io_add_reader(
+	SOCKET	fd,
+	void	(*input)(SOCKET)
+	)
+{
+	struct asyncio_reader *reader = new_asyncio_reader();
+
+	reader->fd = fd;
+	reader->receiver = call_reader;
+	reader->input = input;
+	add_asyncio_reader(reader, FD_TYPE_SOCKET);
+}
+
+/*
+ * io_close_reader - stop watching and close a descriptor given to
+ * io_add_reader(), from its own input handler too.
+ */
+void
+io_close_reader(
+	SOCKET	fd
+	)
+{
+	struct asyncio_reader *reader;
+
+	for (reader = asyncio_reader_list; reader != NULL;
+	     reader = reader->link)
+		if (reader->fd == fd && reader->input != NULL)
+			break;
+	if (NULL == reader)
+		return;
+	remove_asyncio_reader(reader);
+	delete_asyncio_reader(reader);
+}
+#endif /* USE_ASYNCIO_READER */
 
 static void
 netaddr_fromsockaddr(isc_netaddr_t *t, const isc_sockaddr_t *s) {
@@ -745,7 +1064,11 @@ add_interface(
 	ep->addr_refid = addr2refid(&ep->sin);
 	/* link at tail so ntpq -c ifstats index increases each row */
 	LINK_TAIL_SLIST(io_data.ep_list, ep, elink, endpt);
+	ep_sorted_stale = true;
 	ninterfaces++;
+	workers_add_endpt(ep);
+	poller_add_endpt(ep);
+	uring_add_endpt(ep);
 }
 
 
@@ -762,7 +1085,11 @@ remove_interface(
 	sockaddr_u	resmask;
 
 	UNLINK_SLIST(unlinked, io_data.ep_list, ep, elink, endpt);
+	ep_sorted_stale = true;
 	delete_interface_from_list(ep);
+	workers_remove_endpt(ep);
+	poller_remove_endpt(ep);
+	uring_remove_endpt(ep);
 
 	if (ep->fd != INVALID_SOCKET) {
 		msyslog(LOG_INFO,
@@ -777,12 +1104,17 @@ remove_interface(
 			ep->sent,
 			ep->notsent,
 			current_time - ep->starttime);
-		close_and_delete_fd_from_list(ep->fd);
+		/* a shared socket stays with its wildcard */
+		if (!(INT_SHARED & ep->flags))
+			close_and_delete_fd_from_list(ep->fd);
 		ep->fd = INVALID_SOCKET;
 	}
 
 	ninterfaces--;
 	mon_clearinterface(ep);
+#ifdef ENABLE_MSSNTP
+	signd_clearinterface(ep);
+#endif
 
 	/* remove restrict interface entry */
 	SET_HOSTMASK(&resmask, AF(&ep->sin));
@@ -860,6 +1192,8 @@ create_wildcards(
 				socktoa(&wildif->sin), strerror(errno));
 			exit(1);
 		}
+		if (single_socket)
+			enable_pktinfo(wildif);
 		if (NTP_PORT == port) {
 			io_data.wild6_interface_NTP = wildif;
 		} else {
@@ -902,6 +1236,8 @@ create_wildcards(
 				socktoa(&wildif->sin), strerror(errno));
 			exit(1);
 		}
+		if (single_socket)
+			enable_pktinfo(wildif);
 		if (NTP_PORT == port) {
 			io_data.wild_interface_NTP = wildif;
 		} else {
@@ -946,6 +1282,9 @@ add_nic_rule(
 		REQUIRE(NULL == if_name);
 
 	LINK_SLIST(nic_rule_list, rule, next);
+#ifdef USE_NETLINK_ADDRS
+	rescan_needed = true;
+#endif
 }
 
 
@@ -1194,6 +1533,8 @@ refresh_interface(
 	)
 {
 #ifdef  OS_MISSES_SPECIFIC_ROUTE_UPDATES
+	if (INT_SHARED & interface->flags)
+		return true;	/* the wildcard is never bound */
 	if (interface->fd != INVALID_SOCKET) {
 		close_and_delete_fd_from_list(interface->fd);
 
@@ -1223,6 +1564,15 @@ interface_update(void)
 	if (io_data.disable_dynamic_updates)
 		return;
 
+#ifdef USE_NETLINK_ADDRS
+	if (netlink_addrs && !rescan_needed) {
+		/* the addresses are current, the routes may not be */
+		update_interfaces_phase3();
+		return;
+	}
+	rescan_needed = false;
+#endif
+
 	new_interface_found = update_interfaces();
 
 	if (!new_interface_found)
@@ -1401,6 +1751,96 @@ void update_interfaces_phase0(void)
   }
 }
 
+/*
+ * interface_usable - fill in the prototype endpt for an enumerated
+ * address and tell whether we want to listen on it at all.
+ */
+static bool
+interface_usable(
+	isc_interface_t *isc_if,
+	endpt *		enumep,
+	uint16_t	port
+	)
+{
+	unsigned int	family;
+
+	/* See if we have a valid family to use */
+	family = isc_if->address.family;
+	if (AF_INET != family && AF_INET6 != family)
+		return false;
+	if (AF_INET == family && !ipv4_works)
+		return false;
+	if (AF_INET6 == family && !ipv6_works)
+		return false;
+
+	/* create prototype */
+	init_interface(enumep);
+
+	convert_isc_if(isc_if, enumep, port);
+
+	DPRINT_INTERFACE(4, (enumep, "examining ", "\n"));
+
+	/*
+	 * Check if and how we are going to use the interface.
+	 */
+	switch (interface_action(enumep->name, &enumep->sin,
+				 enumep->flags)) {
+
+	default:
+	case ACTION_IGNORE:
+		DPRINT(4, ("ignoring interface %s (%s) - by nic rules\n",
+			   enumep->name, sockporttoa(&enumep->sin)));
+		return false;
+
+	case ACTION_LISTEN:
+		DPRINT(4, ("listen interface %s (%s) - by nic rules\n",
+			   enumep->name, sockporttoa(&enumep->sin)));
+		enumep->ignore_packets = false;
+		break;
+
+	case ACTION_DROP:
+		DPRINT(4, ("drop on interface %s (%s) - by nic rules\n",
+			   enumep->name, sockporttoa(&enumep->sin)));
+		enumep->ignore_packets = true;
+		break;
+	}
+
+	 /* interfaces must be UP to be usable */
+	if (!(enumep->flags & INT_UP)) {
+		DPRINT(4, ("skipping interface %s (%s) - DOWN\n",
+			   enumep->name, sockporttoa(&enumep->sin)));
+		return false;
+	}
+
+	/*
+	 * skip any interfaces UP and bound to a wildcard
+	 * address - some dhcp clients produce that in the
+	 * wild
+	 */
+	if (is_wildcard_addr(&enumep->sin)) {
+		DPRINT(4, ("skipping interface %s (%s) - WILD\n",
+			   enumep->name, sockporttoa(&enumep->sin)));
+		return false;
+	}
+
+	if (is_anycast(&enumep->sin, isc_if->name)) {
+		DPRINT(4, ("skipping interface %s (%s) - ANYCAST\n",
+			   enumep->name, sockporttoa(&enumep->sin)));
+		return false;
+	}
+
+	/*
+	 * skip any address that is an invalid state to be used
+	 */
+	if (!is_valid(&enumep->sin, isc_if->name)) {
+		DPRINT(4, ("skipping interface %s (%s) - ~VALID\n",
+			   enumep->name, sockporttoa(&enumep->sin)));
+		return false;
+	}
+
+	return true;
+}
+
 static bool
 update_interfaces_phase1(uint16_t port)
 {
@@ -1409,7 +1849,6 @@ update_interfaces_phase1(uint16_t port)
 	bool			result;
 	isc_interface_t		isc_if;
 	int			new_interface_found;
-	unsigned int		family;
 	endpt			enumep;
 	endpt *			ep;
 
@@ -1437,80 +1876,8 @@ update_interfaces_phase1(uint16_t port)
 		if (!result)
 			break;
 
-		/* See if we have a valid family to use */
-		family = isc_if.address.family;
-		if (AF_INET != family && AF_INET6 != family)
-			continue;
-		if (AF_INET == family && !ipv4_works)
-			continue;
-		if (AF_INET6 == family && !ipv6_works)
-			continue;
-
-		/* create prototype */
-		init_interface(&enumep);
-
-		convert_isc_if(&isc_if, &enumep, port);
-
-		DPRINT_INTERFACE(4, (&enumep, "examining ", "\n"));
-
-		/*
-		 * Check if and how we are going to use the interface.
-		 */
-		switch (interface_action(enumep.name, &enumep.sin,
-					 enumep.flags)) {
-
-		default:
-		case ACTION_IGNORE:
-			DPRINT(4, ("ignoring interface %s (%s) - by nic rules\n",
-				   enumep.name, sockporttoa(&enumep.sin)));
-			continue;
-
-		case ACTION_LISTEN:
-			DPRINT(4, ("listen interface %s (%s) - by nic rules\n",
-				   enumep.name, sockporttoa(&enumep.sin)));
-			enumep.ignore_packets = false;
-			break;
-
-		case ACTION_DROP:
-			DPRINT(4, ("drop on interface %s (%s) - by nic rules\n",
-				   enumep.name, sockporttoa(&enumep.sin)));
-			enumep.ignore_packets = true;
-			break;
-		}
-
-		 /* interfaces must be UP to be usable */
-		if (!(enumep.flags & INT_UP)) {
-			DPRINT(4, ("skipping interface %s (%s) - DOWN\n",
-				   enumep.name, sockporttoa(&enumep.sin)));
-			continue;
-		}
-
-		/*
-		 * skip any interfaces UP and bound to a wildcard
-		 * address - some dhcp clients produce that in the
-		 * wild
-		 */
-		if (is_wildcard_addr(&enumep.sin)) {
-			DPRINT(4, ("skipping interface %s (%s) - WILD\n",
-				   enumep.name, sockporttoa(&enumep.sin)));
-			continue;
-			}
-
-		if (is_anycast(&enumep.sin, isc_if.name)) {
-			DPRINT(4, ("skipping interface %s (%s) - ANYCAST\n",
-				   enumep.name, sockporttoa(&enumep.sin)));
-			continue;
-			}
-
-		/*
-		 * skip any address that is an invalid state to be used
-		 */
-		if (!is_valid(&enumep.sin, isc_if.name)) {
-			DPRINT(4, ("skipping interface %s (%s) - ~VALID\n",
-				   enumep.name, sockporttoa(&enumep.sin)));
+		if (!interface_usable(&isc_if, &enumep, port))
 			continue;
-			}
-
 
 		/*
 		 * map to local *address* in order to map all duplicate
@@ -1613,6 +1980,31 @@ update_interfaces_phase1(uint16_t port)
 	return new_interface_found;
 }
 
+/*
+ * drop_interface - forget an address that has gone away, leaving
+ * its peers to find another one in phase 3
+ */
+static void
+drop_interface(
+	endpt *	ep
+	)
+{
+	remove_interface(ep);
+
+	/* disconnect peers from deleted endpt. */
+	while (ep->peers != NULL)
+		set_peerdstadr(ep->peers, NULL);
+
+	/*
+	 * update globals in case we lose
+	 * a loopback interface
+	 */
+	if (ep == io_data.loopback_interface)
+		io_data.loopback_interface = NULL;
+
+	delete_interface(ep);
+}
+
 /*
  * phase 2 - delete gone interfaces - reassigning peers to
  * other interfaces
@@ -1636,20 +2028,7 @@ void update_interfaces_phase2(void)
 
 		DPRINT_INTERFACE(3, (ep, "updating ",
 				     "GONE - deleting\n"));
-		remove_interface(ep);
-
-		/* disconnect peers from deleted endpt. */
-		while (ep->peers != NULL)
-			set_peerdstadr(ep->peers, NULL);
-
-		/*
-		 * update globals in case we lose
-		 * a loopback interface
-		 */
-		if (ep == io_data.loopback_interface)
-			io_data.loopback_interface = NULL;
-
-		delete_interface(ep);
+		drop_interface(ep);
 	}
 }
 
@@ -1673,7 +2052,9 @@ static int
 create_sockets(void)
 {
 	maxactivefd = 0;
+#ifndef USE_IO_EVENTS
 	FD_ZERO(&activefds);
+#endif
 
 	DPRINT(2, ("create_sockets(%d %u)\n", NTP_PORT, extra_port));
 
@@ -1705,6 +2086,7 @@ create_interface(
 {
 	sockaddr_u	resmask;
 	endpt *		iface;
+	endpt *		wild;
 	DPRINT(2, ("create_interface(%s#%d)\n", sockporttoa(&protot->sin),
 		    port));
 
@@ -1712,9 +2094,15 @@ create_interface(
 	iface = new_interface(protot);
 
 	/*
-	 * create socket
+	 * create socket, or borrow the wildcard's if it can tell
+	 * which address each datagram was sent to
 	 */
-	iface->fd = open_socket(&iface->sin, true, iface);
+	wild = wildcard_interface(&iface->sin);
+	if (NULL != wild && (INT_PKTINFO & wild->flags)) {
+		iface->flags |= INT_SHARED;
+		iface->fd = wild->fd;
+	} else
+		iface->fd = open_socket(&iface->sin, true, iface);
 
 	if (iface->fd != INVALID_SOCKET)
 		log_listen_address(iface);
@@ -1789,7 +2177,7 @@ set_reuseaddr(
 	endpt *ep;
 
 	for (ep = io_data.ep_list; ep != NULL; ep = ep->elink) {
-		if (ep->flags & INT_WILDCARD)
+		if (ep->flags & (INT_WILDCARD | INT_SHARED))
 			continue;
 
 		/*
@@ -1812,52 +2200,132 @@ set_reuseaddr(
 }
 
 /*
- * open_socket - open a socket, returning the file descriptor
+ * set_socket_options - apply the per-family options every NTP
+ * socket gets
  */
-
-SOCKET
-open_socket(
-	sockaddr_u *	addr,
-	bool		turn_on_reuse,
-	endpt *		interf
+static void
+set_socket_options(
+	SOCKET		fd,
+	sockaddr_u *	addr
 	)
 {
-	SOCKET	fd;
-	int	errval;
-	/*
-	 * int is OK for REUSEADR per
-	 * http://www.kohala.com/start/mcast.api.txt
-	 */
 	const int	on = 1;
-	const int	off = 0;
-
-	if (IS_IPV6(addr) && !ipv6_works)
-		return INVALID_SOCKET;
-
-	/* create a datagram (UDP) socket */
-	fd = socket(AF(addr), SOCK_DGRAM, 0);
-	if (INVALID_SOCKET == fd) {
-		errval = errno;
-		msyslog(LOG_ERR,
-			"IO: socket(AF_INET%s, SOCK_DGRAM, 0) failed on address %s: %s",
-			IS_IPV6(addr) ? "6" : "", socktoa(addr), strerror(errno));
-
-		if (errval == EPROTONOSUPPORT ||
-		    errval == EAFNOSUPPORT ||
-		    errval == EPFNOSUPPORT)
-			return (INVALID_SOCKET);
 
-		errno = errval;
-#ifndef __COVERITY__
-		msyslog(LOG_ERR,
-			"IO: unexpected socket() error %s code %d (not EPROTONOSUPPORT nor EAFNOSUPPORT nor EPFNOSUPPORT) - exiting",
-			strerror(errno), errno);
-		exit(1);
-#endif /* __COVERITY__ */
+	/*
+	 * IPv4 specific options go here
+	 */
+	if (IS_IPV4(addr)) {
+		if (setsockopt(fd, IPPROTO_IP, IP_TOS, (char*)&qos,
+			       sizeof(qos)))
+			msyslog(LOG_ERR,
+				"IO: setsockopt IP_TOS (%02x) fails on "
+				"address %s: %s",
+				(unsigned)qos, socktoa(addr), strerror(errno));
 	}
 
 	/*
-	 * Fixup the file descriptor for some systems
+	 * IPv6 specific options go here
+	 */
+	if (IS_IPV6(addr)) {
+#ifdef IPV6_TCLASS
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, (char*)&qos,
+			       sizeof(qos)))
+			msyslog(LOG_ERR, "IO: setsockopt IPV6_TCLASS (%02x) "
+					"fails on address %s: %s",
+					(unsigned)qos, socktoa(addr), strerror(errno));
+#endif /* IPV6_TCLASS */
+		if (isc_net_probe_ipv6only_bool()
+		    && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+		    (const void *)&on, sizeof(on)))
+			msyslog(LOG_ERR,
+				"IO: setsockopt IPV6_V6ONLY on fails on address %s: %s",
+				socktoa(addr), strerror(errno));
+	}
+
+	if (sock_rcvbuf > 0 && set_sockbuf(fd, SO_RCVBUF, sock_rcvbuf) < 0)
+		msyslog(LOG_ERR, "IO: setsockopt SO_RCVBUF %d fails on "
+			"address %s: %s",
+			sock_rcvbuf, socktoa(addr), strerror(errno));
+	if (sock_sndbuf > 0 && set_sockbuf(fd, SO_SNDBUF, sock_sndbuf) < 0)
+		msyslog(LOG_ERR, "IO: setsockopt SO_SNDBUF %d fails on "
+			"address %s: %s",
+			sock_sndbuf, socktoa(addr), strerror(errno));
+}
+
+
+/*
+ * set_sockbuf - size a socket buffer, past the kernel's cap for
+ * unprivileged processes if we may.  Returns the size the kernel
+ * reports, which on Linux counts its overhead too, or -1.
+ */
+static int
+set_sockbuf(
+	SOCKET	fd,
+	int	opt,
+	int	bytes
+	)
+{
+	socklen_t	len = sizeof(bytes);
+	int		rc = -1;
+
+#if defined(SO_RCVBUFFORCE) && defined(SO_SNDBUFFORCE)
+	rc = setsockopt(fd, SOL_SOCKET,
+			(SO_RCVBUF == opt) ? SO_RCVBUFFORCE : SO_SNDBUFFORCE,
+			(const void *)&bytes, sizeof(bytes));
+#endif
+	if (rc < 0)
+		rc = setsockopt(fd, SOL_SOCKET, opt, (const void *)&bytes,
+				sizeof(bytes));
+	if (rc < 0 || getsockopt(fd, SOL_SOCKET, opt, (void *)&bytes, &len))
+		return -1;
+	return bytes;
+}
+
+
+/*
+ * bind_socket - create a UDP socket bound to addr, INVALID_SOCKET if
+ *		 that fails
+ */
+static SOCKET
+bind_socket(
+	sockaddr_u *	addr,
+	bool		turn_on_reuse,
+	endpt *		interf
+	)
+{
+	SOCKET	fd;
+	int	errval;
+	/*
+	 * int is OK for REUSEADR per
+	 * http://www.kohala.com/start/mcast.api.txt
+	 */
+	const int	on = 1;
+	const int	off = 0;
+
+	/* create a datagram (UDP) socket */
+	fd = socket(AF(addr), SOCK_DGRAM, 0);
+	if (INVALID_SOCKET == fd) {
+		errval = errno;
+		msyslog(LOG_ERR,
+			"IO: socket(AF_INET%s, SOCK_DGRAM, 0) failed on address %s: %s",
+			IS_IPV6(addr) ? "6" : "", socktoa(addr), strerror(errno));
+
+		if (errval == EPROTONOSUPPORT ||
+		    errval == EAFNOSUPPORT ||
+		    errval == EPFNOSUPPORT)
+			return (INVALID_SOCKET);
+
+		errno = errval;
+#ifndef __COVERITY__
+		msyslog(LOG_ERR,
+			"IO: unexpected socket() error %s code %d (not EPROTONOSUPPORT nor EAFNOSUPPORT nor EPFNOSUPPORT) - exiting",
+			strerror(errno), errno);
+		exit(1);
+#endif /* __COVERITY__ */
+	}
+
+	/*
+	 * Fixup the file descriptor for some systems
 	 * See bug #530 for details of the issue.
 	 */
 	fd = move_fd(fd);
@@ -1890,36 +2358,17 @@ open_socket(
 		set_excladdruse(fd);
 #endif
 
-	/*
-	 * IPv4 specific options go here
-	 */
-	if (IS_IPV4(addr)) {
-		if (setsockopt(fd, IPPROTO_IP, IP_TOS, (char*)&qos,
-			       sizeof(qos)))
-			msyslog(LOG_ERR,
-				"IO: setsockopt IP_TOS (%02x) fails on "
-				"address %s: %s",
-				(unsigned)qos, socktoa(addr), strerror(errno));
-	}
+#ifdef SO_REUSEPORT
+	/* responder threads bind their own sockets to this address */
+	if (server_workers > 0 && !(interf->flags & INT_WILDCARD)
+	    && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+			  sizeof(on)))
+		msyslog(LOG_ERR,
+			"IO: setsockopt SO_REUSEPORT fails for address %s: %s",
+			socktoa(addr), strerror(errno));
+#endif
 
-	/*
-	 * IPv6 specific options go here
-	 */
-	if (IS_IPV6(addr)) {
-#ifdef IPV6_TCLASS
-		if (setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, (char*)&qos,
-			       sizeof(qos)))
-			msyslog(LOG_ERR, "IO: setsockopt IPV6_TCLASS (%02x) "
-					"fails on address %s: %s",
-					(unsigned)qos, socktoa(addr), strerror(errno));
-#endif /* IPV6_TCLASS */
-		if (isc_net_probe_ipv6only_bool()
-		    && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
-		    (const void *)&on, sizeof(on)))
-			msyslog(LOG_ERR,
-				"IO: setsockopt IPV6_V6ONLY on fails on address %s: %s",
-				socktoa(addr), strerror(errno));
-	}
+	set_socket_options(fd, addr);
 
 #ifdef NEED_REUSEADDR_FOR_IFADDRBIND
 	/*
@@ -1952,8 +2401,44 @@ open_socket(
 		close(fd);
 		return INVALID_SOCKET;
 	}
+	return fd;
+}
+
 
+/*
+ * open_socket - open a socket, returning the file descriptor
+ */
+
+SOCKET
+open_socket(
+	sockaddr_u *	addr,
+	bool		turn_on_reuse,
+	endpt *		interf
+	)
+{
+	SOCKET	fd;
+	socklen_t optlen;
+
+	if (IS_IPV6(addr) && !ipv6_works)
+		return INVALID_SOCKET;
+
+	/* the ntpd we replace may have one set up already */
+	fd = handover_take(addr, SOCK_DGRAM);
+	if (INVALID_SOCKET == fd)
+		fd = bind_socket(addr, turn_on_reuse, interf);
+	if (INVALID_SOCKET == fd)
+		return INVALID_SOCKET;
+
+	bpf_filter_attach(fd);
 	enable_packetstamps(fd, addr);
+	if (NULL != interf) {
+		enable_timestamping(fd, interf);
+		/* a new socket starts a new drop counter */
+		ZERO(interf->sockbuf);
+		optlen = sizeof(interf->sockbuf.rcvbuf);
+		getsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+			   (void *)&interf->sockbuf.rcvbuf, &optlen);
+	}
 
 	DPRINT(4, ("bind(%d) AF_INET%s, addr %s%%%u#%d, flags 0x%x\n",
 		   fd, IS_IPV6(addr) ? "6" : "", socktoa(addr),
@@ -1961,7 +2446,7 @@ open_socket(
 
 	make_socket_nonblocking(fd);
 
-	add_fd_to_list(fd, FD_TYPE_SOCKET);
+	add_fd_to_list(fd, FD_TYPE_SOCKET, FD_OWNER_ENDPT, interf);
 
 #ifdef F_GETFL
 	/* F_GETFL may not be defined if the underlying OS isn't really Unix */
@@ -1974,47 +2459,714 @@ open_socket(
 
 
 /*
- * sendpkt - send a packet to the specified destination.
+ * enable_pktinfo - have a wildcard socket say where each datagram was
+ * sent, so singlesocket can find the endpoint it belongs to
+ */
+static void
+enable_pktinfo(
+	endpt *	ep
+	)
+{
+	const int	on = 1;
+	int		rc = -1;
+
+	errno = ENOPROTOOPT;
+	if (IS_IPV4(&ep->sin)) {
+#ifdef IP_PKTINFO
+		rc = setsockopt(ep->fd, IPPROTO_IP, IP_PKTINFO,
+				(const void *)&on, sizeof(on));
+#endif
+	} else {
+#ifdef IPV6_RECVPKTINFO
+		rc = setsockopt(ep->fd, IPPROTO_IPV6, IPV6_RECVPKTINFO,
+				(const void *)&on, sizeof(on));
+#endif
+	}
+	if (rc < 0) {
+		msyslog(LOG_ERR,
+			"IO: singlesocket: no destination addresses on %s: %s - binding each address instead",
+			socktoa(&ep->sin), strerror(errno));
+		return;
+	}
+	ep->flags |= INT_PKTINFO;
+}
+
+
+/*
+ * pktinfo_control - fill in the control message that sends a datagram
+ * from a shared endpoint's address.  Returns its length, 0 if none.
+ */
+static size_t
+pktinfo_control(
+	void *		buf,
+	size_t		size,
+	const endpt *	src
+	)
+{
+	struct msghdr	msghdr;
+	struct cmsghdr *cmsghdr = NULL;
+	size_t		space = 0;
+
+	memset(&msghdr, '\0', sizeof(msghdr));
+	msghdr.msg_control = buf;
+	if (IS_IPV4(&src->sin)) {
+#ifdef IP_PKTINFO
+		struct in_pktinfo	pi;
+
+		space = CMSG_SPACE(sizeof(pi));
+		if (size < space)
+			return 0;
+		memset(buf, '\0', space);
+		msghdr.msg_controllen = space;
+		cmsghdr = CMSG_FIRSTHDR(&msghdr);
+		cmsghdr->cmsg_level = IPPROTO_IP;
+		cmsghdr->cmsg_type = IP_PKTINFO;
+		cmsghdr->cmsg_len = CMSG_LEN(sizeof(pi));
+		memset(&pi, '\0', sizeof(pi));
+		pi.ipi_spec_dst = SOCK_ADDR4(&src->sin);
+		memcpy(CMSG_DATA(cmsghdr), &pi, sizeof(pi));
+#endif
+	} else {
+#ifdef IPV6_PKTINFO
+		struct in6_pktinfo	pi6;
+
+		space = CMSG_SPACE(sizeof(pi6));
+		if (size < space)
+			return 0;
+		memset(buf, '\0', space);
+		msghdr.msg_controllen = space;
+		cmsghdr = CMSG_FIRSTHDR(&msghdr);
+		cmsghdr->cmsg_level = IPPROTO_IPV6;
+		cmsghdr->cmsg_type = IPV6_PKTINFO;
+		cmsghdr->cmsg_len = CMSG_LEN(sizeof(pi6));
+		memset(&pi6, '\0', sizeof(pi6));
+		pi6.ipi6_addr = SOCK_ADDR6(&src->sin);
+		pi6.ipi6_ifindex = SCOPE(&src->sin);
+		memcpy(CMSG_DATA(cmsghdr), &pi6, sizeof(pi6));
+#endif
+	}
+	UNUSED_ARG(size);
+	UNUSED_LOCAL(cmsghdr);
+	return space;
+}
+
+
+/*
+ * sendto_from - sendto() through a shared endpoint's wildcard socket,
+ * naming the endpoint's address as the source
+ */
+static ssize_t
+sendto_from(
+	const endpt *	src,
+	void *		pkt,
+	size_t		len,
+	sockaddr_u *	dest
+	)
+{
+	struct msghdr	msghdr;
+	struct iovec	iov;
+	union {
+		char		buf[PKTINFO_CONTROL];
+		struct cmsghdr	align;
+	} control;
+
+	iov.iov_base = pkt;
+	iov.iov_len = len;
+	memset(&msghdr, '\0', sizeof(msghdr));
+	msghdr.msg_name = &dest->sa;
+	msghdr.msg_namelen = SOCKLEN(dest);
+	msghdr.msg_iov = &iov;
+	msghdr.msg_iovlen = 1;
+	msghdr.msg_controllen = pktinfo_control(control.buf,
+						sizeof(control), src);
+	if (0 != msghdr.msg_controllen)
+		msghdr.msg_control = control.buf;
+	return sendmsg(src->fd, &msghdr, 0);
+}
+
+
+/*
+ * pktinfo_endpt - the endpoint a datagram read from a wildcard socket
+ * was sent to, or the wildcard itself if it isn't one of ours
+ */
+static endpt *
+pktinfo_endpt(
+	endpt *		wild,
+	struct msghdr *	msghdr
+	)
+{
+	struct cmsghdr *cmsghdr;
+	sockaddr_u	dst;
+	endpt *		ep;
+
+	ZERO_SOCK(&dst);
+	for (cmsghdr = CMSG_FIRSTHDR(msghdr); NULL != cmsghdr;
+	     cmsghdr = CMSG_NXTHDR(msghdr, cmsghdr)) {
+#ifdef IP_PKTINFO
+		if (IPPROTO_IP == cmsghdr->cmsg_level
+		    && IP_PKTINFO == cmsghdr->cmsg_type) {
+			struct in_pktinfo	pi;
+
+			memcpy(&pi, CMSG_DATA(cmsghdr), sizeof(pi));
+			AF(&dst) = AF_INET;
+			NSRCADR(&dst) = pi.ipi_addr.s_addr;
+			break;
+		}
+#endif
+#ifdef IPV6_PKTINFO
+		if (IPPROTO_IPV6 == cmsghdr->cmsg_level
+		    && IPV6_PKTINFO == cmsghdr->cmsg_type) {
+			struct in6_pktinfo	pi6;
+
+			memcpy(&pi6, CMSG_DATA(cmsghdr), sizeof(pi6));
+			AF(&dst) = AF_INET6;
+			SET_ADDR6N(&dst, pi6.ipi6_addr);
+			/* getifaddrs() only scopes link-local addresses */
+			if (IN6_IS_ADDR_LINKLOCAL(&pi6.ipi6_addr))
+				SET_SCOPE(&dst, pi6.ipi6_ifindex);
+			break;
+		}
+#endif
+	}
+	if (AF_INET != AF(&dst) && AF_INET6 != AF(&dst))
+		return wild;
+	SET_PORT(&dst, SRCPORT(&wild->sin));
+	ep = find_addr_in_list(&dst);
+	return (NULL != ep) ? ep : wild;
+}
+
+
+/*
+ * open_worker_socket - open another socket on an endpoint's address
+ * for a responder thread.  The kernel spreads incoming datagrams
+ * across all the SO_REUSEPORT sockets bound to one address.
+ */
+SOCKET
+open_worker_socket(
+	endpt *	ep
+	)
+{
+#ifdef SO_REUSEPORT
+	SOCKET		fd;
+	int		errval;
+	const int	on = 1;
+
+	fd = socket(AF(&ep->sin), SOCK_DGRAM, 0);
+	if (INVALID_SOCKET == fd) {
+		msyslog(LOG_ERR, "IO: worker socket() on %s failed: %s",
+			socktoa(&ep->sin), strerror(errno));
+		return INVALID_SOCKET;
+	}
+	fd = move_fd(fd);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on,
+		       sizeof(on))
+	    || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+			  sizeof(on))) {
+		msyslog(LOG_ERR, "IO: worker setsockopt on %s failed: %s",
+			socktoa(&ep->sin), strerror(errno));
+		close(fd);
+		return INVALID_SOCKET;
+	}
+	set_socket_options(fd, &ep->sin);
+	bpf_filter_attach(fd);
+#ifdef NEED_REUSEADDR_FOR_IFADDRBIND
+	set_wildcard_reuse(&ep->sin, 1);
+#endif
+	errval = bind(fd, &ep->sin.sa, SOCKLEN(&ep->sin));
+#ifdef NEED_REUSEADDR_FOR_IFADDRBIND
+	set_wildcard_reuse(&ep->sin, 0);
+#endif
+	if (errval < 0) {
+		msyslog(LOG_ERR, "IO: worker bind(%d) %s#%d failed: %s",
+			fd, socktoa(&ep->sin), SRCPORT(&ep->sin),
+			strerror(errno));
+		close(fd);
+		return INVALID_SOCKET;
+	}
+	enable_packetstamps(fd, &ep->sin);
+	enable_timestamping(fd, ep);
+	make_socket_nonblocking(fd);
+	DPRINT(4, ("worker bind(%d) %s#%d\n", fd, socktoa(&ep->sin),
+		   SRCPORT(&ep->sin)));
+	return fd;
+#else
+	UNUSED_ARG(ep);
+	return INVALID_SOCKET;
+#endif
+}
+
+
+/*
+ * xmit_pkt - send a packet to the specified destination, asking for a
+ * transmit stamp if txstamp
+ */
+static void
+xmit_pkt(
+	sockaddr_u *		dest,
+	endpt *			src,
+	void *			pkt,
+	unsigned int		len,
+	bool			txstamp
+	)
+{
+	ssize_t	cc;
+
+	if (len > sizeof(struct pkt)) {
+		msyslog(LOG_ERR, "Err: sendpkt - buffer overflow %u", len);
+		exit(1);
+	}
+
+	if (NULL == src) {
+		/*
+		 * unbound peer - drop request and wait for better
+		 * network conditions
+		 */
+		DPRINT(2, ("sendpkt(dst=%s, len=%u): no interface - IGNORED\n",
+			   socktoa(dest), len));
+		return;
+	}
+
+	DPRINT(2, ("sendpkt(%d, dst=%s, src=%s, len=%u)\n",
+		   src->fd, socktoa(dest), socktoa(&src->sin), len));
+	NTP_TRACE3(send, dest, len, false);
+
+	if (INT_SHARED & src->flags) {
+		/* no transmit stamps, they would pile up on the wildcard */
+		cc = sendto_from(src, pkt, len, dest);
+	} else if (txstamp) {
+		src->txstamped = true;
+		cc = sendto_txstamp(src->fd, pkt, len, dest);
+	} else
+		cc = sendto(src->fd, pkt, (unsigned int)len, 0,
+			    &dest->sa, SOCKLEN(dest));
+	if (cc == -1) {
+		src->notsent++;
+		pkt_count.notsent++;
+	} else	{
+		src->sent++;
+		pkt_count.sent++;
+	}
+}
+
+
+/*
+ * sendpkt - send a packet to the specified destination.
+ */
+void
+sendpkt(
+	sockaddr_u *		dest,
+	endpt *			src,
+	void *			pkt,
+	unsigned int		len
+	)
+{
+	xmit_pkt(dest, src, pkt, len, false);
+}
+
+
+/*
+ * sendpkts - send n packets to one destination, with one sendmmsg()
+ * where there is one.  For the fragments of a mode 6 response, which
+ * are all built before the first leaves.
+ */
+void
+sendpkts(
+	sockaddr_u *		dest,
+	endpt *			src,
+	struct iovec *		iov,
+	unsigned int		n
+	)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr	msgs[RX_BATCH_MAX];
+	unsigned int	done = 0;
+	int		cc;
+
+	/* the wildcard needs sendto_from() to pick the source */
+	if (NULL != src && !(INT_SHARED & src->flags) && n <= RX_BATCH_MAX) {
+		memset(msgs, '\0', n * sizeof(*msgs));
+		for (unsigned int i = 0; i < n; i++) {
+			if (iov[i].iov_len > sizeof(struct pkt)) {
+				msyslog(LOG_ERR,
+					"Err: sendpkts - buffer overflow %zu",
+					iov[i].iov_len);
+				exit(1);
+			}
+			NTP_TRACE3(send, dest, iov[i].iov_len, false);
+			msgs[i].msg_hdr.msg_name = &dest->sa;
+			msgs[i].msg_hdr.msg_namelen = SOCKLEN(dest);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		DPRINT(2, ("sendpkts(%d, dst=%s, src=%s, n=%u)\n",
+			   src->fd, socktoa(dest), socktoa(&src->sin), n));
+		while (done < n) {
+			cc = sendmmsg(src->fd, &msgs[done], n - done, 0);
+			if (cc <= 0) {
+				/* the first unsent message failed, skip it */
+				cc = 1;
+				src->notsent++;
+				pkt_count.notsent++;
+			} else {
+				src->sent += cc;
+				pkt_count.sent += (unsigned long)cc;
+			}
+			done += (unsigned int)cc;
+		}
+		return;
+	}
+#endif
+	for (unsigned int i = 0; i < n; i++)
+		xmit_pkt(dest, src, iov[i].iov_base,
+			 (unsigned int)iov[i].iov_len, false);
+}
+
+
+/*
+ * sendpkt_txstamp - sendpkt() for a client packet whose transmit
+ * stamp should replace the origin timestamp
+ */
+void
+sendpkt_txstamp(
+	sockaddr_u *		dest,
+	endpt *			src,
+	void *			pkt,
+	unsigned int		len
+	)
+{
+	xmit_pkt(dest, src, pkt, len, true);
+}
+
+
+/*
+ * Server replies are queued per endpoint while a batch of requests
+ * is being processed and flushed with one sendmmsg() afterwards.
+ * The main loop uses main_txq; responder threads install their own
+ * queue (and socket) around the calls they make into receive().
+ */
+struct tx_slot {
+	sockaddr_u	dest;
+	struct iovec	iov;
+	struct pkt	pkt;
+	struct nts_seal	seal;	/* NTS encryption still to do */
+	union {			/* asks for a transmit stamp, */
+		char		buf[TXSTAMP_CONTROL];
+		char		pktinfo[PKTINFO_CONTROL]; /* or names */
+		struct cmsghdr	align;			   /* the source */
+	} control;
+};
+
+struct tx_queue {
+	endpt *		ep;	/* all queued replies leave here */
+	SOCKET		fd;	/* or here, if not INVALID_SOCKET */
+	int		count;
+	unsigned long	sent;	/* not yet added to the counters */
+	unsigned long	notsent;
+#ifdef HAVE_SENDMMSG
+	struct tx_slot	slot[RX_BATCH_MAX];
+	struct mmsghdr	msgs[RX_BATCH_MAX];
+#endif
+};
+
+static struct tx_queue	main_txq = { .fd = INVALID_SOCKET };
+static struct tx_queue *txq = &main_txq;
+
+static void	tx_queue_send	(struct tx_queue *);
+#ifdef HAVE_SENDMMSG
+static void	tx_queue_add	(struct tx_queue *, sockaddr_u *, void *,
+				 unsigned int, bool, endpt *);
+#endif
+
+/*
+ * queue_pkt - like xmit_pkt(), but the packet may be held back until
+ * flush_sendpkts() so replies go out in one system call.
+ */
+static void
+queue_pkt(
+	sockaddr_u *		dest,
+	endpt *			src,
+	void *			pkt,
+	unsigned int		len,
+	bool			txstamp
+	)
+{
+#ifdef HAVE_SENDMMSG
+	if (rx_batch <= 1 || NULL == src || len > sizeof(struct pkt)) {
+		xmit_pkt(dest, src, pkt, len, txstamp);
+		return;
+	}
+	if (txq->count > 0 && (src != txq->ep || RX_BATCH_MAX == txq->count)) {
+		if (txq == &main_txq)
+			flush_sendpkts();
+		else
+			tx_queue_send(txq);
+	}
+
+	DPRINT(2, ("queue_sendpkt(%d, dst=%s, src=%s, len=%u)\n",
+		   src->fd, socktoa(dest), socktoa(&src->sin), len));
+
+	tx_queue_add(txq, dest, pkt, len, txstamp, src);
+	txq->ep = src;
+	if (txstamp && !(INT_SHARED & src->flags))
+		src->txstamped = true;
+#else
+	xmit_pkt(dest, src, pkt, len, txstamp);
+#endif
+}
+
+void
+queue_sendpkt(
+	sockaddr_u *		dest,
+	endpt *			src,
+	void *			pkt,
+	unsigned int		len
+	)
+{
+	queue_pkt(dest, src, pkt, len, false);
+}
+
+/*
+ * queue_sendpkt_txstamp - queue_sendpkt() for a server reply whose
+ * transmit stamp the next interleaved reply will carry
+ */
+void
+queue_sendpkt_txstamp(
+	sockaddr_u *		dest,
+	endpt *			src,
+	void *			pkt,
+	unsigned int		len
+	)
+{
+	queue_pkt(dest, src, pkt, len, true);
+}
+
+/*
+ * queue_sealed_sendpkt - queue_sendpkt() for an NTS reply whose
+ * encryption extens_server_send() left to us.  When the reply is
+ * queued, the encryption waits too, and tx_queue_send() does a whole
+ * queue's worth at once, outside proto_lock for a responder thread.
+ */
+void
+queue_sealed_sendpkt(
+	sockaddr_u *		dest,
+	endpt *			src,
+	void *			pkt,
+	unsigned int		len,
+	struct nts_seal *	seal,
+	bool			txstamp
+	)
+{
+#if defined(HAVE_SENDMMSG) && !defined(DISABLE_NTS)
+	if (rx_batch > 1 && NULL != src && len <= sizeof(struct pkt)) {
+		queue_pkt(dest, src, pkt, len, txstamp);
+		txq->slot[txq->count - 1].seal = *seal;
+		seal->pending = false;
+		return;
+	}
+#endif
+#ifndef DISABLE_NTS
+	nts_seal_batch((uint8_t **)&pkt, &seal, 1);
+#else
+	UNUSED_ARG(seal);
+#endif
+	xmit_pkt(dest, src, pkt, len, txstamp);
+}
+
+#ifdef HAVE_SENDMMSG
+static void
+tx_queue_add(
+	struct tx_queue *	q,
+	sockaddr_u *		dest,
+	void *			pkt,
+	unsigned int		len,
+	bool			txstamp,
+	endpt *			src	/* or NULL for a private queue */
+	)
+{
+	struct tx_slot *slot = &q->slot[q->count];
+	struct mmsghdr *msg = &q->msgs[q->count];
+
+	NTP_TRACE3(send, dest, len, true);
+	slot->dest = *dest;
+	memcpy(&slot->pkt, pkt, len);
+	slot->seal.pending = false;
+	slot->iov.iov_base = &slot->pkt;
+	slot->iov.iov_len = len;
+	ZERO(*msg);
+	msg->msg_hdr.msg_name = &slot->dest.sa;
+	msg->msg_hdr.msg_namelen = SOCKLEN(&slot->dest);
+	msg->msg_hdr.msg_iov = &slot->iov;
+	msg->msg_hdr.msg_iovlen = 1;
+	if (NULL != src && (INT_SHARED & src->flags))
+		msg->msg_hdr.msg_controllen = pktinfo_control(
+		    slot->control.buf, sizeof(slot->control), src);
+	else if (txstamp)
+		msg->msg_hdr.msg_controllen = txstamp_control(
+		    slot->control.buf, sizeof(slot->control.buf));
+	if (0 != msg->msg_hdr.msg_controllen)
+		msg->msg_hdr.msg_control = slot->control.buf;
+	q->count++;
+}
+#endif
+
+/*
+ * tx_queue_put - queue a reply on a private queue.  Unlike
+ * queue_sendpkt() this never looks at an endpoint, so a responder
+ * thread may call it without proto_lock.  With txstamp the reply asks
+ * for a transmit stamp, which lands on the queue's own socket.
  */
 void
-sendpkt(
+tx_queue_put(
+	struct tx_queue *	q,
 	sockaddr_u *		dest,
-	endpt *			src,
 	void *			pkt,
-	unsigned int		len
+	unsigned int		len,
+	bool			txstamp
 	)
 {
 	ssize_t	cc;
 
-	if (len > sizeof(struct pkt)) {
-		msyslog(LOG_ERR, "Err: sendpkt - buffer overflow %u", len);
-		exit(1);
+	REQUIRE(INVALID_SOCKET != q->fd);
+#ifdef HAVE_SENDMMSG
+	if (len <= sizeof(struct pkt)) {
+		if (RX_BATCH_MAX == q->count)
+			tx_queue_send(q);
+		tx_queue_add(q, dest, pkt, len, txstamp, NULL);
+		return;
 	}
+#endif
+	NTP_TRACE3(send, dest, len, false);
+	if (txstamp)
+		cc = sendto_txstamp(q->fd, pkt, len, dest);
+	else
+		cc = sendto(q->fd, pkt, len, 0, &dest->sa, SOCKLEN(dest));
+	if (-1 == cc)
+		q->notsent++;
+	else
+		q->sent++;
+}
 
-	if (NULL == src) {
-		/*
-		 * unbound peer - drop request and wait for better
-		 * network conditions
-		 */
-		DPRINT(2, ("sendpkt(dst=%s, len=%u): no interface - IGNORED\n",
-			   socktoa(dest), len));
+/*
+ * tx_queue_send - push a queue out.  Touches only the socket and the
+ * queue, so a responder thread may call it without proto_lock.  The
+ * results are tallied in the queue until its owner accounts for them.
+ */
+static void
+tx_queue_send(
+	struct tx_queue *	q
+	)
+{
+#ifdef HAVE_SENDMMSG
+	SOCKET	fd;
+	int	done = 0;
+	int	cc;
+
+	if (0 == q->count)
 		return;
+#ifndef DISABLE_NTS
+	{
+		uint8_t *		pkts[RX_BATCH_MAX];
+		struct nts_seal *	seals[RX_BATCH_MAX];
+		int			nseal = 0;
+
+		for (int i = 0; i < q->count; i++)
+			if (q->slot[i].seal.pending) {
+				pkts[nseal] = (uint8_t *)&q->slot[i].pkt;
+				seals[nseal] = &q->slot[i].seal;
+				nseal++;
+			}
+		if (nseal > 0)
+			nts_seal_batch(pkts, seals, nseal);
+	}
+#endif
+	fd = (INVALID_SOCKET != q->fd) ? q->fd : q->ep->fd;
+	while (done < q->count) {
+		cc = sendmmsg(fd, &q->msgs[done],
+			      (unsigned int)(q->count - done), 0);
+		if (cc < 0 && EINVAL == errno
+		    && txstamp_refused(&q->msgs[done].msg_hdr))
+			continue;
+		if (cc <= 0) {
+			/* the first unsent message failed, skip it */
+			cc = 1;
+			q->notsent++;
+		} else {
+			q->sent += (unsigned long)cc;
+		}
+		done += cc;
 	}
+	q->count = 0;
+#else
+	UNUSED_ARG(q);
+#endif
+}
 
-	DPRINT(2, ("sendpkt(%d, dst=%s, src=%s, len=%u)\n",
-		   src->fd, socktoa(dest), socktoa(&src->sin), len));
+/*
+ * flush_sendpkts - send everything queued by queue_sendpkt()
+ */
+void
+flush_sendpkts(void)
+{
+	if (0 == main_txq.count)
+		return;
+	tx_queue_send(&main_txq);
+	main_txq.ep->sent += (long)main_txq.sent;
+	main_txq.ep->notsent += (long)main_txq.notsent;
+	pkt_count.sent += main_txq.sent;
+	pkt_count.notsent += main_txq.notsent;
+	main_txq.sent = main_txq.notsent = 0;
+	main_txq.ep = NULL;
+}
 
-	cc = sendto(src->fd, pkt, (unsigned int)len, 0,
-		    &dest->sa, SOCKLEN(dest));
-	if (cc == -1) {
-		src->notsent++;
-		pkt_count.notsent++;
-	} else	{
-		src->sent++;
-		pkt_count.sent++;
+/*
+ * tx_queue_create - allocate a private reply queue for a thread
+ */
+struct tx_queue *
+tx_queue_create(void)
+{
+	struct tx_queue *q;
+
+	q = emalloc_zero(sizeof(*q));
+	q->fd = INVALID_SOCKET;
+	return q;
+}
+
+/*
+ * tx_queue_select - direct queue_sendpkt() at q, sending through fd.
+ * A NULL q restores the main loop's queue.  Call with proto_lock held.
+ */
+void
+tx_queue_select(
+	struct tx_queue *	q,
+	SOCKET			fd
+	)
+{
+	if (NULL == q) {
+		txq = &main_txq;
+		return;
 	}
+	if (q->count > 0 && q->fd != fd)
+		tx_queue_send(q);
+	q->fd = fd;
+	txq = q;
 }
 
+/*
+ * tx_queue_flush - send a private queue and return, then clear, the
+ * tallies of everything it has sent since the last call
+ */
+void
+tx_queue_flush(
+	struct tx_queue *	q,
+	unsigned long *		sent,
+	unsigned long *		notsent
+	)
+{
+	tx_queue_send(q);
+	*sent = q->sent;
+	*notsent = q->notsent;
+	q->sent = q->notsent = 0;
+}
 
 
 #ifdef REFCLOCK
@@ -2023,6 +3175,12 @@ sendpkt(
  * Return the number of bytes read. That way we know if we should
  * read it again or go on to the next one if no bytes returned
  *
+ * Each clock reads into a buffer of its own, set up by io_addclock(),
+ * rather than one from the pool the network uses.  A busy serial
+ * receiver can then neither run the network out of buffers nor lose
+ * its input when a burst of packets has taken them all.  Drivers
+ * handle the data before the next read, so one buffer is enough.
+ *
  * Note: too big to inline
  */
 static int
@@ -2033,9 +3191,7 @@ read_refclock_packet(
 {
 	size_t			i;
 	ssize_t			buflen;
-	int			saved_errno;
-	int			consumed;
-	struct recvbuf *	rb;
+	struct recvbuf *	rb = rp->rb;
 	l_fp			ts;
 
 	/* Could read earlier in normal case,
@@ -2044,19 +3200,6 @@ read_refclock_packet(
 	 */
 	get_systime(&ts);
 
-	rb = get_free_recv_buffer();
-
-	if (NULL == rb) {
-		/*
-		 * No buffer space available - just drop the packet
-		 */
-		char buf[RX_BUFF_SIZE];
-
-		buflen = read(fd, buf, sizeof buf);
-		pkt_count.dropped++;
-		return (buflen);
-	}
-
 	i = (rp->datalen == 0
 	     || rp->datalen > sizeof(rb->recv_buffer))
 		? sizeof(rb->recv_buffer)
@@ -2065,31 +3208,38 @@ read_refclock_packet(
 		buflen = read(fd, (char *)&rb->recv_buffer, i);
 	} while (buflen < 0 && EINTR == errno);
 
-	if (buflen <= 0) {
-		saved_errno = errno;
-		freerecvbuf(rb);
-		errno = saved_errno;
+	if (buflen <= 0)
 		return (int)buflen;
-	}
 
-	/*
-	 * Got one. Mark how and when it got here,
-	 * put it on the full list and do bookkeeping.
-	 */
 	rb->recv_length = (size_t)buflen;
+	rb->recv_time = ts;
+	io_refclock_input(rp, rb);
+
+	return (int)buflen;
+}
+
+
+/*
+ * io_refclock_input - mark where a read from a clock came from, hand
+ * it to the driver and do bookkeeping.  The length and the receive
+ * time are already in rb.  The refclock input thread's reads come
+ * through here too.
+ */
+void
+io_refclock_input(
+	struct refclockio *	rp,
+	struct recvbuf *	rb
+	)
+{
 	rb->recv_peer = rp->srcclock;
 	rb->dstadr = 0;
-	rb->fd = fd;
-	rb->recv_time = ts;
+	rb->fd = rp->fd;
 
-	consumed = indicate_refclock_packet(rp, rb);
-	if (!consumed) {
+	if (!indicate_refclock_packet(rp, rb)) {
 		rp->recvcount++;
 		// FIXME: should have separate slot for refclock packets
 		pkt_count.received++;
 	}
-
-	return (int)buflen;
 }
 #endif	/* REFCLOCK */
 
@@ -2109,7 +3259,7 @@ read_network_packet(
 	struct recvbuf *rb;
 	struct msghdr msghdr;
 	struct iovec iovec;
-	char control[100];   /* FIXME: Need space for time stamp plus overhead */
+	char control[PKTSTAMP_CONTROL];
 
 	/*
 	 * Get a buffer and read the frame.  If we
@@ -2119,7 +3269,8 @@ read_network_packet(
 	 */
 
 	rb = get_free_recv_buffer();
-	if (NULL == rb || itf->ignore_packets) {
+	if (NULL == rb
+	    || (itf->ignore_packets && !(INT_PKTINFO & itf->flags))) {
 		char buf[RX_BUFF_SIZE];
 		sockaddr_u from;
 
@@ -2176,6 +3327,224 @@ read_network_packet(
 	DPRINT(3, ("read_network_packet: fd=%d length %d from %s\n",
 		   fd, (int)buflen, socktoa(&rb->recv_srcadr)));
 
+	rb->fd = fd;
+	process_network_packet(rb, itf, &msghdr);
+	return (buflen);
+}
+
+/*
+ * process_network_packet - sanity check a freshly read datagram,
+ * hand it to the protocol machine and release the buffer
+ */
+static void
+process_network_packet(
+	struct recvbuf *	rb,
+	endpt *			itf,
+	struct msghdr *		msghdr
+	)
+{
+	NTP_TRACE3(read, &rb->recv_srcadr, rb->recv_length, rb->fd);
+	if (INT_PKTINFO & itf->flags) {
+		itf = pktinfo_endpt(itf, msghdr);
+		if (itf->ignore_packets) {
+			pkt_count.ignored++;
+			freerecvbuf(rb);
+			return;
+		}
+	}
+	if (overload_shed(rb) || !accept_network_packet(rb, itf)) {
+		freerecvbuf(rb);
+		return;
+	}
+	rb->recv_time = fetch_packetstamp(msghdr, itf->phc);
+	input_latency(rb);
+
+	receive(rb);
+	freerecvbuf(rb);
+
+	itf->received++;
+	pkt_count.received++;
+}
+
+/*
+ * input_latency - how long a datagram waited between its receive
+ * stamp and the protocol machine
+ */
+void
+input_latency(
+	const struct recvbuf *	rb
+	)
+{
+	l_fp	now;
+
+	get_systime(&now);
+	latency_lfp(LAT_INPUT, now - rb->recv_time);
+}
+
+/*
+ * input_polled - take a datagram the busy poller read and stamped.
+ * The buffer stays the caller's.
+ */
+void
+input_polled(
+	struct recvbuf *	rb,
+	endpt *			itf,
+	struct msghdr *		msghdr
+	)
+{
+	++pkt_count.handler_pkts;
+	NTP_TRACE3(read, &rb->recv_srcadr, rb->recv_length, rb->fd);
+	if (itf->ignore_packets && !(INT_PKTINFO & itf->flags)) {
+		pkt_count.ignored++;
+		return;
+	}
+	if (INT_PKTINFO & itf->flags) {
+		itf = pktinfo_endpt(itf, msghdr);
+		if (itf->ignore_packets) {
+			pkt_count.ignored++;
+			return;
+		}
+	}
+	if (overload_shed(rb) || !accept_network_packet(rb, itf))
+		return;
+	input_latency(rb);
+
+	receive(rb);
+
+	itf->received++;
+	pkt_count.received++;
+}
+
+/*
+ * io_endpt_polled - leave reading an endpoint to the busy poller or
+ * the io_uring, or with polled false take it back.  Its socket is
+ * still watched for errors, which bring transmit stamps.  Returns
+ * false if the main loop has to go on reading it.
+ */
+bool
+io_endpt_polled(
+	endpt *	ep,
+	bool	polled
+	)
+{
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+
+	ZERO(ev);
+	ev.events = polled ? 0 : EPOLLIN;	/* EPOLLERR always comes */
+	ev.data.fd = ep->fd;
+	if (epoll_ctl(io_event_fd, EPOLL_CTL_MOD, ep->fd, &ev) < 0) {
+		msyslog(LOG_ERR, "IO: epoll_ctl(MOD) fd %d failed: %s",
+			ep->fd, strerror(errno));
+		return false;
+	}
+	if (polled)
+		ep->flags |= INT_POLLED;
+	else
+		ep->flags &= ~INT_POLLED;
+	return polled;
+#else
+	UNUSED_ARG(ep);
+	UNUSED_ARG(polled);
+	return false;
+#endif
+}
+
+/*
+ * shed_packet - charge a packet to its source prefix.  Returns true
+ * if the prefix is over its budget and the packet should go no
+ * further.  Called with proto_lock held.
+ */
+static bool
+shed_packet(
+	const sockaddr_u *	src
+	)
+{
+	struct shed_slot *	slot;
+	uint8_t			key[1 + 6];
+	size_t			len;
+	uint32_t		h;
+	uint32_t		tag;
+	uint64_t		tokens;
+
+	if (0 == io_data.shed_average)
+		return false;
+	if (IS_IPV4(src)) {
+		key[0] = AF_INET;
+		memcpy(&key[1], &PSOCK_ADDR4(src)->s_addr, 3);
+		len = 1 + 3;
+	} else {
+		key[0] = AF_INET6;
+		memcpy(&key[1], PSOCK_ADDR6(src)->s6_addr, 6);
+		len = 1 + 6;
+	}
+	h = sock_hash_bytes(key, len);
+	slot = &shed_table[h & (SHED_SLOTS - 1)];
+	tag = h | 1;		/* never 0, the empty slot */
+
+	if (slot->tag != tag) {
+		slot->tag = tag;
+		slot->tokens = io_data.shed_burst;
+		slot->stamp = current_time;
+	} else if (slot->stamp != current_time) {
+		tokens = slot->tokens + (uint64_t)io_data.shed_average *
+		    (current_time - slot->stamp);
+		slot->tokens = (uint32_t)min(tokens, io_data.shed_burst);
+		slot->stamp = current_time;
+	}
+	if (0 == slot->tokens) {
+		pkt_count.shed++;
+		return true;
+	}
+	slot->tokens--;
+	return false;
+}
+
+/*
+ * overload_note - the main loop is falling behind
+ */
+static void
+overload_note(void)
+{
+	if (current_time >= overload_until)
+		pkt_count.overloads++;
+	overload_until = current_time + OVERLOAD_HOLD;
+}
+
+/*
+ * overload_shed - returns true, having counted it, for a client
+ * request over this wakeup's share while the main loop is overloaded
+ */
+static bool
+overload_shed(
+	const struct recvbuf *	rb
+	)
+{
+	if (current_time >= overload_until || rb->recv_length < 1 ||
+	    MODE_CLIENT != PKT_MODE(rb->recv_buffer[0]))
+		return false;
+	if (pass_clients < CLIENT_PASS_MAX) {
+		pass_clients++;
+		return false;
+	}
+	pkt_count.overload_shed++;
+	return true;
+}
+
+/*
+ * accept_network_packet - final checks on a datagram before it goes
+ * to the protocol machine.  Returns false, having counted the drop,
+ * if it must be discarded.
+ */
+bool
+accept_network_packet(
+	struct recvbuf *	rb,
+	endpt *			itf
+	)
+{
+	if (shed_packet(&rb->recv_srcadr))
+		return false;
+
 	/*
 	 * We used to drop network packets with addresses matching the magic
 	 * refclock format here. Now we do the check in the protocol machine,
@@ -2199,8 +3568,7 @@ read_network_packet(
 		   ) {
 			pkt_count.dropped++;
 			DPRINT(2, ("DROPPING that packet\n"));
-			freerecvbuf(rb);
-			return buflen;
+			return false;
 		}
 		DPRINT(2, ("processing that packet\n"));
 	}
@@ -2210,17 +3578,144 @@ read_network_packet(
 	 * put it on the full list and do bookkeeping.
 	 */
 	rb->dstadr = itf;
-	rb->fd = fd;
-	rb->recv_time = fetch_packetstamp(&msghdr);
+	return true;
+}
 
-	receive(rb);
-	freerecvbuf(rb);
+#ifdef HAVE_RECVMMSG
+/*
+ * read_network_batch - read up to rx_batch datagrams from an endpoint
+ * with one recvmmsg() call.  Returns the number of datagrams read,
+ * 0 or -1 as recvmmsg() does when nothing was pending.
+ */
+static int
+read_network_batch(
+	SOCKET			fd,
+	endpt *	itf
+	)
+{
+	static struct mmsghdr	msgs[RX_BATCH_MAX];
+	static struct iovec	iovecs[RX_BATCH_MAX];
+	static char		control[RX_BATCH_MAX][PKTSTAMP_CONTROL];
+	struct recvbuf *	rbs[RX_BATCH_MAX];
+	int			want, got, i;
+
+	want = min(rx_batch, RX_BATCH_MAX);
+	for (i = 0; i < want; i++) {
+		rbs[i] = get_free_recv_buffer();
+		if (NULL == rbs[i])
+			break;
+	}
+	want = i;
+	if (0 == want) {
+		/* out of buffers: the single-packet path drops and counts */
+		return (read_network_packet(fd, itf) > 0) ? 1 : 0;
+	}
 
-	itf->received++;
-	pkt_count.received++;
-	return (buflen);
+	memset(msgs, '\0', sizeof(msgs[0]) * (size_t)want);
+	for (i = 0; i < want; i++) {
+		iovecs[i].iov_base		= &rbs[i]->recv_buffer;
+		iovecs[i].iov_len		= sizeof(rbs[i]->recv_buffer);
+		msgs[i].msg_hdr.msg_name	= &rbs[i]->recv_srcadr;
+		msgs[i].msg_hdr.msg_namelen	= sizeof(rbs[i]->recv_srcadr);
+		msgs[i].msg_hdr.msg_iov		= &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen	= 1;
+		msgs[i].msg_hdr.msg_control	= control[i];
+		msgs[i].msg_hdr.msg_controllen	= sizeof(control[i]);
+	}
+
+	got = recvmmsg(fd, msgs, (unsigned int)want, 0, NULL);
+	if (got < 0 && EWOULDBLOCK != errno && EAGAIN != errno)
+		msyslog(LOG_ERR, "IO: recvmmsg() fd=%d: %s",
+			fd, strerror(errno));
+
+	for (i = 0; i < got; i++) {
+		rbs[i]->recv_length = msgs[i].msg_len;
+		rbs[i]->fd = fd;
+		DPRINT(3, ("read_network_batch: fd=%d length %u from %s\n",
+			   fd, msgs[i].msg_len,
+			   socktoa(&rbs[i]->recv_srcadr)));
+		process_network_packet(rbs[i], itf, &msgs[i].msg_hdr);
+	}
+	for (i = max(got, 0); i < want; i++)
+		freerecvbuf(rbs[i]);
+
+	return got;
+}
+#endif	/* HAVE_RECVMMSG */
+
+/*
+ * sockbuf_poll - count what the kernel dropped on a socket of an
+ * endpoint since the last poll, and give the socket a bigger receive
+ * buffer if it dropped anything.  Main thread, proto_lock held.
+ */
+void
+sockbuf_poll(
+	SOCKET		fd,
+	endpt *		ep,
+	struct sockbuf *sb
+	)
+{
+#ifdef USE_SO_MEMINFO
+	uint32_t	mem[SK_MEMINFO_VARS];
+	socklen_t	len = sizeof(mem);
+	socklen_t	ilen = sizeof(int);
+	uint32_t	drops;
+	int		want, got;
+
+	ZERO(mem);
+	if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, (void *)mem, &len)
+	    || len <= SK_MEMINFO_DROPS * sizeof(mem[0]))
+		return;
+	drops = mem[SK_MEMINFO_DROPS] - sb->drops;
+	sb->drops = mem[SK_MEMINFO_DROPS];
+	if (0 == drops)
+		return;
+	ep->kdropped += drops;
+
+	if (sb->maxed || 0 == sock_rcvmax)
+		return;
+	if (0 == sb->rcvbuf &&
+	    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void *)&sb->rcvbuf, &ilen))
+		return;
+	if (sb->rcvbuf >= sock_rcvmax) {
+		sb->maxed = true;
+		return;
+	}
+	/* the kernel doubles what it is asked for */
+	want = min(sb->rcvbuf, sock_rcvmax / 2);
+	got = set_sockbuf(fd, SO_RCVBUF, want);
+	if (got <= sb->rcvbuf) {
+		sb->maxed = true;
+		msyslog(LOG_WARNING,
+			"IO: %s dropped %u datagrams, receive buffer stuck "
+			"at %d bytes; raise net.core.rmem_max",
+			latoa(ep), drops, sb->rcvbuf);
+		return;
+	}
+	msyslog(LOG_INFO, "IO: %s dropped %u datagrams, receive buffer "
+		"%d bytes now", latoa(ep), drops, got);
+	sb->rcvbuf = got;
+#else
+	UNUSED_ARG(fd);
+	UNUSED_ARG(ep);
+	UNUSED_ARG(sb);
+#endif
+}
+
+
+/*
+ * sockbuf_timer - poll every socket for kernel drops, once a second
+ */
+void
+sockbuf_timer(void)
+{
+	for (endpt *ep = io_data.ep_list; ep != NULL; ep = ep->elink)
+		if (INVALID_SOCKET != ep->fd && !(INT_SHARED & ep->flags))
+			sockbuf_poll(ep->fd, ep, &ep->sockbuf);
+	workers_sockbuf();
 }
 
+
 /*
  * attempt to handle io
  */
@@ -2229,20 +3724,37 @@ io_handler(void)
 {
 	bool flag;
 	sigset_t runMask;
+#ifndef USE_IO_EVENTS
 	fd_set rdfdes;
+#endif
 	int nfound;
 
 	/*
-	 * Use select() on all input fd's for unlimited
-	 * time.  select() will terminate on SIGALARM or on the
-	 * reception of input.
+	 * Wait on all input fd's for unlimited time.  The wait will
+	 * terminate on SIGALARM or on the reception of input.
 	 */
 	pthread_sigmask(SIG_BLOCK, &blockMask, &runMask);
 	flag = sig_flags.sawALRM || sig_flags.sawQuit || sig_flags.sawHUP || \
 	  sig_flags.sawDNS;
 	if (!flag) {
+	  int was = cpu_switch(CPU_IDLE);
+
+	  restrict_publish();	/* before the responders look */
+	  proto_unlock();	/* responders may run while we sleep */
+#if defined(USE_EPOLL)
+	  nfound = epoll_pwait(io_event_fd, io_events, IO_EVENT_BATCH, -1,
+			       &runMask);
+#elif defined(USE_KQUEUE)
+	  /* EVFILT_SIGNAL closes the window opened by unblocking here */
+	  pthread_sigmask(SIG_SETMASK, &runMask, NULL);
+	  nfound = kevent(io_event_fd, NULL, 0, io_events, IO_EVENT_BATCH,
+			  NULL);
+#else
 	  rdfdes = activefds;
 	  nfound = pselect(maxactivefd+1, &rdfdes, NULL, NULL, NULL, &runMask);
+#endif
+	  proto_lock();
+	  cpu_switch(was);
 	} else {
 	  nfound = -1;
 	  errno = EINTR;
@@ -2250,19 +3762,219 @@ io_handler(void)
 	pthread_sigmask(SIG_SETMASK, &runMask, NULL);
 
 	if (nfound > 0) {
+		struct timespec start, end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pass_clients = 0;
+#ifdef USE_IO_EVENTS
+		event_handler(nfound);
+#else
 		input_handler(&rdfdes);
+#endif
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if ((end.tv_sec - start.tv_sec) * NS_PER_S +
+		    (end.tv_nsec - start.tv_nsec) > OVERLOAD_LAG)
+			overload_note();
 	} else if (nfound == -1 && errno != EINTR) {
-		msyslog(LOG_ERR, "IO: select() error: %s", strerror(errno));
+		msyslog(LOG_ERR, "IO: %s() error: %s", io_backend,
+			strerror(errno));
 	}
 #   ifdef DEBUG
 	else if (debug > 4) { /* SPECIAL DEBUG */
-		msyslog(LOG_DEBUG, "IO: select(): nfound=%d, error: %s", nfound, strerror(errno));
+		msyslog(LOG_DEBUG, "IO: %s(): nfound=%d, error: %s",
+			io_backend, nfound, strerror(errno));
 	} else {
-		DPRINT(1, ("select() returned %d: %s\n", nfound, strerror(errno)));
+		DPRINT(1, ("%s() returned %d: %s\n", io_backend, nfound,
+			   strerror(errno)));
 	}
 #   endif /* DEBUG */
 }
 
+#ifdef REFCLOCK
+/*
+ * input_refclock - read everything a readable refclock has for us
+ */
+static void
+input_refclock(
+	struct refclockio *rp
+	)
+{
+	int		buflen;
+	int		saved_errno;
+	const char *	clk;
+	SOCKET		fd = rp->fd;
+	int		was = cpu_switch(CPU_REFCLOCK);
+
+	buflen = read_refclock_packet(fd, rp);
+	/*
+	 * The first read must succeed after select()
+	 * indicates readability, or we've reached
+	 * a permanent EOF.  http://bugs.ntp.org/1732
+	 * reported ntpd munching CPU after a USB GPS
+	 * was unplugged because select was indicating
+	 * EOF but ntpd didn't remove the descriptor
+	 * from the activefds set.
+	 */
+	if (buflen < 0 && EAGAIN != errno) {
+		saved_errno = errno;
+		clk = refclock_name(rp->srcclock);
+		errno = saved_errno;
+		msyslog(LOG_ERR, "IO: %s read: %s", clk, strerror(errno));
+		maintain_activefds(fd, true);
+	} else if (0 == buflen) {
+		clk = refclock_name(rp->srcclock);
+		msyslog(LOG_ERR, "IO: %s read EOF", clk);
+		maintain_activefds(fd, true);
+	} else {
+		/* drain any remaining refclock input */
+		do {
+			buflen = read_refclock_packet(fd, rp);
+		} while (buflen > 0);
+	}
+	cpu_switch(was);
+}
+#endif /* REFCLOCK */
+
+/*
+ * input_first - true for an endpoint on the extra port.  Our own
+ * requests go out from it, so the replies to them come in there.
+ */
+static bool
+input_first(
+	const endpt *	ep
+	)
+{
+	return 0 != extra_port && SRCPORT(&ep->sin) == extra_port;
+}
+
+/*
+ * input_endpt - drain pending datagrams from a readable endpoint, up
+ * to RX_PASS_MAX of them
+ */
+static void
+input_endpt(
+	endpt *	ep
+	)
+{
+	int	buflen;
+	int	reads = 0;
+	int	was = cpu_switch(CPU_RECEIVE);
+
+	/* transmit stamps first, ahead of any reply they belong to */
+	if (ep->txstamped || (INT_POLLED & ep->flags))
+		fetch_txstamps(ep->fd, ep->phc, ep->peers);
+	if (INT_POLLED & ep->flags) {
+		/* the busy poller or the io_uring reads its datagrams */
+		cpu_switch(was);
+		return;
+	}
+
+#ifdef HAVE_RECVMMSG
+	if (rx_batch > 1
+	    && (!ep->ignore_packets || (INT_PKTINFO & ep->flags))) {
+		/* a short batch means the socket has been drained */
+		do {
+			buflen = read_network_batch(ep->fd, ep);
+			if (buflen > 0) {
+				pkt_count.handler_pkts += (uint64_t)buflen;
+				reads += buflen;
+			}
+		} while (buflen >= rx_batch && reads < RX_PASS_MAX);
+		if (buflen >= rx_batch)
+			overload_note();	/* more where those came from */
+		flush_sendpkts();
+		cpu_switch(was);
+		return;
+	}
+#endif
+	do {
+		++pkt_count.handler_pkts;
+		buflen = read_network_packet(ep->fd, ep);
+	} while (buflen > 0 && ++reads < RX_PASS_MAX);
+	if (buflen > 0)
+		overload_note();
+	flush_sendpkts();
+	cpu_switch(was);
+}
+
+#ifdef USE_IO_EVENTS
+/*
+ * event_handler - dispatch the descriptors reported ready by the
+ * event backend.  Unlike input_handler() the cost is proportional
+ * to the number of ready descriptors, not the number of open ones.
+ */
+static void
+event_handler(
+	int	nfound
+	)
+{
+	SOCKET		fd;
+	vsock_t *	lsock;
+	bool		first;
+
+	pkt_count.handler_calls++;
+
+	/* refclocks and replies first, see RX_PASS_MAX */
+	for (int i = 0; i < 2 * nfound; i++) {
+# ifdef USE_EPOLL
+		fd = io_events[i % nfound].data.fd;
+# else
+		if (EVFILT_READ != io_events[i % nfound].filter)
+			continue;	/* signal wakeup, flags already set */
+		fd = (SOCKET)io_events[i % nfound].ident;
+# endif
+		if (fd < 0 || fd >= fd_table_size)
+			continue;
+		lsock = fd_table[fd];
+		if (NULL == lsock)
+			continue;	/* closed earlier in this batch */
+		switch (lsock->owner_type) {
+# ifdef REFCLOCK
+		case FD_OWNER_REFCLOCK:
+			first = true;
+			break;
+# endif
+		case FD_OWNER_ENDPT:
+			first = input_first(lsock->owner);
+			break;
+		case FD_OWNER_ASYNCIO:
+			/* the routing socket and io_add_reader() fds: no
+			 * time stamps to lose, so they can wait */
+		default:
+			first = false;
+			break;
+		}
+		if (first != (i < nfound))
+			continue;
+
+		switch (lsock->owner_type) {
+		case FD_OWNER_ENDPT:
+			input_endpt(lsock->owner);
+			break;
+# ifdef REFCLOCK
+		case FD_OWNER_REFCLOCK:
+			input_refclock(lsock->owner);
+			break;
+# endif
+# ifdef USE_ASYNCIO_READER
+		case FD_OWNER_ASYNCIO: {
+			struct asyncio_reader *reader = lsock->owner;
+
+			/* callback may unlink and free the reader */
+			(*reader->receiver)(reader);
+			break;
+		}
+# endif
+		default:
+			msyslog(LOG_ERR, "IO: fd %d has no input handler", fd);
+			maintain_activefds(fd, true);
+			break;
+		}
+	}
+}
+
+#else /* !USE_IO_EVENTS */
+
 /*
  * input_handler - receive packets
  */
@@ -2271,16 +3983,12 @@ input_handler(
 	fd_set *	fds
 	)
 {
-	int		buflen;
-	SOCKET		fd;
 	size_t		select_count;
 	endpt *		ep;
 #ifdef REFCLOCK
 	struct refclockio *rp;
-	int		saved_errno;
-	const char *	clk;
 #endif
-#ifdef USE_ROUTING_SOCKET
+#ifdef USE_ASYNCIO_READER
 	struct asyncio_reader *	asyncio_reader;
 	struct asyncio_reader *	next_asyncio_reader;
 #endif
@@ -2288,68 +3996,38 @@ input_handler(
 	pkt_count.handler_calls++;
 	select_count = 0;
 
-	/*
-	 * If we have something to do, freeze a timestamp.
-	 * See below for the other cases (nothing left to do or error)
-	 */
-
-
 #ifdef REFCLOCK
 	/*
 	 * Check out the reference clocks first, if any
 	 */
 
 	for (rp = refio; rp != NULL; rp = rp->next) {
-		fd = rp->fd;
-
-		if (!FD_ISSET(fd, fds))
+		if (!FD_ISSET(rp->fd, fds))
 			continue;
 		++select_count;
-		buflen = read_refclock_packet(fd, rp);
-		/*
-		 * The first read must succeed after select()
-		 * indicates readability, or we've reached
-		 * a permanent EOF.  http://bugs.ntp.org/1732
-		 * reported ntpd munching CPU after a USB GPS
-		 * was unplugged because select was indicating
-		 * EOF but ntpd didn't remove the descriptor
-		 * from the activefds set.
-		 */
-		if (buflen < 0 && EAGAIN != errno) {
-			saved_errno = errno;
-			clk = refclock_name(rp->srcclock);
-			errno = saved_errno;
-			msyslog(LOG_ERR, "IO: %s read: %s", clk, strerror(errno));
-			maintain_activefds(fd, true);
-		} else if (0 == buflen) {
-			clk = refclock_name(rp->srcclock);
-			msyslog(LOG_ERR, "IO: %s read EOF", clk);
-			maintain_activefds(fd, true);
-		} else {
-			/* drain any remaining refclock input */
-			do {
-				buflen = read_refclock_packet(fd, rp);
-			} while (buflen > 0);
-		}
+		input_refclock(rp);
 	}
 #endif /* REFCLOCK */
 
 	/*
-	 * Loop through the interfaces looking for data to read.
+	 * Loop through the interfaces looking for data to read, those
+	 * carrying replies to our own requests first.
 	 */
-	for (ep = io_data.ep_list; ep != NULL; ep = ep->elink) {
-		fd = ep->fd;
-		if (FD_ISSET(fd, fds))
-			do {
+	for (int pass = 0; pass < 2; pass++) {
+		for (ep = io_data.ep_list; ep != NULL; ep = ep->elink) {
+			/* a shared socket is read through its wildcard */
+			if (!(INT_SHARED & ep->flags)
+			    && input_first(ep) == (0 == pass)
+			    && FD_ISSET(ep->fd, fds)) {
 				++select_count;
-				++pkt_count.handler_pkts;
-				buflen = read_network_packet(fd, ep);
-			} while (buflen > 0);
+				input_endpt(ep);
+			}
+		}
 	}
 
-#ifdef USE_ROUTING_SOCKET
+#ifdef USE_ASYNCIO_READER
 	/*
-	 * scan list of asyncio readers - currently only used for routing sockets
+	 * scan list of asyncio readers: routing sockets and signd
 	 */
 	asyncio_reader = asyncio_reader_list;
 
@@ -2362,24 +4040,20 @@ input_handler(
 		}
 		asyncio_reader = next_asyncio_reader;
 	}
-#endif /* USE_ROUTING_SOCKET */
+#endif /* USE_ASYNCIO_READER */
 
 	/*
 	 * Done everything from that select.
 	 * If nothing to do, just return.
-	 * If an error occurred, complain and return.
 	 */
 	if (select_count == 0) { /* We really had nothing to do */
 #ifdef DEBUG
 		if (debug) /* SPECIAL DEBUG */
 			msyslog(LOG_DEBUG, "IO: input_handler: select() returned 0");
 #endif /* DEBUG */
-		return;
 	}
-	/* We've done our work */
-	/* We're done... */
-	return;
 }
+#endif /* !USE_IO_EVENTS */
 
 
 /*
@@ -2586,26 +4260,72 @@ findclosestinterface(
 	)
 {
 	endpt *		ep;
+	endpt *		below;
+	endpt *		above;
 	endpt *		winner;
-	sockaddr_u	addr_dist;
-	sockaddr_u	min_dist;
-
-	ZERO_SOCK(&min_dist);
-	winner = NULL;
+	sockaddr_u	below_dist;
+	sockaddr_u	above_dist;
+	size_t		lo, hi, mid, i;
+	int		cmp;
+
+	if (ep_sorted_stale)
+		ep_sorted_build();
+
+	/* the first endpoint at or above addr */
+	lo = 0;
+	hi = ep_sorted_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ep_addr_cmp(addr, ep_sorted[mid]) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	for (ep = io_data.ep_list; ep != NULL; ep = ep->elink) {
-		if (ep->ignore_packets ||
-		    AF(addr) != ep->family ||
-		    (unsigned int)flags & ep->flags)
+	/*
+	 * The nearest usable one on each side.  Ties go to the oldest
+	 * endpoint, as they did when the list was searched in order,
+	 * so below keeps looking among those with the same address.
+	 */
+	below = NULL;
+	for (i = lo; i-- > 0; ) {
+		ep = ep_sorted[i];
+		if (AF(addr) != ep->family)
+			break;
+		if (below != NULL &&
+		    ep_addr_cmp(&below->sin, ep) != COMPARE_EQUAL)
+			break;
+		if (ep->ignore_packets || (unsigned int)flags & ep->flags)
+			continue;
+		below = ep;
+	}
+	above = NULL;
+	for (i = lo; i < ep_sorted_count; i++) {
+		ep = ep_sorted[i];
+		if (AF(addr) != ep->family)
+			break;
+		if (ep->ignore_packets || (unsigned int)flags & ep->flags)
 			continue;
+		above = ep;
+		break;
+	}
 
-		calc_addr_distance(&addr_dist, addr, &ep->sin);
-		if (NULL == winner ||
-		    -1 == cmp_addr_distance(&addr_dist, &min_dist)) {
-			min_dist = addr_dist;
-			winner = ep;
-		}
+	if (NULL == below)
+		winner = above;
+	else if (NULL == above)
+		winner = below;
+	else {
+		calc_addr_distance(&below_dist, addr, &below->sin);
+		calc_addr_distance(&above_dist, addr, &above->sin);
+		cmp = cmp_addr_distance(&below_dist, &above_dist);
+		if (COMPARE_LESSTHAN == cmp)
+			winner = below;
+		else if (COMPARE_GREATERTHAN == cmp)
+			winner = above;
+		else
+			winner = (below->ifnum < above->ifnum) ? below : above;
 	}
+
 	if (NULL == winner)
 		DPRINT(4, ("findclosestinterface(%s) failed\n",
 			   socktoa(addr)));
@@ -2617,6 +4337,72 @@ findclosestinterface(
 }
 
 
+/*
+ * ep_addr_cmp - order an address against an endpoint's, by family
+ *		 and then numerically, ignoring the port and scope
+ */
+static int
+ep_addr_cmp(
+	const sockaddr_u *	addr,
+	const endpt *		ep
+	)
+{
+	int	cmp;
+
+	if (AF(addr) != ep->family)
+		return (AF(addr) < ep->family)
+			   ? COMPARE_LESSTHAN
+			   : COMPARE_GREATERTHAN;
+	if (IS_IPV4(addr)) {
+		if (SRCADR(addr) == SRCADR(&ep->sin))
+			return COMPARE_EQUAL;
+		return (SRCADR(addr) < SRCADR(&ep->sin))
+			   ? COMPARE_LESSTHAN
+			   : COMPARE_GREATERTHAN;
+	}
+	cmp = memcmp(NSRCADR6(addr), NSRCADR6(&ep->sin),
+		     sizeof(NSRCADR6(addr)));
+	return (cmp > 0) - (cmp < 0);
+}
+
+
+/* qsort() helper: by address, then oldest first */
+static int
+ep_sorted_cmp(
+	const void *	v1,
+	const void *	v2
+	)
+{
+	const endpt *	ep1 = *(const endpt * const *)v1;
+	const endpt *	ep2 = *(const endpt * const *)v2;
+	int		cmp;
+
+	cmp = ep_addr_cmp(&ep1->sin, ep2);
+	if (cmp != COMPARE_EQUAL)
+		return cmp;
+	return (ep1->ifnum > ep2->ifnum) - (ep1->ifnum < ep2->ifnum);
+}
+
+
+static void
+ep_sorted_build(void)
+{
+	endpt *	ep;
+	size_t	n;
+
+	n = 0;
+	for (ep = io_data.ep_list; ep != NULL; ep = ep->elink)
+		n++;
+	ep_sorted = erealloc(ep_sorted, (n ? n : 1) * sizeof(*ep_sorted));
+	n = 0;
+	for (ep = io_data.ep_list; ep != NULL; ep = ep->elink)
+		ep_sorted[n++] = ep;
+	qsort(ep_sorted, n, sizeof(*ep_sorted), ep_sorted_cmp);
+	ep_sorted_count = n;
+	ep_sorted_stale = false;
+}
+
+
 /*
  * calc_addr_distance - calculate the distance between two addresses,
  *			the absolute value of the difference between
@@ -2736,6 +4522,9 @@ io_clr_stats(void)
 {
 	pkt_count.dropped = 0;
 	pkt_count.ignored = 0;
+	pkt_count.shed = 0;
+	pkt_count.overload_shed = 0;
+	pkt_count.overloads = 0;
 	pkt_count.received = 0;
 	pkt_count.sent = 0;
 	pkt_count.notsent = 0;
@@ -2762,6 +4551,29 @@ uint64_t ignored_count(void) {
   return pkt_count.ignored;
 }
 
+/*
+ * shed_count - return the number of packets shed as floods
+ */
+uint64_t shed_count(void) {
+  return pkt_count.shed;
+}
+
+/*
+ * overload_shed_count - return the number of client requests shed
+ * while the main loop was overloaded
+ */
+uint64_t overload_shed_count(void) {
+  return pkt_count.overload_shed;
+}
+
+/*
+ * overloads_count - return the number of times the main loop fell
+ * behind
+ */
+uint64_t overloads_count(void) {
+  return pkt_count.overloads;
+}
+
 /*
  * received_count - return the number of received packets
  */
@@ -2777,6 +4589,21 @@ void inc_received_count(void) {
   pkt_count.received++;
 }
 
+/*
+ * inc_ignored_count - increment the number of ignored packets
+ */
+void inc_ignored_count(void) {
+  pkt_count.ignored++;
+}
+
+/*
+ * add_sent_counts - account for packets sent outside sendpkt()
+ */
+void add_sent_counts(unsigned long sent, unsigned long notsent) {
+  pkt_count.sent += sent;
+  pkt_count.notsent += notsent;
+}
+
 /*
  * sent_count - return the number of sent packets
  */
@@ -2829,6 +4656,8 @@ io_addclock(
 	 * in use.  There is a harmless (I hope) race condition here.
 	 */
 	rio->active = true;
+	if (NULL == rio->rb)
+		rio->rb = emalloc_zero(sizeof(*rio->rb));
 
 	/*
 	 * enqueue
@@ -2838,7 +4667,12 @@ io_addclock(
 	/*
 	 * register fd
 	 */
-	add_fd_to_list(rio->fd, FD_TYPE_FILE);
+	add_fd_to_list(rio->fd, FD_TYPE_FILE, FD_OWNER_REFCLOCK, rio);
+
+	/* the refclock input thread reads it, if asked and able */
+	if (NULL != rio->srcclock && (FLAG_IOTHREAD & rio->srcclock->cfg.flags)
+	    && refio_add(rio))
+		maintain_activefds(rio->fd, true);
 
 	return true;
 }
@@ -2858,6 +4692,7 @@ io_closeclock(
 	 * Remove structure from the list
 	 */
 	rio->active = false;
+	refio_remove(rio);
 	UNLINK_SLIST(unlinked, refio, rio, next, struct refclockio);
 	if (NULL != unlinked) {
 		/*
@@ -2876,15 +4711,30 @@ io_closeclock(
 static void
 add_fd_to_list(
 	SOCKET fd,
-	enum desc_type type
+	enum desc_type type,
+	enum desc_owner owner_type,
+	void *owner
 	)
 {
 	vsock_t *lsock = emalloc(sizeof(*lsock));
 
 	lsock->fd = fd;
 	lsock->type = type;
+	lsock->owner_type = owner_type;
+	lsock->owner = owner;
 
 	LINK_SLIST(fd_list, lsock, link);
+#ifdef USE_IO_EVENTS
+	if (fd >= fd_table_size) {
+		int newsize = max(fd + 1, 2 * fd_table_size);
+
+		fd_table = erealloc_zero(fd_table,
+					 (size_t)newsize * sizeof(*fd_table),
+					 (size_t)fd_table_size * sizeof(*fd_table));
+		fd_table_size = newsize;
+	}
+	fd_table[fd] = lsock;
+#endif
 	maintain_activefds(fd, false);
 }
 
@@ -2903,6 +4753,15 @@ close_and_delete_fd_from_list(
 		return;
 	}
 
+	/*
+	 * remove from activefds while the descriptor is still open,
+	 * epoll and kqueue refuse to deregister a closed one
+	 */
+	maintain_activefds(fd, true);
+#ifdef USE_IO_EVENTS
+	fd_table[fd] = NULL;
+#endif
+
 	switch (lsock->type) {
 
 	case FD_TYPE_SOCKET:
@@ -2921,10 +4780,6 @@ close_and_delete_fd_from_list(
 	}
 
 	free(lsock);
-	/*
-	 * remove from activefds
-	 */
-	maintain_activefds(fd, true);
 }
 
 
@@ -2934,25 +4789,45 @@ add_addr_to_list(
 	endpt *		ep
 	)
 {
-	remaddr_t *laddr;
-
-#ifdef DEBUG
-	if (find_addr_in_list(addr) == NULL) {
-#endif
-		/* not there yet - add to list */
-		laddr = emalloc(sizeof(*laddr));
-		laddr->addr = *addr;
-		laddr->ep = ep;
+	remaddr_t *	laddr;
+	remaddr_t **	old;
+	size_t		oldsize;
+	size_t		i;
 
-		LINK_SLIST(remoteaddr_list, laddr, link);
-
-		DPRINT(4, ("Added addr %s to list of addresses\n",
-			   socktoa(addr)));
 #ifdef DEBUG
-	} else
+	if (find_addr_in_list(addr) != NULL) {
 		DPRINT(4, ("WARNING: Attempt to add duplicate addr %s to address list\n",
 			   socktoa(addr)));
+		return;
+	}
 #endif
+	if (remoteaddr_count >= remoteaddr_size) {
+		old = remoteaddr_hash;
+		oldsize = remoteaddr_size;
+		remoteaddr_size = oldsize ? 2 * oldsize : INIT_REMADDR_HASH;
+		remoteaddr_hash = emalloc_zero(remoteaddr_size * sizeof(*old));
+		for (i = 0; i < oldsize; i++)
+			while (old[i] != NULL) {
+				laddr = old[i];
+				old[i] = laddr->link;
+				LINK_SLIST(remoteaddr_hash[sock_hash(&laddr->addr)
+					   & (remoteaddr_size - 1)],
+					   laddr, link);
+			}
+		free(old);
+	}
+
+	/* not there yet - add to list */
+	laddr = emalloc(sizeof(*laddr));
+	laddr->addr = *addr;
+	laddr->ep = ep;
+
+	i = sock_hash(addr) & (remoteaddr_size - 1);
+	LINK_SLIST(remoteaddr_hash[i], laddr, link);
+	remoteaddr_count++;
+
+	DPRINT(4, ("Added addr %s to list of addresses\n",
+		   socktoa(addr)));
 }
 
 
@@ -2961,16 +4836,21 @@ delete_interface_from_list(
 	endpt *iface
 	)
 {
-	remaddr_t *unlinked;
+	remaddr_t **	pp;
+	remaddr_t *	unlinked;
 
-	for (;;) {
-		UNLINK_EXPR_SLIST(unlinked, remoteaddr_list, iface ==
-		    UNLINK_EXPR_SLIST_CURRENT()->ep, link,
-		    remaddr_t);
+	if (0 == remoteaddr_size)
+		return;
 
-		if (unlinked == NULL) {
-			break;
+	/* entries are only ever added under the endpoint's address */
+	pp = &remoteaddr_hash[sock_hash(&iface->sin) & (remoteaddr_size - 1)];
+	while ((unlinked = *pp) != NULL) {
+		if (unlinked->ep != iface) {
+			pp = &unlinked->link;
+			continue;
 		}
+		*pp = unlinked->link;
+		remoteaddr_count--;
 		DPRINT(4, ("Deleted addr %s for interface #%u %s "
 			   "from list of addresses\n",
 			   socktoa(&unlinked->addr), iface->ifnum,
@@ -2990,14 +4870,16 @@ find_addr_in_list(
 	DPRINT(4, ("Searching for addr %s in list of addresses - ",
 		   socktoa(addr)));
 
-	for (entry = remoteaddr_list;
-	     entry != NULL;
-	     entry = entry->link) {
-		if (ADDR_PORT_EQ(&entry->addr, addr)) {
-			DPRINT(4, ("FOUND\n"));
-			return entry->ep;
+	if (remoteaddr_size != 0)
+		for (entry = remoteaddr_hash[sock_hash(addr)
+					     & (remoteaddr_size - 1)];
+		     entry != NULL;
+		     entry = entry->link) {
+			if (ADDR_PORT_EQ(&entry->addr, addr)) {
+				DPRINT(4, ("FOUND\n"));
+				return entry->ep;
+			}
 		}
-	}
 
 	DPRINT(4, ("NOT FOUND\n"));
 	return NULL;
@@ -3048,11 +4930,19 @@ process_routing_msgs(struct asyncio_reader *reader)
 		if (errno == ENOBUFS) {
 			msyslog(LOG_ERR,
 				"IO: routing socket reports: %s", strerror(errno));
+#ifdef USE_NETLINK_ADDRS
+			/* we missed something, look at everything */
+			rescan_needed = true;
+			timer_interfacetimeout(current_time + UPDATE_GRACE);
+#endif
 		} else {
 			msyslog(LOG_ERR,
 				"IO: routing socket reports: %s - disabling", strerror(errno));
 			remove_asyncio_reader(reader);
 			delete_asyncio_reader(reader);
+#ifdef USE_NETLINK_ADDRS
+			netlink_addrs = false;
+#endif
 		}
 		return;
 	}
@@ -3082,10 +4972,29 @@ process_routing_msgs(struct asyncio_reader *reader)
 		msg_type = rtm.rtm_type;
 #endif
 		switch (msg_type) {
-#ifdef RTM_NEWADDR
+#ifdef USE_NETLINK_ADDRS
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			netlink_addr_msg(nh);
+			/* peers may want the new address, or a new one */
+			timer_interfacetimeout(current_time + UPDATE_GRACE);
+			break;
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			/*
+			 * A link going down or losing carrier keeps its
+			 * IPv4 addresses without a word about them.
+			 */
+			DPRINT(3, ("routing message op = %d: scheduling interface rescan\n",
+				   msg_type));
+			rescan_needed = true;
+			timer_interfacetimeout(current_time + UPDATE_GRACE);
+			break;
+#endif
+#if defined(RTM_NEWADDR) && !defined(USE_NETLINK_ADDRS)
 		case RTM_NEWADDR:
 #endif
-#ifdef RTM_DELADDR
+#if defined(RTM_DELADDR) && !defined(USE_NETLINK_ADDRS)
 		case RTM_DELADDR:
 #endif
 #ifdef RTM_ADD
@@ -3109,10 +5018,10 @@ process_routing_msgs(struct asyncio_reader *reader)
 #ifdef RTM_IFANNOUNCE
 		case RTM_IFANNOUNCE:
 #endif
-#ifdef RTM_NEWLINK
+#if defined(RTM_NEWLINK) && !defined(USE_NETLINK_ADDRS)
 		case RTM_NEWLINK:
 #endif
-#ifdef RTM_DELLINK
+#if defined(RTM_DELLINK) && !defined(USE_NETLINK_ADDRS)
 		case RTM_DELLINK:
 #endif
 #ifdef RTM_NEWROUTE
@@ -3146,6 +5055,154 @@ process_routing_msgs(struct asyncio_reader *reader)
 	}
 }
 
+#ifdef USE_NETLINK_ADDRS
+/*
+ * netlink_addr_msg - apply one RTM_NEWADDR or RTM_DELADDR as it
+ * comes, rather than enumerating every address on the box again
+ */
+static void
+netlink_addr_msg(
+	struct nlmsghdr *nh
+	)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	struct rtattr *	rta;
+	int		len;
+	const void *	addr = NULL;
+	const char *	label = NULL;
+	char		devname[IF_NAMESIZE];
+	uint32_t	ifa_flags;
+	size_t		addrlen;
+	isc_interface_t	isc_if;
+	struct ifreq	ifr;
+	endpt		enumep;
+	endpt *		ep;
+	uint16_t	ports[2];
+	int		nports, i, fd;
+	bool		new_interface_found = false;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return;
+	if (AF_INET == ifa->ifa_family)
+		addrlen = sizeof(struct in_addr);
+	else if (AF_INET6 == ifa->ifa_family)
+		addrlen = sizeof(struct in6_addr);
+	else
+		return;
+
+	/*
+	 * IFA_LOCAL is our end of a point-to-point link, IFA_ADDRESS
+	 * the other.  IPv6 only sends IFA_ADDRESS unless it is one.
+	 */
+	ifa_flags = ifa->ifa_flags;
+	len = (int)IFA_PAYLOAD(nh);
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFA_LOCAL:
+			if (RTA_PAYLOAD(rta) >= addrlen)
+				addr = RTA_DATA(rta);
+			break;
+		case IFA_ADDRESS:
+			if (RTA_PAYLOAD(rta) >= addrlen && NULL == addr)
+				addr = RTA_DATA(rta);
+			break;
+		case IFA_LABEL:
+			label = RTA_DATA(rta);
+			break;
+#ifdef IFA_FLAGS
+		case IFA_FLAGS:
+			if (RTA_PAYLOAD(rta) >= sizeof(ifa_flags))
+				memcpy(&ifa_flags, RTA_DATA(rta),
+				       sizeof(ifa_flags));
+			break;
+#endif
+		default:
+			break;
+		}
+	}
+	if (NULL == addr)
+		return;
+
+	ZERO(isc_if);
+	isc_if.af = ifa->ifa_family;
+	isc_if.address.family = ifa->ifa_family;
+	memcpy(&isc_if.address.type, addr, addrlen);
+	/* getifaddrs() only scopes link-local addresses */
+	if (AF_INET6 == ifa->ifa_family &&
+	    IN6_IS_ADDR_LINKLOCAL(&isc_if.address.type.in6))
+		isc_if.address.zone = ifa->ifa_index;
+	isc_if.ifindex = ifa->ifa_index;
+
+	nports = 0;
+	if (extra_port)
+		/* do first so our requests are sent from extra_port */
+		ports[nports++] = extra_port;
+	ports[nports++] = NTP_PORT;
+
+	if (RTM_DELADDR == nh->nlmsg_type) {
+		for (i = 0; i < nports; i++) {
+			init_interface(&enumep);
+			convert_isc_if(&isc_if, &enumep, ports[i]);
+			ep = getinterface(&enumep.sin, INT_WILDCARD);
+			if (NULL == ep)
+				continue;
+			if (!strcmp(ep->name, "*multiple*")) {
+				/* another interface may still have it */
+				rescan_needed = true;
+				continue;
+			}
+			DPRINT_INTERFACE(3, (ep, "netlink ",
+					     "GONE - deleting\n"));
+			drop_interface(ep);
+		}
+		return;
+	}
+
+	/* a new address is not ours until DAD is done with it */
+	if (ifa_flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED))
+		return;
+
+	/* the link it is on has to be up, as for a full scan */
+	if (NULL == if_indextoname(ifa->ifa_index, devname))
+		return;
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return;
+	ZERO(ifr);
+	strlcpy(ifr.ifr_name, devname, sizeof(ifr.ifr_name));
+	i = ioctl(fd, SIOCGIFFLAGS, &ifr);
+	close(fd);
+	if (i < 0 || !(ifr.ifr_flags & IFF_RUNNING))
+		return;
+	if (ifr.ifr_flags & IFF_UP)
+		isc_if.flags |= INTERFACE_F_UP;
+	if (ifr.ifr_flags & IFF_LOOPBACK)
+		isc_if.flags |= INTERFACE_F_LOOPBACK;
+	strlcpy(isc_if.name, (NULL != label) ? label : devname,
+		sizeof(isc_if.name));
+
+	for (i = 0; i < nports; i++) {
+		if (!interface_usable(&isc_if, &enumep, ports[i]))
+			continue;
+		/* address lifetimes are refreshed with RTM_NEWADDR too */
+		if (NULL != getinterface(&enumep.sin, INT_WILDCARD))
+			continue;
+		ep = create_interface(ports[i], &enumep);
+		if (ep == NULL) {
+			msyslog(LOG_INFO,
+				"IO: failed to init interface for %s",
+				sockporttoa(&enumep.sin));
+			continue;
+		}
+		new_interface_found = true;
+		ep->inuse = true;
+		DPRINT_INTERFACE(3, (ep, "netlink ", " new - created\n"));
+	}
+
+	if (new_interface_found)
+		dns_try_again();
+}
+#endif	/* USE_NETLINK_ADDRS */
+
 /*
  * set up routing notifications
  */
@@ -3178,6 +5235,13 @@ init_async_notifications(void)
 			"IO: bind failed on routing socket (%s) - using polled interface update", strerror(errno));
 		return;
 	}
+	/*
+	 * Addresses may have changed since create_sockets() had its
+	 * look, so the first update is a full one.
+	 */
+	netlink_addrs = true;
+	rescan_needed = true;
+	timer_interfacetimeout(current_time + UPDATE_GRACE);
 #endif
 	make_socket_nonblocking(fd);
 
@@ -59,6 +59,7 @@ struct leap_head {
 	time_t   ttime;	 /* nominal transition time (next era start)   */
 	time_t   stime;	 /* schedule time (when we take notice)        */
 	time_t   ebase;	 /* base time of this leap era                 */
+	uint64_t quiet;	 /* nothing to report in [ebase, ebase+quiet)  */
 	bool     dynls;	 /* next leap is dynamic (by peer request)     */
 };
 typedef struct leap_head leap_head_t;
@@ -80,6 +81,10 @@ static char * skipws(char*) __attribute__((pure));
 static bool   parsefail(const char * cp, const char * ep);
 static void   reload_limits(leap_table_t*, time_t);
 static void   reset_times(leap_table_t*);
+static void   set_quiet(leap_table_t*);
+static bool   load_stream_into(leap_table_t*, FILE*, const char*, bool);
+static FILE * open_changed(const char*, struct stat*, bool, bool);
+static void   log_loaded(const leap_table_t*, const char*);
 static bool   leapsec_add(leap_table_t*, time_t, int);
 static bool   leapsec_raw(leap_table_t*, time_t, int, bool);
 
@@ -276,6 +281,15 @@ leapsec_query(
 	pt    = leapsec_get_table(false);
 	memset(qr, 0, sizeof(leap_result_t));
 
+	/* The common case, by far: inside the current era and before
+	 * the schedule limit of the next leap, if there is one.  The
+	 * unsigned difference puts times before ebase out of range too.
+	 */
+	if ((uint64_t)when - (uint64_t)pt->head.ebase < pt->head.quiet) {
+		qr->tai_offs = pt->head.this_tai;
+		return false;
+	}
+
 	if (when < pt->head.ebase) {
 		/* Most likely after leap frame reset. Could also be a
 		 * backstep of the system clock. Anyway, get the new
@@ -374,6 +388,24 @@ leapsec_load_stream(
 	bool  logall)
 {
 	leap_table_t *pt;
+
+	pt = leapsec_get_table(true);
+	if (!load_stream_into(pt, ifp, fname, logall))
+		return false;
+	log_loaded(pt, fname);
+	return leapsec_set_table(pt);
+}
+
+/* [internal] Check and load a stream into a table that is not in
+ * use, so this is safe off the main thread.
+ */
+static bool
+load_stream_into(
+	leap_table_t * pt   ,
+	FILE         * ifp  ,
+	const char   * fname,
+	bool  logall)
+{
 	int           rcheck;
 
 	if (NULL == fname) {
@@ -410,7 +442,6 @@ leapsec_load_stream(
 		return false;
 
 	rewind(ifp);
-	pt = leapsec_get_table(true);
 	if (!leapsec_load(pt, (leapsec_reader)getc, ifp)) {
 		switch (errno) {
 		case EINVAL:
@@ -428,6 +459,19 @@ leapsec_load_stream(
 		}
 		return false;
 	}
+	return true;
+}
+
+/* [internal] Say what we got.  Main thread only, for rfc3339time().
+ */
+static void
+log_loaded(
+	const leap_table_t * pt   ,
+	const char         * fname)
+{
+	if (NULL == fname) {
+		fname = "<unknown>";
+	}
 
 	if (pt->head.size)
 		msyslog(LOG_NOTICE, "CLOCK: %s ('%s'): loaded, expire=%s last=%s ofs=%d",
@@ -438,8 +482,6 @@ leapsec_load_stream(
 			"CLOCK: %s ('%s'): loaded, expire=%s ofs=%d (no entries after build date)",
 			logPrefix, fname, rfc3339time(pt->head.expire),
 			pt->head.base_tai);
-
-	return leapsec_set_table(pt);
 }
 
 /* ------------------------------------------------------------------ */
@@ -451,12 +493,68 @@ leapsec_load_file(
 	bool   logall)
 {
 	FILE       * fp;
-	struct stat  sb_new;
 	int          rc;
 
+	if (NULL == (fp = open_changed(fname, sb_old, force, logall)))
+		return false;
+	rc = leapsec_load_stream(fp, fname, logall);
+	fclose(fp);
+	return rc;
+}
+
+/* ------------------------------------------------------------------ */
+leap_table_t *
+leapsec_read_file(
+	const char  * fname,
+	struct stat * sb_old,
+	bool   force,
+	bool   logall)
+{
+	FILE         * fp;
+	leap_table_t * pt;
+
+	if (NULL == (fp = open_changed(fname, sb_old, force, logall)))
+		return NULL;
+	pt = emalloc(sizeof(*pt));
+	if (!load_stream_into(pt, fp, fname, logall)) {
+		free(pt);
+		pt = NULL;
+	}
+	fclose(fp);
+	return pt;
+}
+
+/* ------------------------------------------------------------------ */
+bool
+leapsec_install(
+	const leap_table_t * pnew,
+	const char         * fname)
+{
+	leap_table_t *pt;
+
+	log_loaded(pnew, fname);
+	pt = leapsec_get_table(true);
+	memcpy(pt, pnew, sizeof(leap_table_t));
+	reset_times(pt);
+	return leapsec_set_table(pt);
+}
+
+/* [internal] Open the leap file if it has changed since 'sb_old', or
+ * in any case if 'force' is set.  NULL if there is nothing to load.
+ */
+static FILE *
+open_changed(
+	const char  * fname,
+	struct stat * sb_old,
+	bool   force,
+	bool   logall)
+{
+	FILE       * fp;
+	struct stat  sb_new;
+
 	/* just do nothing if there is no leap file */
 	if ( !(fname && *fname) )
-		return false;
+		return NULL;
 
 	/* try to stat the leapfile */
 	/* coverity[toctou] */
@@ -464,7 +562,7 @@ leapsec_load_file(
 		if (logall)
 			msyslog(LOG_ERR, "CLOCK: %s ('%s'): stat failed: %s",
 				logPrefix, fname, strerror(errno));
-		return false;
+		return NULL;
 	}
 
 	/* silently skip to postcheck if no new file found */
@@ -473,7 +571,7 @@ leapsec_load_file(
 		 && sb_old->st_mtime == sb_new.st_mtime
 		 && sb_old->st_ctime == sb_new.st_ctime
 		   )
-			return false;
+			return NULL;
 		*sb_old = sb_new;
 	}
 
@@ -499,12 +597,9 @@ leapsec_load_file(
 			msyslog(LOG_ERR,
 				"CLOCK: %s ('%s'): open failed: %s",
 				logPrefix, fname, strerror(errno));
-		return false;
+		return NULL;
 	}
-
-	rc = leapsec_load_stream(fp, fname, logall);
-	fclose(fp);
-	return rc;
+	return fp;
 }
 
 /* ------------------------------------------------------------------ */
@@ -600,6 +695,25 @@ reset_times(
 	pt->head.stime = pt->head.ebase;
 	pt->head.ttime = pt->head.ebase;
 	pt->head.dtime = pt->head.ebase;
+	set_quiet(pt);
+}
+
+/* [internal] Work out how long leapsec_query() has nothing to say
+ * after the start of the era: up to the schedule limit, or the due
+ * time if that comes first.  A leap smear does not start any earlier,
+ * as check_leapsec() only opens the smear window once a query has
+ * reported the coming leap.
+ */
+static void
+set_quiet(
+	leap_table_t * pt)
+{
+	time_t limit = min(pt->head.stime, pt->head.dtime);
+
+	if (limit > pt->head.ebase)
+		pt->head.quiet = (uint64_t)limit - (uint64_t)pt->head.ebase;
+	else
+		pt->head.quiet = 0;
 }
 
 /* [internal] Add raw data to the table, removing old entries on the
@@ -752,6 +866,7 @@ reload_limits(
 		pt->head.next_tai = pt->head.this_tai;
 		pt->head.dynls    = false;
 	}
+	set_quiet(pt);
 }
 
 /* [internal] Take a time stamp and create a leap second frame for
@@ -102,6 +102,35 @@ typedef struct leap_signature leap_signature_t;
 
 #ifdef ENABLE_LEAP_SMEAR
 
+/*
+ * The smear as a straight line about the second it was last worked
+ * out for, so the reply path can smear each time stamp for the instant
+ * it stands for with a multiply and an add, instead of using the
+ * offset of the whole second.  The line only holds for LEAP_SMEAR_SPAN
+ * seconds either side, and not past the ends of the smear interval;
+ * beyond that the offset stays at the value at the edge.
+ */
+#define LEAP_SMEAR_SPAN	16
+
+struct leap_smear_seg {
+	l_fp	t0;	/* NTP time the line is drawn from */
+	l_fp	off0;	/* smear offset at t0 */
+	int64_t	rate;	/* offset change per second, scaled by 2^32 */
+	int64_t	lo;	/* span about t0, as l_fp differences */
+	int64_t	hi;
+};
+
+static inline l_fp leap_smear_at(const struct leap_smear_seg *seg, l_fp t) {
+	int64_t dt = (int64_t)(t - seg->t0);
+
+	if (dt < seg->lo)
+		dt = seg->lo;
+	else if (dt > seg->hi)
+		dt = seg->hi;
+	/* 16 bits off dt first, so the product fits in 64 */
+	return seg->off0 + (l_fp)(((dt >> 16) * seg->rate) >> 16);
+}
+
 struct leap_smear_info {
 	bool enabled;       /* true if smearing is generally enabled */
 	bool in_progress;   /* true if smearing is in progress, i.e. the offset has been computed */
@@ -111,6 +140,7 @@ struct leap_smear_info {
 	long interval;      /* smear interval, in [s], should be at least some hours */
 	double intv_start;  /* start time of the smear interval */
 	double intv_end;    /* end time of the smear interval */
+	struct leap_smear_seg seg; /* the smear about the current second */
 };
 typedef struct leap_smear_info leap_smear_info_t;
 
@@ -164,6 +194,18 @@ extern bool leapsec_load_stream(FILE * fp, const char * fname,
 extern bool leapsec_load_file(const char * fname, struct stat * sb,
 				     bool force, bool logall);
 
+/* Like 'leapsec_load_file()', but into a table of its own, which is
+ * returned on success and must be freed by the caller.  Leaves the
+ * tables in use alone, so it can be called from any thread.
+ */
+extern leap_table_t *leapsec_read_file(const char * fname, struct stat * sb,
+				     bool force, bool logall);
+
+/* Make a copy of a table from 'leapsec_read_file()' the current one,
+ * logging what it holds.
+ */
+extern bool leapsec_install(const leap_table_t * pt, const char * fname);
+
 /* Get the current leap data signature. This consists of the last
  * ransition, the table expiration, and the total TAI difference at the
  * last transition. This is valid even if the leap transition itself was
@@ -20,6 +20,9 @@
 #include "ntp_stdlib.h"
 #include "ntp_syscall.h"
 #include "timespecops.h"
+#ifdef REFCLOCK
+# include "ntp_refclock.h"
+#endif
 
 #define NTP_MAXFREQ	500e-6
 
@@ -45,6 +48,10 @@
 #define CLOCK_LIMIT	30	/* poll-adjust threshold */
 #define CLOCK_PGATE	4.	/* poll-adjust gate */
 /* #define PPS_MAXAGE	120	* kernel pps signal timeout (s) UNUSED */
+#define FAST_MAXRATE	64	/* fastest fast loop (updates/s) */
+#define	SLEW_SHARE	4.	/* held slew below jitter / this */
+#define	SLEW_MAXHOLD	250e-6	/* held slew never above (s) */
+#define	KERN_FREQTOL	1e-9	/* kernel frequency change to skip (s/s) */
 
 /*
  * Clock discipline state machine. This is used to control the
@@ -105,6 +112,7 @@
  */
 static double	clock_minstep = CLOCK_MINSTEP; /* stepout threshold */
 static double	clock_panic = CLOCK_PANIC; /* panic threshold */
+static double	poll_budget;	/* predicted error for poll (s), or 0 */
 double	clock_phi = CLOCK_PHI;	/* dispersion rate (s/s) */
 struct ntp_loop_data loop_data = {
 	.clock_max_back = CLOCK_MAX, /* step threshold */
@@ -124,6 +132,7 @@ static bool loop_started;	/* true after LOOP_DRIFTINIT */
 static void rstclock (int, double); /* transition function */
 static double direct_freq(double); /* direct set frequency */
 static void set_freq(double);	/* set frequency */
+static uint8_t budget_poll(const struct peer *); /* poll for budget */
 
 #ifndef PATH_MAX
 # define PATH_MAX MAX_PATH
@@ -139,6 +148,25 @@ static unsigned int loop_tai;	/* last TAI offset (non-lockclock case only) */
 static	void	start_kern_loop(void);
 static	void	stop_kern_loop(void);
 
+/*
+ * Adjustment coalescing.  Slews of the daemon loop, and of the fast
+ * loop without the kernel, are held in slew_held until together they
+ * are worth an adjtime() call: a quarter of the clock jitter, so the
+ * phase they leave out is lost in the noise, and never more than the
+ * kernel slews in half a second.  kern_mirror is what the kernel last
+ * said it has; kern_coalesce() drops from a call whatever would change
+ * it by less than is worth a system call.
+ */
+static double	slew_held;	/* slew not yet passed to adjtime() (s) */
+static struct {
+	bool		known;		/* the fields below are valid */
+	long		freq;		/* kernel frequency (scaled ppm) */
+	uptime_t	errtime;	/* when the error estimates went in */
+} kern_mirror;
+static	void	slew_clock(double);
+static	void	kern_note(const struct timex *, int);
+static	bool	kern_coalesce(struct timex *);
+
 /*
  * Clock state machine control flags
  */
@@ -164,6 +192,20 @@ struct clock_state_machine clkstate = {
   .allan_xpt = CLOCK_ALLAN,
 };
 
+/*
+ * Fast loop.  With tinker fastloop, timer() ticks fastloop_rate times
+ * a second and calls fast_clock() at each tick.  When the system peer is
+ * a refclock whose driver can take a reading on demand, the fast loop
+ * takes one each tick and steers the clock frequency with a PI
+ * controller of its own, in place of local_clock()'s once-a-poll
+ * updates.  The integral term is drift_comp, so the frequency file and
+ * the normal loop carry on from it.
+ */
+int	fastloop_rate;	/* fast loop updates/s, 0 = off */
+static struct peer *fast_peer;	/* source the fast loop holds, or NULL */
+static int	fast_misses;	/* ticks in a row without a reading */
+static void	fast_release(const char *);
+
 /*
  * Huff-n'-puff filter variables
  */
@@ -496,6 +538,29 @@ local_clock(
 		exit(0);
 	}
 
+	/*
+	 * While the fast loop holds the clock, updates from its source
+	 * only keep the jitter and the statistics going.  One beyond the
+	 * step threshold hands the clock back to this loop.
+	 */
+	if (fast_peer != NULL && fast_peer == peer) {
+		if (  ( fp_offset > loop_data.clock_max_fwd  && loop_data.clock_max_fwd  > 0)
+		   || (-fp_offset > loop_data.clock_max_back && loop_data.clock_max_back > 0)) {
+			fast_release("offset beyond step threshold");
+		} else {
+			etemp = SQUARE(clkstate.clock_jitter);
+			dtemp = SQUARE(fp_offset - clkstate.last_offset);
+			clkstate.clock_jitter = SQRT(etemp + (dtemp - etemp) /
+			    CLOCK_AVG);
+			clkstate.last_offset = fp_offset;
+			clock_epoch = current_time;
+			record_loop_stats(fp_offset, loop_data.drift_comp,
+			    clkstate.clock_jitter, loop_data.clock_stability,
+			    clkstate.sys_poll);
+			return (1);
+		}
+	}
+
 	/*
 	 * The huff-n'-puff filter finds the lowest delay in the recent
 	 * interval. This is used to correct the offset by one-half the
@@ -612,6 +677,7 @@ local_clock(
 			    fp_offset);
 			report_event(EVNT_CLOCKRESET, NULL, tbuf);
 			step_systime(fp_offset);
+			slew_held = 0;
 			reinit_timer();
 			clkstate.tc_counter = 0;
 			clkstate.clock_jitter = LOGTOD(sys_vars.sys_precision);
@@ -641,6 +707,7 @@ local_clock(
 		 * the stepout threshold.
 		 */
 		case EVNT_NSET:
+			slew_held = 0;
 			adj_systime(fp_offset, adjtime);
 			rstclock(EVNT_FREQ, fp_offset);
 			break;
@@ -778,6 +845,7 @@ local_clock(
 		 * frequency and jitter.
 		 */
 		ntp_adj_ret = ntp_adjtime_ns(&ntv);
+		kern_note(&ntv, ntp_adj_ret);
 		/*
 		 * A squeal is a return status < 0, or a state change.
 		 */
@@ -842,9 +910,36 @@ local_clock(
 	 * increased, otherwise it is decreased. A bit of hysteresis
 	 * helps calm the dance. Works best using burst mode. Don't
 	 * fiddle with the poll during the startup clamp period.
+	 *
+	 * With tinker budget, the poll heads for budget_poll() instead,
+	 * through the same hysteresis, and an offset beyond the budget
+	 * counts against it.
 	 */
 	if (freq_cnt > 0) {
 		clkstate.tc_counter = 0;
+	} else if (poll_budget > 0) {
+		uint8_t target = budget_poll(peer);
+
+		if (target > clkstate.sys_poll &&
+		    fabs(clock_offset) < poll_budget) {
+			clkstate.tc_counter += clkstate.sys_poll;
+			if (clkstate.tc_counter > CLOCK_LIMIT) {
+				clkstate.tc_counter = 0;
+				clkstate.sys_poll++;
+			}
+		} else if (target < clkstate.sys_poll ||
+			   fabs(clock_offset) >= poll_budget) {
+			clkstate.tc_counter -= clkstate.sys_poll << 1;
+			if (clkstate.tc_counter < -CLOCK_LIMIT) {
+				clkstate.tc_counter = -CLOCK_LIMIT;
+				if (clkstate.sys_poll > peer->cfg.minpoll) {
+					clkstate.tc_counter = 0;
+					clkstate.sys_poll--;
+				}
+			}
+		} else {
+			clkstate.tc_counter = 0;
+		}
 	} else if (fabs(clock_offset) < CLOCK_PGATE * clkstate.clock_jitter) {
 		clkstate.tc_counter += clkstate.sys_poll;
 		if (clkstate.tc_counter > CLOCK_LIMIT) {
@@ -910,6 +1005,8 @@ adj_host_clock(
 	sys_vars.sys_rootdisp += loop_data.clock_phi;
 	if (loop_data.lockclock || !clock_ctl.ntp_enable || clock_ctl.mode_ntpdate)
 		return;
+	if (fast_peer != NULL)
+		return;		/* fast_clock() has it */
 	/*
 	 * Determine the phase adjustment. The gain factor (denominator)
 	 * increases with poll interval, so is dominated by the FLL
@@ -947,18 +1044,201 @@ adj_host_clock(
 
 	clock_offset -= offset_adj;
 	/*
-	 * FIXME: With the Windows legacy port officially gone, this
-	 * could be called much less often.  However, leave some
-	 * version of the comment below in place in case of a re-port.
-	 * See also the related FIXME comment in libntp/systime.c
-	 *
-	 * Windows port adj_systime() must be called each second,
-	 * even if the argument is zero, to ease emulation of
-	 * adjtime() using Windows' slew API which controls the rate
-	 * but does not automatically stop slewing when an offset
-	 * has decayed to zero.
+	 * The Windows port adj_systime() had to be called each second,
+	 * even if the argument was zero, to ease emulation of adjtime()
+	 * using Windows' slew API which controls the rate but does not
+	 * automatically stop slewing when an offset has decayed to zero.
+	 * Without it, small slews can wait; see slew_clock().
 	 */
-	adj_systime(offset_adj + freq_adj, adjtime);
+	slew_clock(offset_adj + freq_adj);
+}
+
+
+/*
+ * slew_clock - add to the slew, and pass it to adjtime() once it is
+ * large enough to matter
+ */
+static void
+slew_clock(
+	double	adj		/* adjustment (s) */
+	)
+{
+	double	hold;
+
+	slew_held += adj;
+	hold = min(clkstate.clock_jitter / SLEW_SHARE, SLEW_MAXHOLD);
+	if (fabs(slew_held) < hold)
+		return;
+	adj_systime(slew_held, adjtime);
+	slew_held = 0;
+}
+
+
+/*
+ * kern_note - remember what the kernel says it has after a call
+ */
+static void
+kern_note(
+	const struct timex *	tx,
+	int			ret
+	)
+{
+	if (ret < 0) {
+		kern_mirror.known = false;
+		return;
+	}
+	kern_mirror.known = true;
+	kern_mirror.freq = tx->freq;
+	if (tx->modes & (MOD_ESTERROR | MOD_MAXERROR))
+		kern_mirror.errtime = current_time;
+}
+
+
+/*
+ * kern_coalesce - drop from a call what the kernel has near enough
+ * already: a frequency within KERN_FREQTOL, error estimates written
+ * this second.  Returns whether anything is left to write.
+ */
+static bool
+kern_coalesce(
+	struct timex *	tx
+	)
+{
+	if (!kern_mirror.known)
+		return true;
+	if ((tx->modes & MOD_FREQUENCY) &&
+	    labs(tx->freq - kern_mirror.freq) < DTOFREQ(KERN_FREQTOL))
+		tx->modes &= ~(unsigned int)MOD_FREQUENCY;
+	if (kern_mirror.errtime == current_time)
+		tx->modes &= ~(unsigned int)(MOD_ESTERROR | MOD_MAXERROR);
+	return 0 != tx->modes;
+}
+
+
+/*
+ * fast_clock - called at each tick of the fast loop.
+ *
+ * The controller sets the frequency to drift_comp + x / tc and adds
+ * x * dt / (4 tc^2) to drift_comp, x being the offset just read, dt the
+ * tick and tc the time constant, the source's minpoll interval.  That
+ * is a critically damped second order loop, the continuous form of the
+ * PLL in local_clock() with its time constant no longer tied to the
+ * poll.  The kernel takes the frequency through ntp_adjtime() when its
+ * discipline is in use; otherwise each tick slews the clock by the
+ * frequency times the tick.
+ */
+void
+fast_clock(void)
+{
+#ifdef REFCLOCK
+	struct peer *	peer = sys_vars.sys_peer;
+	double		dt, tc, x, freq;
+	int		ntp_adj_ret;
+
+	if (peer != fast_peer && fast_peer != NULL)
+		fast_release("system peer changed");
+	if (0 == fastloop_rate || NULL == peer || loop_data.lockclock ||
+	    !clock_ctl.ntp_enable || clock_ctl.mode_ntpdate ||
+	    clock_ctl.hardpps_enable || state != EVNT_SYNC || freq_cnt > 0) {
+		fast_release("clock not in sync or discipline changed");
+		return;
+	}
+	if (!refclock_fast(peer, &x)) {
+		if (fast_peer != NULL && ++fast_misses >= fastloop_rate)
+			fast_release("no readings for a second");
+		return;
+	}
+	fast_misses = 0;
+	if (  ( x > loop_data.clock_max_fwd  && loop_data.clock_max_fwd  > 0)
+	   || (-x > loop_data.clock_max_back && loop_data.clock_max_back > 0)) {
+		if (fast_peer != NULL)
+			fast_release("offset beyond step threshold");
+		return;
+	}
+	if (NULL == fast_peer) {
+		fast_peer = peer;
+		clock_offset = 0;
+		if (clock_ctl.pll_control && clock_ctl.kern_enable) {
+			/* drop what the kernel has yet to slew */
+			ZERO(ntv);
+			ntv.modes = MOD_OFFSET;
+			ntp_adj_ret = ntp_adjtime_ns(&ntv);
+			kern_note(&ntv, ntp_adj_ret);
+			if (ntp_adj_ret < 0)
+				ntp_adjtime_error_handler(__func__, &ntv,
+				    ntp_adj_ret, errno, false, false,
+				    __LINE__ - 5);
+		}
+		msyslog(LOG_INFO, "CLOCK: fast loop on %s at %d Hz",
+			refclock_name(peer), fastloop_rate);
+	}
+
+	dt = 1. / fastloop_rate;
+	tc = ULOGTOD(peer->cfg.minpoll);
+	loop_data.drift_comp += x * dt / (4 * tc * tc);
+	if (loop_data.drift_comp > NTP_MAXFREQ)
+		loop_data.drift_comp = NTP_MAXFREQ;
+	else if (loop_data.drift_comp < -NTP_MAXFREQ)
+		loop_data.drift_comp = -NTP_MAXFREQ;
+	freq = loop_data.drift_comp + x / tc;
+	if (freq > NTP_MAXFREQ)
+		freq = NTP_MAXFREQ;
+	else if (freq < -NTP_MAXFREQ)
+		freq = -NTP_MAXFREQ;
+
+	if (clock_ctl.pll_control && clock_ctl.kern_enable) {
+		ZERO(ntv);
+		ntv.modes = MOD_FREQUENCY | MOD_MAXERROR | MOD_ESTERROR;
+		ntv.freq = DTOFREQ(freq);
+		ntv.esterror = (long)(clkstate.clock_jitter * US_PER_S);
+		ntv.maxerror = (long)((sys_vars.sys_rootdelay / 2 +
+		    sys_vars.sys_rootdisp) * US_PER_S);
+		if (kern_coalesce(&ntv)) {
+			ntp_adj_ret = ntp_adjtime_ns(&ntv);
+			kern_note(&ntv, ntp_adj_ret);
+			if (ntp_adj_ret < 0)
+				ntp_adjtime_error_handler(__func__, &ntv,
+				    ntp_adj_ret, errno, false, false,
+				    __LINE__ - 5);
+		}
+	} else {
+		slew_clock(freq * dt);
+	}
+	DPRINT(2, ("fast_clock: offset %.9f freq %.6f drift %.6f\n",
+		   x, freq * US_PER_S, loop_data.drift_comp * US_PER_S));
+#endif /* REFCLOCK */
+}
+
+
+/*
+ * fast_release - give the clock back to local_clock()
+ */
+static void
+fast_release(
+	const char *	why
+	)
+{
+	int	ntp_adj_ret;
+
+	if (NULL == fast_peer)
+		return;
+	fast_peer = NULL;
+	fast_misses = 0;
+	if (clock_ctl.pll_control && clock_ctl.kern_enable) {
+		/* the kernel keeps drift_comp, without the phase term */
+		ZERO(ntv);
+		ntv.modes = MOD_FREQUENCY;
+		ntv.freq = DTOFREQ(loop_data.drift_comp);
+		if (kern_coalesce(&ntv)) {
+			ntp_adj_ret = ntp_adjtime_ns(&ntv);
+			kern_note(&ntv, ntp_adj_ret);
+			if (ntp_adj_ret < 0)
+				ntp_adjtime_error_handler(__func__, &ntv,
+				    ntp_adj_ret, errno, false, false,
+				    __LINE__ - 5);
+		}
+	}
+	msyslog(LOG_INFO, "CLOCK: fast loop off: %s", why);
 }
 
 
@@ -979,6 +1259,7 @@ rstclock(
 	state = trans;
 	clkstate.last_offset = clock_offset = offset;
 	clock_epoch = current_time;
+	ctl_sysvars_changed();
 }
 
 
@@ -1003,6 +1284,43 @@ direct_freq(
 	return loop_data.drift_comp;
 }
 
+/*
+ * budget_poll - the longest poll (log2 s) at which the predicted error
+ * of the next sample from the system peer stays within tinker budget.
+ *
+ * The prediction is the phase noise of the peer's samples, the jitter
+ * of its clock filter, together with the time the clock's wander
+ * (clock_stability, s/s) runs up over the poll:
+ *	err(tau) = sqrt(jitter^2 + (wander * tau)^2).
+ * The two terms are equal at the Allan intercept, jitter / wander.
+ * Below it a longer poll costs next to nothing, so a budget a little
+ * over the jitter already allows polls up to the intercept; past it
+ * the error grows with the poll.  A budget under the jitter can't be
+ * met at all and gets minpoll.
+ */
+static uint8_t
+budget_poll(
+	const struct peer *peer
+	)
+{
+	double	jitter, tau;
+	uint8_t	poll = peer->cfg.minpoll;
+
+	jitter = max(peer->jitter, LOGTOD(sys_vars.sys_precision));
+	if (jitter >= poll_budget)
+		return poll;
+	if (loop_data.clock_stability <= 0)
+		return peer->cfg.maxpoll;
+	tau = SQRT(SQUARE(poll_budget) - SQUARE(jitter)) /
+	    loop_data.clock_stability;
+	while (poll < peer->cfg.maxpoll && ULOGTOD(poll + 1) <= tau)
+		poll++;
+	DPRINT(2, ("budget_poll: jitter %.9f wander %.3e intercept %.0f s poll %d\n",
+		   jitter, loop_data.clock_stability,
+		   jitter / loop_data.clock_stability, poll));
+	return poll;
+}
+
 /*
  * set_freq - set clock frequency correction
  *
@@ -1023,6 +1341,7 @@ set_freq(
 	const char *	loop_desc;
 
 	loop_data.drift_comp = freq;
+	ctl_sysvars_changed();
 	loop_desc = "ntpd";
 	if (clock_ctl.pll_control) {
 		int ntp_adj_ret;
@@ -1035,6 +1354,7 @@ set_freq(
 		if ((ntp_adj_ret = ntp_adjtime_ns(&ntv)) != 0) {
 		    ntp_adjtime_error_handler(__func__, &ntv, ntp_adj_ret, errno, false, false, __LINE__ - 1);
 		}
+		kern_note(&ntv, ntp_adj_ret);
 	}
 	mprintf_event(EVNT_FSET, NULL, "%s %.6f PPM", loop_desc,
 	    loop_data.drift_comp * US_PER_S);
@@ -1056,6 +1376,7 @@ start_kern_loop(void)
 	if ((ntp_adj_ret = ntp_adjtime_ns(&ntv)) != 0) {
 	    ntp_adjtime_error_handler(__func__, &ntv, ntp_adj_ret, errno, false, false, __LINE__ - 1);
 	}
+	kern_note(&ntv, ntp_adj_ret);
 
 	/*
 	 * Save the result status and light up an external clock
@@ -1246,6 +1567,19 @@ loop_config(
 		}
 		break;
 
+	case LOOP_BUDGET:	/* predicted error for poll (budget) */
+		poll_budget = freq > 0 ? freq : 0;
+		break;
+
+	case LOOP_FASTLOOP:	/* fast loop updates/s (fastloop) */
+		if (freq < 2)
+			fastloop_rate = 0;
+		else if (freq > FAST_MAXRATE)
+			fastloop_rate = FAST_MAXRATE;
+		else
+			fastloop_rate = (int)freq;
+		break;
+
 	case LOOP_LEAP:		/* not used, fall through */
 	default:
 		msyslog(LOG_NOTICE,
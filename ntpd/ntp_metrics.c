@@ -0,0 +1,495 @@
+/*
+ * ntp_metrics.c - serve counters and clock state in OpenMetrics format
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * "metrics <target>" opens a listening stream socket, either a Unix
+ * socket (absolute path) or TCP (address:port).  A thread of its own,
+ * at idle priority where the system has one, answers each HTTP GET
+ * with the current values and closes the connection, so Prometheus
+ * and friends can scrape ntpd without going through mode 6.
+ *
+ * The thread never touches protocol state.  Once a second the main
+ * thread, holding proto_lock, copies every value into a snapshot; the
+ * thread formats a copy of that.  All the values in one answer come
+ * from the same second.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ntpd.h"
+#include "ntp_io.h"
+#include "ntp_stdlib.h"
+#include "nts.h"
+#include "timespecops.h"
+
+#define METRICS_BACKLOG	8
+#define METRICS_TIMEOUT	2	/* seconds a scraper gets to talk */
+#define METRICS_REQMAX	2048	/* bytes of request we look at */
+#define METRICS_BODYMAX	32768
+
+enum metric_kind {m_u64, m_u64P, m_u32, m_u8, m_dbl};
+
+struct metric {
+	const char *		name;	/* after "ntpd_" */
+	bool			counter;
+	const char *		help;
+	enum metric_kind	kind;
+	union {
+		const uint64_t *u64;
+		uint64_t	(*u64P)(void);
+		const uint32_t *u32;
+		const uint8_t *	u8;
+		const double *	dbl;
+	} p;
+	double			scale;	/* m_dbl only */
+};
+
+#define Counter(xname, xhelp, xloc) \
+	{ xname, true, xhelp, m_u64, { .u64 = &(xloc) }, 0 }
+#define CounterP(xname, xhelp, xfunc) \
+	{ xname, true, xhelp, m_u64P, { .u64P = xfunc }, 0 }
+#define Gauge64(xname, xhelp, xloc) \
+	{ xname, false, xhelp, m_u64, { .u64 = &(xloc) }, 0 }
+#define Gauge32(xname, xhelp, xloc) \
+	{ xname, false, xhelp, m_u32, { .u32 = &(xloc) }, 0 }
+#define Gauge8(xname, xhelp, xloc) \
+	{ xname, false, xhelp, m_u8, { .u8 = &(xloc) }, 0 }
+#define GaugeD(xname, xhelp, xloc, xscale) \
+	{ xname, false, xhelp, m_dbl, { .dbl = &(xloc) }, xscale }
+
+static const struct metric metrics[] = {
+  Gauge32("uptime_seconds", "Seconds since ntpd started", current_time),
+
+/* system and clock state, as ntpq rv shows it */
+  Gauge8("leap", "Leap indicator, 3 when unsynchronized",
+	 sys_vars.sys_leap),
+  Gauge8("stratum", "Stratum of this server", sys_vars.sys_stratum),
+  GaugeD("root_delay_seconds", "Total round trip delay to the root",
+	 sys_vars.sys_rootdelay, 1),
+  GaugeD("root_dispersion_seconds", "Total dispersion to the root",
+	 sys_vars.sys_rootdisp, 1),
+  GaugeD("root_distance_seconds", "Root distance of the system peer",
+	 sys_vars.sys_rootdist, 1),
+  Gauge8("poll_log2_seconds", "System poll interval", clkstate.sys_poll),
+  GaugeD("offset_seconds", "Last offset applied by the loop filter",
+	 clkstate.last_offset, 1),
+  GaugeD("system_jitter_seconds", "Jitter of the selected sources",
+	 clkstate.sys_jitter, 1),
+  GaugeD("clock_jitter_seconds", "Jitter of the local clock",
+	 clkstate.clock_jitter, 1),
+  GaugeD("frequency_ppm", "Frequency correction", loop_data.drift_comp,
+	 US_PER_S),
+  GaugeD("clock_wander_ppm", "Frequency wander", loop_data.clock_stability,
+	 US_PER_S),
+
+/* packets, as ntpq sysstats shows them */
+  CounterP("packets_received", "NTP packets received",
+	   stat_total_received),
+  CounterP("packets_processed", "NTP packets processed for time",
+	   stat_total_processed),
+  CounterP("packets_current_version", "Packets of the current version",
+	   stat_total_newversion),
+  CounterP("packets_old_version", "Packets of older versions",
+	   stat_total_oldversion),
+  CounterP("packets_bad_format", "Packets of bad length or format",
+	   stat_total_badlength),
+  CounterP("packets_bad_auth", "Packets failing authentication",
+	   stat_total_badauth),
+  CounterP("packets_declined", "Packets declined", stat_total_declined),
+  CounterP("packets_restricted", "Packets refused by restrictions",
+	   stat_total_restricted),
+  CounterP("packets_rate_limited", "Packets over the rate limit",
+	   stat_total_limitrejected),
+  CounterP("kod_sent", "Kiss-o'-Death responses sent",
+	   stat_total_kodsent),
+  CounterP("kod_over_budget", "KoDs not sent, over the kodmax budget",
+	   stat_total_kodlimited),
+  CounterP("packets_duplicate", "Copies of a client's last request",
+	   stat_total_duplicate),
+
+/* I/O, as ntpq iostats shows it */
+  CounterP("io_received", "Packets read from sockets", received_count),
+  CounterP("io_sent", "Packets sent", sent_count),
+  CounterP("io_send_failed", "Packets that failed to send",
+	   notsent_count),
+  CounterP("io_dropped", "Packets dropped on input", dropped_count),
+  CounterP("io_ignored", "Packets on ignored interfaces", ignored_count),
+  CounterP("io_shed", "Packets shed as floods before any checks",
+	   shed_count),
+  CounterP("io_overload_shed", "Client requests shed by the busy main loop",
+	   overload_shed_count),
+  CounterP("io_overloads", "Times the main loop fell behind its input",
+	   overloads_count),
+  CounterP("io_bpf_dropped", "Packets the bpffilter dropped in the kernel",
+	   bpf_dropped_count),
+
+/* MRU list, as ntpq monstats shows it */
+  Gauge64("mru_entries", "Sources in the MRU list", mon_data.mru_entries),
+  Gauge64("mru_hashslots", "MRU hash slots in use",
+	  mon_data.mru_hashslots),
+  Counter("mru_exists", "Packets from sources already listed",
+	  mon_data.mru_exists),
+  Counter("mru_new", "MRU entries allocated", mon_data.mru_new),
+  Counter("mru_recycle_old", "MRU entries recycled for age",
+	  mon_data.mru_recycleold),
+  Counter("mru_recycle_full", "MRU entries recycled when full",
+	  mon_data.mru_recyclefull),
+  Counter("mru_expired", "MRU entries freed by the timer for age",
+	  mon_data.mru_expired),
+  Counter("mru_none", "Sources no MRU entry could be found for",
+	  mon_data.mru_none),
+  Counter("mru_sketched", "Packets rate-limited by the sketch alone",
+	  mon_data.mru_sketched),
+
+#ifndef DISABLE_NTS
+/* NTS, as ntpq ntsinfo shows it */
+  Counter("nts_client_send", "NTS client requests sent",
+	  nts_cnt.client_send),
+  Counter("nts_client_recv_good", "Good NTS replies received",
+	  nts_cnt.client_recv_good),
+  Counter("nts_client_recv_bad", "Bad NTS replies received",
+	  nts_cnt.client_recv_bad),
+  Counter("nts_server_send", "NTS replies sent", nts_cnt.server_send),
+  Counter("nts_server_recv_good", "Good NTS requests received",
+	  nts_cnt.server_recv_good),
+  Counter("nts_server_recv_bad", "Bad NTS requests received",
+	  nts_cnt.server_recv_bad),
+  Counter("nts_cookie_make", "NTS cookies made", nts_cnt.cookie_make),
+  Counter("nts_cookie_decode", "NTS cookies decoded",
+	  nts_cnt.cookie_decode_total),
+  Counter("nts_cookie_decode_too_old", "NTS cookies too old or garbage",
+	  nts_cnt.cookie_decode_too_old),
+  Counter("nts_cookie_decode_error", "NTS cookies failing to decode",
+	  nts_cnt.cookie_decode_error),
+  Counter("nts_ke_serves_good", "NTS-KE requests served",
+	  ntske_cnt.serves_good),
+  Counter("nts_ke_serves_nossl", "NTS-KE connections failing TLS",
+	  ntske_cnt.serves_nossl),
+  Counter("nts_ke_serves_bad", "NTS-KE requests refused",
+	  ntske_cnt.serves_bad),
+  Counter("nts_ke_serves_limited", "NTS-KE connections dropped by kelimit",
+	  ntske_cnt.serves_limited),
+  Counter("nts_ke_probes_good", "NTS-KE client probes that worked",
+	  ntske_cnt.probes_good),
+  Counter("nts_ke_probes_bad", "NTS-KE client probes that failed",
+	  ntske_cnt.probes_bad),
+#endif
+};
+
+#define NMETRICS	COUNTOF(metrics)
+
+union metric_value {
+	uint64_t	u;
+	double		d;
+};
+
+static union metric_value snapshot[NMETRICS];
+static pthread_mutex_t	snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int		metrics_fd = -1;	/* listening socket */
+static char *		metrics_target;
+static bool		metrics_running;
+
+static void *	metrics_main	(void *);
+static void	metrics_serve	(int);
+static size_t	metrics_format	(char *, size_t);
+
+
+/*
+ * metrics_config - open the listening socket for "metrics <target>".
+ * This runs at config time, with privileges; the thread waits for
+ * metrics_start().
+ */
+void
+metrics_config(
+	const char *	target
+	)
+{
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	struct sockaddr_un *	sun;
+	sockaddr_u		netaddr;
+	int			fd;
+	int			on = 1;
+
+	if (metrics_running) {
+		msyslog(LOG_ERR, "CONFIG: metrics: already serving %s, "
+			"%s ignored", metrics_target, target);
+		return;
+	}
+	ZERO(addr);
+	if ('/' == target[0]) {
+		sun = (struct sockaddr_un *)&addr;
+		if (strlen(target) >= sizeof(sun->sun_path)) {
+			msyslog(LOG_ERR, "CONFIG: metrics %s: path too long",
+				target);
+			return;
+		}
+		sun->sun_family = AF_UNIX;
+		strlcpy(sun->sun_path, target, sizeof(sun->sun_path));
+		addrlen = sizeof(*sun);
+	} else if (0 == decodenetnum(target, &netaddr)) {
+		memcpy(&addr, &netaddr, SOCKLEN(&netaddr));
+		addrlen = SOCKLEN(&netaddr);
+	} else {
+		msyslog(LOG_ERR, "CONFIG: metrics %s: not a socket path "
+			"or address:port", target);
+		return;
+	}
+
+	fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		msyslog(LOG_ERR, "CONFIG: metrics %s: socket: %s", target,
+			strerror(errno));
+		return;
+	}
+	if (AF_UNIX == addr.ss_family)
+		unlink(target);		/* left over from the last run */
+	else
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0
+	    || listen(fd, METRICS_BACKLOG) < 0) {
+		msyslog(LOG_ERR, "CONFIG: metrics %s: %s", target,
+			strerror(errno));
+		close(fd);
+		return;
+	}
+	/* Anybody may scrape; guard the socket with its directory. */
+	if (AF_UNIX == addr.ss_family)
+		chmod(target, 0666);
+
+	if (metrics_fd >= 0) {
+		close(metrics_fd);
+		free(metrics_target);
+	}
+	metrics_fd = fd;
+	metrics_target = estrdup(target);
+	msyslog(LOG_INFO, "CONFIG: metrics on %s", target);
+}
+
+
+/*
+ * metrics_timer - once a second: copy the values for the thread
+ */
+void
+metrics_timer(void)
+{
+	if (!metrics_running)
+		return;
+
+#ifndef DISABLE_NTS
+	nts_fold_counters();
+#endif
+	pthread_mutex_lock(&snapshot_lock);
+	for (size_t i = 0; i < NMETRICS; i++) {
+		const struct metric *m = &metrics[i];
+
+		switch (m->kind) {
+		case m_u64:
+			snapshot[i].u = *m->p.u64;
+			break;
+		case m_u64P:
+			snapshot[i].u = m->p.u64P();
+			break;
+		case m_u32:
+			snapshot[i].u = *m->p.u32;
+			break;
+		case m_u8:
+			snapshot[i].u = *m->p.u8;
+			break;
+		case m_dbl:
+			snapshot[i].d = *m->p.dbl * m->scale;
+			break;
+		default:
+			/* -Wswitch-enum will warn if this is possible */
+			break;
+		}
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+}
+
+
+/*
+ * metrics_start - start answering scrapers.  Called after the
+ * sandbox is set up, so the thread inherits it.
+ */
+void
+metrics_start(void)
+{
+	pthread_t	tid;
+
+	if (metrics_fd < 0 || metrics_running)
+		return;
+
+	metrics_running = true;
+	metrics_timer();
+
+	if (ntp_thread_create(&tid, metrics_main, NULL, "METRICS")) {
+		metrics_running = false;
+		return;
+	}
+	pthread_detach(tid);
+}
+
+
+static void *
+metrics_main(
+	void *	arg
+	)
+{
+	int fd;
+
+	UNUSED_ARG(arg);
+	thread_place(THREAD_OTHER, -1);
+#ifdef SCHED_IDLE
+	{
+		struct sched_param param;
+
+		ZERO(param);
+		pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	}
+#endif
+
+	for (;;) {
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			if (EINTR != errno && ECONNABORTED != errno) {
+				msyslog(LOG_ERR, "METRICS: accept: %s",
+					strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+		metrics_serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+
+/*
+ * metrics_serve - answer one HTTP request on fd
+ */
+static void
+metrics_serve(
+	int	fd
+	)
+{
+	static char	body[METRICS_BODYMAX];
+	char		req[METRICS_REQMAX];
+	char		head[256];
+	struct timeval	tv;
+	const char *	status = "200 OK";
+	const char *	path;
+	size_t		have = 0, bodylen = 0, hlen, off;
+	ssize_t		n;
+
+	ZERO(tv);
+	tv.tv_sec = METRICS_TIMEOUT;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* All we need is the request line, but let the headers arrive. */
+	while (have < sizeof(req) - 1) {
+		n = recv(fd, req + have, sizeof(req) - 1 - have, 0);
+		if (n <= 0)
+			break;
+		have += (size_t)n;
+		req[have] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	req[have] = '\0';
+	if (NULL == strchr(req, '\n'))
+		return;		/* not even a request line */
+
+	if (strncmp(req, "GET ", 4) && strncmp(req, "HEAD ", 5)) {
+		status = "405 Method Not Allowed";
+	} else {
+		path = strchr(req, ' ') + 1;
+		if ((strncmp(path, "/metrics", 8) || !strchr(" ?", path[8]))
+		    && (strncmp(path, "/", 1) || !strchr(" ?", path[1])))
+			status = "404 Not Found";
+	}
+
+	if ('2' == status[0])
+		bodylen = metrics_format(body, sizeof(body));
+	else
+		bodylen = strlcpy(body, status, sizeof(body));
+	hlen = (size_t)snprintf(head, sizeof(head),
+		"HTTP/1.0 %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		status,
+		('2' == status[0]) ? "application/openmetrics-text; "
+		    "version=1.0.0; charset=utf-8" : "text/plain",
+		bodylen);
+	if (0 == strncmp(req, "HEAD ", 5))
+		bodylen = 0;
+
+	if (send(fd, head, hlen, MSG_NOSIGNAL) != (ssize_t)hlen)
+		return;
+	for (off = 0; off < bodylen; off += (size_t)n) {
+		n = send(fd, body + off, bodylen - off, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+	}
+}
+
+
+/*
+ * metrics_format - the OpenMetrics text for the latest snapshot
+ */
+static size_t
+metrics_format(
+	char *	buf,
+	size_t	size
+	)
+{
+	union metric_value	values[NMETRICS];
+	size_t			len = 0;
+	int			n;
+
+	pthread_mutex_lock(&snapshot_lock);
+	memcpy(values, snapshot, sizeof(values));
+	pthread_mutex_unlock(&snapshot_lock);
+
+	for (size_t i = 0; i < NMETRICS; i++) {
+		const struct metric *m = &metrics[i];
+
+		if (m_dbl == m->kind)
+			n = snprintf(buf + len, size - len,
+				"# TYPE ntpd_%s gauge\n# HELP ntpd_%s %s\n"
+				"ntpd_%s %.9g\n",
+				m->name, m->name, m->help,
+				m->name, values[i].d);
+		else
+			n = snprintf(buf + len, size - len,
+				"# TYPE ntpd_%s %s\n# HELP ntpd_%s %s\n"
+				"ntpd_%s%s %" PRIu64 "\n",
+				m->name, m->counter ? "counter" : "gauge",
+				m->name, m->help,
+				m->name, m->counter ? "_total" : "",
+				values[i].u);
+		if (n < 0 || (size_t)n >= size - len)
+			break;	/* METRICS_BODYMAX is much too small */
+		len += (size_t)n;
+	}
+	len += strlcpy(buf + len, "# EOF\n", size - len);
+	return min(len, size - 1);
+}
@@ -6,11 +6,16 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "ntpd.h"
+#include "ntp_endian.h"
 #include "ntp_io.h"
 #include "ntp_lists.h"
 #include "ntp_stdlib.h"
+#include "ntp_trace.h"
 #include "timespecops.h"
 
 /*
@@ -19,12 +24,20 @@
  * anything else. While at it, implement rate controls for inbound
  * traffic.
  *
- * Each entry is doubly linked into two lists, a hash table and a most-
- * recently-used (MRU) list. When a packet arrives it is looked up in
- * the hash table. If found, the statistics are updated and the entry
- * relinked at the head of the MRU list. If not found, a new entry is
- * allocated, initialized and linked into both the hash table and at the
- * head of the MRU list.
+ * Each entry is indexed by an open-addressing hash table and doubly
+ * linked into a most-recently-used (MRU) list. When a packet arrives
+ * it is looked up in the hash table. If found, the statistics are
+ * updated and the entry relinked at the head of the MRU list. If not
+ * found, a new entry is allocated, initialized, entered in the hash
+ * table and linked at the head of the MRU list.
+ *
+ * The hash table uses Robin Hood linear probing.  Each slot holds a
+ * 32-bit digest of the address next to the entry pointer, so a probe
+ * only touches the entry itself once the digests match.  An entry
+ * that has probed further from its home slot takes precedence over
+ * one closer to home, which keeps probe sequences short and lets a
+ * lookup stop early.  Deletion shifts the following run back instead
+ * of leaving tombstones.
  *
  * Memory is usually allocated by grabbing a big chunk of new memory and
  * cutting it up into littler pieces. The exception to this when we hit
@@ -32,6 +45,21 @@
  * tail for the MRU list, unlinking from the hash table, and
  * reinitializing.
  *
+ * The chunks come from an arena that mon_start() reserves for the
+ * whole of mru_maxdepth, so entries sit next to each other instead of
+ * wherever malloc puts them.  The kernel only backs the pages as they
+ * are carved, and "mru hugepages" asks for huge pages to spare the TLB
+ * on very deep lists.  Past the arena, or without one, chunks fall
+ * back to the heap.
+ *
+ * With "mru clocksweep" a hit only sets the entry's referenced bit
+ * instead of relinking it, which saves writing to two neighbouring
+ * entries on every packet.  Reclaim then works like the CLOCK page
+ * replacement algorithm: referenced entries at the tail get a second
+ * chance at the head, and the first unreferenced one is the victim.
+ * The list drifts out of last-seen order, so mon_sort_mru() restores
+ * it when somebody asks to see it.
+ *
  * INC_MONLIST is the default allocation granularity in entries.
  * INIT_MONLIST is the default initial allocation in entries.
  */
@@ -45,9 +73,19 @@
 # define MRU_MAXDEPTH_DEF	(1024 * 1024 / sizeof(mon_entry))
 #endif
 
+#define MON_HUGEPAGE	(2 * 1024 * 1024)	/* common huge page size */
+#define MON_HOLD_MIN	1.0f	/* s, a shorter hold isn't worth a map update */
+
 #define MON_HASH_SLOTS          (1U << mon_data.mon_hash_bits)
 #define MON_HASH_MASK           (MON_HASH_SLOTS - 1)
-#define MON_HASH(addr)          (sock_hash(addr) & MON_HASH_MASK)
+#define MON_HASH_MINBITS	4
+#define MON_HASH_MAXBITS	30
+/* home slot: the top bits of the key, since those are mixed best */
+#define MON_HOME(key)		((key) >> (32 - mon_data.mon_hash_bits))
+/* how far the key in slot i has been pushed from home */
+#define MON_DIST(key, i)	(((i) - MON_HOME(key)) & MON_HASH_MASK)
+/* grow the table before it is 3/4 full */
+#define MON_HASH_FULL(n)	((n) >= MON_HASH_SLOTS / 4 * 3)
 
 
 struct monitor_data mon_data = {
@@ -57,6 +95,7 @@ struct monitor_data mon_data = {
 	.mru_mindepth = 600, /* preempt above this */
 	.mru_maxage = 3600,	/* recycle if older than this */
 	.mru_minage = 64,	/* recycle if full and older than this */
+	.mru_sweep = 256,	/* stale entries freed each second */
 	.mru_maxdepth = MRU_MAXDEPTH_DEF,	/* MRU count hard limit */
 	.mru_initalloc = INIT_MONLIST, /* entries to preallocate */
 	.mru_incalloc = INC_MONLIST, /* allocation batch factor */
@@ -64,25 +103,87 @@ struct monitor_data mon_data = {
 	.mru_new = 0,		/* allocate a new slot (2 cases) */
 	.mru_recycleold = 0,	/* recycle slot: age > mru_maxage */
 	.mru_recyclefull = 0,	/* recycle slot: full and age > mru_minage */
+	.mru_expired = 0,	/* freed by mon_expire(): age > mru_maxage */
 	.mru_none = 0,		/* couldn't get one */
 	.rate_limit = 1.0,	/* responses per second */
 	.decay_time = 20,	/* seconds, exponential decay time */
 	.kod_limit = 0.5,	/* KoDs per second */
+	.kod_max = 100,		/* KoDs per second, all sources */
+	.ctl_average = 16,	/* mode 6 cost units per second */
+	.ctl_burst = 128,	/* mode 6 cost units */
+	.ctl_slice = 10,	/* ms per mode 6 request, 0 for no limit */
 
 };
 
+/*
+ * "lean" makes the tables on first use and keeps pools and rings
+ * small.  It lives here, with its biggest user.
+ */
+bool	lean_memory;
+
 /*
  * List of free structures, and counters of in-use and total
- * structures. The free structures are linked with the hash_next field.
+ * structures. The free structures are linked with the free_next field.
  */
 static  mon_entry *mon_free;		/* free list or null if none */
 static	uint64_t mru_alloc;		/* mru list + free list count */
 static	uint64_t mon_mem_increments;	/* times called malloc() */
+static	mon_entry *mon_arena;		/* reserved slots, or NULL */
+
+/*
+ * "mru sketch" puts a count-min sketch in front of the MRU list.
+ * Each cell holds a decaying packet rate, scored the way mon->score
+ * is, and a source's rate is the smallest of its SKETCH_ROWS cells.
+ * Sources the sketch rates well under rate_limit are answered without
+ * an MRU entry, so the list holds only the busy ones and a flood of
+ * one-packet sources can't push them out.  Collisions only overstate
+ * a rate, never understate it.
+ */
+#define SKETCH_ROWS	4
+#define SKETCH_ADMIT	0.25	/* fraction of rate_limit to get an entry */
+
+struct sketch_cell {
+	float		score;
+	uint32_t	stamp;		/* recv_time in 1/16 s */
+};
+
+static	struct sketch_cell *mon_sketch;	/* SKETCH_ROWS rows, or NULL */
+static	uint32_t sketch_mask;		/* row width - 1 */
+
+/*
+ * Scores decay by exp(-t / decay_time).  Rather than call expf() for
+ * every packet, t is split into whole 1/16 s ticks and the rest.  The
+ * factor for the ticks is the product of one table entry for each
+ * DECAY_BITS of them, built when decay_time changes; the rest, short
+ * next to any sane decay_time, takes the first two terms of the
+ * series, so a burst of packets closer than a tick still decays.
+ * Each factor is within 0.001% of expf()'s at the default 20 s.  Gaps
+ * too long for the tables, over 4 hours, still go to expf().
+ */
+#define DECAY_BITS	6
+#define DECAY_LEVELS	3
+#define DECAY_MASK	((1U << DECAY_BITS) - 1)
+
+static	float	decay_table[DECAY_LEVELS][DECAY_MASK + 1];
+static	float	decay_built;		/* decay_time the tables are for */
+static	float	decay_frac;		/* per l_fp fraction unit */
 
 static	void	mon_getmoremem(void);
+static	void	mon_reserve_arena(void);
+static	uint32_t mon_key(const sockaddr_u *);
+static	void	mon_rehash(uint8_t);
+static	void	add_to_hash(mon_entry *, uint32_t);
 static	void	remove_from_hash(mon_entry *);
 static	void	mon_free_entry(mon_entry *);
 static	void	mon_reclaim_entry(mon_entry *);
+static	void	mon_sweep(void);
+static	int	mon_age(const mon_entry *, l_fp);
+static	int	mon_cmp_last(const void *, const void *);
+static	void	decay_tables(void);
+static	float	mon_decay(float, uint32_t, uint32_t);
+static	void	mon_hold(const sockaddr_u *, float);
+static	void	sketch_alloc(void);
+static	float	sketch_update(uint32_t, l_fp);
 
 
 /*
@@ -99,6 +200,87 @@ init_mon(void)
 }
 
 
+/*
+ * mon_key - hash an address into a table key; 0 marks an empty slot.
+ * sock_hash() is keyed, so a flood from spoofed addresses can't be
+ * aimed at one run of slots.
+ */
+static uint32_t
+mon_key(
+	const sockaddr_u *addr
+	)
+{
+	uint32_t key = (uint32_t)sock_hash(addr);
+
+	return (0 == key) ? 1 : key;
+}
+
+
+/*
+ * mon_find - return the table slot holding addr, or NULL
+ */
+static struct mon_slot *
+mon_find(
+	const sockaddr_u *addr,
+	uint32_t key
+	)
+{
+	struct mon_slot *slot;
+	unsigned int i, dist;
+
+	if (NULL == mon_data.mon_hash)
+		return NULL;
+	i = MON_HOME(key);
+	for (dist = 0; ; dist++, i = (i + 1) & MON_HASH_MASK) {
+		slot = &mon_data.mon_hash[i];
+		/* a richer resident means addr would have been here */
+		if (0 == slot->key || MON_DIST(slot->key, i) < dist)
+			return NULL;
+		if (slot->key == key && SOCK_EQ(&slot->mon->rmtadr, addr))
+			return slot;
+	}
+}
+
+
+/*
+ * add_to_hash - enter an entry in the address hash table and
+ *		 increment mru_hashslots.
+ */
+static void
+add_to_hash(
+	mon_entry *mon,
+	uint32_t key
+	)
+{
+	struct mon_slot cur, tmp;
+	struct mon_slot *slot;
+	unsigned int i, dist;
+
+	if (MON_HASH_FULL(mon_data.mru_hashslots + 1) &&
+	    mon_data.mon_hash_bits < MON_HASH_MAXBITS)
+		mon_rehash(mon_data.mon_hash_bits + 1);
+
+	cur.key = key;
+	cur.mon = mon;
+	i = MON_HOME(key);
+	for (dist = 0; ; dist++, i = (i + 1) & MON_HASH_MASK) {
+		slot = &mon_data.mon_hash[i];
+		if (0 == slot->key) {
+			*slot = cur;
+			break;
+		}
+		if (MON_DIST(slot->key, i) < dist) {
+			/* take from the rich, carry on with the evictee */
+			tmp = *slot;
+			*slot = cur;
+			cur = tmp;
+			dist = MON_DIST(cur.key, i);
+		}
+	}
+	mon_data.mru_hashslots++;
+}
+
+
 /*
  * remove_from_hash - removes an entry from the address hash table and
  *		      decrements mru_entries.
@@ -108,16 +290,48 @@ remove_from_hash(
 	mon_entry *mon
 	)
 {
-	unsigned int hash;
-	mon_entry *punlinked;
+	struct mon_slot *slot, *next;
+	unsigned int i;
 
 	mon_data.mru_entries--;
-	hash = MON_HASH(&mon->rmtadr);
-	UNLINK_SLIST(punlinked, mon_data.mon_hash[hash], mon, hash_next,
-		     mon_entry);
-	ENSURE(punlinked == mon);
-	if (NULL == mon_data.mon_hash[hash])
-		mon_data.mru_hashslots--;
+	slot = mon_find(&mon->rmtadr, mon_key(&mon->rmtadr));
+	ENSURE(NULL != slot && slot->mon == mon);
+
+	/* backward shift: pull the rest of the run one slot closer home */
+	i = (unsigned int)(slot - mon_data.mon_hash);
+	for (;;) {
+		i = (i + 1) & MON_HASH_MASK;
+		next = &mon_data.mon_hash[i];
+		if (0 == next->key || 0 == MON_DIST(next->key, i))
+			break;
+		*slot = *next;
+		slot = next;
+	}
+	ZERO(*slot);
+	mon_data.mru_hashslots--;
+}
+
+
+/*
+ * mon_rehash - resize the hash table to 2^bits slots and re-enter
+ *		everything on the MRU list.
+ */
+static void
+mon_rehash(
+	uint8_t bits
+	)
+{
+	mon_entry *mon;
+
+	free_tag(MEM_MRU, mon_data.mon_hash,
+		 sizeof(*mon_data.mon_hash) * MON_HASH_SLOTS);
+	mon_data.mon_hash_bits = bits;
+	mon_data.mon_hash = emalloc_zero_tag(MEM_MRU,
+			sizeof(*mon_data.mon_hash) * MON_HASH_SLOTS);
+	mon_data.mru_hashslots = 0;
+	ITER_DLIST_BEGIN(mon_data.mon_mru_list, mon, mru, mon_entry)
+		add_to_hash(mon, mon_key(&mon->rmtadr));
+	ITER_DLIST_END()
 }
 
 
@@ -127,7 +341,7 @@ mon_free_entry(
 	)
 {
 	ZERO(*m);
-	LINK_SLIST(mon_free, m, hash_next);
+	LINK_SLIST(mon_free, m, free_next);
 }
 
 
@@ -167,7 +381,13 @@ mon_getmoremem(void)
 		      : mon_data.mru_incalloc;
 
 	if (entries) {
-		chunk = eallocarray(entries, sizeof(*chunk));
+		if (mon_data.mru_arenaused + entries <= mon_data.mru_arenasize) {
+			chunk = mon_arena + mon_data.mru_arenaused;
+			mon_data.mru_arenaused += entries;
+		} else {
+			chunk = eallocarray(entries, sizeof(*chunk));
+		}
+		mem_charge(MEM_MRU, entries * sizeof(*chunk), 0);
 		mru_alloc += entries;
 		for (chunk += entries; entries; entries--)
 			mon_free_entry(--chunk);
@@ -179,6 +399,63 @@ mon_getmoremem(void)
 }
 
 
+/*
+ * mon_reserve_arena - map address space for mru_maxdepth entries.
+ *		       Failure is not fatal; the heap still works.
+ */
+static void
+mon_reserve_arena(void)
+{
+	size_t	octets;
+	size_t	align;
+	void *	base = MAP_FAILED;
+	int	flags = MAP_PRIVATE | MAP_ANON;
+
+	/* "maxdepth -1" means no limit, so nothing to size against */
+	if (NULL != mon_arena || UINT_MAX <= mon_data.mru_maxdepth)
+		return;
+
+	align = mon_data.mru_hugepages ? MON_HUGEPAGE
+				      : (size_t)sysconf(_SC_PAGESIZE);
+	octets = (size_t)mon_data.mru_maxdepth * sizeof(mon_entry);
+	octets = (octets + align - 1) / align * align;
+
+#ifdef MAP_HUGETLB
+	/*
+	 * Not MAP_NORESERVE: without a reservation an empty huge page
+	 * pool shows up as SIGBUS on first touch instead of here.
+	 */
+	if (mon_data.mru_hugepages) {
+		base = mmap(NULL, octets, PROT_READ | PROT_WRITE,
+			    flags | MAP_HUGETLB, -1, 0);
+		mon_data.mru_arenahuge = (MAP_FAILED != base);
+	}
+#endif
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	if (MAP_FAILED == base)
+		base = mmap(NULL, octets, PROT_READ | PROT_WRITE, flags,
+			    -1, 0);
+	if (MAP_FAILED == base) {
+		msyslog(LOG_WARNING, "MON: can't reserve %llu byte arena: %s",
+			(unsigned long long)octets, strerror(errno));
+		return;
+	}
+#ifdef MADV_HUGEPAGE
+	if (mon_data.mru_hugepages && !mon_data.mru_arenahuge)
+		mon_data.mru_arenahuge =
+		    (0 == madvise(base, octets, MADV_HUGEPAGE));
+#endif
+	if (mon_data.mru_hugepages && !mon_data.mru_arenahuge)
+		msyslog(LOG_INFO, "MON: huge pages unavailable for MRU arena");
+
+	mon_arena = base;
+	mon_data.mru_arenasize = octets / sizeof(mon_entry);
+	mon_data.mru_arenaused = 0;
+}
+
+
 void
 mon_setup(int mode)
 {
@@ -192,34 +469,80 @@ mon_setdown(int mode)
 }
 
 /*
- * mon_start - start up the monitoring software
+ * mon_tables - size the hash table for depth entries, then make it
+ *		and the sketch.
  */
-void
-mon_start(void)
+static void
+mon_tables(
+	uint64_t depth
+	)
 {
 	size_t octets;
-	unsigned int min_hash_slots;
+	uint64_t min_hash_slots;
+	uint8_t bits;
 
-	if (MON_OFF == mon_data.mon_enabled)
-		return;
-	if (0 == mon_mem_increments)
-		mon_getmoremem();
 	/* There used to be a 16 bit limit to mon_hash_bits.
 	 * and a target of 8 entries per hash slot.
 	 * That was not good with large MRU lists.
 	 * There was also a startup timing bug that got 13 bits.
+	 * Open addressing wants some slack, so size the table for
+	 * depth at 3/4 load.  add_to_hash() grows it further
+	 * should mru_mindepth push past that.
 	 */
-	min_hash_slots = mon_data.mru_maxdepth;  /* 1 hash slot per entry */
-	mon_data.mon_hash_bits = 0;
+	min_hash_slots = depth / 3 * 4;
+	bits = 0;
 	while (min_hash_slots >>= 1)
-		mon_data.mon_hash_bits++;
-	mon_data.mon_hash_bits = max(4, mon_data.mon_hash_bits);
-	mon_data.mon_hash_bits = min(24, mon_data.mon_hash_bits);
-	octets = sizeof(*mon_data.mon_hash) * MON_HASH_SLOTS;
+		bits++;
+	bits = max(MON_HASH_MINBITS, bits + 1);
+	bits = min(MON_HASH_MAXBITS, bits);
+	octets = sizeof(*mon_data.mon_hash) << bits;
 	msyslog(LOG_INFO, "INIT: MRU %llu entries, %d hash bits, %llu bytes",
-		(unsigned long long)mon_data.mru_maxdepth,
-		mon_data.mon_hash_bits, (unsigned long long)octets);
-	mon_data.mon_hash = erealloc_zero(mon_data.mon_hash, octets, 0);
+		(unsigned long long)depth,
+		bits, (unsigned long long)octets);
+	mon_rehash(bits);
+	sketch_alloc();
+}
+
+
+/*
+ * mon_start - start up the monitoring software.  Under "lean" nothing
+ *	       is allocated until ntp_monitor() sees the first source,
+ *	       and the table starts out sized for mru_initalloc.
+ */
+void
+mon_start(void)
+{
+	if (MON_OFF == mon_data.mon_enabled)
+		return;
+	if (lean_memory) {
+		free_tag(MEM_MRU, mon_data.mon_hash,
+			 sizeof(*mon_data.mon_hash) * MON_HASH_SLOTS);
+		mon_data.mon_hash = NULL;
+		return;
+	}
+	if (0 == mon_mem_increments) {
+		mon_reserve_arena();
+		mon_getmoremem();
+	}
+	mon_tables(mon_data.mru_maxdepth);
+}
+
+
+/*
+ * mon_memory - bytes in MRU entries handed out, the hash table and the
+ *		sketch.  Arena slots not yet handed out cost nothing.
+ */
+size_t
+mon_memory(void)
+{
+	size_t octets = (size_t)mru_alloc * sizeof(mon_entry);
+
+	if (NULL != mon_data.mon_hash)
+		octets += sizeof(*mon_data.mon_hash) * MON_HASH_SLOTS;
+	if (NULL != mon_sketch)
+		octets += sizeof(*mon_sketch) * SKETCH_ROWS *
+			  ((size_t)sketch_mask + 1);
+	return octets;
 }
 
 
@@ -247,7 +570,138 @@ mon_stop(void)
 	mon_data.mru_entries = 0;
 	mon_data.mru_hashslots = 0;
 	INIT_DLIST(mon_data.mon_mru_list, mru);
-	memset(mon_data.mon_hash, '\0', sizeof(*mon_data.mon_hash) * MON_HASH_SLOTS);
+	mon_data.mru_unsorted = false;
+	if (NULL != mon_data.mon_hash)
+		memset(mon_data.mon_hash, '\0',
+		       sizeof(*mon_data.mon_hash) * MON_HASH_SLOTS);
+	if (NULL != mon_sketch)
+		free_tag(MEM_MRU, mon_sketch, sizeof(*mon_sketch) *
+			 SKETCH_ROWS * ((size_t)sketch_mask + 1));
+	mon_sketch = NULL;
+}
+
+
+/*
+ * sketch_alloc - size the sketch to "mru sketch" kilobytes, rounding
+ * the rows down to a power of two.
+ */
+static void
+sketch_alloc(void)
+{
+	uint64_t width;
+
+	if (NULL != mon_sketch || 0 == mon_data.mru_sketchkb)
+		return;
+	width = mon_data.mru_sketchkb * 1024 /
+		(SKETCH_ROWS * sizeof(*mon_sketch));
+	if (width < 2)
+		return;
+	while (width & (width - 1))
+		width &= width - 1;
+	width = min(width, (uint64_t)1 << 30);
+	sketch_mask = (uint32_t)width - 1;
+	mon_sketch = eallocarray_tag(MEM_MRU, SKETCH_ROWS * width,
+				     sizeof(*mon_sketch));
+	memset(mon_sketch, '\0', sizeof(*mon_sketch) * SKETCH_ROWS * width);
+	msyslog(LOG_INFO, "INIT: MRU sketch %d x %llu cells",
+		SKETCH_ROWS, (unsigned long long)width);
+}
+
+
+static void
+decay_tables(void)
+{
+	double	ticks;
+
+	for (unsigned int l = 0; l < DECAY_LEVELS; l++)
+		for (unsigned int i = 0; i <= DECAY_MASK; i++) {
+			ticks = (double)i * (1U << (l * DECAY_BITS));
+			decay_table[l][i] = (float)exp(-ticks / 16 /
+						       mon_data.decay_time);
+		}
+	decay_frac = (float)(1.0 / 4294967296.0 / mon_data.decay_time);
+	decay_built = mon_data.decay_time;
+}
+
+
+/*
+ * mon_decay - a score after ticks 1/16 s and frac, in l_fp fraction
+ *	       units under a tick, of silence
+ */
+static float
+mon_decay(
+	float		score,
+	uint32_t	ticks,
+	uint32_t	frac
+	)
+{
+	if (islessgreater(mon_data.decay_time, decay_built))
+		decay_tables();
+	if (ticks >> (DECAY_LEVELS * DECAY_BITS))
+		return score * expf(-(float)ticks / 16 / mon_data.decay_time);
+	return score * decay_table[0][ticks & DECAY_MASK]
+		     * decay_table[1][(ticks >> DECAY_BITS) & DECAY_MASK]
+		     * decay_table[2][ticks >> (2 * DECAY_BITS)]
+		     * (1.0f - (float)frac * decay_frac);
+}
+
+
+/*
+ * mon_hold - have the kernel filter drop a limited source's requests
+ *	      until its score would have decayed back to rate_limit
+ */
+static void
+mon_hold(
+	const sockaddr_u *addr,
+	float		score
+	)
+{
+	float	secs;
+
+	if (!bpf_filter_loaded() || mon_data.rate_limit <= 0)
+		return;
+	secs = mon_data.decay_time * logf(score / mon_data.rate_limit);
+	if (secs >= MON_HOLD_MIN)
+		bpf_filter_hold(addr, secs);
+}
+
+
+/*
+ * sketch_update - count a packet from the source with the given key,
+ * and return its estimated score.  The cells are bumped
+ * conservatively: none is raised past the new estimate, which keeps
+ * light sources sharing a cell with a heavy one from looking heavy.
+ */
+static float
+sketch_update(
+	uint32_t	key,
+	l_fp		now
+	)
+{
+	struct sketch_cell *cell[SKETCH_ROWS];
+	float		decayed[SKETCH_ROWS];
+	float		est, bumped;
+	uint32_t	stamp = (uint32_t)(now >> 28);
+	uint32_t	h2 = ((key << 16) | (key >> 16)) | 1;
+	int		i;
+
+	est = -1;
+	for (i = 0; i < SKETCH_ROWS; i++) {
+		cell[i] = &mon_sketch[(size_t)i * (sketch_mask + 1) +
+				      ((key + (uint32_t)i * h2) & sketch_mask)];
+		decayed[i] = cell[i]->score;
+		if (0 < decayed[i])
+			decayed[i] = mon_decay(decayed[i],
+					       stamp - cell[i]->stamp, 0);
+		if (est < 0 || decayed[i] < est)
+			est = decayed[i];
+	}
+	bumped = est + 1.0f / mon_data.decay_time;
+	for (i = 0; i < SKETCH_ROWS; i++) {
+		cell[i]->score = max(decayed[i], bumped);
+		cell[i]->stamp = stamp;
+	}
+	return bumped;
 }
 
 
@@ -276,39 +730,412 @@ mon_clearinterface(
 }
 
 mon_entry *mon_get_slot(sockaddr_u *addr)
+{
+	struct mon_slot *slot;
+
+	slot = mon_find(addr, mon_key(addr));
+	return (NULL == slot) ? NULL : slot->mon;
+}
+
+/*
+ * mon_ctl_charge - take the cost of a mode 6 request from the budget
+ *		    of the source that sent it.  The budget refills at
+ *		    ctl_average units a second up to ctl_burst.  Returns
+ *		    false, and counts a drop, if the source can't pay.
+ */
+bool
+mon_ctl_charge(
+	sockaddr_u *	addr,
+	unsigned int	cost
+	)
 {
 	mon_entry *mon;
+	float burst;
 
-	mon = mon_data.mon_hash[MON_HASH(addr)];
-	for (; mon != NULL; mon = mon->hash_next)
-		if (SOCK_EQ(&mon->rmtadr, addr))
-			break;
-	return mon;
+	if (MON_OFF == mon_data.mon_enabled || mon_data.ctl_average <= 0)
+		return true;
+	mon = mon_get_slot(addr);
+	if (NULL == mon)
+		return true;
+
+	/* A burst smaller than one request would lock everybody out. */
+	burst = max(mon_data.ctl_burst, (float)cost);
+	mon->ctl_tokens += mon_data.ctl_average *
+	    (float)(current_time - mon->ctl_stamp);
+	if (mon->ctl_tokens > burst)
+		mon->ctl_tokens = burst;
+	mon->ctl_stamp = current_time;
+
+	if (mon->ctl_tokens < (float)cost) {
+		mon->dropped++;
+		return false;
+	}
+	mon->ctl_tokens -= (float)cost;
+	return true;
+}
+
+
+/*
+ * mon_sweep - advance the CLOCK hand: move referenced entries off the
+ *	       tail of the MRU list, clearing their bits, until the tail
+ *	       is an entry that has not been hit since the last pass.
+ */
+static void
+mon_sweep(void)
+{
+	mon_entry *mon;
+
+	for (uint64_t n = mon_data.mru_entries; n > 0; n--) {
+		mon = TAIL_DLIST(mon_data.mon_mru_list, mru);
+		if (NULL == mon || !mon->referenced)
+			return;
+		mon->referenced = false;
+		UNLINK_DLIST(mon, mru);
+		LINK_DLIST(mon_data.mon_mru_list, mon, mru);
+	}
+}
+
+
+static int
+mon_cmp_last(
+	const void *a,
+	const void *b
+	)
+{
+	l_fp la = (*(mon_entry * const *)a)->last;
+	l_fp lb = (*(mon_entry * const *)b)->last;
+
+	return (la > lb) - (la < lb);
+}
+
+
+/*
+ * mon_sort_mru - put the MRU list back in last-seen order after
+ *		  clocksweep mode let it drift.  Cheap when it hasn't.
+ */
+void
+mon_sort_mru(void)
+{
+	mon_entry **	v;
+	mon_entry *	mon;
+	size_t		n;
+
+	if (!mon_data.mru_unsorted)
+		return;
+	n = 0;
+	v = eallocarray(mon_data.mru_entries + 1, sizeof(*v));
+	ITER_DLIST_BEGIN(mon_data.mon_mru_list, mon, mru, mon_entry)
+		v[n++] = mon;
+	ITER_DLIST_END()
+	qsort(v, n, sizeof(*v), mon_cmp_last);
+	/* oldest first, so each LINK_DLIST pushes a newer entry on top */
+	INIT_DLIST(mon_data.mon_mru_list, mru);
+	for (size_t i = 0; i < n; i++)
+		LINK_DLIST(mon_data.mon_mru_list, v[i], mru);
+	free(v);
+	mon_data.mru_unsorted = false;
+}
+
+/*
+ * mon_age - seconds since an entry was last heard from
+ */
+static int
+mon_age(
+	const mon_entry *	mon,
+	l_fp			now
+	)
+{
+	now -= mon->last;
+	/* add one-half second to round up */
+	now += 0x80000000;
+	return lfpsint(now);
 }
 
 int mon_get_oldest_age(l_fp now)
 {
-    mon_entry *	oldest;
-    if (mon_data.mru_entries == 0)
-	return 0;
-    oldest = TAIL_DLIST(mon_data.mon_mru_list, mru);
-    if (1) {
-      /* FIXME -fanalyze
-       * Hack to keep compiler -fanalyze happy
-       * If mru_entries !=0, the list is not empty
-       * and TAIL_DLIST will return a valid pointer
-       */
-	if (NULL == oldest) {
-		msyslog(LOG_ERR, "MON: Bug in mon_get_oldest_age");
-		exit(3);
-        }
-    }
-    now -= oldest->last;
-    /* add one-half second to round up */
-    now += 0x80000000;
-    return lfpsint(now);
+	mon_entry *	oldest = TAIL_DLIST(mon_data.mon_mru_list, mru);
+
+	return (NULL == oldest) ? 0 : mon_age(oldest, now);
+}
+
+
+/*
+ * mon_expire - once a second: move entries older than mru_maxage off
+ *		the tail of the MRU list and onto the free list, at
+ *		most mru_sweep of them.  As when a new source needs a
+ *		slot, mru_mindepth entries are kept whatever their
+ *		age.  With clocksweep a recent entry can sit at the
+ *		tail; the sweep stops there.
+ */
+void
+mon_expire(
+	l_fp	now
+	)
+{
+	mon_entry *	mon;
+
+	if (MON_OFF == mon_data.mon_enabled)
+		return;
+	for (uint64_t n = mon_data.mru_sweep;
+	     n > 0 && mon_data.mru_entries > mon_data.mru_mindepth; n--) {
+		mon = TAIL_DLIST(mon_data.mon_mru_list, mru);
+		if (NULL == mon || mon_age(mon, now) <= mon_data.mru_maxage)
+			break;
+		mon_reclaim_entry(mon);
+		LINK_SLIST(mon_free, mon, free_next);
+		mon_data.mru_expired++;
+	}
+}
+
+/*
+ * mon_state - an entry's score decayed to now, and whether it is
+ *	       high enough to be worth keeping over a restart: the
+ *	       level the sketch admits at.
+ */
+bool
+mon_state(
+	const mon_entry *	mon,
+	l_fp			now,
+	float *			score
+	)
+{
+	l_fp	delta_fp;
+	uint64_t ticks;
+
+	*score = mon->score;
+	if (now > mon->last) {
+		delta_fp = now - mon->last;
+		ticks = delta_fp >> 28;
+		*score = mon_decay(mon->score,
+				   (uint32_t)min(ticks, UINT32_MAX),
+				   (uint32_t)delta_fp & 0x0fffffff);
+	}
+	return *score >= SKETCH_ADMIT * mon_data.rate_limit;
+}
+
+
+/*
+ * mon_restore - put back an entry saved before a restart.  It gets its
+ *		 local address when the source is next heard from.
+ *		 Entries that have decayed away, are already known, or
+ *		 would need more than mru_maxdepth are skipped.  Called
+ *		 oldest first, so the MRU order comes back too.
+ */
+bool
+mon_restore(
+	const sockaddr_u *	addr,
+	l_fp			last,
+	int			count,
+	uint8_t			vn_mode,
+	float			score,
+	l_fp			now
+	)
+{
+	mon_entry *	mon;
+	mon_entry	saved;
+	uint32_t	key;
+
+	if (MON_OFF == mon_data.mon_enabled)
+		return false;
+	saved.last = last;
+	saved.score = score;
+	if (!mon_state(&saved, now, &score))
+		return false;
+	key = mon_key(addr);
+	if (NULL == mon_data.mon_hash)
+		mon_tables(mon_data.mru_initalloc);
+	if (NULL != mon_find(addr, key))
+		return false;
+	if (NULL == mon_free) {
+		if (mru_alloc >= mon_data.mru_maxdepth)
+			return false;
+		mon_getmoremem();
+	}
+	UNLINK_HEAD_SLIST(mon, mon_free, free_next);
+	mon_data.mru_entries++;
+	mon_data.mru_peakentries = max(mon_data.mru_peakentries,
+				       mon_data.mru_entries);
+	mon->first = last;
+	mon->last = last;
+	mon->count = count;
+	mon->score = score;
+	mon->ctl_tokens = mon_data.ctl_burst;
+	mon->ctl_stamp = current_time;
+	mon->vn_mode = vn_mode;
+	mon->rmtadr = *addr;
+	add_to_hash(mon, key);
+	LINK_DLIST(mon_data.mon_mru_list, mon, mru);
+	return true;
 }
 
+/*
+ * Interleaved mode (draft-ietf-ntp-interleaved-modes).  A basic reply
+ * carries the time it was built, not when it left.  A client in
+ * interleaved mode sends back the receive timestamp of our last reply
+ * as its origin timestamp and gets, instead of this reply's transmit
+ * time, that of the last one, which by now may be the kernel's stamp
+ * off the error queue.  All a client costs is the two timestamps in
+ * its MRU entry, so the state is bounded just as the MRU list is.
+ *
+ * Replies waiting for a kernel stamp are remembered in a small ring,
+ * by client and receive timestamp, since the looped-back frame
+ * carries the latter.  A reply that falls off the ring keeps the time
+ * it was built.
+ */
+#define XLEAVE_PENDING	128	/* replies waiting for a transmit stamp */
+
+static struct xleave_pending {
+	sockaddr_u	dest;
+	l_fp		rx;		/* its receive timestamp, 0 if done */
+} xl_pending[XLEAVE_PENDING];
+static unsigned int	xl_next;
+
+/*
+ * mon_xleave - decide how a client request is answered and note when
+ * it arrived
+ */
+static void
+mon_xleave(
+	mon_entry *	mon,
+	struct recvbuf *rbufp
+	)
+{
+	l_fp	org, xmt;
+
+	mon->req_xmt = 0;
+	if (rbufp->recv_length < LEN_PKT_NOMAC)
+		return;
+	org = ntp_be64dec(rbufp->recv_buffer + 24);
+	xmt = ntp_be64dec(rbufp->recv_buffer + 40);
+	if (0 != org && org != xmt && org == mon->xl_rx && 0 != mon->xl_tx) {
+		rbufp->xleave = XLEAVE_REPLY;
+		rbufp->xleave_tx = mon->xl_tx;
+	} else if (0 != org) {
+		/* a data-minimized client sends zeros and never asks */
+		rbufp->xleave = XLEAVE_BASIC;
+	}
+	mon->xl_rx = rbufp->recv_time;
+	mon->xl_tx = 0;		/* until mon_xleave_sent() */
+	mon->req_xmt = xmt;
+	mon->req_plain = (LEN_PKT_NOMAC == rbufp->recv_length &&
+			  XLEAVE_REPLY != rbufp->xleave);
+}
+
+/*
+ * mon_duplicate - spot a copy of the last client request from the
+ * same source, transmit timestamp and all, come within dup_window of
+ * the first.  Misconfigured clients and middleboxes send those in
+ * bursts.  A copy leaves the interleaved state alone and is answered
+ * as the first was, with its receive timestamp and a fresh transmit
+ * one.  That takes no more than the header, so a request with a MAC
+ * or NTS fields, whose reply would need the crypto done again, and
+ * every copy under "limit dupdrop", is dropped instead.
+ */
+static bool
+mon_duplicate(
+	mon_entry *	mon,
+	struct recvbuf *rbufp
+	)
+{
+	l_fp	xmt;
+
+	if (0 == mon_data.dup_window || 0 == mon->req_xmt ||
+	    rbufp->recv_length < LEN_PKT_NOMAC)
+		return false;
+	xmt = ntp_be64dec(rbufp->recv_buffer + 40);
+	if (xmt != mon->req_xmt ||
+	    rbufp->recv_time - mon->xl_rx > mon_data.dup_window)
+		return false;
+	if (!mon_data.dup_drop && mon->req_plain &&
+	    LEN_PKT_NOMAC == rbufp->recv_length) {
+		rbufp->xleave = XLEAVE_DUP;
+		rbufp->xleave_tx = mon->xl_rx;
+	} else {
+		rbufp->xleave = XLEAVE_DROP;
+	}
+	return true;
+}
+
+/*
+ * mon_xleave_sent - remember when the reply to rbufp left: when it
+ * was built, until the kernel says better.  Call with proto_lock held.
+ */
+void
+mon_xleave_sent(
+	struct recvbuf *rbufp
+	)
+{
+	struct mon_slot *slot;
+
+	if (XLEAVE_BASIC != rbufp->xleave && XLEAVE_REPLY != rbufp->xleave)
+		return;
+	slot = mon_find(&rbufp->recv_srcadr, mon_key(&rbufp->recv_srcadr));
+	if (NULL == slot || slot->mon->xl_rx != rbufp->recv_time)
+		return;
+	slot->mon->xl_tx = rbufp->xleave_tx;
+	if (XLEAVE_REPLY == rbufp->xleave) {
+		xl_pending[xl_next].dest = rbufp->recv_srcadr;
+		xl_pending[xl_next].rx = rbufp->recv_time;
+		xl_next = (xl_next + 1) % XLEAVE_PENDING;
+	}
+}
+
+/*
+ * mon_txstamp - give a kernel transmit stamp to the interleaved reply
+ * in frame, if it is one.  Call with proto_lock held.
+ */
+bool
+mon_txstamp(
+	const void *	frame,
+	size_t		len,
+	l_fp		stamp
+	)
+{
+	struct xleave_pending *xp;
+	struct mon_slot *slot;
+	uint32_t	wire[2];
+
+	/* newest first, the stamps come back in order */
+	for (unsigned int n = 1; n <= XLEAVE_PENDING; n++) {
+		xp = &xl_pending[(xl_next + XLEAVE_PENDING - n)
+				 % XLEAVE_PENDING];
+		if (0 == xp->rx)
+			continue;
+		wire[0] = htonl(lfpuint(xp->rx));
+		wire[1] = htonl(lfpfrac(xp->rx));
+		if (NULL == memmem(frame, len, wire, sizeof(wire)))
+			continue;
+		slot = mon_find(&xp->dest, mon_key(&xp->dest));
+		if (NULL != slot && slot->mon->xl_rx == xp->rx) {
+			DPRINT(2, ("mon_txstamp: %s %s was %s\n",
+				   socktoa(&xp->dest), ulfptoa(stamp, 9),
+				   ulfptoa(slot->mon->xl_tx, 9)));
+			slot->mon->xl_tx = stamp;
+		}
+		xp->rx = 0;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * mon_restrictions - restrictions() for the source of a packet, from
+ * what its MRU entry remembers if it has one
+ */
+unsigned short
+mon_restrictions(
+	sockaddr_u *	addr
+	)
+{
+	struct mon_slot *slot;
+
+	slot = mon_find(addr, mon_key(addr));
+	if (NULL == slot)
+		return restrictions(addr);
+	return restrictions_cached(addr, slot->mon);
+}
+
+
 /*
  * ntp_monitor - record stats about this packet
  *
@@ -331,34 +1158,34 @@ ntp_monitor(
 	)
 {
 	l_fp		delta_fp;
+	struct mon_slot *slot;
 	mon_entry *	mon;
 	mon_entry *	oldest;
 	int		oldest_age;
-	unsigned int	hash;
+	uint32_t	key;
 	unsigned short	restrict_mask;
 	uint8_t		mode;
 	uint8_t		version;
 	uint8_t		li_vn_mode;
-	float		since_last;	/* seconds since last packet */
+	uint64_t	ticks;		/* 1/16 s since last packet */
+	float		score;
 
+	rbufp->xleave = XLEAVE_NONE;
 	if (mon_data.mon_enabled == MON_OFF)
 		return ~(RES_LIMITED | RES_KOD) & flags;
 
-	hash = MON_HASH(&rbufp->recv_srcadr);
+	key = mon_key(&rbufp->recv_srcadr);
 	li_vn_mode = rbufp->recv_buffer[0];
 	mode = PKT_MODE(li_vn_mode);
 	version = PKT_VERSION(li_vn_mode);
-	mon = mon_data.mon_hash[hash];
 	/*
 	 * We keep track of all traffic for a given IP in one entry,
 	 * otherwise cron'ed ntpdate or similar evades RES_LIMITED.
 	 */
+	slot = mon_find(&rbufp->recv_srcadr, key);
 
-	for (; mon != NULL; mon = mon->hash_next)
-		if (SOCK_EQ(&mon->rmtadr, &rbufp->recv_srcadr))
-			break;
-
-	if (mon != NULL) {
+	if (slot != NULL) {
+		mon = slot->mon;
 		mon_data.mru_exists++;
 		delta_fp = rbufp->recv_time-mon->last;
 		mon->last = rbufp->recv_time;
@@ -366,25 +1193,39 @@ ntp_monitor(
 		mon->count++;
 		restrict_mask = flags;
 		mon->vn_mode = VN_MODE(version, mode);
+		if (NULL == mon->lcladr)	/* restored by mon_restore() */
+			mon->lcladr = rbufp->dstadr;
 
-		/* Shuffle to the head of the MRU list. */
-		UNLINK_DLIST(mon, mru);
-		LINK_DLIST(mon_data.mon_mru_list, mon, mru);
+		if (mon_data.mru_clocksweep) {
+			/* mon_sweep() and mon_sort_mru() catch up later */
+			mon->referenced = true;
+			mon_data.mru_unsorted = true;
+		} else {
+			/* Shuffle to the head of the MRU list. */
+			UNLINK_DLIST(mon, mru);
+			LINK_DLIST(mon_data.mon_mru_list, mon, mru);
+		}
 
 		/* Keep score:
 		 * if packets arrive at 1/second,
 		 * score will build up to (almost) 1.0
 		 */
-		since_last = ldexpf(delta_fp, -32);
-		mon->score *= expf(-since_last/mon_data.decay_time);
+		ticks = delta_fp >> 28;
+		mon->score = mon_decay(mon->score,
+				       (uint32_t)min(ticks, UINT32_MAX),
+				       (uint32_t)delta_fp & 0x0fffffff);
 		mon->score += 1.0/mon_data.decay_time;
 
 		if (mon->score < mon_data.rate_limit) {
 			/* low score, turn off reject bits */
 			restrict_mask &= ~(RES_LIMITED | RES_KOD);
 		}
-		if (RES_LIMITED & restrict_mask)
+		if (RES_LIMITED & restrict_mask) {
 			mon->dropped++;
+			/* the kernel filter drops it till it decays back */
+			if (MODE_CLIENT == mode)
+				mon_hold(&rbufp->recv_srcadr, mon->score);
+		}
 
 		/* HACK: Much abusive traffic is big bursts.
 		 * Don't send KoDs for them or we can be used
@@ -393,7 +1234,11 @@ ntp_monitor(
 			restrict_mask &= ~RES_KOD;
 		}
 
+		if (MODE_CLIENT == mode && !mon_duplicate(mon, rbufp))
+			mon_xleave(mon, rbufp);
 		mon->flags = restrict_mask;
+		NTP_TRACE3(monitor, &rbufp->recv_srcadr, mon->flags,
+			   mon->count);
 		return mon->flags;
 	}
 
@@ -411,8 +1256,9 @@ ntp_monitor(
 	 * - mru_maxage ("mru maxage") is a ceiling on the age in
 	 *   seconds of entries.  Entries older than this are
 	 *   reclaimed once mon_mindepth is exceeded.  3600s default.
-	 *   Note that entries older than this can easily survive
-	 *   as they are reclaimed only as needed.
+	 *   mon_expire() also frees them, up to "mru sweep" a
+	 *   second, so a flood's leftovers don't wait for the next
+	 *   one to be reclaimed.
 	 * - mru_maxdepth ("mru maxdepth") is a hard limit on the
 	 *   number of entries.
 	 * - "mru maxmem" sets mru_maxdepth to the number of entries
@@ -429,13 +1275,28 @@ ntp_monitor(
 	 * Whichever of "mru maxmem" or "mru maxdepth" occurs last in
 	 * ntp.conf controls.  Similarly for "mru initalloc" and "mru
 	 * initmem", and for "mru incalloc" and "mru incmem".
+	 * - "mru sketch" sets the size of the sketch in kilobytes.
+	 *   With one, sources it rates under SKETCH_ADMIT of
+	 *   rate_limit get no entry at all.
 	 */
+	if (NULL == mon_data.mon_hash)
+		mon_tables(mon_data.mru_initalloc);
+	score = 1.0f / mon_data.decay_time;
+	if (NULL != mon_sketch) {
+		score = sketch_update(key, rbufp->recv_time);
+		if (score < SKETCH_ADMIT * mon_data.rate_limit) {
+			mon_data.mru_sketched++;
+			return ~(RES_LIMITED | RES_KOD) & flags;
+		}
+	}
 	if (mon_data.mru_entries < mon_data.mru_mindepth) {
 		mon_data.mru_new++;
 		if (NULL == mon_free)
 			mon_getmoremem();
-		UNLINK_HEAD_SLIST(mon, mon_free, hash_next);
+		UNLINK_HEAD_SLIST(mon, mon_free, free_next);
 	} else {
+		if (mon_data.mru_clocksweep)
+			mon_sweep();
 		oldest = TAIL_DLIST(mon_data.mon_mru_list, mru);
 		oldest_age = mon_get_oldest_age(rbufp->recv_time);
 		if (mon_data.mru_maxage < oldest_age) {
@@ -446,7 +1307,7 @@ ntp_monitor(
 			mon_data.mru_new++;
 			if (NULL == mon_free)
 				mon_getmoremem();
-			UNLINK_HEAD_SLIST(mon, mon_free, hash_next);
+			UNLINK_HEAD_SLIST(mon, mon_free, free_next);
 		} else if (oldest_age < mon_data.mru_minage) {
 			mon_data.mru_none++;
 			return ~(RES_LIMITED | RES_KOD) & flags;
@@ -469,21 +1330,28 @@ ntp_monitor(
 	mon->first = mon->last;
 	mon->count = 1;
 	mon->dropped = 0;
-	mon->score = 1.0/mon_data.decay_time;
+	mon->score = score;
+	mon->ctl_tokens = mon_data.ctl_burst;
+	mon->ctl_stamp = current_time;
 	mon->flags = ~(RES_LIMITED | RES_KOD) & flags;
 	memcpy(&mon->rmtadr, &rbufp->recv_srcadr, sizeof(mon->rmtadr));
 	mon->vn_mode = VN_MODE(version, mode);
 	mon->lcladr = rbufp->dstadr;
+	mon->xl_rx = 0;
+	mon->xl_tx = 0;
+	mon->req_xmt = 0;
+	mon->res_gen = 0;
+	if (MODE_CLIENT == mode)
+		mon_xleave(mon, rbufp);
 
 	/*
-	 * Drop him into front of the hash table. Also put him on top of
-	 * the MRU list.
+	 * Enter him in the hash table. Also put him on top of the MRU
+	 * list.
 	 */
-	if (NULL == mon_data.mon_hash[hash])
-		mon_data.mru_hashslots++;
-	LINK_SLIST(mon_data.mon_hash[hash], mon, hash_next);
+	add_to_hash(mon, key);
 	LINK_DLIST(mon_data.mon_mru_list, mon, mru);
 
+	NTP_TRACE3(monitor, &rbufp->recv_srcadr, mon->flags, mon->count);
 	return mon->flags;
 }
 
@@ -14,6 +14,19 @@
 #include "ntp_stdlib.h"
 #include "timespecops.h"
 
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(HAVE_LINUX_PTP_CLOCK_H) \
+    && defined(SO_TIMESTAMPING) && defined(HAVE_SYS_IOCTL_H)
+# define USE_HWSTAMP
+# include <fcntl.h>
+# include <pthread.h>
+# include <net/if.h>
+# include <linux/errqueue.h>
+# include <linux/ethtool.h>
+# include <linux/net_tstamp.h>
+# include <linux/ptp_clock.h>
+# include <linux/sockios.h>
+#endif
+
 /* We handle 3 flavors of timestamp:
  * SO_TIMESTAMPNS/SCM_TIMESTAMPNS  Linux (maybe others)
  * SO_TS_CLOCK/SCM_REALTIME        FreeBSD
@@ -31,6 +44,9 @@
  * If SO_xxx exists, we assume that SCM_xxx does too.
  * All flavors assume the CMSG_xxx macros exist.
  *
+ * On Linux, interfaces named by "hwtimestamp" also get NIC hardware
+ * stamps through SO_TIMESTAMPING, on top of the software ones; see
+ * the end of this file.
  */
 
 
@@ -120,6 +136,10 @@ static const union {
 #pragma clang diagnostic ignored "-Wunneeded-internal-declaration"
 #endif
 
+#ifdef USE_HWSTAMP
+static bool hwstamp_rx(struct msghdr *, struct phc *, l_fp *);
+#endif
+
 static inline struct timespec *
 access_cmsg_timespec(struct cmsghdr *cmsghdr, struct timespec *temp)
 {
@@ -316,7 +336,8 @@ enable_packetstamps(
  */
 l_fp
 fetch_packetstamp(
-	struct msghdr *		msghdr
+	struct msghdr *		msghdr,
+	struct phc *		phc
 	)
 {
 	struct cmsghdr *	cmsghdr;
@@ -327,8 +348,20 @@ fetch_packetstamp(
 #endif
 	l_fp			nts = 0;  /* network time stamp */
 
-/* There should be only one cmsg. */
+#ifdef USE_HWSTAMP
+	if (NULL != phc && hwstamp_rx(msghdr, phc, &nts))
+		return nts;
+#else
+	UNUSED_ARG(phc);
+#endif
+
+/* There should be only one software stamp. */
 	cmsghdr = CMSG_FIRSTHDR(msghdr);
+#ifdef USE_HWSTAMP
+	while (NULL != cmsghdr && SOL_SOCKET == cmsghdr->cmsg_level
+	       && SCM_TIMESTAMPING == cmsghdr->cmsg_type)
+		cmsghdr = CMSG_NXTHDR(msghdr, cmsghdr);
+#endif
 	if (NULL == cmsghdr) {
 		DPRINT(4, ("fetch_timestamp: can't find timestamp\n"));
 		msyslog(LOG_ERR, "ERR: fetch_timestamp: no msghdrs");
@@ -396,4 +429,507 @@ fetch_packetstamp(
 	return nts;
 }
 
+#ifdef USE_HWSTAMP
+/*
+ * Hardware timestamps.
+ *
+ * The NIC stamps packets with its PTP hardware clock (PHC), which runs
+ * on its own time, so each stamp is carried over to the system clock
+ * through readings of the PHC against it.  A reading is taken when a
+ * stamp is more than PHC_REFRESH away from the last one, and the two
+ * most recent give the rate difference to extrapolate with.
+ *
+ * Receive stamps replace the software ones.
+ *
+ * Transmit stamps need no NIC: every socket but the wildcards reports
+ * the kernel's software stamps too, and packets that want a transmit
+ * stamp ask for both kinds; a NIC that stamps suppresses the software
+ * one.  The stamp comes back on the socket's error queue with the
+ * frame.  A client's replaces the origin timestamp that peer_xmit()
+ * took with get_systime() before the packet was built, which also
+ * takes the time spent on authentication out of the measured delay.
+ * A server reply is only stamped in interleaved mode, where the next
+ * reply can carry the stamp; see ntp_monitor.c.
+ */
+#define HWSTAMP_IFS_MAX	16	/* "hwtimestamp" lines */
+#define PHC_MAX		8	/* distinct PHCs */
+#define PHC_SAMPLES	5	/* PTP_SYS_OFFSET readings per refresh */
+#define PHC_REFRESH	1000000000LL	/* ns */
+
+struct phc {
+	int		index;		/* /dev/ptpN */
+	int		fd;
+	pthread_mutex_t	lock;		/* responder threads stamp too */
+	bool		valid;		/* phc0 and sys0 are set */
+	int64_t		phc0, sys0;	/* last reading, ns */
+	double		rate;		/* sys/phc - 1 between readings */
+};
+
+static char *		hw_ifnames[HWSTAMP_IFS_MAX];
+static int		hw_nifnames;
+static struct phc	phcs[PHC_MAX];
+static int		nphcs;
+static bool		tx_unsupported;	/* kernel refused per-packet stamps */
+
+static inline int64_t
+ptp_ns(const struct ptp_clock_time *t)
+{
+	return t->sec * NS_PER_S + t->nsec;
+}
+
+/*
+ * hwstamp_config - remember an interface name from "hwtimestamp";
+ * "*" means every interface that can do it
+ */
+void
+hwstamp_config(
+	const char *	ifname
+	)
+{
+	if (HWSTAMP_IFS_MAX == hw_nifnames) {
+		msyslog(LOG_ERR, "CONFIG: too many hwtimestamp lines, %s ignored",
+			ifname);
+		return;
+	}
+	hw_ifnames[hw_nifnames++] = estrdup(ifname);
+}
+
+static bool
+hwstamp_wanted(
+	const char *	ifname
+	)
+{
+	for (int i = 0; i < hw_nifnames; i++)
+		if (!strcmp("*", hw_ifnames[i]) || !strcmp(ifname, hw_ifnames[i]))
+			return true;
+	return false;
+}
+
+/*
+ * phc_read - take a fresh reading of the PHC against the system
+ * clock, keeping the one with the shortest system clock bracket.
+ * Called with phc->lock held.
+ */
+static bool
+phc_read(
+	struct phc *	phc
+	)
+{
+	struct ptp_sys_offset	off;
+	int64_t	best = INT64_MAX, phc1 = 0, sys1 = 0;
+
+	memset(&off, '\0', sizeof(off));
+	off.n_samples = PHC_SAMPLES;
+	if (ioctl(phc->fd, PTP_SYS_OFFSET, &off) < 0)
+		return false;
+	for (unsigned int i = 0; i < off.n_samples; i++) {
+		int64_t before = ptp_ns(&off.ts[2 * i]);
+		int64_t after = ptp_ns(&off.ts[2 * i + 2]);
+
+		if (after - before < best) {
+			best = after - before;
+			sys1 = before + (after - before) / 2;
+			phc1 = ptp_ns(&off.ts[2 * i + 1]);
+		}
+	}
+	if (phc->valid && phc1 - phc->phc0 > PHC_REFRESH / 2)
+		phc->rate = (double)((sys1 - phc->sys0) - (phc1 - phc->phc0))
+			    / (double)(phc1 - phc->phc0);
+	phc->phc0 = phc1;
+	phc->sys0 = sys1;
+	phc->valid = true;
+	return true;
+}
+
+/*
+ * phc_to_lfp - carry a PHC time over to the system clock
+ */
+static bool
+phc_to_lfp(
+	struct phc *		phc,
+	const struct timespec *	ts,
+	l_fp *			stamp
+	)
+{
+	struct timespec	sys;
+	int64_t		hw = ts->tv_sec * (int64_t)NS_PER_S + ts->tv_nsec;
+	int64_t		dt, ns;
+
+	if (0 == ts->tv_sec && 0 == ts->tv_nsec)
+		return false;
+	pthread_mutex_lock(&phc->lock);
+	if ((!phc->valid || llabs(hw - phc->phc0) > PHC_REFRESH)
+	    && !phc_read(phc)) {
+		pthread_mutex_unlock(&phc->lock);
+		return false;
+	}
+	dt = hw - phc->phc0;
+	ns = phc->sys0 + dt + (int64_t)((double)dt * phc->rate);
+	pthread_mutex_unlock(&phc->lock);
+
+	sys.tv_sec = (time_t)(ns / NS_PER_S);
+	sys.tv_nsec = (long)(ns % NS_PER_S);
+	*stamp = tspec_stamp_to_lfp(sys);
+	return true;
+}
+
+/*
+ * phc_open - find or open the PHC of an interface, first turning on
+ * its hardware stamping unless something like ptp4l already has
+ */
+static struct phc *
+phc_open(
+	int		sock,
+	const char *	ifname
+	)
+{
+	struct ethtool_ts_info	info;
+	struct hwtstamp_config	cfg;
+	struct ifreq		ifr;
+	const uint32_t		need = SOF_TIMESTAMPING_RX_HARDWARE
+				       | SOF_TIMESTAMPING_TX_HARDWARE
+				       | SOF_TIMESTAMPING_RAW_HARDWARE;
+	char			path[32];
+	struct phc *		phc;
+	int			fd;
+
+	memset(&ifr, '\0', sizeof(ifr));
+	strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	memset(&info, '\0', sizeof(info));
+	info.cmd = ETHTOOL_GET_TS_INFO;
+	ifr.ifr_data = (void *)&info;
+	if (ioctl(sock, SIOCETHTOOL, &ifr) < 0
+	    || need != (need & info.so_timestamping) || info.phc_index < 0) {
+		msyslog(LOG_INFO, "IO: %s has no hardware timestamping",
+			ifname);
+		return NULL;
+	}
+
+	memset(&cfg, '\0', sizeof(cfg));
+	ifr.ifr_data = (void *)&cfg;
+	if (ioctl(sock, SIOCGHWTSTAMP, &ifr) < 0
+	    || HWTSTAMP_TX_ON != cfg.tx_type
+	    || HWTSTAMP_FILTER_NONE == cfg.rx_filter) {
+		cfg.flags = 0;
+		cfg.tx_type = HWTSTAMP_TX_ON;
+		cfg.rx_filter =
+		    (info.rx_filters & (1u << HWTSTAMP_FILTER_NTP_ALL))
+			? HWTSTAMP_FILTER_NTP_ALL : HWTSTAMP_FILTER_ALL;
+		if (ioctl(sock, SIOCSHWTSTAMP, &ifr) < 0) {
+			msyslog(LOG_ERR,
+				"IO: can't enable hardware timestamping on %s: %s",
+				ifname, strerror(errno));
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i < nphcs; i++)
+		if (phcs[i].index == info.phc_index)
+			return &phcs[i];
+	if (PHC_MAX == nphcs) {
+		msyslog(LOG_ERR, "IO: too many PTP clocks, %s not used", ifname);
+		return NULL;
+	}
+	snprintf(path, sizeof(path), "/dev/ptp%d", info.phc_index);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		msyslog(LOG_ERR, "IO: can't open %s for %s: %s",
+			path, ifname, strerror(errno));
+		return NULL;
+	}
+	phc = &phcs[nphcs++];
+	phc->index = info.phc_index;
+	phc->fd = fd;
+	pthread_mutex_init(&phc->lock, NULL);
+	msyslog(LOG_INFO, "IO: hardware timestamping on %s using %s",
+		ifname, path);
+	return phc;
+}
+
+/*
+ * enable_timestamping - have a socket report software transmit stamps,
+ * and NIC stamps if its interface was named by "hwtimestamp"
+ */
+void
+enable_timestamping(
+	int	fd,
+	endpt *	ep
+	)
+{
+	int	flags = SOF_TIMESTAMPING_SOFTWARE;
+
+	if (INT_WILDCARD & ep->flags)
+		return;
+	if (0 < hw_nifnames && !(INT_LOOPBACK & ep->flags)
+	    && hwstamp_wanted(ep->name)) {
+		if (NULL == ep->phc)
+			ep->phc = phc_open(fd, ep->name);
+		if (NULL != ep->phc)
+			flags |= SOF_TIMESTAMPING_RX_HARDWARE
+				 | SOF_TIMESTAMPING_RAW_HARDWARE;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING,
+		       (const void *)&flags, sizeof(flags))) {
+		msyslog(LOG_ERR, "IO: setsockopt SO_TIMESTAMPING on %s: %s",
+			socktoa(&ep->sin), strerror(errno));
+		ep->phc = NULL;
+	}
+}
+
+/* the raw hardware stamp of a datagram, in system time */
+static bool
+hwstamp_rx(
+	struct msghdr *	msghdr,
+	struct phc *	phc,
+	l_fp *		stamp
+	)
+{
+	struct cmsghdr *	cmsghdr;
+	struct scm_timestamping	tss;
+
+	for (cmsghdr = CMSG_FIRSTHDR(msghdr); NULL != cmsghdr;
+	     cmsghdr = CMSG_NXTHDR(msghdr, cmsghdr)) {
+		if (SOL_SOCKET != cmsghdr->cmsg_level
+		    || SCM_TIMESTAMPING != cmsghdr->cmsg_type)
+			continue;
+		memcpy(&tss, CMSG_DATA(cmsghdr), sizeof(tss));
+		return phc_to_lfp(phc, &tss.ts[2], stamp);
+	}
+	return false;
+}
+
+/*
+ * txstamp_control - fill in the control message that asks for a
+ * packet's transmit stamp.  Returns its length, 0 if the kernel can't
+ * take the request per packet (before 4.13).
+ */
+size_t
+txstamp_control(
+	void *	buf,
+	size_t	size
+	)
+{
+	struct msghdr	msghdr;
+	struct cmsghdr *cmsghdr;
+	const uint32_t	flags = SOF_TIMESTAMPING_TX_HARDWARE
+				| SOF_TIMESTAMPING_TX_SOFTWARE;
+
+	if (tx_unsupported || size < CMSG_SPACE(sizeof(flags)))
+		return 0;
+	memset(buf, '\0', CMSG_SPACE(sizeof(flags)));
+	memset(&msghdr, '\0', sizeof(msghdr));
+	msghdr.msg_control = buf;
+	msghdr.msg_controllen = CMSG_SPACE(sizeof(flags));
+	cmsghdr = CMSG_FIRSTHDR(&msghdr);
+	cmsghdr->cmsg_level = SOL_SOCKET;
+	cmsghdr->cmsg_type = SO_TIMESTAMPING;
+	cmsghdr->cmsg_len = CMSG_LEN(sizeof(flags));
+	memcpy(CMSG_DATA(cmsghdr), &flags, sizeof(flags));
+	return CMSG_SPACE(sizeof(flags));
+}
+
+/*
+ * txstamp_refused - after a send of msghdr failed with EINVAL: if it
+ * asked for a transmit stamp, stop asking and say it is worth a retry
+ */
+bool
+txstamp_refused(
+	struct msghdr *	msghdr
+	)
+{
+	if (0 == msghdr->msg_controllen)
+		return false;
+	if (!tx_unsupported)
+		msyslog(LOG_INFO,
+			"IO: kernel can't stamp single packets, "
+			"no transmit timestamps");
+	tx_unsupported = true;
+	msghdr->msg_control = NULL;
+	msghdr->msg_controllen = 0;
+	return true;
+}
+
+/*
+ * sendto_txstamp - sendto() that asks for the packet to be stamped as
+ * it leaves
+ */
+ssize_t
+sendto_txstamp(
+	int		fd,
+	void *		pkt,
+	size_t		len,
+	sockaddr_u *	dest
+	)
+{
+	union {
+		char		buf[TXSTAMP_CONTROL];
+		struct cmsghdr	align;
+	} control;
+	struct msghdr	msghdr;
+	struct iovec	iovec;
+	ssize_t		cc;
+
+	iovec.iov_base = pkt;
+	iovec.iov_len = len;
+	memset(&msghdr, '\0', sizeof(msghdr));
+	msghdr.msg_name = &dest->sa;
+	msghdr.msg_namelen = SOCKLEN(dest);
+	msghdr.msg_iov = &iovec;
+	msghdr.msg_iovlen = 1;
+	msghdr.msg_controllen = txstamp_control(control.buf,
+						sizeof(control.buf));
+	if (0 != msghdr.msg_controllen)
+		msghdr.msg_control = control.buf;
+
+	cc = sendmsg(fd, &msghdr, 0);
+	if (cc < 0 && EINVAL == errno && txstamp_refused(&msghdr))
+		cc = sendmsg(fd, &msghdr, 0);
+	return cc;
+}
+
+/* give a transmit stamp to the peer whose packet frame holds */
+static bool
+txstamp_peer(
+	struct peer *	peers,
+	const char *	frame,
+	size_t		len,
+	l_fp		stamp
+	)
+{
+	uint32_t	wire[2];
+
+	for (struct peer *p = peers; NULL != p; p = p->ilink) {
+		wire[0] = htonl(lfpuint(p->org_rand));
+		wire[1] = htonl(lfpfrac(p->org_rand));
+		if (NULL == memmem(frame, len, wire, sizeof(wire)))
+			continue;
+		DPRINT(2, ("fetch_txstamps: %s tx %s was %s\n",
+			   socktoa(&p->srcadr), ulfptoa(stamp, 9),
+			   ulfptoa(p->org_ts, 9)));
+		p->org_ts = stamp;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * fetch_txstamps - collect the transmit stamps waiting on a socket's
+ * error queue.  The looped-back frame carries the packet.  A client
+ * packet's transmit timestamp field is peer->org_rand, so that is what
+ * is matched against the peers; anything else may be a server reply
+ * in interleaved mode.  Call with proto_lock held.
+ */
+void
+fetch_txstamps(
+	SOCKET		fd,
+	struct phc *	phc,
+	struct peer *	peers
+	)
+{
+	char			frame[512];
+	char			control[256];
+	struct msghdr		msghdr;
+	struct iovec		iovec;
+	struct cmsghdr *	cmsghdr;
+	struct scm_timestamping	tss;
+	l_fp			stamp;
+	ssize_t			len;
+	bool			found;
+
+	for (;;) {
+		iovec.iov_base = frame;
+		iovec.iov_len = sizeof(frame);
+		memset(&msghdr, '\0', sizeof(msghdr));
+		msghdr.msg_iov = &iovec;
+		msghdr.msg_iovlen = 1;
+		msghdr.msg_control = control;
+		msghdr.msg_controllen = sizeof(control);
+		len = recvmsg(fd, &msghdr, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (len < 0)
+			return;
+
+		found = false;
+		for (cmsghdr = CMSG_FIRSTHDR(&msghdr); NULL != cmsghdr;
+		     cmsghdr = CMSG_NXTHDR(&msghdr, cmsghdr))
+			if (SOL_SOCKET == cmsghdr->cmsg_level
+			    && SCM_TIMESTAMPING == cmsghdr->cmsg_type) {
+				memcpy(&tss, CMSG_DATA(cmsghdr), sizeof(tss));
+				found = true;
+			}
+		if (!found)
+			continue;
+		if (NULL == phc || !phc_to_lfp(phc, &tss.ts[2], &stamp)) {
+			if (0 == tss.ts[0].tv_sec && 0 == tss.ts[0].tv_nsec)
+				continue;
+			stamp = tspec_stamp_to_lfp(tss.ts[0]);
+		}
+		if (!txstamp_peer(peers, frame, (size_t)len, stamp))
+			mon_txstamp(frame, (size_t)len, stamp);
+	}
+}
+#else	/* !USE_HWSTAMP */
+void
+hwstamp_config(
+	const char *	ifname
+	)
+{
+	msyslog(LOG_ERR,
+		"CONFIG: hwtimestamp %s ignored, not supported on this system",
+		ifname);
+}
+
+void
+enable_timestamping(
+	int	fd,
+	endpt *	ep
+	)
+{
+	UNUSED_ARG(fd);
+	UNUSED_ARG(ep);
+}
+
+size_t
+txstamp_control(
+	void *	buf,
+	size_t	size
+	)
+{
+	UNUSED_ARG(buf);
+	UNUSED_ARG(size);
+	return 0;
+}
+
+bool
+txstamp_refused(
+	struct msghdr *	msghdr
+	)
+{
+	UNUSED_ARG(msghdr);
+	return false;
+}
+
+ssize_t
+sendto_txstamp(
+	int		fd,
+	void *		pkt,
+	size_t		len,
+	sockaddr_u *	dest
+	)
+{
+	return sendto(fd, pkt, len, 0, &dest->sa, SOCKLEN(dest));
+}
+
+void
+fetch_txstamps(
+	SOCKET		fd,
+	struct phc *	phc,
+	struct peer *	peers
+	)
+{
+	UNUSED_ARG(fd);
+	UNUSED_ARG(phc);
+	UNUSED_ARG(peers);
+}
+#endif	/* USE_HWSTAMP */
+
 // end
@@ -58,36 +58,56 @@
 %token	<Integer>	T_Ask
 %token	<Integer>	T_Auth
 %token	<Integer>	T_Average
+%token	<Integer>	T_Backlog
 %token	<Integer>	T_Baud
 %token	<Integer>	T_Bias
+%token	<Integer>	T_Binary
+%token	<Integer>	T_Bpffilter
+%token	<Integer>	T_Budget
 %token	<Integer>	T_Burst
+%token	<Integer>	T_Busypoll
 %token	<Integer>	T_Calibrate
 %token	<Integer>	T_Ca
 %token	<Integer>	T_Ceiling
 %token	<Integer>	T_Cert
+%token	<Integer>	T_Clientcache
 %token	<Integer>	T_Clock
+%token	<Integer>	T_Clocksweep
 %token	<Integer>	T_Clockstats
 %token	<Integer>	T_Cohort
+%token	<Integer>	T_Compress
 %token	<Integer>	T_Cookie
+%token	<Integer>	T_Cookiesecret
 %token	<Integer>	T_ControlKey
+%token	<Integer>	T_Controlsocket
+%token	<Integer>	T_Cpu
 %token	<Integer>	T_Ctl
+%token	<Integer>	T_Ctlaverage
+%token	<Integer>	T_Ctlburst
+%token	<Integer>	T_Ctlslice
 %token	<Integer>	T_Day
 %token	<Integer>	T_Default
 %token	<Integer>	T_Disable
 %token	<Integer>	T_Dispersion
 %token	<Double>	T_Double		/* Not a token */
+%token	<Integer>	T_Dns
 %token	<Integer>	T_Driftfile
 %token	<Integer>	T_Drop
 %token	<Integer>	T_Dscp
+%token	<Integer>	T_Dupdrop
+%token	<Integer>	T_Duplicate
 %token	<Integer>	T_Expire
 %token	<Integer>	T_Extra
 %token	<Integer>	T_Ellipsis	/* "..." not "ellipsis" */
 %token	<Integer>	T_Enable
 %token	<Integer>	T_End
 %token	<Integer>	T_False
+%token	<Integer>	T_Fastloop
+%token	<Integer>	T_Faststart
 %token	<Integer>	T_File
 %token	<Integer>	T_Filegen
 %token	<Integer>	T_Filenum
+%token	<Integer>	T_Fit
 %token	<Integer>	T_Flag1
 %token	<Integer>	T_Flag2
 %token	<Integer>	T_Flag3
@@ -96,7 +116,10 @@
 %token	<Integer>	T_Floor
 %token	<Integer>	T_Freq
 %token	<Integer>	T_Fudge
+%token	<Integer>	T_Handover
 %token	<Integer>	T_Huffpuff
+%token	<Integer>	T_Hugepages
+%token	<Integer>	T_Hwtimestamp
 %token	<Integer>	T_Iburst
 %token	<Integer>	T_Ignore
 %token	<Integer>	T_Incalloc
@@ -108,15 +131,21 @@
 %token	<Integer>	T_Interface
 %token	<Integer>	T_Intrange		/* Not a token, used as tag */
 %token	<Integer>	T_Io
+%token	<Integer>	T_Iothread
+%token	<Integer>	T_Iouring
 %token	<Integer>	T_Ipv4
 %token	<Integer>	T_Ipv4_flag
 %token	<Integer>	T_Ipv6
 %token	<Integer>	T_Ipv6_flag
+%token	<Integer>	T_Kelimit
 %token	<Integer>	T_Kernel
 %token	<Integer>	T_Key
 %token	<Integer>	T_Keys
 %token	<Integer>	T_Kod
+%token	<Integer>	T_Kodmax
+%token	<Integer>	T_Main
 %token	<Integer>	T_Mssntp
+%token	<Integer>	T_Lean
 %token	<Integer>	T_Leapfile
 %token	<Integer>	T_Leapsmearinterval
 %token	<Integer>	T_Limit
@@ -125,6 +154,7 @@
 %token	<Integer>	T_Listen
 %token	<Integer>	T_Logconfig
 %token	<Integer>	T_Logfile
+%token	<Integer>	T_Loopaggstats
 %token	<Integer>	T_Loopstats
 %token	<Integer>	T_Mask
 %token	<Integer>	T_Maxage
@@ -138,6 +168,7 @@
 %token	<Integer>	T_Mdnstries
 %token	<Integer>	T_Mem
 %token	<Integer>	T_Memlock
+%token	<Integer>	T_Metrics
 %token	<Integer>	T_Minage
 %token	<Integer>	T_Minclock
 %token	<Integer>	T_Mindepth
@@ -150,6 +181,9 @@
 %token	<Integer>	T_Month
 %token	<Integer>	T_Mru
 %token	<Integer>	T_Nic
+%token	<Integer>	T_Nice
+%token	<Integer>	T_Nocompress
+%token	<Integer>	T_Node
 %token	<Integer>	T_Nolink
 %token	<Integer>	T_Nomodify
 %token	<Integer>	T_Nomrulist
@@ -166,6 +200,7 @@
 %token	<Integer>	T_Ntpport
 %token	<Integer>	T_NtpSignDsocket
 %token	<Integer>	T_Nts
+%token	<Integer>	T_Ntske
 %token	<Integer>	T_Ntsstats
 %token	<Integer>	T_Ntskestats
 %token	<Integer>	T_Orphan
@@ -173,16 +208,23 @@
 %token	<Integer>	T_Panic
 %token	<Integer>	T_Path
 %token	<Integer>	T_Peer
+%token	<Integer>	T_Peeraggstats
 %token	<Integer>	T_Peerstats
 %token	<Integer>	T_Phone
 %token	<Integer>	T_Pid
 %token	<Integer>	T_Pidfile
+%token	<Integer>	T_Pkttrace
 %token	<Integer>	T_Pool
 %token	<Integer>	T_Port
 %token	<Integer>	T_Ppspath
+%token	<Integer>	T_Ppsthread
 %token	<Integer>	T_Prefer
+%token	<Integer>	T_Priority
+%token	<Integer>	T_Probe
 %token	<Integer>	T_Protostats
 %token	<Integer>	T_Rawstats
+%token	<Integer>	T_Rcvbuf
+%token	<Integer>	T_Rcvmax
 %token	<Integer>	T_Refclock
 %token	<Integer>	T_Refid
 %token	<Integer>	T_Requestkey
@@ -190,24 +232,40 @@
 %token	<Integer>	T_Reset
 %token	<Integer>	T_Restrict
 %token	<Integer>	T_Rlimit
+%token	<Integer>	T_Rxbatch
+%token	<Integer>	T_Samples
 %token	<Integer>	T_Saveconfigdir
 %token	<Integer>	T_Server
+%token	<Integer>	T_Set
 %token	<Integer>	T_Setvar
+%token	<Integer>	T_Shed
+%token	<Integer>	T_Shedburst
+%token	<Integer>	T_Singlesocket
+%token	<Integer>	T_Sketch
+%token	<Integer>	T_Sndbuf
 %token	<Integer>	T_Source
 %token	<Integer>	T_Stacksize
+%token	<Integer>	T_Stages
+%token	<Integer>	T_Statefile
 %token	<Integer>	T_Statistics
 %token	<Integer>	T_Stats
 %token	<Integer>	T_Statsdir
+%token	<Integer>	T_Statsflush
 %token	<Integer>	T_Step
 %token	<Integer>	T_Stepback
 %token	<Integer>	T_Stepfwd
 %token	<Integer>	T_Stepout
 %token	<Integer>	T_Stratum
+%token	<Integer>	T_Stream
 %token	<Integer>	T_Subtype
+%token	<Integer>	T_Sweep
 %token	<String>	T_String		/* Not a token */
 %token	<Integer>	T_Sys
 %token	<Integer>	T_Sysstats
+%token	<Integer>	T_Text
+%token	<Integer>	T_Thread
 %token	<Integer>	T_Tick
+%token	<Integer>	T_Tickets
 %token	<Integer>	T_Time1
 %token	<Integer>	T_Time2
 %token	<Integer>	T_Timer
@@ -229,6 +287,8 @@
 %token	<Integer>	T_WanderThreshold	/* Not a token, used as tag */
 %token	<Integer>	T_Week
 %token	<Integer>	T_Wildcard
+%token	<Integer>	T_Workers
+%token	<Integer>	T_Xleave
 %token	<Integer>	T_Year
 %token	<Integer>	T_Flag			/* Not a token, used as tag */
 %token	<Integer>	T_EOC
@@ -245,6 +305,8 @@
 %type	<Attr_val>	limit_option
 %type	<Integer>	limit_option_keyword
 %type	<Attr_val_fifo>	limit_option_list
+%type	<Integer>	binary_text
+%type	<Integer>	compress_nocompress
 %type	<Integer>	enable_disable
 %type	<Integer>	extra_option_keyword
 %type	<Attr_val>	extra_option
@@ -299,6 +361,9 @@
 %type	<Integer>	system_option_local_flag_keyword
 %type	<Attr_val_fifo>	system_option_list
 %type	<Integer>	t_default_or_zero
+%type	<Integer>	thread_class
+%type	<Attr_val_fifo>	thread_option
+%type	<Attr_val_fifo>	thread_option_list
 %type	<Integer>	tinker_option_keyword
 %type	<Attr_val>	tinker_option
 %type	<Attr_val_fifo>	tinker_option_list
@@ -359,6 +424,7 @@ command :	/* NULL STATEMENT */
 	|	extra_command
 	|	tinker_command
 	|	nts_command
+	|	thread_command
 	|	miscellaneous_command
 	;
 
@@ -425,12 +491,17 @@ option_flag
 
 option_flag_keyword
 	:	T_Burst
+	|	T_Fit
 	|	T_Iburst
+	|	T_Iothread
 	|	T_Noselect
 	|	T_Noval
 	|	T_Nts
+	|	T_Ppsthread
 	|	T_Prefer
+	|	T_Probe
 	|	T_True
+	|	T_Xleave
 	;
 
 option_int
@@ -458,6 +529,7 @@ option_int_keyword
 	|	T_Subtype
 	|	T_Version
 	|	T_Baud
+	|	T_Stages
 	;
 
 option_double
@@ -597,6 +669,8 @@ tos_option
 			{ $$ = create_attr_dval($1, $2); }
 	|	T_Cohort boolean
 			{ $$ = create_attr_dval($1, (double)$2); }
+	|	T_Faststart boolean
+			{ $$ = create_attr_dval($1, (double)$2); }
 	;
 
 tos_option_int_keyword
@@ -657,7 +731,9 @@ stats_list
 stat
 	:	T_Clockstats
 	|	T_Loopstats
+	|	T_Loopaggstats
 	|	T_Peerstats
+	|	T_Peeraggstats
 	|	T_Rawstats
 	|	T_Sysstats
 	|	T_Protostats
@@ -687,6 +763,16 @@ filegen_option
 				yyerror("filegen file remote config ignored");
 			}
 		}
+	|	T_Stream T_String
+		{
+			if (lex_from_file()) {
+				$$ = create_attr_sval($1, $2);
+			} else {
+				$$ = NULL;
+				YYFREE($2);
+				yyerror("filegen stream remote config ignored");
+			}
+		}
 	|	T_Type filegen_type
 		{
 			if (lex_from_file()) {
@@ -711,6 +797,24 @@ filegen_option
 				yyerror(err);
 			}
 		}
+	|	binary_text
+		{
+			if (lex_from_file()) {
+				$$ = create_attr_ival(T_Flag, $1);
+			} else {
+				$$ = NULL;
+				yyerror("filegen format remote config ignored");
+			}
+		}
+	|	compress_nocompress
+		{
+			if (lex_from_file()) {
+				$$ = create_attr_ival(T_Flag, $1);
+			} else {
+				$$ = NULL;
+				yyerror("filegen compress remote config ignored");
+			}
+		}
 	|	enable_disable
 			{ $$ = create_attr_ival(T_Flag, $1); }
 	;
@@ -720,6 +824,16 @@ link_nolink
 	|	T_Nolink
 	;
 
+binary_text
+	:	T_Binary
+	|	T_Text
+	;
+
+compress_nocompress
+	:	T_Compress
+	|	T_Nocompress
+	;
+
 enable_disable
 	:	T_Enable
 	|	T_Disable
@@ -808,6 +922,15 @@ access_control_command
 				lex_current()->curpos.nline);
 			APPEND_G_FIFO(cfgt.restrict_opts, rn);
 		}
+	|	restrict_prefix T_Set T_String ac_flag_list
+		{
+			restrict_node *	rn;
+
+			rn = create_restrict_node(
+				$1, NULL, NULL, $4, lex_current()->curpos.nline);
+			rn->set = $3;
+			APPEND_G_FIFO(cfgt.restrict_opts, rn);
+		}
 	|	restrict_prefix T_Source ac_flag_list
 		{
 			restrict_node *	rn;
@@ -867,7 +990,15 @@ limit_option
 limit_option_keyword
 	:	T_Average
 	|	T_Burst
+	|	T_Ctlaverage
+	|	T_Ctlburst
+	|	T_Ctlslice
+	|	T_Dupdrop
+	|	T_Duplicate
 	|	T_Kod
+	|	T_Kodmax
+	|	T_Shed
+	|	T_Shedburst
 	;
 
 mru_option_list
@@ -886,6 +1017,10 @@ mru_option_list
 mru_option
 	:	mru_option_keyword T_Integer
 			{ $$ = create_attr_ival($1, $2); }
+	|	T_Clocksweep
+			{ $$ = create_attr_ival($1, 1); }
+	|	T_Hugepages
+			{ $$ = create_attr_ival($1, 1); }
 	;
 
 mru_option_keyword
@@ -898,6 +1033,8 @@ mru_option_keyword
 	|	T_Maxdepth
 	|	T_Maxmem
 	|	T_Mindepth
+	|	T_Sketch
+	|	T_Sweep
 	;
 
 /* Fudge Commands
@@ -1130,7 +1267,9 @@ tinker_option
 
 tinker_option_keyword
 	:	T_Allan
+	|	T_Budget
 	|	T_Dispersion
+	|	T_Fastloop
 	|	T_Freq
 	|	T_Huffpuff
 	|	T_Panic
@@ -1141,6 +1280,64 @@ tinker_option_keyword
 	;
 
 
+/* Thread Commands
+ * ---------------
+ */
+
+thread_command
+	:	T_Thread thread_class thread_option_list
+		{
+			thread_node *tn;
+
+			tn = create_thread_node($2, $3);
+			APPEND_G_FIFO(cfgt.threads, tn);
+		}
+	;
+
+thread_class
+	:	T_Dns
+	|	T_Main
+	|	T_Ntske
+	|	T_Workers
+	;
+
+thread_option_list
+	:	thread_option_list thread_option
+		{
+			$$ = $1;
+			CONCAT_G_FIFOS($$, $2);
+		}
+	|	thread_option
+	;
+
+thread_option
+	:	T_Cpu integer_list_range
+		{
+			attr_val *av;
+
+			/* keep the type, T_Integer or T_Intrange */
+			for (av = HEAD_PFIFO($2); av != NULL; av = av->link)
+				av->attr = $1;
+			$$ = $2;
+		}
+	|	T_Nice T_Integer
+		{
+			$$ = NULL;
+			APPEND_G_FIFO($$, create_attr_ival($1, $2));
+		}
+	|	T_Node T_Integer
+		{
+			$$ = NULL;
+			APPEND_G_FIFO($$, create_attr_ival($1, $2));
+		}
+	|	T_Priority T_Integer
+		{
+			$$ = NULL;
+			APPEND_G_FIFO($$, create_attr_ival($1, $2));
+		}
+	;
+
+
 /* NTS Commands
  * ---------------
  */
@@ -1174,6 +1371,8 @@ nts_option
 			{ $$ = create_attr_ival($1, 1); }
 	|	T_Tlscipherserverpreference
 			{ $$ = create_attr_ival($1, 1); }
+	|	T_Tickets
+			{ $$ = create_attr_ival($1, 1); }
 	|	T_Pool number
 			{ $$ = create_attr_ival($1, $2); }
 	;
@@ -1184,7 +1383,9 @@ nts_string_option_keyword
 	:	T_Aead
 	|	T_Ca
 	|	T_Cert
+	|	T_Clientcache
 	|	T_Cookie
+	|	T_Cookiesecret
 	|	T_Key
 	|	T_Maxtls
 	|	T_Mintls
@@ -1193,7 +1394,10 @@ nts_string_option_keyword
 	;
 
 nts_number_option_keyword
-	:	T_Port
+	:	T_Backlog
+	|	T_Kelimit
+	|	T_Port
+	|	T_Workers
 	;
 
 /* Miscellaneous Commands
@@ -1269,6 +1473,34 @@ miscellaneous_command
 			{ CONCAT_G_FIFOS(cfgt.phone, $2); }
 	|	T_Setvar variable_assign
 			{ APPEND_G_FIFO(cfgt.setvar, $2); }
+	|	T_Singlesocket
+		{
+			attr_val *av;
+
+			av = create_attr_ival($1, 1);
+			APPEND_G_FIFO(cfgt.vars, av);
+		}
+	|	T_Iouring
+		{
+			attr_val *av;
+
+			av = create_attr_ival($1, 1);
+			APPEND_G_FIFO(cfgt.vars, av);
+		}
+	|	T_Bpffilter
+		{
+			attr_val *av;
+
+			av = create_attr_ival($1, 1);
+			APPEND_G_FIFO(cfgt.vars, av);
+		}
+	|	T_Lean
+		{
+			attr_val *av;
+
+			av = create_attr_ival($1, 1);
+			APPEND_G_FIFO(cfgt.vars, av);
+		}
 	;
 
 misc_cmd_dbl_keyword
@@ -1277,7 +1509,16 @@ misc_cmd_dbl_keyword
 	;
 
 misc_cmd_int_keyword
-	:	T_Dscp
+	:	T_Busypoll
+	|	T_Dscp
+	|	T_Pkttrace
+	|	T_Rcvbuf
+	|	T_Rcvmax
+	|	T_Rxbatch
+	|	T_Samples
+	|	T_Sndbuf
+	|	T_Statsflush
+	|	T_Workers
 	;
 
 misc_cmd_int_keyword
@@ -1294,9 +1535,14 @@ misc_cmd_str_keyword
 	;
 
 misc_cmd_str_lcl_keyword
-	:	T_Logfile
+	:	T_Controlsocket
+	|	T_Handover
+	|	T_Hwtimestamp
+	|	T_Logfile
+	|	T_Metrics
 	|	T_Pidfile
 	|	T_Saveconfigdir
+	|	T_Statefile
 	;
 
 drift_parm
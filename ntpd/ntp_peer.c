@@ -10,6 +10,7 @@
 #include "ntp_lists.h"
 #include "ntp_stdlib.h"
 #include "ntp_auth.h"
+#include "ntp_dns.h"
 
 
 /*
@@ -21,6 +22,11 @@
  * - peer_adr_hash is an array of lists indexed by hashed peer address.
  * - peer_aid_hash is an array of lists indexed by hashed associd.
  *
+ * The hash tables are chained through the peers themselves (adr_link,
+ * aid_link).  Each doubles when it holds more peers than buckets and
+ * halves when it holds fewer than a quarter, so findpeer() stays a
+ * short walk with any number of pool and manycast associations.
+ *
  * They also maintain a free list of peer structures, peer_free.
  *
  * The three main entry points are findpeer(), which looks for matching
@@ -31,10 +37,17 @@
 /*
  * Peer hash tables
  */
-static struct peer *peer_hash[NTP_HASH_SIZE];	/* peer hash table */
-static int	peer_hash_count[NTP_HASH_SIZE];	/* peers in each bucket */
-static struct peer *assoc_hash[NTP_HASH_SIZE];	/* association ID hash table */
-static int	assoc_hash_count[NTP_HASH_SIZE];/* peers in each bucket */
+#define PEER_HASH_MINBITS	7
+#define PEER_HASH_MAXBITS	20
+#define PEER_HASH_SLOTS(t)	(1U << (t).bits)
+/* the top bits of the mixed key, since those are mixed best */
+#define PEER_HOME(t, key)	\
+	(((uint32_t)(key) * 0x9e3779b1U) >> (32 - (t).bits))
+#define ADR_HOME(addr)		PEER_HOME(peer_adr_hash, sock_hash(addr))
+#define AID_HOME(assoc)		PEER_HOME(peer_aid_hash, assoc)
+
+struct peer_hash peer_adr_hash;		/* by address, on adr_link */
+struct peer_hash peer_aid_hash;		/* by associd, on aid_link */
 struct peer *peer_list;				/* peer structures list */
 static struct peer *peer_free;			/* peer structures free list */
 static int	peer_free_count;		/* count of free structures */
@@ -50,7 +63,8 @@ static associd_t initial_association_ID; /* association ID */
  * Memory allocation watermarks.
  */
 #define	INIT_PEER_ALLOC		8	/* static preallocation */
-#define	INC_PEER_ALLOC		4	/* add N more when empty */
+#define	INC_PEER_ALLOC		32	/* add N more when empty */
+#define	INC_PEER_LEAN		4	/* the same under "lean" */
 
 /*
  * Miscellaneous statistic counters which may be queried.
@@ -64,12 +78,17 @@ static int		total_peer_structs;	/* peer structs */
 int			peer_associations;	/* mobilized associations */
 static int		peer_preempt;		/* preemptible associations */
 static struct peer init_peer_alloc[INIT_PEER_ALLOC]; /* init alloc */
+static struct peer_cold init_peer_cold[INIT_PEER_ALLOC];
 
 static struct peer *	findexistingpeer_name(const char *, unsigned short,
 					      struct peer *, int);
 static struct peer *	findexistingpeer_addr(sockaddr_u *,
 					      struct peer *, int);
 static void		free_peer(struct peer *);
+static void		adr_hash_resize(uint8_t);
+static void		aid_hash_resize(uint8_t);
+static void		aid_add_hash(struct peer *);
+static void		aid_del_hash(struct peer *);
 static void		getmorepeermem(void);
 static	void		peer_reset	(struct peer *);
 static int		score(struct peer *);
@@ -89,11 +108,18 @@ init_peer(void)
 	/*
 	 * Initialize peer free list from static allocation.
 	 */
-	for (i = COUNTOF(init_peer_alloc) - 1; i >= 0; i--)
+	for (i = COUNTOF(init_peer_alloc) - 1; i >= 0; i--) {
+		init_peer_alloc[i].cold = &init_peer_cold[i];
 		LINK_SLIST(peer_free, &init_peer_alloc[i], p_link);
+	}
 	total_peer_structs = COUNTOF(init_peer_alloc);
 	peer_free_count = COUNTOF(init_peer_alloc);
 
+	adr_hash_resize(PEER_HASH_MINBITS);
+	aid_hash_resize(PEER_HASH_MINBITS);
+	peer_adr_hash.resizes = 0;
+	peer_aid_hash.resizes = 0;
+
 	/*
 	 * Initialize our first association ID
 	 */
@@ -105,21 +131,40 @@ init_peer(void)
 
 
 /*
- * getmorepeermem - add more peer structures to the free list
+ * getmorepeermem - add more peer structures to the free list, a slab
+ * of peers and a slab of their cold sides, which are never given back.
+ * Under "lean" the slabs are small, so the pool stays close to what the
+ * configuration asks for.
  */
 static void
 getmorepeermem(void)
 {
-	int i;
+	int i, n;
 	struct peer *peers;
+	struct peer_cold *colds;
 
-	peers = emalloc_zero(INC_PEER_ALLOC * sizeof(*peers));
+	n = lean_memory ? INC_PEER_LEAN : INC_PEER_ALLOC;
+	peers = emalloc_zero_tag(MEM_PEER, n * sizeof(*peers));
+	colds = emalloc_zero_tag(MEM_PEER, n * sizeof(*colds));
 
-	for (i = INC_PEER_ALLOC - 1; i >= 0; i--)
+	for (i = n - 1; i >= 0; i--) {
+		peers[i].cold = &colds[i];
 		LINK_SLIST(peer_free, &peers[i], p_link);
+	}
+
+	total_peer_structs += n;
+	peer_free_count += n;
+}
+
 
-	total_peer_structs += INC_PEER_ALLOC;
-	peer_free_count += INC_PEER_ALLOC;
+/*
+ * peer_memory - bytes in peer structures, free or not
+ */
+size_t
+peer_memory(void)
+{
+	return (size_t)total_peer_structs *
+	       (sizeof(struct peer) + sizeof(struct peer_cold));
 }
 
 
@@ -139,12 +184,12 @@ findexistingpeer_name(
 		p = start_peer->p_link;
 	}
 	for (; p != NULL; p = p->p_link) {
-		if (p->hostname != NULL
+		if (p->cold->hostname != NULL
 		    && (-1 == mode || p->hmode == mode)
 		    && (AF_UNSPEC == hname_fam
 			|| AF_UNSPEC == AF(&p->srcadr)
 			|| hname_fam == AF(&p->srcadr))
-		    && !strcasecmp(p->hostname, hostname))
+		    && !strcasecmp(p->cold->hostname, hostname))
 			break;
 	}
 	return p;
@@ -175,7 +220,7 @@ findexistingpeer_addr(
 	 * address.
 	 */
 	if (NULL == start_peer)
-		peer = peer_hash[NTP_HASH_ADDR(addr)];
+		peer = peer_adr_hash.bucket[ADR_HOME(addr)];
 	else
 		peer = start_peer->adr_link;
 
@@ -217,7 +262,7 @@ findexistingpeer(
 
 /*
  * findpeer - find and return a peer match for a received datagram in
- *	      the peer_hash table.
+ *	      the peer_adr_hash table.
  */
 struct peer *
 findpeer(
@@ -226,12 +271,11 @@ findpeer(
 {
 	struct peer *	p;
 	sockaddr_u *	srcadr;
-	unsigned int	hash;
 
 	findpeer_calls++;
 	srcadr = &rbufp->recv_srcadr;
-	hash = NTP_HASH_ADDR(srcadr);
-        for (p = peer_hash[hash]; p != NULL; p = p->adr_link) {
+        for (p = peer_adr_hash.bucket[ADR_HOME(srcadr)]; p != NULL;
+	     p = p->adr_link) {
                 /* [Classic Bug 3072] ensure interface of peer matches */
                 if (p->dstadr != rbufp->dstadr) continue;
 
@@ -253,11 +297,10 @@ findpeerbyassoc(
 	)
 {
 	struct peer *p;
-	unsigned int hash;
 
 	assocpeer_calls++;
-	hash = assoc & NTP_HASH_MASK;
-	for (p = assoc_hash[hash]; p != NULL; p = p->aid_link) {
+	for (p = peer_aid_hash.bucket[AID_HOME(assoc)]; p != NULL;
+	     p = p->aid_link) {
 		if (assoc == p->associd)
 			break;
 	}
@@ -365,34 +408,16 @@ free_peer(
 	)
 {
 	struct peer *	unlinked;
-	int		hash;
-
+	struct peer_cold *cold;
 
-	if ((MDF_UCAST & p->cast_flags) && !(FLAG_LOOKUP & p->cfg.flags)) {
-		hash = NTP_HASH_ADDR(&p->srcadr);
-		peer_hash_count[hash]--;
-
-		UNLINK_SLIST(unlinked, peer_hash[hash], p, adr_link,
-			     struct peer);
-		if (NULL == unlinked) {
-			peer_hash_count[hash]++;
-			msyslog(LOG_ERR, "ERR: peer %s not in address table!",
-				socktoa(&p->srcadr));
-		}
-	}
+	if ((MDF_UCAST & p->cast_flags) && !(FLAG_LOOKUP & p->cfg.flags))
+		peer_del_hash(p);
 
 	/* Remove him from the association hash as well. */
-	hash = p->associd & NTP_HASH_MASK;
-	assoc_hash_count[hash]--;
+	aid_del_hash(p);
 
-	UNLINK_SLIST(unlinked, assoc_hash[hash], p, aid_link,
-		     struct peer);
-	if (NULL == unlinked) {
-		assoc_hash_count[hash]++;
-		msyslog(LOG_ERR,
-			"ERR: peer %s not in association ID table!",
-			socktoa(&p->srcadr));
-	}
+	/* No more polls for him. */
+	timer_unschedule(p);
 
 	/* Remove him from the overall list. */
 	UNLINK_SLIST(unlinked, peer_list, p, p_link,
@@ -401,11 +426,27 @@ free_peer(
 		msyslog(LOG_ERR, "ERR: %s not in peer list!",
 			socktoa(&p->srcadr));
 
-	if (p->hostname != NULL)
-		free(p->hostname);
+	if (MDF_POOL & p->cast_flags)
+		pool_forget(p);
+	else if (FLAG_PREEMPT & p->cfg.flags)
+		pool_demote(p);
+
+	if (p->cold->hostname != NULL)
+		free_tag(MEM_PEER, p->cold->hostname,
+			 strlen(p->cold->hostname) + 1);
+	free_tag(MEM_PEER, p->cold->samples,
+		 p->cold->sample_slots * sizeof(*p->cold->samples));
+	peer_agg_forget(p);
+	dns_forget(p);
+#ifndef DISABLE_NTS
+	nts_client_forget(p);
+#endif
 
 	/* Add his corporeal form to peer free list */
+	cold = p->cold;
+	ZERO(*cold);
 	ZERO(*p);
+	p->cold = cold;
 	LINK_SLIST(peer_free, p, p_link);
 	peer_free_count++;
 }
@@ -547,7 +588,6 @@ newpeer(
 	)
 {
 	struct peer *	peer;
-	unsigned int	hash;
 	const char *	name;	/* for error messages */
 
 
@@ -613,7 +653,7 @@ newpeer(
 
 	peer->srcadr = *srcadr;
 	if (hostname != NULL)
-		peer->hostname = estrdup(hostname);
+		peer->cold->hostname = estrdup_tag(MEM_PEER, hostname);
 	peer->hmode = hmode;
 
 	/*
@@ -622,7 +662,7 @@ newpeer(
 	memcpy(&peer->cfg, ctl, sizeof(peer->cfg));
 
 	/* reset NTS */
-	peer->nts_state.count = -1;
+	peer->cold->nts_state.count = -1;
 
 	peer->cast_flags = cast_flags;
 	set_peerdstadr(peer,
@@ -669,14 +709,15 @@ newpeer(
 		peer_clear(peer, "DNS", initializing1);
 	else
 		peer_clear(peer, "INIT", initializing1);
+	state_restore_peer(peer);
 	if (clock_ctl.mode_ntpdate)
 		peer_ntpdate++;
 
 	/*
 	 * Note time on statistics timers.
 	 */
-	peer->timereset = current_time;
-	peer->timereachable = current_time;
+	peer->cold->timereset = current_time;
+	peer->cold->timereachable = current_time;
 	peer->timereceived = current_time;
 
 	/*
@@ -687,9 +728,7 @@ newpeer(
 		peer_add_hash(peer);
 		restrict_source(peer);
 	}
-	hash = peer->associd & NTP_HASH_MASK;
-	LINK_SLIST(assoc_hash[hash], peer, aid_link);
-	assoc_hash_count[hash]++;
+	aid_add_hash(peer);
 	LINK_SLIST(peer_list, peer, p_link);
 
 	mprintf_event(PEVNT_MOBIL, peer, "assoc %d", peer->associd);
@@ -702,27 +741,116 @@ newpeer(
 
 void peer_del_hash (struct peer *peer)
 {
-        unsigned int hash;
         struct peer *unlinked;
 
-        hash = NTP_HASH_ADDR(&peer->srcadr);
-        peer_hash_count[hash]--;
-
-        UNLINK_SLIST(unlinked, peer_hash[hash], peer, adr_link, struct peer);
+        UNLINK_SLIST(unlinked, peer_adr_hash.bucket[ADR_HOME(&peer->srcadr)],
+		     peer, adr_link, struct peer);
         if (NULL == unlinked) {
-            peer_hash_count[hash]++;
             msyslog(LOG_ERR, "ERR: peer %s not in address table!",
                 socktoa(&peer->srcadr));
+	    return;
         }
+	peer_adr_hash.count--;
+	if (peer_adr_hash.bits > PEER_HASH_MINBITS &&
+	    peer_adr_hash.count < PEER_HASH_SLOTS(peer_adr_hash) / 4)
+		adr_hash_resize(peer_adr_hash.bits - 1);
 }
 
 void peer_add_hash (struct peer *peer)
 {
-	unsigned int	hash;
+	if (peer_adr_hash.count >= PEER_HASH_SLOTS(peer_adr_hash) &&
+	    peer_adr_hash.bits < PEER_HASH_MAXBITS)
+		adr_hash_resize(peer_adr_hash.bits + 1);
+	LINK_SLIST(peer_adr_hash.bucket[ADR_HOME(&peer->srcadr)], peer,
+		   adr_link);
+	peer_adr_hash.count++;
+}
 
-	hash = NTP_HASH_ADDR(&peer->srcadr);
-	LINK_SLIST(peer_hash[hash], peer, adr_link);
-	peer_hash_count[hash]++;
+static void
+aid_del_hash(
+	struct peer *peer
+	)
+{
+	struct peer *unlinked;
+
+	UNLINK_SLIST(unlinked, peer_aid_hash.bucket[AID_HOME(peer->associd)],
+		     peer, aid_link, struct peer);
+	if (NULL == unlinked) {
+		msyslog(LOG_ERR,
+			"ERR: peer %s not in association ID table!",
+			socktoa(&peer->srcadr));
+		return;
+	}
+	peer_aid_hash.count--;
+	if (peer_aid_hash.bits > PEER_HASH_MINBITS &&
+	    peer_aid_hash.count < PEER_HASH_SLOTS(peer_aid_hash) / 4)
+		aid_hash_resize(peer_aid_hash.bits - 1);
+}
+
+static void
+aid_add_hash(
+	struct peer *peer
+	)
+{
+	if (peer_aid_hash.count >= PEER_HASH_SLOTS(peer_aid_hash) &&
+	    peer_aid_hash.bits < PEER_HASH_MAXBITS)
+		aid_hash_resize(peer_aid_hash.bits + 1);
+	LINK_SLIST(peer_aid_hash.bucket[AID_HOME(peer->associd)], peer,
+		   aid_link);
+	peer_aid_hash.count++;
+}
+
+/*
+ * adr_hash_resize - move every peer in the address table to a new
+ *		     table of 2^bits buckets
+ */
+static void
+adr_hash_resize(
+	uint8_t bits
+	)
+{
+	struct peer **	old = peer_adr_hash.bucket;
+	unsigned int	oldslots = (NULL == old) ? 0
+				   : PEER_HASH_SLOTS(peer_adr_hash);
+	struct peer *	p;
+
+	peer_adr_hash.bits = bits;
+	peer_adr_hash.bucket = emalloc_zero_tag(MEM_PEER, sizeof(*old) *
+						PEER_HASH_SLOTS(peer_adr_hash));
+	for (unsigned int i = 0; i < oldslots; i++)
+		while (NULL != (p = old[i])) {
+			old[i] = p->adr_link;
+			LINK_SLIST(peer_adr_hash.bucket[ADR_HOME(&p->srcadr)],
+				   p, adr_link);
+		}
+	free_tag(MEM_PEER, old, oldslots * sizeof(*old));
+	peer_adr_hash.resizes++;
+}
+
+/*
+ * aid_hash_resize - the same for the association ID table
+ */
+static void
+aid_hash_resize(
+	uint8_t bits
+	)
+{
+	struct peer **	old = peer_aid_hash.bucket;
+	unsigned int	oldslots = (NULL == old) ? 0
+				   : PEER_HASH_SLOTS(peer_aid_hash);
+	struct peer *	p;
+
+	peer_aid_hash.bits = bits;
+	peer_aid_hash.bucket = emalloc_zero_tag(MEM_PEER, sizeof(*old) *
+						PEER_HASH_SLOTS(peer_aid_hash));
+	for (unsigned int i = 0; i < oldslots; i++)
+		while (NULL != (p = old[i])) {
+			old[i] = p->aid_link;
+			LINK_SLIST(peer_aid_hash.bucket[AID_HOME(p->associd)],
+				   p, aid_link);
+		}
+	free_tag(MEM_PEER, old, oldslots * sizeof(*old));
+	peer_aid_hash.resizes++;
 }
 
 /*
@@ -751,15 +879,15 @@ peer_reset(
 		return;
 }
 
-	peer->timereset = current_time;
+	peer->cold->timereset = current_time;
 	peer->sent = 0;
 	peer->received = 0;
 	peer->processed = 0;
-	peer->badauth = 0;
-	peer->bogusorg = 0;
-	peer->oldpkt = 0;
-	peer->seldisptoolarge = 0;
-	peer->selbroken = 0;
+	peer->cold->badauth = 0;
+	peer->cold->bogusorg = 0;
+	peer->cold->oldpkt = 0;
+	peer->cold->seldisptoolarge = 0;
+	peer->cold->selbroken = 0;
 }
 
 
@@ -0,0 +1,186 @@
+/*
+ * ntp_pkttrace.c - in-memory trace of recent packets
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * ntpd keeps the last pkttrace_slots packets it received and the
+ * replies and polls it sent in a ring, each as the arrival or send
+ * time, the other end's address and the packet's header, much as
+ * rawstats has them.  It costs a few stores per packet and no I/O;
+ * CTL_OP_READ_PKTTRACE reads the ring when something has gone wrong.
+ *
+ * Writers claim a slot with one atomic increment of the ring's
+ * counter, so responder threads sending outside proto_lock need no
+ * lock either.  A slot's sequence number is cleared while it is being
+ * written and set when it is done; the reader copies a slot and keeps
+ * it only if the number it found before and after the copy is the one
+ * it wanted.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
+
+#include "ntpd.h"
+#include "ntp_stdlib.h"
+#include "recvbuff.h"
+
+unsigned int pkttrace_slots = PKTTRACE_DEFAULT; /* 0 = no trace */
+
+static struct pkttrace *	trace_ring;
+static unsigned int		trace_size;	/* fixed once allocated */
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+static atomic_uint_fast64_t	trace_next;
+#else
+static volatile uint64_t	trace_next;	/* racy without atomics */
+#endif /* HAVE_STDATOMIC_H */
+
+static inline void trace_barrier(void) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
+}
+
+static struct pkttrace *	trace_claim	(uint64_t *);
+
+
+/*
+ * pkttrace_init - make the ring.  Called once at startup, after the
+ * configuration is read and before the responder threads start.
+ * "lean" cuts the default ring, not one pkttrace asked for.
+ */
+void
+pkttrace_init(void)
+{
+	if (lean_memory && PKTTRACE_DEFAULT == pkttrace_slots)
+		pkttrace_slots = PKTTRACE_LEAN;
+	if (0 == pkttrace_slots || NULL != trace_ring)
+		return;
+	trace_ring = eallocarray(pkttrace_slots, sizeof(*trace_ring));
+	memset(trace_ring, '\0', pkttrace_slots * sizeof(*trace_ring));
+	trace_size = pkttrace_slots;
+}
+
+
+/*
+ * trace_claim - take the next slot and mark it as being written
+ */
+static struct pkttrace *
+trace_claim(
+	uint64_t *	seq
+	)
+{
+	struct pkttrace *t;
+
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	*seq = atomic_fetch_add_explicit(&trace_next, 1,
+					 memory_order_relaxed) + 1;
+#else
+	*seq = ++trace_next;
+#endif /* HAVE_STDATOMIC_H */
+	t = &trace_ring[(*seq - 1) % trace_size];
+	t->seq = 0;
+	trace_barrier();
+	return t;
+}
+
+
+/*
+ * pkttrace_recv - trace a packet on its way into the protocol machine
+ */
+void
+pkttrace_recv(
+	const struct recvbuf *rbufp
+	)
+{
+	struct pkttrace *t;
+	uint64_t	seq;
+	size_t		len;
+
+	if (NULL == trace_ring)
+		return;
+	t = trace_claim(&seq);
+	t->stamp = rbufp->recv_time;
+	t->addr = rbufp->recv_srcadr;
+	t->length = (uint16_t)min(rbufp->recv_length, UINT16_MAX);
+	t->dir = PKTTRACE_RECV;
+	len = min(rbufp->recv_length, sizeof(t->header));
+	memcpy(t->header, rbufp->recv_buffer, len);
+	memset(t->header + len, '\0', sizeof(t->header) - len);
+	trace_barrier();
+	t->seq = seq;
+}
+
+
+/*
+ * pkttrace_xmit - trace a packet sent: a reply, stamped with the
+ * arrival of the request it answers, or a poll, with its send time
+ */
+void
+pkttrace_xmit(
+	const sockaddr_u *	dest,
+	const struct pkt *	xpkt,
+	size_t			len,
+	l_fp			stamp
+	)
+{
+	struct pkttrace *t;
+	uint64_t	seq;
+
+	if (NULL == trace_ring)
+		return;
+	t = trace_claim(&seq);
+	t->stamp = stamp;
+	t->addr = *dest;
+	t->length = (uint16_t)min(len, UINT16_MAX);
+	t->dir = PKTTRACE_XMIT;
+	memcpy(t->header, xpkt, sizeof(t->header));
+	trace_barrier();
+	t->seq = seq;
+}
+
+
+/*
+ * pkttrace_newest - the number of the last packet traced, from 1;
+ * those from pkttrace_newest() - pkttrace_size() + 1 on may be read
+ */
+uint64_t
+pkttrace_newest(void)
+{
+	trace_barrier();
+	return trace_next;
+}
+
+unsigned int
+pkttrace_size(void)
+{
+	return trace_size;
+}
+
+
+/*
+ * pkttrace_get - copy trace record seq, if it is still in the ring
+ * and not being overwritten
+ */
+bool
+pkttrace_get(
+	uint64_t		seq,
+	struct pkttrace *	out
+	)
+{
+	const struct pkttrace *t;
+
+	if (NULL == trace_ring || 0 == seq)
+		return false;
+	t = &trace_ring[(seq - 1) % trace_size];
+	if (t->seq != seq)
+		return false;
+	trace_barrier();
+	memcpy(out, (const void *)t, sizeof(*out));
+	trace_barrier();
+	return t->seq == seq && out->seq == seq;
+}
@@ -0,0 +1,404 @@
+/*
+ * ntp_poller.c - optional busy-polling receive thread
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * With busypoll set, one thread spins over the endpoints' sockets with
+ * non-blocking recvmsg() and SO_BUSY_POLL, so a datagram is read, and
+ * stamped if the kernel didn't, as soon as the driver has it instead
+ * of after an interrupt, a wakeup and a trip through epoll.  The main
+ * loop then only watches those sockets for transmit stamps.
+ *
+ * The poller reads into a ring of receive buffers it shares with the
+ * main thread.  It is the only producer and the main thread the only
+ * consumer, so the ring takes no locks.  It writes to a pipe, which the
+ * main loop watches, only when the main thread has said it is about to
+ * sleep; a busy main thread picks the packets up on its way round.  A
+ * full ring leaves datagrams in the kernel.
+ *
+ * The poller reads through its own duplicates of the endpoints'
+ * descriptors.  When an endpoint goes, the main thread clears the
+ * poller's reference to it; the poller then closes its descriptor
+ * and the main thread frees the record once nothing in the ring
+ * refers to it.
+ *
+ * The thread uses a whole CPU.  It is meant for dedicated servers,
+ * placed with a thread command on a core of its own.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
+
+#include "ntpd.h"
+#include "ntp_io.h"
+#include "ntp_lists.h"
+#include "ntp_stdlib.h"
+#include "recvbuff.h"
+
+#if defined(SO_BUSY_POLL) && \
+    (defined(HAVE_NET_ROUTE_H) || defined(ENABLE_MSSNTP))
+# define USE_BUSY_POLL
+#endif
+
+int busy_poll = 0;		/* SO_BUSY_POLL us, 0 = no poller */
+
+#ifdef USE_BUSY_POLL
+#define POLL_SLOTS	256		/* power of 2 */
+
+typedef struct poller_sock poller_sock;
+struct poller_sock {
+	poller_sock *	link;
+	endpt *		ep;	/* NULL once the endpoint is gone */
+	struct phc *	phc;	/* ep->phc, which outlives ep */
+	SOCKET		fd;	/* the poller's dup() of ep->fd */
+	bool		closed;	/* fd closed by the poller */
+};
+
+struct poll_slot {
+	recvbuf_t	rb;
+	poller_sock *	ps;
+	size_t		controllen;
+	char		control[PKTSTAMP_CONTROL];
+};
+
+static struct poll_slot *	poll_ring;
+static volatile unsigned int	poll_head;	/* advanced by the main thread */
+static volatile unsigned int	poll_tail;	/* advanced by the poller */
+static volatile bool		poll_armed;	/* main thread wants a poke */
+static volatile unsigned int	poll_gen;	/* bumped when sockets change */
+static poller_sock *		poll_socks;
+static int			poll_pipe[2] = { -1, -1 };
+static bool			poller_running;
+static pthread_t		poller_tid;
+
+static inline void poll_barrier(void) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
+}
+
+static void *	poller_main	(void *);
+static void	poller_input	(SOCKET);
+static void	poller_drain	(void);
+
+
+/*
+ * poller_add_endpt - give the poller a descriptor for a new endpoint.
+ * Called by the main thread, which holds proto_lock.
+ */
+void
+poller_add_endpt(
+	endpt *	ep
+	)
+{
+	poller_sock *	ps;
+	SOCKET		fd;
+	static bool	warned;
+
+	if (0 == busy_poll || INVALID_SOCKET == ep->fd
+	    || (INT_SHARED & ep->flags))
+		return;
+
+	fd = dup(ep->fd);
+	if (fd < 0) {
+		msyslog(LOG_ERR, "IO: busypoll: dup of %s: %s",
+			latoa(ep), strerror(errno));
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	/* more than net.core.busy_read needs CAP_NET_ADMIN */
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (const void *)&busy_poll,
+		       sizeof(busy_poll)) && !warned) {
+		warned = true;
+		msyslog(LOG_WARNING,
+			"IO: busypoll: SO_BUSY_POLL %d on %s: %s, spinning "
+			"without it", busy_poll, latoa(ep), strerror(errno));
+	}
+	ps = emalloc_zero(sizeof(*ps));
+	ps->ep = ep;
+	ps->phc = ep->phc;
+	ps->fd = fd;
+	LINK_SLIST(poll_socks, ps, link);
+	poll_gen++;
+	if (poller_running && !io_endpt_polled(ep, true))
+		poller_remove_endpt(ep);
+}
+
+
+/*
+ * poller_remove_endpt - detach the poller from a dying endpoint.
+ * Called by the main thread, which holds proto_lock.
+ */
+void
+poller_remove_endpt(
+	endpt *	ep
+	)
+{
+	for (poller_sock *ps = poll_socks; ps != NULL; ps = ps->link)
+		if (ps->ep == ep) {
+			ps->ep = NULL;
+			poll_gen++;
+		}
+}
+
+
+/*
+ * poller_timer - free the records of sockets the poller has closed.
+ * Called by the main thread, which holds proto_lock.
+ */
+void
+poller_timer(void)
+{
+	poller_sock *	ps;
+	poller_sock *	unlinked;
+	bool		drained = false;
+
+	ps = poll_socks;
+	while (ps != NULL) {
+		unlinked = ps;
+		ps = ps->link;
+		if (!unlinked->closed)
+			continue;
+		if (!drained) {
+			/* what the ring holds for it was queued first */
+			poller_drain();
+			flush_sendpkts();
+			drained = true;
+		}
+		UNLINK_SLIST(unlinked, poll_socks, unlinked, link,
+			     poller_sock);
+		free(unlinked);
+	}
+}
+
+
+/*
+ * start_poller - launch the busy-polling thread and take the
+ * endpoints' input away from the main loop
+ */
+void
+start_poller(void)
+{
+
+	if (0 == busy_poll || poller_running)
+		return;
+	if (pipe(poll_pipe) < 0) {
+		msyslog(LOG_ERR, "INIT: busypoll: pipe: %s", strerror(errno));
+		goto fail;
+	}
+	make_socket_nonblocking(poll_pipe[0]);
+	make_socket_nonblocking(poll_pipe[1]);
+	poll_ring = eallocarray_tag(MEM_RECVBUF, POLL_SLOTS,
+				    sizeof(*poll_ring));
+	poll_armed = true;
+
+	if (ntp_thread_create(&poller_tid, poller_main, NULL,
+			      "INIT: busypoll")) {
+		free_tag(MEM_RECVBUF, poll_ring,
+			 POLL_SLOTS * sizeof(*poll_ring));
+		poll_ring = NULL;
+		close(poll_pipe[0]);
+		close(poll_pipe[1]);
+		goto fail;
+	}
+	poller_running = true;
+	io_add_reader(poll_pipe[0], poller_input);
+	for (poller_sock *ps = poll_socks; ps != NULL; ps = ps->link)
+		if (!io_endpt_polled(ps->ep, true))
+			poller_remove_endpt(ps->ep);
+	msyslog(LOG_INFO, "INIT: busy polling for input, SO_BUSY_POLL %d us",
+		busy_poll);
+	return;
+
+    fail:
+	/* the main loop keeps reading the endpoints */
+	while (poll_socks != NULL) {
+		poller_sock *ps = poll_socks;
+
+		poll_socks = ps->link;
+		close(ps->fd);
+		free(ps);
+	}
+	busy_poll = 0;
+}
+
+
+static void *
+poller_main(
+	void *	arg
+	)
+{
+	poller_sock **	socks = NULL;
+	poller_sock *	ps;
+	struct poll_slot *slot;
+	struct msghdr	mh;
+	struct iovec	iov;
+	unsigned int	gen = 0;
+	int		nsocks = 0;
+	int		nalloc = 0;
+	ssize_t		len;
+	bool		queued;
+
+	UNUSED_ARG(arg);
+	thread_place(THREAD_WORKERS, server_workers);
+	for (;;) {
+		if (NULL == socks || gen != poll_gen) {
+			proto_lock();
+			nsocks = 0;
+			for (ps = poll_socks; ps != NULL; ps = ps->link) {
+				if (NULL == ps->ep && !ps->closed) {
+					close(ps->fd);
+					ps->closed = true;
+				}
+				if (!ps->closed)
+					nsocks++;
+			}
+			if (nsocks >= nalloc) {
+				nalloc = nsocks + 1;
+				socks = erealloc(socks, (size_t)nalloc *
+						 sizeof(*socks));
+			}
+			nsocks = 0;
+			for (ps = poll_socks; ps != NULL; ps = ps->link)
+				if (!ps->closed)
+					socks[nsocks++] = ps;
+			gen = poll_gen;
+			proto_unlock();
+		}
+
+		queued = false;
+		for (int i = 0; i < nsocks; i++) {
+			ps = socks[i];
+			while (poll_tail - poll_head < POLL_SLOTS) {
+				slot = &poll_ring[poll_tail & (POLL_SLOTS - 1)];
+				ZERO(slot->rb);
+				iov.iov_base = &slot->rb.recv_buffer;
+				iov.iov_len = sizeof(slot->rb.recv_buffer);
+				ZERO(mh);
+				mh.msg_name = &slot->rb.recv_srcadr;
+				mh.msg_namelen = sizeof(slot->rb.recv_srcadr);
+				mh.msg_iov = &iov;
+				mh.msg_iovlen = 1;
+				mh.msg_control = slot->control;
+				mh.msg_controllen = sizeof(slot->control);
+				len = recvmsg(ps->fd, &mh, MSG_DONTWAIT);
+				if (len <= 0)
+					break;
+				slot->rb.recv_length = (size_t)len;
+				slot->rb.recv_time = fetch_packetstamp(&mh,
+								       ps->phc);
+				slot->ps = ps;
+				slot->controllen = mh.msg_controllen;
+				poll_barrier();
+				poll_tail++;
+				queued = true;
+			}
+		}
+		if (queued) {
+			poll_barrier();
+			if (poll_armed) {
+				poll_armed = false;
+				IGNORE(write(poll_pipe[1], "", 1));
+			}
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * poller_drain - hand what the poller queued to the protocol machine.
+ * Main thread, proto_lock held.
+ */
+static void
+poller_drain(void)
+{
+	struct poll_slot *slot;
+	struct msghdr	mh;
+
+	while (poll_head != poll_tail) {
+		poll_barrier();
+		slot = &poll_ring[poll_head & (POLL_SLOTS - 1)];
+		if (slot->ps->ep != NULL) {
+			ZERO(mh);
+			mh.msg_control = slot->control;
+			mh.msg_controllen = slot->controllen;
+			slot->rb.fd = slot->ps->ep->fd;
+			input_polled(&slot->rb, slot->ps->ep, &mh);
+		}
+		poll_barrier();
+		poll_head++;
+	}
+}
+
+
+/*
+ * poller_input - the poller poked the pipe: take everything queued,
+ * then ask for a poke before the main loop sleeps again
+ */
+static void
+poller_input(
+	SOCKET	fd
+	)
+{
+	char	buf[64];
+	int	was = cpu_switch(CPU_RECEIVE);
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		continue;
+	for (;;) {
+		poller_drain();
+		flush_sendpkts();
+		poll_armed = true;
+		poll_barrier();
+		if (poll_head == poll_tail)
+			break;
+		poll_armed = false;
+	}
+	cpu_switch(was);
+}
+
+#else	/* !USE_BUSY_POLL */
+
+void
+poller_add_endpt(
+	endpt *	ep
+	)
+{
+	UNUSED_ARG(ep);
+}
+
+void
+poller_remove_endpt(
+	endpt *	ep
+	)
+{
+	UNUSED_ARG(ep);
+}
+
+void
+poller_timer(void)
+{
+}
+
+void
+start_poller(void)
+{
+	if (busy_poll > 0) {
+		msyslog(LOG_WARNING,
+			"INIT: busypoll: not supported on this system, ignored");
+		busy_poll = 0;
+	}
+}
+#endif	/* !USE_BUSY_POLL */
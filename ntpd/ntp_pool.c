@@ -0,0 +1,325 @@
+/*
+ * ntp_pool.c - candidate servers for pool associations
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Each pool association keeps the addresses its DNS answers have given
+ * it as candidates: an address, the round trip and reach register it
+ * had when last used, and how often in a row it has failed.  Answers
+ * accumulate, so a pool name that hands out a few of its servers per
+ * query builds up a set of hundreds, and associations are made from
+ * that set only as many as are wanted, best candidates first.  Asking
+ * DNS again is left for when the set has nobody fit to offer, or has
+ * not been refreshed for an hour.
+ *
+ * When a pool server's association times out and there is a candidate
+ * to take its place, the association goes and its record goes back
+ * into the set to rest a while, so the pool's servers are used in
+ * turn without a DNS query or a peer allocation for each change.
+ */
+
+#include "config.h"
+
+#include "ntpd.h"
+#include "ntp_calendar.h"
+#include "ntp_stdlib.h"
+
+#define POOL_CANDIDATES	1024		/* addresses kept per pool */
+#define POOL_REQUERY	SECSPERHR	/* refresh the set this often */
+#define POOL_EXPIRE	SECSPERDAY	/* forget what DNS stopped giving */
+#define POOL_REST	1024		/* s, a demoted server waits */
+#define POOL_MAXFAILS	6		/* rest 2^6 times as long at most */
+
+struct pool_cand {
+	sockaddr_u	addr;
+	double		delay;		/* last round trip, 0 if none */
+	uint8_t		reach;		/* reach register when demoted */
+	uint8_t		fails;		/* demoted unreachable, in a row */
+	bool		active;		/* is an association now */
+	uptime_t	seen;		/* last in a DNS answer */
+	uptime_t	rest_until;	/* not to be promoted before */
+};
+
+struct pool_set {
+	struct pool_set *link;
+	struct peer *	pool;		/* the pool association */
+	struct pool_cand *cands;
+	int		count;
+	int		size;
+	uptime_t	queried;	/* last DNS answer, 0 for never */
+};
+
+static struct pool_set *pool_sets;
+
+static struct pool_set *pool_find	(struct peer *, bool);
+static struct pool_cand *pool_member	(sockaddr_u *, struct pool_set **);
+static struct pool_cand *pool_best	(struct pool_set *);
+static int	pool_score	(const struct pool_cand *);
+static bool	pool_promote	(struct pool_set *, struct pool_cand *);
+
+
+static struct pool_set *
+pool_find(
+	struct peer *	pool,
+	bool		create
+	)
+{
+	struct pool_set *set;
+
+	for (set = pool_sets; set != NULL; set = set->link)
+		if (set->pool == pool)
+			return set;
+	if (!create)
+		return NULL;
+	set = emalloc_zero(sizeof(*set));
+	set->pool = pool;
+	LINK_SLIST(pool_sets, set, link);
+	return set;
+}
+
+
+/*
+ * pool_member - the active candidate a pool server's association was
+ * made from, and its set.
+ */
+static struct pool_cand *
+pool_member(
+	sockaddr_u *		addr,
+	struct pool_set **	pset
+	)
+{
+	struct pool_set *set;
+
+	for (set = pool_sets; set != NULL; set = set->link)
+		for (int i = 0; i < set->count; i++)
+			if (set->cands[i].active &&
+			    SOCK_EQ(&set->cands[i].addr, addr)) {
+				*pset = set;
+				return &set->cands[i];
+			}
+	return NULL;
+}
+
+
+/*
+ * pool_score - how much a candidate is wanted, more is better.  One
+ * never tried scores 0, below those that answered and above those
+ * that didn't.
+ */
+static int
+pool_score(
+	const struct pool_cand *c
+	)
+{
+	int bits = 0;
+
+	for (uint8_t r = c->reach; r != 0; r >>= 1)
+		bits += r & 1;
+	return 2 * bits - 4 * c->fails;
+}
+
+
+static struct pool_cand *
+pool_best(
+	struct pool_set *set
+	)
+{
+	struct pool_cand *best = NULL;
+	int		best_score = 0;
+
+	for (int i = 0; i < set->count; i++) {
+		struct pool_cand *c = &set->cands[i];
+		int s;
+
+		if (c->active || c->rest_until > current_time)
+			continue;
+		s = pool_score(c);
+		if (NULL == best || s > best_score ||
+		    (s == best_score && c->delay < best->delay)) {
+			best = c;
+			best_score = s;
+		}
+	}
+	return best;
+}
+
+
+static bool
+pool_promote(
+	struct pool_set *	set,
+	struct pool_cand *	c
+	)
+{
+	if (findexistingpeer(&c->addr, NULL, NULL, MODE_CLIENT) != NULL ||
+	    NULL == pool_associate(set->pool, &c->addr)) {
+		/* configured since, or another pool has it */
+		c->rest_until = current_time + POOL_REST;
+		return false;
+	}
+	c->active = true;
+	return true;
+}
+
+
+/*
+ * pool_take - add an address from a pool's DNS answer to its
+ * candidates.
+ */
+void
+pool_take(
+	struct peer *	pool,
+	sockaddr_u *	addr
+	)
+{
+	struct pool_set *set = pool_find(pool, true);
+	struct pool_cand *c = NULL;
+	int		oldest = -1;
+
+	set->queried = current_time;
+	for (int i = 0; i < set->count; i++) {
+		if (SOCK_EQ(&set->cands[i].addr, addr)) {
+			set->cands[i].seen = current_time;
+			return;
+		}
+		if (!set->cands[i].active &&
+		    (oldest < 0 || set->cands[i].seen < set->cands[oldest].seen))
+			oldest = i;
+	}
+
+	if (set->count < set->size) {
+		c = &set->cands[set->count++];
+	} else if (set->size < POOL_CANDIDATES) {
+		int newsize = set->size ? 2 * set->size : 16;
+
+		set->cands = erealloc(set->cands,
+				      (size_t)newsize * sizeof(*set->cands));
+		set->size = newsize;
+		c = &set->cands[set->count++];
+	} else if (oldest >= 0 && set->cands[oldest].seen < current_time) {
+		c = &set->cands[oldest];	/* the stalest goes */
+	} else {
+		DPRINT(1, ("pool_take: %s full, %s dropped\n",
+			   socktoa(&pool->srcadr), socktoa(addr)));
+		return;
+	}
+	ZERO(*c);
+	c->addr = *addr;
+	c->seen = current_time;
+	DPRINT(1, ("pool_take: %s candidate %d %s\n",
+		   socktoa(&pool->srcadr), set->count, socktoa(addr)));
+}
+
+
+/*
+ * pool_fill - make up to want associations from a pool's candidates.
+ * Returns true if DNS should be asked for more.
+ */
+bool
+pool_fill(
+	struct peer *	pool,
+	int		want
+	)
+{
+	struct pool_set *set = pool_find(pool, true);
+	struct pool_cand *c;
+	int		i = 0;
+
+	/* forget addresses DNS hasn't given for a long time */
+	while (i < set->count) {
+		c = &set->cands[i];
+		if (!c->active && c->seen + POOL_EXPIRE < current_time)
+			*c = set->cands[--set->count];
+		else
+			i++;
+	}
+
+	if (0 == want)
+		return false;
+	while (want > 0 && (c = pool_best(set)) != NULL)
+		if (pool_promote(set, c))
+			want--;
+	return want > 0 || 0 == set->queried ||
+		set->queried + POOL_REQUERY <= current_time;
+}
+
+
+/*
+ * pool_spare - is there a candidate to replace this pool server?
+ */
+bool
+pool_spare(
+	struct peer *	peer
+	)
+{
+	struct pool_set *set;
+
+	if (NULL == pool_member(&peer->srcadr, &set))
+		return false;
+	return pool_best(set) != NULL;
+}
+
+
+/*
+ * pool_demote - a pool server's association is going: keep how it
+ * did, rest it, and have its pool look for a replacement.
+ */
+void
+pool_demote(
+	struct peer *	peer
+	)
+{
+	struct pool_set *set;
+	struct pool_cand *c = pool_member(&peer->srcadr, &set);
+
+	if (NULL == c)
+		return;
+	c->active = false;
+	c->reach = peer->reach;
+	if (peer->reach) {
+		c->delay = peer->delay;
+		c->fails = 0;
+	} else if (c->fails < POOL_MAXFAILS) {
+		c->fails++;
+	}
+	c->rest_until = current_time + ((uptime_t)POOL_REST << c->fails);
+
+	set->pool->nextdate = current_time;
+	timer_schedule(set->pool);
+}
+
+
+/*
+ * pool_stale - ask DNS before using the candidates again, after the
+ * network changed.
+ */
+void
+pool_stale(
+	struct peer *	pool
+	)
+{
+	struct pool_set *set = pool_find(pool, false);
+
+	if (set != NULL)
+		set->queried = 0;
+}
+
+
+/*
+ * pool_forget - a pool association is going away.  The associations
+ * made from it stay.
+ */
+void
+pool_forget(
+	struct peer *	pool
+	)
+{
+	struct pool_set *set = pool_find(pool, false);
+	struct pool_set *unlinked;
+
+	if (NULL == set)
+		return;
+	UNLINK_SLIST(unlinked, pool_sets, set, link, struct pool_set);
+	free(set->cands);
+	free(set);
+}
@@ -11,6 +11,8 @@
 #include "ntp_leapsec.h"
 #include "ntp_dns.h"
 #include "ntp_auth.h"
+#include "ntp_io.h"
+#include "ntp_trace.h"
 #include "timespecops.h"
 
 #include <string.h>
@@ -19,6 +21,9 @@
 #include <libscf.h>
 #endif
 #include <unistd.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
 
 #define MSSNTP_QUERY_MAC_LEN 16
 
@@ -51,6 +56,8 @@ static inline l_fp_w htonl_fp(l_fp lfp) {
  * traffic shaping parameters
  */
 #define	NTP_IBURST	6	/* packets in iburst */
+#define	NTP_PROBES	3	/* unanswered packets that mean a server
+				 * with "probe" is gone */
 #define	RESP_DELAY	1	/* refclock burst delay (s) */
 
 /*
@@ -80,17 +87,6 @@ static inline l_fp_w htonl_fp(l_fp lfp) {
 #define	STRATUM_TO_PKT(s)	((uint8_t)(((s) == (STRATUM_UNSPEC)) ?\
 				(STRATUM_PKT_UNSPEC) : (s)))
 
-/*
- * peer_select groups statistics for a peer used by clock_select() and
- * clock_cluster().
- */
-typedef struct peer_select_tag {
-	struct peer *	peer;
-	double		synch;	/* sync distance */
-	double		error;	/* jitter */
-	double		seljit;	/* selection jitter */
-} peer_select;
-
 /*
  * System variables are declared here. Unless specified otherwise, all
  * times are in seconds.
@@ -126,6 +122,7 @@ static int leap_vote_ins;	/* leap consensus for insert */
 static int leap_vote_del;	/* leap consensus for delete */
 static	unsigned long	leapsec;	/* seconds to next leap (proximity class) */
 int	peer_ntpdate;		/* active peers in ntpdate mode */
+int	peer_samples;		/* raw samples kept per peer, 0 = none */
 static int sys_survivors;		/* truest of the truechimers */
 
 /*
@@ -139,6 +136,26 @@ int	sys_maxclock = NTP_MAXCLOCK; /* maximum candidates */
 int	sys_orphan = STRATUM_UNSPEC + 1; /* orphan stratum */
 static int sys_orphwait = NTP_ORPHWAIT; /* orphan wait */
 
+/*
+ * Fast start (tos faststart), for machines that want the time right
+ * after boot.  Until the clock is set and the system peer would pass
+ * the usual checks:
+ *  - all associations start polling at once, rather than one a second,
+ *    so lookups, NTS-KE and bursts overlap,
+ *  - bursts go out FASTSTART_DELAY apart instead of ntp_minpkt,
+ *  - associations cleared by a step poll again right away,
+ *  - once at least max(minsane, minclock) sources each have
+ *    FASTSTART_SAMPLES samples, the empty filter stages no longer
+ *    count against them, so the selection algorithm can set the clock
+ *    as soon as those agree instead of waiting for the dispersion of
+ *    the stages not yet filled to age away.
+ * The timer runs on whole seconds, so bursts can't be closer than 1 s.
+ */
+#define	FASTSTART_DELAY		1	/* burst spacing (s) */
+#define	FASTSTART_SAMPLES	2	/* samples before a source counts */
+static bool	sys_faststart;		/* tos faststart, until synced */
+static bool	faststart_quorum;	/* enough sources, as of last select */
+
 // proto stats structure and variables
 struct statistics_counters {
 	uint64_t	sys_received;		/* packets received */
@@ -155,6 +172,8 @@ struct statistics_counters {
 	uint64_t	sys_declined;		/* declined */
 	uint64_t	sys_limitrejected;	/* rate exceeded */
 	uint64_t	sys_kodsent;		/* KoD sent */
+	uint64_t	sys_kodlimited;		/* KoD over the server's budget */
+	uint64_t	sys_duplicate;		/* copies of the last request */
 };
 volatile struct statistics_counters stat_proto_hourago, stat_proto_total;
 uptime_t	sys_stattime;		/* time since sysstats "reset" */
@@ -193,6 +212,8 @@ stat_sys_dumps(badauth)
 stat_sys_dumps(declined)
 stat_sys_dumps(limitrejected)
 stat_sys_dumps(kodsent)
+stat_sys_dumps(kodlimited)
+stat_sys_dumps(duplicate)
 
 #undef stat_sys_dumps
 
@@ -213,20 +234,30 @@ void set_use_stattime(uptime_t stattime) {
 
 static	void	clock_combine	(peer_select *, int, int);
 static	void	clock_select	(void);
+static	struct peer *select_peer	(void);
+static	int	filter_samples	(struct peer *);
+static	void	faststart_check	(void);
+static	void	faststart_done	(struct peer *);
 static	void	clock_update	(struct peer *);
-static	void	fast_xmit	(struct recvbuf *, auth_info*, int);
+static	void	fast_xmit	(struct recvbuf *, auth_info*, int) NTP_HOT;
+static	bool	rate_limited	(struct recvbuf *, unsigned short);
+static	bool	duplicate_dropped	(struct recvbuf *);
+static	void	receive_packet	(struct recvbuf *);
 static	int	local_refid	(struct peer *);
 static	void	peer_xmit	(struct peer *);
+static	int	pool_wanted	(void);
 static	int	peer_unfit	(struct peer *);
 static	double	root_distance	(struct peer *);
 #ifndef DISABLE_NTS
 static	void	restart_nts_ke	(struct peer *);
 #endif
-static	void	maybe_log_junk	(const char *tag, struct recvbuf *rbuf);
+static	void	maybe_log_junk	(const char *tag, struct recvbuf *rbuf)
+				NTP_COLD;
 
 void
 set_sys_leap(unsigned char new_sys_leap) {
 	sys_vars.sys_leap = new_sys_leap;
+	ctl_sysvars_changed();
 	xmt_leap = sys_vars.sys_leap;
 
 	/*
@@ -250,6 +281,7 @@ set_sys_leap(unsigned char new_sys_leap) {
 		}
 #endif	/* ENABLE_LEAP_SMEAR */
 	}
+	publish_reply_template();
 }
 
 /* Returns false for packets we want to reject out of hand: those with an
@@ -279,25 +311,30 @@ is_control_packet(
 }
 
 
-static bool
-parse_packet(
+/* Receive runs in stages, cheapest first, so a flood is turned away
+   before it costs much:
+
+   1. the first byte and the length (is_packet_not_low_rot(), or
+      fast_admit()'s own test for plain client requests),
+   2. the source address: mon_restrictions(), check_early_restrictions()
+      and the MRU list in ntp_monitor(),
+   3. parse_header(), the 48 bytes every packet has,
+   4. the MAC or extension fields, for packets that have them.
+
+   Nothing past stage 2 runs for a packet stage 2 drops.
+*/
+
+/* Host-order copy of the fixed header.  The caller has checked there
+   are at least LEN_PKT_NOMAC octets.
+*/
+static void
+parse_header(
 	struct recvbuf * rbufp
 	)
 {
-	REQUIRE(rbufp != NULL);
-
-	size_t recv_length = rbufp->recv_length;
 	uint8_t const* recv_buf = rbufp->recv_buffer;
-
-	if(recv_length < LEN_PKT_NOMAC) {
-		/* Data is too short to possibly be a valid packet. */
-		return false;
-	}
-
 	struct parsed_pkt * pkt = &rbufp->pkt;
-	uint8_t const* bufptr = recv_buf + LEN_PKT_NOMAC;
 
-	/* Parse header fields */
 	pkt->li_vn_mode = recv_buf[0];
 	pkt->stratum = recv_buf[1];
 	pkt->ppoll = recv_buf[2];
@@ -315,7 +352,29 @@ parse_packet(
 	rbufp->mac_len = 0;
 
 	rbufp->extens_present = false;
-	rbufp->ntspacket.valid = false;
+	if (NULL != rbufp->ntspacket)
+		rbufp->ntspacket->valid = false;
+}
+
+static bool
+parse_packet(
+	struct recvbuf * rbufp
+	)
+{
+	REQUIRE(rbufp != NULL);
+
+	size_t recv_length = rbufp->recv_length;
+	uint8_t const* recv_buf = rbufp->recv_buffer;
+
+	if(recv_length < LEN_PKT_NOMAC) {
+		/* Data is too short to possibly be a valid packet. */
+		return false;
+	}
+
+	struct parsed_pkt * pkt = &rbufp->pkt;
+	uint8_t const* bufptr = recv_buf + LEN_PKT_NOMAC;
+
+	parse_header(rbufp);
 
 	if(PKT_VERSION(pkt->li_vn_mode) > NTP_VERSION) {
 		/* Unsupported version */
@@ -509,29 +568,43 @@ handle_procpkt(
 	)
 {
 	unsigned int outcount = peer->outcount;
+	/* An interleaved reply sends back the receive timestamp of our
+	   request, which is when we got the last reply, and carries the
+	   server's transmit time for that one. */
+	const bool xleave = (FLAG_XLEAVE & peer->cfg.flags) &&
+	    0 != peer->dst && rbufp->pkt.org == peer->dst;
+	l_fp t1, t2, t4;
 
 	peer->flash &= ~PKT_BOGON_MASK;
 
-	/* Duplicate detection */
-	if(rbufp->pkt.xmt == peer->xmt) {
+	/* Duplicate detection.  The transmit time in an interleaved
+	   reply may well be the one the last reply claimed, so only
+	   outcount tells its duplicates apart. */
+	if(rbufp->pkt.xmt == peer->xmt && !xleave) {
 		rawstats_filter(peer, rbufp, BOGON1, outcount);
-		peer->oldpkt++;
+		peer->cold->oldpkt++;
 		return;
 	}
 	if(outcount == 0) {
 		rawstats_filter(peer, rbufp, BOGON1, outcount);
-		peer->oldpkt++;
+		peer->cold->oldpkt++;
 		return;
 	}
 
 	/* Origin timestamp validation */
 	if(rbufp->pkt.org == 0) {
 		rawstats_filter(peer, rbufp, BOGON3, outcount);
-		peer->bogusorg++;
+		peer->cold->bogusorg++;
+		return;
+	} else if(rbufp->pkt.org != peer->org_rand && !xleave) {
+		rawstats_filter(peer, rbufp, BOGON2, outcount);
+		peer->cold->bogusorg++;
 		return;
-	} else if(rbufp->pkt.org != peer->org_rand) {
+	} else if(xleave && peer->org_prev == 0) {
+		/* We can't pair the last reply with a request, see
+		   below.  The server falls back to basic mode soon. */
 		rawstats_filter(peer, rbufp, BOGON2, outcount);
-		peer->bogusorg++;
+		peer->cold->bogusorg++;
 		return;
 	}
 
@@ -546,10 +619,11 @@ handle_procpkt(
 
 	if(is_kod(&rbufp->pkt)) {
 		if(!memcmp(rbufp->pkt.refid, "RATE", REFIDLEN)) {
-			peer->selbroken++;
+			peer->cold->selbroken++;
 			report_event(PEVNT_RATE, peer, NULL);
-			peer->burst = peer->retry = 0;
+			peer->burst = peer->retry = peer->probe = 0;
 			peer->throttle = (NTP_SHIFT + 1) * (1 << peer->cfg.minpoll);
+			peer->throttle_at = current_time;
 			if (rbufp->pkt.ppoll > peer->cfg.minpoll)
 			    peer->cfg.minpoll = min(peer->ppoll, 10);
 			poll_update(peer, min(rbufp->pkt.ppoll, 10));
@@ -564,8 +638,8 @@ handle_procpkt(
 		return;
 	}
 
-	if(scalbn((double)rbufp->pkt.rootdelay/2.0 + (double)rbufp->pkt.rootdisp, -16) >=
-	   sys_maxdisp) {
+	if (FP_UNSCALE((double)rbufp->pkt.rootdelay/2.0 +
+		       (double)rbufp->pkt.rootdisp) >= sys_maxdisp) {
 		rawstats_filter(peer, rbufp, BOGON7, outcount);
 		return;
 	}
@@ -575,16 +649,28 @@ handle_procpkt(
 	   the difference between them should be small, so it's important
 	   to do the subtraction *before* converting to floating point to
 	   avoid loss of precision.
+
+	   In interleaved mode the sample is the last exchange, whose
+	   other three timestamps we kept.
 	*/
+	if (xleave) {
+		t1 = peer->org_prev;
+		t2 = peer->rec;
+		t4 = peer->dst;
+	} else {
+		t1 = peer->org_ts;
+		t2 = rbufp->pkt.rec;
+		t4 = rbufp->recv_time;
+	}
 
 	const double t34 =
-	    (rbufp->pkt.xmt >= rbufp->recv_time) ?
-	    scalbn((double)(rbufp->pkt.xmt - rbufp->recv_time), -32) :
-	    -scalbn((double)(rbufp->recv_time - rbufp->pkt.xmt), -32);
+	    (rbufp->pkt.xmt >= t4) ?
+	    (double)(rbufp->pkt.xmt - t4) / FRAC :
+	    -((double)(t4 - rbufp->pkt.xmt) / FRAC);
 	const double t21 =
-	    (rbufp->pkt.rec >= peer->org_ts) ?
-	    scalbn((double)(rbufp->pkt.rec - peer->org_ts), -32) :
-	    -scalbn((double)(peer->org_ts - rbufp->pkt.rec), -32);
+	    (t2 >= t1) ?
+	    (double)(t2 - t1) / FRAC :
+	    -((double)(t1 - t2) / FRAC);
 	const double theta = (t21 + t34) / 2.;
 	const double delta = fabs(t21 - t34);
 	const double epsilon = LOGTOD(sys_vars.sys_precision) +
@@ -603,7 +689,7 @@ handle_procpkt(
 	*/
 	if(delta > sys_maxdist) {
 	  rawstats_filter(peer, rbufp, BOGON14, outcount);
-	  peer->oldpkt++;
+	  peer->cold->oldpkt++;
 	  return;
 	}
 
@@ -611,17 +697,23 @@ handle_procpkt(
 	peer->stratum = min(PKT_TO_STRATUM(rbufp->pkt.stratum), STRATUM_UNSPEC);
 	peer->pmode = PKT_MODE(rbufp->pkt.li_vn_mode);
 	peer->precision = rbufp->pkt.precision;
-	peer->rootdelay = scalbn((double)rbufp->pkt.rootdelay, -16);
-	peer->rootdisp = scalbn((double)rbufp->pkt.rootdisp, -16);
+	peer->rootdelay = FP_UNSCALE(rbufp->pkt.rootdelay);
+	peer->rootdisp = FP_UNSCALE(rbufp->pkt.rootdisp);
 	memcpy(&peer->refid, rbufp->pkt.refid, REFIDLEN);
 	peer->reftime = rbufp->pkt.reftime;
 	peer->rec = rbufp->pkt.rec;
 	peer->xmt = rbufp->pkt.xmt;
 	peer->dst = rbufp->recv_time;
+	/* An interleaved reply may answer any request sent since the
+	   last reply, so org_ts is only its origin if there was one. */
+	peer->org_prev = (xleave && outcount > 0) ? 0 : peer->org_ts;
 
 	/* Record good packet */
 	record_raw_stats(peer, rbufp, 0, outcount);
 
+	/* A reply ends any probing; the server is still there. */
+	peer->probe = 0;
+
 	/* If either burst mode is armed, enable the burst.
 	 * Compute the headway for the next packet and delay if
 	 * necessary to avoid exceeding the threshold. */
@@ -641,19 +733,41 @@ handle_procpkt(
 	  * case, mark it reachable. */
 	if (!peer->reach) {
 		report_event(PEVNT_REACH, peer, NULL);
-		peer->timereachable = current_time;
+		peer->cold->timereachable = current_time;
 	}
 	peer->reach |= 1;
 
 	/* Hooray! Pass our new sample off to the clock filter. */
+	keep_sample(peer, t1, t2, rbufp->pkt.xmt, t4,
+		    theta + peer->cfg.bias, delta, epsilon);
 	clock_filter(peer, theta + peer->cfg.bias, delta, epsilon);
 }
 
 
+/*
+ * receive - process a packet and add the time taken to LAT_RECEIVE
+ */
 void
 receive(
 	struct recvbuf *rbufp
 	)
+{
+	struct timespec start;
+	uint64_t	ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pkttrace_recv(rbufp);
+	receive_packet(rbufp);
+	ns = latency_since(LAT_RECEIVE, &start);
+	NTP_TRACE3(receive, &rbufp->recv_srcadr,
+		   PKT_MODE(rbufp->recv_buffer[0]), ns);
+}
+
+
+static void
+receive_packet(
+	struct recvbuf *rbufp
+	)
 {
 	struct peer *peer = NULL;
 	unsigned short restrict_mask;
@@ -665,6 +779,16 @@ receive(
 	memset(&zero_key, 0, MSSNTP_QUERY_MAC_LEN);
 #endif /* ENABLE_MSSNTP */
 
+	switch (fast_admit(rbufp)) {
+	    case FAST_REPLY:
+		fast_reply(rbufp, NULL);
+		return;
+	    case FAST_DONE:
+		return;
+	    default:
+		break;
+	}
+
 	stat_proto_total.sys_received++;
 
 #ifdef NTPv1
@@ -705,7 +829,7 @@ receive(
 
 	/* FIXME: This is lots more cleanup to do in this area. */
 
-	restrict_mask = restrictions(&rbufp->recv_srcadr);
+	restrict_mask = mon_restrictions(&rbufp->recv_srcadr);
 
 	if(check_early_restrictions(rbufp, restrict_mask)) {
 		stat_proto_total.sys_restricted++;
@@ -713,13 +837,14 @@ receive(
 	}
 
 	restrict_mask = ntp_monitor(rbufp, restrict_mask);
-	if (restrict_mask & RES_LIMITED) {
-		stat_proto_total.sys_limitrejected++;
-		if(!(restrict_mask & RES_KOD)) { return; }
-	}
+	if (rate_limited(rbufp, restrict_mask) || duplicate_dropped(rbufp))
+		return;
 
 	if(is_control_packet(rbufp)) {
+		int was = cpu_switch(CPU_CONTROL);
+
 		process_control(rbufp, restrict_mask);
+		cpu_switch(was);
 		stat_proto_total.sys_processed++;
 		return;
 	}
@@ -804,7 +929,7 @@ receive(
 
 			stat_proto_total.sys_badauth++;
 			if(peer != NULL) {
-				peer->badauth++;
+				peer->cold->badauth++;
 				peer->cfg.flags &= ~FLAG_AUTHENTIC;
 				peer->flash |= BOGON5;
 			}
@@ -816,7 +941,7 @@ receive(
 	    case MODE_CLIENT:  /* Request for us as a server. */
 		if (rbufp->extens_present
 #ifndef DISABLE_NTS
-		    && !extens_server_recv(&rbufp->ntspacket,
+		    && !extens_server_recv(get_recv_ntspacket(rbufp),
 			  rbufp->recv_buffer, rbufp->recv_length)
 #endif
 ) {
@@ -877,23 +1002,17 @@ transmit(
 	hpoll = peer->hpoll;
 
 	/*
-	 * Pool associations transmit unicast solicitations when there
-	 * are less than a hard limit of 2 * sys_maxclock associations,
-	 * and either less than sys_minclock survivors or less than
-	 * sys_maxclock associations.  The hard limit prevents unbounded
-	 * growth in associations if the system clock or network quality
-	 * result in survivor count dipping below sys_minclock often.
-	 * This was observed testing with pool, where sys_maxclock == 12
-	 * resulted in 60 associations without the hard limit.
+	 * Pool associations take servers from their candidates as
+	 * pool_wanted() allows, and ask DNS only when those run out or
+	 * are due a refresh.
 	 */
 	if (peer->cast_flags & MDF_POOL) {
 		peer->outdate = current_time;
-		if ((peer_associations <= 2 * sys_maxclock) &&
-		    (peer_associations < sys_maxclock ||
-		     sys_survivors < sys_minclock))
+		if (pool_fill(peer, pool_wanted()))
 			if (!dns_probe(peer)) {
-			    /* DNS thread busy, try again soon */
+			    /* DNS queue full, try again soon */
 			    peer->nextdate = current_time;
+			    timer_schedule(peer);
 			    return;
                      }
 		poll_update(peer, hpoll);
@@ -905,6 +1024,7 @@ transmit(
 		peer->outdate = current_time;
 		if (!dns_probe(peer)) {
 			peer->nextdate = current_time;
+			timer_schedule(peer);
 			return;
 		}
 		poll_update(peer, hpoll);
@@ -916,7 +1036,28 @@ transmit(
 	 * designed to back off whenever possible to minimize network
 	 * traffic.
 	 */
-	if (peer->burst == 0) {
+	if (peer->burst == 0 && peer->probe > 0) {
+
+		/*
+		 * Probing after a missed reply ("probe" option). These
+		 * go out at the burst spacing and don't count as polls,
+		 * so the reach register is left alone. If the last one
+		 * goes unanswered too the server is gone: stop
+		 * selecting it now rather than after eight polls, and
+		 * wait for the next poll to try it again.
+		 */
+		if (--peer->probe > 0) {
+			peer_xmit(peer);
+			poll_update(peer, hpoll);
+			return;
+		}
+		peer->reach = 0;
+		clock_filter(peer, 0., 0., sys_maxdisp);
+		report_event(PEVNT_UNREACH, peer, "probe");
+		clock_select();
+		poll_update(peer, hpoll);
+		return;
+	} else if (peer->burst == 0) {
 		uint8_t oreach;
 
 		/*
@@ -955,6 +1096,8 @@ transmit(
 			hpoll = clkstate.sys_poll;
 			if (!(peer->cfg.flags & FLAG_PREEMPT))
 				peer->unreach = 0;
+			if ((peer->cfg.flags & FLAG_PROBE) && !(oreach & 1))
+				peer->probe = NTP_PROBES;
 			if ((peer->cfg.flags & FLAG_BURST) && peer->retry ==
 			    0 && !peer_unfit(peer))
 				peer->retry = NTP_RETRY;
@@ -966,7 +1109,7 @@ transmit(
 		 * poll_update() routine will clamp it to maxpoll.
 		 * If preemptible and we have more peers than maxclock,
 		 * and this peer has the minimum score of preemptibles,
-		 * demobilize.
+		 * or its pool has another server to try, demobilize.
 		 */
 		if (peer->unreach >= NTP_UNREACH) {
 			hpoll++;
@@ -978,8 +1121,8 @@ transmit(
 				return;
 			}
 			if ((peer->cfg.flags & FLAG_PREEMPT) &&
-			    (peer_associations > sys_maxclock) &&
-			    score_all(peer)) {
+			    (((peer_associations > sys_maxclock) &&
+			      score_all(peer)) || pool_spare(peer))) {
 				report_event(PEVNT_RESTART, peer, "timeout");
 				peer_clear(peer, "TIME", false);
 				unpeer(peer);
@@ -1025,6 +1168,8 @@ clock_update(
 {
 	double	dtemp;
 	time_t	now;
+	struct timespec start;
+	int	rval;
 #ifdef HAVE_LIBSCF_H
 	char	*fmri;
 #endif /* HAVE_LIBSCF_H */
@@ -1033,6 +1178,7 @@ clock_update(
 	 * Update the system state variables. We do this very carefully,
 	 * as the poll interval might need to be clamped differently.
 	 */
+	ctl_sysvars_changed();
 	sys_vars.sys_peer = peer;
 	sys_epoch = peer->epoch;
 	if (clkstate.sys_poll < peer->cfg.minpoll)
@@ -1079,12 +1225,17 @@ clock_update(
 
 	DPRINT(1, ("clock_update: at %u sample %u associd %d\n",
 		   current_time, peer->epoch, peer->associd));
+	startup_mark(START_UPDATE);
 
 	/*
 	 * Comes now the moment of truth. Crank the clock discipline and
 	 * see what comes out.
 	 */
-	switch (local_clock(peer, clkstate.sys_offset)) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rval = local_clock(peer, clkstate.sys_offset);
+	NTP_TRACE4(clock, &peer->srcadr, (int64_t)(clkstate.sys_offset * 1e9),
+		   rval, latency_since(LAT_CLOCK, &start));
+	switch (rval) {
 
 	/*
 	 * Clock exceeds panic threshold. Life as we know it ends.
@@ -1139,6 +1290,7 @@ clock_update(
 		 */
 		if (sys_vars.sys_leap == LEAP_NOTINSYNC) {
 			set_sys_leap(LEAP_NOWARNING);
+			startup_mark(START_SYNC);
 			/*
 			 * If our parent process is waiting for the
 			 * first clock sync, send them home satisfied.
@@ -1180,6 +1332,7 @@ clock_update(
 	default:
 		break;
 	}
+	publish_reply_template();
 }
 
 
@@ -1223,17 +1376,20 @@ poll_update(
 	 * Now we figure out if there is an override. If a burst is in
 	 * progress and we get called from the receive process, just
 	 * slink away. If called from the poll process, delay 1 s for a
-	 * reference clock, otherwise 2 s.
+	 * reference clock, otherwise 2 s.  Probes for a missed reply
+	 * go out the same way.
 	 */
-	utemp = current_time + (unsigned long)max(peer->throttle - (NTP_SHIFT - 1) *
+	utemp = current_time + (unsigned long)max(peer_throttle(peer) - (NTP_SHIFT - 1) *
 	    (1 << peer->cfg.minpoll), rstrct.ntp_minpkt);
-	if (peer->burst > 0) {
+	if (peer->burst > 0 || peer->probe > 0) {
 		if (peer->nextdate > current_time)
 			return;
 #ifdef REFCLOCK
 		else if (peer->cfg.flags & FLAG_REFCLOCK)
 			peer->nextdate = current_time + RESP_DELAY;
 #endif /* REFCLOCK */
+		else if (sys_faststart)
+			peer->nextdate = current_time + FASTSTART_DELAY;
 		else
 			peer->nextdate = utemp;
 
@@ -1266,17 +1422,38 @@ poll_update(
 			peer->nextdate = next;
 		else
 			peer->nextdate = utemp;
-		if (peer->throttle > (1 << peer->cfg.minpoll))
+		if (peer_throttle(peer) > (1 << peer->cfg.minpoll))
 			peer->nextdate += (unsigned long)rstrct.ntp_minpkt;
 	}
+	timer_schedule(peer);
 	DPRINT(2, ("poll_update: at %u %s poll %d burst %d retry %d head %d early %u next %u\n",
 		   current_time, socktoa(&peer->srcadr), peer->hpoll,
-		   peer->burst, peer->retry, peer->throttle,
+		   peer->burst, peer->retry, peer_throttle(peer),
 		   utemp - current_time, peer->nextdate -
 		   current_time));
 }
 
 
+/*
+ * peer_throttle - the rate control bucket as of now.  It drains by one
+ * a second; rather than have timer() walk every association for that,
+ * the drain is worked out from throttle_at whenever someone looks.
+ */
+int
+peer_throttle(
+	const struct peer *peer
+	)
+{
+	uptime_t gone = current_time - peer->throttle_at;
+
+	if (peer->throttle <= 0)
+		return peer->throttle;
+	if (gone >= (uptime_t)peer->throttle)
+		return 0;
+	return peer->throttle - (int)gone;
+}
+
+
 /*
  * peer_clear - clear peer filter registers.  See Section 3.4.8 of the
  * spec.
@@ -1323,7 +1500,9 @@ peer_clear(
 	 * avoid implosion.
 	 */
 	peer->nextdate = peer->update = peer->outdate = current_time;
-	if (initializing1) {
+	if (sys_faststart) {
+		/* all at once */
+	} else if (initializing1) {
 		peer->nextdate += (unsigned long)peer_associations;
 	} else {
 	    /*
@@ -1339,12 +1518,126 @@ peer_clear(
 	    unsigned int pseudorand = peer->associd ^ sock_hash(&peer->srcadr);
 	    peer->nextdate += (pseudorand % (1 << peer->cfg.minpoll));
 	}
+	timer_schedule(peer);
 	DPRINT(1, ("peer_clear: at %u next %u associd %d refid %s\n",
 		   current_time, peer->nextdate, peer->associd,
 		   ident));
 }
 
 
+/*
+ * filter_sort - sort the filter stages by distance, the newer first
+ * among equals.  dst[] and ord[] come in newest first.  With only
+ * NTP_SHIFT stages a fixed network of compare-exchanges beats any
+ * general sort; it has no data-dependent loops and the compiler turns
+ * most of it into min/max and conditional moves.
+ */
+#if NTP_SHIFT != 8
+#error "filter_sort() is a sorting network for exactly 8 stages"
+#endif
+
+#define FILTER_CX(a, b)							\
+	do {								\
+		if (dst[b] < dst[a] ||					\
+		    (!(dst[a] < dst[b]) && age[b] < age[a])) {		\
+			double	d_ = dst[a];				\
+			int	o_ = ord[a], g_ = age[a];		\
+									\
+			dst[a] = dst[b]; ord[a] = ord[b]; age[a] = age[b]; \
+			dst[b] = d_; ord[b] = o_; age[b] = g_;		\
+		}							\
+	} while (0)
+
+static void
+filter_sort(
+	double	dst[NTP_SHIFT],
+	int	ord[NTP_SHIFT]
+	)
+{
+	int	age[NTP_SHIFT] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+	FILTER_CX(0, 2); FILTER_CX(1, 3); FILTER_CX(4, 6); FILTER_CX(5, 7);
+	FILTER_CX(0, 4); FILTER_CX(1, 5); FILTER_CX(2, 6); FILTER_CX(3, 7);
+	FILTER_CX(0, 1); FILTER_CX(2, 3); FILTER_CX(4, 5); FILTER_CX(6, 7);
+	FILTER_CX(2, 4); FILTER_CX(3, 5);
+	FILTER_CX(1, 4); FILTER_CX(3, 6);
+	FILTER_CX(1, 2); FILTER_CX(3, 4); FILTER_CX(5, 6);
+}
+
+#undef FILTER_CX
+
+
+/*
+ * sample_fixed - a nonnegative time in seconds as 8.24 fixed point,
+ * saturating
+ */
+static uint32_t
+sample_fixed(
+	double	d
+	)
+{
+	d = scalbn(d, 24);
+	if (!(d > 0))
+		return 0;
+	if (d >= UINT32_MAX)
+		return UINT32_MAX;
+	return (uint32_t)(d + 0.5);
+}
+
+
+/*
+ * keep_sample - add a sample to the peer's ring of raw samples, for
+ * CTL_OP_READ_SAMPLES.  The ring is made on the first sample and made
+ * again if peer_samples has changed since; the sample numbers go on.
+ */
+void
+keep_sample(
+	struct peer *peer,
+	l_fp	t1,
+	l_fp	t2,
+	l_fp	t3,
+	l_fp	t4,
+	double	offset,
+	double	delay,
+	double	disp
+	)
+{
+	struct peer_cold *cold = peer->cold;
+	struct peer_sample *s;
+
+	if (0 == peer_samples && NULL == cold->samples)
+		return;
+	if (cold->sample_slots != (unsigned int)peer_samples) {
+		free_tag(MEM_PEER, cold->samples,
+			 cold->sample_slots * sizeof(*cold->samples));
+		cold->samples = NULL;
+		cold->sample_slots = 0;
+		if (0 == peer_samples)
+			return;		/* the option was turned off */
+		cold->samples = eallocarray_tag(MEM_PEER,
+						(size_t)peer_samples,
+						sizeof(*cold->samples));
+		cold->sample_slots = (unsigned int)peer_samples;
+		cold->sample_base = cold->sample_seq;
+	}
+	s = &cold->samples[cold->sample_seq % cold->sample_slots];
+	s->t1 = t1;
+	s->t2 = t2;
+	s->t3 = t3;
+	s->t4 = t4;
+	offset = scalbn(offset, 32);
+	if (offset >= (double)INT64_MAX)
+		s->offset = INT64_MAX;
+	else if (offset <= (double)INT64_MIN)
+		s->offset = INT64_MIN;
+	else
+		s->offset = (int64_t)llround(offset);
+	s->delay = sample_fixed(delay);
+	s->disp = sample_fixed(disp);
+	cold->sample_seq++;
+}
+
+
 /*
  * clock_filter - add incoming clock sample to filter register and run
  *		  the filter procedure to find the best sample.
@@ -1358,9 +1651,11 @@ clock_filter(
 	)
 {
 	double	dst[NTP_SHIFT];		/* distance vector */
+	double	reg[NTP_SHIFT];		/* distance by register slot */
 	int	ord[NTP_SHIFT];		/* index vector */
 	int	i, j, k, m;
 	double	dtemp, etemp, jtemp;
+	uptime_t xpt;
 	char	tbuf[80];
 
 	/*
@@ -1369,64 +1664,61 @@ clock_filter(
 	 * wire protocol. The dispersion grows from the last outbound
 	 * packet to the arrival of this one increased by the sum of the
 	 * peer precision and the system precision as required by the
-	 * error budget. First, shift the new arrival into the shift
-	 * register discarding the oldest one.
+	 * error budget.
+	 *
+	 * First, age the dispersions of the samples already held, then
+	 * shift the new arrival into the shift register discarding the
+	 * oldest one. Clamp every dispersion at the maximum.
 	 */
+	if (sample_disp < sys_maxdisp)
+		startup_mark(START_SAMPLE);
+	dtemp = loop_data.clock_phi * (current_time - peer->update);
+	peer->update = current_time;
+	for (i = 0; i < NTP_SHIFT; i++) {
+		etemp = peer->filter_disp[i] + dtemp;
+		peer->filter_disp[i] = etemp < sys_maxdisp ?
+		    etemp : sys_maxdisp;
+	}
 	j = peer->filter_nextpt;
 	peer->filter_offset[j] = sample_offset;
 	peer->filter_delay[j] = sample_delay;
-	peer->filter_disp[j] = sample_disp;
+	peer->filter_disp[j] = sample_disp < sys_maxdisp ?
+	    sample_disp : sys_maxdisp;
 	peer->filter_epoch[j] = current_time;
-	j = (j + 1) % NTP_SHIFT;
-	peer->filter_nextpt = j;
+	peer->filter_nextpt = (j + 1) % NTP_SHIFT;
 
 	/*
-	 * Update dispersions since the last update and at the same
-	 * time initialize the distance and index lists. Since samples
-	 * become increasingly uncorrelated beyond the Allan intercept,
-	 * only under exceptional cases will an older sample be used.
-	 * Therefore, the distance list uses a compound metric. If the
-	 * dispersion is greater than the maximum dispersion, clamp the
-	 * distance at that value. If the time since the last update is
-	 * less than the Allan intercept use the delay; otherwise, use
-	 * the sum of the delay and dispersion.
+	 * Compute the distance of each sample. Since samples become
+	 * increasingly uncorrelated beyond the Allan intercept, only
+	 * under exceptional cases will an older sample be used.
+	 * Therefore, the distance uses a compound metric. If the
+	 * dispersion is at the maximum dispersion, clamp the distance
+	 * at that value. If the time since the last update is less
+	 * than the Allan intercept use the delay; otherwise, use the
+	 * sum of the delay and dispersion. This runs over the register
+	 * slots in storage order so it compiles to straight vector
+	 * code; the distance and index lists then pick the slots up
+	 * newest first.
 	 */
-	dtemp = loop_data.clock_phi * (current_time - peer->update);
-	peer->update = current_time;
-	for (i = NTP_SHIFT - 1; i >= 0; i--) {
-		if (i != 0)
-			peer->filter_disp[j] += dtemp;
-		if (peer->filter_disp[j] >= sys_maxdisp) {
-			peer->filter_disp[j] = sys_maxdisp;
-			dst[i] = sys_maxdisp;
-		} else if (peer->update - peer->filter_epoch[j] >
-		    (unsigned long)ULOGTOD(clkstate.allan_xpt)) {
-			dst[i] = peer->filter_delay[j] +
-			    peer->filter_disp[j];
-		} else {
-			dst[i] = peer->filter_delay[j];
-		}
-		ord[i] = j;
-		j = (j + 1) % NTP_SHIFT;
+	xpt = (uptime_t)ULOGTOD(clkstate.allan_xpt);
+	for (i = 0; i < NTP_SHIFT; i++) {
+		double	delay = peer->filter_delay[i];
+		double	disp = peer->filter_disp[i];
+		double	dist = current_time - peer->filter_epoch[i] > xpt ?
+		    delay + disp : delay;
+
+		reg[i] = disp >= sys_maxdisp ? sys_maxdisp : dist;
+	}
+	for (i = 0; i < NTP_SHIFT; i++) {
+		ord[i] = (j + NTP_SHIFT - i) % NTP_SHIFT;
+		dst[i] = reg[ord[i]];
 	}
 
 	/*
 	 * If the clock has stabilized, sort the samples by distance.
 	 */
-	if (freq_cnt == 0) {
-		for (i = 1; i < NTP_SHIFT; i++) {
-			for (j = 0; j < i; j++) {
-				if (dst[j] > dst[i]) {
-					k = ord[j];
-					ord[j] = ord[i];
-					ord[i] = k;
-					etemp = dst[j];
-					dst[j] = dst[i];
-					dst[i] = etemp;
-				}
-			}
-		}
-	}
+	if (freq_cnt == 0)
+		filter_sort(dst, ord);
 
 	/*
 	 * Copy the index list to the association structure so ntpq
@@ -1526,7 +1818,90 @@ clock_filter(
 
 
 /*
- * clock_select - find the pick-of-the-litter clock
+ * clock_select - pick the system peer and wind the clock to it.  Only
+ * the picking counts toward LAT_SELECT; clock_update() keeps its own
+ * account of local_clock().
+ */
+void
+clock_select(void)
+{
+	struct timespec start;
+	struct peer *typesystem;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (sys_faststart)
+		faststart_check();
+	typesystem = select_peer();
+	latency_since(LAT_SELECT, &start);
+	if (typesystem != NULL) {
+		clock_update(typesystem);
+		if (sys_faststart)
+			faststart_done(typesystem);
+	}
+}
+
+
+/*
+ * filter_samples - how many stages of the clock filter hold a sample
+ */
+static int
+filter_samples(
+	struct peer *peer
+	)
+{
+	int	i, n = 0;
+
+	for (i = 0; i < NTP_SHIFT; i++)
+		if (peer->filter_disp[i] < sys_maxdisp)
+			n++;
+	return n;
+}
+
+
+/*
+ * faststart_check - are there enough sources with enough samples to
+ * let them through before their dispersion has come down?
+ */
+static void
+faststart_check(void)
+{
+	struct peer *peer;
+	int	n = 0;
+
+	for (peer = peer_list; peer != NULL; peer = peer->p_link) {
+		if ((FLAG_LOOKUP & peer->cfg.flags) ||
+		    (MDF_POOL & peer->cast_flags) ||
+		    (FLAG_NOSELECT & peer->cfg.flags) || !peer->reach)
+			continue;
+		if (filter_samples(peer) >= FASTSTART_SAMPLES)
+			n++;
+	}
+	faststart_quorum = n >= max(sys_minsane, sys_minclock);
+}
+
+
+/*
+ * faststart_done - end the fast start once the clock is set and the
+ * system peer would be selected without its help.
+ */
+static void
+faststart_done(
+	struct peer *peer
+	)
+{
+	if (sys_vars.sys_leap == LEAP_NOTINSYNC ||
+	    peer->disp >= sys_maxdist + loop_data.clock_phi *
+	    ULOGTOD(peer->hpoll))
+		return;
+	sys_faststart = false;
+	faststart_quorum = false;
+	msyslog(LOG_INFO, "PROTO: fast start done");
+}
+
+
+/*
+ * select_peer - find the pick-of-the-litter clock.  Returns NULL when
+ * there is none, or when it has nothing newer than the last update.
  *
  * When lockclock is on: (1) If the local clock is the prefer peer, it
  * will always be enabled, even if declared falseticker, (2) only the
@@ -1534,19 +1909,17 @@ clock_filter(
  * source is down, the system leap bits are set to 11 and the stratum
  * set to infinity.
  */
-void
-clock_select(void)
+static struct peer *
+select_peer(void)
 {
 	struct peer *peer;
-	int	i, j, k, n;
-	int	nlist, nl2;
-	int	allow;
+	int	i, j;
+	int	nlist;
 	int	speer;
-	double	d, e, f, g;
+	double	e, f;
 	double	high, low;
 	double	speermet;
 	double	orphmet = 2.0 * UINT32_MAX; /* 2x is greater than */
-	struct endpoint endp;
 	struct peer *osys_peer;
 	struct peer *sys_prefer = NULL;	/* prefer peer */
 	struct peer *typesystem = NULL;
@@ -1557,23 +1930,26 @@ clock_select(void)
 	struct peer *typepps = NULL;
 #endif /* REFCLOCK */
 	static struct endpoint *endpoint = NULL;
-	static int *indx = NULL;
+	static struct endpoint *scratch = NULL;
 	static peer_select *peers = NULL;
+	static double *sum = NULL;
 	static unsigned int endpoint_size = 0;
 	static unsigned int peers_size = 0;
-	static unsigned int indx_size = 0;
+	static unsigned int sum_size = 0;
 	size_t octets;
 
 	/*
-	 * Initialize and create endpoint, index and peer lists big
-	 * enough to handle all associations.
+	 * Initialize and create endpoint, scratch, peer and sum lists
+	 * big enough to handle all associations.
 	 */
 	osys_peer = sys_vars.sys_peer;
+	ctl_sysvars_changed();
 	sys_survivors = 0;
 	if (loop_data.lockclock) {
 		set_sys_leap(LEAP_NOTINSYNC);
 		sys_vars.sys_stratum = STRATUM_UNSPEC;
 		memcpy(&sys_vars.sys_refid, "DOWN", REFIDLEN);
+		publish_reply_template();
 	}
 
 	/*
@@ -1586,11 +1962,12 @@ clock_select(void)
 	}
 	endpoint_size = ALIGNED_SIZE((unsigned int)nlist * 2 * sizeof(*endpoint));
 	peers_size = ALIGNED_SIZE((unsigned int)nlist * sizeof(*peers));
-	indx_size = ALIGNED_SIZE((unsigned int)nlist * 2 * sizeof(*indx));
-	octets = endpoint_size + peers_size + indx_size;
+	sum_size = ALIGNED_SIZE((unsigned int)nlist * sizeof(*sum));
+	octets = 2 * endpoint_size + peers_size + sum_size;
 	endpoint = erealloc(endpoint, octets);
-	peers = INC_ALIGNED_PTR(endpoint, endpoint_size);
-	indx = INC_ALIGNED_PTR(peers, peers_size);
+	scratch = INC_ALIGNED_PTR(endpoint, endpoint_size);
+	peers = INC_ALIGNED_PTR(scratch, endpoint_size);
+	sum = INC_ALIGNED_PTR(peers, peers_size);
 
 	/*
 	 * Initially, we populate the island with all the rifraff peers
@@ -1602,7 +1979,7 @@ clock_select(void)
 	 * has dwindled to sys_minclock, the survivors split a million
 	 * bucks and collectively crank the chimes.
 	 */
-	nlist = nl2 = 0;	/* none yet */
+	nlist = 0;	/* none yet */
 	for (peer = peer_list; peer != NULL; peer = peer->p_link) {
 		peer->new_status = CTL_PST_SEL_REJECT;
 
@@ -1686,46 +2063,17 @@ clock_select(void)
 		peers[nlist].error = peer->jitter;
 		peers[nlist].synch = f;
 		nlist++;
-
-		/*
-		 * Insert each interval endpoint on the unsorted
-		 * endpoint[] list.
-		 */
-		e = peer->offset;
-		endpoint[nl2].type = -1;	/* lower end */
-		endpoint[nl2].val = e - f;
-		nl2++;
-		endpoint[nl2].type = 1;		/* upper end */
-		endpoint[nl2].val = e + f;
-		nl2++;
 	}
+
 	/*
-	 * Construct sorted indx[] of endpoint[] indexes ordered by
-	 * offset.
+	 * Sort the interval endpoints by offset.  Each peer remembers
+	 * where its endpoints were last time, so this is nearly free
+	 * when nothing much has changed.
 	 */
-	for (i = 0; i < nl2; i++) {
-		indx[i] = i;
-	}
-	for (i = 0; i < nl2; i++) {
-		endp = endpoint[indx[i]];
-		e = endp.val;
-		k = i;
-		for (j = i + 1; j < nl2; j++) {
-			endp = endpoint[indx[j]];
-			if (endp.val < e) {
-				e = endp.val;
-				k = j;
-			}
-		}
-		if (k != i) {
-			j = indx[k];
-			indx[k] = indx[i];
-			indx[i] = j;
-		}
-	}
-	for (i = 0; i < nl2; i++)
+	select_endpoints(peers, nlist, endpoint, scratch);
+	for (i = 0; i < 2 * nlist; i++)
 		DPRINT(3, ("select: endpoint %2d %.6f\n",
-			   endpoint[indx[i]].type, endpoint[indx[i]].val));
+			   endpoint[i].type, endpoint[i].val));
 
 	/*
 	 * This is the actual algorithm that cleaves the truechimers
@@ -1744,45 +2092,11 @@ clock_select(void)
 	 * candidates, the Albanians have won the Byzantine wars and
 	 * correct synchronization is not possible.
 	 *
-	 * Here, nlist is the number of candidates and allow is the
-	 * number of falsetickers. Upon exit, the truechimers are the
-	 * survivors with offsets not less than low and not greater than
-	 * high. There may be none of them.
+	 * Upon exit, the truechimers are the survivors with offsets
+	 * not less than low and not greater than high. There may be
+	 * none of them.
 	 */
-	low = 1e9;
-	high = -1e9;
-	for (allow = 0; 2 * allow < nlist; allow++) {
-
-		/*
-		 * Bound the interval (low, high) as the smallest
-		 * interval containing points from the most sources.
-		 */
-		n = 0;
-		for (i = 0; i < nl2; i++) {
-			low = endpoint[indx[i]].val;
-			n -= endpoint[indx[i]].type;
-			if (n >= nlist - allow) {
-				break;
-}
-		}
-		n = 0;
-		for (j = nl2 - 1; j >= 0; j--) {
-			high = endpoint[indx[j]].val;
-			n += endpoint[indx[j]].type;
-			if (n >= nlist - allow) {
-				break;
-}
-		}
-
-		/*
-		 * If an interval containing truechimers is found, stop.
-		 * If not, increase the number of falsetickers and go
-		 * around again.
-		 */
-		if (high > low) {
-			break;
-}
-	}
+	select_intersect(endpoint, nlist, &low, &high);
 
 	/*
 	 * Clustering algorithm. Whittle candidate list of falsetickers,
@@ -1868,42 +2182,8 @@ clock_select(void)
 	 * jitter. Stop if we are about to discard a TRUE or PREFER
 	 * peer, who of course have the immunity idol.
 	 */
-	while (1) {
-		d = 1e9; // Minimum peer jitter
-		e = -1e9; // Worst peer select jitter * synch
-		g = 0; // Worst peer select jitter
-		k = 0; // Index of the worst peer
-		for (i = 0; i < nlist; i++) {
-			if (peers[i].error < d) {
-				d = peers[i].error;
-			}
-			peers[i].seljit = 0;
-			if (nlist > 1) {
-				f = 0;
-				for (j = 0; j < nlist; j++)
-					f += DIFF(peers[j].peer->offset,
-					    peers[i].peer->offset);
-				peers[i].seljit = SQRT(f / (nlist - 1));
-			}
-			if (peers[i].seljit * peers[i].synch > e) {
-				g = peers[i].seljit;
-				e = peers[i].seljit * peers[i].synch;
-				k = i;
-			}
-		}
-		if (nlist <= max(1, sys_minclock) || g <= d ||
-		    ((FLAG_TRUE | FLAG_PREFER) & peers[k].peer->cfg.flags))
-			break;
-
-		DPRINT(3, ("select: drop %s seljit %.6f jit %.6f\n",
-			   socktoa(&peers[k].peer->srcadr), g, d));
-		if (nlist > sys_maxclock)
-			peers[k].peer->new_status = CTL_PST_SEL_EXCESS;
-		for (j = k + 1; j < nlist; j++) {
-			peers[j - 1] = peers[j];
-		}
-		nlist--;
-	}
+	nlist = select_cluster(peers, nlist, sys_minclock, sys_maxclock,
+			       sum);
 
 	/*
 	 * What remains is a list usually not greater than sys_minclock
@@ -2057,7 +2337,7 @@ clock_select(void)
 		sys_vars.sys_peer = NULL;
 		for (peer = peer_list; peer != NULL; peer = peer->p_link)
 			peer->status = peer->new_status;
-		return;
+		return NULL;
 	}
 
 	/*
@@ -2065,16 +2345,16 @@ clock_select(void)
 	 * stability.
 	 */
 	if (typesystem->epoch <= sys_epoch)
-		return;
+		return NULL;
 
 	/*
-	 * We have found the alpha male. Wind the clock.
+	 * We have found the alpha male.
 	 */
 	if (osys_peer != typesystem)
 		report_event(PEVNT_NEWPEER, typesystem, NULL);
 	for (peer = peer_list; peer != NULL; peer = peer->p_link)
 		peer->status = peer->new_status;
-	clock_update(typesystem);
+	return typesystem;
 }
 
 
@@ -2150,6 +2430,28 @@ root_distance(
 }
 
 
+/*
+ * While the timer sends the polls due in a tick, peer_xmit() queues
+ * them with the server replies, and runs of polls leaving from the
+ * same endpoint go out in one sendmmsg().  The kernel's transmit
+ * stamp replaces the origin timestamp, so the wait doesn't count.
+ */
+static bool	xmit_batching;
+
+/*
+ * xmit_batch - start queueing polls, or send what was queued
+ */
+void
+xmit_batch(
+	bool	on
+	)
+{
+	xmit_batching = on;
+	if (!on)
+		flush_sendpkts();
+}
+
+
 /*
  * peer_xmit - send client-mode packet for persistent association.
  */
@@ -2178,9 +2480,15 @@ peer_xmit(
 		xpkt.rootdelay = 0;
 		xpkt.rootdisp =	0;
 		xpkt.reftime = htonl_fp(0);
-		xpkt.org = htonl_fp(0);
-		xpkt.rec = htonl_fp(0);
-		ntp_RAND_bytes((unsigned char *)&peer->org_rand,
+		if (FLAG_XLEAVE & peer->cfg.flags) {
+			/* ask for the transmit time of the last reply */
+			xpkt.org = htonl_fp(peer->rec);
+			xpkt.rec = htonl_fp(peer->dst);
+		} else {
+			xpkt.org = htonl_fp(0);
+			xpkt.rec = htonl_fp(0);
+		}
+		ntp_RAND_pool_bytes((unsigned char *)&peer->org_rand,
 			sizeof(peer->org_rand));
 		get_systime(&peer->org_ts);	/* as late as possible */
 	} else {
@@ -2209,7 +2517,7 @@ peer_xmit(
 	 */
 	if (FLAG_NTS & peer->cfg.flags) {
 #ifndef DISABLE_NTS
-		if (0 < peer->nts_state.count)
+		if (0 < peer->cold->nts_state.count)
 		  sendlen += extens_client_send(peer, &xpkt);
 		else {
 		  restart_nts_ke(peer);  /* out of cookies */
@@ -2221,18 +2529,24 @@ peer_xmit(
 		if (NULL == auth) {
 			report_event(PEVNT_AUTH, peer, "no key");
 			peer->flash |= BOGON5;		/* auth error */
-			peer->badauth++;
+			peer->cold->badauth++;
 			return;
 		}
 		sendlen += authencrypt(auth, (uint32_t *)&xpkt, sendlen);
 	}
 
-	sendpkt(&peer->srcadr, peer->dstadr, &xpkt, sendlen);
+	if (xmit_batching)
+		queue_sendpkt_txstamp(&peer->srcadr, peer->dstadr, &xpkt,
+				      sendlen);
+	else
+		sendpkt_txstamp(&peer->srcadr, peer->dstadr, &xpkt, sendlen);
+	pkttrace_xmit(&peer->srcadr, &xpkt, sendlen, peer->org_ts);
 
 	peer->sent++;
         peer->outcount++;
         peer->bogons = 0;
-	peer->throttle += (1 << peer->cfg.minpoll) - 2;
+	peer->throttle = peer_throttle(peer) + (1 << peer->cfg.minpoll) - 2;
+	peer->throttle_at = current_time;
 	DPRINT(1, ("transmit: at %u %s->%s mode %d keyid %08x len %u\n",
 		   current_time, peer->dstadr ?
 		   socktoa(&peer->dstadr->sin) : "-",
@@ -2241,30 +2555,114 @@ peer_xmit(
 }
 
 
+/*
+ * Reply template: the header of a server reply as it goes on the wire,
+ * encoded by the main thread whenever the system variables change and
+ * at least once a second, under a sequence lock.  Readers copy it
+ * without locking and retry if a writer got in the way, so responder
+ * threads never see a half-updated set, and a reply only has to add
+ * the version and poll and its own timestamps.
+ */
+struct reply_template {
+	uint8_t		li_vn_mode;	/* leap and mode, no version */
+	uint8_t		stratum;
+	int8_t		precision;
+	u_fp		rootdelay;	/* these in network byte order */
+	u_fp		rootdisp;
+	refid_t		refid;
+	l_fp_w		reftime;
 #ifdef ENABLE_LEAP_SMEAR
+	bool		smear_in_progress;
+	l_fp		smear_offset;
+	struct leap_smear_seg smear_seg;
+#endif
+};
 
-static void
-leap_smear_add_offs(l_fp *t) {
-	*t += leap_smear.offset;
+static struct reply_template	reply_tmpl;
+static volatile unsigned int	reply_seq;	/* odd while writing */
+
+static inline void reply_barrier(void) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
 }
 
-#endif	/* ENABLE_LEAP_SMEAR */
+/*
+ * publish_reply_template - make the current system variables visible
+ * to the reply path.  Main thread only.
+ */
+void
+publish_reply_template(void)
+{
+	struct reply_template t;
+	l_fp	reftime = sys_vars.sys_reftime;
+
+	t.li_vn_mode = PKT_LI_VN_MODE(xmt_leap, 0, MODE_SERVER);
+	t.stratum = STRATUM_TO_PKT(sys_vars.sys_stratum);
+	t.precision = sys_vars.sys_precision;
+	t.rootdelay = HTONS_FP(DTOUFP(sys_vars.sys_rootdelay));
+	t.rootdisp = HTONS_FP(DTOUFP(sys_vars.sys_rootdisp));
+	t.refid = sys_vars.sys_refid;
+#ifdef ENABLE_LEAP_SMEAR
+	/*
+	 * Inside the leap smear interval the refid shows the smear and
+	 * the reftime is smeared too, so it isn't later than the
+	 * receive and transmit times.
+	 */
+	t.smear_in_progress = leap_smear.in_progress;
+	t.smear_offset = leap_smear.offset;
+	t.smear_seg = leap_smear.seg;
+	if (t.smear_in_progress) {
+		reftime += t.smear_offset;
+		t.refid = convertLFPToRefID(t.smear_offset);
+	}
+#endif
+	t.reftime = htonl_fp(reftime);
+
+	reply_seq++;
+	reply_barrier();
+	reply_tmpl = t;
+	reply_barrier();
+	reply_seq++;
+}
 
 /*
- * fast_xmit - Send packet for nonpersistent association. Note that
- * neither the source or destination can be a broadcast address.
+ * read_reply_template - take a consistent copy of the reply template
  */
-static void
-fast_xmit(
+static NTP_HOT void
+read_reply_template(
+	struct reply_template *t
+	)
+{
+	unsigned int seq;
+
+	for (;;) {
+		seq = reply_seq;
+		reply_barrier();
+		if (seq & 1)
+			continue;	/* writer active */
+		*t = reply_tmpl;
+		reply_barrier();
+		if (seq == reply_seq)
+			return;
+	}
+}
+
+/*
+ * build_server_reply - fill in a server reply to the request in rbufp.
+ * Touches only the request, where it notes the reply's transmit time
+ * for interleaved mode, and the reply template, so responder threads
+ * may call it without proto_lock.
+ */
+static NTP_HOT void
+build_server_reply(
 	struct recvbuf *rbufp,	/* receive packet pointer */
-	auth_info *auth,	/* !NULL for authentication */
-	int	flags		/* restrict mask */
+	int	flags,		/* restrict mask */
+	struct pkt *xpkt	/* transmit packet structure */
 	)
 {
-	struct pkt xpkt;	/* transmit packet structure */
-	l_fp	xmt_tx;
-	struct timespec	start, finish;
-	size_t	sendlen;
+	struct reply_template tmpl;
+	l_fp	rx, xmt_tx;
 
 	/*
 	 * Initialize transmit packet header fields from the receive
@@ -2283,43 +2681,30 @@ fast_xmit(
 	 * synchronization.
 	 */
 	if (flags & RES_KOD) {
-		stat_proto_total.sys_kodsent++;
-		xpkt.li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC,
+		xpkt->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC,
 		    PKT_VERSION(rbufp->pkt.li_vn_mode), MODE_SERVER);
-		xpkt.stratum = STRATUM_PKT_UNSPEC;
-		xpkt.ppoll = max(rbufp->pkt.ppoll, rstrct.ntp_minpoll);
-		xpkt.precision = rbufp->pkt.precision;
-		memcpy(&xpkt.refid, "RATE", REFIDLEN);
-		xpkt.rootdelay = htonl(rbufp->pkt.rootdelay);
-		xpkt.rootdisp = htonl(rbufp->pkt.rootdisp);
-		xpkt.reftime.l_ui = htonl(rbufp->pkt.reftime >> 32);
-		xpkt.reftime.l_uf = htonl(rbufp->pkt.reftime & 0xFFFFFFFF);
-		xpkt.org.l_ui = htonl(rbufp->pkt.xmt >> 32);
-		xpkt.org.l_uf = htonl(rbufp->pkt.xmt & 0xFFFFFFFF);
-		xpkt.rec.l_ui = htonl(rbufp->pkt.xmt >> 32);
-		xpkt.rec.l_uf = htonl(rbufp->pkt.xmt & 0xFFFFFFFF);
-		xpkt.xmt.l_ui = htonl(rbufp->pkt.xmt >> 32);
-		xpkt.xmt.l_uf = htonl(rbufp->pkt.xmt & 0xFFFFFFFF);
+		xpkt->stratum = STRATUM_PKT_UNSPEC;
+		xpkt->ppoll = max(rbufp->pkt.ppoll, rstrct.ntp_minpoll);
+		xpkt->precision = rbufp->pkt.precision;
+		memcpy(&xpkt->refid, "RATE", REFIDLEN);
+		xpkt->rootdelay = htonl(rbufp->pkt.rootdelay);
+		xpkt->rootdisp = htonl(rbufp->pkt.rootdisp);
+		xpkt->reftime.l_ui = htonl(rbufp->pkt.reftime >> 32);
+		xpkt->reftime.l_uf = htonl(rbufp->pkt.reftime & 0xFFFFFFFF);
+		xpkt->org.l_ui = htonl(rbufp->pkt.xmt >> 32);
+		xpkt->org.l_uf = htonl(rbufp->pkt.xmt & 0xFFFFFFFF);
+		xpkt->rec.l_ui = htonl(rbufp->pkt.xmt >> 32);
+		xpkt->rec.l_uf = htonl(rbufp->pkt.xmt & 0xFFFFFFFF);
+		xpkt->xmt.l_ui = htonl(rbufp->pkt.xmt >> 32);
+		xpkt->xmt.l_uf = htonl(rbufp->pkt.xmt & 0xFFFFFFFF);
+		rbufp->xleave = XLEAVE_NONE;
 
 	/*
 	 * This is a normal packet. Use the system variables.
 	 */
 	} else {
-#ifdef ENABLE_LEAP_SMEAR
-		/*
-		 * Make copies of the variables which can be affected by smearing.
-		 */
-		l_fp this_ref_time;
-		l_fp this_recv_time;
-#endif
+		read_reply_template(&tmpl);
 
-		/*
-		 * If we are inside the leap smear interval we add the
-		 * current smear offset to the packet receive time, to
-		 * the packet transmit time, and eventually to the
-		 * reftime to make sure the reftime isn't later than
-		 * the transmit/receive times.
-		 */
 		/* Note: This returns the same data for all versions.
 		 * Currently, the mode is always Server.
 		 * The version is copied from the request.
@@ -2327,50 +2712,93 @@ fast_xmit(
 		 * So far, nobody cares.
 		 * Note: There is significant NTPv1 traffic.  See #707
 		 */
-		xpkt.li_vn_mode = PKT_LI_VN_MODE(xmt_leap,
-		    PKT_VERSION(rbufp->pkt.li_vn_mode), MODE_SERVER);
-		xpkt.stratum = STRATUM_TO_PKT(sys_vars.sys_stratum);
-		xpkt.ppoll = max(rbufp->pkt.ppoll, rstrct.ntp_minpoll);
-		xpkt.precision = sys_vars.sys_precision;
-		xpkt.refid = sys_vars.sys_refid;
-		xpkt.rootdelay = HTONS_FP(DTOUFP(sys_vars.sys_rootdelay));
-		xpkt.rootdisp = HTONS_FP(DTOUFP(sys_vars.sys_rootdisp));
+		xpkt->li_vn_mode = tmpl.li_vn_mode |
+		    VN_MODE(PKT_VERSION(rbufp->pkt.li_vn_mode), 0);
+		xpkt->stratum = tmpl.stratum;
+		xpkt->ppoll = max(rbufp->pkt.ppoll, rstrct.ntp_minpoll);
+		xpkt->precision = tmpl.precision;
+		xpkt->rootdelay = tmpl.rootdelay;
+		xpkt->rootdisp = tmpl.rootdisp;
+		xpkt->refid = tmpl.refid;
+		xpkt->reftime = tmpl.reftime;
 
 #ifdef ENABLE_LEAP_SMEAR
-		this_ref_time = sys_vars.sys_reftime;
-		if (leap_smear.in_progress) {
-			leap_smear_add_offs(&this_ref_time);
-			xpkt.refid = convertLFPToRefID(leap_smear.offset);
+		/*
+		 * If we are inside the leap smear interval we add the
+		 * smear offset for the packet receive time and for the
+		 * packet transmit time to each; the template has done
+		 * the reftime.
+		 */
+		if (tmpl.smear_in_progress) {
+			/* kernel stamps are not smeared, answer in basic mode */
+			if (XLEAVE_REPLY == rbufp->xleave)
+				rbufp->xleave = XLEAVE_BASIC;
 			DPRINT(2, ("fast_xmit: leap_smear.in_progress: refid %8x, smear %s\n",
-				ntohl(xpkt.refid),
-				lfptoa(leap_smear.offset, 8)
+				ntohl(xpkt->refid),
+				lfptoa(tmpl.smear_offset, 8)
 				));
 		}
-		xpkt.reftime = htonl_fp(this_ref_time);
-#else
-		xpkt.reftime = htonl_fp(sys_vars.sys_reftime);
 #endif
 
-		xpkt.org.l_ui = htonl(rbufp->pkt.xmt >> 32);
-		xpkt.org.l_uf = htonl(rbufp->pkt.xmt & 0xFFFFFFFF);
+		/*
+		 * An interleaved reply is told apart by its origin
+		 * timestamp, the receive timestamp the client sent us.
+		 */
+		if (XLEAVE_REPLY == rbufp->xleave) {
+			xpkt->org.l_ui = htonl(rbufp->pkt.rec >> 32);
+			xpkt->org.l_uf = htonl(rbufp->pkt.rec & 0xFFFFFFFF);
+		} else {
+			xpkt->org.l_ui = htonl(rbufp->pkt.xmt >> 32);
+			xpkt->org.l_uf = htonl(rbufp->pkt.xmt & 0xFFFFFFFF);
+		}
 
+		/* a duplicate is answered as the request it copies */
+		rx = (XLEAVE_DUP == rbufp->xleave) ?
+		    rbufp->xleave_tx : rbufp->recv_time;
 #ifdef ENABLE_LEAP_SMEAR
-		this_recv_time = rbufp->recv_time;
-		if (leap_smear.in_progress)
-			leap_smear_add_offs(&this_recv_time);
-		xpkt.rec = htonl_fp(this_recv_time);
+		if (tmpl.smear_in_progress)
+			xpkt->rec = htonl_fp(rx +
+			    leap_smear_at(&tmpl.smear_seg, rx));
+		else
+			xpkt->rec = htonl_fp(rx);
 #else
-		xpkt.rec = htonl_fp(rbufp->recv_time);
+		xpkt->rec = htonl_fp(rx);
 #endif
 
 		get_systime(&xmt_tx);
 #ifdef ENABLE_LEAP_SMEAR
-		if (leap_smear.in_progress)
-			leap_smear_add_offs(&xmt_tx);
+		if (tmpl.smear_in_progress)
+			xmt_tx += leap_smear_at(&tmpl.smear_seg, xmt_tx);
 #endif
-		xpkt.xmt = htonl_fp(xmt_tx);
+		/* interleaved, the transmit time of the last reply */
+		if (XLEAVE_REPLY == rbufp->xleave)
+			xpkt->xmt = htonl_fp(rbufp->xleave_tx);
+		else
+			xpkt->xmt = htonl_fp(xmt_tx);
+		rbufp->xleave_tx = xmt_tx;
 	}
+}
+
+/*
+ * fast_xmit - Send packet for nonpersistent association. Note that
+ * neither the source or destination can be a broadcast address.
+ */
+static void
+fast_xmit(
+	struct recvbuf *rbufp,	/* receive packet pointer */
+	auth_info *auth,	/* !NULL for authentication */
+	int	flags		/* restrict mask */
+	)
+{
+	struct pkt xpkt;	/* transmit packet structure */
+	struct timespec	start, finish;
+	l_fp	now;
+	size_t	sendlen;
+	struct nts_seal seal;
 
+	if (flags & RES_KOD)
+		stat_proto_total.sys_kodsent++;
+	build_server_reply(rbufp, flags, &xpkt);
 
 #ifdef ENABLE_MSSNTP
 	if (flags & RES_MSSNTP) {
@@ -2386,10 +2814,12 @@ fast_xmit(
          *  3) none
 	 */
 	sendlen = LEN_PKT_NOMAC;
+	seal.pending = false;
 	clock_gettime(CLOCK_MONOTONIC, &start);
-	if (rbufp->ntspacket.valid) {
+	if (NULL != rbufp->ntspacket && rbufp->ntspacket->valid) {
 #ifndef DISABLE_NTS
-	  sendlen += extens_server_send(&rbufp->ntspacket, &xpkt);
+	  /* encryption is done as the reply is sent */
+	  sendlen += extens_server_send(rbufp->ntspacket, &xpkt, &seal);
 #endif
         } else if (NULL != auth) {
 	  sendlen += (size_t)authencrypt(auth, (uint32_t *)&xpkt, (int)sendlen);
@@ -2402,9 +2832,23 @@ fast_xmit(
 	  maybe_log_junk("DDoS", rbufp);	/* needs a counter */
 	  return;
 	}
-	sendpkt(&rbufp->recv_srcadr, rbufp->dstadr, &xpkt, (int)sendlen);
+	if (seal.pending)
+		queue_sealed_sendpkt(&rbufp->recv_srcadr, rbufp->dstadr,
+				     &xpkt, (int)sendlen, &seal,
+				     XLEAVE_REPLY == rbufp->xleave);
+	else if (XLEAVE_REPLY == rbufp->xleave)
+		queue_sendpkt_txstamp(&rbufp->recv_srcadr, rbufp->dstadr,
+				      &xpkt, (int)sendlen);
+	else
+		queue_sendpkt(&rbufp->recv_srcadr, rbufp->dstadr, &xpkt,
+			      (int)sendlen);
+	mon_xleave_sent(rbufp);
+	pkttrace_xmit(&rbufp->recv_srcadr, &xpkt, sendlen, rbufp->recv_time);
+	NTP_TRACE3(xmit, &rbufp->recv_srcadr, flags, sendlen);
 	clock_gettime(CLOCK_MONOTONIC, &finish);
 	sys_authdelay = tspec_intv_to_lfp(sub_tspec(finish, start));
+	get_systime(&now);
+	latency_lfp(LAT_XMIT, now - rbufp->recv_time);
 	/* Previous versions of this code had separate DPRINT-s so it
 	 * could print the key on the auth case.  That requires separate
 	 * sendpkt-s on each branch or the DPRINT pollutes the timing. */
@@ -2414,6 +2858,179 @@ fast_xmit(
 }
 
 
+/*
+ * KoD budget: a token bucket for the RATE packets the whole server
+ * sends, so a flood spoofing many sources can't make us a reflector
+ * however well each source's own kod limit holds.  Refilled once a
+ * second, up to a second's worth.  proto_lock held.
+ */
+static unsigned int	kod_tokens;
+static uptime_t		kod_stamp;
+
+static bool
+kod_budget(void)
+{
+	uint64_t tokens;
+
+	if (0 == mon_data.kod_max)
+		return true;
+	if (kod_stamp != current_time) {
+		tokens = kod_tokens +
+		    (uint64_t)mon_data.kod_max * (current_time - kod_stamp);
+		kod_tokens = (unsigned int)min(tokens, mon_data.kod_max);
+		kod_stamp = current_time;
+	}
+	if (0 == kod_tokens)
+		return false;
+	kod_tokens--;
+	return true;
+}
+
+/*
+ * rate_limited - the early path for a source over its rate limit,
+ * straight after ntp_monitor().  Returns true if the packet has been
+ * dealt with: dropped, or for a client request the source may have a
+ * KoD for, answered with one if the KoD budget allows.  Only the
+ * header is parsed; the KoD goes without MAC or NTS fields, so the
+ * packets a flood is spending us on cost no authentication.  Other
+ * modes with RES_KOD go on as before, mode 6 to its own budget.
+ */
+static bool
+rate_limited(
+	struct recvbuf *rbufp,
+	unsigned short restrict_mask
+	)
+{
+	uint8_t hisversion = PKT_VERSION(rbufp->recv_buffer[0]);
+
+	if (!(restrict_mask & RES_LIMITED))
+		return false;
+	stat_proto_total.sys_limitrejected++;
+	if (!(restrict_mask & RES_KOD))
+		return true;
+	if (MODE_CLIENT != PKT_MODE(rbufp->recv_buffer[0]))
+		return false;
+	if (hisversion < NTP_OLDVERSION || hisversion > NTP_VERSION ||
+	    i_require_authentication(NULL, restrict_mask))
+		return true;
+	if (!kod_budget()) {
+		stat_proto_total.sys_kodlimited++;
+		return true;
+	}
+	parse_header(rbufp);
+	stat_proto_total.sys_processed++;
+	/* MS-SNTP needs a MAC, which a KoD doesn't get */
+	fast_xmit(rbufp, NULL, restrict_mask & ~RES_MSSNTP);
+	return true;
+}
+
+
+/*
+ * duplicate_dropped - count a copy of a client request ntp_monitor()
+ * has spotted, and say whether it goes no further.  One it wants
+ * answered goes on through the usual checks and is built from the
+ * first copy's receive time.
+ */
+static bool
+duplicate_dropped(
+	struct recvbuf *rbufp
+	)
+{
+	if (XLEAVE_DUP != rbufp->xleave && XLEAVE_DROP != rbufp->xleave)
+		return false;
+	stat_proto_total.sys_duplicate++;
+	return XLEAVE_DROP == rbufp->xleave;
+}
+
+
+/*
+ * fast_admit - the stateless path for plain client requests: 48 bytes,
+ * no MAC, no extension fields, so no peer lookup, no authentication
+ * and no NTS.  Restrictions and the MRU list are applied exactly as
+ * receive() would.  Call with proto_lock held.  FAST_REPLY leaves the
+ * reply to fast_reply(), which a responder thread may run unlocked.
+ */
+int
+fast_admit(
+	struct recvbuf *rbufp
+	)
+{
+	unsigned short restrict_mask;
+	uint8_t hisversion = PKT_VERSION(rbufp->recv_buffer[0]);
+
+	/* NTPv1 takes the long road for its counters, see #707 */
+	if (LEN_PKT_NOMAC != rbufp->recv_length ||
+	    MODE_CLIENT != PKT_MODE(rbufp->recv_buffer[0]) ||
+	    hisversion <= NTP_OLDVERSION || hisversion > NTP_VERSION)
+		return FAST_SLOW;
+
+	stat_proto_total.sys_received++;
+	restrict_mask = mon_restrictions(&rbufp->recv_srcadr);
+	if (check_early_restrictions(rbufp, restrict_mask)) {
+		stat_proto_total.sys_restricted++;
+		return FAST_DONE;
+	}
+
+	restrict_mask = ntp_monitor(rbufp, restrict_mask);
+	if (rate_limited(rbufp, restrict_mask) || duplicate_dropped(rbufp))
+		return FAST_DONE;
+
+	/* RES_VERSION already turned away anything older */
+	if (hisversion == NTP_VERSION)
+		stat_proto_total.sys_newversion++;
+	else
+		stat_proto_total.sys_oldversion++;
+
+	/* exactly the header: no MAC or extensions to look for */
+	parse_header(rbufp);
+	if (i_require_authentication(NULL, restrict_mask)) {
+		stat_proto_total.sys_badauth++;
+		return FAST_DONE;
+	}
+
+	stat_proto_total.sys_processed++;
+	return FAST_REPLY;
+}
+
+/*
+ * fast_reply - answer a request fast_admit() let through.  With a
+ * NULL q the reply goes through queue_sendpkt() and proto_lock must
+ * be held; otherwise it lands on the private queue q, lock or no lock,
+ * and the caller accounts for LAT_XMIT and calls mon_xleave_sent()
+ * once it is sent.
+ */
+void
+fast_reply(
+	struct recvbuf *rbufp,
+	struct tx_queue *q
+	)
+{
+	struct pkt xpkt;
+	bool	txstamp;
+	l_fp	now;
+
+	build_server_reply(rbufp, 0, &xpkt);
+	txstamp = (XLEAVE_REPLY == rbufp->xleave);
+	pkttrace_xmit(&rbufp->recv_srcadr, &xpkt, LEN_PKT_NOMAC,
+		      rbufp->recv_time);
+	NTP_TRACE3(xmit, &rbufp->recv_srcadr, 0, LEN_PKT_NOMAC);
+	if (NULL == q) {
+		if (txstamp)
+			queue_sendpkt_txstamp(&rbufp->recv_srcadr,
+					      rbufp->dstadr, &xpkt,
+					      LEN_PKT_NOMAC);
+		else
+			queue_sendpkt(&rbufp->recv_srcadr, rbufp->dstadr,
+				      &xpkt, LEN_PKT_NOMAC);
+		mon_xleave_sent(rbufp);
+		get_systime(&now);
+		latency_lfp(LAT_XMIT, now - rbufp->recv_time);
+	} else
+		tx_queue_put(q, &rbufp->recv_srcadr, &xpkt, LEN_PKT_NOMAC,
+			     txstamp);
+}
+
+
 /*
  * dns_take_server - process DNS query for server.
  */
@@ -2468,7 +3085,9 @@ dns_take_server(
 	peer_refresh_interface(server);
 
 	server->hpoll = server->cfg.minpoll;
+	state_restore_peer(server);
 	server->nextdate = current_time;
+	timer_schedule(server);
 	peer_xmit(server);
 	if (server->cfg.flags & FLAG_IBURST)
 	  server->retry = NTP_RETRY;
@@ -2476,7 +3095,32 @@ dns_take_server(
 }
 
 /*
- dns_take_pool - process DNS query for pool.
+ * pool_wanted - how many more associations the pools may make now.
+ *
+ * Pools add associations while there are less than a hard limit of
+ * 2 * sys_maxclock associations, and either less than sys_minclock
+ * survivors or less than sys_maxclock associations.  The hard limit
+ * prevents unbounded growth in associations if the system clock or
+ * network quality result in survivor count dipping below sys_minclock
+ * often.  This was observed testing with pool, where sys_maxclock ==
+ * 12 resulted in 60 associations without the hard limit.  Short of
+ * survivors, they are added one at a time.
+ */
+static int
+pool_wanted(void)
+{
+	if (peer_associations > 2 * sys_maxclock)
+		return 0;
+	if (peer_associations < sys_maxclock)
+		return sys_maxclock - peer_associations;
+	if (sys_survivors < sys_minclock)
+		return 1;
+	return 0;
+}
+
+/*
+ dns_take_pool - process DNS query for pool: the address joins the
+ pool's candidates, see ntp_pool.c.
  */
 void
 dns_take_pool(
@@ -2484,16 +3128,26 @@ dns_take_pool(
 	sockaddr_u *		rmtadr
 	)
 {
-	struct peer_ctl		pctl;
-	struct peer *		peer;
-	endpt *			lcladr;
-
-	peer = findexistingpeer(rmtadr, NULL, NULL, MODE_CLIENT);
-	if (NULL != peer) {
+	if (NULL != findexistingpeer(rmtadr, NULL, NULL, MODE_CLIENT)) {
 		/* This address is already in use. */
-		msyslog(LOG_INFO, "DNS: Pool skipping: %s", socktoa(rmtadr));
+		DPRINT(1, ("dns_take_pool: skipping %s\n", socktoa(rmtadr)));
 		return;
 	}
+	pool_take(pool, rmtadr);
+}
+
+/*
+ * pool_associate - make an association with a server from a pool
+ */
+struct peer *
+pool_associate(
+	struct peer *pool,	/* pool solicitor association */
+	sockaddr_u *		rmtadr
+	)
+{
+	struct peer_ctl		pctl;
+	struct peer *		peer;
+	endpt *			lcladr;
 
 	msyslog(LOG_INFO, "DNS: Pool taking: %s", socktoa(rmtadr));
 
@@ -2502,18 +3156,23 @@ dns_take_pool(
 	pctl.version = pool->cfg.version;
 	pctl.minpoll = pool->cfg.minpoll;
 	pctl.maxpoll = pool->cfg.maxpoll;
-	pctl.flags = FLAG_PREEMPT | (FLAG_IBURST & pool->cfg.flags);
+	pctl.flags = FLAG_PREEMPT
+		     | ((FLAG_IBURST | FLAG_PROBE | FLAG_XLEAVE) &
+		        pool->cfg.flags);
 	pctl.mode = 0;
 	pctl.peerkey = 0;
 	peer = newpeer(rmtadr, NULL, lcladr,
 		       MODE_CLIENT, &pctl, MDF_UCAST, false);
+	if (NULL == peer)
+		return NULL;
 	peer_xmit(peer);
 	if (peer->cfg.flags & FLAG_IBURST)
 	  peer->retry = NTP_RETRY;
 	poll_update(peer, peer->hpoll);
 
-	DPRINT(1, ("dns_take_pool: at %u %s->%s pool\n",
+	DPRINT(1, ("pool_associate: at %u %s->%s pool\n",
 		   current_time, latoa(lcladr), socktoa(rmtadr)));
+	return peer;
 }
 
 /*
@@ -2526,7 +3185,7 @@ dns_take_pool(
 void dns_take_status(struct peer* peer, DNS_Status status) {
 	uint8_t hpoll = peer->hpoll;
 	const char *txt;
-	const char *hostname = peer->hostname;
+	const char *hostname = peer->cold->hostname;
 
 	if (NULL == hostname) {
 		hostname = socktoa(&peer->srcadr);
@@ -2569,12 +3228,15 @@ void dns_take_status(struct peer* peer, DNS_Status status) {
 	if ((DNS_good == status) &&
 		(MDF_UCAST & peer->cast_flags) && !(FLAG_LOOKUP & peer->cfg.flags))
 		hpoll = 0;  /* server: no more */
+	if ((DNS_good == status) && (MDF_POOL & peer->cast_flags))
+		(void)pool_fill(peer, pool_wanted());
 	msyslog(LOG_INFO, "DNS: dns_take_status: %s=>%s, %d",
 		hostname, txt, hpoll);
 	if (0 == hpoll)
 		return; /* hpoll already in use by new server */
 	peer->hpoll = hpoll;
 	peer->nextdate = current_time + (1U << hpoll);
+	timer_schedule(peer);
 }
 
 #ifndef DISABLE_NTS
@@ -2596,6 +3258,7 @@ static void restart_nts_ke(struct peer *peer) {
 	peer->ppoll = NTP_MAXPOLL_UNK;
 	peer->hpoll = hpoll;
 	peer->nextdate = current_time + (1U << hpoll);
+	timer_schedule(peer);
 	peer->cfg.flags |= FLAG_LOOKUP;
 };
 #endif
@@ -2603,11 +3266,16 @@ static void restart_nts_ke(struct peer *peer) {
 /*
  * dns_try_again
  *   retry danging DNS and NTS lookups
+ *   The network or resolv.conf may have changed, so don't trust
+ *   cached answers.
  */
 void dns_try_again(void) {
 	struct peer *p;
+	dns_cache_flush();
 	for (p = peer_list; p != NULL; p = p->p_link) {
 		if ((p->cfg.flags & FLAG_LOOKUP) || (p->cast_flags & MDF_POOL)) {
+			if (p->cast_flags & MDF_POOL)
+				pool_stale(p);
 			p->ppoll = NTP_MAXPOLL_UNK;
 			p->hpoll = p->cfg.minpoll;
 			transmit(p);   /* does all the work */
@@ -2679,7 +3347,8 @@ peer_unfit(
  * [2085] Fix root distance and root dispersion calculations.
  */
 	if (!(peer->cfg.flags & FLAG_REFCLOCK) && peer->disp >=
-	    sys_maxdist + loop_data.clock_phi * ULOGTOD(peer->hpoll))
+	    sys_maxdist + loop_data.clock_phi * ULOGTOD(peer->hpoll) &&
+	    !(faststart_quorum && filter_samples(peer) >= FASTSTART_SAMPLES))
 		rval |= BOGON11;		/* Initialization */
 
 	/*
@@ -2727,6 +3396,7 @@ init_proto(const bool verbose)
 	clkstate.sys_jitter = 0;
 	UNUSED_ARG(verbose);
 	sys_vars.sys_precision = -30; /* ns */  // FIXME FUZZ
+	publish_reply_template();
 	get_systime(&dummy);
 	sys_survivors = 0;
 	sys_stattime = current_time;
@@ -2828,6 +3498,10 @@ proto_config(
 		sys_minsane = (int)dvalue;
 		break;
 
+	case PROTO_FASTSTART:	/* fast start (faststart) */
+		sys_faststart = (bool)(int)dvalue;
+		break;
+
 	case PROTO_ORPHAN:	/* orphan stratum (orphan) */
 		sys_orphan = (int)dvalue;
 		break;
@@ -2876,7 +3550,7 @@ void maybe_log_junk(const char *tag, struct recvbuf *rbufp) {
       junk_last = rbufp->recv_time;
     } else {
       l_fp interval_fp = rbufp->recv_time - junk_last;
-      float since_last = ldexpf(interval_fp, -32)/3600.0;
+      float since_last = (float)interval_fp / (float)FRAC / 3600.0;
       junk_last = rbufp->recv_time;
       junk_score *= expf(-since_last/junk_decay);
       if (junk_limit < junk_score)
@@ -1,6 +1,8 @@
 #include "config.h"
 
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "ntp_assert.h"
 #include "ntp_syslog.h"
@@ -11,13 +13,25 @@
 
 /*
  * Memory allocation.
+ *
+ * Only the main thread takes and returns buffers, so plain lists do.
+ * The pool starts at RECV_INIT and grows RECV_INC at a time when it
+ * runs dry, up to RECV_TOOMANY.  NTS request state lives in a pool of
+ * its own, so the common packet doesn't drag it around.
  */
+typedef struct ntsbuf ntsbuf_t;
+struct ntsbuf {
+	ntsbuf_t *		link;
+	struct ntspacket_t	ntspacket;
+};
+
 static unsigned long free_recvbufs;	/* recvbufs on free_recv_list */
 static unsigned long total_recvbufs;	/* total recvbufs currently in use */
 static unsigned long lowater_adds;	/* # of times we have added memory */
 static unsigned long buffer_shortfall;	/* # of missed free receive buffers
 					   between replenishments */
 static recvbuf_t *		   free_recv_list;
+static ntsbuf_t *		   free_nts_list;
 
 #ifdef DEBUG
 static void uninit_recvbuff(void);
@@ -42,10 +56,14 @@ lowater_additions(void)
 	return lowater_adds;
 }
 
+/*
+ * Only the header is cleared.  recv_buffer is 4K and change, and is
+ * only ever read up to recv_length.
+ */
 static inline void
 initialise_buffer(recvbuf_t *buff)
 {
-	ZERO(*buff);
+	memset(buff, 0, offsetof(recvbuf_t, recv_buffer));
 }
 
 static void
@@ -56,9 +74,14 @@ create_buffers(unsigned int nbufs)
 
 	abuf = nbufs + buffer_shortfall;
 	buffer_shortfall = 0;
+	if (total_recvbufs + abuf > RECV_TOOMANY)
+		abuf = (total_recvbufs < RECV_TOOMANY)
+		    ? RECV_TOOMANY - total_recvbufs : 0;
+	if (0 == abuf)
+		return;
 
 #ifndef DEBUG
-	bufp = emalloc_zero(abuf * sizeof(*bufp));
+	bufp = emalloc_zero_tag(MEM_RECVBUF, abuf * sizeof(*bufp));
 #endif
 
 	for (i = 0; i < abuf; i++) {
@@ -68,7 +91,7 @@ create_buffers(unsigned int nbufs)
 		 * free()d during ntpd shutdown on DEBUG builds to
 		 * keep them out of heap leak reports.
 		 */
-		bufp = emalloc_zero(sizeof(*bufp));
+		bufp = emalloc_zero_tag(MEM_RECVBUF, sizeof(*bufp));
 #endif
 		LINK_SLIST(free_recv_list, bufp, link);
 		bufp++;
@@ -79,6 +102,26 @@ create_buffers(unsigned int nbufs)
 	/* coverity[leaked_storage] */
 }
 
+static void
+create_ntsbufs(void)
+{
+	ntsbuf_t *bufp;
+	unsigned int i;
+
+#ifndef DEBUG
+	bufp = emalloc_zero_tag(MEM_NTS, RECV_NTS_INC * sizeof(*bufp));
+#endif
+
+	for (i = 0; i < RECV_NTS_INC; i++) {
+#ifdef DEBUG
+		bufp = emalloc_zero_tag(MEM_NTS, sizeof(*bufp));
+#endif
+		LINK_SLIST(free_nts_list, bufp, link);
+		bufp++;
+	}
+	/* coverity[leaked_storage] */
+}
+
 void
 init_recvbuff(unsigned int nbufs)
 {
@@ -101,12 +144,19 @@ static void
 uninit_recvbuff(void)
 {
 	recvbuf_t *rbunlinked;
+	ntsbuf_t *nbunlinked;
 
 	for (;;) {
 		UNLINK_HEAD_SLIST(rbunlinked, free_recv_list, link);
 		if (rbunlinked == NULL)
 			break;
-		free(rbunlinked);
+		free_tag(MEM_RECVBUF, rbunlinked, sizeof(*rbunlinked));
+	}
+	for (;;) {
+		UNLINK_HEAD_SLIST(nbunlinked, free_nts_list, link);
+		if (nbunlinked == NULL)
+			break;
+		free_tag(MEM_NTS, nbunlinked, sizeof(*nbunlinked));
 	}
 }
 #endif	/* DEBUG */
@@ -117,6 +167,8 @@ get_free_recv_buffer(void)
 {
         recvbuf_t *buffer;
 
+        if (NULL == free_recv_list)
+                create_buffers(RECV_INC);
         UNLINK_HEAD_SLIST(buffer, free_recv_list, link);
         if (buffer != NULL) {
                 free_recvbufs--;
@@ -128,17 +180,40 @@ get_free_recv_buffer(void)
         return buffer;
 }
 
+struct ntspacket_t *
+get_recv_ntspacket(recvbuf_t *rb)
+{
+	ntsbuf_t *nb;
+
+	if (NULL != rb->ntspacket)
+		return rb->ntspacket;
+	if (NULL == free_nts_list)
+		create_ntsbufs();
+	UNLINK_HEAD_SLIST(nb, free_nts_list, link);
+	ZERO(nb->ntspacket);
+	rb->ntspacket = &nb->ntspacket;
+	return rb->ntspacket;
+}
+
 /*
  * freerecvbuf - make a single recvbuf available for reuse
  */
 void
 freerecvbuf(recvbuf_t *rb)
 {
+	ntsbuf_t *nb;
+
 	if (rb == NULL) {
 		msyslog(LOG_ERR, "ERR: freerecvbuff received NULL buffer");
 		return;
 	}
 
+	if (NULL != rb->ntspacket) {
+		nb = (ntsbuf_t *)((char *)rb->ntspacket -
+				  offsetof(ntsbuf_t, ntspacket));
+		LINK_SLIST(free_nts_list, nb, link);
+		rb->ntspacket = NULL;
+	}
 	LINK_SLIST(free_recv_list, rb, link);
 	free_recvbufs++;
 }
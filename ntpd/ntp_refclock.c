@@ -21,16 +21,28 @@
 
 #ifdef REFCLOCK
 
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
+
 #ifdef HAVE_PPSAPI
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include "ppsapi_timepps.h"
 #include "refclock_pps.h"
 #endif /* HAVE_PPSAPI */
 
 
-#define SAMPLE(x)	pp->coderecv = (pp->coderecv + 1) % MAXSTAGE; \
+#define SAMPLE(x, e)	pp->coderecv = (pp->coderecv + 1) % (pp->nstage + 1); \
 			pp->filter[pp->coderecv] = (x); \
+			pp->stamps[pp->coderecv].rec = pp->lastrec; \
+			pp->stamps[pp->coderecv].err = (e); \
 			if (pp->coderecv == pp->codeproc) \
-				pp->codeproc = (pp->codeproc + 1) % MAXSTAGE;
+				pp->codeproc = (pp->codeproc + 1) % \
+				    (pp->nstage + 1);
 
 #define TTY	struct termios
 
@@ -65,12 +77,13 @@
 /* #define LF		0x0a	* ASCII LF UNUSED */
 
 bool	cal_enable;		/* enable refclock calibrate */
+static bool	driver_ready[UINT8_MAX + 1];	/* clock_init done */
 
 /*
  * Forward declarations
  */
-static int refclock_cmpl_fp (const void *, const void *);
-static int refclock_sample (struct refclockproc *);
+static void refclock_sort (double *, size_t);
+static int refclock_sample (struct refclockproc *, bool);
 static bool refclock_setup (int, unsigned int, unsigned int);
 
 
@@ -139,22 +152,6 @@ refclock_name(
 }
 
 
-/*
- * init_refclock - initialize the reference clock drivers
- *
- * This routine calls each of the drivers in turn to initialize internal
- * variables, if necessary. Most drivers have nothing to say at this
- * point.
- */
-void
-init_refclock(void) {
-	for (int i = 0; i < (int)num_refclock_conf; i++)
-	    if (refclock_conf[i]->clock_init) {
-			(refclock_conf[i]->clock_init)();
-	    }
-}
-
-
 /*
  * refclock_newpeer - initialize and start a reference clock
  *
@@ -175,6 +172,9 @@ refclock_newpeer(
 {
 	struct refclockproc *pp;
 
+#ifdef REFCLOCK_MODULES
+	refclock_load(clktype);
+#endif
 	if (clktype >= num_refclock_conf ||
 	    !refclock_conf[clktype]->clock_start) {
 		msyslog(LOG_ERR,
@@ -183,11 +183,27 @@ refclock_newpeer(
 		return false;
 	}
 
+	/*
+	 * A driver's clock_init runs when its first clock is
+	 * configured, so drivers nobody uses cost nothing.
+	 */
+	if (!driver_ready[clktype]) {
+		driver_ready[clktype] = true;
+		if (refclock_conf[clktype]->clock_init)
+			(refclock_conf[clktype]->clock_init)();
+	}
+
 	/*
 	 * Allocate and initialize interface structure
 	 */
 	pp = emalloc_zero(sizeof(*pp));
 	peer->procptr = pp;
+	pp->nstage = peer->cfg.stages ? (int)peer->cfg.stages : FILTER_STAGES;
+	pp->filter = emalloc_zero(((size_t)pp->nstage * 2 + 1) *
+				  sizeof(*pp->filter));
+	pp->sorted = pp->filter + pp->nstage + 1;
+	pp->stamps = emalloc_zero(((size_t)pp->nstage + 1) *
+				  sizeof(*pp->stamps));
 
 	/*
 	 * Initialize structures
@@ -235,6 +251,11 @@ refclock_unpeer(
 	if (NULL == peer->procptr)
 		return;
 
+#ifdef HAVE_PPSAPI
+	/* before the driver closes the handle under it */
+	refclock_ppsthread_stop(peer->procptr);
+#endif /* HAVE_PPSAPI */
+
 	/* There's a standard shutdown sequence if user didn't declare one */
 	if (peer->procptr->conf->clock_shutdown)
 		(peer->procptr->conf->clock_shutdown)(peer->procptr);
@@ -244,6 +265,9 @@ refclock_unpeer(
 		if (-1 != peer->procptr->io.fd)
 			io_closeclock(&peer->procptr->io);
 	}
+	free(peer->procptr->io.rb);
+	free(peer->procptr->filter);
+	free(peer->procptr->stamps);
 	free(peer->procptr);
 	peer->procptr = NULL;
 }
@@ -269,6 +293,25 @@ refclock_timer(
 }
 
 
+/*
+ * refclock_fast - take a reading now for the fast loop, if the driver
+ * can.  The offset has time1 in it, as a sample would.
+ */
+bool
+refclock_fast(
+	struct peer *	p,
+	double *	offset
+	)
+{
+	struct refclockproc *	pp = p->procptr;
+
+	if (!(FLAG_REFCLOCK & p->cfg.flags) || NULL == pp ||
+	    NULL == pp->conf->clock_fast)
+		return false;
+	return (*pp->conf->clock_fast)(pp->refclkunit, p, offset);
+}
+
+
 /*
  * refclock_transmit - simulate the transmit procedure
  *
@@ -310,7 +353,7 @@ refclock_transmit(
 		if (!peer->reach) {
 			if (oreach) {
 				report_event(PEVNT_UNREACH, peer, NULL);
-				peer->timereachable = current_time;
+				peer->cold->timereachable = current_time;
 			}
 		} else {
 			if (peer->cfg.flags & FLAG_BURST)
@@ -326,24 +369,54 @@ refclock_transmit(
 
 
 /*
- * Compare two doubles - used with qsort()
+ * refclock_sort - sort offsets into ascending order.  Insertion sort
+ * for the usual handful of samples, heapsort for the long filters some
+ * PPS setups use; neither calls through a comparison function the way
+ * qsort() does, and heapsort needs no stack beyond its own frame.
  */
-static int
-refclock_cmpl_fp(
-	const void *p1,
-	const void *p2
+static void
+refclock_sort(
+	double *off,
+	size_t	n
 	)
 {
-	const double *dp1 = (const double *)p1;
-	const double *dp2 = (const double *)p2;
+	size_t	i, j, c;
+	double	x;
+
+	if (n <= 16) {
+		for (i = 1; i < n; i++) {
+			x = off[i];
+			for (j = i; j > 0 && x < off[j - 1]; j--)
+				off[j] = off[j - 1];
+			off[j] = x;
+		}
+		return;
+	}
 
-	if (*dp1 < *dp2) {
-		return COMPARE_LESSTHAN;
+	/* heapify, largest on top, then pull the top off n - 1 times */
+	for (i = n / 2; i-- > 0; ) {
+		x = off[i];
+		for (j = i; (c = 2 * j + 1) < n; j = c) {
+			if (c + 1 < n && off[c] < off[c + 1])
+				c++;
+			if (!(x < off[c]))
+				break;
+			off[j] = off[c];
+		}
+		off[j] = x;
 	}
-	if (*dp1 > *dp2) {
-		return COMPARE_GREATERTHAN;
+	while (--n > 0) {
+		x = off[n];
+		off[n] = off[0];
+		for (j = 0; (c = 2 * j + 1) < n; j = c) {
+			if (c + 1 < n && off[c] < off[c + 1])
+				c++;
+			if (!(x < off[c]))
+				break;
+			off[j] = off[c];
+		}
+		off[j] = x;
 	}
-	return COMPARE_EQUAL;
 }
 
 
@@ -369,7 +442,33 @@ refclock_process_offset(
 	lftemp = lasttim;
 	lftemp -= lastrec;
 	doffset = lfptod(lftemp);
-	SAMPLE(doffset + fudge);
+	SAMPLE(doffset + fudge, 0.);
+}
+
+
+/*
+ * refclock_process_batch - add a batch of samples to the median filter
+ *
+ * For drivers that collect many samples between calls, each with its
+ * own receive time and, if they know it, its error.  The fit option
+ * uses both; the median filter only the offsets.
+ */
+void
+refclock_process_batch(
+	struct refclockproc *pp,	/* refclock structure pointer */
+	const struct refclock_stamp *batch, /* oldest first */
+	size_t n,
+	double fudge
+	)
+{
+	l_fp lftemp;
+
+	for (size_t i = 0; i < n; i++) {
+		pp->lastrec = batch[i].rec;
+		lftemp = batch[i].ref;
+		lftemp -= batch[i].rec;
+		SAMPLE(lfptod(lftemp) + fudge, batch[i].err);
+	}
 }
 
 
@@ -429,6 +528,94 @@ refclock_process(
 }
 
 
+/*
+ * refclock_fit - weighted least-squares fit of the samples
+ *
+ * With the fit option, the n samples since the last poll are fitted to
+ * offset + freq * t, t being a sample's receive time less the newest
+ * one's, each weighted by its inverse squared error.  Samples without
+ * an error estimate get the mean estimate of the others, or all weigh
+ * the same if none has one.  Samples more than three standard
+ * deviations off the first fit are dropped and the rest fitted again.
+ * The offset is the fit at the newest sample, the jitter the weighted
+ * RMS of the residuals.
+ */
+static void
+refclock_fit(
+	struct refclockproc *pp,	/* refclock structure pointer */
+	size_t	n			/* samples in the ring, >= 3 */
+	)
+{
+	double	*t = pp->sorted;
+	const int ring = pp->nstage + 1;
+	const int first = (pp->codeproc + 1) % ring;
+	double	esum = 0, wdef, w, r, det, wbar = 0;
+	double	sw, swt, swy, swtt, swty;
+	double	a = 0, b = 0, s2 = 0;
+	size_t	k, nerr = 0, kept;
+	int	idx, pass;
+	l_fp	dt;
+
+	for (k = 0, idx = first; k < n; k++, idx = (idx + 1) % ring) {
+		dt = pp->stamps[idx].rec;
+		dt -= pp->stamps[pp->coderecv].rec;
+		t[k] = lfptod(dt);
+		if (pp->stamps[idx].err > 0) {
+			esum += pp->stamps[idx].err;
+			nerr++;
+		}
+	}
+	wdef = nerr ? 1. / SQUARE(esum / nerr) : 1.;
+
+	for (pass = 0; pass < 2; pass++) {
+		double	pa = a, pb = b, lim = 9. * s2 * wbar;
+
+		sw = swt = swy = swtt = swty = 0;
+		kept = 0;
+		for (k = 0, idx = first; k < n; k++, idx = (idx + 1) % ring) {
+			w = pp->stamps[idx].err > 0 ?
+			    1. / SQUARE(pp->stamps[idx].err) : wdef;
+			r = pp->filter[idx] - pa - pb * t[k];
+			if (pass > 0 && w * SQUARE(r) > lim)
+				continue;
+			sw += w;
+			swt += w * t[k];
+			swy += w * pp->filter[idx];
+			swtt += w * SQUARE(t[k]);
+			swty += w * t[k] * pp->filter[idx];
+			kept++;
+		}
+		if (kept < 3)
+			break;		/* keep the first fit */
+		det = sw * swtt - SQUARE(swt);
+		if (det > 0) {
+			a = (swtt * swy - swt * swty) / det;
+			b = (sw * swty - swt * swy) / det;
+		} else {
+			a = swy / sw;	/* all at one time */
+			b = 0;
+		}
+
+		s2 = 0;
+		for (k = 0, idx = first; k < n; k++, idx = (idx + 1) % ring) {
+			w = pp->stamps[idx].err > 0 ?
+			    1. / SQUARE(pp->stamps[idx].err) : wdef;
+			r = pp->filter[idx] - pa - pb * t[k];
+			if (pass > 0 && w * SQUARE(r) > lim)
+				continue;
+			s2 += w * SQUARE(pp->filter[idx] - a - b * t[k]);
+		}
+		s2 /= sw;
+		wbar = sw / (double)kept;
+	}
+
+	pp->offset = a;
+	pp->freq = b;
+	pp->jitter = SQRT(s2);
+	pp->codeproc = pp->coderecv;
+}
+
+
 /*
  * refclock_sample - process a pile of samples from the clock
  *
@@ -441,28 +628,40 @@ refclock_process(
  */
 static int
 refclock_sample(
-	struct refclockproc *pp		/* refclock structure pointer */
+	struct refclockproc *pp,	/* refclock structure pointer */
+	bool	fit			/* least squares, not median */
 	)
 {
 	size_t	i, j, k, m, n;
-	double	off[MAXSTAGE];
+	double	*off = pp->sorted;
 	double	offset;
 
+	/*
+	 * With the fit option and enough samples, fit a line instead.
+	 */
+	n = (size_t)((pp->coderecv - pp->codeproc + pp->nstage + 1) %
+		     (pp->nstage + 1));
+	if (fit && n >= 3) {
+		refclock_fit(pp, n);
+		DPRINT(1, ("refclock_sample: n %d fit offset %.6f freq %.3e jitter %.6f\n",
+			   (int)n, pp->offset, pp->freq, pp->jitter));
+		return (int)n;
+	}
+
 	/*
 	 * Copy the raw offsets and sort into ascending order. Don't do
 	 * anything if the buffer is empty.
 	 */
 	n = 0;
 	while (pp->codeproc != pp->coderecv) {
-		pp->codeproc = (pp->codeproc + 1) % MAXSTAGE;
+		pp->codeproc = (pp->codeproc + 1) % (pp->nstage + 1);
 		off[n] = pp->filter[pp->codeproc];
 		n++;
 	}
 	if (n == 0)
 		return (0);
 
-	if (n > 1)
-		qsort(off, n, sizeof(off[0]), refclock_cmpl_fp);
+	refclock_sort(off, n);
 
 	/*
 	 * Reject the furthest from the median of the samples until
@@ -533,16 +732,18 @@ refclock_receive(
 	peer->timereceived = current_time;
 	if (!peer->reach) {
 		report_event(PEVNT_REACH, peer, NULL);
-		peer->timereachable = current_time;
+		peer->cold->timereachable = current_time;
 	}
 	peer->reach |= 1;
 	peer->reftime = pp->lastref;
 	peer->org_ts = pp->lastrec;
 	peer->rootdisp = pp->disp;
 	get_systime(&peer->dst);
-	if (!refclock_sample(pp))
+	if (!refclock_sample(pp, (peer->cfg.flags & FLAG_FIT) != 0))
 		return;
 
+	keep_sample(peer, 0, 0, pp->lastref, pp->lastrec, pp->offset, 0.,
+		    pp->jitter);
 	clock_filter(peer, pp->offset, 0., pp->jitter);
 	if (cal_enable && fabs(clkstate.last_offset) < sys_mindist &&
 		sys_vars.sys_peer != NULL) {
@@ -669,12 +870,9 @@ indicate_refclock_packet(
 		 * data was consumed - nothing to pass up
 		 * into block input machine
 		 */
-		freerecvbuf(rb);
-
 		return true;
 	}
 	(rio->clock_recv)(rb);
-	freerecvbuf(rb);
 
 	return false;
 }
@@ -936,6 +1134,187 @@ refclock_control(
 }
 
 
+/*
+ * NTP SHM segments, shared by the SHM driver and the GPSD driver's
+ * SHM mode.
+ */
+static inline void shm_barrier(void) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
+}
+
+
+/*
+ * refclock_shm_attach - attach the "NTP0" + unit segment, making it if
+ * need be
+ */
+struct shmTime *
+refclock_shm_attach(
+	int unit,
+	bool forall
+	)
+{
+	struct shmTime *p = NULL;
+
+	int shmid;
+
+	/* 0x4e545030 is NTP0.
+	 * Big units will give non-ascii but that's OK
+	 * as long as everybody does it the same way.
+	 */
+	shmid=shmget(0x4e545030 + unit, sizeof (struct shmTime),
+		      IPC_CREAT | (forall ? 0666 : 0600));
+	if (shmid == -1) { /* error */
+		msyslog(LOG_ERR, "REFCLOCK: SHM shmget (unit %d): %s", unit, strerror(errno));
+		return NULL;
+	}
+	p = (struct shmTime *)shmat (shmid, 0, 0);
+	if (p == (struct shmTime *)-1) { /* error */
+		msyslog(LOG_ERR, "REFCLOCK: SHM shmat (unit %d): %s", unit, strerror(errno));
+		return NULL;
+	}
+
+	return p;
+}
+
+
+/*
+ * refclock_shm_query - try to grab a sample from an SHM segment
+ */
+enum segstat_t
+refclock_shm_query(
+	volatile struct shmTime *shm_in,
+	struct shm_stat_t *shm_stat
+	)
+{
+	volatile struct shmTime shmcopy, *shm = shm_in;
+	volatile int cnt;
+
+	unsigned int cns_new, rns_new;
+
+	/*
+	 * This is the main routine. It snatches the time from the shm
+	 * board and tacks on a local timestamp.
+	 */
+	if (shm == NULL) {
+		shm_stat->status = SHM_NO_SEGMENT;
+		return SHM_NO_SEGMENT;
+	}
+
+	/*@-type@*//* splint is confused about struct timespec */
+	shm_stat->tvc.tv_sec = shm_stat->tvc.tv_nsec = 0;
+	{
+		time_t now;
+
+		time(&now);
+		shm_stat->tvc.tv_sec = now;
+	}
+
+	/* relying on word access to be atomic here */
+	if (shm->valid == 0) {
+		shm_stat->status = SHM_NOT_READY;
+		return SHM_NOT_READY;
+	}
+
+	cnt = shm->count;
+
+	/*
+	 * This is proof against concurrency issues if either
+	 * (a) the shm_barrier() call works on this host, or
+	 * (b) memset compiles to an uninterruptible single-instruction bitblt.
+	 */
+	shm_barrier();
+	/* structure copy, to preserve volatile */
+	shmcopy = *shm;
+	shm->valid = 0;
+	shm_barrier();
+
+	/*
+	 * Clash detection in case neither (a) nor (b) was true.
+	 * Not supported in mode 0, and word access to the count field
+	 * must be atomic for this to work.
+	 */
+	if (shmcopy.mode > 0 && cnt != shm->count) {
+		shm_stat->status = SHM_CLASH;
+		return (enum segstat_t)shm_stat->status;
+	}
+
+	shm_stat->status = SHM_OK;
+	shm_stat->mode = shmcopy.mode;
+
+	switch (shmcopy.mode) {
+	    case 0:
+		shm_stat->tvr.tv_sec	= shmcopy.receiveTimeStampSec;
+		shm_stat->tvr.tv_nsec	= shmcopy.receiveTimeStampUSec * 1000;
+		rns_new		= shmcopy.receiveTimeStampNSec;
+		shm_stat->tvt.tv_sec	= shmcopy.clockTimeStampSec;
+		shm_stat->tvt.tv_nsec	= shmcopy.clockTimeStampUSec * 1000;
+		cns_new		= shmcopy.clockTimeStampNSec;
+
+		/* Since the following comparisons are between unsigned
+		** variables they are always well defined, and any
+		** (signed) underflow will turn into very large unsigned
+		** values, well above the 1000 cutoff.
+		**
+		** Note: The usecs *must* be a *truncated*
+		** representation of the nsecs. This code will fail for
+		** *rounded* usecs, and the logic to deal with
+		** wrap-arounds in the presence of rounded values is
+		** much more convoluted.
+		*/
+		if (   ((cns_new - (unsigned)shm_stat->tvt.tv_nsec) < 1000)
+		       && ((rns_new - (unsigned)shm_stat->tvr.tv_nsec) < 1000)) {
+			shm_stat->tvt.tv_nsec = (long)cns_new;
+			shm_stat->tvr.tv_nsec = (long)rns_new;
+		}
+		/* At this point shm_stat->tvr and shm_stat->tvt contain valid ns-level
+		** timestamps, possibly generated by extending the old
+		** us-level timestamps
+		*/
+		break;
+
+	    case 1:
+
+		shm_stat->tvr.tv_sec	= shmcopy.receiveTimeStampSec;
+		shm_stat->tvr.tv_nsec	= shmcopy.receiveTimeStampUSec * 1000;
+		rns_new		= shmcopy.receiveTimeStampNSec;
+		shm_stat->tvt.tv_sec	= shmcopy.clockTimeStampSec;
+		shm_stat->tvt.tv_nsec	= shmcopy.clockTimeStampUSec * 1000;
+		cns_new		= shmcopy.clockTimeStampNSec;
+
+		/* See the case above for an explanation of the
+		** following test.
+		*/
+		if (   ((cns_new - (unsigned)shm_stat->tvt.tv_nsec) < 1000)
+		       && ((rns_new - (unsigned)shm_stat->tvr.tv_nsec) < 1000)) {
+			shm_stat->tvt.tv_nsec = (long)cns_new;
+			shm_stat->tvr.tv_nsec = (long)rns_new;
+		}
+		/* At this point shm_stat->tvr and shm_stat->tvt contains valid ns-level
+		** timestamps, possibly generated by extending the old
+		** us-level timestamps
+		*/
+		break;
+
+	    default:
+		shm_stat->status = SHM_BAD_MODE;
+		break;
+	}
+	/*@-type@*/
+
+	/*
+	 * leap field is not a leap offset but a leap notification code.
+	 * The values are magic numbers used by NTP and set by GPSD, if at all, in
+	 * the subframe code.
+	 */
+	shm_stat->leap = shmcopy.leap;
+	shm_stat->precision = shmcopy.precision;
+
+	return (enum segstat_t)shm_stat->status;
+}
+
+
 #ifdef HAVE_PPSAPI
 /*
  * refclock_ppsapi - initialize/update ppsapi
@@ -1011,12 +1390,243 @@ refclock_params(
 }
 
 
+/*
+ * PPS capture thread
+ *
+ * Polled from refclock_catcher() once a second, the kernel hands over
+ * only its latest edge; when the main loop is late, edges in between
+ * are gone.  With the ppsthread option a thread at SCHED_FIFO priority
+ * waits in time_pps_fetch() instead and queues every assert and clear
+ * edge as it happens.  refclock_catcher() takes them all off the queue.
+ * There is one writer and one reader, so the queue needs no lock.
+ */
+#define PPSCAP_SLOTS	64	/* power of 2, a minute of both edges */
+#define PPSCAP_WAIT	1	/* seconds in time_pps_fetch(), to notice stop */
+
+struct pps_edge {
+	struct timespec	ts;
+	unsigned long	sequence;
+	bool		clear;		/* else assert */
+};
+
+struct refclock_ppscap {
+	pps_handle_t		handle;
+	pthread_t		tid;
+	volatile bool		stopping;
+	volatile bool		dead;		/* thread gave up */
+	volatile unsigned int	head;		/* advanced by the main loop */
+	volatile unsigned int	tail;		/* advanced by the thread */
+	volatile unsigned long	missed;		/* sequence numbers skipped */
+	volatile unsigned long	dropped;	/* queue was full */
+	unsigned long		assert_seq;	/* last seen, thread only */
+	unsigned long		clear_seq;
+	struct pps_edge		ring[PPSCAP_SLOTS];
+};
+
+static inline void ppscap_barrier(void) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
+}
+
+static void
+ppscap_edge(
+	struct refclock_ppscap *cap,
+	const struct timespec *ts,
+	unsigned long	sequence,
+	bool		clear
+	)
+{
+	unsigned long *last = clear ? &cap->clear_seq : &cap->assert_seq;
+	struct pps_edge *ep;
+
+	if (sequence == *last)
+		return;		/* not this edge that woke us */
+	if (0 != *last && sequence - *last > 1)
+		cap->missed += sequence - *last - 1;
+	*last = sequence;
+	if (cap->tail - cap->head >= PPSCAP_SLOTS) {
+		cap->dropped++;
+		return;
+	}
+	ep = &cap->ring[cap->tail & (PPSCAP_SLOTS - 1)];
+	ep->ts = *ts;
+	ep->sequence = sequence;
+	ep->clear = clear;
+	ppscap_barrier();
+	cap->tail++;
+}
+
+static void *
+ppscap_main(
+	void *	arg
+	)
+{
+	struct refclock_ppscap *cap = arg;
+	struct sched_param sched;
+	struct timespec	timeout;
+	pps_info_t	info;
+	int		rc;
+
+	ZERO(sched);
+	sched.sched_priority = sched_get_priority_max(SCHED_FIFO);
+	rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
+	if (rc)
+		msyslog(LOG_WARNING,
+			"REFCLOCK: PPS capture thread: not SCHED_FIFO: %s",
+			strerror(rc));
+
+	while (!cap->stopping) {
+		timeout.tv_sec = PPSCAP_WAIT;
+		timeout.tv_nsec = 0;
+		ZERO(info);
+		if (time_pps_fetch(cap->handle, PPS_TSFMT_TSPEC, &info,
+		    &timeout) < 0) {
+			if (ETIMEDOUT == errno || EINTR == errno)
+				continue;
+			msyslog(LOG_ERR,
+				"REFCLOCK: PPS capture thread: time_pps_fetch: %s",
+				strerror(errno));
+			break;
+		}
+		ppscap_edge(cap, &info.assert_timestamp,
+			    info.assert_sequence, false);
+		ppscap_edge(cap, &info.clear_timestamp,
+			    info.clear_sequence, true);
+	}
+	cap->dead = true;
+	return NULL;
+}
+
+
+/*
+ * refclock_ppsthread_start - start capturing on a handle whose
+ * parameters are set.  Leaves pp->ppscap NULL if it can't.
+ */
+static void
+refclock_ppsthread_start(
+	struct peer *peer,		/* peer structure pointer */
+	struct refclock_ppsctl *ap	/* PPS context structure pointer */
+	)
+{
+	struct refclock_ppscap *cap;
+	char		tag[100];
+
+#ifdef PPS_CANWAIT
+	int		caps;
+
+	if (time_pps_getcap(ap->handle, &caps) < 0 ||
+	    !(caps & PPS_CANWAIT)) {
+		msyslog(LOG_ERR,
+			"REFCLOCK: %s: PPS device cannot wait for an edge, no ppsthread",
+			refclock_name(peer));
+		return;
+	}
+#endif /* PPS_CANWAIT */
+
+	cap = emalloc_zero(sizeof(*cap));
+	cap->handle = ap->handle;
+
+	snprintf(tag, sizeof(tag), "REFCLOCK: %s: PPS capture thread",
+		 refclock_name(peer));
+	if (ntp_thread_create(&cap->tid, ppscap_main, cap, tag)) {
+		free(cap);
+		return;
+	}
+	peer->procptr->ppscap = cap;
+	msyslog(LOG_INFO, "REFCLOCK: %s: PPS capture thread started",
+		refclock_name(peer));
+}
+
+
+/*
+ * refclock_ppsthread_stop - stop the capture thread, if there is one
+ */
+void
+refclock_ppsthread_stop(
+	struct refclockproc *pp	/* refclock structure pointer */
+	)
+{
+	struct refclock_ppscap *cap = pp->ppscap;
+
+	if (NULL == cap)
+		return;
+	cap->stopping = true;
+	pthread_join(cap->tid, NULL);
+	free(cap);
+	pp->ppscap = NULL;
+}
+
+
+/*
+ * pps_sample - convert a PPS timestamp to a signed fraction offset and
+ * stuff it in the median filter.
+ */
+static void
+pps_sample(
+	struct refclockproc *pp,	/* refclock structure pointer */
+	const struct timespec *ts	/* PPS edge */
+	)
+{
+	double	dtemp;
+
+	setlfpuint(pp->lastrec, (uint32_t)ts->tv_sec + JAN_1970);
+	dtemp = ts->tv_nsec * S_PER_NS;
+	setlfpfrac(pp->lastrec, (uint32_t)(dtemp * FRAC));
+	if (dtemp > .5) {
+		dtemp -= 1.;
+	}
+	SAMPLE(-dtemp + pp->fudgetime1, 0.);
+	DPRINT(2, ("refclock_pps: %u %f %f\n", current_time,
+		   dtemp, pp->fudgetime1));
+}
+
+
+/*
+ * refclock_ppsdrain - take every captured edge of the configured kind
+ */
+static pps_status
+refclock_ppsdrain(
+	struct refclockproc *pp,	/* refclock structure pointer */
+	struct refclock_ppsctl *ap	/* PPS context structure pointer */
+	)
+{
+	struct refclock_ppscap *cap = pp->ppscap;
+	const struct pps_edge *ep;
+	bool	clear;
+
+	if (ap->pps_params.mode & PPS_CAPTUREASSERT)
+		clear = false;
+	else if (ap->pps_params.mode & PPS_CAPTURECLEAR)
+		clear = true;
+	else
+		return PPS_NREADY;
+
+	while (cap->head != cap->tail) {
+		ppscap_barrier();
+		ep = &cap->ring[cap->head & (PPSCAP_SLOTS - 1)];
+		if (ep->clear == clear) {
+			ap->ts = ep->ts;
+			ap->sequence = ep->sequence;
+			pps_sample(pp, &ap->ts);
+			ap->samples++;
+		}
+		ppscap_barrier();
+		cap->head++;
+	}
+	ap->missed = cap->missed;
+	ap->dropped = cap->dropped;
+	return ap->samples ? PPS_OK : PPS_NREADY;
+}
+
+
 /*
  * refclock_catcher - called once per second
  *
  * This routine is called once per second. It snatches the PPS
- * timestamp from the kernel and saves the sign-extended fraction in
- * a circular buffer for processing at the next poll event.
+ * timestamp from the kernel, or every one the capture thread queued
+ * since the last call, and saves the sign-extended fraction in a
+ * circular buffer for processing at the next poll event.
  */
 pps_status
 refclock_catcher(
@@ -1028,7 +1638,6 @@ refclock_catcher(
 	struct refclockproc *pp;
 	pps_info_t pps_info;
 	struct timespec timeout;
-	double	dtemp;
 
 	UNUSED_ARG(mode);
 
@@ -1038,12 +1647,21 @@ refclock_catcher(
 	 * most recent PPS timestamp.
 	 */
 	pp = peer->procptr;
+	ap->samples = 0;
 	if (ap->handle == 0)
 		return PPS_SETUP;
 
 	if (ap->pps_params.mode == 0 && sys_vars.sys_leap != LEAP_NOTINSYNC) {
 		if (!refclock_params(pp->sloppyclockflag, ap))
 			return PPS_SETUP;
+		if (peer->cfg.flags & FLAG_PPSTHREAD)
+			refclock_ppsthread_start(peer, ap);
+	}
+	if (NULL != pp->ppscap) {
+		if (!pp->ppscap->dead || pp->ppscap->head != pp->ppscap->tail)
+			return refclock_ppsdrain(pp, ap);
+		/* the thread gave up, poll as before */
+		refclock_ppsthread_stop(pp);
 	}
 	timeout.tv_sec = 0;
 	timeout.tv_nsec = 0;
@@ -1072,18 +1690,8 @@ refclock_catcher(
 		return PPS_NREADY;
 	}
 
-	/*
-	 * Convert to signed fraction offset and stuff in median filter.
-	 */
-	setlfpuint(pp->lastrec, (uint32_t)ap->ts.tv_sec + JAN_1970);
-	dtemp = ap->ts.tv_nsec * S_PER_NS;
-	setlfpfrac(pp->lastrec, (uint32_t)(dtemp * FRAC));
-	if (dtemp > .5) {
-		dtemp -= 1.;
-	}
-	SAMPLE(-dtemp + pp->fudgetime1);
-	DPRINT(2, ("refclock_pps: %u %f %f\n", current_time,
-		   dtemp, pp->fudgetime1));
+	pps_sample(pp, &ap->ts);
+	ap->samples = 1;
 	return PPS_OK;
 }
 #endif /* HAVE_PPSAPI */
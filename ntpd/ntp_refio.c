@@ -0,0 +1,465 @@
+/*
+ * ntp_refio.c - optional refclock input thread
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * The main loop reads a serial refclock between network packets, and
+ * stamps each read when it gets round to it, so a burst of client
+ * requests moves the time a timecode is stamped with.  A clock given
+ * the iothread option is read by a thread instead, which waits in
+ * poll() on every such clock and stamps and reads its input the moment
+ * it arrives.  The main thread then hands each read to the driver just
+ * as read_refclock_packet() would, stamp and all.
+ *
+ * The drivers still decode on the main thread.  What they decode into
+ * is shared with refclock_transmit(), refclock_receive() and the
+ * drivers' timers, all of which run under proto_lock, so moving it
+ * would mean locking every driver; it is the stamp that can't wait.
+ *
+ * Reads go into a ring of receive buffers shared with the main thread.
+ * The thread is the only producer and the main thread the only
+ * consumer, so the ring takes no locks.  The thread writes to a pipe
+ * the main loop watches only when the main thread has said it is about
+ * to sleep.  A full ring leaves input in the kernel until the main
+ * thread has made room and says so through a second pipe, which also
+ * tells the thread when clocks come and go.
+ *
+ * The thread reads through its own duplicates of the clocks'
+ * descriptors, as the busy poller does.  io_closeclock() clears the
+ * record's clock; the thread then closes its descriptor, and
+ * refio_timer() frees the record once nothing in the ring refers to it.
+ */
+
+#include "config.h"
+
+#ifdef REFCLOCK
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
+
+#include "ntpd.h"
+#include "ntp_io.h"
+#include "ntp_lists.h"
+#include "ntp_refclock.h"
+#include "ntp_stdlib.h"
+#include "recvbuff.h"
+
+#define REFIO_SLOTS	256		/* power of 2 */
+
+typedef struct refio_clock refio_clock;
+struct refio_clock {
+	refio_clock *	link;
+	struct refclockio *rio;	/* NULL once the clock is closed */
+	SOCKET		fd;	/* the thread's dup() of rio->fd */
+	size_t		readlen;	/* bytes per read, from rio->datalen */
+	bool		failed;	/* thread only: read error or EOF */
+	volatile bool	closed;	/* fd closed by the thread */
+};
+
+struct refio_slot {
+	recvbuf_t	rb;
+	refio_clock *	rc;
+	int		error;	/* errno when rb.recv_length is 0, else EOF */
+};
+
+static struct refio_slot *	refio_ring;
+static volatile unsigned int	refio_head;	/* advanced by the main thread */
+static volatile unsigned int	refio_tail;	/* advanced by the thread */
+static volatile bool		refio_armed;	/* main thread wants a poke */
+static volatile bool		refio_full;	/* thread waits for room */
+static volatile unsigned int	refio_gen;	/* bumped when clocks change */
+static refio_clock *		refio_clocks;
+static int			refio_pipe[2] = { -1, -1 };	/* to main */
+static int			refio_ctl[2] = { -1, -1 };	/* to thread */
+static bool			refio_running;
+static bool			refio_broken;	/* couldn't start, don't retry */
+static pthread_t		refio_tid;
+
+static inline void refio_barrier(void) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
+}
+
+static bool	refio_start	(void);
+static void *	refio_main	(void *);
+static void	refio_input	(SOCKET);
+static void	refio_drain	(void);
+
+
+/* wake the thread to look at its clocks or the ring again */
+static void
+refio_poke(void)
+{
+	IGNORE(write(refio_ctl[1], "", 1));
+}
+
+
+/*
+ * refio_add - have the thread read a clock.  Returns false, leaving the
+ * clock to the main loop, if the thread can't be had.  Main thread,
+ * proto_lock held.
+ */
+bool
+refio_add(
+	struct refclockio *rio
+	)
+{
+	refio_clock *	rc;
+	SOCKET		fd;
+
+	if (!refio_running && !refio_start())
+		return false;
+
+	fd = dup(rio->fd);
+	if (fd < 0) {
+		msyslog(LOG_ERR, "IO: %s: iothread: dup: %s",
+			refclock_name(rio->srcclock), strerror(errno));
+		return false;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	rc = emalloc_zero(sizeof(*rc));
+	rc->rio = rio;
+	rc->fd = fd;
+	LINK_SLIST(refio_clocks, rc, link);
+	refio_gen++;
+	refio_poke();
+	return true;
+}
+
+
+/*
+ * refio_remove - stop reading a clock that is being closed.  Main
+ * thread, proto_lock held.
+ */
+void
+refio_remove(
+	struct refclockio *rio
+	)
+{
+	for (refio_clock *rc = refio_clocks; rc != NULL; rc = rc->link)
+		if (rc->rio == rio) {
+			rc->rio = NULL;
+			refio_gen++;
+			refio_poke();
+		}
+}
+
+
+/*
+ * refio_timer - free the records of clocks the thread has let go of.
+ * Called by the main thread, which holds proto_lock.
+ */
+void
+refio_timer(void)
+{
+	refio_clock *	rc;
+	refio_clock *	unlinked;
+	bool		drained = false;
+
+	rc = refio_clocks;
+	while (rc != NULL) {
+		unlinked = rc;
+		rc = rc->link;
+		if (!unlinked->closed)
+			continue;
+		if (!drained) {
+			/* what the ring holds for it was queued first */
+			refio_drain();
+			drained = true;
+		}
+		UNLINK_SLIST(unlinked, refio_clocks, unlinked, link,
+			     refio_clock);
+		free(unlinked);
+	}
+}
+
+
+/*
+ * refio_start - launch the thread, the first time a clock wants it
+ */
+static bool
+refio_start(void)
+{
+
+	if (refio_broken)
+		return false;
+	if (pipe(refio_pipe) < 0) {
+		msyslog(LOG_ERR, "IO: iothread: pipe: %s", strerror(errno));
+		goto fail;
+	}
+	if (pipe(refio_ctl) < 0) {
+		msyslog(LOG_ERR, "IO: iothread: pipe: %s", strerror(errno));
+		close(refio_pipe[0]);
+		close(refio_pipe[1]);
+		goto fail;
+	}
+	for (int i = 0; i < 2; i++) {
+		make_socket_nonblocking(refio_pipe[i]);
+		make_socket_nonblocking(refio_ctl[i]);
+		fcntl(refio_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(refio_ctl[i], F_SETFD, FD_CLOEXEC);
+	}
+	refio_ring = eallocarray_tag(MEM_RECVBUF, REFIO_SLOTS,
+				     sizeof(*refio_ring));
+	refio_armed = true;
+
+	if (ntp_thread_create(&refio_tid, refio_main, NULL, "IO: iothread")) {
+		free_tag(MEM_RECVBUF, refio_ring,
+			 REFIO_SLOTS * sizeof(*refio_ring));
+		refio_ring = NULL;
+		for (int i = 0; i < 2; i++) {
+			close(refio_pipe[i]);
+			close(refio_ctl[i]);
+		}
+		goto fail;
+	}
+	refio_running = true;
+	io_add_reader(refio_pipe[0], refio_input);
+	msyslog(LOG_INFO, "IO: refclock input thread started");
+	return true;
+
+    fail:
+	/* the main loop keeps reading the clocks */
+	refio_broken = true;
+	return false;
+}
+
+
+/*
+ * refio_read - stamp and read what one clock has, as much as the ring
+ * takes.  Returns true if anything was queued.
+ */
+static bool
+refio_read(
+	refio_clock *	rc
+	)
+{
+	struct refio_slot *slot;
+	ssize_t		len;
+	l_fp		ts;
+	bool		queued = false;
+
+	while (refio_tail - refio_head < REFIO_SLOTS) {
+		slot = &refio_ring[refio_tail & (REFIO_SLOTS - 1)];
+		get_systime(&ts);
+		do {
+			len = read(rc->fd, &slot->rb.recv_buffer,
+				   rc->readlen);
+		} while (len < 0 && EINTR == errno);
+		if (len < 0 && EAGAIN == errno)
+			return queued;
+		slot->rb.recv_length = (len > 0) ? (size_t)len : 0;
+		slot->rb.recv_time = ts;
+		slot->error = (len < 0) ? errno : 0;
+		slot->rc = rc;
+		refio_barrier();
+		refio_tail++;
+		queued = true;
+		if (len <= 0) {
+			/* as the main loop does, stop watching it */
+			rc->failed = true;
+			return queued;
+		}
+	}
+	refio_full = true;
+	return queued;
+}
+
+
+static void *
+refio_main(
+	void *	arg
+	)
+{
+	refio_clock **	clocks = NULL;
+	struct pollfd *	pfd = NULL;
+	refio_clock *	rc;
+	struct sched_param sched;
+	unsigned int	gen = 0;
+	int		nclocks = 0;
+	int		nalloc = 0;
+	int		nfds;
+	int		rv;
+	char		buf[64];
+	bool		queued;
+
+	UNUSED_ARG(arg);
+	ZERO(sched);
+	sched.sched_priority = sched_get_priority_max(SCHED_FIFO);
+	rv = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
+	if (rv)
+		msyslog(LOG_WARNING,
+			"IO: refclock input thread: not SCHED_FIFO: %s",
+			strerror(rv));
+
+	for (;;) {
+		if (NULL == clocks || gen != refio_gen) {
+			proto_lock();
+			nclocks = 0;
+			for (rc = refio_clocks; rc != NULL; rc = rc->link) {
+				if (NULL == rc->rio && !rc->closed) {
+					close(rc->fd);
+					rc->closed = true;
+				}
+				if (!rc->closed)
+					nclocks++;
+			}
+			if (nclocks >= nalloc) {
+				nalloc = nclocks + 1;
+				clocks = erealloc(clocks, (size_t)nalloc *
+						  sizeof(*clocks));
+				pfd = erealloc(pfd, (size_t)(nalloc + 1) *
+					       sizeof(*pfd));
+			}
+			nclocks = 0;
+			for (rc = refio_clocks; rc != NULL; rc = rc->link) {
+				if (rc->closed)
+					continue;
+				rc->readlen = (0 == rc->rio->datalen
+				    || rc->rio->datalen
+				       > sizeof(refio_ring->rb.recv_buffer))
+					? sizeof(refio_ring->rb.recv_buffer)
+					: rc->rio->datalen;
+				clocks[nclocks++] = rc;
+			}
+			gen = refio_gen;
+			proto_unlock();
+		}
+
+		if (refio_full) {
+			/* the main thread may have made room before it saw */
+			refio_barrier();
+			if (refio_tail - refio_head < REFIO_SLOTS)
+				refio_full = false;
+		}
+		pfd[0].fd = refio_ctl[0];
+		pfd[0].events = POLLIN;
+		for (int i = 0; i < nclocks; i++) {
+			/* poll() passes over a negative descriptor */
+			pfd[i + 1].fd = clocks[i]->failed ? -1 : clocks[i]->fd;
+			pfd[i + 1].events = POLLIN;
+			pfd[i + 1].revents = 0;
+		}
+		/* with the ring full only the main thread can wake us */
+		nfds = refio_full ? 1 : nclocks + 1;
+		rv = poll(pfd, (nfds_t)nfds, -1);
+		if (rv < 0) {
+			if (EINTR != errno) {
+				msyslog(LOG_ERR,
+					"IO: refclock input thread: poll: %s",
+					strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+		if (pfd[0].revents) {
+			while (read(refio_ctl[0], buf, sizeof(buf)) > 0)
+				continue;
+			if (refio_full)
+				continue;
+		}
+
+		queued = false;
+		for (int i = 1; i < nfds; i++)
+			if (pfd[i].revents && !clocks[i - 1]->failed &&
+			    refio_read(clocks[i - 1]))
+				queued = true;
+		if (queued) {
+			refio_barrier();
+			if (refio_armed) {
+				refio_armed = false;
+				IGNORE(write(refio_pipe[1], "", 1));
+			}
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * refio_deliver - hand one read to its driver, or report the error
+ * that ended the clock's input
+ */
+static void
+refio_deliver(
+	struct refio_slot *	slot
+	)
+{
+	struct refclockio *rio = slot->rc->rio;
+	recvbuf_t *	rb = &slot->rb;
+	const char *	clk;
+
+	if (0 == rb->recv_length) {
+		clk = refclock_name(rio->srcclock);
+		if (slot->error)
+			msyslog(LOG_ERR, "IO: %s read: %s", clk,
+				strerror(slot->error));
+		else
+			msyslog(LOG_ERR, "IO: %s read EOF", clk);
+		return;
+	}
+	io_refclock_input(rio, rb);
+}
+
+
+/*
+ * refio_drain - hand everything queued to the drivers.  Main thread,
+ * proto_lock held.
+ */
+static void
+refio_drain(void)
+{
+	struct refio_slot *slot;
+	bool		took = false;
+
+	while (refio_head != refio_tail) {
+		refio_barrier();
+		slot = &refio_ring[refio_head & (REFIO_SLOTS - 1)];
+		if (slot->rc->rio != NULL)
+			refio_deliver(slot);
+		refio_barrier();
+		refio_head++;
+		took = true;
+	}
+	refio_barrier();
+	if (took && refio_full)
+		refio_poke();
+}
+
+
+/*
+ * refio_input - the thread poked the pipe: take everything queued,
+ * then ask for a poke before the main loop sleeps again
+ */
+static void
+refio_input(
+	SOCKET	fd
+	)
+{
+	char	buf[64];
+	int	was = cpu_switch(CPU_REFCLOCK);
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		continue;
+	for (;;) {
+		refio_drain();
+		refio_armed = true;
+		refio_barrier();
+		if (refio_head == refio_tail)
+			break;
+		refio_armed = false;
+	}
+	cpu_switch(was);
+}
+#endif /* REFCLOCK */
@@ -4,13 +4,24 @@
 
 #include "config.h"
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
 
 #include "ntpd.h"
 #include "ntp_lists.h"
 #include "ntp_stdlib.h"
 #include "ntp_assert.h"
+#include "ntp_trace.h"
 
 /*
  * This code keeps a simple address-and-mask list of hosts we want
@@ -29,6 +40,51 @@
  * flags you found. Because of the ordering of the list, the most
  * specific match will provide the final set of flags.
  *
+ * Walking the list costs one comparison per entry on every packet,
+ * which hurts with thousands of prefixes.  So each list is also
+ * indexed by a path-compressed binary trie (a Patricia tree) keyed on
+ * prefix bits.  With contiguous masks, the first matching entry in
+ * the sorted list belongs to the longest matching prefix, so walking
+ * the trie from the root and keeping the deepest prefix that has an
+ * eligible entry gives the same answer as the list.  A list with a
+ * non-contiguous mask falls back to the linear scan.
+ *
+ * Packets are not matched against the lists themselves, which only
+ * the main thread touches, but against a snapshot: a copy of both
+ * sorted lists, their tries and the restrict set that is never
+ * changed once made.  After a change the main thread builds a new
+ * one, on its next lookup or before it sleeps, and publishes it with
+ * one atomic pointer store, so a responder thread matches without
+ * waiting for anybody.  The old snapshot is retired and freed once
+ * every thread that might still hold it has moved on.  Readers count
+ * themselves in and out under one of two epochs; the main thread
+ * flips the epoch and frees what was retired before the flip when
+ * the old epoch has no readers left.  Hit counts go to the live
+ * entries, which are recycled but never freed.
+ *
+ * Most packets come from sources the MRU list already knows, and they
+ * match the same entry every time.  So the MRU entry keeps the entry
+ * its source last matched, with the generation of the lists it was
+ * matched in; every change to the lists bumps the generation, and
+ * restrictions_cached() takes the remembered entry while it matches.
+ * A generation is a snapshot, so the entry remembered is in it.
+ *
+ * Feeds of abusive networks run to tens of thousands of prefixes, too
+ * many to load as restrict lines and too changeable to need a restart.
+ * "restrict set <file>" reads such a feed, one prefix per line, into
+ * sorted disjoint address ranges searched by bisection; a source in
+ * one gets the set's flags on top of those its list entry gives it.
+ * The file watcher reads the file again when it changes, on its own
+ * thread, and check_restrict_pending() swaps the new set in.
+ *
+ * Keeping the list sorted as entries come in costs a walk per entry,
+ * as does looking for an existing entry to add flags to, so a config
+ * with thousands of restrict lines took seconds to load.  Instead,
+ * exact matches are found through a hash of address, mask and mflags,
+ * new entries go on the front of the list, and the list is merge
+ * sorted the next time someone walks it.  Anyone outside this file
+ * walking the lists calls sort_restrict() first.
+ *
  * This was originally intended to restrict you from sync'ing to your
  * own broadcasts when you are doing that, by restricting yourself from
  * your own interfaces. It was also thought it would sometimes be useful
@@ -50,6 +106,45 @@
 		}							\
 	} while (0)
 
+/*
+ * A trie node covers the first plen bits of key (network order, IPv4
+ * in the first four bytes).  res is the first list entry with exactly
+ * that prefix, or NULL for a node that only joins two subtrees.
+ */
+typedef struct res_node_tag res_node;
+struct res_node_tag {
+	res_node *	child[2];	/* by the bit after the prefix */
+	restrict_u *	res;
+	uint8_t		key[16];
+	uint8_t		plen;
+};
+
+struct res_trie {
+	res_node *	root;
+	bool		linear;		/* list has an odd mask */
+};
+
+/* the lists have new entries up front */
+static bool		unsorted4;
+static bool		unsorted6;
+
+/*
+ * Every entry on a list is also on a chain in its hash table, linked
+ * through hlink.  The table doubles when the chains average one entry.
+ */
+struct res_hash {
+	restrict_u **	bucket;
+	size_t		size;		/* a power of 2, or 0 */
+	size_t		count;
+};
+
+static struct res_hash	hash4;
+static struct res_hash	hash6;
+
+#define	INIT_RES_HASH	64
+
+#define KEY_BIT(key, i)	(((key)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
 /*
  * We allocate INC_RESLIST{4|6} entries to the free list whenever empty.
  * Auto-tune these to be just less than 1KB (leaving at least 16 bytes
@@ -97,6 +192,77 @@ static	unsigned long res_limited_refcnt;
 static	restrict_u	restrict_def4;
 static	restrict_u	restrict_def6;
 
+/*
+ * Bumped by every snapshot, so MRU entries can tell their remembered
+ * match is stale.  Never 0, which marks no match.
+ */
+static	unsigned int	res_gen = 1;
+
+/*
+ * The restrict set: address ranges, IPv6 ones as two 64 bit halves,
+ * most significant first.  res_set is used by the main thread only;
+ * the file watcher leaves what it reads in res_set_pending.
+ */
+struct res_range4 {
+	uint32_t	lo, hi;
+};
+
+struct res_range6 {
+	uint64_t	lo[2], hi[2];
+};
+
+struct res_set {
+	struct res_range4 *	r4;
+	struct res_range6 *	r6;
+	size_t		n4, n6;		/* ranges, after merging */
+	size_t		alloc4, alloc6;	/* ranges allocated */
+	unsigned long	prefixes;	/* lines read */
+	unsigned short	flags;
+	uint64_t	hits;
+	time_t		loaded;
+};
+
+static	struct res_set *res_set;
+static	struct res_set *res_set_pending;
+static	char *		res_set_path;	/* NULL for no set */
+static	unsigned short	res_set_flags;
+static	pthread_mutex_t	res_set_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A snapshot.  The copies are linked and indexed as the lists are;
+ * live[i] is the entry copy[i] was made from.
+ */
+struct res_snap {
+	restrict_u *	list4;
+	restrict_u *	list6;
+	restrict_u *	copy;		/* IPv4 entries first */
+	restrict_u **	live;
+	size_t		n;		/* entries in copy and live */
+	struct res_trie	trie4;
+	struct res_trie	trie6;
+	struct res_set *set;		/* the restrict set, or NULL */
+	struct res_set *dead_set;	/* replaced set to free with this */
+	unsigned int	gen;
+	struct res_snap *next;		/* on a retired list */
+};
+
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+static	_Atomic(struct res_snap *) res_snap;
+static	atomic_uint	res_epoch;
+static	atomic_uint	res_readers[2];	/* inside, by epoch parity */
+#else
+static	struct res_snap * volatile res_snap;	/* racy without atomics */
+static	volatile unsigned int res_epoch;
+static	volatile unsigned int res_readers[2];
+#endif /* HAVE_STDATOMIC_H */
+
+/* the main thread's, for the rest only the snapshot */
+static	pthread_t	res_writer;
+static	bool		res_dirty = true;	/* lists changed since */
+static	struct res_set *res_dead_set;	/* the published set, replaced */
+static	struct res_snap *res_retired;	/* before the epoch flipped */
+static	struct res_snap *res_retiring;	/* since */
+
 /*
  * "restrict source ..." enabled knob and restriction bits.
  */
@@ -112,12 +278,38 @@ static restrict_u *	alloc_res6(void);
 static void		free_res(restrict_u *, bool);
 static void		inc_res_limited(void);
 static void		dec_res_limited(void);
-static restrict_u *	match_restrict4_addr(uint32_t, unsigned short);
-static restrict_u *	match_restrict6_addr(const struct in6_addr *,
+static restrict_u *	match_restrict4_addr(const struct res_snap *,
+					     uint32_t, unsigned short);
+static restrict_u *	match_restrict6_addr(const struct res_snap *,
+					     const struct in6_addr *,
 					     unsigned short);
 static restrict_u *	match_restrict_entry(const restrict_u *, int);
+static restrict_u *	res_match(const struct res_snap *, sockaddr_u *);
+static unsigned short	res_hit(const struct res_snap *, sockaddr_u *,
+				restrict_u *, bool);
+static struct res_snap *res_snap_build(void);
+static void		res_filter(const struct res_snap *);
+static bool		res_filter_range(uint8_t *, const uint8_t *, bool);
+static void		res_snap_free(struct res_snap *);
+static struct res_snap *res_current(void);
+static void		res_reclaim(void);
 static int		res_sorts_before4(restrict_u *, restrict_u *);
 static int		res_sorts_before6(restrict_u *, restrict_u *);
+static restrict_u *	res_sort(restrict_u *, bool);
+static void		res_list_sort(bool);
+static size_t		res_hash_index(const restrict_u *, size_t, bool);
+static void		res_hash_add(restrict_u *, bool);
+static void		res_hash_del(restrict_u *, bool);
+static bool		res_set_match(const struct res_set *, sockaddr_u *);
+static struct res_set *	res_set_read(const char *, struct stat *, bool,
+				     bool, unsigned short);
+static void		res_set_free(struct res_set *);
+static void		res_set_install(struct res_set *);
+static void		res_set_changed(const char *, struct stat *, bool);
+static void		trie_free(res_node *);
+static void		trie_build(struct res_trie *, restrict_u *, bool);
+static restrict_u *	trie_match(const struct res_trie *,
+				   const uint8_t *, unsigned short, bool);
 
 
 /*
@@ -155,8 +347,20 @@ init_restrict(void)
 	 *
 	 */
 
+	res_writer = pthread_self();
+	res_dirty = true;
+	unsorted4 = unsorted6 = false;
+	free_tag(MEM_RESTRICT, hash4.bucket,
+		 hash4.size * sizeof(*hash4.bucket));
+	free_tag(MEM_RESTRICT, hash6.bucket,
+		 hash6.size * sizeof(*hash6.bucket));
+	ZERO(hash4);
+	ZERO(hash6);
+
 	LINK_SLIST(rstrct.restrictlist4, &restrict_def4, link);
 	LINK_SLIST(rstrct.restrictlist6, &restrict_def6, link);
+	res_hash_add(&restrict_def4, false);
+	res_hash_add(&restrict_def6, true);
 	restrict_def4.flags = RES_Default;
 	restrict_def6.flags = RES_Default;
 	if (RES_Default & RES_LIMITED) {
@@ -179,7 +383,7 @@ alloc_res4(void)
 	if (res != NULL)
 		return res;
 
-	rl = emalloc_zero(count * cb);
+	rl = emalloc_zero_tag(MEM_RESTRICT, count * cb);
 	/* link all but the first onto free list */
 	res = (void *)((char *)rl + (count - 1) * cb);
 	for (int i = count - 1; i > 0; i--) {
@@ -204,7 +408,7 @@ alloc_res6(void)
 	if (res != NULL)
 		return res;
 
-	rl = emalloc_zero(count * cb);
+	rl = emalloc_zero_tag(MEM_RESTRICT, count * cb);
 	/* link all but the first onto free list */
 	res = (void *)((char *)rl + (count - 1) * cb);
 	for (int i = count - 1; i > 0; i--) {
@@ -236,6 +440,8 @@ free_res(
 		plisthead = &rstrct.restrictlist4;
 	UNLINK_SLIST(unlinked, *plisthead, res, link, restrict_u);
 	INSIST(unlinked == res);
+	res_hash_del(res, v6);
+	res_dirty = true;
 
 	if (v6) {
 		memset(res, '\0', V6_SIZEOF_RESTRICT_U);
@@ -266,16 +472,237 @@ dec_res_limited(void)
 }
 
 
+/*
+ * mask_prefix_len - the prefix length of a network-order mask, or -1
+ *		     if its one bits aren't contiguous from the left
+ */
+static int
+mask_prefix_len(
+	const uint8_t *	mask,
+	size_t		octets
+	)
+{
+	int	plen = 0;
+	size_t	i = 0;
+
+	for (; i < octets && 0xff == mask[i]; i++)
+		plen += 8;
+	if (i < octets) {
+		uint8_t m = mask[i++];
+
+		for (; m & 0x80; m = (uint8_t)(m << 1))
+			plen++;
+		if (m)
+			return -1;
+	}
+	for (; i < octets; i++)
+		if (mask[i])
+			return -1;
+	return plen;
+}
+
+
+static void
+v4_key(
+	uint8_t *	key,
+	uint32_t	addr		/* host order */
+	)
+{
+	key[0] = (uint8_t)(addr >> 24);
+	key[1] = (uint8_t)(addr >> 16);
+	key[2] = (uint8_t)(addr >> 8);
+	key[3] = (uint8_t)addr;
+}
+
+
+/*
+ * same_prefix - true if a and b have the same address and mask
+ */
+static bool
+same_prefix(
+	const restrict_u *	a,
+	const restrict_u *	b,
+	bool			v6
+	)
+{
+	if (v6)
+		return ADDR6_EQ(&a->u.v6.addr, &b->u.v6.addr)
+		    && ADDR6_EQ(&a->u.v6.mask, &b->u.v6.mask);
+	return a->u.v4.addr == b->u.v4.addr
+	    && a->u.v4.mask == b->u.v4.mask;
+}
+
+
+static void
+trie_free(
+	res_node *	node
+	)
+{
+	if (NULL == node)
+		return;
+	trie_free(node->child[0]);
+	trie_free(node->child[1]);
+	free_tag(MEM_RESTRICT, node, sizeof(*node));
+}
+
+
+static res_node *
+trie_new_node(
+	const uint8_t *	key,
+	int		plen
+	)
+{
+	res_node *node = emalloc_zero_tag(MEM_RESTRICT, sizeof(*node));
+
+	/* keep only the prefix bits */
+	for (int i = 0; i < (int)sizeof(node->key) && i * 8 < plen; i++)
+		node->key[i] = key[i];
+	if (plen & 7)
+		node->key[plen >> 3] &= (uint8_t)(0xff00 >> (plen & 7));
+	node->plen = (uint8_t)plen;
+	return node;
+}
+
+
+/*
+ * trie_insert - return the node for key/plen, creating it and any
+ *		 joining node needed
+ */
+static res_node *
+trie_insert(
+	res_node **	pp,
+	const uint8_t *	key,
+	int		plen
+	)
+{
+	res_node *	node;
+	res_node *	join;
+	int		common;
+
+	while ((node = *pp) != NULL) {
+		for (common = 0; common < min(plen, node->plen) &&
+		     KEY_BIT(key, common) == KEY_BIT(node->key, common);
+		     common++)
+			/* count shared leading bits */;
+		if (common < node->plen) {
+			/* the new prefix branches off above node */
+			join = trie_new_node(key, common);
+			join->child[KEY_BIT(node->key, common)] = node;
+			*pp = join;
+			if (common == plen)
+				return join;
+			node = trie_new_node(key, plen);
+			join->child[KEY_BIT(key, common)] = node;
+			return node;
+		}
+		if (node->plen == plen)
+			return node;
+		pp = &node->child[KEY_BIT(key, node->plen)];
+	}
+	*pp = trie_new_node(key, plen);
+	return *pp;
+}
+
+
+/*
+ * trie_build - index a sorted restrict list
+ */
+static void
+trie_build(
+	struct res_trie *	trie,
+	restrict_u *		list,
+	bool			v6
+	)
+{
+	uint8_t		key[16];
+	uint8_t		mask[16];
+	res_node *	node;
+	int		plen;
+
+	trie->root = NULL;
+	trie->linear = false;
+
+	for (restrict_u *res = list; res != NULL; res = res->link) {
+		ZERO(key);
+		ZERO(mask);
+		if (v6) {
+			memcpy(key, &res->u.v6.addr, 16);
+			memcpy(mask, &res->u.v6.mask, 16);
+			plen = mask_prefix_len(mask, 16);
+		} else {
+			v4_key(key, res->u.v4.addr);
+			v4_key(mask, res->u.v4.mask);
+			plen = mask_prefix_len(mask, 4);
+		}
+		if (plen < 0) {
+			trie_free(trie->root);
+			trie->root = NULL;
+			trie->linear = true;
+			return;
+		}
+		node = trie_insert(&trie->root, key, plen);
+		/* the list is sorted, so the first one seen leads */
+		if (NULL == node->res)
+			node->res = res;
+	}
+}
+
+
+/*
+ * trie_match - the first list entry that matches key and port, that
+ *		is, the best entry of the longest matching prefix
+ */
+static restrict_u *
+trie_match(
+	const struct res_trie *	trie,
+	const uint8_t *		key,
+	unsigned short		port,
+	bool			v6
+	)
+{
+	const res_node *node = trie->root;
+	restrict_u *	best = NULL;
+	restrict_u *	res;
+	int		i;
+
+	while (node != NULL) {
+		for (i = 0; i < node->plen; i++)
+			if (KEY_BIT(key, i) != KEY_BIT(node->key, i))
+				return best;
+		for (res = node->res;
+		     res != NULL && same_prefix(res, node->res, v6);
+		     res = res->link)
+			if (!(RESM_NTPONLY & res->mflags) || NTP_PORT == port) {
+				best = res;
+				break;
+			}
+		if (node->plen >= (v6 ? 128 : 32))
+			break;
+		node = node->child[KEY_BIT(key, node->plen)];
+	}
+	return best;
+}
+
+
 static restrict_u *
 match_restrict4_addr(
-	uint32_t	addr,
-	unsigned short	port
+	const struct res_snap *	snap,
+	uint32_t		addr,
+	unsigned short		port
 	)
 {
 	restrict_u *	res;
 	restrict_u *	next;
+	uint8_t		key[4];
+
+	if (!snap->trie4.linear) {
+		v4_key(key, addr);
+		res = trie_match(&snap->trie4, key, port, false);
+		INSIST(res != NULL);	/* the default always matches */
+		return res;
+	}
 
-	for (res = rstrct.restrictlist4; res != NULL; res = next) {
+	for (res = snap->list4; res != NULL; res = next) {
 		next = res->link;
 		if (res->u.v4.addr == (addr & res->u.v4.mask)
 		    && (!(RESM_NTPONLY & res->mflags)
@@ -288,6 +715,7 @@ match_restrict4_addr(
 
 static restrict_u *
 match_restrict6_addr(
+	const struct res_snap *	snap,
 	const struct in6_addr *	addr,
 	unsigned short		port
 	)
@@ -296,7 +724,13 @@ match_restrict6_addr(
 	restrict_u *	next;
 	struct in6_addr	masked;
 
-	for (res = rstrct.restrictlist6; res != NULL; res = next) {
+	if (!snap->trie6.linear) {
+		res = trie_match(&snap->trie6, addr->s6_addr, port, true);
+		INSIST(res != NULL);	/* the default always matches */
+		return res;
+	}
+
+	for (res = snap->list6; res != NULL; res = next) {
 		next = res->link;
 		INSIST(next != res);
 		MASK_IPV6_ADDR(&masked, addr, &res->u.v6.mask);
@@ -324,19 +758,13 @@ match_restrict_entry(
 	int			v6
 	)
 {
+	const struct res_hash *hash = v6 ? &hash6 : &hash4;
 	restrict_u *res;
-	restrict_u *rlist;
 	size_t cb;
 
-	if (v6) {
-		rlist = rstrct.restrictlist6;
-		cb = sizeof(pmatch->u.v6);
-	} else {
-		rlist = rstrct.restrictlist4;
-		cb = sizeof(pmatch->u.v4);
-	}
-
-	for (res = rlist; res != NULL; res = res->link)
+	cb = v6 ? sizeof(pmatch->u.v6) : sizeof(pmatch->u.v4);
+	res = hash->bucket[res_hash_index(pmatch, hash->size, v6)];
+	for (; res != NULL; res = res->hlink)
 		if (res->mflags == pmatch->mflags &&
 		    !memcmp(&res->u, &pmatch->u, cb))
 			break;
@@ -344,6 +772,81 @@ match_restrict_entry(
 }
 
 
+/*
+ * res_hash_index - which chain an entry belongs on
+ */
+static size_t
+res_hash_index(
+	const restrict_u *	res,
+	size_t			size,
+	bool			v6
+	)
+{
+	uint32_t	h;
+
+	/* address and mask, keyed like the other address hashes */
+	if (v6)
+		h = sock_hash_bytes(&res->u.v6, sizeof(res->u.v6));
+	else
+		h = sock_hash_bytes(&res->u.v4, sizeof(res->u.v4));
+	h ^= res->mflags;
+	return h & (size - 1);
+}
+
+
+static void
+res_hash_add(
+	restrict_u *	res,
+	bool		v6
+	)
+{
+	struct res_hash *hash = v6 ? &hash6 : &hash4;
+	restrict_u **	old;
+	size_t		oldsize;
+	size_t		i;
+
+	if (hash->count >= hash->size) {
+		old = hash->bucket;
+		oldsize = hash->size;
+		hash->size = oldsize ? 2 * oldsize : INIT_RES_HASH;
+		hash->bucket = emalloc_zero_tag(MEM_RESTRICT,
+						hash->size * sizeof(*old));
+		hash->count = 0;
+		for (i = 0; i < oldsize; i++)
+			while (old[i] != NULL) {
+				restrict_u *moved = old[i];
+
+				old[i] = moved->hlink;
+				res_hash_add(moved, v6);
+			}
+		free_tag(MEM_RESTRICT, old, oldsize * sizeof(*old));
+	}
+	i = res_hash_index(res, hash->size, v6);
+	res->hlink = hash->bucket[i];
+	hash->bucket[i] = res;
+	hash->count++;
+}
+
+
+static void
+res_hash_del(
+	restrict_u *	res,
+	bool		v6
+	)
+{
+	struct res_hash *hash = v6 ? &hash6 : &hash4;
+	restrict_u **	pp;
+
+	pp = &hash->bucket[res_hash_index(res, hash->size, v6)];
+	while (*pp != res) {
+		INSIST(*pp != NULL);
+		pp = &(*pp)->hlink;
+	}
+	*pp = res->hlink;
+	hash->count--;
+}
+
+
 /*
  * res_sorts_before4 - compare two restrict4 entries
  *
@@ -414,19 +917,87 @@ res_sorts_before6(
 
 
 /*
- * restrictions - return restrictions for this host
+ * res_sort - merge sort a restrict list
  */
-unsigned short
-restrictions(
+static restrict_u *
+res_sort(
+	restrict_u *	list,
+	bool		v6
+	)
+{
+	restrict_u *	half[2] = { NULL, NULL };
+	restrict_u *	res;
+	restrict_u **	tail;
+	int		which = 0;
+
+	if (NULL == list || NULL == list->link)
+		return list;
+
+	/* deal the entries out alternately */
+	while (list != NULL) {
+		res = list;
+		list = res->link;
+		LINK_SLIST(half[which], res, link);
+		which ^= 1;
+	}
+	half[0] = res_sort(half[0], v6);
+	half[1] = res_sort(half[1], v6);
+
+	tail = &list;
+	while (half[0] != NULL && half[1] != NULL) {
+		which = (v6)
+			    ? res_sorts_before6(half[1], half[0])
+			    : res_sorts_before4(half[1], half[0]);
+		*tail = half[which];
+		half[which] = half[which]->link;
+		tail = &(*tail)->link;
+	}
+	*tail = (half[0] != NULL) ? half[0] : half[1];
+	return list;
+}
+
+
+/*
+ * res_list_sort - put the entries hack_restrict() added in their place
+ */
+static void
+res_list_sort(
+	bool	v6
+	)
+{
+	if (v6 && unsorted6) {
+		rstrct.restrictlist6 = res_sort(rstrct.restrictlist6, true);
+		unsorted6 = false;
+	} else if (!v6 && unsorted4) {
+		rstrct.restrictlist4 = res_sort(rstrct.restrictlist4, false);
+		unsorted4 = false;
+	}
+}
+
+
+/*
+ * sort_restrict - sort the restrict lists, for callers that walk them
+ */
+void
+sort_restrict(void)
+{
+	res_list_sort(false);
+	res_list_sort(true);
+}
+
+
+/*
+ * res_match - the entry that applies to this host, or NULL for a
+ * multicast source, which is ignored
+ */
+static restrict_u *
+res_match(
+	const struct res_snap *snap,
 	sockaddr_u *srcadr
 	)
 {
-	restrict_u *match;
 	struct in6_addr *pin6;
-	unsigned short flags;
 
-	res_calls++;
-	flags = 0;
 	/* IPv4 source address */
 	if (IS_IPV4(srcadr)) {
 		/*
@@ -435,21 +1006,10 @@ restrictions(
 		 * not later!)
 		 */
 		if (IN_CLASSD(SRCADR(srcadr)))
-			return (int)RES_IGNORE;
+			return NULL;
 
-		match = match_restrict4_addr(SRCADR(srcadr),
-					     SRCPORT(srcadr));
-		match->hitcount++;
-		/*
-		 * res_not_found counts only use of the final default
-		 * entry, not any "restrict default ntpport ...", which
-		 * would be just before the final default.
-		 */
-		if (&restrict_def4 == match)
-			res_not_found++;
-		else
-			res_found++;
-		flags = match->flags;
+		return match_restrict4_addr(snap, SRCADR(srcadr),
+					    SRCPORT(srcadr));
 	}
 
 	/* IPv6 source address */
@@ -462,17 +1022,441 @@ restrictions(
 		 * not later!)
 		 */
 		if (IN6_IS_ADDR_MULTICAST(pin6))
-			return (int)RES_IGNORE;
+			return NULL;
 
-		match = match_restrict6_addr(pin6, SRCPORT(srcadr));
-		match->hitcount++;
-		if (&restrict_def6 == match)
-			res_not_found++;
-		else
-			res_found++;
-		flags = match->flags;
+		return match_restrict6_addr(snap, pin6, SRCPORT(srcadr));
+	}
+	return NULL;
+}
+
+
+/*
+ * res_hit - count a packet matching match, a copy in snap, and the
+ * restrict set if inset, and return their flags.  The counts are
+ * plain, like the other statistics.
+ */
+static unsigned short
+res_hit(
+	const struct res_snap *snap,
+	sockaddr_u *srcadr,
+	restrict_u *match,
+	bool	   inset
+	)
+{
+	restrict_u *live = snap->live[match - snap->copy];
+	unsigned short flags = match->flags;
+
+	live->hitcount++;
+	/*
+	 * res_not_found counts only use of the final default
+	 * entry, not any "restrict default ntpport ...", which
+	 * would be just before the final default.
+	 */
+	if (&restrict_def4 == live || &restrict_def6 == live)
+		res_not_found++;
+	else
+		res_found++;
+	if (inset) {
+		snap->set->hits++;
+		flags |= snap->set->flags;
+	}
+	NTP_TRACE2(restrict, srcadr, flags);
+	return flags;
+}
+
+
+/*
+ * res_snap_build - copy the lists, sorted, and index the copies
+ */
+static struct res_snap *
+res_snap_build(void)
+{
+	struct res_snap *snap;
+	restrict_u **	tail;
+	restrict_u *	res;
+	size_t		n = 0;
+
+	sort_restrict();
+	for (res = rstrct.restrictlist4; res != NULL; res = res->link)
+		n++;
+	for (res = rstrct.restrictlist6; res != NULL; res = res->link)
+		n++;
+	snap = emalloc_zero_tag(MEM_RESTRICT, sizeof(*snap));
+	snap->copy = emalloc_zero_tag(MEM_RESTRICT, n * sizeof(*snap->copy));
+	snap->live = emalloc_zero_tag(MEM_RESTRICT, n * sizeof(*snap->live));
+	snap->n = n;
+
+	n = 0;
+	tail = &snap->list4;
+	for (res = rstrct.restrictlist4; res != NULL; res = res->link) {
+		/* IPv4 entries are allocated short */
+		memcpy(&snap->copy[n], res, V4_SIZEOF_RESTRICT_U);
+		snap->live[n] = res;
+		*tail = &snap->copy[n++];
+		tail = &(*tail)->link;
+	}
+	*tail = NULL;
+	tail = &snap->list6;
+	for (res = rstrct.restrictlist6; res != NULL; res = res->link) {
+		memcpy(&snap->copy[n], res, V6_SIZEOF_RESTRICT_U);
+		snap->live[n] = res;
+		*tail = &snap->copy[n++];
+		tail = &(*tail)->link;
 	}
-	return (flags);
+	*tail = NULL;
+	for (size_t i = 0; i < n; i++) {
+		snap->copy[i].hlink = NULL;
+		snap->copy[i].hitcount = 0;
+	}
+
+	trie_build(&snap->trie4, snap->list4, false);
+	trie_build(&snap->trie6, snap->list6, true);
+	snap->set = res_set;
+	if (0 == ++res_gen)
+		res_gen = 1;
+	snap->gen = res_gen;
+	return snap;
+}
+
+
+static void
+res_snap_free(
+	struct res_snap *snap
+	)
+{
+	trie_free(snap->trie4.root);
+	trie_free(snap->trie6.root);
+	res_set_free(snap->dead_set);
+	free_tag(MEM_RESTRICT, snap->copy, snap->n * sizeof(*snap->copy));
+	free_tag(MEM_RESTRICT, snap->live, snap->n * sizeof(*snap->live));
+	free_tag(MEM_RESTRICT, snap, sizeof(*snap));
+}
+
+
+/*
+ * Readers count themselves in under the parity of the epoch, and out
+ * again when done with the snapshot they loaded in between.
+ */
+static inline unsigned int
+res_read_begin(void)
+{
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	unsigned int e = atomic_load(&res_epoch) & 1;
+
+	atomic_fetch_add(&res_readers[e], 1);
+	return e;
+#else
+	unsigned int e = res_epoch & 1;
+
+	res_readers[e]++;
+	return e;
+#endif /* HAVE_STDATOMIC_H */
+}
+
+static inline void
+res_read_end(
+	unsigned int e
+	)
+{
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_fetch_sub_explicit(&res_readers[e], 1, memory_order_release);
+#else
+	res_readers[e]--;
+#endif /* HAVE_STDATOMIC_H */
+}
+
+static inline struct res_snap *
+res_snap_load(void)
+{
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	return atomic_load(&res_snap);
+#else
+	return res_snap;
+#endif /* HAVE_STDATOMIC_H */
+}
+
+
+/*
+ * restrict_publish - let the other threads see the changes to the
+ * lists and the restrict set, then free the snapshots nobody can still
+ * be using.  Main thread only.
+ */
+void
+restrict_publish(void)
+{
+	struct res_snap *old;
+	struct res_snap *snap;
+
+	if (res_dirty) {
+		res_dirty = false;
+		snap = res_snap_build();
+		res_filter(snap);
+		old = res_snap_load();
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+		atomic_store(&res_snap, snap);
+#else
+		res_snap = snap;
+#endif /* HAVE_STDATOMIC_H */
+		if (NULL != old) {
+			old->dead_set = res_dead_set;
+			old->next = res_retiring;
+			res_retiring = old;
+		} else
+			res_set_free(res_dead_set);
+		res_dead_set = NULL;
+	}
+	res_reclaim();
+}
+
+
+/*
+ * restrict_refilter - have the next restrict_publish() hand a new
+ * snapshot to the kernel filter, which was just loaded
+ */
+void
+restrict_refilter(void)
+{
+	res_dirty = true;
+}
+
+
+/*
+ * res_filter - hand the kernel filter the prefixes of a snapshot.  A
+ * prefix drops when its entry ignores sources on any port, "ntpport"
+ * ones pass, and so does everything of a family whose masks make a
+ * linear list; where the filter passes, restrictions() decides.  The
+ * restrict set's ranges drop whatever is in the lists when it
+ * ignores.  IPv4 goes in IPv4-mapped, under a pass of its own that
+ * keeps IPv6 entries off it.
+ */
+static void
+res_filter(
+	const struct res_snap *snap
+	)
+{
+	const struct res_set *rs = snap->set;
+	restrict_u *	res;
+	uint8_t		key[16];
+	uint8_t		hi[16];
+	uint8_t		mask[4];
+	bool		drop;
+	int		plen;
+
+	if (!bpf_filter_loaded())
+		return;
+	bpf_filter_begin();
+	ZERO(key);
+	key[10] = key[11] = 0xff;
+	bpf_filter_prefix(key, 96, false, false);
+	if (!snap->trie4.linear)
+		for (res = snap->list4; res != NULL; res = res->link) {
+			v4_key(key + 12, res->u.v4.addr);
+			v4_key(mask, res->u.v4.mask);
+			plen = mask_prefix_len(mask, 4);
+			drop = (RES_IGNORE & res->flags) &&
+			    !(RESM_NTPONLY & res->mflags);
+			bpf_filter_prefix(key, 96 + plen, drop, false);
+		}
+	if (!snap->trie6.linear)
+		for (res = snap->list6; res != NULL; res = res->link) {
+			plen = mask_prefix_len(res->u.v6.mask.s6_addr, 16);
+			if (plen >= 96 && IN6_IS_ADDR_V4MAPPED(&res->u.v6.addr))
+				continue;
+			drop = (RES_IGNORE & res->flags) &&
+			    !(RESM_NTPONLY & res->mflags);
+			bpf_filter_prefix(res->u.v6.addr.s6_addr, plen, drop,
+					  false);
+		}
+	if (NULL != rs && (RES_IGNORE & rs->flags)) {
+		for (size_t i = 0; i < rs->n4; i++) {
+			v4_key(key + 12, rs->r4[i].lo);
+			memcpy(hi, key, 12);
+			v4_key(hi + 12, rs->r4[i].hi);
+			if (!res_filter_range(key, hi, false))
+				break;
+		}
+		for (size_t i = 0; i < rs->n6; i++) {
+			for (int b = 0; b < 8; b++) {
+				key[b] = (uint8_t)(rs->r6[i].lo[0] >> (56 - 8 * b));
+				key[8 + b] = (uint8_t)(rs->r6[i].lo[1] >> (56 - 8 * b));
+				hi[b] = (uint8_t)(rs->r6[i].hi[0] >> (56 - 8 * b));
+				hi[8 + b] = (uint8_t)(rs->r6[i].hi[1] >> (56 - 8 * b));
+			}
+			if (!res_filter_range(key, hi, true))
+				break;
+		}
+	}
+	bpf_filter_commit();
+}
+
+
+/*
+ * res_filter_range - drop lo..hi, 16 octets each, as the fewest
+ * prefixes, leaving the IPv4-mapped ones of IPv6 ranges out.  lo is
+ * used up.  Returns false once the filter has no more room.
+ */
+static bool
+res_filter_range(
+	uint8_t *	lo,
+	const uint8_t *	hi,
+	bool		v6
+	)
+{
+	static const uint8_t mapped[12] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	uint8_t		end[16];
+	int		bits;	/* host bits of the prefix */
+	int		i;
+
+	for (;;) {
+		/* the biggest prefix at lo that ends by hi */
+		for (bits = 0; bits < 128; bits++)
+			if (lo[15 - bits / 8] & (1 << (bits % 8)))
+				break;
+		for (;; bits--) {
+			memcpy(end, lo, sizeof(end));
+			for (i = 0; i < bits; i++)
+				end[15 - i / 8] |= (uint8_t)(1 << (i % 8));
+			if (memcmp(end, hi, sizeof(end)) <= 0)
+				break;
+		}
+		if (!(v6 && bits <= 32 && 0 == memcmp(lo, mapped, 12)) &&
+		    !bpf_filter_prefix(lo, 128 - bits, true, true))
+			return false;
+		if (0 == memcmp(end, hi, sizeof(end)))
+			return true;
+		/* lo = end + 1; end < hi, so it doesn't wrap */
+		memcpy(lo, end, sizeof(end));
+		for (i = 15; i >= 0 && 0xff == lo[i]; i--)
+			lo[i] = 0;
+		lo[i]++;
+	}
+}
+
+
+/*
+ * res_reclaim - free what was retired before the epoch flipped once
+ * no reader of the old epoch is left, then flip it again for what was
+ * retired since.  A reader that got in before a flip may hold anything
+ * retired up to the next one.
+ */
+static void
+res_reclaim(void)
+{
+	struct res_snap *snap;
+	unsigned int	old;
+
+	for (;;) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+		old = (atomic_load(&res_epoch) & 1) ^ 1;
+		if (0 != atomic_load(&res_readers[old]))
+			return;
+#else
+		old = (res_epoch & 1) ^ 1;
+		if (0 != res_readers[old])
+			return;
+#endif /* HAVE_STDATOMIC_H */
+		while (NULL != (snap = res_retired)) {
+			res_retired = snap->next;
+			res_snap_free(snap);
+		}
+		if (NULL == res_retiring)
+			return;
+		res_retired = res_retiring;
+		res_retiring = NULL;
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+		atomic_fetch_add(&res_epoch, 1);
+#else
+		res_epoch++;
+#endif /* HAVE_STDATOMIC_H */
+	}
+}
+
+
+/*
+ * res_current - the snapshot to match against: up to date on the main
+ * thread, which sees its own changes at once, and whatever was last
+ * published on the others.  Call between res_read_begin() and
+ * res_read_end() off the main thread.
+ */
+static struct res_snap *
+res_current(void)
+{
+	if (pthread_equal(pthread_self(), res_writer) && res_dirty)
+		restrict_publish();
+	return res_snap_load();
+}
+
+
+/*
+ * restrictions - return restrictions for this host
+ */
+unsigned short
+restrictions(
+	sockaddr_u *srcadr
+	)
+{
+	const struct res_snap *snap;
+	restrict_u *match;
+	unsigned short flags;
+	unsigned int epoch;
+
+	res_calls++;
+	if (!IS_IPV4(srcadr) && !IS_IPV6(srcadr)) {
+		NTP_TRACE2(restrict, srcadr, 0);
+		return 0;
+	}
+	epoch = res_read_begin();
+	snap = res_current();
+	match = res_match(snap, srcadr);
+	if (NULL == match)
+		flags = RES_IGNORE;
+	else
+		flags = res_hit(snap, srcadr, match,
+				res_set_match(snap->set, srcadr));
+	res_read_end(epoch);
+	return flags;
+}
+
+
+/*
+ * restrictions_cached - restrictions() for a source the MRU list
+ * knows, taking the entry it matched last time if the lists haven't
+ * changed since.  The port is part of the match, as "ntpport" entries
+ * apply only to sources on the NTP port.
+ */
+unsigned short
+restrictions_cached(
+	sockaddr_u *srcadr,
+	mon_entry *mon
+	)
+{
+	const struct res_snap *snap;
+	restrict_u *match;
+	unsigned short flags;
+	unsigned int epoch;
+	bool ntpport = (NTP_PORT == SRCPORT(srcadr));
+
+	res_calls++;
+	if (!IS_IPV4(srcadr) && !IS_IPV6(srcadr)) {
+		NTP_TRACE2(restrict, srcadr, 0);
+		return 0;
+	}
+	epoch = res_read_begin();
+	snap = res_current();
+	if (mon->res_gen == snap->gen && mon->res_ntpport == ntpport) {
+		flags = res_hit(snap, srcadr, mon->res, mon->res_inset);
+	} else if (NULL == (match = res_match(snap, srcadr))) {
+		flags = RES_IGNORE;
+	} else {
+		mon->res = match;
+		mon->res_gen = snap->gen;
+		mon->res_ntpport = ntpport;
+		mon->res_inset = res_set_match(snap->set, srcadr);
+		flags = res_hit(snap, srcadr, match, mon->res_inset);
+	}
+	res_read_end(epoch);
+	return flags;
 }
 
 
@@ -496,6 +1480,9 @@ hack_restrict(
 	DPRINT(1, ("restrict: op %d addr %s mask %s mflags %08x flags %08x\n",
 		   op, socktoa(resaddr), socktoa(resmask), mflags, flags));
 
+	/* readers keep the old snapshot until the next is published */
+	res_dirty = true;
+
 	if (NULL == resaddr) {
 		/* restrict source */
 		REQUIRE(NULL == resmask);
@@ -557,12 +1544,13 @@ hack_restrict(
 				       V4_SIZEOF_RESTRICT_U);
 				plisthead = &rstrct.restrictlist4;
 			}
-			LINK_SORT_SLIST(
-				*plisthead, res,
-				(v6)
-				  ? res_sorts_before6(res, L_S_S_CUR())
-				  : res_sorts_before4(res, L_S_S_CUR()),
-				link, restrict_u);
+			/* sorted when next needed */
+			LINK_SLIST(*plisthead, res, link);
+			res_hash_add(res, v6);
+			if (v6)
+				unsorted6 = true;
+			else
+				unsorted4 = true;
 			restrictcount++;
 			if (RES_LIMITED & flags)
 				inc_res_limited();
@@ -627,6 +1615,7 @@ restrict_source(
 {
 	sockaddr_u *	addr = &peer->srcadr;
 	sockaddr_u	onesmask;
+	const struct res_snap *snap = res_current();
 	restrict_u *	res;
 	bool		found_specific = false;
 	bool		need_poke = false;
@@ -642,10 +1631,10 @@ restrict_source(
 	 * server ...".
 	 */
 	if (IS_IPV4(addr)) {
-		res = match_restrict4_addr(SRCADR(addr), SRCPORT(addr));
+		res = match_restrict4_addr(snap, SRCADR(addr), SRCPORT(addr));
 		found_specific = (SRCADR(&onesmask) == res->u.v4.mask);
 	} else {
-		res = match_restrict6_addr(&SOCK_ADDR6(addr),
+		res = match_restrict6_addr(snap, &SOCK_ADDR6(addr),
 					   SRCPORT(addr));
 		found_specific = ADDR6_EQ(&res->u.v6.mask,
 					  &SOCK_ADDR6(&onesmask));
@@ -691,12 +1680,13 @@ unrestrict_source(
 {
 	sockaddr_u *	addr = &peer->srcadr;
 	sockaddr_u	onesmask;
+	const struct res_snap *snap = res_current();
 	restrict_u *	res;
 
 	if (IS_IPV4(addr)) {
-		res = match_restrict4_addr(SRCADR(addr), SRCPORT(addr));
+		res = match_restrict4_addr(snap, SRCADR(addr), SRCPORT(addr));
 	} else {
-		res = match_restrict6_addr(&SOCK_ADDR6(addr),
+		res = match_restrict6_addr(snap, &SOCK_ADDR6(addr),
 					   SRCPORT(addr));
 	}
 	if (!(res->mflags & RESM_SOURCE)) {
@@ -712,3 +1702,487 @@ unrestrict_source(
 }
 
 
+
+
+/*
+ * u128_cmp - compare two IPv6 addresses held as halves
+ */
+static int
+u128_cmp(
+	const uint64_t	a[2],
+	const uint64_t	b[2]
+	)
+{
+	if (a[0] != b[0])
+		return (a[0] < b[0]) ? -1 : 1;
+	if (a[1] != b[1])
+		return (a[1] < b[1]) ? -1 : 1;
+	return 0;
+}
+
+
+/*
+ * u128_reaches - whether b is no further on than the address after a,
+ * so a range ending at a and one starting at b make one range
+ */
+static bool
+u128_reaches(
+	const uint64_t	a[2],
+	const uint64_t	b[2]
+	)
+{
+	uint64_t	next[2];
+
+	if (UINT64_MAX == a[0] && UINT64_MAX == a[1])
+		return true;
+	next[1] = a[1] + 1;
+	next[0] = a[0] + (0 == next[1]);
+	return u128_cmp(b, next) <= 0;
+}
+
+
+static void
+addr6_halves(
+	const uint8_t *	b,
+	uint64_t	h[2]
+	)
+{
+	h[0] = h[1] = 0;
+	for (int i = 0; i < 8; i++) {
+		h[0] = (h[0] << 8) | b[i];
+		h[1] = (h[1] << 8) | b[8 + i];
+	}
+}
+
+
+static int
+range4_cmp(
+	const void *	va,
+	const void *	vb
+	)
+{
+	const struct res_range4 *a = va;
+	const struct res_range4 *b = vb;
+
+	if (a->lo != b->lo)
+		return (a->lo < b->lo) ? -1 : 1;
+	return 0;
+}
+
+
+static int
+range6_cmp(
+	const void *	va,
+	const void *	vb
+	)
+{
+	const struct res_range6 *a = va;
+	const struct res_range6 *b = vb;
+
+	return u128_cmp(a->lo, b->lo);
+}
+
+
+/*
+ * res_set_match - whether the restrict set has this source
+ */
+static bool
+res_set_match(
+	const struct res_set *rs,
+	sockaddr_u *srcadr
+	)
+{
+	size_t		lo, hi, mid;
+	uint32_t	a4;
+	uint64_t	a6[2];
+
+	if (NULL == rs)
+		return false;
+	/* find the last range starting at or before the address */
+	lo = 0;
+	if (IS_IPV4(srcadr)) {
+		a4 = SRCADR(srcadr);
+		hi = rs->n4;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (rs->r4[mid].lo <= a4)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo > 0 && a4 <= rs->r4[lo - 1].hi;
+	}
+	if (IS_IPV6(srcadr)) {
+		addr6_halves(PSOCK_ADDR6(srcadr)->s6_addr, a6);
+		hi = rs->n6;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (u128_cmp(rs->r6[mid].lo, a6) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo > 0 && u128_cmp(a6, rs->r6[lo - 1].hi) <= 0;
+	}
+	return false;
+}
+
+
+/*
+ * res_set_prefix - add the address or address/length in tok to the
+ * set's ranges; false if it isn't one
+ */
+static bool
+res_set_prefix(
+	struct res_set *rs,
+	const char *	tok,
+	size_t		len
+	)
+{
+	char		buf[INET6_ADDRSTRLEN + 5];
+	char *		slash;
+	char *		end;
+	struct in_addr	in4;
+	struct in6_addr	in6;
+	uint32_t	a4, mask4;
+	uint64_t	a6[2], mask6[2];
+	long		plen, maxlen;
+	size_t		alloc;
+
+	if (len >= sizeof(buf))
+		return false;
+	memcpy(buf, tok, len);
+	buf[len] = '\0';
+	maxlen = (NULL != strchr(buf, ':')) ? 128 : 32;
+	plen = maxlen;
+	slash = strchr(buf, '/');
+	if (NULL != slash) {
+		*slash++ = '\0';
+		plen = strtol(slash, &end, 10);
+		if (end == slash || '\0' != *end || plen < 0 || plen > maxlen)
+			return false;
+	}
+
+	if (32 == maxlen) {
+		if (1 != inet_pton(AF_INET, buf, &in4))
+			return false;
+		a4 = ntohl(in4.s_addr);
+		mask4 = (0 == plen) ? 0 : UINT32_MAX << (32 - plen);
+		if (rs->n4 == rs->alloc4) {
+			alloc = rs->alloc4 ? 2 * rs->alloc4 : 1024;
+			rs->r4 = erealloc_tag(MEM_RESTRICT, rs->r4,
+					      alloc * sizeof(*rs->r4),
+					      rs->alloc4 * sizeof(*rs->r4));
+			rs->alloc4 = alloc;
+		}
+		rs->r4[rs->n4].lo = a4 & mask4;
+		rs->r4[rs->n4].hi = a4 | ~mask4;
+		rs->n4++;
+		return true;
+	}
+
+	if (1 != inet_pton(AF_INET6, buf, &in6))
+		return false;
+	addr6_halves(in6.s6_addr, a6);
+	mask6[0] = (plen >= 64) ? UINT64_MAX
+		 : (0 == plen) ? 0 : UINT64_MAX << (64 - plen);
+	mask6[1] = (plen <= 64) ? 0 : UINT64_MAX << (128 - plen);
+	if (rs->n6 == rs->alloc6) {
+		alloc = rs->alloc6 ? 2 * rs->alloc6 : 1024;
+		rs->r6 = erealloc_tag(MEM_RESTRICT, rs->r6,
+				      alloc * sizeof(*rs->r6),
+				      rs->alloc6 * sizeof(*rs->r6));
+		rs->alloc6 = alloc;
+	}
+	for (int i = 0; i < 2; i++) {
+		rs->r6[rs->n6].lo[i] = a6[i] & mask6[i];
+		rs->r6[rs->n6].hi[i] = a6[i] | ~mask6[i];
+	}
+	rs->n6++;
+	return true;
+}
+
+
+/*
+ * res_set_merge - sort the ranges and merge those that overlap or
+ * touch, so at most one range holds any address
+ */
+static void
+res_set_merge(
+	struct res_set *rs
+	)
+{
+	size_t	i, out;
+
+	if (rs->n4 > 1) {
+		qsort(rs->r4, rs->n4, sizeof(*rs->r4), range4_cmp);
+		for (i = 1, out = 0; i < rs->n4; i++) {
+			if ((uint64_t)rs->r4[out].hi + 1 >= rs->r4[i].lo) {
+				if (rs->r4[i].hi > rs->r4[out].hi)
+					rs->r4[out].hi = rs->r4[i].hi;
+			} else {
+				rs->r4[++out] = rs->r4[i];
+			}
+		}
+		rs->n4 = out + 1;
+	}
+	if (rs->n6 > 1) {
+		qsort(rs->r6, rs->n6, sizeof(*rs->r6), range6_cmp);
+		for (i = 1, out = 0; i < rs->n6; i++) {
+			if (u128_reaches(rs->r6[out].hi, rs->r6[i].lo)) {
+				if (u128_cmp(rs->r6[i].hi, rs->r6[out].hi) > 0)
+					memcpy(rs->r6[out].hi, rs->r6[i].hi,
+					       sizeof(rs->r6[out].hi));
+			} else {
+				rs->r6[++out] = rs->r6[i];
+			}
+		}
+		rs->n6 = out + 1;
+	}
+}
+
+
+/*
+ * res_set_read - read a set file, if it changed since sb or in any
+ * case if force.  NULL if there is nothing new to use.  The file is
+ * read whole into one buffer and parsed there: one prefix per line,
+ * as an address or address/length, with # comments.
+ */
+static struct res_set *
+res_set_read(
+	const char *	path,
+	struct stat *	sb,
+	bool		force,
+	bool		logall,
+	unsigned short	flags
+	)
+{
+	struct res_set *rs;
+	struct stat	sb_new;
+	char *		buf;
+	const char *	p;
+	const char *	eol;
+	const char *	end;
+	const char *	tok;
+	size_t		size, got;
+	ssize_t		n = 0;
+	unsigned long	line = 0, bad = 0;
+	int		fd;
+
+	/* coverity[toctou] */
+	if (0 != stat(path, &sb_new)) {
+		if (logall)
+			msyslog(LOG_ERR, "RESTRICT: set %s: %s", path,
+				strerror(errno));
+		return NULL;
+	}
+	if (!force && sb->st_mtime == sb_new.st_mtime &&
+	    sb->st_ctime == sb_new.st_ctime &&
+	    sb->st_ino == sb_new.st_ino && sb->st_size == sb_new.st_size)
+		return NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (logall)
+			msyslog(LOG_ERR, "RESTRICT: set %s: %s", path,
+				strerror(errno));
+		return NULL;
+	}
+	size = (size_t)sb_new.st_size;
+	buf = emalloc(size + 1);
+	for (got = 0; got < size; got += (size_t)n) {
+		n = read(fd, buf + got, size - got);
+		if (n < 0 && EINTR == errno)
+			n = 0;
+		else if (n <= 0)
+			break;
+	}
+	close(fd);
+	if (got < size) {
+		/* being written; the watcher will see it change again */
+		if (logall)
+			msyslog(LOG_ERR, "RESTRICT: set %s: short read: %s",
+				path, (n < 0) ? strerror(errno) : "EOF");
+		free(buf);
+		return NULL;
+	}
+	*sb = sb_new;
+
+	rs = emalloc_zero_tag(MEM_RESTRICT, sizeof(*rs));
+	rs->flags = flags;
+	for (p = buf, end = buf + got; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', (size_t)(end - p));
+		if (NULL == eol)
+			eol = end;
+		line++;
+		while (p < eol && isspace((unsigned char)*p))
+			p++;
+		if (p == eol || '#' == *p)
+			continue;
+		tok = p;
+		while (p < eol && !isspace((unsigned char)*p) && '#' != *p)
+			p++;
+		if (res_set_prefix(rs, tok, (size_t)(p - tok)))
+			rs->prefixes++;
+		else if (bad++ < 5)
+			msyslog(LOG_ERR, "RESTRICT: set %s line %lu: "
+				"not a prefix, ignored", path, line);
+	}
+	free(buf);
+	res_set_merge(rs);
+	rs->loaded = time(NULL);
+	msyslog(LOG_INFO, "RESTRICT: set %s: %lu prefixes, "
+		"%zu IPv4 and %zu IPv6 ranges%s", path, rs->prefixes,
+		rs->n4, rs->n6, (bad > 0) ? ", some lines ignored" : "");
+	return rs;
+}
+
+
+static void
+res_set_free(
+	struct res_set *rs
+	)
+{
+	if (NULL == rs)
+		return;
+	free_tag(MEM_RESTRICT, rs->r4, rs->alloc4 * sizeof(*rs->r4));
+	free_tag(MEM_RESTRICT, rs->r6, rs->alloc6 * sizeof(*rs->r6));
+	free_tag(MEM_RESTRICT, rs, sizeof(*rs));
+}
+
+
+/*
+ * res_set_install - use rs as the restrict set
+ */
+static void
+res_set_install(
+	struct res_set *rs
+	)
+{
+	const struct res_snap *snap = res_snap_load();
+
+	if (NULL != res_set && (RES_LIMITED & res_set->flags))
+		dec_res_limited();
+	/* a published set goes when the last snapshot using it does */
+	if (NULL != snap && snap->set == res_set)
+		res_dead_set = res_set;
+	else
+		res_set_free(res_set);
+	res_set = rs;
+	if (NULL != res_set && (RES_LIMITED & res_set->flags))
+		inc_res_limited();
+	res_dirty = true;
+}
+
+
+/*
+ * res_set_changed - the file watcher's callback.  Reads the set file,
+ * if it changed, for check_restrict_pending().
+ */
+static void
+res_set_changed(
+	const char *	path,
+	struct stat *	sb,
+	bool		verbose
+	)
+{
+	struct res_set *rs;
+	unsigned short	flags;
+	bool		current;
+
+	pthread_mutex_lock(&res_set_lock);
+	current = (NULL != res_set_path && 0 == strcmp(path, res_set_path));
+	flags = res_set_flags;
+	pthread_mutex_unlock(&res_set_lock);
+	if (!current)
+		return;		/* no longer configured */
+
+	rs = res_set_read(path, sb, false, verbose, flags);
+	if (NULL == rs)
+		return;
+	pthread_mutex_lock(&res_set_lock);
+	if (NULL != res_set_path && 0 == strcmp(path, res_set_path) &&
+	    flags == res_set_flags) {
+		res_set_free(res_set_pending);
+		res_set_pending = rs;
+		rs = NULL;
+	}
+	pthread_mutex_unlock(&res_set_lock);
+	res_set_free(rs);
+}
+
+
+/*
+ * restrict_set - from now on, give sources with an address in one of
+ * the prefixes in path flags too, reading the file again when it
+ * changes.  A NULL path drops the set.  Once the file watcher is
+ * running, the file is read there and the old set holds until then.
+ */
+void
+restrict_set(
+	const char *	path,
+	unsigned short	flags
+	)
+{
+	struct res_set *rs = NULL;
+	struct stat	sb;
+
+	pthread_mutex_lock(&res_set_lock);
+	free(res_set_path);
+	res_set_path = (NULL != path) ? estrdup(path) : NULL;
+	res_set_flags = flags;
+	res_set_free(res_set_pending);
+	res_set_pending = NULL;
+	pthread_mutex_unlock(&res_set_lock);
+
+	if (NULL != path) {
+		if (filewatch_load(path, res_set_changed))
+			return;
+		ZERO(sb);
+		rs = res_set_read(path, &sb, true, true, flags);
+		/* watched even if unreadable, to load it once it's fixed */
+		filewatch_add(path, &sb, res_set_changed);
+	}
+	res_set_install(rs);
+}
+
+
+/*
+ * check_restrict_pending - once a second: start using a restrict set
+ * the file watcher has read, and finish off retired snapshots
+ */
+void
+check_restrict_pending(void)
+{
+	struct res_set *rs;
+
+	pthread_mutex_lock(&res_set_lock);
+	rs = res_set_pending;
+	res_set_pending = NULL;
+	pthread_mutex_unlock(&res_set_lock);
+	if (NULL != rs)
+		res_set_install(rs);
+	restrict_publish();
+}
+
+
+/*
+ * restrict_set_info - the restrict set's file, prefix count, hits and
+ * flags, for ntpq reslist.  false if there is none.
+ */
+bool
+restrict_set_info(
+	const char **	path,
+	unsigned long *	prefixes,
+	uint64_t *	hits,
+	unsigned short *flags
+	)
+{
+	/* only the main thread changes res_set_path */
+	if (NULL == res_set_path)
+		return false;
+	*path = res_set_path;
+	*prefixes = (NULL != res_set) ? res_set->prefixes : 0;
+	*hits = (NULL != res_set) ? res_set->hits : 0;
+	*flags = res_set_flags;
+	return true;
+}
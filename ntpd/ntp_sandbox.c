@@ -233,16 +233,24 @@ getgroup:
 			 *  We may be running under non-root uid now,
 			 *  but we still hold full root privileges!
 			 *  We drop all of them, except for the
-			 *  crucial few: cap_sys_nice, cap_sys_time and
+			 *  crucial few: cap_sys_nice, cap_sys_time,
 			 *  cap_net_bind_service for doing dynamic
-			 *  interface tracking.
+			 *  interface tracking and cap_bpf for updating
+			 *  the bpffilter map on older kernels.
 			 */
 			cap_t caps;
-			const char *captext;
+			char captext[80];
+			const char *bpfcap = "";
 
-			captext = want_dynamic_interface_tracking
-				      ? "cap_sys_nice,cap_sys_time,cap_net_bind_service=pe"
-				      : "cap_sys_nice,cap_sys_time=pe";
+#ifdef CAP_BPF
+			if (bpf_filter_loaded())
+				bpfcap = ",cap_bpf";
+#endif
+			snprintf(captext, sizeof(captext),
+				 "cap_sys_nice,cap_sys_time%s%s=pe",
+				 want_dynamic_interface_tracking
+				     ? ",cap_net_bind_service" : "",
+				 bpfcap);
 			caps = cap_from_text(captext);
 			if (!caps) {
 				msyslog(LOG_ERR,
@@ -317,6 +325,9 @@ int scmp_sc[] = {
 	SCMP_SYS(clock_settime),
 	SCMP_SYS(close),
 	SCMP_SYS(connect),
+	SCMP_SYS(epoll_create1),	/* event backend */
+	SCMP_SYS(epoll_ctl),
+	SCMP_SYS(epoll_pwait),
 	SCMP_SYS(exit),
 	SCMP_SYS(exit_group),
 	SCMP_SYS(fcntl),
@@ -325,6 +336,14 @@ int scmp_sc[] = {
 	SCMP_SYS(futex),	/* sem_xxx, used by threads */
 	SCMP_SYS(getdents),	/* Scanning /etc/ntp.d/ */
 	SCMP_SYS(getegid),	/* Needed on Alpine */
+#ifdef __NR_io_uring_setup
+	SCMP_SYS(io_uring_setup),	/* iouring */
+	SCMP_SYS(io_uring_enter),
+	SCMP_SYS(io_uring_register),
+#endif
+#ifdef __NR_bpf
+	SCMP_SYS(bpf),		/* bpffilter map updates */
+#endif
 	SCMP_SYS(getgid),	/* Needed on Alpine */
 	SCMP_SYS(getdents64),
 
@@ -343,6 +362,8 @@ int scmp_sc[] = {
 	SCMP_SYS(getsockopt),
 	SCMP_SYS(gettimeofday),	/* mkstemp */
 	SCMP_SYS(getuid),	/* Needed on Alpine */
+	SCMP_SYS(inotify_add_watch),	/* file watcher */
+	SCMP_SYS(inotify_init1),
 	SCMP_SYS(ioctl),
 	SCMP_SYS(link),
 	SCMP_SYS(listen),
@@ -354,6 +375,10 @@ int scmp_sc[] = {
 #ifdef __NR_openat
 	SCMP_SYS(openat),	/* SUSE */
 #endif
+#ifdef __NR_pipe
+	SCMP_SYS(pipe),		/* file watcher */
+#endif
+	SCMP_SYS(pipe2),
 	SCMP_SYS(poll),
 	SCMP_SYS(pselect6),
 	SCMP_SYS(read),
@@ -363,7 +388,24 @@ int scmp_sc[] = {
 				* (Or maybe sooner if a request arrives.)
 				*/
 	SCMP_SYS(recvmsg),
+#ifdef __NR_recvmmsg
+	SCMP_SYS(recvmmsg),	/* batched receive */
+#endif
+#if defined(__NR_recvmmsg_time64) && defined(__SNR_recvmmsg_time64)
+	SCMP_SYS(recvmmsg_time64),	/* 32-bit, 64-bit time_t */
+#endif
 	SCMP_SYS(rename),
+	SCMP_SYS(sched_get_priority_max),	/* PPS capture thread */
+	SCMP_SYS(sched_get_priority_min),	/* thread priority */
+	SCMP_SYS(sched_getaffinity),	/* thread cpu */
+	SCMP_SYS(sched_setaffinity),	/* thread cpu */
+	SCMP_SYS(sched_setscheduler),	/* metrics thread, SCHED_IDLE */
+	SCMP_SYS(getpriority),	/* thread nice */
+	SCMP_SYS(gettid),	/* thread nice */
+	SCMP_SYS(setpriority),	/* thread nice */
+#ifdef __NR_set_mempolicy
+	SCMP_SYS(set_mempolicy),	/* thread node */
+#endif
 	SCMP_SYS(rt_sigaction),
 	SCMP_SYS(rt_sigprocmask),
 	SCMP_SYS(rt_sigreturn),
@@ -400,6 +442,7 @@ int scmp_sc[] = {
 	SCMP_SYS(write),
 	SCMP_SYS(writev),	/* Needed on Alpine 3.11.3 */
 	SCMP_SYS(unlink),
+	SCMP_SYS(utimensat),	/* compressed stats keep their mtime */
 
 /* Don't comment out this block for testing.
  * pthread_create blocks signals so it will crash
@@ -411,7 +454,7 @@ int scmp_sc[] = {
 	SCMP_SYS(madvise),
 	SCMP_SYS(mprotect),
 	SCMP_SYS(set_robust_list),
-	SCMP_SYS(sendmmsg),	/* DNS lookup */
+	SCMP_SYS(sendmmsg),	/* DNS lookup, batched replies */
 	SCMP_SYS(socketpair),
 	SCMP_SYS(statfs),
 	SCMP_SYS(uname),
@@ -461,6 +504,15 @@ int scmp_sc[] = {
 	SCMP_SYS(linkat),
 	SCMP_SYS(unlinkat),
 #endif
+/* 32-bit systems with a 64-bit time_t */
+#if defined(__NR_clock_gettime64) && defined(__SNR_clock_gettime64)
+	SCMP_SYS(clock_gettime64),
+	SCMP_SYS(clock_adjtime64),
+	SCMP_SYS(clock_settime64),
+	SCMP_SYS(futex_time64),
+	SCMP_SYS(ppoll_time64),
+	SCMP_SYS(pselect6_time64),
+#endif
 #if defined(__i386__) || defined(__arm__) || defined(__powerpc__)
 	SCMP_SYS(_newselect),
 	SCMP_SYS(_llseek),
@@ -468,6 +520,37 @@ int scmp_sc[] = {
 	SCMP_SYS(send),
 	SCMP_SYS(stat64),
 #endif
+};
+/*
+ * The packet path's system calls, busiest first on a loaded server:
+ * each wakeup of the main loop or a worker reads a batch and answers
+ * it with one send.  Before Linux 5.11 cached the verdict for system
+ * calls a filter always allows, the filter ran on every system call
+ * as a chain of comparisons, and libseccomp puts the rules with the
+ * highest priority first.  The rest fall in after these.
+ */
+int scmp_hot[] = {
+#ifdef __NR_recvmmsg
+	SCMP_SYS(recvmmsg),
+#endif
+#if defined(__NR_recvmmsg_time64) && defined(__SNR_recvmmsg_time64)
+	SCMP_SYS(recvmmsg_time64),
+#endif
+	SCMP_SYS(sendmmsg),
+	SCMP_SYS(epoll_pwait),	/* main loop */
+	SCMP_SYS(poll),		/* workers */
+	SCMP_SYS(futex),	/* proto_lock */
+#if defined(__NR_futex_time64) && defined(__SNR_futex_time64)
+	SCMP_SYS(futex_time64),
+#endif
+	SCMP_SYS(recvmsg),	/* no recvmmsg, transmit timestamps */
+	SCMP_SYS(sendmsg),
+	SCMP_SYS(sendto),
+	SCMP_SYS(clock_gettime),	/* when not in the vDSO */
+#if defined(__NR_clock_gettime64) && defined(__SNR_clock_gettime64)
+	SCMP_SYS(clock_gettime64),
+#endif
+	SCMP_SYS(write),	/* statistics */
 };
 	{
 		for (unsigned int i = 0; i < COUNTOF(scmp_sc); i++) {
@@ -478,6 +561,14 @@ int scmp_sc[] = {
 			    exit(1);
 			}
 		}
+		for (unsigned int i = 0; i < COUNTOF(scmp_hot); i++) {
+			/* only a matter of speed */
+			if (seccomp_syscall_priority(ctx, scmp_hot[i],
+			    (uint8_t)(255 - i)) < 0)
+				msyslog(LOG_DEBUG,
+				    "INIT: sandbox: seccomp_syscall_priority(%d) failed",
+				    scmp_hot[i]);
+		}
 	}
 
 	if (0) {
@@ -45,6 +45,7 @@
  */
 
 #define MAX_LEXEME (1024 + 1)	/* The maximum size of a lexeme */
+#define LEX_BUFSIZE	65536	/* file read buffer */
 static char yytext[MAX_LEXEME];	/* Buffer for storing the input text/lexeme */
 static uint32_t conf_file_sum;	/* Simple sum of characters read */
 
@@ -118,6 +119,10 @@ keyword(
  * FILE_INFO structure. This is sufficient, as the parser does *not*
  * jump around via 'seek' or the like, and there's no need to
  * check/clear the backup store in other places than 'lex_getch()'.
+ *
+ * Files are read a buffer at a time with fread() and handed out from
+ * there, so a generated configuration of many thousands of lines
+ * doesn't pay for a locked fgetc() per character.
  */
 
 /*
@@ -156,11 +161,29 @@ lex_open(
 			msyslog(LOG_ERR, "CONFIG: failed to open \'%s\': %s",
 				path, strerror(errno));
 			stream = NULL;
+		} else {
+			stream->buf = emalloc(LEX_BUFSIZE);
 		}
 	}
 	return stream;
 }
 
+/* get the next byte of a file from its read buffer */
+static inline int
+lex_fgetc(
+	struct FILE_INFO *stream
+	)
+{
+	if (stream->bufpos == stream->buflen) {
+		stream->buflen = fread(stream->buf, 1, LEX_BUFSIZE,
+				       stream->fpi);
+		stream->bufpos = 0;
+		if (0 == stream->buflen)
+			return EOF;
+	}
+	return (uint8_t)stream->buf[stream->bufpos++];
+}
+
 /* get next character from buffer or file. This will return any putback
  * character first; it will also make sure the last line is at least
  * virtually terminated with a '\n'.
@@ -183,7 +206,7 @@ lex_getch(
 	} else if (stream->fpi) {
 		/* fetch next 7-bit ASCII char (or EOF) from file */
 		/* coverity[tainted_scalar] */
-		while ((ch = fgetc(stream->fpi)) != EOF && ch > SCHAR_MAX) {
+		while ((ch = lex_fgetc(stream)) != EOF && ch > SCHAR_MAX) {
 			stream->curpos.ncol++;
 		}
 		if (EOF != ch) {
@@ -268,6 +291,7 @@ lex_close(
 		if (NULL != stream->fpi) {
 			fclose(stream->fpi);
 		}
+		free(stream->buf);
 		free(stream);
 	}
 }
@@ -549,31 +573,17 @@ is_keyword(
 	follby *pfollowedby
 	)
 {
-	follby fb;
-	int curr_s;		/* current state index */
-	int token;
-
-	curr_s = SCANNER_INIT_S;
-	token = 0;
-
-	for (int i = 0; lexeme[i]; i++) {
-		while (curr_s && (lexeme[i] != SS_CH(sst[curr_s])))
-			curr_s = (int)SS_OTHER_N(sst[curr_s]);
-
-		if (curr_s && (lexeme[i] == SS_CH(sst[curr_s]))) {
-			if ('\0' == lexeme[i + 1]
-			    && FOLLBY_NON_ACCEPTING
-			       != SS_FB(sst[curr_s])) {
-				fb = SS_FB(sst[curr_s]);
-				*pfollowedby = fb;
-				token = curr_s;
-				break;
-			}
-			curr_s = SS_MATCH_N(sst[curr_s]);
-		} else
-			break;
-	}
+	uint64_t hash;
+	int token;		/* keyword in the lexeme's slot */
+
+	hash = kw_hash(lexeme);
+	token = kw_token[kw_hash_slot(hash, kw_disp[hash & (KW_BUCKETS - 1)])
+			 & (KW_SLOTS - 1)];
+	if (0 == token
+	    || strcmp(keyword_text[token - LOWEST_KEYWORD_ID], lexeme))
+		return 0;
 
+	*pfollowedby = SS_FB(sst[token]);
 	return token;
 }
 
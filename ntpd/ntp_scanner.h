@@ -84,6 +84,35 @@ typedef enum {
 
 typedef uint32_t scan_state;
 
+/*
+ * keyword-gen also builds a perfect hash table of the keywords, which
+ * is what the scanner looks lexemes up in.  The FNV-1a hash of a
+ * keyword picks a bucket by its low bits; the bucket's displacement,
+ * mixed into the high bits, picks the slot holding the token.
+ * keyword-gen chooses the displacements so that no two keywords share
+ * a slot, so a lookup is one hash, one probe and one strcmp().
+ */
+static inline uint64_t kw_hash(const char *s) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while ('\0' != *s) {
+		h ^= (uint8_t)*s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static inline uint32_t kw_hash_slot(uint64_t h, unsigned int disp) {
+	uint32_t x = (uint32_t)(h >> 32) + disp * 0x9e3779b9U;
+
+	x ^= x >> 16;
+	x *= 0x85ebca6bU;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35U;
+	x ^= x >> 16;
+	return x;
+}
+
 struct LCPOS {
 	int nline;
 	int ncol;
@@ -105,6 +134,10 @@ struct FILE_INFO {
 	struct LCPOS       tokpos;	/* current token position */
 	struct LCPOS       errpos;	/* error position */
 
+	char *		   buf;		/* read buffer, files only */
+	size_t		   buflen;	/* bytes in buf */
+	size_t		   bufpos;	/* next byte to hand out */
+
 	char               fname[1];	/* (formal only) buffered name */
 };
 
@@ -0,0 +1,199 @@
+/*
+ * ntp_select - the interval and cluster algorithms of clock_select()
+ *
+ * These work on the candidate list clock_select() builds and touch no
+ * other protocol state, so the tests can hold them up against the
+ * straightforward versions.
+ *
+ * Every candidate's interval moves on each call, since root distance
+ * grows with time, but the order of the endpoints hardly changes.  So
+ * each peer remembers where its endpoints landed last time, and the
+ * next call starts from that order: an insertion sort then does about
+ * one comparison per endpoint.  The cluster algorithm keeps a running
+ * sum of squared offset differences for each survivor and takes out
+ * the terms of the one voted off, instead of summing afresh each round.
+ */
+
+#include "config.h"
+
+#include <math.h>
+
+#include "ntpd.h"
+
+#define DIFF(x, y)	(SQUARE((x) - (y)))
+
+/*
+ * endp_before - the endpoint order: by offset, lower ends first on a
+ * tie, so intervals that only touch still intersect
+ */
+static inline bool
+endp_before(
+	const struct endpoint *a,
+	const struct endpoint *b
+	)
+{
+	return a->val < b->val || (!(a->val > b->val) && a->type < b->type);
+}
+
+
+/*
+ * select_endpoints - fill ep[] with the 2 * nlist interval endpoints
+ * of the candidates, sorted.  tmp[] is scratch of the same size.
+ */
+void
+select_endpoints(
+	const peer_select *peers,
+	int		nlist,
+	struct endpoint *ep,
+	struct endpoint *tmp
+	)
+{
+	int	nl2 = 2 * nlist;
+	int	top = nl2;	/* overflow fills ep[] from the top down */
+	int	n, i, j;
+
+	for (i = 0; i < nl2; i++)
+		tmp[i].peer = NULL;
+
+	/* put each endpoint back where it was, if that place is free */
+	for (i = 0; i < nlist; i++) {
+		struct peer *p = peers[i].peer;
+
+		for (int end = 0; end < 2; end++) {
+			struct endpoint e;
+			int	rank = p->sel_rank[end];
+
+			e.type = end ? 1 : -1;
+			e.val = p->offset + e.type * peers[i].synch;
+			e.peer = p;
+			if (rank >= 1 && rank <= nl2 &&
+			    NULL == tmp[rank - 1].peer)
+				tmp[rank - 1] = e;
+			else
+				ep[--top] = e;
+		}
+	}
+	for (i = 0, n = 0; i < nl2; i++)
+		if (NULL != tmp[i].peer)
+			ep[n++] = tmp[i];
+
+	/* insertion sort: cheap when little has moved */
+	for (i = 1; i < nl2; i++) {
+		struct endpoint e = ep[i];
+
+		for (j = i; j > 0 && endp_before(&e, &ep[j - 1]); j--)
+			ep[j] = ep[j - 1];
+		ep[j] = e;
+	}
+
+	for (i = 0; i < nl2; i++)
+		ep[i].peer->sel_rank[ep[i].type > 0] = i + 1;
+}
+
+
+/*
+ * select_intersect - Marzullo's algorithm as modified for NTP.  Find
+ * the smallest interval (low, high) holding points from the most
+ * candidates, allowing for fewer than half of them to be falsetickers.
+ * When there are no truechimers, high <= low.
+ */
+void
+select_intersect(
+	const struct endpoint *ep,
+	int	nlist,
+	double	*lowp,
+	double	*highp
+	)
+{
+	int	nl2 = 2 * nlist;
+	int	allow, i, j, n;
+	double	low = 1e9, high = -1e9;
+
+	for (allow = 0; 2 * allow < nlist; allow++) {
+		n = 0;
+		for (i = 0; i < nl2; i++) {
+			low = ep[i].val;
+			n -= ep[i].type;
+			if (n >= nlist - allow)
+				break;
+		}
+		n = 0;
+		for (j = nl2 - 1; j >= 0; j--) {
+			high = ep[j].val;
+			n += ep[j].type;
+			if (n >= nlist - allow)
+				break;
+		}
+		if (high > low)
+			break;
+	}
+	*lowp = low;
+	*highp = high;
+}
+
+
+/*
+ * select_cluster - vote outliers off the island by select jitter
+ * weighted by root distance, as long as more than minclock survive
+ * and the worst select jitter is more than the least peer jitter.
+ * Stop short of a TRUE or PREFER peer.  Those voted off while more
+ * than maxclock remain are marked CTL_PST_SEL_EXCESS.  Fills in
+ * seljit for the survivors and returns how many there are.  sum[] is
+ * scratch for nlist doubles.
+ */
+int
+select_cluster(
+	peer_select *peers,
+	int	nlist,
+	int	minclock,
+	int	maxclock,
+	double	*sum
+	)
+{
+	int	i, j, k;
+	double	d, e, g;
+
+	/* sum[i] is the sum of (offset_j - offset_i)^2 over survivors */
+	for (i = 0; i < nlist; i++) {
+		sum[i] = 0;
+		for (j = 0; j < nlist; j++)
+			sum[i] += DIFF(peers[j].peer->offset,
+				       peers[i].peer->offset);
+	}
+
+	while (1) {
+		d = 1e9;	/* minimum peer jitter */
+		e = -1e9;	/* worst peer select jitter * synch */
+		g = 0;		/* worst peer select jitter */
+		k = 0;		/* index of the worst peer */
+		for (i = 0; i < nlist; i++) {
+			if (peers[i].error < d)
+				d = peers[i].error;
+			peers[i].seljit = 0;
+			if (nlist > 1 && sum[i] > 0)
+				peers[i].seljit = SQRT(sum[i] / (nlist - 1));
+			if (peers[i].seljit * peers[i].synch > e) {
+				g = peers[i].seljit;
+				e = peers[i].seljit * peers[i].synch;
+				k = i;
+			}
+		}
+		if (nlist <= max(1, minclock) || g <= d ||
+		    ((FLAG_TRUE | FLAG_PREFER) & peers[k].peer->cfg.flags))
+			break;
+
+		DPRINT(3, ("select: drop %s seljit %.6f jit %.6f\n",
+			   socktoa(&peers[k].peer->srcadr), g, d));
+		if (nlist > maxclock)
+			peers[k].peer->new_status = CTL_PST_SEL_EXCESS;
+		for (j = 0; j < nlist; j++)
+			sum[j] -= DIFF(peers[k].peer->offset,
+				       peers[j].peer->offset);
+		for (j = k + 1; j < nlist; j++) {
+			peers[j - 1] = peers[j];
+			sum[j - 1] = sum[j];
+		}
+		nlist--;
+	}
+	return nlist;
+}
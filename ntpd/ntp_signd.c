@@ -14,11 +14,13 @@
 #include "ntp_stdlib.h"
 #include "timespecops.h"
 
+#include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <sys/un.h>
 
@@ -43,13 +45,72 @@ static struct do_we_log do_we_log_signd = {
 
 static uint32_t signd_count = 1;
 
+/*
+ * One connection to Samba stays open and carries every request.  The
+ * reply echoes the request's packet_id, so many can be outstanding at
+ * once: requests are written without waiting, and the main loop reads
+ * the replies as Samba sends them and finishes each one, rather than
+ * every Windows client stalling the daemon for a connect and a round
+ * trip of its own.
+ *
+ * packet_id picks the slot a request waits in.  If that slot is still
+ * taken, Samba is SIGND_PENDING requests behind, and the new one is
+ * dropped.  A request unanswered after SIGND_TIMEOUT means Samba is
+ * stuck; the connection is closed, failing what is still waiting, and
+ * opened again for the next request.
+ */
+#define SIGND_PENDING	64		/* requests awaiting Samba */
+#define SIGND_TIMEOUT	2400		/* ms */
+#define SIGND_HEADER	12U		/* reply version, op, packet_id */
+#define SIGND_MAX_REPLY	1512U
+
+struct samba_key_in {
+	uint32_t version;
+	uint32_t op;
+	uint32_t packet_id;
+	uint32_t key_id_le;
+	char pkt[LEN_PKT_NOMAC];
+};
+
+struct samba_key_out {
+	uint32_t version;
+	uint32_t op;
+	uint32_t packet_id;
+};
+
+#define SIGND_REQUEST	(sizeof(uint32_t) + sizeof(struct samba_key_in))
+
+struct signd_request {
+	bool		busy;
+	uint32_t	packet_id;
+	sockaddr_u	client;		/* reply goes to */
+	endpt *		dstadr;		/* from */
+	keyid_t		keyid;
+	struct timespec	start;
+};
+
+static struct signd_request pending[SIGND_PENDING];
+static int	signd_fd = -1;
+static uptime_t	signd_retry;		/* no connect attempt before */
+
+/* requests not yet taken by the socket, all of them waiting above */
+static char	outbuf[SIGND_PENDING * SIGND_REQUEST];
+static size_t	outlen;
+/* a partly read reply */
+static char	inbuf[sizeof(uint32_t) + SIGND_MAX_REPLY];
+static size_t	inlen;
+
+static void	signd_close	(void);
+static void	signd_flush	(void);
+static void	signd_input	(SOCKET);
+static void	signd_reply	(char *, uint32_t);
+
 /*
   connect to a unix domain socket
 */
 static int
 ux_socket_connect(const char *name)
 {
-	struct timeval tv = { .tv_sec=2, .tv_usec=400000};
 	int fd;
 	struct sockaddr_un addr;
 	if (!name) {
@@ -70,8 +131,8 @@ ux_socket_connect(const char *name)
 		return -1;
 	}
 
-	// FIXME: Chutzpah code ... always works so well.
-	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const void *)&tv, sizeof(tv));
+	/* A full listen queue fails rather than blocking the main loop */
+	make_socket_nonblocking(fd);
 
 	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
 		char errbuf[ERR_BUF_LEN];
@@ -86,111 +147,195 @@ ux_socket_connect(const char *name)
 	return fd;
 }
 
+/*
+  open the connection to Samba if it isn't, at most once a second
+*/
+static bool
+signd_open(void)
+{
+	char full_socket[256];
+
+	if (signd_fd >= 0)
+		return true;
+	if (current_time < signd_retry)
+		return false;
+	signd_retry = current_time + 1;
+
+	snprintf(full_socket, sizeof(full_socket), "%s/socket", ntp_signd_socket);
+	signd_fd = ux_socket_connect(full_socket);
+	if (signd_fd < 0)
+		return false;
+	outlen = 0;
+	inlen = 0;
+	io_add_reader(signd_fd, signd_input);
+	return true;
+}
 
 /*
-  keep writing until its all sent
+  close the connection, failing every request still waiting on it
 */
-static size_t
-write_all(int fd, const void *buf, size_t len)
+static void
+signd_close(void)
 {
-	size_t total = 0;
-	while (len) {
-		ssize_t n = write(fd, buf, len);
-		if (n <= 0) return total;
-		buf = n + (const char *)buf;
-		len -= (unsigned int)n;
-		total += (unsigned int)n;
-	}
-	return total;
+	if (signd_fd >= 0)
+		io_close_reader(signd_fd);
+	signd_fd = -1;
+	outlen = 0;
+	inlen = 0;
+	for (int i = 0; i < SIGND_PENDING; i++)
+		if (pending[i].busy) {
+			pending[i].busy = false;
+			mssntp_cnt.serves_err++;
+		}
 }
 
 /*
-  keep reading until its all read
+  hand Samba as much of the queued requests as it will take
 */
-static size_t
-read_all(int fd, void *buf, size_t len)
+static void
+signd_flush(void)
 {
-	size_t total = 0;
-	while (len) {
-		ssize_t n = read(fd, buf, len);
-		if (n <= 0) return total;
-		buf = n + (char *)buf;
-		len -= (unsigned int)n;
-		total += (unsigned int)n;
+	ssize_t n;
+
+	while (outlen > 0) {
+		n = write(signd_fd, outbuf, outlen);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+			return;		/* the rest goes on the next flush */
+		if (n <= 0) {
+			char errbuf[ERR_BUF_LEN];
+			ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+			maybe_log(&do_we_log_signd, LOG_DEBUG,
+				"SIGND: can not send packet to samba: %s",
+				errbuf);
+			signd_close();
+			return;
+		}
+		outlen -= (size_t)n;
+		memmove(outbuf, outbuf + n, outlen);
 	}
-	return total;
 }
 
 /*
-  send a packet in length prefix format
+  read every reply Samba has for us, called from the main loop
 */
-static int
-send_packet(int fd, const char *buf, uint32_t len)
+static void
+signd_input(SOCKET fd)
 {
-	uint32_t net_len = htonl(len);
-	if (write_all(fd, &net_len, sizeof(net_len)) != sizeof(net_len)) {
-		char errbuf[ERR_BUF_LEN];
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		maybe_log(&do_we_log_signd, LOG_DEBUG,
-			"SIGND: can not send length: %s",
-			errbuf);
-		return -1;
-	}
-	if (write_all(fd, buf, len) != (size_t)len) {
-		char errbuf[ERR_BUF_LEN];
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		maybe_log(&do_we_log_signd, LOG_DEBUG,
-			"SIGND: can not send packet to samba: %s", errbuf);
-		return -1;
+	uint32_t len;
+	size_t used;
+	ssize_t n;
+
+	UNUSED_ARG(fd);
+	for (;;) {
+		n = read(signd_fd, inbuf + inlen, sizeof(inbuf) - inlen);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+			break;
+		if (n <= 0) {
+			char errbuf[ERR_BUF_LEN];
+			if (0 == n)
+				strlcpy(errbuf, "EOF", sizeof(errbuf));
+			else
+				ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+			maybe_log(&do_we_log_signd, LOG_DEBUG,
+				"SIGND: can not receive signed packet from samba: %s",
+				errbuf);
+			signd_close();
+			return;
+		}
+		inlen += (size_t)n;
+
+		/* each reply in length prefix format */
+		used = 0;
+		while (inlen - used >= sizeof(len)) {
+			memcpy(&len, inbuf + used, sizeof(len));
+			// There are constraints on length.
+			// anything not in 64 <= len <= 1512 is probably garbage
+			// 12 is metadata len before the signed packet
+			// 48 is packet len, and 4 the keyID len
+			// anything > 1512 will unacceptably fragment on ethernet
+			// FIXME: Word is the one true length is 80 (12+48+4+16)
+			//        and all others are as an abominataton unto MS-SNTP
+			len = ntohl(len);
+			if (SIGND_MAX_REPLY < len || SIGND_HEADER > len) {
+				maybe_log(&do_we_log_signd, LOG_DEBUG,
+					"SIGND: rejecting packet of length %u, "
+					"want %u to %u",
+					len, SIGND_HEADER, SIGND_MAX_REPLY);
+				/* no way to find the next reply */
+				signd_close();
+				return;
+			}
+			if (inlen - used < sizeof(len) + len)
+				break;
+			signd_reply(inbuf + used + sizeof(len), len);
+			used += sizeof(len) + len;
+		}
+		inlen -= used;
+		memmove(inbuf, inbuf + used, inlen);
 	}
-	return 0;
+	signd_flush();
 }
 
 /*
-  receive a packet in length prefix format
+  send the client what Samba signed
 */
-static int
-recv_packet(int fd, char **buf, uint32_t *len)
+static void
+signd_reply(char *reply, uint32_t reply_len)
 {
-	if (read_all(fd, len, sizeof(*len)) != sizeof(*len)) {
-		char errbuf[ERR_BUF_LEN];
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		maybe_log(&do_we_log_signd, LOG_DEBUG,
-			"SIGND: can not receive length: %s",
-			errbuf);
-		return -1;
-	}
-	// There are constraints on length.
-	// anything not in 64 <= len <= 1512 is probably garbage
-	// 12 is metadata len before the signed packet
-	// 48 is packet len, and 4 the keyID len
-	// anything > 1512 will unacceptably fragment on ethernet 
-	// FIXME: Word is the one true length is 80 (12+48+4+16)
-	//        and all others are as an abominataton unto MS-SNTP
-	*len = ntohl(*len);
-	if (1512 < *len) {
-		maybe_log(&do_we_log_signd, LOG_DEBUG,
-			"SIGND: rejecting too long packet: got %u, max is 1512",
-			*len);
-		return -1;
-	}
-	if (12 > *len) {
-		maybe_log(&do_we_log_signd, LOG_DEBUG,
-			"SIGND: rejecting too short packet: got %u, min is 12",
-			*len);
-		return -1;
+	/* Return packet is also simple:
+	   [packet size] - network byte order - 4 bytes
+	   [protocol version (0)] network byte order - - 4 bytes
+	   [operation (signed success=3, failure=4)] network byte order - - 4 byte
+	   [packet ID] - as sent - 4 bytes
+	   (optional) [signed message] - as provided before, with signature appended
+	*/
+	struct samba_key_out samba_reply;
+	struct signd_request *req;
+	struct timespec finish;
+	uint32_t op_reply;
+	uint32_t sendlen;
+	l_fp wall;
+
+	memcpy(&samba_reply, reply, sizeof(samba_reply));
+	req = &pending[samba_reply.packet_id % SIGND_PENDING];
+	if (!req->busy || req->packet_id != samba_reply.packet_id) {
+		/* timed out, or its interface went away */
+		DPRINT(1, ("ntp_signd: reply to packet %u, not waiting\n",
+			   samba_reply.packet_id));
+		return;
 	}
-	(*buf) = emalloc(*len);
-	if (read_all(fd, *buf, *len) != (size_t)*len) {
-		char errbuf[ERR_BUF_LEN];
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		free(*buf);
-		maybe_log(&do_we_log_signd, LOG_DEBUG,
-			"SIGND: can not receive signed packet from samba: %s",
-			errbuf);
-		return -1;
+	req->busy = false;
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	wall = tspec_intv_to_lfp(sub_tspec(finish, req->start));
+
+	op_reply = ntohl(samba_reply.op);
+	if (3 != op_reply) {
+		maybe_log(&do_we_log_signd, LOG_INFO,
+			   "SIGND: bad Samba repy op want 3, got %u.\n",
+			   op_reply);
+		mssntp_cnt.serves_bad++;
+		mssntp_cnt.serves_bad_wall += wall;
+		if (wall > mssntp_cnt.serves_bad_slowest)
+		  mssntp_cnt.serves_bad_slowest = wall;
+		return;
 	}
-	return 0;
+
+	sendlen = reply_len - SIGND_HEADER;
+	sendpkt(&req->client, req->dstadr, reply + SIGND_HEADER,
+		sendlen);
+
+	mssntp_cnt.serves_good++;
+	mssntp_cnt.serves_good_wall += wall;
+	if (wall > mssntp_cnt.serves_good_slowest)
+	  mssntp_cnt.serves_good_slowest = wall;
+
+	DPRINT(1, ("transmit ntp_signd packet: at %u %s->%s keyid %08x len %u\n",
+		   current_time, socktoa(&req->dstadr->sin),
+		   socktoa(&req->client), req->keyid, sendlen));
 }
 
 void
@@ -216,59 +361,46 @@ send_via_ntp_signd(
 	 * https://learn.microsoft.com/en-us/openspecs/windows_protocols/ms-sntp/8106cb73-ab3a-4542-8bc8-784dd32031cc
 	 */
 
-	struct timespec start, finish;
-	l_fp wall;
-
-	bool quit = false;
-	int fd;
-	size_t sendlen;
-	struct samba_key_in {
-		uint32_t version;
-		uint32_t op;
-		uint32_t packet_id;
-		uint32_t key_id_le;
-		char pkt[LEN_PKT_NOMAC];
-	} samba_pkt;
-
-	struct samba_key_out {
-		uint32_t version;
-		uint32_t op;
-		uint32_t packet_id;
-	} samba_reply;
-
-	uint32_t header_length = sizeof(samba_reply);
-	char full_socket[256];
-
-	char *reply = NULL;
-	uint32_t reply_len;
+	struct samba_key_in samba_pkt;
+	struct signd_request *req;
+	uint32_t net_len;
 
 	mssntp_cnt.serves++;
-	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Only continue with this if we can talk to Samba */
+	if (!signd_open()) {
+		mssntp_cnt.serves_no++;
+		return;
+	}
 
 	ZERO(samba_pkt);
 	samba_pkt.op = 0; /* Sign message */
-	/* This will be echoed into the reply - a different
-	 * implementation might want multiple packets
-	 * awaiting signing */
-
+	/* This will be echoed into the reply, and finds the
+	 * request the reply belongs to */
 	samba_pkt.packet_id = signd_count++;
 
+	req = &pending[samba_pkt.packet_id % SIGND_PENDING];
+	if (req->busy) {
+		maybe_log(&do_we_log_signd, LOG_INFO,
+			"SIGND: %d requests awaiting Samba, dropping",
+			SIGND_PENDING);
+		mssntp_cnt.serves_err++;
+		return;
+	}
+	req->busy = true;
+	req->packet_id = samba_pkt.packet_id;
+	req->client = rbufp->recv_srcadr;
+	req->dstadr = rbufp->dstadr;
+	req->keyid = rbufp->keyid;
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+
 	/* Swap the byte order back - it's actually little
 	 * endian on the wire, but it was read above as
 	 * network byte order */
 	samba_pkt.key_id_le = htonl(rbufp->keyid);
 	memcpy(&samba_pkt.pkt, xpkt, sizeof(samba_pkt.pkt));
 
-	snprintf(full_socket, sizeof(full_socket), "%s/socket", ntp_signd_socket);
-
-	fd = ux_socket_connect(full_socket);
-	/* Only continue with this if we can talk to Samba */
-	if (fd < 4) {
-		mssntp_cnt.serves_no++;
-		goto signd_cleanup;
-	}
-	
-	/* Send old packet to Samba, expect response */
+	/* Send old packet to Samba, the response comes to signd_input() */
 	/* Packet to Samba is quite simple:
 	   All values BIG endian except key ID as noted
 	   [packet size as BE] - 4 bytes
@@ -278,71 +410,53 @@ send_via_ntp_signd(
 	   [key id] - LITTLE endian (as on wire) - 4 bytes
 	   [message to sign] - as marshalled, without signature
 	*/
+	net_len = htonl((uint32_t)sizeof(samba_pkt));
+	memcpy(outbuf + outlen, &net_len, sizeof(net_len));
+	memcpy(outbuf + outlen + sizeof(net_len), &samba_pkt,
+	       sizeof(samba_pkt));
+	outlen += SIGND_REQUEST;
+	signd_flush();
+}
 
-	if (send_packet(fd, (char *)&samba_pkt, offsetof(struct samba_key_in, pkt) + LEN_PKT_NOMAC) != 0) {
-		/* Huh?  could not talk to Samba... */
-		mssntp_cnt.serves_err++;
-		goto signd_cleanup;
-	}
-
-	if (recv_packet(fd, &reply, &reply_len) != 0) {
-		mssntp_cnt.serves_err++;
-		goto signd_cleanup;
-	}
-	/* Return packet is also simple:
-	   [packet size] - network byte order - 4 bytes
-	   [protocol version (0)] network byte order - - 4 bytes
-	   [operation (signed success=3, failure=4)] network byte order - - 4 byte
-	   (optional) [signed message] - as provided before, with signature appended
-	*/
-
-	{
-		uint32_t op_reply = 0;
-		memcpy(&samba_reply, reply, header_length > reply_len ? reply_len: header_length);
-		op_reply = ntohl(samba_reply.op);
-		if (reply_len < header_length) {
-			maybe_log(&do_we_log_signd, LOG_INFO,
-				  "SIGND: bad samba reply length %u <= %u reply header length.\n",
-				  reply_len, header_length);
-			quit = true;
-		}
-		if (3 != op_reply) {
+/*
+ * signd_timer - once a second, give up on Samba if it has sat on a
+ * request too long, and send what the socket wouldn't take earlier.
+ */
+void
+signd_timer(void)
+{
+	struct timespec now, timeout;
+
+	if (signd_fd < 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timeout = sub_tspec_ns(now, SIGND_TIMEOUT * 1000000L);
+	for (int i = 0; i < SIGND_PENDING; i++) {
+		if (pending[i].busy &&
+		    cmp_tspec(pending[i].start, timeout) < 0) {
 			maybe_log(&do_we_log_signd, LOG_INFO,
-				   "SIGND: bad Samba repy op want 3, got %u.\n",
-				   op_reply);
-			quit = true;
-		}
-		if (quit) {
-			mssntp_cnt.serves_bad++;
-			clock_gettime(CLOCK_MONOTONIC, &finish);
-			wall = tspec_intv_to_lfp(sub_tspec(finish, start));
-			mssntp_cnt.serves_bad_wall += wall;
-			if (wall > mssntp_cnt.serves_bad_slowest)
-			  mssntp_cnt.serves_bad_slowest = wall;
-			goto signd_cleanup;
+				"SIGND: no reply from Samba in %d ms, "
+				"reconnecting", SIGND_TIMEOUT);
+			signd_close();
+			return;
 		}
 	}
+	signd_flush();
+}
 
-	sendlen = reply_len - header_length;
-	xpkt = reply + header_length;
-	sendpkt(&rbufp->recv_srcadr, rbufp->dstadr, xpkt, (uint32_t)sendlen);
-
-	mssntp_cnt.serves_good++;
-	clock_gettime(CLOCK_MONOTONIC, &finish);
-	wall = tspec_intv_to_lfp(sub_tspec(finish, start));
-	mssntp_cnt.serves_good_wall += wall;
-	if (wall > mssntp_cnt.serves_good_slowest)
-	  mssntp_cnt.serves_good_slowest = wall;
-
-	DPRINT(1, ("transmit ntp_signd packet: at %u %s->%s keyid %08x len %zu\n",
-		   current_time, socktoa(&rbufp->dstadr->sin),
-		   socktoa(&rbufp->recv_srcadr), rbufp->keyid, sendlen));
-
-signd_cleanup:
-	if (reply) {
-		free(reply);
-		reply = NULL;
-	}
-	close(fd);
+/*
+ * signd_clearinterface - forget the requests whose reply would go out
+ * an interface that is being removed.
+ */
+void
+signd_clearinterface(
+	endpt *interface
+	)
+{
+	for (int i = 0; i < SIGND_PENDING; i++)
+		if (pending[i].busy && pending[i].dstadr == interface) {
+			pending[i].busy = false;
+			mssntp_cnt.serves_err++;
+		}
 }
 #endif
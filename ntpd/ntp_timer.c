@@ -8,7 +8,10 @@
 #include "ntp_stdlib.h"
 #include "ntp_calendar.h"
 #include "ntp_leapsec.h"
+#include "ntp_filegen.h"
+#include "timespecops.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
@@ -23,14 +26,19 @@
 #define	EVENT_TIMEOUT	0	/* one second, that is */
 
 static void check_leapsec(time_t, bool);
+#ifdef ENABLE_LEAP_SMEAR
+static void smear_segment(time_t, double);
+#endif
+static void poll_sift_up(unsigned int);
+static void poll_sift_down(unsigned int);
 
 /*
  * These routines provide support for the event timer.  The timer is
  * implemented by an interrupt routine which sets a flag once every
  * second, and a timer routine which is called when the mainline code
  * gets around to seeing the flag.  The timer routine dispatches the
- * clock adjustment code if its time has come, then searches the timer
- * queue for expiries which are dispatched to the transmit procedure.
+ * clock adjustment code if its time has come, then takes the expiries
+ * off the poll queue and dispatches them to the transmit procedure.
  * Finally, we call the hourly procedure to do cleanup and print a
  * message.
  */
@@ -49,6 +57,20 @@ unsigned int	leap_smear_intv;	/* Duration of smear.  Enables smear mode. */
 int	leapdif;		/* TAI difference step at next leap second*/
 uptime_t	orphwait; 	/* orphan wait time */
 
+/*
+ * The poll queue, a binary min-heap of the associations keyed by when
+ * each next transmits, so timer() only touches those that are due.  A
+ * peer's poll_index is 1 + its place here, or 0 when not queued.
+ */
+struct poll_entry {
+	uptime_t	when;		/* tick to dispatch at */
+	struct peer *	peer;
+};
+static struct poll_entry *poll_queue;
+static unsigned int	poll_count;	/* entries in use */
+static unsigned int	poll_size;	/* entries allocated */
+#define	POLL_QUEUE_INIT	16		/* first allocation */
+
 /*
  * Statistics counter for the interested.
  */
@@ -68,13 +90,34 @@ static	void catchALRM (int);
 static timer_t timer_id;
 typedef struct itimerspec intervaltimer;
 #define	itv_frac	tv_nsec
+#define	ITV_PER_S	NS_PER_S
 #else
 typedef struct itimerval intervaltimer;
 #define	itv_frac	tv_usec
+#define	ITV_PER_S	US_PER_S
 #endif
 static intervaltimer itimer;
+static int	fast_ticks;	/* fast loop ticks so far this second */
 
 void	set_timer_or_die(void);
+static void	set_interval(void);
+
+
+/*
+ * set_interval - tick once a second, or fastloop_rate times a second
+ * when the fast loop is on
+ */
+static void
+set_interval(void)
+{
+	if (fastloop_rate > 1) {
+		itimer.it_interval.tv_sec = 0;
+		itimer.it_interval.itv_frac = ITV_PER_S / fastloop_rate;
+	} else {
+		itimer.it_interval.tv_sec = (1 << EVENT_TIMEOUT);
+		itimer.it_interval.itv_frac = 0;
+	}
+}
 
 void
 set_timer_or_die(void)
@@ -109,16 +152,18 @@ reinit_timer(void)
 #else
 	getitimer(ITIMER_REAL, &itimer);
 #endif
+	set_interval();
 	if (itimer.it_value.tv_sec < 0 ||
-	    itimer.it_value.tv_sec > (1 << EVENT_TIMEOUT))
-		itimer.it_value.tv_sec = (1 << EVENT_TIMEOUT);
+	    itimer.it_value.tv_sec > itimer.it_interval.tv_sec)
+		itimer.it_value.tv_sec = itimer.it_interval.tv_sec;
 	if (itimer.it_value.itv_frac < 0)
 		itimer.it_value.itv_frac = 0;
+	if (itimer.it_value.tv_sec == itimer.it_interval.tv_sec &&
+	    itimer.it_value.itv_frac > itimer.it_interval.itv_frac)
+		itimer.it_value.itv_frac = itimer.it_interval.itv_frac;
 	if (0 == itimer.it_value.tv_sec &&
 	    0 == itimer.it_value.itv_frac)
-		itimer.it_value.tv_sec = (1 << EVENT_TIMEOUT);
-	itimer.it_interval.tv_sec = (1 << EVENT_TIMEOUT);
-	itimer.it_interval.itv_frac = 0;
+		itimer.it_value = itimer.it_interval;
 	set_timer_or_die();
 }
 
@@ -146,7 +191,7 @@ init_timer(void)
 	/*
 	 * Set up the alarm interrupt.	The first comes 2**EVENT_TIMEOUT
 	 * seconds from now and they continue on every 2**EVENT_TIMEOUT
-	 * seconds.
+	 * seconds, or every fast loop tick.
 	 */
 #ifdef HAVE_TIMER_CREATE
 	if (TC_ERR == timer_create(CLOCK_MONOTONIC, NULL, &timer_id)) {
@@ -155,9 +200,9 @@ init_timer(void)
 	}
 #endif
 	signal_no_reset(SIGALRM, catchALRM);
-	itimer.it_interval.tv_sec =
-		itimer.it_value.tv_sec = (1 << EVENT_TIMEOUT);
-	itimer.it_interval.itv_frac = itimer.it_value.itv_frac = 0;
+	set_interval();
+	itimer.it_value = itimer.it_interval;
+	fast_ticks = 0;
 	set_timer_or_die();
 }
 
@@ -170,8 +215,25 @@ void
 timer(void)
 {
 	struct peer *	p;
+#ifdef REFCLOCK
 	struct peer *	next_peer;
+#endif
 	time_t          now;
+	l_fp		mon_now;
+	int		was = cpu_switch(CPU_TIMER);
+
+	/*
+	 * With the fast loop on, all but the last of each second's ticks
+	 * only run it.
+	 */
+	if (fastloop_rate > 1) {
+		fast_clock();
+		if (++fast_ticks < fastloop_rate) {
+			cpu_switch(was);
+			return;
+		}
+		fast_ticks = 0;
+	}
 
 	/*
 	 * The basic timerevent is one second.  This is used to adjust the
@@ -183,39 +245,41 @@ timer(void)
 		adjust_timer += 1;
 		adj_host_clock();
 #ifdef REFCLOCK
+		cpu_switch(CPU_REFCLOCK);
 		for (p = peer_list; p != NULL; p = next_peer) {
 			next_peer = p->p_link;
 			if (FLAG_REFCLOCK & p->cfg.flags)
 				refclock_timer(p);
 		}
+		cpu_switch(CPU_TIMER);
 #endif /* REFCLOCK */
 	}
 
 	/*
-	 * Now dispatch any peers whose event timer has expired. Be
-	 * careful here, since the peer structure might go away as the
-	 * result of the call.
+	 * Now dispatch any peers whose event timer has expired. Each
+	 * is requeued for the next tick before the call, which is where
+	 * it stays unless the call schedules it; if the peer goes away
+	 * as the result of the call, free_peer() dequeues it. The rate
+	 * control bucket drains by itself, see peer_throttle().
 	 */
-	for (p = peer_list; p != NULL; p = next_peer) {
-		next_peer = p->p_link;
-
-		/*
-		 * Restrain the non-burst packet rate not more
-		 * than one packet every 16 seconds. This is
-		 * usually tripped using iburst and minpoll of
-		 * 128 s or less.
-		 */
-		if (p->throttle > 0)
-			p->throttle--;
-		if (p->nextdate <= current_time) {
+	xmit_batch(true);
+	while (poll_count > 0 && poll_queue[0].when <= current_time) {
+		p = poll_queue[0].peer;
+		poll_queue[0].when = current_time + 1;
+		poll_sift_down(0);
 #ifdef REFCLOCK
-			if (FLAG_REFCLOCK & p->cfg.flags)
-				refclock_transmit(p);
-			else
+		if (FLAG_REFCLOCK & p->cfg.flags) {
+			cpu_switch(CPU_REFCLOCK);
+			refclock_transmit(p);
+		} else
 #endif	/* REFCLOCK */
-				transmit(p);
+		{
+			cpu_switch(CPU_TRANSMIT);
+			transmit(p);
 		}
+		cpu_switch(CPU_TIMER);
 	}
+	xmit_batch(false);
 
 	/*
 	 * Orphan mode is active when enabled and when no servers less
@@ -236,10 +300,19 @@ timer(void)
 		clkstate.sys_offset = 0;
 		sys_vars.sys_rootdelay = 0;
 		sys_vars.sys_rootdisp = 0;
+		ctl_sysvars_changed();
 	}
 
 	time(&now);
 
+	/* a leap file the file watcher read in the meantime */
+	check_leap_pending(now);
+	/* and a restrict set */
+	check_restrict_pending();
+	/* MRU entries nobody has heard from in a while */
+	get_systime(&mon_now);
+	mon_expire(mon_now);
+
 	/*
 	 * Leapseconds. Get time and defer to worker if either something
 	 * is imminent or every 8th second.
@@ -257,6 +330,42 @@ timer(void)
 		}
 	}
 
+	/* orphan mode and leap smearing change the reply fields */
+	publish_reply_template();
+
+	/* new stats file generations, buffered records due out */
+	cpu_switch(CPU_STATS);
+	filegen_timer();
+	cpu_switch(CPU_TIMER);
+
+	/* abandoned mrulist cursors */
+	ctl_timer();
+
+	/* values for the metrics thread */
+	metrics_timer();
+
+	/* peeraggstats and loopaggstats, each minute */
+	record_agg_stats();
+
+#ifdef ENABLE_MSSNTP
+	/* signing requests Samba never answered */
+	signd_timer();
+#endif
+
+	/* receive queue overflows, bigger buffers for them */
+	sockbuf_timer();
+
+	/* sockets the busy poller let go of */
+	poller_timer();
+
+	/* limited sources the kernel filter has held long enough */
+	bpf_filter_timer();
+
+#ifdef REFCLOCK
+	/* clocks the refclock input thread let go of */
+	refio_timer();
+#endif
+
 	/*
 	 * Update huff-n'-puff filter.
 	 */
@@ -279,12 +388,15 @@ timer(void)
 	 */
 	if (hour_timer <= current_time) {
 		hour_timer += SECSPERHR;
+		cpu_switch(CPU_STATS);
 		write_stats();
+		cpu_switch(CPU_TIMER);
 #ifndef DISABLE_NTS
 		nts_timer();
 #endif
 		mon_timer();
 		check_logfile();
+		check_keys_file();
 		if (leapf_timer <= current_time) {
 			leapf_timer += SECSPERDAY;
 			check_leap_file(true, now);
@@ -293,6 +405,7 @@ timer(void)
 		}
 	}
 
+	cpu_switch(was);
 }
 
 
@@ -334,6 +447,113 @@ timer_interfacetimeout(uptime_t timeout)
 }
 
 
+static inline void
+poll_put(
+	unsigned int		i,
+	struct poll_entry	e
+	)
+{
+	poll_queue[i] = e;
+	e.peer->poll_index = i + 1;
+}
+
+
+static void
+poll_sift_up(
+	unsigned int	i
+	)
+{
+	struct poll_entry e = poll_queue[i];
+
+	while (i > 0 && e.when < poll_queue[(i - 1) / 2].when) {
+		poll_put(i, poll_queue[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	poll_put(i, e);
+}
+
+
+static void
+poll_sift_down(
+	unsigned int	i
+	)
+{
+	struct poll_entry e = poll_queue[i];
+	unsigned int	c;
+
+	while ((c = 2 * i + 1) < poll_count) {
+		if (c + 1 < poll_count &&
+		    poll_queue[c + 1].when < poll_queue[c].when)
+			c++;
+		if (!(poll_queue[c].when < e.when))
+			break;
+		poll_put(i, poll_queue[c]);
+		i = c;
+	}
+	poll_put(i, e);
+}
+
+
+/*
+ * timer_schedule - (re)queue a peer to transmit at its nextdate.  Call
+ * after any change to nextdate.  A nextdate already past means the
+ * next tick, as it always has.
+ */
+void
+timer_schedule(
+	struct peer *	p
+	)
+{
+	uptime_t	when = max(p->nextdate, current_time + 1);
+	unsigned int	i;
+
+	if (p->poll_index != 0) {
+		i = p->poll_index - 1;
+		if (when < poll_queue[i].when) {
+			poll_queue[i].when = when;
+			poll_sift_up(i);
+		} else {
+			poll_queue[i].when = when;
+			poll_sift_down(i);
+		}
+		return;
+	}
+	if (poll_count == poll_size) {
+		poll_size = poll_size ? 2 * poll_size : POLL_QUEUE_INIT;
+		poll_queue = erealloc(poll_queue,
+				      poll_size * sizeof(*poll_queue));
+	}
+	i = poll_count++;
+	poll_queue[i].when = when;
+	poll_queue[i].peer = p;
+	poll_sift_up(i);
+}
+
+
+/*
+ * timer_unschedule - take a peer off the poll queue
+ */
+void
+timer_unschedule(
+	struct peer *	p
+	)
+{
+	struct peer *	moved;
+	unsigned int	i;
+
+	if (p->poll_index == 0)
+		return;
+	i = p->poll_index - 1;
+	p->poll_index = 0;
+	if (i == --poll_count)
+		return;
+	moved = poll_queue[poll_count].peer;
+	poll_put(i, poll_queue[poll_count]);
+	poll_sift_up(i);
+	poll_sift_down(moved->poll_index - 1);
+}
+
+
 /*
  * timer_clr_stats - clear timer module stat counters
  */
@@ -354,6 +574,28 @@ check_leap_sec_in_progress( const leap_result_t *lsdata ) {
 		set_sys_leap(sys_vars.sys_leap);
 }
 
+#ifdef ENABLE_LEAP_SMEAR
+/*
+ * smear_segment - draw the smear as a line through now, rate seconds
+ * of offset per second, for the replies until the next leap check.
+ * The offset at now is filled in once it is known.
+ */
+static void
+smear_segment(
+	time_t	now,
+	double	rate
+	)
+{
+	double	lo = max(-LEAP_SMEAR_SPAN, leap_smear.intv_start - now);
+	double	hi = min(LEAP_SMEAR_SPAN, leap_smear.intv_end - now);
+
+	leap_smear.seg.t0 = lfpinit_u((uint32_t)(now + JAN_1970), 0);
+	leap_smear.seg.rate = (int64_t)llround(rate * FRAC);
+	leap_smear.seg.lo = (int64_t)llround(lo * FRAC);
+	leap_smear.seg.hi = (int64_t)llround(hi * FRAC);
+}
+#endif	/* ENABLE_LEAP_SMEAR */
+
 static void
 check_leapsec(
 	time_t now,
@@ -373,6 +615,7 @@ check_leapsec(
 
 	leap_result_t lsdata;
 	uint32_t       lsprox;
+	unsigned int   old_tai = sys_tai;
 	leapsec_electric((clock_ctl.pll_control && clock_ctl.kern_enable) ? electric_on : electric_off);
 #ifdef ENABLE_LEAP_SMEAR
 	leap_smear.enabled = (leap_smear_intv != 0);
@@ -391,6 +634,7 @@ check_leapsec(
 #ifdef ENABLE_LEAP_SMEAR
 		leap_smear.in_progress = false;
 		leap_smear.doffset = 0.0;
+		ZERO(leap_smear.seg);
 
 		if (leap_smear.enabled) {
 			if (lsdata.tai_diff) {
@@ -424,6 +668,8 @@ check_leapsec(
 					 * leap_smear.doffset
 					 */
 					leap_smear.in_progress = true;
+					smear_segment(now, -(double)lsdata.tai_diff /
+						      leap_smear.interval);
 #if 0 && defined( DEBUG )
 					msyslog(LOG_NOTICE, "CLOCK: *** leapsec_query: [%.0f:%.0f] (%li), now %u (%.0f), smear offset %.6f ms\n",
 						leap_smear.intv_start, leap_smear.intv_end, leap_smear.interval,
@@ -443,6 +689,7 @@ check_leapsec(
 		 * Update the current leap smear offset, eventually 0.0 if outside smear interval.
 		 */
 		leap_smear.offset = dtolfp(leap_smear.doffset);
+		leap_smear.seg.off0 = leap_smear.offset;
 #endif	/* ENABLE_LEAP_SMEAR */
 
 		/* Full hit. Eventually step the clock, but always
@@ -478,6 +725,8 @@ check_leapsec(
 			sys_tai = (unsigned int)lsdata.tai_offs;
 		}
 	}
+	if (sys_tai != old_tai)
+		ctl_sysvars_changed();
 
 	/* We guard against panic alarming during the red alert phase.
 	 * Strange and evil things might happen if we go from stone cold
@@ -0,0 +1,520 @@
+/*
+ * ntp_uring.c - optional io_uring receive path
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * With iouring set, each endpoint's socket gets one multishot
+ * recvmsg request on an io_uring.  The kernel reads every datagram
+ * as it arrives into a buffer from a ring this file provides and
+ * posts a completion for it; the main loop wakes on the ring's
+ * descriptor and takes all the completions there are without a
+ * system call per datagram.  Each buffer holds the datagram behind
+ * its source address and control data, receive stamps and packet
+ * info included, so it is copied into a receive buffer and handled
+ * the way the busy poller's are.  The main loop still watches the
+ * sockets for errors, which bring transmit stamps.
+ *
+ * A request ends when the ring runs out of buffers, and is made
+ * again once its last completion is in.  A socket that keeps failing
+ * goes back to the main loop.  When an endpoint goes, its request is
+ * cancelled and its record freed with the last completion; until
+ * then the kernel holds the socket open.
+ *
+ * The rings are driven through the system calls directly, there is
+ * no liburing dependency.  Replies still leave in batches through
+ * flush_sendpkts().
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+#endif
+
+#include "ntpd.h"
+#include "ntp_io.h"
+#include "ntp_lists.h"
+#include "ntp_stdlib.h"
+#include "recvbuff.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT) && \
+    defined(__NR_io_uring_setup) && \
+    (defined(HAVE_NET_ROUTE_H) || defined(ENABLE_MSSNTP))
+# define USE_IO_URING
+#endif
+
+bool io_uring_input = false;	/* iouring configured */
+
+#ifdef USE_IO_URING
+#define URING_ENTRIES	64		/* submission queue */
+#define URING_CQ	1024		/* completion queue */
+#define URING_BUFS	256		/* provided buffers, power of 2 */
+#define URING_LEAN	32		/* the same under "lean" */
+#define URING_BGID	1		/* their buffer group */
+#define URING_ERRORS	8		/* failures in a row, then give up */
+/* header, source address, control data and the datagram */
+#define URING_BUFSIZE	((sizeof(struct io_uring_recvmsg_out) + \
+			  sizeof(sockaddr_u) + PKTSTAMP_CONTROL + \
+			  RX_BUFF_SIZE + 63) & ~(size_t)63)
+
+typedef struct uring_sock uring_sock;
+struct uring_sock {
+	uring_sock *	link;
+	endpt *		ep;	/* NULL once the endpoint is gone */
+	struct msghdr	mh;	/* address and control space wanted */
+	bool		armed;	/* request outstanding */
+	int		errors;	/* failed requests in a row */
+};
+
+static int			ring_fd = -1;
+static volatile unsigned int *	sq_head;
+static volatile unsigned int *	sq_tail;
+static unsigned int *		sq_array;
+static unsigned int		sq_mask;
+static unsigned int		sq_entries;
+static volatile unsigned int *	sq_flags;
+static struct io_uring_sqe *	sqes;
+static volatile unsigned int *	cq_head;
+static volatile unsigned int *	cq_tail;
+static unsigned int		cq_mask;
+static struct io_uring_cqe *	cqes;
+static struct io_uring_buf_ring *buf_ring;
+static char *			buf_base;
+static unsigned int		buf_count;	/* URING_BUFS or URING_LEAN */
+static unsigned short		buf_tail;
+static uring_sock *		uring_socks;
+static bool			uring_running;
+
+static inline void uring_barrier(void) {
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
+}
+
+static void	uring_input	(SOCKET);
+
+
+static int
+uring_enter(
+	unsigned int	submit,
+	unsigned int	flags
+	)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, submit, 0,
+			    flags, NULL, 0);
+}
+
+
+/*
+ * uring_submit - queue one request and hand it to the kernel
+ */
+static bool
+uring_submit(
+	const struct io_uring_sqe *	req
+	)
+{
+	unsigned int	tail = *sq_tail;
+	unsigned int	slot = tail & sq_mask;
+
+	/* every request is submitted at once, so there is room */
+	if (tail - *sq_head >= sq_entries)
+		return false;
+	sqes[slot] = *req;
+	sq_array[slot] = slot;
+	uring_barrier();
+	*sq_tail = tail + 1;
+	uring_barrier();
+	return 1 == uring_enter(1, 0);
+}
+
+
+/*
+ * uring_give - put a buffer (back) on the provided buffer ring
+ */
+static void
+uring_give(
+	unsigned short	bid
+	)
+{
+	struct io_uring_buf *buf = &buf_ring->bufs[buf_tail & (buf_count - 1)];
+
+	buf->addr = (uintptr_t)(buf_base + (size_t)bid * URING_BUFSIZE);
+	buf->len = URING_BUFSIZE;
+	buf->bid = bid;
+	buf_tail++;
+	uring_barrier();
+	((volatile struct io_uring_buf_ring *)buf_ring)->tail = buf_tail;
+}
+
+
+/*
+ * uring_arm - start the multishot receive on an endpoint's socket
+ */
+static void
+uring_arm(
+	uring_sock *	us
+	)
+{
+	struct io_uring_sqe req;
+
+	ZERO(req);
+	req.opcode = IORING_OP_RECVMSG;
+	req.fd = us->ep->fd;
+	req.addr = (uintptr_t)&us->mh;
+	req.ioprio = IORING_RECV_MULTISHOT;
+	req.flags = IOSQE_BUFFER_SELECT;
+	req.buf_group = URING_BGID;
+	req.user_data = (uintptr_t)us;
+	us->armed = uring_submit(&req);
+}
+
+
+/*
+ * uring_drop - stop reading an endpoint through the ring
+ */
+static void
+uring_drop(
+	uring_sock *	us
+	)
+{
+	uring_sock *	unlinked;
+
+	UNLINK_SLIST(unlinked, uring_socks, us, link, uring_sock);
+	free(us);
+}
+
+
+/*
+ * uring_add_endpt - take over reading a new endpoint.  Called by the
+ * main thread, which holds proto_lock.
+ */
+void
+uring_add_endpt(
+	endpt *	ep
+	)
+{
+	uring_sock *	us;
+
+	if (!uring_running || INVALID_SOCKET == ep->fd
+	    || ((INT_SHARED | INT_POLLED) & ep->flags))
+		return;
+	if (!io_endpt_polled(ep, true))
+		return;
+	us = emalloc_zero(sizeof(*us));
+	us->ep = ep;
+	us->mh.msg_namelen = sizeof(sockaddr_u);
+	us->mh.msg_controllen = PKTSTAMP_CONTROL;
+	LINK_SLIST(uring_socks, us, link);
+	uring_arm(us);
+	if (!us->armed) {
+		msyslog(LOG_ERR, "IO: io_uring: can't read %s: %s",
+			latoa(ep), strerror(errno));
+		io_endpt_polled(ep, false);
+		uring_drop(us);
+	}
+}
+
+
+/*
+ * uring_remove_endpt - cancel the request of a dying endpoint.
+ * Called by the main thread, which holds proto_lock.
+ */
+void
+uring_remove_endpt(
+	endpt *	ep
+	)
+{
+	struct io_uring_sqe req;
+
+	for (uring_sock *us = uring_socks; us != NULL; us = us->link) {
+		if (us->ep != ep)
+			continue;
+		us->ep = NULL;
+		if (!us->armed) {
+			uring_drop(us);
+			return;
+		}
+		ZERO(req);
+		req.opcode = IORING_OP_ASYNC_CANCEL;
+		req.addr = (uintptr_t)us;
+		req.user_data = 0;	/* its own completion is ignored */
+		if (!uring_submit(&req))
+			msyslog(LOG_ERR, "IO: io_uring: can't cancel read: %s",
+				strerror(errno));
+		return;
+	}
+}
+
+
+/*
+ * uring_packet - hand one received datagram to the protocol machine
+ */
+static void
+uring_packet(
+	uring_sock *	us,
+	char *		buf,
+	size_t		len
+	)
+{
+	static recvbuf_t rb;
+	struct io_uring_recvmsg_out *out = (void *)buf;
+	char *		name = buf + sizeof(*out);
+	char *		control = name + us->mh.msg_namelen;
+	char *		payload = control + us->mh.msg_controllen;
+	size_t		hdr = (size_t)(payload - buf);
+	struct msghdr	mh;
+
+	if (len < hdr)
+		return;
+	ZERO(rb);
+	memcpy(&rb.recv_srcadr, name,
+	       min(out->namelen, sizeof(rb.recv_srcadr)));
+	rb.recv_length = min(min(out->payloadlen, len - hdr),
+			     sizeof(rb.recv_buffer));
+	memcpy(&rb.recv_buffer, payload, rb.recv_length);
+	rb.fd = us->ep->fd;
+	ZERO(mh);
+	mh.msg_control = control;
+	mh.msg_controllen = out->controllen;
+	mh.msg_flags = (int)out->flags;
+	rb.recv_time = fetch_packetstamp(&mh, us->ep->phc);
+	input_polled(&rb, us->ep, &mh);
+}
+
+
+/*
+ * uring_complete - deal with one completion
+ */
+static void
+uring_complete(
+	const struct io_uring_cqe *	cqe
+	)
+{
+	uring_sock *	us = (uring_sock *)(uintptr_t)cqe->user_data;
+	unsigned short	bid;
+
+	if (NULL == us)
+		return;		/* a cancel */
+	if (IORING_CQE_F_BUFFER & cqe->flags) {
+		bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if (cqe->res > 0 && us->ep != NULL) {
+			us->errors = 0;
+			uring_packet(us, buf_base + (size_t)bid * URING_BUFSIZE,
+				     (size_t)cqe->res);
+		}
+		uring_give(bid);
+	}
+	if (IORING_CQE_F_MORE & cqe->flags)
+		return;
+
+	/* the request is over */
+	us->armed = false;
+	if (NULL == us->ep) {
+		uring_drop(us);
+		return;
+	}
+	if (cqe->res < 0 && -ENOBUFS != cqe->res
+	    && (++us->errors >= URING_ERRORS || -EINVAL == cqe->res)) {
+		msyslog(LOG_ERR, "IO: io_uring: reading %s: %s, "
+			"reading it directly", latoa(us->ep),
+			strerror(-cqe->res));
+		io_endpt_polled(us->ep, false);
+		uring_drop(us);
+		return;
+	}
+	uring_arm(us);
+}
+
+
+/*
+ * uring_input - the ring has completions: take them all
+ */
+static void
+uring_input(
+	SOCKET	fd
+	)
+{
+	unsigned int	head, tail;
+	int		was = cpu_switch(CPU_RECEIVE);
+
+	UNUSED_ARG(fd);
+	for (;;) {
+		/* completions the queue had no room for wait in the kernel */
+		if (IORING_SQ_CQ_OVERFLOW & *sq_flags)
+			uring_enter(0, IORING_ENTER_GETEVENTS);
+		head = *cq_head;
+		tail = *cq_tail;
+		uring_barrier();
+		if (head == tail)
+			break;
+		for (; head != tail; head++)
+			uring_complete(&cqes[head & cq_mask]);
+		uring_barrier();
+		*cq_head = head;
+	}
+	flush_sendpkts();
+	cpu_switch(was);
+}
+
+
+/*
+ * uring_setup - make the ring and its buffers
+ */
+static bool
+uring_setup(void)
+{
+	struct io_uring_params	p;
+	struct io_uring_buf_reg	reg;
+	size_t			sqlen, cqlen, buflen;
+	char *			sqp;
+	char *			cqp;
+	void *			mem;
+
+	ZERO(p);
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ;
+	ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring_fd < 0)
+		return false;
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (IORING_FEAT_SINGLE_MMAP & p.features)
+		sqlen = cqlen = max(sqlen, cqlen);
+	sqp = mmap(NULL, sqlen, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == sqp)
+		return false;
+	cqp = sqp;
+	if (!(IORING_FEAT_SINGLE_MMAP & p.features)) {
+		cqp = mmap(NULL, cqlen, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (MAP_FAILED == cqp)
+			return false;
+	}
+	mem = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   ring_fd, IORING_OFF_SQES);
+	if (MAP_FAILED == mem)
+		return false;
+	sqes = mem;
+	sq_head = (unsigned int *)(sqp + p.sq_off.head);
+	sq_tail = (unsigned int *)(sqp + p.sq_off.tail);
+	sq_mask = *(unsigned int *)(sqp + p.sq_off.ring_mask);
+	sq_entries = *(unsigned int *)(sqp + p.sq_off.ring_entries);
+	sq_flags = (unsigned int *)(sqp + p.sq_off.flags);
+	sq_array = (unsigned int *)(sqp + p.sq_off.array);
+	cq_head = (unsigned int *)(cqp + p.cq_off.head);
+	cq_tail = (unsigned int *)(cqp + p.cq_off.tail);
+	cq_mask = *(unsigned int *)(cqp + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cqp + p.cq_off.cqes);
+
+	/* the buffer ring has to be page aligned */
+	buf_count = lean_memory ? URING_LEAN : URING_BUFS;
+	buflen = buf_count * sizeof(struct io_uring_buf);
+	mem = mmap(NULL, buflen, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mem)
+		return false;
+	buf_ring = mem;
+	ZERO(reg);
+	reg.ring_addr = (uintptr_t)buf_ring;
+	reg.ring_entries = buf_count;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ring_fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return false;
+	buf_base = emalloc_tag(MEM_RECVBUF, buf_count * URING_BUFSIZE);
+	for (unsigned short bid = 0; bid < buf_count; bid++)
+		uring_give(bid);
+	return true;
+}
+
+
+/*
+ * start_uring - set up the ring and take the endpoints' input away
+ * from the main loop
+ */
+void
+start_uring(void)
+{
+	if (!io_uring_input || uring_running)
+		return;
+	if (busy_poll > 0) {
+		msyslog(LOG_WARNING,
+			"INIT: iouring: the busy poller reads the sockets, ignored");
+		io_uring_input = false;
+		return;
+	}
+	if (!uring_setup()) {
+		/* the main loop keeps reading the endpoints */
+		msyslog(LOG_ERR, "INIT: iouring: can't set up the ring: %s",
+			strerror(errno));
+		if (ring_fd >= 0)
+			close(ring_fd);
+		ring_fd = -1;
+		io_uring_input = false;
+		return;
+	}
+	uring_running = true;
+	io_add_reader(ring_fd, uring_input);
+	for (endpt *ep = io_data.ep_list; ep != NULL; ep = ep->elink)
+		uring_add_endpt(ep);
+	msyslog(LOG_INFO, "INIT: io_uring multishot receive, %u buffers",
+		buf_count);
+}
+
+
+/*
+ * uring_memory - bytes in the provided buffers
+ */
+size_t
+uring_memory(void)
+{
+	return (NULL == buf_base) ? 0 : buf_count * URING_BUFSIZE;
+}
+
+#else	/* !USE_IO_URING */
+
+void
+uring_add_endpt(
+	endpt *	ep
+	)
+{
+	UNUSED_ARG(ep);
+}
+
+void
+uring_remove_endpt(
+	endpt *	ep
+	)
+{
+	UNUSED_ARG(ep);
+}
+
+void
+start_uring(void)
+{
+	if (io_uring_input) {
+		msyslog(LOG_WARNING,
+			"INIT: iouring: not supported on this system, ignored");
+		io_uring_input = false;
+	}
+}
+
+size_t
+uring_memory(void)
+{
+	return 0;
+}
+#endif	/* !USE_IO_URING */
@@ -17,6 +17,8 @@
 
 #include <stdio.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -26,11 +28,6 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 
-/*
- * Defines used by file logging
- */
-#define MJD_1970        40587           /* MJD for 1 Jan 1970 */
-
 /*
  * This contains odds and ends, including the hourly stats, various
  * configuration items, leapseconds stuff, etc.
@@ -39,13 +36,19 @@
  * File names
  */
 static	char *key_file_name;		/* keys file name */
+static struct stat key_file_stat;	/* keys file stat() buffer */
 static char *leapfile_name;		/* leapseconds file name */
 static struct stat leapfile_stat;	/* leapseconds file stat() buffer */
 static bool have_leapfile = false;
+static bool leapfile_force;		/* reload even if unchanged */
+static leap_table_t *leap_pending;	/* read by the file watcher */
+static pthread_mutex_t leap_pending_lock = PTHREAD_MUTEX_INITIALIZER;
 char *stats_drift_file;			/* frequency file name */
+static char *stats_state_file;		/* warm restart file name */
 static double wander_resid;		/* last frequency update */
 double	wander_threshold = 1e-7;	/* initial frequency threshold */
-static char *timespec_to_MJDtime(const struct timespec *);
+#define MJDTIME_LEN	32	/* "%lu %lu.%03lu" */
+static char *timespec_to_MJDtime(const struct timespec *, char *, size_t);
 
 /*
  * Statistics file stuff
@@ -59,14 +62,72 @@ char statsdir[MAXFILENAME] = NTP_VAR;
 static FILEGEN clockstats;
 static FILEGEN loopstats;
 static FILEGEN peerstats;
+static FILEGEN peeraggstats;
+static FILEGEN loopaggstats;
 static FILEGEN protostats;
 static FILEGEN rawstats;
 static FILEGEN refstats;
 static FILEGEN sysstats;
 static FILEGEN usestats;
 static FILEGEN ntsstats;
+
+/*
+ * Binary records for the busiest files, see filegen_binary().
+ * Keep these in step with the put_*() calls that fill them in.
+ */
+#define RAWSTATS_RECLEN		104
+static const char rawstats_fields[] =
+	"time:ns64 src:addr dst:addr t1:lfp t2:lfp t3:lfp t4:lfp "
+	"leap:u8 version:u8 mode:u8 stratum:u8 ppoll:i8 precision:i8 "
+	"rootdelay:fix16 rootdisp:fix16 refid:refid "
+	"outcount:u32 bogons:u32 flag:x32";
+#define PEERSTATS_RECLEN	59
+static const char peerstats_fields[] =
+	"time:ns64 src:addr status:x16 "
+	"offset:f64 delay:f64 disp:f64 jitter:f64";
+
+#define BIN_ADDRLEN		17	/* kind, then 16 bytes */
+#define BIN_ADDR_NONE		0
+#define BIN_ADDR_V4		4
+#define BIN_ADDR_V6		6
+#define BIN_ADDR_REFCLOCK	'R'	/* NUL padded name */
 static FILEGEN ntskestats;
 
+/*
+ * A minute of peer or loop updates for peeraggstats and loopaggstats:
+ * the extremes and moments of each value, and up to AGG_SAMPLES
+ * offsets for the percentiles.  Past that, each new offset takes the
+ * place of the oldest, so the percentiles are of the last ones.
+ */
+#define AGG_INTERVAL	60	/* s, whole UTC minutes */
+#define AGG_SAMPLES	64
+#define AGG_VALUES	4	/* offset first */
+
+struct stats_agg {
+	time_t		start;		/* of the interval */
+	unsigned long	n;		/* updates in it, 0 for none */
+	double		min[AGG_VALUES];
+	double		max[AGG_VALUES];
+	double		sum[AGG_VALUES];
+	double		sumsq[AGG_VALUES];
+	double		offset[AGG_SAMPLES];
+	int		poll;		/* the last, for the loop */
+};
+
+static struct stats_agg	loop_agg;
+static time_t		agg_current;	/* interval the timer is in */
+
+struct histogram latency[LAT_MAX];
+static const char * const latency_name[LAT_MAX] = {
+	"xmit", "receive", "select", "clock", "ntske", "input"
+};
+
+l_fp cpu_time[CPU_MAX];
+static int		cpu_current = CPU_OTHER;
+static struct timespec	cpu_mark;
+static pthread_t	cpu_thread;
+static bool		cpu_running;
+
 /*
  * This controls whether stats are written to the fileset. Provided
  * so that ntpq can turn off stats when the file system fills up.
@@ -85,8 +146,16 @@ static	void	record_sys_stats(void);
 static	void	record_use_stats(void);
 static	void	record_nts_stats(void);
 static	void	record_ntske_stats(void);
+static	void	record_latency_stats(void);
+static	void	agg_add		(struct stats_agg *, time_t,
+				 const double *, int);
+static	char *	agg_format	(const struct stats_agg *, int, char *,
+				 size_t);
+static	void	agg_write_peer	(struct peer *);
+static	void	agg_write_loop	(void);
 	void	ntpd_time_stepped(void);
 static  void	check_leap_expiration(bool, time_t);
+static  void	leap_file_changed(const char *, struct stat *, bool);
 
 /*
  * Prototypes
@@ -102,10 +171,15 @@ void	uninit_util(void);
 void
 uninit_util(void)
 {
+	filegen_stop_writer();
 	if (stats_drift_file) {
 		free(stats_drift_file);
 		stats_drift_file = NULL;
 	}
+	if (stats_state_file) {
+		free(stats_state_file);
+		stats_state_file = NULL;
+	}
 	if (key_file_name) {
 		free(key_file_name);
 		key_file_name = NULL;
@@ -116,6 +190,8 @@ uninit_util(void)
 	filegen_unregister("refstats");
 	filegen_unregister("sysstats");
 	filegen_unregister("peerstats");
+	filegen_unregister("peeraggstats");
+	filegen_unregister("loopaggstats");
 	filegen_unregister("protostats");
 	filegen_unregister("usestats");
 	filegen_unregister("ntsstats");
@@ -136,10 +212,14 @@ init_util(void)
 	filegen_register(statsdir, "refstats",	  &refstats);
 	filegen_register(statsdir, "sysstats",	  &sysstats);
 	filegen_register(statsdir, "peerstats",	  &peerstats);
+	filegen_register(statsdir, "peeraggstats", &peeraggstats);
+	filegen_register(statsdir, "loopaggstats", &loopaggstats);
 	filegen_register(statsdir, "protostats",  &protostats);
 	filegen_register(statsdir, "usestats",	  &usestats);
 	filegen_register(statsdir, "ntsstats",	  &ntsstats);
 	filegen_register(statsdir, "ntskestats",  &ntskestats);
+	filegen_binary(&rawstats, rawstats_fields, RAWSTATS_RECLEN);
+	filegen_binary(&peerstats, peerstats_fields, PEERSTATS_RECLEN);
 
 	/*
 	 * register with libntp ntp_set_tod() to call us back
@@ -207,10 +287,12 @@ static void drift_write(char *driftfile, double drift) {
  */
 void
 write_stats(void) {
+	state_write();
 	record_sys_stats();
 	record_use_stats();
 	record_nts_stats();
 	record_ntske_stats();
+	record_latency_stats();
 	if (stats_drift_file != NULL) {
 
 		/*
@@ -253,6 +335,262 @@ static bool drift_read(const char *drift_file, double *drift)
 	return true;
 }
 
+/* Optional state file, statefile, so that after a restart the
+ * associations and the rate limiter carry on from where they were
+ * rather than from nothing.  Read at startup, written hourly and on
+ * the way out, like the NTS client cache.  A peer's entry is used
+ * once, by the first association with its address; what no
+ * association has claimed by the next write is dropped.
+ *
+ * Format:
+ *   T: <time saved>	(once, first)
+ *   P: <address:port> <hpoll> <reach> <nextpt> <jitter>
+ *   F: <offset> <delay> <dispersion> <order>	(NTP_SHIFT of them)
+ *   M: <address> <last> <count> <vn_mode> <score>	(oldest first)
+ *
+ * The dispersions are aged to the time saved, and again by the time
+ * ntpd was down when they are read back.  An MRU entry is only worth
+ * saving while its score could still matter to the rate limiter.
+ */
+#define STATE_LIFETIME	(2 * 3600)	/* two writes; older is news */
+
+struct saved_peer {
+	struct saved_peer *link;
+	sockaddr_u addr;
+	int hpoll, nextpt;
+	unsigned int reach;
+	double jitter;
+	double offset[NTP_SHIFT], delay[NTP_SHIFT], disp[NTP_SHIFT];
+	uint8_t order[NTP_SHIFT];
+};
+static struct saved_peer *saved_peers;
+static double saved_gone;		/* s from the save to the read */
+
+static void saved_peers_free(void)
+{
+	struct saved_peer *entry;
+
+	while (NULL != saved_peers) {
+		entry = saved_peers;
+		saved_peers = entry->link;
+		free(entry);
+	}
+}
+
+/* Main thread.  Give a new association what its address had before
+ * the restart.  The samples keep epoch 0, so none is mistaken for a
+ * fresh one and fed to the clock a second time.
+ */
+void state_restore_peer(struct peer *peer)
+{
+	struct saved_peer *entry, **prev;
+	double aged;
+
+	for (prev = &saved_peers; NULL != *prev; prev = &(*prev)->link) {
+		entry = *prev;
+		if (!ADDR_PORT_EQ(&entry->addr, &peer->srcadr))
+			continue;
+		*prev = entry->link;
+		peer->hpoll = (uint8_t)max(peer->cfg.minpoll,
+				min(peer->cfg.maxpoll, entry->hpoll));
+		peer->reach = (uint8_t)entry->reach;
+		peer->jitter = entry->jitter;
+		peer->filter_nextpt = entry->nextpt;
+		for (int i = 0; i < NTP_SHIFT; i++) {
+			aged = entry->disp[i] + loop_data.clock_phi * saved_gone;
+			peer->filter_offset[i] = entry->offset[i];
+			peer->filter_delay[i] = entry->delay[i];
+			peer->filter_disp[i] = min(aged, sys_maxdisp);
+			peer->filter_epoch[i] = 0;
+			peer->filter_order[i] = entry->order[i];
+		}
+		peer->update = current_time;
+		DPRINT(1, ("state_restore_peer: %s hpoll %d reach %03o\n",
+			   sockporttoa(&peer->srcadr), peer->hpoll,
+			   peer->reach));
+		free(entry);
+		return;
+	}
+}
+
+/* Read state from in, saved to a file or handed over by the ntpd
+ * this one replaces; name is for the log.
+ */
+static bool state_load(FILE *in, const char *name)
+{
+	unsigned long saved;
+	unsigned long long last;
+	char addrbuf[100];
+	struct saved_peer *entry = NULL;
+	sockaddr_u addr;
+	l_fp now;
+	float score;
+	int count, np = 0, nm = 0;
+	unsigned int vn_mode, order;
+
+	if (1 != fscanf(in, "T: %lu\n", &saved))
+		goto bail;
+	saved_gone = difftime(time(NULL), (time_t)saved);
+	if (STATE_LIFETIME < saved_gone || 0 > saved_gone) {
+		msyslog(LOG_INFO, "LOG: state from %s is too old", name);
+		return false;
+	}
+	get_systime(&now);
+	for (;;) {
+		if (5 == fscanf(in, "M: %99s %llu %d %u %f\n", addrbuf, &last,
+				&count, &vn_mode, &score)) {
+			if (0 != decodenetnum(addrbuf, &addr))
+				goto bail;
+			if (mon_restore(&addr, (l_fp)last, count,
+					(uint8_t)vn_mode, score, now))
+				nm++;
+			continue;
+		}
+		entry = emalloc_zero(sizeof(*entry));
+		if (1 != fscanf(in, "P: %99s", addrbuf)) {
+			if (feof(in))
+				break;
+			goto bail;
+		}
+		if (0 != decodenetnum(addrbuf, &entry->addr))
+			goto bail;
+		if (4 != fscanf(in, " %d %u %d %lf\n", &entry->hpoll,
+				&entry->reach, &entry->nextpt, &entry->jitter))
+			goto bail;
+		if (0 > entry->nextpt || NTP_SHIFT <= entry->nextpt)
+			goto bail;
+		for (int i = 0; i < NTP_SHIFT; i++) {
+			if (4 != fscanf(in, "F: %lf %lf %lf %u\n",
+					&entry->offset[i], &entry->delay[i],
+					&entry->disp[i], &order) ||
+			    NTP_SHIFT <= order)
+				goto bail;
+			entry->order[i] = (uint8_t)order;
+		}
+		entry->link = saved_peers;
+		saved_peers = entry;
+		np++;
+	}
+	free(entry);
+	msyslog(LOG_INFO, "LOG: read state from %s, %d peers, %d MRU entries",
+		name, np, nm);
+	return true;
+
+  bail:
+	free(entry);
+	saved_peers_free();
+	msyslog(LOG_ERR, "LOG: format error in state from %s", name);
+	return false;
+}
+
+/*
+ * state_restore - after mon_start(): read the state handed over, or
+ *		   failing that the state file, and put back the MRU
+ *		   entries and the associations made so far
+ */
+void
+state_restore(
+	FILE *	handed	/* from the ntpd we replace, or NULL */
+	)
+{
+	FILE *in;
+	bool ok;
+
+	if (NULL != handed) {
+		ok = state_load(handed, "handover");
+	} else {
+		if (NULL == stats_state_file)
+			return;
+		in = fopen(stats_state_file, "r");
+		if (NULL == in) {
+			if (ENOENT != errno)
+				msyslog(LOG_ERR, "LOG: state file %s: %s",
+					stats_state_file, strerror(errno));
+			return;
+		}
+		ok = state_load(in, stats_state_file);
+		fclose(in);
+	}
+	if (!ok)
+		return;
+	for (struct peer *p = peer_list; NULL != p; p = p->p_link)
+		if (!(FLAG_LOOKUP & p->cfg.flags))
+			state_restore_peer(p);
+}
+
+/*
+ * state_save - write the associations and the MRU scores to out.
+ *		With the protocol lock.
+ */
+void
+state_save(FILE *out)
+{
+	char addrbuf[100];
+	mon_entry *mon;
+	l_fp now;
+	double aged;
+	float score;
+
+	fprintf(out, "T: %lu\n", (unsigned long)time(NULL));
+	for (struct peer *p = peer_list; NULL != p; p = p->p_link) {
+		if ((FLAG_LOOKUP & p->cfg.flags) || 0 == p->reach)
+			continue;
+		aged = loop_data.clock_phi * (current_time - p->update);
+		sockporttoa_r(&p->srcadr, addrbuf, sizeof(addrbuf));
+		fprintf(out, "P: %s %d %u %d %.9g\n", addrbuf, p->hpoll,
+			p->reach, p->filter_nextpt, p->jitter);
+		for (int i = 0; i < NTP_SHIFT; i++)
+			fprintf(out, "F: %.9g %.9g %.9g %u\n",
+				p->filter_offset[i], p->filter_delay[i],
+				min(p->filter_disp[i] + aged, sys_maxdisp),
+				p->filter_order[i]);
+	}
+	if (MON_OFF != mon_data.mon_enabled) {
+		get_systime(&now);
+		mon_sort_mru();
+		for (mon = TAIL_DLIST(mon_data.mon_mru_list, mru);
+		     mon != NULL;
+		     mon = PREV_DLIST(mon_data.mon_mru_list, mon, mru)) {
+			if (!mon_state(mon, now, &score))
+				continue;
+			fprintf(out, "M: %s %llu %d %u %.6g\n",
+				socktoa_r(&mon->rmtadr, addrbuf,
+					  sizeof(addrbuf)),
+				(unsigned long long)mon->last, mon->count,
+				mon->vn_mode, score);
+		}
+	}
+}
+
+/*
+ * state_write - save the state file.  Main thread, with the protocol
+ *		 lock.
+ */
+void
+state_write(void)
+{
+	char tempfile[PATH_MAX];
+	FILE *out;
+
+	saved_peers_free();
+	if (NULL == stats_state_file)
+		return;
+	strlcpy(tempfile, stats_state_file, sizeof(tempfile));
+	strlcat(tempfile, "-tmp", sizeof(tempfile));
+	if ((out = fopen(tempfile, "w")) == NULL) {
+		msyslog(LOG_ERR, "LOG: state file %s: %s",
+			tempfile, strerror(errno));
+		return;
+	}
+	state_save(out);
+	(void)fclose(out);
+	/* atomic */
+	if (rename(tempfile, stats_state_file))
+		msyslog(LOG_WARNING,
+			"LOG: Unable to rename temp state file %s to %s, %s",
+			tempfile, stats_state_file, strerror(errno));
+}
+
 /*
  * stats_config - configure the stats operation
  */
@@ -331,6 +669,19 @@ stats_config(
 		write_pidfile(value, getpid());
 		break;
 
+	/*
+	 * Name the state file; state_restore() reads it once the MRU
+	 * list is up.
+	 */
+	case STATS_STATE_FILE:
+		if (!value || (len = strlen(value)) == 0) {
+			break;
+		}
+
+		stats_state_file = erealloc(stats_state_file, len + 1);
+		memcpy(stats_state_file, value, len + 1);
+		break;
+
 	/*
 	 * Read leapseconds file.
 	 *
@@ -368,6 +719,8 @@ stats_config(
 			 */
 			check_leap_expiration(true, ttnow);
 		}
+		leapfile_force = !have_leapfile;
+		filewatch_add(leapfile_name, &leapfile_stat, leap_file_changed);
 		break;
 
 	default:
@@ -377,32 +730,103 @@ stats_config(
 }
 
 /* timespec_to_MJDtime
+ *
+ * The stats files are written from the main thread, a day at a time,
+ * so the day is worked out once and kept.
  */
 
 static char *
-timespec_to_MJDtime(const struct timespec *ts) {
-	char *buf;
+timespec_to_MJDtime(const struct timespec *ts, char *buf, size_t len) {
+	static ntpcal_daycache today;
 	unsigned long	day, sec, msec;
+	size_t		n;
 
-	buf = lib_getbuf();
-
-	day = (unsigned long)ts->tv_sec / SECSPERDAY + MJD_1970;
-	sec = (unsigned long)ts->tv_sec % SECSPERDAY;
+	sec = (unsigned long)ntpcal_daycache_update(&today,
+						    (time64_t)ts->tv_sec);
+	day = (unsigned long)today.mjd;
 	msec = (unsigned long)ts->tv_nsec / NS_PER_MS;  /* nano secs to milli sec */
-	snprintf(buf, LIB_BUFLENGTH, "%lu %lu.%03lu", day, sec, msec);
+
+	/* "%lu %lu.%03lu", without the printf */
+	n = u64toa_r(day, buf, len);
+	buf[n++] = ' ';
+	n += u64toa_r(sec, buf + n, len - n);
+	buf[n++] = '.';
+	buf[n++] = (char)('0' + msec / 100);
+	memcpy(buf + n, &digit_pairs[2 * (msec % 100)], 2);
+	buf[n + 2] = '\0';
 
 	return buf;
 }
 
 
 static const char *
-peerlabel(const struct peer *peer) {
+peerlabel(const struct peer *peer, char *buf, size_t len) {
 #if defined(REFCLOCK) && !defined(ENABLE_CLASSIC_MODE)
 	if (peer->procptr != NULL)
 		return refclock_name(peer);
 	else
 #endif /* defined(REFCLOCK) && !defined(ENABLE_CLASSIC_MODE)*/
-		return socktoa(&peer->srcadr);
+		return socktoa_r(&peer->srcadr, buf, len);
+}
+
+/*
+ * Little-endian encoders for binary records.  Each returns the
+ * position after the field.
+ */
+static uint8_t *
+put_le(uint8_t *p, uint64_t v, int len)
+{
+	for (int i = 0; i < len; i++) {
+		*p++ = (uint8_t)v;
+		v >>= 8;
+	}
+	return p;
+}
+
+static uint8_t *
+put_f64(uint8_t *p, double d)
+{
+	uint64_t v;
+
+	memcpy(&v, &d, sizeof(v));
+	return put_le(p, v, 8);
+}
+
+static uint8_t *
+put_ns64(uint8_t *p, const struct timespec *ts)
+{
+	return put_le(p, (uint64_t)ts->tv_sec * NS_PER_S
+		      + (uint64_t)ts->tv_nsec, 8);
+}
+
+static uint8_t *
+put_addr(uint8_t *p, const sockaddr_u *addr)
+{
+	memset(p, '\0', BIN_ADDRLEN);
+	if (NULL == addr)
+		p[0] = BIN_ADDR_NONE;
+	else if (IS_IPV4(addr)) {
+		p[0] = BIN_ADDR_V4;
+		memcpy(p + 1, &SOCK_ADDR4(addr), 4);
+	} else {
+		p[0] = BIN_ADDR_V6;
+		memcpy(p + 1, NSRCADR6(addr), 16);
+	}
+	return p + BIN_ADDRLEN;
+}
+
+static uint8_t *
+put_peer(uint8_t *p, const struct peer *peer)
+{
+#if defined(REFCLOCK) && !defined(ENABLE_CLASSIC_MODE)
+	if (peer->procptr != NULL) {
+		memset(p, '\0', BIN_ADDRLEN);
+		p[0] = BIN_ADDR_REFCLOCK;
+		strncpy((char *)p + 1, refclock_name(peer), BIN_ADDRLEN - 1);
+		return p + BIN_ADDRLEN;
+	}
+#endif /* defined(REFCLOCK) && !defined(ENABLE_CLASSIC_MODE)*/
+	return put_addr(p, &peer->srcadr);
 }
 
 /*
@@ -425,20 +849,45 @@ record_peer_stats(
 	)
 {
 	struct timespec now;
+	char		mjd[MJDTIME_LEN];
+	char		label[LIB_BUFLENGTH];
 
 	if (!stats_control)
 		return;
 
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&peerstats, now.tv_sec);
-	if (peerstats.fp != NULL) {
-		fprintf(peerstats.fp,
-		    "%s %s %x %.9f %.9f %.9f %.9f\n",
-		    timespec_to_MJDtime(&now),
-		    peerlabel(peer), (unsigned int)status, peer->offset,
-		    peer->delay, peer->disp, peer->jitter);
-		fflush(peerstats.fp);
+	if (peeraggstats.flag & FGEN_FLAG_ENABLED) {
+		const double v[3] = { peer->offset, peer->delay,
+				      peer->jitter };
+
+		if (NULL == peer->cold->agg)
+			peer->cold->agg = emalloc_zero_tag(MEM_PEER,
+						sizeof(*peer->cold->agg));
+		else if (peer->cold->agg->n > 0 &&
+			 peer->cold->agg->start != now.tv_sec / AGG_INTERVAL *
+						   AGG_INTERVAL)
+			agg_write_peer(peer);
+		agg_add(peer->cold->agg, now.tv_sec, v, COUNTOF(v));
 	}
+	if (peerstats.flag & FGEN_FLAG_BINARY) {
+		uint8_t rec[PEERSTATS_RECLEN], *p = rec;
+
+		p = put_ns64(p, &now);
+		p = put_peer(p, peer);
+		p = put_le(p, (unsigned int)status, 2);
+		p = put_f64(p, peer->offset);
+		p = put_f64(p, peer->delay);
+		p = put_f64(p, peer->disp);
+		p = put_f64(p, peer->jitter);
+		INSIST(p == rec + sizeof(rec));
+		filegen_write_binary(&peerstats, now.tv_sec, rec, sizeof(rec));
+		return;
+	}
+	filegen_write(&peerstats, now.tv_sec,
+	    "%s %s %x %.9f %.9f %.9f %.9f\n",
+	    timespec_to_MJDtime(&now, mjd, sizeof(mjd)),
+	    peerlabel(peer, label, sizeof(label)), (unsigned int)status,
+	    peer->offset, peer->delay, peer->disp, peer->jitter);
 }
 
 /*
@@ -463,19 +912,219 @@ record_loop_stats(
 	)
 {
 	struct timespec	now;
+	char		mjd[MJDTIME_LEN];
 
 	if (!stats_control)
 		return;
 
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&loopstats, now.tv_sec);
-	if (loopstats.fp != NULL) {
-		fprintf(loopstats.fp, "%s %.9f %.6f %.9f %.6f %d\n",
-		    timespec_to_MJDtime(&now),
-		    offset, freq * US_PER_S, jitter,
-		    wander * US_PER_S, spoll);
-		fflush(loopstats.fp);
+	if (loopaggstats.flag & FGEN_FLAG_ENABLED) {
+		const double v[AGG_VALUES] = { offset, freq * US_PER_S,
+					       jitter, wander * US_PER_S };
+
+		if (loop_agg.n > 0 && loop_agg.start !=
+		    now.tv_sec / AGG_INTERVAL * AGG_INTERVAL)
+			agg_write_loop();
+		agg_add(&loop_agg, now.tv_sec, v, AGG_VALUES);
+		loop_agg.poll = spoll;
+	}
+	filegen_write(&loopstats, now.tv_sec, "%s %.9f %.6f %.9f %.6f %d\n",
+	    timespec_to_MJDtime(&now, mjd, sizeof(mjd)),
+	    offset, freq * US_PER_S, jitter,
+	    wander * US_PER_S, spoll);
+}
+
+
+/*
+ * agg_add - count an update at now in the aggregate, starting a new
+ * interval if it is empty
+ */
+static void
+agg_add(
+	struct stats_agg *	agg,
+	time_t			now,
+	const double *		v,
+	int			nv
+	)
+{
+	if (0 == agg->n) {
+		agg->start = now / AGG_INTERVAL * AGG_INTERVAL;
+		for (int i = 0; i < nv; i++) {
+			agg->min[i] = agg->max[i] = v[i];
+			agg->sum[i] = agg->sumsq[i] = 0;
+		}
+	}
+	for (int i = 0; i < nv; i++) {
+		agg->min[i] = min(agg->min[i], v[i]);
+		agg->max[i] = max(agg->max[i], v[i]);
+		agg->sum[i] += v[i];
+		agg->sumsq[i] += v[i] * v[i];
+	}
+	agg->offset[agg->n % AGG_SAMPLES] = v[0];
+	agg->n++;
+}
+
+
+static int
+agg_cmp(
+	const void *	a,
+	const void *	b
+	)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+
+/*
+ * agg_format - the fields after the count: min, mean, max and
+ * standard deviation of each of nv values, with the 5th, 50th and
+ * 95th percentile offsets after the offset's
+ */
+static char *
+agg_format(
+	const struct stats_agg *agg,
+	int			nv,
+	char *			buf,
+	size_t			len
+	)
+{
+	double		sorted[AGG_SAMPLES];
+	size_t		ns = min(agg->n, AGG_SAMPLES);
+	size_t		used = 0;
+	double		mean, var;
+
+	memcpy(sorted, agg->offset, ns * sizeof(*sorted));
+	qsort(sorted, ns, sizeof(*sorted), agg_cmp);
+	for (int i = 0; i < nv && used < len; i++) {
+		mean = agg->sum[i] / agg->n;
+		var = agg->sumsq[i] / agg->n - mean * mean;
+		used += (size_t)snprintf(buf + used, len - used,
+		    " %.9f %.9f %.9f %.9f", agg->min[i], mean, agg->max[i],
+		    sqrt(max(var, 0)));
+		if (0 == i && used < len)
+			used += (size_t)snprintf(buf + used, len - used,
+			    " %.9f %.9f %.9f", sorted[(ns - 1) * 5 / 100],
+			    sorted[(ns - 1) / 2], sorted[(ns - 1) * 95 / 100]);
 	}
+	return buf;
+}
+
+
+/*
+ * agg_write_peer - write and empty a peer's peeraggstats interval
+ *
+ * file format:
+ * day (MJD)
+ * time (s past UTC midnight), the start of the interval
+ * IP address or drivername(unit)
+ * updates
+ * offset min, mean, max, standard deviation, 5th, 50th, 95th
+ *   percentile
+ * delay min, mean, max, standard deviation
+ * jitter min, mean, max, standard deviation
+ */
+static void
+agg_write_peer(
+	struct peer *peer
+	)
+{
+	struct stats_agg *agg = peer->cold->agg;
+	struct timespec	start;
+	char		mjd[MJDTIME_LEN];
+	char		label[LIB_BUFLENGTH];
+	char		fields[512];
+
+	if (NULL == agg || 0 == agg->n)
+		return;
+	start.tv_sec = agg->start;
+	start.tv_nsec = 0;
+	filegen_write(&peeraggstats, agg->start, "%s %s %lu%s\n",
+	    timespec_to_MJDtime(&start, mjd, sizeof(mjd)),
+	    peerlabel(peer, label, sizeof(label)), agg->n,
+	    agg_format(agg, 3, fields, sizeof(fields)));
+	agg->n = 0;
+}
+
+
+/*
+ * agg_write_loop - write and empty the loopaggstats interval
+ *
+ * file format:
+ * day (MJD)
+ * time (s past UTC midnight), the start of the interval
+ * updates
+ * offset min, mean, max, standard deviation, 5th, 50th, 95th
+ *   percentile
+ * frequency (PPM) min, mean, max, standard deviation
+ * jitter min, mean, max, standard deviation
+ * wander (PPM) min, mean, max, standard deviation
+ * time constant (log2), the last
+ */
+static void
+agg_write_loop(void)
+{
+	struct timespec	start;
+	char		mjd[MJDTIME_LEN];
+	char		fields[512];
+
+	if (0 == loop_agg.n)
+		return;
+	start.tv_sec = loop_agg.start;
+	start.tv_nsec = 0;
+	filegen_write(&loopaggstats, loop_agg.start, "%s %lu%s %d\n",
+	    timespec_to_MJDtime(&start, mjd, sizeof(mjd)), loop_agg.n,
+	    agg_format(&loop_agg, AGG_VALUES, fields, sizeof(fields)),
+	    loop_agg.poll);
+	loop_agg.n = 0;
+}
+
+
+/*
+ * record_agg_stats - once a second: when a minute is over, write the
+ * aggregates of everything updated in it
+ */
+void
+record_agg_stats(void)
+{
+	struct timespec	now;
+	time_t		interval;
+	int		was;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	interval = now.tv_sec / AGG_INTERVAL * AGG_INTERVAL;
+	if (interval == agg_current)
+		return;
+	agg_current = interval;
+	if (!stats_control)
+		return;
+	was = cpu_switch(CPU_STATS);
+	for (struct peer *p = peer_list; NULL != p; p = p->p_link)
+		if (NULL != p->cold->agg && p->cold->agg->start != interval)
+			agg_write_peer(p);
+	if (loop_agg.start != interval)
+		agg_write_loop();
+	cpu_switch(was);
+}
+
+
+/*
+ * peer_agg_forget - write what a departing peer has of its interval
+ * and free the aggregate
+ */
+void
+peer_agg_forget(
+	struct peer *peer
+	)
+{
+	if (NULL == peer->cold->agg)
+		return;
+	if (stats_control)
+		agg_write_peer(peer);
+	free_tag(MEM_PEER, peer->cold->agg, sizeof(*peer->cold->agg));
+	peer->cold->agg = NULL;
 }
 
 
@@ -495,17 +1144,16 @@ record_clock_stats(
 	)
 {
 	struct timespec	now;
+	char		mjd[MJDTIME_LEN];
+	char		label[LIB_BUFLENGTH];
 
 	if (!stats_control)
 		return;
 
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&clockstats, now.tv_sec);
-	if (clockstats.fp != NULL) {
-		fprintf(clockstats.fp, "%s %s %s\n",
-		    timespec_to_MJDtime(&now), peerlabel(peer), text);
-		fflush(clockstats.fp);
-	}
+	filegen_write(&clockstats, now.tv_sec, "%s %s %s\n",
+	    timespec_to_MJDtime(&now, mjd, sizeof(mjd)),
+	    peerlabel(peer, label, sizeof(label)), text);
 }
 
 
@@ -552,6 +1200,10 @@ record_raw_stats(
   unsigned int outcount)
 {
 	struct timespec	now;
+	char		mjd[MJDTIME_LEN];
+	char		label[LIB_BUFLENGTH], dst[LIB_BUFLENGTH];
+	char		ts[4][LFPTOA_LEN];
+	char		refid_buf[LIB_BUFLENGTH];
 	const sockaddr_u *dstaddr = peer->dstadr ? &peer->dstadr->sin : NULL;
 	/* This lies.  It shows the time we sent it rather than the
 	 * data from the packet which was probably random.
@@ -569,22 +1221,56 @@ record_raw_stats(
 	if (!stats_control)
 		return;
 
+	/* skip the formatting if nobody wants it */
+	if (!(rawstats.flag & FGEN_FLAG_ENABLED))
+		return;
+
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&rawstats, now.tv_sec);
-	if (rawstats.fp == NULL) return;
 
 	/* copy of PKT_TO_STRATUM from ntp_proto.c */
 	stratum = rbufp->pkt.stratum;
 	if (stratum == STRATUM_PKT_UNSPEC) stratum = STRATUM_UNSPEC;
 
-	rootdelay = scalbn((double)rbufp->pkt.rootdelay, -16);
-	rootdisp = scalbn((double)rbufp->pkt.rootdisp, -16);
+	if (rawstats.flag & FGEN_FLAG_BINARY) {
+		uint8_t rec[RAWSTATS_RECLEN], *p = rec;
+
+		p = put_ns64(p, &now);
+		p = put_peer(p, peer);
+		p = put_addr(p, dstaddr);
+		p = put_le(p, t1, 8);
+		p = put_le(p, t2, 8);
+		p = put_le(p, t3, 8);
+		p = put_le(p, t4, 8);
+		*p++ = PKT_LEAP(rbufp->pkt.li_vn_mode);
+		*p++ = PKT_VERSION(rbufp->pkt.li_vn_mode);
+		*p++ = PKT_MODE(rbufp->pkt.li_vn_mode);
+		*p++ = (uint8_t)stratum;
+		*p++ = rbufp->pkt.ppoll;
+		*p++ = (uint8_t)rbufp->pkt.precision;
+		p = put_le(p, rbufp->pkt.rootdelay, 4);
+		p = put_le(p, rbufp->pkt.rootdisp, 4);
+		memcpy(p, rbufp->pkt.refid, REFIDLEN);
+		p += REFIDLEN;
+		p = put_le(p, outcount, 4);
+		p = put_le(p, peer->bogons, 4);
+		p = put_le(p, flag, 4);
+		INSIST(p == rec + sizeof(rec));
+		filegen_write_binary(&rawstats, now.tv_sec, rec, sizeof(rec));
+		return;
+	}
 
-	fprintf(rawstats.fp, "%s %s %s %s %s %s %s %d %d %d %d %d %d %.6f %.6f %s %u %u %x\n",
-	    timespec_to_MJDtime(&now),
-	    peerlabel(peer), dstaddr ?  socktoa(dstaddr) : "-",
-	    ulfptoa(t1, 9), ulfptoa(t2, 9),
-	    ulfptoa(t3, 9), ulfptoa(t4, 9),
+	rootdelay = FP_UNSCALE(rbufp->pkt.rootdelay);
+	rootdisp = FP_UNSCALE(rbufp->pkt.rootdisp);
+
+	filegen_write(&rawstats, now.tv_sec,
+	    "%s %s %s %s %s %s %s %d %d %d %d %d %d %.6f %.6f %s %u %u %x\n",
+	    timespec_to_MJDtime(&now, mjd, sizeof(mjd)),
+	    peerlabel(peer, label, sizeof(label)),
+	    dstaddr ?  socktoa_r(dstaddr, dst, sizeof(dst)) : "-",
+	    ulfptoa_r(t1, 9, ts[0], sizeof(ts[0])),
+	    ulfptoa_r(t2, 9, ts[1], sizeof(ts[1])),
+	    ulfptoa_r(t3, 9, ts[2], sizeof(ts[2])),
+	    ulfptoa_r(t4, 9, ts[3], sizeof(ts[3])),
 	    PKT_LEAP(rbufp->pkt.li_vn_mode),
 	    PKT_VERSION(rbufp->pkt.li_vn_mode),
 	    PKT_MODE(rbufp->pkt.li_vn_mode),
@@ -593,9 +1279,8 @@ record_raw_stats(
 	    rbufp->pkt.precision,
 	    rootdelay,
 	    rootdisp,
-	    refid_str(refid, stratum),
+	    refid_str_r(refid, stratum, refid_buf, sizeof(refid_buf)),
 	    outcount, peer->bogons, flag);
-	fflush(rawstats.fp);
 }
 
 /*
@@ -626,20 +1311,19 @@ void record_ref_stats(
     )
 {
     struct timespec now;
+    char mjd[MJDTIME_LEN];
+    char label[LIB_BUFLENGTH];
 
     if (!stats_control)
         return;
 
     clock_gettime(CLOCK_REALTIME, &now);
-    filegen_setup(&refstats, now.tv_sec);
-    if (refstats.fp != NULL) {
-        fprintf(refstats.fp,
-            "%s %s %d %d %d  %.9f %.9f %.9f %.9f %.9f  %.9f %.9f %.9f\n",
-            timespec_to_MJDtime(&now), peerlabel(peer),
-            n, i, j,
-            t1, t2, t3, t4, t5, jitter, std_dev, std_dev_all);
-        fflush(refstats.fp);
-    }
+    filegen_write(&refstats, now.tv_sec,
+        "%s %s %d %d %d  %.9f %.9f %.9f %.9f %.9f  %.9f %.9f %.9f\n",
+        timespec_to_MJDtime(&now, mjd, sizeof(mjd)),
+        peerlabel(peer, label, sizeof(label)),
+        n, i, j,
+        t1, t2, t3, t4, t5, jitter, std_dev, std_dev_all);
 }
 
 
@@ -661,29 +1345,29 @@ void record_ref_stats(
  * rate exceeded
  * KoD sent
  * NTPv1 packets
+ * KoD over the kodmax budget
+ * duplicate client requests
  */
 void
 record_sys_stats(void)
 {
 	struct timespec	now;
+	char		mjd[MJDTIME_LEN];
 
 	if (!stats_control)
 		return;
 
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&sysstats, now.tv_sec);
-	if (sysstats.fp != NULL) {
-		fprintf(sysstats.fp,
-		    "%s %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
-		    " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 \
-		    " %" PRIu64 " %" PRIu64"\n",
-			timespec_to_MJDtime(&now), stat_stattime(),
-			stat_received(), stat_processed(), stat_newversion(),
-			stat_oldversion(), stat_restricted(), stat_badlength(),
-			stat_badauth(), stat_declined(), stat_limitrejected(),
-			stat_kodsent(), stat_version1());
-		fflush(sysstats.fp);
-	}
+	filegen_write(&sysstats, now.tv_sec,
+	    "%s %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+	    " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 \
+	    " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+		timespec_to_MJDtime(&now, mjd, sizeof(mjd)), stat_stattime(),
+		stat_received(), stat_processed(), stat_newversion(),
+		stat_oldversion(), stat_restricted(), stat_badlength(),
+		stat_badauth(), stat_declined(), stat_limitrejected(),
+		stat_kodsent(), stat_version1(), stat_kodlimited(),
+		stat_duplicate());
 	proto_clr_stats();
 }
 
@@ -699,6 +1383,7 @@ record_sys_stats(void)
 void record_use_stats(void)
 {
 	struct timespec	now;
+	char		mjd[MJDTIME_LEN];
 	struct rusage usage;
 	static struct rusage oldusage;
 	/* Descriptions in NetBSD and FreeBSD are better than Linux
@@ -708,8 +1393,7 @@ void record_use_stats(void)
 		return;
 
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&usestats, now.tv_sec);
-	if (usestats.fp != NULL) {
+	if (usestats.flag & FGEN_FLAG_ENABLED) {
 		double utime, stimex; /* stime() is in time.h */
 		getrusage(RUSAGE_SELF, &usage);
 		utime = usage.ru_utime.tv_usec - oldusage.ru_utime.tv_usec;
@@ -718,9 +1402,9 @@ void record_use_stats(void)
 		stimex = usage.ru_stime.tv_usec - oldusage.ru_stime.tv_usec;
 		stimex /= 1E6;
 		stimex += usage.ru_stime.tv_sec - oldusage.ru_stime.tv_sec;
-		fprintf(usestats.fp,
+		filegen_write(&usestats, now.tv_sec,
 		    "%s %u %.3f %.3f %ld %ld %ld %ld %ld %ld %ld %ld %ld\n",
-		    timespec_to_MJDtime(&now), stat_use_stattime(),
+		    timespec_to_MJDtime(&now, mjd, sizeof(mjd)), stat_use_stattime(),
 		    utime, stimex,
 		    usage.ru_minflt -   oldusage.ru_minflt,
 		    usage.ru_majflt -   oldusage.ru_majflt,
@@ -731,7 +1415,6 @@ void record_use_stats(void)
 		    usage.ru_nivcsw -   oldusage.ru_nivcsw,
 		    usage.ru_nsignals - oldusage.ru_nsignals,
 		    usage.ru_maxrss );
-		fflush(usestats.fp);
 		oldusage = usage;
 		set_use_stattime(current_time);
 	}
@@ -742,33 +1425,31 @@ uptime_t nts_stattime;
 void record_nts_stats(void) {
 #ifndef DISABLE_NTS
 	struct timespec	now;
+	char		mjd[MJDTIME_LEN];
 
 	if (!stats_control)
 		return;
 
+	nts_fold_counters();
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&ntsstats, now.tv_sec);
-	if (ntsstats.fp != NULL) {
-		fprintf(ntsstats.fp,
-		    "%s %u %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
-		    timespec_to_MJDtime(&now), current_time-nts_stattime,
-		    nts_since(client_send),
-		    nts_since(client_recv_good),
-		    nts_since(client_recv_bad),
-		    nts_since(server_send),
-		    nts_since(server_recv_good),
-		    nts_since(server_recv_bad),
-		    nts_since(cookie_make),
-		    nts_since(cookie_not_server),
-		    nts_since(cookie_decode_total),
-		    nts_since(cookie_decode_current),
-		    nts_since(cookie_decode_old),
-		    nts_since(cookie_decode_old2),
-		    nts_since(cookie_decode_older),
-		    nts_since(cookie_decode_too_old),
-		    nts_since(cookie_decode_error) );
-		fflush(ntsstats.fp);
-	}
+	filegen_write(&ntsstats, now.tv_sec,
+	    "%s %u %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+	    timespec_to_MJDtime(&now, mjd, sizeof(mjd)), current_time-nts_stattime,
+	    nts_since(client_send),
+	    nts_since(client_recv_good),
+	    nts_since(client_recv_bad),
+	    nts_since(server_send),
+	    nts_since(server_recv_good),
+	    nts_since(server_recv_bad),
+	    nts_since(cookie_make),
+	    nts_since(cookie_not_server),
+	    nts_since(cookie_decode_total),
+	    nts_since(cookie_decode_current),
+	    nts_since(cookie_decode_old),
+	    nts_since(cookie_decode_old2),
+	    nts_since(cookie_decode_older),
+	    nts_since(cookie_decode_too_old),
+	    nts_since(cookie_decode_error) );
 	old_nts_cnt = nts_cnt;
 	nts_stattime = current_time;
 #endif
@@ -780,29 +1461,27 @@ uptime_t ntske_stattime;
 void record_ntske_stats(void) {
 #ifndef DISABLE_NTS
 	struct timespec	now;
+	char		mjd[MJDTIME_LEN];
 
 	if (!stats_control)
 		return;
 
+	nts_fold_counters();
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&ntskestats, now.tv_sec);
-	if (ntsstats.fp != NULL) {
-		fprintf(ntskestats.fp,
-		    "%s %u %llu %.3f %.3f %llu %.3f %.3f %llu %.3f %.3f %llu %llu\n",
-		    timespec_to_MJDtime(&now), current_time-ntske_stattime,
-		    ntske_since(serves_good),
-		    ntske_since_f(serves_good_wall),
-		    ntske_since_f(serves_good_cpu),
-		    ntske_since(serves_nossl),
-		    ntske_since_f(serves_nossl_wall),
-		    ntske_since_f(serves_nossl_cpu),
-		    ntske_since(serves_bad),
-		    ntske_since_f(serves_bad_wall),
-		    ntske_since_f(serves_bad_cpu),
-		    ntske_since(probes_good),
-		    ntske_since(probes_bad) );
-		fflush(ntskestats.fp);
-	}
+	filegen_write(&ntskestats, now.tv_sec,
+	    "%s %u %llu %.3f %.3f %llu %.3f %.3f %llu %.3f %.3f %llu %llu\n",
+	    timespec_to_MJDtime(&now, mjd, sizeof(mjd)), current_time-ntske_stattime,
+	    ntske_since(serves_good),
+	    ntske_since_f(serves_good_wall),
+	    ntske_since_f(serves_good_cpu),
+	    ntske_since(serves_nossl),
+	    ntske_since_f(serves_nossl_wall),
+	    ntske_since_f(serves_nossl_cpu),
+	    ntske_since(serves_bad),
+	    ntske_since_f(serves_bad_wall),
+	    ntske_since_f(serves_bad_cpu),
+	    ntske_since(probes_good),
+	    ntske_since(probes_bad) );
 	old_ntske_cnt = ntske_cnt;
 	ntske_stattime = current_time;
 #endif
@@ -822,19 +1501,156 @@ record_proto_stats(
 	)
 {
 	struct timespec	now;
+	char		mjd[MJDTIME_LEN];
 
 	if (!stats_control)
 		return;
 
 	clock_gettime(CLOCK_REALTIME, &now);
-	filegen_setup(&protostats, now.tv_sec);
-	if (protostats.fp != NULL) {
-		fprintf(protostats.fp, "%s %s\n",
-		    timespec_to_MJDtime(&now), str);
-		fflush(protostats.fp);
+	filegen_write(&protostats, now.tv_sec, "%s %s\n",
+	    timespec_to_MJDtime(&now, mjd, sizeof(mjd)), str);
+}
+
+
+/*
+ * record_latency_stats - hourly, one protostats line per histogram
+ * with samples: the count, the median, 99th and 99.9th percentiles
+ * and the largest sample, in ms, all since startup.
+ */
+static void
+record_latency_stats(void)
+{
+	char	statstr[128];
+
+	if (!stats_control)
+		return;
+
+	for (int i = 0; i < LAT_MAX; i++) {
+		const struct histogram *h = &latency[i];
+
+		if (0 == h->count)
+			continue;
+		snprintf(statstr, sizeof(statstr),
+		    "0.0.0.0 0000 00 latency %s %" PRIu64
+		    " %.6f %.6f %.6f %.6f",
+		    latency_name[i], h->count,
+		    (double)histogram_percentile(h, 50) / NS_PER_MS,
+		    (double)histogram_percentile(h, 99) / NS_PER_MS,
+		    (double)histogram_percentile(h, 99.9) / NS_PER_MS,
+		    (double)h->max / NS_PER_MS);
+		record_proto_stats(statstr);
 	}
 }
 
+/*
+ * latency_ns - a nonnegative interval in ns
+ */
+uint64_t
+latency_ns(
+	struct timespec	intv
+	)
+{
+	if (intv.tv_sec < 0)
+		return 0;
+	return (uint64_t)intv.tv_sec * NS_PER_S + (uint64_t)intv.tv_nsec;
+}
+
+/*
+ * latency_since - add the time since start, from CLOCK_MONOTONIC.
+ * Returns it, in ns.
+ */
+uint64_t
+latency_since(
+	int	which,
+	const struct timespec *start
+	)
+{
+	struct timespec	now;
+	uint64_t	ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = latency_ns(sub_tspec(now, *start));
+	histogram_add(&latency[which], ns);
+	return ns;
+}
+
+/*
+ * cpu_init - start charging the calling thread's time to CPU_OTHER
+ */
+void
+cpu_init(void)
+{
+	cpu_thread = pthread_self();
+	cpu_current = CPU_OTHER;
+	clock_gettime(CLOCK_MONOTONIC, &cpu_mark);
+	cpu_running = true;
+}
+
+/*
+ * cpu_switch - charge the time since the last switch to the current
+ * activity and make which current.  Returns the one it replaced, for
+ * switching back.
+ */
+int
+cpu_switch(
+	int	which
+	)
+{
+	struct timespec	now;
+	int		prev = cpu_current;
+
+	if (!cpu_running || !pthread_equal(pthread_self(), cpu_thread))
+		return which;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	cpu_time[prev] += tspec_intv_to_lfp(sub_tspec(now, cpu_mark));
+	cpu_mark = now;
+	cpu_current = which;
+	return prev;
+}
+
+/*
+ * startup_mark - note reaching a startup milestone, the first time
+ * only, with how long since startup and since the one before.
+ */
+void
+startup_mark(
+	int	which
+	)
+{
+	static const char *names[START_MAX] = {
+		"exec", "config read", "main loop", "first DNS answer",
+		"first NTS-KE", "first sample", "first clock update",
+		"in sync" };
+	static struct timespec	start, last;
+	static bool		seen[START_MAX];
+	struct timespec		now;
+
+	if (which < 0 || which >= START_MAX || seen[which])
+		return;
+	seen[which] = true;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (START_EXEC == which) {
+		start = last = now;
+		return;
+	}
+	msyslog(LOG_INFO, "INIT: startup: %s after %.3f s (+%.3f s)",
+		names[which], tspec_to_d(sub_tspec(now, start)),
+		tspec_to_d(sub_tspec(now, last)));
+	last = now;
+}
+
+/*
+ * latency_lfp - add an interval given as an l_fp.  A step of the
+ * clock can make it negative; that counts as zero.
+ */
+void
+latency_lfp(
+	int	which,
+	l_fp	intv
+	)
+{
+	histogram_add(&latency[which], latency_ns(lfp_intv_to_tspec(intv)));
+}
 
 
 /*
@@ -857,6 +1673,13 @@ check_leap_file(
 		return;
 	}
 
+	/* the file watcher reads it, check_leap_pending() takes it */
+	if (filewatch_poke(is_daily_check)) {
+		if (have_leapfile)
+			check_leap_expiration(is_daily_check, systime);
+		return;
+	}
+
 	/* try to load leapfile, force it if no leapfile loaded yet */
 	if (leapsec_load_file(
 		    leapfile_name, &leapfile_stat,
@@ -868,6 +1691,53 @@ check_leap_file(
 	check_leap_expiration(is_daily_check, systime);
 }
 
+/*
+ * leap_file_changed - the file watcher's callback.  Reads the leap
+ * file, if it changed, into a table for check_leap_pending().
+ */
+static void
+leap_file_changed(
+	const char *	path,
+	struct stat *	sb,
+	bool		verbose
+	)
+{
+	leap_table_t *	pt;
+
+	pt = leapsec_read_file(path, sb, leapfile_force, verbose);
+	if (NULL == pt)
+		return;
+	leapfile_force = false;
+	pthread_mutex_lock(&leap_pending_lock);
+	free(leap_pending);
+	leap_pending = pt;
+	pthread_mutex_unlock(&leap_pending_lock);
+}
+
+/*
+ * check_leap_pending - once a second: start using a leap table the
+ * file watcher has read.
+ */
+void
+check_leap_pending(
+	time_t systime
+	)
+{
+	leap_table_t *	pt;
+
+	pthread_mutex_lock(&leap_pending_lock);
+	pt = leap_pending;
+	leap_pending = NULL;
+	pthread_mutex_unlock(&leap_pending_lock);
+	if (NULL == pt)
+		return;
+	if (leapsec_install(pt, leapfile_name)) {
+		have_leapfile = true;
+		check_leap_expiration(false, systime);
+	}
+	free(pt);
+}
+
 /*
  * check expiration of a loaded leap table
  */
@@ -920,7 +1790,100 @@ getauthkeys(
 	key_file_name = erealloc(key_file_name, len + 1);
 	memcpy(key_file_name, keyfile, len + 1);
 
-	authreadkeys(key_file_name);
+	if (authreadkeys(key_file_name) &&
+	    0 != stat(key_file_name, &key_file_stat))
+		ZERO(key_file_stat);
+}
+
+
+/*
+ * Keys file reloads.  Parsing a big keys file takes a while, so it
+ * is done by a helper thread while the main loop carries on.  Once
+ * it's done, the main thread applies just the keys that changed.
+ */
+static pthread_mutex_t	keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t	keys_tid;
+static bool		keys_busy;	/* thread started, result not applied */
+static bool		keys_done;	/* under keys_mutex */
+static auth_keyfile *	keys_parsed;	/* under keys_mutex, NULL on error */
+
+static void *
+keys_reload_main(
+	void *	arg
+	)
+{
+	auth_keyfile *kf;
+
+	UNUSED_ARG(arg);
+	thread_place(THREAD_OTHER, -1);
+	kf = authparsekeys(key_file_name);
+	pthread_mutex_lock(&keys_mutex);
+	keys_parsed = kf;
+	keys_done = true;
+	pthread_mutex_unlock(&keys_mutex);
+	return NULL;
+}
+
+
+/*
+ * check_keys_file - start a reload if the keys file has changed.
+ * Called on SIGHUP and hourly.
+ */
+void
+check_keys_file(void)
+{
+	struct stat	sb;
+
+	if (NULL == key_file_name || keys_busy)
+		return;
+	if (0 != stat(key_file_name, &sb)) {
+		msyslog(LOG_ERR, "AUTH: can't stat keys file %s: %s",
+			key_file_name, strerror(errno));
+		return;
+	}
+	if (sb.st_mtime == key_file_stat.st_mtime &&
+	    sb.st_size == key_file_stat.st_size &&
+	    sb.st_ino == key_file_stat.st_ino)
+		return;
+	key_file_stat = sb;
+
+	if (ntp_thread_create(&keys_tid, keys_reload_main, NULL,
+			      "AUTH: keys reload")) {
+		ZERO(key_file_stat);	/* try again next time */
+		return;
+	}
+	keys_busy = true;
+}
+
+
+/*
+ * check_keys_reload - apply a finished keys file reload.
+ * Called from the main loop, which holds proto_lock.
+ */
+void
+check_keys_reload(void)
+{
+	auth_keyfile *	kf;
+	bool		done;
+	int		changed;
+
+	if (!keys_busy)
+		return;
+	pthread_mutex_lock(&keys_mutex);
+	done = keys_done;
+	kf = keys_parsed;
+	keys_done = false;
+	keys_parsed = NULL;
+	pthread_mutex_unlock(&keys_mutex);
+	if (!done)
+		return;
+	pthread_join(keys_tid, NULL);
+	keys_busy = false;
+	if (NULL == kf)
+		return;		/* already complained */
+	changed = authapplykeys(kf);
+	msyslog(LOG_INFO, "AUTH: reloaded keys file %s, %d keys changed",
+		key_file_name, changed);
 }
 
 /*
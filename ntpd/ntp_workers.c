@@ -0,0 +1,418 @@
+/*
+ * ntp_workers.c - optional pool of server-mode responder threads
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Each worker owns one SO_REUSEPORT socket per listening endpoint, so
+ * the kernel spreads client traffic across threads.  The expensive
+ * part of answering a client, moving datagrams through the kernel,
+ * then runs in parallel.  Protocol state is still single-threaded:
+ * the main loop holds proto_lock except while it sleeps, and a worker
+ * takes it around the calls it makes into receive().  Plain client
+ * requests only need the lock for restrictions and the MRU list; the
+ * reply itself is built from the published reply template and sent
+ * after the lock is dropped.  NTS replies are built under the lock,
+ * but their AES-SIV encryption waits for the send, after unlocking.
+ */
+
+#include "config.h"
+
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "ntpd.h"
+#include "ntp_io.h"
+#include "ntp_lists.h"
+#include "ntp_stdlib.h"
+#include "recvbuff.h"
+
+int server_workers = 0;		/* responder threads, 0 = none */
+
+static pthread_mutex_t	proto_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A worker's socket on one endpoint.  The main thread clears ep when
+ * the endpoint goes away; the worker then closes the socket.
+ */
+typedef struct worker_sock worker_sock;
+struct worker_sock {
+	worker_sock *	link;
+	endpt *		ep;
+	struct phc *	phc;	/* ep->phc, which outlives ep */
+	SOCKET		fd;
+	struct sockbuf	sockbuf;
+};
+
+struct worker {
+	pthread_t		tid;
+	int			index;
+	worker_sock *		socks;
+	struct tx_queue *	txq;
+	recvbuf_t		rb[RX_BATCH_MAX];
+	bool			fast[RX_BATCH_MAX];	/* fast_reply() due */
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr		msgs[RX_BATCH_MAX];
+#else
+	struct msghdr		msgs[RX_BATCH_MAX];
+#endif
+	struct iovec		iov[RX_BATCH_MAX];
+	char			control[RX_BATCH_MAX][PKTSTAMP_CONTROL];
+};
+
+static struct worker *	workers;
+static int		nworkers;	/* fixed once started */
+static unsigned int	workers_gen;	/* bumped when sockets change */
+static bool		workers_running;
+
+static void *	worker_main	(void *);
+static int	worker_read	(struct worker *, worker_sock *);
+static void	worker_process	(struct worker *, worker_sock *, int);
+
+
+void
+proto_lock(void)
+{
+	int err = pthread_mutex_lock(&proto_mutex);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't lock proto_lock: %d", err);
+		exit(2);
+	}
+}
+
+void
+proto_unlock(void)
+{
+	int err = pthread_mutex_unlock(&proto_mutex);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't unlock proto_lock: %d", err);
+		exit(2);
+	}
+}
+
+
+/*
+ * workers_add_endpt - give each worker a socket on a new endpoint.
+ * Called by the main thread, which holds proto_lock.
+ */
+void
+workers_add_endpt(
+	endpt *	ep
+	)
+{
+	worker_sock *	ws;
+	SOCKET		fd;
+
+	if (0 == server_workers || INVALID_SOCKET == ep->fd
+	    || ((INT_WILDCARD | INT_SHARED) & ep->flags))
+		return;
+
+	if (NULL == workers) {
+		nworkers = server_workers;
+		workers = eallocarray_tag(MEM_RECVBUF, (size_t)nworkers,
+					  sizeof(*workers));
+		memset(workers, '\0', (size_t)nworkers * sizeof(*workers));
+		for (int i = 0; i < nworkers; i++) {
+			workers[i].index = i;
+			workers[i].txq = tx_queue_create();
+		}
+	}
+
+	for (int i = 0; i < nworkers; i++) {
+		fd = open_worker_socket(ep);
+		if (INVALID_SOCKET == fd)
+			return;
+		thread_socket(fd, i);
+		ws = emalloc_zero(sizeof(*ws));
+		ws->ep = ep;
+		ws->phc = ep->phc;
+		ws->fd = fd;
+		LINK_SLIST(workers[i].socks, ws, link);
+	}
+	workers_gen++;
+}
+
+
+/*
+ * workers_remove_endpt - detach workers from a dying endpoint.
+ * Called by the main thread, which holds proto_lock.
+ */
+void
+workers_remove_endpt(
+	endpt *	ep
+	)
+{
+	worker_sock *	ws;
+
+	for (int i = 0; i < nworkers; i++)
+		for (ws = workers[i].socks; ws != NULL; ws = ws->link)
+			if (ws->ep == ep) {
+				ws->ep = NULL;
+				workers_gen++;
+			}
+}
+
+
+/*
+ * workers_sockbuf - poll the workers' sockets for kernel drops, which
+ * count against their endpoints.  Called by the main thread, which
+ * holds proto_lock, so no worker closes a socket meanwhile.
+ */
+void
+workers_sockbuf(void)
+{
+	worker_sock *	ws;
+
+	for (int i = 0; i < nworkers; i++)
+		for (ws = workers[i].socks; ws != NULL; ws = ws->link)
+			if (ws->ep != NULL)
+				sockbuf_poll(ws->fd, ws->ep, &ws->sockbuf);
+}
+
+
+/*
+ * start_workers - launch the responder threads
+ */
+void
+start_workers(void)
+{
+	char		tag[32];
+	worker_sock *	ws;
+	int		started;
+
+	if (0 == nworkers || workers_running)
+		return;
+
+	for (started = 0; started < nworkers; started++) {
+		snprintf(tag, sizeof(tag), "INIT: worker %d", started);
+		if (ntp_thread_create(&workers[started].tid, worker_main,
+				      &workers[started], tag))
+			break;
+	}
+	if (started < nworkers) {
+		/* the kernel would still hand packets to their sockets */
+		for (int i = started; i < nworkers; i++)
+			while (workers[i].socks != NULL) {
+				UNLINK_HEAD_SLIST(ws, workers[i].socks, link);
+				close(ws->fd);
+				free(ws);
+			}
+		msyslog(LOG_ERR,
+			"INIT: only %d of %d server-mode responder threads started",
+			started, nworkers);
+		nworkers = started;
+	}
+	if (0 == started)
+		return;
+	workers_running = true;
+	msyslog(LOG_INFO, "INIT: started %d server-mode responder threads",
+		nworkers);
+}
+
+
+static void *
+worker_main(
+	void *	arg
+	)
+{
+	struct worker *	w = arg;
+	struct pollfd *	pfd = NULL;
+	worker_sock **	pws = NULL;
+	worker_sock *	ws;
+	worker_sock *	unlinked;
+	unsigned int	gen = 0;
+	int		npfd = 0;
+	int		nalloc = 0;
+	int		nready;
+	int		got;
+
+	thread_place(THREAD_WORKERS, w->index);
+	for (;;) {
+		proto_lock();
+		if (NULL == pfd || gen != workers_gen) {
+			/* drop sockets on removed endpoints */
+			ws = w->socks;
+			while (ws != NULL) {
+				unlinked = ws;
+				ws = ws->link;
+				if (NULL == unlinked->ep) {
+					UNLINK_SLIST(unlinked, w->socks,
+						     unlinked, link,
+						     worker_sock);
+					close(unlinked->fd);
+					free(unlinked);
+				}
+			}
+			npfd = 0;
+			for (ws = w->socks; ws != NULL; ws = ws->link)
+				npfd++;
+			if (npfd > nalloc) {
+				nalloc = npfd;
+				pfd = erealloc(pfd, (size_t)nalloc *
+					       sizeof(*pfd));
+				pws = erealloc(pws, (size_t)nalloc *
+					       sizeof(*pws));
+			}
+			npfd = 0;
+			for (ws = w->socks; ws != NULL; ws = ws->link) {
+				pfd[npfd].fd = ws->fd;
+				pfd[npfd].events = POLLIN;
+				pws[npfd] = ws;
+				npfd++;
+			}
+			gen = workers_gen;
+		}
+		proto_unlock();
+
+		/* the timeout picks up sockets added while we slept */
+		nready = poll(pfd, (nfds_t)npfd, 1000);
+		if (nready <= 0)
+			continue;
+		for (int i = 0; i < npfd; i++) {
+			if (pfd[i].revents & POLLERR) {
+				/* interleaved replies' transmit stamps */
+				proto_lock();
+				fetch_txstamps(pws[i]->fd, pws[i]->phc, NULL);
+				proto_unlock();
+			}
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			do {
+				got = worker_read(w, pws[i]);
+				if (got > 0)
+					worker_process(w, pws[i], got);
+			} while (got >= max(rx_batch, 1));
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * worker_read - pull up to rx_batch datagrams off a worker socket.
+ * No lock is held; only worker-private buffers are touched.
+ */
+static int
+worker_read(
+	struct worker *	w,
+	worker_sock *	ws
+	)
+{
+	struct msghdr *	mh;
+	int		want = min(max(rx_batch, 1), RX_BATCH_MAX);
+	int		got;
+
+	for (int i = 0; i < want; i++) {
+		ZERO(w->rb[i]);
+#ifdef HAVE_RECVMMSG
+		mh = &w->msgs[i].msg_hdr;
+#else
+		mh = &w->msgs[i];
+#endif
+		ZERO(*mh);
+		w->iov[i].iov_base = &w->rb[i].recv_buffer;
+		w->iov[i].iov_len = sizeof(w->rb[i].recv_buffer);
+		mh->msg_name = &w->rb[i].recv_srcadr;
+		mh->msg_namelen = sizeof(w->rb[i].recv_srcadr);
+		mh->msg_iov = &w->iov[i];
+		mh->msg_iovlen = 1;
+		mh->msg_control = w->control[i];
+		mh->msg_controllen = sizeof(w->control[i]);
+	}
+
+#ifdef HAVE_RECVMMSG
+	got = recvmmsg(ws->fd, w->msgs, (unsigned int)want, 0, NULL);
+	for (int i = 0; i < got; i++) {
+		w->rb[i].recv_length = w->msgs[i].msg_len;
+		w->rb[i].fd = ws->fd;
+		w->rb[i].recv_time = fetch_packetstamp(&w->msgs[i].msg_hdr,
+						       ws->phc);
+	}
+#else
+	for (got = 0; got < want; got++) {
+		ssize_t len = recvmsg(ws->fd, &w->msgs[got], 0);
+		if (len <= 0)
+			break;
+		w->rb[got].recv_length = (size_t)len;
+		w->rb[got].fd = ws->fd;
+		w->rb[got].recv_time = fetch_packetstamp(&w->msgs[got],
+							 ws->phc);
+	}
+#endif
+	return got;
+}
+
+
+/*
+ * worker_process - run a batch through the protocol machine, then
+ * send the replies it queued from this worker's own socket
+ */
+static NTP_HOT void
+worker_process(
+	struct worker *	w,
+	worker_sock *	ws,
+	int		got
+	)
+{
+	endpt *		ep;
+	unsigned long	sent, notsent;
+	l_fp		now;
+
+	proto_lock();
+	ep = ws->ep;
+	if (NULL == ep) {
+		proto_unlock();
+		return;
+	}
+	tx_queue_select(w->txq, ws->fd);
+	for (int i = 0; i < got; i++) {
+		w->fast[i] = false;
+		if (ep->ignore_packets) {
+			inc_ignored_count();
+			continue;
+		}
+		if (!accept_network_packet(&w->rb[i], ep))
+			continue;
+		input_latency(&w->rb[i]);
+		switch (fast_admit(&w->rb[i])) {
+		    case FAST_REPLY:
+			w->fast[i] = true;
+			pkttrace_recv(&w->rb[i]);
+			break;
+		    case FAST_SLOW:
+			receive(&w->rb[i]);	/* traces it */
+			break;
+		    default:
+			pkttrace_recv(&w->rb[i]);
+			break;
+		}
+		ep->received++;
+		inc_received_count();
+	}
+	tx_queue_select(NULL, INVALID_SOCKET);
+	proto_unlock();
+
+	/* plain client requests are answered outside the lock */
+	for (int i = 0; i < got; i++)
+		if (w->fast[i])
+			fast_reply(&w->rb[i], w->txq);
+
+	tx_queue_flush(w->txq, &sent, &notsent);
+	if (0 == sent + notsent)
+		return;
+	proto_lock();
+	if (ws->ep != NULL) {
+		ws->ep->sent += (long)sent;
+		ws->ep->notsent += (long)notsent;
+	}
+	add_sent_counts(sent, notsent);
+	get_systime(&now);
+	for (int i = 0; i < got; i++)
+		if (w->fast[i]) {
+			mon_xleave_sent(&w->rb[i]);
+			latency_lfp(LAT_XMIT, now - w->rb[i].recv_time);
+		}
+	proto_unlock();
+}
@@ -14,6 +14,7 @@
 #include "ntp_assert.h"
 #include "ntp_auth.h"
 #include "ntp_dns.h"
+#include "ntp_filegen.h"
 
 #include <unistd.h>
 #include <sys/stat.h>
@@ -26,6 +27,7 @@
 #include <sched.h>
 #include <pthread.h>  /* For pthread_setschedparam() */
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 #include <termios.h>
 
@@ -47,6 +49,9 @@ static DNSServiceRef mdns;
 #endif
 
 static void check_minsane(void);
+static void report_memory(void);
+
+#define LOG_LEAN	32	/* msyslog_slots under "lean" */
 
 bool listen_to_virtual_ips = true;
 
@@ -429,10 +434,12 @@ main(
 	int		rc;
 	int		exit_code;
 	int op;
+	FILE *		handed;	/* state from the ntpd we replace */
 #ifdef SIGDANGER
 	struct sigaction sa;
 #endif
 
+	startup_mark(START_EXEC);
 	uv = umask(0);
 	if (uv) {
 		umask(uv);
@@ -563,15 +570,13 @@ main(
 	 * Exactly what command-line options are we expecting here?
 	 */
 	ssl_init();
+	sock_hash_init();
 	auth_init();
 	init_util();
 	init_restrict();
 	init_mon();
 	init_control();
 	init_peer();
-# ifdef REFCLOCK
-	init_refclock();
-# endif
 	init_proto(!dumpopts);	/* Call at high priority */
 	init_io();
 	init_loopfilter();
@@ -749,6 +754,8 @@ main(
 	 */
 	have_interface_option = (!listen_to_virtual_ips || explicit_interface);
 	readconfig(getconfig(explicit_config));
+	startup_mark(START_CONFIG);
+	thread_setup();		/* before droproot */
 	check_minsane();
         if ( 8 > sizeof(time_t) ) {
 	    msyslog(LOG_NOTICE, "INIT: This system has a 32-bit time_t.");
@@ -756,11 +763,15 @@ main(
         }
 
 	mon_start();
+	handed = handover_state();
+	state_restore(handed);
+	if (NULL != handed)
+		fclose(handed);
 	loop_config(LOOP_DRIFTINIT, 0);
 	report_event(EVNT_SYSRESTART, NULL, NULL);
 
 #ifndef DISABLE_NTS
-	nts_init();		/* Before droproot */
+	nts_init(lean_memory);	/* Before droproot */
 #endif
 
 #ifndef ENABLE_EARLY_DROPROOT
@@ -779,6 +790,20 @@ main(
 	    msyslog(LOG_ERR, "statistics directory %s does not exist or is unwriteable, error %s", statsdir, strerror(errno));
 	}
 
+	pkttrace_init();
+	start_workers();
+	start_poller();
+	start_uring();
+	filewatch_start();
+	filegen_start_writer();
+	if (lean_memory)
+		msyslog_slots = LOG_LEAN;
+	msyslog_start_async();
+	metrics_start();
+	ctlstream_start();
+	startup_mark(START_LOOP);
+	report_memory();
+	handover_start();	/* the ntpd we replace may go now */
 	mainloop();
         /* unreachable, mainloop() never returns */
 }
@@ -828,6 +853,8 @@ void announce_starting(void) {
 static void mainloop(void)
 {
 	init_timer();
+	proto_lock();	/* released only while waiting for input */
+	cpu_init();
 
 	for (;;) {
 		if (sig_flags.sawQuit)
@@ -862,13 +889,16 @@ static void mainloop(void)
 			sig_flags.sawHUP = false;
 			msyslog(LOG_INFO, "LOG: Saw SIGHUP");
 
+			reload_config();
 			check_logfile();
 			check_leap_file(false, time(NULL));
+			check_keys_file();
 #ifndef DISABLE_NTS
 			check_cert_file();
 #endif
 			dns_try_again();
 		}
+		check_keys_reload();
 
 		/*
 		 * Go around again
@@ -917,7 +947,17 @@ finish_safe(
 	if (mdns != NULL)
 		DNSServiceRefDeallocate(mdns);
 # endif
+	/* after a handover the new ntpd owns the files */
+	if (!handover_gone()) {
+#ifndef DISABLE_NTS
+		nts_write_client_cache();
+#endif
+		state_write();
+	}
 	peer_cleanup();
+	filegen_stop_writer();
+	filegen_flush();
+	msyslog_stop_async();
 	exit(0);
 }
 
@@ -1052,6 +1092,36 @@ static void check_minsane(void)
 
 }
 
+/*
+ * report_memory - log what the pools and rings ntpd sizes for itself
+ * hold once it is up, and the peak resident set so far.  Under "lean"
+ * the MRU table and the NTS client context are made later, on first
+ * use, and show up only in the peak.
+ */
+#define KBYTES(octets)	((unsigned long)(((octets) + 1023) / 1024))
+
+static void report_memory(void)
+{
+	struct rusage ru;
+	long rss = 0;
+
+	if (0 == getrusage(RUSAGE_SELF, &ru)) {
+		rss = ru.ru_maxrss;
+#ifdef __APPLE__
+		rss /= 1024;		/* bytes there, kilobytes elsewhere */
+#endif
+	}
+	msyslog(LOG_INFO,
+		"INIT: memory: recvbufs %lu kB, peers %lu kB, MRU %lu kB, "
+		"trace %lu kB, stats %lu kB, log %lu kB, io_uring %lu kB, "
+		"peak RSS %ld kB%s",
+		KBYTES(total_recvbuffs() * sizeof(recvbuf_t)),
+		KBYTES(peer_memory()), KBYTES(mon_memory()),
+		KBYTES(pkttrace_size() * sizeof(struct pkttrace)),
+		KBYTES(filegen_memory()), KBYTES(msyslog_memory()),
+		KBYTES(uring_memory()), rss, lean_memory ? " (lean)" : "");
+}
+
 # ifdef DEBUG
 
 /*
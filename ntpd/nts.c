@@ -17,20 +17,25 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 
 #include "ntp_types.h"
 #include "ntp_stdlib.h"
+#include "ntp_shard.h"
 #include "ntpd.h"
 #include "nts.h"
 #include "nts2.h"
 
 struct nts_counters nts_cnt, old_nts_cnt;
 struct ntske_counters ntske_cnt, old_ntske_cnt;
+static struct shard_set nts_shards = SHARD_SET_INIT(struct nts_counters);
+static struct shard_set ntske_shards = SHARD_SET_INIT(struct ntske_counters);
 
 struct ntsconfig_t ntsconfig = {
 	.ntsenable = false,
@@ -44,6 +49,12 @@ struct ntsconfig_t ntsconfig = {
 	.ca = NULL,
 	.aead = NULL,
 	.tlscipherserverpreference = false,
+	.workers = NTS_KE_WORKERS,
+	.backlog = SOMAXCONN,
+	.kelimit = NTS_KE_LIMIT,
+	.tickets = false,
+	.clientcache = NULL,
+	.cookiesecret = NULL,
 };
 
 void nts_log_version(void);
@@ -52,13 +63,13 @@ void nts_log_version(void);
 
 /* More SSL initialization in ssl_init() from libntp/ssl_init.c */
 
-void nts_init(void) {
+void nts_init(bool lazy) {
 	bool ok = true;
 	nts_log_version();
 	if (ntsconfig.ntsenable) {
 		ok &= nts_server_init();
 	}
-	ok &= nts_client_init();
+	ok &= nts_client_init(lazy);
 	ok &= nts_cookie_init();
 	ok &= extens_init();
 	if (!ok) {
@@ -119,6 +130,23 @@ void nts_log_version(void) {
 void nts_timer(void) {
 	nts_cert_timer();
 	nts_cookie_timer();
+	nts_write_client_cache();
+}
+
+/*****************************************************/
+
+struct nts_counters *nts_cnt_mine(void) {
+	return shard_mine(&nts_shards);
+}
+
+struct ntske_counters *ntske_cnt_mine(void) {
+	return shard_mine(&ntske_shards);
+}
+
+/* Sum the shards into nts_cnt and ntske_cnt for the readers. */
+void nts_fold_counters(void) {
+	shard_fold(&nts_shards, &nts_cnt);
+	shard_fold(&ntske_shards, &ntske_cnt);
 }
 
 /*****************************************************/
@@ -144,6 +172,8 @@ uint16_t nts_string_to_aead(const char* text) {
 		return AEAD_AES_SIV_CMAC_384;
 	} else if (0 == strcmp(text, "AES_SIV_CMAC_512")) {
 		return AEAD_AES_SIV_CMAC_512;
+	} else if (0 == strcmp(text, "AES_128_GCM_SIV")) {
+		return AEAD_AES_128_GCM_SIV;
 	} else {
 		return NO_AEAD;
 	}
@@ -158,6 +188,8 @@ int nts_get_key_length(uint16_t aead) {
 		return AEAD_AES_SIV_CMAC_384_KEYLEN;
 	    case AEAD_AES_SIV_CMAC_512:
 		return AEAD_AES_SIV_CMAC_512_KEYLEN;
+	    case AEAD_AES_128_GCM_SIV:
+		return AEAD_AES_128_GCM_SIV_KEYLEN;
 	    default:
 		return 0;
 	}
@@ -250,13 +282,12 @@ void nts_reload_certificate(SSL_CTX *ctx) {
 
 bool nts_load_certificate(SSL_CTX *ctx) {
 	const char *cert = NTS_CERT_FILE;
-	const char *key = NTS_KEY_FILE;
-        char errbuf[100];
+	struct nts_cert nc;
+	char errbuf[100];
+	bool ok;
 
 	if (NULL != ntsconfig.cert)
 		cert = ntsconfig.cert;
-	if (NULL != ntsconfig.key)
-		key = ntsconfig.key;
 
 	/* for reload checking */
 	if (0 != stat(cert, &certfile_stat)) {
@@ -265,23 +296,71 @@ bool nts_load_certificate(SSL_CTX *ctx) {
 		return false;
 	}
 
-	if (1 != SSL_CTX_use_certificate_chain_file(ctx, cert)) {
+	if (!nts_read_certificate(&nc))
+		return false;
+	ok = nts_use_certificate(ctx, &nc);
+	nts_free_certificate(&nc);
+	return ok;
+}
+
+/* Read and check the certificate chain and private key without
+ * touching an SSL_CTX, so that the file watcher thread can do it.
+ */
+bool nts_read_certificate(struct nts_cert *nc) {
+	const char *cert = NTS_CERT_FILE;
+	const char *key = NTS_KEY_FILE;
+	unsigned long err;
+	BIO *bio;
+	X509 *ca;
+
+	if (NULL != ntsconfig.cert)
+		cert = ntsconfig.cert;
+	if (NULL != ntsconfig.key)
+		key = ntsconfig.key;
+
+	ZERO(*nc);
+	ERR_clear_error();
+	nc->chain = sk_X509_new_null();
+	bio = BIO_new_file(cert, "r");
+	if (NULL != bio)
+		nc->cert = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+	/* the rest of the chain, as SSL_CTX_use_certificate_chain_file() */
+	while (NULL != nc->cert && NULL != nc->chain &&
+	       NULL != (ca = PEM_read_bio_X509(bio, NULL, NULL, NULL)))
+		if (0 == sk_X509_push(nc->chain, ca)) {
+			X509_free(ca);
+			break;
+		}
+	err = ERR_peek_last_error();
+	if (ERR_GET_LIB(err) == ERR_LIB_PEM &&
+	    ERR_GET_REASON(err) == PEM_R_NO_START_LINE)
+		ERR_clear_error();	/* just the end of the file */
+	BIO_free(bio);
+	if (NULL == nc->cert || NULL == nc->chain || 0 != ERR_peek_error()) {
 		msyslog(LOG_ERR, "NTSs: can't load certificate (chain) from %s", cert);
 		nts_log_ssl_error();
+		nts_free_certificate(nc);
 		return false;
 	} else {
 		msyslog(LOG_ERR, "NTSs: loaded certificate (chain) from %s", cert);
 	}
-	if (1 != SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM)) {
+
+	bio = BIO_new_file(key, "r");
+	if (NULL != bio)
+		nc->key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (NULL == nc->key) {
 		msyslog(LOG_ERR, "NTSs: can't load private key from %s", key);
 		nts_log_ssl_error();
+		nts_free_certificate(nc);
 		return false;
 	} else {
 		msyslog(LOG_ERR, "NTSs: loaded private key from %s", key);
 	}
 
-	if (1 != SSL_CTX_check_private_key(ctx)) {
+	if (1 != X509_check_private_key(nc->cert, nc->key)) {
 		msyslog(LOG_ERR, "NTSs: Private Key doesn't work ******");
+		nts_free_certificate(nc);
 		return false;
 	} else {
 		msyslog(LOG_INFO, "NTSs: Private Key OK");
@@ -289,6 +368,24 @@ bool nts_load_certificate(SSL_CTX *ctx) {
 	return true;
 }
 
+/* Quick: the caller may be holding the certificate lock. */
+bool nts_use_certificate(SSL_CTX *ctx, struct nts_cert *nc) {
+	if (1 != SSL_CTX_use_cert_and_key(ctx, nc->cert, nc->key,
+					  nc->chain, 1)) {
+		msyslog(LOG_ERR, "NTSs: can't use certificate");
+		nts_log_ssl_error();
+		return false;
+	}
+	return true;
+}
+
+void nts_free_certificate(struct nts_cert *nc) {
+	X509_free(nc->cert);
+	EVP_PKEY_free(nc->key);
+	sk_X509_pop_free(nc->chain, X509_free);
+	ZERO(*nc);
+}
+
 
 int nts_ssl_read(SSL *ssl, uint8_t *buff, int buff_length) {
 	int bytes_read;
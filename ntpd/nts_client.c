@@ -15,6 +15,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 
 #ifdef HAVE_RES_INIT
 #include <netinet/in.h>
@@ -31,175 +34,275 @@
 #include "nts.h"
 #include "nts2.h"
 #include "ntp_dns.h"
+#include "ntp_lists.h"
 #include "ntp_stdlib.h"
 #include "timespecops.h"
 
 SSL_CTX* make_ssl_client_ctx(const char *filename);
-int open_TCP_socket(struct peer *peer, const char *hostname);
-struct addrinfo * find_best_addr(struct addrinfo *answer);
-bool connect_TCP_socket(int sockfd, struct addrinfo *addr);
+SSL_CTX *ca_client_ctx(const char *ca);
+bool nts_resolve(struct peer *peer, const char *hostname, struct addrinfo **answer);
+int nts_order_addrs(struct addrinfo *answer, struct addrinfo **addrs, int max);
 bool nts_set_cert_search(SSL_CTX *ctx, const char *filename);
 void set_hostname(SSL *ssl, const char *hostname);
 bool check_certificate(SSL *ssl, struct peer *peer);
 bool check_alpn(SSL *ssl, struct peer *peer, const char *hostname);
-bool nts_client_send_request(SSL *ssl, struct peer *peer);
 bool nts_client_send_request_core(uint8_t *buff, int buf_size, int *used, struct peer* peer);
-bool nts_client_process_response(SSL *ssl, struct peer *peer);
 bool nts_client_process_response_core(uint8_t *buff, int transferred, struct peer* peer);
 bool nts_server_lookup(char *server, sockaddr_u *addr, int af);
+static int new_session_cb(SSL *ssl, SSL_SESSION *session);
 
 static SSL_CTX *client_ctx = NULL;
+/* Under "lean" client_ctx waits for the first NTS-KE. */
+static pthread_once_t client_ctx_once = PTHREAD_ONCE_INIT;
 
-/* Ugly global variables passed from worker thread back to main thread. */
+/* Client SSL_CTXs for servers with their own "ca", one per path,
+ * shared by every peer using it.  The CA bundle is parsed once
+ * rather than at every NTS-KE, and again only when its mtime or
+ * ctime changes.  Only touched on the KE thread.
+ */
+struct ca_ctx {
+	struct ca_ctx *link;
+	char *ca;
+	time_t mtime, ctime;
+	SSL_CTX *ctx;
+};
+static struct ca_ctx *ca_ctxs = NULL;
+
+/* NTP server address, as adjusted by the server and port records.
+ * Only touched by nts_client_process_response_core, on the KE thread. */
 static sockaddr_u sockaddr;
-static bool addrOK;
 
+/*
+ * All NTS-KE exchanges run on one thread, with non-blocking sockets,
+ * so a long list of NTS servers doesn't make for a long, serial
+ * startup or a thread per server.
+ *
+ * A DNS worker (ntp_dns.c) still does the name lookup, then hands
+ * the answer over with nts_probe().  The KE thread races connections
+ * to the addresses it got, Happy Eyeballs style (RFC 8305), keeps the
+ * first to connect and runs TLS and the NTS-KE exchange over it.
+ * Finished jobs go back to the main thread, which is kicked with
+ * SIGDNS and picks them up in nts_check_done().
+ *
+ * The KE thread holds ke_client_mutex whenever it works on a job,
+ * so nts_client_forget() can cancel one without racing it.  Only
+ * the KE thread frees jobs on ke_jobs; the main thread frees those
+ * on ke_done.
+ */
+#define KE_MAX_ADDRS	8	/* addresses raced per server */
+#define KE_RACE_DELAY	0.250	/* sec, RFC 8305 Connection Attempt Delay */
+#define KE_POLL_MS	50	/* new jobs are noticed this often */
+#define KE_BUFSIZE	2048	/* RFC 4. says SHOULD be 65K */
+
+enum ke_step { KE_CONNECT, KE_HANDSHAKE, KE_SEND, KE_RECV, KE_DONE };
+
+struct ke_job {
+	struct ke_job *link;
+	struct peer *peer;		/* NULL once cancelled */
+	char hostname[256];
+	struct addrinfo *answer;
+	struct addrinfo *addrs[KE_MAX_ADDRS];
+	int naddrs;
+	int tried;			/* connects started */
+	int fds[KE_MAX_ADDRS];		/* racing connects, -1 if closed */
+	int fd;				/* the one that won */
+	SSL *ssl;
+	enum ke_step step;
+	short events;			/* what SSL is waiting for */
+	struct timespec start, next_try, deadline;
+	sockaddr_u addr;		/* NTP server address */
+	uint8_t buff[KE_BUFSIZE];
+	int used;			/* bytes in buff */
+	bool ok;
+};
+
+static pthread_mutex_t ke_client_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ke_client_wake = PTHREAD_COND_INITIALIZER;
+static pthread_once_t ke_client_once = PTHREAD_ONCE_INIT;
+static pthread_t ke_client_thread;
+static struct ke_job *ke_jobs;		/* in progress */
+static struct ke_job *ke_done;		/* waiting for nts_check_done */
+
+static void ke_client_lock(void);
+static void ke_client_unlock(void);
+static void ke_client_start(void);
+static void *ke_client_main(void *arg);
+static int ke_job_tick(struct ke_job *job, struct timespec now);
+static void ke_job_connected(struct ke_job *job, int i);
+static void ke_job_tls(struct ke_job *job);
+static void ke_job_end(struct ke_job *job, bool ok);
+static void ke_job_free(struct ke_job *job);
+static bool ke_message_complete(uint8_t *buff, int length);
+static void ke_forget_session(struct peer *peer);
+static bool ke_pending(struct peer *peer);
+static const char *ke_peer_name(struct peer *peer, char *buf, size_t len);
+
+/* Optional cache of client state, ntsconfig.clientcache, so that after
+ * a restart we can skip NTS-KE while the cookies are still good.
+ * Read at startup, written hourly and on the way out.
+ * Entries are used once; after that the peer does NTS-KE as usual.
+ */
+struct client_cache {
+	struct client_cache *link;
+	char name[256];			/* see ke_peer_name */
+	sockaddr_u addr;		/* NTP server address */
+	uint16_t aead;
+	int cookielen, count;
+	uint8_t c2s[NTS_MAX_KEYLEN], s2c[NTS_MAX_KEYLEN];
+	uint8_t cookies[NTS_CLIENT_COOKIES][NTS_MAX_COOKIELEN];
+};
+static struct client_cache *client_cache;
+
+static bool nts_read_client_cache(void);
+static bool read_hex(FILE *in, uint8_t *data, int length);
+static void write_hex(FILE *out, const char *tag, uint8_t *data, int length);
+
+
+static void client_ctx_init(void) {
+	client_ctx = make_ssl_client_ctx(ntsconfig.ca);
+}
 
-bool nts_client_init(void) {
+/* lazy: leave client_ctx to the first nts_probe() */
+bool nts_client_init(bool lazy) {
 
-	client_ctx = make_ssl_client_ctx(ntsconfig.ca);
+	if (!lazy)
+		pthread_once(&client_ctx_once, client_ctx_init);
 
+	if (NULL != ntsconfig.clientcache)
+		nts_read_client_cache();
 
-/* Ugly global variables passed from worker thread back to main thread. */
 	return true;
 }
 
+/* Called on a DNS worker thread: look up the NTS-KE server and queue
+ * a job for the KE thread.  Returns false if there is nothing to queue.
+ */
 bool nts_probe(struct peer * peer) {
-	struct timeval timeout = {.tv_sec = NTS_KE_TIMEOUT, .tv_usec = 0};
-	const char *hostname = peer->hostname;
+	const char *hostname;
 	char hostbuf[100];
-	char errbuf[100];
-	SSL     *ssl;
-	int      server;
-	struct timespec start, finish;
-	int      err;
+	struct ke_job *job;
 
+	pthread_once(&client_ctx_once, client_ctx_init);
 	if (NULL == client_ctx)
 		return false;
 
-	addrOK = false;
-	clock_gettime(CLOCK_MONOTONIC, &start);
-
-	if (NULL == hostname) {
-		/* IP Address case */
-		int af = AF(&peer->srcadr);
-		switch (af) {
-		    case AF_INET:
-			inet_ntop(af, PSOCK_ADDR4(&peer->srcadr), hostbuf, sizeof(hostbuf));
-			break;
-		    case AF_INET6:
-			inet_ntop(af, PSOCK_ADDR6(&peer->srcadr), hostbuf, sizeof(hostbuf));
-			break;
-		    default:
-			return false;
-		}
-		hostname = hostbuf;
-	}
-
-	server = open_TCP_socket(peer, hostname);
-	if (-1 == server) {
-		ntske_cnt.probes_bad++;
+	hostname = ke_peer_name(peer, hostbuf, sizeof(hostbuf));
+	if (NULL == hostname)
 		return false;
-	}
 
-	err = setsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-	if (0 > err) {
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		msyslog(LOG_ERR, "NTSc: can't setsockopt: %s", errbuf);
-		close(server);
-		ntske_cnt.probes_bad++;
+	job = emalloc_zero_tag(MEM_NTS, sizeof(*job));
+	job->peer = peer;
+	job->fd = -1;
+	for (int i=0; i<KE_MAX_ADDRS; i++)
+		job->fds[i] = -1;
+	strlcpy(job->hostname, hostname, sizeof(job->hostname));
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+	if (!nts_resolve(peer, hostname, &job->answer)) {
+		free_tag(MEM_NTS, job, sizeof(*job));
+		ntske_cnt_mine()->probes_bad++;
+		peer->cold->nts_state.count = -1;
 		return false;
 	}
-
-	if (NULL == peer->cfg.nts_cfg.ca)
-		ssl = SSL_new(client_ctx);
-	else {
-		SSL_CTX *ctx;
-		ctx = make_ssl_client_ctx(peer->cfg.nts_cfg.ca);
-		if (NULL == ctx) {
-			close(server);
-			return false;
-		}
-		ssl = SSL_new(ctx);
-		SSL_CTX_free(ctx);
-	}
-	set_hostname(ssl, hostname);
-	SSL_set_fd(ssl, server);
-
-	if (1 != SSL_connect(ssl)) {
-		msyslog(LOG_INFO, "NTSc: SSL_connect failed");
-		nts_log_ssl_error();
-		goto bail;
-	}
-	if (1 != SSL_do_handshake(ssl)) {
-		msyslog(LOG_INFO, "NTSc: SSL_do_handshake failed");
-		nts_log_ssl_error();
-		goto bail;
+	job->naddrs = nts_order_addrs(job->answer, job->addrs, KE_MAX_ADDRS);
+	if (0 == job->naddrs) {
+		ke_job_free(job);
+		ntske_cnt_mine()->probes_bad++;
+		peer->cold->nts_state.count = -1;
+		return false;
 	}
+	job->step = KE_CONNECT;
+	job->next_try = job->start;
+	job->deadline = job->start;
+	job->deadline.tv_sec += NTS_KE_TIMEOUT;
 
-	/* This may be clutter, but this is how to do it. */
-	msyslog(LOG_INFO, "NTSc: Using %s, %s (%d)",
-		SSL_get_version(ssl),
-		SSL_get_cipher_name(ssl),
-		SSL_get_cipher_bits(ssl, NULL));
+	pthread_once(&ke_client_once, ke_client_start);
+	ke_client_lock();
+	LINK_TAIL_SLIST(ke_jobs, job, link, struct ke_job);
+	pthread_cond_signal(&ke_client_wake);
+	ke_client_unlock();
 
-	if (!check_certificate(ssl, peer))
-		goto bail;
-	if (!check_alpn(ssl, peer, hostname))
-		goto bail;
+	return true;
+}
 
-	if (!nts_client_send_request(ssl, peer))
-		goto bail;
-	if (!nts_client_process_response(ssl, peer))
-		goto bail;
+/* Called on the main thread once the DNS worker is done, with what
+ * nts_probe returned. */
+bool nts_check(struct peer *peer, bool queued) {
+	if (!queued)
+		dns_take_status(peer, DNS_error);
+	/* else nts_check_done finishes things off */
+	return queued;
+}
 
-	/* We are using AEAD_AES_SIV_CMAC_xxx, from RFC 5297
-	 * key length depends upon which key is selected */
-	peer->nts_state.keylen = nts_get_key_length(peer->nts_state.aead);
-	if (0 == peer->nts_state.keylen) {
-		msyslog(LOG_ERR, "NTSc: Unknown AEAD code: %d", peer->nts_state.aead);
-		goto bail;
+/* Called on the main thread after SIGDNS: hand the results of
+ * finished NTS-KE exchanges to their peers.
+ */
+void nts_check_done(void) {
+	struct ke_job *done;
+	struct ke_job *job;
+
+	ke_client_lock();
+	done = ke_done;
+	ke_done = NULL;
+	ke_client_unlock();
+
+	while (NULL != done) {
+		job = done;
+		done = job->link;
+		if (NULL != job->peer) {
+			if (job->ok) {
+				startup_mark(START_NTSKE);
+				dns_take_server(job->peer, &job->addr);
+				dns_take_status(job->peer, DNS_good);
+			} else
+				dns_take_status(job->peer, DNS_error);
+		}
+		ke_job_free(job);
 	}
-	if (!nts_make_keys(ssl,
-			   peer->nts_state.aead,
-			   peer->nts_state.c2s,
-			   peer->nts_state.s2c,
-			   peer->nts_state.keylen))
-		goto bail;
+}
 
-	addrOK = true;
-	ntske_cnt.probes_good++;
+/* True if an NTS-KE exchange with this peer is under way. */
+bool nts_probe_pending(struct peer *peer) {
+	bool found;
 
-  bail:
-	if (!addrOK) {
-		ntske_cnt.probes_bad++;
-		peer->nts_state.count = -1;
-	}
-	SSL_shutdown(ssl);
-	SSL_free(ssl);
-	close(server);
+	ke_client_lock();
+	found = ke_pending(peer);
+	ke_client_unlock();
+	return found;
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &finish);
-	finish = sub_tspec(finish, start);
-	msyslog(LOG_INFO, "NTSc: NTS-KE req to %s took %.3f sec, %s",
-		hostname, tspec_to_d(finish),
-		addrOK? "OK" : "fail");
+/* Caller holds ke_client_mutex */
+static bool ke_pending(struct peer *peer) {
+	struct ke_job *job;
 
-	return addrOK;
+	for (job = ke_jobs; NULL != job; job = job->link)
+		if (peer == job->peer)
+			return true;
+	for (job = ke_done; NULL != job; job = job->link)
+		if (peer == job->peer)
+			return true;
+	return false;
 }
 
-bool nts_check(struct peer *peer) {
-	if (0) {
-		char errbuf[100];
-		sockporttoa_r(&sockaddr, errbuf, sizeof(errbuf));
-		msyslog(LOG_INFO, "NTSc: nts_check %s, %d", errbuf, addrOK);
+/* The name we look up for NTS-KE: the hostname, or the address
+ * as text for servers configured by number.  NULL if neither. */
+static const char *ke_peer_name(struct peer *peer, char *buf, size_t len) {
+	int af = AF(&peer->srcadr);
+
+	if (NULL != peer->cold->hostname)
+		return peer->cold->hostname;
+	/* IP Address case */
+	switch (af) {
+	    case AF_INET:
+		inet_ntop(af, PSOCK_ADDR4(&peer->srcadr), buf, len);
+		break;
+	    case AF_INET6:
+		inet_ntop(af, PSOCK_ADDR6(&peer->srcadr), buf, len);
+		break;
+	    default:
+		return NULL;
 	}
-	if (addrOK) {
-		dns_take_server(peer, &sockaddr);
-		dns_take_status(peer, DNS_good);
-	} else
-		dns_take_status(peer, DNS_error);
-	return addrOK;
+	return buf;
 }
 
 SSL_CTX* make_ssl_client_ctx(const char * filename) {
@@ -220,8 +323,17 @@ SSL_CTX* make_ssl_client_ctx(const char * filename) {
 		SSL_CTX_set_alpn_protos(ctx, alpn, sizeof(alpn));
 	}
 
-	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
-	SSL_CTX_set_timeout(ctx, NTS_KE_TIMEOUT);   /* session lifetime */
+	if (ntsconfig.tickets) {
+		/* Keep sessions per peer, see new_session_cb */
+		SSL_CTX_set_session_cache_mode(ctx,
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+		SSL_CTX_set_timeout(ctx, NTS_TICKET_LIFETIME);
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		SSL_CTX_set_timeout(ctx, NTS_KE_TIMEOUT);   /* session lifetime */
+	}
 
 	ok &= nts_load_versions(ctx);
 	ok &= nts_load_ciphers(ctx);
@@ -237,15 +349,484 @@ SSL_CTX* make_ssl_client_ctx(const char * filename) {
 	return ctx;
 }
 
-/* return -1 on error */
-int open_TCP_socket(struct peer *peer, const char *hostname) {
-	char host[256], port[32];
+/* KE thread: the client SSL_CTX for ca, made or remade as needed.
+ * The cache keeps its reference; SSL_new() takes its own.
+ */
+SSL_CTX *ca_client_ctx(const char *ca) {
+	struct ca_ctx *cc;
+	struct stat sb;
 	char errbuf[100];
+
+	if (0 != stat(ca, &sb)) {
+		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+		msyslog(LOG_ERR, "NTSc: can't stat cert dir/file: %s, %s",
+			ca, errbuf);
+		return NULL;
+	}
+	for (cc = ca_ctxs; NULL != cc; cc = cc->link)
+		if (0 == strcmp(ca, cc->ca))
+			break;
+	if (NULL != cc && NULL != cc->ctx &&
+	    sb.st_mtime == cc->mtime && sb.st_ctime == cc->ctime)
+		return cc->ctx;
+	if (NULL == cc) {
+		cc = emalloc_zero_tag(MEM_NTS, sizeof(*cc));
+		cc->ca = estrdup_tag(MEM_NTS, ca);
+		cc->link = ca_ctxs;
+		ca_ctxs = cc;
+	}
+	SSL_CTX_free(cc->ctx);		/* ok on NULL */
+	cc->ctx = make_ssl_client_ctx(ca);
+	cc->mtime = sb.st_mtime;
+	cc->ctime = sb.st_ctime;
+	return cc->ctx;
+}
+
+/* OpenSSL hands us the session when a TLS 1.3 ticket arrives.
+ * Keep the latest one with the peer so the next NTS-KE, after the
+ * cookies run out, can skip the full handshake.
+ * Returning 1 means we took the reference.
+ */
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+	struct peer *peer = SSL_get_app_data(ssl);
+
+	if (NULL == peer || !SSL_SESSION_is_resumable(session))
+		return 0;
+	if (NULL != peer->cold->nts_state.session)
+		SSL_SESSION_free(peer->cold->nts_state.session);
+	peer->cold->nts_state.session = session;
+	return 1;
+}
+
+/* The peer is going away: drop any NTS-KE in flight for it,
+ * and its TLS session.
+ */
+void nts_client_forget(struct peer *peer) {
+	struct ke_job *job;
+
+	ke_client_lock();
+	for (job = ke_jobs; NULL != job; job = job->link)
+		if (peer == job->peer)
+			job->peer = NULL;
+	for (job = ke_done; NULL != job; job = job->link)
+		if (peer == job->peer)
+			job->peer = NULL;
+	ke_client_unlock();
+	ke_forget_session(peer);
+}
+
+static void ke_forget_session(struct peer *peer) {
+	if (NULL == peer->cold->nts_state.session)
+		return;
+	SSL_SESSION_free(peer->cold->nts_state.session);
+	peer->cold->nts_state.session = NULL;
+}
+
+static void ke_client_lock(void) {
+	int err = pthread_mutex_lock(&ke_client_mutex);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't lock ke_client_mutex: %d", err);
+		exit(2);
+	}
+}
+
+static void ke_client_unlock(void) {
+	int err = pthread_mutex_unlock(&ke_client_mutex);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't unlock ke_client_mutex: %d", err);
+		exit(2);
+	}
+}
+
+/* Runs once, on a DNS worker thread. */
+static void ke_client_start(void) {
+	if (ntp_thread_create(&ke_client_thread, ke_client_main, NULL,
+			      "NTSc: NTS-KE client thread"))
+		exit(2);
+}
+
+static void *ke_client_main(void *arg) {
+	struct pollfd *pfd = NULL;
+	struct ke_job **owner = NULL;
+	int nalloc = 0;
+	int npfd, timeout, nready;
+	struct ke_job *job, *unlinked;
+	struct timespec now;
+	bool finished;
+
+	UNUSED_ARG(arg);
+#ifdef HAVE_SECCOMP_H
+	setup_SIGSYS_trap();      /* enable trap for this thread */
+#endif
+	thread_place(THREAD_NTSKE, -1);
+
+	for (;;) {
+		ke_client_lock();
+		while (NULL == ke_jobs)
+			pthread_cond_wait(&ke_client_wake, &ke_client_mutex);
+
+		/* start connects, check timeouts, collect sockets */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		npfd = 0;
+		timeout = KE_POLL_MS;
+		for (job = ke_jobs; NULL != job; job = job->link) {
+			int wait = ke_job_tick(job, now);
+			timeout = min(timeout, wait);
+			npfd += KE_MAX_ADDRS;
+		}
+		if (npfd > nalloc) {
+			nalloc = npfd;
+			pfd = erealloc(pfd, (size_t)nalloc * sizeof(*pfd));
+			owner = erealloc(owner, (size_t)nalloc * sizeof(*owner));
+		}
+		npfd = 0;
+		for (job = ke_jobs; NULL != job; job = job->link) {
+			if (KE_CONNECT == job->step) {
+				for (int i=0; i<job->tried; i++) {
+					if (-1 == job->fds[i])
+						continue;
+					pfd[npfd].fd = job->fds[i];
+					pfd[npfd].events = POLLOUT;
+					owner[npfd++] = job;
+				}
+			} else if (KE_DONE != job->step) {
+				pfd[npfd].fd = job->fd;
+				pfd[npfd].events = job->events;
+				owner[npfd++] = job;
+			}
+		}
+		ke_client_unlock();
+
+		nready = poll(pfd, (nfds_t)npfd, timeout);
+
+		ke_client_lock();
+		for (int i=0; i<npfd && 0<nready; i++) {
+			if (0 == pfd[i].revents)
+				continue;
+			job = owner[i];
+			if (NULL == job->peer || KE_DONE == job->step)
+				continue;
+			if (KE_CONNECT == job->step) {
+				for (int j=0; j<job->tried; j++)
+					if (pfd[i].fd == job->fds[j])
+						ke_job_connected(job, j);
+			} else
+				ke_job_tls(job);
+		}
+
+		/* retire finished and cancelled jobs */
+		finished = false;
+		job = ke_jobs;
+		while (NULL != job) {
+			unlinked = job;
+			job = job->link;
+			if (NULL == unlinked->peer && KE_DONE != unlinked->step)
+				ke_job_end(unlinked, false);
+			if (KE_DONE != unlinked->step)
+				continue;
+			UNLINK_SLIST(unlinked, ke_jobs, unlinked, link,
+				     struct ke_job);
+			if (NULL == unlinked->peer) {
+				ke_job_free(unlinked);
+				continue;
+			}
+			LINK_SLIST(ke_done, unlinked, link);
+			finished = true;
+		}
+		ke_client_unlock();
+		if (finished)
+			kill(getpid(), SIGDNS);
+	}
+	return NULL;
+}
+
+/* Housekeeping before the poll: time out, start the next racing
+ * connect if it's due.  Returns how long poll may wait, in ms.
+ */
+static int ke_job_tick(struct ke_job *job, struct timespec now) {
+	char errbuf[100];
+	double wait;
+	int open = 0;
+
+	if (NULL == job->peer || KE_DONE == job->step)
+		return 0;
+	if (cmp_tspec(now, job->deadline) >= 0) {
+		msyslog(LOG_INFO, "NTSc: NTS-KE with %s: timeout",
+			job->hostname);
+		ke_job_end(job, false);
+		return 0;
+	}
+	wait = tspec_to_d(sub_tspec(job->deadline, now));
+	if (KE_CONNECT != job->step)
+		return (int)(wait*1000)+1;
+
+	for (int i=0; i<job->tried; i++)
+		if (-1 != job->fds[i])
+			open++;
+	/* Start the next address when its turn comes, or right away
+	 * if everything we tried so far has failed. */
+	while (job->tried < job->naddrs &&
+	       (0 == open || cmp_tspec(now, job->next_try) >= 0)) {
+		struct addrinfo *ai = job->addrs[job->tried];
+		int fd;
+		sockaddr_u addr;
+
+		memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+		sockporttoa_r(&addr, errbuf, sizeof(errbuf));
+		msyslog(LOG_INFO, "NTSc: connecting to %s => %s",
+			job->hostname, errbuf);
+		fd = socket(ai->ai_family, SOCK_STREAM, 0);
+		if (-1 == fd || -1 == fcntl(fd, F_SETFL, O_NONBLOCK) ||
+		    (-1 == connect(fd, ai->ai_addr, ai->ai_addrlen) &&
+		     EINPROGRESS != errno)) {
+			ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+			msyslog(LOG_INFO, "NTSc: connect to %s failed: %s",
+				job->hostname, errbuf);
+			if (-1 != fd)
+				close(fd);
+			fd = -1;
+		} else
+			open++;
+		job->fds[job->tried++] = fd;
+		job->next_try = add_tspec(now, d_to_tspec(KE_RACE_DELAY));
+	}
+	if (0 == open) {
+		msyslog(LOG_INFO, "NTSc: can't connect to %s", job->hostname);
+		ke_job_end(job, false);
+		return 0;
+	}
+	if (job->tried < job->naddrs)
+		wait = min(wait, tspec_to_d(sub_tspec(job->next_try, now)));
+	return (int)(wait*1000)+1;
+}
+
+/* One of the racing connects is ready: connected, or failed. */
+static void ke_job_connected(struct ke_job *job, int i) {
+	char errbuf[100];
+	int so_error = 0;
+	socklen_t so_len = sizeof(so_error);
+	SSL_CTX *ctx = client_ctx;
+
+	if (-1 == getsockopt(job->fds[i], SOL_SOCKET, SO_ERROR, &so_error, &so_len))
+		so_error = errno;
+	if (0 != so_error) {
+		ntp_strerror_r(so_error, errbuf, sizeof(errbuf));
+		msyslog(LOG_INFO, "NTSc: connect to %s failed: %s",
+			job->hostname, errbuf);
+		close(job->fds[i]);
+		job->fds[i] = -1;
+		return;		/* ke_job_tick tries the next one */
+	}
+
+	/* We have a winner.  Drop the rest. */
+	job->fd = job->fds[i];
+	job->fds[i] = -1;
+	for (int j=0; j<job->tried; j++) {
+		if (-1 != job->fds[j])
+			close(job->fds[j]);
+		job->fds[j] = -1;
+	}
+	memcpy(&job->addr, job->addrs[i]->ai_addr, job->addrs[i]->ai_addrlen);
+	/* setup default NTP port now
+	 *   in case of server-name:port later on
+	 */
+	SET_PORT(&job->addr, NTP_PORT);
+
+	if (NULL != job->peer->cfg.nts_cfg.ca) {
+		ctx = ca_client_ctx(job->peer->cfg.nts_cfg.ca);
+		if (NULL == ctx) {
+			ke_job_end(job, false);
+			return;
+		}
+	}
+	job->ssl = SSL_new(ctx);
+	if (NULL == job->ssl) {
+		nts_log_ssl_error();
+		ke_job_end(job, false);
+		return;
+	}
+	set_hostname(job->ssl, job->hostname);
+	SSL_set_fd(job->ssl, job->fd);
+	SSL_set_app_data(job->ssl, job->peer);
+	if (NULL != job->peer->cold->nts_state.session)
+		SSL_set_session(job->ssl, job->peer->cold->nts_state.session);
+
+	/* Fresh timeout for the TLS part, as when it was blocking. */
+	clock_gettime(CLOCK_MONOTONIC, &job->deadline);
+	job->deadline.tv_sec += NTS_KE_TIMEOUT;
+	job->step = KE_HANDSHAKE;
+	ke_job_tls(job);
+}
+
+/* Push the TLS side along as far as it will go without blocking. */
+static void ke_job_tls(struct ke_job *job) {
+	struct peer *peer = job->peer;
+	int rc, err;
+
+	for (;;) {
+		switch (job->step) {
+		    case KE_HANDSHAKE:
+			rc = SSL_connect(job->ssl);
+			break;
+		    case KE_SEND:
+			rc = SSL_write(job->ssl, job->buff, job->used);
+			break;
+		    case KE_RECV:
+			rc = SSL_read(job->ssl, job->buff+job->used,
+				      KE_BUFSIZE-job->used);
+			break;
+		    case KE_CONNECT:	/* no TLS until the socket connects */
+		    case KE_DONE:	/* nothing left to push */
+		    default:
+			return;
+		}
+		if (0 >= rc) {
+			err = SSL_get_error(job->ssl, rc);
+			if (SSL_ERROR_WANT_READ == err) {
+				job->events = POLLIN;
+				return;
+			}
+			if (SSL_ERROR_WANT_WRITE == err) {
+				job->events = POLLOUT;
+				return;
+			}
+			if (KE_RECV == job->step && SSL_ERROR_ZERO_RETURN == err
+			    && 0 < job->used)
+				break;  /* closed, see what we got */
+			msyslog(LOG_INFO, "NTSc: %s with %s failed",
+				(KE_HANDSHAKE == job->step) ? "SSL_connect" :
+				(KE_SEND == job->step) ? "SSL_write" : "SSL_read",
+				job->hostname);
+			nts_log_ssl_error();
+			ke_job_end(job, false);
+			return;
+		}
+
+		if (KE_HANDSHAKE == job->step) {
+			/* This may be clutter, but this is how to do it. */
+			msyslog(LOG_INFO, "NTSc: Using %s, %s (%d)%s",
+				SSL_get_version(job->ssl),
+				SSL_get_cipher_name(job->ssl),
+				SSL_get_cipher_bits(job->ssl, NULL),
+				SSL_session_reused(job->ssl) ? ", resumed" : "");
+			if (!check_certificate(job->ssl, peer) ||
+			    !check_alpn(job->ssl, peer, job->hostname) ||
+			    !nts_client_send_request_core(job->buff, KE_BUFSIZE,
+							  &job->used, peer)) {
+				ke_job_end(job, false);
+				return;
+			}
+			job->step = KE_SEND;
+		} else if (KE_SEND == job->step) {
+			job->used = 0;
+			job->step = KE_RECV;
+		} else {
+			job->used += rc;
+			if (ke_message_complete(job->buff, job->used))
+				break;
+			if (KE_BUFSIZE == job->used) {
+				msyslog(LOG_ERR, "NTSc: response from %s too big",
+					job->hostname);
+				ke_job_end(job, false);
+				return;
+			}
+		}
+	}
+
+	/* Have the whole response */
+	msyslog(LOG_ERR, "NTSc: read %d bytes", job->used);
+	sockaddr = job->addr;
+	if (!nts_client_process_response_core(job->buff, job->used, peer)) {
+		ke_job_end(job, false);
+		return;
+	}
+	job->addr = sockaddr;
+
+	/* We are using AEAD_AES_SIV_CMAC_xxx, from RFC 5297,
+	 * or AEAD_AES_128_GCM_SIV, from RFC 8452.
+	 * key length depends upon which key is selected */
+	peer->cold->nts_state.keylen = nts_get_key_length(peer->cold->nts_state.aead);
+	if (0 == peer->cold->nts_state.keylen) {
+		msyslog(LOG_ERR, "NTSc: Unknown AEAD code: %d", peer->cold->nts_state.aead);
+		ke_job_end(job, false);
+		return;
+	}
+	ke_job_end(job, nts_make_keys(job->ssl,
+				      peer->cold->nts_state.aead,
+				      peer->cold->nts_state.c2s,
+				      peer->cold->nts_state.s2c,
+				      peer->cold->nts_state.keylen));
+}
+
+/* Wrap up a job, good or bad.  It stays on ke_jobs until retired. */
+static void ke_job_end(struct ke_job *job, bool ok) {
+	struct timespec finish;
+
+	job->ok = ok;
+	job->step = KE_DONE;
+	if (NULL != job->peer) {
+		if (ok)
+			ntske_cnt_mine()->probes_good++;
+		else {
+			ntske_cnt_mine()->probes_bad++;
+			job->peer->cold->nts_state.count = -1;
+			/* Don't retry with a session that may be the problem. */
+			ke_forget_session(job->peer);
+		}
+	}
+	if (NULL != job->ssl) {
+		SSL_shutdown(job->ssl);
+		SSL_free(job->ssl);
+		job->ssl = NULL;
+	}
+	if (-1 != job->fd)
+		close(job->fd);
+	job->fd = -1;
+	for (int i=0; i<job->tried; i++) {
+		if (-1 != job->fds[i])
+			close(job->fds[i]);
+		job->fds[i] = -1;
+	}
+	if (NULL != job->answer)
+		dns_cache_free(job->answer);
+	job->answer = NULL;
+	job->naddrs = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	finish = sub_tspec(finish, job->start);
+	msyslog(LOG_INFO, "NTSc: NTS-KE req to %s took %.3f sec, %s",
+		job->hostname, tspec_to_d(finish),
+		NULL == job->peer ? "cancelled" : ok ? "OK" : "fail");
+}
+
+static void ke_job_free(struct ke_job *job) {
+	if (NULL != job->answer)
+		dns_cache_free(job->answer);
+	free_tag(MEM_NTS, job, sizeof(*job));
+}
+
+/* True once the records in buff run through an End of Message. */
+static bool ke_message_complete(uint8_t *buff, int length) {
+	int used = 0;
+
+	while (used + NTS_KE_HDR_LNG <= length) {
+		uint16_t type = (uint16_t)((buff[used] << 8) | buff[used+1]);
+		int body = (buff[used+2] << 8) | buff[used+3];
+		used += NTS_KE_HDR_LNG + body;
+		if (nts_end_of_message == (type & ~NTS_CRITICAL))
+			return used <= length;
+	}
+	return false;
+}
+
+/* Look up the NTS-KE server.  hostname may end with :port.
+ * Runs on a DNS worker thread.  returns false on error
+ */
+bool nts_resolve(struct peer *peer, const char *hostname, struct addrinfo **answer) {
+	char host[256], port[32];
 	char *tmp;
 	struct addrinfo hints;
-	struct addrinfo *answer, *worker;
 	int gai_rc;
-	int sockfd;
 	struct timespec start, finish;
 
 	/* copy avoids dancing around const warnings */
@@ -273,120 +854,55 @@ int open_TCP_socket(struct peer *peer, const char *hostname) {
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_family = AF(&peer->srcadr);  /* -4, -6 switch */
 	clock_gettime(CLOCK_MONOTONIC, &start);
-	gai_rc = getaddrinfo(host, port, &hints, &answer);
+	gai_rc = dns_cache_getaddrinfo(host, port, &hints, answer);
 	if (0 != gai_rc) {
-		msyslog(LOG_INFO, "NTSc: open_TCP_socket: DNS error trying to contact %s: %d, %s",
+		msyslog(LOG_INFO, "NTSc: nts_resolve: DNS error trying to contact %s: %d, %s",
 			hostname, gai_rc, gai_strerror(gai_rc));
-		return -1;
+		return false;
 	}
 	clock_gettime(CLOCK_MONOTONIC, &finish);
 	finish = sub_tspec(finish, start);
 	msyslog(LOG_INFO, "NTSc: DNS lookup of %s took %.3f sec",
 		hostname, tspec_to_d(finish));
-
-	/* Use first answer
-	 * sockaddr is global for NTP address
-	 * also use as temp for printing here
-	 */
-	worker = find_best_addr(answer);
-	memcpy(&sockaddr, worker->ai_addr, worker->ai_addrlen);
-	sockporttoa_r(&sockaddr, errbuf, sizeof(errbuf));
-	msyslog(LOG_INFO, "NTSc: connecting to %s:%s => %s",
-		host, port, errbuf);
-
-	/* setup default NTP port now
-	 *   in case of server-name:port later on
-	 */
-	SET_PORT(&sockaddr, NTP_PORT);
-	sockfd = socket(worker->ai_family, SOCK_STREAM, 0);
-	if (-1 == sockfd) {
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		msyslog(LOG_INFO, "NTSc: open_TCP_socket: no socket: %s", errbuf);
-	} else {
-		/* Use first IP Address */
-		if (!connect_TCP_socket(sockfd, worker)) {
-			close(sockfd);
-			sockfd = -1;
-		}
-	}
-
-	freeaddrinfo(answer);
-	return sockfd;
-
-}
-
-struct addrinfo *find_best_addr(struct addrinfo *answer) {
-	/* default to first one */
-	return(answer);
+	return true;
 }
 
-
-/* This kludgery is needed to get a sane timeout.
- * The default is unspecified but long.
- * On Linux, man connect gets man 2 which doesn't mention O_NONBLOCK
- * Use man 3 connect.
+/* Pick the order to try addresses in, RFC 8305 section 4:
+ * getaddrinfo has already sorted them (RFC 6724), so keep that
+ * order within each family but alternate families, starting with
+ * the family of the first answer.
+ * Returns the number of addresses stored in addrs.
  */
-bool connect_TCP_socket(int sockfd, struct addrinfo *addr) {
-	char errbuf[100];
-	int err;
-	fd_set fdset;
-	struct timeval timeout;
-	int so_error;
-	socklen_t so_len = sizeof(so_error);
-
-	err = fcntl(sockfd, F_SETFL, O_NONBLOCK);
-	if (-1 == err) {
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		msyslog(LOG_INFO, "NTSc: can't set O_NONBLOCK %s", errbuf);
-		return false;
-	}
-	err = connect(sockfd, addr->ai_addr, addr->ai_addrlen);
-	/* The normal case is -1 and errno == EINPROGRESS
-	 * Getting connected should be possible if the scheduler
-	 * avoids us for long enough.
-	 * Other errors may be possible.  No route?
-	 * I haven't seen that yet.  HGM, 2020 Jan 19
-	 */
-	if (-1 != err || EINPROGRESS != errno) {
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		msyslog(LOG_INFO, "NTSc: connect_TCP_socket: connect failed: %s", errbuf);
-		return false;
-	}
-
-	FD_ZERO(&fdset);
-	FD_SET(sockfd, &fdset);
-	timeout.tv_sec = NTS_KE_TIMEOUT;
-	timeout.tv_usec = 0;
-
-	if (0 == select(sockfd + 1, NULL, &fdset, NULL, &timeout)) {
-		msyslog(LOG_INFO, "NTSc: connect_TCP_socket: timeout");
-		return false;
-	}
-
-	/* It's ready, either connected or error. */
-	if (-1 == getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &so_error, &so_len)) {
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		msyslog(LOG_INFO, "NTSc: connect_TCP_socket: getsockopt failed: %s", errbuf);
-		return false;
-	}
+int nts_order_addrs(struct addrinfo *answer, struct addrinfo **addrs, int max) {
+	struct addrinfo *first = NULL, *other = NULL;
+	int family, n = 0;
+	bool take_first = true;
 
-	if (0 != so_error) {
-		ntp_strerror_r(so_error, errbuf, sizeof(errbuf));
-		msyslog(LOG_INFO, "NTSc: connect_TCP_socket: connect failed: %s", errbuf);
-		return false;
-	}
-
-	err = fcntl(sockfd, F_SETFL, 0); /* turn off O_NONBLOCK */
-	if (-1 == err) {
-		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-		msyslog(LOG_INFO, "NTSc: can't unset O_NONBLOCK %s", errbuf);
-		return false;
+	for (; NULL != answer; answer = answer->ai_next)
+		if (sizeof(sockaddr_u) >= answer->ai_addrlen)
+			break;
+	if (NULL == answer)
+		return 0;
+	family = answer->ai_family;
+	first = answer;
+	other = answer;
+
+	while (n < max && (NULL != first || NULL != other)) {
+		struct addrinfo **next = take_first ? &first : &other;
+		/* advance to the next usable address of this kind */
+		while (NULL != *next &&
+		       ((family == (*next)->ai_family) != take_first ||
+			sizeof(sockaddr_u) < (*next)->ai_addrlen))
+			*next = (*next)->ai_next;
+		if (NULL != *next) {
+			addrs[n++] = *next;
+			*next = (*next)->ai_next;
+		}
+		take_first = !take_first;
 	}
-
-	return true;
+	return n;
 }
 
-
 void set_hostname(SSL *ssl, const char *hostname) {
 	char host[256], *tmp;
 
@@ -542,23 +1058,6 @@ bool nts_make_keys(SSL *ssl, uint16_t aead, uint8_t *c2s, uint8_t *s2c, int keyl
 	return true;
 }
 
-bool nts_client_send_request(SSL *ssl, struct peer* peer) {
-	uint8_t buff[1000];
-	int     used, transferred;
-	bool    success;
-
-	success = nts_client_send_request_core(buff, sizeof(buff), &used, peer);
-	if (!success) {
-		return false;
-	}
-
-	transferred = nts_ssl_write(ssl, buff, used);
-	if (used != transferred)
-		return false;
-
-	return true;
-}
-
 bool nts_client_send_request_core(uint8_t *buff, int buf_size, int *used, struct peer* peer) {
 	struct  BufCtl_t buf;
 	uint16_t aead = NO_AEAD;
@@ -593,27 +1092,15 @@ bool nts_client_send_request_core(uint8_t *buff, int buf_size, int *used, struct
 	return true;
 }
 
-bool nts_client_process_response(SSL *ssl, struct peer* peer) {
-	uint8_t  buff[2048];  /* RFC 4. says SHOULD be 65K */
-	int transferred;
-
-	transferred = nts_ssl_read(ssl, buff, sizeof(buff));
-	if (0 > transferred)
-		return false;
-	msyslog(LOG_ERR, "NTSc: read %d bytes", transferred);
-
-	return nts_client_process_response_core(buff, transferred, peer);
-}
-
 bool nts_client_process_response_core(uint8_t *buff, int transferred, struct peer* peer) {
 	int idx;
 	struct BufCtl_t buf;
 
-	peer->nts_state.aead = NO_AEAD;
-	peer->nts_state.keylen = 0;
-	peer->nts_state.writeIdx = 0;
-	peer->nts_state.readIdx = 0;
-	peer->nts_state.count = 0;
+	peer->cold->nts_state.aead = NO_AEAD;
+	peer->cold->nts_state.keylen = 0;
+	peer->cold->nts_state.writeIdx = 0;
+	peer->cold->nts_state.readIdx = 0;
+	peer->cold->nts_state.count = 0;
 
 	buf.next = buff;
 	buf.left = transferred;
@@ -667,29 +1154,29 @@ bool nts_client_process_response_core(uint8_t *buff, int transferred, struct pee
 				msyslog(LOG_ERR, "NTSc: AN-Unsupported AEAN type: %d", data);
 				return false;
 			}
-			peer->nts_state.aead = data;
+			peer->cold->nts_state.aead = data;
 			break;
 		    case nts_new_cookie:
 			if (NTS_MAX_COOKIELEN < length) {
 				msyslog(LOG_ERR, "NTSc: NC cookie too big: %d", length);
 				return false;
 			}
-			if (0 == peer->nts_state.cookielen)
-				peer->nts_state.cookielen = length;
-			if (length != peer->nts_state.cookielen) {
+			if (0 == peer->cold->nts_state.cookielen)
+				peer->cold->nts_state.cookielen = length;
+			if (length != peer->cold->nts_state.cookielen) {
 				msyslog(LOG_ERR, "NTSc: Cookie length mismatch %d, %d.",
-					length, peer->nts_state.cookielen);
+					length, peer->cold->nts_state.cookielen);
 				return false;
 			}
-			idx = peer->nts_state.writeIdx;
-			if (NTS_MAX_COOKIES <= peer->nts_state.count) {
+			idx = peer->cold->nts_state.writeIdx;
+			if (NTS_MAX_COOKIES <= peer->cold->nts_state.count) {
 				msyslog(LOG_ERR, "NTSc: Extra cookie ignored.");
 				break;
 			}
-			next_bytes(&buf, (uint8_t*)&peer->nts_state.cookies[idx], length);
-			peer->nts_state.writeIdx++;
-			peer->nts_state.writeIdx = peer->nts_state.writeIdx % NTS_MAX_COOKIES;
-			peer->nts_state.count++;
+			next_bytes(&buf, (uint8_t*)&peer->cold->nts_state.cookies[idx], length);
+			peer->cold->nts_state.writeIdx++;
+			peer->cold->nts_state.writeIdx = peer->cold->nts_state.writeIdx % NTS_CLIENT_COOKIES;
+			peer->cold->nts_state.count++;
 			break;
 		    case nts_server_negotiation:
 			if (MAX_SERVER < (length+1)) {
@@ -742,17 +1229,17 @@ bool nts_client_process_response_core(uint8_t *buff, int transferred, struct pee
 	if (buf.left > 0)
 		return false;
 
-	if (NO_AEAD == peer->nts_state.aead) {
+	if (NO_AEAD == peer->cold->nts_state.aead) {
 		msyslog(LOG_ERR, "NTSc: No AEAD algorithm.");
 		return false;
 	}
-	if (0 == peer->nts_state.count) {
+	if (0 == peer->cold->nts_state.count) {
 		msyslog(LOG_ERR, "NTSc: No cookies.");
 		return false;
 	}
 
 	msyslog(LOG_ERR, "NTSc: Got %d cookies, length %d, aead=%d.",
-		peer->nts_state.count, peer->nts_state.cookielen, peer->nts_state.aead);
+		peer->cold->nts_state.count, peer->cold->nts_state.cookielen, peer->cold->nts_state.aead);
 	return true;
 }
 
@@ -809,7 +1296,7 @@ bool nts_server_lookup(char *server, sockaddr_u *addr, int af) {
 	hints.ai_socktype = SOCK_DGRAM;
 	hints.ai_family = af;
 
-	gai_rc = getaddrinfo(server, NTS_KE_PORTA, &hints, &answer);
+	gai_rc = dns_cache_getaddrinfo(server, NTS_KE_PORTA, &hints, &answer);
 	if (0 != gai_rc) {
 		msyslog(LOG_INFO, "NTSc: DNS error trying to lookup %s: %d, %s",
 			server, gai_rc, gai_strerror(gai_rc));
@@ -822,8 +1309,213 @@ bool nts_server_lookup(char *server, sockaddr_u *addr, int af) {
 	if (sizeof(sockaddr_u) >= answer->ai_addrlen)
 		memcpy(addr, answer->ai_addr, answer->ai_addrlen);
 
-	freeaddrinfo(answer);
+	dns_cache_free(answer);
+
+	return true;
+}
+
+/* Main thread, from dns_probe: if we saved cookies for this server
+ * before a restart, take them and its address rather than doing
+ * NTS-KE.  Returns true if it did.
+ */
+bool nts_client_restore(struct peer *peer) {
+	struct client_cache *entry, **prev;
+	struct ntsclient_t *state = &peer->cold->nts_state;
+	char namebuf[100];
+	const char *name;
+	int af = AF(&peer->srcadr);
+
+	if (NULL == client_cache)
+		return false;
+	name = ke_peer_name(peer, namebuf, sizeof(namebuf));
+	if (NULL == name)
+		return false;
+	for (prev = &client_cache; NULL != *prev; prev = &(*prev)->link) {
+		entry = *prev;
+		if (0 != strcmp(name, entry->name))
+			continue;
+		if (AF_UNSPEC != af && af != AF(&entry->addr))
+			continue;	/* -4/-6 changed */
+		*prev = entry->link;
+		state->aead = entry->aead;
+		state->keylen = nts_get_key_length(entry->aead);
+		memcpy(state->c2s, entry->c2s, sizeof(state->c2s));
+		memcpy(state->s2c, entry->s2c, sizeof(state->s2c));
+		state->cookielen = entry->cookielen;
+		state->count = entry->count;
+		state->readIdx = 0;
+		state->writeIdx = entry->count % NTS_CLIENT_COOKIES;
+		memcpy(state->cookies, entry->cookies, sizeof(state->cookies));
+		msyslog(LOG_INFO, "NTSc: restored %d cookies for %s",
+			entry->count, name);
+		dns_take_server(peer, &entry->addr);
+		dns_take_status(peer, DNS_good);
+		ZERO(*entry);	/* keys */
+		free_tag(MEM_NTS, entry, sizeof(*entry));
+		return true;
+	}
+	return false;
+}
 
+/* Format, one block per server:
+ *   T: <time saved>	(once, first)
+ *   N: <name>
+ *   A: <NTP server address:port>
+ *   E: <aead> <cookie length> <cookie count>
+ *   C: <c2s key in hex>
+ *   S: <s2c key in hex>
+ *   K: <cookie in hex>	(count of them)
+ */
+static bool nts_read_client_cache(void) {
+	const char *filename = ntsconfig.clientcache;
+	FILE *in;
+	unsigned long saved;
+	char addrbuf[100];
+	struct client_cache *entry = NULL;
+	int keylen, n = 0;
+	unsigned int aead;
+
+	in = fopen(filename, "r");
+	if (NULL == in) {
+		char errbuf[100];
+		if (ENOENT == errno)
+			return false;		/* File doesn't exist */
+		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+		msyslog(LOG_ERR, "NTSc: can't read client cache: %s=>%s",
+			filename, errbuf);
+		return false;
+	}
+	if (1 != fscanf(in, "T: %lu\n", &saved))
+		goto bail;
+	if (NTS_CLIENT_CACHE_LIFETIME < time(NULL) - (time_t)saved) {
+		msyslog(LOG_INFO, "NTSc: client cache %s is too old", filename);
+		fclose(in);
+		return false;
+	}
+	for (;;) {
+		entry = emalloc_zero_tag(MEM_NTS, sizeof(*entry));
+		if (1 != fscanf(in, "N: %255s\n", entry->name)) {
+			if (feof(in))
+				break;
+			goto bail;
+		}
+		if (1 != fscanf(in, "A: %99s\n", addrbuf))
+			goto bail;
+		if (0 != decodenetnum(addrbuf, &entry->addr))
+			goto bail;
+		if (3 != fscanf(in, "E: %u %d %d\n", &aead,
+				&entry->cookielen, &entry->count))
+			goto bail;
+		entry->aead = (uint16_t)aead;
+		keylen = nts_get_key_length(entry->aead);
+		if (0 == keylen ||
+		    0 >= entry->cookielen || NTS_MAX_COOKIELEN < entry->cookielen ||
+		    0 >= entry->count || NTS_CLIENT_COOKIES < entry->count)
+			goto bail;
+		if (0 != fscanf(in, "C: ") || !read_hex(in, entry->c2s, keylen))
+			goto bail;
+		if (0 != fscanf(in, "S: ") || !read_hex(in, entry->s2c, keylen))
+			goto bail;
+		for (int i=0; i<entry->count; i++)
+			if (0 != fscanf(in, "K: ") ||
+			    !read_hex(in, entry->cookies[i], entry->cookielen))
+				goto bail;
+		entry->link = client_cache;
+		client_cache = entry;
+		n++;
+	}
+	free_tag(MEM_NTS, entry, sizeof(*entry));
+	fclose(in);
+	msyslog(LOG_INFO, "NTSc: read client cache, %d servers.", n);
+	return true;
+
+  bail:
+	free_tag(MEM_NTS, entry, sizeof(*entry));
+	msyslog(LOG_ERR, "NTSc: Error parsing client cache %s", filename);
+	fclose(in);
+	return false;
+}
+
+static bool read_hex(FILE *in, uint8_t *data, int length) {
+	for (int j=0; j<length; j++) {
+		unsigned int temp;
+		if (1 != fscanf(in, "%02x", &temp))
+			return false;
+		data[j] = (uint8_t)temp;
+	}
+	return 0 == fscanf(in, "\n");
+}
+
+static void write_hex(FILE *out, const char *tag, uint8_t *data, int length) {
+	fprintf(out, "%s: ", tag);
+	for (int j=0; j<length; j++)
+		fprintf(out, "%02x", data[j]);
+	fprintf(out, "\n");
+}
+
+/* Main thread.  Save the unused cookies of every NTS server we have
+ * keys for.  The file holds keys, so it is only readable by us. */
+bool nts_write_client_cache(void) {
+	const char *filename = ntsconfig.clientcache;
+	char tempfile[PATH_MAX];
+	char addrbuf[100], namebuf[100];
+	const char *name;
+	int fd, n = 0;
+	FILE *out;
+	char errbuf[100];
+
+	if (NULL == filename)
+		return true;
+	strlcpy(tempfile, filename, sizeof(tempfile));
+	strlcat(tempfile, "-tmp", sizeof(tempfile));
+	fd = open(tempfile, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR);
+	if (-1 == fd) {
+		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+		msyslog(LOG_ERR, "NTSc: can't open %s: %s", tempfile, errbuf);
+		return false;
+	}
+	out = fdopen(fd, "w");
+	if (NULL == out) {
+		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+		msyslog(LOG_ERR, "NTSc: can't fdopen %s: %s", tempfile, errbuf);
+		close(fd);
+		return false;
+	}
+
+	fprintf(out, "T: %lu\n", (unsigned long)time(NULL));
+	ke_client_lock();	/* keep the KE thread off nts_state */
+	for (struct peer *p = peer_list; NULL != p; p = p->p_link) {
+		struct ntsclient_t *state = &p->cold->nts_state;
+		if (!(FLAG_NTS & p->cfg.flags) || (FLAG_LOOKUP & p->cfg.flags))
+			continue;
+		if (0 >= state->count || 0 == state->keylen || ke_pending(p))
+			continue;
+		name = ke_peer_name(p, namebuf, sizeof(namebuf));
+		if (NULL == name)
+			continue;
+		sockporttoa_r(&p->srcadr, addrbuf, sizeof(addrbuf));
+		fprintf(out, "N: %s\n", name);
+		fprintf(out, "A: %s\n", addrbuf);
+		fprintf(out, "E: %u %d %d\n", (unsigned int)state->aead,
+			state->cookielen, state->count);
+		write_hex(out, "C", state->c2s, state->keylen);
+		write_hex(out, "S", state->s2c, state->keylen);
+		for (int i=0; i<state->count; i++) {
+			int idx = (state->readIdx + i) % NTS_CLIENT_COOKIES;
+			write_hex(out, "K", state->cookies[idx], state->cookielen);
+		}
+		n++;
+	}
+	ke_client_unlock();
+	fclose(out);
+	if (rename(tempfile, filename)) {
+		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+		msyslog(LOG_WARNING,
+			"NTSc: Unable to rename temp client cache %s to %s, %s",
+			tempfile, filename, errbuf);
+		return false;
+	}
+	msyslog(LOG_INFO, "NTSc: wrote client cache, %d servers.", n);
 	return true;
 }
 
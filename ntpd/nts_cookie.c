@@ -8,6 +8,7 @@
  *
  * This follows section 6, Suggested Format for NTS Cookies
  * It uses AEAD_AES_SIV_CMAC_256/384/512 from RFC 5297
+ * or AEAD_AES_128_GCM_SIV from RFC 8452.
  * The selection is done by the key length.
  *
  * We use the implementation in libaes_siv by Daniel Franke (Akamai)
@@ -29,6 +30,8 @@
 #include <unistd.h>
 
 #include <aes_siv.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
 
 #include "ntpd.h"
 #include "ntp_stdlib.h"
@@ -43,6 +46,9 @@
  *  P is AEAD, C2S, S2C
  *  length of C2S and S2C depends upon AEAD
  *  CMAC is 16 bytes
+ *
+ *  With AES-GCM-SIV it is I,N,C,T instead: the 16 byte tag T goes
+ *  after C, and the nonce is the first 12 bytes of N.
  */
 
 /* K and I should be preserved across boots, and rotated every day or so.
@@ -58,12 +64,24 @@
  * of NTS-KE requests until all clients obtained new/working cookies.
  */
 
+/* Cluster mode: with "nts cookiesecret", the keys are not kept in the
+ * cookie file at all.  Each day's K and I are derived with HKDF-SHA256
+ * from a secret shared by every NTS-KE and NTP server in the cluster
+ * and the day number (UTC days since 1970), so all of them make and
+ * accept the same cookies without talking to each other.  They rotate
+ * together at midnight UTC.  The secret file looks like:
+ *   L: 32
+ *   S: <64 to 256 hex digits>
+ * L picks the key length as in the cookie file.
+ */
+
 /* Encryption within cookies uses AEAD_AES_SIV_CMAC_nnn.  That's the
  * same family of algorithms as NTS uses on the wire.
  * The nnn is selected by the key length.
  *   32 => 256
  *   48 => 384
  *   64 => 512
+ * A 16 byte key selects AEAD_AES_128_GCM_SIV, which is cheaper.
  */
 
 /* NTS_MAX_COOKIELEN:
@@ -83,7 +101,7 @@
 
 /* cookies use same AEAD algorithms as wire */
 /* This determines which algorithm we use.
- * Valid choices are 32, 48, and 64
+ * Valid choices are 16, 32, 48, and 64
  * making this a variable rather than #define
  * opens up the opportunity to pick one at run time.
  * The default (below) is 32/AEAD_AES_SIV_CMAC_256
@@ -94,15 +112,78 @@ time_t K_time = 0;	/* time K was created, 0 for none */
 struct NTS_Key nts_keys[NTS_nKEYS];
 int nts_nKeys = 0;
 
-/* The mutex protects cookie_ctx
- * The NTS-KE servers can make cookies
- *   while the main NTP server thread is unpacking and making cookies.
- * If this becomes a bottleneck, we could use a cookie_ctx per thread. */
-pthread_mutex_t cookie_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CLUSTER_SECRET_MIN 32
+#define CLUSTER_SECRET_MAX 128
+/* In the last hour of the day also accept the next day's key,
+ * in case another node's clock is a bit ahead of ours. */
+#define CLUSTER_GRACE 3600
+#define CLUSTER_INFO "ntpsec NTS cookie key"
+static uint8_t cluster_secret[CLUSTER_SECRET_MAX];
+static size_t cluster_secret_len = 0;	/* 0 when not in cluster mode */
+static int64_t cluster_day = -1;	/* day of nts_keys[0] */
+static bool cluster_grace = false;	/* nts_keys[NTS_nKEYS-1] is tomorrow */
+static bool cluster_derive(int64_t day, struct NTS_Key *key);
+
+/* Non-NULL once nts_cookie_init has run. */
 AES_SIV_CTX* cookie_ctx;
 
-void nts_lock_cookielock(void);
-void nts_unlock_cookielock(void);
+/* K_gen changes whenever nts_keys[] or K_length does. */
+static unsigned int K_gen = 1;
+
+/* The main thread rotates nts_keys[] while the NTS-KE servers are
+ * making cookies with them, outside proto_lock.  cookie_key_lock
+ * covers nts_keys[], nts_nKeys, K_length, K_gen and K_index.
+ * Writers hold it from the first key byte to nts_keys_changed();
+ * readers hold it from looking up a key until they are done with it,
+ * which includes rekeying their cached context.
+ */
+static pthread_mutex_t cookie_key_lock = PTHREAD_MUTEX_INITIALIZER;
+static void nts_lock_cookie_keys(void);
+static void nts_unlock_cookie_keys(void);
+
+/* Index from key ID (I) to position in nts_keys[], open addressing
+ * with linear probing.  Every cookie from the net is looked up here,
+ * so garbage and expired IDs cost one or two probes and never get
+ * near the keys.  Rebuilt by nts_keys_changed().
+ * Slot values are index+1, 0 for empty.
+ */
+#define K_INDEX_SLOTS (2*NTS_nKEYS)
+static struct {
+	uint32_t I;
+	int key;
+} K_index[K_INDEX_SLOTS];
+
+static void nts_keys_changed(void);
+static int nts_find_key(uint32_t id);
+
+/* The NTS-KE servers make cookies while the main NTP server thread
+ * is unpacking and making cookies.  AES_SIV_Init, the key schedule
+ * plus a CMAC, is a large part of the cost, so rather than share one
+ * context under a lock, each thread keeps a context keyed for each
+ * entry of nts_keys[] and copies it into a scratch context per cookie.
+ * Keyed contexts are set up on first use after K_gen changes,
+ * under cookie_key_lock like any other use of the keys.
+ *
+ * Each cookie also needs a fresh nonce.  Those come from
+ * ntp_RAND_pool_bytes(), which keeps a pool per thread for the same
+ * reason.
+ */
+
+struct cookie_cache {
+	unsigned int gen[NTS_nKEYS];	/* K_gen when keyed[i] was keyed */
+	AES_SIV_CTX *keyed[NTS_nKEYS];
+	AES_SIV_CTX *work;
+	GCM_SIV_CTX *gcm;		/* for 16 byte keys */
+};
+
+static pthread_key_t cookie_cache_key;
+static pthread_once_t cookie_cache_once = PTHREAD_ONCE_INIT;
+
+static void cookie_cache_make_key(void);
+static void cookie_cache_free(void *arg);
+static struct cookie_cache *cookie_cache_this(void);
+static AES_SIV_CTX *cookie_cache_get(int i);
+static GCM_SIV_CTX *cookie_cache_gcm(void);
 
 // FIXME  AEAD_LENGTH
 /* Associated data: aead (rounded up to 4) plus NONCE */
@@ -122,6 +203,14 @@ bool nts_cookie_init(void) {
 /* cookie key needed for server side */
 bool nts_cookie_init2(void) {
 	bool OK = true;
+	if (NULL != ntsconfig.cookiesecret) {
+		if (!nts_read_cookie_secret())
+			return false;
+		nts_cluster_cookie_keys(time(NULL));
+		msyslog(LOG_INFO, "NTS: cookie keys from cluster secret %s, L=%d",
+			ntsconfig.cookiesecret, K_length);
+		return true;
+	}
 	if (!nts_read_cookie_keys()) {
 		/* Can't read cookie file.  Make one */
 		nts_make_cookie_key();
@@ -143,6 +232,17 @@ bool nts_cookie_init2(void) {
 // #define SecondsPerDay 3600
 void nts_cookie_timer(void) {
 	time_t now;
+	if (0 < cluster_secret_len) {
+		int64_t day = cluster_day;
+		now = time(NULL);
+		nts_cluster_cookie_keys(now);
+		if (day != cluster_day) {
+			nts_rotate_ticket_keys();
+			msyslog(LOG_INFO, "NTS: New cluster cookie key, day %lld.",
+				(long long)cluster_day);
+		}
+		return;
+	}
 	if (0 == K_time) {
 		return;
 	}
@@ -151,6 +251,7 @@ void nts_cookie_timer(void) {
 		return;
 	}
 	nts_make_cookie_key();
+	nts_rotate_ticket_keys();
 	/* In case we were off for many days. */
 	while (SecondsPerDay < (now-K_time)) {
 		K_time += SecondsPerDay;
@@ -179,6 +280,7 @@ bool nts_read_cookie_keys(void) {
 			cookie_filename, errbuf);
 		exit(1);
 	}
+	nts_lock_cookie_keys();
 	if (1 != fscanf(in, "T: %lu\n", &templ)) {
 		goto bail;
 	}
@@ -186,7 +288,8 @@ bool nts_read_cookie_keys(void) {
 	if (1 != fscanf(in, "L: %d\n", &K_length)) {
 		goto bail;
 	}
-	if ( !((32 == K_length) || (48 == K_length) || (64 == K_length))) {
+	if ( !((AEAD_AES_128_GCM_SIV_KEYLEN == K_length) || (32 == K_length) ||
+	       (48 == K_length) || (64 == K_length))) {
 		goto bail;
 	}
 	nts_nKeys = 0;
@@ -212,10 +315,14 @@ bool nts_read_cookie_keys(void) {
 	  nts_nKeys = i+1;
 	}
 	fclose(in);
+	nts_keys_changed();
+	nts_unlock_cookie_keys();
 	msyslog(LOG_INFO, "NTS: Read cookie file, %d keys.", nts_nKeys);
 	return true;
 
   bail:
+	nts_keys_changed();	/* may have overwritten some keys */
+	nts_unlock_cookie_keys();
 	msyslog(LOG_ERR, "ERR: Error parsing cookie keys file");
 	fclose(in);
 	return false;
@@ -229,15 +336,132 @@ bool nts_read_cookie_keys(void) {
  * they copy the key file to other systems and have them load it.
  */
 void nts_make_cookie_key(void) {
+	nts_lock_cookie_keys();
 	if (nts_nKeys < NTS_nKEYS) nts_nKeys++;
 	for (int i=nts_nKeys-1; i>0; i--) {
 	  nts_keys[i] = nts_keys[i-1];
 	}
 	ntp_RAND_priv_bytes(nts_keys[0].K, K_length);
 	ntp_RAND_bytes((uint8_t *)&nts_keys[0].I, sizeof(nts_keys[0].I));
+	nts_keys_changed();
+	nts_unlock_cookie_keys();
 	return;
 }
 
+/* Read the cluster secret, ntsconfig.cookiesecret.
+ * Everything in the file is secret, so complain if others can read it.
+ */
+bool nts_read_cookie_secret(void) {
+	const char *filename = ntsconfig.cookiesecret;
+	struct stat sb;
+	FILE *in;
+	int length;
+	size_t len = 0;
+	unsigned int temp;
+
+	in = fopen(filename, "r");
+	if (NULL == in) {
+		char errbuf[100];
+		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+		msyslog(LOG_ERR, "NTSs: can't read cookie secret: %s=>%s",
+			filename, errbuf);
+		return false;
+	}
+	if (0 == fstat(fileno(in), &sb) && (sb.st_mode & (S_IRWXG|S_IRWXO)))
+		msyslog(LOG_WARNING,
+			"NTSs: cookie secret %s is readable by others", filename);
+	if (1 != fscanf(in, "L: %d\n", &length))
+		goto bail;
+	if ( !((AEAD_AES_128_GCM_SIV_KEYLEN == length) || (32 == length) ||
+	       (48 == length) || (64 == length)))
+		goto bail;
+	if (0 != fscanf(in, "S: "))
+		goto bail;
+	while (len < sizeof(cluster_secret) && 1 == fscanf(in, "%02x", &temp))
+		cluster_secret[len++] = temp;
+	if (CLUSTER_SECRET_MIN > len)
+		goto bail;
+	fclose(in);
+	K_length = length;
+	cluster_secret_len = len;
+	cluster_day = -1;
+	return true;
+
+  bail:
+	OPENSSL_cleanse(cluster_secret, sizeof(cluster_secret));
+	cluster_secret_len = 0;
+	msyslog(LOG_ERR, "NTSs: Error parsing cookie secret %s, "
+		"need L: and at least %d bytes of S:",
+		filename, CLUSTER_SECRET_MIN);
+	fclose(in);
+	return false;
+}
+
+/* Derive K and I for day from the cluster secret.
+ * Info is the label, the day and the key length, all big-endian,
+ * so every node gets the same bytes whatever it runs on.
+ */
+static bool cluster_derive(int64_t day, struct NTS_Key *key) {
+	uint8_t info[sizeof(CLUSTER_INFO) + 8 + 4];
+	uint8_t out[NTS_MAX_KEYLEN + 4];
+	size_t outlen = K_length + 4;
+	uint8_t *p = info + sizeof(CLUSTER_INFO);
+	EVP_PKEY_CTX *pctx;
+	bool ok;
+
+	memcpy(info, CLUSTER_INFO, sizeof(CLUSTER_INFO));
+	for (int i = 7; i >= 0; i--)
+		*p++ = (uint8_t)((uint64_t)day >> (8*i));
+	for (int i = 3; i >= 0; i--)
+		*p++ = (uint8_t)((uint32_t)K_length >> (8*i));
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	ok = (NULL != pctx) &&
+	     (0 < EVP_PKEY_derive_init(pctx)) &&
+	     (0 < EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256())) &&
+	     (0 < EVP_PKEY_CTX_set1_hkdf_key(pctx, cluster_secret,
+					     (int)cluster_secret_len)) &&
+	     (0 < EVP_PKEY_CTX_add1_hkdf_info(pctx, info, (int)sizeof(info))) &&
+	     (0 < EVP_PKEY_derive(pctx, out, &outlen));
+	EVP_PKEY_CTX_free(pctx);
+	if (ok) {
+		memcpy(key->K, out, K_length);
+		memcpy(&key->I, out + K_length, sizeof(key->I));
+	}
+	OPENSSL_cleanse(out, sizeof(out));
+	return ok;
+}
+
+/* Set nts_keys[] for now from the cluster secret.
+ * nts_keys[0] is today, nts_keys[i] is i days ago.  Near midnight
+ * the last slot holds tomorrow instead.  Does nothing if the keys
+ * are already right.
+ */
+void nts_cluster_cookie_keys(time_t now) {
+	int64_t day = (int64_t)now / SecondsPerDay;
+	bool grace = (SecondsPerDay - CLUSTER_GRACE) <=
+		     ((int64_t)now % SecondsPerDay);
+
+	if (day == cluster_day && grace == cluster_grace)
+		return;
+	nts_lock_cookie_keys();
+	for (int i = 0; i < NTS_nKEYS; i++) {
+		int64_t kday = day - i;
+		if (grace && NTS_nKEYS-1 == i)
+			kday = day + 1;
+		if (!cluster_derive(kday, &nts_keys[i])) {
+			msyslog(LOG_ERR, "NTSs: can't derive cluster cookie key");
+			exit(1);
+		}
+	}
+	nts_nKeys = NTS_nKEYS;
+	K_time = (time_t)(day * SecondsPerDay);
+	cluster_day = day;
+	cluster_grace = grace;
+	nts_keys_changed();
+	nts_unlock_cookie_keys();
+}
+
 bool nts_write_cookie_keys(void) {
 	const char *cookiefile = NTS_COOKIE_KEY_FILE;
 	char tempfile[PATH_MAX];
@@ -283,29 +507,42 @@ bool nts_write_cookie_keys(void) {
 	return true;
 }
 
-/* returns actual length */
+/* Length of the cookie nts_make_cookie will make for keylen */
+int nts_cookie_length(int keylen) {
+	return AD_LENGTH + CMAC_LENGTH + AEAD_LENGTH + 2*keylen;
+}
+
+/* returns actual length
+ * cookie may point straight into the packet being built:
+ * the plaintext is assembled where the ciphertext goes
+ * and encrypted in place.
+ */
 int nts_make_cookie(uint8_t *cookie,
   uint16_t aead,
   uint8_t *c2s, uint8_t *s2c, int keylen) {
-	uint8_t plaintext[NTS_MAX_COOKIELEN];
+	uint8_t *plaintext;
 	uint8_t *nonce;
 	int used, plainlength;
 	bool ok;
 	uint8_t * finger;
 	uint32_t temp;	/* keep 4 byte alignment */
 	size_t left;
+	AES_SIV_CTX *ctx;
+	bool gcm;
 
 	if (NULL == cookie_ctx)
 		return 0;		/* We aren't initialized yet. */
 
-	nts_cnt.cookie_make++;
+	nts_cnt_mine()->cookie_make++;
 
 	INSIST(keylen <= NTS_MAX_KEYLEN);
 
-	/* collect plaintext
-	 * separate buffer avoids encrypt in place
-	 * but costs cache space
-	 */
+	nts_lock_cookie_keys();
+	gcm = (AEAD_AES_128_GCM_SIV_KEYLEN == K_length);
+
+	/* collect plaintext, after the AD and the SIV (GCM-SIV: before
+	 * the tag) */
+	plaintext = cookie + AD_LENGTH + (gcm ? 0 : CMAC_LENGTH);
 	finger = plaintext;
 	temp = aead;
 	memcpy(finger, &temp, AEAD_LENGTH);
@@ -323,22 +560,30 @@ int nts_make_cookie(uint8_t *cookie,
 	finger += sizeof(nts_keys[0].I);
 
 	nonce = finger;
-	ntp_RAND_bytes(finger, NONCE_LENGTH);
+	ntp_RAND_pool_bytes(finger, NONCE_LENGTH);
 	finger += NONCE_LENGTH;
 
 	used = finger-cookie;
 	left = NTS_MAX_COOKIELEN-used;
-
-	nts_lock_cookielock();
-
-	ok = AES_SIV_Encrypt(cookie_ctx,
-			     finger, &left,   /* left: in: max out length, out: length used */
-			     nts_keys[0].K, K_length,
-			     nonce, NONCE_LENGTH,
-			     plaintext, plainlength,
-			     cookie, AD_LENGTH);
-
-	nts_unlock_cookielock();
+	INSIST((size_t)plainlength + CMAC_LENGTH <= left);
+
+	if (gcm) {
+		GCM_SIV_CTX *gctx = cookie_cache_gcm();
+		ok = (NULL != gctx) &&
+		     gcm_siv_encrypt(gctx, plaintext, nts_keys[0].K, K_length,
+				     nonce, plaintext, plainlength,
+				     cookie, AD_LENGTH);
+	} else {
+		/* Same steps as AES_SIV_Encrypt, minus AES_SIV_Init */
+		ctx = cookie_cache_get(0);
+		ok = (NULL != ctx) &&
+		     AES_SIV_AssociateData(ctx, cookie, AD_LENGTH) &&
+		     AES_SIV_AssociateData(ctx, nonce, NONCE_LENGTH) &&
+		     AES_SIV_EncryptFinal(ctx, finger, plaintext,
+					  plaintext, plainlength);
+	}
+	nts_unlock_cookie_keys();
+	left = plainlength + CMAC_LENGTH;
 
 	if (!ok) {
 		msyslog(LOG_ERR, "NTS: nts_make_cookie - Error from AES_SIV_Encrypt");
@@ -368,41 +613,43 @@ bool nts_unpack_cookie(uint8_t *cookie, int cookielen,
 	int cipherlength;
 	bool ok;
 	struct NTS_Key *key;
+	uint32_t id;
 	int i;
+	AES_SIV_CTX *ctx;
 
 	if (NULL == cookie_ctx)
 		return false;	/* We aren't initialized yet. */
 
+	nts_lock_cookie_keys();
 	if (0 == nts_nKeys) {
-		nts_cnt.cookie_not_server++;
+		nts_unlock_cookie_keys();
+		nts_cnt_mine()->cookie_not_server++;
 		return false;  /* We are not a NTS enabled server. */
 	}
 
 	/* We may get garbage from the net */
-	if (cookielen > NTS_MAX_COOKIELEN)
+	if (cookielen > NTS_MAX_COOKIELEN || cookielen < AD_LENGTH) {
+		nts_unlock_cookie_keys();
 		return false;
-
-	finger = cookie;
-	key = NULL;		/* squash uninitialized warning */
-	for (i=0; i<nts_nKeys; i++) {
-	  key = &nts_keys[i];
-	  if (0 == memcmp(finger, &key->I, sizeof(key->I))) {
-		break;
-	  }
 	}
-	nts_cnt.cookie_decode_total++;  /* total attempts, includes too old */
-	if (nts_nKeys == i) {
-		nts_cnt.cookie_decode_too_old++;
+
+	memcpy(&id, cookie, sizeof(id));
+	i = nts_find_key(id);
+	nts_cnt_mine()->cookie_decode_total++;  /* total attempts, includes too old */
+	if (0 > i) {
+		nts_unlock_cookie_keys();
+		nts_cnt_mine()->cookie_decode_too_old++;
 		return false;
-        }
+	}
+	key = &nts_keys[i];
 	if (0 == i) {
-		nts_cnt.cookie_decode_current++;
+		nts_cnt_mine()->cookie_decode_current++;
 	} else if (1 == i) {
-		nts_cnt.cookie_decode_old++;
+		nts_cnt_mine()->cookie_decode_old++;
 	} else if (2 == i) {
-		nts_cnt.cookie_decode_old2++;
+		nts_cnt_mine()->cookie_decode_old2++;
 	} else {
-		nts_cnt.cookie_decode_older++;
+		nts_cnt_mine()->cookie_decode_older++;
 	}
 #if 0
 	if (1<i) {
@@ -412,28 +659,39 @@ bool nts_unpack_cookie(uint8_t *cookie, int cookielen,
 	}
 #endif
 
-	finger += sizeof(key->I);
+	finger = cookie + sizeof(key->I);
 	nonce = finger;
 	finger += NONCE_LENGTH;
 
 	// require(AD_LENGTH==finger-cookie);
 
 	cipherlength = cookielen - AD_LENGTH;
-	plainlength = NTS_MAX_COOKIELEN;
-
-	nts_lock_cookielock();
-
-	ok = AES_SIV_Decrypt(cookie_ctx,
-			     plaintext, &plainlength,
-			     key->K, K_length,
-			     nonce, NONCE_LENGTH,
-			     finger, cipherlength,
-			     cookie, AD_LENGTH);
-
-	nts_unlock_cookielock();
+	if (cipherlength < CMAC_LENGTH) {
+		nts_unlock_cookie_keys();
+		nts_cnt_mine()->cookie_decode_error++;
+		return false;
+	}
+	plainlength = cipherlength - CMAC_LENGTH;
+
+	if (AEAD_AES_128_GCM_SIV_KEYLEN == K_length) {
+		GCM_SIV_CTX *gctx = cookie_cache_gcm();
+		ok = (NULL != gctx) &&
+		     gcm_siv_decrypt(gctx, plaintext, key->K, K_length,
+				     nonce, finger, cipherlength,
+				     cookie, AD_LENGTH);
+	} else {
+		/* Same steps as AES_SIV_Decrypt, minus AES_SIV_Init */
+		ctx = cookie_cache_get(i);
+		ok = (NULL != ctx) &&
+		     AES_SIV_AssociateData(ctx, cookie, AD_LENGTH) &&
+		     AES_SIV_AssociateData(ctx, nonce, NONCE_LENGTH) &&
+		     AES_SIV_DecryptFinal(ctx, plaintext, finger,
+					  finger+CMAC_LENGTH, plainlength);
+	}
+	nts_unlock_cookie_keys();
 
 	if (!ok) {
-		nts_cnt.cookie_decode_error++;
+		nts_cnt_mine()->cookie_decode_error++;
 		return false;
 	}
 
@@ -450,20 +708,133 @@ bool nts_unpack_cookie(uint8_t *cookie, int cookielen,
 	return true;
 }
 
-void nts_lock_cookielock(void) {
-	int err = pthread_mutex_lock(&cookie_lock);
+static void nts_lock_cookie_keys(void) {
+	int err = pthread_mutex_lock(&cookie_key_lock);
 	if (0 != err) {
-		msyslog(LOG_ERR, "ERR: Can't lock cookie_lock: %d", err);
+		msyslog(LOG_ERR, "ERR: Can't lock cookie_key_lock: %d", err);
 		exit(2);
 	}
 }
 
-void nts_unlock_cookielock(void) {
-	int err = pthread_mutex_unlock(&cookie_lock);
+static void nts_unlock_cookie_keys(void) {
+	int err = pthread_mutex_unlock(&cookie_key_lock);
 	if (0 != err) {
-		msyslog(LOG_ERR, "ERR: Can't unlock cookie_lock: %d", err);
+		msyslog(LOG_ERR, "ERR: Can't unlock cookie_key_lock: %d", err);
 		exit(2);
 	}
 }
 
+/* Caller holds cookie_key_lock. */
+static void nts_keys_changed(void) {
+	unsigned int slot;
+
+	K_gen++;
+	ZERO(K_index);
+	for (int i=0; i<nts_nKeys; i++) {
+		slot = nts_keys[i].I % K_INDEX_SLOTS;
+		while (0 != K_index[slot].key)
+			slot = (slot + 1) % K_INDEX_SLOTS;
+		K_index[slot].I = nts_keys[i].I;
+		K_index[slot].key = i + 1;
+	}
+}
+
+/* Return position of key id in nts_keys[], -1 if we don't have it. */
+static int nts_find_key(uint32_t id) {
+	unsigned int slot = id % K_INDEX_SLOTS;
+	int i;
+
+	for (unsigned int probes = 0; probes < K_INDEX_SLOTS; probes++) {
+		if (0 == K_index[slot].key)
+			return -1;
+		if (id == K_index[slot].I) {
+			i = K_index[slot].key - 1;
+			/* paranoia: index out of step with the keys */
+			if (i >= nts_nKeys || id != nts_keys[i].I)
+				return -1;
+			return i;
+		}
+		slot = (slot + 1) % K_INDEX_SLOTS;
+	}
+	return -1;
+}
+
+static void cookie_cache_make_key(void) {
+	int err = pthread_key_create(&cookie_cache_key, cookie_cache_free);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't create cookie_cache_key: %d", err);
+		exit(2);
+	}
+}
+
+static void cookie_cache_free(void *arg) {
+	struct cookie_cache *cache = arg;
+	for (int i=0; i<NTS_nKEYS; i++) {
+		if (NULL != cache->keyed[i])
+			AES_SIV_CTX_free(cache->keyed[i]);
+	}
+	if (NULL != cache->work)
+		AES_SIV_CTX_free(cache->work);
+	gcm_siv_free(cache->gcm);
+	free_tag(MEM_NTS, cache, sizeof(*cache));
+}
+
+/* Return this thread's cache, making it on first use.
+ * NULL if out of memory.
+ */
+static struct cookie_cache *cookie_cache_this(void) {
+	struct cookie_cache *cache;
+
+	pthread_once(&cookie_cache_once, cookie_cache_make_key);
+	cache = pthread_getspecific(cookie_cache_key);
+	if (NULL == cache) {
+		cache = emalloc_zero_tag(MEM_NTS, sizeof(*cache));
+		cache->work = AES_SIV_CTX_new();
+		if (NULL == cache->work) {
+			free_tag(MEM_NTS, cache, sizeof(*cache));
+			return NULL;
+		}
+		pthread_setspecific(cookie_cache_key, cache);
+	}
+	return cache;
+}
+
+/* Return this thread's scratch context, ready to take the associated
+ * data for a cookie made with nts_keys[i].  NULL if out of memory.
+ */
+static AES_SIV_CTX *cookie_cache_get(int i) {
+	struct cookie_cache *cache = cookie_cache_this();
+	unsigned int gen = K_gen;
+
+	if (NULL == cache)
+		return NULL;
+	if (NULL == cache->keyed[i]) {
+		cache->keyed[i] = AES_SIV_CTX_new();
+		if (NULL == cache->keyed[i])
+			return NULL;
+	}
+	if (gen != cache->gen[i]) {
+		if (!AES_SIV_Init(cache->keyed[i], nts_keys[i].K, K_length))
+			return NULL;
+		cache->gen[i] = gen;
+	}
+	if (!AES_SIV_CTX_copy(cache->work, cache->keyed[i]))
+		return NULL;
+	return cache->work;
+}
+
+/* Return this thread's AES-GCM-SIV context.  It keeps the key
+ * schedule for the last K it was given, which is nearly always
+ * nts_keys[0].K.  NULL if out of memory.
+ */
+static GCM_SIV_CTX *cookie_cache_gcm(void) {
+	struct cookie_cache *cache = cookie_cache_this();
+
+	if (NULL == cache)
+		return NULL;
+	if (NULL == cache->gcm)
+		cache->gcm = gcm_siv_new();
+	return cache->gcm;
+}
+
 /* end */
@@ -8,8 +8,13 @@
  *
  * We carefully arrange things so that no padding is necessary.
  *
- * This is only called by the main ntpd thread, so we don't need
- * a lock to protect wire_ctx.
+ * Packets are handled with proto_lock held, so wire_ctx and wire_gcm
+ * need no lock of their own.  Deferred server replies are sealed by
+ * whichever thread sends them, with that thread's seal_ctx.
+ *
+ * The AEEF uses AES-SIV-CMAC, with a 16 byte nonce and the SIV ahead
+ * of the ciphertext, unless the NTS-KE settled on AES-128-GCM-SIV,
+ * which has a 12 byte nonce and the tag after the ciphertext.
  */
 
 #include "config.h"
@@ -17,6 +22,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <aes_siv.h>
 
@@ -39,67 +45,127 @@ enum NtpExtFieldType {
 	NTS_AEEF = 0x404 /* Authenticated and Encrypted Extension Fields */
 };
 
-/* This is only called by the main thread so we don't need a lock. */
+/* Only used with proto_lock held, so we don't need a lock. */
 AES_SIV_CTX* wire_ctx = NULL;
+static GCM_SIV_CTX* wire_gcm = NULL;
+
+/* Per-thread contexts for nts_seal_batch() */
+struct seal_ctx {
+	AES_SIV_CTX *siv;
+	GCM_SIV_CTX *gcm;
+};
+static pthread_key_t seal_ctx_key;
+static pthread_once_t seal_ctx_once = PTHREAD_ONCE_INIT;
+
+#define SEAL_BATCH 16		/* jobs per AES_SIV_Encrypt_batch() */
+
+static void seal_ctx_free(void *arg) {
+	struct seal_ctx *ctx = arg;
+	AES_SIV_CTX_free(ctx->siv);
+	gcm_siv_free(ctx->gcm);
+	free_tag(MEM_NTS, ctx, sizeof(*ctx));
+}
+
+static void seal_ctx_make_key(void) {
+	int err = pthread_key_create(&seal_ctx_key, seal_ctx_free);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't create seal_ctx_key: %d", err);
+		exit(2);
+	}
+}
 
 
 bool extens_init(void) {
 	wire_ctx = AES_SIV_CTX_new();
-	if (NULL == wire_ctx) {
+	if (NULL == wire_gcm)
+		wire_gcm = gcm_siv_new();
+	if (NULL == wire_ctx || NULL == wire_gcm) {
 		msyslog(LOG_ERR, "NTS: Can't init wire_ctx");
 		exit(1);
 	}
 	return true;
 }
 
+/* Each request spends a cookie, and its reply brings back one for the
+ * cookie and each placeholder sent, so a lost reply costs one cookie
+ * and NTS_MAX_COOKIES lost in a row cost a new NTS-KE.  Where replies
+ * go missing in runs, hold twice the longest recent run (lossrun),
+ * up to NTS_CLIENT_COOKIES.  The extra placeholders are limited to
+ * PLACEHOLDER_BYTES a request, to stay clear of fragmentation.
+ */
+#define PLACEHOLDER_BYTES 1024
+#define LOSSRUN_DECAY 0.9f	/* per good reply */
+
+static int cookies_wanted(const struct ntsclient_t *state) {
+	int want = 2*(int)ceilf(state->lossrun) + 1;
+	int fit = state->count + 1 +
+		  PLACEHOLDER_BYTES / (NTP_EX_HDR_LNG + state->cookielen);
+
+	want = min(want, min(fit, NTS_CLIENT_COOKIES));
+	return max(want, NTS_MAX_COOKIES);
+}
+
 int extens_client_send(struct peer *peer, struct pkt *xpkt) {
 	struct BufCtl_t buf;
-	int used, adlength, idx;
+	int used, adlength, idx, noncelen, want;
 	size_t left;
 	uint8_t *nonce, *packet;
-	bool ok;
+	bool ok, gcm;
 
 	packet = (uint8_t*)xpkt;
 	buf.next = xpkt->exten;
 	buf.left = MAX_EXT_LEN;
 
 	/* UID */
-	ntp_RAND_bytes(peer->nts_state.UID, NTS_UID_LENGTH);
+	ntp_RAND_pool_bytes(peer->cold->nts_state.UID, NTS_UID_LENGTH);
 	ex_append_record_bytes(&buf, Unique_Identifier,
-			       peer->nts_state.UID, NTS_UID_LENGTH);
+			       peer->cold->nts_state.UID, NTS_UID_LENGTH);
 
 	/* cookie */
-	idx = peer->nts_state.readIdx++;
+	idx = peer->cold->nts_state.readIdx++;
 	ex_append_record_bytes(&buf, NTS_Cookie,
-			       peer->nts_state.cookies[idx], peer->nts_state.cookielen);
-	peer->nts_state.readIdx = peer->nts_state.readIdx % NTS_MAX_COOKIES;
-	peer->nts_state.count--;
+			       peer->cold->nts_state.cookies[idx], peer->cold->nts_state.cookielen);
+	peer->cold->nts_state.readIdx = peer->cold->nts_state.readIdx % NTS_CLIENT_COOKIES;
+	peer->cold->nts_state.count--;
+	peer->cold->nts_state.unanswered++;
 
 	/* Need more cookies? */
-	for (int i=peer->nts_state.count+1; i<NTS_MAX_COOKIES; i++) {
+	want = cookies_wanted(&peer->cold->nts_state);
+	for (int i=peer->cold->nts_state.count+1; i<want; i++) {
 		/* WARN: This may get too big for the MTU. */
-		ex_append_header(&buf, NTS_Cookie_Placeholder, peer->nts_state.cookielen);
-		memset(buf.next, 0, peer->nts_state.cookielen);
-		buf.next += peer->nts_state.cookielen;
-		buf.left -= peer->nts_state.cookielen;
+		ex_append_header(&buf, NTS_Cookie_Placeholder, peer->cold->nts_state.cookielen);
+		memset(buf.next, 0, peer->cold->nts_state.cookielen);
+		buf.next += peer->cold->nts_state.cookielen;
+		buf.left -= peer->cold->nts_state.cookielen;
 	}
 
 	/* AEAD */
+	gcm = (AEAD_AES_128_GCM_SIV == peer->cold->nts_state.aead);
+	noncelen = gcm ? GCM_SIV_NONCE_LENGTH : NONCE_LENGTH;
 	adlength = buf.next-packet;
-	ex_append_header(&buf, NTS_AEEF, NTP_EX_U16_LNG*2+NONCE_LENGTH+CMAC_LENGTH);
-	append_uint16(&buf, NONCE_LENGTH);
+	ex_append_header(&buf, NTS_AEEF, NTP_EX_U16_LNG*2+noncelen+CMAC_LENGTH);
+	append_uint16(&buf, noncelen);
 	append_uint16(&buf, CMAC_LENGTH);
 	nonce = buf.next;
-	ntp_RAND_bytes(nonce, NONCE_LENGTH);
-	buf.next += NONCE_LENGTH;
-	buf.left -= NONCE_LENGTH;
+	ntp_RAND_pool_bytes(nonce, noncelen);
+	buf.next += noncelen;
+	buf.left -= noncelen;
 	left = buf.left;
-	ok = AES_SIV_Encrypt(wire_ctx,
-			     buf.next, &left,   /* left: in: max out length, out: length used */
-			     peer->nts_state.c2s, peer->nts_state.keylen,
-			     nonce, NONCE_LENGTH,
-			     NULL, 0,           /* no plain/cipher text */
-			     packet, adlength);
+	if (gcm) {
+		ok = gcm_siv_encrypt(wire_gcm, buf.next,
+				     peer->cold->nts_state.c2s, peer->cold->nts_state.keylen,
+				     nonce,
+				     NULL, 0,   /* no plain/cipher text */
+				     packet, adlength);
+		left = GCM_SIV_TAG_LENGTH;
+	} else {
+		ok = AES_SIV_Encrypt(wire_ctx,
+				     buf.next, &left,   /* left: in: max out length, out: length used */
+				     peer->cold->nts_state.c2s, peer->cold->nts_state.keylen,
+				     nonce, NONCE_LENGTH,
+				     NULL, 0,           /* no plain/cipher text */
+				     packet, adlength);
+	}
 	if (!ok) {
 		msyslog(LOG_ERR, "NTS: extens_client_send - Error from AES_SIV_Encrypt");
 		/* I don't think this should happen,
@@ -113,7 +179,7 @@ int extens_client_send(struct peer *peer, struct pkt *xpkt) {
 	buf.left -= left;
 
 	used = buf.next-xpkt->exten;
-	nts_cnt.client_send++;
+	nts_cnt_mine()->client_send++;
 	return used;
 }
 
@@ -124,7 +190,7 @@ bool extens_server_recv(struct ntspacket_t *ntspacket, uint8_t *pkt, int lng) {
 	bool sawcookie, sawAEEF;
 	int cookielen;			/* cookie and placeholder(s) */
 
-	nts_cnt.server_recv_bad++;		/* assume bad, undo if OK */
+	nts_cnt_mine()->server_recv_bad++;		/* assume bad, undo if OK */
 
 	buf.next = pkt+LEN_PKT_NOMAC;
 	buf.left = lng-LEN_PKT_NOMAC;
@@ -137,10 +203,10 @@ bool extens_server_recv(struct ntspacket_t *ntspacket, uint8_t *pkt, int lng) {
 	while (buf.left >= NTS_KE_HDR_LNG) {
 		uint16_t type;
 		bool critical = false;
-		int length, adlength;
+		int length, adlength, expect;
 		size_t outlen;
 		uint8_t *nonce, *cmac;
-		bool ok;
+		bool ok, gcm;
 
 		type = ex_next_record(&buf, &length); /* length excludes header */
 		if (length&3 || length > buf.left || length < 0) {
@@ -197,7 +263,9 @@ bool extens_server_recv(struct ntspacket_t *ntspacket, uint8_t *pkt, int lng) {
 			if (!sawcookie) {
 				return false; /* no cookie yet, no c2s */
 			}
-			if (length != NTP_EX_HDR_LNG+NONCE_LENGTH+CMAC_LENGTH) {
+			gcm = (AEAD_AES_128_GCM_SIV == ntspacket->aead);
+			expect = gcm ? GCM_SIV_NONCE_LENGTH : NONCE_LENGTH;
+			if (length != NTP_EX_HDR_LNG+expect+CMAC_LENGTH) {
 				return false;
 			}
 			/* Additional data is up to this exten. */
@@ -211,15 +279,27 @@ bool extens_server_recv(struct ntspacket_t *ntspacket, uint8_t *pkt, int lng) {
 			if (CMAC_LENGTH != cmaclen) {
 				return false;
 			}
+			if (gcm && GCM_SIV_NONCE_LENGTH != noncelen) {
+				return false;
+			}
 			nonce = buf.next;
-			cmac = nonce+NONCE_LENGTH;
+			cmac = nonce+expect;
 			outlen = 6;
-			ok = AES_SIV_Decrypt(wire_ctx,
-					     NULL, &outlen,
-					     ntspacket->c2s, ntspacket->keylen,
-					     nonce, noncelen,
-					     cmac, CMAC_LENGTH,
-					     pkt, adlength);
+			if (gcm) {
+				ok = gcm_siv_decrypt(wire_gcm, NULL,
+						     ntspacket->c2s, ntspacket->keylen,
+						     nonce,
+						     cmac, GCM_SIV_TAG_LENGTH,
+						     pkt, adlength);
+				outlen = 0;
+			} else {
+				ok = AES_SIV_Decrypt(wire_ctx,
+						     NULL, &outlen,
+						     ntspacket->c2s, ntspacket->keylen,
+						     nonce, noncelen,
+						     cmac, CMAC_LENGTH,
+						     pkt, adlength);
+			}
 			if (!ok) {
 				return false;
 			}
@@ -257,24 +337,27 @@ bool extens_server_recv(struct ntspacket_t *ntspacket, uint8_t *pkt, int lng) {
 	//  printf("ESRx: %d, %d, %d\n",
 	//      lng-LEN_PKT_NOMAC, ntspacket->needed, ntspacket->keylen);
 	ntspacket->valid = true;
-	nts_cnt.server_recv_good++;
-	nts_cnt.server_recv_bad--;
+	nts_cnt_mine()->server_recv_good++;
+	nts_cnt_mine()->server_recv_bad--;
 	return true;
 }
 
-int extens_server_send(struct ntspacket_t *ntspacket, struct pkt *xpkt) {
+/* With a non-NULL seal, the reply is left unencrypted and seal says
+ * how to finish it; see nts_seal_batch().
+ */
+int extens_server_send(struct ntspacket_t *ntspacket, struct pkt *xpkt,
+	struct nts_seal *seal) {
 	struct BufCtl_t buf;
 	int used, adlength;
 	size_t left;
 	uint8_t *nonce, *packet;
 	uint8_t *plaintext, *ciphertext;;
-	uint8_t cookie[NTS_MAX_COOKIELEN];
-	int cookielen, plainleng, aeadlen;
-	bool ok;
+	int cookielen, plainleng, aeadlen, noncelen;
+	bool ok, gcm;
 
-	/* get first cookie now so we have length */
-	cookielen = nts_make_cookie(cookie, ntspacket->aead,
-				    ntspacket->c2s, ntspacket->s2c, ntspacket->keylen);
+	/* Cookies are made straight into the packet, so we need
+	 * their length before making them. */
+	cookielen = nts_cookie_length(ntspacket->keylen);
 
 	packet = (uint8_t*)xpkt;
 	buf.next = xpkt->exten;
@@ -287,46 +370,78 @@ int extens_server_send(struct ntspacket_t *ntspacket, struct pkt *xpkt) {
 
 	adlength = buf.next-packet;		/* up to here is Additional Data */
 
+	gcm = (AEAD_AES_128_GCM_SIV == ntspacket->aead);
+	noncelen = gcm ? GCM_SIV_NONCE_LENGTH : NONCE_LENGTH;
+
 	/* length of whole AEEF */
 	plainleng = ntspacket->needed*(NTP_EX_HDR_LNG+cookielen);
 	/* length of whole AEEF header */
-	aeadlen = NTP_EX_U16_LNG*2+NONCE_LENGTH+CMAC_LENGTH + plainleng;
+	aeadlen = NTP_EX_U16_LNG*2+noncelen+CMAC_LENGTH + plainleng;
 	ex_append_header(&buf, NTS_AEEF, aeadlen);
-	append_uint16(&buf, NONCE_LENGTH);
+	append_uint16(&buf, noncelen);
 	append_uint16(&buf, plainleng+CMAC_LENGTH);
 
 	nonce = buf.next;
-	ntp_RAND_bytes(nonce, NONCE_LENGTH);
-	buf.next += NONCE_LENGTH;
-	buf.left -= NONCE_LENGTH;
+	ntp_RAND_pool_bytes(nonce, noncelen);
+	buf.next += noncelen;
+	buf.left -= noncelen;
 
 	ciphertext = buf.next;	/* cipher text starts here */
 	left = buf.left;
-	buf.next += CMAC_LENGTH;	/* skip space for CMAC */
-	buf.left -= CMAC_LENGTH;
+	if (gcm) {
+		buf.left -= GCM_SIV_TAG_LENGTH;	/* tag goes after the cookies */
+	} else {
+		buf.next += CMAC_LENGTH;	/* skip space for CMAC */
+		buf.left -= CMAC_LENGTH;
+	}
 	plaintext = buf.next;		/* encrypt in place */
 
-	ex_append_record_bytes(&buf, NTS_Cookie,
-			       cookie, cookielen);
-	for (int i=1; i<ntspacket->needed; i++) {
+	for (int i=0; i<ntspacket->needed; i++) {
 		/* WARN: This may get too big for the MTU. See length calculation above.
 		 * Responses are the same length as requests to avoid DDoS amplification.
 		 * So if it got to us, there is a good chance it will get back.  */
-		nts_make_cookie(cookie, ntspacket->aead,
+		int made;
+		if (NTP_EX_HDR_LNG+cookielen > buf.left)
+			break;
+		ex_append_header(&buf, NTS_Cookie, cookielen);
+		made = nts_make_cookie(buf.next, ntspacket->aead,
 				ntspacket->c2s, ntspacket->s2c, ntspacket->keylen);
-		ex_append_record_bytes(&buf, NTS_Cookie,
-				       cookie, cookielen);
+		INSIST(made == cookielen);
+		buf.next += cookielen;
+		buf.left -= cookielen;
 	}
+	if (gcm)
+		buf.next += GCM_SIV_TAG_LENGTH;
 
 	//printf("ESSa: %d, %d, %d, %d\n",
 	//  adlength, plainleng, cookielen, ntspacket->needed);
 
-	ok = AES_SIV_Encrypt(wire_ctx,
-			     ciphertext, &left,   /* left: in: max out length, out: length used */
-			     ntspacket->s2c, ntspacket->keylen,
-			     nonce, NONCE_LENGTH,
-			     plaintext, plainleng,
-			     packet, adlength);
+	if (NULL != seal) {
+		seal->pending = true;
+		seal->aead = ntspacket->aead;
+		seal->keylen = ntspacket->keylen;
+		memcpy(seal->key, ntspacket->s2c, ntspacket->keylen);
+		seal->adlen = adlength;
+		seal->nonce = nonce - packet;
+		seal->cipher = ciphertext - packet;
+		seal->plainlen = plainleng;
+		nts_cnt_mine()->server_send++;
+		return buf.next-xpkt->exten;
+	}
+
+	if (gcm)
+		ok = gcm_siv_encrypt(wire_gcm, ciphertext,
+				     ntspacket->s2c, ntspacket->keylen,
+				     nonce,
+				     plaintext, plainleng,
+				     packet, adlength);
+	else
+		ok = AES_SIV_Encrypt(wire_ctx,
+				     ciphertext, &left,   /* left: in: max out length, out: length used */
+				     ntspacket->s2c, ntspacket->keylen,
+				     nonce, NONCE_LENGTH,
+				     plaintext, plainleng,
+				     packet, adlength);
 	if (!ok) {
 		msyslog(LOG_ERR, "NTS: extens_server_send - Error from AES_SIV_Encrypt");
 		nts_log_ssl_error();
@@ -342,16 +457,87 @@ int extens_server_send(struct ntspacket_t *ntspacket, struct pkt *xpkt) {
 
 	// printf("ESSx: %lu, %d\n", (long unsigned)left, used);
 
-	nts_cnt.server_send++;
+	nts_cnt_mine()->server_send++;
 	return used;
 }
 
+/* Finish n replies left pending by extens_server_send().
+ * AES-SIV-CMAC replies go through AES_SIV_Encrypt_batch() together;
+ * AES-GCM-SIV has no batch call, and needs none, so those are done
+ * one at a time.
+ * May be called without proto_lock.
+ */
+void nts_seal_batch(uint8_t **pkts, struct nts_seal **seals, int n) {
+	AES_SIV_Job jobs[SEAL_BATCH];
+	struct seal_ctx *ctx;
+	size_t good = 0;
+	int njobs = 0;
+	bool gcmok = true;
+
+	pthread_once(&seal_ctx_once, seal_ctx_make_key);
+	ctx = pthread_getspecific(seal_ctx_key);
+	if (NULL == ctx) {
+		ctx = emalloc_zero_tag(MEM_NTS, sizeof(*ctx));
+		ctx->siv = AES_SIV_CTX_new();
+		ctx->gcm = gcm_siv_new();
+		if (NULL == ctx->siv || NULL == ctx->gcm) {
+			msyslog(LOG_ERR, "NTS: Can't init seal_ctx");
+			exit(1);
+		}
+		pthread_setspecific(seal_ctx_key, ctx);
+	}
+
+	for ( ; n > SEAL_BATCH; n -= SEAL_BATCH) {
+		nts_seal_batch(pkts, seals, SEAL_BATCH);
+		pkts += SEAL_BATCH;
+		seals += SEAL_BATCH;
+	}
+	for (int i=0; i<n; i++) {
+		uint8_t *packet = pkts[i];
+		struct nts_seal *seal = seals[i];
+		AES_SIV_Job *job = &jobs[njobs];
+
+		if (AEAD_AES_128_GCM_SIV == seal->aead) {
+			if (!gcm_siv_encrypt(ctx->gcm, packet + seal->cipher,
+					     seal->key, seal->keylen,
+					     packet + seal->nonce,
+					     packet + seal->cipher, seal->plainlen,
+					     packet, seal->adlen))
+				gcmok = false;
+			continue;
+		}
+		job->out = packet + seal->cipher;
+		job->out_len = CMAC_LENGTH + seal->plainlen;
+		job->key = seal->key;
+		job->key_len = seal->keylen;
+		job->nonce = packet + seal->nonce;
+		job->nonce_len = NONCE_LENGTH;
+		job->plaintext = packet + seal->cipher + CMAC_LENGTH;
+		job->plaintext_len = seal->plainlen;
+		job->ad = packet;
+		job->ad_len = seal->adlen;
+		njobs++;
+	}
+	if (0 < njobs)
+		good = AES_SIV_Encrypt_batch(ctx->siv, jobs, (size_t)njobs);
+	for (int i=0; i<n; i++) {
+		memset(seals[i]->key, 0, sizeof(seals[i]->key));
+		seals[i]->pending = false;
+	}
+	if ((size_t)njobs != good || !gcmok) {
+		msyslog(LOG_ERR, "NTS: nts_seal_batch - Error from AES_SIV_Encrypt");
+		nts_log_ssl_error();
+		/* Same as extens_server_send */
+		exit(1);
+	}
+}
+
 bool extens_client_recv(struct peer *peer, uint8_t *pkt, int lng) {
 	struct BufCtl_t buf;
 	int idx;
 	bool sawAEEF = false;
 
-	nts_cnt.client_recv_bad++;	/* assume bad, undo if OK */
+	nts_cnt_mine()->client_recv_bad++;	/* assume bad, undo if OK */
 
 	buf.next = pkt+LEN_PKT_NOMAC;
 	buf.left = lng-LEN_PKT_NOMAC;
@@ -362,7 +548,7 @@ bool extens_client_recv(struct peer *peer, uint8_t *pkt, int lng) {
 		int length, adlength, noncelen;
 		uint8_t *nonce, *ciphertext, *plaintext;
 		size_t outlen;
-		bool ok;
+		bool ok, gcm;
 
 		type = ex_next_record(&buf, &length); /* length excludes header */
 		if (length&3 || length > buf.left || length < 0)
@@ -376,7 +562,7 @@ bool extens_client_recv(struct peer *peer, uint8_t *pkt, int lng) {
 		    case Unique_Identifier:
 			if (NTS_UID_LENGTH != length)
 				return false;
-			if (0 != memcmp(buf.next, peer->nts_state.UID, NTS_UID_LENGTH))
+			if (0 != memcmp(buf.next, peer->cold->nts_state.UID, NTS_UID_LENGTH))
 				return false;
 			buf.next += length;
 			buf.left -= length;
@@ -384,14 +570,14 @@ bool extens_client_recv(struct peer *peer, uint8_t *pkt, int lng) {
 		    case NTS_Cookie:
 			if (!sawAEEF)
 				return false;			/* reject unencrypted cookies */
-			if (NTS_MAX_COOKIES <= peer->nts_state.count)
+			if (NTS_CLIENT_COOKIES <= peer->cold->nts_state.count)
 				return false;			/* reject extra cookies */
-			if (length != peer->nts_state.cookielen)
+			if (length != peer->cold->nts_state.cookielen)
 				return false;			/* reject length change */
-			idx = peer->nts_state.writeIdx++;
-			memcpy((uint8_t*)&peer->nts_state.cookies[idx], buf.next, length);
-			peer->nts_state.writeIdx = peer->nts_state.writeIdx % NTS_MAX_COOKIES;
-			peer->nts_state.count++;
+			idx = peer->cold->nts_state.writeIdx++;
+			memcpy((uint8_t*)&peer->cold->nts_state.cookies[idx], buf.next, length);
+			peer->cold->nts_state.writeIdx = peer->cold->nts_state.writeIdx % NTS_CLIENT_COOKIES;
+			peer->cold->nts_state.count++;
 			buf.next += length;
 			buf.left -= length;
 			break;
@@ -403,12 +589,32 @@ bool extens_client_recv(struct peer *peer, uint8_t *pkt, int lng) {
 				return false;                 /* else round up */
 			nonce = buf.next;
 			ciphertext = nonce+noncelen;
+			gcm = (AEAD_AES_128_GCM_SIV == peer->cold->nts_state.aead);
+			if (gcm) {
+				if (GCM_SIV_NONCE_LENGTH != noncelen ||
+				    (size_t)buf.left < GCM_SIV_NONCE_LENGTH+GCM_SIV_TAG_LENGTH)
+					return false;
+				outlen = buf.left-noncelen-GCM_SIV_TAG_LENGTH;
+				ok = gcm_siv_decrypt(wire_gcm, ciphertext,
+						     peer->cold->nts_state.s2c, peer->cold->nts_state.keylen,
+						     nonce,
+						     ciphertext, outlen+GCM_SIV_TAG_LENGTH,
+						     pkt, adlength);
+				if (!ok)
+					return false;
+				/* setup to process encrypted headers,
+				 * up to the tag */
+				buf.next += noncelen;
+				buf.left -= noncelen+GCM_SIV_TAG_LENGTH;
+				sawAEEF = true;
+				break;
+			}
 			plaintext = ciphertext+CMAC_LENGTH;
 			outlen = buf.left-NONCE_LENGTH-CMAC_LENGTH;
 			//      printf("ECRa: %lu, %d\n", (long unsigned)outlen, noncelen);
 			ok = AES_SIV_Decrypt(wire_ctx,
 					     plaintext, &outlen,
-					     peer->nts_state.s2c, peer->nts_state.keylen,
+					     peer->cold->nts_state.s2c, peer->cold->nts_state.keylen,
 					     nonce, noncelen,
 					     ciphertext, outlen+CMAC_LENGTH,
 					     pkt, adlength);
@@ -432,15 +638,21 @@ bool extens_client_recv(struct peer *peer, uint8_t *pkt, int lng) {
 		}
 	}
 
-	//  printf("ECRx: %d, %d  %d, %d\n", sawAEEF, peer->nts_state.count,
-	//      peer->nts_state.writeIdx, peer->nts_state.readIdx);
+	//  printf("ECRx: %d, %d  %d, %d\n", sawAEEF, peer->cold->nts_state.count,
+	//      peer->cold->nts_state.writeIdx, peer->cold->nts_state.readIdx);
 	if (!sawAEEF) {
 		return false;
 	}
 	if (buf.left > 0)
 		return false;
-	nts_cnt.client_recv_good++;
-	nts_cnt.client_recv_bad--;
+	/* A run of lost replies, if any, just ended.  Remember the
+	 * longest, and let older runs fade. */
+	peer->cold->nts_state.lossrun =
+		max((float)(peer->cold->nts_state.unanswered - 1),
+		    peer->cold->nts_state.lossrun * LOSSRUN_DECAY);
+	peer->cold->nts_state.unanswered = 0;
+	nts_cnt_mine()->client_recv_good++;
+	nts_cnt_mine()->client_recv_bad--;
 	return true;
 }
 /* end */
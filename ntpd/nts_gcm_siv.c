@@ -0,0 +1,419 @@
+/*
+ * nts_gcm_siv.c - AEAD_AES_128_GCM_SIV and AEAD_AES_256_GCM_SIV
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Section references are to
+ * https://tools.ietf.org/html/rfc8452
+ *
+ * OpenSSL only has AES-GCM-SIV from 3.2 on, so this puts it together
+ * from AES-ECB, which EVP does with AES-NI (and VAES) where the CPU has
+ * them, and POLYVAL, which is done here with PCLMULQDQ when the CPU has
+ * it and with constant time integer multiplies when it doesn't.
+ *
+ * The output is C||T, the ciphertext followed by the 16 byte tag, and
+ * encryption and decryption may be done in place.  Unlike AES-SIV-CMAC,
+ * each message needs only two key schedules and a carry-less multiply
+ * per block of AD and text, no CMAC subkeys.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "ntp_stdlib.h"
+#include "nts2.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define GCM_SIV_PCLMUL
+# include <wmmintrin.h>
+#endif
+
+#define BLOCK 16
+#define CTR_BATCH 8		/* counter blocks per EVP call */
+
+struct gcm_siv_ctx {
+	EVP_CIPHER_CTX *kgk;	/* keyed with the key-generating key */
+	EVP_CIPHER_CTX *enc;	/* keyed with the message-encryption key */
+	size_t kgk_cipher;	/* key length kgk and enc are set up for, */
+	size_t enc_cipher;	/* 0 before their first use */
+	size_t keylen;		/* of kgk, 0 until keyed */
+	uint8_t key[32];	/* kgk, to skip its key schedule next time */
+};
+
+typedef void (*polyval_fn)(uint8_t S[BLOCK], const uint8_t H[BLOCK],
+			   const uint8_t *in, size_t blocks);
+
+static pthread_once_t gcm_siv_once = PTHREAD_ONCE_INIT;
+static const EVP_CIPHER *aes128_ecb, *aes256_ecb;
+static polyval_fn polyval_blocks;
+
+static void gcm_siv_setup(void);
+
+
+/*****************************************************/
+
+/* POLYVAL, section 3.  Field elements are little-endian: bit 0 of
+ * byte 0 is the x^0 coefficient, so they load as two uint64_t, low
+ * half first.  dot(a, b) is a*b*x^-128, reduced by
+ * x^128 + x^127 + x^126 + x^121 + 1.
+ */
+
+static inline uint64_t get_le64(const uint8_t *p) {
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	       (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline void put_le64(uint8_t *p, uint64_t v) {
+	for (int i = 0; i < 8; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+	for (int i = 0; i < 4; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+}
+
+/* Low 64 bits of the carry-less product.  Each multiply sees only
+ * every fourth bit, so carries land in the holes and are masked off.
+ * No data dependent branches or table lookups.
+ */
+static inline uint64_t bmul64(uint64_t x, uint64_t y) {
+	const uint64_t m0 = 0x1111111111111111ULL, m1 = 0x2222222222222222ULL;
+	const uint64_t m2 = 0x4444444444444444ULL, m3 = 0x8888888888888888ULL;
+	uint64_t x0 = x & m0, x1 = x & m1, x2 = x & m2, x3 = x & m3;
+	uint64_t y0 = y & m0, y1 = y & m1, y2 = y & m2, y3 = y & m3;
+	uint64_t z0, z1, z2, z3;
+
+	z0 = (x0 * y0) ^ (x1 * y3) ^ (x2 * y2) ^ (x3 * y1);
+	z1 = (x0 * y1) ^ (x1 * y0) ^ (x2 * y3) ^ (x3 * y2);
+	z2 = (x0 * y2) ^ (x1 * y1) ^ (x2 * y0) ^ (x3 * y3);
+	z3 = (x0 * y3) ^ (x1 * y2) ^ (x2 * y1) ^ (x3 * y0);
+	return (z0 & m0) | (z1 & m1) | (z2 & m2) | (z3 & m3);
+}
+
+static inline uint64_t rev64(uint64_t x) {
+	x = ((x & 0x5555555555555555ULL) << 1) | ((x >> 1) & 0x5555555555555555ULL);
+	x = ((x & 0x3333333333333333ULL) << 2) | ((x >> 2) & 0x3333333333333333ULL);
+	x = ((x & 0x0F0F0F0F0F0F0F0FULL) << 4) | ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+	x = ((x & 0x00FF00FF00FF00FFULL) << 8) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+	x = ((x & 0x0000FFFF0000FFFFULL) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFULL);
+	return (x << 32) | (x >> 32);
+}
+
+/* 64x64 -> 128 carry-less multiply; the high half is the low half
+ * of the product of the bit reversed operands, reversed.
+ */
+static inline void clmul64(uint64_t x, uint64_t y, uint64_t *lo, uint64_t *hi) {
+	*lo = bmul64(x, y);
+	*hi = rev64(bmul64(rev64(x), rev64(y))) >> 1;
+}
+
+#define POLYVAL_C 0xc200000000000000ULL	/* x^-128 reduction constant */
+
+static void polyval_generic(uint8_t S[BLOCK], const uint8_t H[BLOCK],
+			    const uint8_t *in, size_t blocks) {
+	uint64_t h0 = get_le64(H), h1 = get_le64(H + 8);
+	uint64_t s0 = get_le64(S), s1 = get_le64(S + 8);
+
+	for ( ; blocks > 0; blocks--, in += BLOCK) {
+		uint64_t p0, p1, p2, p3, m0, m1, t0, t1, lo, hi;
+
+		s0 ^= get_le64(in);
+		s1 ^= get_le64(in + 8);
+		/* Karatsuba: 256 bit product in p3:p2:p1:p0 */
+		clmul64(s0, h0, &p0, &p1);
+		clmul64(s1, h1, &p2, &p3);
+		clmul64(s0 ^ s1, h0 ^ h1, &m0, &m1);
+		m0 ^= p0 ^ p2;
+		m1 ^= p1 ^ p3;
+		p1 ^= m0;
+		p2 ^= m1;
+		/* Montgomery reduction, two folds of 64 bits */
+		clmul64(p0, POLYVAL_C, &t0, &t1);
+		lo = t0 ^ p1;
+		hi = t1 ^ p0;
+		clmul64(lo, POLYVAL_C, &t0, &t1);
+		s0 = t0 ^ hi ^ p2;
+		s1 = t1 ^ lo ^ p3;
+	}
+	put_le64(S, s0);
+	put_le64(S + 8, s1);
+}
+
+#ifdef GCM_SIV_PCLMUL
+/* The same steps as polyval_generic(), a multiply per instruction. */
+__attribute__((target("pclmul,sse2")))
+static void polyval_pclmul(uint8_t S[BLOCK], const uint8_t H[BLOCK],
+			   const uint8_t *in, size_t blocks) {
+	const __m128i poly = _mm_set_epi64x((long long)POLYVAL_C, 1);
+	__m128i h = _mm_loadu_si128((const __m128i *)(const void *)H);
+	__m128i s = _mm_loadu_si128((const __m128i *)(void *)S);
+
+	for ( ; blocks > 0; blocks--, in += BLOCK) {
+		__m128i t0, t1, t2, t3;
+
+		s = _mm_xor_si128(s, _mm_loadu_si128(
+			(const __m128i *)(const void *)in));
+		t0 = _mm_clmulepi64_si128(s, h, 0x00);
+		t3 = _mm_clmulepi64_si128(s, h, 0x11);
+		t1 = _mm_xor_si128(_mm_clmulepi64_si128(s, h, 0x10),
+				   _mm_clmulepi64_si128(s, h, 0x01));
+		t0 = _mm_xor_si128(t0, _mm_slli_si128(t1, 8));
+		t3 = _mm_xor_si128(t3, _mm_srli_si128(t1, 8));
+		t2 = _mm_clmulepi64_si128(t0, poly, 0x10);
+		t0 = _mm_xor_si128(_mm_shuffle_epi32(t0, 78), t2);
+		t2 = _mm_clmulepi64_si128(t0, poly, 0x10);
+		t0 = _mm_xor_si128(_mm_shuffle_epi32(t0, 78), t2);
+		s = _mm_xor_si128(t0, t3);
+	}
+	_mm_storeu_si128((__m128i *)(void *)S, s);
+}
+#endif /* GCM_SIV_PCLMUL */
+
+/* POLYVAL over len bytes, the last block padded with zeros */
+static void polyval_padded(uint8_t S[BLOCK], const uint8_t H[BLOCK],
+			   const uint8_t *in, size_t len) {
+	uint8_t last[BLOCK];
+
+	if (len >= BLOCK)
+		polyval_blocks(S, H, in, len / BLOCK);
+	if (0 != len % BLOCK) {
+		memset(last, 0, sizeof(last));
+		memcpy(last, in + len - len % BLOCK, len % BLOCK);
+		polyval_blocks(S, H, last, 1);
+	}
+}
+
+/* For tests: POLYVAL(H, X_1, ..., X_n), with the portable code or
+ * with whichever this CPU gets.
+ */
+void gcm_siv_polyval(uint8_t S[BLOCK], const uint8_t H[BLOCK],
+		     const uint8_t *in, size_t blocks, bool generic) {
+	pthread_once(&gcm_siv_once, gcm_siv_setup);
+	memset(S, 0, BLOCK);
+	if (generic)
+		polyval_generic(S, H, in, blocks);
+	else
+		polyval_blocks(S, H, in, blocks);
+}
+
+
+/*****************************************************/
+
+static void gcm_siv_setup(void) {
+#if OPENSSL_VERSION_NUMBER > 0x20000000L
+	/* Fetch once; EVP_aes_128_ecb() would fetch on every init. */
+	aes128_ecb = EVP_CIPHER_fetch(NULL, "AES-128-ECB", NULL);
+	aes256_ecb = EVP_CIPHER_fetch(NULL, "AES-256-ECB", NULL);
+#else
+	aes128_ecb = EVP_aes_128_ecb();
+	aes256_ecb = EVP_aes_256_ecb();
+#endif
+	polyval_blocks = polyval_generic;
+#ifdef GCM_SIV_PCLMUL
+	if (__builtin_cpu_supports("pclmul"))
+		polyval_blocks = polyval_pclmul;
+#endif
+}
+
+GCM_SIV_CTX *gcm_siv_new(void) {
+	GCM_SIV_CTX *ctx;
+
+	pthread_once(&gcm_siv_once, gcm_siv_setup);
+	if (NULL == aes128_ecb || NULL == aes256_ecb)
+		return NULL;
+	ctx = emalloc_zero(sizeof(*ctx));
+	ctx->kgk = EVP_CIPHER_CTX_new();
+	ctx->enc = EVP_CIPHER_CTX_new();
+	if (NULL == ctx->kgk || NULL == ctx->enc) {
+		gcm_siv_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void gcm_siv_free(GCM_SIV_CTX *ctx) {
+	if (NULL == ctx)
+		return;
+	EVP_CIPHER_CTX_free(ctx->kgk);
+	EVP_CIPHER_CTX_free(ctx->enc);
+	OPENSSL_cleanse(ctx->key, sizeof(ctx->key));
+	free(ctx);
+}
+
+/* Key cctx for AES-ECB.  Once it has its cipher only the key
+ * schedule is redone.
+ */
+static bool ecb_key(EVP_CIPHER_CTX *cctx, size_t *cipher_keylen,
+		    const uint8_t *key, size_t keylen) {
+	const EVP_CIPHER *cipher = (16 == keylen) ? aes128_ecb : aes256_ecb;
+
+	if (*cipher_keylen == keylen)
+		return 1 == EVP_EncryptInit_ex(cctx, NULL, NULL, key, NULL);
+	*cipher_keylen = 0;
+	if (1 != EVP_EncryptInit_ex(cctx, cipher, NULL, key, NULL) ||
+	    1 != EVP_CIPHER_CTX_set_padding(cctx, 0))
+		return false;
+	*cipher_keylen = keylen;
+	return true;
+}
+
+static bool ecb(EVP_CIPHER_CTX *cctx, uint8_t *out, const uint8_t *in,
+		size_t len) {
+	int outl = 0;
+
+	return 1 == EVP_EncryptUpdate(cctx, out, &outl, in, (int)len) &&
+	       (size_t)outl == len;
+}
+
+/* Section 4: the POLYVAL key H and the message-encryption key,
+ * from the key-generating key and the nonce.
+ */
+static bool derive_keys(GCM_SIV_CTX *ctx, const uint8_t *key, size_t keylen,
+			const uint8_t *nonce, uint8_t H[BLOCK]) {
+	uint8_t in[6 * BLOCK], out[6 * BLOCK], enckey[32];
+	size_t n = (16 == keylen) ? 4 : 6;
+	bool ok;
+
+	if (16 != keylen && 32 != keylen)
+		return false;
+	if (ctx->keylen != keylen ||
+	    0 != CRYPTO_memcmp(ctx->key, key, keylen)) {
+		if (!ecb_key(ctx->kgk, &ctx->kgk_cipher, key, keylen)) {
+			ctx->keylen = 0;
+			return false;
+		}
+		memcpy(ctx->key, key, keylen);
+		ctx->keylen = keylen;
+	}
+	for (size_t i = 0; i < n; i++) {
+		put_le32(in + i * BLOCK, (uint32_t)i);
+		memcpy(in + i * BLOCK + 4, nonce, GCM_SIV_NONCE_LENGTH);
+	}
+	if (!ecb(ctx->kgk, out, in, n * BLOCK))
+		return false;
+	/* first 8 bytes of each block */
+	memcpy(H, out, 8);
+	memcpy(H + 8, out + BLOCK, 8);
+	for (size_t i = 2; i < n; i++)
+		memcpy(enckey + (i - 2) * 8, out + i * BLOCK, 8);
+	ok = ecb_key(ctx->enc, &ctx->enc_cipher, enckey, keylen);
+	OPENSSL_cleanse(out, sizeof(out));
+	OPENSSL_cleanse(enckey, sizeof(enckey));
+	return ok;
+}
+
+/* Section 4: the tag is the encrypted POLYVAL of AD, text and their
+ * lengths, with the nonce mixed in.
+ */
+static bool make_tag(GCM_SIV_CTX *ctx, const uint8_t H[BLOCK],
+		     const uint8_t *nonce,
+		     const uint8_t *text, size_t textlen,
+		     const uint8_t *ad, size_t adlen, uint8_t tag[BLOCK]) {
+	uint8_t S[BLOCK], lengths[BLOCK];
+
+	memset(S, 0, sizeof(S));
+	polyval_padded(S, H, ad, adlen);
+	polyval_padded(S, H, text, textlen);
+	put_le64(lengths, (uint64_t)adlen * 8);
+	put_le64(lengths + 8, (uint64_t)textlen * 8);
+	polyval_blocks(S, H, lengths, 1);
+	for (int i = 0; i < GCM_SIV_NONCE_LENGTH; i++)
+		S[i] ^= nonce[i];
+	S[BLOCK - 1] &= 0x7f;
+	return ecb(ctx->enc, tag, S, BLOCK);
+}
+
+/* CTR mode with a 32 bit little-endian counter in the first word,
+ * started from the tag with its top bit set.
+ */
+static bool ctr_xor(GCM_SIV_CTX *ctx, uint8_t *out, const uint8_t *in,
+		    size_t len, const uint8_t tag[BLOCK]) {
+	uint8_t ctrs[CTR_BATCH * BLOCK], stream[CTR_BATCH * BLOCK];
+	uint32_t counter;
+	bool ok = true;
+
+	if (0 == len)
+		return true;
+	for (int i = 0; i < CTR_BATCH; i++) {
+		memcpy(ctrs + i * BLOCK, tag, BLOCK);
+		ctrs[i * BLOCK + BLOCK - 1] |= 0x80;
+	}
+	counter = (uint32_t)get_le64(ctrs) & 0xffffffffU;
+	while (len > 0) {
+		size_t blocks = (len + BLOCK - 1) / BLOCK;
+		size_t chunk;
+
+		if (blocks > CTR_BATCH)
+			blocks = CTR_BATCH;
+		for (size_t i = 0; i < blocks; i++)
+			put_le32(ctrs + i * BLOCK, counter++);
+		if (!ecb(ctx->enc, stream, ctrs, blocks * BLOCK)) {
+			ok = false;
+			break;
+		}
+		chunk = (len < blocks * BLOCK) ? len : blocks * BLOCK;
+		for (size_t i = 0; i < chunk; i++)
+			out[i] = in[i] ^ stream[i];
+		out += chunk;
+		in += chunk;
+		len -= chunk;
+	}
+	OPENSSL_cleanse(stream, sizeof(stream));
+	return ok;
+}
+
+/* Encrypt plainlen bytes of plaintext into out, which gets
+ * plainlen + GCM_SIV_TAG_LENGTH bytes.  out may be plaintext.
+ */
+bool gcm_siv_encrypt(GCM_SIV_CTX *ctx, uint8_t *out,
+		     const uint8_t *key, size_t keylen, const uint8_t *nonce,
+		     const uint8_t *plaintext, size_t plainlen,
+		     const uint8_t *ad, size_t adlen) {
+	uint8_t H[BLOCK], tag[BLOCK];
+	bool ok;
+
+	ok = derive_keys(ctx, key, keylen, nonce, H) &&
+	     make_tag(ctx, H, nonce, plaintext, plainlen, ad, adlen, tag) &&
+	     ctr_xor(ctx, out, plaintext, plainlen, tag);
+	if (ok)
+		memcpy(out + plainlen, tag, BLOCK);
+	OPENSSL_cleanse(H, sizeof(H));
+	return ok;
+}
+
+/* Decrypt cipherlen bytes, ciphertext and tag, into out, which gets
+ * cipherlen - GCM_SIV_TAG_LENGTH bytes.  out may be ciphertext.  On
+ * failure out is zeroed, never left with unauthenticated plaintext.
+ */
+bool gcm_siv_decrypt(GCM_SIV_CTX *ctx, uint8_t *out,
+		     const uint8_t *key, size_t keylen, const uint8_t *nonce,
+		     const uint8_t *ciphertext, size_t cipherlen,
+		     const uint8_t *ad, size_t adlen) {
+	uint8_t H[BLOCK], tag[BLOCK], expect[BLOCK];
+	size_t plainlen;
+	bool ok;
+
+	if (cipherlen < GCM_SIV_TAG_LENGTH)
+		return false;
+	plainlen = cipherlen - GCM_SIV_TAG_LENGTH;
+	memcpy(tag, ciphertext + plainlen, BLOCK);
+	ok = derive_keys(ctx, key, keylen, nonce, H) &&
+	     ctr_xor(ctx, out, ciphertext, plainlen, tag) &&
+	     make_tag(ctx, H, nonce, out, plainlen, ad, adlen, expect) &&
+	     0 == CRYPTO_memcmp(tag, expect, BLOCK);
+	if (!ok && 0 < plainlen)
+		OPENSSL_cleanse(out, plainlen);
+	OPENSSL_cleanse(H, sizeof(H));
+	return ok;
+}
+/* end */
@@ -13,12 +13,22 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/x509.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER > 0x20000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #include "ntp.h"
 #include "ntpd.h"
@@ -34,12 +44,24 @@
 
 static bool create_listener4(int port);
 static bool create_listener6(int port);
+static void tune_listener(int sock, const char *tag);
 static void* nts_ke_listener(void*);
+static void* nts_ke_worker(void*);
 static bool nts_ke_request(SSL *ssl);
 static void nts_ke_accept_fail(char* addrbuf, double sec);
 
 static void nts_lock_certlock(void);
 static void nts_unlock_certlock(void);
+static void cert_file_changed(const char *path, struct stat *sb, bool verbose);
+static void nts_lock_kelock(void);
+static void nts_unlock_kelock(void);
+#if OPENSSL_VERSION_NUMBER > 0x20000000L
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+	EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc);
+#else
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+	EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc);
+#endif
 
 
 static SSL_CTX *server_ctx = NULL;
@@ -50,6 +72,52 @@ static int listener6_sock = -1;
  * This seems like overkill, but it doesn't happen often. */
 pthread_mutex_t certificate_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Connections accepted by the listeners wait here for a KE worker.
+ * The TLS handshake and the request happen in the worker, so one slow
+ * client only ties up one worker.  ke_lock also protects the
+ * session ticket keys, the rate table and the KE latency histogram.
+ */
+struct ke_client {
+	struct ke_client *link;
+	int sock;
+	sockaddr_u addr;
+	struct timespec start;		/* accept time, wall clock */
+};
+
+static pthread_mutex_t ke_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ke_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ke_space = PTHREAD_COND_INITIALIZER;
+static struct ke_client *ke_head, *ke_tail;
+static int ke_queued;
+static int ke_queue_max;
+
+/* Recent connection rate of each source, checked by the listeners so
+ * a flood from one address is closed before it costs a queue slot, a
+ * worker or SSL_new().  Each cell holds a decaying rate scored the way
+ * mon->score is in ntp_monitor.c, keyed by the address, or the /64 for
+ * IPv6.  Collisions only overstate a rate.  Protected by ke_lock.
+ */
+#define KE_RATE_CELLS	4096		/* power of 2 */
+#define KE_RATE_DECAY	60.0f		/* seconds */
+
+struct ke_rate {
+	float score;			/* connections per second */
+	uint32_t stamp;			/* monotonic time in 1/16 s */
+};
+static struct ke_rate ke_rate[KE_RATE_CELLS];
+
+/* Session ticket keys, only used with "nts tickets".
+ * ticket_keys[0] encrypts new tickets, [1] is the previous key,
+ * still good for decrypting.  They are rotated with the cookie key.
+ */
+struct ticket_key {
+	bool valid;
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+};
+static struct ticket_key ticket_keys[2];	/* protected by ke_lock */
+
 static int alpn_select_cb(SSL *ssl,
 			  const unsigned char **out,
 			  unsigned char *outlen,
@@ -100,7 +168,21 @@ bool nts_server_init(void) {
 
 	SSL_CTX_set_alpn_select_cb(server_ctx, alpn_select_cb, NULL);
 	SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
-	SSL_CTX_set_timeout(server_ctx, NTS_KE_TIMEOUT);  /* session lifetime */
+	if (ntsconfig.tickets) {
+		/* Stateless TLS 1.3 tickets, so no server side cache. */
+		nts_rotate_ticket_keys();
+#if OPENSSL_VERSION_NUMBER > 0x20000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(server_ctx, ticket_key_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(server_ctx, ticket_key_cb);
+#endif
+		SSL_CTX_set_num_tickets(server_ctx, 1);
+		SSL_CTX_set_timeout(server_ctx, NTS_TICKET_LIFETIME);
+	} else {
+		SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+		SSL_CTX_set_num_tickets(server_ctx, 0);
+		SSL_CTX_set_timeout(server_ctx, NTS_KE_TIMEOUT);  /* session lifetime */
+	}
 
 	ok &= nts_load_versions(server_ctx);
 	ok &= nts_load_ciphers(server_ctx);
@@ -127,33 +209,121 @@ bool nts_server_init(void) {
 
 bool nts_server_init2(void) {
 	pthread_t worker;
-	sigset_t block_mask, saved_sig_mask;
-	int rc;
-	char errbuf[100];
+	int i;
 
 	if (!nts_load_certificate(server_ctx)) {
 		return false;
 	}
+	filewatch_add((NULL != ntsconfig.cert) ? ntsconfig.cert : NTS_CERT_FILE,
+		      NULL, cert_file_changed);
+
+	if (0 >= ntsconfig.workers)
+		ntsconfig.workers = NTS_KE_WORKERS;
+	ke_queue_max = ntsconfig.workers * 4;
+	msyslog(LOG_INFO, "NTSs: starting %d NTS-KE worker threads",
+		ntsconfig.workers);
+
+	for (i = 0; i < ntsconfig.workers; i++)
+		if (ntp_thread_create(&worker, nts_ke_worker, NULL,
+				      "NTSs: nts_ke_worker"))
+			break;
+	if (0 == i)
+		return false;
+	if (listener4_sock != -1)
+		ntp_thread_create(&worker, nts_ke_listener, &listener4_sock,
+				  "NTSs: nts_start_server4");
+	if (listener6_sock != -1)
+		ntp_thread_create(&worker, nts_ke_listener, &listener6_sock,
+				  "NTSs: nts_start_server6");
 
-	sigfillset(&block_mask);
-	pthread_sigmask(SIG_BLOCK, &block_mask, &saved_sig_mask);
-	if (listener4_sock != -1) {
-		rc = pthread_create(&worker, NULL, nts_ke_listener, &listener4_sock);
-		if (rc) {
-			ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-			msyslog(LOG_ERR, "NTSs: nts_start_server4: error from pthread_create: %s", errbuf);
-		}
+	return true;
+}
+
+/* Called from nts_cookie_timer when the cookie key changes.
+ * Tickets made with the old key still work for one more period.
+ */
+void nts_rotate_ticket_keys(void) {
+	struct ticket_key fresh;
+
+	if (!ntsconfig.tickets)
+		return;
+	fresh.valid = true;
+	ntp_RAND_bytes(fresh.name, sizeof(fresh.name));
+	ntp_RAND_priv_bytes(fresh.aes, sizeof(fresh.aes));
+	ntp_RAND_priv_bytes(fresh.hmac, sizeof(fresh.hmac));
+
+	nts_lock_kelock();
+	ticket_keys[1] = ticket_keys[0];
+	ticket_keys[0] = fresh;
+	nts_unlock_kelock();
+	memset(&fresh, 0, sizeof(fresh));
+}
+
+/* OpenSSL calls this to encrypt (enc=1) or decrypt (enc=0) a ticket.
+ * Returns -1 on error, 0 to reject the ticket (full handshake),
+ * 1 to use it, and 2 to use it and issue a new one.
+ */
+#if OPENSSL_VERSION_NUMBER > 0x20000000L
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+	EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc) {
+	static char digest[] = "sha256";
+	OSSL_PARAM params[3];
+#else
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+	EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc) {
+#endif
+	struct ticket_key key;
+	int which, ret;
+
+	UNUSED_ARG(ssl);
+
+	nts_lock_kelock();
+	if (enc) {
+		which = 0;
+	} else {
+		for (which = 0; which < 2; which++)
+			if (ticket_keys[which].valid &&
+			    0 == memcmp(name, ticket_keys[which].name,
+					sizeof(ticket_keys[which].name)))
+				break;
 	}
-	if (listener6_sock != -1) {
-		rc = pthread_create(&worker, NULL, nts_ke_listener, &listener6_sock);
-		if (rc) {
-			ntp_strerror_r(errno, errbuf, sizeof(errbuf));
-			msyslog(LOG_ERR, "NTSs: nts_start_server6: error from pthread_create: %s", errbuf);
-		}
+	if (2 == which || !ticket_keys[which].valid) {
+		nts_unlock_kelock();
+		return 0;
 	}
-	pthread_sigmask(SIG_SETMASK, &saved_sig_mask, NULL);
-
-	return true;
+	key = ticket_keys[which];
+	nts_unlock_kelock();
+
+	ret = -1;
+	if (enc) {
+		memcpy(name, key.name, sizeof(key.name));
+		if (1 != RAND_bytes(iv, EVP_MAX_IV_LENGTH))
+			goto done;
+		if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(),
+					    NULL, key.aes, iv))
+			goto done;
+	} else {
+		if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(),
+					    NULL, key.aes, iv))
+			goto done;
+	}
+#if OPENSSL_VERSION_NUMBER > 0x20000000L
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+		key.hmac, sizeof(key.hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+		digest, 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (1 != EVP_MAC_CTX_set_params(hctx, params))
+		goto done;
+#else
+	if (1 != HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac),
+			      EVP_sha256(), NULL))
+		goto done;
+#endif
+	ret = (0 == which) ? 1 : 2;
+  done:
+	memset(&key, 0, sizeof(key));
+	return ret;
 }
 
 /* called every hour */
@@ -165,11 +335,36 @@ void nts_cert_timer(void) {
 void check_cert_file(void) {
 	if (NULL == server_ctx)
 		return;
+	if (filewatch_poke(false))
+		return;		/* cert_file_changed() will look */
 	nts_lock_certlock();
 	nts_reload_certificate(server_ctx);
 	nts_unlock_certlock();
 }
 
+/* The file watcher's callback, on its thread.  The new certificate
+ * and key are read and checked before taking the lock, so NTS-KE
+ * sessions only wait for them to be swapped in.
+ */
+static void cert_file_changed(const char *path, struct stat *sb,
+			      bool verbose) {
+	struct stat now;
+	struct nts_cert nc;
+
+	UNUSED_ARG(verbose);
+	if (0 != stat(path, &now))
+		return;
+	if (now.st_mtime == sb->st_mtime && now.st_ctime == sb->st_ctime)
+		return;  /* avoid clutter in log file */
+	*sb = now;
+	if (!nts_read_certificate(&nc))
+		return;
+	nts_lock_certlock();
+	nts_use_certificate(server_ctx, &nc);
+	nts_unlock_certlock();
+	nts_free_certificate(&nc);
+}
+
 void nts_lock_certlock(void) {
 	int err = pthread_mutex_lock(&certificate_lock);
 	if (0 != err) {
@@ -186,6 +381,22 @@ void nts_unlock_certlock(void) {
 	}
 }
 
+void nts_lock_kelock(void) {
+	int err = pthread_mutex_lock(&ke_lock);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't lock ke_lock: %d", err);
+		exit(2);
+	}
+}
+
+void nts_unlock_kelock(void) {
+	int err = pthread_mutex_unlock(&ke_lock);
+	if (0 != err) {
+		msyslog(LOG_ERR, "ERR: Can't unlock ke_lock: %d", err);
+		exit(2);
+	}
+}
+
 /* lfptod goes to long double */
 static inline double lfptox(l_fp r) {
 /* l_fp to double */
@@ -197,37 +408,20 @@ void* nts_ke_listener(void* arg) {
 	struct timeval timeout = {.tv_sec = NTS_KE_TIMEOUT, .tv_usec = 0};
 	int sock = *(int*)arg;
 	char errbuf[100];
-	char addrbuf[100];
-	char usingbuf[100];
-	struct timespec start, finish;		/* wall clock */
-	l_fp wall;
-	bool worked;
-	const char *good;
-#ifdef RUSAGE_THREAD
-	struct timespec start_u, finish_u;	/* CPU user */
-	struct timespec start_s, finish_s;	/* CPU system */
-	l_fp usr, sys;
-	struct rusage usage;
-#endif
+	struct ntske_counters *cnt;
 
 #ifdef HAVE_SECCOMP_H
         setup_SIGSYS_trap();   /* enable trap for this thread */
 #endif
-
-#ifdef RUSAGE_THREAD
-	/* NB: start_u and start_s are from near the end of the previous cycle.
-	 * Thus usage timing includes the TCP accept and
-	 * writing the previous msyslog message.
-	 */
-	getrusage(RUSAGE_THREAD, &usage);
-	start_u = tval_to_tspec(usage.ru_utime);
-	start_s = tval_to_tspec(usage.ru_stime);
-#endif
+	thread_place(THREAD_NTSKE, -1);
+	cnt = ntske_cnt_mine();
 
 	while(1) {
+		struct ke_client *kc;
 		sockaddr_u addr;
 		socklen_t len = sizeof(addr);
-		SSL *ssl;
+		struct timespec start;
+		bool limited;
 		int client, err;
 
 		client = accept(sock, &addr.sa, &len);
@@ -239,8 +433,6 @@ void* nts_ke_listener(void* arg) {
 			sleep(1);		/* avoid log clutter on bug */
 			continue;
 		}
-		clock_gettime(CLOCK_MONOTONIC, &start);
-		sockporttoa_r(&addr, addrbuf, sizeof(addrbuf));
 
 /* This is disabled in order to reduce clutter in the log file.
  * The client's address is now included in the final message.
@@ -259,40 +451,150 @@ void* nts_ke_listener(void* arg) {
  */
 /*		msyslog(LOG_INFO, "NTSs: TCP accept-ed from %s", addrbuf); */
 
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		nts_lock_kelock();
+		limited = nts_ke_rate_limited(&addr, start);
+		nts_unlock_kelock();
+		if (limited) {
+			cnt->serves_limited++;
+			close(client);
+			continue;
+		}
+
 		err = setsockopt(client, SOL_SOCKET, SO_RCVTIMEO,
 			&timeout, sizeof(timeout));
+		if (0 == err)
+			err = setsockopt(client, SOL_SOCKET, SO_SNDTIMEO,
+				&timeout, sizeof(timeout));
 		if (0 > err) {
 			ntp_strerror_r(errno, errbuf, sizeof(errbuf));
 			msyslog(LOG_ERR, "NTSs: can't setsockopt: %s", errbuf);
 			close(client);
-			ntske_cnt.serves_bad++;
+			cnt->serves_bad++;
 			continue;
 		}
 
-		/* WARN: For high volume servers, this should go in a new thread. */
+		kc = emalloc_zero_tag(MEM_NTS, sizeof(*kc));
+		kc->sock = client;
+		kc->addr = addr;
+		kc->start = start;
+
+		/* If every worker is busy and the queue is full, stop
+		 * accepting.  The kernel's listen backlog holds the rest. */
+		nts_lock_kelock();
+		while (ke_queued >= ke_queue_max)
+			pthread_cond_wait(&ke_space, &ke_lock);
+		if (NULL == ke_tail)
+			ke_head = kc;
+		else
+			ke_tail->link = kc;
+		ke_tail = kc;
+		ke_queued++;
+		pthread_cond_signal(&ke_ready);
+		nts_unlock_kelock();
+	}
+	return NULL;
+}
+
+/* Count a connection from addr at now, and say whether its source is
+ * over ntsconfig.kelimit connections a minute.  Refused connections
+ * count too, so a steady flood stays refused.  Caller holds ke_lock.
+ */
+bool nts_ke_rate_limited(const sockaddr_u *addr, struct timespec now) {
+	struct ke_rate *cell;
+	uint32_t stamp = (uint32_t)(now.tv_sec * 16 + now.tv_nsec / 62500000);
+	unsigned int key;
+
+	if (0 == ntsconfig.kelimit)
+		return false;
+	if (IS_IPV6(addr))
+		key = sock_hash_bytes(PSOCK_ADDR6(addr), 8);
+	else
+		key = sock_hash_bytes(PSOCK_ADDR4(addr), 4);
+	cell = &ke_rate[key & (KE_RATE_CELLS - 1)];
+	if (0 < cell->score)
+		cell->score *= expf(-(float)(stamp - cell->stamp) / 16 /
+				    KE_RATE_DECAY);
+	cell->score += 1.0f / KE_RATE_DECAY;
+	cell->stamp = stamp;
+	return cell->score * 60 > (float)ntsconfig.kelimit + 0.5f;
+}
+
+/* One of ntsconfig.workers threads doing the TLS handshake and
+ * the NTS-KE exchange for connections queued by the listeners.
+ */
+void* nts_ke_worker(void* arg) {
+	char addrbuf[100];
+	char usingbuf[100];
+	struct timespec finish;			/* wall clock */
+	struct timespec req_start, req_finish;	/* nts_ke_request() */
+	l_fp wall;
+	bool worked;
+	const char *good;
+	struct ntske_counters *cnt = ntske_cnt_mine();
+#ifdef RUSAGE_THREAD
+	struct timespec start_u, finish_u;	/* CPU user */
+	struct timespec start_s, finish_s;	/* CPU system */
+	l_fp usr, sys;
+	struct rusage usage;
+#endif
+
+	UNUSED_ARG(arg);
+
+#ifdef HAVE_SECCOMP_H
+        setup_SIGSYS_trap();   /* enable trap for this thread */
+#endif
+	thread_place(THREAD_NTSKE, -1);
+
+	while(1) {
+		struct ke_client *kc;
+		SSL *ssl;
+
+		nts_lock_kelock();
+		while (NULL == ke_head)
+			pthread_cond_wait(&ke_ready, &ke_lock);
+		kc = ke_head;
+		ke_head = kc->link;
+		if (NULL == ke_head)
+			ke_tail = NULL;
+		ke_queued--;
+		pthread_cond_signal(&ke_space);
+		nts_unlock_kelock();
+
+#ifdef RUSAGE_THREAD
+		/* NB: usage timing includes writing the previous
+		 * msyslog message but not the wait for work.
+		 */
+		getrusage(RUSAGE_THREAD, &usage);
+		start_u = tval_to_tspec(usage.ru_utime);
+		start_s = tval_to_tspec(usage.ru_stime);
+#endif
+		sockporttoa_r(&kc->addr, addrbuf, sizeof(addrbuf));
+
 		nts_lock_certlock();
 		ssl = SSL_new(server_ctx);
 		nts_unlock_certlock();
-		SSL_set_fd(ssl, client);
+		SSL_set_fd(ssl, kc->sock);
 
 		if (SSL_accept(ssl) <= 0) {
 			clock_gettime(CLOCK_MONOTONIC, &finish);
-			wall = tspec_intv_to_lfp(sub_tspec(finish, start));
+			wall = tspec_intv_to_lfp(sub_tspec(finish, kc->start));
 			nts_ke_accept_fail(addrbuf, lfptox(wall));
 			SSL_free(ssl);
-			close(client);
-			ntske_cnt.serves_nossl++;
-			ntske_cnt.serves_nossl_wall += wall;
+			close(kc->sock);
+			free_tag(MEM_NTS, kc, sizeof(*kc));
 #ifdef RUSAGE_THREAD
 			getrusage(RUSAGE_THREAD, &usage);
 			finish_u = tval_to_tspec(usage.ru_utime);
 			finish_s = tval_to_tspec(usage.ru_stime);
 			usr = tspec_intv_to_lfp(sub_tspec(finish_u, start_u));
 			sys = tspec_intv_to_lfp(sub_tspec(finish_s, start_s));
-			start_u = finish_u;
-			start_s = finish_s;
-			ntske_cnt.serves_nossl_cpu += usr;
-			ntske_cnt.serves_nossl_cpu += sys;
+#endif
+			cnt->serves_nossl++;
+			cnt->serves_nossl_wall += wall;
+#ifdef RUSAGE_THREAD
+			cnt->serves_nossl_cpu += usr;
+			cnt->serves_nossl_cpu += sys;
 #endif
 			continue;
 		}
@@ -303,6 +605,7 @@ void* nts_ke_listener(void* arg) {
 			SSL_get_cipher_name(ssl),
 			SSL_get_cipher_bits(ssl, NULL));
 
+		clock_gettime(CLOCK_MONOTONIC, &req_start);
 		if (nts_ke_request(ssl)) {
 			worked = true;
 			good = "OK";
@@ -310,35 +613,42 @@ void* nts_ke_listener(void* arg) {
 			worked = false;
 			good = "Failed";
 		}
+		clock_gettime(CLOCK_MONOTONIC, &req_finish);
 
 		SSL_shutdown(ssl);
 		SSL_free(ssl);
-		close(client);
+		close(kc->sock);
 
 		clock_gettime(CLOCK_MONOTONIC, &finish);
-		wall = tspec_intv_to_lfp(sub_tspec(finish, start));
-		if (worked) {
-			ntske_cnt.serves_good++;
-			ntske_cnt.serves_good_wall += wall;
-		} else {
-			ntske_cnt.serves_bad++;
-			ntske_cnt.serves_bad_wall += wall;
-		}
+		wall = tspec_intv_to_lfp(sub_tspec(finish, kc->start));
+		free_tag(MEM_NTS, kc, sizeof(*kc));
 #ifdef RUSAGE_THREAD
 		getrusage(RUSAGE_THREAD, &usage);
 		finish_u = tval_to_tspec(usage.ru_utime);
 		finish_s = tval_to_tspec(usage.ru_stime);
 		usr = tspec_intv_to_lfp(sub_tspec(finish_u, start_u));
 		sys = tspec_intv_to_lfp(sub_tspec(finish_s, start_s));
-		start_u = finish_u;
-		start_s = finish_s;
+#endif
+		nts_lock_kelock();
+		histogram_add(&latency[LAT_NTSKE],
+		    latency_ns(sub_tspec(req_finish, req_start)));
+		nts_unlock_kelock();
 		if (worked) {
-			ntske_cnt.serves_good_cpu += usr;
-			ntske_cnt.serves_good_cpu += sys;
+			cnt->serves_good++;
+			cnt->serves_good_wall += wall;
+#ifdef RUSAGE_THREAD
+			cnt->serves_good_cpu += usr;
+			cnt->serves_good_cpu += sys;
+#endif
 		} else {
-			ntske_cnt.serves_bad_cpu += usr;
-			ntske_cnt.serves_bad_cpu += sys;
+			cnt->serves_bad++;
+			cnt->serves_bad_wall += wall;
+#ifdef RUSAGE_THREAD
+			cnt->serves_bad_cpu += usr;
+			cnt->serves_bad_cpu += sys;
+#endif
 		}
+#ifdef RUSAGE_THREAD
 		msyslog(LOG_INFO, "NTSs: NTS-KE from %s, %s, Using %s, took %.3f sec, CPU: %.3f+%.3f ms",
 			addrbuf, good, usingbuf, lfptox(wall),
 			lfptox(usr*1000), lfptox(sys*1000));
@@ -378,7 +688,8 @@ void nts_ke_accept_fail(char* addrbuf, double sec) {
 
 bool nts_ke_request(SSL *ssl) {
 	/* RFC 4: servers must accept 1024
-	 * Our cookies can be 104, 136, or 168 for AES_SIV_CMAC_xxx
+	 * Our cookies can be 104, 136, or 168 for AES_SIV_CMAC_xxx,
+	 * 72 for AES_128_GCM_SIV
 	 * 8*168 fits comfortably into 2K.
 	 */
 	uint8_t buff[2048] = {0};
@@ -424,6 +735,17 @@ bool nts_ke_request(SSL *ssl) {
 	return true;
 }
 
+/* The KE listeners, for handing over to a new ntpd */
+int nts_server_listeners(int *fds) {
+	int n = 0;
+
+	if (listener4_sock != -1)
+		fds[n++] = listener4_sock;
+	if (listener6_sock != -1)
+		fds[n++] = listener6_sock;
+	return n;
+}
+
 bool create_listener4(int port) {
 	int sock = -1;
 	sockaddr_u addr;
@@ -431,9 +753,16 @@ bool create_listener4(int port) {
 	int err;
 	char errbuf[100];
 
+	ZERO(addr);
 	addr.sa4.sin_family = AF_INET;
 	addr.sa4.sin_port = htons(port);
 	addr.sa4.sin_addr.s_addr= htonl(INADDR_ANY);
+	sock = handover_take(&addr, SOCK_STREAM);
+	if (sock >= 0) {
+		msyslog(LOG_INFO, "NTSs: listen4 taken over");
+		listener4_sock = sock;
+		return true;
+	}
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) {
 		if (EAFNOSUPPORT == errno) {
@@ -458,12 +787,13 @@ bool create_listener4(int port) {
 		close(sock);
 		return false;
 	}
-	if (listen(sock, 6) < 0) {
+	if (listen(sock, ntsconfig.backlog) < 0) {
 		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
 		msyslog(LOG_ERR, "NTSs: can't listen4: %s", errbuf);
 		close(sock);
 		return false;
 	}
+	tune_listener(sock, "4");
 	msyslog(LOG_INFO, "NTSs: listen4 worked");
 
 	listener4_sock = sock;
@@ -477,9 +807,16 @@ bool create_listener6(int port) {
 	int err;
 	char errbuf[100];
 
+	ZERO(addr);
 	addr.sa6.sin6_family = AF_INET6;
 	addr.sa6.sin6_port = htons(port);
 	addr.sa6.sin6_addr = in6addr_any;
+	sock = handover_take(&addr, SOCK_STREAM);
+	if (sock >= 0) {
+		msyslog(LOG_INFO, "NTSs: listen6 taken over");
+		listener6_sock = sock;
+		return true;
+	}
 	sock = socket(AF_INET6, SOCK_STREAM, 0);
 	if (sock < 0) {
 		if (EAFNOSUPPORT == errno) {
@@ -512,18 +849,53 @@ bool create_listener6(int port) {
 		close(sock);
 		return false;
 	}
-	if (listen(sock, 6) < 0) {
+	if (listen(sock, ntsconfig.backlog) < 0) {
 		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
 		msyslog(LOG_ERR, "NTSs: can't listen6: %s", errbuf);
 		close(sock);
 		return false;
 	}
+	tune_listener(sock, "6");
 	msyslog(LOG_INFO, "NTSs: listen6 worked");
 
 	listener6_sock = sock;
 	return true;
 }
 
+/* Optional TCP tuning for a KE listener.  With TCP_DEFER_ACCEPT the
+ * kernel holds a connection until the ClientHello arrives, so port
+ * scans and idle connects never reach accept().  TCP_FASTOPEN lets a
+ * returning client's ClientHello ride on the SYN.  Neither is needed,
+ * so failures are only logged.
+ */
+static void tune_listener(int sock, const char *tag) {
+	char errbuf[100];
+	int opt;
+
+	UNUSED_ARG(sock);
+	UNUSED_ARG(tag);
+	UNUSED_ARG(errbuf);
+	UNUSED_ARG(opt);
+#ifdef TCP_DEFER_ACCEPT
+	opt = NTS_KE_TIMEOUT;
+	if (0 > setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			   &opt, sizeof(opt))) {
+		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+		msyslog(LOG_INFO, "NTSs: can't set TCP_DEFER_ACCEPT%s: %s",
+			tag, errbuf);
+	}
+#endif
+#ifdef TCP_FASTOPEN
+	opt = ntsconfig.backlog;
+	if (0 > setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+			   &opt, sizeof(opt))) {
+		ntp_strerror_r(errno, errbuf, sizeof(errbuf));
+		msyslog(LOG_INFO, "NTSs: can't set TCP_FASTOPEN%s: %s",
+			tag, errbuf);
+	}
+#endif
+}
+
 bool nts_ke_process_receive(struct BufCtl_t *buf, int *aead) {
 	while (buf->left >= NTS_KE_HDR_LNG) {
 		uint16_t type, data;
@@ -606,6 +978,7 @@ bool nts_ke_process_receive(struct BufCtl_t *buf, int *aead) {
 
 bool nts_ke_setup_send(struct BufCtl_t *buf, int aead,
        uint8_t *c2s, uint8_t *s2c, int keylen) {
+	int cookielen, made;
 
 	/* 4.1.2 Next Protocol */
 	ke_append_record_uint16(buf,
@@ -617,10 +990,16 @@ bool nts_ke_setup_send(struct BufCtl_t *buf, int aead,
 	        ke_append_record_uint16(buf, nts_port_negotiation, extra_port);
 
 
+	/* Cookies are made in place, right after their record header. */
+	cookielen = nts_cookie_length(keylen);
 	for (int i=0; i<NTS_MAX_COOKIES; i++) {
-		uint8_t cookie[NTS_MAX_COOKIELEN];
-		int cookielen = nts_make_cookie(cookie, aead, c2s, s2c, keylen);
-		ke_append_record_bytes(buf, nts_new_cookie, cookie, cookielen);
+		if (NTS_KE_HDR_LNG+cookielen > buf->left)
+			break;
+		append_header(buf, nts_new_cookie, cookielen);
+		made = nts_make_cookie(buf->next, aead, c2s, s2c, keylen);
+		INSIST(made == cookielen);
+		buf->next += cookielen;
+		buf->left -= cookielen;
 	}
 
 	/* 4.1.1: End, Critical */
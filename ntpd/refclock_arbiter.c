@@ -128,7 +128,8 @@ struct	refclock refclock_arbiter = {
 	arb_poll,		/* transmit poll message */
 	NULL,			/* not used (old arb_control) */
 	NULL,			/* initialize driver (not used) */
-	NULL			/* timer - not used */
+	NULL,			/* timer - not used */
+	NULL			/* fast loop reading - not used */
 };
 
 
@@ -6,8 +6,12 @@
  */
 #include "config.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <sys/types.h>
+#ifdef REFCLOCK_MODULES
+# include <dlfcn.h>
+#endif
 
 #include "ntpd.h"
 #include "ntp_refclock.h"
@@ -21,8 +25,143 @@ struct refclock refclock_none = {
 	NULL,		/* not used (old hpgps_control) */
 	NULL,		/* initialize driver */
 	NULL,		/* timer - not used */
+	NULL		/* fast loop reading - not used */
 };
 
+#ifdef REFCLOCK_MODULES
+/*
+ * Built with --enable-refclock-modules, the drivers are not in ntpd.
+ * Each is refclock_<file>.so in REFCLOCK_MODULE_DIR, and its slot in
+ * the table below points at a stand-in with only its name, which is
+ * all the configuration parser needs.  refclock_load() fills the
+ * stand-in in from the module when the first clock of that type is
+ * configured, so a server without refclocks never maps driver code.
+ */
+#define STAND_IN(sym, name) \
+	static struct refclock sym##_stand_in = { name, NULL, NULL, NULL, \
+						  NULL, NULL, NULL, NULL }
+
+#ifdef CLOCK_ARBITER
+STAND_IN(refclock_arbiter, "ARBITER");
+#define refclock_arbiter refclock_arbiter_stand_in
+#endif
+#ifdef CLOCK_GENERIC
+STAND_IN(refclock_parse, "GENERIC");
+#define refclock_parse refclock_parse_stand_in
+#endif
+#ifdef CLOCK_GPSDJSON
+STAND_IN(refclock_gpsdjson, "GPSD");
+#define refclock_gpsdjson refclock_gpsdjson_stand_in
+#endif
+#ifdef CLOCK_HPGPS
+STAND_IN(refclock_hpgps, "HPGPS");
+#define refclock_hpgps refclock_hpgps_stand_in
+#endif
+#ifdef CLOCK_JJY
+STAND_IN(refclock_jjy, "JJY");
+#define refclock_jjy refclock_jjy_stand_in
+#endif
+#ifdef CLOCK_LOCAL
+STAND_IN(refclock_local, "LOCAL");
+#define refclock_local refclock_local_stand_in
+#endif
+#ifdef CLOCK_MODEM
+STAND_IN(refclock_modem, "MODEM");
+#define refclock_modem refclock_modem_stand_in
+#endif
+#ifdef CLOCK_NMEA
+STAND_IN(refclock_nmea, "NMEA");
+#define refclock_nmea refclock_nmea_stand_in
+#endif
+#ifdef CLOCK_ONCORE
+STAND_IN(refclock_oncore, "ONCORE");
+#define refclock_oncore refclock_oncore_stand_in
+#endif
+#ifdef CLOCK_PHC
+STAND_IN(refclock_phc, "PHC");
+#define refclock_phc refclock_phc_stand_in
+#endif
+#if defined(CLOCK_PPS) && defined(HAVE_PPSAPI)
+STAND_IN(refclock_pps, "PPS");
+#define refclock_pps refclock_pps_stand_in
+#endif
+#ifdef CLOCK_SPECTRACOM
+STAND_IN(refclock_spectracom, "SPECTRACOM");
+#define refclock_spectracom refclock_spectracom_stand_in
+#endif
+#ifdef CLOCK_TRUETIME
+STAND_IN(refclock_true, "TRUETIME");
+#define refclock_true refclock_true_stand_in
+#endif
+#ifdef CLOCK_SHM
+STAND_IN(refclock_shm, "SHM");
+#define refclock_shm refclock_shm_stand_in
+#endif
+#ifdef CLOCK_TRIMBLE
+STAND_IN(refclock_trimble, "TRIMBLE");
+#define refclock_trimble refclock_trimble_stand_in
+#endif
+#ifdef CLOCK_ZYFER
+STAND_IN(refclock_zyfer, "ZYFER");
+#define refclock_zyfer refclock_zyfer_stand_in
+#endif
+
+static const struct refclock_module {
+	const char *	file;		/* refclock_<file>.so */
+	const char *	symbol;		/* its struct refclock */
+	struct refclock *stand_in;
+} refclock_modules[] = {
+#ifdef CLOCK_ARBITER
+	{ "arbiter",	"refclock_arbiter",	&refclock_arbiter },
+#endif
+#ifdef CLOCK_GENERIC
+	{ "generic",	"refclock_parse",	&refclock_parse },
+#endif
+#ifdef CLOCK_GPSDJSON
+	{ "gpsd",	"refclock_gpsdjson",	&refclock_gpsdjson },
+#endif
+#ifdef CLOCK_HPGPS
+	{ "hpgps",	"refclock_hpgps",	&refclock_hpgps },
+#endif
+#ifdef CLOCK_JJY
+	{ "jjy",	"refclock_jjy",	&refclock_jjy },
+#endif
+#ifdef CLOCK_LOCAL
+	{ "local",	"refclock_local",	&refclock_local },
+#endif
+#ifdef CLOCK_MODEM
+	{ "modem",	"refclock_modem",	&refclock_modem },
+#endif
+#ifdef CLOCK_NMEA
+	{ "nmea",	"refclock_nmea",	&refclock_nmea },
+#endif
+#ifdef CLOCK_ONCORE
+	{ "oncore",	"refclock_oncore",	&refclock_oncore },
+#endif
+#ifdef CLOCK_PHC
+	{ "phc",	"refclock_phc",	&refclock_phc },
+#endif
+#if defined(CLOCK_PPS) && defined(HAVE_PPSAPI)
+	{ "pps",	"refclock_pps",	&refclock_pps },
+#endif
+#ifdef CLOCK_SPECTRACOM
+	{ "spectracom",	"refclock_spectracom",	&refclock_spectracom },
+#endif
+#ifdef CLOCK_TRUETIME
+	{ "truetime",	"refclock_true",	&refclock_true },
+#endif
+#ifdef CLOCK_SHM
+	{ "shm",	"refclock_shm",	&refclock_shm },
+#endif
+#ifdef CLOCK_TRIMBLE
+	{ "trimble",	"refclock_trimble",	&refclock_trimble },
+#endif
+#ifdef CLOCK_ZYFER
+	{ "zyfer",	"refclock_zyfer",	&refclock_zyfer },
+#endif
+};
+#endif /* REFCLOCK_MODULES */
+
 /*
  * This is the only place in the code that knows about the mapping between
  * old-style numeric driver types and the drivers.
@@ -80,7 +219,53 @@ struct refclock * const refclock_conf[] = {
 	&refclock_none,		/* 43 was: REFCLK_RIPENCC */
 	&refclock_none,		/* 44 was: REFCLK_NEOCLOCK4X */
 	&refclock_none, 	/* 45 was: REFCLK_TSYNCPCI */
-	&refclock_gpsdjson	/* 46 REFCLK_GPSDJSON */
+	&refclock_gpsdjson,	/* 46 REFCLK_GPSDJSON */
+	&refclock_phc		/* 47 REFCLK_PHC */
 };
 
 const uint8_t num_refclock_conf = sizeof(refclock_conf)/sizeof(struct refclock *);
+
+#ifdef REFCLOCK_MODULES
+/*
+ * refclock_load - if clktype's driver is a module not yet loaded, load
+ * it.  Failures are logged; the caller finds clock_start still NULL.
+ */
+void
+refclock_load(
+	uint8_t	clktype
+	)
+{
+	const struct refclock_module *m;
+	const struct refclock *conf;
+	char	path[PATH_MAX];
+	void *	handle;
+
+	if (clktype >= num_refclock_conf)
+		return;
+	for (m = refclock_modules; m < refclock_modules +
+	     COUNTOF(refclock_modules); m++)
+		if (m->stand_in == refclock_conf[clktype])
+			break;
+	if (m == refclock_modules + COUNTOF(refclock_modules) ||
+	    NULL != m->stand_in->clock_start)
+		return;		/* built in, unused or loaded */
+
+	snprintf(path, sizeof(path), "%s/refclock_%s.so",
+		 REFCLOCK_MODULE_DIR, m->file);
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (NULL == handle) {
+		msyslog(LOG_ERR, "REFCLOCK: %s", dlerror());
+		return;
+	}
+	conf = dlsym(handle, m->symbol);
+	if (NULL == conf || NULL == conf->clock_start) {
+		msyslog(LOG_ERR, "REFCLOCK: %s: no driver %s", path,
+			m->symbol);
+		dlclose(handle);
+		return;
+	}
+	/* for good: the driver's code stays mapped for ntpd's life */
+	*m->stand_in = *conf;
+	msyslog(LOG_INFO, "REFCLOCK: loaded %s", path);
+}
+#endif /* REFCLOCK_MODULES */
@@ -145,6 +145,7 @@ struct	refclock refclock_parse = {
 	parse_control,       		/* control settings */
 	NULL,				/* init */
 	NULL,				/* timer */
+	NULL				/* fast loop reading - not used */
 };
 
 /*
@@ -1892,27 +1893,26 @@ local_input(
 			}
 			if (count)
 			{	/* simulate receive */
-// FIXME - this copy is no longer needed
-// This code is the result of a simple fix for SINGLEBUFFER
-// The copy used to go to add_full_recv_buffer, but that's not needed anymore
-// I'm not sure the local_receive below is correct
-// Hal, 2018-Sep-21
-				buf = get_free_recv_buffer();
-				if (buf != NULL) {
-					memmove((void *)buf->recv_buffer,
-						(void *)&parse->parseio.parse_dtime,
-						sizeof(parsetime_t));
-					buf->recv_length  = sizeof(parsetime_t);
-					buf->recv_time    = rbufp->recv_time;
-					buf->recv_srcadr  = rbufp->recv_srcadr;
-					buf->dstadr       = rbufp->dstadr;
-					buf->fd           = rbufp->fd;
-					buf->recv_peer    = rbufp->recv_peer;
-					parse->generic->io.recvcount++;
-					inc_received_count();
-					local_receive(buf);
-					freerecvbuf(buf);
-				}
+				/*
+				 * rbufp still holds unread input, so the
+				 * sample goes up in a buffer of our own
+				 * rather than one from the network's pool.
+				 */
+				static struct recvbuf simbuf;
+
+				buf = &simbuf;
+				memmove((void *)buf->recv_buffer,
+					(void *)&parse->parseio.parse_dtime,
+					sizeof(parsetime_t));
+				buf->recv_length  = sizeof(parsetime_t);
+				buf->recv_time    = rbufp->recv_time;
+				buf->recv_srcadr  = rbufp->recv_srcadr;
+				buf->dstadr       = rbufp->dstadr;
+				buf->fd           = rbufp->fd;
+				buf->recv_peer    = rbufp->recv_peer;
+				parse->generic->io.recvcount++;
+				inc_received_count();
+				local_receive(buf);
 				parse_iodone(&parse->parseio);
 			}
 			else
@@ -2825,9 +2825,10 @@ parse_start(
 
 	if (!PARSE_SETFMT(parse, &tmp_ctl))
 	{
+		/* formats left out with --parse-clocks aren't there */
 		msyslog(LOG_ERR,
-                    "REFCLOCK: PARSE receiver #%u: parse_start: parse_setfmt() FAILED.",
-                    unit);
+                    "REFCLOCK: PARSE receiver #%u: parse_start: parse_setfmt(\"%s\") FAILED.",
+                    unit, parse->parse_type->cl_format);
 		parse_shutdown(peer->procptr);	/* let our cleaning staff do the work */
 		return false;			/* well, ok - special initialisation broke */
 	}
@@ -4275,13 +4276,17 @@ gps16x_message(
 	       struct parseunit *parse,
 	       parsetime_t      *parsetime
 	       )
-{}
+{
+	UNUSED_ARG(parse);
+	UNUSED_ARG(parsetime);
+}
 
 static bool
 gps16x_poll_init(
 	struct parseunit *parse
 	)
 {
+	UNUSED_ARG(parse);
 	return true;
 }
 #endif /* CLOCK_MEINBERG */
@@ -31,6 +31,14 @@
  * GPSD; it also ensures that data is transmitted and evaluated only
  * once on the side of NTPD.
  *
+ * All primary units share one connection to GPSD. GPSD keeps a single
+ * device filter per client, so with one unit the connection watches
+ * that unit's device, and with more it watches every device and each
+ * record goes to the unit whose device it names; records for devices
+ * no unit uses are dropped after reading their class and device.
+ * Adding or removing a unit while connected drops the connection, so
+ * the next one is made with the right watch.
+ *
  * ---------------------------------------------------------------------
  *
  * trouble shooting hints:
@@ -64,36 +72,6 @@
 #include "ntp_types.h"
 #include "ntp_debug.h"
 
-/* =====================================================================
- * Get the little JSMN library directly into our guts. Use the 'parent
- * link' feature for maximum speed.
- */
-#define JSMN_STATIC
-#define JSMN_PARENT_LINKS
-#include "jsmn.h"
-
-/* =====================================================================
- * JSON parsing stuff
- */
-
-#define JSMN_MAXTOK	350
-#define INVALID_TOKEN (-1)
-
-typedef struct json_ctx {
-	char        * buf;
-	int           ntok;
-	jsmntok_t     tok[JSMN_MAXTOK];
-} json_ctx;
-
-typedef int tok_ref;
-
-/* We roll our own integer number parser.
- */
-typedef signed   long int json_int;
-typedef unsigned long int json_uint;
-#define JSON_INT_MAX LONG_MAX
-#define JSON_INT_MIN LONG_MIN
-
 /* =====================================================================
  * header stuff we need
  */
@@ -106,6 +84,7 @@ typedef unsigned long int json_uint;
 #include <math.h>
 
 #include <sys/types.h>
+#include <sys/shm.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <netinet/tcp.h>
@@ -118,6 +97,7 @@ typedef unsigned long int json_uint;
 #include "ntp_stdlib.h"
 #include "ntp_calendar.h"
 #include "timespecops.h"
+#include "json_scan.h"
 
 /* get operation modes from mode word.
 
@@ -155,6 +135,15 @@ typedef unsigned long int json_uint;
 #define MODE_OP_MAXVAL 2
 #define MODE_OP_MODE(x)		((x) & MODE_OP_MASK)
 
+/* With the SHM bit set, a unit takes its time stamps from the NTP SHM
+ * segments GPSD writes instead of from TOFF and PPS records: segment 2u
+ * for the in-band time and 2u+1 for the pulse, which is how GPSD
+ * numbers them when it runs as root and activates the devices in unit
+ * order. The JSON stream then only carries VERSION, WATCH and the fix
+ * status in TPV.
+ */
+#define MODE_SHM	0x04
+
 #define	PRECISION	(-9)	/* precision assumed (about 2 ms) */
 #define	PPS_PRECISION	(-20)	/* precision assumed (about 1 us) */
 #define	REFID		"GPSD"	/* reference id */
@@ -231,7 +220,8 @@ struct refclock refclock_gpsdjson = {
 	gpsd_poll,		/* transmit poll message */
 	gpsd_control,		/* fudge and option control */
 	gpsd_init,		/* initialize driver */
-	gpsd_timer		/* called once per second */
+	gpsd_timer,		/* called once per second */
+	NULL			/* fast loop reading - not used */
 };
 
 /* =====================================================================
@@ -246,7 +236,8 @@ struct gpsd_unit {
 	gpsd_unitT *next_unit;
 	size_t      refcount;
 
-	/* data for the secondary PPS channel */
+	/* peers of the primary and the secondary PPS channel, or NULL */
+	peerT      *peer;
 	peerT      *pps_peer;
 
 	/* unit and operation modes */
@@ -255,9 +246,6 @@ struct gpsd_unit {
 	char    *logname;	/* cached name for log/print */
 	char    *device;	/* device name of unit */
 
-	/* current line protocol version */
-	uint32_t proto_version;
-
 	/* PPS time stamps primary + secondary channel */
 	l_fp pps_local;	/* when we received the PPS message */
 	l_fp pps_stamp;	/* related reference time */
@@ -287,17 +275,14 @@ struct gpsd_unit {
 	bool fl_pps   : true;	/* valid pulse seen */
 	bool fl_pps2  : true;	/* valid pulse seen for PPS channel */
 	bool fl_rawibt: true;	/* permit raw TPV/TOFF time stamps */
-	bool fl_vers  : true;	/* have protocol version */
-	bool fl_watch : true;	/* watch reply seen */
 	/* protocol flags */
 	bool pf_nsec  : true;	/* have nanosec PPS info */
 	bool pf_toff  : true;	/* have TOFF record for timing */
+	bool pf_shm   : true;	/* timing from SHM, not TOFF/PPS */
 
-	/* admin stuff for sockets and device selection */
-	int         fdt;	/* current connecting socket */
-	addrinfoT * addr;	/* next address to try */
-	unsigned int       tickover;	/* timeout countdown */
-	unsigned int       tickpres;	/* timeout preset */
+	/* SHM segments for IBT and PPS, attached on first use */
+	struct shmTime *shm_ibt;
+	struct shmTime *shm_pps;
 
 	/* tallies for the various events */
 	unsigned int       tc_recv;	/* received known records */
@@ -307,31 +292,52 @@ struct gpsd_unit {
 	unsigned int       tc_ibt_used;/* used        --^-- */
 	unsigned int       tc_pps_recv;/* received PPS timing info records */
 	unsigned int       tc_pps_used;/* used        --^-- */
+};
+
+/* =====================================================================
+ * the connection to GPSD, shared by all units
+ */
+typedef struct gpsd_conn {
+	/* I/O registration; srcclock is the peer of any primary unit */
+	struct refclockio io;
+
+	/* admin stuff for sockets */
+	int         fdt;	/* current connecting socket */
+	addrinfoT * addr;	/* next address to try */
+	unsigned int       tickover;	/* timeout countdown */
+	unsigned int       tickpres;	/* timeout preset */
+	uptime_t    lasttick;	/* second the timer last ran */
+	int         nunits;	/* primary units started */
+
+	/* current line protocol version */
+	uint32_t proto_version;
+	bool fl_vers  : true;	/* have protocol version */
+	bool fl_watch : true;	/* watch reply seen */
 
 	/* log bloat throttle */
 	unsigned int       logthrottle;/* seconds to next log slot */
 
-	/* The parse context for the current record */
-	json_ctx    json_parse;
-
 	/* record assembly buffer and saved length */
 	int  buflen;
 	char buffer[MAX_PDU_LEN];
-};
+} gpsd_connT;
 
 /* =====================================================================
  * static local helpers forward decls
  */
-static void gpsd_init_socket(peerT * const peer);
-static void gpsd_test_socket(peerT * const peer);
-static void gpsd_stop_socket(peerT * const peer);
-
-static void gpsd_parse(peerT * const peer,
-		       const l_fp  * const rtime);
+static void gpsd_init_socket(void);
+static void gpsd_test_socket(void);
+static void gpsd_stop_socket(void);
+
+static void gpsd_parse(const l_fp  * const rtime);
+static void gpsd_eval(peerT * const peer, clockprocT * const pp,
+		      gpsd_unitT * const up);
+static void pps_stamps(clockprocT * const pp, gpsd_unitT * const up);
 static bool convert_ascii_time(l_fp * fp, const char * gps_time);
 static void save_ltc(clockprocT * const pp, const char * const tc);
-static bool syslogok(clockprocT * const pp, gpsd_unitT * const up);
-static void log_data(peerT *peer, const char *what,
+static bool conn_syslogok(void);
+static void conn_units_changed(void);
+static void log_data(const char *name, const char *what,
 		     const char *buf, size_t len);
 static int16_t clamped_precision(int rawprec);
 
@@ -350,6 +356,14 @@ static const char * const s_req_watch[2] = {
 	"?WATCH={\"device\":\"%s\",\"enable\":true,\"json\":true,\"pps\":true};\r\n"
 };
 
+/* ... and the same for all devices, when more than one unit shares the
+ * connection.
+ */
+static const char * const s_req_watch_all[2] = {
+	"?WATCH={\"enable\":true,\"json\":true};\r\n",
+	"?WATCH={\"enable\":true,\"json\":true,\"pps\":true};\r\n"
+};
+
 static const char * const s_req_version =
     "?VERSION;\r\n";
 
@@ -366,6 +380,10 @@ static const char * const s_req_version =
  */
 static addrinfoT  *s_gpsd_addr;
 static gpsd_unitT *s_clock_units;
+static gpsd_connT  s_conn = {
+	.io.fd = -1, .io.clock_recv = gpsd_receive,
+	.fdt = -1, .tickpres = TICKOVER_LOW
+};
 
 /* list of service/socket names we want to resolve against */
 static const char * const s_svctab[][2] = {
@@ -384,16 +402,22 @@ static int s_svcidx;
 /* =====================================================================
  * log throttling
  */
+/* The messages are about the connection, and flag3 on any primary unit
+ * lets them all through.
+ */
 static bool
-syslogok(
-	clockprocT * const pp,
-	gpsd_unitT * const up)
+conn_syslogok(void)
 {
-	int res = (0 != (pp->sloppyclockflag & CLK_FLAG3))
-	       || (0           == up->logthrottle )
-	       || (LOGTHROTTLE == up->logthrottle );
+	gpsd_unitT * up;
+	bool res = (0           == s_conn.logthrottle )
+		|| (LOGTHROTTLE == s_conn.logthrottle );
+
+	for (up = s_clock_units; up != NULL && !res; up = up->next_unit)
+		if (up->peer != NULL &&
+		    (up->peer->procptr->sloppyclockflag & CLK_FLAG3))
+			res = true;
 	if (res)
-		up->logthrottle = LOGTHROTTLE;
+		s_conn.logthrottle = LOGTHROTTLE;
 	return res;
 }
 
@@ -499,9 +523,6 @@ gpsd_start(
 		pp->clockname     = NAME; /* Hack, needed by refclock_name */
 		up->logname  = estrdup(refclock_name(peer));
 		up->unit     = unit & 0x7F;
-		up->fdt      = -1;
-		up->addr     = s_gpsd_addr;
-		up->tickpres = TICKOVER_LOW;
 
 		/* Create the device name and check for a Character
 		 * Device. It's assumed that GPSD was started with the
@@ -533,12 +554,9 @@ gpsd_start(
 		++up->refcount;
 	}
 
-	/* setup refclock processing */
+	/* setup refclock processing; the I/O is the connection's */
 	pp->unitptr       = (void *)up;
 	pp->io.fd         = -1;
-	pp->io.clock_recv = gpsd_receive;
-	pp->io.srcclock   = peer;
-	pp->io.datalen    = 0;
 	pp->a_lastcode[0] = '\0';
 	pp->lencode       = 0;
 	pp->clockname     = NAME;
@@ -553,7 +571,7 @@ gpsd_start(
 		peer->precision = PRECISION;
 
 	/* If the daemon name lookup failed, just give up now. */
-	if (NULL == up->addr) {
+	if (NULL == s_gpsd_addr) {
 		msyslog(LOG_ERR,
 			"REFCLOCK: %s: no GPSD socket address, giving up",
 			up->logname);
@@ -570,6 +588,11 @@ gpsd_start(
 	if (unit >= 128) {
 		up->pps_peer = peer;
 	} else {
+		up->peer = peer;
+		up->pf_shm  = (peer->cfg.mode & MODE_SHM) != 0;
+		up->pf_toff = up->pf_shm;
+		++s_conn.nunits;
+		conn_units_changed();
 		enter_opmode(peer, up->mode);
 	}
 	return true;
@@ -588,6 +611,34 @@ dev_fail:
 	return false;
 }
 
+/* ---------------------------------------------------------------------
+ * A primary unit came or went: the watch sent on the connection no
+ * longer fits, so drop it and let the timer make a new one.  The last
+ * unit to go closes it for good.
+ */
+static void
+conn_units_changed(void)
+{
+	gpsd_unitT * up;
+
+	if (-1 != s_conn.io.fd)
+		gpsd_stop_socket();
+	s_conn.fl_watch = false;
+	if (0 == s_conn.nunits) {
+		if (-1 != s_conn.fdt)
+			close(s_conn.fdt);
+		s_conn.fdt      = -1;
+		s_conn.tickover = 0;
+		s_conn.tickpres = TICKOVER_LOW;
+	}
+
+	/* received data is handed to us through any unit's peer */
+	for (up = s_clock_units;
+	     NULL == s_conn.io.srcclock && up != NULL;
+	     up = up->next_unit)
+		s_conn.io.srcclock = up->peer;
+}
+
 /* ------------------------------------------------------------------ */
 
 static void
@@ -602,20 +653,15 @@ gpsd_shutdown(
 		return;
 	}
 
-	if (up->pps_peer == NULL) {
-		/* This is NULL if no related PPS */
-		DPRINT(1, ("%s: pps_peer found NULL", up->logname));
-	} else if (pp != up->pps_peer->procptr) {
-		/* now check if we must close IO resources */
-		if (-1 != pp->io.fd) {
-			DPRINT(1, ("%s: closing clock, fd=%d\n",
-				   up->logname, pp->io.fd));
-			io_closeclock(&pp->io);
-			pp->io.fd = -1;
-		}
-		if (up->fdt != -1) {
-			close(up->fdt);
-		}
+	if (up->pps_peer != NULL && pp == up->pps_peer->procptr) {
+		up->pps_peer = NULL;
+	} else if (up->peer != NULL && pp == up->peer->procptr) {
+		/* leave the connection to the other units, if any */
+		if (s_conn.io.srcclock == up->peer)
+			s_conn.io.srcclock = NULL;
+		up->peer = NULL;
+		--s_conn.nunits;
+		conn_units_changed();
 	}
 	/* decrement use count and eventually remove this unit. */
 	if (!--up->refcount) {
@@ -627,6 +673,10 @@ gpsd_shutdown(
 				uscan = &(*uscan)->next_unit;
 			}
 		}
+		if (NULL != up->shm_ibt)
+			(void)shmdt((char *)up->shm_ibt);
+		if (NULL != up->shm_pps)
+			(void)shmdt((char *)up->shm_pps);
 		free(up->logname);
 		free(up->device);
 		free(up);
@@ -642,16 +692,11 @@ static void
 gpsd_receive(
 	struct recvbuf * rbufp)
 {
-	/* declare & init control structure ptrs */
-	peerT	   * const peer = rbufp->recv_peer;
-	clockprocT * const pp   = peer->procptr;
-	gpsd_unitT * const up   = (gpsd_unitT *)pp->unitptr;
-
 	const char *psrc, *esrc;
 	char       *pdst, *edst, ch;
 
 	/* log the data stream, if this is enabled */
-	log_data(peer, "recv", (const char*)rbufp->recv_buffer,
+	log_data("GPSD_JSON", "recv", (const char*)rbufp->recv_buffer,
 		 (size_t)rbufp->recv_length);
 
 
@@ -665,30 +710,30 @@ gpsd_receive(
 	psrc = (const char*)rbufp->recv_buffer;
 	esrc = psrc + rbufp->recv_length;
 
-	pdst = up->buffer + up->buflen;
-	edst = pdst + sizeof(up->buffer) - 1; /* for trailing NUL */
+	pdst = s_conn.buffer + s_conn.buflen;
+	edst = s_conn.buffer + sizeof(s_conn.buffer) - 1; /* for NUL */
 
 	while (psrc < esrc) {
 		ch = *psrc++;
 		if (ch == '\n') {
 			/* trim trailing whitespace & terminate buffer */
-			while (pdst != up->buffer && pdst[-1] <= ' ') {
+			while (pdst != s_conn.buffer && pdst[-1] <= ' ') {
 				--pdst;
 			}
 			*pdst = '\0';
 			/* process data and reset buffer */
-			up->buflen = (int)(pdst - up->buffer);
-			gpsd_parse(peer, &rbufp->recv_time);
-			pdst = up->buffer;
+			s_conn.buflen = (int)(pdst - s_conn.buffer);
+			gpsd_parse(&rbufp->recv_time);
+			pdst = s_conn.buffer;
 		} else if (pdst < edst) {
 			/* add next char, ignoring leading whitespace */
-			if (ch > ' ' || pdst != up->buffer) {
+			if (ch > ' ' || pdst != s_conn.buffer) {
 				*pdst++ = ch;
 			}
 		}
 	}
-	up->buflen = (int)(pdst - up->buffer);
-	up->tickover = TICKOVER_LOW;
+	s_conn.buflen = (int)(pdst - s_conn.buffer);
+	s_conn.tickover = TICKOVER_LOW;
 }
 
 /* ------------------------------------------------------------------ */
@@ -711,7 +756,7 @@ poll_primary(
 		 * cause, and everything else is just a timeout.
 		 */
 		peer->precision = PRECISION;
-		if (-1 == pp->io.fd)
+		if (-1 == s_conn.io.fd)
 			refclock_report(peer, CEVNT_FAULT);
 		else if (0 != up->tc_breply)
 			refclock_report(peer, CEVNT_BADREPLY);
@@ -810,10 +855,7 @@ gpsd_control(
 /* ------------------------------------------------------------------ */
 
 static void
-timer_primary(
-	peerT      * const peer ,
-	clockprocT * const pp   ,
-	gpsd_unitT * const up   )
+timer_conn(void)
 {
 	int rc;
 
@@ -824,45 +866,116 @@ timer_primary(
 	 *
 	 * Note that the timer stays at zero here, unless some of the
 	 * functions set it to another value.
+	 *
+	 * Every primary unit's timer calls this; only the first call
+	 * in a second does anything.
 	 */
-	if (up->logthrottle) {
-		--up->logthrottle;
+	if (s_conn.lasttick == current_time) {
+		return;
+	}
+	s_conn.lasttick = current_time;
+	if (s_conn.logthrottle) {
+		--s_conn.logthrottle;
 	}
-	if (up->tickover) {
-		--up->tickover;
+	if (s_conn.tickover) {
+		--s_conn.tickover;
 	}
-	switch (up->tickover) {
+	switch (s_conn.tickover) {
 	case 4:
 		/* If we are connected to GPSD, try to get a live signal
 		 * by querying the version. Otherwise just check the
 		 * socket to become ready.
 		 */
-		if (-1 != pp->io.fd) {
+		if (-1 != s_conn.io.fd) {
 			size_t rlen = strlen(s_req_version);
-			DPRINT(2, ("%s: timer livecheck: '%s'\n",
-				   up->logname, s_req_version));
-			log_data(peer, "send", s_req_version, rlen);
-			rc = write(pp->io.fd, s_req_version, rlen);
+			DPRINT(2, ("GPSD_JSON: timer livecheck: '%s'\n",
+				   s_req_version));
+			log_data("GPSD_JSON", "send", s_req_version, rlen);
+			rc = write(s_conn.io.fd, s_req_version, rlen);
 			(void)rc;
-		} else if (-1 != up->fdt) {
-			gpsd_test_socket(peer);
+		} else if (-1 != s_conn.fdt) {
+			gpsd_test_socket();
 		}
 		break;
 
 	case 0:
-		if (-1 != pp->io.fd)
-			gpsd_stop_socket(peer);
-		else if (-1 != up->fdt) {
-			gpsd_test_socket(peer);
+		if (-1 != s_conn.io.fd)
+			gpsd_stop_socket();
+		else if (-1 != s_conn.fdt) {
+			gpsd_test_socket();
 		} else if (NULL != s_gpsd_addr) {
-			gpsd_init_socket(peer);
+			gpsd_init_socket();
 		}
 		break;
 
 	default:
-		if (-1 == pp->io.fd && -1 != up->fdt)
-			gpsd_test_socket(peer);
+		if (-1 == s_conn.io.fd && -1 != s_conn.fdt)
+			gpsd_test_socket();
+	}
+}
+
+/* In SHM mode, take this second's samples from GPSD's segments. The
+ * TPV records still say whether there is a fix.
+ */
+static void
+timer_shm(
+	peerT      * const peer ,
+	clockprocT * const pp   ,
+	gpsd_unitT * const up   )
+{
+	struct shm_stat_t st;
+	int seg = 2 * up->unit;
+
+	if (NULL == up->shm_ibt)
+		up->shm_ibt = refclock_shm_attach(seg, seg >= 2);
+	if (NULL == up->shm_pps)
+		up->shm_pps = refclock_shm_attach(seg + 1, seg >= 2);
+
+	switch (refclock_shm_query(up->shm_ibt, &st)) {
+	case SHM_OK:
+		++up->tc_ibt_recv;
+		if (up->fl_nosync)
+			break;
+		up->ibt_stamp = tspec_stamp_to_lfp(st.tvt);
+		up->ibt_local = tspec_stamp_to_lfp(st.tvr);
+		up->ibt_recvt = up->ibt_local;
+		up->ibt_recvt -= up->ibt_fudge;
+		up->ibt_prec  = clamped_precision(st.precision);
+		up->fl_ibt    = true;
+		save_ltc(pp, prettydate(up->ibt_stamp));
+		break;
+	case SHM_BAD_MODE:
+	case SHM_CLASH:
+		++up->tc_breply;
+		break;
+	case SHM_NO_SEGMENT:	/* GPSD isn't there yet */
+	case SHM_NOT_READY:	/* or has nothing new this second */
+	default:
+		break;
+	}
+
+	switch (refclock_shm_query(up->shm_pps, &st)) {
+	case SHM_OK:
+		++up->tc_pps_recv;
+		if (up->fl_nosync)
+			break;
+		up->pps_stamp2 = tspec_stamp_to_lfp(st.tvt);
+		up->pps_recvt2 = tspec_stamp_to_lfp(st.tvr);
+		up->pps_local  = up->pps_recvt2;
+		up->pps_prec   = clamped_precision(st.precision);
+		pps_stamps(pp, up);
+		break;
+	case SHM_BAD_MODE:
+	case SHM_CLASH:
+		++up->tc_breply;
+		break;
+	case SHM_NO_SEGMENT:
+	case SHM_NOT_READY:
+	default:
+		break;
 	}
+
+	gpsd_eval(peer, pp, up);
 }
 
 static void
@@ -897,7 +1010,9 @@ gpsd_timer(
 	if (peer == up->pps_peer) {
 		timer_secondary(peer, pp, up);
 	} else {
-		timer_primary(peer, pp, up);
+		timer_conn();
+		if (up->pf_shm)
+			timer_shm(peer, pp, up);
 	}
 }
 
@@ -1071,429 +1186,148 @@ eval_auto(
 
 /* =====================================================================
  * JSON parsing stuff
+ *
+ * A record is scanned once for its class, which GPSD puts first, and
+ * once more for just the members its handler reads; everything else in
+ * it is stepped over unread.  Records we have no handler for, like the
+ * bulky SKY, go no further than the class.
  */
 
-/* ------------------------------------------------------------------ */
-/* Parse a decimal integer with a possible sign. Works like 'strtoll()'
- * or 'strtol()', but with a fixed base of 10 and without eating away
- * leading whitespace. For the error codes, the handling of the end
- * pointer and the return values see 'strtol()'.
- */
-static json_int
-strtojint(
-	const char *cp, char **ep)
-{
-	json_uint     accu, limit_lo, limit_hi;
-	int           flags; /* bit 0: overflow; bit 1: sign */
-	const char  * hold;
-
-	/* pointer union to circumvent a tricky/sticky const issue */
-	union {	const char * c; char * v; } vep;
-
-	/* store initial value of 'cp' -- see 'strtol()' */
-	vep.c = cp;
-
-	/* Eat away an optional sign and set the limits accordingly: The
-	 * high limit is the maximum absolute value that can be returned,
-	 * and the low limit is the biggest value that does not cause an
-	 * overflow when multiplied with 10. Avoid negation overflows.
-	 */
-	if (*cp == '-') {
-		cp += 1;
-		flags    = 2;
-		limit_hi = (json_uint)-(JSON_INT_MIN + 1) + 1;
-	} else {
-		cp += (*cp == '+');
-		flags    = 0;
-		limit_hi = (json_uint)JSON_INT_MAX;
-	}
-	limit_lo = limit_hi / 10;
-
-	/* Now try to convert a sequence of digits. */
-	hold = cp;
-	accu = 0;
-	while (isdigit(*(const unsigned char*)cp)) {
-	    flags |= (accu > limit_lo);
-	    accu = accu * 10 + (json_uint)(*(const unsigned char*)cp++ - '0');
-	    flags |= (accu > limit_hi);
-	}
-	/* Check for empty conversion (no digits seen). */
-	if (hold != cp) {
-		vep.c = cp;
-	} else {
-		errno = EINVAL;	/* accu is still zero */
-	}
-	/* Check for range overflow */
-	if (flags & 1) {
-		errno = ERANGE;
-		accu  = limit_hi;
-	}
-	/* If possible, store back the end-of-conversion pointer */
-	if (ep) {
-		*ep = vep.v;
-	}
-	/* If negative, return the negated result if the accu is not
-	 * zero. Avoid negation overflows.
-	 */
-	if ((flags & 2) && accu) {
-		return -(json_int)(accu - 1) - 1;
-	} else {
-		return (json_int)accu;
-	}
-}
-
-/* ------------------------------------------------------------------ */
-
-static tok_ref
-json_token_skip(
-	const json_ctx * ctx,
-	tok_ref          tid)
-{
-	if (tid >= 0 && tid < ctx->ntok) {
-		int len = ctx->tok[tid].size;
-		/* For arrays and objects, the size is the number of
-		 * ITEMS in the compound. That's the number of objects in
-		 * the array, and the number of key/value pairs for
-		 * objects. In theory, the key must be a string, and we
-		 * could simply skip one token before skipping the
-		 * value, which can be anything. We're a bit paranoid
-		 * and lazy at the same time: We simply double the
-		 * number of tokens to skip and fall through into the
-		 * array processing when encountering an object.
-		 */
-		switch (ctx->tok[tid].type) {
-		case JSMN_OBJECT:
-			len *= 2;
-			/* FALLTHROUGH */
-		case JSMN_ARRAY:
-			for (++tid; len; --len)
-				tid = json_token_skip(ctx, tid);
-			break;
-
-                case JSMN_PRIMITIVE:
-                case JSMN_STRING:
-                case JSMN_UNDEFINED:
-		default:
-			++tid;
-			break;
-		}
-		if (tid > ctx->ntok) { /* Impossible? Paranoia rulez. */
-			tid = ctx->ntok;
-		}
-	}
-	return tid;
-}
-
-/* ------------------------------------------------------------------ */
-
-static int
-json_object_lookup(
-	const json_ctx * ctx ,
-	tok_ref          tid ,
-	const char     * key ,
-	int              what)
-{
-	int len;
-
-	if (tid < 0 || tid >= ctx->ntok ||
-	    ctx->tok[tid].type != JSMN_OBJECT)
-		return INVALID_TOKEN;
-
-	len = ctx->tok[tid].size;
-	for (++tid; len && tid+1 < ctx->ntok; --len) {
-		if (ctx->tok[tid].type != JSMN_STRING) { /* Blooper! */
-			tid = json_token_skip(ctx, tid); /* skip key */
-			tid = json_token_skip(ctx, tid); /* skip val */
-		} else if (strcmp(key, ctx->buf + ctx->tok[tid].start)) {
-			tid = json_token_skip(ctx, tid+1); /* skip key+val */
-		} else if (what < 0 || what == (int)ctx->tok[tid+1].type) {
-			return tid + 1;
-		} else {
-			break;
-		}
-		/* if skipping ahead returned an error, bail out here. */
-		if (tid < 0) {
-			break;
-		}
-	}
-	return INVALID_TOKEN;
-}
-
-/* ------------------------------------------------------------------ */
-
-static const char*
-json_object_lookup_primitive(
-	const json_ctx * ctx,
-	tok_ref          tid,
-	const char     * key)
-{
-	tid = json_object_lookup(ctx, tid, key, JSMN_PRIMITIVE);
-	if (INVALID_TOKEN  != tid) {
-		return ctx->buf + ctx->tok[tid].start;
-	} else {
-		return NULL;
-	}
-}
-/* ------------------------------------------------------------------ */
-/* look up a boolean value. This essentially returns a tribool:
- * 0->false, 1->true, (-1)->error/undefined
- */
-static int
-json_object_lookup_bool(
-	const json_ctx * ctx,
-	tok_ref          tid,
-	const char     * key)
-{
-	const char *cp;
-	cp  = json_object_lookup_primitive(ctx, tid, key);
-	switch ( cp ? *cp : '\0') {
-	case 't': return  1;
-	case 'f': return  0;
-	default : return -1;
-	}
-}
-
-/* ------------------------------------------------------------------ */
-
-static const char*
-json_object_lookup_string(
-	const json_ctx * ctx,
-	tok_ref          tid,
-	const char     * key)
-{
-	tid = json_object_lookup(ctx, tid, key, JSMN_STRING);
-	if (INVALID_TOKEN != tid)
-		return ctx->buf + ctx->tok[tid].start;
-	return NULL;
-}
-
-static const char*
-json_object_lookup_string_default(
-	const json_ctx * ctx,
-	tok_ref          tid,
-	const char     * key,
-	const char     * def)
-{
-	tid = json_object_lookup(ctx, tid, key, JSMN_STRING);
-	if (INVALID_TOKEN != tid)
-		return ctx->buf + ctx->tok[tid].start;
-	return def;
-}
-
-/* ------------------------------------------------------------------ */
-
-static json_int
-json_object_lookup_int(
-	const json_ctx * ctx,
-	tok_ref          tid,
-	const char     * key)
-{
-	json_int     ret;
-	const char * cp;
-	char       * ep;
-
-	cp = json_object_lookup_primitive(ctx, tid, key);
-	if (NULL != cp) {
-		ret = strtojint(cp, &ep);
-		if (cp != ep && '\0' == *ep) {
-			return ret;
-		}
-	} else {
-		errno = EINVAL;
-	}
-	return 0;
-}
-
-static json_int
-json_object_lookup_int_default(
-	const json_ctx * ctx,
-	tok_ref          tid,
-	const char     * key,
-	json_int         def)
-{
-	json_int     ret;
-	const char * cp;
-	char       * ep;
-
-	cp = json_object_lookup_primitive(ctx, tid, key);
-	if (NULL != cp) {
-		ret = strtojint(cp, &ep);
-		if (cp != ep && '\0' == *ep) {
-			return ret;
-		}
-	}
-	return def;
-}
-
-/* ------------------------------------------------------------------ */
-
-static double
-json_object_lookup_float_default(
-	const json_ctx * ctx,
-	tok_ref          tid,
-	const char     * key,
-	double           def)
-{
-	double       ret;
-	const char * cp;
-	char       * ep;
-
-	cp = json_object_lookup_primitive(ctx, tid, key);
-	if (NULL != cp) {
-		ret = strtod(cp, &ep);
-		if (cp != ep && '\0' == *ep) {
-			return ret;
-		}
-	}
-	return def;
-}
-
-/* ------------------------------------------------------------------ */
-
-static bool
-json_parse_record(
-	json_ctx * ctx,
-	char     * buf,
-	size_t     len)
-{
-	jsmn_parser jsm;
-	int         idx, rc;
-
-	jsmn_init(&jsm);
-	rc = jsmn_parse(&jsm, buf, len, ctx->tok, JSMN_MAXTOK);
-	if (rc <= 0)
-		return false;
-	ctx->buf  = buf;
-	ctx->ntok = rc;
-
-	if (JSMN_OBJECT != ctx->tok[0].type)
-		return false; /* not object!?! */
-
-	/* Make all tokens NUL terminated by overwriting the
-	 * terminator symbol. Makes string compares and number parsing a
-	 * lot easier!
-	 */
-	for (idx = 0; idx < ctx->ntok; ++idx)
-		if (ctx->tok[idx].end > ctx->tok[idx].start)
-			ctx->buf[ctx->tok[idx].end] = '\0';
-	return true;
-}
-
+/* the most members any handler asks for */
+#define GPSD_MAXKEYS	7
 
 /* =====================================================================
  * static local helpers
  */
 static bool
 get_binary_time(
-	l_fp       * const dest     ,
-	json_ctx   * const jctx     ,
-	const char * const time_name,
-	const char * const frac_name,
-	long               fscale   )
+	l_fp             * const dest     ,
+	const json_value * const time_val ,
+	const json_value * const frac_val ,
+	long                     fscale   )
 {
-	bool            retv = false;
 	struct timespec ts;
+	long            secs, frac;
 
-	errno = 0;
-	ts.tv_sec  = (time_t)json_object_lookup_int(jctx, 0, time_name);
-	ts.tv_nsec = (long  )json_object_lookup_int(jctx, 0, frac_name);
-	if (0 == errno) {
-		ts.tv_nsec *= fscale;
-		*dest = tspec_stamp_to_lfp(ts);
-		retv  = true;
-	}
-	return retv;
+	if ( ! json_value_int(time_val, &secs) ||
+	     ! json_value_int(frac_val, &frac))
+		return false;
+	ts.tv_sec  = (time_t)secs;
+	ts.tv_nsec = frac * fscale;
+	*dest = tspec_stamp_to_lfp(ts);
+	return true;
 }
 
 /* ------------------------------------------------------------------ */
 /* Process a WATCH record
  *
  * Currently this is only used to recognise that the device is present
- * and that we're listed subscribers.
+ * and that we're listed subscribers. A watch of all devices has no
+ * device member.
  */
+enum { WATCH_DEVICE, WATCH_ENABLE, WATCH_JSON, WATCH_NKEYS };
+static const char * const s_watch_keys[WATCH_NKEYS] = {
+	"device", "enable", "json"
+};
+
 static void
 process_watch(
 	peerT      * const peer ,
-	json_ctx   * const jctx ,
+	json_value * const jval ,
 	const l_fp * const rtime)
 {
-	clockprocT * const pp = peer->procptr;
-	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
-
 	const char * path;
+	gpsd_unitT * up;
 
+	UNUSED_ARG(peer);
 	UNUSED_ARG(rtime);
 
-	path = json_object_lookup_string(jctx, 0, "device");
-	if (NULL == path || strcmp(path, up->device)) {
-		return;
+	path = json_value_string(&jval[WATCH_DEVICE]);
+	if (NULL != path) {
+		for (up = s_clock_units; up != NULL; up = up->next_unit)
+			if (NULL != up->peer && !strcmp(path, up->device))
+				break;
+		if (NULL == up)
+			return;
 	}
 
-	if (json_object_lookup_bool(jctx, 0, "enable") > 0 &&
-	    json_object_lookup_bool(jctx, 0, "json"  ) > 0  )
-		up->fl_watch = true;
+	if (json_value_bool(&jval[WATCH_ENABLE]) > 0 &&
+	    json_value_bool(&jval[WATCH_JSON  ]) > 0  )
+		s_conn.fl_watch = true;
 	else
-		up->fl_watch = false;
-	DPRINT(2, ("%s: process_watch, enabled=%d\n",
-		   up->logname, up->fl_watch));
+		s_conn.fl_watch = false;
+	DPRINT(2, ("GPSD_JSON: process_watch, enabled=%d\n",
+		   s_conn.fl_watch));
 }
 
 /* ------------------------------------------------------------------ */
 
+enum { VERSION_REV, VERSION_RELEASE, VERSION_MAJOR, VERSION_MINOR,
+       VERSION_NKEYS };
+static const char * const s_version_keys[VERSION_NKEYS] = {
+	"rev", "release", "proto_major", "proto_minor"
+};
+
 static void
 process_version(
 	peerT      * const peer ,
-	json_ctx   * const jctx ,
+	json_value * const jval ,
 	const l_fp * const rtime)
 {
-	clockprocT * const pp = peer->procptr;
-	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
-
+	gpsd_unitT * up;
 	size_t len;
 	ssize_t ret;
 	char * buf;
 	const char *revision;
 	const char *release;
-	uint16_t    pvhi, pvlo;
+	long        pvhi, pvlo;
+	bool        pf_toff;
+	bool        want_pps = false;
 
+	UNUSED_ARG(peer);
 	UNUSED_ARG(rtime);
 
 	/* get protocol version number */
-	revision = json_object_lookup_string_default(
-		jctx, 0, "rev", "(unknown)");
-	release  = json_object_lookup_string_default(
-		jctx, 0, "release", "(unknown)");
-	errno = 0;
-	pvhi = (uint16_t)json_object_lookup_int(jctx, 0, "proto_major");
-	pvlo = (uint16_t)json_object_lookup_int(jctx, 0, "proto_minor");
-
-	if (0 == errno) {
-		if ( ! up->fl_vers)
+	revision = json_value_string(&jval[VERSION_REV]);
+	if (NULL == revision)
+		revision = "(unknown)";
+	release  = json_value_string(&jval[VERSION_RELEASE]);
+	if (NULL == release)
+		release = "(unknown)";
+
+	if (json_value_int(&jval[VERSION_MAJOR], &pvhi) &&
+	    json_value_int(&jval[VERSION_MINOR], &pvlo)) {
+		if ( ! s_conn.fl_vers)
 			msyslog(LOG_INFO,
-				"REFCLOCK: %s: GPSD revision=%s release=%s "
-				"protocol=%u.%u",
-				up->logname, revision, release,
-				pvhi, pvlo);
-		up->proto_version = PROTO_VERSION(pvhi, pvlo);
-		up->fl_vers = true;
+				"REFCLOCK: GPSD_JSON: GPSD revision=%s "
+				"release=%s protocol=%ld.%ld",
+				revision, release, pvhi, pvlo);
+		s_conn.proto_version = PROTO_VERSION(pvhi, pvlo);
+		s_conn.fl_vers = true;
 	} else {
-		if (syslogok(pp, up))
+		if (conn_syslogok())
 			msyslog(LOG_INFO,
-				"REFCLOCK: %s: could not evaluate version data",
-				up->logname);
+				"REFCLOCK: GPSD_JSON: could not evaluate "
+				"version data");
 		return;
 	}
 	/* With the 3.9 GPSD protocol, '*_musec' vanished from the PPS
 	 * record and was replace by '*_nsec'.
-	 */
-	up->pf_nsec = up->proto_version >= PROTO_VERSION(3,9);
-
-	/* With the 3.10 protocol we can get TOFF records for better
+	 *
+	 * With the 3.10 protocol we can get TOFF records for better
 	 * timing information.
 	 */
-	up->pf_toff = up->proto_version >= PROTO_VERSION(3,10);
+	pf_toff = s_conn.proto_version >= PROTO_VERSION(3,10);
+	for (up = s_clock_units; up != NULL; up = up->next_unit) {
+		up->pf_nsec = s_conn.proto_version >= PROTO_VERSION(3,9);
+		up->pf_toff = pf_toff || up->pf_shm;
+		if (NULL != up->peer && !up->pf_shm)
+			want_pps = pf_toff;
+	}
 
-	/* request watch for our GPS device if not yet watched.
+	/* request watch for our GPS devices if not yet watched: just
+	 * the one device for a single unit, all of them otherwise.
+	 * Units in SHM mode need no PPS or TOFF records.
 	 *
 	 * The version string is also sent as a life signal, if we have
 	 * seen usable data. So if we're already watching the device,
@@ -1506,47 +1340,58 @@ process_version(
 	 * TCP/IP window size gets lower than the length of the
 	 * request. We handle that when it happens.)
 	 */
-	if (up->fl_watch)
+	if (s_conn.fl_watch || 0 == s_conn.nunits)
 		return;
 
-	snprintf(up->buffer, sizeof(up->buffer),
-		 s_req_watch[up->pf_toff], up->device);
-	buf = up->buffer;
+	if (1 == s_conn.nunits) {
+		for (up = s_clock_units; NULL == up->peer; up = up->next_unit)
+			continue;
+		snprintf(s_conn.buffer, sizeof(s_conn.buffer),
+			 s_req_watch[want_pps], up->device);
+	} else {
+		strlcpy(s_conn.buffer, s_req_watch_all[want_pps],
+			sizeof(s_conn.buffer));
+	}
+	buf = s_conn.buffer;
 	len = strlen(buf);
-	log_data(peer, "send", buf, len);
-	ret = write(pp->io.fd, buf, len);
-	if ( (ret < 0 || (size_t)ret != len) && (syslogok(pp, up))) {
+	log_data("GPSD_JSON", "send", buf, len);
+	ret = write(s_conn.io.fd, buf, len);
+	if ( (ret < 0 || (size_t)ret != len) && (conn_syslogok())) {
 		/* Note: if the server fails to read our request, the
 		 * resulting data timeout will take care of the
 		 * connection!
 		 */
 		msyslog(LOG_ERR,
-                        "REFCLOCK: %s: failed to write watch request (%s)",
-			up->logname, strerror(errno));
+                        "REFCLOCK: GPSD_JSON: failed to write watch request (%s)",
+			strerror(errno));
 	}
 }
 
 /* ------------------------------------------------------------------ */
 
+enum { TPV_MODE, TPV_TIME, TPV_EPT, TPV_NKEYS };
+static const char * const s_tpv_keys[TPV_NKEYS] = {
+	"mode", "time", "ept"
+};
+
 static void
 process_tpv(
 	peerT      * const peer ,
-	json_ctx   * const jctx ,
+	json_value * const jval ,
 	const l_fp * const rtime)
 {
 	clockprocT * const pp = peer->procptr;
 	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
 
 	const char * gps_time;
-	int          gps_mode;
+	long         gps_mode;
 	double       ept;
 	int          xlog2;
 
-	gps_mode = (int)json_object_lookup_int_default(
-		jctx, 0, "mode", 0);
+	if ( ! json_value_int(&jval[TPV_MODE], &gps_mode))
+		gps_mode = 0;
 
-	gps_time = json_object_lookup_string(
-		jctx, 0, "time");
+	gps_time = json_value_string(&jval[TPV_TIME]);
 
 	/* accept time stamps only in 2d or 3d fix */
 	if (gps_mode < 2 || NULL == gps_time) {
@@ -1571,7 +1416,7 @@ process_tpv(
 		/* now parse the time string */
 		if (convert_ascii_time(&up->ibt_stamp, gps_time)) {
 			DPRINT(2, ("%s: process_tpv, stamp='%s',"
-				   " recvt='%s' mode=%d\n",
+				   " recvt='%s' mode=%ld\n",
 				   up->logname,
 				   prettydate(up->ibt_stamp),
 				   prettydate(up->ibt_recvt),
@@ -1598,7 +1443,8 @@ process_tpv(
 	 * precision estimation, since it gets the proper value directly
 	 * from GPSD!)
 	 */
-	ept = json_object_lookup_float_default(jctx, 0, "ept", 2.0e-3);
+	if ( ! json_value_float(&jval[TPV_EPT], &ept))
+		ept = 2.0e-3;
 	ept = frexp(fabs(ept)*0.70710678, &xlog2); /* ~ sqrt(0.5) */
 	if (ept < 0.25)
 		xlog2 = INT_MIN;
@@ -1609,16 +1455,60 @@ process_tpv(
 
 /* ------------------------------------------------------------------ */
 
+/* Take a pulse whose time GPSD measured as pps_recvt2 and whose GPS
+ * time is pps_stamp2, and set the primary unit's time stamps from it.
+ */
+static void
+pps_stamps(
+	clockprocT * const pp,
+	gpsd_unitT * const up)
+{
+	/* Get fudged receive times for primary & secondary unit */
+	up->pps_recvt = up->pps_recvt2;
+	up->pps_recvt -= up->pps_fudge;
+	up->pps_recvt2 -= up->pps_fudge2;
+	pp->lastrec = up->pps_recvt;
+
+	/* Map to nearest full second as reference time stamp for the
+	 * primary channel. Sanity checks are done in evaluation step.
+	 */
+	up->pps_stamp = up->pps_recvt;
+	up->pps_stamp += 0x80000000U;
+	setlfpfrac(up->pps_stamp, 0);
+
+	if (NULL != up->pps_peer)
+		save_ltc(up->pps_peer->procptr, prettydate(up->pps_stamp2));
+	DPRINT(2, ("%s: PPS processed,"
+		   " stamp='%s', recvt='%s'\n",
+		   up->logname,
+		   prettydate(up->pps_stamp2),
+		   prettydate(up->pps_recvt2)));
+
+	up->fl_pps  = !(pp->sloppyclockflag & CLK_FLAG2);
+	up->fl_pps2 = true;
+}
+
+/* ------------------------------------------------------------------ */
+
+enum { PPS_CLOCK_SEC, PPS_CLOCK_NSEC, PPS_CLOCK_MUSEC,
+       PPS_REAL_SEC, PPS_REAL_NSEC, PPS_REAL_MUSEC,
+       PPS_PREC, PPS_NKEYS };
+static const char * const s_pps_keys[PPS_NKEYS] = {
+	"clock_sec", "clock_nsec", "clock_musec",
+	"real_sec", "real_nsec", "real_musec",
+	"precision"
+};
+
 static void
 process_pps(
 	peerT      * const peer ,
-	json_ctx   * const jctx ,
+	json_value * const jval ,
 	const l_fp * const rtime)
 {
 	clockprocT * const pp = peer->procptr;
 	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
 
-	int xlog2;
+	long xlog2;
 
 	++up->tc_pps_recv;
 
@@ -1634,51 +1524,29 @@ process_pps(
 	 * reference time GPSD associated with the pulse.
 	 */
 	if (up->pf_nsec) {
-		if ( ! get_binary_time(&up->pps_recvt2, jctx,
-				       "clock_sec", "clock_nsec", 1))
+		if ( ! get_binary_time(&up->pps_recvt2, &jval[PPS_CLOCK_SEC],
+				       &jval[PPS_CLOCK_NSEC], 1))
 			goto fail;
-		if ( ! get_binary_time(&up->pps_stamp2, jctx,
-				       "real_sec", "real_nsec", 1))
+		if ( ! get_binary_time(&up->pps_stamp2, &jval[PPS_REAL_SEC],
+				       &jval[PPS_REAL_NSEC], 1))
 			goto fail;
 	} else {
-		if ( ! get_binary_time(&up->pps_recvt2, jctx,
-				       "clock_sec", "clock_musec", 1000))
+		if ( ! get_binary_time(&up->pps_recvt2, &jval[PPS_CLOCK_SEC],
+				       &jval[PPS_CLOCK_MUSEC], 1000))
 			goto fail;
-		if ( ! get_binary_time(&up->pps_stamp2, jctx,
-				       "real_sec", "real_musec", 1000))
+		if ( ! get_binary_time(&up->pps_stamp2, &jval[PPS_REAL_SEC],
+				       &jval[PPS_REAL_MUSEC], 1000))
 			goto fail;
 	}
 
 	/* Try to read the precision field from the PPS record. If it's
 	 * not there, take the precision from the serial data.
 	 */
-	xlog2 = (int)json_object_lookup_int_default(
-			jctx, 0, "precision", up->ibt_prec);
-	up->pps_prec = clamped_precision(xlog2);
-
-	/* Get fudged receive times for primary & secondary unit */
-	up->pps_recvt = up->pps_recvt2;
-	up->pps_recvt -= up->pps_fudge;
-	up->pps_recvt2 -= up->pps_fudge2;
-	pp->lastrec = up->pps_recvt;
-
-	/* Map to nearest full second as reference time stamp for the
-	 * primary channel. Sanity checks are done in evaluation step.
-	 */
-	up->pps_stamp = up->pps_recvt;
-	up->pps_stamp += 0x80000000U;
-	setlfpfrac(up->pps_stamp, 0);
-
-	if (NULL != up->pps_peer)
-		save_ltc(up->pps_peer->procptr, prettydate(up->pps_stamp2));
-	DPRINT(2, ("%s: PPS record processed,"
-		   " stamp='%s', recvt='%s'\n",
-		   up->logname,
-		   prettydate(up->pps_stamp2),
-		   prettydate(up->pps_recvt2)));
-
-	up->fl_pps  = !(pp->sloppyclockflag & CLK_FLAG2);
-	up->fl_pps2 = true;
+	if ( ! json_value_int(&jval[PPS_PREC], &xlog2) ||
+	    xlog2 < INT_MIN || xlog2 > INT_MAX)
+		xlog2 = up->ibt_prec;
+	up->pps_prec = clamped_precision((int)xlog2);
+	pps_stamps(pp, up);
 	return;
 
   fail:
@@ -1689,10 +1557,16 @@ process_pps(
 
 /* ------------------------------------------------------------------ */
 
+enum { TOFF_CLOCK_SEC, TOFF_CLOCK_NSEC, TOFF_REAL_SEC, TOFF_REAL_NSEC,
+       TOFF_NKEYS };
+static const char * const s_toff_keys[TOFF_NKEYS] = {
+	"clock_sec", "clock_nsec", "real_sec", "real_nsec"
+};
+
 static void
 process_toff(
 	peerT      * const peer ,
-	json_ctx   * const jctx ,
+	json_value * const jval ,
 	const l_fp * const rtime)
 {
 	clockprocT * const pp = peer->procptr;
@@ -1707,11 +1581,11 @@ process_toff(
 	if (up->fl_nosync)
 		return;
 
-	if ( ! get_binary_time(&up->ibt_recvt, jctx,
-			       "clock_sec", "clock_nsec", 1))
+	if ( ! get_binary_time(&up->ibt_recvt, &jval[TOFF_CLOCK_SEC],
+			       &jval[TOFF_CLOCK_NSEC], 1))
 			goto fail;
-	if ( ! get_binary_time(&up->ibt_stamp, jctx,
-			       "real_sec", "real_nsec", 1))
+	if ( ! get_binary_time(&up->ibt_stamp, &jval[TOFF_REAL_SEC],
+			       &jval[TOFF_REAL_NSEC], 1))
 			goto fail;
 	up->ibt_recvt -= up->ibt_fudge;
 	up->ibt_local = *rtime;
@@ -1733,51 +1607,30 @@ process_toff(
 
 /* ------------------------------------------------------------------ */
 
+static const struct gpsd_class {
+	const char         * name;
+	void              (* process)(peerT * const, json_value * const,
+				      const l_fp * const);
+	const char * const * keys;
+	int                  nkeys;
+	bool                 perdev;	/* for a device's unit */
+	bool                 timing;	/* SHM has it instead */
+} s_gpsd_classes[] = {
+	{ "TPV",     process_tpv,     s_tpv_keys,     TPV_NKEYS,     true,  false },
+	{ "PPS",     process_pps,     s_pps_keys,     PPS_NKEYS,     true,  true  },
+	{ "TOFF",    process_toff,    s_toff_keys,    TOFF_NKEYS,    true,  true  },
+	{ "VERSION", process_version, s_version_keys, VERSION_NKEYS, false, false },
+	{ "WATCH",   process_watch,   s_watch_keys,   WATCH_NKEYS,   false, false },
+};
+
+/* ------------------------------------------------------------------ */
+/* Feed whatever the last record or SHM sample made available */
 static void
-gpsd_parse(
+gpsd_eval(
 	peerT      * const peer ,
-	const l_fp * const rtime)
+	clockprocT * const pp   ,
+	gpsd_unitT * const up   )
 {
-	clockprocT * const pp = peer->procptr;
-	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
-
-	const char * clsid;
-
-        DPRINT(2, ("%s: gpsd_parse: time %s '%.*s'\n",
-		   up->logname, ulfptoa(*rtime, 6),
-		   up->buflen, up->buffer));
-
-	/* See if we can grab anything potentially useful. JSMN does not
-	 * need a trailing NUL, but it needs the number of bytes to
-	 * process. */
-	if (!json_parse_record(&up->json_parse, up->buffer,
-                               (size_t)up->buflen)) {
-		++up->tc_breply;
-		return;
-	}
-
-	/* Now dispatch over the objects we know */
-	clsid = json_object_lookup_string(&up->json_parse, 0, "class");
-	if (NULL == clsid) {
-		++up->tc_breply;
-		return;
-	}
-
-	if      (!strcmp("TPV", clsid)) {
-		process_tpv(peer, &up->json_parse, rtime);
-	} else if (!strcmp("PPS", clsid)) {
-		process_pps(peer, &up->json_parse, rtime);
-	} else if (!strcmp("TOFF", clsid)) {
-		process_toff(peer, &up->json_parse, rtime);
-	} else if (!strcmp("VERSION", clsid)) {
-		process_version(peer, &up->json_parse, rtime);
-	} else if (!strcmp("WATCH", clsid)) {
-		process_watch(peer, &up->json_parse, rtime);
-	} else {
-		return; /* nothing we know about... */
-	}
-	++up->tc_recv;
-
 	/* if possible, feed the PPS side channel */
 	if (up->pps_peer)
 		eval_pps_secondary(
@@ -1815,61 +1668,149 @@ gpsd_parse(
 	}
 }
 
+/* ------------------------------------------------------------------ */
+/* find the unit a record is for by its device member; a record without
+ * one can only be for a single unit
+ */
+static gpsd_unitT *
+find_unit(
+	const json_value * const dev)
+{
+	gpsd_unitT * up;
+
+	for (up = s_clock_units; up != NULL; up = up->next_unit) {
+		if (NULL == up->peer)
+			continue;
+		if (JSON_NONE == dev->kind) {
+			if (1 == s_conn.nunits)
+				return up;
+		} else if (json_value_is(dev, up->device)) {
+			return up;
+		}
+	}
+	return NULL;
+}
+
+static void
+gpsd_parse(
+	const l_fp * const rtime)
+{
+	static const char * const head_keys[2] = { "class", "device" };
+
+	peerT      * peer;
+	clockprocT * pp;
+	gpsd_unitT * up;
+
+	const struct gpsd_class * cls;
+	json_value   jval[GPSD_MAXKEYS];
+	size_t       idx;
+
+        DPRINT(2, ("GPSD_JSON: gpsd_parse: time %s '%.*s'\n",
+		   ulfptoa(*rtime, 6), s_conn.buflen, s_conn.buffer));
+
+	/* Find out what we've got, and for which device. GPSD puts the
+	 * class first and the device second, so the scan seldom has to
+	 * go further.
+	 */
+	if (json_scan(s_conn.buffer, (size_t)s_conn.buflen,
+		      head_keys, 2, jval) < 1 ||
+	    JSON_STRING != jval[0].kind) {
+		for (up = s_clock_units; up != NULL; up = up->next_unit)
+			++up->tc_breply;
+		return;
+	}
+
+	/* Now dispatch over the objects we know */
+	for (idx = 0; idx < COUNTOF(s_gpsd_classes); ++idx)
+		if (json_value_is(&jval[0], s_gpsd_classes[idx].name))
+			break;
+	if (idx == COUNTOF(s_gpsd_classes))
+		return; /* nothing we know about... */
+	cls = &s_gpsd_classes[idx];
+
+	/* records about the connection count for every unit */
+	if ( ! cls->perdev) {
+		bool bad = json_scan(s_conn.buffer, (size_t)s_conn.buflen,
+				     cls->keys, cls->nkeys, jval) < 0;
+		if ( ! bad)
+			cls->process(NULL, jval, rtime);
+		for (up = s_clock_units; up != NULL; up = up->next_unit)
+			if (bad)
+				++up->tc_breply;
+			else
+				++up->tc_recv;
+		return;
+	}
+	if (NULL == (up = find_unit(&jval[1])))
+		return; /* not a device of ours */
+	if (up->pf_shm && cls->timing)
+		return; /* SHM carries this unit's timing */
+	peer = up->peer;
+	pp = peer->procptr;
+
+	if (json_scan(s_conn.buffer, (size_t)s_conn.buflen,
+		      cls->keys, cls->nkeys, jval) < 0) {
+		++up->tc_breply;
+		return;
+	}
+	cls->process(peer, jval, rtime);
+	++up->tc_recv;
+	gpsd_eval(peer, pp, up);
+}
+
 /* ------------------------------------------------------------------ */
 
 static void
-gpsd_stop_socket(
-	peerT * const peer)
+gpsd_stop_socket(void)
 {
-	clockprocT * const pp = peer->procptr;
-	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
+	gpsd_unitT * up;
 
-	if (-1 != pp->io.fd) {
-		if (syslogok(pp, up))
+	if (-1 != s_conn.io.fd) {
+		if (conn_syslogok())
 			msyslog(LOG_INFO,
-				"REFCLOCK: %s: closing socket to GPSD, fd=%d",
-				up->logname, pp->io.fd);
+				"REFCLOCK: GPSD_JSON: closing socket to GPSD, fd=%d",
+				s_conn.io.fd);
 		else
-			DPRINT(1, ("%s: closing socket to GPSD, fd=%d\n",
-				   up->logname, pp->io.fd));
-		io_closeclock(&pp->io);
-		pp->io.fd = -1;
-	}
-	up->tickover = up->tickpres;
-	up->tickpres = min(up->tickpres + 5, TICKOVER_HIGH);
-	up->fl_vers  = false;
-	up->fl_ibt   = false;
-	up->fl_pps   = false;
-	up->fl_watch = false;
+			DPRINT(1, ("GPSD_JSON: closing socket to GPSD, fd=%d\n",
+				   s_conn.io.fd));
+		io_closeclock(&s_conn.io);
+		s_conn.io.fd = -1;
+	}
+	s_conn.tickover = s_conn.tickpres;
+	s_conn.tickpres = min(s_conn.tickpres + 5, TICKOVER_HIGH);
+	s_conn.fl_vers  = false;
+	s_conn.fl_watch = false;
+	s_conn.buflen   = 0;
+	for (up = s_clock_units; up != NULL; up = up->next_unit) {
+		up->fl_ibt = false;
+		up->fl_pps = false;
+	}
 }
 
 /* ------------------------------------------------------------------ */
 
 static void
-gpsd_init_socket(
-	peerT * const peer)
+gpsd_init_socket(void)
 {
-	clockprocT * const pp = peer->procptr;
-	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
 	addrinfoT  * ai;
 	int          rc;
 	int          ov;
 
 	/* draw next address to try */
-	if (NULL == up->addr) {
-		up->addr = s_gpsd_addr;
+	if (NULL == s_conn.addr) {
+		s_conn.addr = s_gpsd_addr;
 	}
-	ai = up->addr;
-	up->addr = ai->ai_next;
+	ai = s_conn.addr;
+	s_conn.addr = ai->ai_next;
 
 	/* try to create a matching socket */
-	up->fdt = socket(
+	s_conn.fdt = socket(
 		ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-	if (-1 == up->fdt) {
-		if (syslogok(pp, up))
+	if (-1 == s_conn.fdt) {
+		if (conn_syslogok())
 			msyslog(LOG_ERR,
-				"REFCLOCK: %s: cannot create GPSD socket: %s",
-				up->logname, strerror(errno));
+				"REFCLOCK: GPSD_JSON: cannot create GPSD socket: %s",
+				strerror(errno));
 		goto no_socket;
 	}
 
@@ -1877,13 +1818,13 @@ gpsd_init_socket(
 	 * IO happen in an event-driven environment, and synchronous
 	 * operations wreak havoc on that.
 	 */
-	rc = fcntl(up->fdt, F_SETFL, O_NONBLOCK, 1);
+	rc = fcntl(s_conn.fdt, F_SETFL, O_NONBLOCK, 1);
 	if (-1 == rc) {
-		if (syslogok(pp, up))
+		if (conn_syslogok())
 			msyslog(LOG_ERR,
-				"REFCLOCK: %s: cannot set GPSD socket "
+				"REFCLOCK: GPSD_JSON: cannot set GPSD socket "
                                 "to non-blocking: %s",
-				up->logname, strerror(errno));
+				strerror(errno));
 		goto no_socket;
 	}
 	/* Disable nagling. The way both GPSD and NTPD handle the
@@ -1893,30 +1834,30 @@ gpsd_init_socket(
 	 * delay, which can worsen the situation for some packets.
 	 */
 	ov = 1;
-	rc = setsockopt(up->fdt, IPPROTO_TCP, TCP_NODELAY,
+	rc = setsockopt(s_conn.fdt, IPPROTO_TCP, TCP_NODELAY,
 			(char*)&ov, sizeof(ov));
 	if (-1 == rc) {
-		if (syslogok(pp, up))
+		if (conn_syslogok())
 			msyslog(LOG_INFO,
-				"REFCLOCK: %s: cannot disable TCP nagle: %s",
-				up->logname, strerror(errno));
+				"REFCLOCK: GPSD_JSON: cannot disable TCP nagle: %s",
+				strerror(errno));
 	}
 
 	/* Start a non-blocking connect. There might be a synchronous
 	 * connection result we have to handle.
 	 */
-	rc = connect(up->fdt, ai->ai_addr, ai->ai_addrlen);
+	rc = connect(s_conn.fdt, ai->ai_addr, ai->ai_addrlen);
 	if (-1 == rc) {
 		if (errno == EINPROGRESS) {
-			DPRINT(1, ("%s: async connect pending, fd=%d\n",
-				   up->logname, up->fdt));
+			DPRINT(1, ("GPSD_JSON: async connect pending, fd=%d\n",
+				   s_conn.fdt));
 			return;
 		}
 
-		if (syslogok(pp, up))
+		if (conn_syslogok())
 			msyslog(LOG_ERR,
-				"REFCLOCK: %s: cannot connect GPSD socket: %s",
-				up->logname, strerror(errno));
+				"REFCLOCK: GPSD_JSON: cannot connect GPSD socket: %s",
+				strerror(errno));
 		goto no_socket;
 	}
 
@@ -1925,43 +1866,38 @@ gpsd_init_socket(
 	 * version string and apply the watch command later on, but we
 	 * might as well get the show on the road now.
 	 */
-	DPRINT(1, ("%s: new socket connection, fd=%d\n",
-		   up->logname, up->fdt));
+	DPRINT(1, ("GPSD_JSON: new socket connection, fd=%d\n",
+		   s_conn.fdt));
 
-	pp->io.fd = up->fdt;
-	up->fdt   = -1;
-	if (0 == io_addclock(&pp->io)) {
-		if (syslogok(pp, up))
+	s_conn.io.fd = s_conn.fdt;
+	s_conn.fdt   = -1;
+	if (0 == io_addclock(&s_conn.io)) {
+		if (conn_syslogok())
 			msyslog(LOG_ERR,
-				"REFCLOCK: %s: failed to register "
-                                "with I/O engine",
-				up->logname);
+				"REFCLOCK: GPSD_JSON: failed to register "
+                                "with I/O engine");
 		goto no_socket;
 	}
 
 	return;
 
   no_socket:
-	if (-1 != pp->io.fd)
-		close(pp->io.fd);
-	if (-1 != up->fdt) {
-		close(up->fdt);
-	}
-	pp->io.fd    = -1;
-	up->fdt      = -1;
-	up->tickover = up->tickpres;
-	up->tickpres = min(up->tickpres + 5, TICKOVER_HIGH);
+	if (-1 != s_conn.io.fd)
+		close(s_conn.io.fd);
+	if (-1 != s_conn.fdt) {
+		close(s_conn.fdt);
+	}
+	s_conn.io.fd    = -1;
+	s_conn.fdt      = -1;
+	s_conn.tickover = s_conn.tickpres;
+	s_conn.tickpres = min(s_conn.tickpres + 5, TICKOVER_HIGH);
 }
 
 /* ------------------------------------------------------------------ */
 
 static void
-gpsd_test_socket(
-	peerT * const peer)
+gpsd_test_socket(void)
 {
-	clockprocT * const pp = peer->procptr;
-	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
-
 	int       ec, rc;
 	socklen_t lc;
 
@@ -1969,8 +1905,8 @@ gpsd_test_socket(
 	 * socket for writeability. Use the 'poll()' API if available
 	 * and 'select()' otherwise.
 	 */
-	DPRINT(2, ("%s: check connect, fd=%d\n",
-		   up->logname, up->fdt));
+	DPRINT(2, ("GPSD_JSON: check connect, fd=%d\n",
+		   s_conn.fdt));
 
 	{
 		struct timespec tout;
@@ -1978,61 +1914,60 @@ gpsd_test_socket(
 
 		memset(&tout, 0, sizeof(tout));
 		FD_ZERO(&wset);
-		FD_SET(up->fdt, &wset);
-		rc = pselect(up->fdt+1, NULL, &wset, NULL, &tout, NULL);
-		if (0 == rc || !(FD_ISSET(up->fdt, &wset))) {
+		FD_SET(s_conn.fdt, &wset);
+		rc = pselect(s_conn.fdt+1, NULL, &wset, NULL, &tout, NULL);
+		if (0 == rc || !(FD_ISSET(s_conn.fdt, &wset))) {
 			return;
 		}
 	}
 
 	/* next timeout is a full one... */
-	up->tickover = TICKOVER_LOW;
+	s_conn.tickover = TICKOVER_LOW;
 
 	/* check for socket error */
 	ec = 0;
 	lc = sizeof(ec);
-	rc = getsockopt(up->fdt, SOL_SOCKET, SO_ERROR, &ec, &lc);
+	rc = getsockopt(s_conn.fdt, SOL_SOCKET, SO_ERROR, &ec, &lc);
 	if (-1 == rc || 0 != ec) {
 		const char *errtxt;
 		if (0 == ec)
 			ec = errno;
 		errtxt = strerror(ec);
-		if (syslogok(pp, up))
+		if (conn_syslogok())
 			msyslog(LOG_ERR,
-				"REFCLOCK: %s: async connect to GPSD failed,"
+				"REFCLOCK: GPSD_JSON: async connect to GPSD failed,"
 				" fd=%d, ec=%d(%s)",
-				up->logname, up->fdt, ec, errtxt);
+				s_conn.fdt, ec, errtxt);
 		else
-			DPRINT(1, ("%s: async connect to GPSD failed,"
+			DPRINT(1, ("GPSD_JSON: async connect to GPSD failed,"
 				   " fd=%d, ec=%d(%s)\n",
-				   up->logname, up->fdt, ec, errtxt));
+				   s_conn.fdt, ec, errtxt));
 		goto no_socket;
 	} else {
-		DPRINT(1, ("%s: async connect to GPSD succeeded, fd=%d\n",
-			   up->logname, up->fdt));
+		DPRINT(1, ("GPSD_JSON: async connect to GPSD succeeded, fd=%d\n",
+			   s_conn.fdt));
 	}
 
 	/* swap socket FDs, and make sure the clock was added */
-	pp->io.fd = up->fdt;
-	up->fdt   = -1;
-	if (0 == io_addclock(&pp->io)) {
-		if (syslogok(pp, up))
+	s_conn.io.fd = s_conn.fdt;
+	s_conn.fdt   = -1;
+	if (0 == io_addclock(&s_conn.io)) {
+		if (conn_syslogok())
 			msyslog(LOG_ERR,
-			    "REFCLOCK: %s: failed to register with I/O engine",
-			    up->logname);
+			    "REFCLOCK: GPSD_JSON: failed to register with I/O engine");
 		goto no_socket;
 	}
 	return;
 
   no_socket:
-	if (-1 != up->fdt) {
-		DPRINT(1, ("%s: closing socket, fd=%d\n",
-			   up->logname, up->fdt));
-		close(up->fdt);
-	}
-	up->fdt      = -1;
-	up->tickover = up->tickpres;
-	up->tickpres = min(up->tickpres + 5, TICKOVER_HIGH);
+	if (-1 != s_conn.fdt) {
+		DPRINT(1, ("GPSD_JSON: closing socket, fd=%d\n",
+			   s_conn.fdt));
+		close(s_conn.fdt);
+	}
+	s_conn.fdt      = -1;
+	s_conn.tickover = s_conn.tickpres;
+	s_conn.tickpres = min(s_conn.tickpres + 5, TICKOVER_HIGH);
 }
 
 /* =====================================================================
@@ -2153,22 +2088,19 @@ myasprintf(
 
 static void
 log_data(
-	peerT      *peer,
+	const char *name,
 	const char *what,
 	const char *buf ,
 	size_t      len )
 {
 #ifndef DEBUG
-	UNUSED_ARG(peer);
+	UNUSED_ARG(name);
 	UNUSED_ARG(what);
 	UNUSED_ARG(buf);
 	UNUSED_ARG(len);
 #else
 	char s_lbuf[MAX_PDU_LEN];
 
-	clockprocT * const pp = peer->procptr;
-	gpsd_unitT * const up = (gpsd_unitT *)pp->unitptr;
-
 	if (debug > 1) { /* SPECIAL DEBUG */
 		const char *sptr = buf;
 		const char *stop = buf + len;
@@ -2191,7 +2123,7 @@ log_data(
 			sptr++;
 		}
 		*dptr = '\0';
-		printf("%s[%s]: '%s'\n", up->logname, what, s_lbuf);
+		printf("%s[%s]: '%s'\n", name, what, s_lbuf);
 	}
 #endif
 }
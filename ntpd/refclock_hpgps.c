@@ -135,7 +135,8 @@ struct	refclock refclock_hpgps = {
 	hpgps_poll,		/* transmit poll message */
 	NULL,			/* not used (old hpgps_control) */
 	NULL,			/* initialize driver */
-	NULL			/* timer - not used */
+	NULL,			/* timer - not used */
+	NULL			/* fast loop reading - not used */
 };
 
 
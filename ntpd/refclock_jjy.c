@@ -331,7 +331,8 @@ struct	refclock refclock_jjy = {
 	jjy_poll,	/* transmit poll message */
 	NULL,		/* control - not used */
 	NULL,		/* init - not used */
-	jjy_timer	/* 1 second interval timer */
+	jjy_timer,	/* 1 second interval timer */
+	NULL		/* fast loop reading - not used */
 };
 
 /*
@@ -83,7 +83,8 @@ struct	refclock refclock_local = {
 	local_poll,	 	/* transmit poll message */
 	NULL,			/* not used (old lcl_control) */
 	NULL,			/* initialize driver (not used) */
-	NULL 			/* timer - not used */
+	NULL,			/* timer - not used */
+	NULL			/* fast loop reading - not used */
 };
 
 
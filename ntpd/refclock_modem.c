@@ -235,7 +235,8 @@ struct refclock refclock_modem = {
 	modem_poll,		/* transmit poll message */
 	NULL,			/* control - not used */
 	NULL,			/* init - not used */
-	modem_timer		/* housekeeping timer */
+	modem_timer,		/* housekeeping timer */
+	NULL			/* fast loop reading - not used */
 };
 
 /*
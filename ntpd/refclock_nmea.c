@@ -29,6 +29,7 @@
 #include "ntpd.h"
 #include "ntp_io.h"
 #include "ntp_refclock.h"
+#include "nmea_scan.h"
 #include "ntp_stdlib.h"
 #include "timespecops.h"
 #include "PIVOT.h"
@@ -85,11 +86,6 @@
 #define NMEA_EXTLOG_MASK	0x00010000U
 #define NMEA_DATETRUST_MASK	0x02000000U
 
-#define NMEA_PROTO_IDLEN	5	/* tag name must be at least 5 chars */
-/* #define NMEA_PROTO_MINLEN 6 * min chars in sentence, excluding CS UNUSED */
-#define NMEA_PROTO_MAXLEN	80	/* max chars in sentence, excluding CS */
-#define NMEA_PROTO_FIELDS	32	/* not official; limit on fields per record */
-
 /*
  * We check the timecode format and decode its contents.  We only care
  * about a few of them, the most important being the $GPRMC format:
@@ -154,10 +150,10 @@
 #define	DESCRIPTION	"NMEA GPS Clock" /* who we are */
 
 /* NMEA sentence array indexes for those we use */
-#define NMEA_GPRMC	0	/* recommended min. nav. */
-#define NMEA_GPGGA	1	/* fix and quality */
-#define NMEA_GPGLL	2	/* geo. lat/long */
-#define NMEA_GPZDA	3	/* date/time */
+#define NMEA_GPRMC	NMEA_SENT_RMC	/* recommended min. nav. */
+#define NMEA_GPGGA	NMEA_SENT_GGA	/* fix and quality */
+#define NMEA_GPGLL	NMEA_SENT_GLL	/* geo. lat/long */
+#define NMEA_GPZDA	NMEA_SENT_ZDA	/* date/time */
 /*
  * $GPZDG is a proprietary sentence that violates the spec, by not
  * using $P and an assigned company identifier to prefix the sentence
@@ -167,9 +163,9 @@
  * UTC due to not respecting leap seconds since 1970 or so.  Other
  * than the different timebase, $GPZDG is similar to $GPZDA.
  */
-#define NMEA_GPZDG	4
-#define NMEA_PGRMF	5
-#define NMEA_ARRAY_SIZE (NMEA_PGRMF + 1)
+#define NMEA_GPZDG	NMEA_SENT_ZDG
+#define NMEA_PGRMF	NMEA_SENT_PGRMF
+#define NMEA_ARRAY_SIZE NMEA_SENT_COUNT
 
 /*
  * Sentence selection mode bits
@@ -197,16 +193,6 @@ enum date_fmt {
 	DATE_3_DDMMYYYY	/* use 3 fields with 4-digit year */
 };
 
-/* results for 'field_init()'
- *
- * Note: If a checksum is present, the checksum test must pass OK or the
- * sentence is tagged invalid.
- */
-#define CHECK_EMPTY  -1	/* no data			*/
-#define CHECK_INVALID 0	/* not a valid NMEA sentence	*/
-#define CHECK_VALID   1	/* valid but without checksum	*/
-#define CHECK_CSVALID 2	/* valid with checksum OK	*/
-
 /*
  * Unit control structure
  */
@@ -236,16 +222,6 @@ typedef struct {
 	uint8_t	cksum_type[NMEA_ARRAY_SIZE];
 } nmea_unit;
 
-/*
- * helper for faster field access
- */
-typedef struct {
-	char  *base;	/* buffer base		*/
-	char  *cptr;	/* current field ptr	*/
-	int    blen;	/* buffer length	*/
-	int    cidx;	/* current field index	*/
-} nmea_data;
-
 
 /*
  * Function prototypes
@@ -264,13 +240,11 @@ static	void	nmea_control	(int, const struct refclockstat *,
 static	void	nmea_timer	(int, struct peer *);
 
 /* parsing helpers */
-static int	field_init	(nmea_data * data, char * cp, int len);
-static char *	field_parse	(nmea_data * data, int fn);
-static void	field_wipe	(nmea_data * data, ...);
-static uint8_t	parse_qual	(nmea_data * data, int idx,
+static void	field_wipe	(nmea_sentence * data, ...);
+static uint8_t	parse_qual	(nmea_sentence * data, int idx,
 				 char tag, int inv);
-static bool	parse_time	(struct timespec *dt, nmea_data *, int idx);
-static bool	parse_date	(struct timespec *dt, nmea_data*,
+static bool	parse_time	(struct timespec *dt, nmea_sentence *, int idx);
+static bool	parse_date	(struct timespec *dt, nmea_sentence *,
 					int idx, enum date_fmt fmt);
 static bool	kludge_day	(struct timespec *dt);
 static bool	fix_WNRO	(struct timespec *dt, int *wnro, \
@@ -299,7 +273,8 @@ struct refclock refclock_nmea = {
 	nmea_poll,		/* transmit poll message */
 	NMEA_CONTROL,		/* fudge control */
 	NULL,			/* initialize driver */
-	nmea_timer		/* called once per second */
+	nmea_timer,		/* called once per second */
+	NULL			/* fast loop reading - not used */
 };
 
 /*
@@ -466,7 +441,7 @@ nmea_start(
 	/* force change detection on first valid message */
 	memset(&up->last_reftime, 0xFF, sizeof(up->last_reftime));
 	/* force checksum on GPRMC, see below */
-	up->cksum_type[NMEA_GPRMC] = CHECK_CSVALID;
+	up->cksum_type[NMEA_GPRMC] = NMEA_CSVALID;
 #ifdef HAVE_PPSAPI
 	up->ppsapi_fd = -1;
 #endif
@@ -818,7 +793,7 @@ nmea_receive(
 	nmea_unit	    * const up = (nmea_unit*)pp->unitptr;
 
 	/* Use these variables to hold data until we decide its worth keeping */
-	nmea_data rdata;
+	nmea_sentence rdata;
 	char 	  rd_lastcode[BMAX];
 	l_fp 	  rd_timestamp, rd_reftime;
 	int	  rd_lencode;
@@ -829,7 +804,6 @@ nmea_receive(
 	/* results of sentence/date/time parsing */
 	uint8_t		sentence;	/* sentence tag */
 	int		checkres;
-	char *		cp;
 	bool		rc_date;
 	bool		rc_time;
 
@@ -847,16 +821,16 @@ nmea_receive(
 	 */
 	rd_lencode = refclock_gtlin(rbufp, rd_lastcode,
 				    sizeof(rd_lastcode), &rd_timestamp);
-	checkres = field_init(&rdata, rd_lastcode, rd_lencode);
+	checkres = nmea_scan(rd_lastcode, rd_lencode, &rdata);
 	switch (checkres) {
 
-	case CHECK_INVALID:
+	case NMEA_INVALID:
 		DPRINT(1, ("%s invalid data: '%s'\n",
 			   refclock_name(peer), rd_lastcode));
 		refclock_report(peer, CEVNT_BADREPLY);
 		return;
 
-	case CHECK_EMPTY:
+	case NMEA_EMPTY:
 		return;
 
 	default:
@@ -870,27 +844,13 @@ nmea_receive(
 	/*
 	 * --> below this point we have a valid NMEA sentence <--
 	 *
-	 * Check sentence name. Skip first 2 chars (talker ID) in most
-	 * cases, to allow for $GLGGA and $GPGGA etc. Since the name
-	 * field has at least 5 chars we can simply shift the field
-	 * start.
+	 * nmea_scan() has already told the sentence name, ignoring the
+	 * talker ID, to allow for $GLGGA and $GPGGA etc.
 	 */
-	cp = field_parse(&rdata, 0);
-	if      (strncmp(cp + 2, "RMC,", 4) == 0) {
-		sentence = NMEA_GPRMC;
-	} else if (strncmp(cp + 2, "GGA,", 4) == 0) {
-		sentence = NMEA_GPGGA;
-	} else if (strncmp(cp + 2, "GLL,", 4) == 0) {
-		sentence = NMEA_GPGLL;
-	} else if (strncmp(cp + 2, "ZDA,", 4) == 0) {
-		sentence = NMEA_GPZDA;
-	} else if (strncmp(cp + 2, "ZDG,", 4) == 0) {
-		sentence = NMEA_GPZDG;
-	} else if (strncmp(cp,   "PGRMF,", 6) == 0) {
-		sentence = NMEA_PGRMF;
-	} else {
+	if (NMEA_SENT_UNKNOWN == rdata.sentence) {
 		return;	/* not something we know about */
 	}
+	sentence = (uint8_t)rdata.sentence;
 
 	/* Eventually output delay measurement now. */
 	if (peer->cfg.mode & NMEA_DELAYMEAS_MASK) {
@@ -1251,7 +1211,7 @@ gps_send(
 	)
 {
 	/* $...*xy<CR><LF><NUL> add 7 */
-	char	      buf[NMEA_PROTO_MAXLEN + 7];
+	char	      buf[NMEA_MAXLEN + 7];
 	int	      len;
 	uint8_t	      dcs;
 	const uint8_t *beg, *end;
@@ -1286,156 +1246,6 @@ gps_send(
 }
 #endif /* NMEA_WRITE_SUPPORT */
 
-/*
- * -------------------------------------------------------------------
- * helpers for faster field splitting
- * -------------------------------------------------------------------
- *
- * set up a field record, check syntax and verify checksum
- *
- * format is $XXXXX,1,2,3,4*ML
- *
- * 8-bit XOR of characters between $ and * noninclusive is transmitted
- * in last two chars M and L holding most and least significant nibbles
- * in hex representation such as:
- *
- *   $GPGLL,5057.970,N,00146.110,E,142451,A*27
- *   $GPVTG,089.0,T,,,15.2,N,,*7F
- *
- * Some other constraints:
- * + The field name must at least 5 upcase characters or digits and must
- *   start with a character.
- * + The checksum (if present) must be uppercase hex digits.
- * + The length of a sentence is limited to 80 characters (not including
- *   the final CR/LF nor the checksum, but including the leading '$')
- *
- * Return values:
- *  + CHECK_INVALID
- *	The data does not form a valid NMEA sentence or a checksum error
- *	occurred.
- *  + CHECK_VALID
- *	The data is a valid NMEA sentence but contains no checksum.
- *  + CHECK_CSVALID
- *	The data is a valid NMEA sentence and passed the checksum test.
- * -------------------------------------------------------------------
- */
-static int
-field_init(
-	nmea_data * data,	/* context structure		       */
-	char 	  * cptr,	/* start of raw data		       */
-	int	    dlen	/* data len, not counting trailing NUL */
-	)
-{
-	uint8_t cs_l;	/* checksum local computed	*/
-	uint8_t cs_r;	/* checksum remote given	*/
-	char * eptr;	/* buffer end end pointer	*/
-	char   tmp;	/* char buffer 			*/
-
-	cs_l = 0;
-	cs_r = 0;
-	/* some basic input constraints */
-	if (dlen < 0) {
-		dlen = 0;
-	}
-	eptr = cptr + dlen;
-	*eptr = '\0';
-
-	/* load data context */
-	data->base = cptr;
-	data->cptr = cptr;
-	data->cidx = 0;
-	data->blen = dlen;
-
-	/* syntax check follows here. check allowed character
-	 * sequences, updating the local computed checksum as we go.
-	 *
-	 * regex equiv: '^\$[A-Z][A-Z0-9]{4,}[^*]*(\*[0-9A-F]{2})?$'
-	 */
-
-	/* -*- start character: '^\$' */
-	if (*cptr == '\0') {
-		return CHECK_EMPTY;
-	}
-	if (*cptr++ != '$') {
-		return CHECK_INVALID;
-	}
-
-	/* -*- advance context beyond start character */
-	data->base++;
-	data->cptr++;
-	data->blen--;
-
-	/* -*- field name: '[A-Z][A-Z0-9]{4,},' */
-	if (*cptr < 'A' || *cptr > 'Z') {
-		return CHECK_INVALID;
-	}
-	cs_l ^= *cptr++;
-	while ((*cptr >= 'A' && *cptr <= 'Z') ||
-	       (*cptr >= '0' && *cptr <= '9')  )
-		cs_l ^= *cptr++;
-	if (*cptr != ',' || (cptr - data->base) < NMEA_PROTO_IDLEN) {
-		return CHECK_INVALID;
-}
-	cs_l ^= *cptr++;
-
-	/* -*- data: '[^*]*' */
-	while (*cptr && *cptr != '*')
-		cs_l ^= *cptr++;
-
-	/* -*- checksum field: (\*[0-9A-F]{2})?$ */
-	if (*cptr == '\0') {
-		return CHECK_VALID;
-}
-	if (*cptr != '*' || cptr != eptr - 3 ||
-	    (cptr - data->base) >= NMEA_PROTO_MAXLEN) {
-		return CHECK_INVALID;
-}
-
-	for (cptr++; (tmp = *cptr) != '\0'; cptr++) {
-		if (tmp >= '0' && tmp <= '9') {
-			cs_r = (cs_r << 4) + (tmp - '0');
-		} else if (tmp >= 'A' && tmp <= 'F') {
-			cs_r = (cs_r << 4) + (tmp - 'A' + 10);
-		} else {
-			break;
-}
-	}
-
-	/* -*- make sure we are at end of string and csum matches */
-	if (cptr != eptr || cs_l != cs_r)
-		return CHECK_INVALID;
-
-	return CHECK_CSVALID;
-}
-
-/*
- * -------------------------------------------------------------------
- * fetch a data field by index, zero being the name field. If this
- * function is called repeatedly with increasing indices, the total load
- * is O(n), n being the length of the string; if it is called with
- * decreasing indices, the total load is O(n^2). Try not to go backwards
- * too often.
- * -------------------------------------------------------------------
- */
-static char *
-field_parse(
-	nmea_data * data,
-	int 	    fn
-	)
-{
-	char tmp;
-
-	if (fn < data->cidx) {
-		data->cidx = 0;
-		data->cptr = data->base;
-	}
-	while ((fn > data->cidx) && (tmp = *data->cptr) != '\0') {
-		data->cidx += (tmp == ',');
-		data->cptr++;
-	}
-	return data->cptr;
-}
-
 /*
  * -------------------------------------------------------------------
  * Wipe (that is, overwrite with '_') data fields and the checksum in
@@ -1458,7 +1268,7 @@ field_parse(
  */
 static void
 field_wipe(
-	nmea_data * data,
+	nmea_sentence * data,
 	...
 	)
 {
@@ -1472,8 +1282,8 @@ field_wipe(
 	va_start(va, data);
 	do {
 		fidx = va_arg(va, int);
-		if (fidx >= 0 && fidx <= NMEA_PROTO_FIELDS) {
-			cp = field_parse(data, fidx);
+		if (fidx >= 0 && fidx <= NMEA_FIELDS) {
+			cp = nmea_field(data, fidx);
 		} else {
 			cp = data->base + data->blen;
 			if (data->blen >= 3 && cp[-3] == '*') {
@@ -1504,7 +1314,7 @@ field_wipe(
  */
 static uint8_t
 parse_qual(
-	nmea_data * rd,
+	nmea_sentence * rd,
 	int         idx,
 	char        tag,
 	int         inv
@@ -1514,7 +1324,7 @@ parse_qual(
 				{ LEAP_NOTINSYNC, LEAP_NOWARNING };
 	char * dp;
 
-	dp = field_parse(rd, idx);
+	dp = nmea_field(rd, idx);
 
 	return table[ *dp && ((*dp == tag) == !inv) ];
 }
@@ -1531,7 +1341,7 @@ parse_qual(
 static bool
 parse_time(
 	struct timespec * dt,	/* result date+time */
-	nmea_data       * rd,
+	nmea_sentence   * rd,
 	int		  idx
 	)
 {
@@ -1548,7 +1358,7 @@ parse_time(
 	unsigned long	f;
 	char  * dp;
 
-	dp = field_parse(rd, idx);
+	dp = nmea_field(rd, idx);
 	rc = sscanf(dp, "%2u%2u%2u%n.%3lu%n", &h, &m, &s, &p1, &f, &p2);
 	if (rc < 3 || p1 != 6) {
 		DPRINT(1, ("nmea: invalid time code: '%.6s'\n", dp));
@@ -1586,7 +1396,7 @@ parse_time(
 static bool
 parse_date(
 	struct timespec * dt,	/* result pointer */
-	nmea_data       * rd,
+	nmea_sentence   * rd,
 	int		  idx,
 	enum date_fmt	  fmt
 	)
@@ -1599,7 +1409,7 @@ parse_date(
 	char  	      * dp;
 	struct tm	tm;
 
-	dp = field_parse(rd, idx);
+	dp = nmea_field(rd, idx);
 	switch (fmt) {
 
 	case DATE_1_DDMMYY:
@@ -321,6 +321,8 @@ struct instance {
 	unsigned long	ev_serial;
 	unsigned	Rcvptr;
 	uint8_t	Rcvbuf[500];
+	uint8_t	Rcvsum;		/* XOR of the message at Rcvbuf[0] so far */
+	unsigned	Rcvsummed;	/* up to here */
 	uint8_t	BEHa[160];	/* Ba, Ea or Ha */
 	uint8_t	BEHn[80];	/* Bn , En , or Hn */
 	uint8_t	Cj[300];
@@ -367,6 +369,8 @@ static	void	oncore_check_almanac  (struct instance *);
 static	void	oncore_check_antenna  (struct instance *);
 static	void	oncore_check_leap_sec (struct instance *);
 static	int	oncore_checksum_ok    (uint8_t *, int);
+static	void	oncore_index_init     (void);
+static	int	oncore_msg_lookup     (uint8_t, uint8_t);
 static	void	oncore_compute_dH     (struct instance *);
 static	void	oncore_load_almanac   (struct instance *);
 static	void	oncore_log	      (struct instance *, int, const char *);
@@ -413,7 +417,8 @@ struct	refclock refclock_oncore = {
 	oncore_poll,		/* transmit poll message */
 	NULL,			/* control - not used */
 	NULL,			/* init - not used */
-	NULL 			/* timer - not used */
+	NULL,			/* timer - not used */
+	NULL			/* fast loop reading - not used */
 };
 
 /*
@@ -472,6 +477,14 @@ static struct msg_desc {
 	{ {0},	  7,	0,		   "", 0 }
 };
 
+/*
+ * Messages are found by their two-letter ID in oncore_index rather
+ * than by a scan of the table above: the row is the upper-case first
+ * letter, the column the low six bits of the second, which keep A-Z
+ * and a-z apart.  Entries are the table index plus one, 0 if unknown.
+ */
+static uint8_t oncore_index[26][64];
+
 
 static uint8_t oncore_cmd_Aa[]  = { 'A', 'a', 0, 0, 0 }; 			    /* 6/8	Time of Day				*/
 static uint8_t oncore_cmd_Ab[]  = { 'A', 'b', 0, 0, 0 }; 			    /* 6/8	GMT Correction				*/
@@ -594,6 +607,7 @@ oncore_start(
 	/* create instance structure for this unit */
 
 	instance = emalloc_zero(sizeof(*instance));
+	oncore_index_init();
 
 	/* initialize miscellaneous variables */
 
@@ -1499,7 +1513,10 @@ oncore_receive(
 
 
 /*
- * Deal with any complete messages
+ * Deal with any complete messages.  Each is handled where it lies in
+ * the buffer, which is shifted down once at the end.  The checksum of
+ * the message at the head is kept up as its bytes come in, so each is
+ * looked at once however the serial input is split up.
  */
 
 static void
@@ -1507,13 +1524,17 @@ oncore_consume(
 	struct instance *instance
 	)
 {
-	unsigned i, m, l;
-
-	while (rcvptr >= 7) {
-		if (rcvbuf[0] != '@' || rcvbuf[1] != '@') {
+	unsigned i, l, n, head;
+	int m;
+	uint8_t *msg;
+
+	for (head = 0; rcvptr - head >= 7; ) {
+		msg = rcvbuf + head;
+		n = rcvptr - head;
+		if (msg[0] != '@' || msg[1] != '@') {
 			/* We're not in sync, lets try to get there */
-			for (i=1; i < rcvptr-1; i++) {
-				if (rcvbuf[i] == '@' && rcvbuf[i+1] == '@')
+			for (i=1; i < n-1; i++) {
+				if (msg[i] == '@' && msg[i+1] == '@')
 					break;
 			}
 #ifdef ONCORE_VERBOSE_CONSUME
@@ -1522,27 +1543,24 @@ oncore_consume(
 					     ">>> skipping %d chars",
 					     i);
 #endif
-			if (i != rcvptr)
-				memcpy(rcvbuf, rcvbuf+i, (size_t)(rcvptr-i));
-			rcvptr -= i;
+			head += i;
+			instance->Rcvsum = 0;
+			instance->Rcvsummed = 0;
 			continue;
 		}
 
 		/* Ok, we have a header now */
-		l = sizeof(oncore_messages)/sizeof(oncore_messages[0]) -1;
-		for(m = 0; m < l; m++) {
-			if (!strncmp(oncore_messages[m].flag, (char *)(rcvbuf+2), (size_t) 2))
-				break;
-		}
-		if (m == l) {
+		m = oncore_msg_lookup(msg[2], msg[3]);
+		if (m < 0) {
 #ifdef ONCORE_VERBOSE_CONSUME
 			if (debug > 4) /* SPECIAL DEBUG */
 				oncore_log_f(instance, LOG_DEBUG,
 					     ">>> Unknown MSG, skipping 4 (%c%c)",
-					     rcvbuf[2], rcvbuf[3]);
+					     msg[2], msg[3]);
 #endif
-			memcpy(rcvbuf, rcvbuf+4, (size_t) 4);
-			rcvptr -= 4;
+			head += 4;
+			instance->Rcvsum = 0;
+			instance->Rcvsummed = 0;
 			continue;
 		}
 
@@ -1551,43 +1569,48 @@ oncore_consume(
 		if (debug > 3) /* SPECIAL DEBUG */
 			oncore_log_f(instance, LOG_DEBUG,
 				     "GOT: %c%c  %d of %d entry %d",
-				     instance->unit, rcvbuf[2],
-				     rcvbuf[3], rcvptr, l, m);
+				     msg[2], msg[3], n, l, m);
 #endif
+		/* fold in what has come since last time */
+		i = max(instance->Rcvsummed, 2);
+		for ( ; i < min(n, l-3); i++)
+			instance->Rcvsum ^= msg[i];
+		instance->Rcvsummed = i;
+
 		/* Got the entire message ? */
 
-		if (rcvptr < l) {
-			return;
+		if (n < l) {
+			break;
 		}
 
 		/* are we at the end of message? should be <Cksum><CR><LF> */
 
-		if (rcvbuf[l-2] != '\r' || rcvbuf[l-1] != '\n') {
+		if (msg[l-2] != '\r' || msg[l-1] != '\n') {
 #ifdef ONCORE_VERBOSE_CONSUME
 			if (debug) /* SPECIAL DEBUG */
 				oncore_log(instance, LOG_DEBUG, "NO <CR><LF> at end of message");
 #endif
 		} else {	/* check the CheckSum */
-			if (oncore_checksum_ok(rcvbuf, (int)l)) {
+			if (instance->Rcvsum == msg[l-3]) {
 				if (instance->shmem != NULL) {
 					instance->shmem[oncore_messages[m].shmem + 2]++;
 					memcpy(instance->shmem + oncore_messages[m].shmem + 3,
-					    rcvbuf, (size_t) l);
+					    msg, (size_t) l);
 				}
-				oncore_msg_any(instance, rcvbuf,
-                                               (size_t)(l-3), (int)m);
+				oncore_msg_any(instance, msg,
+                                               (size_t)(l-3), m);
 				if (oncore_messages[m].handler)
-					oncore_messages[m].handler(instance, rcvbuf, (size_t) (l-3));
+					oncore_messages[m].handler(instance, msg, (size_t) (l-3));
 			}
 #ifdef ONCORE_VERBOSE_CONSUME
 			else if (debug) { /* SPECIAL DEBUG */
 				char	Msg[120], Msg2[10];
 
 				oncore_log(instance, LOG_ERR, "Checksum mismatch!");
-				snprintf(Msg, sizeof(Msg), "@@%c%c ", rcvbuf[2], rcvbuf[3]);
+				snprintf(Msg, sizeof(Msg), "@@%c%c ", msg[2], msg[3]);
 				for (i = 4; i < l; i++) {
 					snprintf(Msg2, sizeof(Msg2),
-						 "%03o ", rcvbuf[i]);
+						 "%03o ", msg[i]);
 					strlcat(Msg, Msg2, sizeof(Msg));
 				}
 				oncore_log(instance, LOG_DEBUG, Msg);
@@ -1595,10 +1618,52 @@ oncore_consume(
 #endif
 		}
 
-		if (l != rcvptr)
-			memcpy(rcvbuf, rcvbuf+l, (size_t) (rcvptr-l));
-		rcvptr -= l;
+		head += l;
+		instance->Rcvsum = 0;
+		instance->Rcvsummed = 0;
 	}
+
+	if (head > 0) {
+		memmove(rcvbuf, rcvbuf+head, (size_t)(rcvptr-head));
+		rcvptr -= head;
+	}
+}
+
+
+
+/*
+ * fill in oncore_index from oncore_messages, the first time
+ */
+
+static void
+oncore_index_init(void)
+{
+	unsigned m;
+
+	if (oncore_index['E'-'A']['a' & 0x3f])
+		return;
+	for (m = 0; oncore_messages[m].flag[0]; m++)
+		oncore_index[oncore_messages[m].flag[0] - 'A']
+			    [oncore_messages[m].flag[1] & 0x3f] = (uint8_t)(m+1);
+}
+
+
+
+/*
+ * the index in oncore_messages of message ID c0 c1, or -1
+ */
+
+static int
+oncore_msg_lookup(
+	uint8_t c0,
+	uint8_t c1
+	)
+{
+	if (c0 < 'A' || c0 > 'Z')
+		return -1;
+	if ((c1 < 'A' || c1 > 'Z') && (c1 < 'a' || c1 > 'z'))
+		return -1;
+	return oncore_index[c0 - 'A'][c1 & 0x3f] - 1;
 }
 
 
@@ -0,0 +1,374 @@
+/*
+ * refclock_phc - clock driver for PTP hardware clocks
+ *
+ * Copyright the NTPsec project contributors
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include "config.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/ptp_clock.h>
+
+#include "ntpd.h"
+#include "ntp_refclock.h"
+#include "ntp_stdlib.h"
+#include "timespecops.h"
+
+/*
+ * This driver reads a PTP hardware clock (PHC), typically the clock of
+ * a NIC kept on time by ptp4l, straight from its /dev/ptpN character
+ * device.  There is no daemon in between and no SHM segment; each
+ * second the driver asks the kernel for the offset between the PHC and
+ * the system clock and puts it in the median filter.  The fast loop,
+ * when it is on and this clock is the system peer, takes a reading of
+ * its own at each of its ticks.
+ *
+ * The kernel offers three ways of asking, tried in this order when the
+ * clock starts:
+ *
+ * PTP_SYS_OFFSET_PRECISE  The NIC latches both clocks at once, over
+ *                         PCIe PTM or the like.  No read delay at all.
+ * PTP_SYS_OFFSET_EXTENDED The driver reads the system clock just before
+ *                         and just after the PHC register, per sample.
+ * PTP_SYS_OFFSET          As above but brackets a whole burst of reads.
+ *
+ * The last two take SAMPLES readings per second and keep the one with
+ * the narrowest system clock bracket, which is the one least disturbed
+ * by the read itself.
+ *
+ * Fudge factors
+ *
+ * flag1 says the PHC keeps TAI, as ptp4l leaves it; the TAI offset
+ * ntpd knows from the leap second file is taken off.  Samples are
+ * dropped until that offset is known.  time1 is added to every offset.
+ * If flag4 is lit, a clockstats record is written at each poll.
+ */
+
+/*
+ * Interface definitions
+ */
+#define DEVICE		"/dev/ptp%d"	/* device name and unit */
+#define	PRECISION	(-30)		/* with PTP_SYS_OFFSET_PRECISE */
+#define	REFID		"PHC\0"		/* reference ID */
+#define	NAME		"PHC"		/* shortname */
+#define	DESCRIPTION	"PTP hardware clock" /* WRU */
+#define	SAMPLES		9		/* readings per second */
+
+enum phc_method {
+	PHC_PRECISE, PHC_EXTENDED, PHC_BURST
+};
+
+static const char * const method_name[] = {
+	"precise", "extended", "burst"
+};
+
+/*
+ * PHC unit control structure
+ */
+struct phcunit {
+	int	fd;		/* /dev/ptpN */
+	enum phc_method method;	/* which ioctl works */
+	int64_t	delay;		/* narrowest bracket this poll, ns */
+
+	/* clockstats tallies, reset at each poll */
+	int	good;		/* samples taken */
+	int	bad;		/* ioctl failures */
+	int	notai;		/* dropped, TAI offset unknown */
+};
+
+/*
+ * Function prototypes
+ */
+static	bool	phc_start	(int, struct peer *);
+static	void	phc_shutdown	(struct refclockproc *);
+static	void	phc_poll	(int, struct peer *);
+static	void	phc_timer	(int, struct peer *);
+static	bool	phc_fast	(int, struct peer *, double *);
+
+/*
+ * Transfer vector
+ */
+struct	refclock refclock_phc = {
+	NAME,			/* basename of driver */
+	phc_start,		/* start up driver */
+	phc_shutdown,		/* shut down driver */
+	phc_poll,		/* transmit poll message */
+	NULL,			/* control (not used) */
+	NULL,			/* initialize driver (not used) */
+	phc_timer,		/* called once per second */
+	phc_fast,		/* one reading for the fast loop */
+};
+
+
+static inline l_fp
+ptp_to_lfp(
+	const struct ptp_clock_time *t
+	)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t->sec;
+	ts.tv_nsec = (long)t->nsec;
+	return tspec_stamp_to_lfp(ts);
+}
+
+static inline int64_t
+ptp_ns(
+	const struct ptp_clock_time *t
+	)
+{
+	return t->sec * NS_PER_S + t->nsec;
+}
+
+
+/*
+ * phc_read - one offset reading.  Fills in the PHC time and the
+ * system time it goes with, and the width of the bracket around it.
+ */
+static bool
+phc_read(
+	struct phcunit *up,
+	l_fp	*phc,
+	l_fp	*sys,
+	int64_t	*delay
+	)
+{
+	int64_t	best = INT64_MAX;
+
+	switch (up->method) {
+#ifdef PTP_SYS_OFFSET_PRECISE
+	case PHC_PRECISE: {
+		struct ptp_sys_offset_precise pre;
+
+		memset(&pre, '\0', sizeof(pre));
+		if (ioctl(up->fd, PTP_SYS_OFFSET_PRECISE, &pre) < 0)
+			return false;
+		*phc = ptp_to_lfp(&pre.device);
+		*sys = ptp_to_lfp(&pre.sys_realtime);
+		*delay = 0;
+		return true;
+	}
+#endif
+#ifdef PTP_SYS_OFFSET_EXTENDED
+	case PHC_EXTENDED: {
+		struct ptp_sys_offset_extended ext;
+
+		memset(&ext, '\0', sizeof(ext));
+		ext.n_samples = SAMPLES;
+		if (ioctl(up->fd, PTP_SYS_OFFSET_EXTENDED, &ext) < 0)
+			return false;
+		for (unsigned int i = 0; i < ext.n_samples; i++) {
+			int64_t before = ptp_ns(&ext.ts[i][0]);
+			int64_t after = ptp_ns(&ext.ts[i][2]);
+
+			if (after - before < best) {
+				best = after - before;
+				*sys = ptp_to_lfp(&ext.ts[i][0]);
+				*sys += dtolfp((double)best / 2 * S_PER_NS);
+				*phc = ptp_to_lfp(&ext.ts[i][1]);
+			}
+		}
+		break;
+	}
+#endif
+	case PHC_BURST: {
+		struct ptp_sys_offset off;
+
+		memset(&off, '\0', sizeof(off));
+		off.n_samples = SAMPLES;
+		if (ioctl(up->fd, PTP_SYS_OFFSET, &off) < 0)
+			return false;
+		for (unsigned int i = 0; i < off.n_samples; i++) {
+			int64_t before = ptp_ns(&off.ts[2 * i]);
+			int64_t after = ptp_ns(&off.ts[2 * i + 2]);
+
+			if (after - before < best) {
+				best = after - before;
+				*sys = ptp_to_lfp(&off.ts[2 * i]);
+				*sys += dtolfp((double)best / 2 * S_PER_NS);
+				*phc = ptp_to_lfp(&off.ts[2 * i + 1]);
+			}
+		}
+		break;
+	}
+	default:
+		return false;	/* not in these kernel headers */
+	}
+	if (INT64_MAX == best)
+		return false;
+	*delay = best;
+	return true;
+}
+
+
+/*
+ * phc_start - open the device and find out how to read it
+ */
+static bool
+phc_start(
+	int unit,		/* unit number */
+	struct peer *peer	/* peer structure pointer */
+	)
+{
+	struct refclockproc *pp = peer->procptr;
+	struct phcunit *up;
+	char	device[20];
+	const char *path;
+	l_fp	phc, sys;
+	int64_t	delay;
+
+	snprintf(device, sizeof(device), DEVICE, unit);
+	path = peer->cfg.path ? peer->cfg.path : device;
+
+	up = emalloc_zero(sizeof(struct phcunit));
+	up->fd = open(path, O_RDONLY);
+	if (up->fd < 0) {
+		msyslog(LOG_ERR, "REFCLOCK: refclock_phc: %s open failed: %s",
+			path, strerror(errno));
+		free(up);
+		return false;
+	}
+	for (up->method = PHC_PRECISE; ; up->method++) {
+		if (phc_read(up, &phc, &sys, &delay))
+			break;
+		if (PHC_BURST == up->method) {
+			msyslog(LOG_ERR,
+				"REFCLOCK: refclock_phc: %s cannot be read: %s",
+				path, strerror(errno));
+			close(up->fd);
+			free(up);
+			return false;
+		}
+	}
+	msyslog(LOG_INFO, "REFCLOCK: refclock_phc: %s, %s offsets",
+		path, method_name[up->method]);
+
+	pp->unitptr = up;
+	pp->clockname = NAME;
+	pp->clockdesc = DESCRIPTION;
+	memcpy((char *)&pp->refid, REFID, REFIDLEN);
+	peer->precision = PRECISION;
+	peer->sstclktype = CTL_SST_TS_ATOM;
+	return true;
+}
+
+
+/*
+ * phc_shutdown - shut down the clock
+ */
+static void
+phc_shutdown(
+	struct refclockproc *pp	/* refclock structure pointer */
+	)
+{
+	struct phcunit *up = pp->unitptr;
+
+	if (NULL == up)
+		return;
+	close(up->fd);
+	free(up);
+}
+
+
+/*
+ * phc_timer - called once per second, takes a sample
+ */
+static void
+phc_timer(
+	int	unit,		/* unit number (not used) */
+	struct peer *peer	/* peer structure pointer */
+	)
+{
+	struct refclockproc *pp = peer->procptr;
+	struct phcunit *up = pp->unitptr;
+	l_fp	phc, sys;
+	int64_t	delay;
+
+	UNUSED_ARG(unit);
+
+	if (!phc_read(up, &phc, &sys, &delay)) {
+		up->bad++;
+		return;
+	}
+	if (pp->sloppyclockflag & CLK_FLAG1) {
+		if (0 == sys_tai) {
+			up->notai++;
+			return;
+		}
+		phc -= lfpinit((int32_t)sys_tai, 0);
+	}
+	if (0 == up->good || delay < up->delay)
+		up->delay = delay;
+	up->good++;
+	refclock_process_offset(pp, phc, sys, pp->fudgetime1);
+}
+
+
+/*
+ * phc_fast - one reading for the fast loop, outside the median filter
+ */
+static bool
+phc_fast(
+	int	unit,		/* unit number (not used) */
+	struct peer *peer,	/* peer structure pointer */
+	double	*offset		/* PHC less system clock, plus time1 */
+	)
+{
+	struct refclockproc *pp = peer->procptr;
+	struct phcunit *up = pp->unitptr;
+	l_fp	phc, sys;
+	int64_t	delay;
+
+	UNUSED_ARG(unit);
+
+	if (!phc_read(up, &phc, &sys, &delay))
+		return false;
+	if (pp->sloppyclockflag & CLK_FLAG1) {
+		if (0 == sys_tai)
+			return false;
+		phc -= lfpinit((int32_t)sys_tai, 0);
+	}
+	phc -= sys;
+	*offset = lfptod(phc) + pp->fudgetime1;
+	return true;
+}
+
+
+/*
+ * phc_poll - called by the transmit procedure
+ */
+static void
+phc_poll(
+	int unit,		/* unit number (not used) */
+	struct peer *peer	/* peer structure pointer */
+	)
+{
+	struct refclockproc *pp = peer->procptr;
+	struct phcunit *up = pp->unitptr;
+
+	UNUSED_ARG(unit);
+
+	pp->polls++;
+	if (pp->coderecv != pp->codeproc) {
+		/* a bracket wider than 1 ns says how well we read */
+		peer->precision = (up->delay > 1) ?
+		    (int8_t)ilogb((double)up->delay * S_PER_NS) + 1 :
+		    PRECISION;
+		pp->lastref = pp->lastrec;
+		refclock_receive(peer);
+	} else if (up->bad >= up->notai) {
+		refclock_report(peer, CEVNT_FAULT);
+	} else {
+		refclock_report(peer, CEVNT_BADTIME);
+	}
+
+	if (pp->sloppyclockflag & CLK_FLAG4)
+		mprintf_clock_stats(peer, "%s %d %d %d %lld",
+				    method_name[up->method], up->good,
+				    up->bad, up->notai, (long long)up->delay);
+	up->good = up->bad = up->notai = 0;
+}
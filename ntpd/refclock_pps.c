@@ -107,6 +107,7 @@ struct	refclock refclock_pps = {
 	NULL,			/* control (not used) */
 	NULL,			/* initialize driver (not used) */
 	pps_timer,		/* called once per second */
+	NULL			/* fast loop reading - not used */
 };
 
 
@@ -193,7 +194,7 @@ pps_timer(
 	rc = refclock_catcher(peer, &up->ppsctl, pp->sloppyclockflag);
         switch (rc) {
             case PPS_OK:
-                up->pcount++;
+                up->pcount += up->ppsctl.samples;
                 break;
             default:
             case PPS_SETUP:
@@ -212,10 +213,18 @@ pps_timer(
 
 	/*
 	 * If flag4 is lit, record each second offset to clockstats.
-	 * That's so we can make awesome Allan deviation plots.
+	 * That's so we can make awesome Allan deviation plots.  The
+	 * capture thread may have queued more than one since last time.
 	 */
 	if (pp->sloppyclockflag & CLK_FLAG4) {
-		mprintf_clock_stats(peer, "%.9f", pp->filter[pp->coderecv]);
+		int i = up->ppsctl.samples - 1;
+
+		if (i >= pp->nstage)
+			i = pp->nstage - 1;
+		for (; i >= 0; i--)
+			mprintf_clock_stats(peer, "%.9f",
+			    pp->filter[(pp->coderecv + pp->nstage + 1 - i) %
+				       (pp->nstage + 1)]);
 	}
 }
 
@@ -249,10 +258,17 @@ pps_poll(
 
 	pp->polls++;
 
-	mprintf_clock_stats(peer,
-	    "%lu %d %d %d %d",
-	    up->ppsctl.sequence,
-	    up->pcount, up->scount, up->kcount, up->rcount);
+	if (NULL != pp->ppscap)
+		mprintf_clock_stats(peer,
+		    "%lu %d %d %d %d %lu %lu",
+		    up->ppsctl.sequence,
+		    up->pcount, up->scount, up->kcount, up->rcount,
+		    up->ppsctl.missed, up->ppsctl.dropped);
+	else
+		mprintf_clock_stats(peer,
+		    "%lu %d %d %d %d",
+		    up->ppsctl.sequence,
+		    up->pcount, up->scount, up->kcount, up->rcount);
 	up->pcount = up->scount = up->kcount = up->rcount = 0;
 
 	if (pp->codeproc == pp->coderecv) {
@@ -28,7 +28,11 @@
 
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <assert.h>
+#include <math.h>
 #include <unistd.h>
 #include <stdio.h>
 
@@ -54,6 +58,7 @@
  * Mode flags
  */
 #define SHM_MODE_PRIVATE 0x0001
+#define SHM_MODE_RING	 0x0002
 
 /*
  * Function prototypes
@@ -63,6 +68,10 @@ static  void    shm_shutdown    (struct refclockproc *peer);
 static  void    shm_poll        (int unit, struct peer *peer);
 static  void    shm_timer       (int unit, struct peer *peer);
 static	void	shm_clockstats  (int unit, struct peer *peer);
+static	void	shm_take	(int unit, struct peer *peer);
+static	void	shm_ring_take	(int unit, struct peer *peer);
+static	bool	shm_fast	(int unit, struct peer *peer, double *offset);
+static	void	shm_bell	(struct recvbuf *rbufp);
 static	void	shm_control	(int unit, const struct refclockstat * in_st,
 				 struct refclockstat * out_st, struct peer *peer);
 
@@ -77,33 +86,52 @@ struct  refclock refclock_shm = {
 	shm_control,		/* control settings */
 	NULL,			/* not used: init */
 	shm_timer,              /* once per second */
+	shm_fast		/* newest ring sample, for the fast loop */
 };
 
-struct shmTime {
-	int    mode; /* 0 - if valid is set:
-		      *       use values,
-		      *       clear valid
-		      * 1 - if valid is set:
-		      *       if count before and after read of values is equal,
-		      *         use values
-		      *       clear valid
-		      */
-	volatile int    count;
-	time_t		clockTimeStampSec;
-	int		clockTimeStampUSec;
-	time_t		receiveTimeStampSec;
-	int		receiveTimeStampUSec;
-	int		leap;
-	int		precision;
-	int		nsamples;
-	volatile int    valid;
-	unsigned	clockTimeStampNSec;	/* Unsigned ns timestamps */
-	unsigned	receiveTimeStampNSec;	/* Unsigned ns timestamps */
-	int		dummy[8];
+/*
+ * The ring segment, used instead of the one above when mode bit 1 is
+ * set.  A producer with many samples a second publishes each one into
+ * the next slot rather than waiting for ntpd to clear valid.  To
+ * publish sample number n it does
+ *
+ *	slot = &ring->slot[n % ring->nslots];
+ *	slot->lock++;				(now odd)
+ *	barrier; slot->seq = n; fill in the rest; barrier;
+ *	slot->lock++;				(even again)
+ *	barrier; ring->head = n + 1;
+ *
+ * Each second ntpd takes every sample from the last one it saw up to
+ * head.  It checks lock before and after copying a slot and seq after,
+ * so a producer that lapped it meanwhile is caught.  The segment key is
+ * "NTR0" plus the unit, beside the "NTP0" one.
+ */
+#define SHM_RING_KEY	0x4e545230	/* NTR0 */
+#define SHM_RING_SLOTS	128		/* divides 2^32, so seq may wrap */
+
+struct shmRingSlot {
+	volatile uint32_t lock;		/* odd while being written */
+	uint32_t	seq;		/* producer sequence number */
+	int64_t		clockTimeStampSec;
+	int64_t		receiveTimeStampSec;
+	uint32_t	clockTimeStampNSec;
+	uint32_t	receiveTimeStampNSec;
+	int32_t		leap;
+	int32_t		precision;
+};
+
+struct shmRing {
+	volatile uint32_t head;		/* samples published so far */
+	uint32_t	nslots;		/* SHM_RING_SLOTS, set by ntpd */
+	struct shmRingSlot slot[SHM_RING_SLOTS];
 };
 
 struct shmunit {
 	struct shmTime *shm;	/* pointer to shared memory segment */
+	struct shmRing *ring;	/* or to the ring segment */
+	uint32_t tail;		/* next ring sample to take */
+	uint32_t fastseen;	/* ring head at the last fast reading */
+	char *bell;		/* doorbell socket path, or NULL */
 	int forall;		/* access for all UIDs?	*/
 
 	/* debugging/monitoring counters - reset when printed */
@@ -118,36 +146,87 @@ struct shmunit {
 };
 
 
-static struct shmTime*
-getShmTime(
+static struct shmRing*
+getShmRing(
 	int unit,
 	bool forall
 	)
 {
-	struct shmTime *p = NULL;
-
+	struct shmRing *p;
 	int shmid;
 
-	/* 0x4e545030 is NTP0.
-	 * Big units will give non-ascii but that's OK
-	 * as long as everybody does it the same way.
-	 */
-	shmid=shmget(0x4e545030 + unit, sizeof (struct shmTime),
-		      IPC_CREAT | (forall ? 0666 : 0600));
-	if (shmid == -1) { /* error */
-		msyslog(LOG_ERR, "REFCLOCK: SHM shmget (unit %d): %s", unit, strerror(errno));
+	shmid = shmget(SHM_RING_KEY + unit, sizeof(struct shmRing),
+		       IPC_CREAT | (forall ? 0666 : 0600));
+	if (shmid == -1) {
+		msyslog(LOG_ERR, "REFCLOCK: SHM ring shmget (unit %d): %s",
+			unit, strerror(errno));
 		return NULL;
 	}
-	p = (struct shmTime *)shmat (shmid, 0, 0);
-	if (p == (struct shmTime *)-1) { /* error */
-		msyslog(LOG_ERR, "REFCLOCK: SHM shmat (unit %d): %s", unit, strerror(errno));
+	p = (struct shmRing *)shmat(shmid, 0, 0);
+	if (p == (struct shmRing *)-1) {
+		msyslog(LOG_ERR, "REFCLOCK: SHM ring shmat (unit %d): %s",
+			unit, strerror(errno));
 		return NULL;
 	}
-
+	p->nslots = SHM_RING_SLOTS;
 	return p;
 }
 
 
+/*
+ * shm_bell_open - bind the doorbell socket named by the path option.
+ * A producer sends a datagram to it, contents ignored, after each
+ * sample; the main loop then wakes us and we read the segment at once
+ * instead of at the next second.  On failure we just poll.
+ */
+static void
+shm_bell_open(
+	int unit,
+	struct peer *peer
+	)
+{
+	struct refclockproc * const pp = peer->procptr;
+	struct shmunit *      const up = pp->unitptr;
+	const char *path = peer->cfg.path;
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		msyslog(LOG_ERR, "REFCLOCK: SHM(%d) doorbell path too long: %s",
+			unit, path);
+		return;
+	}
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		msyslog(LOG_ERR, "REFCLOCK: SHM(%d) doorbell socket: %s",
+			unit, strerror(errno));
+		return;
+	}
+	ZERO(sun);
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	(void)unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		msyslog(LOG_ERR, "REFCLOCK: SHM(%d) doorbell bind %s: %s",
+			unit, path, strerror(errno));
+		close(fd);
+		return;
+	}
+	(void)chmod(path, up->forall ? 0666 : 0600);
+	make_socket_nonblocking(fd);
+
+	pp->io.clock_recv = shm_bell;
+	pp->io.fd = fd;
+	if (!io_addclock(&pp->io)) {
+		close(fd);
+		(void)unlink(path);
+		pp->io.fd = -1;
+		return;
+	}
+	up->bell = estrdup(path);
+}
+
+
 /*
  * shm_start - attach to shared memory
  */
@@ -167,24 +246,33 @@ shm_start(
 
 	up->forall = (unit >= 2) && !(peer->cfg.mode & SHM_MODE_PRIVATE);
 
-	up->shm = getShmTime(unit, up->forall);
+	if (peer->cfg.mode & SHM_MODE_RING) {
+		up->ring = getShmRing(unit, up->forall);
+		if (up->ring != NULL)
+			up->tail = up->ring->head;	/* skip any backlog */
+	} else
+		up->shm = refclock_shm_attach(unit, up->forall);
 
 	/*
 	 * Initialize miscellaneous peer variables
 	 */
 	memcpy((char *)&pp->refid, REFID, REFIDLEN);
 	peer->sstclktype = CTL_SST_TS_UHF;
-	if (up->shm != 0) {
+	if (up->shm != NULL || up->ring != NULL) {
 		pp->unitptr = up;
-		up->shm->precision = PRECISION;
-		peer->precision = (int8_t)up->shm->precision;
-		up->shm->valid = 0;
-		up->shm->nsamples = NSAMPLES;
+		peer->precision = PRECISION;
+		if (up->shm != NULL) {
+			up->shm->precision = PRECISION;
+			up->shm->valid = 0;
+			up->shm->nsamples = NSAMPLES;
+		}
 		pp->clockname = NAME;
 		pp->clockdesc = DESCRIPTION;
 		/* items to be changed later in 'shm_control()': */
 		up->max_delay = 5;
 		up->max_delta = 4 * SECSPERHR;
+		if (peer->cfg.path != NULL)
+			shm_bell_open(unit, peer);
 		return true;
 	} else {
 		free(up);
@@ -242,7 +330,15 @@ shm_shutdown(
 		return;
 	}
 
-	(void)shmdt((char *)up->shm);
+	if (up->shm != NULL)
+		(void)shmdt((char *)up->shm);
+	if (up->ring != NULL)
+		(void)shmdt((char *)up->ring);
+	if (up->bell != NULL) {
+		io_closeclock(&pp->io);
+		(void)unlink(up->bell);
+		free(up->bell);
+	}
 
 	free(up);
 }
@@ -275,7 +371,7 @@ shm_poll(
 		/* have some samples, everything OK */
 		pp->lastref = pp->lastrec;
 		refclock_receive(peer);
-	} else if (NULL == up->shm) { /* is this possible at all? */
+	} else if (NULL == up->shm && NULL == up->ring) {
 		/* we're out of business without SHM access */
 		refclock_report(peer, CEVNT_FAULT);
 	} else if (major_error == up->clash) {
@@ -293,159 +389,127 @@ shm_poll(
 }
 
 
-enum segstat_t {
-	OK, NO_SEGMENT, NOT_READY, BAD_MODE, CLASH
-};
-
-struct shm_stat_t {
-	int status;
-	int mode;
-	struct timespec tvc, tvr, tvt;
-	int precision;
-	int leap;
-};
-
 static inline void memory_barrier(void) {
 #if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
 	atomic_thread_fence(memory_order_seq_cst);
 #endif /* HAVE_STDATOMIC_H */
 }
 
-static enum segstat_t shm_query(volatile struct shmTime *shm_in, struct shm_stat_t *shm_stat) {
-/* try to grab a sample from the specified SHM segment */
-	volatile struct shmTime shmcopy, *shm = shm_in;
-	volatile int cnt;
+/*
+ * shm_feed - sanity check one sample and pass it to the median filter,
+ * or, given somewhere to put it, keep it for a batch.  Returns whether
+ * the sample was good.
+ */
+static bool
+shm_feed(
+	int unit,
+	struct peer *peer,
+	const struct shm_stat_t *shm_stat,
+	struct refclock_stamp *batch
+	)
+{
+	struct refclockproc * const pp = peer->procptr;
+	struct shmunit *      const up = pp->unitptr;
 
-	unsigned int cns_new, rns_new;
+	l_fp tsrcv;
+	l_fp tsref;
+	int c;
+	time_t tt;
 
 	/*
-	 * This is the main routine. It snatches the time from the shm
-	 * board and tacks on a local timestamp.
+	 * Add POSIX UTC seconds and fractional seconds as a timecode.
+	 * We used to unpack this to calendar time, but it is bad
+	 * practice for the driver to pretend to know calendar time;
+	 * that interpretation is best left to higher levels.
 	 */
-	if (shm == NULL) {
-		shm_stat->status = NO_SEGMENT;
-		return NO_SEGMENT;
-	}
-
-	/*@-type@*//* splint is confused about struct timespec */
-	shm_stat->tvc.tv_sec = shm_stat->tvc.tv_nsec = 0;
-	{
-		time_t now;
+	/* a_lastcode is seen as timecode with: ntpq -c cv [associd] */
+	c = snprintf(pp->a_lastcode, sizeof(pp->a_lastcode), "%ld.%09ld",
+		     (long)shm_stat->tvt.tv_sec, (long)shm_stat->tvt.tv_nsec);
+	pp->lencode = (c < (int)sizeof(pp->a_lastcode)) ? c : 0;
 
-		time(&now);
-		shm_stat->tvc.tv_sec = now;
+	/* check 1: age control of local time stamp */
+	tt = shm_stat->tvc.tv_sec - shm_stat->tvr.tv_sec;
+	if (tt < 0 || tt > up->max_delay) {
+		DPRINT(1, ("%s:SHM(%d) stale/bad receive time, delay=%llds\n",
+			   refclock_name(peer), unit, (long long)tt));
+		up->bad++;
+		msyslog (LOG_ERR,
+                         "SHM(%d): stale/bad receive time, delay=%llds",
+			 unit, (long long)tt);
+		return false;
 	}
 
-	/* relying on word access to be atomic here */
-	if (shm->valid == 0) {
-		shm_stat->status = NOT_READY;
-		return NOT_READY;
+	/* check 2: delta check */
+	tt = shm_stat->tvr.tv_sec - shm_stat->tvt.tv_sec - (shm_stat->tvr.tv_nsec < shm_stat->tvt.tv_nsec);
+	if (tt < 0) {
+		tt = -tt;
+	}
+	if (up->max_delta > 0 && tt > up->max_delta) {
+		DPRINT(1, ("%s: SHM(%d) diff limit exceeded, delta=%llds\n",
+			   refclock_name(peer), unit, (long long)tt));
+		up->bad++;
+		msyslog (LOG_ERR,
+                         "SHM(%d): difference limit exceeded, delta=%llds\n",
+			 unit, (long long)tt);
+		return false;
 	}
 
-	cnt = shm->count;
+	/* if we really made it to this point... we're winners! */
+	DPRINT(2, ("%s: SHM(%d) feeding data\n", refclock_name(peer), unit));
+	tsrcv = tspec_stamp_to_lfp(shm_stat->tvr);
+	tsref = tspec_stamp_to_lfp(shm_stat->tvt);
+	pp->leap = (uint8_t)shm_stat->leap;
+	peer->precision = (int8_t)shm_stat->precision;
+	if (batch != NULL) {
+		batch->ref = tsref;
+		batch->rec = tsrcv;
+		batch->err = ldexp(1., shm_stat->precision);
+	} else
+		refclock_process_offset(pp, tsref, tsrcv, pp->fudgetime1);
+	up->good++;
+	return true;
+}
 
-	/*
-	 * This is proof against concurrency issues if either
-	 * (a) the memory_barrier() call works on this host, or
-	 * (b) memset compiles to an uninterruptible single-instruction bitblt.
-	 */
-	memory_barrier();
-	/* structure copy, to preserve volatile */
-	shmcopy = *shm;
-	shm->valid = 0;
-	memory_barrier();
 
-	/*
-	 * Clash detection in case neither (a) nor (b) was true.
-	 * Not supported in mode 0, and word access to the count field
-	 * must be atomic for this to work.
-	 */
-	if (shmcopy.mode > 0 && cnt != shm->count) {
-		shm_stat->status = CLASH;
-		return (enum segstat_t)shm_stat->status;
-	}
+/*
+ * shm_timer - called once every second.
+ *
+ * Without a doorbell, this is when we look at the segment.
+ */
+static void
+shm_timer(
+	int unit,
+	struct peer *peer
+	)
+{
+	struct shmunit * const up = peer->procptr->unitptr;
 
-	shm_stat->status = OK;
-	shm_stat->mode = shmcopy.mode;
-
-	switch (shmcopy.mode) {
-	    case 0:
-		shm_stat->tvr.tv_sec	= shmcopy.receiveTimeStampSec;
-		shm_stat->tvr.tv_nsec	= shmcopy.receiveTimeStampUSec * 1000;
-		rns_new		= shmcopy.receiveTimeStampNSec;
-		shm_stat->tvt.tv_sec	= shmcopy.clockTimeStampSec;
-		shm_stat->tvt.tv_nsec	= shmcopy.clockTimeStampUSec * 1000;
-		cns_new		= shmcopy.clockTimeStampNSec;
-
-		/* Since the following comparisons are between unsigned
-		** variables they are always well defined, and any
-		** (signed) underflow will turn into very large unsigned
-		** values, well above the 1000 cutoff.
-		**
-		** Note: The usecs *must* be a *truncated*
-		** representation of the nsecs. This code will fail for
-		** *rounded* usecs, and the logic to deal with
-		** wrap-arounds in the presence of rounded values is
-		** much more convoluted.
-		*/
-		if (   ((cns_new - (unsigned)shm_stat->tvt.tv_nsec) < 1000)
-		       && ((rns_new - (unsigned)shm_stat->tvr.tv_nsec) < 1000)) {
-			shm_stat->tvt.tv_nsec = (long)cns_new;
-			shm_stat->tvr.tv_nsec = (long)rns_new;
-		}
-		/* At this point shm_stat->tvr and shm_stat->tvt contain valid ns-level
-		** timestamps, possibly generated by extending the old
-		** us-level timestamps
-		*/
-		break;
-
-	    case 1:
-
-		shm_stat->tvr.tv_sec	= shmcopy.receiveTimeStampSec;
-		shm_stat->tvr.tv_nsec	= shmcopy.receiveTimeStampUSec * 1000;
-		rns_new		= shmcopy.receiveTimeStampNSec;
-		shm_stat->tvt.tv_sec	= shmcopy.clockTimeStampSec;
-		shm_stat->tvt.tv_nsec	= shmcopy.clockTimeStampUSec * 1000;
-		cns_new		= shmcopy.clockTimeStampNSec;
-
-		/* See the case above for an explanation of the
-		** following test.
-		*/
-		if (   ((cns_new - (unsigned)shm_stat->tvt.tv_nsec) < 1000)
-		       && ((rns_new - (unsigned)shm_stat->tvr.tv_nsec) < 1000)) {
-			shm_stat->tvt.tv_nsec = (long)cns_new;
-			shm_stat->tvr.tv_nsec = (long)rns_new;
-		}
-		/* At this point shm_stat->tvr and shm_stat->tvt contains valid ns-level
-		** timestamps, possibly generated by extending the old
-		** us-level timestamps
-		*/
-		break;
-
-	    default:
-		shm_stat->status = BAD_MODE;
-		break;
-	}
-	/*@-type@*/
+	up->ticks++;
+	if (up->bell == NULL)
+		shm_take(unit, peer);
+}
 
-	/*
-	 * leap field is not a leap offset but a leap notification code.
-	 * The values are magic numbers used by NTP and set by GPSD, if at all, in
-	 * the subframe code.
-	 */
-	shm_stat->leap = shmcopy.leap;
-	shm_stat->precision = shmcopy.precision;
 
-	return (enum segstat_t)shm_stat->status;
+/*
+ * shm_bell - the producer rang, look at the segment now
+ */
+static void
+shm_bell(
+	struct recvbuf *rbufp
+	)
+{
+	struct peer * const peer = rbufp->recv_peer;
+
+	shm_take(peer->procptr->refclkunit, peer);
 }
 
+
 /*
- * shm_timer - called once every second.
- *
- * This tries to grab a sample from the SHM segment, filtering bad ones
+ * shm_take - try to grab a sample from the SHM segment, filtering bad
+ * ones
  */
 static void
-shm_timer(
+shm_take(
 	int unit,
 	struct peer *peer
 	)
@@ -455,19 +519,17 @@ shm_timer(
 
 	volatile struct shmTime *shm;
 
-	l_fp tsrcv;
-	l_fp tsref;
-	int c;
-	time_t tt;
-
 	enum segstat_t status;
 	struct shm_stat_t shm_stat;
 
-	up->ticks++;
+	if (peer->cfg.mode & SHM_MODE_RING) {
+		shm_ring_take(unit, peer);
+		return;
+	}
 	if ((shm = up->shm) == NULL) {
 		/* try to map again - this may succeed if meanwhile some-
 		body has ipcrm'ed the old (unaccessible) shared mem segment */
-		shm = up->shm = getShmTime(unit, up->forall);
+		shm = up->shm = refclock_shm_attach(unit, up->forall);
 		if (shm == NULL) {
 			DPRINT(1, ("%s: no SHM segment\n",refclock_name(peer)));
 			return;
@@ -475,28 +537,28 @@ shm_timer(
 	}
 
 	/* query the segment, atomically */
-	status = shm_query(shm, &shm_stat);
+	status = refclock_shm_query(shm, &shm_stat);
 
 	switch (status) {
-	case OK:
+	case SHM_OK:
 	    DPRINT(2, ("%s: SHM(%d) type %d sample\n",
 		       refclock_name(peer), unit, shm_stat.mode));
 	    break;
-	case NO_SEGMENT:
+	case SHM_NO_SEGMENT:
 	    /* should never happen, but is harmless */
 	    return;
-	case NOT_READY:
+	case SHM_NOT_READY:
 	    DPRINT(1, ("%s: SHM(%d) not ready\n",refclock_name(peer), unit));
 	    up->notready++;
 	    return;
-	case BAD_MODE:
+	case SHM_BAD_MODE:
 	    DPRINT(1, ("%s: SHM(%d) type blooper, mode=%d\n",
 		       refclock_name(peer), unit, shm->mode));
 	    up->bad++;
 	    msyslog (LOG_ERR, "SHM(%d): bad mode found in shared memory: %d",
 		     unit, shm->mode);
 	    return;
-	case CLASH:
+	case SHM_CLASH:
 	    DPRINT(1, ("%s: type 1 access clash\n",
 		       refclock_name(peer)));
 	    msyslog (LOG_NOTICE, "SHM(%d): access clash in shared memory",
@@ -513,54 +575,136 @@ shm_timer(
 	}
 
 
-	/*
-	 * Add POSIX UTC seconds and fractional seconds as a timecode.
-	 * We used to unpack this to calendar time, but it is bad
-	 * practice for the driver to pretend to know calendar time;
-	 * that interpretation is best left to higher levels.
-	 */
-	/* a_lastcode is seen as timecode with: ntpq -c cv [associd] */
-	c = snprintf(pp->a_lastcode, sizeof(pp->a_lastcode), "%ld.%09ld",
-		     (long)shm_stat.tvt.tv_sec, (long)shm_stat.tvt.tv_nsec);
-	pp->lencode = (c < (int)sizeof(pp->a_lastcode)) ? c : 0;
+	shm_feed(unit, peer, &shm_stat, NULL);
+}
 
-	/* check 1: age control of local time stamp */
-	tt = shm_stat.tvc.tv_sec - shm_stat.tvr.tv_sec;
-	if (tt < 0 || tt > up->max_delay) {
-		DPRINT(1, ("%s:SHM(%d) stale/bad receive time, delay=%llds\n",
-			   refclock_name(peer), unit, (long long)tt));
-		up->bad++;
-		msyslog (LOG_ERR,
-                         "SHM(%d): stale/bad receive time, delay=%llds",
-			 unit, (long long)tt);
-		return;
-	}
 
-	/* check 2: delta check */
-	tt = shm_stat.tvr.tv_sec - shm_stat.tvt.tv_sec - (shm_stat.tvr.tv_nsec < shm_stat.tvt.tv_nsec);
-	if (tt < 0) {
-		tt = -tt;
+/*
+ * shm_ring_take - take every sample published to the ring since the
+ * last call.  Samples the producer overwrote before we got to them
+ * count as clashes.
+ */
+static void
+shm_ring_take(
+	int unit,
+	struct peer *peer
+	)
+{
+	struct refclockproc * const pp = peer->procptr;
+	struct shmunit *      const up = pp->unitptr;
+
+	struct shmRing *ring;
+	struct shm_stat_t shm_stat;
+	struct refclock_stamp batch[SHM_RING_SLOTS];
+	size_t n = 0;
+	uint32_t head;
+	time_t now;
+
+	if ((ring = up->ring) == NULL) {
+		/* try to map again, as for the single-sample segment */
+		ring = up->ring = getShmRing(unit, up->forall);
+		if (ring == NULL) {
+			DPRINT(1, ("%s: no SHM ring\n", refclock_name(peer)));
+			return;
+		}
+		up->tail = ring->head;
 	}
-	if (up->max_delta > 0 && tt > up->max_delta) {
-		DPRINT(1, ("%s: SHM(%d) diff limit exceeded, delta=%llds\n",
-			   refclock_name(peer), unit, (long long)tt));
-		up->bad++;
-		msyslog (LOG_ERR,
-                         "SHM(%d): difference limit exceeded, delta=%llds\n",
-			 unit, (long long)tt);
+
+	head = ring->head;
+	memory_barrier();
+	if (head == up->tail) {
+		DPRINT(1, ("%s: SHM(%d) ring empty\n",
+			   refclock_name(peer), unit));
+		up->notready++;
 		return;
 	}
+	if (head - up->tail > SHM_RING_SLOTS) {
+		/* the producer lapped us, the oldest are gone */
+		up->clash += (int)(head - up->tail - SHM_RING_SLOTS);
+		up->tail = head - SHM_RING_SLOTS;
+	}
 
-	/* if we really made it to this point... we're winners! */
-	DPRINT(2, ("%s: SHM(%d) feeding data\n", refclock_name(peer), unit));
-	tsrcv = tspec_stamp_to_lfp(shm_stat.tvr);
-	tsref = tspec_stamp_to_lfp(shm_stat.tvt);
-	pp->leap = (uint8_t)shm_stat.leap;
-	peer->precision = (int8_t)shm_stat.precision;
-	refclock_process_offset(pp, tsref, tsrcv, pp->fudgetime1);
-	up->good++;
+	time(&now);
+	ZERO(shm_stat);
+	shm_stat.status = SHM_OK;
+	shm_stat.mode = SHM_MODE_RING;
+	shm_stat.tvc.tv_sec = now;
+	for (; up->tail != head; up->tail++) {
+		volatile struct shmRingSlot *slot =
+		    &ring->slot[up->tail % SHM_RING_SLOTS];
+		volatile struct shmRingSlot copy;
+		uint32_t lock;
+
+		lock = slot->lock;
+		memory_barrier();
+		copy = *slot;
+		memory_barrier();
+		if ((lock & 1) || lock != slot->lock ||
+		    copy.seq != up->tail) {
+			DPRINT(1, ("%s: SHM(%d) ring clash at %u\n",
+				   refclock_name(peer), unit, up->tail));
+			up->clash++;
+			continue;
+		}
+		shm_stat.tvr.tv_sec = (time_t)copy.receiveTimeStampSec;
+		shm_stat.tvr.tv_nsec = (long)copy.receiveTimeStampNSec;
+		shm_stat.tvt.tv_sec = (time_t)copy.clockTimeStampSec;
+		shm_stat.tvt.tv_nsec = (long)copy.clockTimeStampNSec;
+		shm_stat.leap = copy.leap;
+		shm_stat.precision = copy.precision;
+		if (shm_feed(unit, peer, &shm_stat, &batch[n]))
+			n++;
+	}
+	refclock_process_batch(pp, batch, n, pp->fudgetime1);
+}
+
+
+/*
+ * shm_fast - the newest ring sample, if one came since the last call.
+ * The fast loop reads it between the timer's takes, which still put
+ * every sample in the median filter.
+ */
+static bool
+shm_fast(
+	int unit,
+	struct peer *peer,
+	double *offset
+	)
+{
+	struct refclockproc * const pp = peer->procptr;
+	struct shmunit *      const up = pp->unitptr;
+
+	volatile struct shmRingSlot *slot;
+	struct timespec tvr, tvt;
+	uint32_t head, lock, seq;
+	l_fp tsref;
+
+	UNUSED_ARG(unit);
+	if (NULL == up->ring)
+		return false;
+	head = up->ring->head;
+	memory_barrier();
+	if (head == up->fastseen)
+		return false;
+	up->fastseen = head;
+	slot = &up->ring->slot[(head - 1) % SHM_RING_SLOTS];
+	lock = slot->lock;
+	memory_barrier();
+	seq = slot->seq;
+	tvr.tv_sec = (time_t)slot->receiveTimeStampSec;
+	tvr.tv_nsec = (long)slot->receiveTimeStampNSec;
+	tvt.tv_sec = (time_t)slot->clockTimeStampSec;
+	tvt.tv_nsec = (long)slot->clockTimeStampNSec;
+	memory_barrier();
+	if ((lock & 1) || lock != slot->lock || seq != head - 1)
+		return false;
+	tsref = tspec_stamp_to_lfp(tvt);
+	tsref -= tspec_stamp_to_lfp(tvr);
+	*offset = lfptod(tsref) + pp->fudgetime1;
+	return true;
 }
 
+
 /*
  * shm_clockstats - dump and reset counters
  */
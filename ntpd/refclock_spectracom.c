@@ -153,7 +153,8 @@ struct	refclock refclock_spectracom = {
 	spectracom_poll,		/* transmit poll message */
 	SPECTRACOM_CONTROL,		/* fudge set/change notification */
 	NULL,				/* initialize driver (not used) */
-	spectracom_timer		/* called once per second */
+	spectracom_timer,		/* called once per second */
+	NULL				/* fast loop reading - not used */
 };
 
 
@@ -37,6 +37,7 @@
 #include "ntp_stdlib.h"
 #include "timespecops.h"
 #include "gpstolfp.h"
+#include "tsip_frame.h"
 
 /*
  * GPS Definitions
@@ -62,20 +63,16 @@
 
 /* parse consts */
 #define RMAX 172 /* TSIP packet 0x58 can be 172 bytes */
-#define DLE 0x10
-#define ETX 0x03
+#define DLE TSIP_DLE
+#define ETX TSIP_ETX
 #define MSG_TSIP 0
 #define MSG_PRAECIS 1
 #define SPSTAT_LEN 34 /* length of reply from Praecis SPSTAT message */
 
-/* parse states */
-#define TSIP_PARSED_EMPTY       0
-#define TSIP_PARSED_FULL        1
-#define TSIP_PARSED_DLE_1       2
-#define TSIP_PARSED_DATA        3
-#define TSIP_PARSED_DLE_2       4
-#define TSIP_PARSED_ASCII       5
-#define TSIP_PARSED_PARITY      6
+/* Praecis ASCII reply states, TSIP packets are left to tsip_frame() */
+#define ASCII_EMPTY	0
+#define ASCII_TEXT	1
+#define ASCII_PARITY	2
 
 #define mb(_X_) (up->rpt_buf[(_X_ + 1)]) /* shortcut for buffer access	*/
 
@@ -105,9 +102,10 @@ struct trimble_unit {
 	int			samples;	/* samples in filter this poll */
 	unsigned char		UTC_flags;	/* UTC & leap second flag */
 	unsigned char		trk_status;	/* reported tracking status */
-	char			rpt_status;	/* TSIP Parser State */
-	size_t 			rpt_cnt;	/* TSIP packet length so far */
+	char			rpt_status;	/* Praecis ASCII parser state */
+	size_t 			rpt_cnt;	/* packet length, less the ID */
 	unsigned char 		rpt_buf[RMAX];	/* packet assembly buffer */
+	struct tsip_framer	frame;		/* TSIP framing into rpt_buf */
 	int			type;		/* Clock mode type */
 	bool			use_event;	/* receiver has event input */
 	bool			event_reply;	/* response to event input has been received */
@@ -180,7 +178,8 @@ struct refclock refclock_trimble = {
 	trimble_poll,		/* transmit poll message */
 	NULL,			/* control - not used  */
 	NULL,			/* initialize driver (not used) */
-	trimble_timer		/* called at 1Hz by mainloop */
+	trimble_timer,		/* called at 1Hz by mainloop */
+	NULL			/* fast loop reading - not used */
 };
 
 /* Extract the clock type from the mode setting */
@@ -536,8 +535,10 @@ trimble_start (
 	memcpy((char *)&pp->refid, REFID, REFIDLEN);
 
 	up->unit = (short) unit;
-	up->rpt_status = TSIP_PARSED_EMPTY;
+	up->rpt_status = ASCII_EMPTY;
 	up->rpt_cnt = 0;
+	/* the ID and up to RMAX - 2 data bytes */
+	tsip_framer_init(&up->frame, up->rpt_buf, RMAX - 1, up->parity_chk);
 
 	if (ntpcal_get_build_date(&build_date)) {
 		caltogps(&build_date, 0, &up->build_week, NULL);
@@ -1112,104 +1113,88 @@ trimble_io (
 	struct trimble_unit *up;
 	struct refclockproc *pp;
 	struct peer *peer;
+	unsigned int starts;
+	int event;
 
-	char * c, * d;
+	uint8_t * c, * d;
 
 	peer = rbufp->recv_peer;
 	pp = peer->procptr;
 	up = pp->unitptr;
 
-	c = (char *) &rbufp->recv_buffer;
+	c = (uint8_t *) &rbufp->recv_buffer;
 	d = c + rbufp->recv_length;
 
-	while (c != d) {
-		switch (up->rpt_status) {
-		    case TSIP_PARSED_DLE_1:
-			switch (*c)
-			{
-			    case 0:
-			    case DLE:
-			    case ETX:
-				up->rpt_status = TSIP_PARSED_EMPTY;
-				break;
-
-			    default:
-				up->rpt_status = TSIP_PARSED_DATA;
-				/* save packet ID */
-				up->rpt_buf[0] = *c;
-				/* save packet receive time */
-				up->p_recv_time = rbufp->recv_time;
-				break;
-			}
-			break;
-
-		    case TSIP_PARSED_DATA:
-			if (*c == DLE) {
-				up->rpt_status = TSIP_PARSED_DLE_2;
-			} else if (up->parity_chk && *c == '\377')
-				up->rpt_status = TSIP_PARSED_PARITY;
-			else
-				mb(up->rpt_cnt++) = *c;
-			break;
-
-		    case TSIP_PARSED_PARITY:
-			if (*c == '\377') {
-				up->rpt_status = TSIP_PARSED_DATA;
-				mb(up->rpt_cnt++) = *c;
-			} else {
-				msyslog(LOG_ERR, "REFCLOCK: %s: detected serial parity error or receive buffer overflow",
-					refclock_name(peer));
-				up->rpt_status = TSIP_PARSED_EMPTY;
-			}
-			break;
-
-		    case TSIP_PARSED_DLE_2:
-			if (*c == DLE) {
-				up->rpt_status = TSIP_PARSED_DATA;
-				mb(up->rpt_cnt++) = *c;
-			} else if (*c == ETX) {
-				up->rpt_status = TSIP_PARSED_FULL;
-				trimble_receive(peer, MSG_TSIP);
-			} else {
-				/* error: start new report packet */
-				up->rpt_status = TSIP_PARSED_DLE_1;
-				up->rpt_buf[0] = *c;
-			}
-			break;
-
-		    case TSIP_PARSED_ASCII:
-			if (*c == '\n') {
+	while (c < d) {
+		if (ASCII_EMPTY != up->rpt_status) {
+			/* in a Praecis command reply, one byte at a time */
+			if (ASCII_PARITY == up->rpt_status) {
+				if (*c == 0xff) {
+					up->rpt_status = ASCII_TEXT;
+					mb(up->rpt_cnt++) = *c;
+				} else {
+					msyslog(LOG_ERR, "REFCLOCK: %s: detected serial parity error or receive buffer overflow",
+						refclock_name(peer));
+					up->rpt_status = ASCII_EMPTY;
+				}
+			} else if (*c == '\n') {
 				mb(up->rpt_cnt++) = *c;
-				up->rpt_status = TSIP_PARSED_FULL;
+				up->rpt_status = ASCII_EMPTY;
 				trimble_receive(peer, MSG_PRAECIS);
-			} else if (up->parity_chk && *c == '\377') {
-				up->rpt_status = TSIP_PARSED_PARITY;
+			} else if (up->parity_chk && *c == 0xff) {
+				up->rpt_status = ASCII_PARITY;
 			} else {
 				mb(up->rpt_cnt++) = *c;
 			}
-			break;
+			c++;
+			if (up->rpt_cnt > RMAX - 2) {/* additional byte for ID */
+				up->rpt_status = ASCII_EMPTY;
+				DPRINT(1, ("trimble_io: unit %d: oversize serial message (%luB) 0x%02x discarded\n",
+					up->unit, (unsigned long)up->rpt_cnt,
+					(uint8_t)up->rpt_buf[0]));
+			}
+			continue;
+		}
 
-		    case TSIP_PARSED_FULL:
-		    case TSIP_PARSED_EMPTY:
-		    default:
-			up->rpt_cnt = 0;
-			if (*c == DLE) {
-				up->rpt_status = TSIP_PARSED_DLE_1;
-			} else if (up->type == CLK_PRAECIS && NULL != strchr("6L789ADTP", *c)) {
+		if (up->type == CLK_PRAECIS && TSIP_IDLE == up->frame.state &&
+		    *c != DLE) {
+			if ('\0' != *c && NULL != strchr("6L789ADTP", *c)) {
 				/* Praecis command reply */
 				up->rpt_buf[0] = *c;
-				up->rpt_status = TSIP_PARSED_ASCII;
-			} else {
- 				up->rpt_status = TSIP_PARSED_EMPTY;
+				up->rpt_cnt = 0;
+				up->rpt_status = ASCII_TEXT;
 			}
-			break;
+			c++;
+			continue;
+		}
+
+		/* whole runs of TSIP at once, up to the end of a packet */
+		starts = up->frame.starts;
+		c += tsip_frame(&up->frame, c, (size_t)(d - c), &event);
+		if (starts != up->frame.starts) {
+			/* save packet receive time */
+			up->p_recv_time = rbufp->recv_time;
 		}
-		c++;
-		if (up->rpt_cnt > RMAX - 2) {/* additional byte for ID */
-			up->rpt_status = TSIP_PARSED_EMPTY;
+		switch (event) {
+		    case TSIP_PACKET:
+			up->rpt_cnt = up->frame.len - 1;
+			trimble_receive(peer, MSG_TSIP);
+			break;
+
+		    case TSIP_PARITY:
+			msyslog(LOG_ERR, "REFCLOCK: %s: detected serial parity error or receive buffer overflow",
+				refclock_name(peer));
+			break;
+
+		    case TSIP_OVERSIZE:
 			DPRINT(1, ("trimble_io: unit %d: oversize serial message (%luB) 0x%02x discarded\n",
-			        up->unit, (unsigned long)up->rpt_cnt,
+				up->unit, (unsigned long)up->frame.len - 1,
 				(uint8_t)up->rpt_buf[0]));
+			break;
+
+		    case TSIP_MORE:
+		    default:
+			break;
 		}
 	} /* while chars in buffer */
 }
@@ -143,7 +143,8 @@ struct	refclock refclock_true = {
 	true_poll,		/* transmit poll message */
 	NULL,			/* not used (old true_control) */
 	NULL,			/* initialize driver (not used) */
-	NULL			/* timer - not used */
+	NULL,			/* timer - not used */
+	NULL			/* fast loop reading - not used */
 };
 
 
@@ -101,7 +101,8 @@ struct	refclock refclock_zyfer = {
 	zyfer_poll,		/* transmit poll message */
 	NULL,			/* not used (old zyfer_control) */
 	NULL,			/* initialize driver (not used) */
-	NULL			/* timer - not used */
+	NULL,			/* timer - not used */
+	NULL			/* fast loop reading - not used */
 };
 
 
@@ -6,6 +6,7 @@
 
 from __future__ import print_function, division
 
+import bisect
 import select
 import time
 import sys
@@ -34,7 +35,7 @@ def gen_next(generator):
 
 class MIBControl:
     def __init__(self, oidTree=None, mibRoot=(), rangeSubid=0, upperBound=None,
-                 mibContext=None):
+                 mibContext=None, treeCacheTTL=0):
         self.oidTree = {}  # contains callbacks for the MIB
         if oidTree is not None:
             self.oidTree = oidTree
@@ -47,6 +48,12 @@ class MIBControl:
         self.rangeSubid = rangeSubid
         self.upperBound = upperBound
         self.context = mibContext
+        # Seconds to reuse a walk of the tree for, dynamic subtrees and
+        # all; 0 walks it afresh for every lookup
+        self.treeCacheTTL = treeCacheTTL
+        self.flatTree = None  # implemented (oid, reader, writer), in order
+        self.flatKeys = None  # their subids, to bisect on
+        self.flatTime = 0
 
     def mib_rootOID(self):
         return self.mibRoot
@@ -63,6 +70,7 @@ class MIBControl:
     def addNode(self, oid, reader=None, writer=None, dynamic=None):
         if isinstance(oid, ax.OID):  # get it in a mungable format
             oid = tuple(oid.subids)
+        self.flatTree = None
         # dynamic is the generator for tables
         currentLevel = self.oidTree
         remainingOID = oid
@@ -84,7 +92,32 @@ class MIBControl:
                     currentLevel[node]["subids"] = {}
                 currentLevel = currentLevel[node]["subids"]
 
+    def flattenMIB(self):
+        "Walk the tree into flatTree, unless the last walk is fresh enough"
+        now = ntp.util.monoclock()
+        if self.flatTree is not None and \
+           now - self.flatTime < self.treeCacheTTL:
+            return
+        self.flatTree = [(oid, reader, writer) for (oid, reader, writer)
+                         in walkMIBTree(self.oidTree, self.mibRoot)
+                         if reader is not None]
+        self.flatKeys = [tuple(x[0].subids) for x in self.flatTree]
+        self.flatTime = now
+
     def getOID_core(self, nextP, searchoid, returnGenerator=False):
+        if self.treeCacheTTL > 0 and not returnGenerator:
+            self.flattenMIB()
+            key = tuple(searchoid.subids)
+            if nextP:  # GetNext: any OID greater than the start qualifies
+                index = bisect.bisect_right(self.flatKeys, key)
+            else:  # Get: we need a *specific* OID
+                index = bisect.bisect_left(self.flatKeys, key)
+                if index < len(self.flatKeys) and \
+                   self.flatKeys[index] != key:
+                    index = len(self.flatKeys)
+            if index < len(self.flatTree):
+                return self.flatTree[index]
+            return None, None, None
         gen = walkMIBTree(self.oidTree, self.mibRoot)
         while True:
             try:
@@ -119,6 +152,21 @@ class MIBControl:
 
     def getOIDsInRange(self, oidrange, firstOnly=False):
         "Get a list of every (optionally the first) OID in a range"
+        if self.treeCacheTTL > 0:
+            self.flattenMIB()
+            start = tuple(oidrange.start.subids)
+            if oidrange.start.include:
+                first = bisect.bisect_left(self.flatKeys, start)
+            else:
+                first = bisect.bisect_right(self.flatKeys, start)
+            if oidrange.end.isNull():
+                last = len(self.flatKeys)
+            else:
+                last = bisect.bisect_left(self.flatKeys,
+                                          tuple(oidrange.end.subids))
+            if firstOnly:
+                last = min(last, first + 1)
+            return self.flatTree[first:last]
         oids = []
         gen = walkMIBTree(self.oidTree, self.mibRoot)
         # Find the first OID
@@ -165,6 +213,7 @@ class PacketControl:
     def __init__(self, sock, dbase, spinGap=0.001, timeout=defaultTimeout,
                  logfp=None, debug=10000):
         self.log = (lambda txt, dbg: ntp.util.dolog(logfp, txt, debug, dbg))
+        self.debug = debug  # to skip building log text no one will see
         # take a pre-made socket instead of making our own so that
         # PacketControl doesn't have to know or care about implementation
         self.socket = sock
@@ -291,7 +340,8 @@ class PacketControl:
                 self.receivedPackets.append(pkt)
                 if pkt.transactionID > self.highestTransactionID:
                     self.highestTransactionID = pkt.transactionID
-                self.log("Received a full packet: %s" % repr(pkt), 4)
+                if self.debug >= 4:
+                    self.log("Received a full packet: %s" % repr(pkt), 4)
             except (ax.ParseVersionError, ax.ParsePDUTypeError,
                     ax.ParseError) as e:
                 if e.header["type"] != ax.PDU_RESPONSE:
@@ -306,8 +356,9 @@ class PacketControl:
     def sendPacket(self, packet, expectsReply, replyTimeout=defaultTimeout,
                    callback=None):
         encoded = packet.encode()
-        self.log("Sending packet (with reply: %s): %s" % (expectsReply,
-                                                          repr(packet)), 4)
+        if self.debug >= 4:
+            self.log("Sending packet (with reply: %s): %s"
+                     % (expectsReply, repr(packet)), 4)
         self.socket.sendall(encoded)
         if expectsReply:
             index = (packet.sessionID,
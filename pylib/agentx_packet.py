@@ -850,10 +850,9 @@ class OID:
         n_subid = len(subids)
         include = int(bool(self.include))  # force integer bool
         endianToken = getendian(bigEndian)
-        body = struct.pack(endianToken + "BBBx", n_subid, prefix, include)
-        for subid in subids:
-            body += struct.pack(endianToken + "I", subid)
-        return body
+        # One pack for the header and every subid
+        return struct.pack(endianToken + "BBBx" + ("I" * n_subid),
+                           n_subid, prefix, include, *subids)
 
 
 def encode_octetstr(bigEndian, octets):
@@ -868,9 +867,7 @@ def encode_octetstr(bigEndian, octets):
         octets = ntp.poly.polybytes(octets)
         data = header + octets + pad
     else:
-        fmt = "B" * numoctets
-        data = struct.pack(fmt, *octets)
-        data = header + data + pad
+        data = header + bytes(bytearray(octets)) + pad
     return data
 
 
@@ -1104,10 +1101,7 @@ def decode_searchrange_list(data, header):  # Cannot handle extra data
 
 
 def encode_varbindlist(bigEndian, varbinds):
-    payload = b""
-    for varbind in varbinds:
-        payload += varbind.encode(bigEndian)
-    return payload
+    return b"".join([varbind.encode(bigEndian) for varbind in varbinds])
 
 
 def decode_varbindlist(data, header):
@@ -5,6 +5,7 @@
 
 """Access libntp funtions from Python."""
 from __future__ import absolute_import
+import array
 import ctypes
 import ctypes.util
 import errno
@@ -129,6 +130,47 @@ def lfptofloat(in_string):
     return _lfp_wrap(_lfptofloat, in_string)
 
 
+def varlist(text):
+    """Split mode 6 response bytes into (key, value, kind) triples.
+
+    None if the library is too old to do it."""
+    if _varlist is None:
+        return None
+    buf = ctypes.create_string_buffer(4 * len(text) + 4)
+    length = _varlist(text, len(text), buf, len(buf))
+    fields = ntp.poly.polystr(buf.raw[:length]).split("\0")
+    return [(fields[i][1:], fields[i + 1], fields[i][0])
+            for i in range(0, len(fields) - 1, 2)]
+
+
+def _stamps(callback, text):
+    """Run a column converter over text into a fresh array('d')."""
+    if callback is None:
+        return None
+    text = ntp.poly.polybytes(text)
+    # no more values than separators, plus one
+    out = array.array('d', [0.0]) * (len(text) // 2 + 1)
+    length = callback(text, len(text), out.buffer_info()[0], len(out))
+    del out[length:]
+    return out
+
+
+def lfptofloats(text):
+    """A column of NTP l_fp, split at white space or commas, to an
+    array of Python-style float times, NaN where ill-formed.
+
+    None if the library is too old to do it."""
+    return _stamps(_lfptofloats, text)
+
+
+def mjdtounix(text):
+    """The MJD and seconds starting each line of stats file text to an
+    array of Unix times, NaN for lines that don't start that way.
+
+    None if the library is too old to do it."""
+    return _stamps(_mjdtounix, text)
+
+
 def msyslog(level, in_string):
     """Log send a message to terminal or output."""
     mid_bytes = ntp.poly.polybytes(in_string)
@@ -166,3 +208,26 @@ adj_systime.argtypes = [ctypes.c_double]
 step_systime = _ntpc.ntpc_step_systime
 step_systime.restype = ctypes.c_bool
 step_systime.argtypes = [ctypes.c_double]
+
+# Split a mode 6 text response.
+try:
+    _varlist = _ntpc.do_varlist
+    _varlist.restype = ctypes.c_size_t
+    _varlist.argtypes = [ctypes.c_char_p, ctypes.c_size_t,
+                         ctypes.c_char_p, ctypes.c_size_t]
+except AttributeError:
+    _varlist = None
+
+# Convert columns of timestamps.
+try:
+    _lfptofloats = _ntpc.do_lfptofloats
+    _lfptofloats.restype = ctypes.c_size_t
+    _lfptofloats.argtypes = [ctypes.c_char_p, ctypes.c_size_t,
+                             ctypes.c_void_p, ctypes.c_size_t]
+    _mjdtounix = _ntpc.do_mjdtounix
+    _mjdtounix.restype = ctypes.c_size_t
+    _mjdtounix.argtypes = [ctypes.c_char_p, ctypes.c_size_t,
+                           ctypes.c_void_p, ctypes.c_size_t]
+except AttributeError:
+    _lfptofloats = None
+    _mjdtounix = None
@@ -244,6 +244,14 @@ import ntp.poly
 # of requests and multipacket responses to each.
 MAXFRAGS = 32
 
+# Limit on packets in a response over ntpd's control socket, where
+# nothing is lost and there is no queue in the path to overrun.
+STREAM_FRAGS = 65535
+
+# Where ntpd's "controlsocket" usually is.  Requests to a server on
+# this host go there instead of over UDP, if it exists and we may use it.
+STREAM_PATH = "/run/ntpd.sock"
+
 # Requests are automatically retried once, so total timeout with no
 # response is a bit over 2 * DEFTIMEOUT, or 10 seconds.  At the other
 # extreme, a request eliciting 32 packets of responses each for some
@@ -582,15 +590,72 @@ class Peer:
         self.associd = associd
         self.status = status
         self.variables = {}
+        self.due = 0    # refreshpeers() reads the variables again then
+
+    # Longest a refreshpeers() without since= trusts the old variables
+    REFRESH_MAX = 64
 
     def readvars(self):
         self.variables = self.session.readvar()
 
+    def pollinterval(self):
+        "Seconds until the variables are likely to change, from hpoll."
+        hpoll = self.variables.get("hpoll")
+        if isinstance(hpoll, tuple):
+            hpoll = hpoll[0]
+        try:
+            return min(2 ** int(hpoll), Peer.REFRESH_MAX)
+        except (TypeError, ValueError, OverflowError):
+            return 1
+
     def __str__(self):
         return "<Peer: associd=%s status=%0x>" % (self.associd, self.status)
     __repr__ = __str__
 
 
+class PeerSample:
+    """A raw sample kept by an association, from CTL_OP_READ_SAMPLES.
+    t1 to t4 are l_fp integers, the rest seconds."""
+
+    def __init__(self, seq, t1, t2, t3, t4, offset, delay, dispersion):
+        self.seq = seq
+        self.t1 = t1
+        self.t2 = t2
+        self.t3 = t3
+        self.t4 = t4
+        self.offset = offset
+        self.delay = delay
+        self.dispersion = dispersion
+
+    def __repr__(self):
+        return "<PeerSample: " + repr(self.__dict__)[1:-1] + ">"
+
+
+class PacketTrace:
+    """A packet from ntpd's packet trace, from CTL_OP_READ_PKTTRACE.
+    stamp is an l_fp integer; header the packet's first 48 octets."""
+
+    def __init__(self, seq, stamp, direction, addr, length, header):
+        self.seq = seq
+        self.stamp = stamp
+        self.direction = direction      # "recv" or "xmit"
+        self.addr = addr
+        self.length = length
+        self.header = header
+
+    def version(self):
+        return (ntp.poly.polyord(self.header[0]) >> 3) & 0x07
+
+    def mode(self):
+        return ntp.poly.polyord(self.header[0]) & 0x07
+
+    def stratum(self):
+        return ntp.poly.polyord(self.header[1])
+
+    def __repr__(self):
+        return "<PacketTrace: " + repr(self.__dict__)[1:-1] + ">"
+
+
 SERR_BADFMT = "***Server reports a bad format request packet\n"
 SERR_PERMISSION = "***Server disallowed request (authentication?)\n"
 SERR_BADOP = "***Server reports a bad opcode in request\n"
@@ -638,8 +703,13 @@ def dump_hex_printable(xdata, outfp=sys.stdout):
         outfp.write(line)
 
 
+# The per-entry tags of an mrulist response, and MRUEntry attributes
+MRU_MEMBERS = ("addr", "last", "first", "ct", "mv", "rs", "sc", "dr")
+
+
 class MRUEntry:
     "A traffic entry for an MRU list."
+    times = None    # (first, last) as floats, set by MRUList.convert()
 
     def __init__(self):
         self.addr = None        # text of IPv4 or IPv6 address and port
@@ -651,9 +721,15 @@ class MRUEntry:
         self.sc = None          # score
         self.dr = None          # dropped packets
 
+    def stamps(self):
+        "The first and last timestamps as float times."
+        if self.times is not None:
+            return self.times
+        return (ntp.ntpc.lfptofloat(self.first),
+                ntp.ntpc.lfptofloat(self.last))
+
     def avgint(self):
-        last = ntp.ntpc.lfptofloat(self.last)
-        first = ntp.ntpc.lfptofloat(self.first)
+        (first, last) = self.stamps()
         return (last - first) / self.ct
 
     def sortaddr(self):
@@ -689,6 +765,23 @@ class MRUList:
         "Is the server done shipping entries for this span?"
         return self.now is not None
 
+    @staticmethod
+    def convert(entries):
+        """Work out the float first and last times of entries in one
+        C call, rather than two per entry as they are shown."""
+        lfptofloats = getattr(ntp.ntpc, "lfptofloats", None)
+        if lfptofloats is None:
+            return
+        floats = lfptofloats(" ".join("%s %s" % (entry.first, entry.last)
+                                      for entry in entries))
+        if floats is None or len(floats) != 2 * len(entries):
+            return
+        for (i, entry) in enumerate(entries):
+            (first, last) = (floats[2 * i], floats[2 * i + 1])
+            # NaN: leave it to lfptofloat() to complain
+            if first == first and last == last:
+                entry.times = (first, last)
+
     def __repr__(self):
         return "<MRUList: entries=%s now=%s>" % (self.entries, self.now)
 
@@ -706,6 +799,7 @@ class ControlException(BaseException):
 class ControlSession:
     "A session to a host"
     MRU_ROW_LIMIT = 256
+    MRU_WINDOW = 8      # mrulist requests outstanding at most
     _authpass = True
     server_errors = {
         ntp.control.CERR_UNSPEC: "UNSPEC",
@@ -733,6 +827,9 @@ class ControlSession:
         self.hostname = None
         self.isnum = False
         self.sock = None
+        self.stream = False     # self.sock is ntpd's control socket
+        self.stream_path = STREAM_PATH
+        self.maxfrags = MAXFRAGS
         self.port = 0
         self.sequence = 0
         self.response = ""
@@ -742,6 +839,13 @@ class ControlSession:
         self.nonce_xmit = 0
         self.slots = 0
         self.flakey = None
+        # Ask for binary readvar replies, until the server refuses
+        self.binary = False
+        # Read all peers in one request, until the server refuses
+        self.bulkpeers = True
+        # Ask READ_PEERS for changes only, until the server refuses
+        self.peerssince = True
+        self.peers_now = None   # server uptime of the last READ_PEERS
 
     def warndbg(self, text, threshold):
         ntp.util.dolog(self.logfp, text, self.debug, threshold)
@@ -750,6 +854,8 @@ class ControlSession:
         if self.sock:
             self.sock.close()
             self.sock = None
+        self.stream = False
+        self.maxfrags = MAXFRAGS
 
     def havehost(self):
         "Is the session connected to a host?"
@@ -827,6 +933,8 @@ class ControlSession:
         ntp.util.dolog(self.logfp, "Opening host %s" % self.hostname,
                        self.debug, 3)
         self.port = sockaddr[1]
+        if self.__open_stream(sockaddr):
+            return True
         try:
             self.sock = socket.socket(family, socktype, protocol)
         except socket.error as e:
@@ -839,6 +947,28 @@ class ControlSession:
                                    % (hname, e.strerror, e.errno))
         return True
 
+    def __open_stream(self, sockaddr):
+        """Talk to a server on this host over its control socket, if
+        it has one we may use; a response of any length comes in one
+        go and none of it is lost."""
+        if sockaddr[0] not in ("127.0.0.1", "::1") or \
+           not self.stream_path or not os.path.exists(self.stream_path):
+            return False
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(self.stream_path)
+        except socket.error as e:
+            sock.close()
+            ntp.util.dolog(self.logfp, "%s: %s, using UDP"
+                           % (self.stream_path, e.strerror), self.debug, 3)
+            return False
+        ntp.util.dolog(self.logfp, "Using %s" % self.stream_path,
+                       self.debug, 3)
+        self.sock = sock
+        self.stream = True
+        self.maxfrags = STREAM_FRAGS
+        return True
+
     def password(self):
         "Get a keyid and the password if we don't have one."
         if self.keyid is None:
@@ -887,6 +1017,8 @@ class ControlSession:
         ntp.util.dolog(self.logfp,
                        "Sending %d octets.  seq=%d"
                        % (len(xdata), self.sequence), self.debug, 3)
+        if self.stream:
+            xdata = struct.pack("!H", len(xdata)) + ntp.poly.polybytes(xdata)
         try:
             self.sock.sendall(ntp.poly.polybytes(xdata))
         except socket.error:
@@ -960,9 +1092,10 @@ class ControlSession:
         # each packet and collect it in one long block.  When the last
         # packet in the sequence is received we'll know how much data we
         # should have had.  Note we use one long time out, should reconsider.
+        if self.stream:
+            return self.__stream_response(opcode, associd)
         fragments = []
         self.response = ''
-        seenlastfrag = False
         bail = 0
         # TODO: refactor to simplify while retaining semantic info
         if self.logfp is not None:
@@ -1010,6 +1143,8 @@ class ControlSession:
                             "ERR_INCOMPLETE: Received fragments:\n")
                         for (i, frag) in enumerate(fragments):
                             self.logfp.write("%d: %s" % (i+1, frag.stats()))
+                        seenlastfrag = any(not frag.more()
+                                           for frag in fragments)
                         self.logfp.write("last fragment %sreceived\n"
                                          % ("not ", "")[seenlastfrag])
                 raise ControlException(SERR_INCOMPLETE)
@@ -1025,117 +1160,195 @@ class ControlSession:
                 warndbg('Flaky: I deliberately dropped a packet.', 1)
                 rawdata = None
 
-            warndbg("Received %d octets" % len(rawdata), 3)
+            done = self.take_fragment(rawdata, opcode, associd, fragments)
+            if done:
+                return None
+            if done is not None:
+                break
+        if not self._authpass:
+            warn('AUTH: Content untrusted due to authentication failure!\n')
+
+    def __stream_response(self, opcode, associd):
+        """Get a response over a control socket.  Packets come in the
+        order sent, so each is appended until the one without the more
+        bit; their offsets, 16 bits, wrap in a long one."""
+        fragments = []
+        self.response = ''
+        tvo = self.primary_timeout / 1000
+        while True:
+            (length,) = struct.unpack("!H", self.__stream_read(2, tvo))
+            rawdata = self.__stream_read(length, tvo)
             rpkt = ControlPacket(self)
             try:
                 rpkt.analyze(rawdata)
             except struct.error:
                 raise ControlException(SERR_UNSPEC)
-
-            # Validate that packet header is sane, and the correct type
-            valid = self.__validate_packet(rpkt, rawdata, opcode, associd)
-            if not valid:  # pragma: no cover
-                continue
-
-            # Someday, perhaps, check authentication here
-            if self._authpass and self.auth:
-                _pend = rpkt.count + MODE_SIX_HEADER_LENGTH
-                _pend += (-_pend % MODE_SIX_ALIGNMENT)
-                if len(rawdata) < (_pend + KEYID_LENGTH + MINIMUM_MAC_LENGTH):
-                    self.logfp.write('AUTH - packet too short for MAC %d < %d\n' %
-                                     (len(rawdata), (_pend + KEYID_LENGTH + MINIMUM_MAC_LENGTH)))
-                    self._authpass = False
-                elif not self.auth.verify_mac(rawdata, packet_end=_pend,
-                                              mac_begin=_pend):
-                    self._authpass = False
-
-            # Clip off the MAC, if any
-            rpkt.extension = rpkt.extension[:rpkt.count]
-
-            if rpkt.count == 0 and rpkt.more():
-                warn("Received count of 0 in non-final fragment\n")
+            # An answer to a request that timed out is passed over
+            if not self.__validate_packet(rpkt, rawdata, opcode, associd):
                 continue
-
-            if seenlastfrag and rpkt.more():  # pragma: no cover
-                # I'n not sure this can be triggered without hitting another
-                # error first.
-                warn("Received second last fragment\n")
-                continue
-
-            # Find the most recent fragment with a
-            not_earlier = [frag for frag in fragments
-                           if frag.offset >= rpkt.offset]
-            if not_earlier:
-                not_earlier = not_earlier[0]
-                if not_earlier.offset == rpkt.offset:
-                    warn("duplicate %d octets at %d ignored, prior "
-                         " %d at %d\n"
-                         % (rpkt.count, rpkt.offset,
-                            not_earlier.count, not_earlier.offset))
-                    continue
-
-            if fragments:
-                last = fragments[-1]
-                if last.end() > rpkt.offset:
-                    warn("received frag at %d overlaps with %d octet "
-                         "frag at %d\n"
-                         % (rpkt.offset, last.count, last.offset))
-                    continue
-
-            if not_earlier and rpkt.end() > not_earlier.offset:
-                warn("received %d octet frag at %d overlaps with "
-                     "frag at %d\n"
-                     % (rpkt.count, rpkt.offset, not_earlier.offset))
-                continue
-
-            warndbg("Recording fragment %d, size = %d offset = %d, "
-                    " end = %d, more=%s"
-                    % (len(fragments)+1, rpkt.count,
-                       rpkt.offset, rpkt.end(), rpkt.more()), 3)
-
-            # Passed all tests, insert it into the frag list.
-            fragments.append(rpkt)
-            fragments.sort(key=lambda frag: frag.offset)
-
-            # Figure out if this was the last.
-            # Record status info out of the last packet.
+            self.__check_mac(rpkt, rawdata)
+            fragments.append(rpkt.extension[:rpkt.count])
+            tvo = self.secondary_timeout / 1000
             if not rpkt.more():
-                seenlastfrag = True
-                self.rstatus = rpkt.status
-
-            # If we've seen the last fragment, look for holes in the sequence.
-            # If there aren't any, we're done.
-            if seenlastfrag and fragments[0].offset == 0:
-                for f in range(1, len(fragments)):
-                    if fragments[f-1].end() != fragments[f].offset:
-                        warndbg("Hole in fragment sequence, %d of %d"
-                                % (f, len(fragments)), 1)
-                        break
-                else:
-                    tempfraglist = [ntp.poly.polystr(f.extension)
-                                    for f in fragments]
-                    self.response = ntp.poly.polybytes("".join(tempfraglist))
-                    warndbg("Fragment collection ends. %d bytes "
-                            " in %d fragments"
-                            % (len(self.response), len(fragments)), 1)
-                    # special loggers, not replacing with dolog()
-                    if self.debug >= 5:  # pragma: no cover
-                        warn("Response packet:\n")
-                        dump_hex_printable(self.response, self.logfp)
-                    elif self.debug >= 3:  # pragma: no cover
-                        # FIXME: Garbage when retrieving assoc list (binary)
-                        warn("Response packet:\n%s\n" % repr(self.response))
-                    elif self.debug >= 2:  # pragma: no cover
-                        # FIXME: Garbage when retrieving assoc list (binary)
-                        eol = self.response.find(b"\n")
-                        firstline = self.response[:eol]
-                        warn("First line:\n%s\n" % repr(firstline))
-                    return None
                 break
-        if not self._authpass:
-            warn('AUTH: Content untrusted due to authentication failure!\n')
+        self.rstatus = rpkt.status
+        self.response = b"".join(fragments)
+        self.warndbg("Fragment collection ends. %d bytes in %d fragments"
+                     % (len(self.response), len(fragments)), 1)
+        if not self._authpass and self.logfp is not None:
+            self.logfp.write('AUTH: Content untrusted due to '
+                             'authentication failure!\n')
+
+    def __stream_read(self, count, tvo):
+        "Read count octets from a control socket."
+        data = b""
+        while len(data) < count:
+            try:
+                (rd, _, _) = select.select([self.sock], [], [], tvo)
+            except select.error:
+                raise ControlException(SERR_SELECT)
+            if not rd:
+                raise ControlException(SERR_TIMEOUT)
+            try:
+                more = self.sock.recv(count - len(data))
+            except socket.error:
+                raise ControlException(SERR_SOCKET)
+            if not more:
+                raise ControlException(SERR_SOCKET)
+            data += ntp.poly.polybytes(more)
+        return data
+
+    def __check_mac(self, rpkt, rawdata):
+        "Note in self._authpass if a response packet's MAC is bad."
+        if self._authpass and self.auth:
+            _pend = rpkt.count + MODE_SIX_HEADER_LENGTH
+            _pend += (-_pend % MODE_SIX_ALIGNMENT)
+            if len(rawdata) < (_pend + KEYID_LENGTH + MINIMUM_MAC_LENGTH):
+                self.logfp.write('AUTH - packet too short for MAC %d < %d\n' %
+                                 (len(rawdata), (_pend + KEYID_LENGTH + MINIMUM_MAC_LENGTH)))
+                self._authpass = False
+            elif not self.auth.verify_mac(rawdata, packet_end=_pend,
+                                          mac_begin=_pend):
+                self._authpass = False
+
+    def take_fragment(self, rawdata, opcode, associd, fragments,
+                      sequence=None):
+        """Add a received datagram to the fragments of a response to
+        the request with sequence, by default the last one sent.
+        Returns True once the response is complete and in
+        self.response, False if collection should be given up, and
+        None if more fragments are wanted."""
+        if self.logfp is not None:
+            warn = self.logfp.write
+        else:
+            warn = (lambda x: x)
+        warndbg = (lambda txt, th: ntp.util.dolog(self.logfp, txt,
+                                                  self.debug, th))
+        seenlastfrag = any(not frag.more() for frag in fragments)
+
+        warndbg("Received %d octets" % len(rawdata), 3)
+        rpkt = ControlPacket(self)
+        try:
+            rpkt.analyze(rawdata)
+        except struct.error:
+            raise ControlException(SERR_UNSPEC)
+
+        # Validate that packet header is sane, and the correct type
+        valid = self.__validate_packet(rpkt, rawdata, opcode, associd,
+                                       sequence)
+        if not valid:  # pragma: no cover
+            return None
+
+        # Someday, perhaps, check authentication here
+        self.__check_mac(rpkt, rawdata)
+
+        # Clip off the MAC, if any
+        rpkt.extension = rpkt.extension[:rpkt.count]
+
+        if rpkt.count == 0 and rpkt.more():
+            warn("Received count of 0 in non-final fragment\n")
+            return None
+
+        if seenlastfrag and rpkt.more():  # pragma: no cover
+            # I'n not sure this can be triggered without hitting another
+            # error first.
+            warn("Received second last fragment\n")
+            return None
+
+        # Find the most recent fragment with a
+        not_earlier = [frag for frag in fragments
+                       if frag.offset >= rpkt.offset]
+        if not_earlier:
+            not_earlier = not_earlier[0]
+            if not_earlier.offset == rpkt.offset:
+                warn("duplicate %d octets at %d ignored, prior "
+                     " %d at %d\n"
+                     % (rpkt.count, rpkt.offset,
+                        not_earlier.count, not_earlier.offset))
+                return None
+
+        if fragments:
+            last = fragments[-1]
+            if last.end() > rpkt.offset:
+                warn("received frag at %d overlaps with %d octet "
+                     "frag at %d\n"
+                     % (rpkt.offset, last.count, last.offset))
+                return None
+
+        if not_earlier and rpkt.end() > not_earlier.offset:
+            warn("received %d octet frag at %d overlaps with "
+                 "frag at %d\n"
+                 % (rpkt.count, rpkt.offset, not_earlier.offset))
+            return None
+
+        warndbg("Recording fragment %d, size = %d offset = %d, "
+                " end = %d, more=%s"
+                % (len(fragments)+1, rpkt.count,
+                   rpkt.offset, rpkt.end(), rpkt.more()), 3)
+
+        # Passed all tests, insert it into the frag list.
+        fragments.append(rpkt)
+        fragments.sort(key=lambda frag: frag.offset)
+
+        # Figure out if this was the last.
+        # Record status info out of the last packet.
+        if not rpkt.more():
+            seenlastfrag = True
+            self.rstatus = rpkt.status
+
+        # If we've seen the last fragment, look for holes in the sequence.
+        # If there aren't any, we're done.
+        if seenlastfrag and fragments[0].offset == 0:
+            for f in range(1, len(fragments)):
+                if fragments[f-1].end() != fragments[f].offset:
+                    warndbg("Hole in fragment sequence, %d of %d"
+                            % (f, len(fragments)), 1)
+                    break
+            else:
+                tempfraglist = [ntp.poly.polystr(f.extension)
+                                for f in fragments]
+                self.response = ntp.poly.polybytes("".join(tempfraglist))
+                warndbg("Fragment collection ends. %d bytes "
+                        " in %d fragments"
+                        % (len(self.response), len(fragments)), 1)
+                # special loggers, not replacing with dolog()
+                if self.debug >= 5:  # pragma: no cover
+                    warn("Response packet:\n")
+                    dump_hex_printable(self.response, self.logfp)
+                elif self.debug >= 3:  # pragma: no cover
+                    # FIXME: Garbage when retrieving assoc list (binary)
+                    warn("Response packet:\n%s\n" % repr(self.response))
+                elif self.debug >= 2:  # pragma: no cover
+                    # FIXME: Garbage when retrieving assoc list (binary)
+                    eol = self.response.find(b"\n")
+                    firstline = self.response[:eol]
+                    warn("First line:\n%s\n" % repr(firstline))
+                return True
+            return False
+        return None
 
-    def __validate_packet(self, rpkt, rawdata, opcode, associd):
+    def __validate_packet(self, rpkt, rawdata, opcode, associd,
+                          sequence=None):
         # TODO: refactor to simplify while retaining semantic info
         if self.logfp is not None:
             warn = self.logfp.write
@@ -1158,9 +1371,11 @@ class ControlSession:
 
         # Check opcode and sequence number for a match.
         # Could be old data getting to us.
-        if rpkt.sequence != self.sequence:
+        if sequence is None:
+            sequence = self.sequence
+        if rpkt.sequence != sequence:
             warndbg("Received sequence number %d, wanted %d" %
-                    (rpkt.sequence, self.sequence), 1)
+                    (rpkt.sequence, sequence), 1)
             return False
         if rpkt.opcode() != opcode:
             warndbg("Received opcode %d, wanted %d" %
@@ -1203,7 +1418,8 @@ class ControlSession:
         "send a request and save the response"
         if not self.havehost():
             raise ControlException(SERR_NOHOST)
-        retry = True
+        # Nothing is lost on a control socket; a timeout there is final
+        retry = not self.stream
         while True:
             # Ship the request
             self.sendrequest(opcode, associd, qdata, auth)
@@ -1236,56 +1452,103 @@ class ControlSession:
 
     def __parse_varlist(self, raw=False):
         "Parse a response as a textual varlist."
-        # Strip out NULs and binary garbage from text;
-        # ntpd seems prone to generate these, especially
-        # in reslist responses.
-        kvpairs = []
-        instring = False
-        response = ""
+        return collections.OrderedDict(self.__varlist_items(raw))
+
+    def __varlist_items(self, raw=False):
+        "Parse a response as a textual varlist into (key, value) pairs."
         self.response = ntp.poly.polystr(self.response)
-        for c in self.response:
-            cord = ntp.poly.polyord(c)
-            if c == '"':
-                response += c
-                instring = not instring
-            elif not instring and c == ",":
-                # Separator between key=value pairs, done with this pair
-                kvpairs.append(response.strip())
-                response = ""
-            elif 0 < cord < 127:
-                # if it isn't a special case or garbage, add it
-                response += c
-        if response:  # The last item won't be caught by the loop
-            kvpairs.append(response.strip())
+        triples = ntp.ntpc.varlist(ntp.poly.polybytes(self.response))
+        if triples is None:
+            triples = varlist_split(self.response)
         items = []
-        for pair in kvpairs:
-            if "=" in pair:
-                key, value = ntp.util.slicedata(pair, pair.index("="))
-                value = value[1:]  # Remove '='
-            else:
-                key, value = pair, ""
-            key, value = key.strip(), value.strip()
-            # Start trying to cast to non-string types
-            if value:
-                try:
-                    castedvalue = int(value, 0)
-                except ValueError:
-                    try:
-                        castedvalue = float(value)
-                        if key == "delay" and not raw:
-                            # Hack for non-raw-mode to get precision
-                            items.append(("delay-s", value))
-                    except ValueError:
-                        if (value[0] == '"') and (value[-1] == '"'):
-                            value = value[1:-1]
-                        castedvalue = value  # str / unknown, stillneed casted
-            else:  # no value
+        for (key, value, kind) in triples:
+            self.__cast_item(items, key, value, raw, kind)
+        return items
+
+    @staticmethod
+    def __cast_item(items, key, value, raw, kind="?"):
+        """Append a textual key=value to items, cast to its natural type.
+
+        kind is what ntp.ntpc.varlist() made of the value, to save
+        trying int() and float() on it in turn."""
+        # Start trying to cast to non-string types
+        castedvalue = None
+        if value and kind in "i?":
+            try:
+                castedvalue = int(value, 0)
+            except ValueError:
+                pass
+        if castedvalue is None and value and kind in "f?":
+            try:
+                castedvalue = float(value)
+                if key == "delay" and not raw:
+                    # Hack for non-raw-mode to get precision
+                    items.append(("delay-s", value))
+            except ValueError:
+                pass
+        if castedvalue is None:  # str / unknown, or no value
+            if value and (value[0] == '"') and (value[-1] == '"'):
+                value = value[1:-1]
+            castedvalue = value
+        if raw:
+            items.append((key, (castedvalue, value)))
+        else:
+            items.append((key, castedvalue))
+
+    def __parse_binvars(self, raw=False):
+        "Parse a CTL_OP_READVAR_BIN response into the same form as text."
+        return collections.OrderedDict(self.__binvar_items(raw))
+
+    def __binvar_items(self, raw=False):
+        "Parse CTL_BIN_* records into (key, value) pairs."
+        data = ntp.poly.polybytes(self.response)
+        items = []
+        i = 0
+        while i + 4 <= len(data):
+            (vtype, namelen, vallen) = struct.unpack("!BBH", data[i:i+4])
+            i += 4
+            key = ntp.poly.polystr(data[i:i+namelen])
+            i += namelen
+            val = data[i:i+vallen]
+            i += vallen
+            if len(val) != vallen:
+                raise ControlException(SERR_INCOMPLETE)
+            if vtype == ntp.control.CTL_BIN_STR:
+                value = castedvalue = ntp.poly.polystr(val)
+            elif vtype == ntp.control.CTL_BIN_INT:
+                castedvalue = struct.unpack("!q", val)[0]
+                value = str(castedvalue)
+            elif vtype == ntp.control.CTL_BIN_UINT:
+                castedvalue = struct.unpack("!Q", val)[0]
+                value = str(castedvalue)
+            elif vtype == ntp.control.CTL_BIN_HEX:
+                castedvalue = struct.unpack("!Q", val)[0]
+                value = "0x%x" % castedvalue
+            elif vtype == ntp.control.CTL_BIN_DBL:
+                (castedvalue, prec) = struct.unpack("!dB", val)
+                if prec == ntp.control.CTL_BIN_GFMT:
+                    value = "%g" % castedvalue
+                else:
+                    value = "%.*f" % (prec, castedvalue)
+                if key == "delay" and not raw:
+                    items.append(("delay-s", value))
+            elif vtype == ntp.control.CTL_BIN_TS:
+                value = "0x%08x.%08x" % struct.unpack("!II", val)
+                castedvalue = value
+            elif vtype == ntp.control.CTL_BIN_ARRAY:
+                value = " ".join("%.2f" % d for d in
+                                 struct.unpack("!%dd" % (vallen // 8), val))
                 castedvalue = value
+            else:
+                # CTL_BIN_TEXT, or a type newer than we are
+                self.__cast_item(items, key,
+                                 ntp.poly.polystr(val).strip(), raw)
+                continue
             if raw:
                 items.append((key, (castedvalue, value)))
             else:
                 items.append((key, castedvalue))
-        return collections.OrderedDict(items)
+        return items
 
     def readvar(self, associd=0, varlist=None,
                 opcode=ntp.control.CTL_OP_READVAR, raw=False):
@@ -1294,9 +1557,250 @@ class ControlSession:
             qdata = ""
         else:
             qdata = ",".join(varlist)
+        if self.binary and opcode == ntp.control.CTL_OP_READVAR:
+            try:
+                self.doquery(ntp.control.CTL_OP_READVAR_BIN,
+                             associd=associd, qdata=qdata)
+                return self.readvar_reply(ntp.control.CTL_OP_READVAR_BIN,
+                                          raw)
+            except ControlException as e:
+                if e.errorcode != ntp.control.CERR_BADOP:
+                    raise e
+                # An older server, stay with text from now on
+                self.binary = False
         self.doquery(opcode, associd=associd, qdata=qdata)
+        return self.readvar_reply(opcode, raw)
+
+    def readvar_reply(self, opcode, raw=False):
+        "Parse the response to a readvar request made with opcode."
+        if opcode == ntp.control.CTL_OP_READVAR_BIN:
+            return self.__parse_binvars(raw)
         return self.__parse_varlist(raw)
 
+    def readpeers(self, varlist=None, raw=False):
+        """Read the variables of all peers, as a list of Peer objects
+        sorted by associd, or throw an exception."""
+        if self.bulkpeers:
+            try:
+                return self.__readpeers_bulk(varlist, raw)
+            except ControlException as e:
+                if e.errorcode != ntp.control.CERR_BADOP:
+                    raise e
+                # An older server, ask peer by peer from now on
+                self.bulkpeers = False
+        peers = []
+        for peer in self.readstat():
+            try:
+                peer.variables = self.readvar(peer.associd, varlist,
+                                              raw=raw)
+            except ControlException as e:
+                if e.errorcode != ntp.control.CERR_BADASSOC:
+                    raise e
+                continue    # gone since the readstat
+            peer.status = self.rstatus
+            peers.append(peer)
+        return peers
+
+    def __readpeers_bulk(self, varlist, raw, since=None):
+        "readpeers() with CTL_OP_READ_PEERS."
+        peers = []
+        after = None
+        now = None
+        while True:
+            self.doquery(ntp.control.CTL_OP_READ_PEERS,
+                         qdata=self.readpeers_request(varlist, after, since))
+            self.peers_now = None
+            after = self.readpeers_reply(peers, raw)
+            if now is None:
+                now = self.peers_now    # the earliest, to miss nothing
+            if after is None:
+                self.peers_now = now
+                return peers
+
+    def refreshpeers(self, peers, varlist=None, raw=False):
+        """Bring peers, a list from readpeers() or an earlier
+        refreshpeers(), up to date, fetching the variables of only the
+        associations that changed.  Returns a new list.  With peers
+        None, everything is read."""
+        old = dict((peer.associd, peer) for peer in peers or ())
+        if self.bulkpeers and self.peerssince:
+            since = self.peers_now if peers is not None else None
+            try:
+                fresh = self.__readpeers_bulk(varlist, raw,
+                                              since=since or 0)
+            except ControlException as e:
+                if e.errorcode == ntp.control.CERR_BADOP:
+                    self.bulkpeers = False
+                elif e.errorcode != ntp.control.CERR_UNKNOWNVAR:
+                    raise e
+                # An older server, compare status words from now on
+                self.peerssince = False
+            else:
+                if self.peers_now is None:
+                    self.peerssince = False     # since= was ignored
+                return self.__refresh_unchanged(fresh, old, varlist, raw)
+        # Without since=, refetch on a new status word or poll
+        fresh = []
+        now = ntp.util.monoclock()
+        for peer in self.readstat():
+            prev = old.get(peer.associd)
+            if prev is not None and prev.status == peer.status \
+                    and now < prev.due:
+                peer.variables = prev.variables
+                peer.due = prev.due
+            else:
+                try:
+                    peer.variables = self.readvar(peer.associd, varlist,
+                                                  raw=raw)
+                except ControlException as e:
+                    if e.errorcode != ntp.control.CERR_BADASSOC:
+                        raise e
+                    continue    # gone since the readstat
+                peer.status = self.rstatus
+                peer.due = now + peer.pollinterval()
+            fresh.append(peer)
+        return fresh
+
+    def __refresh_unchanged(self, fresh, old, varlist, raw):
+        "Fill in the variables READ_PEERS left out as unchanged."
+        peers = []
+        for peer in fresh:
+            if not peer.variables:
+                prev = old.get(peer.associd)
+                if prev is not None and prev.status == peer.status:
+                    peer.variables = prev.variables
+                else:
+                    try:
+                        peer.variables = self.readvar(peer.associd,
+                                                      varlist, raw=raw)
+                    except ControlException as e:
+                        if e.errorcode != ntp.control.CERR_BADASSOC:
+                            raise e
+                        continue
+            peers.append(peer)
+        return peers
+
+    def readpeers_request(self, varlist=None, after=None, since=None):
+        "The qdata of a CTL_OP_READ_PEERS request."
+        parms = ["frags=%d" % self.maxfrags]
+        if after is not None:
+            parms.append("after=%d" % after)
+        if since is not None:
+            parms.append("since=%d" % since)
+        if self.binary:
+            parms.append("binary")
+        if varlist:
+            parms += list(varlist)
+        return ", ".join(parms)
+
+    def readpeers_reply(self, peers, raw=False):
+        """Add the peers in the response to a CTL_OP_READ_PEERS
+        request to peers.  Returns the associd to ask for more after,
+        or None if that was all of them."""
+        if self.binary:
+            items = self.__binvar_items(raw)
+        else:
+            items = self.__varlist_items(raw)
+        after = None
+        for (key, value) in items:
+            if raw and key in ("associd", "status", "after", "now"):
+                value = value[0]
+            if key == "associd":
+                peers.append(Peer(self, value, 0))
+                peers[-1].variables = collections.OrderedDict()
+            elif key == "after":
+                after = value
+            elif key == "now" and not peers:
+                self.peers_now = value
+            elif not peers:
+                continue
+            elif key == "status":
+                peers[-1].status = value
+            else:
+                peers[-1].variables[key] = value
+        return after
+
+    def readsamples(self, associd, after=None):
+        """Read the raw samples association associd keeps, oldest first,
+        as PeerSample objects, or throw an exception.  With after, only
+        those numbered after it."""
+        samples = []
+        while True:
+            qdata = "frags=%d" % self.maxfrags
+            if after is not None:
+                qdata += ", after=%d" % after
+            self.doquery(ntp.control.CTL_OP_READ_SAMPLES, associd, qdata)
+            newest = self.readsamples_reply(samples)
+            if not samples or samples[-1].seq >= newest \
+               or samples[-1].seq == after:
+                return samples
+            after = samples[-1].seq
+
+    def readsamples_reply(self, samples):
+        """Add the samples in a CTL_OP_READ_SAMPLES response to samples.
+        Returns the number of the newest sample the peer has."""
+        data = ntp.poly.polybytes(self.response)
+        hdrlen = ntp.control.CTL_SAMPLES_HDRLEN
+        if len(data) < hdrlen:
+            raise ControlException(SERR_INCOMPLETE)
+        (newest, _, reclen, count) = struct.unpack("!IIHH", data[:hdrlen])
+        if reclen < ntp.control.CTL_SAMPLE_LEN \
+           or len(data) < hdrlen + count * reclen:
+            raise ControlException(SERR_INCOMPLETE)
+        for i in range(hdrlen, hdrlen + count * reclen, reclen):
+            (seq, t1, t2, t3, t4, offset, delay, disp) = struct.unpack(
+                "!IQQQQqII", data[i:i+ntp.control.CTL_SAMPLE_LEN])
+            samples.append(PeerSample(seq, t1, t2, t3, t4,
+                                      offset / 2.0**32, delay / 2.0**24,
+                                      disp / 2.0**24))
+        return newest
+
+    def pkttrace(self, after=None):
+        """Read ntpd's packet trace, oldest first, as PacketTrace
+        objects, or throw an exception.  With after, only the records
+        numbered after it.  Stops at the newest record of the first
+        response, as a busy server keeps adding more."""
+        entries = []
+        last = None
+        while True:
+            qdata = "frags=%d" % self.maxfrags
+            if after is not None:
+                qdata += ", after=%d" % after
+            self.doquery(ntp.control.CTL_OP_READ_PKTTRACE, qdata=qdata,
+                         auth=True)
+            newest = self.pkttrace_reply(entries)
+            if last is None:
+                last = newest
+            if not entries or entries[-1].seq >= last \
+               or entries[-1].seq == after:
+                return entries
+            after = entries[-1].seq
+
+    def pkttrace_reply(self, entries):
+        """Add the records in a CTL_OP_READ_PKTTRACE response to
+        entries.  Returns the number of the newest record ntpd has."""
+        data = ntp.poly.polybytes(self.response)
+        hdrlen = ntp.control.CTL_PKTTRACE_HDRLEN
+        if len(data) < hdrlen:
+            raise ControlException(SERR_INCOMPLETE)
+        (newest, _, reclen) = struct.unpack("!QQH", data[:18])
+        if reclen < ntp.control.CTL_PKTTRACE_LEN:
+            raise ControlException(SERR_INCOMPLETE)
+        for i in range(hdrlen, len(data) - reclen + 1, reclen):
+            (seq, stamp, direction, family, port, length, addr,
+             header) = struct.unpack(
+                 "!QQBBHH2x16s48s", data[i:i+ntp.control.CTL_PKTTRACE_LEN])
+            if family == 6:
+                addr = "[%s]:%d" % (socket.inet_ntop(socket.AF_INET6, addr),
+                                    port)
+            else:
+                addr = "%s:%d" % (socket.inet_ntop(socket.AF_INET,
+                                                   addr[:4]), port)
+            direction = "xmit" if direction == 2 else "recv"
+            entries.append(PacketTrace(seq, stamp, direction, addr, length,
+                                       header))
+        return newest
+
     def config(self, configtext):
         "Send configuration text to the daemon. Return True if accepted."
         self.doquery(opcode=ntp.control.CTL_OP_CONFIGURE,
@@ -1334,51 +1838,39 @@ This combats source address spoofing
 
     def __mru_analyze(self, variables, span, direct):
         """Extracts data from the key/value list into a more useful form"""
-        mru = None
         nonce = None
-        items = list(variables.items())
-        fake_list = []
-        fake_dict = {}
-        if items:                   # See issue #642
-            items.sort(key=mru_kv_key)
-        for (tag, val) in items:
-            self.warndbg("tag=%s, val=%s" % (tag, val), 4)
+        rows = {}
+        # Formatting a line per tag costs more than the rest together
+        verbose = self.debug >= 4
+        for (tag, val) in variables.items():
+            if verbose:
+                self.warndbg("tag=%s, val=%s" % (tag, val), 4)
             if tag == "nonce":
                 nonce = "%s=%s" % (tag, val)
-            elif tag == "last.older":
                 continue
-            elif tag == "addr.older":
-                continue
-            if tag == "now":
+            elif tag == "now":
                 # finished marker
                 span.now = ntp.ntpc.lfptofloat(val)
                 continue
-            elif tag == "last.newest":
-                # more finished
+            elif tag in ("last.older", "addr.older", "last.newest"):
                 continue
-            for prefix in ("addr", "last", "first", "ct", "mv", "rs", "sc", "dr"):
-                if tag.startswith(prefix + "."):
-                    (member, idx) = tag.split(".")
-                    try:
-                        idx = int(idx)
-                    except ValueError:
-                        raise ControlException(SERR_BADTAG % tag)
-                    # Does not check missing/gappy entries
-                    if idx not in fake_list:
-                        fake_dict[str(idx)] = {}
-                        fake_list.append(idx)
-                    fake_dict[str(idx)][member] = val
-        fake_list.sort()
-        for idx in fake_list:
+            (member, dot, idx) = tag.partition(".")
+            if dot and member in MRU_MEMBERS:
+                try:
+                    idx = int(idx)
+                except ValueError:
+                    raise ControlException(SERR_BADTAG % tag)
+                # Does not check missing/gappy entries
+                rows.setdefault(idx, {})[member] = val
+        fresh = []
+        for idx in sorted(rows):
             mru = MRUEntry()
             self.slots += 1
-            # Always 6 in practice, in the tests not so much
-#            if len(fake_dict[str(idx)]) != 6:
-#                continue
-            for prefix in ("addr", "last", "first", "ct", "mv", "rs", "sc", "dr"):
-                if prefix in fake_dict[str(idx)]:  # dodgy test needs this line
-                    setattr(mru, prefix, fake_dict[str(idx)][prefix])
-            span.entries.append(mru)
+            for (member, val) in rows[idx].items():
+                setattr(mru, member, val)
+            fresh.append(mru)
+        MRUList.convert(fresh)
+        span.entries.extend(fresh)
         if direct is not None:
             direct(span.entries)
         return nonce
@@ -1407,37 +1899,200 @@ This combats source address spoofing
                 limit = min(limit, self.ntpd_row_limit)
                 self.warndbg("Row limit reduced to %d following "
                              "CERR_BADVALUE." % limit, 1)
-        elif e.errorcode in (SERR_INCOMPLETE, SERR_TIMEOUT):
+        elif (e.errorcode in (SERR_INCOMPLETE, SERR_TIMEOUT) or
+              e.message in (SERR_INCOMPLETE, SERR_TIMEOUT)):
             # Reduce the number of rows/frags requested by
             # half to recover from lost response fragments.
             if cap_frags:
-                frags = max(2, frags / 2)
+                frags = max(2, frags // 2)
                 self.warndbg("Frag limit reduced to %d following "
                              "incomplete response." % frags, 1)
             else:
-                limit = max(2, limit / 2)
+                limit = max(2, limit // 2)
                 self.warndbg("Row limit reduced to %d following "
                              " incomplete response." % limit, 1)
         elif e.errorcode:
             raise e
         return restarted_count, cap_frags, limit, frags
 
+    def __mru_pipeline(self, span, cursor, total, nonce, rows,
+                       rawhook, direct):
+        """Fetch the rest of an mrulist snapshot from the position in
+        cursor on, with up to MRU_WINDOW requests for pages of it
+        outstanding at once, so a long list over a slow link goes at
+        the speed of the link rather than one round trip per page.
+
+        Pages can come back in any order; entries are added to span
+        in order.  The number of requests outstanding grows by one for
+        each page that comes back and halves when one is lost.  The
+        page size halves too if a page came back in part, and never
+        goes above what ntpd managed to fit in one answer.  A page
+        counts as lost after a few times the round trip seen so far,
+        doubled for each loss in a row, and never more than the
+        primary timeout; if nothing at all came back, after a second,
+        when ntpd's budget for us has had time to refill."""
+        (snapshot, pos) = cursor.split("-")
+        pos = int(pos)
+        rows = max(2, min(rows, self.ntpd_row_limit))
+        maxrows = rows
+        todo = [(pos, total - pos)]     # (start, count) yet to ask for
+        window = 2
+        srtt = None
+        rttvar = 0
+        outstanding = {}
+        pages = {}
+        losses = 0
+        throttled = False
+        opcode = ntp.control.CTL_OP_READ_MRU
+        try:
+            # Room for a full window of answers arriving at once
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF,
+                                 self.MRU_WINDOW * MAXFRAGS * 1024)
+        except (socket.error, AttributeError):  # pragma: no cover
+            pass
+
+        while todo or outstanding:
+            while todo and len(outstanding) < window:
+                (start, count) = todo.pop(0)
+                if count > rows:
+                    todo.insert(0, (start + rows, count - rows))
+                    count = rows
+                # limit=1 means something else to ntpd
+                self.sendrequest(opcode, 0, "%s, limit=%d, cursor=%s-%d"
+                                 % (nonce, max(2, count), snapshot, start))
+                outstanding[self.sequence] = {
+                    "start": start, "count": count, "fragments": [],
+                    "sent": time.time()}
+            if srtt is None:
+                rto = self.primary_timeout / 1000
+            elif throttled:
+                # ntpd drops mode 6 requests from a source over its
+                # budget, which refills a second at a time
+                rto = max(1.0, srtt + 4 * rttvar)
+            else:
+                rto = min(self.primary_timeout / 1000,
+                          max(0.05, srtt + 4 * rttvar) * 2 ** losses)
+            deadline = min(req["sent"] for req in outstanding.values()) + rto
+            try:
+                (rd, _, _) = select.select([self.sock], [], [],
+                                           max(0, deadline - time.time()))
+            except select.error:
+                raise ControlException(SERR_SELECT)
+
+            if not rd:
+                # Lost: back off, and ask again.  A page that came
+                # back in part lost fragments, so ask for smaller ones;
+                # one that didn't come back at all was likely dropped
+                # by ntpd's budget, and more requests would not help.
+                losses += 1
+                if losses > 8:
+                    raise ControlException(SERR_STALL)
+                window = max(1, window // 2)
+                now = time.time()
+                expired = [sequence for (sequence, req)
+                           in outstanding.items()
+                           if req["sent"] + rto <= now]
+                if any(outstanding[sequence]["fragments"]
+                       for sequence in expired):
+                    rows = max(2, rows // 2)
+                else:
+                    throttled = True
+                self.warndbg("mrulist window %d, %d rows, after a loss"
+                             % (window, rows), 1)
+                for sequence in expired:
+                    req = outstanding.pop(sequence)
+                    todo.append((req["start"], req["count"]))
+                todo.sort()
+                continue
+
+            try:
+                rawdata = ntp.poly.polybytes(self.sock.recv(4096))
+            except socket.error:  # pragma: no cover
+                raise ControlException(SERR_SOCKET)
+            rpkt = ControlPacket(self)
+            try:
+                rpkt.analyze(rawdata)
+            except struct.error:
+                continue
+            req = outstanding.get(rpkt.sequence)
+            if req is None:
+                continue    # an answer to a request given up on
+            done = self.take_fragment(rawdata, opcode, 0, req["fragments"],
+                                      rpkt.sequence)
+            if done is None:
+                continue
+            del outstanding[rpkt.sequence]
+            if not done:
+                todo.append((req["start"], req["count"]))
+                todo.sort()
+                continue
+
+            # A lost page is asked for again with a new sequence
+            # number, so every answer gives a true round trip
+            rtt = time.time() - req["sent"]
+            if srtt is None:
+                (srtt, rttvar) = (rtt, rtt / 2)
+            else:
+                rttvar += (abs(srtt - rtt) - rttvar) / 4
+                srtt += (rtt - srtt) / 8
+            window = min(self.MRU_WINDOW, window + 1)
+            rows = min(maxrows, rows + max(1, maxrows // 8))
+            throttled = False
+
+            variables = self.__parse_varlist()
+            if rawhook:
+                rawhook(variables)
+            page = MRUList()
+            nonce = self.__mru_analyze(variables, page, None) or nonce
+            page.entries = page.entries[:req["count"]]
+            got = len(page.entries)
+            if page.is_complete():
+                span.now = page.now
+            elif got == 0:
+                losses += 1
+                if losses > 8:
+                    raise ControlException(SERR_STALL)
+            else:
+                losses = max(0, losses - 1)
+            if got < req["count"] and not page.is_complete():
+                # ntpd ran out of room first; ask for the rest, and
+                # no more than fits from now on
+                todo.append((req["start"] + got, req["count"] - got))
+                todo.sort()
+                maxrows = rows = max(2, got)
+            if got:
+                pages[req["start"]] = page.entries
+            while pos in pages:
+                entries = pages.pop(pos)
+                pos += len(entries)
+                span.entries += entries
+                if direct is not None:
+                    direct(span.entries)
+                    span.entries = []
+        if span.now is None:
+            # Nothing said it was the last page
+            raise ControlException(SERR_INCOMPLETE)
+
     def mrulist(self, variables=None, rawhook=None, direct=None):
         "Retrieve MRU list data"
         restarted_count = 0
         cap_frags = True
         sorter = None
         sortkey = None
-        frags = MAXFRAGS
+        frags = self.maxfrags
         if variables is None:
             variables = {}
 
         if variables:
-            sorter, sortkey, frags = parse_mru_variables(variables)
+            sorter, sortkey, frags = parse_mru_variables(variables, frags)
 
         nonce = self.fetch_nonce()
 
         span = MRUList()
+        # Ask ntpd for a snapshot to page through.  Until it sends a
+        # cursor back, it is "new"; None once ntpd has answered without
+        # one, which means the classic last-seen protocol.
+        cursor = "new"
         try:
             # Form the initial request
             limit = min(3 * MAXFRAGS, self.ntpd_row_limit)
@@ -1448,7 +2103,7 @@ This combats source address spoofing
                 if 'resany' in variables:
                     variables['resany'] = hex(variables['resany'])
             parms, firstParms = generate_mru_parms(variables)
-            req_buf += firstParms
+            req_buf += firstParms + ", cursor=new"
 
             while True:
                 # Request additions to the MRU list
@@ -1458,12 +2113,19 @@ This combats source address spoofing
                     recoverable_read_errors = False
                 except ControlException as e:
                     recoverable_read_errors = True
+                    if cursor not in (None, "new") and \
+                       e.errorcode == ntp.control.CERR_UNKNOWNVAR:
+                        # The snapshot expired; take a new one
+                        cursor = "new"
+                        span.entries = []
                     res = self.__mru_query_error(e, restarted_count,
                                                  cap_frags, limit, frags)
                     restarted_count, cap_frags, limit, frags = res
 
                 # Parse the response
                 variables = self.__parse_varlist()
+                if not recoverable_read_errors and cursor is not None:
+                    cursor = variables.get("cursor")
 
                 # Comment from the C code:
                 # This is a cheap cop-out implementation of rawmode
@@ -1481,6 +2143,25 @@ This combats source address spoofing
                 if newNonce:
                     nonce = newNonce
 
+                # With a snapshot whose size we know, ask for the
+                # rest of it several pages at a time
+                if cursor not in (None, "new") and not self.stream and \
+                   "total" in variables and not span.is_complete():
+                    try:
+                        self.__mru_pipeline(span, cursor,
+                                            variables["total"], nonce,
+                                            limit, rawhook, direct)
+                    except ControlException as e:
+                        if e.errorcode != ntp.control.CERR_UNKNOWNVAR:
+                            raise e
+                        # The snapshot expired; take a new one
+                        cursor = "new"
+                        span.entries = []
+                        res = self.__mru_query_error(e, restarted_count,
+                                                     cap_frags, limit,
+                                                     frags)
+                        restarted_count, cap_frags, limit, frags = res
+
                 # If we've seen the end sentinel on the span, break out
                 if span.is_complete():
                     break
@@ -1502,7 +2183,7 @@ This combats source address spoofing
                 # our best guess at the server's row limit.
                 if not recoverable_read_errors:
                     if cap_frags:
-                        frags = min(MAXFRAGS, frags + 1)
+                        frags = min(self.maxfrags, frags + 1)
                     else:
                         limit = min(3 * MAXFRAGS,
                                     self.ntpd_row_limit,
@@ -1514,12 +2195,26 @@ This combats source address spoofing
                 # might be required.
                 if time.time() - self.nonce_xmit >= ntp.control.NONCE_TIMEOUT:
                     nonce = self.fetch_nonce()
-                req_buf = "%s, %s=%d%s" % \
-                          (nonce,
-                           "frags" if cap_frags else "limit",
-                           frags if cap_frags else limit,
-                           parms)
-                req_buf += generate_mru_lastseen(span, len(req_buf))
+                if cursor == "new":
+                    req_buf = "%s, %s=%d%s, cursor=new" % \
+                              (nonce,
+                               "frags" if cap_frags else "limit",
+                               frags if cap_frags else limit,
+                               firstParms)
+                elif cursor is not None:
+                    # ntpd applied the filters when it took the snapshot
+                    req_buf = "%s, %s=%d, cursor=%s" % \
+                              (nonce,
+                               "frags" if cap_frags else "limit",
+                               frags if cap_frags else limit,
+                               cursor)
+                else:
+                    req_buf = "%s, %s=%d%s" % \
+                              (nonce,
+                               "frags" if cap_frags else "limit",
+                               frags if cap_frags else limit,
+                               parms)
+                    req_buf += generate_mru_lastseen(span, len(req_buf))
                 if direct is not None:
                     span.entries = []
         except KeyboardInterrupt:  # pragma: no cover
@@ -1528,11 +2223,12 @@ This combats source address spoofing
         stitch_mru(span, sorter, sortkey)
         return span
 
-    def __ordlist(self, listtype):
-        "Retrieve ordered-list data."
+    def __ordlist(self, listtype, stanzas=None):
+        "Retrieve ordered-list data, adding to stanzas if given."
         self.doquery(opcode=ntp.control.CTL_OP_READ_ORDLIST_A,
                      qdata=listtype, auth=True)
-        stanzas = []
+        if stanzas is None:
+            stanzas = []
         for (key, value) in self.__parse_varlist().items():
             if key[-1].isdigit() and '.' in key:
                 (stem, stanza) = key.split(".")
@@ -1545,17 +2241,215 @@ This combats source address spoofing
 
     def reslist(self):
         "Retrieve reslist data."
-        return self.__ordlist("addr_restrictions")
+        # ntpd sends as much as fits in its time for a request, and
+        # then where to ask from next; an older one sends it all
+        stanzas = []
+        start = 0
+        while True:
+            try:
+                self.__ordlist("addr_restrictions from=%d" % start, stanzas)
+            except ControlException as e:
+                if start or e.errorcode != ntp.control.CERR_UNKNOWNVAR:
+                    raise
+                return self.__ordlist("addr_restrictions")
+            more = self.__parse_varlist().get("more")
+            if more is None:
+                return stanzas
+            if int(more) <= start:
+                raise ControlException(SERR_INCOMPLETE)
+            start = int(more)
 
     def ifstats(self):
         "Retrieve ifstats data."
         return self.__ordlist("ifstats")
 
 
-def parse_mru_variables(variables):
+class ControlMux:
+    """Hold one conversation with each of many ControlSessions at once.
+
+    A request goes out on every session together and the replies are
+    collected by a single select() over all the sockets, so asking a
+    few hundred hosts takes about as long as asking the slowest one.
+    Each session keeps its own timeouts, and gets the one retry
+    ControlSession.doquery() would give it.
+
+    select() can't watch more than FD_SETSIZE sockets, so callers with
+    thousands of hosts should take them a few hundred at a time.
+    """
+
+    def __init__(self, sessions):
+        self.sessions = list(sessions)
+
+    def doquery(self, opcode, associd=0, qdata=""):
+        """Send a request on every session and collect the replies,
+        each into its session's response.  qdata may be a list, with
+        the data for each session.  Returns a list with, for each
+        session, None or the ControlException it ended with."""
+        errors = [None] * len(self.sessions)
+        if not isinstance(qdata, list):
+            qdata = [qdata] * len(self.sessions)
+        talking = {}
+        for (i, session) in enumerate(self.sessions):
+            if not session.havehost():
+                errors[i] = ControlException(SERR_NOHOST)
+                continue
+            if session.stream:
+                # A local server over its control socket; no waiting
+                try:
+                    session.doquery(opcode, associd, qdata[i])
+                except ControlException as e:
+                    errors[i] = e
+                continue
+            talking[session.sock] = self.__start(i, session, opcode,
+                                                 associd, qdata[i], True)
+
+        while talking:
+            now = time.time()
+            for (sock, talk) in list(talking.items()):
+                if talk["deadline"] > now:
+                    continue
+                if talk["fragments"]:
+                    self.__end(talking, errors, talk, SERR_INCOMPLETE)
+                else:
+                    self.__end(talking, errors, talk, SERR_TIMEOUT)
+            if not talking:
+                break
+            tvo = min(talk["deadline"] for talk in talking.values()) - now
+            try:
+                (rd, _, _) = select.select(list(talking), [], [],
+                                           max(tvo, 0))
+            except select.error:
+                raise ControlException(SERR_SELECT)
+            for sock in rd:
+                talk = talking[sock]
+                session = talk["session"]
+                try:
+                    rawdata = ntp.poly.polybytes(sock.recv(4096))
+                except socket.error:
+                    self.__end(talking, errors, talk, SERR_SOCKET)
+                    continue
+                if session.flakey and session.flakey >= random.random():
+                    continue
+                talk["bail"] += 1
+                try:
+                    if talk["bail"] >= (2*MAXFRAGS):
+                        raise ControlException(SERR_TOOMUCH)
+                    done = session.take_fragment(rawdata, opcode, associd,
+                                                 talk["fragments"])
+                except ControlException as e:
+                    self.__end(talking, errors, talk, e.message, e)
+                    continue
+                if done is None:
+                    talk["deadline"] = (time.time() +
+                                        session.secondary_timeout / 1000)
+                else:
+                    del talking[sock]
+        return errors
+
+    def __start(self, i, session, opcode, associd, qdata, retry):
+        "Send a request and note what we are waiting for."
+        session.response = ''
+        session.sendrequest(opcode, associd, qdata)
+        return {"index": i, "session": session, "fragments": [],
+                "bail": 0, "retry": retry,
+                "request": (opcode, associd, qdata),
+                "deadline": time.time() + session.primary_timeout / 1000}
+
+    def __end(self, talking, errors, talk, message, exception=None):
+        "A conversation failed.  Try it once more, or give up on it."
+        session = talk["session"]
+        if talk["retry"] and message in (SERR_TIMEOUT, SERR_INCOMPLETE):
+            (opcode, associd, qdata) = talk["request"]
+            talking[session.sock] = self.__start(talk["index"], session,
+                                                 opcode, associd, qdata,
+                                                 False)
+            return
+        del talking[session.sock]
+        errors[talk["index"]] = exception or ControlException(message)
+
+    def readvar(self, associd=0, varlist=None, raw=False):
+        """Read system vars from every host.  Returns a list with,
+        for each session, a dict or the ControlException it got."""
+        if varlist is None:
+            qdata = ""
+        else:
+            qdata = ",".join(varlist)
+        results = [None] * len(self.sessions)
+        for binary in (True, False):
+            if binary:
+                opcode = ntp.control.CTL_OP_READVAR_BIN
+            else:
+                opcode = ntp.control.CTL_OP_READVAR
+            todo = [i for (i, session) in enumerate(self.sessions)
+                    if results[i] is None and session.binary == binary]
+            if not todo:
+                continue
+            mux = ControlMux([self.sessions[i] for i in todo])
+            for (i, error) in zip(todo, mux.doquery(opcode, associd, qdata)):
+                session = self.sessions[i]
+                if error is None:
+                    try:
+                        results[i] = session.readvar_reply(opcode, raw)
+                    except ControlException as e:
+                        results[i] = e
+                elif binary and error.errorcode == ntp.control.CERR_BADOP:
+                    # An older server, stay with text from now on
+                    session.binary = False
+                else:
+                    results[i] = error
+        return results
+
+    def readpeers(self, varlist=None, raw=False):
+        """Read the variables of all peers of every host.  Returns a
+        list with, for each session, a list of Peer objects sorted by
+        associd or the ControlException it got."""
+        results = [None] * len(self.sessions)
+        peers = [[] for _ in self.sessions]
+        after = dict((i, None) for (i, session) in enumerate(self.sessions)
+                     if session.bulkpeers)
+        while after:
+            todo = sorted(after)
+            mux = ControlMux([self.sessions[i] for i in todo])
+            qdata = [self.sessions[i].readpeers_request(varlist, after[i])
+                     for i in todo]
+            errors = mux.doquery(ntp.control.CTL_OP_READ_PEERS, qdata=qdata)
+            for (i, error) in zip(todo, errors):
+                session = self.sessions[i]
+                if error is None:
+                    try:
+                        after[i] = session.readpeers_reply(peers[i], raw)
+                    except ControlException as e:
+                        error = e
+                    else:
+                        if after[i] is None:
+                            results[i] = peers[i]
+                            del after[i]
+                        continue
+                del after[i]
+                if error.errorcode == ntp.control.CERR_BADOP:
+                    # An older server, ask peer by peer from now on
+                    session.bulkpeers = False
+                else:
+                    results[i] = error
+        # Whatever is left has to be asked the slow way
+        for (i, session) in enumerate(self.sessions):
+            if results[i] is None:
+                try:
+                    results[i] = session.readpeers(varlist, raw)
+                except ControlException as e:
+                    results[i] = e
+        return results
+
+
+def parse_mru_variables(variables, frags=MAXFRAGS):
     sorter = None
     sortkey = None
-    frags = MAXFRAGS
+    if "top" in variables:
+        if variables.get("by", "count") not in ("count", "drop", "score"):
+            raise ControlException(SERR_BADPARAM % "by")
+        if "sort" not in variables:
+            # ntpd picked them by this; show them by it, highest first
+            variables["sort"] = "-" + variables.get("by", "count")
     if "sort" in variables:
         sortkey = variables["sort"]
         del variables["sort"]
@@ -1567,9 +2461,9 @@ def parse_mru_variables(variables):
         #  since we really want to sort on now-last rather than last.
         sortdict = {
             # lstint ascending
-            "lstint": lambda e: ntp.ntpc.lfptofloat(e.last),
+            "lstint": lambda e: e.stamps()[1],
             # lstint descending
-            "-lstint": lambda e: -ntp.ntpc.lfptofloat(e.last),
+            "-lstint": lambda e: -e.stamps()[1],
             # avgint ascending
             "avgint": lambda e: -e.avgint(),
             # avgint descending
@@ -1601,7 +2495,7 @@ def parse_mru_variables(variables):
         if k in ("mincount", "mindrop", "minscore",
                  "resall", "resany", "kod", "limited",
                  "maxlstint", "minlstint", "laddr", "recent",
-                 "sort", "frags", "limit"):
+                 "sort", "frags", "limit", "top", "by"):
             continue
         elif k.startswith('addr.') or k.startswith('last.'):
             kn = k.split('.')
@@ -1681,6 +2575,40 @@ def generate_mru_lastseen(span, existingBufferSize):
     return buf
 
 
+def varlist_split(text):
+    """Split a mode 6 text response into (key, value, kind) triples,
+    as ntp.ntpc.varlist() does when the library can."""
+    # Strip out NULs and binary garbage from text;
+    # ntpd seems prone to generate these, especially
+    # in reslist responses.
+    kvpairs = []
+    instring = False
+    response = ""
+    for c in text:
+        cord = ntp.poly.polyord(c)
+        if c == '"':
+            response += c
+            instring = not instring
+        elif not instring and c == ",":
+            # Separator between key=value pairs, done with this pair
+            kvpairs.append(response.strip())
+            response = ""
+        elif 0 < cord < 127:
+            # if it isn't a special case or garbage, add it
+            response += c
+    if response:  # The last item won't be caught by the loop
+        kvpairs.append(response.strip())
+    triples = []
+    for pair in kvpairs:
+        if "=" in pair:
+            key, value = ntp.util.slicedata(pair, pair.index("="))
+            value = value[1:]  # Remove '='
+        else:
+            key, value = pair, ""
+        triples.append((key.strip(), value.strip(), "?"))
+    return triples
+
+
 def mru_kv_key(token):
     bits = token[0].split('.')
     if len(bits) == 1:
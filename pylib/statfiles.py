@@ -14,31 +14,232 @@ Requires gnuplot and liberation fonts installed.
 from __future__ import print_function, division
 
 import calendar
+import gc
 import glob
 import gzip
+import hashlib
+import heapq
+import itertools
+import marshal
 import os
 import socket
+import struct
 import sys
 import time
+import ntp.ntpc
+import ntp.util
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+# Host names for peer addresses, shared by every NTPStats
+label_cache = ntp.util.Cache()
+
+# Binary statistics files, "filegen ... binary" in ntp.conf
+BINARY_MAGIC = b"NTPSTATB"
+BINARY_SUFFIX = "-bin"
+BINARY_STEMS = ("peerstats", "rawstats")
+
+# Bump when the rows kept in a cache directory change shape
+CACHE_VERSION = 1
+
+
+def _binary_addr(raw):
+    "Render an addr field the way ntpd labels it in text files."
+    kind = raw[0:1]
+    if kind == b"\x04":
+        return socket.inet_ntop(socket.AF_INET, raw[1:5])
+    if kind == b"\x06":
+        return socket.inet_ntop(socket.AF_INET6, raw[1:17])
+    if kind == b"R":
+        return raw[1:].split(b"\0", 1)[0].decode("ascii", "replace")
+    return "-"
+
+
+def _binary_lfp(value):
+    "Render an l_fp field as ulfptoa(, 9) does."
+    seconds = value >> 32
+    frac = ((value & 0xffffffff) * 1000000000 + 0x80000000) >> 32
+    if frac >= 1000000000:
+        seconds += 1
+        frac -= 1000000000
+    return "%d.%09d" % (seconds, frac)
+
+
+def _binary_refid(raw, stratum):
+    "Render a refid field as refid_str() does."
+    if stratum > 1:
+        return socket.inet_ntop(socket.AF_INET, raw)
+    text = raw.split(b"\0", 1)[0].rstrip(b" ")
+    return text.decode("ascii", "replace") or "?"
+
+
+# field type: (struct format, renderer)
+_BINARY_TYPES = {
+    "ns64": ("Q", None),
+    "addr": ("17s", _binary_addr),
+    "lfp": ("Q", _binary_lfp),
+    "u8": ("B", str),
+    "i8": ("b", str),
+    "u32": ("I", str),
+    "x16": ("H", lambda v: "%x" % v),
+    "x32": ("I", lambda v: "%x" % v),
+    "fix16": ("I", lambda v: "%.6f" % (v / 65536)),
+    "f64": ("d", lambda v: "%.9f" % v),
+    "refid": ("4s", None),
+}
+
+
+def filegen_span(suffix):
+    """Return the (start, end) Unix times covered by a filegen file with
+    the given name suffix, for the day, month and year types, else None.
+    A trailing "gz" or ".gz" is ignored."""
+    if suffix.endswith("gz"):
+        suffix = suffix[:-2].rstrip(".")
+    if not suffix.isdigit() or len(suffix) not in (4, 6, 8):
+        return None
+    year = int(suffix[0:4])
+    month = int(suffix[4:6] or 1)
+    day = int(suffix[6:8] or 1)
+    if not (1 <= month <= 12 and 1 <= day <= 31):
+        return None
+    start = calendar.timegm((year, month, day, 0, 0, 0))
+    if len(suffix) == 8:
+        end = start + 24*60*60
+    elif len(suffix) == 6:
+        end = calendar.timegm((year + month // 12, month % 12 + 1, 1,
+                               0, 0, 0))
+    else:
+        end = calendar.timegm((year + 1, 1, 1, 0, 0, 0))
+    return (start, end)
+
+
+def read_lines(logpart):
+    "Yield the lines of a statistics file, gzipped or not, one at a time."
+    try:
+        if logpart.endswith("gz"):
+            logfile = gzip.open(logpart, 'rt')
+        else:
+            logfile = open(logpart, 'r')
+        with logfile:
+            for line in logfile:
+                yield line
+    except (IOError, EOFError):
+        sys.stderr.write("ntpviz: WARNING: could not read %s\n"
+                         % logpart)
+
+
+def merge_rows(parts):
+    """Merge iterables of time-ordered rows into one.  heapq.merge()
+    costs a Python step per row, so it is skipped when there is only
+    one, the usual case when the files are named by date."""
+    parts = list(parts)
+    if 1 == len(parts):
+        return parts[0]
+    return heapq.merge(*parts)
+
+
+def binary_rows(data, starttime, endtime):
+    """Convert the contents of a binary statistics file to rows like
+    NTPStats.unixize() makes from a text file: milliseconds, seconds
+    as a string, then the other fields as strings, in record order."""
+    if len(data) < 12 or data[:8] != BINARY_MAGIC:
+        return []
+    (hdrlen, reclen) = struct.unpack("<HH", data[8:12])
+    fields = data[12:hdrlen].split(b"\0", 1)[0].decode("ascii").split()
+    fields = [field.split(":", 1) for field in fields]
+    if not fields or fields[0][1] != "ns64" \
+       or any(ftype not in _BINARY_TYPES for (_, ftype) in fields):
+        return []
+    fmt = "<" + "".join(_BINARY_TYPES[ftype][0] for (_, ftype) in fields)
+    if struct.calcsize(fmt) != reclen:
+        return []
+    names = [name for (name, _) in fields]
+    stratum = names.index("stratum") if "stratum" in names else None
+    rows = []
+    for offset in range(hdrlen, len(data) - reclen + 1, reclen):
+        values = struct.unpack_from(fmt, data, offset)
+        msec = values[0] // 1000000
+        if not starttime <= msec / 1000 <= endtime:
+            continue
+        row = [msec, str(msec / 1000)]
+        for ((_, ftype), value) in zip(fields[1:], values[1:]):
+            if ftype == "refid":
+                row.append(_binary_refid(value, values[stratum]
+                                         if stratum is not None else 0))
+            else:
+                row.append(_BINARY_TYPES[ftype][1](value))
+        rows.append(row)
+    return rows
 
 
 class NTPStats:
     "Gather statistics for a specified NTP site"
     SecondsInDay = 24*60*60
+    STAMP_BATCH = 4096      # lines to a mjdtounix() call
     DefaultPeriod = 7*24*60*60  # default 7 days, 604800 secs
     peermap = {}    # cached result of peersplit()
     period = None
     starttime = None
     endtime = None
     sitename = ''
+    cachedir = None
 
     @staticmethod
     def unixize(lines, starttime, endtime):
         """Extract first two fields, MJD and seconds past midnight.
         convert timestamp (MJD & seconds past midnight) to Unix time
         Replace MJD+second with Unix time."""
+        return list(NTPStats.unixize_rows(lines, starttime, endtime))
+
+    @staticmethod
+    def unix_times(lines):
+        """The Unix time starting each of a list of stats file lines,
+        worked out in C.  NaN for an unparseable line, None if the
+        lines won't go through C whole or the library can't do it."""
+        mjdtounix = getattr(ntp.ntpc, "mjdtounix", None)
+        if mjdtounix is None:
+            return None
+        text = "".join(lines)
+        if not text.endswith("\n"):
+            text += "\n"
+        if text.count("\n") != len(lines):
+            # not one line apiece, C would lose count
+            return None
+        return mjdtounix(text)
+
+    @staticmethod
+    def unixize_rows(lines, starttime, endtime):
+        "As unixize(), but yield the rows one at a time."
         # HOT LOOP!  Do not change w/o profiling before and after
-        lines1 = []
+        # Only rows in range get split, the times come from C a few
+        # thousand lines at a go
+        lines = iter(lines)
+        while True:
+            chunk = list(itertools.islice(lines, NTPStats.STAMP_BATCH))
+            if not chunk:
+                return
+            times = NTPStats.unix_times(chunk)
+            if times is None:
+                for split in NTPStats.unixize_slow(chunk, starttime,
+                                                   endtime):
+                    yield split
+                continue
+            for (line, time) in zip(chunk, times):
+                # NaN is never in range
+                if starttime <= time <= endtime:
+                    split = line.split()
+                    # time as integer number milli seconds
+                    split[0] = int(time * 1000)
+                    # time as string
+                    split[1] = str(time)
+                    yield split
+
+    @staticmethod
+    def unixize_slow(lines, starttime, endtime):
+        "As unixize_rows(), a line at a time in Python."
         for line in lines:
             try:
                 split = line.split()
@@ -55,8 +256,28 @@ class NTPStats:
                 split[0] = int(time * 1000)
                 # time as string
                 split[1] = str(time)
-                lines1.append(split)
-        return lines1
+                yield split
+
+    @staticmethod
+    def posix_rows(lines, starttime, endtime):
+        """Yield the rows of lines which start with Unix time, as temps
+        and gpsd do, prefixed with the time in integer milliseconds."""
+        for line in lines:
+            split = line.split()
+            if 3 > len(split):
+                # skip short lines
+                continue
+
+            try:
+                time_float = float(split[0])
+            except ValueError:
+                # ignore comment lines, lines with no time
+                continue
+
+            if starttime <= time_float <= endtime:
+                # prefix with int milli sec.
+                split.insert(0, int(time_float * 1000))
+                yield split
 
     @staticmethod
     def timestamp(line):
@@ -87,6 +308,81 @@ class NTPStats:
                     ret["p" + str(perc)] = values[int(length * (perc/100))]
         return ret
 
+    @staticmethod
+    def select_percentiles(percents, values):
+        """As percentiles(), but the values need not be sorted, and are
+        left alone.  With numpy only the wanted ranks are selected;
+        without it a sorted copy is the fastest way in pure Python."""
+        length = len(values)
+        if 1 >= length or numpy is None:
+            return NTPStats.percentiles(percents, sorted(values))
+        ranks = {}
+        for perc in percents:
+            if perc == 100:
+                ranks["p100"] = length - 1
+            else:
+                ranks["p" + str(perc)] = int(length * (perc/100))
+        picked = numpy.partition(numpy.asarray(values, dtype=float),
+                                 sorted(set(ranks.values())))
+        return dict((key, float(picked[rank]))
+                    for (key, rank) in ranks.items())
+
+    @staticmethod
+    def polyfit(pairs, degree=1):
+        """Least-squares polynomial through (x, y) pairs, coefficients
+        highest power first as numpy.polyfit() gives them, or None if
+        the points can't pin one down.  pairs is gone through once:
+        with numpy into an array, without it into the sums of the
+        normal equations, with x taken from the first point so big x
+        like times keep their precision."""
+        size = degree + 1
+        if numpy is not None:
+            xy = numpy.fromiter(itertools.chain.from_iterable(pairs),
+                                dtype=float).reshape(-1, 2)
+            if len(numpy.unique(xy[:, 0])) < size:
+                return None
+            return [float(c) for c in numpy.polyfit(xy[:, 0], xy[:, 1],
+                                                    degree)]
+        origin = None
+        xsums = [0.0] * (2 * size - 1)  # sum of x**k
+        ysums = [0.0] * size            # sum of y * x**k
+        for (x, y) in pairs:
+            if origin is None:
+                origin = x
+            x -= origin
+            power = 1.0
+            for k in range(2 * size - 1):
+                xsums[k] += power
+                if k < size:
+                    ysums[k] += power * y
+                power *= x
+        if origin is None:
+            return None
+        # Solve the normal equations by Gaussian elimination
+        rows = [xsums[i:i + size] + [ysums[i]] for i in range(size)]
+        for col in range(size):
+            pivot = max(range(col, size), key=lambda i: abs(rows[i][col]))
+            if rows[pivot][col] == 0:
+                return None
+            rows[col], rows[pivot] = rows[pivot], rows[col]
+            for i in range(col + 1, size):
+                scale = rows[i][col] / rows[col][col]
+                for j in range(col, size + 1):
+                    rows[i][j] -= scale * rows[col][j]
+        coefs = [0.0] * size  # of (x - origin)**k
+        for i in range(size - 1, -1, -1):
+            coefs[i] = (rows[i][size] - sum(
+                rows[i][j] * coefs[j]
+                for j in range(i + 1, size))) / rows[i][i]
+        # Back to powers of x, by Horner's rule on (x - origin)
+        result = [coefs[-1]]
+        for coef in coefs[-2::-1]:
+            result = [a - origin * b for (a, b) in
+                      zip([0.0] + result, result + [0.0])]
+            result[0] += coef
+        result.reverse()
+        return result
+
     @staticmethod
     def ip_label(key):
         "Produce appropriate label for an IP address."
@@ -103,16 +399,32 @@ class NTPStats:
                 return "REFCLOCK(type=%s,unit=%s)" % (clock_type, unit)
             # Ordinary IP address - replace with primary hostname.
             # Punt if the lookup fails.
+            label = label_cache.get(key)
+            if label is not None:
+                return label
             try:
                 (hostname, _, _) = socket.gethostbyaddr(key)
+                label_cache.set(key, hostname)
                 return hostname
             except socket.herror:
                 pass
         return key      # Someday, be smarter than this.
 
+    @staticmethod
+    def prefetch_labels(keys):
+        "Look up the labels for many keys in parallel, for ip_label()."
+        pending = [key for key in keys
+                   if key[:1].isdigit() and label_cache.get(key) is None]
+        ntp.util.parallel_lookup(NTPStats.ip_label, pending)
+        for key in pending:
+            if label_cache.get(key) is None:
+                label_cache.set(key, key, ntp.util.DNS_SLOW_TTL)
+
     def __init__(self, statsdir, sitename=None,
-                 period=None, starttime=None, endtime=None):
-        "Grab content of logfiles, sorted by timestamp."
+                 period=None, starttime=None, endtime=None, cachedir=None):
+        """Grab content of logfiles, sorted by timestamp.  With a
+        cachedir, each text file is decoded once and the rows kept
+        there until the file changes."""
         if period is None:
             period = NTPStats.DefaultPeriod
         self.period = period
@@ -127,6 +439,7 @@ class NTPStats:
             endtime = starttime + period
         self.starttime = starttime
         self.endtime = endtime
+        self.cachedir = cachedir
 
         self.sitename = sitename or os.path.basename(statsdir)
         if 'ntpstats' == self.sitename:
@@ -145,63 +458,161 @@ class NTPStats:
         self.temps = []
         self.gpsd = []
 
-        for stem in ("clockstats", "peerstats", "loopstats",
-                     "rawstats", "temps", "gpsd"):
-            lines = self.__load_stem(statsdir, stem)
-            processed = self.__process_stem(stem, lines)
-            setattr(self, stem, processed)
+        # The rows are millions of small lists with no cycles among
+        # them.  Left running, the cycle collector walks them again and
+        # again as they pile up, which near doubles the time taken.
+        collecting = gc.isenabled()
+        gc.disable()
+        try:
+            for stem in ("clockstats", "peerstats", "loopstats",
+                         "rawstats", "temps", "gpsd"):
+                if self.cachedir is None:
+                    parts = self.__load_stem(statsdir, stem)
+                    rows = self.__process_stem(stem, parts)
+                else:
+                    rows = self.__load_cached(statsdir, stem)
+                if stem in BINARY_STEMS:
+                    rows = merge_rows([rows] + self.__load_binary(statsdir,
+                                                                  stem))
+                setattr(self, stem, list(rows))
+        finally:
+            if collecting:
+                gc.enable()
+
+    def __stem_files(self, pattern):
+        """Return (start, end, path) for the files matching pattern that
+        may hold rows in starttime..endtime, in time order.  Day, month
+        and year files are placed by name; for the rest end is None."""
+        files = []
+        for logpart in glob.glob(pattern + "*"):
+            # skip files older than starttime
+            mtime = os.path.getmtime(logpart)
+            if self.starttime > mtime:
+                continue
+            span = None
+            if pattern.endswith("."):
+                span = filegen_span(logpart[len(pattern):])
+            if span is None:
+                files.append((mtime, None, logpart))
+            elif span[1] > self.starttime and span[0] <= self.endtime:
+                files.append((span[0], span[1], logpart))
+        files.sort(key=lambda f: (f[0], f[2]))
+        return files
+
+    def __stem_runs(self, statsdir, stem):
+        """Return lists of a stem's files.  Day, month and year files
+        follow one another in a single list, as they don't overlap in
+        time; any other file gets a list of its own."""
+        pattern = os.path.join(statsdir, stem)
+        if stem != "temps" and stem != "gpsd":
+            pattern += "."
+        runs = []
+        run_end = None
+        for (start, end, logpart) in self.__stem_files(pattern):
+            if end is None or run_end is None or start < run_end:
+                runs.append([])
+            runs[-1].append(logpart)
+            run_end = end
+        return runs
 
     def __load_stem(self, statsdir, stem):
-        lines = []
+        """Return iterables over the lines of a stem's files, one for
+        each of __stem_runs().  Nothing is read until they are."""
+        return [itertools.chain.from_iterable(read_lines(logpart)
+                                              for logpart in run)
+                for run in self.__stem_runs(statsdir, stem)]
+
+    def __load_cached(self, statsdir, stem):
+        """As __process_stem() of __load_stem(), but with the rows of
+        each file taken from the cache directory when the file has not
+        changed since they were put there."""
+        if stem == "temps" or stem == "gpsd":
+            decode = NTPStats.posix_rows
+        else:
+            decode = NTPStats.unixize_rows
+        statsdir = os.path.abspath(statsdir)
+        # several directories may share a cache, and their file names
+        cachedir = os.path.join(self.cachedir, hashlib.sha1(
+            statsdir.encode("utf-8")).hexdigest()[:16])
+        try:
+            os.makedirs(cachedir)
+        except OSError:
+            pass    # already there, or writing it will fail quietly
+        # forget files that are gone
+        for name in os.listdir(cachedir):
+            if name.startswith(stem) and \
+               not os.path.exists(os.path.join(statsdir, name)):
+                os.remove(os.path.join(cachedir, name))
+        return merge_rows(itertools.chain.from_iterable(
+            self.__cached_rows(cachedir, logpart, decode)
+            for logpart in run)
+            for run in self.__stem_runs(statsdir, stem))
+
+    def __cached_rows(self, cachedir, logpart, decode):
+        "Return the rows of logpart inside starttime..endtime."
         try:
-            pattern = os.path.join(statsdir, stem)
-            if stem != "temps" and stem != "gpsd":
-                pattern += "."
-            for logpart in glob.glob(pattern + "*"):
-                # skip files older than starttime
-                if self.starttime > os.path.getmtime(logpart):
-                    continue
+            stat = os.stat(logpart)
+        except OSError:
+            return []
+        key = [CACHE_VERSION, list(sys.version_info[:2]), logpart,
+               stat.st_size, stat.st_mtime]
+        cachefile = os.path.join(cachedir, os.path.basename(logpart))
+        rows = None
+        try:
+            # loads() of the whole file is several times faster than load()
+            with open(cachefile, "rb") as cache:
+                (cachekey, rows) = marshal.loads(cache.read())
+            if cachekey != key:
+                rows = None
+        except (IOError, OSError, EOFError, ValueError, TypeError):
+            rows = None
+        if rows is None:
+            # all of it, whatever the period, so any period can use it
+            rows = list(decode(read_lines(logpart),
+                               float("-inf"), float("inf")))
+            try:
+                with open(cachefile + ".new", "wb") as cache:
+                    cache.write(marshal.dumps((key, rows)))
+                os.rename(cachefile + ".new", cachefile)
+            except (IOError, OSError):
+                sys.stderr.write("ntpviz: WARNING: could not write %s\n"
+                                 % cachefile)
+        if not rows or (self.starttime <= float(rows[0][1]) and
+                        float(rows[-1][1]) <= self.endtime):
+            return rows
+        return [row for row in rows
+                if self.starttime <= float(row[1]) <= self.endtime]
+
+    def __load_binary(self, statsdir, stem):
+        parts = []
+        pattern = os.path.join(statsdir, stem + BINARY_SUFFIX + ".")
+        for (_, _, logpart) in self.__stem_files(pattern):
+            try:
                 if logpart.endswith("gz"):
-                    lines += gzip.open(logpart, 'rt').readlines()
+                    data = gzip.open(logpart, 'rb').read()
                 else:
-                    lines += open(logpart, 'r').readlines()
-        except IOError:  # pragma: no cover
-            sys.stderr.write("ntpviz: WARNING: could not read %s\n"
-                             % logpart)
-
-        return lines
+                    data = open(logpart, 'rb').read()
+            except IOError:  # pragma: no cover
+                sys.stderr.write("ntpviz: WARNING: could not read %s\n"
+                                 % logpart)
+                continue
+            parts.append(binary_rows(data, self.starttime, self.endtime))
+        return parts
 
-    def __process_stem(self, stem, lines):
-        lines1 = []
+    def __process_stem(self, stem, parts):
+        """Decode the rows of each part inside starttime..endtime and
+        merge them into one stream, ordered by time.  ntpd writes each
+        file in time order, so a heap merge does instead of a sort."""
         if stem == "temps" or stem == "gpsd":
             # temps and gpsd are already in UNIX time
-            for line in lines:
-                split = line.split()
-                if 3 > len(split):
-                    # skip short lines
-                    continue
-
-                try:
-                    time_float = float(split[0])
-                except ValueError:
-                    # ignore comment lines, lines with no time
-                    continue
-
-                if self.starttime <= time_float <= self.endtime:
-                    # prefix with int milli sec.
-                    split.insert(0, int(time_float * 1000))
-                    lines1.append(split)
+            decode = NTPStats.posix_rows
         else:
             # Morph first fields into Unix time with fractional seconds
-            # ut into nice dictionary of dictionary rows
-            lines1 = NTPStats.unixize(lines, self.starttime, self.endtime)
-
-        # Sort by datestamp
-        # by default, a tuple sort()s on the 1st item, which is a nice
-        # integer of milli seconds.  This is faster than using
-        # cmp= or key=
-        lines1.sort()
-        return lines1
+            decode = NTPStats.unixize_rows
+        # by default, lists compare on the 1st item, which is a nice
+        # integer of milli seconds.  This is faster than using key=
+        return merge_rows(decode(lines, self.starttime, self.endtime)
+                          for lines in parts)
 
     def peersplit(self):
         """Return a dictionary mapping peerstats IPs to entry subsets.
@@ -15,6 +15,7 @@ import shutil
 import socket
 import string
 import sys
+import threading
 import time
 import ntp.ntpc
 import ntp.magic
@@ -624,15 +625,16 @@ class Cache:
         self._cache = {}
 
     def get(self, key):
-        if key in self._cache:
-            value, settime, ttl = self._cache[key]
-            if settime >= monoclock() - ttl:
-                return value
-            else:  # key expired, delete it
-                del self._cache[key]
-                return None
-        else:
+        # One lookup, so a resolver thread can't drop the key under us
+        hit = self._cache.get(key)
+        if hit is None:
             return None
+        value, settime, ttl = hit
+        if settime >= monoclock() - ttl:
+            return value
+        # key expired, delete it
+        self._cache.pop(key, None)
+        return None
 
     def set(self, key, value, customTTL=None):
         ttl = customTTL if customTTL is not None else self.defaultTimeout
@@ -671,6 +673,76 @@ def canonicalize_dns(inhost, family=socket.AF_UNSPEC):
     return result
 
 
+def confirm_dns(ip, dns):
+    "Forward-confirm that the name dns maps back to ip; cached."
+    confirmed = canonicalization_cache.get(dns)
+    if confirmed is None:
+        confirmed = False
+        try:
+            ai = socket.getaddrinfo(dns, None)
+            for (_, _, _, _, sockaddr) in ai:
+                if sockaddr and sockaddr[0] == ip:
+                    confirmed = True
+                    break
+        except socket.gaierror:
+            pass
+        canonicalization_cache.set(dns, confirmed)
+    return confirmed
+
+
+# A display of many addresses resolves them all at once, on a pool of
+# threads, instead of one getnameinfo() per row.  Whatever is still
+# unresolved at the deadline is shown numerically for a while.
+DNS_WORKERS = 16
+DNS_DEADLINE = 5.0      # seconds, for the whole batch
+DNS_SLOW_TTL = 60       # seconds an unresolved address stays numeric
+
+
+def parallel_lookup(lookup, keys, deadline=DNS_DEADLINE, workers=DNS_WORKERS):
+    "Call lookup(key) for every key on a thread pool, until the deadline."
+    todo = list(keys)
+    if not todo:
+        return
+    lock = threading.Lock()
+
+    def worker():
+        while True:
+            with lock:
+                if not todo:
+                    return
+                key = todo.pop()
+            try:
+                lookup(key)
+            except Exception:   # pragma: no cover
+                # The row will be looked up, or shown raw, later
+                pass
+
+    threads = [threading.Thread(target=worker)
+               for _ in range(min(workers, len(todo)))]
+    for thread in threads:
+        thread.daemon = True    # a stuck lookup must not hold up exit
+        thread.start()
+    end = monoclock() + deadline
+    for thread in threads:
+        thread.join(max(0.0, end - monoclock()))
+
+
+def prefetch_dns(hosts, confirm=False, deadline=DNS_DEADLINE):
+    "Canonicalize hosts in parallel into canonicalization_cache."
+    pending = set(host for host in hosts
+                  if canonicalization_cache.get(host) is None)
+
+    def lookup(host):
+        dns = canonicalize_dns(host)
+        if confirm:
+            confirm_dns(portsplit(host)[0], dns)
+
+    parallel_lookup(lookup, pending, deadline)
+    for host in pending:
+        if canonicalization_cache.get(host) is None:
+            canonicalization_cache.set(host, host, DNS_SLOW_TTL)
+
+
 TermSize = collections.namedtuple("TermSize", ["width", "height"])
 
 
@@ -961,6 +1033,23 @@ class PeerSummary:
         "Width of display"
         return 79 + self.horizontal_slack
 
+    def prefetch(self, variable_sets):
+        "Resolve the names summary() will show for these peers, at once."
+        if not self.showhostnames & 1:
+            return
+        hosts = []
+        for variables in variable_sets:
+            # values are (cooked, raw) pairs, as summary() takes them
+            (srcadr, _) = variables.get("srcadr",
+                                        variables.get("peeradr", (None, None)))
+            (srchost, _) = variables.get("srchost", (None, None))
+            if self.showhostnames & 2 and srchost:
+                continue
+            if srcadr and srcadr not in ("0.0.0.0", "::") \
+                    and not srcadr.startswith("127.127"):
+                hosts.append(srcadr)
+        prefetch_dns(hosts)
+
     def summary(self, rstatus, variables, associd):
         "Peer status summary line."
         clock_name = ''
@@ -1241,9 +1330,14 @@ class MRUSummary:
 
     header = " lstint avgint rstr r m v  count    score   drop rport remote address"
 
+    def prefetch(self, entries):
+        "Resolve and confirm the names summary() will show, at once."
+        if self.showhostnames & 1:
+            prefetch_dns([portsplit(entry.addr)[0] for entry in entries],
+                         confirm=True)
+
     def summary(self, entry):
-        first = ntp.ntpc.lfptofloat(entry.first)
-        last = ntp.ntpc.lfptofloat(entry.last)
+        (first, last) = entry.stamps()
         active = float(last - first)
         count = int(entry.ct)
         if self.now:
@@ -1277,18 +1371,7 @@ class MRUSummary:
             else:
                 dns = canonicalize_dns(ip)
                 # Forward-confirm the returned DNS
-                confirmed = canonicalization_cache.get(dns)
-                if confirmed is None:
-                    confirmed = False
-                    try:
-                        ai = socket.getaddrinfo(dns, None)
-                        for (_, _, _, _, sockaddr) in ai:
-                            if sockaddr and sockaddr[0] == ip:
-                                confirmed = True
-                                break
-                    except socket.gaierror:
-                        pass
-                    canonicalization_cache.set(dns, confirmed)
+                confirmed = confirm_dns(ip, dns)
                 if not confirmed:
                     dns = "%s (%s)" % (ip, dns)
             if not self.wideremote:
@@ -1343,6 +1426,11 @@ class ReslistSummary:
 
     def summary(self, variables):
         hits = variables.get("hits", "?")
+        if "set" in variables:
+            # the restrict set: a file of prefixes, not an address
+            return "%10s set %s, %s prefixes\n           %s\n" % (
+                hits, variables["set"], variables.get("prefixes", "?"),
+                variables.get("flags", "?"))
         address = variables.get("addr", "?")
         mask = variables.get("mask", "?")
         if address == '?' or mask == '?':
@@ -1362,12 +1450,12 @@ class ReslistSummary:
 class IfstatsSummary:
     "Reusable class for ifstats entry summary generation."
     header = """\
-    interface name                                  send
- #  address/broadcast     drop flag received sent failed peers   uptime
+    interface name                              send kernel
+ #  address/broadcast drop flag   recv   sent failed  drops peers   uptime
  """
     width = 74
     # Numbers are the fieldsize
-    fields = {'name':  '%-24.24s',
+    fields = {'name':  '%-20.20s',
               'flags': '%4x',
               'rx':    '%6d',
               'tx':    '%6d',
@@ -1386,11 +1474,14 @@ class IfstatsSummary:
                 else:
                     fmt = self.fields[name] % value
                 formatted[name] = fmt
+            # an older ntpd doesn't count kernel drops
+            kd = variables.get("kd")
+            formatted['kd'] = ' ' * 6 if kd is None else '%6d' % kd
             enFlag = '.' if variables.get('en', False) else 'D'
             address = variables.get("addr", "?")
             bcast = variables.get("bcast")
             # Assemble the fields into a line
-            s = ("%3u %s %s %s %s %s %s %s %s\n    %s\n"
+            s = ("%3u %s %s %s %s %s %s %s %s %s\n    %s\n"
                  % (i,
                     formatted['name'],
                     enFlag,
@@ -1398,6 +1489,7 @@ class IfstatsSummary:
                     formatted['rx'],
                     formatted['tx'],
                     formatted['txerr'],
+                    formatted['kd'],
                     formatted['pc'],
                     formatted['up'],
                     address))
@@ -1415,6 +1507,26 @@ class IfstatsSummary:
         return s
 
 
+class PkttraceSummary:
+    "Reusable class for packet trace entry summary generation."
+    header = """\
+       age dir    len v m  st remote address
+"""
+    width = 60
+
+    def summary(self, newest, entry):
+        "One line for a PacketTrace, its age counted back from newest."
+        age = (newest - entry.stamp) / 2.0**32
+        # modes 6 and 7 have no stratum there
+        if entry.mode() < 6:
+            stratum = "%3d" % entry.stratum()
+        else:
+            stratum = "  -"
+        return "%10.6f %s %5d %d %d %s %s\n" % (
+            age, entry.direction, entry.length, entry.version(),
+            entry.mode(), stratum, entry.addr)
+
+
 def packetize(packets, period, clipdigits=0, periodized=False):
     """Given a number of packets and a duration (s) return a tuple.
 
@@ -0,0 +1,25 @@
+/*
+ * Copyright the NTPsec project contributors
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * test_ntpd links all of ntpd but ntpd_nonroot.c, whose main() would
+ * clash with the test runner's.  These stand in for what the rest of
+ * ntpd takes from it.
+ */
+
+#include "config.h"
+
+#include "ntpd.h"
+
+bool listen_to_virtual_ips = true;
+int waitsync_fd_to_close = -1;
+
+const char *ntpd_version(void) {
+	return progname;
+}
+
+void announce_starting(void) {
+}
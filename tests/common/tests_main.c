@@ -46,13 +46,18 @@ static void RunAllTests(void)
 	RUN_TEST_GROUP(decodenetnum);
 	RUN_TEST_GROUP(dolfptoa);
 	RUN_TEST_GROUP(hextolfp);
+	RUN_TEST_GROUP(histogram);
+	RUN_TEST_GROUP(json_scan);
 	RUN_TEST_GROUP(lfpfunc);
 	RUN_TEST_GROUP(lfptostr);
 	RUN_TEST_GROUP(macencrypt);
+	RUN_TEST_GROUP(msyslog);
+	RUN_TEST_GROUP(nmea_scan);
 	RUN_TEST_GROUP(numtoa);
 	RUN_TEST_GROUP(prettydate);
 	RUN_TEST_GROUP(random);
 	RUN_TEST_GROUP(refidsmear);
+	RUN_TEST_GROUP(shard);
 	RUN_TEST_GROUP(socktoa);
 	RUN_TEST_GROUP(statestr);
 	RUN_TEST_GROUP(timespecops);
@@ -64,18 +69,24 @@ static void RunAllTests(void)
 	RUN_TEST_GROUP(binio);
 	RUN_TEST_GROUP(gpstolfp);
 	RUN_TEST_GROUP(ieee754io);
+	RUN_TEST_GROUP(tsip_frame);
 #endif
 
 #ifdef TEST_NTPD
+	RUN_TEST_GROUP(dnscache);
+	RUN_TEST_GROUP(io);
 	RUN_TEST_GROUP(leapsec);
+	RUN_TEST_GROUP(monitor);
 	RUN_TEST_GROUP(hackrestrict);
 	RUN_TEST_GROUP(recvbuff);
+	RUN_TEST_GROUP(select);
 #ifndef DISABLE_NTS
 	RUN_TEST_GROUP(nts);
 	RUN_TEST_GROUP(nts_client);
 	RUN_TEST_GROUP(nts_server);
 	RUN_TEST_GROUP(nts_cookie);
 	RUN_TEST_GROUP(nts_extens);
+	RUN_TEST_GROUP(nts_gcm_siv);
 #endif
 #endif
 
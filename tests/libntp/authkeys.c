@@ -6,6 +6,9 @@
 #include "unity_fixture.h"
 
 #include <openssl/evp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "ntp.h"
 
@@ -89,9 +92,241 @@ TEST(authkeys, HaveKeyIncorrect) {
 	TEST_ASSERT_NULL(authlookup(KEYNO, false));
 }
 
+TEST(authkeys, ReplaceKeyRekeysCMAC) {
+	const keyid_t KEYNO = 7;
+	unsigned char new_key[16] = "fedcba9876543210";
+	uint32_t pkt1[16], pkt2[16];
+	auth_info fresh;
+	auth_info *auth;
+
+	AddTrustedKey(KEYNO);
+	auth_setkey(KEYNO, AUTH_CMAC, "AES-128-CBC", new_key, sizeof(new_key));
+	auth = authlookup(KEYNO, true);
+	TEST_ASSERT_NOT_NULL(auth);
+
+	/* The cached context must use the new key, not the old one */
+	memset(&fresh, 0, sizeof(fresh));
+	fresh.type = AUTH_CMAC;
+	fresh.key = new_key;
+	fresh.key_size = sizeof(new_key);
+	fresh.mac_ctx = Setup_MAC_CTX("AES-128-CBC", fresh.key, fresh.key_size);
+	TEST_ASSERT_NOT_NULL(fresh.mac_ctx);
+
+	memset(pkt1, 0x5a, sizeof(pkt1));
+	memset(pkt2, 0x5a, sizeof(pkt2));
+	TEST_ASSERT_EQUAL(4+16, cmac_encrypt(auth, pkt1, 32));
+	TEST_ASSERT_EQUAL(4+16, cmac_encrypt(&fresh, pkt2, 32));
+	TEST_ASSERT_EQUAL_MEMORY(pkt2, pkt1, 32+4+16);
+	Free_MAC_CTX(&fresh);
+}
+
+TEST(authkeys, ReplaceKeyRedigests) {
+	const keyid_t KEYNO = 8;
+	unsigned char new_key[16] = "fedcba9876543210";
+	uint32_t pkt1[16], pkt2[16];
+	auth_info fresh;
+	auth_info *auth;
+
+	auth_setkey(KEYNO, AUTH_DIGEST, "MD5", aes_key, sizeof(aes_key));
+	auth_setkey(KEYNO, AUTH_DIGEST, "MD5", new_key, sizeof(new_key));
+	auth = authlookup(KEYNO, false);
+	TEST_ASSERT_NOT_NULL(auth);
+
+	/* The key hashed ahead must be the new one */
+	memset(&fresh, 0, sizeof(fresh));
+	fresh.type = AUTH_DIGEST;
+	fresh.digest = auth->digest;
+	fresh.key = new_key;
+	fresh.key_size = sizeof(new_key);
+	fresh.md_ctx = Setup_MD_CTX(fresh.digest, fresh.key, fresh.key_size);
+	TEST_ASSERT_NOT_NULL(fresh.md_ctx);
+
+	memset(pkt1, 0x5a, sizeof(pkt1));
+	memset(pkt2, 0x5a, sizeof(pkt2));
+	TEST_ASSERT_EQUAL(4+16, digest_encrypt(auth, pkt1, 32));
+	TEST_ASSERT_EQUAL(4+16, digest_encrypt(&fresh, pkt2, 32));
+	TEST_ASSERT_EQUAL_MEMORY(pkt2, pkt1, 32+4+16);
+	Free_MAC_CTX(&fresh);
+}
+
+TEST(authkeys, ManyKeys) {
+	const keyid_t NKEYS = 20000;
+	const keyid_t STRIDE = 7919;	/* prime, spreads the keyids */
+
+	for (keyid_t i = 1; i <= NKEYS; i++)
+		auth_setkey(i * STRIDE, AUTH_DIGEST, "MD5", aes_key,
+			    sizeof(aes_key));
+	auth_index();
+
+	for (keyid_t i = 1; i <= NKEYS; i++) {
+		auth_info *auth = authlookup(i * STRIDE, false);
+		TEST_ASSERT_NOT_NULL(auth);
+		TEST_ASSERT_EQUAL(i * STRIDE, auth->keyid);
+	}
+	for (keyid_t i = 1; i <= NKEYS; i++)
+		TEST_ASSERT_NULL(authlookup(i * STRIDE + 1, false));
+
+	/* a key added later is found once the index catches up */
+	auth_setkey(1, AUTH_DIGEST, "MD5", aes_key, sizeof(aes_key));
+	TEST_ASSERT_NOT_NULL(authlookup(1, false));
+}
+
+static void WriteKeys(const char *path, const char *text) {
+	FILE *fp = fopen(path, "w");
+
+	TEST_ASSERT_NOT_NULL(fp);
+	fputs(text, fp);
+	fclose(fp);
+}
+
+TEST(authkeys, ReloadChangesOnlyDiffs) {
+	char path[] = "/tmp/ntpkeys-XXXXXX";
+	auth_keyfile *kf;
+	auth_info *auth, *kept;
+	int fd = mkstemp(path);
+
+	TEST_ASSERT_TRUE(fd >= 0);
+	close(fd);
+	WriteKeys(path,
+		  "# test keys\n"
+		  "101 MD5 first\n"
+		  "102 SHA1 second\n"
+		  "103 AES 0123456789abcdef0123456789abcdef\n"
+		  "102 SHA1 twice\n");
+	TEST_ASSERT_TRUE(authreadkeys(path));
+	auth = authlookup(102, false);
+	TEST_ASSERT_NOT_NULL(auth);
+	TEST_ASSERT_EQUAL(5, auth->key_size);	/* last line wins */
+	TEST_ASSERT_EQUAL_MEMORY("twice", auth->key, 5);
+	kept = authlookup(103, false);
+	TEST_ASSERT_NOT_NULL(kept);
+	TEST_ASSERT_EQUAL(AUTH_CMAC, kept->type);
+
+	/* drop 101, change 102, keep 103, add 104 */
+	WriteKeys(path,
+		  "102 SHA1 changed\n"
+		  "103 AES 0123456789abcdef0123456789abcdef\n"
+		  "104 MD5 fourth\n");
+	kf = authparsekeys(path);
+	TEST_ASSERT_NOT_NULL(kf);
+	TEST_ASSERT_EQUAL(3, authapplykeys(kf));
+
+	TEST_ASSERT_NULL(authlookup(101, false));
+	auth = authlookup(102, false);
+	TEST_ASSERT_NOT_NULL(auth);
+	TEST_ASSERT_EQUAL_MEMORY("changed", auth->key, 7);
+	TEST_ASSERT_TRUE(kept == authlookup(103, false));
+	TEST_ASSERT_NOT_NULL(authlookup(104, false));
+
+	/* nothing changed */
+	kf = authparsekeys(path);
+	TEST_ASSERT_NOT_NULL(kf);
+	TEST_ASSERT_EQUAL(0, authapplykeys(kf));
+	unlink(path);
+}
+
+static void Put32(FILE *fp, uint32_t v) {
+	putc((int)(v >> 24), fp);
+	putc((int)(v >> 16) & 0xff, fp);
+	putc((int)(v >> 8) & 0xff, fp);
+	putc((int)v & 0xff, fp);
+}
+
+static void PutRecord(FILE *fp, int name, const char *key, size_t len) {
+	uint8_t rec[2 + 32] = { 0 };
+
+	rec[0] = (uint8_t)name;
+	rec[1] = (uint8_t)len;
+	memcpy(rec + 2, key, len);
+	fwrite(rec, sizeof(rec), 1, fp);
+}
+
+/* A compiled keys file, as ntpkeydb writes it */
+static void WriteKeyDB(const char *path) {
+	char names[2][32] = { "AES", "MD5" };
+	FILE *fp = fopen(path, "w");
+
+	TEST_ASSERT_NOT_NULL(fp);
+	fputs("NTPKEYDB", fp);
+	Put32(fp, 1);			/* version */
+	Put32(fp, 2);			/* names */
+	Put32(fp, 2);			/* keys */
+	fwrite(names, sizeof(names), 1, fp);
+	for (uint32_t keyno = 0; keyno <= NTP_MAXKEY; keyno++)
+		Put32(fp, (201 == keyno) ? 1 : (202 == keyno) ? 2 : 0);
+	PutRecord(fp, 0, (const char *)aes_key, sizeof(aes_key));
+	PutRecord(fp, 1, "hello", 5);
+	fclose(fp);
+}
+
+TEST(authkeys, CompiledKeysLoadOnUse) {
+	char path[] = "/tmp/ntpkeys-XXXXXX";
+	auth_info *auth;
+	unsigned int before;
+	int fd = mkstemp(path);
+
+	TEST_ASSERT_TRUE(fd >= 0);
+	close(fd);
+	WriteKeyDB(path);
+	TEST_ASSERT_TRUE(authreadkeys(path));
+
+	/* nothing is loaded until it is looked up */
+	before = authnumkeys;
+	auth = authlookup(201, false);
+	TEST_ASSERT_NOT_NULL(auth);
+	TEST_ASSERT_EQUAL(before + 1, authnumkeys);
+	TEST_ASSERT_EQUAL(AUTH_CMAC, auth->type);
+	TEST_ASSERT_EQUAL_MEMORY(aes_key, auth->key, sizeof(aes_key));
+	TEST_ASSERT_TRUE(auth == authlookup(201, false));
+	auth = authlookup(202, false);
+	TEST_ASSERT_NOT_NULL(auth);
+	TEST_ASSERT_EQUAL(AUTH_DIGEST, auth->type);
+	TEST_ASSERT_EQUAL_MEMORY("hello", auth->key, 5);
+	TEST_ASSERT_NULL(authlookup(203, false));
+	TEST_ASSERT_EQUAL(before + 2, authnumkeys);
+
+	/* back to a text file drops them */
+	WriteKeys(path, "204 MD5 text\n");
+	TEST_ASSERT_TRUE(authreadkeys(path));
+	TEST_ASSERT_NULL(authlookup(201, false));
+	TEST_ASSERT_NOT_NULL(authlookup(204, false));
+	unlink(path);
+}
+
+/* key material is charged to MEM_KEYS and credited back on delete */
+TEST(authkeys, KeyMemoryAccounted) {
+	const keyid_t KEYNO = 9;
+	uint64_t bytes, blocks;
+
+	AddTrustedKey(KEYNO);
+	bytes = mem_stat(MEM_KEYS, MEM_BYTES);
+	blocks = mem_stat(MEM_KEYS, MEM_BLOCKS);
+
+	/* a longer key replaces the old block */
+	auth_setkey(KEYNO, AUTH_DIGEST, "MD5",
+		    (const uint8_t *)"0123456789abcdefghij", 20);
+	TEST_ASSERT_EQUAL(bytes + 20 - sizeof(aes_key),
+			  mem_stat(MEM_KEYS, MEM_BYTES));
+	TEST_ASSERT_EQUAL(blocks, mem_stat(MEM_KEYS, MEM_BLOCKS));
+	TEST_ASSERT_TRUE(mem_stat(MEM_KEYS, MEM_PEAK)
+			 >= mem_stat(MEM_KEYS, MEM_BYTES));
+
+	/* a trusted key keeps its slot but loses its material */
+	auth_delkey(KEYNO);
+	TEST_ASSERT_EQUAL(bytes - sizeof(aes_key),
+			  mem_stat(MEM_KEYS, MEM_BYTES));
+	TEST_ASSERT_EQUAL(blocks - 1, mem_stat(MEM_KEYS, MEM_BLOCKS));
+}
+
 TEST_GROUP_RUNNER(authkeys) {
 	RUN_TEST_CASE(authkeys, AddTrustedKeys);
 	RUN_TEST_CASE(authkeys, AddUntrustedKey);
 	RUN_TEST_CASE(authkeys, HaveKeyCorrect);
 	RUN_TEST_CASE(authkeys, HaveKeyIncorrect);
+	RUN_TEST_CASE(authkeys, ReplaceKeyRekeysCMAC);
+	RUN_TEST_CASE(authkeys, ReplaceKeyRedigests);
+	RUN_TEST_CASE(authkeys, ManyKeys);
+	RUN_TEST_CASE(authkeys, ReloadChangesOnlyDiffs);
+	RUN_TEST_CASE(authkeys, CompiledKeysLoadOnUse);
+	RUN_TEST_CASE(authkeys, KeyMemoryAccounted);
 }
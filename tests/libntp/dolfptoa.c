@@ -73,8 +73,37 @@ TEST(dolfptoa, MfpToMs) {
 	TEST_ASSERT_EQUAL_STRING("-42000.000", mfptoms(in, 3));
 }
 
+TEST(dolfptoa, DoLfpToAR) {
+	char buf[LFPTOA_LEN];
+	l_fp in;
+
+	// Odd digit counts take the last one singly
+	in = lfpinit(1444359386, 0x2e0c7583);
+	TEST_ASSERT_EQUAL_STRING("1444359386.1798776",
+		dolfptoa_r(in, false, 7, false, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("1444359386.179877610",
+		ulfptoa_r(in, 9, buf, sizeof(buf)));
+	// Rounding carries through the integral part
+	in = lfpinit(999, 0xFFFFFFFF);
+	TEST_ASSERT_EQUAL_STRING("1000.000",
+		dolfptoa_r(in, false, 3, false, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("-1000",
+		dolfptoa_r(in, true, 0, false, buf, sizeof(buf)));
+	in = lfpinit(0, 0xFFFFFFFF);
+	TEST_ASSERT_EQUAL_STRING("1000.0",
+		dolfptoa_r(in, false, 1, true, buf, sizeof(buf)));
+	// Same as the shared buffer version
+	in = lfpinit(0xFFFFFFFF, 0xFF000000);
+	TEST_ASSERT_EQUAL_STRING(dolfptoa(in, true, 15, true),
+		dolfptoa_r(in, true, 15, true, buf, sizeof(buf)));
+	// Too small a buffer truncates
+	TEST_ASSERT_EQUAL_STRING("4294",
+		dolfptoa_r(in, false, 5, false, buf, 5));
+}
+
 TEST_GROUP_RUNNER(dolfptoa) {
 	RUN_TEST_CASE(dolfptoa, DoLfpToA);
 	RUN_TEST_CASE(dolfptoa, MfpToA);
 	RUN_TEST_CASE(dolfptoa, MfpToMs);
+	RUN_TEST_CASE(dolfptoa, DoLfpToAR);
 }
@@ -0,0 +1,62 @@
+#include "config.h"
+#include "ntp_stdlib.h"
+#include "ntp_histogram.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP(histogram);
+
+TEST_SETUP(histogram) {}
+
+TEST_TEAR_DOWN(histogram) {}
+
+static struct histogram h;
+
+TEST(histogram, Buckets) {
+	/* every value lies within the bucket it is put in */
+	for (uint64_t ns = 1; ns < (1ull << 20); ns = ns * 9 / 8 + 1) {
+		unsigned int b = histogram_bucket(ns);
+
+		TEST_ASSERT_TRUE(ns <= histogram_bucket_top(b));
+		TEST_ASSERT_TRUE(0 == b || ns > histogram_bucket_top(b - 1));
+	}
+	TEST_ASSERT_EQUAL(0, histogram_bucket(0));
+	TEST_ASSERT_EQUAL(9, histogram_bucket_top(histogram_bucket(8)));
+	TEST_ASSERT_EQUAL(HIST_BUCKETS - 1, histogram_bucket(UINT64_MAX));
+}
+
+TEST(histogram, Empty) {
+	histogram_clear(&h);
+	TEST_ASSERT_EQUAL(0, histogram_percentile(&h, 50));
+	TEST_ASSERT_EQUAL(0, histogram_percentile(&h, 100));
+}
+
+TEST(histogram, Percentiles) {
+	histogram_clear(&h);
+	for (uint64_t i = 1; i <= 1000; i++)
+		histogram_add(&h, i * 1000);
+	TEST_ASSERT_EQUAL(1000, h.count);
+	TEST_ASSERT_EQUAL(1000000, h.max);
+	TEST_ASSERT_EQUAL(500500000, h.sum);
+	/* within a bucket width, never below the truth */
+	TEST_ASSERT_TRUE(histogram_percentile(&h, 50) >= 500000);
+	TEST_ASSERT_TRUE(histogram_percentile(&h, 50) < 500000 * 5 / 4);
+	TEST_ASSERT_TRUE(histogram_percentile(&h, 99) >= 990000);
+	TEST_ASSERT_EQUAL(1000000, histogram_percentile(&h, 99.9));
+	TEST_ASSERT_EQUAL(1000000, histogram_percentile(&h, 100));
+}
+
+TEST(histogram, Single) {
+	histogram_clear(&h);
+	histogram_add(&h, 12345);
+	TEST_ASSERT_EQUAL(12345, histogram_percentile(&h, 0));
+	TEST_ASSERT_EQUAL(12345, histogram_percentile(&h, 50));
+}
+
+TEST_GROUP_RUNNER(histogram) {
+	RUN_TEST_CASE(histogram, Buckets);
+	RUN_TEST_CASE(histogram, Empty);
+	RUN_TEST_CASE(histogram, Percentiles);
+	RUN_TEST_CASE(histogram, Single);
+}
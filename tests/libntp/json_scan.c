@@ -0,0 +1,97 @@
+#include "config.h"
+#include "ntp_stdlib.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+#include "json_scan.h"
+
+TEST_GROUP(json_scan);
+
+TEST_SETUP(json_scan) {}
+
+TEST_TEAR_DOWN(json_scan) {}
+
+static const char * const keys[] = { "mode", "time", "ept", "sats" };
+static json_value val[4];
+static char buf[512];
+
+static int
+scan(const char *text, int nkeys)
+{
+	strlcpy(buf, text, sizeof(buf));
+	return json_scan(buf, strlen(buf), keys, nkeys, val);
+}
+
+
+TEST(json_scan, Members) {
+	long	mode;
+	double	ept;
+
+	TEST_ASSERT_EQUAL_INT(4, scan(
+		"{\"class\":\"TPV\",\"mode\":3,\"sats\":[{\"a\":\"]}\"},[1]],"
+		" \"time\" : \"2024-01-02T03:04:05.000Z\",\"ept\":0.005}", 4));
+	TEST_ASSERT_TRUE(json_value_int(&val[0], &mode));
+	TEST_ASSERT_EQUAL_INT(3, mode);
+	TEST_ASSERT_EQUAL_INT(JSON_STRING, val[1].kind);
+	TEST_ASSERT_TRUE(json_value_float(&val[2], &ept));
+	TEST_ASSERT_EQUAL_DOUBLE(0.005, ept);
+	TEST_ASSERT_EQUAL_INT(JSON_COMPOUND, val[3].kind);
+	TEST_ASSERT_EQUAL_INT(16, val[3].len);
+	TEST_ASSERT_EQUAL_STRING("2024-01-02T03:04:05.000Z",
+				 json_value_string(&val[1]));
+}
+
+TEST(json_scan, Missing) {
+	long	mode;
+
+	TEST_ASSERT_EQUAL_INT(1, scan("{\"class\":\"SKY\",\"mode\":-2}", 3));
+	TEST_ASSERT_EQUAL_INT(JSON_NONE, val[1].kind);
+	TEST_ASSERT_NULL(json_value_string(&val[1]));
+	TEST_ASSERT_FALSE(json_value_float(&val[2], NULL));
+	TEST_ASSERT_TRUE(json_value_int(&val[0], &mode));
+	TEST_ASSERT_EQUAL_INT(-2, mode);
+	TEST_ASSERT_EQUAL_INT(0, scan("{ }", 3));
+}
+
+TEST(json_scan, StopsEarly) {
+	/* the junk after the last wanted member is never read */
+	TEST_ASSERT_EQUAL_INT(1, scan("{\"mode\":1,junk", 1));
+	TEST_ASSERT_EQUAL_INT(-1, scan("{\"mode\":1,junk", 2));
+}
+
+TEST(json_scan, Malformed) {
+	TEST_ASSERT_EQUAL_INT(-1, scan("", 1));
+	TEST_ASSERT_EQUAL_INT(-1, scan("[1,2]", 1));
+	TEST_ASSERT_EQUAL_INT(-1, scan("{\"time\":\"open", 2));
+	TEST_ASSERT_EQUAL_INT(-1, scan("{\"sats\":[{}", 4));
+	TEST_ASSERT_EQUAL_INT(-1, scan("{\"mode\" 1}", 1));
+	/* a primitive that runs off the end */
+	TEST_ASSERT_EQUAL_INT(-1, scan("{\"mode\":1", 1));
+}
+
+TEST(json_scan, Values) {
+	long	n;
+
+	TEST_ASSERT_EQUAL_INT(3, scan(
+		"{\"mode\":true,\"time\":\"a\\\"b\",\"ept\":1e3}", 3));
+	TEST_ASSERT_EQUAL_INT(1, json_value_bool(&val[0]));
+	TEST_ASSERT_FALSE(json_value_int(&val[0], &n));
+	TEST_ASSERT_FALSE(json_value_int(&val[2], &n));
+	TEST_ASSERT_EQUAL_INT(-1, json_value_bool(&val[1]));
+	TEST_ASSERT_TRUE(json_value_is(&val[1], "a\\\"b"));
+	TEST_ASSERT_FALSE(json_value_is(&val[1], "a"));
+
+	TEST_ASSERT_EQUAL_INT(1, scan("{\"mode\":99999999999999999999}", 1));
+	TEST_ASSERT_FALSE(json_value_int(&val[0], &n));
+	TEST_ASSERT_EQUAL_INT(1, scan("{\"mode\":false}", 1));
+	TEST_ASSERT_EQUAL_INT(0, json_value_bool(&val[0]));
+}
+
+TEST_GROUP_RUNNER(json_scan) {
+	RUN_TEST_CASE(json_scan, Members);
+	RUN_TEST_CASE(json_scan, Missing);
+	RUN_TEST_CASE(json_scan, StopsEarly);
+	RUN_TEST_CASE(json_scan, Malformed);
+	RUN_TEST_CASE(json_scan, Values);
+}
@@ -281,6 +281,50 @@ TEST(lfpfunc, FDF_RoundTrip) {
 }
 
 
+//----------------------------------------------------------------------
+// the conversions scale by multiplying, check that against ldexp(),
+// which they used to call, bit for bit
+//----------------------------------------------------------------------
+static uint64_t
+xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/* a == b, without -Wfloat-equal's complaint, none are NaN */
+static bool
+same(doubletime_t a, doubletime_t b)
+{
+	return !(a < b || a > b);
+}
+
+TEST(lfpfunc, ScaleMatchesLdexp) {
+	uint64_t state = 0x9e3779b97f4a7c15;
+
+	for (int i = 0; i < 1000000; i++) {
+		l_fp x = xorshift64(&state);
+		/* from every magnitude, not just the top one */
+		if (i & 1)
+			x >>= i % 64;
+		doubletime_t d = ldexpl((double)((int64_t)x), -32);
+		TEST_ASSERT_TRUE(same(d, lfptod(x)));
+		TEST_ASSERT_EQUAL_UINT64((l_fp)(int64_t)ldexpl(d, 32),
+					 dtolfp(d));
+		TEST_ASSERT_TRUE(same(ldexp((double)(uint32_t)x, -16),
+				      FP_UNSCALE((uint32_t)x)));
+		TEST_ASSERT_TRUE(same(ldexp((double)d, 16),
+				      FP_SCALE((double)d)));
+	}
+	for (size_t idx = 0; idx < round_cnt; ++idx)
+		TEST_ASSERT_TRUE(same(ldexpl((double)((int64_t)roundtab[idx]),
+					     -32), lfptod(roundtab[idx])));
+}
+
 //----------------------------------------------------------------------
 // test the compare stuff
 //
@@ -360,6 +404,7 @@ TEST_GROUP_RUNNER(lfpfunc) {
 	RUN_TEST_CASE(lfpfunc, Negation);
 	RUN_TEST_CASE(lfpfunc, Absolute);
 	RUN_TEST_CASE(lfpfunc, FDF_RoundTrip);
+	RUN_TEST_CASE(lfpfunc, ScaleMatchesLdexp);
 	RUN_TEST_CASE(lfpfunc, SignedRelOps);
 	RUN_TEST_CASE(lfpfunc, UnsignedRelOps);
 }
@@ -52,15 +52,14 @@ TEST(macencrypt, Encrypt) {
 #else
 	auth.digest = EVP_get_digestbyname("MD5");
 #endif
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
 	auth.mac_ctx = NULL;
-#else
-	auth.cipher = NULL;
-#endif
 	auth.key = (uint8_t *)MD5key;
 	auth.key_size = (unsigned short)strlen(MD5key);
 
 	TEST_ASSERT_NOT_NULL(auth.digest);
+	EVP_MD_CTX_free(auth.md_ctx);
+	auth.md_ctx = Setup_MD_CTX(auth.digest, auth.key, auth.key_size);
+	TEST_ASSERT_NOT_NULL(auth.md_ctx);
 
 	int length = digest_encrypt(&auth,
 				    (uint32_t*)packetPtr, packetLength);
@@ -96,13 +95,8 @@ TEST(macencrypt, CMAC_Encrypt) {
 	auth.digest = NULL;
 	auth.key = (uint8_t *)CMACkey;
 	auth.key_size = (unsigned short)strlen(CMACkey);
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
 	auth.mac_ctx = Setup_MAC_CTX("AES-128-CBC", auth.key, auth.key_size);
 	TEST_ASSERT_NOT_NULL(auth.mac_ctx);
-#else
-	auth.cipher = EVP_get_cipherbyname("AES-128-CBC");
-	TEST_ASSERT_NOT_NULL(auth.cipher);
-#endif
 
 	int length = cmac_encrypt(&auth,
 				  (uint32_t*)packetPtr, packetLength);
@@ -212,13 +206,8 @@ TEST(macencrypt, null_trunc) {
 	auth.key = (uint8_t *)key;
 	auth.key_size = (unsigned short)strlen(CMACkey);
 
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
 	auth.mac_ctx = Setup_MAC_CTX("AES-128-CBC", auth.key, auth.key_size);
 	TEST_ASSERT_NOT_NULL(auth.mac_ctx);
-#else
-	auth.cipher = EVP_get_cipherbyname("AES-128-CBC");
-	TEST_ASSERT_NOT_NULL(auth.cipher);
-#endif
 
 	int length = cmac_encrypt(&auth,
 				  (uint32_t*)sample, len_pack);
@@ -282,13 +271,8 @@ TEST(macencrypt, CMAC_TestVectors) {
 	auth.key = (uint8_t *)key;
 	auth.key_size = (unsigned short)sizeof(key);
 
-#if OPENSSL_VERSION_NUMBER > 0x20000000L
 	auth.mac_ctx = Setup_MAC_CTX("AES-128-CBC", auth.key, auth.key_size);
 	TEST_ASSERT_NOT_NULL(auth.mac_ctx);
-#else
-	auth.cipher = EVP_get_cipherbyname("AES-128-CBC");
-	TEST_ASSERT_NOT_NULL(auth.cipher);
-#endif
 
 	memcpy(buffer, M, 0);
 	length = cmac_encrypt(&auth, (uint32_t*)buffer, 0);
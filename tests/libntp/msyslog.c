@@ -0,0 +1,117 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ntp_stdlib.h"
+#include "ntp_syslog.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP(msyslog);
+
+TEST_SETUP(msyslog) {}
+
+TEST_TEAR_DOWN(msyslog) {}
+
+static char logname[] = "/tmp/msyslogXXXXXX";
+static char logtext[4096];
+
+/* log to a scratch file, do it, and read the file back */
+static void
+log_to_file(void (*body)(void))
+{
+	bool	saved_termlogit = termlogit;
+	FILE *	fp;
+	size_t	len;
+	int	fd;
+
+	fd = mkstemp(logname);
+	TEST_ASSERT_TRUE(fd >= 0);
+	close(fd);
+	termlogit = false;
+	TEST_ASSERT_EQUAL(0, change_logfile(logname, false));
+	body();
+	change_logfile("stderr", false);
+	syslogit = true;
+	termlogit = saved_termlogit;
+
+	fp = fopen(logname, "r");
+	TEST_ASSERT_NOT_NULL(fp);
+	len = fread(logtext, 1, sizeof(logtext) - 1, fp);
+	logtext[len] = '\0';
+	fclose(fp);
+	unlink(logname);
+	strlcpy(logname, "/tmp/msyslogXXXXXX", sizeof(logname));
+}
+
+static void
+repeats(void)
+{
+	msyslog_start_async();
+	msyslog(LOG_INFO, "TEST: one");
+	for (int i = 0; i < 5; i++)
+		msyslog(LOG_INFO, "TEST: two");
+	msyslog(LOG_INFO, "TEST: three");
+	msyslog(LOG_INFO, "TEST: three");
+	msyslog_stop_async();
+	/* and written from the caller again */
+	msyslog(LOG_INFO, "TEST: four");
+	msyslog(LOG_INFO, "TEST: four");
+}
+
+TEST(msyslog, Coalesce) {
+	const char *p;
+
+	log_to_file(repeats);
+	p = strstr(logtext, "TEST: one\n");
+	TEST_ASSERT_NOT_NULL(p);
+	p = strstr(p, "TEST: two\n");
+	TEST_ASSERT_NOT_NULL(p);
+	TEST_ASSERT_NULL(strstr(p + 1, "TEST: two\n"));
+	p = strstr(p, "last message repeated 4 times\n");
+	TEST_ASSERT_NOT_NULL(p);
+	p = strstr(p, "TEST: three\n");
+	TEST_ASSERT_NOT_NULL(p);
+	/* the repeat still pending is said on the way out */
+	p = strstr(p, "last message repeated 1 time\n");
+	TEST_ASSERT_NOT_NULL(p);
+	p = strstr(p, "TEST: four\n");
+	TEST_ASSERT_NOT_NULL(p);
+	TEST_ASSERT_NOT_NULL(strstr(p + 1, "TEST: four\n"));
+}
+
+static void
+repeats_later(void)
+{
+	msyslog_report = 1;
+	msyslog_start_async();
+	msyslog(LOG_INFO, "TEST: five");
+	/* let the logger write that and go back to sleep */
+	sleep(1);
+	msyslog(LOG_INFO, "TEST: five");
+	/* nothing is queued now, so only a deadline says the repeat */
+	sleep(3);
+	msyslog(LOG_INFO, "TEST: five");
+	msyslog_stop_async();
+	msyslog_report = 30;
+}
+
+TEST(msyslog, RepeatsSaidOnTime) {
+	const char *p;
+
+	log_to_file(repeats_later);
+	p = strstr(logtext, "TEST: five\n");
+	TEST_ASSERT_NOT_NULL(p);
+	p = strstr(p, "last message repeated 1 time\n");
+	TEST_ASSERT_NOT_NULL(p);
+	TEST_ASSERT_NOT_NULL(strstr(p + 1, "last message repeated 1 time\n"));
+	TEST_ASSERT_NULL(strstr(logtext, "repeated 2 times"));
+}
+
+TEST_GROUP_RUNNER(msyslog) {
+	RUN_TEST_CASE(msyslog, Coalesce);
+	RUN_TEST_CASE(msyslog, RepeatsSaidOnTime);
+}
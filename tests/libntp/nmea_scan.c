@@ -0,0 +1,124 @@
+#include "config.h"
+#include "ntp_stdlib.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+#include "nmea_scan.h"
+
+TEST_GROUP(nmea_scan);
+
+TEST_SETUP(nmea_scan) {}
+
+TEST_TEAR_DOWN(nmea_scan) {}
+
+static nmea_sentence s;
+static char buf[128];
+
+static int
+scan(const char *text)
+{
+	strlcpy(buf, text, sizeof(buf));
+	return nmea_scan(buf, (int)strlen(buf), &s);
+}
+
+static bool
+field_is(int idx, const char *want)
+{
+	const char *cp = nmea_field(&s, idx);
+	size_t len = strlen(want);
+
+	return !strncmp(cp, want, len) &&
+	    ('\0' == cp[len] || ',' == cp[len] || '*' == cp[len]);
+}
+
+
+TEST(nmea_scan, Checksum) {
+	TEST_ASSERT_EQUAL_INT(NMEA_CSVALID,
+		scan("$GPGLL,5057.970,N,00146.110,E,142451,A*27"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_GLL, s.sentence);
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID,
+		scan("$GPGLL,5057.970,N,00146.110,E,142451,A*28"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID,
+		scan("$GPGLL,5057.970,N,00146.110,E,142451,A*27 "));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID,
+		scan("$GPGLL,5057.970,N,00146.110,E,142451,A*2"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID,
+		scan("$GPGLL,5057.970,N,00146.110,E,142451,A*2f"));
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID,
+		scan("$GPGLL,5057.970,N,00146.110,E,142451,A"));
+}
+
+TEST(nmea_scan, Syntax) {
+	TEST_ASSERT_EQUAL_INT(NMEA_EMPTY, scan(""));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID, scan("GPRMC,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID, scan("$1PRMC,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID, scan("$GPRM,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID, scan("$GPRMC"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID, scan("$GPrmc,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID, scan("$GPRMC,1*2,3"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID, scan("$GPRMC,12345678*9,12345678"));
+	/* 80 characters is one too many to carry a checksum */
+	TEST_ASSERT_EQUAL_INT(NMEA_CSVALID, scan(
+		"$GPTXT,0123456789012345678901234567890123456789"
+		"012345678901234567890123456789012*51"));
+	TEST_ASSERT_EQUAL_INT(NMEA_INVALID, scan(
+		"$GPTXT,0123456789012345678901234567890123456789"
+		"0123456789012345678901234567890123*62"));
+}
+
+TEST(nmea_scan, Classify) {
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$GPRMC,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_RMC, s.sentence);
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$GNGGA,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_GGA, s.sentence);
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$GLZDA,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_ZDA, s.sentence);
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$GPZDG,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_ZDG, s.sentence);
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$PGRMF,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_PGRMF, s.sentence);
+	/* the talker counts for PGRMF, and only there */
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$GPRMF,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_UNKNOWN, s.sentence);
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$PGRMC,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_RMC, s.sentence);
+	/* shares a slot with ZDG */
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$GPVTG,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_UNKNOWN, s.sentence);
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan("$GPRMCX,1"));
+	TEST_ASSERT_EQUAL_INT(NMEA_SENT_UNKNOWN, s.sentence);
+}
+
+TEST(nmea_scan, Fields) {
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID,
+		scan("$GPRMC,123519,A,4807.038,N,,E,022.4,084.4,230394"));
+	TEST_ASSERT_EQUAL_INT(10, s.nfields);
+	TEST_ASSERT_TRUE(field_is(0, "GPRMC"));
+	TEST_ASSERT_TRUE(field_is(9, "230394"));
+	TEST_ASSERT_TRUE(field_is(2, "A"));
+	TEST_ASSERT_TRUE(field_is(5, ""));
+	TEST_ASSERT_TRUE(field_is(1, "123519"));
+	TEST_ASSERT_EQUAL_STRING("", nmea_field(&s, 10));
+	TEST_ASSERT_EQUAL_STRING("", nmea_field(&s, -1));
+
+	TEST_ASSERT_EQUAL_INT(NMEA_CSVALID,
+		scan("$GPGLL,5057.970,N,00146.110,E,142451,A*27"));
+	TEST_ASSERT_TRUE(field_is(6, "A"));
+	TEST_ASSERT_EQUAL_STRING("", nmea_field(&s, 7));
+
+	/* past NMEA_FIELDS they are not kept */
+	TEST_ASSERT_EQUAL_INT(NMEA_VALID, scan(
+		"$GPGSV,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,"
+		"21,22,23,24,25,26,27,28,29,30,31,32,33,34"));
+	TEST_ASSERT_EQUAL_INT(NMEA_FIELDS + 1, s.nfields);
+	TEST_ASSERT_TRUE(field_is(NMEA_FIELDS, "32"));
+	TEST_ASSERT_EQUAL_STRING("", nmea_field(&s, NMEA_FIELDS + 1));
+}
+
+TEST_GROUP_RUNNER(nmea_scan) {
+	RUN_TEST_CASE(nmea_scan, Checksum);
+	RUN_TEST_CASE(nmea_scan, Syntax);
+	RUN_TEST_CASE(nmea_scan, Classify);
+	RUN_TEST_CASE(nmea_scan, Fields);
+}
@@ -248,6 +248,45 @@ TEST(calendar, RataDie1) {
 	TEST_ASSERT_TRUE(IsEqualDate(&expected, &actual));
 }
 
+TEST(calendar, RataDieLimits) {
+	struct calendar last = { 65535, 365, 12, 31, 0, 0, 0, 0};
+	struct calendar actual;
+
+	TEST_ASSERT_EQUAL(0, ntpcal_rd_to_date(&actual, 23936166));
+	TEST_ASSERT_TRUE(IsEqualDate(&last, &actual));
+	/* past the last, and before the first, the cycles take over */
+	TEST_ASSERT_EQUAL(-1, ntpcal_rd_to_date(&actual, 23936167));
+	TEST_ASSERT_EQUAL(1, ntpcal_rd_to_date(&actual, 0));
+	TEST_ASSERT_EQUAL(0, actual.year);
+	TEST_ASSERT_EQUAL(12, actual.month);
+	TEST_ASSERT_EQUAL(31, actual.monthday);
+}
+
+TEST(calendar, DayCache) {
+	ntpcal_daycache dc;
+	struct calendar jd, expected;
+
+	ZERO(dc);
+	/* 2016-12-31T23:59:59, then the next day */
+	TEST_ASSERT_EQUAL(86399, ntpcal_daycache_update(&dc, 1483228799));
+	TEST_ASSERT_EQUAL(57753, dc.mjd);
+	TEST_ASSERT_EQUAL(1, dc.leaps);
+	TEST_ASSERT_EQUAL(0, ntpcal_daycache_update(&dc, 1483228800));
+	TEST_ASSERT_EQUAL(57754, dc.mjd);
+	TEST_ASSERT_EQUAL(0, dc.leaps);
+
+	/* same answers as without the cache, either way in time */
+	ntpcal_time_to_date(&expected, 1000000);
+	TEST_ASSERT_EQUAL(0, ntpcal_time_to_date_cached(&dc, &jd, 1000000));
+	TEST_ASSERT_EQUAL_MEMORY(&expected, &jd, sizeof(jd));
+	ntpcal_time_to_date(&expected, 1000001);
+	ntpcal_time_to_date_cached(&dc, &jd, 1000001);
+	TEST_ASSERT_EQUAL_MEMORY(&expected, &jd, sizeof(jd));
+	ntpcal_time_to_date(&expected, 1483228800);
+	ntpcal_time_to_date_cached(&dc, &jd, 1483228800);
+	TEST_ASSERT_EQUAL_MEMORY(&expected, &jd, sizeof(jd));
+}
+
 TEST(calendar, DaysecToDate1) {
 	struct calendar cal;
 	int32_t days;
@@ -459,6 +498,8 @@ TEST_GROUP_RUNNER(calendar) {
 	RUN_TEST_CASE(calendar, SplitYearDays1);
 	RUN_TEST_CASE(calendar, SplitYearDays2);
 	RUN_TEST_CASE(calendar, RataDie1);
+	RUN_TEST_CASE(calendar, RataDieLimits);
+	RUN_TEST_CASE(calendar, DayCache);
 	RUN_TEST_CASE(calendar, TimeToDate1);
 	RUN_TEST_CASE(calendar, DayJoin1);
 	RUN_TEST_CASE(calendar, DaysInYears1);
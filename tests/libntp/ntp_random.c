@@ -1,6 +1,9 @@
 #include "config.h"
 #include "ntp.h"
 
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "unity.h"
 #include "unity_fixture.h"
 
@@ -67,7 +70,42 @@ TEST(random, random_bytes) {
 	TEST_ASSERT_EQUAL_MEMORY(clear, zeros, BYTES);
 }
 
+TEST(random, pool_bytes) {
+	unsigned char seen[8][16];
+
+	/* Crude again: no two draws from the pool should match */
+	for (int i=0; i<8; i++) {
+		ntp_RAND_pool_bytes(seen[i], (int)sizeof(seen[i]));
+		for (int j=0; j<i; j++)
+			TEST_ASSERT_TRUE(memcmp(seen[i], seen[j], sizeof(seen[i])));
+	}
+}
+
+TEST(random, pool_fork) {
+	unsigned char mine[16], childs[16];
+	int fds[2];
+	pid_t pid;
+
+	/* A child must not hand out what is left in the parent's pool */
+	ntp_RAND_pool_bytes(mine, 1);
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+	pid = fork();
+	TEST_ASSERT_TRUE(pid >= 0);
+	if (0 == pid) {
+		ntp_RAND_pool_bytes(childs, (int)sizeof(childs));
+		_exit(sizeof(childs) != write(fds[1], childs, sizeof(childs)));
+	}
+	ntp_RAND_pool_bytes(mine, (int)sizeof(mine));
+	TEST_ASSERT_EQUAL(sizeof(childs), read(fds[0], childs, sizeof(childs)));
+	waitpid(pid, NULL, 0);
+	close(fds[0]);
+	close(fds[1]);
+	TEST_ASSERT_TRUE(memcmp(mine, childs, sizeof(mine)));
+}
+
 TEST_GROUP_RUNNER(random) {
 	RUN_TEST_CASE(random, random32);
 	RUN_TEST_CASE(random, random_bytes);
+	RUN_TEST_CASE(random, pool_bytes);
+	RUN_TEST_CASE(random, pool_fork);
 }
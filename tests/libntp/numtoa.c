@@ -25,6 +25,37 @@ TEST(numtoa, RefidStr) {
 	TEST_ASSERT_EQUAL_STRING("FB", res);
 }
 
+TEST(numtoa, RefidStrR) {
+	char buf[16];
+
+	TEST_ASSERT_EQUAL_STRING("68.51.34.17",
+		refid_str_r(htonl(0x44332211), 8, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("FB",
+		refid_str_r(htonl(0x46422020), 0, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("?",
+		refid_str_r(0, 0, buf, sizeof(buf)));
+}
+
+TEST(numtoa, U64toaR) {
+	char buf[24];
+
+	TEST_ASSERT_EQUAL(1, u64toa_r(0, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("0", buf);
+	TEST_ASSERT_EQUAL(1, u64toa_r(7, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("7", buf);
+	TEST_ASSERT_EQUAL(2, u64toa_r(42, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("42", buf);
+	TEST_ASSERT_EQUAL(3, u64toa_r(100, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("100", buf);
+	TEST_ASSERT_EQUAL(20, u64toa_r(UINT64_MAX, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL_STRING("18446744073709551615", buf);
+	// Too small a buffer keeps the leading digits
+	TEST_ASSERT_EQUAL(3, u64toa_r(123456, buf, 4));
+	TEST_ASSERT_EQUAL_STRING("123", buf);
+}
+
 TEST_GROUP_RUNNER(numtoa) {
 	RUN_TEST_CASE(numtoa, RefidStr);
+	RUN_TEST_CASE(numtoa, RefidStrR);
+	RUN_TEST_CASE(numtoa, U64toaR);
 }
@@ -0,0 +1,70 @@
+#include "config.h"
+#include "ntp_stdlib.h"
+#include "ntp_shard.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP(shard);
+
+TEST_SETUP(shard) {}
+
+TEST_TEAR_DOWN(shard) {}
+
+struct counts {
+	uint64_t	up;
+	uint64_t	down;
+	uint64_t	odd;
+};
+
+#define THREADS	4
+#define BUMPS	100000
+
+static struct shard_set counts_shards = SHARD_SET_INIT(struct counts);
+
+static void *
+bump(void *arg)
+{
+	struct counts *mine = shard_mine(&counts_shards);
+
+	(void)arg;
+	for (int i = 0; i < BUMPS; i++) {
+		mine->up++;
+		mine->down--;
+		if (i & 1)
+			mine->odd++;
+	}
+	return NULL;
+}
+
+TEST(shard, Mine) {
+	struct counts *a = shard_mine(&counts_shards);
+
+	/* same block every time, aligned, and zero to start */
+	TEST_ASSERT_TRUE(a == shard_mine(&counts_shards));
+	TEST_ASSERT_EQUAL(0, (uintptr_t)a % SHARD_ALIGN);
+	TEST_ASSERT_EQUAL(0, a->up);
+}
+
+TEST(shard, Fold) {
+	pthread_t tid[THREADS];
+	struct counts *main_counts = shard_mine(&counts_shards);
+	struct counts before, total;
+
+	shard_fold(&counts_shards, &before);
+	main_counts->up += 5;
+	/* these threads exit before the fold, their counts are kept */
+	for (int i = 0; i < THREADS; i++)
+		TEST_ASSERT_EQUAL(0, pthread_create(&tid[i], NULL, bump, NULL));
+	for (int i = 0; i < THREADS; i++)
+		pthread_join(tid[i], NULL);
+	shard_fold(&counts_shards, &total);
+	TEST_ASSERT_EQUAL(before.up + 5 + THREADS * BUMPS, total.up);
+	TEST_ASSERT_EQUAL(before.down - THREADS * BUMPS, total.down);
+	TEST_ASSERT_EQUAL(before.odd + THREADS * BUMPS / 2, total.odd);
+}
+
+TEST_GROUP_RUNNER(shard) {
+	RUN_TEST_CASE(shard, Mine);
+	RUN_TEST_CASE(shard, Fold);
+}
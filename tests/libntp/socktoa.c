@@ -107,6 +107,34 @@ TEST(socktoa, IgnoreIPv6Fields) {
 	TEST_ASSERT_EQUAL(sock_hash(&input1), sock_hash(&input2));
 }
 
+TEST(socktoa, HashKeyed) {
+	sockaddr_u input1 = CreateSockaddr4("192.0.2.1", 123);
+	sockaddr_u input2 = CreateSockaddr4("192.0.2.1", 123);
+	unsigned int before = sock_hash(&input1);
+
+	/* a new key moves the address, but equal ones stay together */
+	sock_hash_init();
+	TEST_ASSERT_NOT_EQUAL(before, sock_hash(&input1));
+	TEST_ASSERT_EQUAL(sock_hash(&input1), sock_hash(&input2));
+}
+
+TEST(socktoa, SipHash24) {
+#ifndef WORDS_BIGENDIAN
+	/* reference vectors: key 00..0f, message 00, 01, ... */
+	uint8_t kb[16], msg[64];
+	uint64_t key[2];
+
+	for (int i = 0; i < 16; i++)
+		kb[i] = (uint8_t)i;
+	for (int i = 0; i < 64; i++)
+		msg[i] = (uint8_t)i;
+	memcpy(key, kb, sizeof(key));
+	TEST_ASSERT_TRUE(0x726fdb47dd0e0e31ULL == sip_hash24(key, msg, 0));
+	TEST_ASSERT_TRUE(0x74f839c593dc67fdULL == sip_hash24(key, msg, 1));
+	TEST_ASSERT_TRUE(0xa129ca6149be45e5ULL == sip_hash24(key, msg, 15));
+#endif
+}
+
 TEST_GROUP_RUNNER(socktoa) {
 	RUN_TEST_CASE(socktoa, IPv4AddressWithPort);
 	RUN_TEST_CASE(socktoa, IPv6AddressWithPort);
@@ -114,4 +142,6 @@ TEST_GROUP_RUNNER(socktoa) {
 	RUN_TEST_CASE(socktoa, HashEqual);
 	RUN_TEST_CASE(socktoa, HashNotEqual);
 	RUN_TEST_CASE(socktoa, IgnoreIPv6Fields);
+	RUN_TEST_CASE(socktoa, HashKeyed);
+	RUN_TEST_CASE(socktoa, SipHash24);
 }
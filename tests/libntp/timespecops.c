@@ -9,6 +9,7 @@
 #include "unity_fixture.h"
 
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -164,6 +165,40 @@ TEST(timespecops, Normalise) {
 	return;
 }
 
+// what normalize_tspec() did before it went branch free
+static struct timespec
+old_normalize_tspec(struct timespec x)
+{
+	if (x.tv_nsec < 0 || x.tv_nsec >= NS_PER_S) {
+		ldiv_t	z = ldiv(x.tv_nsec, NS_PER_S);
+		if (z.rem < 0) {
+			z.quot--;
+			z.rem  += NS_PER_S;
+		}
+		x.tv_sec  += z.quot;
+		x.tv_nsec  = z.rem;
+	}
+	return x;
+}
+
+TEST(timespecops, NormaliseMatchesOld) {
+	uint64_t state = 0x2545f4914f6cdd1d;
+
+	for (int i = 0; i < 1000000; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		/* near the normal range as often as far from it */
+		long ns = (long)state;
+		if (i & 1)
+			ns %= 3L * NS_PER_S;
+		struct timespec x = timespec_init(i, ns);
+		struct timespec E = old_normalize_tspec(x);
+		struct timespec r = normalize_tspec(x);
+		TEST_ASSERT_EQUAL_timespec(E, r);
+	}
+}
+
 //----------------------------------------------------------------------
 // test classification
 //----------------------------------------------------------------------
@@ -483,6 +518,19 @@ TEST(timespecops, test_ToLFPabs) {
 	return;
 }
 
+TEST(timespecops, test_ToLFPabsDenorm) {
+	for (int i = 0; i < (int)COUNTOF(fdata); ++i) {
+		// same instant, nanoseconds out of range either way
+		struct timespec a = timespec_init(0, fdata[i].nsec + NS_PER_S);
+		struct timespec b = timespec_init(2, fdata[i].nsec - NS_PER_S);
+		l_fp E = lfpinit((int)(1 + JAN_1970), fdata[i].frac);
+		TEST_ASSERT_EQUAL_l_fp(E, tspec_stamp_to_lfp(a));
+		TEST_ASSERT_EQUAL_l_fp(E, tspec_stamp_to_lfp(b));
+	}
+
+	return;
+}
+
 //----------------------------------------------------------------------
 // conversion from l_fp
 //----------------------------------------------------------------------
@@ -534,6 +582,65 @@ TEST(timespecops, test_FromLFPrelNeg) {
 }
 
 
+// what lfp_intv_to_tspec() did before it went branch free
+static struct timespec
+old_lfp_intv_to_tspec(l_fp x)
+{
+	struct timespec out;
+	l_fp		absx;
+	int		neg;
+
+	neg = L_ISNEG(x);
+	absx = x;
+	if (neg) {
+		L_NEG(absx);
+	}
+	out.tv_nsec = FTOTVN(lfpfrac(absx));
+	out.tv_sec = lfpsint(absx);
+	if (neg) {
+		out.tv_sec = -out.tv_sec;
+		out.tv_nsec = -out.tv_nsec;
+		out = normalize_tspec(out);
+	}
+
+	return out;
+}
+
+static void
+check_from_lfp(int32_t sec, uint32_t frac)
+{
+	l_fp a = lfpinit(sec, frac);
+	// the old code left a fraction that rounded up to a whole
+	// second denormal when positive
+	struct timespec E = normalize_tspec(old_lfp_intv_to_tspec(a));
+	struct timespec r = lfp_intv_to_tspec(a);
+
+	TEST_ASSERT_EQUAL_timespec(E, r);
+}
+
+TEST(timespecops, FromLFPmatchesOld) {
+	static const int32_t secs[] = {
+		0, 1, -1, 2, -2, 1000, -1000, INT32_MAX, INT32_MIN + 1
+	};
+
+	for (size_t i = 0; i < COUNTOF(secs); i++) {
+		// every 65537th fraction, and those at either end
+		for (uint64_t f = 0; f < 0x100000000; f += 65537)
+			check_from_lfp(secs[i], (uint32_t)f);
+		for (uint32_t f = 0; f < 4096; f++) {
+			check_from_lfp(secs[i], f);
+			check_from_lfp(secs[i], ~f);
+		}
+		// every fraction exactly half a nanosecond off, where
+		// the rounding goes toward zero
+		for (uint32_t k = 0; k < 512; k++)
+			check_from_lfp(secs[i], 0x400000 + (k << 23));
+	}
+	// the old code overflowed negating the most negative value
+	TEST_ASSERT_EQUAL(INT32_MIN,
+			  lfp_intv_to_tspec(lfpinit(INT32_MIN, 0)).tv_sec);
+}
+
 // nsec -> frac -> nsec roundtrip, using a prime start and increment
 TEST(timespecops, test_LFProundtrip) {
 	for (int32_t t = -1; t < 2; ++t)
@@ -652,6 +759,7 @@ TEST(timespecops, TvalToTspec) {
 TEST_GROUP_RUNNER(timespecops) {
 	RUN_TEST_CASE(timespecops, Helpers1);
 	RUN_TEST_CASE(timespecops, Normalise);
+	RUN_TEST_CASE(timespecops, NormaliseMatchesOld);
 	RUN_TEST_CASE(timespecops, SignNoFrac);
 	RUN_TEST_CASE(timespecops, SignWithFrac);
 	RUN_TEST_CASE(timespecops, CmpFracEQ);
@@ -673,9 +781,11 @@ TEST_GROUP_RUNNER(timespecops) {
 	RUN_TEST_CASE(timespecops, test_ToLFPrelPos);
 	RUN_TEST_CASE(timespecops, test_ToLFPrelNeg);
 	RUN_TEST_CASE(timespecops, test_ToLFPabs);
+	RUN_TEST_CASE(timespecops, test_ToLFPabsDenorm);
 	RUN_TEST_CASE(timespecops, test_FromLFPbittest);
 	RUN_TEST_CASE(timespecops, test_FromLFPrelPos);
 	RUN_TEST_CASE(timespecops, test_FromLFPrelNeg);
+	RUN_TEST_CASE(timespecops, FromLFPmatchesOld);
 	RUN_TEST_CASE(timespecops, test_LFProundtrip);
 	RUN_TEST_CASE(timespecops, test_FromLFPuBittest);
 	RUN_TEST_CASE(timespecops, test_FromLFPuRelPos);
@@ -0,0 +1,143 @@
+#include "config.h"
+#include "ntp_stdlib.h"
+
+#include "tsip_frame.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP(tsip_frame);
+
+static struct tsip_framer f;
+static uint8_t buf[16];
+
+TEST_SETUP(tsip_frame) {
+	tsip_framer_init(&f, buf, sizeof(buf), true);
+}
+
+TEST_TEAR_DOWN(tsip_frame) {}
+
+/* the stuffed DLE comes out single, the junk ahead is skipped */
+TEST(tsip_frame, Unstuff) {
+	static const uint8_t in[] = {
+		0x41, 0x00, 0x10, 0x8f, 0x01, 0x10, 0x10, 0x02, 0x10, 0x03,
+		0x55
+	};
+	static const uint8_t want[] = { 0x8f, 0x01, 0x10, 0x02 };
+	int event;
+
+	TEST_ASSERT_EQUAL(10, tsip_frame(&f, in, sizeof(in), &event));
+	TEST_ASSERT_EQUAL(TSIP_PACKET, event);
+	TEST_ASSERT_EQUAL(sizeof(want), f.len);
+	TEST_ASSERT_EQUAL_MEMORY(want, buf, sizeof(want));
+	TEST_ASSERT_EQUAL(1, f.starts);
+
+	TEST_ASSERT_EQUAL(1, tsip_frame(&f, in + 10, 1, &event));
+	TEST_ASSERT_EQUAL(TSIP_MORE, event);
+}
+
+/* a packet cut anywhere, even between a DLE and its partner */
+TEST(tsip_frame, Split) {
+	static const uint8_t in[] = {
+		0x10, 0x41, 0x10, 0x10, 0x10, 0x10, 0x07, 0x10, 0x03
+	};
+	static const uint8_t want[] = { 0x41, 0x10, 0x10, 0x07 };
+	int event;
+
+	for (size_t cut = 0; cut <= sizeof(in); cut++) {
+		tsip_framer_init(&f, buf, sizeof(buf), false);
+		TEST_ASSERT_EQUAL(cut, tsip_frame(&f, in, cut, &event));
+		if (cut < sizeof(in)) {
+			TEST_ASSERT_EQUAL(TSIP_MORE, event);
+			TEST_ASSERT_EQUAL(sizeof(in) - cut,
+					  tsip_frame(&f, in + cut,
+						     sizeof(in) - cut, &event));
+		}
+		TEST_ASSERT_EQUAL(TSIP_PACKET, event);
+		TEST_ASSERT_EQUAL(sizeof(want), f.len);
+		TEST_ASSERT_EQUAL_MEMORY(want, buf, sizeof(want));
+	}
+}
+
+/* a DLE that isn't doubled or followed by ETX starts over */
+TEST(tsip_frame, Resync) {
+	static const uint8_t in[] = {
+		0x10, 0x41, 0x01, 0x02, 0x10, 0x46, 0x03, 0x10, 0x03
+	};
+	static const uint8_t want[] = { 0x46, 0x03 };
+	int event;
+
+	TEST_ASSERT_EQUAL(sizeof(in), tsip_frame(&f, in, sizeof(in), &event));
+	TEST_ASSERT_EQUAL(TSIP_PACKET, event);
+	TEST_ASSERT_EQUAL(sizeof(want), f.len);
+	TEST_ASSERT_EQUAL_MEMORY(want, buf, sizeof(want));
+	TEST_ASSERT_EQUAL(2, f.starts);
+}
+
+/* DLE ETX, DLE DLE and DLE NUL are not packet starts */
+TEST(tsip_frame, BadID) {
+	static const uint8_t in[] = { 0x10, 0x03, 0x10, 0x00, 0x10, 0x10 };
+	int event;
+
+	TEST_ASSERT_EQUAL(sizeof(in), tsip_frame(&f, in, sizeof(in), &event));
+	TEST_ASSERT_EQUAL(TSIP_MORE, event);
+	TEST_ASSERT_EQUAL(TSIP_IDLE, f.state);
+	TEST_ASSERT_EQUAL(0, f.starts);
+}
+
+/* with PARMRK, 0xff 0xff is data and 0xff anything else an error */
+TEST(tsip_frame, ParityMark) {
+	static const uint8_t good[] = {
+		0x10, 0x41, 0xff, 0xff, 0x01, 0x10, 0x03
+	};
+	static const uint8_t bad[] = { 0x10, 0x41, 0xff, 0x00, 0x05, 0x10 };
+	static const uint8_t want[] = { 0x41, 0xff, 0x01 };
+	int event;
+
+	TEST_ASSERT_EQUAL(sizeof(good),
+			  tsip_frame(&f, good, sizeof(good), &event));
+	TEST_ASSERT_EQUAL(TSIP_PACKET, event);
+	TEST_ASSERT_EQUAL(sizeof(want), f.len);
+	TEST_ASSERT_EQUAL_MEMORY(want, buf, sizeof(want));
+
+	TEST_ASSERT_EQUAL(4, tsip_frame(&f, bad, sizeof(bad), &event));
+	TEST_ASSERT_EQUAL(TSIP_PARITY, event);
+	TEST_ASSERT_EQUAL(TSIP_IDLE, f.state);
+
+	/* without it, 0xff is just data */
+	tsip_framer_init(&f, buf, sizeof(buf), false);
+	TEST_ASSERT_EQUAL(sizeof(bad), tsip_frame(&f, bad, sizeof(bad), &event));
+	TEST_ASSERT_EQUAL(TSIP_MORE, event);
+	TEST_ASSERT_EQUAL(TSIP_STUFF, f.state);
+	TEST_ASSERT_EQUAL(4, f.len);
+}
+
+/* too long for the buffer is dropped, and the next one still found */
+TEST(tsip_frame, Oversize) {
+	uint8_t in[32];
+	static const uint8_t next[] = { 0x10, 0x46, 0x00, 0x10, 0x03 };
+	size_t used;
+	int event;
+
+	in[0] = 0x10;
+	for (size_t i = 1; i < sizeof(in); i++)
+		in[i] = 0x42;
+	used = tsip_frame(&f, in, sizeof(in), &event);
+	TEST_ASSERT_EQUAL(TSIP_OVERSIZE, event);
+	TEST_ASSERT_EQUAL(TSIP_IDLE, f.state);
+	TEST_ASSERT_EQUAL(sizeof(in), used);
+
+	TEST_ASSERT_EQUAL(sizeof(next),
+			  tsip_frame(&f, next, sizeof(next), &event));
+	TEST_ASSERT_EQUAL(TSIP_PACKET, event);
+	TEST_ASSERT_EQUAL(2, f.len);
+}
+
+TEST_GROUP_RUNNER(tsip_frame) {
+	RUN_TEST_CASE(tsip_frame, Unstuff);
+	RUN_TEST_CASE(tsip_frame, Split);
+	RUN_TEST_CASE(tsip_frame, Resync);
+	RUN_TEST_CASE(tsip_frame, BadID);
+	RUN_TEST_CASE(tsip_frame, ParityMark);
+	RUN_TEST_CASE(tsip_frame, Oversize);
+}
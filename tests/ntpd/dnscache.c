@@ -0,0 +1,155 @@
+#include "config.h"
+
+#include "ntpd.h"
+#include "ntp_dns.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+/* Not static, for the tests */
+void dns_cache_put(const char *node, const char *service,
+	const struct addrinfo *hints, const struct addrinfo *answer, int ttl);
+int dns_cache_answer_ttl(const unsigned char *msg, int len);
+
+TEST_GROUP(dnscache);
+
+TEST_SETUP(dnscache) {
+	dns_cache_flush();
+}
+
+TEST_TEAR_DOWN(dnscache) {
+	dns_cache_flush();
+}
+
+static struct sockaddr_in sin4;
+static struct addrinfo ai4;
+
+static void
+make_hints(struct addrinfo *hints, int family)
+{
+	ZERO(*hints);
+	hints->ai_family = family;
+	hints->ai_socktype = SOCK_DGRAM;
+	hints->ai_protocol = IPPROTO_UDP;
+}
+
+static void
+make_answer(const char *addr)
+{
+	ZERO(sin4);
+	sin4.sin_family = AF_INET;
+	sin4.sin_port = htons(123);
+	inet_pton(AF_INET, addr, &sin4.sin_addr);
+	ZERO(ai4);
+	ai4.ai_family = AF_INET;
+	ai4.ai_socktype = SOCK_DGRAM;
+	ai4.ai_protocol = IPPROTO_UDP;
+	ai4.ai_addrlen = sizeof(sin4);
+	ai4.ai_addr = (struct sockaddr *)&sin4;
+}
+
+
+TEST(dnscache, PutGet) {
+	struct addrinfo hints, *res = NULL;
+	struct sockaddr_in *got;
+
+	make_hints(&hints, AF_UNSPEC);
+	make_answer("192.0.2.7");
+	dns_cache_put("ntp.example.com", "123", &hints, &ai4, 60);
+
+	TEST_ASSERT_TRUE(dns_cache_get("NTP.example.com", "123", &hints, &res));
+	TEST_ASSERT_NOT_NULL(res);
+	TEST_ASSERT_NULL(res->ai_next);
+	TEST_ASSERT_EQUAL_INT(AF_INET, res->ai_family);
+	TEST_ASSERT_EQUAL_INT(sizeof(sin4), res->ai_addrlen);
+	got = (struct sockaddr_in *)res->ai_addr;
+	TEST_ASSERT_EQUAL_MEMORY(&sin4.sin_addr, &got->sin_addr, 4);
+	dns_cache_free(res);
+
+	/* the question has to match */
+	TEST_ASSERT_FALSE(dns_cache_get("ntp.example.com", "4460", &hints, &res));
+	make_hints(&hints, AF_INET6);
+	TEST_ASSERT_FALSE(dns_cache_get("ntp.example.com", "123", &hints, &res));
+
+	/* a new answer replaces the old */
+	make_hints(&hints, AF_UNSPEC);
+	make_answer("192.0.2.8");
+	dns_cache_put("ntp.example.com", "123", &hints, &ai4, 60);
+	TEST_ASSERT_TRUE(dns_cache_get("ntp.example.com", "123", &hints, &res));
+	got = (struct sockaddr_in *)res->ai_addr;
+	TEST_ASSERT_EQUAL_MEMORY(&sin4.sin_addr, &got->sin_addr, 4);
+	dns_cache_free(res);
+
+	dns_cache_flush();
+	TEST_ASSERT_FALSE(dns_cache_get("ntp.example.com", "123", &hints, &res));
+}
+
+TEST(dnscache, ZeroTTL) {
+	struct addrinfo hints, *res = NULL;
+
+	make_hints(&hints, AF_UNSPEC);
+	make_answer("192.0.2.7");
+	dns_cache_put("ntp.example.com", "123", &hints, &ai4, 0);
+	TEST_ASSERT_FALSE(dns_cache_get("ntp.example.com", "123", &hints, &res));
+}
+
+TEST(dnscache, Numeric) {
+	struct addrinfo hints, *res = NULL;
+
+	make_hints(&hints, AF_INET);
+	hints.ai_flags = AI_NUMERICHOST;
+	TEST_ASSERT_EQUAL_INT(0,
+		dns_cache_getaddrinfo("127.0.0.1", "123", &hints, &res));
+	TEST_ASSERT_NOT_NULL(res);
+	dns_cache_free(res);
+	res = NULL;
+	TEST_ASSERT_TRUE(dns_cache_get("127.0.0.1", "123", &hints, &res));
+	TEST_ASSERT_NOT_NULL(res);
+	dns_cache_free(res);
+
+	/* failures are not kept */
+	TEST_ASSERT_NOT_EQUAL(0,
+		dns_cache_getaddrinfo("not a number", "123", &hints, &res));
+	TEST_ASSERT_FALSE(dns_cache_get("not a number", "123", &hints, &res));
+}
+
+#ifdef HAVE_RES_INIT
+/* www.example.com CNAME ntp.example.com, A 192.0.2.7 */
+static const unsigned char reply[] = {
+	0x12, 0x34, 0x81, 0x80, 0, 1, 0, 2, 0, 0, 0, 0,
+	3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+	3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+	0xc0, 0x0c, 0, 5, 0, 1, 0, 0, 0x0e, 0x10, 0, 6,
+	3, 'n', 't', 'p', 0xc0, 0x10,
+	0xc0, 0x2d, 0, 1, 0, 1, 0, 0, 0, 0x78, 0, 4,
+	192, 0, 2, 7,
+};
+
+TEST(dnscache, AnswerTTL) {
+	unsigned char msg[sizeof(reply)];
+
+	TEST_ASSERT_EQUAL_INT(120,
+		dns_cache_answer_ttl(reply, (int)sizeof(reply)));
+	/* truncated */
+	TEST_ASSERT_EQUAL_INT(-1,
+		dns_cache_answer_ttl(reply, (int)sizeof(reply) - 1));
+	TEST_ASSERT_EQUAL_INT(-1, dns_cache_answer_ttl(reply, 10));
+	/* no answers */
+	memcpy(msg, reply, sizeof(msg));
+	msg[7] = 0;
+	TEST_ASSERT_EQUAL_INT(-1, dns_cache_answer_ttl(msg, (int)sizeof(msg)));
+	/* RFC 2181: a TTL with the top bit set is 0 */
+	memcpy(msg, reply, sizeof(msg));
+	msg[57] = 0x80;
+	TEST_ASSERT_EQUAL_INT(0, dns_cache_answer_ttl(msg, (int)sizeof(msg)));
+}
+#endif
+
+TEST_GROUP_RUNNER(dnscache) {
+	RUN_TEST_CASE(dnscache, PutGet);
+	RUN_TEST_CASE(dnscache, ZeroTTL);
+	RUN_TEST_CASE(dnscache, Numeric);
+#ifdef HAVE_RES_INIT
+	RUN_TEST_CASE(dnscache, AnswerTTL);
+#endif
+}
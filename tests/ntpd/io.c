@@ -0,0 +1,66 @@
+#include "config.h"
+
+#include "ntpd.h"
+#include "ntp_io.h"
+#include "recvbuff.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+static endpt itf;
+
+static bool
+from(
+	const char *	addr
+	)
+{
+	recvbuf_t rb;
+
+	ZERO(rb);
+	SET_AF(&rb.recv_srcadr, AF_INET);
+	PSOCK_ADDR4(&rb.recv_srcadr)->s_addr = inet_addr(addr);
+	SET_PORT(&rb.recv_srcadr, 123);
+	return accept_network_packet(&rb, &itf);
+}
+
+TEST_GROUP(io);
+
+TEST_SETUP(io) {
+	ZERO(itf);
+	itf.family = AF_INET;
+	current_time = 1000;
+}
+
+TEST_TEAR_DOWN(io) {
+	io_data.shed_average = 2000;
+	io_data.shed_burst = 4000;
+}
+
+TEST(io, ShedFloodingPrefix) {
+	uint64_t shed = shed_count();
+
+	io_data.shed_average = 1;
+	io_data.shed_burst = 5;
+	for (int n = 0; n < 5; n++)
+		TEST_ASSERT_TRUE(from("192.0.2.1"));
+	TEST_ASSERT_EQUAL(shed, shed_count());
+
+	/* over the burst, for the whole /24 */
+	TEST_ASSERT_FALSE(from("192.0.2.1"));
+	TEST_ASSERT_FALSE(from("192.0.2.200"));
+	TEST_ASSERT_EQUAL(shed + 2, shed_count());
+
+	/* another prefix has a budget of its own */
+	TEST_ASSERT_TRUE(from("198.51.100.7"));
+	TEST_ASSERT_EQUAL(shed + 2, shed_count());
+
+	/* a second later there is one more */
+	current_time++;
+	TEST_ASSERT_TRUE(from("192.0.2.1"));
+	TEST_ASSERT_FALSE(from("192.0.2.1"));
+	TEST_ASSERT_EQUAL(shed + 3, shed_count());
+}
+
+TEST_GROUP_RUNNER(io) {
+	RUN_TEST_CASE(io, ShedFloodingPrefix);
+}
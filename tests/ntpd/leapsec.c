@@ -427,6 +427,41 @@ TEST(leapsec, loadFileTTL) {
 	TEST_ASSERT_EQUAL(-1, rc);
 }
 
+// ----------------------------------------------------------------------
+// read a file aside, as the file watcher does, then install it
+TEST(leapsec, readFileInstall) {
+	char fname[] = "/tmp/leapsec-XXXXXX";
+	struct stat sb;
+	leap_table_t * pt;
+	FILE * fp;
+	int fd;
+
+	fd = mkstemp(fname);
+	TEST_ASSERT_TRUE(fd >= 0);
+	fp = fdopen(fd, "w");
+	TEST_ASSERT_NOT_NULL(fp);
+	fputs(leap_ghash, fp);
+	fclose(fp);
+
+	// unchanged and not forced: nothing to read
+	TEST_ASSERT_EQUAL(0, stat(fname, &sb));
+	pt = leapsec_read_file(fname, &sb, false, false);
+	TEST_ASSERT_NULL(pt);
+
+	ZERO(sb);
+	pt = leapsec_read_file(fname, &sb, false, false);
+	TEST_ASSERT_NOT_NULL(pt);
+	// reading does not touch the current, pristine, table
+	TEST_ASSERT_EQUAL(1, leapsec_expired(3439756800U - JAN_1970));
+
+	// pt is left to leak: it came from emalloc(), and unity's
+	// free() only takes back what unity's malloc() handed out
+	TEST_ASSERT_TRUE(leapsec_install(pt, fname));
+	unlink(fname);
+	TEST_ASSERT_EQUAL(0, leapsec_expired(3439756800U - JAN_1970));
+	TEST_ASSERT_EQUAL(1, leapsec_expired(3610569601U - JAN_1970));
+}
+
 
 // Hack to avoid compiler warnings from gcc 8.0
 // We should be able to cast fprintf, but that gets:
@@ -494,6 +529,50 @@ TEST(leapsec, ls2009weekaway) {
 	TEST_ASSERT_EQUAL(LSPROX_SCHEDULE, qr.proximity);
 }
 
+// ----------------------------------------------------------------------
+// jumps into and out of the quiet part of an era, in both directions
+TEST(leapsec, ls2009quiet) {
+	bool           rc;
+	leap_result_t  qr;
+
+	rc = setup_load_table(leap1);
+	TEST_ASSERT_EQUAL(1, rc);
+
+	rc = leapsec_query(&qr, lsec2009 - 60*SECSPERDAY);
+	TEST_ASSERT_FALSE(rc);
+	TEST_ASSERT_EQUAL(33, qr.tai_offs);
+	TEST_ASSERT_EQUAL(LSPROX_NOWARN, qr.proximity);
+
+	// past the leap, and then back before it
+	rc = leapsec_query(&qr, lsec2009 + SECSPERDAY);
+	TEST_ASSERT_TRUE(rc);
+	TEST_ASSERT_EQUAL(34, qr.tai_offs);
+	rc = leapsec_query(&qr, lsec2009 - 60*SECSPERDAY);
+	TEST_ASSERT_FALSE(rc);
+	TEST_ASSERT_EQUAL(33, qr.tai_offs);
+	TEST_ASSERT_EQUAL(0,  qr.tai_diff);
+	TEST_ASSERT_EQUAL(LSPROX_NOWARN, qr.proximity);
+
+	// out of the quiet part once the leap is scheduled
+	rc = leapsec_query(&qr, lsec2009 - 7*SECSPERDAY);
+	TEST_ASSERT_FALSE(rc);
+	TEST_ASSERT_EQUAL(33, qr.tai_offs);
+	TEST_ASSERT_EQUAL(1,  qr.tai_diff);
+	TEST_ASSERT_EQUAL(LSPROX_SCHEDULE, qr.proximity);
+	rc = leapsec_query(&qr, lsec2009 - 59*SECSPERDAY);
+	TEST_ASSERT_FALSE(rc);
+	TEST_ASSERT_EQUAL(0,  qr.tai_diff);
+	TEST_ASSERT_EQUAL(LSPROX_NOWARN, qr.proximity);
+
+	// before the table's first entry
+	rc = leapsec_query(&qr, lsec2009 - 9000*SECSPERDAY);
+	TEST_ASSERT_FALSE(rc);
+	TEST_ASSERT_EQUAL(LSPROX_NOWARN, qr.proximity);
+	rc = leapsec_query(&qr, lsec2009 - 60*SECSPERDAY);
+	TEST_ASSERT_FALSE(rc);
+	TEST_ASSERT_EQUAL(33, qr.tai_offs);
+}
+
 // ----------------------------------------------------------------------
 // ad-hoc jump: leap second at 2009.01.01 -1hr
 TEST(leapsec, ls2009houraway) {
@@ -997,6 +1076,32 @@ TEST(leapsec, lsEmptyTableElectric) {
 	}
 }
 
+#ifdef ENABLE_LEAP_SMEAR
+// ----------------------------------------------------------------------
+// the smear between leap checks follows the line through the last one
+TEST(leapsec, smearSegment) {
+	struct leap_smear_seg seg;
+	const double rate = -1.0 / 86400;
+	const l_fp t0 = lfpinit_u(3600000000U, 0);
+
+	seg.t0 = t0;
+	seg.off0 = dtolfp(-0.25);
+	seg.rate = (int64_t)(rate * FRAC);
+	seg.lo = -(int64_t)(16 * FRAC);
+	seg.hi = (int64_t)(2 * FRAC);	/* smear ends 2 s on */
+
+	TEST_ASSERT_DOUBLE_WITHIN(1e-9, -0.25,
+				  lfptod(leap_smear_at(&seg, t0)));
+	TEST_ASSERT_DOUBLE_WITHIN(1e-9, -0.25 + 0.75 * rate,
+	    lfptod(leap_smear_at(&seg, t0 + dtolfp(0.75))));
+	TEST_ASSERT_DOUBLE_WITHIN(1e-9, -0.25 - 3.5 * rate,
+	    lfptod(leap_smear_at(&seg, t0 - dtolfp(3.5))));
+	/* held at the end of the interval */
+	TEST_ASSERT_DOUBLE_WITHIN(1e-9, -0.25 + 2 * rate,
+	    lfptod(leap_smear_at(&seg, t0 + dtolfp(10.0))));
+}
+#endif
+
 TEST_GROUP_RUNNER(leapsec) {
 	RUN_TEST_CASE(leapsec, ValidateGood);
 	RUN_TEST_CASE(leapsec, ValidateNoHash);
@@ -1007,9 +1112,11 @@ TEST_GROUP_RUNNER(leapsec) {
 	RUN_TEST_CASE(leapsec, tableSelect);
 	RUN_TEST_CASE(leapsec, loadFileExpire);
 	RUN_TEST_CASE(leapsec, loadFileTTL);
+	RUN_TEST_CASE(leapsec, readFileInstall);
 	RUN_TEST_CASE(leapsec, lsQueryPristineState);
 	RUN_TEST_CASE(leapsec, ls2009faraway);
 	RUN_TEST_CASE(leapsec, ls2009weekaway);
+	RUN_TEST_CASE(leapsec, ls2009quiet);
 	RUN_TEST_CASE(leapsec, ls2009houraway);
 	RUN_TEST_CASE(leapsec, ls2009secaway);
 	RUN_TEST_CASE(leapsec, ls2009onspot);
@@ -1025,4 +1132,7 @@ TEST_GROUP_RUNNER(leapsec) {
 	RUN_TEST_CASE(leapsec, ls2012seqInsDumb);
 	RUN_TEST_CASE(leapsec, lsEmptyTableDumb);
 	RUN_TEST_CASE(leapsec, lsEmptyTableElectric);
+#ifdef ENABLE_LEAP_SMEAR
+	RUN_TEST_CASE(leapsec, smearSegment);
+#endif
 }
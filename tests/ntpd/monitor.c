@@ -0,0 +1,461 @@
+#include "config.h"
+
+#include <math.h>
+
+#include "ntpd.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+#define MON_TEST_HOSTS	500
+
+static endpt	ep_a, ep_b;
+
+/* Helper functions */
+
+static void
+fill_packet(recvbuf_t *rb, unsigned int n)
+{
+	ZERO(*rb);
+	SET_AF(&rb->recv_srcadr, AF_INET);
+	SET_PORT(&rb->recv_srcadr, 123);
+	PSOCK_ADDR4(&rb->recv_srcadr)->s_addr = htonl(0x0a000000 + n);
+	rb->recv_buffer[0] = PKT_LI_VN_MODE(0, NTP_VERSION, MODE_CLIENT);
+	rb->recv_length = LEN_PKT_NOMAC;
+	rb->recv_time = (l_fp)n << 32;
+	rb->dstadr = (n & 1) ? &ep_a : &ep_b;
+}
+
+static mon_entry *
+lookup(unsigned int n)
+{
+	recvbuf_t rb;
+
+	fill_packet(&rb, n);
+	return mon_get_slot(&rb.recv_srcadr);
+}
+
+TEST_GROUP(monitor);
+
+TEST_SETUP(monitor) {
+	init_mon();
+	/* a tiny table forces it to grow */
+	mon_data.mru_maxdepth = 8;
+	mon_start();
+}
+
+TEST_TEAR_DOWN(monitor) {
+	mon_stop();
+	mon_data.mru_maxdepth = 1024 * 1024 / sizeof(mon_entry);
+	mon_data.mru_mindepth = 600;
+	mon_data.mru_maxage = 3600;
+	mon_data.mru_sweep = 256;
+	mon_data.mru_clocksweep = false;
+	mon_data.mru_sketchkb = 0;
+	mon_data.dup_window = 0;
+	mon_data.dup_drop = false;
+	mon_data.decay_time = 20;
+	lean_memory = false;
+}
+
+/* Tests */
+
+TEST(monitor, NewSourcesAreFound) {
+	recvbuf_t rb;
+
+	for (unsigned int n = 0; n < MON_TEST_HOSTS; n++) {
+		fill_packet(&rb, n);
+		ntp_monitor(&rb, 0);
+	}
+	TEST_ASSERT_EQUAL(MON_TEST_HOSTS, mon_data.mru_entries);
+	TEST_ASSERT_EQUAL(MON_TEST_HOSTS, mon_data.mru_hashslots);
+	for (unsigned int n = 0; n < MON_TEST_HOSTS; n++) {
+		mon_entry *mon = lookup(n);
+		TEST_ASSERT_NOT_NULL(mon);
+		TEST_ASSERT_EQUAL(1, mon->count);
+	}
+	TEST_ASSERT_NULL(lookup(MON_TEST_HOSTS));
+}
+
+TEST(monitor, RepeatMovesToHead) {
+	recvbuf_t rb;
+
+	for (unsigned int n = 0; n < 10; n++) {
+		fill_packet(&rb, n);
+		ntp_monitor(&rb, 0);
+	}
+	fill_packet(&rb, 3);
+	rb.recv_time += (l_fp)100 << 32;
+	ntp_monitor(&rb, 0);
+
+	TEST_ASSERT_EQUAL(10, mon_data.mru_entries);
+	TEST_ASSERT_EQUAL_PTR(lookup(3), HEAD_DLIST(mon_data.mon_mru_list, mru));
+	TEST_ASSERT_EQUAL(2, lookup(3)->count);
+	TEST_ASSERT_EQUAL_PTR(lookup(0), TAIL_DLIST(mon_data.mon_mru_list, mru));
+}
+
+TEST(monitor, ClearInterfaceKeepsOthers) {
+	recvbuf_t rb;
+
+	for (unsigned int n = 0; n < MON_TEST_HOSTS; n++) {
+		fill_packet(&rb, n);
+		ntp_monitor(&rb, 0);
+	}
+	mon_clearinterface(&ep_a);
+
+	TEST_ASSERT_EQUAL(MON_TEST_HOSTS / 2, mon_data.mru_entries);
+	TEST_ASSERT_EQUAL(MON_TEST_HOSTS / 2, mon_data.mru_hashslots);
+	for (unsigned int n = 0; n < MON_TEST_HOSTS; n++) {
+		if (n & 1)
+			TEST_ASSERT_NULL(lookup(n));
+		else
+			TEST_ASSERT_NOT_NULL(lookup(n));
+	}
+}
+
+TEST(monitor, ClockSweepDefersRelink) {
+	recvbuf_t rb;
+
+	mon_data.mru_clocksweep = true;
+	for (unsigned int n = 0; n < 10; n++) {
+		fill_packet(&rb, n);
+		ntp_monitor(&rb, 0);
+	}
+	fill_packet(&rb, 3);
+	rb.recv_time += (l_fp)100 << 32;
+	ntp_monitor(&rb, 0);
+
+	/* the hit left the list alone... */
+	TEST_ASSERT_EQUAL_PTR(lookup(9), HEAD_DLIST(mon_data.mon_mru_list, mru));
+	TEST_ASSERT_TRUE(lookup(3)->referenced);
+	TEST_ASSERT_TRUE(mon_data.mru_unsorted);
+
+	/* ...until somebody wants to look at it */
+	mon_sort_mru();
+	TEST_ASSERT_EQUAL_PTR(lookup(3), HEAD_DLIST(mon_data.mon_mru_list, mru));
+	TEST_ASSERT_EQUAL_PTR(lookup(0), TAIL_DLIST(mon_data.mon_mru_list, mru));
+	TEST_ASSERT_FALSE(mon_data.mru_unsorted);
+}
+
+TEST(monitor, ClockSweepSparesReferenced) {
+	recvbuf_t rb;
+
+	mon_data.mru_clocksweep = true;
+	mon_data.mru_mindepth = 4;
+	mon_data.mru_maxage = 0;	/* recycle the oldest at once */
+	for (unsigned int n = 0; n < 4; n++) {
+		fill_packet(&rb, n);
+		ntp_monitor(&rb, 0);
+	}
+	fill_packet(&rb, 0);
+	rb.recv_time = (l_fp)10 << 32;
+	ntp_monitor(&rb, 0);
+	fill_packet(&rb, 4);
+	rb.recv_time = (l_fp)11 << 32;
+	ntp_monitor(&rb, 0);
+
+	TEST_ASSERT_EQUAL(4, mon_data.mru_entries);
+	TEST_ASSERT_NOT_NULL(lookup(0));
+	TEST_ASSERT_NULL(lookup(1));
+	TEST_ASSERT_NOT_NULL(lookup(4));
+}
+
+/* the timer frees what is past maxage, a budget at a time */
+TEST(monitor, ExpireFreesStale) {
+	recvbuf_t rb;
+	uint64_t expired = mon_data.mru_expired;
+
+	mon_data.mru_mindepth = 2;
+	mon_data.mru_maxage = 10;
+	mon_data.mru_sweep = 3;
+	for (unsigned int n = 0; n < 8; n++) {
+		fill_packet(&rb, n);
+		ntp_monitor(&rb, 0);
+	}
+
+	/* nothing is old enough yet */
+	mon_expire((l_fp)10 << 32);
+	TEST_ASSERT_EQUAL(8, mon_data.mru_entries);
+
+	mon_expire((l_fp)20 << 32);
+	TEST_ASSERT_EQUAL(5, mon_data.mru_entries);
+	TEST_ASSERT_NULL(lookup(2));
+	TEST_ASSERT_NOT_NULL(lookup(3));
+
+	/* down to mindepth and no further */
+	mon_expire((l_fp)30 << 32);
+	mon_expire((l_fp)30 << 32);
+	TEST_ASSERT_EQUAL(2, mon_data.mru_entries);
+	TEST_ASSERT_NOT_NULL(lookup(7));
+	TEST_ASSERT_EQUAL(6, mon_data.mru_expired - expired);
+
+	/* the freed slots are used again */
+	fill_packet(&rb, 100);
+	rb.recv_time = (l_fp)12 << 32;
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_NOT_NULL(lookup(100));
+	TEST_ASSERT_EQUAL(3, mon_data.mru_entries);
+}
+
+/* saved scores come back decayed, and only while they still count */
+TEST(monitor, RestoreKeepsBusySources) {
+	recvbuf_t rb;
+	l_fp now = (l_fp)100 << 32;
+	mon_entry *mon;
+	float score;
+
+	fill_packet(&rb, 1);
+	TEST_ASSERT_TRUE(mon_restore(&rb.recv_srcadr, now - ((l_fp)20 << 32),
+				     50, 0x1b, 4 * mon_data.rate_limit, now));
+	mon = lookup(1);
+	TEST_ASSERT_NOT_NULL(mon);
+	TEST_ASSERT_EQUAL(50, mon->count);
+	TEST_ASSERT_NULL(mon->lcladr);
+	TEST_ASSERT_FLOAT_WITHIN(0.01f, 4 * mon_data.rate_limit * expf(-1),
+				 mon->score);
+	TEST_ASSERT_TRUE(mon_state(mon, now, &score));
+
+	/* already known */
+	TEST_ASSERT_FALSE(mon_restore(&rb.recv_srcadr, now, 1, 0x1b,
+				      4 * mon_data.rate_limit, now));
+	TEST_ASSERT_EQUAL(50, lookup(1)->count);
+
+	/* decayed away while ntpd was down */
+	fill_packet(&rb, 2);
+	TEST_ASSERT_FALSE(mon_restore(&rb.recv_srcadr, now - ((l_fp)60 << 32),
+				      50, 0x1b, 4 * mon_data.rate_limit, now));
+	TEST_ASSERT_NULL(lookup(2));
+	TEST_ASSERT_EQUAL(1, mon_data.mru_entries);
+
+	/* the next packet carries on from the restored score */
+	fill_packet(&rb, 1);
+	rb.recv_time = now;
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(51, lookup(1)->count);
+	TEST_ASSERT_EQUAL_PTR(&ep_a, lookup(1)->lcladr);
+	TEST_ASSERT_FLOAT_WITHIN(0.01f, 4 * mon_data.rate_limit * expf(-2) +
+				 1.0f / mon_data.decay_time,
+				 lookup(1)->score);
+}
+
+/* the decay tables give the scores expf() would */
+TEST(monitor, ScoreMatchesFloatModel) {
+	static const float decays[] = { 20, 7.5, 300 };
+	recvbuf_t rb;
+	uint32_t seed = 12345;
+	double model;
+	l_fp gap;
+
+	for (unsigned int d = 0; d < COUNTOF(decays); d++) {
+		mon_data.decay_time = decays[d];
+		fill_packet(&rb, 1000 + d);
+		ntp_monitor(&rb, 0);
+		model = 1.0 / decays[d];
+		for (unsigned int n = 0; n < 2000; n++) {
+			seed = seed * 1103515245 + 12345;
+			/* bursts, a second or so, and now and then hours */
+			if (0 == n % 500)
+				gap = (l_fp)(5 * 3600) << 32;
+			else if (seed & 0x80000000)
+				gap = (l_fp)(seed & 0x0fffffff);
+			else
+				gap = (l_fp)(seed & 0x3ffffff) << 7;
+			rb.recv_time += gap;
+			ntp_monitor(&rb, 0);
+			model *= exp(-ldexp((double)gap, -32) / decays[d]);
+			model += 1.0 / decays[d];
+			TEST_ASSERT_FLOAT_WITHIN(0.002 * model + 1e-6,
+						 (float)model,
+						 lookup(1000 + d)->score);
+		}
+	}
+}
+
+TEST(monitor, SketchAdmitsBusySources) {
+	recvbuf_t rb;
+	uint64_t sketched = mon_data.mru_sketched;
+
+	mon_stop();
+	mon_data.mru_sketchkb = 4;
+	mon_start();
+
+	/* one packet each is nowhere near the limit */
+	for (unsigned int n = 0; n < MON_TEST_HOSTS; n++) {
+		fill_packet(&rb, n);
+		ntp_monitor(&rb, 0);
+	}
+	TEST_ASSERT_EQUAL(0, mon_data.mru_entries);
+	TEST_ASSERT_EQUAL(MON_TEST_HOSTS, mon_data.mru_sketched - sketched);
+
+	/* a burst from one source earns it an entry */
+	for (int i = 0; i < 6; i++) {
+		fill_packet(&rb, 7);
+		rb.recv_time = (l_fp)MON_TEST_HOSTS << 32;
+		ntp_monitor(&rb, 0);
+	}
+	TEST_ASSERT_EQUAL(1, mon_data.mru_entries);
+	TEST_ASSERT_NOT_NULL(lookup(7));
+	TEST_ASSERT_NULL(lookup(8));
+	TEST_ASSERT_TRUE(lookup(7)->score > 0.25 * mon_data.rate_limit);
+}
+
+TEST(monitor, EntriesComeFromArena) {
+	TEST_ASSERT_TRUE(mon_data.mru_arenasize >= 8);
+	TEST_ASSERT_TRUE(mon_data.mru_arenaused > 0);
+	TEST_ASSERT_TRUE(mon_data.mru_arenaused <= mon_data.mru_arenasize);
+}
+
+TEST(monitor, LeanWaitsForFirstSource) {
+	recvbuf_t rb;
+
+	mon_stop();
+	lean_memory = true;
+	mon_start();
+	TEST_ASSERT_NULL(mon_data.mon_hash);
+	TEST_ASSERT_NULL(lookup(1));
+
+	fill_packet(&rb, 1);
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_NOT_NULL(mon_data.mon_hash);
+	TEST_ASSERT_NOT_NULL(lookup(1));
+	/* sized for the initial allocation, then grown */
+	for (unsigned int n = 2; n < MON_TEST_HOSTS; n++) {
+		fill_packet(&rb, n);
+		ntp_monitor(&rb, 0);
+	}
+	TEST_ASSERT_NOT_NULL(lookup(MON_TEST_HOSTS - 1));
+	TEST_ASSERT_TRUE(mon_memory() >= MON_TEST_HOSTS * sizeof(mon_entry));
+}
+
+static void
+put_stamp(recvbuf_t *rb, int offset, l_fp ts)
+{
+	uint32_t wire[2] = { htonl(lfpuint(ts)), htonl(lfpfrac(ts)) };
+
+	memcpy(rb->recv_buffer + offset, wire, sizeof(wire));
+}
+
+TEST(monitor, Interleave) {
+	recvbuf_t rb;
+	uint8_t frame[90];
+	const l_fp rx1 = (l_fp)100 << 32, rx2 = (l_fp)101 << 32;
+	const l_fp built = (l_fp)100 << 32 | 5, sent = (l_fp)100 << 32 | 9;
+
+	/* a data-minimized request keeps nothing */
+	fill_packet(&rb, 7);
+	rb.recv_time = rx1;
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_NONE, rb.xleave);
+
+	/* a basic request with an origin remembers its reply */
+	fill_packet(&rb, 7);
+	rb.recv_time = rx1;
+	put_stamp(&rb, 24, (l_fp)1);
+	put_stamp(&rb, 40, (l_fp)2);
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_BASIC, rb.xleave);
+	rb.xleave_tx = built;
+	mon_xleave_sent(&rb);
+	TEST_ASSERT_TRUE(built == lookup(7)->xl_tx);
+
+	/* echoing our receive timestamp asks for the last transmit time */
+	fill_packet(&rb, 7);
+	rb.recv_time = rx2;
+	put_stamp(&rb, 24, rx1);
+	put_stamp(&rb, 40, (l_fp)3);
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_REPLY, rb.xleave);
+	TEST_ASSERT_TRUE(built == rb.xleave_tx);
+	TEST_ASSERT_TRUE(rx2 == lookup(7)->xl_rx);
+
+	/* whose kernel stamp is matched by the receive timestamp */
+	rb.xleave_tx = built + 1;
+	mon_xleave_sent(&rb);
+	memset(frame, 0, sizeof(frame));
+	memcpy(frame + 74, rb.recv_buffer + 40, 8);
+	TEST_ASSERT_FALSE(mon_txstamp(frame, sizeof(frame), sent));
+	put_stamp(&rb, 24, rx2);
+	memcpy(frame + 74, rb.recv_buffer + 24, 8);
+	TEST_ASSERT_TRUE(mon_txstamp(frame, sizeof(frame), sent));
+	TEST_ASSERT_TRUE(sent == lookup(7)->xl_tx);
+	TEST_ASSERT_FALSE(mon_txstamp(frame, sizeof(frame), sent));
+
+	/* a stale origin falls back to basic mode */
+	fill_packet(&rb, 7);
+	rb.recv_time = rx2 + 1;
+	put_stamp(&rb, 24, rx1);
+	put_stamp(&rb, 40, (l_fp)4);
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_BASIC, rb.xleave);
+}
+
+TEST(monitor, Duplicate) {
+	recvbuf_t rb;
+	const l_fp rx = (l_fp)100 << 32, xmt = (l_fp)7 << 32 | 1;
+	const l_fp ms = (l_fp)1 << 22;	/* about a millisecond */
+
+	mon_data.dup_window = 20 * ms;
+
+	/* the first copy is an ordinary request */
+	fill_packet(&rb, 9);
+	rb.recv_time = rx;
+	put_stamp(&rb, 24, (l_fp)1);
+	put_stamp(&rb, 40, xmt);
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_BASIC, rb.xleave);
+	rb.xleave_tx = rx + ms;
+	mon_xleave_sent(&rb);
+
+	/* a copy soon after is answered as the first, state untouched */
+	rb.recv_time = rx + 2 * ms;
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_DUP, rb.xleave);
+	TEST_ASSERT_TRUE(rx == rb.xleave_tx);
+	TEST_ASSERT_TRUE(rx == lookup(9)->xl_rx);
+	TEST_ASSERT_TRUE(rx + ms == lookup(9)->xl_tx);
+
+	/* one with a MAC would need the crypto again */
+	rb.recv_length = LEN_PKT_NOMAC + 20;
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_DROP, rb.xleave);
+
+	/* and under dupdrop none are answered */
+	rb.recv_length = LEN_PKT_NOMAC;
+	mon_data.dup_drop = true;
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_DROP, rb.xleave);
+	mon_data.dup_drop = false;
+
+	/* later than the window it is a request again */
+	rb.recv_time = rx + 30 * ms;
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_BASIC, rb.xleave);
+	TEST_ASSERT_TRUE(rx + 30 * ms == lookup(9)->xl_rx);
+
+	/* as is a new transmit timestamp */
+	rb.recv_time += ms;
+	put_stamp(&rb, 40, xmt + 1);
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_BASIC, rb.xleave);
+
+	/* and with the window shut nothing is a duplicate */
+	mon_data.dup_window = 0;
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_EQUAL(XLEAVE_BASIC, rb.xleave);
+}
+
+TEST_GROUP_RUNNER(monitor) {
+	RUN_TEST_CASE(monitor, ExpireFreesStale);
+	RUN_TEST_CASE(monitor, RestoreKeepsBusySources);
+	RUN_TEST_CASE(monitor, ScoreMatchesFloatModel);
+	RUN_TEST_CASE(monitor, SketchAdmitsBusySources);
+	RUN_TEST_CASE(monitor, EntriesComeFromArena);
+	RUN_TEST_CASE(monitor, LeanWaitsForFirstSource);
+	RUN_TEST_CASE(monitor, NewSourcesAreFound);
+	RUN_TEST_CASE(monitor, RepeatMovesToHead);
+	RUN_TEST_CASE(monitor, ClearInterfaceKeepsOthers);
+	RUN_TEST_CASE(monitor, ClockSweepDefersRelink);
+	RUN_TEST_CASE(monitor, ClockSweepSparesReferenced);
+	RUN_TEST_CASE(monitor, Interleave);
+	RUN_TEST_CASE(monitor, Duplicate);
+}
@@ -27,6 +27,8 @@ TEST(nts, nts_string_to_aead) {
 				nts_string_to_aead("AES_SIV_CMAC_384"));
 	TEST_ASSERT_EQUAL_INT16(AEAD_AES_SIV_CMAC_512,
 				nts_string_to_aead("AES_SIV_CMAC_512"));
+	TEST_ASSERT_EQUAL_INT16(AEAD_AES_128_GCM_SIV,
+				nts_string_to_aead("AES_128_GCM_SIV"));
 	TEST_ASSERT_EQUAL_INT16(NO_AEAD, nts_string_to_aead("blah"));
 }
 
@@ -37,6 +39,8 @@ TEST(nts, nts_get_key_length) {
 				nts_get_key_length(AEAD_AES_SIV_CMAC_384));
 	TEST_ASSERT_EQUAL_INT32(AEAD_AES_SIV_CMAC_512_KEYLEN,
 				nts_get_key_length(AEAD_AES_SIV_CMAC_512));
+	TEST_ASSERT_EQUAL_INT32(AEAD_AES_128_GCM_SIV_KEYLEN,
+				nts_get_key_length(AEAD_AES_128_GCM_SIV));
 	TEST_ASSERT_EQUAL_INT32(0, nts_get_key_length(-23));
 }
 
@@ -8,12 +8,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-void dns_take_server(struct peer *a, sockaddr_u *b);
-void dns_take_status(struct peer *a, DNS_Status b);
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 bool nts_client_send_request_core(uint8_t *buff, int buf_size, int *used, struct peer* peer);
 bool nts_client_process_response_core(uint8_t *buff, int transferred, struct peer* peer);
+int nts_order_addrs(struct addrinfo *answer, struct addrinfo **addrs, int max);
+SSL_CTX *ca_client_ctx(const char *ca);
 
 
 TEST_GROUP(nts_client);
@@ -27,9 +29,12 @@ TEST(nts_client, nts_client_send_request_core) {
 	bool success;
 	int used;
 	struct peer peer;
+	struct peer_cold cold;
 	uint8_t buffer[1000];
 	char pAEAD[50] = "AES_SIV_CMAC_512";
 	/* ===== Test: correct, peer aead ===== */
+	memset(&cold, 0, sizeof(cold));
+	peer.cold = &cold;
 	peer.cfg.nts_cfg.aead = pAEAD;
 	/* run */
 	success = nts_client_send_request_core(buffer, sizeof(buffer), &used, &peer);
@@ -104,10 +109,12 @@ TEST(nts_client, nts_client_process_response_core) {
 	/* General init */
 	bool success;
 	struct peer peer;
-	peer.nts_state.aead = 42; /* Dummy init values */
-	peer.nts_state.cookielen = 0;
-	peer.nts_state.writeIdx = 0;
-	peer.nts_state.count = 0;
+	struct peer_cold cold;
+	peer.cold = &cold;
+	peer.cold->nts_state.aead = 42; /* Dummy init values */
+	peer.cold->nts_state.cookielen = 0;
+	peer.cold->nts_state.writeIdx = 0;
+	peer.cold->nts_state.count = 0;
 	/* Coverity barfed on uninitialized peer.srcadr, 2022-Mar-16
 	 * ** CID 349664:  Uninitialized variables  (UNINIT)
 	 * So initialize it with something. */
@@ -132,18 +139,18 @@ TEST(nts_client, nts_client_process_response_core) {
 	success = nts_client_process_response_core(buf0, sizeof(buf0), &peer);
 	/* check */
 	TEST_ASSERT_EQUAL(true, success);
-	TEST_ASSERT_EQUAL_INT16(AEAD_AES_SIV_CMAC_256, peer.nts_state.aead);
-	TEST_ASSERT_EQUAL_INT32(8, peer.nts_state.cookielen);
-	TEST_ASSERT_EQUAL_INT8(1, peer.nts_state.cookies[0][0]);
-	TEST_ASSERT_EQUAL_INT8(2, peer.nts_state.cookies[0][1]);
-	TEST_ASSERT_EQUAL_INT8(3, peer.nts_state.cookies[0][2]);
-	TEST_ASSERT_EQUAL_INT8(4, peer.nts_state.cookies[0][3]);
-	TEST_ASSERT_EQUAL_INT8(5, peer.nts_state.cookies[0][4]);
-	TEST_ASSERT_EQUAL_INT8(6, peer.nts_state.cookies[0][5]);
-	TEST_ASSERT_EQUAL_INT8(7, peer.nts_state.cookies[0][6]);
-	TEST_ASSERT_EQUAL_INT8(8, peer.nts_state.cookies[0][7]);
-	TEST_ASSERT_EQUAL_INT32(1, peer.nts_state.writeIdx);
-	TEST_ASSERT_EQUAL_INT32(1, peer.nts_state.count);
+	TEST_ASSERT_EQUAL_INT16(AEAD_AES_SIV_CMAC_256, peer.cold->nts_state.aead);
+	TEST_ASSERT_EQUAL_INT32(8, peer.cold->nts_state.cookielen);
+	TEST_ASSERT_EQUAL_INT8(1, peer.cold->nts_state.cookies[0][0]);
+	TEST_ASSERT_EQUAL_INT8(2, peer.cold->nts_state.cookies[0][1]);
+	TEST_ASSERT_EQUAL_INT8(3, peer.cold->nts_state.cookies[0][2]);
+	TEST_ASSERT_EQUAL_INT8(4, peer.cold->nts_state.cookies[0][3]);
+	TEST_ASSERT_EQUAL_INT8(5, peer.cold->nts_state.cookies[0][4]);
+	TEST_ASSERT_EQUAL_INT8(6, peer.cold->nts_state.cookies[0][5]);
+	TEST_ASSERT_EQUAL_INT8(7, peer.cold->nts_state.cookies[0][6]);
+	TEST_ASSERT_EQUAL_INT8(8, peer.cold->nts_state.cookies[0][7]);
+	TEST_ASSERT_EQUAL_INT32(1, peer.cold->nts_state.writeIdx);
+	TEST_ASSERT_EQUAL_INT32(1, peer.cold->nts_state.count);
 	/* ===== Test: nts_error ===== */
 	/* data */
 	uint8_t buf1[] = {
@@ -200,7 +207,7 @@ TEST(nts_client, nts_client_process_response_core) {
 	TEST_ASSERT_EQUAL(false, success);
 	/* ===== Test: nts_new_cookie, cookie doesn't equal peer cookie size ===== */
 	/* data */
-	peer.nts_state.cookielen = 8;
+	peer.cold->nts_state.cookielen = 8;
 	uint8_t buf7[] = {
 		0x80, nts_new_cookie, 0, 4, 0, 9,
 		0x80, nts_end_of_message, 0, 0
@@ -214,14 +221,14 @@ TEST(nts_client, nts_client_process_response_core) {
 		0x80, nts_new_cookie, 0, 4, 0, 8, 10, 20, 30, 40, 50, 60, 70, 80,
 		0x80, nts_end_of_message, 0, 0
 	};
-	peer.nts_state.writeIdx = 0;
-	peer.nts_state.count = NTS_MAX_COOKIES;
+	peer.cold->nts_state.writeIdx = 0;
+	peer.cold->nts_state.count = NTS_MAX_COOKIES;
 	/* run */
 	success = nts_client_process_response_core(buf8, sizeof(buf8), &peer);
 	/* check */
 	TEST_ASSERT_EQUAL(false, success);
-	TEST_ASSERT_EQUAL(0, peer.nts_state.writeIdx);
-	TEST_ASSERT_NOT_EQUAL(10, peer.nts_state.cookies[0][0]);
+	TEST_ASSERT_EQUAL(0, peer.cold->nts_state.writeIdx);
+	TEST_ASSERT_NOT_EQUAL(10, peer.cold->nts_state.cookies[0][0]);
 	/* ===== Test: nts_end_of_message, wrong length ===== */
 	/* data */
 	uint8_t buf9[] = {
@@ -250,7 +257,7 @@ TEST(nts_client, nts_client_process_response_core) {
 	TEST_ASSERT_EQUAL(false, success);
 	/* ===== Test: no cookies ===== */
 	/* data */
-	peer.nts_state.count = 0;
+	peer.cold->nts_state.count = 0;
 	uint8_t buf12[] = {
 		0x80, nts_end_of_message, 0, 0
 	};
@@ -259,8 +266,8 @@ TEST(nts_client, nts_client_process_response_core) {
 	TEST_ASSERT_EQUAL(false, success);
 	/* ===== Test: no aead ===== */
 	/* data */
-	peer.nts_state.count = 8; /* So this doesn't trigger an error */
-	peer.nts_state.aead = NO_AEAD;
+	peer.cold->nts_state.count = 8; /* So this doesn't trigger an error */
+	peer.cold->nts_state.aead = NO_AEAD;
 	uint8_t buf13[] = {
 		0x80, nts_end_of_message, 0, 0
 	};
@@ -269,29 +276,65 @@ TEST(nts_client, nts_client_process_response_core) {
 	TEST_ASSERT_EQUAL(false, success);
 }
 
-/* Hacks to keep linker happy */
+TEST(nts_client, nts_order_addrs) {
+	struct addrinfo ai[5];
+	struct addrinfo *addrs[8];
+	int families[5] = {AF_INET6, AF_INET6, AF_INET6, AF_INET, AF_INET};
+	int n;
 
-#ifdef HAVE_SECCOMP_H
-void setup_SIGSYS_trap(void) {
-        return;         /* dummy to keep linker happy */
+	memset(ai, 0, sizeof(ai));
+	for (int i = 0; i < 5; i++) {
+		ai[i].ai_family = families[i];
+		ai[i].ai_addrlen = sizeof(struct sockaddr_in6);
+		ai[i].ai_next = (i < 4) ? &ai[i+1] : NULL;
+	}
+	/* ===== Test: families alternate, first family leads ===== */
+	n = nts_order_addrs(ai, addrs, 8);
+	TEST_ASSERT_EQUAL(5, n);
+	TEST_ASSERT_EQUAL_PTR(&ai[0], addrs[0]);
+	TEST_ASSERT_EQUAL_PTR(&ai[3], addrs[1]);
+	TEST_ASSERT_EQUAL_PTR(&ai[1], addrs[2]);
+	TEST_ASSERT_EQUAL_PTR(&ai[4], addrs[3]);
+	TEST_ASSERT_EQUAL_PTR(&ai[2], addrs[4]);
+	/* ===== Test: stops at max ===== */
+	n = nts_order_addrs(ai, addrs, 3);
+	TEST_ASSERT_EQUAL(3, n);
+	TEST_ASSERT_EQUAL_PTR(&ai[1], addrs[2]);
+	/* ===== Test: one family ===== */
+	n = nts_order_addrs(&ai[3], addrs, 8);
+	TEST_ASSERT_EQUAL(2, n);
+	TEST_ASSERT_EQUAL_PTR(&ai[3], addrs[0]);
+	TEST_ASSERT_EQUAL_PTR(&ai[4], addrs[1]);
+	/* ===== Test: empty ===== */
+	n = nts_order_addrs(NULL, addrs, 8);
+	TEST_ASSERT_EQUAL(0, n);
 }
-#endif
 
-void dns_take_server(struct peer *a, sockaddr_u *b) {
-	UNUSED_ARG(a);
-	UNUSED_ARG(b);
-	return;
-}
+TEST(nts_client, ca_client_ctx) {
+	char dir[] = "/tmp/nts-ca-XXXXXX";
+	struct timeval tv[2] = {{.tv_sec = 1000000000}, {.tv_sec = 1000000000}};
+	SSL_CTX *ctx, *ctx2;
 
-void dns_take_status(struct peer *a, DNS_Status b) {
-	UNUSED_ARG(a);
-	UNUSED_ARG(b);
-	return;
-}
+	TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+	TEST_ASSERT_NULL(ca_client_ctx("/nonexistent/nts-ca"));
 
-struct peer *peer_list = NULL;
+	/* one CTX per CA, until the CA changes */
+	ctx = ca_client_ctx(dir);
+	TEST_ASSERT_NOT_NULL(ctx);
+	TEST_ASSERT_EQUAL_PTR(ctx, ca_client_ctx(dir));
+	SSL_CTX_up_ref(ctx);	/* so its address can't come back */
+	TEST_ASSERT_EQUAL(0, utimes(dir, tv));
+	ctx2 = ca_client_ctx(dir);
+	TEST_ASSERT_NOT_NULL(ctx2);
+	TEST_ASSERT_NOT_EQUAL(ctx, ctx2);
+	TEST_ASSERT_EQUAL_PTR(ctx2, ca_client_ctx(dir));
+	SSL_CTX_free(ctx);
+	rmdir(dir);
+}
 
 TEST_GROUP_RUNNER(nts_client) {
 	RUN_TEST_CASE(nts_client, nts_client_send_request_core);
 	RUN_TEST_CASE(nts_client, nts_client_process_response_core);
+	RUN_TEST_CASE(nts_client, nts_order_addrs);
+	RUN_TEST_CASE(nts_client, ca_client_ctx);
 }
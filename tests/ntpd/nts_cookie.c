@@ -14,6 +14,7 @@
 extern AES_SIV_CTX* cookie_ctx;
 extern uint8_t K[NTS_MAX_KEYLEN], K2[NTS_MAX_KEYLEN];
 extern uint32_t I;
+extern int K_length;
 
 TEST_GROUP(nts_cookie);
 
@@ -77,6 +78,100 @@ TEST(nts_cookie, nts_make_unpack_cookie) {
 	TEST_ASSERT_EQUAL_UINT8_ARRAY(s2c, s2c_2, 16);
 }
 
+TEST(nts_cookie, nts_make_unpack_cookie_gcm_siv) {
+	uint8_t cookie[NTS_MAX_COOKIELEN];
+	uint8_t c2s[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+	uint8_t s2c[16] = {16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+	uint8_t c2s_2[16], s2c_2[16];
+	int len, keylen, saved = K_length;
+	uint16_t aead;
+
+	/* a 16 byte K seals cookies with AES-128-GCM-SIV */
+	nts_cookie_init();
+	nts_nKeys = 0;
+	K_length = AEAD_AES_128_GCM_SIV_KEYLEN;
+	nts_make_cookie_key();
+	len = nts_make_cookie(cookie, AEAD_AES_128_GCM_SIV, c2s, s2c, sizeof(c2s));
+	TEST_ASSERT_EQUAL(72, len);
+	TEST_ASSERT_TRUE(nts_unpack_cookie(cookie, len, &aead, c2s_2, s2c_2, &keylen));
+	TEST_ASSERT_EQUAL(AEAD_AES_128_GCM_SIV, aead);
+	TEST_ASSERT_EQUAL(16, keylen);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(c2s, c2s_2, 16);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(s2c, s2c_2, 16);
+	/* the tag is at the end */
+	cookie[len-1] ^= 1;
+	TEST_ASSERT_FALSE(nts_unpack_cookie(cookie, len, &aead, c2s_2, s2c_2, &keylen));
+	K_length = saved;
+	nts_make_cookie_key();
+}
+
+TEST(nts_cookie, nts_cookie_key_rotation) {
+	uint8_t cookie[NTS_MAX_COOKIELEN], cookie2[NTS_MAX_COOKIELEN];
+	uint8_t c2s[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+	uint8_t s2c[16] = {16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+	uint8_t c2s_2[16], s2c_2[16];
+	int len, len2;
+	int keylen;
+	uint16_t aead;
+
+	nts_cookie_init();
+	nts_nKeys = 0;
+	nts_make_cookie_key();
+	len = nts_make_cookie(cookie, AEAD_AES_SIV_CMAC_256, c2s, s2c, sizeof(c2s));
+	/* Keyed contexts must follow the rotation */
+	nts_make_cookie_key();
+	len2 = nts_make_cookie(cookie2, AEAD_AES_SIV_CMAC_256, c2s, s2c, sizeof(c2s));
+	TEST_ASSERT_NOT_EQUAL(0, memcmp(cookie, cookie2, 4));
+
+	/* old cookie now decodes with nts_keys[1] */
+	TEST_ASSERT_TRUE(nts_unpack_cookie(cookie, len, &aead, c2s_2, s2c_2, &keylen));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(c2s, c2s_2, 16);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(s2c, s2c_2, 16);
+	TEST_ASSERT_TRUE(nts_unpack_cookie(cookie2, len2, &aead, c2s_2, s2c_2, &keylen));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(c2s, c2s_2, 16);
+
+	/* tampered or truncated cookies fail */
+	cookie2[len2-1] ^= 1;
+	TEST_ASSERT_FALSE(nts_unpack_cookie(cookie2, len2, &aead, c2s_2, s2c_2, &keylen));
+	TEST_ASSERT_FALSE(nts_unpack_cookie(cookie, 24, &aead, c2s_2, s2c_2, &keylen));
+}
+
+TEST(nts_cookie, nts_unpack_unknown_key) {
+	uint8_t cookie[NTS_MAX_COOKIELEN];
+	uint8_t c2s[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+	uint8_t s2c[16] = {16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+	uint8_t c2s_2[16], s2c_2[16];
+	uint64_t too_old;
+	uint32_t id;
+	int len, keylen;
+	uint16_t aead;
+
+	nts_cookie_init();
+	nts_nKeys = 0;
+	for (int i = 0; i < NTS_nKEYS + 2; i++)
+		nts_make_cookie_key();
+	TEST_ASSERT_EQUAL(NTS_nKEYS, nts_nKeys);
+	len = nts_make_cookie(cookie, AEAD_AES_SIV_CMAC_256, c2s, s2c, sizeof(c2s));
+
+	/* every retained key is found */
+	for (int i = 0; i < nts_nKeys; i++) {
+		memcpy(cookie, &nts_keys[i].I, sizeof(id));
+		too_old = nts_cnt_mine()->cookie_decode_too_old;
+		(void)nts_unpack_cookie(cookie, len, &aead, c2s_2, s2c_2, &keylen);
+		TEST_ASSERT_EQUAL(too_old, nts_cnt_mine()->cookie_decode_too_old);
+	}
+
+	/* an ID we never had is rejected before decrypting */
+	id = nts_keys[0].I + 1;
+	for (int i = 0; i < nts_nKeys; i++)
+		if (id == nts_keys[i].I)
+			id++;
+	memcpy(cookie, &id, sizeof(id));
+	too_old = nts_cnt_mine()->cookie_decode_too_old;
+	TEST_ASSERT_FALSE(nts_unpack_cookie(cookie, len, &aead, c2s_2, s2c_2, &keylen));
+	TEST_ASSERT_EQUAL(too_old + 1, nts_cnt_mine()->cookie_decode_too_old);
+}
+
 const char *cookie_file_name = "test-cookie-keys";
 
 TEST(nts_cookie, nts_read_write_cookies) {
@@ -107,10 +202,78 @@ TEST(nts_cookie, nts_read_write_cookies) {
 	TEST_ASSERT_EQUAL(nts_keys[2].I, k2.I);
 }
 
+const char *cookie_secret_name = "test-cookie-secret";
+
+TEST(nts_cookie, nts_cluster_cookie_keys) {
+	uint8_t cookie[NTS_MAX_COOKIELEN];
+	uint8_t c2s[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+	uint8_t s2c[16] = {16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+	uint8_t c2s_2[16], s2c_2[16];
+	struct NTS_Key today, tomorrow;
+	time_t noon = 20000*86400 + 43200;
+	int len, keylen, saved = K_length;
+	uint16_t aead;
+	FILE *out;
+
+	out = fopen(cookie_secret_name, "w");
+	TEST_ASSERT_NOT_NULL(out);
+	fprintf(out, "L: 16\nS: ");
+	for (int i = 0; i < 32; i++)
+		fprintf(out, "%02x", (unsigned int)i * 7);
+	fprintf(out, "\n");
+	fclose(out);
+	ntsconfig.cookiesecret = cookie_secret_name;
+	TEST_ASSERT_TRUE(nts_read_cookie_secret());
+	TEST_ASSERT_EQUAL(AEAD_AES_128_GCM_SIV_KEYLEN, K_length);
+
+	/* any node with the secret gets the same keys */
+	nts_cookie_init();
+	nts_cluster_cookie_keys(noon);
+	TEST_ASSERT_EQUAL(NTS_nKEYS, nts_nKeys);
+	today = nts_keys[0];
+	len = nts_make_cookie(cookie, AEAD_AES_SIV_CMAC_256, c2s, s2c, sizeof(c2s));
+	ZERO(nts_keys);
+	TEST_ASSERT_TRUE(nts_read_cookie_secret());
+	nts_cluster_cookie_keys(noon);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(today.K, nts_keys[0].K, K_length);
+	TEST_ASSERT_EQUAL(today.I, nts_keys[0].I);
+	TEST_ASSERT_NOT_EQUAL(today.I, nts_keys[1].I);
+
+	/* near midnight tomorrow's key is already accepted */
+	nts_cluster_cookie_keys(noon + 43000);
+	tomorrow = nts_keys[NTS_nKEYS-1];
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(today.K, nts_keys[0].K, K_length);
+
+	/* after midnight, today's cookie still decodes */
+	nts_cluster_cookie_keys(noon + 86400);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(tomorrow.K, nts_keys[0].K, K_length);
+	TEST_ASSERT_EQUAL(today.I, nts_keys[1].I);
+	TEST_ASSERT_TRUE(nts_unpack_cookie(cookie, len, &aead, c2s_2, s2c_2, &keylen));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(c2s, c2s_2, 16);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(s2c, s2c_2, 16);
+
+	/* too short a secret is refused */
+	out = fopen(cookie_secret_name, "w");
+	TEST_ASSERT_NOT_NULL(out);
+	fprintf(out, "L: 32\nS: 0011223344556677\n");
+	fclose(out);
+	TEST_ASSERT_FALSE(nts_read_cookie_secret());
+
+	unlink(cookie_secret_name);
+	ntsconfig.cookiesecret = NULL;
+	K_length = saved;
+	nts_nKeys = 0;
+	nts_make_cookie_key();
+}
+
 TEST_GROUP_RUNNER(nts_cookie) {
 	RUN_TEST_CASE(nts_cookie, nts_make_unpack_cookie);
+	RUN_TEST_CASE(nts_cookie, nts_make_unpack_cookie_gcm_siv);
 	RUN_TEST_CASE(nts_cookie, nts_make_cookie_key);
+	RUN_TEST_CASE(nts_cookie, nts_cookie_key_rotation);
+	RUN_TEST_CASE(nts_cookie, nts_unpack_unknown_key);
 	RUN_TEST_CASE(nts_cookie, nts_read_write_cookies);
+	RUN_TEST_CASE(nts_cookie, nts_cluster_cookie_keys);
 	/* This test gets run as root during install
 	 * that leaves the cookie file that we can't read/write
 	 * so clean it up now.
@@ -42,20 +42,23 @@ TEST_TEAR_DOWN(nts_extens) {}
 TEST(nts_extens, extens_client_send) {
 	/* init */
 	struct peer peer;
-	peer.nts_state.readIdx = 0;
-	peer.nts_state.count = 4; /* 1/2 of max, -1, should cause 5 requests */
+	struct peer_cold cold;
+	peer.cold = &cold;
+	peer.cold->nts_state.aead = AEAD_AES_SIV_CMAC_256;
+	peer.cold->nts_state.readIdx = 0;
+	peer.cold->nts_state.count = 4; /* 1/2 of max, -1, should cause 5 requests */
 	uint8_t c2s[NTS_MAX_KEYLEN] = {1, 2, 3, 4, 5, 6, 7, 8};
-	memcpy(peer.nts_state.c2s, c2s, sizeof(c2s));
-	peer.nts_state.keylen = sizeof(c2s);
-	peer.nts_state.cookielen = NTS_MAX_COOKIELEN;
+	memcpy(peer.cold->nts_state.c2s, c2s, sizeof(c2s));
+	peer.cold->nts_state.keylen = sizeof(c2s);
+	peer.cold->nts_state.cookielen = NTS_MAX_COOKIELEN;
 	struct pkt xpkt;
 	int used = 0;
 	/* Test */
 	used = extens_client_send(&peer, &xpkt);
 	TEST_ASSERT_EQUAL(1056, used);
-	TEST_ASSERT_EQUAL(1, peer.nts_state.readIdx);
-	TEST_ASSERT_EQUAL(1, nts_cnt.client_send);
-	TEST_ASSERT_EQUAL(3, peer.nts_state.count);
+	TEST_ASSERT_EQUAL(1, peer.cold->nts_state.readIdx);
+	TEST_ASSERT_EQUAL(1, nts_cnt_mine()->client_send);
+	TEST_ASSERT_EQUAL(3, peer.cold->nts_state.count);
 }
 
 TEST(nts_extens, extens_server_recv) {
@@ -225,7 +228,144 @@ TEST(nts_extens, extens_server_recv) {
 	/* TEST_ASSERT_EQUAL(true, ok); //disable */
 }
 
+TEST(nts_extens, gcm_siv_round_trip) {
+	struct peer peer;
+	struct peer_cold cold;
+	struct ntspacket_t ntspkt;
+	struct pkt request, reply;
+	struct nts_seal seal, *seals[1] = {&seal};
+	uint8_t *pkts[1] = {(uint8_t *)&reply};
+	uint8_t c2s[16], s2c[16];
+	int used;
+
+	memset(&peer, 0, sizeof(peer));
+	memset(&cold, 0, sizeof(cold));
+	memset(&ntspkt, 0, sizeof(ntspkt));
+	memset(&request, 0, sizeof(request));
+	memset(&reply, 0, sizeof(reply));
+	peer.cold = &cold;
+	for (int i = 0; i < 16; i++) {
+		c2s[i] = (uint8_t)(i + 1);
+		s2c[i] = (uint8_t)(0x80 + i);
+	}
+	nts_cookie_init();
+	if (0 == nts_nKeys)
+		nts_make_cookie_key();
+	cold.nts_state.aead = AEAD_AES_128_GCM_SIV;
+	cold.nts_state.keylen = AEAD_AES_128_GCM_SIV_KEYLEN;
+	memcpy(cold.nts_state.c2s, c2s, sizeof(c2s));
+	memcpy(cold.nts_state.s2c, s2c, sizeof(s2c));
+	cold.nts_state.cookielen = nts_make_cookie(cold.nts_state.cookies[0],
+		AEAD_AES_128_GCM_SIV, c2s, s2c, sizeof(c2s));
+	cold.nts_state.count = 1;
+	cold.nts_state.writeIdx = 1;
+
+	/* client asks with one cookie and seven placeholders */
+	used = extens_client_send(&peer, &request);
+	TEST_ASSERT_TRUE(extens_server_recv(&ntspkt, (uint8_t *)&request,
+					    LEN_PKT_NOMAC + used));
+	TEST_ASSERT_EQUAL(AEAD_AES_128_GCM_SIV, ntspkt.aead);
+	TEST_ASSERT_EQUAL(NTS_MAX_COOKIES, ntspkt.needed);
+
+	/* server answers with eight new cookies */
+	used = extens_server_send(&ntspkt, &reply, NULL);
+	TEST_ASSERT_TRUE(extens_client_recv(&peer, (uint8_t *)&reply,
+					    LEN_PKT_NOMAC + used));
+	TEST_ASSERT_EQUAL(NTS_MAX_COOKIES, cold.nts_state.count);
+
+	/* the same, sealed later as the responder threads do it */
+	cold.nts_state.count = 0;
+	used = extens_server_send(&ntspkt, &reply, &seal);
+	TEST_ASSERT_TRUE(seal.pending);
+	nts_seal_batch(pkts, seals, 1);
+	TEST_ASSERT_TRUE(extens_client_recv(&peer, (uint8_t *)&reply,
+					    LEN_PKT_NOMAC + used));
+
+	/* a damaged reply is refused */
+	cold.nts_state.count = 0;
+	used = extens_server_send(&ntspkt, &reply, NULL);
+	reply.exten[used - 1] ^= 1;
+	TEST_ASSERT_FALSE(extens_client_recv(&peer, (uint8_t *)&reply,
+					     LEN_PKT_NOMAC + used));
+	/* and so is a request with the wrong c2s */
+	cold.nts_state.c2s[0] ^= 1;
+	cold.nts_state.count = 1;
+	used = extens_client_send(&peer, &request);
+	TEST_ASSERT_FALSE(extens_server_recv(&ntspkt, (uint8_t *)&request,
+					     LEN_PKT_NOMAC + used));
+}
+
+TEST(nts_extens, cookie_replenish) {
+	struct peer peer;
+	struct peer_cold cold;
+	struct ntspacket_t ntspkt;
+	struct pkt request, reply;
+	uint8_t c2s[16], s2c[16];
+	int used;
+
+	memset(&peer, 0, sizeof(peer));
+	memset(&cold, 0, sizeof(cold));
+	memset(&ntspkt, 0, sizeof(ntspkt));
+	peer.cold = &cold;
+	for (int i = 0; i < 16; i++) {
+		c2s[i] = (uint8_t)(i + 1);
+		s2c[i] = (uint8_t)(0x80 + i);
+	}
+	nts_cookie_init();
+	if (0 == nts_nKeys)
+		nts_make_cookie_key();
+	cold.nts_state.aead = AEAD_AES_128_GCM_SIV;
+	cold.nts_state.keylen = AEAD_AES_128_GCM_SIV_KEYLEN;
+	memcpy(cold.nts_state.c2s, c2s, sizeof(c2s));
+	memcpy(cold.nts_state.s2c, s2c, sizeof(s2c));
+	for (int i = 0; i < NTS_MAX_COOKIES; i++)
+		cold.nts_state.cookielen = nts_make_cookie(
+			cold.nts_state.cookies[i], AEAD_AES_128_GCM_SIV,
+			c2s, s2c, sizeof(c2s));
+	cold.nts_state.count = NTS_MAX_COOKIES;
+	cold.nts_state.writeIdx = NTS_MAX_COOKIES;
+
+	/* five replies lost, then one answered */
+	for (int i = 0; i < 6; i++) {
+		memset(&request, 0, sizeof(request));
+		used = extens_client_send(&peer, &request);
+	}
+	TEST_ASSERT_EQUAL(NTS_MAX_COOKIES - 6, cold.nts_state.count);
+	TEST_ASSERT_TRUE(extens_server_recv(&ntspkt, (uint8_t *)&request,
+					    LEN_PKT_NOMAC + used));
+	TEST_ASSERT_EQUAL(6, ntspkt.needed);
+	memset(&reply, 0, sizeof(reply));
+	used = extens_server_send(&ntspkt, &reply, NULL);
+	TEST_ASSERT_TRUE(extens_client_recv(&peer, (uint8_t *)&reply,
+					    LEN_PKT_NOMAC + used));
+	TEST_ASSERT_EQUAL(NTS_MAX_COOKIES, cold.nts_state.count);
+	TEST_ASSERT_EQUAL(0, cold.nts_state.unanswered);
+	TEST_ASSERT_EQUAL_FLOAT(5.0, cold.nts_state.lossrun);
+
+	/* so the next request asks for enough to ride out twice that */
+	memset(&request, 0, sizeof(request));
+	used = extens_client_send(&peer, &request);
+	TEST_ASSERT_TRUE(extens_server_recv(&ntspkt, (uint8_t *)&request,
+					    LEN_PKT_NOMAC + used));
+	TEST_ASSERT_EQUAL(11 - (NTS_MAX_COOKIES - 1), ntspkt.needed);
+	memset(&reply, 0, sizeof(reply));
+	used = extens_server_send(&ntspkt, &reply, NULL);
+	TEST_ASSERT_TRUE(extens_client_recv(&peer, (uint8_t *)&reply,
+					    LEN_PKT_NOMAC + used));
+	TEST_ASSERT_EQUAL(11, cold.nts_state.count);
+
+	/* all spent in a long outage: no more than NTS_CLIENT_COOKIES */
+	cold.nts_state.lossrun = 100;
+	memset(&request, 0, sizeof(request));
+	used = extens_client_send(&peer, &request);
+	TEST_ASSERT_TRUE(extens_server_recv(&ntspkt, (uint8_t *)&request,
+					    LEN_PKT_NOMAC + used));
+	TEST_ASSERT_EQUAL(NTS_CLIENT_COOKIES - 10, ntspkt.needed);
+}
+
 TEST_GROUP_RUNNER(nts_extens) {
 	RUN_TEST_CASE(nts_extens, extens_client_send);
 	RUN_TEST_CASE(nts_extens, extens_server_recv);
+	RUN_TEST_CASE(nts_extens, gcm_siv_round_trip);
+	RUN_TEST_CASE(nts_extens, cookie_replenish);
 }
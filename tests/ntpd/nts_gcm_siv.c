@@ -0,0 +1,157 @@
+#include "config.h"
+#include "ntpd.h"
+#include "nts.h"
+#include "nts2.h"
+#include "unity.h"
+#include "unity_fixture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Test vectors are from RFC 8452, Appendix C.1 */
+
+static GCM_SIV_CTX *ctx;
+
+static const uint8_t key[16] = {1};
+static const uint8_t nonce[GCM_SIV_NONCE_LENGTH] = {3};
+
+TEST_GROUP(nts_gcm_siv);
+
+TEST_SETUP(nts_gcm_siv) {
+	ctx = gcm_siv_new();
+	TEST_ASSERT_NOT_NULL(ctx);
+}
+
+TEST_TEAR_DOWN(nts_gcm_siv) {
+	gcm_siv_free(ctx);
+}
+
+TEST(nts_gcm_siv, polyval) {
+	const uint8_t H[16] = {
+		0x25, 0x62, 0x93, 0x47, 0x58, 0x92, 0x42, 0x76,
+		0x1d, 0x31, 0xf8, 0x26, 0xba, 0x4b, 0x75, 0x7b};
+	const uint8_t X[32] = {
+		0x4f, 0x4f, 0x95, 0x66, 0x8c, 0x83, 0xdf, 0xb6,
+		0x40, 0x17, 0x62, 0xbb, 0x2d, 0x01, 0xa2, 0x62,
+		0xd1, 0xa2, 0x4d, 0xdd, 0x27, 0x21, 0xd0, 0x06,
+		0xbb, 0xe4, 0x5f, 0x20, 0xd3, 0xc9, 0xf3, 0x62};
+	const uint8_t expect[16] = {
+		0xf7, 0xa3, 0xb4, 0x7b, 0x84, 0x61, 0x19, 0xfa,
+		0xe5, 0xb7, 0x86, 0x6c, 0xf5, 0xe5, 0xb7, 0x7e};
+	uint8_t S[16];
+
+	/* Appendix A */
+	gcm_siv_polyval(S, H, X, 2, true);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(expect, S, sizeof(expect));
+	/* whatever this CPU uses, PCLMULQDQ or not */
+	gcm_siv_polyval(S, H, X, 2, false);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(expect, S, sizeof(expect));
+}
+
+TEST(nts_gcm_siv, polyval_agree) {
+	uint8_t H[16], X[16*64], S1[16], S2[16];
+
+	for (unsigned int i = 0; i < sizeof(H); i++)
+		H[i] = (uint8_t)(0xa5 ^ (i * 37));
+	for (unsigned int i = 0; i < sizeof(X); i++)
+		X[i] = (uint8_t)(i * 131 + (i >> 3));
+	gcm_siv_polyval(S1, H, X, 64, true);
+	gcm_siv_polyval(S2, H, X, 64, false);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(S1, S2, sizeof(S1));
+}
+
+TEST(nts_gcm_siv, encrypt_empty) {
+	const uint8_t expect[] = {
+		0xdc, 0x20, 0xe2, 0xd8, 0x3f, 0x25, 0x70, 0x5b,
+		0xb4, 0x9e, 0x43, 0x9e, 0xca, 0x56, 0xde, 0x25};
+	uint8_t out[sizeof(expect)];
+
+	TEST_ASSERT_TRUE(gcm_siv_encrypt(ctx, out, key, sizeof(key), nonce,
+					 NULL, 0, NULL, 0));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(expect, out, sizeof(expect));
+	TEST_ASSERT_TRUE(gcm_siv_decrypt(ctx, NULL, key, sizeof(key), nonce,
+					 out, sizeof(out), NULL, 0));
+}
+
+TEST(nts_gcm_siv, encrypt_text) {
+	const uint8_t plain[12] = {1};
+	const uint8_t expect8[] = {
+		0xb5, 0xd8, 0x39, 0x33, 0x0a, 0xc7, 0xb7, 0x86,
+		0x57, 0x87, 0x82, 0xff, 0xf6, 0x01, 0x3b, 0x81,
+		0x5b, 0x28, 0x7c, 0x22, 0x49, 0x3a, 0x36, 0x4c};
+	const uint8_t expect12[] = {
+		0x73, 0x23, 0xea, 0x61, 0xd0, 0x59, 0x32, 0x26,
+		0x00, 0x47, 0xd9, 0x42, 0xa4, 0x97, 0x8d, 0xb3,
+		0x57, 0x39, 0x1a, 0x0b, 0xc4, 0xfd, 0xec, 0x8b,
+		0x0d, 0x10, 0x66, 0x39};
+	uint8_t out[sizeof(expect12)], back[sizeof(plain)];
+
+	TEST_ASSERT_TRUE(gcm_siv_encrypt(ctx, out, key, sizeof(key), nonce,
+					 plain, 8, NULL, 0));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(expect8, out, sizeof(expect8));
+	TEST_ASSERT_TRUE(gcm_siv_encrypt(ctx, out, key, sizeof(key), nonce,
+					 plain, 12, NULL, 0));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(expect12, out, sizeof(expect12));
+	TEST_ASSERT_TRUE(gcm_siv_decrypt(ctx, back, key, sizeof(key), nonce,
+					 out, sizeof(out), NULL, 0));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(plain, back, sizeof(plain));
+}
+
+TEST(nts_gcm_siv, encrypt_ad) {
+	const uint8_t plain[12] = {2}, ad[1] = {1};
+	const uint8_t expect[] = {
+		0x1e, 0x6d, 0xab, 0xa3, 0x56, 0x69, 0xf4, 0x27,
+		0x3b, 0x0a, 0x1a, 0x25, 0x60, 0x96, 0x9c, 0xdf,
+		0x79, 0x0d, 0x99, 0x75, 0x9a, 0xbd, 0x15, 0x08};
+	uint8_t buf[sizeof(expect)];
+
+	/* in place */
+	memcpy(buf, plain, 8);
+	TEST_ASSERT_TRUE(gcm_siv_encrypt(ctx, buf, key, sizeof(key), nonce,
+					 buf, 8, ad, sizeof(ad)));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(expect, buf, sizeof(expect));
+	TEST_ASSERT_TRUE(gcm_siv_decrypt(ctx, buf, key, sizeof(key), nonce,
+					 buf, sizeof(buf), ad, sizeof(ad)));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(plain, buf, 8);
+}
+
+TEST(nts_gcm_siv, decrypt_bad) {
+	uint8_t plain[300], buf[sizeof(plain)+GCM_SIV_TAG_LENGTH];
+	uint8_t ad[100], back[sizeof(plain)];
+	const uint8_t zero[sizeof(plain)] = {0};
+
+	for (unsigned int i = 0; i < sizeof(plain); i++)
+		plain[i] = (uint8_t)i;
+	for (unsigned int i = 0; i < sizeof(ad); i++)
+		ad[i] = (uint8_t)(255 - i);
+	TEST_ASSERT_TRUE(gcm_siv_encrypt(ctx, buf, key, sizeof(key), nonce,
+					 plain, sizeof(plain), ad, sizeof(ad)));
+	TEST_ASSERT_TRUE(gcm_siv_decrypt(ctx, back, key, sizeof(key), nonce,
+					 buf, sizeof(buf), ad, sizeof(ad)));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(plain, back, sizeof(plain));
+	/* wrong AD */
+	ad[99] ^= 1;
+	TEST_ASSERT_FALSE(gcm_siv_decrypt(ctx, back, key, sizeof(key), nonce,
+					  buf, sizeof(buf), ad, sizeof(ad)));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(zero, back, sizeof(back));
+	ad[99] ^= 1;
+	/* damaged ciphertext */
+	buf[200] ^= 0x80;
+	TEST_ASSERT_FALSE(gcm_siv_decrypt(ctx, back, key, sizeof(key), nonce,
+					  buf, sizeof(buf), ad, sizeof(ad)));
+	buf[200] ^= 0x80;
+	/* too short for a tag, bad key length */
+	TEST_ASSERT_FALSE(gcm_siv_decrypt(ctx, back, key, sizeof(key), nonce,
+					  buf, GCM_SIV_TAG_LENGTH-1, NULL, 0));
+	TEST_ASSERT_FALSE(gcm_siv_encrypt(ctx, buf, key, 24, nonce,
+					  plain, 8, NULL, 0));
+}
+
+TEST_GROUP_RUNNER(nts_gcm_siv) {
+	RUN_TEST_CASE(nts_gcm_siv, polyval);
+	RUN_TEST_CASE(nts_gcm_siv, polyval_agree);
+	RUN_TEST_CASE(nts_gcm_siv, encrypt_empty);
+	RUN_TEST_CASE(nts_gcm_siv, encrypt_text);
+	RUN_TEST_CASE(nts_gcm_siv, encrypt_ad);
+	RUN_TEST_CASE(nts_gcm_siv, decrypt_bad);
+}
@@ -9,9 +9,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-/* Hack to keep linker happy */
-uint16_t extra_port = 0;
-
 TEST_GROUP(nts_server);
 
 TEST_SETUP(nts_server) {}
@@ -105,6 +102,41 @@ TEST(nts_server, nts_ke_process_receive) {
 	TEST_ASSERT_EQUAL(false, success);
 }
 
+TEST(nts_server, nts_ke_rate_limited) {
+	struct timespec now = {.tv_sec = 1000, .tv_nsec = 0};
+	sockaddr_u a, b, c;
+	int saved = ntsconfig.kelimit;
+	int i;
+
+	ZERO(a);
+	AF(&a) = AF_INET6;
+	SET_ADDR6N(&a, in6addr_loopback);
+	PSOCK_ADDR6(&a)->s6_addr[0] = 0x20;
+	b = a;
+	PSOCK_ADDR6(&b)->s6_addr[15] = 0x99;	/* same /64 */
+	ZERO(c);
+	AF(&c) = AF_INET;
+	PSOCK_ADDR4(&c)->s_addr = htonl(0xc0000201);
+
+	ntsconfig.kelimit = 0;
+	for (i = 0; i < 100; i++)
+		TEST_ASSERT_FALSE(nts_ke_rate_limited(&a, now));
+
+	/* a burst from one /64 gets cut off, others don't notice */
+	ntsconfig.kelimit = 10;
+	for (i = 0; i < 10; i++)
+		TEST_ASSERT_FALSE(nts_ke_rate_limited(&a, now));
+	TEST_ASSERT_TRUE(nts_ke_rate_limited(&b, now));
+	TEST_ASSERT_FALSE(nts_ke_rate_limited(&c, now));
+
+	/* and lets it back in once it slows down */
+	now.tv_sec += 600;
+	TEST_ASSERT_FALSE(nts_ke_rate_limited(&a, now));
+
+	ntsconfig.kelimit = saved;
+}
+
 TEST_GROUP_RUNNER(nts_server) {
 	RUN_TEST_CASE(nts_server, nts_ke_process_receive);
+	RUN_TEST_CASE(nts_server, nts_ke_rate_limited);
 }
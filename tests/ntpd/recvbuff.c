@@ -4,6 +4,7 @@
 #include "unity.h"
 #include "unity_fixture.h"
 #include "recvbuff.h"
+#include "nts.h"
 
 
 TEST_GROUP(recvbuff);
@@ -28,7 +29,60 @@ TEST(recvbuff, GetAndFree) {
 	TEST_ASSERT_EQUAL(initial, free_recvbuffs());
 }
 
+TEST(recvbuff, Layout) {
+	/* what every packet touches fits in a cache line */
+	TEST_ASSERT_TRUE(offsetof(recvbuf_t, fd) + sizeof(SOCKET) <=
+			 (8 == sizeof(void *) ? 64 : 48));
+	TEST_ASSERT_TRUE(offsetof(recvbuf_t, recv_buffer) >
+			 offsetof(recvbuf_t, pkt));
+}
+
+TEST(recvbuff, Grow) {
+	recvbuf_t *taken[2 * RECV_TOOMANY];
+	recvbuf_t *buf;
+	unsigned long adds = lowater_additions();
+	unsigned long before;
+	int n = 0, got;
+
+	while (n < (int)COUNTOF(taken) &&
+	       NULL != (buf = get_free_recv_buffer()))
+		taken[n++] = buf;
+	TEST_ASSERT_TRUE(n < (int)COUNTOF(taken));
+	TEST_ASSERT_EQUAL(RECV_TOOMANY, total_recvbuffs());
+	TEST_ASSERT_NULL(get_free_recv_buffer());
+	TEST_ASSERT_TRUE(lowater_additions() > adds);
+	before = free_recvbuffs();
+	got = n;
+	while (n > 0)
+		freerecvbuf(taken[--n]);
+	TEST_ASSERT_EQUAL(before + (unsigned long)got, free_recvbuffs());
+}
+
+TEST(recvbuff, NTSState) {
+	recvbuf_t *buf = get_free_recv_buffer();
+	struct ntspacket_t *nts;
+
+	TEST_ASSERT_NULL(buf->ntspacket);
+	nts = get_recv_ntspacket(buf);
+	TEST_ASSERT_NOT_NULL(nts);
+	TEST_ASSERT_FALSE(nts->valid);
+	TEST_ASSERT_EQUAL_PTR(nts, get_recv_ntspacket(buf));
+	nts->valid = true;
+	freerecvbuf(buf);
+	TEST_ASSERT_NULL(buf->ntspacket);
+
+	/* the slot comes back clean */
+	buf = get_free_recv_buffer();
+	TEST_ASSERT_NULL(buf->ntspacket);
+	TEST_ASSERT_EQUAL_PTR(nts, get_recv_ntspacket(buf));
+	TEST_ASSERT_FALSE(nts->valid);
+	freerecvbuf(buf);
+}
+
 TEST_GROUP_RUNNER(recvbuff) {
 	RUN_TEST_CASE(recvbuff, Initialization);
 	RUN_TEST_CASE(recvbuff, GetAndFree);
+	RUN_TEST_CASE(recvbuff, Layout);
+	RUN_TEST_CASE(recvbuff, Grow);
+	RUN_TEST_CASE(recvbuff, NTSState);
 }
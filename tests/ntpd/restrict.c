@@ -1,11 +1,20 @@
 #include "config.h"
 
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "ntpd.h"
+#include "ntp_config.h"
 #include "ntp_lists.h"
 
 #include "unity.h"
 #include "unity_fixture.h"
 
+/* Not in a header, for the tests */
+extern const char *config_path;
+
 /* Helper functions */
 
 static sockaddr_u
@@ -21,25 +30,34 @@ create_sockaddr_u(unsigned short sin_port, const char* ip_addr)
 	return sockaddr;
 }
 
+static sockaddr_u
+create_sockaddr6_u(unsigned short sin_port, const char* ip_addr)
+{
+	sockaddr_u sockaddr;
+
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	SET_AF(&sockaddr, AF_INET6);
+	NSRCPORT(&sockaddr) = htons(sin_port);
+	inet_pton(AF_INET6, ip_addr, PSOCK_ADDR6(&sockaddr));
+
+	return sockaddr;
+}
+
 TEST_GROUP(hackrestrict);
 
 TEST_SETUP(hackrestrict) {
 	init_restrict();
 }
 
-uptime_t	current_time;	/* not used - restruct code needs it */
-
 TEST_TEAR_DOWN(hackrestrict) {
-	restrict_u *empty_restrict = malloc(sizeof(restrict_u));
-	memset(empty_restrict, 0, sizeof(restrict_u));
-
 	restrict_u *current;
 
+	/* IPv4 entries are allocated short, without room for IPv6 */
 	do {
 		UNLINK_HEAD_SLIST(current, rstrct.restrictlist4, link);
 		if (current != NULL)
 		{
-			*current = *empty_restrict;
+			memset(current, 0, V4_SIZEOF_RESTRICT_U);
 		}
 	} while (current != NULL);
 
@@ -47,11 +65,9 @@ TEST_TEAR_DOWN(hackrestrict) {
 		UNLINK_HEAD_SLIST(current, rstrct.restrictlist6, link);
 		if (current != NULL)
 		{
-			*current = *empty_restrict;
+			memset(current, 0, V6_SIZEOF_RESTRICT_U);
 		}
 	} while (current != NULL);
-
-	free(empty_restrict);
 }
 
 /* Tests */
@@ -184,6 +200,302 @@ TEST(hackrestrict, RestrictUnflagWorks) {
 	TEST_ASSERT_EQUAL(1, restrictions(&resaddr));
 }
 
+TEST(hackrestrict, NestedPrefixesLongestWins) {
+	sockaddr_u target = create_sockaddr_u(54321, "10.1.2.3");
+	sockaddr_u sibling = create_sockaddr_u(54321, "10.1.3.3");
+	sockaddr_u outside = create_sockaddr_u(54321, "10.2.0.1");
+	char mask[16];
+
+	/* added widest last, so list order can't hide a bad match */
+	for (int plen = 32; plen >= 8; plen -= 8) {
+		uint32_t m = htonl(~0U << (32 - plen));
+		sockaddr_u resmask;
+
+		inet_ntop(AF_INET, &m, mask, sizeof(mask));
+		resmask = create_sockaddr_u(54321, mask);
+		hack_restrict(RESTRICT_FLAGS, &target, &resmask, 0,
+			      (unsigned short)plen);
+	}
+
+	TEST_ASSERT_EQUAL(32, restrictions(&target));
+	TEST_ASSERT_EQUAL(16, restrictions(&sibling));
+	TEST_ASSERT_EQUAL(8, restrictions(&outside));
+}
+
+
+TEST(hackrestrict, NtpOnlyNeedsNtpPort) {
+	sockaddr_u resaddr = create_sockaddr_u(54321, "10.0.0.0");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.0.0.0");
+	sockaddr_u fromport = create_sockaddr_u(54321, "10.1.2.3");
+	sockaddr_u fromntp = create_sockaddr_u(NTP_PORT, "10.1.2.3");
+
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 8);
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, RESM_NTPONLY, 16);
+
+	TEST_ASSERT_EQUAL(8, restrictions(&fromport));
+	TEST_ASSERT_EQUAL(16, restrictions(&fromntp));
+}
+
+
+TEST(hackrestrict, CachedMatchFollowsChanges) {
+	sockaddr_u resaddr = create_sockaddr_u(54321, "10.0.0.0");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.0.0.0");
+	sockaddr_u hostmask = create_sockaddr_u(54321, "255.255.255.255");
+	sockaddr_u fromport = create_sockaddr_u(54321, "10.1.2.3");
+	sockaddr_u fromntp = create_sockaddr_u(NTP_PORT, "10.1.2.3");
+	mon_entry mon;
+
+	ZERO(mon);
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 8);
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, RESM_NTPONLY, 16);
+
+	TEST_ASSERT_EQUAL(8, restrictions_cached(&fromport, &mon));
+	TEST_ASSERT_EQUAL(8, restrictions_cached(&fromport, &mon));
+	/* the port is part of the match */
+	TEST_ASSERT_EQUAL(16, restrictions_cached(&fromntp, &mon));
+	TEST_ASSERT_EQUAL(8, restrictions_cached(&fromport, &mon));
+
+	/* a more specific entry takes over at once */
+	hack_restrict(RESTRICT_FLAGS, &fromport, &hostmask, 0, 32);
+	TEST_ASSERT_EQUAL(32, restrictions_cached(&fromport, &mon));
+	hack_restrict(RESTRICT_REMOVE, &fromport, &hostmask, 0, 0);
+	TEST_ASSERT_EQUAL(8, restrictions_cached(&fromport, &mon));
+}
+
+
+static void *
+restrictions_thread(void *arg)
+{
+	static int flags;
+
+	flags = restrictions(arg);
+	return &flags;
+}
+
+static int
+restrictions_elsewhere(sockaddr_u *srcadr)
+{
+	pthread_t thread;
+	void *flags;
+
+	TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL,
+					    restrictions_thread, srcadr));
+	TEST_ASSERT_EQUAL(0, pthread_join(thread, &flags));
+	return *(int *)flags;
+}
+
+/* other threads see a change once it is published, and count hits */
+TEST(hackrestrict, OtherThreadsSeePublished) {
+	sockaddr_u resaddr = create_sockaddr_u(54321, "10.0.0.0");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.0.0.0");
+	sockaddr_u hostmask = create_sockaddr_u(54321, "255.255.255.255");
+	sockaddr_u from = create_sockaddr_u(54321, "10.1.2.3");
+	restrict_u *res;
+
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 8);
+	restrict_publish();
+	TEST_ASSERT_EQUAL(8, restrictions_elsewhere(&from));
+
+	hack_restrict(RESTRICT_FLAGS, &from, &hostmask, 0, 32);
+	TEST_ASSERT_EQUAL(8, restrictions_elsewhere(&from));
+	TEST_ASSERT_EQUAL(32, restrictions(&from));
+	TEST_ASSERT_EQUAL(32, restrictions_elsewhere(&from));
+
+	for (res = rstrct.restrictlist4; res != NULL; res = res->link)
+		if (SRCADR(&from) == res->u.v4.addr)
+			break;
+	TEST_ASSERT_NOT_NULL(res);
+	TEST_ASSERT_EQUAL(2, res->hitcount);
+}
+
+
+TEST(hackrestrict, OddMaskStillMatches) {
+	sockaddr_u resaddr = create_sockaddr_u(54321, "10.0.3.0");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.0.255.0");
+	sockaddr_u inside = create_sockaddr_u(54321, "10.99.3.7");
+	sockaddr_u outside = create_sockaddr_u(54321, "10.99.4.7");
+
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 42);
+
+	TEST_ASSERT_EQUAL(42, restrictions(&inside));
+	TEST_ASSERT_EQUAL(RES_Default, restrictions(&outside));
+}
+
+
+TEST(hackrestrict, Ipv6PrefixMatch) {
+	sockaddr_u resaddr = create_sockaddr6_u(54321, "2001:db8::");
+	sockaddr_u resmask = create_sockaddr6_u(54321, "ffff:ffff::");
+	sockaddr_u hostaddr = create_sockaddr6_u(54321, "2001:db8:1::5");
+	sockaddr_u hostmask = create_sockaddr6_u(54321,
+	    "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff");
+	sockaddr_u inside = create_sockaddr6_u(54321, "2001:db8:2::1");
+	sockaddr_u outside = create_sockaddr6_u(54321, "2001:db9::1");
+
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 42);
+	hack_restrict(RESTRICT_FLAGS, &hostaddr, &hostmask, 0, 7);
+
+	TEST_ASSERT_EQUAL(42, restrictions(&inside));
+	TEST_ASSERT_EQUAL(7, restrictions(&hostaddr));
+	TEST_ASSERT_EQUAL(RES_Default, restrictions(&outside));
+
+	hack_restrict(RESTRICT_REMOVE, &hostaddr, &hostmask, 0, 0);
+	TEST_ASSERT_EQUAL(42, restrictions(&hostaddr));
+}
+
+
+TEST(hackrestrict, ManyEntriesMergeAndSort) {
+	const int count = 1000;
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.255.255.0");
+	sockaddr_u resaddr;
+	restrict_u *res;
+	uint32_t addr;
+	int n;
+
+	/* scattered, each one twice with different flags */
+	for (int pass = 0; pass < 2; pass++)
+		for (int i = 0; i < count; i++) {
+			addr = htonl(0x0a000000U |
+				     (uint32_t)((i * 7919) % count) << 8);
+			resaddr = create_sockaddr_u(54321, "0.0.0.0");
+			PSOCK_ADDR4(&resaddr)->s_addr = addr;
+			hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0,
+				      pass ? RES_KOD : RES_NOQUERY);
+		}
+
+	/* lookups sort the list first */
+	resaddr = create_sockaddr_u(54321, "10.0.1.1");
+	TEST_ASSERT_EQUAL(RES_KOD|RES_NOQUERY, restrictions(&resaddr));
+	resaddr = create_sockaddr_u(54321, "10.4.0.1");
+	TEST_ASSERT_EQUAL(RES_Default, restrictions(&resaddr));
+
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, RES_KOD);
+	sort_restrict();
+	n = 0;
+	for (res = rstrct.restrictlist4; res->link != NULL; res = res->link) {
+		TEST_ASSERT_TRUE(res->u.v4.addr > res->link->u.v4.addr);
+		n++;
+	}
+	TEST_ASSERT_EQUAL(count + 1, n);
+}
+
+
+TEST(hackrestrict, RestrictSetFromFile) {
+	char path[] = "/tmp/restrict-set.XXXXXX";
+	sockaddr_u resaddr = create_sockaddr_u(54321, "192.0.2.0");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.255.255.0");
+	sockaddr_u listed = create_sockaddr_u(54321, "192.0.2.77");
+	sockaddr_u merged = create_sockaddr_u(54321, "198.51.101.200");
+	sockaddr_u host = create_sockaddr_u(54321, "203.0.113.9");
+	sockaddr_u outside = create_sockaddr_u(54321, "203.0.113.10");
+	sockaddr_u inside6 = create_sockaddr6_u(54321, "2001:db8:ffff::1");
+	sockaddr_u outside6 = create_sockaddr6_u(54321, "2001:db9::1");
+	const char *setpath;
+	unsigned long prefixes;
+	uint64_t hits;
+	unsigned short flags;
+	mon_entry mon;
+	FILE *fp;
+	int fd;
+
+	fd = mkstemp(path);
+	TEST_ASSERT_TRUE(fd >= 0);
+	fp = fdopen(fd, "w");
+	fputs("# abuse feed\n"
+	      "192.0.2.0/24\n"
+	      "  198.51.100.0/24   # touches the next one\n"
+	      "198.51.101.0/24\n"
+	      "198.51.100.128/25\n"
+	      "203.0.113.9\n"
+	      "not-a-prefix\n"
+	      "10.0.0.0/33\n"
+	      "\n"
+	      "2001:db8::/32\n", fp);
+	fclose(fp);
+
+	ZERO(mon);
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, RES_KOD);
+	restrict_set(path, RES_NOSERVE);
+
+	TEST_ASSERT_TRUE(restrict_set_info(&setpath, &prefixes, &hits,
+					   &flags));
+	TEST_ASSERT_EQUAL_STRING(path, setpath);
+	TEST_ASSERT_EQUAL(6, prefixes);
+	TEST_ASSERT_EQUAL(RES_NOSERVE, flags);
+
+	/* the set's flags go on top of the list entry's */
+	TEST_ASSERT_EQUAL(RES_KOD|RES_NOSERVE, restrictions(&listed));
+	TEST_ASSERT_EQUAL(RES_Default|RES_NOSERVE, restrictions(&merged));
+	TEST_ASSERT_EQUAL(RES_Default|RES_NOSERVE, restrictions(&host));
+	TEST_ASSERT_EQUAL(RES_Default, restrictions(&outside));
+	TEST_ASSERT_EQUAL(RES_Default|RES_NOSERVE, restrictions(&inside6));
+	TEST_ASSERT_EQUAL(RES_Default, restrictions(&outside6));
+	TEST_ASSERT_EQUAL(RES_Default|RES_NOSERVE,
+			  restrictions_cached(&host, &mon));
+	TEST_ASSERT_TRUE(restrict_set_info(&setpath, &prefixes, &hits,
+					   &flags));
+	TEST_ASSERT_EQUAL(5, hits);
+
+	/* a new file replaces the set, and cached matches see it */
+	fp = fopen(path, "w");
+	fputs("203.0.113.8/29\n", fp);
+	fclose(fp);
+	restrict_set(path, RES_NOTRUST);
+	TEST_ASSERT_EQUAL(RES_Default|RES_NOTRUST,
+			  restrictions_cached(&host, &mon));
+	TEST_ASSERT_EQUAL(RES_KOD, restrictions(&listed));
+
+	restrict_set(NULL, 0);
+	TEST_ASSERT_FALSE(restrict_set_info(&setpath, &prefixes, &hits,
+					    &flags));
+	TEST_ASSERT_EQUAL(RES_Default, restrictions_cached(&host, &mon));
+	unlink(path);
+}
+
+TEST(hackrestrict, ReloadWithSyntaxErrorChangesNothing) {
+	char dir[] = "/tmp/restrict-reload.XXXXXX";
+	char path[sizeof(dir) + 16];
+	sockaddr_u kept = create_sockaddr_u(54321, "192.0.2.1");
+	sockaddr_u added = create_sockaddr_u(54321, "198.51.100.1");
+	unsigned short keptflags, addedflags;
+	FILE *fp;
+
+	TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+	snprintf(path, sizeof(path), "%s/ntp.conf", dir);
+	config_path = path;
+
+	fp = fopen(path, "w");
+	fputs("restrict 192.0.2.0 mask 255.255.255.0 nomodify\n", fp);
+	fclose(fp);
+	reload_config();
+	keptflags = restrictions(&kept);
+	addedflags = restrictions(&added);
+	TEST_ASSERT_TRUE(keptflags & RES_NOMODIFY);
+	TEST_ASSERT_FALSE(addedflags & RES_NOTRUST);
+
+	/* the good line would drop 192.0.2.0/24, but the file is bad */
+	fp = fopen(path, "w");
+	fputs("restrict 198.51.100.0 mask 255.255.255.0 notrust\n", fp);
+	fputs("restrict 203.0.113.0 mask 255.255.255.0 frobnicate\n", fp);
+	fclose(fp);
+	parsing_errors = 0;
+	reload_config();
+	TEST_ASSERT_EQUAL(0, parsing_errors);
+	TEST_ASSERT_EQUAL(keptflags, restrictions(&kept));
+	TEST_ASSERT_EQUAL(addedflags, restrictions(&added));
+
+	/* and once it is fixed, the reload goes through */
+	fp = fopen(path, "w");
+	fputs("restrict 198.51.100.0 mask 255.255.255.0 notrust\n", fp);
+	fclose(fp);
+	reload_config();
+	TEST_ASSERT_FALSE(restrictions(&kept) & RES_NOMODIFY);
+	TEST_ASSERT_TRUE(restrictions(&added) & RES_NOTRUST);
+
+	config_path = NULL;
+	unlink(path);
+	rmdir(dir);
+}
+
 TEST_GROUP_RUNNER(hackrestrict) {
 	RUN_TEST_CASE(hackrestrict, RestrictionsAreEmptyAfterInit);
 	RUN_TEST_CASE(hackrestrict, ReturnsCorrectDefaultRestrictions);
@@ -193,4 +505,13 @@ TEST_GROUP_RUNNER(hackrestrict) {
 	RUN_TEST_CASE(hackrestrict, TheMostFittingRestrictionIsMatched);
 	RUN_TEST_CASE(hackrestrict, DeletedRestrictionIsNotMatched);
 	RUN_TEST_CASE(hackrestrict, RestrictUnflagWorks);
+	RUN_TEST_CASE(hackrestrict, NestedPrefixesLongestWins);
+	RUN_TEST_CASE(hackrestrict, NtpOnlyNeedsNtpPort);
+	RUN_TEST_CASE(hackrestrict, CachedMatchFollowsChanges);
+	RUN_TEST_CASE(hackrestrict, OtherThreadsSeePublished);
+	RUN_TEST_CASE(hackrestrict, OddMaskStillMatches);
+	RUN_TEST_CASE(hackrestrict, Ipv6PrefixMatch);
+	RUN_TEST_CASE(hackrestrict, ManyEntriesMergeAndSort);
+	RUN_TEST_CASE(hackrestrict, RestrictSetFromFile);
+	RUN_TEST_CASE(hackrestrict, ReloadWithSyntaxErrorChangesNothing);
 }
@@ -0,0 +1,213 @@
+#include "config.h"
+
+#include <math.h>
+
+#include "ntpd.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*
+ * Hold the sorted-endpoint interval algorithm and the incremental
+ * cluster algorithm up against the straightforward versions they
+ * replaced in clock_select().
+ */
+
+#define NPEERS	40
+#define ROUNDS	300
+
+static struct peer	pool[NPEERS];
+static peer_select	cand[NPEERS];
+static peer_select	ref[NPEERS];
+static struct endpoint	ep[2 * NPEERS];
+static struct endpoint	tmp[2 * NPEERS];
+static double		sum[NPEERS];
+static uint32_t		seed;
+
+/* a small LCG, so every run sees the same candidates */
+static double
+uniform(double lo, double hi)
+{
+	seed = seed * 1664525 + 1013904223;
+	return lo + (hi - lo) * (seed >> 8) / (double)(1 << 24);
+}
+
+/* the old clock_select(): unsorted list, selection sort, allow loop */
+static void
+ref_intersect(const peer_select *peers, int nlist, double *lowp,
+	      double *highp)
+{
+	struct endpoint endpoint[2 * NPEERS];
+	int	indx[2 * NPEERS];
+	int	nl2 = 0, allow, i, j, k, n;
+	double	e, low = 1e9, high = -1e9;
+
+	for (i = 0; i < nlist; i++) {
+		endpoint[nl2].type = -1;
+		endpoint[nl2++].val = peers[i].peer->offset - peers[i].synch;
+		endpoint[nl2].type = 1;
+		endpoint[nl2++].val = peers[i].peer->offset + peers[i].synch;
+	}
+	for (i = 0; i < nl2; i++)
+		indx[i] = i;
+	for (i = 0; i < nl2; i++) {
+		e = endpoint[indx[i]].val;
+		k = i;
+		for (j = i + 1; j < nl2; j++) {
+			if (endpoint[indx[j]].val < e) {
+				e = endpoint[indx[j]].val;
+				k = j;
+			}
+		}
+		j = indx[k];
+		indx[k] = indx[i];
+		indx[i] = j;
+	}
+	for (allow = 0; 2 * allow < nlist; allow++) {
+		n = 0;
+		for (i = 0; i < nl2; i++) {
+			low = endpoint[indx[i]].val;
+			n -= endpoint[indx[i]].type;
+			if (n >= nlist - allow)
+				break;
+		}
+		n = 0;
+		for (j = nl2 - 1; j >= 0; j--) {
+			high = endpoint[indx[j]].val;
+			n += endpoint[indx[j]].type;
+			if (n >= nlist - allow)
+				break;
+		}
+		if (high > low)
+			break;
+	}
+	*lowp = low;
+	*highp = high;
+}
+
+/* the old cluster loop, summing afresh each round */
+static int
+ref_cluster(peer_select *peers, int nlist, int minclock)
+{
+	int	i, j, k;
+	double	d, e, f, g;
+
+	while (1) {
+		d = 1e9;
+		e = -1e9;
+		g = 0;
+		k = 0;
+		for (i = 0; i < nlist; i++) {
+			if (peers[i].error < d)
+				d = peers[i].error;
+			peers[i].seljit = 0;
+			if (nlist > 1) {
+				f = 0;
+				for (j = 0; j < nlist; j++)
+					f += SQUARE(peers[j].peer->offset -
+						    peers[i].peer->offset);
+				peers[i].seljit = SQRT(f / (nlist - 1));
+			}
+			if (peers[i].seljit * peers[i].synch > e) {
+				g = peers[i].seljit;
+				e = peers[i].seljit * peers[i].synch;
+				k = i;
+			}
+		}
+		if (nlist <= max(1, minclock) || g <= d)
+			break;
+		for (j = k + 1; j < nlist; j++)
+			peers[j - 1] = peers[j];
+		nlist--;
+	}
+	return nlist;
+}
+
+/* pick a random subset of the pool as this round's candidates */
+static int
+make_candidates(void)
+{
+	int	nlist = 0;
+
+	for (int i = 0; i < NPEERS; i++) {
+		if (uniform(0, 1) < 0.2)
+			continue;
+		cand[nlist].peer = &pool[i];
+		cand[nlist].synch = uniform(.001, .02);
+		cand[nlist].error = uniform(0, .002);
+		nlist++;
+	}
+	return nlist;
+}
+
+TEST_GROUP(select);
+
+TEST_SETUP(select) {
+	seed = 1;
+	memset(pool, 0, sizeof(pool));
+	for (int i = 0; i < NPEERS; i++) {
+		pool[i].offset = uniform(-.01, .01);
+		if (i % 7 == 0)		/* falseticker */
+			pool[i].offset += uniform(.2, .5);
+	}
+}
+
+TEST_TEAR_DOWN(select) {}
+
+
+TEST(select, Intersect) {
+	struct peer p[3];
+	peer_select s[3];
+	double	low, high;
+
+	memset(p, 0, sizeof(p));
+	p[0].offset = 0;
+	p[1].offset = .002;
+	p[2].offset = 1;		/* well away from the others */
+	for (int i = 0; i < 3; i++) {
+		s[i].peer = &p[i];
+		s[i].synch = .005;
+	}
+
+	select_endpoints(s, 3, ep, tmp);
+	for (int i = 1; i < 6; i++)
+		TEST_ASSERT_TRUE(ep[i - 1].val <= ep[i].val);
+	select_intersect(ep, 3, &low, &high);
+	TEST_ASSERT_EQUAL_DOUBLE(-.003, low);
+	TEST_ASSERT_EQUAL_DOUBLE(.005, high);
+}
+
+TEST(select, MatchesReference) {
+	for (int round = 0; round < ROUNDS; round++) {
+		int	nlist = make_candidates();
+		int	nref, nnew;
+		double	low, high, rlow, rhigh;
+
+		select_endpoints(cand, nlist, ep, tmp);
+		for (int i = 1; i < 2 * nlist; i++)
+			TEST_ASSERT_TRUE(ep[i - 1].val <= ep[i].val);
+		select_intersect(ep, nlist, &low, &high);
+		ref_intersect(cand, nlist, &rlow, &rhigh);
+		TEST_ASSERT_EQUAL_DOUBLE(rlow, low);
+		TEST_ASSERT_EQUAL_DOUBLE(rhigh, high);
+
+		memcpy(ref, cand, sizeof(ref));
+		nref = ref_cluster(ref, nlist, 3);
+		nnew = select_cluster(cand, nlist, 3, 10, sum);
+		TEST_ASSERT_EQUAL_INT(nref, nnew);
+		for (int i = 0; i < nnew; i++) {
+			TEST_ASSERT_EQUAL_PTR(ref[i].peer, cand[i].peer);
+			TEST_ASSERT_DOUBLE_WITHIN(1e-12, ref[i].seljit,
+						  cand[i].seljit);
+		}
+
+		/* drift a little before the next call */
+		for (int i = 0; i < NPEERS; i++)
+			pool[i].offset += uniform(-1e-4, 1e-4);
+	}
+}
+
+TEST_GROUP_RUNNER(select) {
+	RUN_TEST_CASE(select, Intersect);
+	RUN_TEST_CASE(select, MatchesReference);
+}
@@ -144,6 +144,42 @@ class TestMIBControl(unittest.TestCase):
                           (AP.OID((0, 2, 3)), 40, 41),
                           (AP.OID((0, 4, 1, 0)), 50, 51)])
 
+    def test_treeCache(self):
+        calls = []
+
+        def dynamic():
+            calls.append(1)
+            return {1: {"reader": 60}, 2: {"reader": 70}}
+        c = AX.MIBControl(treeCacheTTL=60)
+        c.addNode((0, 1))
+        c.addNode((0, 2, 0), 10, 11)
+        c.addNode((0, 2, 1), 20, 21)
+        c.addNode((0, 3), dynamic=dynamic)
+        # Same answers as a fresh walk
+        self.assertEqual(c.getOID(AP.OID((0, 1))), (None, None, None))
+        self.assertEqual(c.getOID(AP.OID((0, 2, 1))),
+                         (AP.OID((0, 2, 1)), 20, 21))
+        self.assertEqual(c.getNextOID(AP.OID((0, 1))),
+                         (AP.OID((0, 2, 0)), 10, 11))
+        self.assertEqual(c.getNextOID(AP.OID((0, 2, 1))),
+                         (AP.OID((0, 3, 1)), 60, None))
+        self.assertEqual(c.getNextOID(AP.OID((0, 3, 2))),
+                         (None, None, None))
+        rng = AP.SearchRange((0, 2, 0), (0, 3, 2))
+        self.assertEqual(c.getOIDsInRange(rng),
+                         [(AP.OID((0, 2, 1)), 20, 21),
+                          (AP.OID((0, 3, 1)), 60, None)])
+        rng = AP.SearchRange(AP.OID((0, 2, 0), True), ())
+        self.assertEqual(c.getOIDsInRange(rng, True),
+                         [(AP.OID((0, 2, 0)), 10, 11)])
+        # The dynamic subtree was only generated once
+        self.assertEqual(len(calls), 1)
+        # A new node needs a new walk
+        c.addNode((0, 2, 2), 30, 31)
+        self.assertEqual(c.getNextOID(AP.OID((0, 2, 1))),
+                         (AP.OID((0, 2, 2)), 30, 31))
+        self.assertEqual(len(calls), 2)
+
 
 class TestPacketControl(unittest.TestCase):
     def test___init__(self):
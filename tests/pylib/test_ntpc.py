@@ -3,6 +3,7 @@
 #
 # SPDX-License-Identifier: BSD-2-Clause
 
+import math
 import unittest
 import ntp.ntpc
 import ntp.poly
@@ -33,6 +34,42 @@ class TestPylibNtpc(unittest.TestCase):
             self.assertEqual(ntp.ntpc.prettydate(in_string), to_string)
             self.assertAlmostEqual(ntp.ntpc.lfptofloat(in_string), to_float)
 
+    def test_varlist(self):
+        self.assertEqual(
+            ntp.ntpc.varlist(b'a=1, b = 0x1f,c="x,y",\r\nd=-1.5e3,'
+                             b'last.2=0xe9a0c0b1.12345678,\x00,e=0_1,'
+                             b'addr.2=10.0.0.1:123'),
+            [("a", "1", "i"), ("b", "0x1f", "i"), ("c", '"x,y"', "s"),
+             ("d", "-1.5e3", "f"), ("last.2", "0xe9a0c0b1.12345678", "s"),
+             ("", "", "s"), ("e", "0_1", "?"),
+             ("addr.2", "10.0.0.1:123", "s")])
+        self.assertEqual(ntp.ntpc.varlist(b""), [])
+
+    def test_lfptofloats(self):
+        stamps = ["0xcfba1ce0.80000000", "0xE4D1C3A0.8E3C0001"]
+        floats = ntp.ntpc.lfptofloats(" ,".join(stamps) +
+                                      " cfba1ce080000000\n0x1234")
+        self.assertEqual(len(floats), 4)
+        for (i, in_string) in enumerate(stamps):
+            self.assertEqual(floats[i], ntp.ntpc.lfptofloat(in_string))
+        # 0x and the dot can go
+        self.assertEqual(floats[2], floats[0])
+        self.assertTrue(math.isnan(floats[3]))
+        self.assertEqual(len(ntp.ntpc.lfptofloats("")), 0)
+
+    def test_mjdtounix(self):
+        lines = ["60000 3600.5 1 2\n", "40587 .125\n",
+                 "heeeey duuuude!\n", "\n", "59999 86399.999999"]
+        times = ntp.ntpc.mjdtounix("".join(lines))
+        self.assertEqual(len(times), len(lines))
+        # bit for bit what statfiles.py worked out in Python
+        self.assertEqual(times[0], 86400 * 60000 + 3600.5 - 3506716800)
+        self.assertEqual(times[1], 0.125)
+        self.assertTrue(math.isnan(times[2]))
+        self.assertTrue(math.isnan(times[3]))
+        self.assertEqual(times[4],
+                         86400 * 59999 + 86399.999999 - 3506716800)
+
     def test_nul_trunc16b(self):
         k_type = "aes-128"
         key = ntp.util.hexstr2octets(
@@ -10,6 +10,7 @@ from collections import OrderedDict as odict
 import getpass
 import select
 import socket
+import struct
 import sys
 import unittest
 import jigs
@@ -152,6 +153,18 @@ class TestPacket(unittest.TestCase):
                          {"mincount": 50, "resall": 1, "resany": 1061,
                           "maxlstint": 100, "laddr": "foo.test",
                           "recent": "foo", "limit": 80})
+        # Test top, shown by what it was picked by
+        data = {"top": 20, "by": "drop"}
+        sorter, sortkey, frags = f(data)
+        self.assertEqual(sortkey, "-drop")
+        self.assertEqual(data, {"top": 20, "by": "drop"})
+        data = {"top": 20, "by": "FAIL"}
+        try:
+            f(data)
+            errored = False
+        except ntpp.ControlException as e:
+            errored = e.message
+        self.assertEqual(errored, "***Unknown parameter 'by'")
         # Test bad sort
         data = {"sort": "FAIL", "mincount": 50, "resall": 1, "resany": 5,
                 "kod": True, "limited": True, "maxlstint": 100,
@@ -1237,6 +1250,54 @@ class TestControlSession(unittest.TestCase):
         finally:
             ntpp.select = select
 
+    def test_stream(self):
+        sockjig = jigs.SocketJig()
+        fakeselectmod = jigs.SelectModuleJig()
+        # Init
+        cls = self.target()
+        cls.logfp = None
+        cls.sock = sockjig
+        cls.stream = True
+        try:
+            ntpp.select = fakeselectmod
+            # Test requests go out behind their length
+            cls.sendpkt(ntp.poly.polybytes("blahfoo"))
+            self.assertEqual(sockjig.data,
+                             [ntp.poly.polybytes("\x00\x08blahfoo\x00")])
+            # Test packets in order, split across reads, a stale one
+            # passed over, and offsets that don't add up (they wrap)
+            sockjig.return_data = [
+                "\x00\x18\x16\xA1\x00\x01\x00\x02\x00\x03\x00\x00",
+                "\x00\x09foo=4223,\x00\x00\x00",
+                "\x00\x14\x16\x81\x00\x00\x00\x02\x00\x03\x00\x00\x00\x03"
+                "old\x00\x00\x00\x00\x00",
+                "\x00\x14\x16\x81\x00\x01\x00\x02\x00\x03\x00\x00\x00\x06"
+                "quux=1\x00\x00"]
+            cls.sequence = 1
+            cls.getresponse(1, 3, True)
+            self.assertEqual(cls.response,
+                             ntp.poly.polybytes("foo=4223,quux=1"))
+            # Test the server hanging up
+            sockjig.return_data = ["\x00"]
+            try:
+                cls.getresponse(1, 3, True)
+                errored = False
+            except ctlerr as e:
+                errored = e.message
+            self.assertEqual(errored, ntpp.SERR_SOCKET)
+            # Test timeout, which is not retried
+            fakeselectmod.do_return = [False]
+            sockjig.data = []
+            try:
+                cls.doquery(1, 3)
+                errored = False
+            except ctlerr as e:
+                errored = e.message
+            self.assertEqual(errored, ntpp.SERR_TIMEOUT)
+            self.assertEqual(len(sockjig.data), 1)
+        finally:
+            ntpp.select = select
+
     def test___validate_packet(self):
         logjig = jigs.FileJig()
         faketimemod = jigs.TimeModuleJig()
@@ -1577,6 +1638,277 @@ class TestControlSession(unittest.TestCase):
                          [(ntp.control.CTL_OP_READVAR,
                            0, "foo,bar,quux", False)])
 
+    def test_readvar_binary(self):
+        queries = []
+
+        def rec(vtype, name, value):
+            return struct.pack("!BBH", vtype, len(name),
+                               len(value)) + name + value
+
+        def doquery_jig(opcode, associd=0, qdata="", auth=False):
+            queries.append((opcode, associd, qdata, auth))
+            if opcode != ntp.control.CTL_OP_READVAR_BIN:
+                return
+            if fail:
+                raise ctlerr(ntpp.SERR_SERVER % "BADOP",
+                             ntp.control.CERR_BADOP)
+            cls.response = b"".join((
+                rec(ntp.control.CTL_BIN_STR, b"version", b"ntpd 1"),
+                rec(ntp.control.CTL_BIN_TEXT, b"refid", b"10.0.0.1"),
+                rec(ntp.control.CTL_BIN_INT, b"precision",
+                    struct.pack("!q", -24)),
+                rec(ntp.control.CTL_BIN_UINT, b"stratum",
+                    struct.pack("!Q", 2)),
+                rec(ntp.control.CTL_BIN_HEX, b"reach",
+                    struct.pack("!Q", 0o377)),
+                rec(ntp.control.CTL_BIN_DBL, b"delay",
+                    struct.pack("!dB", 1.5, 3)),
+                rec(ntp.control.CTL_BIN_DBL, b"rootdisp",
+                    struct.pack("!dB", 0.25,
+                                ntp.control.CTL_BIN_GFMT)),
+                rec(ntp.control.CTL_BIN_TS, b"reftime",
+                    struct.pack("!II", 0xdeadbeef, 0x80000000)),
+                rec(ntp.control.CTL_BIN_ARRAY, b"filtdelay",
+                    struct.pack("!2d", 1.0, 2.5))))
+        # Init
+        cls = self.target()
+        cls.doquery = doquery_jig
+        cls.binary = True
+        fail = False
+        # Test decoding
+        result = cls.readvar(5)
+        self.assertEqual(result, odict((("version", "ntpd 1"),
+                                        ("refid", "10.0.0.1"),
+                                        ("precision", -24),
+                                        ("stratum", 2),
+                                        ("reach", 0o377),
+                                        ("delay-s", "1.500"),
+                                        ("delay", 1.5),
+                                        ("rootdisp", 0.25),
+                                        ("reftime", "0xdeadbeef.80000000"),
+                                        ("filtdelay", "1.00 2.50"))))
+        self.assertEqual(queries,
+                         [(ntp.control.CTL_OP_READVAR_BIN, 5, "", False)])
+        # Test raw, which keeps the text the server would have sent
+        result = cls.readvar(raw=True)
+        self.assertEqual(result["version"], ("ntpd 1", "ntpd 1"))
+        self.assertEqual(result["reach"], (0o377, "0xff"))
+        self.assertEqual(result["delay"], (1.5, "1.500"))
+        self.assertEqual(result["rootdisp"], (0.25, "0.25"))
+        # Test truncated response
+        cls.response = cls.response[:-1]
+        cls.doquery = lambda opcode, associd=0, qdata="", auth=False: None
+        try:
+            cls.readvar()
+            errored = False
+        except ctlerr as e:
+            errored = e.message
+        self.assertEqual(errored, ntpp.SERR_INCOMPLETE)
+        # Test an older server, which gets asked again in text
+        cls.doquery = doquery_jig
+        queries = []
+        fail = True
+        cls.response = "foo=bar"
+        result = cls.readvar(varlist=("foo",))
+        self.assertEqual(result, odict((("foo", "bar"),)))
+        self.assertEqual(queries,
+                         [(ntp.control.CTL_OP_READVAR_BIN, 0, "foo", False),
+                          (ntp.control.CTL_OP_READVAR, 0, "foo", False)])
+        self.assertEqual(cls.binary, False)
+        # Clock variables have no binary form
+        queries = []
+        cls.binary = True
+        cls.readvar(opcode=ntp.control.CTL_OP_READCLOCK)
+        self.assertEqual(queries,
+                         [(ntp.control.CTL_OP_READCLOCK, 0, "", False)])
+
+    def test_readpeers(self):
+        queries = []
+        responses = []
+
+        def doquery_jig(opcode, associd=0, qdata="", auth=False):
+            queries.append((opcode, associd, qdata, auth))
+            response = responses.pop(0)
+            if isinstance(response, ctlerr):
+                raise response
+            cls.response = response
+            cls.rstatus = 0x9014
+        # Init
+        cls = self.target()
+        cls.doquery = doquery_jig
+        # Test one request
+        responses = ["associd=1, status=0x961a, srcadr=10.0.0.1, "
+                     "associd=2, status=0x9114, srcadr=10.0.0.2"]
+        peers = cls.readpeers(varlist=("srcadr",))
+        self.assertEqual([(p.associd, p.status) for p in peers],
+                         [(1, 0x961a), (2, 0x9114)])
+        self.assertEqual(peers[1].variables, odict((("srcadr", "10.0.0.2"),)))
+        self.assertEqual(queries, [(ntp.control.CTL_OP_READ_PEERS, 0,
+                                    "frags=32, srcadr", False)])
+        # Test a response cut short, in raw mode
+        queries = []
+        responses = ["associd=3, status=0x961a, offset=1.5, after=3",
+                     "associd=4, status=0x9114, offset=-2.25"]
+        peers = cls.readpeers(raw=True)
+        self.assertEqual([p.associd for p in peers], [3, 4])
+        self.assertEqual(peers[1].variables["offset"], (-2.25, "-2.25"))
+        self.assertEqual(queries,
+                         [(ntp.control.CTL_OP_READ_PEERS, 0,
+                           "frags=32", False),
+                          (ntp.control.CTL_OP_READ_PEERS, 0,
+                           "frags=32, after=3", False)])
+        # Test an older server, asked peer by peer
+        queries = []
+        responses = [ctlerr(ntpp.SERR_SERVER % "BADOP",
+                            ntp.control.CERR_BADOP),
+                     ntp.poly.polybytes("\x00\x05\x96\x1a\x00\x06\x91\x14"),
+                     "srcadr=10.0.0.5",
+                     ctlerr(ntpp.SERR_SERVER % "BADASSOC",
+                            ntp.control.CERR_BADASSOC)]
+        peers = cls.readpeers()
+        self.assertEqual([(p.associd, p.status) for p in peers],
+                         [(5, 0x9014)])
+        self.assertEqual(peers[0].variables, odict((("srcadr", "10.0.0.5"),)))
+        self.assertEqual([q[0] for q in queries],
+                         [ntp.control.CTL_OP_READ_PEERS,
+                          ntp.control.CTL_OP_READSTAT,
+                          ntp.control.CTL_OP_READVAR,
+                          ntp.control.CTL_OP_READVAR])
+        self.assertEqual(cls.bulkpeers, False)
+
+    def test_refreshpeers(self):
+        queries = []
+        responses = []
+
+        def doquery_jig(opcode, associd=0, qdata="", auth=False):
+            queries.append((opcode, associd, qdata, auth))
+            response = responses.pop(0)
+            if isinstance(response, ctlerr):
+                raise response
+            cls.response = response
+            cls.rstatus = 0x9014
+        # Init
+        cls = self.target()
+        cls.doquery = doquery_jig
+        # Test the first read, everything
+        responses = ["now=100, associd=1, status=0x961a, srcadr=10.0.0.1, "
+                     "associd=2, status=0x9114, srcadr=10.0.0.2"]
+        peers = cls.refreshpeers(None)
+        self.assertEqual(cls.peers_now, 100)
+        self.assertEqual(queries, [(ntp.control.CTL_OP_READ_PEERS, 0,
+                                    "frags=32, since=0", False)])
+        # Test unchanged peers keep their variables, a new status word
+        # without variables is read on its own
+        queries = []
+        responses = ["now=164, associd=1, status=0x961a, "
+                     "associd=2, status=0x9124, "
+                     "associd=3, status=0x9014, srcadr=10.0.0.3",
+                     "srcadr=10.0.0.22"]
+        peers = cls.refreshpeers(peers)
+        self.assertEqual([p.associd for p in peers], [1, 2, 3])
+        self.assertEqual([p.variables["srcadr"] for p in peers],
+                         ["10.0.0.1", "10.0.0.22", "10.0.0.3"])
+        self.assertEqual(cls.peers_now, 164)
+        self.assertEqual(queries, [(ntp.control.CTL_OP_READ_PEERS, 0,
+                                    "frags=32, since=100", False),
+                                   (ntp.control.CTL_OP_READVAR, 2,
+                                    "", False)])
+        # Test an older server without since=, by status word and poll
+        queries = []
+        responses = [ctlerr(ntpp.SERR_SERVER % "UNKNOWNVAR",
+                            ntp.control.CERR_UNKNOWNVAR),
+                     ntp.poly.polybytes("\x00\x01\x96\x1a"),
+                     "srcadr=10.0.0.1, hpoll=10"]
+        peers = cls.refreshpeers(peers)
+        self.assertEqual(cls.peerssince, False)
+        self.assertEqual(peers[0].due - ntp.util.monoclock() <= 64, True)
+        queries = []
+        responses = [ntp.poly.polybytes("\x00\x01\x90\x14")]
+        peers = cls.refreshpeers(peers)
+        self.assertEqual(peers[0].variables["srcadr"], "10.0.0.1")
+        self.assertEqual([q[0] for q in queries],
+                         [ntp.control.CTL_OP_READSTAT])
+
+    def test_readsamples(self):
+        queries = []
+        responses = []
+
+        def doquery_jig(opcode, associd=0, qdata="", auth=False):
+            queries.append((opcode, associd, qdata))
+            cls.response = responses.pop(0)
+
+        def record(seq, offset):
+            return struct.pack("!IQQQQqII", seq, 1 << 32, 2 << 32,
+                               3 << 32, 4 << 32, offset, 1 << 23, 1 << 20)
+        # Init
+        cls = self.target()
+        cls.doquery = doquery_jig
+        # Test a ring read in two responses
+        responses = [struct.pack("!IIHH", 3, 2, 52, 1) + record(2, -1 << 31),
+                     struct.pack("!IIHH", 3, 2, 52, 1) + record(3, 1 << 32)]
+        samples = cls.readsamples(7)
+        self.assertEqual([s.seq for s in samples], [2, 3])
+        self.assertEqual((samples[0].t1, samples[0].t4), (1 << 32, 4 << 32))
+        self.assertEqual((samples[0].offset, samples[1].offset), (-0.5, 1.0))
+        self.assertEqual((samples[0].delay, samples[0].dispersion),
+                         (0.5, 1.0 / 16))
+        self.assertEqual(queries,
+                         [(ntp.control.CTL_OP_READ_SAMPLES, 7, "frags=32"),
+                          (ntp.control.CTL_OP_READ_SAMPLES, 7,
+                           "frags=32, after=2")])
+        # Test nothing new
+        queries = []
+        responses = [struct.pack("!IIHH", 3, 2, 52, 0)]
+        self.assertEqual(cls.readsamples(7, after=3), [])
+        self.assertEqual(queries,
+                         [(ntp.control.CTL_OP_READ_SAMPLES, 7,
+                           "frags=32, after=3")])
+        # Test a short response
+        responses = [struct.pack("!IIHH", 3, 2, 52, 1)]
+        self.assertRaises(ntpp.ControlException, cls.readsamples, 7)
+
+    def test_pkttrace(self):
+        queries = []
+        responses = []
+
+        def doquery_jig(opcode, associd=0, qdata="", auth=False):
+            queries.append((opcode, qdata, auth))
+            cls.response = responses.pop(0)
+
+        def header(newest):
+            return struct.pack("!QQHxx", newest, 1, 88)
+
+        def record(seq, direction, family, addr):
+            return struct.pack("!QQBBHHxx16s48s", seq, seq << 32, direction,
+                               family, 123, 48, addr, b"\x24\x01")
+        # Init
+        cls = self.target()
+        cls.doquery = doquery_jig
+        v6 = socket.inet_pton(socket.AF_INET6, "fe80::1")
+        # Test two responses, the newest moving on meanwhile
+        responses = [header(3) + record(2, 1, 4, b"\x0a\0\0\x01"),
+                     header(9) + record(3, 2, 6, v6) + record(4, 1, 4, b"")]
+        entries = cls.pkttrace(after=1)
+        self.assertEqual([(e.seq, e.direction, e.addr) for e in entries],
+                         [(2, "recv", "10.0.0.1:123"),
+                          (3, "xmit", "[fe80::1]:123"),
+                          (4, "recv", "0.0.0.0:123")])
+        self.assertEqual((entries[0].stamp, entries[0].length), (2 << 32, 48))
+        self.assertEqual((entries[0].version(), entries[0].mode(),
+                          entries[0].stratum()), (4, 4, 1))
+        self.assertEqual(queries,
+                         [(ntp.control.CTL_OP_READ_PKTTRACE,
+                           "frags=32, after=1", True),
+                          (ntp.control.CTL_OP_READ_PKTTRACE,
+                           "frags=32, after=2", True)])
+        # Test an empty trace
+        queries = []
+        responses = [header(0)]
+        self.assertEqual(cls.pkttrace(), [])
+        self.assertEqual(queries,
+                         [(ntp.control.CTL_OP_READ_PKTTRACE, "frags=32",
+                           True)])
+
     def test_config(self):
         queries = []
 
@@ -1719,7 +2051,7 @@ class TestControlSession(unittest.TestCase):
             result = cls.mrulist()
             self.assertEqual(nonce_fetch_count, [4])
             self.assertEqual(queries,
-                             [(10, 0, "nonce=foo, frags=32", False),
+                             [(10, 0, "nonce=foo, frags=32, cursor=new", False),
                               (10, 0,
                                "nonce=foo, frags=32, addr.0=1.2.3.4:23, "
                                "last.0=40",
@@ -1757,7 +2089,8 @@ class TestControlSession(unittest.TestCase):
                                             "resall": 5})
             self.assertEqual(nonce_fetch_count, [4])
             self.assertEqual(queries,
-                             [(10, 0, "nonce=foo, frags=24, resall=0x5", False),
+                             [(10, 0, "nonce=foo, frags=24, resall=0x5, cursor=new",
+                               False),
                               (10, 0,
                                "nonce=foo, frags=25, resall=0x5, "
                                "addr.0=1.2.3.4:23, last.0=40",
@@ -1836,8 +2169,8 @@ class TestControlSession(unittest.TestCase):
             result = cls.mrulist()
             self.assertEqual(nonce_fetch_count, [5])
             self.assertEqual(queries,
-                             [(10, 0, "nonce=foo, frags=32", False),
-                              (10, 0, "nonce=foo, frags=32", False),
+                             [(10, 0, "nonce=foo, frags=32, cursor=new", False),
+                              (10, 0, "nonce=foo, frags=32, cursor=new", False),
                               (10, 0,
                                "nonce=foo, frags=32, addr.0=1.2.3.4:23, last.0=40",
                                False),
@@ -1862,9 +2195,9 @@ class TestControlSession(unittest.TestCase):
             result = cls.mrulist()
             self.assertEqual(nonce_fetch_count, [6])
             self.assertEqual(queries,
-                             [(10, 0, "nonce=foo, frags=32", False),
-                              (10, 0, "nonce=foo, limit=96", False),
-                              (10, 0, "nonce=foo, limit=96", False),
+                             [(10, 0, "nonce=foo, frags=32, cursor=new", False),
+                              (10, 0, "nonce=foo, limit=96, cursor=new", False),
+                              (10, 0, "nonce=foo, limit=96, cursor=new", False),
                               (10, 0,
                                "nonce=foo, limit=96, addr.0=1.2.3.4:23, last.0=40",
                                False),
@@ -1896,10 +2229,10 @@ class TestControlSession(unittest.TestCase):
             result = cls.mrulist()
             self.assertEqual(nonce_fetch_count, [7])
             self.assertEqual(queries,
-                             [(10, 0, "nonce=foo, frags=32", False),
-                              (10, 0, "nonce=foo, frags=16", False),
-                              (10, 0, "nonce=foo, limit=96", False),
-                              (10, 0, "nonce=foo, limit=48", False),
+                             [(10, 0, "nonce=foo, frags=32, cursor=new", False),
+                              (10, 0, "nonce=foo, frags=16, cursor=new", False),
+                              (10, 0, "nonce=foo, limit=96, cursor=new", False),
+                              (10, 0, "nonce=foo, limit=48, cursor=new", False),
                               (10, 0,
                                "nonce=foo, limit=49, addr.0=1.2.3.4:23, last.0=40",
                                False),
@@ -1932,10 +2265,10 @@ class TestControlSession(unittest.TestCase):
             result = cls.mrulist()
             self.assertEqual(nonce_fetch_count, [7])
             self.assertEqual(queries,
-                             [(10, 0, "nonce=foo, frags=32", False),
-                              (10, 0, "nonce=foo, frags=16", False),
-                              (10, 0, "nonce=foo, limit=96", False),
-                              (10, 0, "nonce=foo, limit=48", False),
+                             [(10, 0, "nonce=foo, frags=32, cursor=new", False),
+                              (10, 0, "nonce=foo, frags=16, cursor=new", False),
+                              (10, 0, "nonce=foo, limit=96, cursor=new", False),
+                              (10, 0, "nonce=foo, limit=48, cursor=new", False),
                               (10, 0,
                                "nonce=foo, limit=49, addr.0=1.2.3.4:23, last.0=40",
                                False),
@@ -1954,9 +2287,89 @@ class TestControlSession(unittest.TestCase):
                               "from fragments limit.\n",
                               "1970-01-01T00:00:00Z Row limit reduced to 48 "
                               "following  incomplete response.\n"])
+            # Test server side cursor, which expires once
+            nonce_fetch_count = [0]
+            query_results = ["addr.0=1.2.3.4:23,last.0=40,first.0=23,"
+                             "ct.0=1,mv.0=2,rs.0=3,cursor=0000abcd-1",
+                             "addr.0=1.2.3.4:23,last.0=41,first.0=23,"
+                             "ct.0=1,mv.0=2,rs.0=3,cursor=00001234-1",
+                             "addr.0=10.20.30.40:23,last.0=42,first.0=23,"
+                             "ct.0=1,mv.0=2,rs.0=3,"
+                             "now=0x00000000.00000000,last.newest=42"]
+            queries = []
+            query_fail = [0]
+            query_fail_code = [ntp.control.CERR_UNKNOWNVAR]
+
+            def doquery_fail_second(opcode, associd=0, qdata="", auth=False):
+                if len(queries) == 1:
+                    query_fail[0] = 1
+                doquery_jig(opcode, associd, qdata, auth)
+            cls.doquery = doquery_fail_second
+            result = cls.mrulist(variables={"mincount": 2})
+            cls.doquery = doquery_jig
+            self.assertEqual(queries,
+                             [(10, 0, "nonce=foo, frags=32, mincount=2, "
+                               "cursor=new", False),
+                              (10, 0, "nonce=foo, frags=32, "
+                               "cursor=0000abcd-1", False),
+                              (10, 0, "nonce=foo, frags=32, mincount=2, "
+                               "cursor=new", False),
+                              (10, 0, "nonce=foo, frags=32, "
+                               "cursor=00001234-1", False)])
+            self.assertEqual(len(result.entries), 2)
+            self.assertEqual(result.entries[0].addr, "1.2.3.4:23")
+            self.assertEqual(result.entries[0].last, 41)
+            self.assertEqual(result.entries[1].addr, "10.20.30.40:23")
         finally:
             ntp.util.time = timetemp
 
+    def test_mru_pipeline(self):
+        def reply(sequence, data):
+            data = ntp.poly.polybytes(data)
+            pkt = struct.pack("!BBHHHHH", 0x16, 0x8A, sequence, 0, 0, 0,
+                              len(data)) + data
+            while len(pkt) % 4:
+                pkt += b"\x00"
+            server.send(pkt)
+
+        cls = self.target()
+        (cls.sock, server) = socket.socketpair(socket.AF_UNIX,
+                                               socket.SOCK_DGRAM)
+        cls.primary_timeout = cls.secondary_timeout = 50
+        try:
+            # Rows 2 to 5 of a snapshot, asked for two at a time.  The
+            # second page comes back first, the first one short.
+            reply(2, "addr.4=10.0.0.4:123,addr.5=10.0.0.5:123,"
+                  "now=0x00000000.00000000")
+            reply(1, "addr.2=10.0.0.2:123")
+            reply(3, "addr.3=10.0.0.3:123")
+            span = ntpp.MRUList()
+            cls._ControlSession__mru_pipeline(span, "0000abcd-2", 6,
+                                              "nonce=foo", 2, None, None)
+            self.assertEqual([entry.addr for entry in span.entries],
+                             ["10.0.0.2:123", "10.0.0.3:123",
+                              "10.0.0.4:123", "10.0.0.5:123"])
+            self.assertTrue(span.is_complete())
+            queries = [ntp.poly.polystr(server.recv(4096)[12:]).rstrip("\0")
+                       for _ in range(3)]
+            self.assertEqual(queries,
+                             ["nonce=foo, limit=2, cursor=0000abcd-2",
+                              "nonce=foo, limit=2, cursor=0000abcd-4",
+                              "nonce=foo, limit=2, cursor=0000abcd-3"])
+            # Nothing says the list is done
+            reply(4, "addr.2=10.0.0.2:123,addr.3=10.0.0.3:123")
+            try:
+                cls._ControlSession__mru_pipeline(ntpp.MRUList(),
+                                                  "0000abcd-2", 4,
+                                                  "nonce=foo", 2, None, None)
+                errored = False
+            except ctlerr as e:
+                errored = e.message
+            self.assertEqual(errored, ntpp.SERR_INCOMPLETE)
+        finally:
+            server.close()
+            cls.close()
+
     def test___ordlist(self):
         queries = []
 
@@ -1976,17 +2389,35 @@ class TestControlSession(unittest.TestCase):
 
     def test_reslist(self):
         ords = []
+        pages = ["addr.0=1.2.3.4, more=1", "addr.1=5.6.7.8"]
 
-        def ordlist_jig(listtype):
+        def ordlist_jig(listtype, stanzas=None):
             ords.append(listtype)
-            return 23
+            cls.response = pages.pop(0)
+            stanzas.append(cls.response.split(",")[0])
+            return stanzas
         # Init
         cls = self.target()
         cls._ControlSession__ordlist = ordlist_jig
-        # Test
+        # Test, a slice at a time
+        result = cls.reslist()
+        self.assertEqual(result, ["addr.0=1.2.3.4", "addr.1=5.6.7.8"])
+        self.assertEqual(ords, ["addr_restrictions from=0",
+                                "addr_restrictions from=1"])
+
+        # Test, an ntpd that sends it all at once
+        def old_jig(listtype, stanzas=None):
+            ords.append(listtype)
+            if stanzas is not None:
+                raise ntpp.ControlException(
+                    "", errorcode=ntp.control.CERR_UNKNOWNVAR)
+            return 23
+        ords = []
+        cls._ControlSession__ordlist = old_jig
         result = cls.reslist()
         self.assertEqual(result, 23)
-        self.assertEqual(ords, ["addr_restrictions"])
+        self.assertEqual(ords, ["addr_restrictions from=0",
+                                "addr_restrictions"])
 
     def test_ifstats(self):
         ords = []
@@ -2003,6 +2434,51 @@ class TestControlSession(unittest.TestCase):
         self.assertEqual(ords, ["ifstats"])
 
 
+class TestControlMux(unittest.TestCase):
+    target = ntpp.ControlMux
+
+    @staticmethod
+    def reply(sock, more, offset, data):
+        "Send a READVAR response fragment to sequence 1."
+        data = ntp.poly.polybytes(data)
+        pkt = struct.pack("!BBHHHHH", 0x16, 0xA2 if more else 0x82,
+                          1, 0, 0, offset, len(data)) + data
+        while len(pkt) % 4:
+            pkt += b"\x00"
+        sock.send(pkt)
+
+    def test_readvar(self):
+        sessions = [ntpp.ControlSession() for _ in range(4)]
+        servers = []
+        try:
+            for session in sessions[:3]:
+                (session.sock, server) = socket.socketpair(
+                    socket.AF_UNIX, socket.SOCK_DGRAM)
+                session.primary_timeout = session.secondary_timeout = 50
+                servers.append(server)
+            # One fragment
+            self.reply(servers[0], False, 0, "foo=1")
+            # Two
+            self.reply(servers[1], True, 0, "bar=2,")
+            self.reply(servers[1], False, 6, "baz=3")
+            # servers[2] never answers, sessions[3] has no host
+            cls = self.target(sessions)
+            results = cls.readvar()
+            self.assertEqual(results[0], odict([("foo", 1)]))
+            self.assertEqual(results[1], odict([("bar", 2), ("baz", 3)]))
+            self.assertEqual(results[2].message, ntpp.SERR_TIMEOUT)
+            self.assertEqual(results[3].message, ntpp.SERR_NOHOST)
+            # Asked twice, as doquery() would
+            self.assertEqual(sessions[2].sequence, 2)
+            self.assertEqual(len(servers[2].recv(4096)), 12)
+            self.assertEqual(len(servers[2].recv(4096)), 12)
+        finally:
+            for sock in servers:
+                sock.close()
+            for session in sessions:
+                session.close()
+
+
 class TestAuthenticator(unittest.TestCase):
     target = ntpp.Authenticator
     open_calls = []
@@ -4,9 +4,14 @@
 #
 # SPDX-License-Identifier: BSD-2-Clause
 
+import itertools
+import os
+import shutil
+import tempfile
 import unittest
 import ntp.statfiles
 import jigs
+import struct
 import sys
 
 
@@ -32,6 +37,68 @@ class TestPylibStatfiles(unittest.TestCase):
             ntp.statfiles.iso_to_posix("2016-12-06T04:49:46")),
             "2016-12-06T04:49:46")
 
+    def test_filegen_span(self):
+        f = ntp.statfiles.filegen_span
+
+        self.assertEqual(f("20161206"), (1480982400, 1481068800))
+        self.assertEqual(f("20161206.gz"), (1480982400, 1481068800))
+        self.assertEqual(f("201612"), (1480550400, 1483228800))
+        self.assertEqual(f("2016"), (1451606400, 1483228800))
+        self.assertEqual(f("2016w01"), None)
+        self.assertEqual(f("20161306"), None)
+        self.assertEqual(f("1"), None)
+        self.assertEqual(f(""), None)
+
+    def test_binary_rows(self):
+        f = ntp.statfiles.binary_rows
+
+        def header(fields, reclen):
+            fields = fields.encode("ascii") + b"\0"
+            hdrlen = (12 + len(fields) + 7) & ~7
+            hdr = b"NTPSTATB" + struct.pack("<HH", hdrlen, reclen) + fields
+            return hdr + b"\0" * (hdrlen - len(hdr))
+
+        # rawstats, as record_raw_stats() packs it
+        fields = ("time:ns64 src:addr dst:addr t1:lfp t2:lfp t3:lfp "
+                  "t4:lfp leap:u8 version:u8 mode:u8 stratum:u8 ppoll:i8 "
+                  "precision:i8 rootdelay:fix16 rootdisp:fix16 "
+                  "refid:refid outcount:u32 bogons:u32 flag:x32")
+        rec = struct.pack("<Q17s17sQQQQBBBBbbII4sIII",
+                          1480999786250000000,
+                          b"\x04\xc0\x00\x02\x01",
+                          b"\x06" + b"\x20\x01\x0d\xb8" + b"\0" * 11
+                          + b"\x01",
+                          (3689988586 << 32) | 0x80000000,
+                          3689988586 << 32, 3689988586 << 32,
+                          (3689988586 << 32) | 0xffffffff,
+                          0, 4, 4, 2, 6, -23, 0x8000, 0x10000,
+                          b"\x0a\x00\x00\x01", 3, 0, 0x1f)
+        data = header(fields, len(rec)) + rec
+        self.assertEqual(len(rec), 104)
+        self.assertEqual(f(data, 0, 2 ** 32),
+                         [[1480999786250, "1480999786.25",
+                           "192.0.2.1", "2001:db8::1",
+                           "3689988586.500000000", "3689988586.000000000",
+                           "3689988586.000000000", "3689988587.000000000",
+                           "0", "4", "4", "2", "6", "-23",
+                           "0.500000", "1.000000", "10.0.0.1",
+                           "3", "0", "1f"]])
+        # outside the time window
+        self.assertEqual(f(data, 0, 1480999786), [])
+        # peerstats from a refclock, two records and a partial one
+        fields = ("time:ns64 src:addr status:x16 "
+                  "offset:f64 delay:f64 disp:f64 jitter:f64")
+        rec = struct.pack("<Q17sHdddd", 5000000000, b"RSHM(0)", 0x9414,
+                          0.5, 0.25, 0.125, 0.0625)
+        data = header(fields, len(rec)) + rec + rec + rec[:10]
+        self.assertEqual(f(data, 0, 10),
+                         [[5000, "5.0", "SHM(0)", "9414", "0.500000000",
+                           "0.250000000", "0.125000000", "0.062500000"]] * 2)
+        # not a binary file, or one we can't read
+        self.assertEqual(f(b"40594 10\n", 0, 10), [])
+        self.assertEqual(f(header("time:ns64 x:what", 9), 0, 10), [])
+        self.assertEqual(f(header("time:ns64", 9), 0, 10), [])
+
 
 class TestNTPStats(unittest.TestCase):
     target = ntp.statfiles.NTPStats
@@ -83,6 +150,16 @@ class TestNTPStats(unittest.TestCase):
                             "40587 86399", "40588 1"], 1, 86400),
                          [[1062, "1.0625"], [86399000, "86399.0"]])
 
+    def test_unixize_batch(self):
+        f = self.target.unixize
+        # newline ended, as read from a file, goes through mjdtounix()
+        lines = ["40587 0 a\n", "heeeey duuuude!\n", "40587 1.0625 b\n",
+                 "40587 86399\n", "40588 1"]
+        self.assertEqual(f(lines, 1, 86400),
+                         [[1062, "1.0625", "b"], [86399000, "86399.0"]])
+        self.assertEqual(f(lines, 1, 86400),
+                         list(self.target.unixize_slow(lines, 1, 86400)))
+
     def test_timestamp(self):
         f = self.target.timestamp
 
@@ -105,6 +182,42 @@ class TestNTPStats(unittest.TestCase):
                          {"p10": 1, "p25": 23, "p90": 99,
                           "p50": 42, "p100": 99})
 
+    def test_select_percentiles(self):
+        f = self.target.select_percentiles
+        percents = (100, 99, 95, 50, 5, 1, 0)
+
+        self.assertEqual(f([10, 90], []), {"p10": 0, "p90": 0})
+        self.assertEqual(f([10, 90], [42]), {"p10": 42, "p90": 42})
+        values = [float((i * 7919) % 1000) for i in range(1000)]
+        unsorted = values[:]
+        self.assertEqual(f(percents, values),
+                         self.target.percentiles(percents, sorted(values)))
+        # the caller's values are not reordered
+        self.assertEqual(values, unsorted)
+
+    def test_polyfit(self):
+        f = self.target.polyfit
+        saved = ntp.statfiles.numpy
+        try:
+            for numpy in (saved, None):
+                ntp.statfiles.numpy = numpy
+                # too few points, or none apart
+                self.assertEqual(f([]), None)
+                self.assertEqual(f([(3.0, 1.0), (3.0, 2.0)]), None)
+                self.assertEqual(f([(3.0, 1.0), (4.0, 2.0)], 2), None)
+                # a line, handed over as a generator
+                fit = f((x, 0.5 * x - 2.0) for x in range(10))
+                self.assertAlmostEqual(fit[0], 0.5)
+                self.assertAlmostEqual(fit[1], -2.0)
+                # a parabola a long way from x = 0
+                fit = f([(x, 2.0 * (x - 1e6) ** 2 + 1.0)
+                         for x in range(1000000 - 5, 1000000 + 6)], 2)
+                self.assertAlmostEqual(fit[0], 2.0)
+                self.assertAlmostEqual(fit[1] / 1e6, -4.0)
+                self.assertAlmostEqual(fit[2] / 1e12, 2.0)
+        finally:
+            ntp.statfiles.numpy = saved
+
     def test_ip_label(self):
         f = self.target.ip_label
 
@@ -117,9 +230,12 @@ class TestNTPStats(unittest.TestCase):
             # Test hostname, success
             fakesockmod.ghba_returns = [("result.com", None, None)]
             self.assertEqual(f("1.2.3.4"), "result.com")
+            # Test hostname, cached
+            fakesockmod.ghba_returns = []
+            self.assertEqual(f("1.2.3.4"), "result.com")
             # Test hostname, failure
             fakesockmod.ghba_returns = [None]
-            self.assertEqual(f("1.2.3.4"), "1.2.3.4")
+            self.assertEqual(f("1.2.3.5"), "1.2.3.5")
             # Test old style NTP
             fakesockmod.ghba_returns = [("foo.org", None, None)]
             self.assertEqual(f("127.127.42.23"), "REFCLOCK(type=42,unit=23)")
@@ -159,6 +275,8 @@ class TestNTPStats(unittest.TestCase):
             self.target._NTPStats__load_stem = loadjig
             processtemp = self.target._NTPStats__process_stem
             self.target._NTPStats__process_stem = processjig
+            bintemp = self.target._NTPStats__load_binary
+            self.target._NTPStats__load_binary = lambda s, d, stem: []
             # Test simplest
             TDP = self.target.DefaultPeriod
             faketimemod.time_returns = [TDP * 2]
@@ -254,10 +372,12 @@ class TestNTPStats(unittest.TestCase):
             self.assertEqual(cls.temps, [])
             self.assertEqual(cls.gpsd, [])
         finally:
+            ntp.statfiles.socket = socktemp
             ntp.statfiles.os = ostemp
             ntp.statfiles.time = timetemp
             self.target._NTPStats__load_stem = stemtemp
             self.target._NTPStats__process_stem = processtemp
+            self.target._NTPStats__load_binary = bintemp
             sys.stderr = errtemp
 
     def test___load_statfiles(self):
@@ -286,6 +406,8 @@ class TestNTPStats(unittest.TestCase):
             ntp.statfiles.open = self.open_jig
             prostemp = self.target._NTPStats__process_stem
             self.target._NTPStats__process_stem = self.process_stem_jig
+            bintemp = self.target._NTPStats__load_binary
+            self.target._NTPStats__load_binary = lambda s, d, stem: []
             # Set up repetable data
             TDP = self.target.DefaultPeriod
             faketimemod.time_returns = [TDP * 2]
@@ -350,32 +472,30 @@ class TestNTPStats(unittest.TestCase):
             fakegzipmod.files_returned = [jigs.FileJig(["40594 20\n",
                                                         "40594 21"])]
             TestNTPStats.process_stem_returns = [[]] * 6
-            self.assertEqual(cls._NTPStats__load_stem("/foo/bar",
-                                                      "clockstats"),
+
+            def load(cls, stem):
+                parts = cls._NTPStats__load_stem("/foo/bar", stem)
+                return list(itertools.chain.from_iterable(parts))
+            self.assertEqual(load(cls, "clockstats"),
                              ['40594 10\n', '40594 11',
                               '40594 20\n', '40594 21'])
-            self.assertEqual(cls._NTPStats__load_stem("/foo/bar",
-                                                      "peerstats"),
+            self.assertEqual(load(cls, "peerstats"),
                              ['40594 30\n', '40594 31',
                               '40594 40\n', '40594 41'])
-            self.assertEqual(cls._NTPStats__load_stem("/foo/bar",
-                                                      "loopstats"),
+            self.assertEqual(load(cls, "loopstats"),
                              ['40594 50\n', '40594 51',
                               '40594 60\n', '40594 61'])
-            self.assertEqual(cls._NTPStats__load_stem("/foo/bar",
-                                                      "rawstats"),
+            self.assertEqual(load(cls, "rawstats"),
                              ['40594 70\n', '40594 71',
                               '40594 80\n', '40594 81'])
-            self.assertEqual(cls._NTPStats__load_stem("/foo/bar",
-                                                      "temps"),
+            self.assertEqual(load(cls, "temps"),
                              ["604801.25 40594 90\n",
                               "#blah",
                               "604802.25 40594 91",
                               "604803.25 40594 100\n",
                               "#blah",
                               "604804.25 40594 101"])
-            self.assertEqual(cls._NTPStats__load_stem("/foo/bar",
-                                                      "gpsd"),
+            self.assertEqual(load(cls, "gpsd"),
                              ['604805.25 40594 110\n', '#blah',
                               '604806.25 40594 111'])
         finally:
@@ -387,6 +507,7 @@ class TestNTPStats(unittest.TestCase):
             ntp.statfiles.open = opentemp
             sys.stderr = errtemp
             self.target._NTPStats__process_stem = prostemp
+            self.target._NTPStats__load_binary = bintemp
 
     def test___process_stem_lines(self):
         try:
@@ -404,28 +525,30 @@ class TestNTPStats(unittest.TestCase):
             fakeosmod.path.isdir_returns = [True] * 10
             cls = self.target("/foo/bar", "sitename", starttime=0,
                               endtime=(86400 * 7))
-            self.assertEqual(cls._NTPStats__process_stem("clockstats",
-                                                         dataOne),
+            self.assertEqual(list(cls._NTPStats__process_stem(
+                "clockstats", [dataOne])),
                              [[5000, '5.0', 'foo'], [10000, '10.0', 'bar'],
                               [15000, '15.0', 'baz'], [20000, '20.0', 'quux']])
-            self.assertEqual(cls._NTPStats__process_stem("peerstats",
-                                                         dataOne),
+            self.assertEqual(list(cls._NTPStats__process_stem(
+                "peerstats", [dataOne])),
                              [[5000, '5.0', 'foo'], [10000, '10.0', 'bar'],
                               [15000, '15.0', 'baz'], [20000, '20.0', 'quux']])
-            self.assertEqual(cls._NTPStats__process_stem("loopstats",
-                                                         dataOne),
+            self.assertEqual(list(cls._NTPStats__process_stem(
+                "loopstats", [dataOne])),
                              [[5000, '5.0', 'foo'], [10000, '10.0', 'bar'],
                               [15000, '15.0', 'baz'], [20000, '20.0', 'quux']])
-            self.assertEqual(cls._NTPStats__process_stem("rawstats",
-                                                         dataOne),
+            self.assertEqual(list(cls._NTPStats__process_stem(
+                "rawstats", [dataOne])),
                              [[5000, '5.0', 'foo'], [10000, '10.0', 'bar'],
                               [15000, '15.0', 'baz'], [20000, '20.0', 'quux']])
-            self.assertEqual(cls._NTPStats__process_stem("temps", dataTwo),
+            self.assertEqual(list(cls._NTPStats__process_stem(
+                "temps", [dataTwo])),
                              [[20500, '20.5', '5', 'foo'],
                               [21500, '21.5', '10', 'bar'],
                               [22500, '22.5', '15', 'baz'],
                               [23500, '23.5', '20', 'quux']])
-            self.assertEqual(cls._NTPStats__process_stem("gpsd", dataTwo),
+            self.assertEqual(list(cls._NTPStats__process_stem(
+                "gpsd", [dataTwo])),
                              [[20500, '20.5', '5', 'foo'],
                               [21500, '21.5', '10', 'bar'],
                               [22500, '22.5', '15', 'baz'],
@@ -434,6 +557,96 @@ class TestNTPStats(unittest.TestCase):
             self.target._NTPStats__load_stem = loadtemp
             ntp.statfiles.os = ostemp
 
+    def test___process_stem_merge(self):
+        try:
+            fakeosmod = jigs.OSModuleJig()
+            ostemp = ntp.statfiles.os
+            ntp.statfiles.os = fakeosmod
+            loadtemp = self.target._NTPStats__load_stem
+            self.target._NTPStats__load_stem = self.load_stem_jig
+            partOne = ["40587 5 foo\n", "40587 20 baz\n", "40588 1 late\n"]
+            partTwo = ["40587 10 bar\n", "#comment\n", "40587 30 quux\n"]
+            TestNTPStats.load_stem_returns = [[]] * 6
+            fakeosmod.path.isdir_returns = [True] * 10
+            cls = self.target("/foo/bar", "sitename", starttime=0,
+                              endtime=86400)
+            rows = cls._NTPStats__process_stem("loopstats",
+                                               [partOne, partTwo])
+            self.assertFalse(isinstance(rows, list))
+            self.assertEqual(list(rows),
+                             [[5000, '5.0', 'foo'], [10000, '10.0', 'bar'],
+                              [20000, '20.0', 'baz'],
+                              [30000, '30.0', 'quux']])
+        finally:
+            self.target._NTPStats__load_stem = loadtemp
+            ntp.statfiles.os = ostemp
+
+    def test___load_stem_by_name(self):
+        statsdir = tempfile.mkdtemp()
+        try:
+            files = {"loopstats.20200101": "58849 10 a\n58849 20 b\n",
+                     "loopstats.20200102": "58850 50 c\n",
+                     # outside the window by name, though not by content
+                     "loopstats.20200110": "58849 12 skipped\n",
+                     "loopstats.old": "58849 15 x\n58850 60 y\n"}
+            for (name, text) in files.items():
+                with open(os.path.join(statsdir, name), "w") as logfile:
+                    logfile.write(text)
+            cls = self.target(statsdir, "sitename", starttime=1577836800,
+                              endtime=1577836800 + 2 * 86400)
+            self.assertEqual([row[2] for row in cls.loopstats],
+                             ["a", "x", "b", "c", "y"])
+            # the dated files make one run, the other file another
+            self.assertEqual(len(cls._NTPStats__load_stem(statsdir,
+                                                          "loopstats")), 2)
+        finally:
+            shutil.rmtree(statsdir)
+
+    def test___load_cached(self):
+        statsdir = tempfile.mkdtemp()
+        cachedir = os.path.join(statsdir, "cache")
+        logpart = os.path.join(statsdir, "loopstats.20200101")
+        start = 1577836800
+        try:
+            with open(logpart, "w") as logfile:
+                logfile.write("58849 10 a\n58849 20 b\n58849 30 c\n")
+            cls = self.target(statsdir, "sitename", starttime=start,
+                              endtime=start + 86400, cachedir=cachedir)
+            self.assertEqual([row[2] for row in cls.loopstats],
+                             ["a", "b", "c"])
+            (subdir,) = os.listdir(cachedir)
+            cachefile = os.path.join(cachedir, subdir, "loopstats.20200101")
+            self.assertTrue(os.path.exists(cachefile))
+            # the whole file is kept, whatever the period
+            cls = self.target(statsdir, "sitename", starttime=start + 15,
+                              endtime=start + 25, cachedir=cachedir)
+            self.assertEqual([row[2] for row in cls.loopstats], ["b"])
+            # an unchanged file is not read again
+            with open(cachefile, "rb") as cache:
+                (key, rows) = ntp.statfiles.marshal.load(cache)
+            rows[0][2] = "cached"
+            with open(cachefile, "wb") as cache:
+                ntp.statfiles.marshal.dump((key, rows), cache)
+            cls = self.target(statsdir, "sitename", starttime=start,
+                              endtime=start + 86400, cachedir=cachedir)
+            self.assertEqual([row[2] for row in cls.loopstats],
+                             ["cached", "b", "c"])
+            # a changed one is
+            with open(logpart, "a") as logfile:
+                logfile.write("58849 40 d\n")
+            cls = self.target(statsdir, "sitename", starttime=start,
+                              endtime=start + 86400, cachedir=cachedir)
+            self.assertEqual([row[2] for row in cls.loopstats],
+                             ["a", "b", "c", "d"])
+            # and one that is gone is forgotten
+            os.remove(logpart)
+            cls = self.target(statsdir, "sitename", starttime=start,
+                              endtime=start + 86400, cachedir=cachedir)
+            self.assertEqual(cls.loopstats, [])
+            self.assertFalse(os.path.exists(cachefile))
+        finally:
+            shutil.rmtree(statsdir)
+
     def test_peersplit(self):
         # Create jigs
         fakesockmod = jigs.SocketModuleJig()
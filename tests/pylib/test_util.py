@@ -13,6 +13,7 @@ import ntp.util
 import ntp.packet
 import sys
 import socket
+import threading
 
 import jigs
 
@@ -587,6 +588,40 @@ class TestPylibUtilMethods(unittest.TestCase):
             ntp.util.canonicalization_cache = cachetemp
             ntp.util.socket = sockettemp
 
+    def test_prefetch_dns(self):
+        f = ntp.util.prefetch_dns
+
+        mycache = ntp.util.Cache()
+        calls = []
+        gate = threading.Event()
+
+        def cdns_jig(host):  # canonicalize_dns()
+            calls.append(host)
+            if host == "192.0.2.9":
+                gate.wait(5)    # stuck until the test is done
+            mycache.set(host, "name-" + host)
+            return "name-" + host
+
+        try:
+            cachetemp = ntp.util.canonicalization_cache
+            ntp.util.canonicalization_cache = mycache
+            cdnstemp = ntp.util.canonicalize_dns
+            ntp.util.canonicalize_dns = cdns_jig
+            mycache.set("192.0.2.3", "cached")
+            f(["192.0.2.1", "192.0.2.2", "192.0.2.9", "192.0.2.1",
+                "192.0.2.3"], deadline=0.2)
+            # each address once, none that were cached
+            self.assertEqual(sorted(calls),
+                             ["192.0.2.1", "192.0.2.2", "192.0.2.9"])
+            self.assertEqual(mycache.get("192.0.2.1"), "name-192.0.2.1")
+            self.assertEqual(mycache.get("192.0.2.3"), "cached")
+            # the one past the deadline is shown numerically
+            self.assertEqual(mycache.get("192.0.2.9"), "192.0.2.9")
+        finally:
+            gate.set()
+            ntp.util.canonicalization_cache = cachetemp
+            ntp.util.canonicalize_dns = cdnstemp
+
     def test_termsize(self):
         f = ntp.util.termsize
 
@@ -982,6 +1017,12 @@ class TestPylibUtilMethods(unittest.TestCase):
         # Test with missing data
         data = {"addr": "42.23.1.2", "mask": "FF:FF:0:0"}
         self.assertEqual(cls.summary(data), "")
+        # Test the restrict set
+        data = {"hits": "7", "set": "/etc/ntp-abuse.txt",
+                "prefixes": "12000", "flags": "ignore"}
+        self.assertEqual(cls.summary(data),
+                         "         7 set /etc/ntp-abuse.txt, "
+                         "12000 prefixes\n           ignore\n")
 
     def test_IfstatsSummary(self):
         c = ntp.util.IfstatsSummary
@@ -991,21 +1032,33 @@ class TestPylibUtilMethods(unittest.TestCase):
         # Test with all variables available
         data = od((("addr", "1.2.3.4"), ("bcast", "foo"),
                    ("name", "Namus Maximus"), ("en", True), ("flags", 0xFACE),
-                   ("rx", 12), ("tx", 34), ("txerr", 56), ("pc", 78),
-                   ("up", 90)))
+                   ("rx", 12), ("tx", 34), ("txerr", 56), ("kd", 7),
+                   ("pc", 78), ("up", 90)))
         self.assertEqual(cls.summary(1, data),
-                         "  1 Namus Maximus            . face     12     34"
-                         "     56    78       90\n    1.2.3.4\n    foo\n")
+                         "  1 Namus Maximus        . face     12     34"
+                         "     56      7    78       90\n    1.2.3.4\n"
+                         "    foo\n")
         # Test without bcast
         data = od((("addr", "1.2.3.4"), ("name", "Namus Maximus"),
                    ("en", True), ("flags", 0xFACE), ("rx", 12), ("tx", 34),
                    ("txerr", 56), ("pc", 78), ("up", 90)))
+        # Without kd, as from an older ntpd
         self.assertEqual(cls.summary(1, data),
-                         "  1 Namus Maximus            . face     12     34"
-                         "     56    78       90\n    1.2.3.4\n")
+                         "  1 Namus Maximus        . face     12     34"
+                         "     56           78       90\n    1.2.3.4\n")
         # Test with missing data
         self.assertEqual(cls.summary(1, od()), "")
 
+    def test_PkttraceSummary(self):
+        cls = ntp.util.PkttraceSummary()
+        entry = ntp.packet.PacketTrace(5, 3 << 31, "recv", "10.0.0.1:123",
+                                       48, b"\x23\x02" + b"\0" * 46)
+        self.assertEqual(cls.summary(2 << 32, entry),
+                         "  0.500000 recv    48 4 3   2 10.0.0.1:123\n")
+        entry.header = b"\x16\x10"
+        self.assertEqual(cls.summary(2 << 32, entry),
+                         "  0.500000 recv    48 2 6   - 10.0.0.1:123\n")
+
 
 class TestPeerSummary(unittest.TestCase):
     target = ntp.util.PeerSummary
@@ -92,6 +92,7 @@ def cmd_bin_test(ctx):
     ]
     cmd_list_python = [
         (BIN, NTPCLIENTS, "ntpdig", "--version"),
+        (BIN, NTPCLIENTS, "ntpkeydb", "--version"),
         (BIN, NTPCLIENTS, "ntpkeygen", "--version"),
         (BIN, NTPCLIENTS, "ntpq", "--version"),
         (BIN, NTPCLIENTS, "ntpsnmpd", "--version"),
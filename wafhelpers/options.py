@@ -34,6 +34,9 @@ def options_cmd(ctx, config):
     grp.add_option('--enable-debug-timing', action='store_true',
                    default=False,
                    help="Collect timing statistics for debugging.")
+    grp.add_option('--enable-usdt', action='store_true',
+                   default=False,
+                   help="Add USDT tracepoints (needs sys/sdt.h).")
     grp.add_option('--enable-pylib', action='store',
                    default='ffi', choices=['ext', 'ffi', 'none'],
                    help="""Choose which Python library to build.\n
@@ -55,14 +58,34 @@ ext, ffi, or none. defaults to ffi.""", nargs=1)
                    help="Enable leaps on other than 1st of month.")
     grp.add_option('--enable-mssntp', action='store_true',
                    default=False, help="Enable Samba MS SNTP support.")
+    grp.add_option('--enable-server-profile', action='store_true',
+                   default=False,
+                   help="Build ntpd for dedicated servers: no refclocks, "
+                   "MS-SNTP or leap smear, request path tuned.")
+    grp.add_option('--enable-lto', action='store_true',
+                   default=False, help="Enable link time optimization.")
+    grp.add_option('--enable-pgo', action='store',
+                   default=None, choices=['generate', 'use'],
+                   help="Profile guided optimization: generate builds "
+                   "instrumented binaries, use rebuilds with the "
+                   "profile they wrote. See devel/pgo-train.")
 
     grp = ctx.add_option_group("Refclock configure options")
     grp.add_option(
         '--refclock', dest='refclocks',
         help="Comma-separated list of Refclock IDs to build (or \"all\")",
         type=str)
+    grp.add_option(
+        '--parse-clocks', dest='parse_clocks', default="all",
+        help="Comma-separated list of clock formats to build the generic "
+        "driver with (or \"all\"), see --list",
+        type=str)
     grp.add_option('--list', action='store_true', default=False,
                    help="List available Refclocks")
+    grp.add_option('--enable-refclock-modules', action='store_true',
+                   default=False,
+                   help="Build the refclocks as modules ntpd loads when "
+                   "a clock of theirs is configured")
 
     grp = ctx.add_option_group("NTP developer configure options")
     grp.add_option('--build-version-tag', type=str,
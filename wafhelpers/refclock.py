@@ -103,9 +103,34 @@ refclock_map = {
         "descr":    "GPSD NG client protocol",
         "define":   "CLOCK_GPSDJSON",
         "file":     "gpsd"
+    },
+
+    "phc": {
+        "descr":    "PTP Hardware Clock",
+        "define":   "CLOCK_PHC",
+        "require":  ["ptp"],
+        "file":     "phc"
     }
 }
 
+# Clock formats the generic (parse) driver can be built with, by
+# --parse-clocks name: the define that puts each in libparse's format
+# table and the libparse file that decodes it.
+parse_clock_map = {
+    "computime": ("CLOCK_COMPUTIME", "clk_computime"),
+    "dcf7000":   ("CLOCK_DCF7000", "clk_dcf7000"),
+    "hopf6021":  ("CLOCK_HOPF6021", "clk_hopf6021"),
+    "meinberg":  ("CLOCK_MEINBERG", "clk_meinberg"),
+    "rawdcf":    ("CLOCK_RAWDCF", "clk_rawdcf"),
+    "rcc8000":   ("CLOCK_RCC8000", "clk_rcc8000"),
+    "schmid":    ("CLOCK_SCHMID", "clk_schmid"),
+    "sel240x":   ("CLOCK_SEL240X", "clk_sel240x"),
+    "trimtaip":  ("CLOCK_TRIMTAIP", "clk_trimtaip"),
+    "trimtsip":  ("CLOCK_TRIMTSIP", "clk_trimtsip"),
+    "varitext":  ("CLOCK_VARITEXT", "clk_varitext"),
+    "wharton":   ("CLOCK_WHARTON_400A", "clk_wharton"),
+}
+
 
 @conf
 def refclock_config(ctx):
@@ -129,22 +154,20 @@ def refclock_config(ctx):
         rc = refclock_map[id]
 
         if rc['define'] == "CLOCK_GENERIC":
-            parse_clocks = (
-                "CLOCK_COMPUTIME",
-                "CLOCK_DCF7000",
-                "CLOCK_HOPF6021",
-                "CLOCK_MEINBERG",
-                "CLOCK_RAWDCF",
-                "CLOCK_RCC8000",
-                "CLOCK_SCHMID",
-                "CLOCK_SEL240X",
-                "CLOCK_TRIMTAIP",
-                "CLOCK_TRIMTSIP",
-                "CLOCK_VARITEXT",
-                "CLOCK_WHARTON_400A",
-            )
-            for subtype in parse_clocks:
-                ctx.define(subtype, 1, comment="Enable individual parse clock")
+            if ctx.options.parse_clocks == "all":
+                formats = sorted(parse_clock_map)
+            else:
+                formats = ctx.options.parse_clocks.split(",")
+            ctx.env.PARSE_SOURCE = []
+            for name in formats:
+                if name not in parse_clock_map:
+                    ctx.fatal("'%s' is not a valid parse clock format" % name)
+                define, file = parse_clock_map[name]
+                if file + ".c" in ctx.env.PARSE_SOURCE:
+                    continue
+                ctx.define(define, 1, comment="Enable individual parse clock")
+                ctx.env.PARSE_SOURCE.append(file + ".c")
+            ctx.msg("Parse clock formats", ", ".join(formats))
 
         ctx.start_msg("Enabling Refclock %s (%s):" % (rc["descr"], id))
 
@@ -156,6 +179,14 @@ def refclock_config(ctx):
                            "Refclock \"%s\" disabled, PPS API has not "
                            "been detected as working." % rc["descr"])
                     continue
+            if "ptp" in rc["require"]:
+                if not (ctx.get_define("HAVE_LINUX_PTP_CLOCK_H") and
+                        ctx.get_define("HAVE_SYS_IOCTL_H")):
+                    ctx.end_msg("No")
+                    pprint("RED",
+                           "Refclock \"%s\" disabled, Linux PTP clock "
+                           "support has not been found." % rc["descr"])
+                    continue
 
         ctx.env.REFCLOCK_SOURCE.append((rc["file"], rc["define"]))
         ctx.env["REFCLOCK_%s" % rc["file"].upper()] = True